@@ -32,6 +32,7 @@ AROUTPUT   += -o
 MAKE       ?= make
 
 ZMATLIB    :=lib/libzmat.a
+ZMATAR     :=ar
 
 LIBOPENCLDIR ?= /usr/local/cuda/lib64
 LIBOPENCL  ?=-lOpenCL
@@ -62,6 +63,11 @@ ifeq ($(findstring x86_64,$(ARCH)), x86_64)
      CCFLAGS+=-m64
 endif
 
+# on non-x86 CPUs (AArch64 NEON etc), the SSE ray-tracers are built on the portable SIMD layer in mmc_simd.h
+ifeq (,$(filter x86_64 i386 i486 i586 i686 amd64,$(ARCH)))
+     SSEFLAGS:=-DMMC_USE_SSE -DHAVE_SSE2
+endif
+
 ISCLANG = $(shell $(CC) --version | grep clang)
 
 MEXLINKOPT +=$(OPENMPLIB)
@@ -124,15 +130,6 @@ endif
 
 .DEFAULT_GOAL := ssemath
 
-ifeq ($(findstring Darwin,$(PLATFORM)), Darwin)
-    ifeq ($(findstring arm64,$(ARCH)), arm64)
-       .DEFAULT_GOAL := omp
-       ifneq (,$(filter $(MAKECMDGOALS),mex oct))
-           SSEFLAGS=
-       endif
-    endif
-endif
-
 ifeq ($(BACKEND),ocelot)
   LINKOPT=-L/usr/local/lib `OcelotConfig -l` -ltinfo
   CUCCOPT=-D__STRICT_ANSI__ -g #--maxrregcount 32
@@ -201,14 +198,21 @@ mex mexomp:        ARFLAGS+=$(MKMEXOPT)
 prof:      CCFLAGS+= -O3 -pg
 prof:      ARFLAGS+= -O3 -g -pg
 
-web: CCFLAGS+= -DMMC_USE_SSE -DHAVE_SSE2 -msse -msse2 -msse3 -mssse3
-web: CCFLAGS+= -O3 $(OPENMP) $(FASTMATH)
-web: ARFLAGS+= $(OPENMPLIB) $(FASTMATH) -DUSE_SSE2 -DMMC_USE_SSE_MATH
-web: CFLAGS+=-D__SSE__ -D__SSE2__
+# emscripten maps the SSE4 intrinsics to wasm SIMD128; it has no OpenMP runtime, webmmc.html splits the photons over web workers instead
+web: CCFLAGS+= -DMMC_USE_SSE -DHAVE_SSE2 -msimd128 -msse -msse2 -msse3 -mssse3 -msse4.1
+web: CCFLAGS+= -O3 $(FASTMATH) -DUSE_SSE2 -DMMC_USE_SSE_MATH -Wno-unknown-pragmas
+web: ARFLAGS+= -O3 -msimd128 $(FASTMATH)
 web: CC=emcc
-web: BINDIR:=webmmc
-web: AR=emcc
-web: EXTRALIB=-s SIMD=1 -s WASM=1 -s EXTRA_EXPORTED_RUNTIME_METHODS='["cwrap"]' -s FORCE_FILESYSTEM=1 -o $(BINDIR)/webmmc.html
+web: CXX=em++
+web: AR=em++
+web: ZMATAR=emar
+web: EXTRALIB=-sWASM=1 -sMODULARIZE=1 -sEXPORT_NAME=WebMMC -sINVOKE_RUN=0 -sALLOW_MEMORY_GROWTH=1 -sFORCE_FILESYSTEM=1 -sEXPORTED_RUNTIME_METHODS=callMain,FS
+
+ifneq (,$(filter web,$(MAKECMDGOALS)))
+    BINDIR :=$(MMCDIR)/webmmc
+    BINARY :=webmmc.js
+    CCFLAGS:=$(filter-out -m64,$(CCFLAGS))
+endif
 
 mex oct mexomp octomp:   EXTRALIB=
 mex oct mexomp octomp:   CCFLAGS+=$(DLLFLAG) -DMCX_CONTAINER
@@ -246,11 +250,12 @@ ifeq ($(TARGETSUFFIX),.a)
 endif
 
 cuda: ssemath
+hip: ssemath
 cudamex: mex
 cudaoct: oct
 trinity: cuda
 
-all release sse ssemath prof omp mex oct mexomp octomp web debug cuda: $(SUBDIRS) $(BINDIR)/$(BINARY)
+all release sse ssemath prof omp mex oct mexomp octomp web debug cuda hip: $(SUBDIRS) $(BINDIR)/$(BINARY)
 
 $(SUBDIRS):
 	$(MAKE) -C $@ --no-print-directory
@@ -295,7 +300,7 @@ $(BINDIR)/$(BINARY): makedirs $(CLSOURCE) $(ZMATLIB) $(OBJS)
 
 
 $(ZMATLIB):
-	-$(MAKE) -C zmat lib AR=ar CPPOPT="$(DLLFLAG)" CCOPT="$(DLLFLAG)" USERLINKOPT=
+	-$(MAKE) -C zmat lib CC="$(CC)" CXX="$(CXX)" AR=$(ZMATAR) CPPOPT="$(DLLFLAG)" CCOPT="$(DLLFLAG)" USERLINKOPT=
 
 ##  Documentation  ##
 doc: makedocdir
@@ -0,0 +1,31 @@
+#!/bin/bash
+
+# format:
+#    ./run_test.sh [-b "xorshift128p philox sfmt logistic posix drand48"] -- <more mmc_rngbench parameters>
+#
+#  -b backends   RNG backends to test, built by "make rngbench" in src/
+#
+# for example, "./run_test.sh -- -n 1e7 -t 4" tests all backends on 4 threads
+
+BIN=../../bin
+BACKENDS="xorshift128p philox sfmt logistic posix drand48"
+FAILED=0
+
+while getopts "b:" opt; do
+    case $opt in
+        b) BACKENDS=$OPTARG ;;
+        *) sed -n '3,8p' $0; exit 1 ;;
+    esac
+done
+
+shift $((OPTIND - 1))
+
+make -C ../../src rngbench || exit 1
+
+for rng in $BACKENDS
+do
+    echo "== $rng"
+    $BIN/mmc_rngbench_$rng "$@" || FAILED=1
+done
+
+exit $FAILED
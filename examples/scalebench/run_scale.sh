@@ -0,0 +1,126 @@
+#!/bin/bash
+
+# format:
+#    ./run_scale.sh [-s "1e5 1e6"] [-m "P H B S G"] [-c "cpu gpu"] [-n 1e6]
+#                   [-b baseline.csv] [-o result.csv] [-t 10] [-u] -- <more mmc parameters>
+#
+#  -s sizes      generated mesh sizes, any of 1e5 1e6 1e7 5e7 (elements)
+#  -m methods    ray-tracing methods passed to -M, the GPU only runs B and G
+#  -c backends   cpu (-c sse) and/or gpu (-c opencl)
+#  -n photons    photon number of each run
+#  -b file       compare the throughput against a stored baseline
+#  -o file       save the throughput of this run, default to <hostname>.csv
+#  -t percent    a case regresses if it is slower than the baseline by this much
+#  -u            save the result as the new baseline (file given by -b)
+
+MMC=../../bin/mmc
+SIZES="1e5 1e6"
+METHODS="P H B S G"
+BACKENDS="cpu"
+PHOTON=1e6
+BASELINE=
+OUTPUT=$(hostname -s).csv
+TOL=10
+UPDATE=0
+
+while getopts "s:m:c:n:b:o:t:u" opt; do
+    case $opt in
+        s) SIZES=$OPTARG ;;
+        m) METHODS=$OPTARG ;;
+        c) BACKENDS=$OPTARG ;;
+        n) PHOTON=$OPTARG ;;
+        b) BASELINE=$OPTARG ;;
+        o) OUTPUT=$OPTARG ;;
+        t) TOL=$OPTARG ;;
+        u) UPDATE=1 ;;
+        *) sed -n '3,15p' $0; exit 1 ;;
+    esac
+done
+
+shift $((OPTIND - 1))
+EXTRA=$@
+
+# voxels along each axis of the 60x60x60 mm cube, 6 tetrahedra per voxel
+declare -A VOXEL=( [1e5]=26 [1e6]=56 [1e7]=119 [5e7]=203 )
+
+# the pattern source is launched from a one-voxel layer under the cube
+patterncfg() {
+    local n=$1
+    local step=$(awk "BEGIN{printf \"%.8f\", 60/$n}")
+    echo "{\"Session\":{\"ID\":\"scale-pattern\",\"Photons\":1e6,\"RNGSeed\":1648335518,\"OutputFormat\":\"bin\"},\
+\"Domain\":{\"Media\":[{\"mua\":0,\"mus\":0,\"g\":1,\"n\":1},{\"mua\":0.005,\"mus\":1.0,\"g\":0.01,\"n\":1.37}]},\
+\"Mesh\":{\"MeshGen\":{\"Size\":[$n,$n,$((n+1))],\"Step\":$step,\"Origin\":[0,0,-$step],\"SrcLayer\":1}},\
+\"Forward\":{\"T0\":0,\"T1\":5e-9,\"Dt\":5e-9},\
+\"Optode\":{\"Source\":{\"Type\":\"pattern\",\"Pos\":[10,10,-$(awk "BEGIN{print $step/2}")],\"Dir\":[0,0,1],\
+\"Param1\":[40,0,0,4],\"Param2\":[0,40,0,4],\"Pattern\":{\"Nx\":4,\"Ny\":4,\
+\"Data\":[1,0,1,0,0,1,0,1,1,0,1,0,0,1,0,1]}},\
+\"Detector\":[{\"Pos\":[30,20,-$step],\"R\":1},{\"Pos\":[30,40,-$step],\"R\":1},{\"Pos\":[20,30,-$step],\"R\":1},{\"Pos\":[40,30,-$step],\"R\":1}]}}"
+}
+
+echo "case,elem,speed" > $OUTPUT
+
+for size in $SIZES; do
+    if [ -z "${VOXEL[$size]}" ]; then
+        echo "unsupported size $size, must be one of ${!VOXEL[@]}"
+        exit 1
+    fi
+
+    for backend in $BACKENDS; do
+        if [ $backend = "gpu" ]; then
+            DEVOPT="-c opencl -G 1"
+        else
+            DEVOPT="-c sse"
+        fi
+
+        for method in $METHODS; do
+            if [ $backend = "gpu" ] && [ $method != "B" ] && [ $method != "G" ]; then
+                continue
+            fi
+
+            for src in pencil pattern; do
+                for det in 0 1; do
+                    for refl in 0 1; do
+                        name=${size}_${backend}_${method}_${src}_d${det}_b${refl}
+
+                        if [ $src = "pattern" ]; then
+                            INPUT=(-f "$(patterncfg ${VOXEL[$size]})")
+                        else
+                            INPUT=(--bench scale-$size)
+                        fi
+
+                        speed=$($MMC "${INPUT[@]}" -n $PHOTON -M $method -d $det -b $refl -S 0 -D T \
+                               -s $name $DEVOPT $EXTRA 2>&1 | sed -e 's/\x1b\[[0-9;]*m//g' | \
+                               grep -o '[0-9.]* photon/ms' | tail -1 | awk '{print $1}')
+
+                        echo "$name: ${speed:-failed} photon/ms"
+                        echo "$name,$size,${speed:-0}" >> $OUTPUT
+                        rm -f $name*.dat $name*.mch $name*.bin
+                    done
+                done
+            done
+        done
+    done
+done
+
+if [ -z "$BASELINE" ]; then
+    exit 0
+fi
+
+if [ $UPDATE -eq 1 ] || [ ! -f "$BASELINE" ]; then
+    cp $OUTPUT $BASELINE
+    echo "saved baseline to $BASELINE"
+    exit 0
+fi
+
+# a case regresses if its throughput drops by more than TOL percent
+awk -F, -v tol=$TOL '
+    BEGIN { printf "%-32s %12s %12s %8s\n", "case", "baseline", "speed", "ratio" }
+    NR == FNR { if (FNR > 1) base[$1] = $3; next }
+    FNR > 1 && ($1 in base) && base[$1] > 0 {
+        ratio = $3 / base[$1];
+        flag = (ratio < 1 - tol / 100.0) ? "REGRESSION" : "ok";
+        printf "%-32s %12.2f %12.2f %8.3f %s\n", $1, base[$1], $3, ratio, flag;
+        bad += (flag != "ok");
+    }
+    END { printf "%d case(s) regressed by more than %g%%\n", bad, tol; exit (bad > 0) }
+' $BASELINE $OUTPUT
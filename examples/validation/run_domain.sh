@@ -0,0 +1,58 @@
+#!/bin/bash
+
+# format:
+#    ./run_domain.sh [-r "2 3"] [-m "P H B S"] [-n 1e5] [-t 1e-5] -- <more mmc parameters>
+#
+#  -r ranks      MPI rank numbers of the --domain runs
+#  -m methods    ray-tracing methods passed to -M
+#  -n photons    photon number of each run
+#  -t tol        largest relative difference of the absorbed fraction
+#
+# mmc must be built by "make mpi" in src/. With --rng philox, each photon
+# keeps its own random number stream when handed over between the ranks, so
+# a --domain run must match a single-rank run up to the rounding of sums.
+# Set MPIRUN to pass more options to mpirun.
+
+MMC=../../bin/mmc
+MPIRUN=${MPIRUN:-mpirun}
+RANKS="2 3"
+METHODS="P H B S"
+PHOTON=1e5
+TOL=1e-5
+FAILED=0
+
+while getopts "r:m:n:t:" opt; do
+    case $opt in
+        r) RANKS=$OPTARG ;;
+        m) METHODS=$OPTARG ;;
+        n) PHOTON=$OPTARG ;;
+        t) TOL=$OPTARG ;;
+        *) sed -n '3,9p' $0; exit 1 ;;
+    esac
+done
+
+shift $((OPTIND - 1))
+EXTRA=$@
+
+absorbed() {
+    "$@" 2>&1 | sed -e 's/\x1b\[[0-9;]*m//g' | grep -o 'absorbed: [0-9.]*%' | tail -1 | grep -o '[0-9.]*'
+}
+
+for method in $METHODS; do
+    ref=$(absorbed $MMC -f cube2.inp -n $PHOTON -M $method -c sse --rng philox -D T -s domain_ref $EXTRA)
+
+    for np in $RANKS; do
+        val=$(absorbed $MPIRUN -np $np $MMC -f cube2.inp -n $PHOTON -M $method -c sse --rng philox --domain 1 -D T -s domain_$np $EXTRA)
+
+        if awk -v a="$ref" -v b="$val" -v tol=$TOL 'BEGIN { exit !(a > 0 && (a - b) ^ 2 <= (tol * a) ^ 2) }'; then
+            echo "-M $method, $np ranks: absorbed ${val}%, single rank ${ref}%, ok"
+        else
+            echo "-M $method, $np ranks: absorbed ${val:-failed}%, single rank ${ref:-failed}%, MISMATCH"
+            FAILED=1
+        fi
+    done
+done
+
+rm -f domain_*.dat domain_*.mch
+
+exit $FAILED
@@ -25,16 +25,29 @@ function varargout = mmclab(varargin)
 %    fluence=mmclab(cfg);
 %    newcfg=mmclab(cfg,'prep');
 %    [fluence,detphoton,ncfg,seeds,traj]=mmclab(cfg, options);
+%    [fluence,detphoton,ncfg,seeds,traj]=mmclab(cfg, jobs);
 %
 % Input:
 %    cfg: a struct, or struct array. Each element in cfg defines
 %         a set of parameters for a simulation.
+%         When run in turn (see cfg.concurrent), an element that only
+%         differs from the previous ones in the fields of a batch job
+%         (see jobs below) reuses their prepared mesh.
 %
 %    option: (optional), options is a string, specifying additional options
 %         option='preview': this plots the domain configuration using mcxpreview(cfg)
 %         option='opencl':  force using OpenCL (set cfg.gpuid=1 if not set)
 %                           instead of SSE on CPUs/GPUs that support OpenCL
 %
+%    jobs: (optional), a struct array; cfg must then be a single struct.
+%         The mesh in cfg is prepared only once and one simulation is run
+%         for each element of jobs, which may only change the following
+%         fields of cfg: nphoton, seed, srcpos, srcdir, srcparam1, srcparam2,
+%         detpos and prop (with the same number of rows). The outputs have
+%         one element per job, for example, to scan a pencil beam
+%              jobs=struct('srcpos',{[20 30 0],[30 30 0],[40 30 0]});
+%              flux=mmclab(cfg,jobs);
+%
 %
 %    cfg may contain the following fields:
 %
@@ -72,7 +85,8 @@ function varargout = mmclab(varargin)
 %      cfg.ismomentum:  [0]-save momentum transfer for each detected photon
 %      cfg.method:      ray-tracing method, ["plucker"]:Plucker, "havel": Havel (SSE4),
 %                       "badouel": partial Badouel, "elem": branchless Badouel (SSE),
-%                       "grid": dual-grid MMC
+%                       "grid": dual-grid MMC, "packet": branchless Badouel using
+                       AVX2/AVX-512 ray packets (CPU only)
 %      cfg.mcmethod:    0 use MCX-styled MC method, 1 use MCML style MC
 %      cfg.nout:        [1.0] refractive index for medium type 0 (background)
 %      cfg.minenergy:   terminate photon when weight less than this level (float) [0.0]
@@ -158,6 +172,11 @@ function varargout = mmclab(varargin)
 %
 % == Output control ==
 %      cfg.issaveexit: [0]-save the position (x,y,z) and (vx,vy,vz) for a detected photon
+%      cfg.savedetflag: ['dspw']-a string of letters for the detected photon fields: 'd' detector ID,
+%                      's' per-medium scattering counts, 'p' partial paths, 'm' momentum transfer,
+%                      'x'/'v' exit position/direction, 'w' initial weight; only dropping 's' changes
+%                      the CPU records, the other fields follow cfg.ismomentum and cfg.issaveexit;
+%                      the GPU and cfg.pmcprop always keep 's'
 %      cfg.issaveref:  [0]-save diffuse reflectance/transmittance on the exterior surfaces.
 %                      The output is stored as flux.dref in a 2D array of size [#Nf,  #time_gate]
 %                      where #Nf is the number of triangles on the surface; #time_gate is the
@@ -165,8 +184,91 @@ function varargout = mmclab(varargin)
 %                      triangle surface mesh can be extracted by faces=faceneighbors(cfg.elem,'rowmajor');
 %                      where 'faceneighbors' can be found in the iso2mesh toolbox.
 %                      Example: see <demo_mmclab_basic.m>
+%      cfg.varbatch:   [0]-if >1, split the photons into this many batches and return
+%                      the variance of the output over the batches in fluence(i).var;
+%                      on the GPU, each respin (cfg.respin, set to cfg.varbatch if 1)
+%                      is a batch, and cfg.flushrespin must be >0
+%      cfg.rng:        ['xorshift128p']-random number generator: 'xorshift128p', 'philox'
+%                      (counter-based, a photon has the same stream whichever thread, device
+%                      or respin runs it, on the CPU and the GPU) or 'posix' (erand48 LCG,
+%                      CPU only); seeds saved with one RNG must be replayed with the same cfg.rng
 %      cfg.issaveseed:  [0]-save the RNG seed for a detected photon so one can replay
 %      cfg.isatomic:    [1]-use atomic operations for saving fluence, 0-no atomic operations
+%      cfg.iswavefront: [0]-1 group CPU photons by next event and process each group
+%                       in a batch, 0 simulate one photon at a time
+%      cfg.isprivatebuf: [0]-1 accumulate fluence in per-thread buffers and
+%                       merge at the end instead of atomics (used only if
+%                       the buffers fit in 1/4 of the host memory)
+%      cfg.iselemmoment: [0]-1 accumulate the atomic nodal output (basisorder=1)
+%                       at the 4 corners of each element and add them to the
+%                       nodes after the run, so the threads do not contend
+%                       for the shared nodes; needs 4*#elem/#node times the
+%                       output memory
+%      cfg.reorder:     [0]-renumber elements and nodes along a space-filling curve
+%                       to improve cache reuse, 0: no, 1: Morton, 2: Hilbert; the
+%                       outputs are always in the original numbering
+%      cfg.iscachetracer: [0]-1 save the precomputed ray-tracer data to
+%                       tracer_*.mmct in cfg.rootpath and reuse it in later
+%                       runs of the same mesh and method
+%      cfg.iscachekernel: [0]-1 save the compiled OpenCL kernel binaries to
+%                       kernel_*.clbin in cfg.rootpath and skip the kernel
+%                       compilation in later runs on the same devices
+%      cfg.isheatmap:   [0]-1 count the ray-tet tests, the edge/vertex fixes and
+%                       the reflections/refractions in each element (CPU only);
+%                       returned as flux.heat, an [#elem, 3] array with one
+%                       column per counter, to find the costly mesh regions
+%      cfg.autotune:    [0]-1 replace the autopilot thread/block settings of
+%                       OpenCL devices by those of a short benchmark sweep,
+%                       run once per device, driver and kind of simulation
+%                       and cached in autotune_*.txt in cfg.rootpath; 2 to
+%                       calibrate again
+%      cfg.isdynload:   [0]-1 let multiple OpenCL devices pull photons in
+%                       chunks sized by their measured speed, instead of
+%                       the static split by cfg.workload
+%      cfg.hybrid:      [0]|float if in (0,1), the CPU simulates this fraction of
+%                       the photons next to the GPU, and the outputs of both
+%                       are merged before the normalization
+%      cfg.ispersistent: [0]-1 let each GPU thread take the next photon from a
+%                       device-side counter until all are launched, instead
+%                       of a fixed number of photons per thread; when
+%                       saving detected photons in OpenCL, a launch stops
+%                       before cfg.maxdetphoton is full and resumes after
+%                       the records are read back
+%      cfg.gpusort:     [0]|int >0: with -c cuda, each photon advances this
+%                       many scattering events per launch, then the GPU
+%                       threads are regrouped by the element of their
+%                       photon, so that nearby threads read nearby
+%                       elements; best combined with cfg.reorder=1
+%      cfg.unifiedmem: [1]-1 move the output, detected photon and replay
+%                       buffers to host memory shared with the GPU (CUDA
+%                       managed memory) if the mesh does not fit on the
+%                       device; 2 always; 0 never
+%      cfg.ispackmesh:  [0]-1 store the mesh on the GPU as one 64-byte record
+%                       per element with half-precision face normals;
+%                       reduces memory traffic at a ~5e-4 relative
+%                       error of the face positions
+%      cfg.islocalmesh: [1]-1 if the mesh fits in the GPU shared memory, each
+%                       work-group traces photons from its own copy of
+%                       the element normals, types and neighbors; 0
+%                       always reads them from the GPU global memory
+%      cfg.ishalfface:  [0]-1 store each face plane of the mesh once on the
+%                       GPU, shared by its 2 elements through 32-bit
+%                       half-face entries, instead of 4 normals and
+%                       neighbors per element; about 20% less memory
+%      cfg.patternbits: [32]-16 or 8 bits per weight of a pattern source
+%                       on the GPU, each pattern stored over its own
+%                       scale; 1/2 or 1/4 of the memory and launch reads
+%      cfg.outmask:     [''] save the output of the selected elements only,
+%                       a ';'-joined list of 'label:l1,l2', 'elem:i,j,k' or
+%                       'box:x0,y0,z0,x1,y1,z1'; rows follow the input
+%                       element order; element output on the CPU only
+%      cfg.meshsession: [0] a non-zero id keeps the mesh on the GPU after
+%                       the run; later calls with the same id and mesh
+%                       size skip the mesh upload, 0 releases it
+%      cfg.concurrent:  [1] for a struct array cfg, the number of CPU
+%                       simulations run at the same time, each on an equal
+%                       share of the OpenMP threads; read from cfg(1), GPU
+%                       simulations always run one after another
 %      cfg.outputtype:  'flux' - output fluence-rate
 %                       'fluence' - fluence,
 %                       'energy' - energy deposit,
@@ -178,6 +280,9 @@ function varargout = mmclab(varargin)
 %      cfg.maxjumpdebug: [10000000|int] when trajectory is requested in the output,
 %                     use this parameter to set the maximum position stored. By default,
 %                     only the first 1e6 positions are stored.
+%      cfg.trajsample: [1|int] only save the trajectories of every n-th photon, i.e.
+%                     the photons with an index divisible by n, to show more photons
+%                     within the cfg.maxjumpdebug positions
 %
 %      fields marked with * are required; options in [] are the default values
 %      fields marked with - are calculated if not given (can be faster if precomputed)
@@ -198,6 +303,9 @@ function varargout = mmclab(varargin)
 %            If cfg.issaveref is set to 1, fluence(i).dref is not empty, and stores
 %            the surface diffuse reflectance (normalized by default). The surface mesh
 %            that the dref output is attached can be obtained by faces=faceneighbors(cfg.elem,'rowmajor');
+%            If cfg.varbatch is set, fluence(i).var is the batch-means estimate of the
+%            variance of fluence(i).data over its first #time_gate frames, in the
+%            same layout; sqrt(var)./data is the relative statistical error.
 %      detphoton: (optional) a struct array, with a length equals to that of cfg.
 %            Starting from v2016.5, the detphoton contains the below subfields:
 %              detphoton.detid: the ID(>0) of the detector that captures the photon
@@ -262,7 +370,21 @@ end
 
 useopencl = defaultocl;
 
-if (nargin == 2 && ischar(varargin{2}))
+jobs = [];
+if (nargin == 2 && isstruct(varargin{2}))
+    jobs = varargin{2};
+    varargin(2) = [];
+    castlist = {'srcpos', 'detpos', 'prop', 'srcdir'};
+    for i = 1:length(jobs)
+        for j = 1:length(castlist)
+            if (isfield(jobs(i), castlist{j}))
+                jobs(i).(castlist{j}) = double(jobs(i).(castlist{j}));
+            end
+        end
+    end
+end
+
+if (length(varargin) == 2 && ischar(varargin{2}))
     if (strcmp(varargin{2}, 'preview') || strcmp(varargin{2}, 'prep') || strcmp(varargin{2}, 'cuda'))
         useopencl = 0;
     end
@@ -297,6 +419,10 @@ if (~isstruct(cfg))
     error('cfg must be a struct or struct array');
 end
 
+if (~isempty(jobs) && length(cfg) ~= 1)
+    error('cfg must be a single struct when jobs are given');
+end
+
 len = length(cfg);
 for i = 1:len
     if (~isfield(cfg(i), 'node') || ~isfield(cfg(i), 'elem'))
@@ -421,19 +547,24 @@ if (nargout >= 3)
     varargout{nargout} = cfg;
 end
 
+batch = {};
+if (~isempty(jobs))
+    batch = {jobs};
+end
+
 if (useopencl == 1)
     for i = 1:length(cfg)
         if (isfield(cfg(i), 'gpuid') && ~ischar(cfg(i).gpuid) && cfg(i).gpuid < -1)
             cfg(i).gpuid = 1;
         end
     end
-    [varargout{1:mmcout}] = mmc(cfg);
+    [varargout{1:mmcout}] = mmc(cfg, batch{:});
 elseif (length(varargin) < 2)
-    [varargout{1:mmcout}] = mmc(cfg);
+    [varargout{1:mmcout}] = mmc(cfg, batch{:});
 elseif (strcmp(type, 'omp'))
-    [varargout{1:mmcout}] = mmc(cfg);
+    [varargout{1:mmcout}] = mmc(cfg, batch{:});
 elseif (strcmp(type, 'sse'))
-    [varargout{1:mmcout}] = mmc_sse(cfg);
+    [varargout{1:mmcout}] = mmc_sse(cfg, batch{:});
 elseif (strcmp(type, 'prep') && nargout == 1)
     varargout{1} = cfg;
 elseif (strcmp(type, 'preview') && nargout == 1)
@@ -442,6 +573,19 @@ else
     error('type is not recognized');
 end
 
+% expand cfg to one element per job so that the outputs are post-processed with the job settings
+if (~isempty(jobs))
+    cfg = repmat(cfg, length(jobs), 1);
+    jobfields = fieldnames(jobs);
+    for i = 1:length(jobs)
+        for j = 1:length(jobfields)
+            if (~isempty(jobs(i).(jobfields{j})))
+                cfg(i).(jobfields{j}) = jobs(i).(jobfields{j});
+            end
+        end
+    end
+end
+
 if (mmcout >= 2)
     for i = 1:length(varargout{2})
         if (~isfield(cfg(i), 'issaveexit') || cfg(i).issaveexit ~= 2)
@@ -450,11 +594,17 @@ if (mmcout >= 2)
             if (isempty(detp))
                 continue
             end
+            ismom = (isfield(cfg(i), 'ismomentum') && cfg(i).ismomentum);
+            isexit = (isfield(cfg(i), 'issaveexit') && cfg(i).issaveexit);
+            % the scattering counts are absent when cfg.savedetflag drops 'S'
+            nscatlen = (size(detp, 1) == (2 + ismom) * medianum + isexit * 6 + 2) * medianum;
             newdetp.detid = int32(detp(1, :))';
-            newdetp.nscat = int32(detp(2:medianum + 1, :))';    % 1st medianum block is num of scattering
-            newdetp.ppath = detp(medianum + 2:2 * medianum + 1, :)'; % 2nd medianum block is partial path
-            if (isfield(cfg(i), 'ismomentum') && cfg(i).ismomentum)
-                newdetp.mom = detp(2 * medianum + 2:3 * medianum + 1, :)'; % 3rd medianum block is the momentum transfer
+            if (nscatlen)
+                newdetp.nscat = int32(detp(2:medianum + 1, :))';    % 1st medianum block is num of scattering
+            end
+            newdetp.ppath = detp(nscatlen + 2:nscatlen + medianum + 1, :)'; % next medianum block is partial path
+            if (ismom)
+                newdetp.mom = detp(nscatlen + medianum + 2:nscatlen + 2 * medianum + 1, :)'; % then the momentum transfer
             end
             if (isfield(cfg(i), 'issaveexit') && cfg(i).issaveexit)
                 newdetp.p = detp(end - 6:end - 4, :)';             % columns 7-5 from the right store the exit positions*/
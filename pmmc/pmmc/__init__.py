@@ -32,6 +32,15 @@ cfg = {'nphoton': 1000000, 'node': node, 'elem': elem, 'elemprop': np.ones(elem.
        'tstart':0, 'tend':5e-9, 'tstep':5e-9, 'srcpos': [30,30,0], 'srcdir':[0,0,1],
        'prop':[[0,0,1,1],[0.005,1,0.01,1.37]]}
 res = pmmc.run(cfg)
+
+# To run several sources/optical properties on the same mesh, preparing the mesh only once
+jobs = [{'srcpos': [20,30,0]}, {'srcpos': [40,30,0], 'prop':[[0,0,1,1],[0.01,1,0.01,1.37]]}]
+reslist = pmmc.runbatch(cfg, jobs)
+
+# To run in the background, with a progress callback, and stop early if needed
+handle = pmmc.runasync(cfg, progress=lambda p: print(f"{p:.0%}"))
+handle.cancel()      # optional, keeps the photons launched so far
+res = handle.result()
 """
 
 import sys
@@ -50,7 +59,7 @@ try:
             )
         )
 
-    from _pmmc import gpuinfo, run, version
+    from _pmmc import gpuinfo, run, runbatch, runasync, RunHandle, version
 except ImportError:  # pragma: no cover
     print("the pmmc binary extension (_pmmc) is not compiled! please compile first")
 
@@ -77,6 +86,9 @@ __version__ = "0.2.5"
 __all__ = (
     "gpuinfo",
     "run",
+    "runbatch",
+    "runasync",
+    "RunHandle",
     "version",
     "detweight",
     "cwdref",
@@ -72,6 +72,10 @@ fwrite(fp, clhex, 'char');
 fclose(fp);
 
 cflags = '-c -Wall -g -DMCX_EMBED_CL -fno-strict-aliasing -m64 -DMMC_USE_SSE -DHAVE_SSE2 -msse -msse2 -msse3 -mssse3 -msse4.1 -O3 -fopenmp  -DUSE_OS_TIMER -DUSE_OPENCL -DMCX_CONTAINER';
+if (~isempty(regexpi(computer, '(aarch64|arm64|maca64)', 'once')))
+    % ARM CPUs build the SSE ray-tracers on the portable SIMD layer in mmc_simd.h
+    cflags = regexprep(cflags, ' -m64| -ms?sse[\w.]*', '');
+end
 
 filelist = {'mmc_rand_xorshift128p.c', 'mmc_mesh.c', 'mmc_raytrace.c', ...
             'mmc_utils.c', 'mmc_tictoc.c', 'mmc_host.c', ...
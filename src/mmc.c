@@ -36,6 +36,7 @@
 *******************************************************************************/
 
 #include "mmc_host.h"
+#include "mmc_tictoc.h"
 
 #ifdef USE_OPENCL
     #include "mmc_cl_host.h"
@@ -45,16 +46,72 @@
     #include "mmc_cu_host.h"
 #endif
 
+#ifdef MMC_USE_MPI
+    #include <mpi.h>
+#endif
+
 /***************************************************************************//**
 In this unit, we first launch a master thread and initialize the
 necessary data structures. This include the command line options (cfg),
 tetrahedral mesh (mesh) and the ray-tracer precomputed data (tracer).
 *******************************************************************************/
 
+/**
+ * \brief Run one simulation with the backend selected by cfg->compute
+ *
+ * With --hybrid, the CPU simulates a share of the photons next to the GPU.
+ */
+
+static void mmc_run(mcconfig* cfg, tetmesh* mesh, raytracer* tracer) {
+    /** With --reciprocal, the smaller of the pattern and detector sets is launched */
+    if (cfg->isreciprocal && cfg->detnum >= cfg->srcnum) {
+        MMCDEBUG(cfg, dlTime, (cfg->flog, "--reciprocal: %d patterns and %d detectors, launching the patterns\n", cfg->srcnum, cfg->detnum));
+    }
+
+    if (cfg->emitfile[0]) {
+        mmc_run_emission(cfg, mesh, tracer);
+    } else if (cfg->isreciprocal && cfg->detnum < cfg->srcnum) {
+        mmc_run_reciprocal(cfg, mesh, tracer);
+    } else if (cfg->compute == cbSSE || cfg->gpuid > MAX_DEVICE) {
+        mmc_run_mp(cfg, mesh, tracer);
+    }
+
+#ifdef USE_CUDA
+    else if (cfg->compute == cbCUDA && cfg->hybrid > 0.f) {
+        mmc_run_hybrid(cfg, mesh, tracer, mmc_run_cu);
+    } else if (cfg->compute == cbCUDA) {
+        mmc_run_cu(cfg, mesh, tracer);
+    }
+
+#endif
+#ifdef USE_OPENCL
+    else if (cfg->hybrid > 0.f) {
+        mmc_run_hybrid(cfg, mesh, tracer, mmc_run_cl);
+    } else {
+        mmc_run_cl(cfg, mesh, tracer);
+    }
+
+#endif
+
+    /** With --adjoint, the Jacobians of the source-detector pairs are integrated from the output fields */
+    if (cfg->adjointnum > 0 && cfg->mpirank == 0) {
+        mesh_savejacobian(mesh, cfg);
+    }
+}
+
 int main(int argc, char** argv) {
     mcconfig cfg;          /** cfg: structure to store all simulation parameters */
     tetmesh mesh;          /** mesh: structure to store mesh information */
     raytracer tracer;      /** tracer: structure to store  */
+    unsigned long long trun;
+
+#ifdef MMC_USE_MPI
+    /**
+     * When built with MPI (make mpi), every rank loads and prepares the same
+     * input, simulates its share of the photons, and rank 0 saves the output.
+     */
+    MPI_Init(&argc, &argv);
+#endif
 
     /**
      * To start an MMC simulation, we first create a simulation configuration,
@@ -63,6 +120,20 @@ int main(int argc, char** argv) {
      */
     mmc_init_from_cmd(&cfg, &mesh, &tracer, argc, argv);
 
+    /**
+     * With --pmc, the detected photons of a previous run are re-weighted for
+     * the property sets of --pmcprop instead of simulating new photons.
+     */
+    if (cfg.pmcfile[0] && cfg.isgpuinfo == 0) {
+        mesh_runpmc(&mesh, &cfg);
+        mesh_clear(&mesh, &cfg);
+        mcx_clearcfg(&cfg);
+#ifdef MMC_USE_MPI
+        MPI_Finalize();
+#endif
+        return 0;
+    }
+
     /**
      * In the second step, we pre-compute all needed mesh and ray-tracing data
      * and get ready for launching photon simulations.
@@ -71,26 +142,49 @@ int main(int argc, char** argv) {
         mmc_prep(&cfg, &mesh, &tracer);
     }
 
+    /**
+     * With --estimate, the memory of each buffer and the runtime projected from
+     * a short calibration run are reported instead of running the simulation.
+     */
+    if (cfg.isestimate && cfg.isgpuinfo == 0) {
+        mmc_estimate(&cfg, &mesh, &tracer, mmc_run);
+        mmc_cleanup(&cfg, &mesh, &tracer);
+#ifdef MMC_USE_MPI
+        MPI_Finalize();
+#endif
+        return 0;
+    }
+
     /**
      * The core simulation loop is executed in the mmc_run_mp() function where
      * multiple threads are executed to simulate all photons.
      */
-    if (cfg.compute == cbSSE || cfg.gpuid > MAX_DEVICE) {
-        mmc_run_mp(&cfg, &mesh, &tracer);
-    }
+    trun = GetTimeNanos();
 
-#ifdef USE_CUDA
-    else if (cfg.compute == cbCUDA) {
-        mmc_run_cu(&cfg, &mesh, &tracer);
+    /**
+     * With --serve, the prepared mesh and ray-tracer are reused by every job
+     * read from the queue, instead of running the input once. With
+     * --resultcache, a run identical to a cached one copies its outputs.
+     */
+    if (cfg.servefile[0] && cfg.isgpuinfo == 0) {
+        mmc_serve(&cfg, &mesh, &tracer, mmc_run);
+    } else if (cfg.resultcache[0] && cfg.isgpuinfo == 0) {
+        mmc_cacherun(&cfg, &mesh, &tracer, mmc_run);
+    } else {
+        mmc_run(&cfg, &mesh, &tracer);
     }
 
-#endif
-#ifdef USE_OPENCL
-    else {
-        mmc_run_cl(&cfg, &mesh, &tracer);
-    }
+    /**
+     * The GPU backends do not time the phases of a run separately, in which
+     * case the whole run is reported as the simulation phase.
+     */
+    if (cfg.issaveprofile && cfg.isgpuinfo == 0 && cfg.mpirank == 0) {
+        if (cfg.profile[ppSimulation] == 0) {
+            cfg.profile[ppSimulation] = GetTimeNanos() - trun;
+        }
 
-#endif
+        mcx_saveprofile(&cfg);
+    }
 
     /**
      * Once all photon simulations are complete, we clean up all allocated memory
@@ -98,5 +192,9 @@ int main(int argc, char** argv) {
      */
     mmc_cleanup(&cfg, &mesh, &tracer);
 
+#ifdef MMC_USE_MPI
+    MPI_Finalize();
+#endif
+
     return 0;
 }
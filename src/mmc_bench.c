@@ -39,7 +39,9 @@
 
 #define MSTR(...) #__VA_ARGS__
 
-const char* benchname[MAX_MCX_BENCH] = {"dmmc-cube60", "dmmc-cube60b", "edgeimmc", "nodeimmc", "faceimmc", ""};
+const char* benchname[MAX_MCX_BENCH] = {"dmmc-cube60", "dmmc-cube60b", "edgeimmc", "nodeimmc", "faceimmc",
+                                         "scale-1e5", "scale-1e6", "scale-1e7", "scale-5e7", ""
+                                        };
 
 const char* benchjson[MAX_MCX_BENCH] = {
 MSTR(
@@ -431,6 +433,214 @@ MSTR(
              "Dir":[0,0,-1]
          }
      }
+}),
+
+MSTR(
+{
+    "Session": {
+        "ID": "scale-1e5",
+        "Photons": 1e6,
+        "RNGSeed": 1648335518,
+        "OutputFormat": "bin",
+        "DoMismatch": 0
+    },
+    "Domain" : {
+         "Media": [
+             {"mua": 0.00, "mus": 0.0, "g": 1.00, "n": 1.0},
+             {"mua": 0.005,"mus": 1.0, "g": 0.01, "n": 1.37}
+         ]
+    },
+    "Mesh": {
+        "MeshGen": {
+            "Size": [26, 26, 26],
+            "Step": 2.30769231
+        }
+    },
+    "Forward": {
+        "T0": 0.0e+00,
+        "T1": 5.0e-09,
+        "Dt": 5.0e-09
+    },
+    "Optode": {
+        "Source": {
+            "Pos": [30.1, 30.2, 0.0],
+            "Dir": [0.0, 0.0, 1.0]
+        },
+        "Detector": [
+            {
+                "Pos": [30.0, 20.0, 0.0],
+                "R": 1.0
+            },
+            {
+                "Pos": [30.0, 40.0, 0.0],
+                "R": 1.0
+            },
+            {
+                "Pos": [20.0, 30.0, 0.0],
+                "R": 1.0
+            },
+            {
+                "Pos": [40.0, 30.0, 0.0],
+                "R": 1.0
+            }
+        ]
+    }
+}),
+
+MSTR(
+{
+    "Session": {
+        "ID": "scale-1e6",
+        "Photons": 1e6,
+        "RNGSeed": 1648335518,
+        "OutputFormat": "bin",
+        "DoMismatch": 0
+    },
+    "Domain" : {
+         "Media": [
+             {"mua": 0.00, "mus": 0.0, "g": 1.00, "n": 1.0},
+             {"mua": 0.005,"mus": 1.0, "g": 0.01, "n": 1.37}
+         ]
+    },
+    "Mesh": {
+        "MeshGen": {
+            "Size": [56, 56, 56],
+            "Step": 1.07142857
+        }
+    },
+    "Forward": {
+        "T0": 0.0e+00,
+        "T1": 5.0e-09,
+        "Dt": 5.0e-09
+    },
+    "Optode": {
+        "Source": {
+            "Pos": [30.1, 30.2, 0.0],
+            "Dir": [0.0, 0.0, 1.0]
+        },
+        "Detector": [
+            {
+                "Pos": [30.0, 20.0, 0.0],
+                "R": 1.0
+            },
+            {
+                "Pos": [30.0, 40.0, 0.0],
+                "R": 1.0
+            },
+            {
+                "Pos": [20.0, 30.0, 0.0],
+                "R": 1.0
+            },
+            {
+                "Pos": [40.0, 30.0, 0.0],
+                "R": 1.0
+            }
+        ]
+    }
+}),
+
+MSTR(
+{
+    "Session": {
+        "ID": "scale-1e7",
+        "Photons": 1e6,
+        "RNGSeed": 1648335518,
+        "OutputFormat": "bin",
+        "DoMismatch": 0
+    },
+    "Domain" : {
+         "Media": [
+             {"mua": 0.00, "mus": 0.0, "g": 1.00, "n": 1.0},
+             {"mua": 0.005,"mus": 1.0, "g": 0.01, "n": 1.37}
+         ]
+    },
+    "Mesh": {
+        "MeshGen": {
+            "Size": [119, 119, 119],
+            "Step": 0.50420168
+        }
+    },
+    "Forward": {
+        "T0": 0.0e+00,
+        "T1": 5.0e-09,
+        "Dt": 5.0e-09
+    },
+    "Optode": {
+        "Source": {
+            "Pos": [30.1, 30.2, 0.0],
+            "Dir": [0.0, 0.0, 1.0]
+        },
+        "Detector": [
+            {
+                "Pos": [30.0, 20.0, 0.0],
+                "R": 1.0
+            },
+            {
+                "Pos": [30.0, 40.0, 0.0],
+                "R": 1.0
+            },
+            {
+                "Pos": [20.0, 30.0, 0.0],
+                "R": 1.0
+            },
+            {
+                "Pos": [40.0, 30.0, 0.0],
+                "R": 1.0
+            }
+        ]
+    }
+}),
+
+MSTR(
+{
+    "Session": {
+        "ID": "scale-5e7",
+        "Photons": 1e6,
+        "RNGSeed": 1648335518,
+        "OutputFormat": "bin",
+        "DoMismatch": 0
+    },
+    "Domain" : {
+         "Media": [
+             {"mua": 0.00, "mus": 0.0, "g": 1.00, "n": 1.0},
+             {"mua": 0.005,"mus": 1.0, "g": 0.01, "n": 1.37}
+         ]
+    },
+    "Mesh": {
+        "MeshGen": {
+            "Size": [203, 203, 203],
+            "Step": 0.2955665
+        }
+    },
+    "Forward": {
+        "T0": 0.0e+00,
+        "T1": 5.0e-09,
+        "Dt": 5.0e-09
+    },
+    "Optode": {
+        "Source": {
+            "Pos": [30.1, 30.2, 0.0],
+            "Dir": [0.0, 0.0, 1.0]
+        },
+        "Detector": [
+            {
+                "Pos": [30.0, 20.0, 0.0],
+                "R": 1.0
+            },
+            {
+                "Pos": [30.0, 40.0, 0.0],
+                "R": 1.0
+            },
+            {
+                "Pos": [20.0, 30.0, 0.0],
+                "R": 1.0
+            },
+            {
+                "Pos": [40.0, 30.0, 0.0],
+                "R": 1.0
+            }
+        ]
+    }
 })
 
-};
\ No newline at end of file
+};
@@ -38,7 +38,7 @@
 #ifndef _MCEXTREME_BENCHMARK_H
 #define _MCEXTREME_BENCHMARK_H
 
-#define MAX_MCX_BENCH  6                           /**< Total number of built-in benchmarks */
+#define MAX_MCX_BENCH  10                          /**< Total number of built-in benchmarks */
 extern const char* benchname[MAX_MCX_BENCH];       /**< String list defining the names of each built-in benchmark */
 extern const char* benchjson[MAX_MCX_BENCH];       /**< JSON-formatted input configuration for each built-in benchmark */
 
@@ -35,6 +35,7 @@
 \brief   OpenCL host code for OpenCL based MMC simulations
 *******************************************************************************/
 
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
@@ -61,6 +62,878 @@ const char* sourceflag[] = {"-DMCX_SRC_PENCIL", "-DMCX_SRC_ISOTROPIC", "-DMCX_SR
 
 extern cl_event kernelevent;
 
+/**
+ * \brief Mesh buffers kept on the OpenCL devices between runs of the same mesh session
+ *
+ * When cfg->meshsession is non-zero, the context and the node, elem, type, facenb
+ * and normal buffers outlive mmc_run_cl(); a later run with the same session id,
+ * mesh dimensions, ray-tracing method and devices uses them without uploading the mesh.
+ */
+
+typedef struct MMC_clmeshcache {
+    int session;                   /**< cfg->meshsession of the run that created the buffers, 0 if empty */
+    int nn;                        /**< number of nodes */
+    int ne;                        /**< number of elements */
+    int elemlen;                   /**< number of nodes per element */
+    int method;                    /**< ray-tracing method, determines the normal buffer */
+    int ispackmesh;                /**< 1 if the normal buffer holds the packed element records */
+    int halffacenum;               /**< number of faces in the shared face table of --halfface, 0 if not used */
+    cl_uint workdev;               /**< number of devices */
+    cl_device_id devices[MAX_DEVICE]; /**< the devices of the context */
+    cl_context context;            /**< the context owning the buffers */
+    cl_mem* gnode, *gelem, *gtype, *gfacenb, *gnormal; /**< per-device mesh buffers */
+} clmeshcache;
+
+static clmeshcache clmesh = {0};
+
+/**
+ * @brief Release the device-resident mesh buffers kept by a previous mesh session
+ */
+
+void mmc_cl_release_meshcache(void) {
+    cl_mem* buf[] = {clmesh.gnode, clmesh.gelem, clmesh.gtype, clmesh.gfacenb, clmesh.gnormal};
+    cl_uint i, j;
+
+    if (clmesh.session == 0) {
+        return;
+    }
+
+    for (i = 0; i < sizeof(buf) / sizeof(buf[0]); i++) {
+        for (j = 0; j < clmesh.workdev; j++) {
+            OCL_ASSERT(clReleaseMemObject(buf[i][j]));
+        }
+
+        free(buf[i]);
+    }
+
+    OCL_ASSERT(clReleaseContext(clmesh.context));
+    memset(&clmesh, 0, sizeof(clmeshcache));
+}
+
+#define MMC_KERNEL_CACHE_MAGIC   "MMCCLBN"
+#define MMC_KERNEL_CACHE_VERSION 1
+
+/**
+ * \brief Header of the on-disk OpenCL program binary cache (kernel_<hash>.clbin)
+ *
+ * The header is followed by ndev 64bit binary lengths and then by the program
+ * binary of each device, in the order the devices were passed to the context
+ */
+
+typedef struct MMC_kernelcacheheader {
+    char magic[8];                 /**< MMC_KERNEL_CACHE_MAGIC */
+    unsigned int version;          /**< cache format version */
+    unsigned int headersize;       /**< sizeof(kernelcacheheader) */
+    unsigned long long hash;       /**< hash of the kernel source, build options and device/driver identity */
+    unsigned int ndev;             /**< number of devices */
+    unsigned int reserved;         /**< padding, always 0 */
+} kernelcacheheader;
+
+/**
+ * @brief Compute the key of the program binary cache
+ *
+ * The key covers the kernel source, the full build option string and, for each
+ * device, the platform, device name and version and the driver version, so that
+ * a driver or hardware change never loads a stale binary.
+ *
+ * @param[in] source: the OpenCL kernel source
+ * @param[in] opt: the build options passed to clBuildProgram
+ * @param[in] devices: the list of devices in the context
+ * @param[in] workdev: the number of devices
+ */
+
+static unsigned long long mmc_kernel_cache_hash(const char* source, const char* opt, cl_device_id* devices, cl_uint workdev) {
+    const cl_device_info keys[] = {CL_DEVICE_PLATFORM, CL_DEVICE_VENDOR, CL_DEVICE_NAME, CL_DEVICE_VERSION, CL_DRIVER_VERSION};
+    unsigned long long hash = 0xcbf29ce484222325ULL;
+    char info[MAX_PATH_LENGTH];
+    cl_uint i, j;
+
+    hash = mesh_hashbuffer(source, strlen(source), hash);
+    hash = mesh_hashbuffer(opt, strlen(opt) + 1, hash);
+
+    for (i = 0; i < workdev; i++) {
+        for (j = 0; j < sizeof(keys) / sizeof(keys[0]); j++) {
+            size_t len = 0;
+
+            if (keys[j] == CL_DEVICE_PLATFORM) {
+                cl_platform_id platform = NULL;
+
+                if (clGetDeviceInfo(devices[i], CL_DEVICE_PLATFORM, sizeof(platform), &platform, NULL) == CL_SUCCESS) {
+                    clGetPlatformInfo(platform, CL_PLATFORM_VERSION, sizeof(info), info, &len);
+                }
+            } else {
+                clGetDeviceInfo(devices[i], keys[j], sizeof(info), info, &len);
+            }
+
+            hash = mesh_hashbuffer(info, MIN(len, sizeof(info)), hash);
+            hash = mesh_hashbuffer(&j, sizeof(j), hash);
+        }
+    }
+
+    return hash;
+}
+
+/**
+ * @brief Create a program from the on-disk binary cache
+ *
+ * @param[in] fcache: the cache file name
+ * @param[in] head: the expected cache header
+ * @param[in] context: the OpenCL context
+ * @param[in] devices: the list of devices in the context
+ * @return the program created from the cached binaries (not yet built), or NULL if
+ *         the file does not exist or does not match the header
+ */
+
+static cl_program mmc_kernel_cache_load(const char* fcache, kernelcacheheader* head, cl_context context, cl_device_id* devices) {
+    kernelcacheheader filehead;
+    unsigned long long len[MAX_DEVICE];
+    size_t binlen[MAX_DEVICE];
+    unsigned char* bin[MAX_DEVICE] = {NULL};
+    cl_program program = NULL;
+    cl_int status = CL_SUCCESS;
+    cl_uint i = 0;
+    FILE* fp;
+
+    if ((fp = fopen(fcache, "rb")) == NULL) {
+        return NULL;
+    }
+
+    if (fread(&filehead, sizeof(kernelcacheheader), 1, fp) == 1 && memcmp(&filehead, head, sizeof(kernelcacheheader)) == 0 &&
+            fread(len, sizeof(len[0]), head->ndev, fp) == head->ndev) {
+        for (i = 0; i < head->ndev; i++) {
+            binlen[i] = (size_t)len[i];
+            bin[i] = (unsigned char*)malloc(binlen[i]);
+
+            if (binlen[i] == 0 || fread(bin[i], binlen[i], 1, fp) != 1) {
+                break;
+            }
+        }
+    }
+
+    fclose(fp);
+
+    if (i == head->ndev) {
+        program = clCreateProgramWithBinary(context, head->ndev, devices, binlen, (const unsigned char**)bin, NULL, &status);
+
+        if (status != CL_SUCCESS) {
+            program = NULL;
+        }
+    }
+
+    for (i = 0; i < head->ndev; i++) {
+        if (bin[i]) {
+            free(bin[i]);
+        }
+    }
+
+    return program;
+}
+
+/**
+ * @brief Save the binaries of a built program to the on-disk cache
+ *
+ * @param[in] fcache: the cache file name
+ * @param[in] head: the cache header
+ * @param[in] program: the built OpenCL program
+ * @param[in] cfg: the simulation configuration structure
+ */
+
+static void mmc_kernel_cache_save(const char* fcache, kernelcacheheader* head, cl_program program, mcconfig* cfg) {
+    char ftmp[MAX_FULL_PATH + 4];
+    unsigned long long len[MAX_DEVICE];
+    size_t binlen[MAX_DEVICE];
+    unsigned char* bin[MAX_DEVICE] = {NULL};
+    int iserror = 0;
+    cl_uint i;
+    FILE* fp;
+
+    if (clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES, head->ndev * sizeof(size_t), binlen, NULL) != CL_SUCCESS) {
+        return;
+    }
+
+    for (i = 0; i < head->ndev; i++) {
+        len[i] = binlen[i];
+        iserror |= (binlen[i] == 0);
+        bin[i] = (unsigned char*)malloc(binlen[i] + 1);
+    }
+
+    if (iserror == 0 && clGetProgramInfo(program, CL_PROGRAM_BINARIES, head->ndev * sizeof(unsigned char*), bin, NULL) == CL_SUCCESS) {
+        /*write to a temporary file first, so that concurrent runs never read a partial cache*/
+        sprintf(ftmp, "%s.tmp", fcache);
+
+        if ((fp = fopen(ftmp, "wb")) != NULL) {
+            iserror = (fwrite(head, sizeof(kernelcacheheader), 1, fp) != 1);
+            iserror |= (fwrite(len, sizeof(len[0]), head->ndev, fp) != head->ndev);
+
+            for (i = 0; i < head->ndev; i++) {
+                iserror |= (fwrite(bin[i], binlen[i], 1, fp) != 1);
+            }
+
+            iserror |= fclose(fp);
+
+            if (iserror || rename(ftmp, fcache)) {
+                remove(ftmp);
+            }
+        } else {
+            MMC_FPRINTF(cfg->flog, S_RED "WARNING: can not write the kernel cache %s\n" S_RESET, fcache);
+        }
+    }
+
+    for (i = 0; i < head->ndev; i++) {
+        free(bin[i]);
+    }
+}
+
+/**
+ * @brief Create a buffer in device memory, or in host memory accessed by the device over the bus
+ *
+ * The large output and replay buffers are placed in host memory when all buffers
+ * do not fit in the device memory (see cfg->unifiedmem), so that larger meshes run
+ * at a reduced speed. NVIDIA drivers pin such buffers with clCreateBufferNV and
+ * CL_MEM_LOCATION_HOST_NV; others are asked to with CL_MEM_ALLOC_HOST_PTR.
+ *
+ * @param[in] context: the OpenCL context
+ * @param[in] flags: the memory flags of the buffer, RO_MEM or RW_MEM
+ * @param[in] ishostmem: 1 to place the buffer in host memory
+ * @param[in] len: length of the buffer in bytes
+ * @param[in] hostptr: the initial content of the buffer
+ * @param[out] status: the OpenCL error code
+ * @param[in] createbuffernv: the clCreateBufferNV extension function, NULL if not supported
+ */
+
+static cl_mem mmc_cl_buffer(cl_context context, cl_mem_flags flags, int ishostmem, size_t len, void* hostptr, cl_int* status,
+                            cl_mem (*createbuffernv)(cl_context, cl_mem_flags, cl_mem_flags_NV, size_t, void*, cl_int*)) {
+    if (ishostmem && createbuffernv) {
+        cl_mem buf = createbuffernv(context, flags, NV_PIN, len, hostptr, status);
+
+        if (*status == CL_SUCCESS) {
+            return buf;
+        }
+    }
+
+    return clCreateBuffer(context, flags | (ishostmem ? CL_MEM_ALLOC_HOST_PTR : 0), len, hostptr, status);
+}
+
+/**
+ * @brief Give the host access to the content of an output buffer once the kernel is complete
+ *
+ * On a device sharing the host memory (GPUInfo::isunified), the output buffers are
+ * created with CL_MEM_ALLOC_HOST_PTR and mapped here, so that the host reads them in
+ * place; otherwise the content is copied to a new host array. The returned pointer
+ * must be released by mmc_cl_unmapout.
+ *
+ * @param[in] queue: the command queue of the device
+ * @param[in] buf: the output buffer
+ * @param[in] len: length of the buffer in bytes
+ * @param[in] iszerocopy: 1 to map the buffer, 0 to copy it
+ * @param[out] event: the event of the map or the copy, may be NULL
+ */
+
+static void* mmc_cl_mapout(cl_command_queue queue, cl_mem buf, size_t len, int iszerocopy, cl_event* event) {
+    void* ptr;
+    cl_int status = 0;
+
+    if (iszerocopy) {
+        OCL_ASSERT(((ptr = clEnqueueMapBuffer(queue, buf, CL_TRUE, CL_MAP_READ, 0, len, 0, NULL, event, &status)), status));
+        return ptr;
+    }
+
+    ptr = malloc(len);
+    OCL_ASSERT((clEnqueueReadBuffer(queue, buf, CL_TRUE, 0, len, ptr, 0, NULL, event)));
+    return ptr;
+}
+
+/**
+ * @brief Release the host view of an output buffer returned by mmc_cl_mapout
+ */
+
+static void mmc_cl_unmapout(cl_command_queue queue, cl_mem buf, void* ptr, int iszerocopy) {
+    if (iszerocopy) {
+        OCL_ASSERT((clEnqueueUnmapMemObject(queue, buf, ptr, 0, NULL, NULL)));
+    } else {
+        free(ptr);
+    }
+}
+
+/**
+ * @brief Upload the replay inputs of a chunk of photons to a replay buffer set
+ *
+ * The writes start once the kernel that last read the set has completed; as the
+ * queue is in order, the event of the last write marks the whole upload.
+ *
+ * @param[in] cfg: the simulation configuration structure, holding the inputs of all replayed photons
+ * @param[in] queue: the replay upload queue of the device
+ * @param[in] lastread: the kernel event of the previous chunk read from the set, NULL if none
+ * @param[in] first: index of the first photon of the chunk
+ * @param[in] len: photons in the chunk
+ * @param[in] weight, time, seed, detid: the buffers of the set, detid is NULL without cfg->replaydetid
+ * @param[out] uploaded: the event of the completed upload
+ */
+
+static void mmc_cl_uploadreplay(mcconfig* cfg, cl_command_queue queue, cl_event lastread, cl_uint first, cl_uint len,
+                                cl_mem weight, cl_mem time, cl_mem seed, cl_mem detid, cl_event* uploaded) {
+    cl_uint nwait = (lastread != NULL);
+    size_t seedlen = sizeof(RandType) * RAND_BUF_LEN;
+
+    OCL_ASSERT((clEnqueueWriteBuffer(queue, weight, CL_FALSE, 0, sizeof(float) * len, cfg->replayweight + first, nwait, (nwait ? &lastread : NULL), NULL)));
+    OCL_ASSERT((clEnqueueWriteBuffer(queue, time, CL_FALSE, 0, sizeof(float) * len, cfg->replaytime + first, 0, NULL, NULL)));
+
+    if (detid) {
+        OCL_ASSERT((clEnqueueWriteBuffer(queue, detid, CL_FALSE, 0, sizeof(int) * len, cfg->replaydetid + first, 0, NULL, NULL)));
+    }
+
+    OCL_ASSERT((clEnqueueWriteBuffer(queue, seed, CL_FALSE, 0, seedlen * len, (char*)cfg->photonseed + seedlen * first, 0, NULL, uploaded)));
+    OCL_ASSERT((clFlush(queue)));
+}
+
+/**
+ * @brief Add a flushed output buffer set to the batch-variance sums (--varbatch)
+ *
+ * Each flush of a set is a batch; its output is mapped to the nodes first if
+ * the output is node-based, as the squares of the element sums can not be
+ * mapped afterwards. See mesh_batchvariance.
+ *
+ * @param[in] cfg: the simulation configuration structure
+ * @param[in,out] mesh: the mesh object, mesh->weightvar receives the sums
+ * @param[in] buf: host copy of the set, both halves of the fieldlen*2 buffer
+ * @param[in] fieldlen: output length, not counting the 2nd half of the buffer
+ * @param[in] nphoton: the photons deposited in the set since its last flush
+ */
+
+static void mmc_cl_addvariance(mcconfig* cfg, tetmesh* mesh, const float* buf, cl_uint fieldlen, double nphoton) {
+    size_t i, j, k, frame = (size_t)((cfg->method == rtBLBadouelGrid) ? cfg->crop0.z : mesh->ne) * cfg->srcnum;
+    double* batch;
+
+    if (cfg->basisorder == 0 || cfg->method == rtBLBadouelGrid) {
+        for (i = 0; i < frame * cfg->maxgate; i++) {
+            double delta = (double)buf[i] + buf[i + fieldlen];
+
+            mesh->weightvar[i] += delta * delta / nphoton;
+        }
+
+        return;
+    }
+
+    batch = (double*)calloc((size_t)mesh->nn * cfg->srcnum, sizeof(double));
+
+    for (i = 0; i < (size_t)cfg->maxgate; i++) {
+        double* var = mesh->weightvar + i * mesh->nn * cfg->srcnum;
+
+        memset(batch, 0, sizeof(double) * mesh->nn * cfg->srcnum);
+
+        for (j = 0; j < (size_t)mesh->ne; j++) {
+            for (k = 0; k < (size_t)cfg->srcnum; k++) {
+                size_t id = i * frame + j * cfg->srcnum + k;
+                double ww = ((double)buf[id] + buf[id + fieldlen]) * 0.25;
+                int n;
+
+                for (n = 0; n < mesh->elemlen; n++) {
+                    batch[(mesh->elem[j * mesh->elemlen + n] - 1) * cfg->srcnum + k] += ww;
+                }
+            }
+        }
+
+        for (j = 0; j < (size_t)mesh->nn * cfg->srcnum; j++) {
+            var[j] += batch[j] * batch[j] / nphoton;
+        }
+    }
+
+    free(batch);
+}
+
+/**
+ * @brief Add a flushed output buffer set to the double-precision host sum
+ *
+ * The set was read to buf through the read-back queue and cleared on the
+ * device, the last of the two commands signals ev. This waits for both, so
+ * that the set can be filled again by the next kernel. With --varbatch, the
+ * set is also added to the batch-variance sums.
+ *
+ * @param[in,out] ev: the event of the pending flush, released and set to NULL
+ * @param[in] buf: host copy of the set, both halves of the fieldlen*2 buffer
+ * @param[in,out] dfield: the host sum of the output
+ * @param[in] fieldlen: output length, not counting the 2nd half of the buffer
+ * @param[in] cfg: the simulation configuration structure
+ * @param[in,out] mesh: the mesh object
+ * @param[in,out] setphoton: the photons deposited in the set, reset to 0
+ * @param[in,out] varstat: the batch number and the photon number of the variance sums
+ */
+
+static void mmc_cl_flushweight(cl_event* ev, const float* buf, double* dfield, cl_uint fieldlen, mcconfig* cfg, tetmesh* mesh,
+                               double* setphoton, double* varstat) {
+    cl_uint i;
+
+    if (*ev == NULL) {
+        return;
+    }
+
+    OCL_ASSERT((clWaitForEvents(1, ev)));
+    OCL_ASSERT((clReleaseEvent(*ev)));
+    *ev = NULL;
+
+    for (i = 0; i < fieldlen; i++) {
+        dfield[i] += (double)buf[i] + buf[i + fieldlen];
+    }
+
+    if (mesh->weightvar && *setphoton > 0.0) {
+        mmc_cl_addvariance(cfg, mesh, buf, fieldlen, *setphoton);
+        varstat[0] += 1.0;
+        varstat[1] += *setphoton;
+    }
+
+    *setphoton = 0.0;
+}
+
+/**
+ * @brief Append the detected photons of one device to cfg->exportdetected
+ *
+ * In the streaming mode (cfg->streamdet > 0), the records are written to the
+ * output file instead, so that the host memory does not grow with the respins.
+ * The records are read through the read-back queue once the given kernel-end
+ * event has completed, so that the kernel of the next respin, which fills the
+ * other set of the double-buffered detected photon buffers, runs at the same time.
+ *
+ * @param[in] cfg: the simulation configuration structure
+ * @param[in] queue: the read-back command queue of the device
+ * @param[in] kernelend: the event marking the end of the kernel that filled the buffers
+ * @param[in] gdetected: the detected photon counter
+ * @param[in] gdetphoton: the detected photon records
+ * @param[in] gphotonseed: the RNG states of the detected photons, used if cfg->issaveseed is set
+ * @param[out] Pdet: host buffer for cfg->maxdetphoton records
+ * @param[out] Pphotonseed: host buffer for cfg->maxdetphoton RNG states
+ * @param[in] hostdetreclen: the length of a detected photon record in float
+ * @param[in] mesh: the mesh object, used to restore the detector IDs of streamed records
+ * @return the number of records copied to Pdet
+ */
+
+static cl_uint mmc_cl_readdetected(mcconfig* cfg, cl_command_queue queue, cl_event kernelend, cl_mem gdetected, cl_mem gdetphoton,
+                                cl_mem gphotonseed, float* Pdet, RandType* Pphotonseed, cl_uint hostdetreclen, tetmesh* mesh) {
+    cl_uint detected = 0, total = cfg->detectedcount + ((cfg->streamdet > 0) ? cfg->his.savedphoton : 0);
+
+    OCL_ASSERT((clEnqueueReadBuffer(queue, gdetected, CL_TRUE, 0, sizeof(cl_uint), &detected, 1, &kernelend, NULL)));
+
+    if (detected > cfg->maxdetphoton) {
+        MMC_FPRINTF(cfg->flog, "WARNING: the detected photon (%d) \
+is more than what your have specified (%d), please use the -H option to specify a greater number\t"
+                    , detected, cfg->maxdetphoton);
+    } else {
+        MMC_FPRINTF(cfg->flog, "detected %d photons, total: %d\t", detected, total + detected);
+    }
+
+    cfg->his.detected += detected;
+    detected = MIN(detected, cfg->maxdetphoton);
+
+    if (detected == 0) {
+        return 0;
+    }
+
+    OCL_ASSERT((clEnqueueReadBuffer(queue, gdetphoton, CL_FALSE, 0, sizeof(float) * detected * hostdetreclen, Pdet, 0, NULL, NULL)));
+
+    if (cfg->issaveseed && cfg->streamdet <= 0) {
+        OCL_ASSERT((clEnqueueReadBuffer(queue, gphotonseed, CL_FALSE, 0, detected * (sizeof(RandType) * RAND_BUF_LEN), Pphotonseed, 0, NULL, NULL)));
+    }
+
+    OCL_ASSERT((clFinish(queue)));
+
+    if (cfg->streamdet > 0) {
+#ifndef MCX_CONTAINER
+        mesh_restoredetid(mesh, cfg, Pdet, detected, hostdetreclen);
+        mesh_appenddetphoton(Pdet, detected, hostdetreclen, cfg);
+#endif
+    } else if (cfg->exportdetected) {
+        cfg->exportdetected = (float*)realloc(cfg->exportdetected, (cfg->detectedcount + detected) * hostdetreclen * sizeof(float));
+        memcpy(cfg->exportdetected + cfg->detectedcount * (hostdetreclen), Pdet, detected * (hostdetreclen)*sizeof(float));
+
+        if (cfg->issaveseed) {
+            cfg->exportseed = (unsigned char*)realloc(cfg->exportseed, (cfg->detectedcount + detected) * (sizeof(RandType) * RAND_BUF_LEN));
+            memcpy(cfg->exportseed + cfg->detectedcount * sizeof(RandType)*RAND_BUF_LEN, Pphotonseed, detected * (sizeof(RandType)*RAND_BUF_LEN));
+        }
+
+        cfg->detectedcount += detected;
+    }
+
+    return detected;
+}
+
+/**
+ * @brief Count the detected photons of one respin per detector for the convergence test
+ *
+ * The GPU records do not store the partial paths, so the convergence of a detector
+ * is measured on its detected photon count.
+ *
+ * @param[in] cfg: the simulation configuration structure
+ * @param[in] Pdet: the records read by mmc_cl_readdetected
+ * @param[in] count: the number of records in Pdet
+ * @param[in] hostdetreclen: the length of a detected photon record in float
+ * @param[in,out] total: the accumulated detected photon count of each detector
+ */
+
+static void mmc_cl_convcount(mcconfig* cfg, float* Pdet, cl_uint count, cl_uint hostdetreclen, double* total) {
+    cl_uint i;
+    int detid;
+
+    for (i = 0; i < count; i++) {
+        detid = (int)Pdet[i * hostdetreclen];
+        total[(detid >= 1 && detid <= (int)cfg->detnum) ? detid - 1 : 0] += 1.0;
+    }
+}
+
+#define MMC_DYNLOAD_FIRST_SPLIT  4     /**< the first chunk of a device is 1/4 of its static share */
+#define MMC_DYNLOAD_GUIDED_SPLIT 2     /**< later chunks cover 1/2 of the projected remaining time */
+
+/**
+ * @brief Size the next photon chunk of a device in the dynamic load-balancing mode
+ *
+ * Before a device has completed any chunk, it receives a fraction of its static
+ * share; afterwards, chunks follow a guided schedule: a device receives the photons
+ * it is expected to simulate in half of the time that all devices need to drain
+ * the queue at their measured throughput, so that chunks shrink towards the end
+ * and all devices finish at nearly the same time.
+ *
+ * @param[in] remain: the number of photons left in the queue
+ * @param[in] share: the static share of this device, from cfg->workload
+ * @param[in] rate: the measured throughput of this device (photon/ms), 0 if unknown
+ * @param[in] ratesum: the sum of the measured throughputs of all devices
+ * @param[in] nthread: the total thread number of this device
+ */
+
+static cl_ulong mmc_cl_chunksize(cl_ulong remain, double share, double rate, double ratesum, size_t nthread) {
+    double chunk;
+
+    if (rate <= 0.0 || ratesum <= 0.0) {
+        chunk = share / MMC_DYNLOAD_FIRST_SPLIT;
+    } else {
+        chunk = rate * (remain / ratesum) / MMC_DYNLOAD_GUIDED_SPLIT;
+    }
+
+    chunk = MIN(chunk, (double)0x7FFFFFFF * nthread);
+    chunk = MAX(chunk, (double)nthread);   /*at least one photon per thread*/
+
+    return MIN((cl_ulong)chunk, remain);
+}
+
+/**
+ * @brief Event callback storing the final status of a command, CL_COMPLETE or a negative error code
+ */
+
+static void CL_CALLBACK mmc_cl_eventdone(cl_event ev, cl_int status, void* flag) {
+    #pragma omp atomic write
+    *(volatile cl_int*)flag = status;
+}
+
+/**
+ * @brief Let the driver report the completion of a command to a host flag
+ *
+ * The flag holds CL_QUEUED until the command ends. Reading it replaces polling the
+ * event status, so that the host thread only wakes up to draw the progress bar or
+ * when a command is expected to finish, rather than spinning through the run.
+ *
+ * @param[in] ev: the event of the command
+ * @param[out] flag: the flag set by mmc_cl_eventdone, it must outlive the command
+ */
+
+static void mmc_cl_watchevent(cl_event ev, volatile cl_int* flag) {
+    *flag = CL_QUEUED;
+    OCL_ASSERT((clSetEventCallback(ev, CL_COMPLETE, mmc_cl_eventdone, (void*)flag)));
+}
+
+/**
+ * @brief Read a flag set by mmc_cl_eventdone
+ */
+
+static cl_int mmc_cl_eventstatus(volatile cl_int* flag) {
+    cl_int status;
+
+    #pragma omp atomic read
+    status = *flag;
+
+    return status;
+}
+
+/**
+ * \struct MMC_cl_timer mmc_cl_host.c
+ * \brief A kernel or read-back time counter of the profile report, fed by event callbacks
+ */
+
+typedef struct MMC_cl_timer {
+    unsigned long long* total;     /**< the counter in devprof receiving the command times in ns */
+    unsigned int* count;           /**< the counter of timed commands in devprof, or NULL */
+    volatile cl_int pending;       /**< number of timed commands whose time is not yet added */
+} cltimer;
+
+/**
+ * @brief Event callback adding the execution time of a command to a cltimer
+ */
+
+static void CL_CALLBACK mmc_cl_eventtime(cl_event ev, cl_int status, void* timer) {
+    cltimer* t = (cltimer*)timer;
+    cl_ulong tstart = 0, tend = 0;
+
+    if (status == CL_COMPLETE
+            && clGetEventProfilingInfo(ev, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &tstart, NULL) == CL_SUCCESS
+            && clGetEventProfilingInfo(ev, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &tend, NULL) == CL_SUCCESS && tend > tstart) {
+        #pragma omp atomic
+        *(t->total) += (unsigned long long)(tend - tstart);
+    }
+
+    if (t->count) {
+        #pragma omp atomic
+        (*(t->count))++;
+    }
+
+    clReleaseEvent(ev);
+
+    #pragma omp atomic
+    t->pending--;
+}
+
+/**
+ * @brief Add the execution time of a command to a cltimer once it completes
+ *
+ * The command must be in a queue created with CL_QUEUE_PROFILING_ENABLE. The event is
+ * retained until the callback has run, so the caller may release it at any time.
+ *
+ * @param[in] ev: the event of the command, nothing is done if it is NULL
+ * @param[in,out] timers: the counters, or NULL if the run is not profiled
+ * @param[in] id: the counter receiving the time
+ */
+
+static void mmc_cl_timeevent(cl_event ev, cltimer* timers, int id) {
+    cltimer* timer;
+
+    if (timers == NULL || ev == NULL) {
+        return;
+    }
+
+    timer = timers + id;
+
+    #pragma omp atomic
+    timer->pending++;
+
+    OCL_ASSERT((clRetainEvent(ev)));
+    OCL_ASSERT((clSetEventCallback(ev, CL_COMPLETE, mmc_cl_eventtime, (void*)timer)));
+}
+
+/**
+ * @brief Time a command by its event, see mmc_cl_timeevent, and release the event
+ *
+ * @param[in,out] ev: the event of the command, set to NULL; nothing is done if it is NULL
+ * @param[in,out] timers: the counters, or NULL if the run is not profiled
+ * @param[in] id: the counter receiving the time
+ */
+
+static void mmc_cl_timerelease(cl_event* ev, cltimer* timers, int id) {
+    if (*ev) {
+        mmc_cl_timeevent(*ev, timers, id);
+        OCL_ASSERT((clReleaseEvent(*ev)));
+        *ev = NULL;
+    }
+}
+
+/**
+ * @brief Wait until the callbacks of all timed commands have run, see mmc_cl_timeevent
+ *
+ * The callbacks may run after clFinish returns, so the counters are only complete once
+ * no command is pending.
+ */
+
+static void mmc_cl_waittimer(cltimer* timer, int len) {
+    int i;
+
+    for (i = 0; i < len; i++) {
+        while (mmc_cl_eventstatus(&timer[i].pending) > 0) {
+            sleep_ms(1);
+        }
+    }
+}
+
+#define MMC_AUTOTUNE_PHOTON 1000000     /**< photons of each calibration run of --autotune, at most -n */
+
+/**
+ * @brief Run a short simulation on a single device at the given launch settings, see mmc_cl_autotune
+ *
+ * The run is a copy of the configuration with its own output buffers, so that it leaves
+ * the outputs, detected photons and energy counters of cfg and mesh untouched; its log
+ * goes to a temporary file.
+ *
+ * @param[in] cfg: the simulation configuration
+ * @param[in] mesh: the mesh
+ * @param[in] tracer: the ray-tracer
+ * @param[in] id: the 1-based index of the device in -G
+ * @param[in] block: the work-group size
+ * @param[in] nthread: the total thread number
+ * @param[in] fieldlen: the length of the output buffer
+ * @param[in] dreflen: the length of the surface output buffer
+ * @return the photon throughput of the kernel in photon/ms
+ */
+
+static double mmc_cl_trialrun(mcconfig* cfg, tetmesh* mesh, raytracer* tracer, int id, size_t block, size_t nthread, size_t fieldlen, size_t dreflen) {
+    mcconfig trial = *cfg;
+    tetmesh trialmesh = *mesh;
+    double rate;
+
+    memset(trial.deviceid, 0, MAX_DEVICE);
+    trial.deviceid[id - 1] = '1';
+    memset(trial.workload, 0, sizeof(trial.workload));
+    trial.autopilot = 0;
+    trial.autotune = 0;
+    trial.nblocksize = (int)block;
+    trial.nthread = (int)nthread;
+    trial.nphoton = MIN(cfg->nphoton, MMC_AUTOTUNE_PHOTON);
+    trial.respin = 1;
+    trial.flushrespin = 0;
+    trial.varbatch = 0;
+    trial.isdynload = 0;
+    trial.convtarget = 0.f;
+    trial.isnormalized = 0;
+    trial.meshsession = 0;
+    trial.debuglevel &= ~MCX_DEBUG_PROGRESS;
+    trial.progressfun = NULL;
+    trial.cancelflag = NULL;
+    trial.issaveprofile = 0;
+    trial.devprof = NULL;
+    trial.profdev = 0;
+    trial.detectedcount = 0;
+    trial.debugdatalen = 0;
+    trial.runtime = 0;
+    trial.exportfield = (double*)calloc(fieldlen, sizeof(double));
+    trial.exportdetected = NULL;
+    trial.exportseed = NULL;
+    trial.exportdebugdata = NULL;
+    trial.exportdetimage = NULL;
+    trial.energytot = NULL;
+    trial.energyesc = NULL;
+    trialmesh.weight = trial.exportfield;
+    trialmesh.dref = (mesh->dref) ? (double*)calloc(dreflen, sizeof(double)) : NULL;
+    trialmesh.weightvar = NULL;
+
+    if ((trial.flog = tmpfile()) == NULL) {
+        trial.flog = cfg->flog;
+    }
+
+    mmc_run_cl(&trial, &trialmesh, tracer);
+
+    rate = trial.nphoton / (double)MAX(trial.runtime, 1);
+
+    if (trial.flog != cfg->flog) {
+        fclose(trial.flog);
+    }
+
+    free(trial.exportfield);
+    free(trial.exportdetected);
+    free(trial.exportseed);
+    free(trial.exportdebugdata);
+    free(trial.exportdetimage);
+    free(trialmesh.dref);
+    free(trialmesh.weightvar);
+
+    return rate;
+}
+
+/**
+ * @brief Replace the autopilot thread/block heuristics by calibrated settings, see --autotune
+ *
+ * The settings are keyed, like the program binary cache, by the kernel source and the
+ * platform, device and driver of each device, and also by the kind of simulation: the
+ * method, outputs and source settings that change the kernel or its memory footprint.
+ * They are read from autotune_<hash>.txt in the root path, one "block thread" line per
+ * device. On a cache miss, or with --autotune 2, each device simulates up to
+ * MMC_AUTOTUNE_PHOTON photons of the same configuration at each work-group size, at
+ * the heuristic work-groups per compute unit, and then at each work-group count per
+ * compute unit, at the fastest size; the settings of the highest throughput are saved.
+ *
+ * @param[in] cfg: the simulation configuration
+ * @param[in] mesh: the mesh
+ * @param[in] tracer: the ray-tracer
+ * @param[in] devices: the devices of the run
+ * @param[in] gpu: the device information, autoblock/autothread hold the settings of mcx_list_cl_gpu
+ * @param[in] workdev: the number of devices
+ * @param[out] tuned: the work-group size and total thread number of each device
+ */
+
+static void mmc_cl_autotune(mcconfig* cfg, tetmesh* mesh, raytracer* tracer, cl_device_id* devices, GPUInfo* gpu, cl_uint workdev, size_t tuned[][2]) {
+    const size_t blocks[] = {32, 64, 128, 256};
+    const size_t groups[] = {4, 8, 16, 32, 64};
+    char kind[MAX_PATH_LENGTH], format[MAX_PATH_LENGTH], fcache[MAX_FULL_PATH];
+    size_t frames = (size_t)((cfg->tend - cfg->tstart) / cfg->tstep + 0.5) * cfg->replaydetnum + 2 * cfg->freqnum;
+    size_t fieldlen = MAX((size_t)((cfg->method == rtBLBadouelGrid) ? cfg->crop0.z : mesh->ne), (size_t)mesh->nn) * cfg->srcnum * frames;
+    size_t dreflen = (size_t)mesh->nf * cfg->srcnum * (size_t)((cfg->tend - cfg->tstart) / cfg->tstep + 0.5);
+    size_t threadmem = sizeof(cl_float) * ((cfg->issavedet ? mcx_detreclen(cfg, mesh->prop) : 0) + 3 * cfg->srcnum);
+    cl_uint i, j, pass;
+    FILE* fp;
+
+    sprintf(kind, "autotune %d %d %d %d %d %d %d %d %d %d %d %d %d %d %d", cfg->method, cfg->basisorder, cfg->outputtype, cfg->issave2pt,
+            cfg->issavedet, cfg->issaveref, cfg->issaveexit, cfg->srctype, cfg->srcnum, cfg->ispersistent, cfg->isatomic,
+            cfg->islocalmesh, cfg->ispackmesh, cfg->ishalfface, cfg->freqnum);
+    sprintf(format, "autotune_%016llx.txt", mmc_kernel_cache_hash(cfg->clsource, kind, devices, workdev));
+    mesh_filenames(format, fcache, cfg);
+
+    if (cfg->autotune == 1 && (fp = fopen(fcache, "rt")) != NULL) {
+        unsigned long long block, nthread;
+
+        for (i = 0; i < workdev; i++) {
+            if (fscanf(fp, "%llu %llu", &block, &nthread) != 2 || block == 0 || nthread < block) {
+                break;
+            }
+
+            tuned[i][0] = (size_t)block;
+            tuned[i][1] = (size_t)nthread;
+        }
+
+        fclose(fp);
+
+        if (i == workdev) {
+            MMCDEBUG(cfg, dlTime, (cfg->flog, "loaded the calibrated thread settings from %s\n", fcache));
+            return;
+        }
+    }
+
+    MMC_FPRINTF(cfg->flog, "calibrating the thread settings of %u device(s), saved to %s\n", workdev, fcache);
+
+    for (i = 0; i < workdev; i++) {
+        size_t maxblock = 0, block = (gpu[i].autoblock > 0) ? gpu[i].autoblock : 64;
+        size_t group = (gpu[i].autothread >= block * gpu[i].sm) ? gpu[i].autothread / (block * gpu[i].sm) : 16;
+        double rate, bestrate = 0.0;
+
+        tuned[i][0] = gpu[i].autoblock;
+        tuned[i][1] = gpu[i].autothread;
+        clGetDeviceInfo(devices[i], CL_DEVICE_MAX_WORK_GROUP_SIZE, sizeof(size_t), &maxblock, NULL);
+
+        /*the work-group size at the heuristic occupancy first, then the occupancy at the fastest size*/
+        for (pass = 0; pass < 2; pass++) {
+            cl_uint ntry = (pass == 0) ? sizeof(blocks) / sizeof(blocks[0]) : sizeof(groups) / sizeof(groups[0]);
+
+            for (j = 0; j < ntry; j++) {
+                size_t tryblock = (pass == 0) ? blocks[j] : tuned[i][0];
+                size_t trythread = tryblock * ((pass == 0) ? group : groups[j]) * gpu[i].sm;
+
+                if (tryblock > maxblock || threadmem * tryblock > gpu[i].sharedmem || (pass == 1 && groups[j] == group)) {
+                    continue;
+                }
+
+                rate = mmc_cl_trialrun(cfg, mesh, tracer, gpu[i].id, tryblock, trythread, fieldlen, dreflen);
+                MMC_FPRINTF(cfg->flog, "- [device %d: %s] block %u, thread %u: %.1f photon/ms\n", gpu[i].id, gpu[i].name, (uint)tryblock, (uint)trythread, rate);
+
+                if (rate > bestrate) {
+                    bestrate = rate;
+                    tuned[i][0] = tryblock;
+                    tuned[i][1] = trythread;
+                }
+            }
+        }
+    }
+
+    if ((fp = fopen(fcache, "wt")) != NULL) {
+        for (i = 0; i < workdev; i++) {
+            fprintf(fp, "%llu %llu\n", (unsigned long long)tuned[i][0], (unsigned long long)tuned[i][1]);
+        }
+
+        fclose(fp);
+    } else {
+        MMC_FPRINTF(cfg->flog, S_RED "WARNING: can not write the thread settings to %s\n" S_RESET, fcache);
+    }
+}
+
 /*
    master driver code to run MC simulations
 */
@@ -80,6 +953,10 @@ void mmc_run_cl(mcconfig* cfg, tetmesh* mesh, raytracer* tracer) {
     cl_command_queue* mcxqueue;          // compute command queue
     cl_program mcxprogram;                 // compute mcxprogram
     cl_kernel* mcxkernel;                   // compute mcxkernel
+    cl_kernel* sumkernel;                   // sums the per-thread energy counters, see mmc_sum_energy
+    size_t sumblock[MAX_DEVICE], sumsize;   // work-group and global size of sumkernel
+    int zerocopy[MAX_DEVICE] = {0};         // 1 if the outputs of a device are mapped instead of read back, see mmc_cl_mapout
+    cl_uint sumthread;                      // counter rows summed by sumkernel, the thread count of mcxkernel
     cl_int status = 0;
     cl_device_id devices[MAX_DEVICE];
     cl_event* waittoread;
@@ -88,26 +965,65 @@ void mmc_run_cl(mcconfig* cfg, tetmesh* mesh, raytracer* tracer) {
     cl_uint  totalcucore;
     cl_uint  devid = 0;
     cl_mem* gnode = NULL, *gelem = NULL, *gtype = NULL, *gfacenb = NULL, *gsrcelem = NULL, *gnormal = NULL;
-    cl_mem* gproperty = NULL, *gparam = NULL, *gsrcpattern = NULL, *greplayweight = NULL, *greplaytime = NULL, *greplayseed = NULL; /*read-only buffers*/
-    cl_mem* gweight, *gdref, *gdetphoton, *gseed, *genergy, *greporter, *gdebugdata, *gcamsignals;     /*read-write buffers*/
+    cl_mem* gproperty = NULL, *gparam = NULL, *gsrcpattern = NULL, *greplayweight = NULL, *greplaytime = NULL, *greplayseed = NULL, *greplaydetid = NULL, *ginvcdf = NULL, *gdetgrid = NULL, *gelemmed = NULL; /*read-only buffers*/
+    cl_mem* gweight, *gdref, *gdetphoton, *gseed, *genergy, *genergysum, *greporter, *gdebugdata, *gcamsignals, *gdetimage;     /*read-write buffers*/
     cl_mem* gprogress = NULL, *gdetected = NULL, *gphotonseed = NULL; /*write-only buffers*/
 
     cl_uint meshlen = ((cfg->method == rtBLBadouelGrid) ? cfg->crop0.z : mesh->ne) * cfg->srcnum;    /**< total output data length in float count per time-frame */
-    cfg->crop0.w = meshlen * cfg->maxgate;    /**< total output data length, before double-buffer expansion */
+    cfg->crop0.w = meshlen * (cfg->maxgate * cfg->replaydetnum + 2 * cfg->freqnum);    /**< total output data length, before double-buffer expansion */
 
     cl_float*  field, *dref = NULL, *camsignals = NULL;
+    double*    dfield = NULL;              /*host sum of the output of all devices and respins*/
 
     cl_uint*   Pseed = NULL;
     float*     Pdet = NULL;
     RandType*  Pphotonseed = NULL;
-    char opt[MAX_PATH_LENGTH + 1] = {'\0'};
+    char opt[(MAX_PATH_LENGTH << 2) + 1] = {'\0'};
+    char format[MAX_PATH_LENGTH], kernelcache[MAX_FULL_PATH];
+    cl_event chunkevent[MAX_DEVICE];
+    size_t tuned[MAX_DEVICE][2] = {{0}};   /*work-group size and thread number of each device calibrated by --autotune*/
+    int isdynload;
+    int ismeshcached;
+    cl_command_queue* mcxreadqueue;      // read-back queue, overlapping the next respin
+    cl_command_queue* mcxreplayqueue = NULL; // replay input upload queue, overlapping the previous chunk
+    cl_uint replaylen = (cfg->seed == SEED_FROM_FILE) ? MIN((cl_uint)cfg->nphoton, MAX_REPLAY_CHUNK) : 0; /*photons per replay chunk*/
+    cl_event replayend[MAX_DEVICE << 1] = {NULL}; /*the kernel of the last chunk read from each replay buffer set*/
+    cl_uint nreplay[MAX_DEVICE] = {0};     /*replay chunks launched on each device, alternating the buffer sets*/
+    cl_event kernelend[MAX_DEVICE << 1];
+    cl_uint* respinseed[MAX_DEVICE << 1] = {NULL};
+    cl_uint detbuf = (cfg->respin > 1 && cfg->issavedet) ? 2 : 1; /*detected photon buffer sets*/
+    cl_uint wbuf = (cfg->respin > 1 && cfg->flushrespin > 0 && cfg->issave2pt) ? 2 : 1; /*output buffer sets, alternating between the flushes*/
+    float* flushbuf[MAX_DEVICE << 1] = {NULL};  /*host copies of the flushed output buffer sets*/
+    cl_event flushevent[MAX_DEVICE << 1] = {NULL}; /*pending read and clear of each output buffer set*/
+    char isdirty[MAX_DEVICE << 1] = {0};   /*1 if an output buffer set holds deposits not yet flushed*/
+    double setphoton[MAX_DEVICE << 1] = {0.0}; /*photons deposited in each output buffer set since its last flush*/
+    double varstat[2] = {0.0, 0.0};        /*batch number and photon number of the batch-variance sums*/
+    cl_uint nrespin = cfg->respin, ndet;    /*respins to run, fewer than cfg->respin if converged early*/
+    convstate conv;
+    double* convtotal = NULL;
+    const cl_uint zero = 0;
+    cl_uint launchphoton[MAX_DEVICE] = {0}; /*photons of one launch per device, the persistent-mode progress total*/
+    cl_uint launched[MAX_DEVICE << 1] = {0}; /*photons taken by each launch, fewer if it stopped to drain the detected photons*/
+    cl_uint owed[MAX_DEVICE] = {0};         /*photons left by the launches that stopped to drain the detected photons*/
+    cl_uint* owedrange = NULL;              /*with the Philox RNG, the first photon index and the count of the photons owed by each respin*/
+    cl_uint devoffset[MAX_DEVICE] = {0};    /*index of the first photon of a device in a respin*/
+    cl_uint photonoffset[MAX_DEVICE << 1] = {0}; /*index of the first photon of each launch, alternating as the respins overlap*/
+    cl_uint respinphoton = 0;               /*photons of one respin on all devices*/
+    cl_uint rngkey = 0;                     /*the Philox key shared by all devices, the same as that of the CPU*/
+    cl_event progressend = NULL;            /*the launch on the first device, ends the progress bar of a launch stopped early*/
+    volatile cl_int progressstatus = CL_QUEUED; /*status of progressend, set by its completion callback*/
+    cltimer* devtimer = NULL;      /*kernel and read-back time counters of --saveprofile, see mmc_cl_timeevent*/
+    cl_event timedevent = NULL;    /*event of a command timed only for --saveprofile*/
+    kernelcacheheader kernelhead;
+    int iskernelcached = 0;
     cl_uint detreclen = (cfg->issaveexit > 0) * 7; // (2 + ((cfg->ismomentum) > 0)) * mesh->prop + (cfg->issaveexit > 0) * 7 + 1;
     cl_uint hostdetreclen = detreclen + 1;
-    int sharedmemsize = 0;
+    int sharedmemsize = 0, accumcachesize = 0, meshcachesize = 0;
 
     GPUInfo* gpu = NULL;
     float4* propdet;
     double energytot = 0.0, energyesc = 0.0;
+    int isenergyowner = (cfg->energytot == NULL); /*0 if the caller collects the energy totals, see mmc_run_hybrid*/
 
     MCXParam param = {{{cfg->srcpos.x, cfg->srcpos.y, cfg->srcpos.z}}, {{cfg->srcdir.x, cfg->srcdir.y, cfg->srcdir.z}},
         cfg->tstart, cfg->tend, (uint)cfg->isreflect, (uint)cfg->issavedet, (uint)cfg->issaveexit,
@@ -131,6 +1047,55 @@ void mmc_run_cl(mcconfig* cfg, tetmesh* mesh, raytracer* tracer) {
     };
 
     MCXReporter reporter = {0.f, 0};
+    cl_uint* packmesh = NULL;
+    int* halfface = NULL;
+    float4* halffacetable = NULL;
+    void* srcpattern = NULL;
+    size_t srcpatternbytes = 0;
+
+    param.ispackmesh = cfg->ispackmesh;
+    param.patternbits = cfg->patternbits;
+    param.detparam1 = (cl_float4) {{cfg->detparam1.x, cfg->detparam1.y, cfg->detparam1.z, cfg->detparam1.w}};
+    param.detparam2 = (cl_float4) {{cfg->detparam2.x, cfg->detparam2.y, cfg->detparam2.z, cfg->detparam2.w}};
+    param.detorigin = (cl_float4) {{(cfg->detpos) ? cfg->detpos[0].x : 0.f, (cfg->detpos) ? cfg->detpos[0].y : 0.f, (cfg->detpos) ? cfg->detpos[0].z : 0.f, 0.f}};
+    param.freqnum = cfg->freqnum;
+    param.nphase = cfg->nphase;
+    param.ispersistent = cfg->ispersistent;
+    param.rngtype = (cfg->rngtype == rngPhilox);
+    param.trajsample = cfg->trajsample;
+    param.isdetstat = cfg->isdetstat;
+
+    /*the per-label importance of --importance follows the detectors in gproperty, the normals are moved after it*/
+    if (cfg->importance) {
+        param.importoffset = param.maxpropdet;
+        param.maxpropdet += (mesh->prop + 4) >> 2;
+
+        if (param.maxpropdet > MAX_PROP) {
+            mcx_error(-5, (char*)("Total tissue type, detector and importance count is too large for the constant memory"), __FILE__, __LINE__);
+        }
+
+        param.normbuf = MIN((MAX_PROP - param.maxpropdet), ((mesh->ne) << 2)) >> 2;
+    }
+
+    /*the half-face mesh has no per-element normals to copy to the constant memory*/
+    if (cfg->ishalfface) {
+        param.normbuf = 0;
+    }
+
+    if (mesh->srcgrid) {
+        param.srcgridorig = (cl_float4) {{mesh->srcgrid->pmin.x, mesh->srcgrid->pmin.y, mesh->srcgrid->pmin.z, mesh->srcgrid->rcellsize}};
+        param.srcgriddim = (cl_int4) {{mesh->srcgrid->dim[0], mesh->srcgrid->dim[1], mesh->srcgrid->dim[2], mesh->srcelemlen}};
+    }
+
+    if (mesh->detgrid) {
+        param.detgridorig = (cl_float4) {{mesh->detgrid->pmin.x, mesh->detgrid->pmin.y, mesh->detgrid->pmin.z, mesh->detgrid->rcellsize}};
+        param.detgriddim = (cl_int4) {{mesh->detgrid->dim[0], mesh->detgrid->dim[1], mesh->detgrid->dim[2], 0}};
+    }
+
+    for (i = 0; i < cfg->freqnum; i++) {
+        param.omega[i] = TWO_PI * cfg->freq[i];
+    }
+
     platform = mcx_list_cl_gpu(cfg, &workdev, devices, &gpu);
 
     if (workdev > MAX_DEVICE) {
@@ -141,6 +1106,10 @@ void mmc_run_cl(mcconfig* cfg, tetmesh* mesh, raytracer* tracer) {
         mcx_error(-99, (char*)("Unable to find devices!"), __FILE__, __LINE__);
     }
 
+    if (cfg->autopilot && cfg->autotune) {
+        mmc_cl_autotune(cfg, mesh, tracer, devices, gpu, workdev, tuned);
+    }
+
     if (cfg->issavedet) {
         sharedmemsize = sizeof(cl_float) * detreclen;
     }
@@ -153,25 +1122,49 @@ void mmc_run_cl(mcconfig* cfg, tetmesh* mesh, raytracer* tracer) {
         sharedmemsize += sizeof(cl_float) * cfg->srcnum;
     }
 
+    if (cfg->isatomic) {
+        accumcachesize = sizeof(cl_uint) * (MAX_ACCUM_CACHE << 1);    /**< work-group cache merging the weight atomics, keys and values */
+    }
+
     cl_context_properties cps[3] = {CL_CONTEXT_PLATFORM, (cl_context_properties)platform, 0};
 
     /* Use NULL for backward compatibility */
     cl_context_properties* cprops = (platform == NULL) ? NULL : cps;
-    OCL_ASSERT(((mcxcontext = clCreateContext(cprops, workdev, devices, NULL, NULL, &status), status)));
+
+    ismeshcached = (cfg->meshsession != 0 && clmesh.session == cfg->meshsession && clmesh.nn == mesh->nn &&
+                    clmesh.ne == mesh->ne && clmesh.elemlen == mesh->elemlen && clmesh.method == cfg->method &&
+                    clmesh.ispackmesh == param.ispackmesh && (clmesh.halffacenum > 0) == (cfg->ishalfface != 0) &&
+                    clmesh.workdev == workdev && memcmp(clmesh.devices, devices, workdev * sizeof(cl_device_id)) == 0);
+
+    if (ismeshcached) {
+        mcxcontext = clmesh.context;
+        MMCDEBUG(cfg, dlTime, (cfg->flog, "reusing the device-resident mesh of session %d\n", cfg->meshsession));
+    } else {
+        mmc_cl_release_meshcache();
+        OCL_ASSERT(((mcxcontext = clCreateContext(cprops, workdev, devices, NULL, NULL, &status), status)));
+    }
 
     mcxqueue = (cl_command_queue*)malloc(workdev * sizeof(cl_command_queue));
+    mcxreadqueue = (cl_command_queue*)malloc(workdev * sizeof(cl_command_queue));
+
+    if (replaylen) {
+        mcxreplayqueue = (cl_command_queue*)malloc(workdev * sizeof(cl_command_queue));
+    }
+
     waittoread = (cl_event*)malloc(workdev * sizeof(cl_event));
 
     gseed = (cl_mem*)malloc(workdev * sizeof(cl_mem));
-    gweight = (cl_mem*)malloc(workdev * sizeof(cl_mem));
+    gweight = (cl_mem*)malloc(workdev * wbuf * sizeof(cl_mem));
     gdref = (cl_mem*)malloc(workdev * sizeof(cl_mem));
     gcamsignals = (cl_mem*)malloc(workdev * sizeof(cl_mem));
-    gdetphoton = (cl_mem*)malloc(workdev * sizeof(cl_mem));
+    gdetphoton = (cl_mem*)malloc(workdev * detbuf * sizeof(cl_mem));
     genergy = (cl_mem*)malloc(workdev * sizeof(cl_mem));
-    gdetected = (cl_mem*)malloc(workdev * sizeof(cl_mem));
-    gphotonseed = (cl_mem*)malloc(workdev * sizeof(cl_mem));
+    genergysum = (cl_mem*)malloc(workdev * sizeof(cl_mem));
+    gdetected = (cl_mem*)malloc(workdev * detbuf * sizeof(cl_mem));
+    gphotonseed = (cl_mem*)malloc(workdev * detbuf * sizeof(cl_mem));
     greporter = (cl_mem*)malloc(workdev * sizeof(cl_mem));
     gdebugdata = (cl_mem*)malloc(workdev * sizeof(cl_mem));
+    gdetimage = (cl_mem*)malloc(workdev * sizeof(cl_mem));
 
     gnode = (cl_mem*)malloc(workdev * sizeof(cl_mem));
     gelem = (cl_mem*)malloc(workdev * sizeof(cl_mem));
@@ -184,18 +1177,30 @@ void mmc_run_cl(mcconfig* cfg, tetmesh* mesh, raytracer* tracer) {
 
     gprogress = (cl_mem*)malloc(workdev * sizeof(cl_mem));
     gsrcpattern = (cl_mem*)malloc(workdev * sizeof(cl_mem));
-    greplayweight = (cl_mem*)malloc(workdev * sizeof(cl_mem));
-    greplaytime = (cl_mem*)malloc(workdev * sizeof(cl_mem));
-    greplayseed = (cl_mem*)malloc(workdev * sizeof(cl_mem));
+    greplayweight = (cl_mem*)malloc(workdev * 2 * sizeof(cl_mem));
+    greplaytime = (cl_mem*)malloc(workdev * 2 * sizeof(cl_mem));
+    greplayseed = (cl_mem*)malloc(workdev * 2 * sizeof(cl_mem));
+    greplaydetid = (cl_mem*)malloc(workdev * 2 * sizeof(cl_mem));
+    ginvcdf = (cl_mem*)malloc(workdev * sizeof(cl_mem));
+    gdetgrid = (cl_mem*)malloc(workdev * sizeof(cl_mem));
+    gelemmed = (cl_mem*)malloc(workdev * sizeof(cl_mem));
 
     /* The block is to move the declaration of prop closer to its use */
     cl_command_queue_properties prop = CL_QUEUE_PROFILING_ENABLE;
 
     totalcucore = 0;
     int camsignals_size = cfg->cam_image_width * cfg->cam_image_height + 2;
+    size_t detimagesize = (cfg->issaveexit == 2) ? (size_t)cfg->detparam1.w * cfg->detparam2.w * cfg->maxgate :
+                          (cfg->isdetstat ? (size_t)cfg->detnum * mcx_detstatlen(cfg, mesh->prop) : 0);
 
     for (i = 0; i < workdev; i++) {
         OCL_ASSERT(((mcxqueue[i] = clCreateCommandQueue(mcxcontext, devices[i], prop, &status), status)));
+        OCL_ASSERT(((mcxreadqueue[i] = clCreateCommandQueue(mcxcontext, devices[i], (cfg->issaveprofile ? prop : 0), &status), status)));
+
+        if (mcxreplayqueue) {
+            OCL_ASSERT(((mcxreplayqueue[i] = clCreateCommandQueue(mcxcontext, devices[i], 0, &status), status)));
+        }
+
         totalcucore += gpu[i].core;
 
         if (!cfg->autopilot) {
@@ -222,6 +1227,11 @@ void mmc_run_cl(mcconfig* cfg, tetmesh* mesh, raytracer* tracer) {
                     gpu[i].autothread = gpu[i].autoblock * 64 * gpu[i].sm;
                 }
             }
+
+            if (tuned[i][0]) { // calibrated by --autotune
+                gpu[i].autoblock  = tuned[i][0];
+                gpu[i].autothread = tuned[i][1];
+            }
         }
 
         if (gpu[i].autothread % gpu[i].autoblock) {
@@ -235,6 +1245,26 @@ void mmc_run_cl(mcconfig* cfg, tetmesh* mesh, raytracer* tracer) {
         }
     }
 
+    /*
+       a mesh fitting in the local memory of all devices, next to the per-thread records and the
+       accumulation cache, is traced from a copy in each work-group, see cachemesh(); the type and
+       facenb buffers are not read with the packed mesh, 3 floats align the copy to a float4
+    */
+    if (cfg->islocalmesh && !cfg->ishalfface) {
+        meshcachesize = sizeof(cl_float4) * (mesh->ne << 2) + (cfg->ispackmesh ? 0 : sizeof(cl_int) * mesh->ne * (mesh->elemlen + 1)) + sizeof(cl_float) * 3;
+        param.islocalmesh = 1;
+
+        for (i = 0; i < workdev; i++) {
+            if ((cl_ulong)sharedmemsize * gpu[i].autoblock + accumcachesize + meshcachesize > gpu[i].sharedmem) {
+                param.islocalmesh = 0;
+            }
+        }
+
+        if (!param.islocalmesh) {
+            meshcachesize = 0;
+        }
+    }
+
     cfg->maxgate = (int)((cfg->tend - cfg->tstart) / cfg->tstep + 0.5);
     param.maxgate = cfg->maxgate;
     cl_uint nflen = mesh->nf * cfg->maxgate;
@@ -253,9 +1283,42 @@ void mmc_run_cl(mcconfig* cfg, tetmesh* mesh, raytracer* tracer) {
         fullload = totalcucore;
     }
 
-    field = (cl_float*)calloc(sizeof(cl_float) * meshlen * 2, cfg->maxgate);
+    /*replayed photons are indexed by thread and photon count, which requires the static split*/
+    isdynload = (cfg->isdynload && workdev > 1 && cfg->seed != SEED_FROM_FILE);
+
+    if (cfg->isdynload && !isdynload && workdev > 1) {
+        MMC_FPRINTF(cfg->flog, S_RED "WARNING: dynamic load balancing is disabled in the replay mode\n" S_RESET);
+    }
+
+    /*a persistent launch stops before the detected photons overflow, the photons it did not take are launched again after a read-back*/
+    if (cfg->ispersistent && cfg->issavedet && cfg->issaveexit != 2 && cfg->seed != SEED_FROM_FILE && !isdynload) {
+        param.ispersistent = 2;
+
+        for (i = 0; i < workdev; i++) {
+            if (cfg->maxdetphoton < 2 * gpu[i].autothread) {
+                param.ispersistent = 1;
+            }
+        }
+    }
+
+    /*the photons owed by a respin keep their indices, and so their Philox streams, when launched again*/
+    if (param.ispersistent == 2 && param.rngtype) {
+        owedrange = (cl_uint*)calloc(workdev * cfg->respin * 2, sizeof(cl_uint));
+    }
+
+    field = (cl_float*)calloc(sizeof(cl_float) * meshlen * 2, cfg->maxgate * cfg->replaydetnum + 2 * cfg->freqnum);
     dref = (cl_float*)calloc(sizeof(cl_float) * mesh->nf, cfg->maxgate);
     camsignals = (cl_float*)calloc(sizeof(cl_float) * camsignals_size, cfg->maxgate);
+
+    /*with -x 2, the detected photons are binned on the device, only the image is read back*/
+    if (detimagesize) {
+        if (cfg->exportdetimage) {
+            free(cfg->exportdetimage);
+        }
+
+        cfg->exportdetimage = (float*)calloc(detimagesize, sizeof(float));
+    }
+
     Pdet = (float*)calloc(cfg->maxdetphoton * sizeof(float), hostdetreclen);
 
     if (cfg->issaveseed) {
@@ -263,6 +1326,7 @@ void mmc_run_cl(mcconfig* cfg, tetmesh* mesh, raytracer* tracer) {
     }
 
     fieldlen = cfg->crop0.w;  /**< total float counts of the output buffer, before double-buffer expansion (x2) for improving saving accuracy */
+    dfield = (double*)calloc(fieldlen, sizeof(double));
 
     if (cfg->seed > 0) {
         srand(cfg->seed);
@@ -296,22 +1360,82 @@ void mmc_run_cl(mcconfig* cfg, tetmesh* mesh, raytracer* tracer) {
         memcpy(propdet + (mesh->prop + 1 + cfg->isextdet), cfg->detpos, cfg->detnum * sizeof(float4));
     }
 
+    for (i = 0; param.importoffset && i <= (cl_uint)mesh->prop; i++) {
+        ((float*)(propdet + param.importoffset))[i] = MESH_IMPORTANCE(cfg, i);
+    }
+
     memcpy(propdet + param.maxpropdet, tracer->n, (param.normbuf << 2)*sizeof(float4));
 
+    if (param.ispackmesh && !ismeshcached) {
+        packmesh = (cl_uint*)malloc(sizeof(cl_uint) * ((size_t)mesh->ne << 4));
+        tracer_packgpu(tracer, packmesh);
+    }
+
+    /*the half-face mesh replaces the per-element normals and facenb*/
+    if (cfg->ishalfface) {
+        if (ismeshcached) {
+            param.halffacenum = clmesh.halffacenum;
+        } else {
+            halfface = (int*)malloc(sizeof(int) * (mesh->ne << 2));
+            param.halffacenum = tracer_packhalfface(tracer, halfface, &halffacetable);
+        }
+    }
+
     for (i = 0; i < workdev; i++) {
-        OCL_ASSERT(((gnode[i] = clCreateBuffer(mcxcontext, RO_MEM, sizeof(FLOAT3) * (mesh->nn), mesh->node, &status), status)));
-        OCL_ASSERT(((gelem[i] = clCreateBuffer(mcxcontext, RO_MEM, sizeof(int4) * (mesh->ne), mesh->elem, &status), status)));
-        OCL_ASSERT(((gtype[i] = clCreateBuffer(mcxcontext, RO_MEM, sizeof(int) * (mesh->ne), mesh->type, &status), status)));
-        OCL_ASSERT(((gfacenb[i] = clCreateBuffer(mcxcontext, RO_MEM, sizeof(int4) * (mesh->ne), mesh->facenb, &status), status)));
+        /*
+           the mesh buffers are read at every step and always stay in the device memory; if all
+           buffers exceed the device memory, the output, detected photon and replay buffers go to host memory
+        */
+        size_t meshmem = sizeof(FLOAT3) * mesh->nn + (sizeof(int4) * 2 + sizeof(int) + sizeof(float4) * 4 * !param.halffacenum) * mesh->ne
+                         + sizeof(float4) * (param.halffacenum + ((param.halffacenum + 1) >> 1));
+        size_t outmem = sizeof(float) * fieldlen * 2 * wbuf + sizeof(float) * nflen +
+                        (sizeof(float) * hostdetreclen + sizeof(RandType) * RAND_BUF_LEN * cfg->issaveseed) * cfg->maxdetphoton * detbuf +
+                        (sizeof(float) * 3 + sizeof(RandType) * RAND_BUF_LEN) * (size_t)replaylen * 2;
+        int hostmem = (cfg->unifiedmem == 2 || (cfg->unifiedmem == 1 && meshmem + outmem + MMC_MEM_RESERVE > gpu[i].globalmem));
+
+        /*on a device sharing the host memory, the outputs are mapped by the host instead of copied*/
+        zerocopy[i] = (cfg->unifiedmem && gpu[i].isunified);
+
+        if (zerocopy[i]) {
+            hostmem = 1;
+            MMC_FPRINTF(cfg->flog, "- [device %d(%d): %s] shares the host memory, mapping the output buffers instead of copying them\n", i, gpu[i].id, gpu[i].name);
+        } else if (hostmem) {
+            MMC_FPRINTF(cfg->flog, "- [device %d(%d): %s] %.1f MB of buffers exceed %.1f MB of device memory, placing the output buffers in host memory\n",
+                        i, gpu[i].id, gpu[i].name, (meshmem + outmem) / 1048576.0, gpu[i].globalmem / 1048576.0);
+        }
+
+        if (ismeshcached) {
+            gnode[i] = clmesh.gnode[i];
+            gelem[i] = clmesh.gelem[i];
+            gtype[i] = clmesh.gtype[i];
+            gfacenb[i] = clmesh.gfacenb[i];
+            gnormal[i] = clmesh.gnormal[i];
+        } else {
+            OCL_ASSERT(((gnode[i] = clCreateBuffer(mcxcontext, RO_MEM, sizeof(FLOAT3) * (mesh->nn), mesh->node, &status), status)));
+            OCL_ASSERT(((gelem[i] = clCreateBuffer(mcxcontext, RO_MEM, sizeof(int4) * (mesh->ne), mesh->elem, &status), status)));
+            OCL_ASSERT(((gtype[i] = clCreateBuffer(mcxcontext, RO_MEM, sizeof(int) * (mesh->ne), mesh->type, &status), status)));
+            OCL_ASSERT(((gfacenb[i] = clCreateBuffer(mcxcontext, RO_MEM, sizeof(int4) * (mesh->ne), (halfface ? (void*)halfface : (void*)mesh->facenb), &status), status)));
+
+            if (halffacetable) {
+                OCL_ASSERT(((gnormal[i] = clCreateBuffer(mcxcontext, RO_MEM, sizeof(float4) * (param.halffacenum + ((param.halffacenum + 1) >> 1)), halffacetable, &status), status)));
+            } else {
+                OCL_ASSERT(((gnormal[i] = clCreateBuffer(mcxcontext, RO_MEM, sizeof(float4) * (mesh->ne) * 4, (packmesh ? (void*)packmesh : (void*)tracer->n), &status), status)));
+            }
+        }
 
         if (mesh->srcelemlen > 0) {
-            OCL_ASSERT(((gsrcelem[i] = clCreateBuffer(mcxcontext, RO_MEM, sizeof(int) * (mesh->srcelemlen), mesh->srcelem, &status), status)));
+            int srcelemlen;
+            int* srcelem = mesh_packgrid(mesh->srcgrid, mesh->srcelem, mesh->srcelemlen, &srcelemlen);
+
+            OCL_ASSERT(((gsrcelem[i] = clCreateBuffer(mcxcontext, RO_MEM, sizeof(int) * srcelemlen, srcelem, &status), status)));
+
+            if (srcelem != mesh->srcelem) {
+                free(srcelem);
+            }
         } else {
             gsrcelem[i] = NULL;
         }
 
-        OCL_ASSERT(((gnormal[i] = clCreateBuffer(mcxcontext, RO_MEM, sizeof(float4) * (mesh->ne) * 4, tracer->n, &status), status)));
-
         OCL_ASSERT(((gproperty[i] = clCreateBuffer(mcxcontext, RO_MEM, MAX_PROP * sizeof(float4), propdet, &status), status)));
         OCL_ASSERT(((gparam[i] = clCreateBuffer(mcxcontext, RO_MEM, sizeof(MCXParam), &param, &status), status)));
 
@@ -322,42 +1446,103 @@ void mmc_run_cl(mcconfig* cfg, tetmesh* mesh, raytracer* tracer) {
             Pseed[j] = rand();
         }
 
+        /*the key is the first random number of the seed, as seeds[0] of the CPU threads*/
+        if (i == 0) {
+            rngkey = Pseed[0];
+        }
+
+        Pseed[0] = rngkey;
+
         OCL_ASSERT(((gseed[i] = clCreateBuffer(mcxcontext, RW_MEM, sizeof(cl_uint) * gpu[i].autothread * RAND_SEED_WORD_LEN, Pseed, &status), status)));
-        OCL_ASSERT(((gweight[i] = clCreateBuffer(mcxcontext, RW_MEM, sizeof(float) * fieldlen * 2, field, &status), status)));
-        OCL_ASSERT(((gdref[i] = clCreateBuffer(mcxcontext, RW_MEM, sizeof(float) * nflen, dref, &status), status)));
-        OCL_ASSERT(((gcamsignals[i] = clCreateBuffer(mcxcontext, RW_MEM, sizeof(float) * camsignals_size, camsignals, &status), status)));
-        OCL_ASSERT(((gdetphoton[i] = clCreateBuffer(mcxcontext, RW_MEM, sizeof(float) * cfg->maxdetphoton * hostdetreclen, Pdet, &status), status)));
+        for (j = i; j < workdev * wbuf; j += workdev) {
+            OCL_ASSERT(((gweight[j] = mmc_cl_buffer(mcxcontext, RW_MEM, hostmem, sizeof(float) * fieldlen * 2, field, &status, clCreateBufferNV), status)));
 
-        if (cfg->issaveseed) {
-            OCL_ASSERT(((gphotonseed[i] = clCreateBuffer(mcxcontext, RW_MEM, cfg->maxdetphoton * (sizeof(RandType) * RAND_BUF_LEN), Pphotonseed, &status), status)));
-        } else {
-            gphotonseed[i] = NULL;
+            if (wbuf > 1) {
+                flushbuf[j] = (float*)malloc(sizeof(float) * fieldlen * 2);
+            }
+        }
+
+        OCL_ASSERT(((gdref[i] = mmc_cl_buffer(mcxcontext, RW_MEM, hostmem, sizeof(float) * nflen, dref, &status, clCreateBufferNV), status)));
+        OCL_ASSERT(((gcamsignals[i] = mmc_cl_buffer(mcxcontext, RW_MEM, zerocopy[i], sizeof(float) * camsignals_size, camsignals, &status, clCreateBufferNV), status)));
+
+        for (j = i; j < workdev * detbuf; j += workdev) {
+            OCL_ASSERT(((gdetphoton[j] = mmc_cl_buffer(mcxcontext, RW_MEM, hostmem, sizeof(float) * cfg->maxdetphoton * hostdetreclen, Pdet, &status, clCreateBufferNV), status)));
+            OCL_ASSERT(((gdetected[j] = clCreateBuffer(mcxcontext, RW_MEM, sizeof(cl_uint), &detected, &status), status)));
+
+            if (cfg->issaveseed) {
+                OCL_ASSERT(((gphotonseed[j] = mmc_cl_buffer(mcxcontext, RW_MEM, hostmem, cfg->maxdetphoton * (sizeof(RandType) * RAND_BUF_LEN), Pphotonseed, &status, clCreateBufferNV), status)));
+            } else {
+                gphotonseed[j] = NULL;
+            }
+        }
+
+        if (cfg->respin > 1) {
+            respinseed[i] = (cl_uint*)malloc(sizeof(cl_uint) * gpu[i].autothread * RAND_SEED_WORD_LEN);
+            respinseed[i + workdev] = (cl_uint*)malloc(sizeof(cl_uint) * gpu[i].autothread * RAND_SEED_WORD_LEN);
         }
 
         if (cfg->debuglevel & dlTraj) {
             OCL_ASSERT(((gdebugdata[i] = clCreateBuffer(mcxcontext, RW_MEM, sizeof(float) * (debuglen * cfg->maxjumpdebug), cfg->exportdebugdata, &status), status)));
         }
 
+        if (detimagesize) {
+            OCL_ASSERT(((gdetimage[i] = mmc_cl_buffer(mcxcontext, RW_MEM, zerocopy[i], sizeof(float) * detimagesize, cfg->exportdetimage, &status, clCreateBufferNV), status)));
+        }
+
         OCL_ASSERT(((genergy[i] = clCreateBuffer(mcxcontext, RW_MEM, sizeof(float) * (gpu[i].autothread << 1) * cfg->srcnum, energy, &status), status)));
-        OCL_ASSERT(((gdetected[i] = clCreateBuffer(mcxcontext, RW_MEM, sizeof(cl_uint), &detected, &status), status)));
+        OCL_ASSERT(((genergysum[i] = clCreateBuffer(mcxcontext, CL_MEM_WRITE_ONLY, sizeof(cl_float2) * (cfg->srcnum << 1), NULL, &status), status)));
         OCL_ASSERT(((greporter[i] = clCreateBuffer(mcxcontext, RW_MEM, sizeof(MCXReporter), &reporter, &status), status)));
 
-        if (cfg->srctype == MCX_SRC_PATTERN) {
-            OCL_ASSERT(((gsrcpattern[i] = clCreateBuffer(mcxcontext, RO_MEM, sizeof(float) * (int)(cfg->srcparam1.w * cfg->srcparam2.w * cfg->srcnum), cfg->srcpattern, &status), status)));
-        } else if (cfg->srctype == MCX_SRC_PATTERN3D) {
-            OCL_ASSERT(((gsrcpattern[i] = clCreateBuffer(mcxcontext, RO_MEM, sizeof(float) * (int)(cfg->srcparam1.x * cfg->srcparam1.y * cfg->srcparam1.z * cfg->srcnum), cfg->srcpattern, &status), status)));
+        if (cfg->srctype == MCX_SRC_PATTERN || cfg->srctype == MCX_SRC_PATTERN3D) {
+            if (srcpattern == NULL) {
+                srcpattern = mcx_packpattern(cfg, &srcpatternbytes);
+            }
+
+            OCL_ASSERT(((gsrcpattern[i] = clCreateBuffer(mcxcontext, RO_MEM, srcpatternbytes, srcpattern, &status), status)));
         } else {
             gsrcpattern[i] = NULL;
         }
 
-        if (cfg->seed == SEED_FROM_FILE) {
-            OCL_ASSERT(((greplayweight[i] = clCreateBuffer(mcxcontext, RO_MEM, sizeof(float) * cfg->nphoton, cfg->replayweight, &status), status)));
-            OCL_ASSERT(((greplaytime[i] = clCreateBuffer(mcxcontext, RO_MEM, sizeof(float) * cfg->nphoton, cfg->replaytime, &status), status)));
-            OCL_ASSERT(((greplayseed[i] = clCreateBuffer(mcxcontext, RO_MEM, (sizeof(RandType) * RAND_BUF_LEN) * cfg->nphoton, cfg->photonseed, &status), status)));
+        /*two replay buffer sets of one chunk each, filled by mmc_cl_uploadreplay() as the chunks are launched*/
+        for (j = i; j < workdev * 2; j += workdev) {
+            if (replaylen) {
+                OCL_ASSERT(((greplayweight[j] = mmc_cl_buffer(mcxcontext, CL_MEM_READ_ONLY, hostmem, sizeof(float) * replaylen, NULL, &status, clCreateBufferNV), status)));
+                OCL_ASSERT(((greplaytime[j] = mmc_cl_buffer(mcxcontext, CL_MEM_READ_ONLY, hostmem, sizeof(float) * replaylen, NULL, &status, clCreateBufferNV), status)));
+                OCL_ASSERT(((greplayseed[j] = mmc_cl_buffer(mcxcontext, CL_MEM_READ_ONLY, hostmem, (sizeof(RandType) * RAND_BUF_LEN) * replaylen, NULL, &status, clCreateBufferNV), status)));
+            } else {
+                greplayweight[j] = NULL;
+                greplaytime[j] = NULL;
+                greplayseed[j] = NULL;
+            }
+
+            if (cfg->replaydetid) {
+                OCL_ASSERT(((greplaydetid[j] = mmc_cl_buffer(mcxcontext, CL_MEM_READ_ONLY, hostmem, sizeof(int) * replaylen, NULL, &status, clCreateBufferNV), status)));
+            } else {
+                greplaydetid[j] = NULL;
+            }
+        }
+
+        if (cfg->invcdf) {
+            OCL_ASSERT(((ginvcdf[i] = clCreateBuffer(mcxcontext, RO_MEM, sizeof(float) * cfg->nphase * (mesh->prop + cfg->isextdet), cfg->invcdf, &status), status)));
         } else {
-            greplayweight[i] = NULL;
-            greplaytime[i] = NULL;
-            greplayseed[i] = NULL;
+            ginvcdf[i] = NULL;
+        }
+
+        if (mesh->detgrid) {
+            int detgridlen;
+            int* detgrid = mesh_packgrid(mesh->detgrid, NULL, 0, &detgridlen);
+
+            OCL_ASSERT(((gdetgrid[i] = clCreateBuffer(mcxcontext, RO_MEM, sizeof(int) * detgridlen, detgrid, &status), status)));
+            free(detgrid);
+        } else {
+            gdetgrid[i] = NULL;
+        }
+
+        /*the per-element media of --elemprop are read from the global memory, not limited by MAX_PROP*/
+        if (mesh->elemmed) {
+            OCL_ASSERT(((gelemmed[i] = clCreateBuffer(mcxcontext, RO_MEM, sizeof(medium) * mesh->ne, mesh->elemmed, &status), status)));
+        } else {
+            gelemmed[i] = NULL;
         }
 
         free(Pseed);
@@ -365,6 +1550,13 @@ void mmc_run_cl(mcconfig* cfg, tetmesh* mesh, raytracer* tracer) {
     }
 
     free(propdet);
+    free(packmesh);
+    free(halfface);
+    free(halffacetable);
+
+    if (srcpattern != cfg->srcpattern) {
+        free(srcpattern);
+    }
 
     mcx_printheader(cfg);
 
@@ -378,14 +1570,12 @@ void mmc_run_cl(mcconfig* cfg, tetmesh* mesh, raytracer* tracer) {
                     CL_VERSION_1_0);
     }
 
-    MMC_FPRINTF(cfg->flog, "- compiled with: [RNG] %s [Seed Length] %d\n", MCX_RNG_NAME, RAND_SEED_WORD_LEN);
+    MMC_FPRINTF(cfg->flog, "- compiled with: [RNG] %s [Seed Length] %d\n", (param.rngtype ? "Philox2x32-10 RNG" : MCX_RNG_NAME), RAND_SEED_WORD_LEN);
     MMC_FPRINTF(cfg->flog, "initializing streams ...\t");
 
     MMC_FPRINTF(cfg->flog, "init complete : %d ms\n", GetTimeMillis() - tic);
     mcx_fflush(cfg->flog);
 
-    OCL_ASSERT(((mcxprogram = clCreateProgramWithSource(mcxcontext, 1, (const char**) & (cfg->clsource), NULL, &status), status)));
-
     if (cfg->optlevel >= 1) {
         sprintf(opt, "%s ", "-cl-mad-enable -DMCX_USE_NATIVE");
     }
@@ -394,7 +1584,8 @@ void mmc_run_cl(mcconfig* cfg, tetmesh* mesh, raytracer* tracer) {
         sprintf(opt + strlen(opt), "%s ", "-DMCX_SIMPLIFY_BRANCH -DMCX_VECTOR_INDEX");
     }
 
-    if (cfg->optlevel >= 4) {
+    /*large runs amortize a kernel specialized for the media, gate and source counts, repeated runs reuse it from the binary cache*/
+    if (cfg->optlevel >= 4 || (cfg->optlevel == 3 && cfg->nphoton >= MMC_MACRO_CONST_PHOTON)) {
         sprintf(opt + strlen(opt), "%s ", "-DUSE_MACRO_CONST");
     }
 
@@ -412,6 +1603,10 @@ void mmc_run_cl(mcconfig* cfg, tetmesh* mesh, raytracer* tracer) {
         sprintf(opt + strlen(opt), " -DMCX_SKIP_VOLUME");
     }
 
+    if (cfg->maxgate == 1) {
+        sprintf(opt + strlen(opt), " -DMCX_CW");
+    }
+
     if (cfg->issavedet) {
         sprintf(opt + strlen(opt), " -DMCX_SAVE_DETECTORS");
     }
@@ -424,6 +1619,10 @@ void mmc_run_cl(mcconfig* cfg, tetmesh* mesh, raytracer* tracer) {
         sprintf(opt + strlen(opt), " -DMCX_SAVE_SEED");
     }
 
+    if (param.rngtype) {
+        sprintf(opt + strlen(opt), " -DMCX_RNG_PHILOX");
+    }
+
     if (cfg->isreflect) {
         sprintf(opt + strlen(opt), " -DMCX_DO_REFLECTION");
     }
@@ -436,6 +1635,26 @@ void mmc_run_cl(mcconfig* cfg, tetmesh* mesh, raytracer* tracer) {
         sprintf(opt + strlen(opt), " -DUSE_BLBADOUEL");
     }
 
+    if (param.ispackmesh) {
+        sprintf(opt + strlen(opt), " -DUSE_PACKED_MESH");
+    }
+
+    if (param.islocalmesh) {
+        sprintf(opt + strlen(opt), " -DUSE_LOCAL_MESH");
+    }
+
+    if (param.halffacenum) {
+        sprintf(opt + strlen(opt), " -DUSE_HALF_FACE");
+    }
+
+    if (param.patternbits != 32 && (cfg->srctype == MCX_SRC_PATTERN || cfg->srctype == MCX_SRC_PATTERN3D)) {
+        sprintf(opt + strlen(opt), (param.patternbits == 16) ? " -DUSE_HALF_PATTERN" : " -DUSE_BYTE_PATTERN");
+    }
+
+    if (param.importoffset) {
+        sprintf(opt + strlen(opt), " -DMCX_DO_SPLIT");
+    }
+
     if (cfg->srctype == stPattern && cfg->srcnum > 1) {
         sprintf(opt + strlen(opt), " -DUSE_PHOTON_SHARING");
     }
@@ -446,17 +1665,24 @@ void mmc_run_cl(mcconfig* cfg, tetmesh* mesh, raytracer* tracer) {
 
     if (strstr(opt, "USE_MACRO_CONST")) {
         IPARAM_TO_MACRO(opt, param, debuglevel);
+        IPARAM_TO_MACRO(opt, param, detnum);
         FPARAM_TO_MACRO(opt, param, dstep);
         IPARAM_TO_MACRO(opt, param, e0);
         IPARAM_TO_MACRO(opt, param, elemlen);
         FPARAM_TO_MACRO(opt, param, focus);
         IPARAM_TO_MACRO(opt, param, framelen);
+        IPARAM_TO_MACRO(opt, param, freqnum);
+        IPARAM_TO_MACRO(opt, param, halffacenum);
+        IPARAM_TO_MACRO(opt, param, importoffset);
+        IPARAM_TO_MACRO(opt, param, isdetstat);
         IPARAM_TO_MACRO(opt, param, isextdet);
         IPARAM_TO_MACRO(opt, param, ismomentum);
+        IPARAM_TO_MACRO(opt, param, ispersistent);
         IPARAM_TO_MACRO(opt, param, isreflect);
         IPARAM_TO_MACRO(opt, param, issavedet);
         IPARAM_TO_MACRO(opt, param, issaveexit);
         IPARAM_TO_MACRO(opt, param, issaveref);
+        IPARAM_TO_MACRO(opt, param, issaveseed);
         IPARAM_TO_MACRO(opt, param, isspecular);
         IPARAM_TO_MACRO(opt, param, maxdetphoton);
         IPARAM_TO_MACRO(opt, param, maxjumpdebug);
@@ -465,19 +1691,53 @@ void mmc_run_cl(mcconfig* cfg, tetmesh* mesh, raytracer* tracer) {
         IPARAM_TO_MACRO(opt, param, maxpropdet);
         IPARAM_TO_MACRO(opt, param, method);
         FPARAM_TO_MACRO(opt, param, minenergy);
+        IPARAM_TO_MACRO(opt, param, nf);
         IPARAM_TO_MACRO(opt, param, normbuf);
         FPARAM_TO_MACRO(opt, param, nout);
+        IPARAM_TO_MACRO(opt, param, nphase);
         IPARAM_TO_MACRO(opt, param, outputtype);
+        IPARAM_TO_MACRO(opt, param, patternbits);
         IPARAM_TO_MACRO(opt, param, reclen);
         FPARAM_TO_MACRO(opt, param, roulettesize);
         FPARAM_TO_MACRO(opt, param, Rtstep);
         IPARAM_TO_MACRO(opt, param, srcelemlen);
+        IPARAM_TO_MACRO(opt, param, srcnum);
         IPARAM_TO_MACRO(opt, param, srctype);
+        IPARAM_TO_MACRO(opt, param, trajsample);
         IPARAM_TO_MACRO(opt, param, voidtime);
     }
 
     MMC_FPRINTF(cfg->flog, "Building kernel with option: %s\n", opt);
-    status = clBuildProgram(mcxprogram, 0, NULL, opt, NULL, NULL);
+
+    mcxprogram = NULL;
+
+    if (cfg->iscachekernel) {
+        memset(&kernelhead, 0, sizeof(kernelcacheheader));
+        memcpy(kernelhead.magic, MMC_KERNEL_CACHE_MAGIC, sizeof(MMC_KERNEL_CACHE_MAGIC));
+        kernelhead.version = MMC_KERNEL_CACHE_VERSION;
+        kernelhead.headersize = sizeof(kernelcacheheader);
+        kernelhead.ndev = workdev;
+        kernelhead.hash = mmc_kernel_cache_hash(cfg->clsource, opt, devices, workdev);
+
+        sprintf(format, "kernel_%016llx.clbin", kernelhead.hash);
+        mesh_filenames(format, kernelcache, cfg);
+
+        /*binaries still need clBuildProgram; if the driver rejects them, rebuild from the source*/
+        if ((mcxprogram = mmc_kernel_cache_load(kernelcache, &kernelhead, mcxcontext, devices)) != NULL) {
+            if ((status = clBuildProgram(mcxprogram, 0, NULL, opt, NULL, NULL)) == CL_SUCCESS) {
+                MMC_FPRINTF(cfg->flog, "loaded kernel binary from %s\n", kernelcache);
+                iskernelcached = 1;
+            } else {
+                clReleaseProgram(mcxprogram);
+                mcxprogram = NULL;
+            }
+        }
+    }
+
+    if (mcxprogram == NULL) {
+        OCL_ASSERT(((mcxprogram = clCreateProgramWithSource(mcxcontext, 1, (const char**) & (cfg->clsource), NULL, &status), status)));
+        status = clBuildProgram(mcxprogram, 0, NULL, opt, NULL, NULL);
+    }
 
     size_t len;
     // get the details on the error, and store it in buffer
@@ -502,10 +1762,23 @@ void mmc_run_cl(mcconfig* cfg, tetmesh* mesh, raytracer* tracer) {
         mcx_error(-(int)status, (char*)("Error: Failed to build program executable!"), __FILE__, __LINE__);
     }
 
+    if (cfg->iscachekernel && !iskernelcached) {
+        mmc_kernel_cache_save(kernelcache, &kernelhead, mcxprogram, cfg);
+    }
+
     MMC_FPRINTF(cfg->flog, "build program complete : %d ms\n", GetTimeMillis() - tic);
     mcx_fflush(cfg->flog);
 
     mcxkernel = (cl_kernel*)malloc(workdev * sizeof(cl_kernel));
+    sumkernel = (cl_kernel*)malloc(workdev * sizeof(cl_kernel));
+
+    /*the kernel time of device devid is counted by devtimer[2*devid], its read-back time by devtimer[2*devid+1]*/
+    if (cfg->issaveprofile) {
+        cfg->devprof = (deviceprofile*)realloc(cfg->devprof, workdev * sizeof(deviceprofile));
+        cfg->profdev = workdev;
+        memset(cfg->devprof, 0, workdev * sizeof(deviceprofile));
+        devtimer = (cltimer*)calloc(workdev * 2, sizeof(cltimer));
+    }
 
     for (i = 0; i < workdev; i++) {
         cl_int threadphoton, oddphotons;
@@ -513,16 +1786,42 @@ void mmc_run_cl(mcconfig* cfg, tetmesh* mesh, raytracer* tracer) {
         threadphoton = (int)(cfg->nphoton * cfg->workload[i] / (fullload * gpu[i].autothread * cfg->respin));
         oddphotons = (int)(cfg->nphoton * cfg->workload[i] / (fullload * cfg->respin) - threadphoton * gpu[i].autothread);
 
+        launchphoton[i] = threadphoton * gpu[i].autothread + oddphotons;
+        devoffset[i] = respinphoton;
+        respinphoton += launchphoton[i];
+
         MMC_FPRINTF(cfg->flog, "- [device %d(%d): %s] threadph=%d oddphotons=%d np=%.1f nthread=%d nblock=%d repetition=%d\n", i, gpu[i].id, gpu[i].name, threadphoton, oddphotons,
                     cfg->nphoton * cfg->workload[i] / fullload, (int)gpu[i].autothread, (int)gpu[i].autoblock, cfg->respin);
 
-        MMC_FPRINTF(cfg->flog, "requesting %d bytes of shared memory\n", sharedmemsize * (int)gpu[i].autoblock);
+        MMC_FPRINTF(cfg->flog, "requesting %d bytes of shared memory%s\n", sharedmemsize * (int)gpu[i].autoblock + accumcachesize + meshcachesize,
+                    (param.islocalmesh ? ", including a copy of the mesh" : ""));
 
         OCL_ASSERT(((mcxkernel[i] = clCreateKernel(mcxprogram, "mmc_main_loop", &status), status)));
+
+        /*OpenCL reports neither the register count nor the occupancy of a kernel*/
+        if (cfg->issaveprofile) {
+            deviceprofile* prof = cfg->devprof + i;
+            cl_ulong kernelmem = 0;
+
+            prof->id = gpu[i].id;
+            strncpy(prof->name, gpu[i].name, MAX_SESSION_LENGTH - 1);
+            prof->block = (unsigned int)gpu[i].autoblock;
+            prof->thread = (unsigned int)gpu[i].autothread;
+            prof->registers = -1;
+            prof->occupancy = -1.f;
+            OCL_ASSERT((clGetKernelWorkGroupInfo(mcxkernel[i], devices[i], CL_KERNEL_PRIVATE_MEM_SIZE, sizeof(cl_ulong), &kernelmem, NULL)));
+            prof->privatemem = (long long)kernelmem;
+            prof->sharedmem = (long long)sharedmemsize * gpu[i].autoblock + accumcachesize + meshcachesize;
+            OCL_ASSERT((clGetKernelWorkGroupInfo(mcxkernel[i], devices[i], CL_KERNEL_LOCAL_MEM_SIZE, sizeof(cl_ulong), &kernelmem, NULL)));
+            prof->sharedmem = MAX(prof->sharedmem, (long long)kernelmem);
+            devtimer[i << 1].total = &prof->kernel;
+            devtimer[i << 1].count = &prof->nlaunch;
+            devtimer[(i << 1) + 1].total = &prof->copy;
+        }
         OCL_ASSERT((clSetKernelArg(mcxkernel[i], 0, sizeof(cl_uint), (void*)&threadphoton)));
         OCL_ASSERT((clSetKernelArg(mcxkernel[i], 1, sizeof(cl_uint), (void*)&oddphotons)));
         //OCL_ASSERT((clSetKernelArg(mcxkernel[i], 2, sizeof(cl_mem), (void*)(gparam+i))));
-        OCL_ASSERT((clSetKernelArg(mcxkernel[i], 3, sharedmemsize * (int)gpu[i].autoblock, NULL)));
+        OCL_ASSERT((clSetKernelArg(mcxkernel[i], 3, sharedmemsize * (int)gpu[i].autoblock + accumcachesize + meshcachesize, NULL)));
         OCL_ASSERT((clSetKernelArg(mcxkernel[i], 4, sizeof(cl_mem), (void*)(gproperty + i))));
         OCL_ASSERT((clSetKernelArg(mcxkernel[i], 5, sizeof(cl_mem), (void*)(gnode + i))));
         OCL_ASSERT((clSetKernelArg(mcxkernel[i], 6, sizeof(cl_mem), (void*)(gelem + i))));
@@ -545,6 +1844,27 @@ void mmc_run_cl(mcconfig* cfg, tetmesh* mesh, raytracer* tracer) {
         OCL_ASSERT((clSetKernelArg(mcxkernel[i], 23, sizeof(cl_mem), (void*)(greplayseed + i))));
         OCL_ASSERT((clSetKernelArg(mcxkernel[i], 24, sizeof(cl_mem), (void*)(gphotonseed + i))));
         OCL_ASSERT((clSetKernelArg(mcxkernel[i], 25, sizeof(cl_mem), ((cfg->debuglevel & dlTraj) ? (void*)(gdebugdata + i) : NULL) )));
+        OCL_ASSERT((clSetKernelArg(mcxkernel[i], 26, sizeof(cl_mem), (detimagesize ? (void*)(gdetimage + i) : NULL) )));
+        OCL_ASSERT((clSetKernelArg(mcxkernel[i], 27, sizeof(cl_mem), (cfg->replaydetid ? (void*)(greplaydetid + i) : NULL) )));
+        OCL_ASSERT((clSetKernelArg(mcxkernel[i], 28, sizeof(cl_mem), (cfg->invcdf ? (void*)(ginvcdf + i) : NULL) )));
+        OCL_ASSERT((clSetKernelArg(mcxkernel[i], 29, sizeof(cl_mem), (mesh->detgrid ? (void*)(gdetgrid + i) : NULL) )));
+        OCL_ASSERT((clSetKernelArg(mcxkernel[i], 30, sizeof(cl_mem), (mesh->elemmed ? (void*)(gelemmed + i) : NULL) )));
+
+        /*the energy counters are summed on the device by work-groups of a power-of-2 size*/
+        OCL_ASSERT(((sumkernel[i] = clCreateKernel(mcxprogram, "mmc_sum_energy", &status), status)));
+        sumthread = (cl_uint)gpu[i].autothread;
+        OCL_ASSERT((clGetKernelWorkGroupInfo(sumkernel[i], devices[i], CL_KERNEL_WORK_GROUP_SIZE, sizeof(size_t), sumblock + i, NULL)));
+
+        sumblock[i] = MIN(sumblock[i], MMC_ENERGY_BLOCK);
+
+        while (sumblock[i] & (sumblock[i] - 1)) {
+            sumblock[i] &= sumblock[i] - 1;
+        }
+
+        OCL_ASSERT((clSetKernelArg(sumkernel[i], 0, sizeof(cl_mem), (void*)(genergy + i))));
+        OCL_ASSERT((clSetKernelArg(sumkernel[i], 1, sizeof(cl_mem), (void*)(genergysum + i))));
+        OCL_ASSERT((clSetKernelArg(sumkernel[i], 2, sizeof(cl_uint), (void*)&sumthread)));
+        OCL_ASSERT((clSetKernelArg(sumkernel[i], 3, sizeof(cl_float2) * sumblock[i], NULL)));
     }
     
     MMC_FPRINTF(cfg->flog, "set kernel arguments complete : %d ms %d\n", GetTimeMillis() - tic, param.method);
@@ -558,6 +1878,10 @@ void mmc_run_cl(mcconfig* cfg, tetmesh* mesh, raytracer* tracer) {
         cfg->exportdetected = (float*)malloc(hostdetreclen * cfg->maxdetphoton * sizeof(float));
     }
 
+    if (cfg->streamdet > 0) {
+        cfg->his.savedphoton = 0;
+    }
+
     if (cfg->issaveseed && cfg->exportseed == NULL) {
         cfg->exportseed = (unsigned char*)malloc(cfg->maxdetphoton * (sizeof(RandType) * RAND_BUF_LEN));
     }
@@ -566,12 +1890,44 @@ void mmc_run_cl(mcconfig* cfg, tetmesh* mesh, raytracer* tracer) {
         cfg->exportdebugdata = (float*)calloc(sizeof(float), (debuglen * cfg->maxjumpdebug));
     }
 
-    cfg->energytot = (double*)calloc(cfg->srcnum, sizeof(double));
-    cfg->energyesc = (double*)calloc(cfg->srcnum, sizeof(double));
+    if (isenergyowner) {
+        cfg->energytot = (double*)calloc(cfg->srcnum, sizeof(double));
+        cfg->energyesc = (double*)calloc(cfg->srcnum, sizeof(double));
+    }
+
     energytot = 0.0;
     energyesc = 0.0;
     cfg->runtime = 0;
 
+    /*in the convergence-driven mode, each respin is a batch, and the respins stop once the detected photons converge*/
+    mcx_convinit(&conv, 0);
+    cfg->convphoton = cfg->nphoton;
+    cfg->convrse = 0.f;
+
+    if (cfg->convtarget > 0.f) {
+        if (cfg->issavedet == 0 || cfg->respin <= 1) {
+            MMC_FPRINTF(cfg->flog, S_YELLOW "WARNING: the GPU can only test the convergence of the detected photons over multiple respins, simulating all photons\n" S_RESET);
+        } else {
+            if (cfg->convroinum > 0) {
+                MMC_FPRINTF(cfg->flog, S_YELLOW "WARNING: convroi is not monitored on the GPU, only the detected photons are tested\n" S_RESET);
+            }
+
+            mcx_convinit(&conv, MAX(cfg->detnum, 1));
+            convtotal = (double*)calloc(conv.nquantity, sizeof(double));
+        }
+    }
+
+    if (cfg->ckptperiod > 0 || cfg->checkpt[0] > 0 || cfg->isresume) {
+        MMC_FPRINTF(cfg->flog, S_YELLOW "WARNING: checkpoints are only supported by the CPU simulation, ignored\n" S_RESET);
+    }
+
+    /*on the GPU, the batches of the variance are the flushes of the output sets to the host*/
+    if (mesh->weightvar && wbuf == 1) {
+        MMC_FPRINTF(cfg->flog, S_YELLOW "WARNING: the GPU computes the variance over the respins flushed to the host, it needs -r >1 and --flushrespin >0, ignored\n" S_RESET);
+        free(mesh->weightvar);
+        mesh->weightvar = NULL;
+    }
+
     //simulate for all time-gates in maxgate groups per run
 
     tic0 = GetTimeMillis();
@@ -584,184 +1940,434 @@ void mmc_run_cl(mcconfig* cfg, tetmesh* mesh, raytracer* tracer) {
                     , twindow0 * 1e9, twindow1 * 1e9);
         mcx_fflush(cfg->flog);
 
-        //total number of repetition for the simulations, results will be accumulated to field
-        for (iter = 0; iter < cfg->respin; iter++) {
+        /*
+           total number of repetition for the simulations, results will be accumulated to field;
+           respin k+1 is queued before respin k ends, and the detected photons of respin k, kept
+           in one of two alternating buffer sets, are read back through a second queue while
+           respin k+1 runs. The accumulated outputs are read once all respins are complete.
+        */
+        nrespin = cfg->respin;
+        mcx_convclear(&conv);
+
+        if (convtotal) {
+            mcx_convinit(&conv, MAX(cfg->detnum, 1));
+            memset(convtotal, 0, conv.nquantity * sizeof(double));
+        }
+
+        for (iter = 0; iter < nrespin; iter++) {
+            cl_uint detid = iter % detbuf;
+
             MMC_FPRINTF(cfg->flog, "simulation run#%2d ... \n", iter + 1);
             mcx_fflush(cfg->flog);
-            mcx_fflush(cfg->flog);
             param.tstart = twindow0;
             param.tend = twindow1;
 
             for (devid = 0; devid < workdev; devid++) {
-                OCL_ASSERT((clEnqueueWriteBuffer(mcxqueue[devid], gparam[devid], CL_TRUE, 0, sizeof(MCXParam), &param, 0, NULL, NULL)));
-                OCL_ASSERT((clSetKernelArg(mcxkernel[devid], 2, sizeof(cl_mem), (void*)(gparam + devid))));
+                if (iter == 0) {
+                    OCL_ASSERT((clEnqueueWriteBuffer(mcxqueue[devid], gparam[devid], CL_TRUE, 0, sizeof(MCXParam), &param, 0, NULL, NULL)));
+                    OCL_ASSERT((clSetKernelArg(mcxkernel[devid], 2, sizeof(cl_mem), (void*)(gparam + devid))));
+                } else if (RAND_SEED_WORD_LEN > 1 && !param.rngtype) {
+                    /*the host copy alternates so that the pending write of the previous respin is never overwritten*/
+                    cl_uint* newseed = respinseed[devid + (iter & 1) * workdev];
+
+                    for (i = 0; i < gpu[devid].autothread * RAND_SEED_WORD_LEN; i++) {
+                        newseed[i] = rand();
+                    }
+
+                    OCL_ASSERT((clEnqueueWriteBuffer(mcxqueue[devid], gseed[devid], CL_FALSE, 0, sizeof(cl_uint)*gpu[devid].autothread * RAND_SEED_WORD_LEN,
+                                                     newseed, 0, NULL, NULL)));
+                }
+
+                /*each group of flushrespin respins deposits into one output set, while the other set is read back*/
+                if (wbuf > 1 && iter % cfg->flushrespin == 0) {
+                    cl_uint wset = devid + ((iter / cfg->flushrespin) & 1) * workdev;
+
+                    mmc_cl_flushweight(flushevent + wset, flushbuf[wset], dfield, fieldlen, cfg, mesh, setphoton + wset, varstat);
+                    OCL_ASSERT((clSetKernelArg(mcxkernel[devid], 7, sizeof(cl_mem), (void*)(gweight + wset))));
+                    isdirty[wset] = 1;
+                }
+
+                /*count the photons of the set, the batch size of the variance; the dynamic load adds them per chunk*/
+                if (wbuf > 1 && !isdynload) {
+                    setphoton[devid + ((iter / cfg->flushrespin) & 1) * workdev] += launchphoton[devid];
+                }
+
+                if (detbuf > 1) {
+                    cl_uint setid = devid + detid * workdev;
+
+                    if (iter >= detbuf) {
+                        OCL_ASSERT((clEnqueueWriteBuffer(mcxqueue[devid], gdetected[setid], CL_FALSE, 0, sizeof(cl_uint), &zero, 0, NULL, NULL)));
+                    }
+
+                    OCL_ASSERT((clSetKernelArg(mcxkernel[devid], 14, sizeof(cl_mem), (void*)(gdetphoton + setid))));
+                    OCL_ASSERT((clSetKernelArg(mcxkernel[devid], 15, sizeof(cl_mem), (void*)(gdetected + setid))));
+                    OCL_ASSERT((clSetKernelArg(mcxkernel[devid], 24, sizeof(cl_mem), (void*)(gphotonseed + setid))));
+                }
+
+                if (isdynload) {
+                    continue;
+                }
+
+                if (cfg->ispersistent) {
+                    OCL_ASSERT((clEnqueueWriteBuffer(mcxqueue[devid], greporter[devid], CL_FALSE, offsetof(MCXReporter, photonid), sizeof(cl_uint), &zero, 0, NULL, NULL)));
+                }
+
+                if (param.rngtype) {
+                    photonoffset[devid + (iter & 1) * workdev] = iter * respinphoton + devoffset[devid];
+                    OCL_ASSERT((clEnqueueWriteBuffer(mcxqueue[devid], greporter[devid], CL_FALSE, offsetof(MCXReporter, photonoffset), sizeof(cl_uint),
+                                                     photonoffset + devid + (iter & 1) * workdev, 0, NULL, NULL)));
+                }
 
                 // launch mcxkernel
+                /*
+                   replay: the photons of the launch, from its first index in the whole run, run in
+                   chunks of replaylen; each chunk reads one of the two replay buffer sets, uploaded
+                   through the replay queue while the kernel of the previous chunk runs
+                */
+                if (replaylen) {
+                    cl_uint first = iter * respinphoton + devoffset[devid], done;
+
+                    for (done = 0; done < launchphoton[devid]; done += replaylen) {
+                        cl_uint len = MIN(replaylen, launchphoton[devid] - done), set = devid + (nreplay[devid]++ & 1) * workdev;
+                        cl_int chunkthread = (cl_int)(len / gpu[devid].autothread), chunkodd = (cl_int)(len - chunkthread * gpu[devid].autothread);
+                        cl_event uploaded;
+
+                        mmc_cl_uploadreplay(cfg, mcxreplayqueue[devid], replayend[set], first + done, len, greplayweight[set], greplaytime[set],
+                                            greplayseed[set], greplaydetid[set], &uploaded);
+
+                        if (replayend[set]) {
+                            OCL_ASSERT((clReleaseEvent(replayend[set])));
+                        }
+
+                        OCL_ASSERT((clSetKernelArg(mcxkernel[devid], 0, sizeof(cl_uint), (void*)&chunkthread)));
+                        OCL_ASSERT((clSetKernelArg(mcxkernel[devid], 1, sizeof(cl_uint), (void*)&chunkodd)));
+                        OCL_ASSERT((clSetKernelArg(mcxkernel[devid], 21, sizeof(cl_mem), (void*)(greplayweight + set))));
+                        OCL_ASSERT((clSetKernelArg(mcxkernel[devid], 22, sizeof(cl_mem), (void*)(greplaytime + set))));
+                        OCL_ASSERT((clSetKernelArg(mcxkernel[devid], 23, sizeof(cl_mem), (void*)(greplayseed + set))));
+                        OCL_ASSERT((clSetKernelArg(mcxkernel[devid], 27, sizeof(cl_mem), (cfg->replaydetid ? (void*)(greplaydetid + set) : NULL))));
+
+                        if (cfg->ispersistent && done > 0) {
+                            OCL_ASSERT((clEnqueueWriteBuffer(mcxqueue[devid], greporter[devid], CL_FALSE, offsetof(MCXReporter, photonid), sizeof(cl_uint), &zero, 0, NULL, NULL)));
+                        }
+
+                        OCL_ASSERT((clEnqueueNDRangeKernel(mcxqueue[devid], mcxkernel[devid], 1, NULL, &gpu[devid].autothread, &gpu[devid].autoblock, 1, &uploaded, replayend + set)));
+                        mmc_cl_timeevent(replayend[set], devtimer, devid << 1);
+                        OCL_ASSERT((clReleaseEvent(uploaded)));
+                        OCL_ASSERT((clFlush(mcxqueue[devid])));
+                    }
+
+#ifndef USE_OS_TIMER
+                    kernelevent = replayend[devid + ((nreplay[devid] - 1) & 1) * workdev];
+                    OCL_ASSERT((clRetainEvent(kernelevent)));
+#endif
+                } else {
 #ifndef USE_OS_TIMER
-                OCL_ASSERT((clEnqueueNDRangeKernel(mcxqueue[devid], mcxkernel[devid], 1, NULL, &gpu[devid].autothread, &gpu[devid].autoblock, 0, NULL, &kernelevent)));
+                    OCL_ASSERT((clEnqueueNDRangeKernel(mcxqueue[devid], mcxkernel[devid], 1, NULL, &gpu[devid].autothread, &gpu[devid].autoblock, 0, NULL, &kernelevent)));
+                    mmc_cl_timeevent(kernelevent, devtimer, devid << 1);
 #else
-                OCL_ASSERT((clEnqueueNDRangeKernel(mcxqueue[devid], mcxkernel[devid], 1, NULL, &gpu[devid].autothread, &gpu[devid].autoblock, 0, NULL, &waittoread[devid])));
-                printf("F\n");
+                    OCL_ASSERT((clEnqueueNDRangeKernel(mcxqueue[devid], mcxkernel[devid], 1, NULL, &gpu[devid].autothread, &gpu[devid].autoblock, 0, NULL, &waittoread[devid])));
+                    mmc_cl_timeevent(waittoread[devid], devtimer, devid << 1);
+                    printf("F\n");
 #endif
+                }
+
+                if (param.ispersistent == 2) {
+                    OCL_ASSERT((clEnqueueReadBuffer(mcxqueue[devid], greporter[devid], CL_FALSE, offsetof(MCXReporter, photonid), sizeof(cl_uint),
+                                                    launched + devid + (iter & 1) * workdev, 0, NULL, (devid == 0 && MMC_HASPROGRESS(cfg)) ? &progressend : NULL)));
+                }
 
                 OCL_ASSERT((clFlush(mcxqueue[devid])));
             }
 
-            if ((cfg->debuglevel & MCX_DEBUG_PROGRESS)) {
+            if (isdynload) {
+                /*photons are pulled from a host-side queue in chunks by whichever device becomes idle*/
+                cl_ulong total = (cl_ulong)(cfg->nphoton / cfg->respin), remain = total, done = 0;
+                cl_ulong chunk[MAX_DEVICE] = {0}, devphoton[MAX_DEVICE] = {0};
+                cl_uint chunktic[MAX_DEVICE] = {0}, nchunk[MAX_DEVICE] = {0};
+                volatile cl_int chunkstatus[MAX_DEVICE];
+                double rate[MAX_DEVICE] = {0.0}, ratesum;
+                int nbusy = 0, wait;
+
+                if (MMC_HASPROGRESS(cfg)) {
+                    mcx_reportprogress(cfg, -0.f);
+                }
+
+                do {
+                    for (devid = 0; devid < workdev; devid++) {
+                        if (chunk[devid]) {
+                            cl_int evstatus = mmc_cl_eventstatus(chunkstatus + devid);
+
+                            if (evstatus < 0) {
+                                mcx_error(-(int)evstatus, (char*)("Error: kernel execution failed"), __FILE__, __LINE__);
+                            }
+
+                            if (evstatus != CL_COMPLETE) {
+                                continue;
+                            }
+
+                            OCL_ASSERT((clReleaseEvent(chunkevent[devid])));
+                            rate[devid] = chunk[devid] / (double)MAX(GetTimeMillis() - chunktic[devid], 1);
+                            done += chunk[devid];
+                            chunk[devid] = 0;
+                            nbusy--;
+                        }
+
+                        if (remain > 0) {
+                            cl_int threadphoton, oddphotons;
+
+                            ratesum = 0.0;
+
+                            for (j = 0; j < workdev; j++) {
+                                ratesum += rate[j];
+                            }
+
+                            chunk[devid] = mmc_cl_chunksize(remain, total * cfg->workload[devid] / fullload, rate[devid], ratesum, gpu[devid].autothread);
+                            threadphoton = (int)(chunk[devid] / gpu[devid].autothread);
+                            oddphotons = (int)(chunk[devid] - (cl_ulong)threadphoton * gpu[devid].autothread);
+
+                            /*a new chunk must not repeat the random sequences of the previous one*/
+                            if (nchunk[devid] > 0 && !param.rngtype) {
+                                Pseed = (cl_uint*)malloc(sizeof(cl_uint) * gpu[devid].autothread * RAND_SEED_WORD_LEN);
+
+                                for (i = 0; i < gpu[devid].autothread * RAND_SEED_WORD_LEN; i++) {
+                                    Pseed[i] = rand();
+                                }
+
+                                OCL_ASSERT((clEnqueueWriteBuffer(mcxqueue[devid], gseed[devid], CL_TRUE, 0, sizeof(cl_uint)*gpu[devid].autothread * RAND_SEED_WORD_LEN,
+                                                                 Pseed, 0, NULL, NULL)));
+                                free(Pseed);
+                            }
+
+                            OCL_ASSERT((clSetKernelArg(mcxkernel[devid], 0, sizeof(cl_uint), (void*)&threadphoton)));
+                            OCL_ASSERT((clSetKernelArg(mcxkernel[devid], 1, sizeof(cl_uint), (void*)&oddphotons)));
+
+                            if (cfg->ispersistent) {
+                                OCL_ASSERT((clEnqueueWriteBuffer(mcxqueue[devid], greporter[devid], CL_FALSE, offsetof(MCXReporter, photonid), sizeof(cl_uint), &zero, 0, NULL, NULL)));
+                            }
+
+                            /*the chunks are taken in order, continuing the photon indices of the respin*/
+                            if (param.rngtype) {
+                                cl_uint chunkoffset = (cl_uint)(iter * total + (total - remain));
+
+                                OCL_ASSERT((clEnqueueWriteBuffer(mcxqueue[devid], greporter[devid], CL_TRUE, offsetof(MCXReporter, photonoffset), sizeof(cl_uint), &chunkoffset, 0, NULL, NULL)));
+                            }
+
+                            OCL_ASSERT((clEnqueueNDRangeKernel(mcxqueue[devid], mcxkernel[devid], 1, NULL, &gpu[devid].autothread, &gpu[devid].autoblock, 0, NULL, chunkevent + devid)));
+                            mmc_cl_watchevent(chunkevent[devid], chunkstatus + devid);
+                            mmc_cl_timeevent(chunkevent[devid], devtimer, devid << 1);
+                            OCL_ASSERT((clFlush(mcxqueue[devid])));
+
+                            chunktic[devid] = GetTimeMillis();
+                            remain -= chunk[devid];
+                            devphoton[devid] += chunk[devid];
+
+                            if (wbuf > 1) {
+                                setphoton[devid + ((iter / cfg->flushrespin) & 1) * workdev] += chunk[devid];
+                            }
+
+                            nchunk[devid]++;
+                            nbusy++;
+                        }
+                    }
+
+                    if (MMC_HASPROGRESS(cfg)) {
+                        mcx_reportprogress(cfg, (iter + (float)done / total) / cfg->respin);
+                    }
+
+                    /*sleep until the first chunk is expected to end at the measured throughput, waking up at least every 100 ms*/
+                    wait = 100;
+
+                    for (devid = 0; devid < workdev; devid++) {
+                        if (chunk[devid] && rate[devid] > 0.0) {
+                            wait = MIN(wait, (int)(chunk[devid] / rate[devid]) - (int)(GetTimeMillis() - chunktic[devid]));
+                        }
+                    }
+
+                    if (nbusy > 0) {
+                        sleep_ms(MAX(wait, 1));
+                    }
+                } while (nbusy > 0);
+
+                if (MMC_HASPROGRESS(cfg)) {
+                    mcx_reportprogress(cfg, (iter + 1.f) / cfg->respin);
+                    MMCDEBUG(cfg, dlProgress, (cfg->flog, "\n"));
+                }
+
+                for (devid = 0; devid < workdev; devid++) {
+                    MMC_FPRINTF(cfg->flog, "- [device %d(%d): %s] simulated %llu photons in %u chunks\n", devid, gpu[devid].id, gpu[devid].name,
+                                (unsigned long long)devphoton[devid], nchunk[devid]);
+                }
+            } else if (MMC_HASPROGRESS(cfg)) {
                 int p0 = 0, ndone = -1;
+                /*the counter is bumped once per thread, or once per photon in the persistent mode*/
+                int ntotal = (cfg->ispersistent) ? (int)launchphoton[0] : (int)gpu[0].autothread;
 
-                mcx_progressbar(-0.f);
+                /*each replay chunk is a launch of all threads*/
+                if (replaylen && !cfg->ispersistent) {
+                    ntotal *= (launchphoton[0] + replaylen - 1) / replaylen;
+                }
+
+                mcx_reportprogress(cfg, -0.f);
+
+                if (progressend) {
+                    mmc_cl_watchevent(progressend, &progressstatus);
+                }
 
                 do {
                     ndone = *progress;
 
                     if (ndone > p0) {
-                        mcx_progressbar((float)ndone / gpu[0].autothread);
+                        mcx_reportprogress(cfg, (iter + (float)ndone / ntotal) / cfg->respin);
                         p0 = ndone;
                     }
 
+                    if (progressend && mmc_cl_eventstatus(&progressstatus) <= CL_COMPLETE) {
+                        break;
+                    }
+
                     sleep_ms(100);
-                } while (p0 < gpu[0].autothread);
+                } while (p0 < ntotal);
+
+                if (progressend) {
+                    OCL_ASSERT((clReleaseEvent(progressend)));
+                    progressend = NULL;
+                }
 
-                mcx_progressbar(cfg->nphoton);
-                MMC_FPRINTF(cfg->flog, "\n");
+                mcx_reportprogress(cfg, (iter + 1.f) / cfg->respin);
+                MMCDEBUG(cfg, dlProgress, (cfg->flog, "\n"));
             }
 
             clEnqueueUnmapMemObject(mcxqueue[0], gprogress[0], progress, 0, NULL, NULL);
 
-            //clWaitForEvents(workdev,waittoread);
             for (devid = 0; devid < workdev; devid++) {
-                OCL_ASSERT((clFinish(mcxqueue[devid])));
+                OCL_ASSERT((clEnqueueMarkerWithWaitList(mcxqueue[devid], 0, NULL, kernelend + devid + (iter & 1) * workdev)));
+
+                /*at the end of a group, read the output set and clear it while the next respin runs on the other set*/
+                if (wbuf > 1 && (iter + 1) % cfg->flushrespin == 0) {
+                    cl_uint wset = devid + ((iter / cfg->flushrespin) & 1) * workdev;
+
+                    OCL_ASSERT((clEnqueueReadBuffer(mcxreadqueue[devid], gweight[wset], CL_FALSE, 0, sizeof(cl_float) * fieldlen * 2,
+                                                    flushbuf[wset], 1, kernelend + devid + (iter & 1) * workdev, (devtimer ? &timedevent : NULL))));
+                    mmc_cl_timerelease(&timedevent, devtimer, (devid << 1) + 1);
+                    OCL_ASSERT((clEnqueueWriteBuffer(mcxreadqueue[devid], gweight[wset], CL_FALSE, 0, sizeof(cl_float) * fieldlen * 2,
+                                                     field, 0, NULL, flushevent + wset)));
+                    OCL_ASSERT((clFlush(mcxreadqueue[devid])));
+                    isdirty[wset] = 0;
+                }
             }
 
-            tic1 = GetTimeMillis();
-            toc += tic1 - tic0;
-            MMC_FPRINTF(cfg->flog, "kernel completeteto:  \t%d ms\nretrieving flux ... \t", tic1 - tic);
-            mcx_fflush(cfg->flog);
+            /*read back the detected photons of the previous respin while this one runs*/
+            if (iter > 0) {
+                for (devid = 0; devid < workdev; devid++) {
+                    cl_event* lastend = kernelend + devid + ((iter - 1) & 1) * workdev;
+                    cl_uint lastid = devid + ((iter - 1) % detbuf) * workdev;
 
-            if (cfg->runtime < tic1 - tic) {
-                cfg->runtime = tic1 - tic;
-            }
+                    if (cfg->issavedet) {
+                        ndet = mmc_cl_readdetected(cfg, mcxreadqueue[devid], *lastend, gdetected[lastid], gdetphoton[lastid], gphotonseed[lastid], Pdet, Pphotonseed, hostdetreclen, mesh);
 
-            for (devid = 0; devid < workdev; devid++) {
-                MCXReporter rep;
-                OCL_ASSERT((clEnqueueReadBuffer(mcxqueue[devid], greporter[devid], CL_TRUE, 0, sizeof(MCXReporter),
-                                                &rep, 0, NULL, waittoread + devid)));
-                reporter.raytet += rep.raytet;
-                reporter.jumpdebug += rep.jumpdebug;
-
-                energy = (cl_float*)calloc(sizeof(cl_float) * cfg->srcnum, gpu[devid].autothread << 1);
-                OCL_ASSERT((clEnqueueReadBuffer(mcxqueue[devid], genergy[devid], CL_TRUE, 0, sizeof(cl_float) * (gpu[devid].autothread << 1) * cfg->srcnum,
-                                                energy, 0, NULL, NULL)));
-
-                for (i = 0; i < gpu[devid].autothread; i++) {
-                    for (j = 0; j < cfg->srcnum; j++) {
-                        cfg->energyesc[j] += energy[(i << 1) * cfg->srcnum + j];
-                        cfg->energytot[j] += energy[((i << 1) + 1) * cfg->srcnum + j];
-                        energyesc += energy[(i << 1) * cfg->srcnum + j];
-                        energytot += energy[((i << 1) + 1) * cfg->srcnum + j];
+                        if (convtotal) {
+                            mmc_cl_convcount(cfg, Pdet, ndet, hostdetreclen, convtotal);
+                        }
                     }
-                }
 
-                free(energy);
+                    OCL_ASSERT((clWaitForEvents(1, lastend)));
+                    OCL_ASSERT((clReleaseEvent(*lastend)));
 
-                if (cfg->debuglevel & dlTraj) {
-                    uint debugrec = rep.jumpdebug;
+                    if (param.ispersistent == 2) {
+                        cl_uint taken = MIN(launched[devid + ((iter - 1) & 1) * workdev], launchphoton[devid]);
 
-                    if (debugrec > 0) {
-                        if (debugrec > cfg->maxjumpdebug) {
-                            MMC_FPRINTF(cfg->flog, S_RED "WARNING: the saved trajectory positions (%d) \
-  are more than what your have specified (%d), please use the --maxjumpdebug option to specify a greater number\n" S_RESET
-                                        , debugrec, cfg->maxjumpdebug);
-                        } else {
-                            MMC_FPRINTF(cfg->flog, "saved %u trajectory positions, total: %d\t", debugrec, cfg->debugdatalen + debugrec);
-                        }
+                        owed[devid] += launchphoton[devid] - taken;
 
-                        debugrec = MIN(debugrec, cfg->maxjumpdebug);
-                        cfg->exportdebugdata = (float*)realloc(cfg->exportdebugdata, (cfg->debugdatalen + debugrec) * debuglen * sizeof(float));
-                        OCL_ASSERT((clEnqueueReadBuffer(mcxqueue[devid], gdebugdata[devid], CL_FALSE, 0, sizeof(float)*debuglen * debugrec,
-                                                        cfg->exportdebugdata + cfg->debugdatalen, 0, NULL, waittoread + devid)));
-                        cfg->debugdatalen += debugrec;
+                        if (owedrange) {
+                            owedrange[(devid * cfg->respin + iter - 1) * 2] = (iter - 1) * respinphoton + devoffset[devid] + taken;
+                            owedrange[(devid * cfg->respin + iter - 1) * 2 + 1] = launchphoton[devid] - taken;
+                        }
                     }
                 }
 
-                if (cfg->issavedet) {
-                    OCL_ASSERT((clEnqueueReadBuffer(mcxqueue[devid], gdetected[devid], CL_FALSE, 0, sizeof(uint),
-                                                    &detected, 0, NULL, NULL)));
-                    OCL_ASSERT((clEnqueueReadBuffer(mcxqueue[devid], gdetphoton[devid], CL_TRUE, 0, sizeof(float)*cfg->maxdetphoton * hostdetreclen,
-                                                    Pdet, 0, NULL, NULL)));
+                /*respin iter is already running, it is the last one if the previous respins have converged*/
+                if (convtotal) {
+                    mcx_convaddbatch(&conv, convtotal, (double)iter * (cfg->nphoton / cfg->respin));
+                    cfg->convrse = mcx_convrse(&conv);
 
-                    if (cfg->issaveseed) {
-                        OCL_ASSERT((clEnqueueReadBuffer(mcxqueue[devid], gphotonseed[devid], CL_TRUE, 0, cfg->maxdetphoton * (sizeof(RandType)*RAND_BUF_LEN),
-                                                        Pphotonseed, 0, NULL, NULL)));
+                    if (cfg->convrse <= cfg->convtarget) {
+                        nrespin = iter + 1;
                     }
+                }
+            }
 
-                    if (detected > cfg->maxdetphoton) {
-                        MMC_FPRINTF(cfg->flog, "WARNING: the detected photon (%d) \
-is more than what your have specified (%d), please use the -H option to specify a greater number\t"
-                                    , detected, cfg->maxdetphoton);
-                    } else {
-                        MMC_FPRINTF(cfg->flog, "detected %d photons, total: %d\t", detected, cfg->detectedcount + detected);
-                    }
+            /*a running kernel can not be interrupted, a cancelled run ends with the respin already queued*/
+            if (MMC_CANCELLED(cfg)) {
+                nrespin = iter + 1;
+            }
+        }// iteration
 
-                    cfg->his.detected += detected;
-                    detected = MIN(detected, cfg->maxdetphoton);
+        if (convtotal || nrespin < (cl_uint)cfg->respin) {
+            cfg->convphoton = (cfg->nphoton / cfg->respin) * nrespin;
+        }
 
-                    if (cfg->exportdetected) {
-                        cfg->exportdetected = (float*)realloc(cfg->exportdetected, (cfg->detectedcount + detected) * hostdetreclen * sizeof(float));
-                        memcpy(cfg->exportdetected + cfg->detectedcount * (hostdetreclen), Pdet, detected * (hostdetreclen)*sizeof(float));
+        if (convtotal) {
+            MMC_FPRINTF(cfg->flog, "%s after %u of %d respins, relative standard error of the detected photons %g (target %g)\n",
+                        (cfg->convrse <= cfg->convtarget) ? "converged" : "did not converge", nrespin, cfg->respin, cfg->convrse, cfg->convtarget);
+        }
 
-                        if (cfg->issaveseed) {
-                            cfg->exportseed = (unsigned char*)realloc(cfg->exportseed, (cfg->detectedcount + detected) * (sizeof(RandType) * RAND_BUF_LEN));
-                            memcpy(cfg->exportseed + cfg->detectedcount * sizeof(RandType)*RAND_BUF_LEN, Pphotonseed, detected * (sizeof(RandType)*RAND_BUF_LEN));
-                        }
+        for (devid = 0; devid < workdev; devid++) {
+            cl_event* lastend = kernelend + devid + ((nrespin - 1) & 1) * workdev;
+            cl_uint lastid = devid + ((nrespin - 1) % detbuf) * workdev;
 
-                        cfg->detectedcount += detected;
-                    }
-                }
+            OCL_ASSERT((clFinish(mcxqueue[devid])));
 
-                if (cfg->issaveref) {
-                    float* rawdref = (float*)calloc(sizeof(float), nflen);
-                    OCL_ASSERT((clEnqueueReadBuffer(mcxqueue[devid], gdref[devid], CL_TRUE, 0, sizeof(float)*nflen,
-                                                    rawdref, 0, NULL, NULL)));
+            if (cfg->issavedet) {
+                mmc_cl_readdetected(cfg, mcxreadqueue[devid], *lastend, gdetected[lastid], gdetphoton[lastid], gphotonseed[lastid], Pdet, Pphotonseed, hostdetreclen, mesh);
+            }
 
-                    //TODO: saving dref has not yet adopting double-buffer
-                    for (i = 0; i < nflen; i++) { //accumulate field, can be done in the GPU
-                        dref[i] += rawdref[i];    //+rawfield[i+fieldlen];
-                    }
+            OCL_ASSERT((clReleaseEvent(*lastend)));
 
-                    free(rawdref);
-                }
-                if (cfg->cam_focal_length > 0)
-                {
-                    float* rawcamsignals = (float*)calloc(sizeof(float), camsignals_size);
-                    OCL_ASSERT((clEnqueueReadBuffer(mcxqueue[devid], gcamsignals[devid], CL_TRUE, 0, sizeof(float)*camsignals_size,
-                                                    rawcamsignals, 0, NULL, NULL)));
+            if (param.ispersistent != 2) {
+                continue;
+            }
 
-                    for (i = 0; i < camsignals_size; i++) { //accumulate field, can be done in the GPU
-                        camsignals[i] += rawcamsignals[i];    //+rawfield[i+fieldlen];
-                    }
+            {
+                cl_uint taken = MIN(launched[devid + ((nrespin - 1) & 1) * workdev], launchphoton[devid]);
 
-                    free(rawcamsignals);
+                owed[devid] += launchphoton[devid] - taken;
+
+                if (owedrange) {
+                    owedrange[(devid * cfg->respin + nrespin - 1) * 2] = (nrespin - 1) * respinphoton + devoffset[devid] + taken;
+                    owedrange[(devid * cfg->respin + nrespin - 1) * 2 + 1] = launchphoton[devid] - taken;
                 }
+            }
 
-                //handling the 2pt distributions
-                if (cfg->issave2pt) {
-                    float* rawfield = (float*)malloc(sizeof(float) * fieldlen * 2);
+            if (owed[devid] == 0) {
+                continue;
+            }
 
-                    OCL_ASSERT((clEnqueueReadBuffer(mcxqueue[devid], gweight[devid], CL_TRUE, 0, sizeof(cl_float)*fieldlen * 2,
-                                                    rawfield, 0, NULL, NULL)));
-                    MMC_FPRINTF(cfg->flog, "transfer complete:        %d ms\n", GetTimeMillis() - tic);
-                    mcx_fflush(cfg->flog);
+            /*launch the photons left by the stopped launches into the drained detected photon buffer until none is left,
+              depositing into the output set of the last group, which is flushed again with the other sets*/
+            if (wbuf > 1) {
+                cl_uint wset = devid + (((nrespin - 1) / cfg->flushrespin) & 1) * workdev;
 
-                    for (i = 0; i < fieldlen; i++) { //accumulate field, can be done in the GPU
-                        field[i] += rawfield[i] + rawfield[i + fieldlen];
-                    }
+                mmc_cl_flushweight(flushevent + wset, flushbuf[wset], dfield, fieldlen, cfg, mesh, setphoton + wset, varstat);
+                setphoton[wset] += owed[devid];
+                isdirty[wset] = 1;
+            }
 
-                    free(rawfield);
-                }
+            MMC_FPRINTF(cfg->flog, "- [device %d(%d): %s] launching %u photons left by the detected photon read-back\n", devid, gpu[devid].id, gpu[devid].name, owed[devid]);
 
-                if (cfg->respin > 1 && RAND_SEED_WORD_LEN > 1) {
+            for (j = 0; owed[devid] > 0;) {
+                cl_uint nowed = owed[devid], *range = NULL, ntaken = 0;
+                cl_uint threadphoton, oddphotons;
+
+                /*with the Philox RNG, each launch continues the photon indices of one respin*/
+                if (owedrange) {
+                    while (owedrange[(devid * cfg->respin + j) * 2 + 1] == 0) {
+                        j++;
+                    }
+
+                    range = owedrange + (devid * cfg->respin + j) * 2;
+                    nowed = range[1];
+                    OCL_ASSERT((clEnqueueWriteBuffer(mcxqueue[devid], greporter[devid], CL_TRUE, offsetof(MCXReporter, photonoffset), sizeof(cl_uint), range, 0, NULL, NULL)));
+                } else {
                     Pseed = (cl_uint*)malloc(sizeof(cl_uint) * gpu[devid].autothread * RAND_SEED_WORD_LEN);
 
                     for (i = 0; i < gpu[devid].autothread * RAND_SEED_WORD_LEN; i++) {
@@ -770,27 +2376,182 @@ is more than what your have specified (%d), please use the -H option to specify
 
                     OCL_ASSERT((clEnqueueWriteBuffer(mcxqueue[devid], gseed[devid], CL_TRUE, 0, sizeof(cl_uint)*gpu[devid].autothread * RAND_SEED_WORD_LEN,
                                                      Pseed, 0, NULL, NULL)));
-                    OCL_ASSERT((clSetKernelArg(mcxkernel[devid], 15, sizeof(cl_mem), (void*)(gseed + devid))));
                     free(Pseed);
                 }
 
-                OCL_ASSERT((clFinish(mcxqueue[devid])));
-            }// loop over work devices
-        }// iteration
+                threadphoton = nowed / gpu[devid].autothread;
+                oddphotons = nowed % gpu[devid].autothread;
+
+                OCL_ASSERT((clEnqueueWriteBuffer(mcxqueue[devid], gdetected[lastid], CL_FALSE, 0, sizeof(cl_uint), &zero, 0, NULL, NULL)));
+                OCL_ASSERT((clEnqueueWriteBuffer(mcxqueue[devid], greporter[devid], CL_FALSE, offsetof(MCXReporter, photonid), sizeof(cl_uint), &zero, 0, NULL, NULL)));
+                OCL_ASSERT((clSetKernelArg(mcxkernel[devid], 0, sizeof(cl_uint), (void*)&threadphoton)));
+                OCL_ASSERT((clSetKernelArg(mcxkernel[devid], 1, sizeof(cl_uint), (void*)&oddphotons)));
+                OCL_ASSERT((clEnqueueNDRangeKernel(mcxqueue[devid], mcxkernel[devid], 1, NULL, &gpu[devid].autothread, &gpu[devid].autoblock, 0, NULL, (devtimer ? &timedevent : NULL))));
+                mmc_cl_timerelease(&timedevent, devtimer, devid << 1);
+                OCL_ASSERT((clEnqueueReadBuffer(mcxqueue[devid], greporter[devid], CL_FALSE, offsetof(MCXReporter, photonid), sizeof(cl_uint), &ntaken, 0, NULL, NULL)));
+                OCL_ASSERT((clEnqueueMarkerWithWaitList(mcxqueue[devid], 0, NULL, lastend)));
+                OCL_ASSERT((clFlush(mcxqueue[devid])));
+
+                mmc_cl_readdetected(cfg, mcxreadqueue[devid], *lastend, gdetected[lastid], gdetphoton[lastid], gphotonseed[lastid], Pdet, Pphotonseed, hostdetreclen, mesh);
+                OCL_ASSERT((clWaitForEvents(1, lastend)));
+                OCL_ASSERT((clReleaseEvent(*lastend)));
+
+                ntaken = MIN(ntaken, nowed);
+                owed[devid] -= ntaken;
+
+                if (range) {
+                    range[0] += ntaken;
+                    range[1] -= ntaken;
+                }
+            }
+
+            /*restore the photons per launch for the next time window*/
+            {
+                cl_uint threadphoton = launchphoton[devid] / gpu[devid].autothread, oddphotons = launchphoton[devid] % gpu[devid].autothread;
+
+                OCL_ASSERT((clSetKernelArg(mcxkernel[devid], 0, sizeof(cl_uint), (void*)&threadphoton)));
+                OCL_ASSERT((clSetKernelArg(mcxkernel[devid], 1, sizeof(cl_uint), (void*)&oddphotons)));
+            }
+        }
+
+        tic1 = GetTimeMillis();
+        toc += tic1 - tic0;
+        MMC_FPRINTF(cfg->flog, "kernel completeteto:  \t%d ms\nretrieving flux ... \t", tic1 - tic);
+        mcx_fflush(cfg->flog);
+
+        if (cfg->runtime < tic1 - tic) {
+            cfg->runtime = tic1 - tic;
+        }
+
+        for (devid = 0; devid < workdev; devid++) {
+            MCXReporter rep;
+            OCL_ASSERT((clEnqueueReadBuffer(mcxqueue[devid], greporter[devid], CL_TRUE, 0, sizeof(MCXReporter),
+                                            &rep, 0, NULL, waittoread + devid)));
+            reporter.raytet += rep.raytet;
+            reporter.jumpdebug += rep.jumpdebug;
+
+            /*only the 2*srcnum totals, each a float pair of a sum and its residual, are read back*/
+            sumsize = sumblock[devid] * (cfg->srcnum << 1);
+            energy = (cl_float*)calloc(sizeof(cl_float2), cfg->srcnum << 1);
+            OCL_ASSERT((clEnqueueNDRangeKernel(mcxqueue[devid], sumkernel[devid], 1, NULL, &sumsize, sumblock + devid, 0, NULL, NULL)));
+            OCL_ASSERT((clEnqueueReadBuffer(mcxqueue[devid], genergysum[devid], CL_TRUE, 0, sizeof(cl_float2) * (cfg->srcnum << 1),
+                                            energy, 0, NULL, NULL)));
+
+            for (j = 0; j < cfg->srcnum; j++) {
+                double esc = (double)energy[j << 1] + energy[(j << 1) + 1];
+                double tot = (double)energy[(cfg->srcnum + j) << 1] + energy[((cfg->srcnum + j) << 1) + 1];
+
+                cfg->energyesc[j] += esc;
+                cfg->energytot[j] += tot;
+                energyesc += esc;
+                energytot += tot;
+            }
+
+            free(energy);
+
+            if (cfg->debuglevel & dlTraj) {
+                uint debugrec = rep.jumpdebug;
+
+                if (debugrec > 0) {
+                    if (debugrec > cfg->maxjumpdebug) {
+                        MMC_FPRINTF(cfg->flog, S_RED "WARNING: the saved trajectory positions (%d) \
+  are more than what your have specified (%d), please use the --maxjumpdebug option to specify a greater number\n" S_RESET
+                                    , debugrec, cfg->maxjumpdebug);
+                    } else {
+                        MMC_FPRINTF(cfg->flog, "saved %u trajectory positions, total: %d\t", debugrec, cfg->debugdatalen + debugrec);
+                    }
+
+                    debugrec = MIN(debugrec, cfg->maxjumpdebug);
+                    cfg->exportdebugdata = (float*)realloc(cfg->exportdebugdata, (cfg->debugdatalen + debugrec) * debuglen * sizeof(float));
+                    OCL_ASSERT((clEnqueueReadBuffer(mcxqueue[devid], gdebugdata[devid], CL_FALSE, 0, sizeof(float)*debuglen * debugrec,
+                                                    cfg->exportdebugdata + cfg->debugdatalen, 0, NULL, waittoread + devid)));
+                    cfg->debugdatalen += debugrec;
+                }
+            }
+
+            if (cfg->issaveref) {
+                float* rawdref = (float*)mmc_cl_mapout(mcxqueue[devid], gdref[devid], sizeof(float) * nflen, zerocopy[devid], (devtimer ? &timedevent : NULL));
+                mmc_cl_timerelease(&timedevent, devtimer, (devid << 1) + 1);
+
+                //TODO: saving dref has not yet adopting double-buffer
+                for (i = 0; i < nflen; i++) { //accumulate field, can be done in the GPU
+                    dref[i] += rawdref[i];    //+rawfield[i+fieldlen];
+                }
+
+                mmc_cl_unmapout(mcxqueue[devid], gdref[devid], rawdref, zerocopy[devid]);
+            }
+            if (cfg->cam_focal_length > 0)
+            {
+                float* rawcamsignals = (float*)mmc_cl_mapout(mcxqueue[devid], gcamsignals[devid], sizeof(float) * camsignals_size, zerocopy[devid], (devtimer ? &timedevent : NULL));
+                mmc_cl_timerelease(&timedevent, devtimer, (devid << 1) + 1);
+
+                for (i = 0; i < camsignals_size; i++) { //accumulate field, can be done in the GPU
+                    camsignals[i] += rawcamsignals[i];    //+rawfield[i+fieldlen];
+                }
+
+                mmc_cl_unmapout(mcxqueue[devid], gcamsignals[devid], rawcamsignals, zerocopy[devid]);
+            }
+
+            if (detimagesize) {
+                float* rawdetimage = (float*)mmc_cl_mapout(mcxqueue[devid], gdetimage[devid], sizeof(float) * detimagesize, zerocopy[devid], (devtimer ? &timedevent : NULL));
+                mmc_cl_timerelease(&timedevent, devtimer, (devid << 1) + 1);
+
+                for (i = 0; i < (int)detimagesize; i++) {
+                    cfg->exportdetimage[i] += rawdetimage[i];
+                }
+
+                mmc_cl_unmapout(mcxqueue[devid], gdetimage[devid], rawdetimage, zerocopy[devid]);
+            }
+
+            //handling the 2pt distributions
+            if (cfg->issave2pt && wbuf > 1) {
+                /*complete the pending flushes, then flush the set of an unfinished group and clear it for the next time window*/
+                for (j = devid; j < workdev * wbuf; j += workdev) {
+                    mmc_cl_flushweight(flushevent + j, flushbuf[j], dfield, fieldlen, cfg, mesh, setphoton + j, varstat);
+
+                    if (isdirty[j]) {
+                        OCL_ASSERT((clEnqueueReadBuffer(mcxqueue[devid], gweight[j], CL_TRUE, 0, sizeof(cl_float) * fieldlen * 2,
+                                                        flushbuf[j], 0, NULL, (devtimer ? &timedevent : NULL))));
+                        mmc_cl_timerelease(&timedevent, devtimer, (devid << 1) + 1);
+                        OCL_ASSERT((clEnqueueWriteBuffer(mcxqueue[devid], gweight[j], CL_FALSE, 0, sizeof(cl_float) * fieldlen * 2,
+                                                         field, 0, NULL, flushevent + j)));
+                        mmc_cl_flushweight(flushevent + j, flushbuf[j], dfield, fieldlen, cfg, mesh, setphoton + j, varstat);
+                        isdirty[j] = 0;
+                    }
+                }
+
+                MMC_FPRINTF(cfg->flog, "transfer complete:        %d ms\n", GetTimeMillis() - tic);
+                mcx_fflush(cfg->flog);
+            } else if (cfg->issave2pt) {
+                float* rawfield = (float*)mmc_cl_mapout(mcxqueue[devid], gweight[devid], sizeof(cl_float) * fieldlen * 2, zerocopy[devid], (devtimer ? &timedevent : NULL));
+
+                mmc_cl_timerelease(&timedevent, devtimer, (devid << 1) + 1);
+                MMC_FPRINTF(cfg->flog, "transfer complete:        %d ms\n", GetTimeMillis() - tic);
+                mcx_fflush(cfg->flog);
+
+                for (i = 0; i < fieldlen; i++) { //accumulate field, can be done in the GPU
+                    dfield[i] += (double)rawfield[i] + rawfield[i + fieldlen];
+                }
+
+                mmc_cl_unmapout(mcxqueue[devid], gweight[devid], rawfield, zerocopy[devid]);
+            }
+
+            OCL_ASSERT((clFinish(mcxqueue[devid])));
+        }// loop over work devices
     }// time gates
 
     if (cfg->exportfield) {
         if (cfg->basisorder == 0 || cfg->method == rtBLBadouelGrid) {
             for (i = 0; i < fieldlen; i++) {
-                cfg->exportfield[i] += field[i];
+                cfg->exportfield[i] += dfield[i];
             }
         } else {
             int srcid;
 
-            for (i = 0; i < cfg->maxgate; i++) {
+            for (i = 0; i < cfg->maxgate * cfg->replaydetnum + 2 * cfg->freqnum; i++) {
                 for (j = 0; j < mesh->ne; j++) {
                     for (srcid = 0; srcid < cfg->srcnum; srcid++) {
-                        float ww = field[(i * mesh->ne + j) * cfg->srcnum + srcid] * 0.25f;
+                        double ww = dfield[(i * mesh->ne + j) * cfg->srcnum + srcid] * 0.25;
                         int k;
 
                         for (k = 0; k < mesh->elemlen; k++) {
@@ -810,6 +2571,8 @@ is more than what your have specified (%d), please use the -H option to specify
     }
 
 
+    mesh_batchvariance(mesh, cfg, varstat[1], (int)varstat[0]);
+
     if (cfg->isnormalized) {
         double cur_normalizer, sum_normalizer = 0.0, energyabs = 0.0;
 
@@ -824,6 +2587,21 @@ is more than what your have specified (%d), please use the -H option to specify
         cfg->his.normalizer = sum_normalizer / cfg->srcnum; // average normalizer value for all simulated sources
     }
 
+    mesh_scalevariance(mesh, cfg);
+    mesh_restoreorder(mesh, cfg, cfg->exportdetected, cfg->detectedcount, hostdetreclen);
+
+    /*with --detstat, the detector image holds the per-detector sums of accumdetstat()*/
+    if (cfg->isdetstat) {
+        double* detsums = (double*)malloc(sizeof(double) * detimagesize);
+
+        for (i = 0; i < (int)detimagesize; i++) {
+            detsums[i] = cfg->exportdetimage[i];
+        }
+
+        mesh_normdetstat(mesh, cfg, detsums, (double)cfg->nphoton);
+        free(detsums);
+    }
+
 #ifndef MCX_CONTAINER
     if (cfg->cam_focal_length > 0)
     {
@@ -833,15 +2611,30 @@ is more than what your have specified (%d), please use the -H option to specify
         mcx_fflush(cfg->flog);
     }
 
-    if (cfg->issave2pt && cfg->parentid == mpStandalone) {
+    if (cfg->exportdetstat && cfg->parentid == mpStandalone) {
+        MMC_FPRINTF(cfg->flog, "saving detector statistics ...\n");
+        mesh_savedetstat(mesh, cfg);
+    }
+
+    if (cfg->issaveexit == 2 && cfg->parentid == mpStandalone) {
+        MMC_FPRINTF(cfg->flog, "saving detector image to file ...\t");
+        mesh_savedetimage(cfg->exportdetimage, cfg);
+        MMC_FPRINTF(cfg->flog, "saving data complete : %d ms\n\n", GetTimeMillis() - tic);
+        mcx_fflush(cfg->flog);
+    }
+
+    if (cfg->issave2pt && cfg->parentid == mpStandalone && cfg->ispipeline != 2) {
         MMC_FPRINTF(cfg->flog, "saving data to file ...\t");
         mesh_saveweight(mesh, cfg, 0);
+        mesh_savevariance(mesh, cfg);
         MMC_FPRINTF(cfg->flog, "saving data complete : %d ms\n\n", GetTimeMillis() - tic);
         mcx_fflush(cfg->flog);
     }
 
-    if (cfg->issavedet && cfg->parentid == mpStandalone && cfg->exportdetected) {
-        cfg->his.totalphoton = cfg->nphoton;
+    if (cfg->streamdet > 0) {
+        mesh_appenddetphoton(NULL, 0, hostdetreclen, cfg);
+    } else if (cfg->issavedet && cfg->parentid == mpStandalone && cfg->exportdetected) {
+        cfg->his.totalphoton = cfg->convphoton;
         cfg->his.unitinmm = cfg->unitinmm;
         cfg->his.savedphoton = cfg->detectedcount;
         cfg->his.detected = cfg->detectedcount;
@@ -852,21 +2645,27 @@ is more than what your have specified (%d), please use the -H option to specify
     if ((cfg->debuglevel & dlTraj) && cfg->parentid == mpStandalone && cfg->exportdebugdata) {
         cfg->his.colcount = MCX_DEBUG_REC_LEN;
         cfg->his.savedphoton = cfg->debugdatalen;
-        cfg->his.totalphoton = cfg->nphoton;
+        cfg->his.totalphoton = cfg->convphoton;
         cfg->his.detected = 0;
         mesh_savedetphoton(cfg->exportdebugdata, NULL, cfg->debugdatalen, 0, cfg);
     }
 
-    if (cfg->issaveref && cfg->parentid == mpStandalone) {
+    if (cfg->issaveref && cfg->parentid == mpStandalone && cfg->ispipeline != 2) {
         MMC_FPRINTF(cfg->flog, "saving surface diffuse reflectance ...");
         mesh_saveweight(mesh, cfg, 1);
     }
 
+    if (cfg->shmname[0] && cfg->parentid == mpStandalone) {
+        MMC_FPRINTF(cfg->flog, "saving outputs to shared memory ...\t");
+        mesh_saveshm(mesh, cfg, hostdetreclen);
+        MMC_FPRINTF(cfg->flog, "saving data complete : %d ms\n\n", GetTimeMillis() - tic);
+    }
+
 #endif
 
     // total energy here equals total simulated photons+unfinished photons for all threads
     MMC_FPRINTF(cfg->flog, "simulated %zu photons (%zu) with %d devices (ray-tet %.0f)\nMCX simulation speed: %.2f photon/ms\n",
-                cfg->nphoton, cfg->nphoton, workdev, reporter.raytet, (double)cfg->nphoton / toc);
+                cfg->convphoton, cfg->nphoton, workdev, reporter.raytet, (double)cfg->convphoton / toc);
     MMC_FPRINTF(cfg->flog, "total simulated energy: %.2f\tabsorbed: %5.5f%%\n(loss due to initial specular reflection is excluded in the total)\n",
                 energytot, (energytot - energyesc) / energytot * 100.f);
     mcx_fflush(cfg->flog);
@@ -875,29 +2674,44 @@ is more than what your have specified (%d), please use the -H option to specify
 
     for (i = 0; i < workdev; i++) {
         OCL_ASSERT(clReleaseMemObject(gseed[i]));
-        OCL_ASSERT(clReleaseMemObject(gdetphoton[i]));
-        OCL_ASSERT(clReleaseMemObject(gweight[i]));
+        for (j = i; j < workdev * wbuf; j += workdev) {
+            OCL_ASSERT(clReleaseMemObject(gweight[j]));
+            free(flushbuf[j]);
+        }
+
         OCL_ASSERT(clReleaseMemObject(gdref[i]));
         OCL_ASSERT(clReleaseMemObject(gcamsignals[i]));
         OCL_ASSERT(clReleaseMemObject(genergy[i]));
-        OCL_ASSERT(clReleaseMemObject(gdetected[i]));
+        OCL_ASSERT(clReleaseMemObject(genergysum[i]));
+
+        for (j = i; j < workdev * detbuf; j += workdev) {
+            OCL_ASSERT(clReleaseMemObject(gdetphoton[j]));
+            OCL_ASSERT(clReleaseMemObject(gdetected[j]));
 
-        if (gphotonseed[i]) {
-            OCL_ASSERT(clReleaseMemObject(gphotonseed[i]));
+            if (gphotonseed[j]) {
+                OCL_ASSERT(clReleaseMemObject(gphotonseed[j]));
+            }
+        }
+
+        if (respinseed[i]) {
+            free(respinseed[i]);
+            free(respinseed[i + workdev]);
         }
 
         OCL_ASSERT(clReleaseMemObject(greporter[i]));
 
-        OCL_ASSERT(clReleaseMemObject(gnode[i]));
-        OCL_ASSERT(clReleaseMemObject(gelem[i]));
-        OCL_ASSERT(clReleaseMemObject(gtype[i]));
-        OCL_ASSERT(clReleaseMemObject(gfacenb[i]));
+        if (cfg->meshsession == 0) {
+            OCL_ASSERT(clReleaseMemObject(gnode[i]));
+            OCL_ASSERT(clReleaseMemObject(gelem[i]));
+            OCL_ASSERT(clReleaseMemObject(gtype[i]));
+            OCL_ASSERT(clReleaseMemObject(gfacenb[i]));
+            OCL_ASSERT(clReleaseMemObject(gnormal[i]));
+        }
 
         if (gsrcelem[i]) {
             OCL_ASSERT(clReleaseMemObject(gsrcelem[i]));
         }
 
-        OCL_ASSERT(clReleaseMemObject(gnormal[i]));
         OCL_ASSERT(clReleaseMemObject(gproperty[i]));
         OCL_ASSERT(clReleaseMemObject(gparam[i]));
 
@@ -909,19 +2723,46 @@ is more than what your have specified (%d), please use the -H option to specify
             OCL_ASSERT(clReleaseMemObject(gdebugdata[i]));
         }
 
-        if (greplayweight[i]) {
-            OCL_ASSERT(clReleaseMemObject(greplayweight[i]));
+        if (detimagesize) {
+            OCL_ASSERT(clReleaseMemObject(gdetimage[i]));
+        }
+
+        for (j = i; j < workdev * 2; j += workdev) {
+            if (greplayweight[j]) {
+                OCL_ASSERT(clReleaseMemObject(greplayweight[j]));
+            }
+
+            if (greplayseed[j]) {
+                OCL_ASSERT(clReleaseMemObject(greplayseed[j]));
+            }
+
+            if (greplaytime[j]) {
+                OCL_ASSERT(clReleaseMemObject(greplaytime[j]));
+            }
+
+            if (greplaydetid[j]) {
+                OCL_ASSERT(clReleaseMemObject(greplaydetid[j]));
+            }
+
+            if (replayend[j]) {
+                OCL_ASSERT(clReleaseEvent(replayend[j]));
+            }
+        }
+
+        if (ginvcdf[i]) {
+            OCL_ASSERT(clReleaseMemObject(ginvcdf[i]));
         }
 
-        if (greplayseed[i]) {
-            OCL_ASSERT(clReleaseMemObject(greplayseed[i]));
+        if (gdetgrid[i]) {
+            OCL_ASSERT(clReleaseMemObject(gdetgrid[i]));
         }
 
-        if (greplaytime[i]) {
-            OCL_ASSERT(clReleaseMemObject(greplaytime[i]));
+        if (gelemmed[i]) {
+            OCL_ASSERT(clReleaseMemObject(gelemmed[i]));
         }
 
         OCL_ASSERT(clReleaseKernel(mcxkernel[i]));
+        OCL_ASSERT(clReleaseKernel(sumkernel[i]));
     }
 
     free(gseed);
@@ -930,12 +2771,34 @@ is more than what your have specified (%d), please use the -H option to specify
     free(gdref);
     free(gcamsignals);
     free(genergy);
+    free(genergysum);
     free(gprogress);
     free(gdetected);
     free(gphotonseed);
     free(gdebugdata);
+    free(gdetimage);
     free(greporter);
 
+    /*hand the mesh buffers and the context over to the mesh session*/
+    if (cfg->meshsession && !ismeshcached) {
+        clmesh.session = cfg->meshsession;
+        clmesh.nn = mesh->nn;
+        clmesh.ne = mesh->ne;
+        clmesh.elemlen = mesh->elemlen;
+        clmesh.method = cfg->method;
+        clmesh.ispackmesh = param.ispackmesh;
+        clmesh.halffacenum = param.halffacenum;
+        clmesh.workdev = workdev;
+        memcpy(clmesh.devices, devices, workdev * sizeof(cl_device_id));
+        clmesh.context = mcxcontext;
+        clmesh.gnode = gnode;
+        clmesh.gelem = gelem;
+        clmesh.gtype = gtype;
+        clmesh.gfacenb = gfacenb;
+        clmesh.gnormal = gnormal;
+        gnode = gelem = gtype = gfacenb = gnormal = NULL;
+    }
+
     free(gnode);
     free(gelem);
     free(gtype);
@@ -949,13 +2812,21 @@ is more than what your have specified (%d), please use the -H option to specify
     free(greplayweight);
     free(greplayseed);
     free(greplaytime);
+    free(greplaydetid);
+    free(ginvcdf);
+    free(gdetgrid);
+    free(gelemmed);
     free(mcxkernel);
+    free(sumkernel);
 
     free(waittoread);
-    free(cfg->energytot);
-    free(cfg->energyesc);
-    cfg->energytot = NULL;
-    cfg->energyesc = NULL;
+
+    if (isenergyowner) {
+        free(cfg->energytot);
+        free(cfg->energyesc);
+        cfg->energytot = NULL;
+        cfg->energyesc = NULL;
+    }
 
     if (gpu) {
         free(gpu);
@@ -964,20 +2835,46 @@ is more than what your have specified (%d), please use the -H option to specify
     for (devid = 0; devid < workdev; devid++) {
         OCL_ASSERT((clFinish(mcxqueue[devid])));
         OCL_ASSERT(clReleaseCommandQueue(mcxqueue[devid]));
+        OCL_ASSERT(clReleaseCommandQueue(mcxreadqueue[devid]));
+
+        if (mcxreplayqueue) {
+            OCL_ASSERT(clReleaseCommandQueue(mcxreplayqueue[devid]));
+        }
     }
 
     free(mcxqueue);
+    free(mcxreadqueue);
+    free(mcxreplayqueue);
+
+    if (devtimer) {
+        mmc_cl_waittimer(devtimer, workdev << 1);
+        free(devtimer);
+    }
     OCL_ASSERT(clReleaseProgram(mcxprogram));
-    OCL_ASSERT(clReleaseContext(mcxcontext));
+
+    if (cfg->meshsession == 0) {
+        OCL_ASSERT(clReleaseContext(mcxcontext));
+    }
 #ifndef USE_OS_TIMER
     OCL_ASSERT(clReleaseEvent(kernelevent));
 #endif
     free(field);
+    free(dfield);
 
     if (Pdet) {
         free(Pdet);
     }
 
+    if (convtotal) {
+        free(convtotal);
+    }
+
+    if (owedrange) {
+        free(owedrange);
+    }
+
+    mcx_convclear(&conv);
+
     if (Pphotonseed) {
         free(Pphotonseed);
     }
@@ -38,6 +38,7 @@
 #ifndef _MMC_HOSTCODE_CL_H
 #define _MMC_HOSTCODE_CL_H
 
+#include "mmc_const.h"
 #include "mmc_cl_utils.h"
 #include "mmc_mesh.h"
 #include "mmc_raytrace.h"
@@ -61,6 +62,10 @@ typedef cl_bitfield         cl_mem_flags_NV;
 
 #define RAND_SEED_WORD_LEN      4        //48 bit packed with 64bit length
 
+#define MMC_MEM_RESERVE         (64 << 20) /**< device memory kept free for the driver when checking if the buffers fit */
+#define MMC_MACRO_CONST_PHOTON  1e8      /**< at -o 3, runs with at least this many photons bake the kernel constants (-DUSE_MACRO_CONST) */
+#define MMC_ENERGY_BLOCK        256      /**< max work-group size of mmc_sum_energy, one group per energy counter of a source */
+
 typedef struct PRE_ALIGN(32) GPU_mcconfig {
     cl_float3 srcpos;
     cl_float3 srcdir;
@@ -108,14 +113,36 @@ typedef struct PRE_ALIGN(32) GPU_mcconfig {
     cl_uint cam_image_height;          /**< The camera image height.*/
     cl_uint cam_image_width;           /**< The camera image width.*/
     cl_float cam_pixel_pitch;         /**< How many mm a pixel represents.*/
+    cl_int    ispackmesh;             /**< 1 if gnormal holds the packed per-element records from tracer_packgpu() */
+    cl_float4 detparam1;              /**< area detector edge 1 and its pixel count, used when issaveexit is 2 */
+    cl_float4 detparam2;              /**< area detector edge 2 and its pixel count, used when issaveexit is 2 */
+    cl_float4 detorigin;              /**< lower corner of the area detector, i.e. the first detector position */
+    cl_int    freqnum;                /**< number of modulation frequencies of the frequency-domain output */
+    cl_float  omega[MAX_FREQ_NUM];    /**< angular modulation frequencies (rad/s) */
+    cl_int    nphase;                 /**< entries per label of the inverse CDF of cos(theta) in ginvcdf */
+    cl_int    ispersistent;           /**< 1 if threads pull photon IDs from the reporter counter instead of a fixed share */
+    cl_float4 srcgridorig;            /**< lower corner and inverse cell size (w) of the wide-field source grid */
+    cl_int4   srcgriddim;             /**< cells of the source grid along x/y/z, and the offset (w) of its cell starts in gsrcelem, 0 if no grid */
+    cl_float4 detgridorig;            /**< lower corner and inverse cell size (w) of the detector grid in gdetgrid */
+    cl_int4   detgriddim;             /**< cells of the detector grid along x/y/z */
+    cl_int    rngtype;                /**< 0 for xorshift128+, 1 for the Philox RNG with a stream per photon */
+    cl_uint   trajsample;             /**< only the trajectories of every trajsample-th photon are saved */
+    cl_int    islocalmesh;            /**< 1 if the kernel is built with USE_LOCAL_MESH, tracing from a copy of the mesh in the local memory */
+    cl_int    isdetstat;              /**< 1 to accumulate the per-detector statistics of --detstat in gdetimage */
+    cl_int    importoffset;           /**< offset (in float4) of the per-label importance table in gproperty, 0 if photons are not split */
+    cl_int    halffacenum;            /**< number of faces in the shared face table of --halfface in gnormal, 0 if gnormal and gfacenb hold per-element data */
+    cl_int    patternbits;            /**< bits per weight in gsrcpattern, 16 or 8 if it starts with the per-pattern scales of mcx_packpattern */
 } MCXParam POST_ALIGN(32);
 
 typedef struct POST_ALIGN(32) GPU_reporter {
     float     raytet;
     cl_uint   jumpdebug;
+    cl_uint   photonid;
+    cl_uint   photonoffset;           /**< index of the first photon of a launch in the whole run */
 } MCXReporter  POST_ALIGN(32);
 
 void mmc_run_cl(mcconfig* cfg, tetmesh* mesh, raytracer* tracer);
+void mmc_cl_release_meshcache(void);
 
 #ifdef  __cplusplus
 }
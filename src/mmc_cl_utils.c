@@ -299,6 +299,16 @@ cl_platform_id mcx_list_cl_gpu(mcconfig* cfg, unsigned int* activedev, cl_device
                         OCL_ASSERT((clGetDeviceInfo(devices[k], CL_DEVICE_LOCAL_MEM_SIZE, sizeof(cl_ulong), (void*)&cuinfo.sharedmem, NULL)));
                         OCL_ASSERT((clGetDeviceInfo(devices[k], CL_DEVICE_MAX_CONSTANT_BUFFER_SIZE, sizeof(cl_ulong), (void*)&cuinfo.constmem, NULL)));
                         OCL_ASSERT((clGetDeviceInfo(devices[k], CL_DEVICE_MAX_CLOCK_FREQUENCY, sizeof(cl_uint), (void*)&cuinfo.clock, NULL)));
+
+                        /*deprecated since OpenCL 2.0, treated as a discrete device if not reported*/
+                        {
+                            cl_bool isunified = CL_FALSE;
+
+                            if (clGetDeviceInfo(devices[k], CL_DEVICE_HOST_UNIFIED_MEMORY, sizeof(cl_bool), (void*)&isunified, NULL) == CL_SUCCESS) {
+                                cuinfo.isunified = (isunified == CL_TRUE);
+                            }
+                        }
+
                         cuinfo.maxgate = cfg->maxgate;
                         cuinfo.autoblock = 64;
                         cuinfo.core = cuinfo.sm;
@@ -345,6 +355,7 @@ cl_platform_id mcx_list_cl_gpu(mcconfig* cfg, unsigned int* activedev, cl_device
                             MMC_FPRINTF(cfg->flog, " Local memory    :\t%ld B\n", (unsigned long)cuinfo.sharedmem);
                             MMC_FPRINTF(cfg->flog, " Constant memory :\t%ld B\n", (unsigned long)cuinfo.constmem);
                             MMC_FPRINTF(cfg->flog, " Clock speed     :\t%d MHz\n", cuinfo.clock);
+                            MMC_FPRINTF(cfg->flog, " Unified memory  :\t%s\n", (cuinfo.isunified ? "yes" : "no"));
 
                             if (strstr(pbuf, "NVIDIA")) {
                                 MMC_FPRINTF(cfg->flog, " Compute Capacity:\t%d.%d\n", cuinfo.major, cuinfo.minor);
@@ -41,6 +41,16 @@
 #define MED_MASK           0x0000FFFF
 
 #define MAX_PROP           4000
+#define MAX_FREQ_NUM       16    /**< maximum number of modulation frequencies of the frequency-domain output, must match mmc_core.cl */
+#define MAX_ACCUM_CACHE    128   /**< slots of the per-work-group weight accumulation cache in the GPU kernel, must match mmc_core.cl */
+#define MAX_ZIP_BLOCK      (1 << 22)  /**< bytes per independently compressed block of a large zlib/gzip output */
+#define MAX_JSON_CHUNK     (1 << 20)  /**< minimum byte length of an inline JSON mesh array chunk parsed by one thread */
+#define MAX_REPLAY_CHUNK   (1 << 20)  /**< replayed photons per GPU kernel launch, whose seeds, weights and times are uploaded while the previous chunk runs */
+#define MIN_REPLAY_CHUNK   (1 << 14)  /**< minimum number of detected photons filtered by one thread when a replay is initialized */
+#define MMC_WEIGHT_BLOCK   256        /**< number of launched photons summed in float before folding the launched/absorbed weights into double */
+#define MMC_DCS_TAU_NUM    200   /**< default number of the log-spaced correlation times from 1e-7 to 1e-1 s of --dcs, as matlab/generate_g1.m */
+#define MMC_PHASE_TABLE_LEN 1024     /**< default entries per medium of the inverse CDF of cos(theta), see --phasetable */
+#define MMC_PHASE_TABLE_MAX (1 << 20) /**< maximum entries per medium of the inverse CDF of cos(theta) */
 
 #define R_C0               3.335640951981520e-12f  /**< one over speed of light in s/mm */
 
@@ -29,7 +29,18 @@
 **          GPL v3, see LICENSE.txt for details
 *******************************************************************************/
 
-#ifdef __NVCC__
+/* the CUDA kernel is also built by hipcc for AMD GPUs, see mmc_hip.h */
+#if defined(__NVCC__) || defined(__HIPCC__)
+#define MMC_CUDA_KERNEL
+#endif
+
+#ifdef MMC_CUDA_KERNEL
+#ifdef __HIPCC__
+#include <hip/hip_fp16.h>
+#else
+#include <cuda_fp16.h>
+#endif
+
 #define __constant const
 #define __private
 #define __local
@@ -50,6 +61,12 @@ inline __device__ __host__ int get_local_id(int idx) {
 inline __device__ __host__ int get_local_size(int idx) {
     return (idx == 0) ? blockDim.x : ( (idx == 1) ? blockDim.y : blockDim.z );
 }
+inline __device__ __host__ int get_global_size(int idx) {
+    return (idx == 0) ? gridDim.x * blockDim.x
+           : ( (idx == 1) ? gridDim.y * blockDim.y : gridDim.z * blockDim.z);
+}
+/* HIP vector types come with these operators */
+#ifndef __HIPCC__
 inline __device__ __host__ float3 operator *(float3 a, float3 b) {
     return make_float3(a.x * b.x, a.y * b.y, a.z * b.z);
 }
@@ -154,6 +171,7 @@ inline __device__ __host__ float4 operator /(float4 a, float4 b) {
     return make_float4(a.x / b.x, a.y / b.y, a.z / b.z, a.w / b.w);
 }
 #endif
+#endif
 
 inline __device__ __host__ float dot(float3 a, float3 b) {
     return a.x * b.x + a.y * b.y + a.z * b.z;
@@ -181,11 +199,27 @@ inline __device__ __host__ float4 convert_float4_rte(float4 v) {
     return make_float4(roundf(v.x), roundf(v.y), roundf(v.z), roundf(v.w));
 }
 #define FL4(f) make_float4(f,f,f,f)
+#define FL4_4(a,b,c,d) make_float4(a,b,c,d)
 #define FL3(f) make_float3(f,f,f)
 #define FL4_3(f) make_float3(f.x,f.y,f.z)
 #define FLT_EPSILON   1.19209290E-07F
 #define atomicadd(a,b)  atomicAdd(a,b)
 #define atomic_inc(x)   atomicAdd(x,1)
+#define atomic_add(a,b) atomicAdd(a,b)
+#define atomic_cmpxchg(a,b,c)  atomicCAS(a,b,c)
+#define mul_hi(a,b)     __umulhi(a,b)
+#define vload_half(i,p)  __half2float((p)[i])
+inline __device__ float4 vload_half4(int i, const half* p) {
+    return make_float4(__half2float(p[i << 2]), __half2float(p[(i << 2) + 1]), __half2float(p[(i << 2) + 2]), __half2float(p[(i << 2) + 3]));
+}
+#define barrier(x)      __syncthreads()
+
+/*read the never-written mesh buffers through the read-only (texture) data cache, unless copied to the shared memory*/
+#ifdef USE_LDG
+    #define MMC_RO(x)   (LOCAL_MESH ? (x) : __ldg(&(x)))
+#else
+    #define MMC_RO(x)   (x)
+#endif
 
 #ifdef MCX_USE_NATIVE
     #define MCX_MATHFUN(fun)              fun
@@ -199,8 +233,10 @@ typedef struct MMC_FLOAT3 {
     float x, y, z;
 } FLOAT3;
 #define FL4(f) (f)
+#define FL4_4(a,b,c,d) ((float4)(a,b,c,d))
 #define FL3(f) (f)
 #define FL4_3(f) (f.x,f.y,f.z)
+#define MMC_RO(x)   (x)
 #define __constant__  __constant
 #define __device__
 #ifndef NULL
@@ -251,7 +287,7 @@ typedef struct MMC_FLOAT3 {
 #define SAME_VOXEL         -9999.f                 //scatter within a voxel
 #define NO_LAUNCH          9999                    //when fail to launch, for debug
 
-#ifndef __NVCC__
+#ifndef MMC_CUDA_KERNEL
     #define ID_UNDEFINED       0x7FFFFFFFU              /**< flag indicating the index is outside of the volume */
     #define TWO_PI             6.28318530717959f       //2*pi
     #define EPS                FLT_EPSILON             //round-off limit
@@ -262,6 +298,10 @@ typedef struct MMC_FLOAT3 {
 #define DET_MASK           0xFFFF0000
 #define MED_MASK           0x0000FFFF
 #define MAX_ACCUM          1000.f
+#define ACCUM_CACHE_BITS   7                        /**< log2 of the number of slots in the work-group accumulation cache */
+#define MAX_ACCUM_CACHE    (1 << ACCUM_CACHE_BITS)  /**< slots in the work-group accumulation cache, must match mmc_const.h */
+#define ACCUM_CACHE_EMPTY  0xFFFFFFFFU              /**< key of an unused accumulation cache slot */
+#define MAX_FREQ_NUM       16                       /**< maximum number of modulation frequencies, must match mmc_const.h */
 #define R_MIN_MUS          1e9f
 #define FIX_PHOTON         1e-3f      /**< offset to the ray to avoid edge/vertex */
 #define MAX_TRIAL          3          /**< number of fixes when a photon hits an edge/vertex */
@@ -278,7 +318,7 @@ typedef struct MMC_FLOAT3 {
 #define F32N(a) ((a) & 0x80000000)          /**<  Macro to test if a floating point is negative */
 #define F32P(a) ((a) ^ 0x80000000)          /**<  Macro to test if a floating point is positive */
 
-typedef struct MMC_Ray {
+typedef struct __attribute__ ((aligned (16))) MMC_Ray {
     float3 p0;                    /**< current photon position */
     float3 vec;                   /**< current photon direction vector */
     float3 pout;                  /**< the intersection position of the ray to the enclosing tet */
@@ -296,10 +336,10 @@ typedef struct MMC_Ray {
     //float4 bary0;               /**< the Barycentric coordinate of the intersection with the tet */
     float slen0;                  /**< initial unitless scattering length = length*mus */
     unsigned int photonid;        /**< index of the current photon */
-} ray __attribute__ ((aligned (16)));
+} ray;
 
 
-typedef struct MMC_Parameter {
+typedef struct __attribute__ ((aligned (16))) MMC_Parameter {
     float3 srcpos;
     float3 srcdir;
     float  tstart, tend;
@@ -346,21 +386,42 @@ typedef struct MMC_Parameter {
     int cam_image_width;
     int cam_image_height;
     float cam_pixel_pitch;
-} MCXParam __attribute__ ((aligned (16)));
-
-typedef struct MMC_Reporter {
+    int   ispackmesh;             /**< 1 if the normal buffer holds the packed per-element records from tracer_packgpu() */
+    float4 detparam1;             /**< area detector edge 1 (x,y,z) and its pixel count (w), used when issaveexit is 2 */
+    float4 detparam2;             /**< area detector edge 2 (x,y,z) and its pixel count (w), used when issaveexit is 2 */
+    float4 detorigin;             /**< lower corner of the area detector, i.e. the first detector position */
+    int    freqnum;               /**< number of modulation frequencies of the frequency-domain output */
+    float  omega[MAX_FREQ_NUM];   /**< angular modulation frequencies (rad/s) */
+    int    nphase;                /**< entries per label of the inverse CDF of cos(theta), used when invcdf is not NULL */
+    int    ispersistent;          /**< 1 if threads pull photon IDs from reporter->photonid instead of a fixed per-thread share, 2 to also stop before detectedphoton can overflow */
+    float4 srcgridorig;           /**< lower corner (x,y,z) and inverse cell size (w) of the wide-field source grid */
+    int4   srcgriddim;            /**< cells of the source grid along x/y/z, and the offset (w) of its cell starts in srcelem, 0 if no grid */
+    float4 detgridorig;           /**< lower corner (x,y,z) and inverse cell size (w) of the detector grid, used when detgrid is not NULL */
+    int4   detgriddim;            /**< cells of the detector grid along x/y/z */
+    int    rngtype;               /**< 0 for xorshift128+ with per-thread seeds, 1 for Philox2x32-10 with a stream per photon */
+    uint   trajsample;            /**< only the trajectories of photons with an index divisible by trajsample are saved */
+    int    islocalmesh;           /**< 1 if each work-group traces from a copy of the per-step mesh buffers in the shared memory, see cachemesh() */
+    int    isdetstat;             /**< 1 to accumulate the TPSF and mean partial paths/scattering counts of each detector in detimage (--detstat) */
+    int    importoffset;          /**< offset (in float4) of the per-label importance of --importance in gmed, 0 if photons are not split */
+    int    halffacenum;           /**< number of faces in the shared face table of --halfface, 0 if normal and facenb hold per-element data */
+    int    patternbits;           /**< bits per weight in srcpattern, 16 or 8 if it starts with the per-pattern scales of mcx_packpattern() */
+} MCXParam;
+
+typedef struct __attribute__ ((aligned (16))) MMC_Reporter {
     float  raytet;
     uint   jumpdebug;
-} MCXReporter  __attribute__ ((aligned (16)));
+    uint   photonid;              /**< next photon to launch in the persistent-thread mode, reset before each launch */
+    uint   photonoffset;          /**< index of the first photon of a launch in the whole run, the stream of the Philox RNG */
+} MCXReporter;
 
-typedef struct MCX_medium {
+typedef struct __attribute__ ((aligned (16))) MCX_medium {
     float mua;                    /**<absorption coeff in 1/mm unit*/
     float mus;                    /**<scattering coeff in 1/mm unit*/
     float g;                      /**<anisotropy*/
     float n;                      /**<refractive index*/
-} Medium __attribute__ ((aligned (16)));
+} Medium;
 
-#ifdef __NVCC__
+#ifdef MMC_CUDA_KERNEL
 __constant__ MCXParam gcfg[1];
 __constant__ Medium   gmed[MAX_PROP];
 #define GPU_PARAM(a,b) (a->b)
@@ -377,6 +438,76 @@ enum TBoundary {bcNoReflect, bcReflect, bcAbsorbExterior, bcMirror /*, bcCylic*/
 
 #endif
 
+/**
+ * With the packed mesh, the normal buffer holds one 64-byte record per element (see tracer_packgpu):
+ * half-precision face normals and centroid-relative plane offsets, the centroid, the type and the
+ * face neighbors; the type and facenb buffers are then only read off the per-step path
+ */
+
+#ifdef MMC_CUDA_KERNEL
+    #define PACKED_MESH            (gcfg->ispackmesh)
+#elif defined(USE_PACKED_MESH)
+    #define PACKED_MESH            1
+#else
+    #define PACKED_MESH            0
+#endif
+
+/**
+ * With --halfface, the facenb buffer holds a 32-bit half-face entry (face << 1 | flip) per element
+ * face, and the normal buffer holds the planes of the unique faces followed by the 2 sides of each
+ * face, see tracer_packhalfface(); the plane of a half-face with flip set is negated
+ */
+
+#ifdef MMC_CUDA_KERNEL
+    #define HALF_FACE_MESH         (gcfg->halffacenum > 0)
+#elif defined(USE_HALF_FACE)
+    #define HALF_FACE_MESH         1
+#else
+    #define HALF_FACE_MESH         0
+#endif
+
+/**
+ * With --patternbits 16 or 8, srcpattern starts with a float scale per pattern, padded to a
+ * multiple of 4, followed by the weights as halfs or unsigned bytes, see mcx_packpattern()
+ */
+
+#ifdef MMC_CUDA_KERNEL
+    #define PATTERN_BITS           (gcfg->patternbits)
+#elif defined(USE_HALF_PATTERN)
+    #define PATTERN_BITS           16
+#elif defined(USE_BYTE_PATTERN)
+    #define PATTERN_BITS           8
+#else
+    #define PATTERN_BITS           32
+#endif
+
+/**
+ * A mesh small enough is traced from a copy of the buffers read at every step, normal and, unless
+ * packed, type and facenb, that each work-group keeps in its local memory, see cachemesh(); with
+ * OpenCL, these buffers are then in the __local address space of the kernel built with USE_LOCAL_MESH
+ */
+
+#ifdef MMC_CUDA_KERNEL
+    #define LOCAL_MESH             (gcfg->islocalmesh)
+#elif defined(USE_LOCAL_MESH)
+    #define LOCAL_MESH             1
+#else
+    #define LOCAL_MESH             0
+#endif
+
+#if defined(USE_LOCAL_MESH) && !defined(MMC_CUDA_KERNEL)
+    #define __mesh                 __local
+#else
+    #define __mesh                 __global
+#endif
+
+#define ELEM_TYPE(e)               (PACKED_MESH ? MMC_RO(((__mesh int*)(normal + ((uint)(e) << 2)))[11]) : MMC_RO(type[e]))
+#define HALF_FACE_PLANE(h)         ((((h) & 1) ? -1.f : 1.f) * MMC_RO(normal[(h) >> 1]))
+#define HALF_FACE_SIDE(h)          MMC_RO(((__mesh int*)(normal + GPU_PARAM(gcfg, halffacenum)))[((h) & ~1) | (((h) & 1) ^ 1)])
+#define ELEM_NEIGHBOR(e,f)         (PACKED_MESH ? MMC_RO(((__mesh int*)(normal + ((uint)(e) << 2)))[12 + (f)]) : (HALF_FACE_MESH ? HALF_FACE_SIDE(MMC_RO(facenb[((uint)(e) << 2) + (f)])) \
+                                    : MMC_RO(((__mesh int*)(facenb + (e) * GPU_PARAM(gcfg, elemlen)))[f])))
+#define ELEM_MEDIUM(e)             (elemmed ? elemmed[e] : gmed[ELEM_TYPE(e)]) /**< medium of element e (from 0), read from the per-element media of --elemprop if given */
+
 __constant__ int faceorder[] = {1, 3, 2, 0, -1};
 __constant__ int ifaceorder[] = {3, 0, 2, 1};
 //__constant int fc[4][3]={{0,4,2},{3,5,4},{2,5,1},{1,3,0}};
@@ -387,7 +518,7 @@ __constant__ int facemap[] = {2, 0, 1, 3};
 __constant__ int ifacemap[] = {1, 2, 0, 3};
 #endif
 
-#ifndef __NVCC__
+#ifndef MMC_CUDA_KERNEL
 enum TDebugLevel {dlMove = 1, dlTracing = 2, dlBary = 4, dlWeight = 8, dlDist = 16, dlTracingEnter = 32,
                   dlTracingExit = 64, dlEdge = 128, dlAccum = 256, dlTime = 512, dlReflect = 1024,
                   dlProgress = 2048, dlExit = 4096, dlTraj = 8192
@@ -410,6 +541,18 @@ typedef ulong  RandType;
 #define RAND_BUF_LEN       2        //register arrays
 #define RAND_SEED_WORD_LEN      4        //48 bit packed with 64bit length
 #define LOG_MT_MAX         22.1807097779182f
+#define PHILOX_M2x32       0xD256D193U
+#define PHILOX_W32         0x9E3779B9U
+#define PHILOX_ROUNDS      10
+
+/*the RNG is fixed for a run: a kernel constant with OpenCL, the constant memory gcfg with CUDA*/
+#ifdef MMC_CUDA_KERNEL
+    #define MCX_RNG_COUNTER    (gcfg->rngtype == 1)
+#elif defined(MCX_RNG_PHILOX)
+    #define MCX_RNG_COUNTER    1
+#else
+    #define MCX_RNG_COUNTER    0
+#endif
 #define IEEE754_DOUBLE_BIAS     0x3FF0000000000000ul /* Added to exponent.  */
 
 
@@ -429,7 +572,7 @@ __device__ static float xorshift128p_nextf (__private RandType t[RAND_BUF_LEN])
 
     return s1.f[0] - 1.0f;
 }
-#if defined(MCX_SAVE_DETECTORS) || defined(__NVCC__)
+#if defined(MCX_SAVE_DETECTORS) || defined(MMC_CUDA_KERNEL)
 __device__ static void copystate(__local float* v1, __private float* v2, int len) {
     for (int i = 0; i < len; i++) {
         v1[i] = v2[i];
@@ -437,8 +580,29 @@ __device__ static void copystate(__local float* v1, __private float* v2, int len
 }
 #endif
 
+/*Philox2x32-10 of mmc_rand_philox.c: t[0] is the key, the high word of the counter t[1] is the photon index*/
+__device__ static float philox2x32_nextf (__private RandType t[RAND_BUF_LEN]) {
+    union {
+        uint  u;
+        float f;
+    } s1;
+    uint key = (uint)t[0], c0 = (uint)t[1], c1 = (uint)(t[1] >> 32), lo;
+
+    for (int i = 0; i < PHILOX_ROUNDS; i++) {
+        lo = PHILOX_M2x32 * c0;
+        c0 = mul_hi((uint)PHILOX_M2x32, c0) ^ key ^ c1;
+        c1 = lo;
+        key += PHILOX_W32;
+    }
+
+    t[1]++;
+    s1.u = 0x3F800000U | (c0 >> 9);
+
+    return s1.f - 1.0f;
+}
+
 __device__ static float rand_uniform01(__private RandType t[RAND_BUF_LEN]) {
-    return xorshift128p_nextf(t);
+    return MCX_RNG_COUNTER ? philox2x32_nextf(t) : xorshift128p_nextf(t);
 }
 
 __device__ static void xorshift128p_seed (__global uint* seed, RandType t[RAND_BUF_LEN]) {
@@ -447,7 +611,12 @@ __device__ static void xorshift128p_seed (__global uint* seed, RandType t[RAND_B
 }
 
 __device__ static void gpu_rng_init(__private RandType t[RAND_BUF_LEN], __global uint* n_seed, int idx) {
-    xorshift128p_seed((n_seed + idx * RAND_SEED_WORD_LEN), t);
+    if (MCX_RNG_COUNTER) {
+        t[0] = n_seed[0];   // all threads and devices share the key, photons are told apart by the counter
+        t[1] = 0;
+    } else {
+        xorshift128p_seed((n_seed + idx * RAND_SEED_WORD_LEN), t);
+    }
 }
 
 __device__ float rand_next_scatlen(__private RandType t[RAND_BUF_LEN]) {
@@ -461,7 +630,7 @@ __device__ float rand_next_scatlen(__private RandType t[RAND_BUF_LEN]) {
 
 #ifdef USE_ATOMIC
 
-#ifndef __NVCC__
+#ifndef MMC_CUDA_KERNEL
 
 #if defined(USE_NVIDIA_GPU) && !defined(USE_OPENCL_ATOMIC)
 // float atomicadd on NVIDIA GPU via PTX
@@ -491,7 +660,121 @@ __device__ inline float atomicadd(volatile __global float* address, const float
 }
 #endif
 
+// same hack for the work-group shared accumulation cache
+
+__device__ inline float atomicadd_local(volatile __local float* address, const float value) {
+    float old = value, orig;
+
+    while ((old = atomic_xchg(address, (orig = atomic_xchg(address, 0.0f)) + old)) != 0.0f);
+
+    return orig;
+}
+
+#else
+
+#define atomicadd_local(a,b)  atomicAdd(a,b)
+
+#endif
+
+/**
+ * @brief Add a weight to the output volume, moving the value to the upper half when it is too large to accumulate
+ */
+
+__device__ inline void atomicdeposit(__global float* weight, uint idx, float value, uint overflow) {
+    float oldval = atomicadd(weight + idx, value);
+
+    if (oldval > MAX_ACCUM) {
+        if (atomicadd(weight + idx, -oldval) < 0.0f) {
+            atomicadd(weight + idx, oldval);
+        } else {
+            atomicadd(weight + idx + overflow, oldval);
+        }
+    }
+}
+
+/**
+ * @brief Merge a weight deposit with those from other threads of the work-group before it reaches global memory
+ *
+ * Photons launched from the same source hit the same few elements near the source,
+ * so their global atomics serialize there. The work-group keeps MAX_ACCUM_CACHE
+ * slots in local memory (output index, then accumulated value); a deposit whose
+ * index maps to a free slot or to a slot holding the same index is added there
+ * with a cheaper local atomic, any other deposit goes to global memory directly.
+ * The slots are written to the output once all threads of the work-group finish.
+ *
+ * \param[in] cache: the work-group accumulation cache, keys followed by values
+ * \param[in,out] weight: the output volume
+ * \param[in] idx: index of the output element
+ * \param[in] value: the weight to add
+ * \param[in] overflow: offset of the upper half of the output used by atomicdeposit()
+ */
+
+__device__ inline void depositweight(__local uint* cache, __global float* weight, uint idx, float value, uint overflow) {
+    uint slot = (idx * 2654435761u) >> (32 - ACCUM_CACHE_BITS);
+    uint key = atomic_cmpxchg(cache + slot, ACCUM_CACHE_EMPTY, idx);
+
+    if (key == ACCUM_CACHE_EMPTY || key == idx) {
+        float oldval = atomicadd_local((__local float*)(cache + MAX_ACCUM_CACHE + slot), value);
+
+        if (oldval > MAX_ACCUM) {
+            if (atomicadd_local((__local float*)(cache + MAX_ACCUM_CACHE + slot), -oldval) < 0.0f) {
+                atomicadd_local((__local float*)(cache + MAX_ACCUM_CACHE + slot), oldval);
+            } else {
+                atomicdeposit(weight, idx, oldval, overflow);
+            }
+        }
+    } else {
+        atomicdeposit(weight, idx, value, overflow);
+    }
+}
+
+#endif
+
+#ifndef DO_NOT_SAVE
+
+/**
+ * @brief Add a deposit to the real and imaginary frames of each modulation frequency
+ *
+ * The frames follow the maxgate time gates; the weight deposited at time t is
+ * multiplied by exp(-i*omega*t) so that the output is the Fourier transform of
+ * the time-resolved output, independent of the time gate width.
+ *
+ * \param[in] gcfg: the simulation settings
+ * \param[in] ppath: the per-thread shared memory, holding the pattern weights after reclen records
+ * \param[in] cache: the work-group accumulation cache
+ * \param[in,out] weight: the output volume
+ * \param[in] idx: index of the output element (tet or voxel) in a frame
+ * \param[in] value: the weight deposited to the time gate
+ * \param[in] t: the time of the deposit
+ */
+
+__device__ void depositfreq(__constant MCXParam* gcfg, __local float* ppath, __local uint* cache, __global float* weight, uint idx, float value, float t) {
+    for (int k = 0; k < GPU_PARAM(gcfg, freqnum); k++) {
+        float part[2];
+        part[0] = value * cos(gcfg->omega[k] * t);
+        part[1] = -value * sin(gcfg->omega[k] * t);
+
+        for (int j = 0; j < 2; j++) {
+            uint frameidx = (GPU_PARAM(gcfg, maxgate) + (k << 1) + j) * GPU_PARAM(gcfg, framelen) + idx;
+
+            if (GPU_PARAM(gcfg, srctype) != stPattern || GPU_PARAM(gcfg, srcnum) == 1) {
+#ifdef USE_ATOMIC
+                depositweight(cache, weight, frameidx, part[j], gcfg->crop0.w);
+#else
+                weight[frameidx] += part[j];
+#endif
+            } else {
+                for (int pidx = 0; pidx < GPU_PARAM(gcfg, srcnum); pidx++) {
+#ifdef USE_ATOMIC
+                    depositweight(cache, weight, frameidx * GPU_PARAM(gcfg, srcnum) + pidx, part[j] * ppath[GPU_PARAM(gcfg, reclen) + pidx], gcfg->crop0.w);
+#else
+                    weight[frameidx * GPU_PARAM(gcfg, srcnum) + pidx] += part[j] * ppath[GPU_PARAM(gcfg, reclen) + pidx];
 #endif
+                }
+            }
+        }
+    }
+}
 
 #endif
 
@@ -503,11 +786,24 @@ __device__ void clearpath(__local float* p, int len) {
     }
 }
 
-#if defined(MCX_SAVE_DETECTORS) || defined(__NVCC__)
-__device__ uint finddetector(float3* p0, __constant float4* gmed, __constant MCXParam* gcfg) {
-    uint i;
+#if defined(MCX_SAVE_DETECTORS) || defined(MMC_CUDA_KERNEL)
+__device__ uint finddetector(float3* p0, __constant float4* gmed, __constant MCXParam* gcfg, __global const int* detgrid) {
+    uint i, k = 0, kend = GPU_PARAM(gcfg, detnum), d0 = GPU_PARAM(gcfg, maxmedia) + 1 + GPU_PARAM(gcfg, isextdet);
+
+    /*only test the detectors binned in the grid cell enclosing the exit position, see mesh_builddetgrid()*/
+    if (detgrid) {
+        int ix = (int)fmax(0.f, fmin(floor((p0[0].x - gcfg->detgridorig.x) * gcfg->detgridorig.w), (float)(gcfg->detgriddim.x - 1)));
+        int iy = (int)fmax(0.f, fmin(floor((p0[0].y - gcfg->detgridorig.y) * gcfg->detgridorig.w), (float)(gcfg->detgriddim.y - 1)));
+        int iz = (int)fmax(0.f, fmin(floor((p0[0].z - gcfg->detgridorig.z) * gcfg->detgridorig.w), (float)(gcfg->detgriddim.z - 1)));
+
+        k = (iz * gcfg->detgriddim.y + iy) * gcfg->detgriddim.x + ix;
+        kend = detgrid[k + 1];
+        k = detgrid[k];
+    }
+
+    for (; k < kend; k++) {
+        i = d0 + (detgrid ? (uint)detgrid[k] : k);
 
-    for (i = GPU_PARAM(gcfg, maxmedia) + 1 + GPU_PARAM(gcfg, isextdet); i < GPU_PARAM(gcfg, maxmedia) + 1 + GPU_PARAM(gcfg, isextdet) + GPU_PARAM(gcfg, detnum); i++) {
         if ((gmed[i].x - p0[0].x) * (gmed[i].x - p0[0].x) +
                 (gmed[i].y - p0[0].y) * (gmed[i].y - p0[0].y) +
                 (gmed[i].z - p0[0].z) * (gmed[i].z - p0[0].z) < gmed[i].w * gmed[i].w) {
@@ -616,10 +912,10 @@ __device__ void map_photon_to_camera_sensor(__constant MCXParam* gcfg, __global
 }
 
 
-__device__ void savedetphoton(__global float* n_det, __global float* camsignals, __global uint* detectedphoton,
+__device__ void savedetphoton(__global float* n_det, __global float* camsignals, __global float* detimage, __global uint* detectedphoton,
                               __local float* ppath, ray* r, __constant Medium* gmed,
-                              int extdetid, __constant MCXParam* gcfg, __global RandType* photonseed, RandType* initseed) {
-    uint detid = (extdetid < 0) ? finddetector(&(r->p0), (__constant float4*)gmed, gcfg) : extdetid;
+                              int extdetid, __constant MCXParam* gcfg, __global RandType* photonseed, RandType* initseed, __global const int* detgrid) {
+    uint detid = (extdetid < 0) ? finddetector(&(r->p0), (__constant float4*)gmed, gcfg, detgrid) : extdetid;
 
     if (detid && r->vec.z < 0) {
         //if (r->vec.z > 0.99)
@@ -629,12 +925,51 @@ __device__ void savedetphoton(__global float* n_det, __global float* camsignals,
         camsignals[gcfg->cam_image_width * gcfg->cam_image_height + 1]++;
         map_photon_to_camera_sensor(gcfg, camsignals, *r);
 
+        /*bin the exit weight into the time-resolved area-detector image instead of saving the photon, same as mesh_getdetimage()*/
+        if (GPU_PARAM(gcfg, issaveexit) == 2) {
+            int xsize = (int)gcfg->detparam1.w, ysize = (int)gcfg->detparam2.w;
+            int xindex = (r->p0.x - gcfg->detorigin.x) / (gcfg->detparam1.x + gcfg->detparam2.x) * xsize;
+            int yindex = (r->p0.y - gcfg->detorigin.y) / (gcfg->detparam1.y + gcfg->detparam2.y) * ysize;
+#ifdef MCX_CW
+            int ntg = 0;
+#else
+            int ntg = MIN(((int)((r->photontimer - gcfg->tstart) * GPU_PARAM(gcfg, Rtstep))), GPU_PARAM(gcfg, maxgate) - 1);
+#endif
+
+            if (xindex >= 0 && xindex < xsize && yindex >= 0 && yindex < ysize) {
+                atomicadd(detimage + (ntg * ysize + yindex) * xsize + xindex, r->weight);
+            }
+
+            return;
+        }
+
+        /*add the photon to the sums of its detector instead of saving it, same layout as accumdetstat() on the CPU*/
+        if (GPU_PARAM(gcfg, isdetstat)) {
+            uint i, maxgate = GPU_PARAM(gcfg, maxgate), maxmedia = GPU_PARAM(gcfg, maxmedia);
+            __global float* stat = detimage + (detid - 1) * (maxgate + (maxmedia << 1) + 1);
+#ifdef MCX_CW
+            int ntg = 0;
+#else
+            int ntg = MIN(((int)((r->photontimer - gcfg->tstart) * GPU_PARAM(gcfg, Rtstep))), (int)maxgate - 1);
+#endif
+
+            atomicadd(stat + ((ntg > 0) ? ntg : 0), r->weight);
+
+            for (i = 0; i < maxmedia; i++) {
+                atomicadd(stat + maxgate + i, r->weight * ppath[maxmedia + i]);
+                atomicadd(stat + maxgate + maxmedia + i, r->weight * ppath[i]);
+            }
+
+            atomicadd(stat + maxgate + (maxmedia << 1), r->weight);
+            return;
+        }
+
         uint baseaddr = atomic_inc(detectedphoton);
 
         if (baseaddr < GPU_PARAM(gcfg, maxdetphoton)) {
             uint i;
-#if defined(MCX_SAVE_SEED) || defined(__NVCC__)
-#ifdef __NVCC__
+#if defined(MCX_SAVE_SEED) || defined(MMC_CUDA_KERNEL)
+#ifdef MMC_CUDA_KERNEL
 
             if (GPU_PARAM(gcfg, issaveseed)) {
 #endif
@@ -643,7 +978,7 @@ __device__ void savedetphoton(__global float* n_det, __global float* camsignals,
                     photonseed[baseaddr * RAND_BUF_LEN + i] = initseed[i];
                 }
 
-#ifdef __NVCC__
+#ifdef MMC_CUDA_KERNEL
             }
 
 #endif
@@ -667,13 +1002,22 @@ __device__ void savedetphoton(__global float* n_det, __global float* camsignals,
 
 /**
  * @brief Saving photon trajectory data for debugging purposes
+ *
+ * Only the photons with an index divisible by gcfg->trajsample are recorded.
+ *
  * @param[in] p: the position/weight of the current photon packet
  * @param[in] id: the global index of the photon
  * @param[in] gdebugdata: pointer to the global-memory buffer to store the trajectory info
  */
 
 __device__ void savedebugdata(ray* r, uint id, __global MCXReporter* reporter, __global float* gdebugdata, __constant MCXParam* gcfg) {
-    uint pos = atomic_inc(&reporter->jumpdebug);
+    uint pos;
+
+    if (GPU_PARAM(gcfg, trajsample) > 1 && id % GPU_PARAM(gcfg, trajsample)) {
+        return;
+    }
+
+    pos = atomic_inc(&reporter->jumpdebug);
 
     if (pos < GPU_PARAM(gcfg, maxjumpdebug)) {
         pos *= MCX_DEBUG_REC_LEN;
@@ -701,8 +1045,9 @@ __device__ void savedebugdata(ray* r, uint id, __global MCXReporter* reporter, _
  * \param[out] visit: statistics counters of this thread
  */
 
-__device__ float branchless_badouel_raytet(ray* r, __constant MCXParam* gcfg, __local float* ppath, __global int* elem, __global float* weight,
-        int type, __global int* facenb, __global float4* normal, __constant Medium* gmed, __global float* replayweight, __global float* replaytime) {
+__device__ float branchless_badouel_raytet(ray* r, __constant MCXParam* gcfg, __local float* ppath, __local uint* accumcache, __global int* elem, __global float* weight,
+        int type, __mesh int* facenb, __mesh float4* normal, __constant Medium* gmed, __global float* replayweight, __global float* replaytime, __global int* replaydetid,
+        __global const Medium* elemmed) {
 
     float Lmin;
     float ww, totalloss = 0.f;
@@ -728,17 +1073,40 @@ __device__ float branchless_badouel_raytet(ray* r, __constant MCXParam* gcfg, __
         eid += GPU_PARAM(gcfg, maxpropdet);
         S = ((r->vec.x) * ((__constant float4*)gmed)[eid]) + ((r->vec.y) * ((__constant float4*)gmed)[eid + 1]) + ((r->vec.z) * ((__constant float4*)gmed)[eid + 2]);
         T = ((__constant float4*)gmed)[eid + 3] - (((r->p0.x) * ((__constant float4*)gmed)[eid]) + ((r->p0.y) * ((__constant float4*)gmed)[eid + 1]) + ((r->p0.z) * ((__constant float4*)gmed)[eid + 2]));
+    } else if (PACKED_MESH) {
+#if defined(MMC_CUDA_KERNEL) && defined(USE_LDG)
+        float4 pk[2] = {MMC_RO(normal[eid]), MMC_RO(normal[eid + 1])};
+        const half* pn = (const half*)pk;
+#else
+        __mesh half* pn = (__mesh half*)(normal + eid);
+#endif
+        float4 nx = vload_half4(0, pn), ny = vload_half4(1, pn), nz = vload_half4(2, pn), c0 = MMC_RO(normal[eid + 2]);
+        float dx = r->p0.x - c0.x, dy = r->p0.y - c0.y, dz = r->p0.z - c0.z;
+
+        S = ((r->vec.x) * nx) + ((r->vec.y) * ny) + ((r->vec.z) * nz);
+        T = vload_half4(3, pn) - ((dx * nx) + (dy * ny) + (dz * nz));
+    } else if (HALF_FACE_MESH) {
+        /*gather the planes of the facenb slots 1, 3, 2 and 0, i.e. in the order of faceorder*/
+        float4 p1 = HALF_FACE_PLANE(MMC_RO(facenb[eid + 1])), p3 = HALF_FACE_PLANE(MMC_RO(facenb[eid + 3]));
+        float4 p2 = HALF_FACE_PLANE(MMC_RO(facenb[eid + 2])), p0 = HALF_FACE_PLANE(MMC_RO(facenb[eid]));
+        float4 nx = FL4_4(p1.x, p3.x, p2.x, p0.x), ny = FL4_4(p1.y, p3.y, p2.y, p0.y), nz = FL4_4(p1.z, p3.z, p2.z, p0.z);
+
+        S = ((r->vec.x) * nx) + ((r->vec.y) * ny) + ((r->vec.z) * nz);
+        T = FL4_4(p1.w, p3.w, p2.w, p0.w) - (((r->p0.x) * nx) + ((r->p0.y) * ny) + ((r->p0.z) * nz));
     } else {
-        S = ((r->vec.x) * normal[eid]) + ((r->vec.y) * normal[eid + 1]) + ((r->vec.z) * normal[eid + 2]);
-        T = normal[eid + 3] - (((r->p0.x) * normal[eid]) + ((r->p0.y) * normal[eid + 1]) + ((r->p0.z) * normal[eid + 2]));
+        /*the 4 planes of an element are 4 consecutive float4 (x, y, z components and offsets), one 64-byte line*/
+        float4 nx = MMC_RO(normal[eid]), ny = MMC_RO(normal[eid + 1]), nz = MMC_RO(normal[eid + 2]);
+
+        S = ((r->vec.x) * nx) + ((r->vec.y) * ny) + ((r->vec.z) * nz);
+        T = MMC_RO(normal[eid + 3]) - (((r->p0.x) * nx) + ((r->p0.y) * ny) + ((r->p0.z) * nz));
     }
 
-#ifndef __NVCC__
+#ifndef MMC_CUDA_KERNEL
     T = -convert_float4_rte(isgreater(T, FL4(0.f)) * 2) * FL4(0.5f) * T;
 #endif
     T = T / S;
 
-#ifndef __NVCC__
+#ifndef MMC_CUDA_KERNEL
     S = -convert_float4_rte(isgreater(S, FL4(0.f)) * 2) * FL4(0.5f);
     T =  (S * T) + ((FL4(1.f) - S) * FL4(1e10f));
 #else
@@ -753,7 +1121,7 @@ __device__ float branchless_badouel_raytet(ray* r, __constant MCXParam* gcfg, __
     if (r->faceid >= 0 && Lmin >= 0.f) {
         Medium prop;
 
-        prop = gmed[type];
+        prop = elemmed ? elemmed[r->eid - 1] : gmed[type];
         currweight.f = r->weight;
 
         r->Lmove = (prop.mus <= EPS) ? R_MIN_MUS : r->slen / prop.mus;
@@ -761,7 +1129,13 @@ __device__ float branchless_badouel_raytet(ray* r, __constant MCXParam* gcfg, __
         r->Lmove = ((r->isend) ? r->Lmove : Lmin);
         r->pout = r->p0 + FL3(Lmin) * r->vec;
 
+#ifdef MCX_CW
+
+        if ((r->photontimer + r->Lmove * (prop.n * R_C0) - gcfg->tstart)*GPU_PARAM(gcfg, Rtstep) >= 1.f) { /*exit the only time gate*/
+#else
+
         if ((int)((r->photontimer + r->Lmove * (prop.n * R_C0) - gcfg->tstart)*GPU_PARAM(gcfg, Rtstep)) > GPU_PARAM(gcfg, maxgate) - 1) { /*exit time window*/
+#endif
             r->faceid = -2;
             r->pout.x = MMC_UNDEFINED;
             r->Lmove = (gcfg->tend - r->photontimer) / (prop.n * R_C0) - 1e-4f;
@@ -772,7 +1146,7 @@ __device__ float branchless_badouel_raytet(ray* r, __constant MCXParam* gcfg, __
 
         totalloss = 1.f - totalloss; /*remaining fraction*/
 
-        if (GPU_PARAM(gcfg, seed) == SEED_FROM_FILE) {
+        if (gcfg->seed == SEED_FROM_FILE) {
             if (GPU_PARAM(gcfg, outputtype) == otWL || GPU_PARAM(gcfg, outputtype) == otJacobian) {
                 currweight.f = r->Lmove;
                 currweight.f *= replayweight[r->photonid];
@@ -794,9 +1168,19 @@ __device__ float branchless_badouel_raytet(ray* r, __constant MCXParam* gcfg, __
         r->photontimer += r->Lmove * (prop.n * R_C0);
 
         if (GPU_PARAM(gcfg, outputtype) == otWL || GPU_PARAM(gcfg, outputtype) == otWP) {
-            tshift = MIN( ((int)(replaytime[r->photonid] * GPU_PARAM(gcfg, Rtstep))), GPU_PARAM(gcfg, maxgate) - 1 ) * GPU_PARAM(gcfg, framelen);
+            tshift = MIN( ((int)(replaytime[r->photonid] * GPU_PARAM(gcfg, Rtstep))), GPU_PARAM(gcfg, maxgate) - 1 );
+
+            if (replaydetid) { /*replaying all detectors in one pass, each detector owns maxgate frames*/
+                tshift += (replaydetid[r->photonid] - 1) * GPU_PARAM(gcfg, maxgate);
+            }
+
+            tshift *= GPU_PARAM(gcfg, framelen);
         } else {
+#ifdef MCX_CW
+            tshift = 0; /*continuous-wave, all weight goes to the only frame*/
+#else
             tshift = MIN( ((int)((r->photontimer - gcfg->tstart) * GPU_PARAM(gcfg, Rtstep))), GPU_PARAM(gcfg, maxgate) - 1 ) * GPU_PARAM(gcfg, framelen);
+#endif
         }
 
         {
@@ -809,7 +1193,7 @@ __device__ float branchless_badouel_raytet(ray* r, __constant MCXParam* gcfg, __
             }
 
 #ifdef USE_BLBADOUEL
-#ifdef __NVCC__
+#ifdef MMC_CUDA_KERNEL
 
             if (GPU_PARAM(gcfg, method) == rtBLBadouel) {
 #endif
@@ -822,16 +1206,7 @@ __device__ float branchless_badouel_raytet(ray* r, __constant MCXParam* gcfg, __
                     if (r->oldweight > 0.f) {
                         if (GPU_PARAM(gcfg, srctype) != stPattern || GPU_PARAM(gcfg, srcnum) == 1) {
 #ifdef USE_ATOMIC
-                            float oldval = atomicadd(weight + r->oldidx, r->oldweight);
-
-                            if (oldval > MAX_ACCUM) {
-                                if (atomicadd(weight + r->oldidx, -oldval) < 0.0f) {
-                                    atomicadd(weight + r->oldidx, oldval);
-                                } else {
-                                    atomicadd(weight + r->oldidx + gcfg->crop0.w, oldval);
-                                }
-                            }
-
+                            depositweight(accumcache, weight, r->oldidx, r->oldweight, gcfg->crop0.w);
 #else
                             weight[r->oldidx] += r->oldweight;
 #endif
@@ -839,16 +1214,7 @@ __device__ float branchless_badouel_raytet(ray* r, __constant MCXParam* gcfg, __
 
                             for (int pidx = 0; pidx < GPU_PARAM(gcfg, srcnum); pidx++) {
 #ifdef USE_ATOMIC
-                                float oldval = atomicadd(weight + r->oldidx * GPU_PARAM(gcfg, srcnum) + pidx, r->oldweight * ppath[GPU_PARAM(gcfg, reclen) + pidx]);
-
-                                if (oldval > MAX_ACCUM) {
-                                    if (atomicadd(weight + r->oldidx * GPU_PARAM(gcfg, srcnum) + pidx, -oldval) < 0.0f) {
-                                        atomicadd(weight + r->oldidx * GPU_PARAM(gcfg, srcnum) + pidx, oldval);
-                                    } else {
-                                        atomicadd(weight + r->oldidx * GPU_PARAM(gcfg, srcnum) + pidx + gcfg->crop0.w, oldval);
-                                    }
-                                }
-
+                                depositweight(accumcache, weight, r->oldidx * GPU_PARAM(gcfg, srcnum) + pidx, r->oldweight * ppath[GPU_PARAM(gcfg, reclen) + pidx], gcfg->crop0.w);
 #else
                                 weight[r->oldidx * GPU_PARAM(gcfg, srcnum) + pidx] += r->oldweight * ppath[GPU_PARAM(gcfg, reclen) + pidx];
 #endif
@@ -871,16 +1237,7 @@ __device__ float branchless_badouel_raytet(ray* r, __constant MCXParam* gcfg, __
                     if (GPU_PARAM(gcfg, srctype) != stPattern || GPU_PARAM(gcfg, srcnum) == 1) {
 
 #ifdef USE_ATOMIC
-                        float oldval = atomicadd(weight + newidx, r->oldweight);
-
-                        if (oldval > MAX_ACCUM) {
-                            if (atomicadd(weight + newidx, -oldval) < 0.0f) {
-                                atomicadd(weight + newidx, oldval);
-                            } else {
-                                atomicadd(weight + newidx + gcfg->crop0.w, oldval);
-                            }
-                        }
-
+                        depositweight(accumcache, weight, newidx, r->oldweight, gcfg->crop0.w);
 #else
                         weight[newidx] += r->oldweight;
 #endif
@@ -888,16 +1245,7 @@ __device__ float branchless_badouel_raytet(ray* r, __constant MCXParam* gcfg, __
 
                         for (int pidx = 0; pidx < GPU_PARAM(gcfg, srcnum); pidx++) {
 #ifdef USE_ATOMIC
-                            float oldval = atomicadd(weight + newidx * GPU_PARAM(gcfg, srcnum) + pidx, r->oldweight * ppath[GPU_PARAM(gcfg, reclen) + pidx]);
-
-                            if (oldval > MAX_ACCUM) {
-                                if (atomicadd(weight + newidx * GPU_PARAM(gcfg, srcnum) + pidx, -oldval) < 0.0f) {
-                                    atomicadd(weight + newidx * GPU_PARAM(gcfg, srcnum) + pidx, oldval);
-                                } else {
-                                    atomicadd(weight + newidx * GPU_PARAM(gcfg, srcnum) + pidx + gcfg->crop0.w, oldval);
-                                }
-                            }
-
+                            depositweight(accumcache, weight, newidx * GPU_PARAM(gcfg, srcnum) + pidx, r->oldweight * ppath[GPU_PARAM(gcfg, reclen) + pidx], gcfg->crop0.w);
 #else
                             weight[newidx * GPU_PARAM(gcfg, srcnum) + pidx] += r->oldweight * ppath[GPU_PARAM(gcfg, reclen) + pidx];
 #endif
@@ -908,15 +1256,20 @@ __device__ float branchless_badouel_raytet(ray* r, __constant MCXParam* gcfg, __
                     r->oldweight = 0.f;
                 }
 
+                /*the frequency-domain deposits depend on the time of each move, so they are not merged*/
+                if (GPU_PARAM(gcfg, freqnum) > 0) {
+                    depositfreq(gcfg, ppath, accumcache, weight, eid, ww, r->photontimer - 0.5f * r->Lmove * (prop.n * R_C0));
+                }
+
 #endif // for ifdef DO_NOT_SAVE
-#ifdef __NVCC__
+#ifdef MMC_CUDA_KERNEL
             }
 
 #endif // for if (GPU_PARAM(gcfg, method) == rtBLBadouel
 #endif // for ifdef USE_BLBADOUEL
 
 #ifdef USE_DMMC
-#ifdef __NVCC__
+#ifdef MMC_CUDA_KERNEL
 
             if (GPU_PARAM(gcfg, method) == rtBLBadouelGrid) {
 #endif
@@ -924,7 +1277,7 @@ __device__ float branchless_badouel_raytet(ray* r, __constant MCXParam* gcfg, __
                 eid = (eid << 1);
                 S.w = r->Lmove / eid;                 // segment length
                 T.w = MCX_MATHFUN(exp)(-prop.mua * S.w); // segment loss
-#ifndef __NVCC__
+#ifndef MMC_CUDA_KERNEL
                 T.xyz =  r->vec * FL3(S.w);      // delta vector
                 S.xyz =  (r->p0 - gcfg->nmin) + (T.xyz * FL3(0.5f)); /*starting point*/
 #else
@@ -935,7 +1288,7 @@ __device__ float branchless_badouel_raytet(ray* r, __constant MCXParam* gcfg, __
                 S.w = ww;                             // S.w is now the current weight
 
                 for (faceidx = 0; faceidx < eid; faceidx++) {
-#ifndef __NVCC__
+#ifndef MMC_CUDA_KERNEL
                     int3 idx = convert_int3_rtn(S.xyz * FL3((float)GPU_PARAM(gcfg, dstep)));
                     idx = idx & (idx >= (int3)(0));
 #else
@@ -952,16 +1305,7 @@ __device__ float branchless_badouel_raytet(ray* r, __constant MCXParam* gcfg, __
                         if (GPU_PARAM(gcfg, srctype) != stPattern || GPU_PARAM(gcfg, srcnum) == 1) {
 
 #ifdef USE_ATOMIC
-                            float oldval = atomicadd(weight + r->oldidx, r->oldweight);
-
-                            if (oldval > MAX_ACCUM) {
-                                if (atomicadd(weight + r->oldidx, -oldval) < 0.0f) {
-                                    atomicadd(weight + r->oldidx, oldval);
-                                } else {
-                                    atomicadd(weight + r->oldidx + gcfg->crop0.w, oldval);
-                                }
-                            }
-
+                            depositweight(accumcache, weight, r->oldidx, r->oldweight, gcfg->crop0.w);
 #else
                             weight[r->oldidx] += r->oldweight;
 #endif
@@ -969,16 +1313,7 @@ __device__ float branchless_badouel_raytet(ray* r, __constant MCXParam* gcfg, __
 
                             for (int pidx = 0; pidx < GPU_PARAM(gcfg, srcnum); pidx++) {
 #ifdef USE_ATOMIC
-                                float oldval = atomicadd(weight + r->oldidx * GPU_PARAM(gcfg, srcnum) + pidx, r->oldweight * ppath[GPU_PARAM(gcfg, reclen) + pidx]);
-
-                                if (oldval > MAX_ACCUM) {
-                                    if (atomicadd(weight + r->oldidx * GPU_PARAM(gcfg, srcnum) + pidx, -oldval) < 0.0f) {
-                                        atomicadd(weight + r->oldidx * GPU_PARAM(gcfg, srcnum) + pidx, oldval);
-                                    } else {
-                                        atomicadd(weight + r->oldidx * GPU_PARAM(gcfg, srcnum) + pidx + gcfg->crop0.w, oldval);
-                                    }
-                                }
-
+                                depositweight(accumcache, weight, r->oldidx * GPU_PARAM(gcfg, srcnum) + pidx, r->oldweight * ppath[GPU_PARAM(gcfg, reclen) + pidx], gcfg->crop0.w);
 #else
                                 weight[r->oldidx * GPU_PARAM(gcfg, srcnum) + pidx] += r->oldweight * ppath[GPU_PARAM(gcfg, reclen) + pidx];
 #endif
@@ -1000,16 +1335,7 @@ __device__ float branchless_badouel_raytet(ray* r, __constant MCXParam* gcfg, __
                         if (GPU_PARAM(gcfg, srctype) != stPattern || GPU_PARAM(gcfg, srcnum) == 1) {
 
 #ifdef USE_ATOMIC
-                            float oldval = atomicadd(weight + newidx, r->oldweight);
-
-                            if (oldval > MAX_ACCUM) {
-                                if (atomicadd(weight + newidx, -oldval) < 0.0f) {
-                                    atomicadd(weight + newidx, oldval);
-                                } else {
-                                    atomicadd(weight + newidx + gcfg->crop0.w, oldval);
-                                }
-                            }
-
+                            depositweight(accumcache, weight, newidx, r->oldweight, gcfg->crop0.w);
 #else
                             weight[newidx] += r->oldweight;
 #endif
@@ -1017,16 +1343,7 @@ __device__ float branchless_badouel_raytet(ray* r, __constant MCXParam* gcfg, __
 
                             for (int pidx = 0; pidx < GPU_PARAM(gcfg, srcnum); pidx++) {
 #ifdef USE_ATOMIC
-                                float oldval = atomicadd(weight + newidx * GPU_PARAM(gcfg, srcnum) + pidx, r->oldweight * ppath[GPU_PARAM(gcfg, reclen) + pidx]);
-
-                                if (oldval > MAX_ACCUM) {
-                                    if (atomicadd(weight + newidx * GPU_PARAM(gcfg, srcnum) + pidx, -oldval) < 0.0f) {
-                                        atomicadd(weight + newidx * GPU_PARAM(gcfg, srcnum) + pidx, oldval);
-                                    } else {
-                                        atomicadd(weight + newidx * GPU_PARAM(gcfg, srcnum) + pidx + gcfg->crop0.w, oldval);
-                                    }
-                                }
-
+                                depositweight(accumcache, weight, newidx * GPU_PARAM(gcfg, srcnum) + pidx, r->oldweight * ppath[GPU_PARAM(gcfg, reclen) + pidx], gcfg->crop0.w);
 #else
                                 weight[newidx * GPU_PARAM(gcfg, srcnum) + pidx] += r->oldweight * ppath[GPU_PARAM(gcfg, reclen) + pidx];
 #endif
@@ -1037,9 +1354,13 @@ __device__ float branchless_badouel_raytet(ray* r, __constant MCXParam* gcfg, __
                         r->oldweight = 0.f;
                     }
 
+                    if (GPU_PARAM(gcfg, freqnum) > 0) { /*at the center of the segment*/
+                        depositfreq(gcfg, ppath, accumcache, weight, newidx - tshift, S.w * totalloss, r->photontimer - (r->Lmove - (faceidx + 0.5f) * r->Lmove / eid) * (prop.n * R_C0));
+                    }
+
 #endif // for ifdef DO_NOT_SAVE
 
-#ifndef __NVCC__
+#ifndef MMC_CUDA_KERNEL
                     S.w *= T.w;
                     S.xyz += T.xyz;
 #else
@@ -1047,7 +1368,7 @@ __device__ float branchless_badouel_raytet(ray* r, __constant MCXParam* gcfg, __
 #endif
                 }
 
-#ifdef __NVCC__
+#ifdef MMC_CUDA_KERNEL
             }
 
 #endif
@@ -1080,25 +1401,39 @@ __device__ float branchless_badouel_raytet(ray* r, __constant MCXParam* gcfg, __
 
 #ifdef MCX_DO_REFLECTION
 
-__device__ float reflectray(__constant MCXParam* gcfg, float3* c0, int* oldeid, int* eid, int faceid, __private RandType* ran, __global int* type, __global float4* normal, __constant Medium* gmed) {
+__device__ float reflectray(__constant MCXParam* gcfg, float3* c0, int* oldeid, int* eid, int faceid, __private RandType* ran, __mesh int* type, __mesh int* facenb, __mesh float4* normal, __constant Medium* gmed,
+                            __global const Medium* elemmed) {
     /*to handle refractive index mismatch*/
     float3 pnorm = {0.f, 0.f, 0.f};
     float Icos, Re, Im, Rtotal, tmp0, tmp1, tmp2, n1, n2;
     int offs = (*oldeid - 1) << 2;
 
-    faceid = ifaceorder[faceid];
     /*calculate the normal direction of the intersecting triangle*/
-    pnorm.x = ((__global float*) & (normal[offs]))[faceid];
-    pnorm.y = ((__global float*) & (normal[offs]))[faceid + 4];
-    pnorm.z = ((__global float*) & (normal[offs]))[faceid + 8];
+    if (HALF_FACE_MESH) {
+        float4 plane = HALF_FACE_PLANE(MMC_RO(facenb[offs + faceid]));
+
+        pnorm.x = plane.x;
+        pnorm.y = plane.y;
+        pnorm.z = plane.z;
+    } else if (PACKED_MESH) {
+        faceid = ifaceorder[faceid];
+        pnorm.x = vload_half(faceid, (__mesh half*)(normal + offs));
+        pnorm.y = vload_half(faceid + 4, (__mesh half*)(normal + offs));
+        pnorm.z = vload_half(faceid + 8, (__mesh half*)(normal + offs));
+    } else {
+        faceid = ifaceorder[faceid];
+        pnorm.x = MMC_RO(((__mesh float*) & (normal[offs]))[faceid]);
+        pnorm.y = MMC_RO(((__mesh float*) & (normal[offs]))[faceid + 4]);
+        pnorm.z = MMC_RO(((__mesh float*) & (normal[offs]))[faceid + 8]);
+    }
 
     /*pn pointing outward*/
 
     /*compute the cos of the incidence angle*/
     Icos = fabs(dot(*c0, pnorm));
 
-    n1 = ((*oldeid != *eid) ? gmed[type[*oldeid - 1]].n : GPU_PARAM(gcfg, nout));
-    n2 = ((*eid > 0) ? gmed[type[*eid - 1]].n : GPU_PARAM(gcfg, nout));
+    n1 = ((*oldeid != *eid) ? ELEM_MEDIUM(*oldeid - 1).n : GPU_PARAM(gcfg, nout));
+    n2 = ((*eid > 0) ? ELEM_MEDIUM(*eid - 1).n : GPU_PARAM(gcfg, nout));
 
     tmp0 = n1 * n1;
     tmp1 = n2 * n2;
@@ -1146,13 +1481,14 @@ __device__ float reflectray(__constant MCXParam* gcfg, float3* c0, int* oldeid,
  * This function updates the direction of the photon by performing a scattering calculation
  *
  * @param[in] g: anisotropy g
+ * @param[in] invcdf: the nphase entry inverse CDF of cos(theta) of the medium, NULL to sample Henyey-Greenstein
  * @param[out] dir: current ray direction vector
  * @param[out] ran: random number generator states
  * @param[out] cfg: the simulation configuration
  * @param[out] pmom: buffer to store momentum transfer data if needed
  */
 
-__device__ float mc_next_scatter(float g, float3* dir, __private RandType* ran, __constant MCXParam* gcfg, float* pmom) {
+__device__ float mc_next_scatter(float g, __global const float* invcdf, float3* dir, __private RandType* ran, __constant MCXParam* gcfg, float* pmom) {
 
     float nextslen;
     float sphi, cphi, tmp0, theta, stheta, ctheta, tmp1;
@@ -1164,7 +1500,13 @@ __device__ float mc_next_scatter(float g, float3* dir, __private RandType* ran,
     tmp0 = TWO_PI * rand_next_aangle(ran); //next arimuth angle
     MCX_SINCOS(tmp0, sphi, cphi);
 
-    if (g > EPS) { //if g is too small, the distribution of theta is bad
+    if (invcdf) { //tabulated phase function, see mesh_buildinvcdf
+        tmp0 = rand_next_zangle(ran) * (GPU_PARAM(gcfg, nphase) - 1);
+        int idx = MIN((int)tmp0, GPU_PARAM(gcfg, nphase) - 2);
+        tmp0 -= idx;
+        ctheta = clamp(invcdf[idx] + tmp0 * (invcdf[idx + 1] - invcdf[idx]), -1.f, 1.f);
+        stheta = MCX_MATHFUN(sqrt)(1.f - ctheta * ctheta);
+    } else if (g > EPS) { //if g is too small, the distribution of theta is bad
         tmp0 = (1.f - g * g) / (1.f - g + 2.f * g * rand_next_zangle(ran));
         tmp0 *= tmp0;
         tmp0 = (1.f + g * g - tmp0) / (2.f * g);
@@ -1232,6 +1574,28 @@ __device__ void fixphoton(float3* p, __global FLOAT3* node, __global int* ee) {
 
 
 
+/**
+ * @brief Read the weight of a pattern at a launch position of the pattern source
+ *
+ * \param[in] gcfg: simulation configuration
+ * \param[in] srcpattern: the pattern weights, packed as set by PATTERN_BITS
+ * \param[in] posidx: the launch position
+ * \param[in] pidx: the pattern
+ */
+
+__device__ float patternweight(__constant MCXParam* gcfg, __global float* srcpattern, uint posidx, int pidx) {
+    uint idx = posidx * GPU_PARAM(gcfg, srcnum) + pidx;
+    __global float* packed = srcpattern + ((GPU_PARAM(gcfg, srcnum) + 3) & ~3);
+
+    if (PATTERN_BITS == 16) {
+        return srcpattern[pidx] * vload_half(idx, (__global half*)packed);
+    } else if (PATTERN_BITS == 8) {
+        return srcpattern[pidx] * ((__global unsigned char*)packed)[idx];
+    }
+
+    return srcpattern[idx];
+}
+
 /**
  * @brief Launch a new photon
  *
@@ -1248,8 +1612,8 @@ __device__ void launchnewphoton(__constant MCXParam* gcfg, ray* r, __global FLOA
     float3 origin = r->p0;
 
     r->slen = rand_next_scatlen(ran);
-#if defined(__NVCC__) || defined(MCX_SRC_PENCIL)
-#ifdef __NVCC__
+#if defined(MMC_CUDA_KERNEL) || defined(MCX_SRC_PENCIL)
+#ifdef MMC_CUDA_KERNEL
 
     if (GPU_PARAM(gcfg, srctype) == MCX_SRC_PENCIL) {
 #endif
@@ -1259,8 +1623,8 @@ __device__ void launchnewphoton(__constant MCXParam* gcfg, ray* r, __global FLOA
         }
 
 #endif
-#if defined(__NVCC__) || defined(MCX_SRC_PLANAR) || defined(MCX_SRC_PATTERN) || defined(MCX_SRC_PATTERN3D) || defined(MCX_SRC_FOURIER) /*a rectangular grid over a plane*/
-#ifdef __NVCC__
+#if defined(MMC_CUDA_KERNEL) || defined(MCX_SRC_PLANAR) || defined(MCX_SRC_PATTERN) || defined(MCX_SRC_PATTERN3D) || defined(MCX_SRC_FOURIER) /*a rectangular grid over a plane*/
+#ifdef MMC_CUDA_KERNEL
     } else if (GPU_PARAM(gcfg, srctype) == MCX_SRC_PLANAR || GPU_PARAM(gcfg, srctype) == MCX_SRC_PATTERN || GPU_PARAM(gcfg, srctype) == MCX_SRC_PATTERN3D || GPU_PARAM(gcfg, srctype) == MCX_SRC_FOURIER) {
 #endif
         float rx = rand_uniform01(ran);
@@ -1269,19 +1633,19 @@ __device__ void launchnewphoton(__constant MCXParam* gcfg, ray* r, __global FLOA
         r->p0.y = gcfg->srcpos.y + rx * gcfg->srcparam1.y + ry * gcfg->srcparam2.y;
         r->p0.z = gcfg->srcpos.z + rx * gcfg->srcparam1.z + ry * gcfg->srcparam2.z;
         r->weight = 1.f;
-#if defined(__NVCC__) || defined(MCX_SRC_PATTERN)
-#ifdef __NVCC__
+#if defined(MMC_CUDA_KERNEL) || defined(MCX_SRC_PATTERN)
+#ifdef MMC_CUDA_KERNEL
 
         if (GPU_PARAM(gcfg, srctype) == MCX_SRC_PATTERN) {
 #endif
             int xsize = (int)gcfg->srcparam1.w;
             int ysize = (int)gcfg->srcparam2.w;
             r->posidx = MIN((int)(ry * JUST_BELOW_ONE * ysize), ysize - 1) * xsize + MIN((int)(rx * JUST_BELOW_ONE * xsize), xsize - 1);
-            r->weight = (GPU_PARAM(gcfg, srcnum) > 1) ? 1.f : srcpattern[r->posidx];
+            r->weight = (GPU_PARAM(gcfg, srcnum) > 1) ? 1.f : patternweight(gcfg, srcpattern, r->posidx, 0);
 
 #endif
-#if defined(__NVCC__) || defined(MCX_SRC_FOURIER)  // need to prevent rx/ry=1 here
-#ifdef __NVCC__
+#if defined(MMC_CUDA_KERNEL) || defined(MCX_SRC_FOURIER)  // need to prevent rx/ry=1 here
+#ifdef MMC_CUDA_KERNEL
         } else if (GPU_PARAM(gcfg, srctype) == MCX_SRC_FOURIER)
 #endif
             r->weight = (MCX_MATHFUN(cos)((floor(gcfg->srcparam1.w) * rx + floor(gcfg->srcparam2.w) * ry + gcfg->srcparam1.w - floor(gcfg->srcparam1.w)) * TWO_PI) * (1.f - gcfg->srcparam2.w + floor(gcfg->srcparam2.w)) + 1.f) * 0.5f;
@@ -1291,8 +1655,8 @@ __device__ void launchnewphoton(__constant MCXParam* gcfg, ray* r, __global FLOA
         origin.y += (gcfg->srcparam1.y + gcfg->srcparam2.y) * 0.5f;
         origin.z += (gcfg->srcparam1.z + gcfg->srcparam2.z) * 0.5f;
 #endif
-#if defined(__NVCC__) || defined(MCX_SRC_FOURIERX) || defined(MCX_SRC_FOURIERX2D) // [v1x][v1y][v1z][|v2|]; [kx][ky][phi0][M], unit(v0) x unit(v1)=unit(v2)
-#ifdef __NVCC__
+#if defined(MMC_CUDA_KERNEL) || defined(MCX_SRC_FOURIERX) || defined(MCX_SRC_FOURIERX2D) // [v1x][v1y][v1z][|v2|]; [kx][ky][phi0][M], unit(v0) x unit(v1)=unit(v2)
+#ifdef MMC_CUDA_KERNEL
     } else if (GPU_PARAM(gcfg, srctype) == MCX_SRC_FOURIERX || GPU_PARAM(gcfg, srctype) == MCX_SRC_FOURIERX2D) {
 #endif
         float rx = rand_uniform01(ran);
@@ -1301,16 +1665,16 @@ __device__ void launchnewphoton(__constant MCXParam* gcfg, ray* r, __global FLOA
         r->p0.x = gcfg->srcpos.x + rx * gcfg->srcparam1.x + ry * tmp * (gcfg->srcdir.y * gcfg->srcparam1.z - gcfg->srcdir.z * gcfg->srcparam1.y);
         r->p0.y = gcfg->srcpos.y + rx * gcfg->srcparam1.y + ry * tmp * (gcfg->srcdir.z * gcfg->srcparam1.x - gcfg->srcdir.x * gcfg->srcparam1.z);
         r->p0.z = gcfg->srcpos.z + rx * gcfg->srcparam1.z + ry * tmp * (gcfg->srcdir.x * gcfg->srcparam1.y - gcfg->srcdir.y * gcfg->srcparam1.x);
-#if defined(__NVCC__) || defined(MCX_SRC_FOURIERX2D)
-#ifdef __NVCC__
+#if defined(MMC_CUDA_KERNEL) || defined(MCX_SRC_FOURIERX2D)
+#ifdef MMC_CUDA_KERNEL
 
         if (GPU_PARAM(gcfg, srctype) == MCX_SRC_FOURIERX2D)
 #endif
             r->weight = (MCX_MATHFUN(sin)((gcfg->srcparam2.x * rx + gcfg->srcparam2.z) * TWO_PI) * MCX_MATHFUN(sin)((gcfg->srcparam2.y * ry + gcfg->srcparam2.w) * TWO_PI) + 1.f) * 0.5f; //between 0 and 1
 
 #endif
-#if defined(__NVCC__) || defined(MCX_SRC_FOURIERX)
-#ifdef __NVCC__
+#if defined(MMC_CUDA_KERNEL) || defined(MCX_SRC_FOURIERX)
+#ifdef MMC_CUDA_KERNEL
         else
 #endif
             r->weight = (MCX_MATHFUN(cos)((gcfg->srcparam2.x * rx + gcfg->srcparam2.y * ry + gcfg->srcparam2.z) * TWO_PI) * (1.f - gcfg->srcparam2.w) + 1.f) * 0.5f; //between 0 and 1
@@ -1320,8 +1684,8 @@ __device__ void launchnewphoton(__constant MCXParam* gcfg, ray* r, __global FLOA
         origin.y += (gcfg->srcparam1.y + tmp * (gcfg->srcdir.z * gcfg->srcparam1.x - gcfg->srcdir.x * gcfg->srcparam1.z)) * 0.5f;
         origin.z += (gcfg->srcparam1.z + tmp * (gcfg->srcdir.x * gcfg->srcparam1.y - gcfg->srcdir.y * gcfg->srcparam1.x)) * 0.5f;
 #endif
-#if defined(__NVCC__) || defined(MCX_SRC_DISK) || defined(MCX_SRC_GAUSSIAN) // uniform disk distribution or Gaussian-beam
-#ifdef __NVCC__
+#if defined(MMC_CUDA_KERNEL) || defined(MCX_SRC_DISK) || defined(MCX_SRC_GAUSSIAN) // uniform disk distribution or Gaussian-beam
+#ifdef MMC_CUDA_KERNEL
     } else if (GPU_PARAM(gcfg, srctype) == MCX_SRC_DISK || GPU_PARAM(gcfg, srctype) == MCX_SRC_GAUSSIAN) {
 #endif
         float sphi, cphi;
@@ -1329,15 +1693,15 @@ __device__ void launchnewphoton(__constant MCXParam* gcfg, ray* r, __global FLOA
         sphi = MCX_MATHFUN(sin)(phi);
         cphi = MCX_MATHFUN(cos)(phi);
         float r0;
-#if defined(__NVCC__) || defined(MCX_SRC_DISK)
-#ifdef __NVCC__
+#if defined(MMC_CUDA_KERNEL) || defined(MCX_SRC_DISK)
+#ifdef MMC_CUDA_KERNEL
 
         if (GPU_PARAM(gcfg, srctype) == MCX_SRC_DISK) {
 #endif
             r0 = MCX_MATHFUN(sqrt)(rand_uniform01(ran)) * gcfg->srcparam1.x;
 #endif
-#if defined(__NVCC__) || defined(MCX_SRC_GAUSSIAN)
-#ifdef __NVCC__
+#if defined(MMC_CUDA_KERNEL) || defined(MCX_SRC_GAUSSIAN)
+#ifdef MMC_CUDA_KERNEL
         } else {
 #endif
 
@@ -1348,7 +1712,7 @@ __device__ void launchnewphoton(__constant MCXParam* gcfg, ray* r, __global FLOA
                 r0 = MCX_MATHFUN(sqrt)(-MCX_MATHFUN(log)((rand_uniform01(ran)) * (1.f + (GPU_PARAM(gcfg, focus) * GPU_PARAM(gcfg, focus) / (z0 * z0))))) * gcfg->srcparam1.x;
             }
 
-#ifdef __NVCC__
+#ifdef MMC_CUDA_KERNEL
         }
 
 #endif
@@ -1366,16 +1730,16 @@ __device__ void launchnewphoton(__constant MCXParam* gcfg, ray* r, __global FLOA
         }
 
 #endif
-#if defined(__NVCC__) || defined(MCX_SRC_CONE) || defined(MCX_SRC_ISOTROPIC) || defined(MCX_SRC_ARCSINE)
-#ifdef __NVCC__
+#if defined(MMC_CUDA_KERNEL) || defined(MCX_SRC_CONE) || defined(MCX_SRC_ISOTROPIC) || defined(MCX_SRC_ARCSINE)
+#ifdef MMC_CUDA_KERNEL
     } else if (GPU_PARAM(gcfg, srctype) == MCX_SRC_CONE || GPU_PARAM(gcfg, srctype) == MCX_SRC_ISOTROPIC || GPU_PARAM(gcfg, srctype) == MCX_SRC_ARCSINE) {
 #endif
         float ang, stheta, ctheta, sphi, cphi;
         ang = TWO_PI * rand_uniform01(ran); //next arimuth angle
         sphi = MCX_MATHFUN(sin)(ang);
         cphi = MCX_MATHFUN(cos)(ang);
-#if defined(__NVCC__) || defined(MCX_SRC_CONE) // a solid-angle section of a uniform sphere
-#ifdef __NVCC__
+#if defined(MMC_CUDA_KERNEL) || defined(MCX_SRC_CONE) // a solid-angle section of a uniform sphere
+#ifdef MMC_CUDA_KERNEL
 
         if (GPU_PARAM(gcfg, srctype) == MCX_SRC_CONE) {
 #endif
@@ -1385,8 +1749,8 @@ __device__ void launchnewphoton(__constant MCXParam* gcfg, ray* r, __global FLOA
             } while (ang > gcfg->srcparam1.x);
 
 #endif
-#if defined(__NVCC__) || defined(MCX_SRC_ISOTROPIC) || defined(MCX_SRC_ARCSINE)
-#ifdef __NVCC__
+#if defined(MMC_CUDA_KERNEL) || defined(MCX_SRC_ISOTROPIC) || defined(MCX_SRC_ARCSINE)
+#ifdef MMC_CUDA_KERNEL
         } else {
 #endif
 
@@ -1396,7 +1760,7 @@ __device__ void launchnewphoton(__constant MCXParam* gcfg, ray* r, __global FLOA
                 ang = M_PI * rand_uniform01(ran);    //uniform distribution in zenith angle, arcsine
             }
 
-#ifdef __NVCC__
+#ifdef MMC_CUDA_KERNEL
         }
 
 #endif
@@ -1414,8 +1778,8 @@ __device__ void launchnewphoton(__constant MCXParam* gcfg, ray* r, __global FLOA
             }
 
 #endif
-#if defined(__NVCC__) || defined(MCX_SRC_ZGAUSSIAN)
-#ifdef __NVCC__
+#if defined(MMC_CUDA_KERNEL) || defined(MCX_SRC_ZGAUSSIAN)
+#ifdef MMC_CUDA_KERNEL
     } else if (GPU_PARAM(gcfg, srctype) == MCX_SRC_ZGAUSSIAN) {
 #endif
         float ang, stheta, ctheta, sphi, cphi;
@@ -1430,8 +1794,8 @@ __device__ void launchnewphoton(__constant MCXParam* gcfg, ray* r, __global FLOA
         r->vec.z = ctheta;
         canfocus = 0;
 #endif
-#if defined(__NVCC__) || defined(MCX_SRC_LINE) || defined(MCX_SRC_SLIT)
-#ifdef __NVCC__
+#if defined(MMC_CUDA_KERNEL) || defined(MCX_SRC_LINE) || defined(MCX_SRC_SLIT)
+#ifdef MMC_CUDA_KERNEL
     } else if (GPU_PARAM(gcfg, srctype) == MCX_SRC_LINE || GPU_PARAM(gcfg, srctype) == MCX_SRC_SLIT) {
 #endif
         float t = rand_uniform01(ran);
@@ -1439,8 +1803,8 @@ __device__ void launchnewphoton(__constant MCXParam* gcfg, ray* r, __global FLOA
         r->p0.y += t * gcfg->srcparam1.y;
         r->p0.z += t * gcfg->srcparam1.z;
 
-#if defined(__NVCC__) || defined(MCX_SRC_LINE)
-#ifdef __NVCC__
+#if defined(MMC_CUDA_KERNEL) || defined(MCX_SRC_LINE)
+#ifdef MMC_CUDA_KERNEL
 
         if (GPU_PARAM(gcfg, srctype) == MCX_SRC_LINE) {
 #endif
@@ -1454,7 +1818,7 @@ __device__ void launchnewphoton(__constant MCXParam* gcfg, ray* r, __global FLOA
             vv.z = r->vec.x * s - r->vec.y * t;
             r->vec = vv;
             //*((float3*)&(r->vec))=(float3)(r->vec.y*p-r->vec.z*s,r->vec.z*t-r->vec.x*p,r->vec.x*s-r->vec.y*t);
-#ifdef __NVCC__
+#ifdef MMC_CUDA_KERNEL
         }
 
 #endif
@@ -1463,7 +1827,7 @@ __device__ void launchnewphoton(__constant MCXParam* gcfg, ray* r, __global FLOA
         origin.y += (gcfg->srcparam1.y) * 0.5f;
         origin.z += (gcfg->srcparam1.z) * 0.5f;
         canfocus = (GPU_PARAM(gcfg, srctype) == stSlit);
-#ifdef __NVCC__
+#ifdef MMC_CUDA_KERNEL
     }
 
 #endif
@@ -1491,18 +1855,30 @@ __device__ void launchnewphoton(__constant MCXParam* gcfg, ray* r, __global FLOA
 
     r->p0 += r->vec * EPS;
 
-#if defined(__NVCC__) || defined(MCX_SRC_PLANAR) || defined(MCX_SRC_PATTERN) || defined(MCX_SRC_PATTERN3D) || defined(MCX_SRC_FOURIER) || defined(MCX_SRC_FOURIERX) || defined(MCX_SRC_FOURIERX2D)
-#ifdef __NVCC__
+#if defined(MMC_CUDA_KERNEL) || defined(MCX_SRC_PLANAR) || defined(MCX_SRC_PATTERN) || defined(MCX_SRC_PATTERN3D) || defined(MCX_SRC_FOURIER) || defined(MCX_SRC_FOURIERX) || defined(MCX_SRC_FOURIERX2D)
+#ifdef MMC_CUDA_KERNEL
 
     if (GPU_PARAM(gcfg, srctype) == MCX_SRC_PLANAR || GPU_PARAM(gcfg, srctype) == MCX_SRC_PATTERN || GPU_PARAM(gcfg, srctype) == MCX_SRC_PATTERN3D || GPU_PARAM(gcfg, srctype) == MCX_SRC_FOURIER || GPU_PARAM(gcfg, srctype) == MCX_SRC_FOURIERX || GPU_PARAM(gcfg, srctype) == MCX_SRC_FOURIERX2D) {
 #endif
         /*Caluclate intial element id and bary-centric coordinates for area sources - position changes everytime*/
         float3 vecS = FL3(0.f), vecAB, vecAC, vecN;
-        int is, i, ea, eb, ec;
+        int is, i, ea, eb, ec, k = 0, kend = GPU_PARAM(gcfg, srcelemlen);
         float bary[4] = {0.f};
 
-        for (is = 0; is < GPU_PARAM(gcfg, srcelemlen); is++) {
+        /*only test the candidates binned in the source grid cell enclosing the launch position, see mesh_packgrid()*/
+        if (gcfg->srcgriddim.w) {
+            int ix = (int)fmax(0.f, fmin(floor((r->p0.x - gcfg->srcgridorig.x) * gcfg->srcgridorig.w), (float)(gcfg->srcgriddim.x - 1)));
+            int iy = (int)fmax(0.f, fmin(floor((r->p0.y - gcfg->srcgridorig.y) * gcfg->srcgridorig.w), (float)(gcfg->srcgriddim.y - 1)));
+            int iz = (int)fmax(0.f, fmin(floor((r->p0.z - gcfg->srcgridorig.z) * gcfg->srcgridorig.w), (float)(gcfg->srcgriddim.z - 1)));
+
+            k = gcfg->srcgriddim.w + (iz * gcfg->srcgriddim.y + iy) * gcfg->srcgriddim.x + ix;
+            kend = srcelem[k + 1];
+            k = srcelem[k];
+        }
+
+        for (; k < kend; k++) {
             int include = 1;
+            is = (gcfg->srcgriddim.w) ? srcelem[k] : k;
             __global int* elems = elem + (srcelem[is] - 1) * GPU_PARAM(gcfg, elemlen);
 
             for (i = 0; i < 4; i++) {
@@ -1540,7 +1916,7 @@ __device__ void launchnewphoton(__constant MCXParam* gcfg, ray* r, __global FLOA
             }
         }
 
-#ifdef __NVCC__
+#ifdef MMC_CUDA_KERNEL
     }
 
 #endif
@@ -1549,48 +1925,39 @@ __device__ void launchnewphoton(__constant MCXParam* gcfg, ray* r, __global FLOA
 
 
 /**
- * @brief The core Monte Carlo function simulating a single photon (!!!Important!!!)
- *
- * This is the core Monte Carlo simulation function. It simulates the life-time
- * of a single photon packet, from launching to termination.
+ * @brief Launch a photon and initialize its partial-path record
  *
- * \param[in] id: the linear index of the current photon, starting from 0.
- * \param[in] tracer: the ray-tracer aux data structure
- * \param[in] mesh: the mesh data structure
+ * \param[in] id: the linear index of the photon, starting from 0
+ * \param[out] r: the state of the launched photon
+ * \param[out] ppath: the partial-path record of the photon
+ * \param[in,out] energytot: the launched weight of each source pattern, incremented
  * \param[in,out] ran: the random number generator states
- * \param[in,out] cfg: simulation configuration structure
- * \param[out] visit: statistics counters of this thread
+ * \param[out] initseed: the RNG states before the launch, NULL if they are not saved
  */
 
-__device__ void onephoton(unsigned int id, __local float* ppath, __constant MCXParam* gcfg, __global FLOAT3* node, __global int* elem, __global float* weight, __global float* dref, __global float* camsignals,
-                          __global int* type, __global int* facenb,  __global int* srcelem, __global float4* normal, __constant Medium* gmed,
-                          __global float* n_det, __global uint* detectedphoton, __local float* energytot, __local float* energyesc, __private RandType* ran, int* raytet, __global float* srcpattern,
-                          __global float* replayweight, __global float* replaytime, __global RandType* photonseed, __global MCXReporter* reporter, __global float* gdebugdata) {
+__device__ void photonlaunch(unsigned int id, ray* r, __local float* ppath, __local float* energytot, __constant MCXParam* gcfg, __global FLOAT3* node, __global int* elem,
+                             __global int* srcelem, __private RandType* ran, __global float* srcpattern, RandType* initseed, __global MCXReporter* reporter, __global float* gdebugdata) {
 
-    int oldeid, fixcount = 0;
-    ray r = {gcfg->srcpos, gcfg->srcdir, {MMC_UNDEFINED, 0.f, 0.f}, GPU_PARAM(gcfg, e0), 0, 0, 1.f, 0.f, 0.f, 0.f, ID_UNDEFINED, 0.f};
-#if defined(MCX_SAVE_SEED) || defined(__NVCC__)
-    RandType initseed[RAND_BUF_LEN] = {NULL};
-#endif
+    int i;
+    ray r0 = {gcfg->srcpos, gcfg->srcdir, {MMC_UNDEFINED, 0.f, 0.f}, GPU_PARAM(gcfg, e0), 0, 0, 1.f, 0.f, 0.f, 0.f, ID_UNDEFINED, 0.f};
 
     clearpath(ppath, (GPU_PARAM(gcfg, reclen) + (GPU_PARAM(gcfg, srcnum) > 1) * GPU_PARAM(gcfg, srcnum)));
-    clearpath(energytot, GPU_PARAM(gcfg, srcnum));
-    clearpath(energyesc, GPU_PARAM(gcfg, srcnum));
 
-    r.photonid = id;
+    *r = r0;
+    r->photonid = id;
 
-#if defined(MCX_SAVE_SEED) || defined(__NVCC__)
+#if defined(MCX_SAVE_SEED) || defined(MMC_CUDA_KERNEL)
 
-#ifdef __NVCC__
+#ifdef MMC_CUDA_KERNEL
 
     if (GPU_PARAM(gcfg, issaveseed)) {
 #endif
 
-        for (oldeid = 0; oldeid < RAND_BUF_LEN; oldeid++) {
-            initseed[oldeid] = ran[oldeid];
+        for (i = 0; i < RAND_BUF_LEN; i++) {
+            initseed[i] = ran[i];
         }
 
-#ifdef __NVCC__
+#ifdef MMC_CUDA_KERNEL
     }
 
 #endif
@@ -1598,21 +1965,21 @@ __device__ void onephoton(unsigned int id, __local float* ppath, __constant MCXP
 #endif
 
     /*initialize the photon parameters*/
-    launchnewphoton(gcfg, &r, node, elem, srcelem, ran, srcpattern);
+    launchnewphoton(gcfg, r, node, elem, srcelem, ran, srcpattern);
 
-#if defined(MCX_SAVE_DETECTORS) || defined(__NVCC__)
-#ifdef __NVCC__
+#if defined(MCX_SAVE_DETECTORS) || defined(MMC_CUDA_KERNEL)
+#ifdef MMC_CUDA_KERNEL
 
     if (GPU_PARAM(gcfg, issavedet)) {
 #endif
 
         if (GPU_PARAM(gcfg, srctype) != stPattern || GPU_PARAM(gcfg, srcnum) == 1) {
-            ppath[GPU_PARAM(gcfg, reclen) - 1] = r.weight; /*last record in partialpath is the initial photon weight*/
+            ppath[GPU_PARAM(gcfg, reclen) - 1] = r->weight; /*last record in partialpath is the initial photon weight*/
         } else if (GPU_PARAM(gcfg, srctype) == stPattern) {
-            *((__local uint*)(ppath + GPU_PARAM(gcfg, reclen) - 1)) = r.posidx;
+            *((__local uint*)(ppath + GPU_PARAM(gcfg, reclen) - 1)) = r->posidx;
         }
 
-#ifdef __NVCC__
+#ifdef MMC_CUDA_KERNEL
     }
 
 #endif
@@ -1620,288 +1987,605 @@ __device__ void onephoton(unsigned int id, __local float* ppath, __constant MCXP
 #endif
 
     if (GPU_PARAM(gcfg, srcnum) == 1) {
-        *energytot += r.weight;
+        *energytot += r->weight;
     } else {
-        for (oldeid = 0; oldeid < GPU_PARAM(gcfg, srcnum); oldeid++) {
-            ppath[GPU_PARAM(gcfg, reclen) + oldeid] = srcpattern[r.posidx * GPU_PARAM(gcfg, srcnum) + oldeid];
-            energytot[oldeid] += r.weight * ppath[GPU_PARAM(gcfg, reclen) + oldeid];
+        for (i = 0; i < GPU_PARAM(gcfg, srcnum); i++) {
+            ppath[GPU_PARAM(gcfg, reclen) + i] = patternweight(gcfg, srcpattern, r->posidx, i);
+            energytot[i] += r->weight * ppath[GPU_PARAM(gcfg, reclen) + i];
         }
     }
 
     if (GPU_PARAM(gcfg, debuglevel) & dlTraj) {
-        savedebugdata(&r, id, reporter, gdebugdata, gcfg);
+        savedebugdata(r, id, reporter, gdebugdata, gcfg);
     }
+}
 
-    /*use Kahan summation to accumulate weight, otherwise, counter stops at 16777216*/
-    /*http://stackoverflow.com/questions/2148149/how-to-sum-a-large-number-of-float-number*/
+/**
+ * @brief Move a photon to its next scattering site, or until it terminates
+ *
+ * The propagation part of photonstep(): the photon is traced over the remaining
+ * scattering length through the tetrahedra, reflected, or terminated at the
+ * boundary or by Russian roulette, otherwise the next scattering direction and
+ * length are sampled. The records of a photon leaving the domain are left to
+ * photonexit(), so that the split kernels of --fission do not carry them.
+ *
+ * \param[in,out] r: the state of the photon
+ * \param[in,out] fixcount: number of retries after the photon hit an edge or a vertex
+ * \param[out] exiteid: the last element of a photon leaving the domain, passed to photonexit()
+ * \param[in,out] ppath: the partial-path record of the photon
+ * \param[in,out] ran: the random number generator states
+ * \return 0 if the photon reached its next scattering site, 1 if it terminated, 2 if it
+ *         terminated at the boundary and photonexit() is due
+ */
 
-    while (1) { /*propagate a photon until exit*/
-        r.slen = branchless_badouel_raytet(&r, gcfg, ppath, elem, weight, type[r.eid - 1], facenb, normal, gmed, replayweight, replaytime);
-        (*raytet)++;
+__device__ int photonmove(ray* r, int* fixcount, int* exiteid, __local float* ppath, __local uint* accumcache, __constant MCXParam* gcfg, __global FLOAT3* node, __global int* elem, __global float* weight,
+                          __mesh int* type, __mesh int* facenb, __mesh float4* normal, __constant Medium* gmed, __private RandType* ran, int* raytet,
+                          __global float* replayweight, __global float* replaytime, __global int* replaydetid, __global MCXReporter* reporter, __global float* gdebugdata,
+                          __global float* invcdf, __global const Medium* elemmed) {
 
-        if (r.pout.x == MMC_UNDEFINED) {
-            if (r.faceid == -2) {
-                break;    /*reaches the time limit*/
-            }
+    int oldeid = r->eid;
 
-            if (fixcount++ < MAX_TRIAL) {
-                fixphoton(&r.p0, node, (__global int*)(elem + (r.eid - 1)*GPU_PARAM(gcfg, elemlen)));
-                continue;
-            }
+    r->slen = branchless_badouel_raytet(r, gcfg, ppath, accumcache, elem, weight, ELEM_TYPE(r->eid - 1), facenb, normal, gmed, replayweight, replaytime, replaydetid, elemmed);
+    (*raytet)++;
 
-            r.eid = ID_UNDEFINED;
-            r.faceid = -1;
+    if (r->pout.x == MMC_UNDEFINED) {
+        if (r->faceid == -2) {
+            return 1;    /*reaches the time limit*/
         }
 
-#if defined(MCX_SAVE_DETECTORS) || defined(__NVCC__)
-
-        if (GPU_PARAM(gcfg, issavedet) && r.Lmove > 0.f && type[r.eid - 1] > 0) {
-            ppath[GPU_PARAM(gcfg, maxmedia) + type[r.eid - 1] - 1] += r.Lmove;    /*second medianum block is the partial path*/
+        if ((*fixcount)++ < MAX_TRIAL) {
+            fixphoton(&r->p0, node, (__global int*)(elem + (r->eid - 1)*GPU_PARAM(gcfg, elemlen)));
+            return 0;
         }
 
+        r->eid = ID_UNDEFINED;
+        r->faceid = -1;
+    }
+
+#if defined(MCX_SAVE_DETECTORS) || defined(MMC_CUDA_KERNEL)
+
+    if (GPU_PARAM(gcfg, issavedet) && r->Lmove > 0.f && ELEM_TYPE(r->eid - 1) > 0) {
+        ppath[GPU_PARAM(gcfg, maxmedia) + ELEM_TYPE(r->eid - 1) - 1] += r->Lmove;    /*second medianum block is the partial path*/
+    }
+
 #endif
 
-        /*move a photon until the end of the current scattering path*/
-        // Might cause an infinite loop
-        int iteration_idx = 0;
-        while (r.faceid >= 0 && !r.isend) {
-            iteration_idx++;
-            if (iteration_idx > 997)
-            {
-                printf("Photon is stuck here for a long time... %.2f %.2f %.2f | %.2f %.2f %.2f \n",r.p0.x,r.p0.y,r.p0.z, r.vec.x,r.vec.y,r.vec.z);
-            }
+    /*move a photon until the end of the current scattering path*/
+    // Might cause an infinite loop
+    int iteration_idx = 0;
+    while (r->faceid >= 0 && !r->isend) {
+        iteration_idx++;
+        if (iteration_idx > 997)
+        {
+            printf("Photon is stuck here for a long time... %.2f %.2f %.2f | %.2f %.2f %.2f \n",r->p0.x,r->p0.y,r->p0.z, r->vec.x,r->vec.y,r->vec.z);
+        }
 
-            if (iteration_idx > 1000)
-            {
-                printf("Aborting loop\n");
-                break;
-            }
+        if (iteration_idx > 1000)
+        {
+            printf("Aborting loop\n");
+            break;
+        }
 
-            r.p0 = r.pout;
+        r->p0 = r->pout;
 
-            oldeid = r.eid;
-            r.eid = ((__global int*)(facenb + (r.eid - 1) * GPU_PARAM(gcfg, elemlen)))[r.faceid];
+        oldeid = r->eid;
+        r->eid = ELEM_NEIGHBOR(r->eid - 1, r->faceid);
 #ifdef MCX_DO_REFLECTION
 
-            if (GPU_PARAM(gcfg, isreflect) && (r.eid <= 0 || (r.eid > 0 && gmed[type[r.eid - 1]].n != gmed[type[oldeid - 1]].n ))) {
-                if (! (r.eid <= 0 && ((gmed[type[oldeid - 1]].n == GPU_PARAM(gcfg, nout) && GPU_PARAM(gcfg, isreflect) != (int)bcMirror) || GPU_PARAM(gcfg, isreflect) == (int)bcAbsorbExterior) )) {
-                    reflectray(gcfg, &r.vec, &oldeid, &r.eid, r.faceid, ran, type, normal, gmed);
-                }
+        if (GPU_PARAM(gcfg, isreflect) && (r->eid <= 0 || (r->eid > 0 && ELEM_MEDIUM(r->eid - 1).n != ELEM_MEDIUM(oldeid - 1).n ))) {
+            if (! (r->eid <= 0 && ((ELEM_MEDIUM(oldeid - 1).n == GPU_PARAM(gcfg, nout) && GPU_PARAM(gcfg, isreflect) != (int)bcMirror) || GPU_PARAM(gcfg, isreflect) == (int)bcAbsorbExterior) )) {
+                reflectray(gcfg, &r->vec, &oldeid, &r->eid, r->faceid, ran, type, facenb, normal, gmed, elemmed);
             }
+        }
 
 #endif
 
-            if (r.eid <= 0) {
-                break;
-            }
+        if (r->eid <= 0) {
+            break;
+        }
 
-            /*when a photon enters the domain from the background*/
-            if (type[oldeid - 1] == 0 && type[r.eid - 1]) {
-                //if(GPU_PARAM(gcfg,debuglevel)&dlExit)
-                GPUDEBUG(("e %f %f %f %f %f %f %f %d\n", r.p0.x, r.p0.y, r.p0.z,
-                          r.vec.x, r.vec.y, r.vec.z, r.weight, r.eid));
+        /*when a photon enters the domain from the background*/
+        if (ELEM_TYPE(oldeid - 1) == 0 && ELEM_TYPE(r->eid - 1)) {
+            //if(GPU_PARAM(gcfg,debuglevel)&dlExit)
+            GPUDEBUG(("e %f %f %f %f %f %f %f %d\n", r->p0.x, r->p0.y, r->p0.z,
+                      r->vec.x, r->vec.y, r->vec.z, r->weight, r->eid));
 
-                if (!GPU_PARAM(gcfg, voidtime)) {
-                    r.photontimer = 0.f;
-                }
+            if (!GPU_PARAM(gcfg, voidtime)) {
+                r->photontimer = 0.f;
             }
+        }
 
-            /*when a photon exits the domain into the background*/
-            if (type[oldeid - 1] && type[r.eid - 1] == 0) {
-                //if(GPU_PARAM(gcfg,debuglevel)&dlExit)
-                GPUDEBUG(("x %f %f %f %f %f %f %f %d\n", r.p0.x, r.p0.y, r.p0.z,
-                          r.vec.x, r.vec.y, r.vec.z, r.weight, r.eid));
+        /*when a photon exits the domain into the background*/
+        if (ELEM_TYPE(oldeid - 1) && ELEM_TYPE(r->eid - 1) == 0) {
+            //if(GPU_PARAM(gcfg,debuglevel)&dlExit)
+            GPUDEBUG(("x %f %f %f %f %f %f %f %d\n", r->p0.x, r->p0.y, r->p0.z,
+                      r->vec.x, r->vec.y, r->vec.z, r->weight, r->eid));
 
-                if (!GPU_PARAM(gcfg, isextdet)) {
-                    r.eid = 0;
-                    break;
-                }
+            if (!GPU_PARAM(gcfg, isextdet)) {
+                r->eid = 0;
+                break;
             }
+        }
 
-            //          if(r.eid==0 && gmed[type[oldeid-1]].n == GPU_PARAM(gcfg,nout) ) break;
-            if (r.pout.x != MMC_UNDEFINED) { // && (GPU_PARAM(gcfg,debuglevel)&dlMove))
-                GPUDEBUG(("P %f %f %f %d %u %e\n", r.pout.x, r.pout.y, r.pout.z, r.eid, id, r.slen));
-            }
+        //          if(r->eid==0 && gmed[type[oldeid-1]].n == GPU_PARAM(gcfg,nout) ) break;
+        if (r->pout.x != MMC_UNDEFINED) { // && (GPU_PARAM(gcfg,debuglevel)&dlMove))
+            GPUDEBUG(("P %f %f %f %d %u %e\n", r->pout.x, r->pout.y, r->pout.z, r->eid, r->photonid, r->slen));
+        }
 
-            r.slen = branchless_badouel_raytet(&r, gcfg, ppath, elem, weight, type[r.eid - 1], facenb, normal, gmed, replayweight, replaytime);
-            (*raytet)++;
-#if defined(MCX_SAVE_DETECTORS) || defined(__NVCC__)
+        r->slen = branchless_badouel_raytet(r, gcfg, ppath, accumcache, elem, weight, ELEM_TYPE(r->eid - 1), facenb, normal, gmed, replayweight, replaytime, replaydetid, elemmed);
+        (*raytet)++;
+#if defined(MCX_SAVE_DETECTORS) || defined(MMC_CUDA_KERNEL)
 
-            if (GPU_PARAM(gcfg, issavedet) && r.Lmove > 0.f && type[r.eid - 1] > 0) {
-                ppath[GPU_PARAM(gcfg, maxmedia) + type[r.eid - 1] - 1] += r.Lmove;
-            }
+        if (GPU_PARAM(gcfg, issavedet) && r->Lmove > 0.f && ELEM_TYPE(r->eid - 1) > 0) {
+            ppath[GPU_PARAM(gcfg, maxmedia) + ELEM_TYPE(r->eid - 1) - 1] += r->Lmove;
+        }
 
 #endif
 
-            if (r.faceid == -2) {
-                break;
-            }
+        if (r->faceid == -2) {
+            break;
+        }
 
-            fixcount = 0;
+        *fixcount = 0;
 
-            while (r.pout.x == MMC_UNDEFINED && fixcount++ < MAX_TRIAL) {
-                fixphoton(&r.p0, node, (__global int*)(elem + (r.eid - 1)*GPU_PARAM(gcfg, elemlen)));
-                r.slen = branchless_badouel_raytet(&r, gcfg, ppath, elem, weight, type[r.eid - 1], facenb, normal, gmed, replayweight, replaytime);
-                (*raytet)++;
-#if defined(MCX_SAVE_DETECTORS) || defined(__NVCC__)
+        while (r->pout.x == MMC_UNDEFINED && (*fixcount)++ < MAX_TRIAL) {
+            fixphoton(&r->p0, node, (__global int*)(elem + (r->eid - 1)*GPU_PARAM(gcfg, elemlen)));
+            r->slen = branchless_badouel_raytet(r, gcfg, ppath, accumcache, elem, weight, ELEM_TYPE(r->eid - 1), facenb, normal, gmed, replayweight, replaytime, replaydetid, elemmed);
+            (*raytet)++;
+#if defined(MCX_SAVE_DETECTORS) || defined(MMC_CUDA_KERNEL)
 
-                if (GPU_PARAM(gcfg, issavedet) && r.Lmove > 0.f && type[r.eid - 1] > 0) {
-                    ppath[GPU_PARAM(gcfg, maxmedia) + type[r.eid - 1] - 1] += r.Lmove;
-                }
+            if (GPU_PARAM(gcfg, issavedet) && r->Lmove > 0.f && ELEM_TYPE(r->eid - 1) > 0) {
+                ppath[GPU_PARAM(gcfg, maxmedia) + ELEM_TYPE(r->eid - 1) - 1] += r->Lmove;
+            }
 
 #endif
-            }
+        }
 
-            if (r.pout.x == MMC_UNDEFINED) {
-                /*possibily hit an edge or miss*/
-                r.eid = ID_UNDEFINED;
-                break;
-            }
+        if (r->pout.x == MMC_UNDEFINED) {
+            /*possibily hit an edge or miss*/
+            r->eid = ID_UNDEFINED;
+            break;
         }
+    }
 
-        if (iteration_idx > 1000)
-        {
-            break;
+    if (iteration_idx > 1000)
+    {
+        return 1;
+    }
+
+    if (r->eid <= 0 || r->pout.x == MMC_UNDEFINED) {
+        //if(r->eid==0 && (GPU_PARAM(gcfg,debuglevel)&dlMove))
+        GPUDEBUG(("B %f %f %f %d %u %e\n", r->p0.x, r->p0.y, r->p0.z, r->eid, r->photonid, r->slen));
+
+        *exiteid = oldeid;
+        return 2;  /*photon exits boundary*/
+    }
+
+    //if(GPU_PARAM(gcfg,debuglevel)&dlMove)
+    GPUDEBUG(("M %f %f %f %d %u %e\n", r->p0.x, r->p0.y, r->p0.z, r->eid, r->photonid, r->slen));
+
+    if (GPU_PARAM(gcfg, minenergy) > 0.f && r->weight < GPU_PARAM(gcfg, minenergy) && (gcfg->tend - gcfg->tstart)*GPU_PARAM(gcfg, Rtstep) <= 1.f) { /*Russian Roulette*/
+        if (rand_do_roulette(ran)*GPU_PARAM(gcfg, roulettesize) <= 1.f) {
+            r->weight *= GPU_PARAM(gcfg, roulettesize);
+            //if(GPU_PARAM(gcfg,debuglevel)&dlWeight)
+            GPUDEBUG(("Russian Roulette bumps r->weight to %f\n", r->weight));
+        } else {
+            return 1;
         }
+    }
+
+    float mom = 0.f;
+    r->slen0 = mc_next_scatter(ELEM_MEDIUM(r->eid - 1).g, (invcdf && ELEM_TYPE(r->eid - 1) > 0) ? invcdf + (ELEM_TYPE(r->eid - 1) - 1) * GPU_PARAM(gcfg, nphase) : NULL,
+                              &r->vec, ran, gcfg, &mom);
+    r->slen = r->slen0;
 
-        if (r.eid <= 0 || r.pout.x == MMC_UNDEFINED) {
-            //if(r.eid==0 && (GPU_PARAM(gcfg,debuglevel)&dlMove))
-            GPUDEBUG(("B %f %f %f %d %u %e\n", r.p0.x, r.p0.y, r.p0.z, r.eid, id, r.slen));
+    if (GPU_PARAM(gcfg, debuglevel) & dlTraj) {
+        savedebugdata(r, r->photonid, reporter, gdebugdata, gcfg);
+    }
 
-            if (r.eid != ID_UNDEFINED) {
-                //if(GPU_PARAM(gcfg,debuglevel)&dlExit)
-                GPUDEBUG(("E %f %f %f %f %f %f %f %d\n", r.p0.x, r.p0.y, r.p0.z,
-                          r.vec.x, r.vec.y, r.vec.z, r.weight, r.eid));
-#if defined(MCX_SAVE_DETECTORS) || defined(__NVCC__)
+#if defined(MCX_SAVE_DETECTORS) || defined(MMC_CUDA_KERNEL)
 
-                if (GPU_PARAM(gcfg, issavedet) && GPU_PARAM(gcfg, issaveexit)) {                                 /*when issaveexit is set to 1*/
-                    copystate(ppath + (GPU_PARAM(gcfg, reclen) - 7), (__private float*) & (r.p0), 3); /*columns 7-5 from the right store the exit positions*/
-                    copystate(ppath + (GPU_PARAM(gcfg, reclen) - 4), (__private float*) & (r.vec), 3); /*columns 4-2 from the right store the exit dirs*/
-                }
+    if (GPU_PARAM(gcfg, issavedet)) {
+        if (GPU_PARAM(gcfg, ismomentum) && ELEM_TYPE(r->eid - 1) > 0) {             /*when ismomentum is set to 1*/
+            ppath[(GPU_PARAM(gcfg, maxmedia) << 1) + ELEM_TYPE(r->eid - 1) - 1] += mom;    /*the third medianum block stores the momentum transfer*/
+        }
+
+        if (GPU_PARAM(gcfg, issavedet)) {
+            ppath[ELEM_TYPE(r->eid - 1) - 1] += 1.f;    /*the first medianum block stores the scattering event counts*/
+        }
+    }
+
+#endif
+
+    return 0;
+}
+
+/**
+ * @brief Save the exit position, the diffuse reflectance and the detection of a photon leaving the domain
+ *
+ * \param[in] r: the state of the photon at the boundary
+ * \param[in] exiteid: the last element of the photon inside the domain, from photonmove()
+ * \param[in,out] ppath: the partial-path record of the photon
+ * \param[in] initseed: the RNG states at the launch, saved with a detected photon
+ */
+
+__device__ void photonexit(ray* r, int exiteid, __local float* ppath, __constant MCXParam* gcfg, __global float* dref, __global float* camsignals, __global float* detimage,
+                           __mesh int* type, __mesh float4* normal, __constant Medium* gmed, __global float* n_det, __global uint* detectedphoton,
+                           __global RandType* photonseed, RandType* initseed, __global const int* detgrid) {
+    if (r->eid != ID_UNDEFINED) {
+        //if(GPU_PARAM(gcfg,debuglevel)&dlExit)
+        GPUDEBUG(("E %f %f %f %f %f %f %f %d\n", r->p0.x, r->p0.y, r->p0.z,
+                  r->vec.x, r->vec.y, r->vec.z, r->weight, r->eid));
+#if defined(MCX_SAVE_DETECTORS) || defined(MMC_CUDA_KERNEL)
+
+        if (GPU_PARAM(gcfg, issavedet) && GPU_PARAM(gcfg, issaveexit)) {                                 /*when issaveexit is set to 1*/
+            copystate(ppath + (GPU_PARAM(gcfg, reclen) - 7), (__private float*) & (r->p0), 3); /*columns 7-5 from the right store the exit positions*/
+            copystate(ppath + (GPU_PARAM(gcfg, reclen) - 4), (__private float*) & (r->vec), 3); /*columns 4-2 from the right store the exit dirs*/
+        }
 
 #endif
 #ifdef MCX_SAVE_DREF
 
-                if (GPU_PARAM(gcfg, issaveref) && r.eid < 0 && dref) {
-                    int tshift = MIN( ((int)((r.photontimer - gcfg->tstart) * GPU_PARAM(gcfg, Rtstep))), GPU_PARAM(gcfg, maxgate) - 1 ) * GPU_PARAM(gcfg, nf);
-                    dref[((-r.eid) - 1) + tshift] += r.weight;
-                }
+        if (GPU_PARAM(gcfg, issaveref) && r->eid < 0 && dref) {
+#ifdef MCX_CW
+            dref[(-r->eid) - 1] += r->weight;
+#else
+            int tshift = MIN( ((int)((r->photontimer - gcfg->tstart) * GPU_PARAM(gcfg, Rtstep))), GPU_PARAM(gcfg, maxgate) - 1 ) * GPU_PARAM(gcfg, nf);
+            dref[((-r->eid) - 1) + tshift] += r->weight;
+#endif
+        }
 
 #endif
-            } else if (r.faceid == -2 && (GPU_PARAM(gcfg, debuglevel)&dlMove)) {
-                GPUDEBUG(("T %f %f %f %d %u %e\n", r.p0.x, r.p0.y, r.p0.z, r.eid, id, r.slen));
-            } else if (r.eid && r.faceid != -2  && GPU_PARAM(gcfg, debuglevel)&dlEdge) {
-                GPUDEBUG(("X %f %f %f %d %u %e\n", r.p0.x, r.p0.y, r.p0.z, r.eid, id, r.slen));
-            }
+    } else if (r->faceid == -2 && (GPU_PARAM(gcfg, debuglevel)&dlMove)) {
+        GPUDEBUG(("T %f %f %f %d %u %e\n", r->p0.x, r->p0.y, r->p0.z, r->eid, r->photonid, r->slen));
+    } else if (r->eid && r->faceid != -2  && GPU_PARAM(gcfg, debuglevel)&dlEdge) {
+        GPUDEBUG(("X %f %f %f %d %u %e\n", r->p0.x, r->p0.y, r->p0.z, r->eid, r->photonid, r->slen));
+    }
 
-#if defined(MCX_SAVE_DETECTORS) || defined(__NVCC__)
+#if defined(MCX_SAVE_DETECTORS) || defined(MMC_CUDA_KERNEL)
 
-#ifdef __NVCC__
+#ifdef MMC_CUDA_KERNEL
 
-            if (GPU_PARAM(gcfg, issavedet)) {
+    if (GPU_PARAM(gcfg, issavedet)) {
 #endif
 
-                if (r.eid <= 0) {
+        if (r->eid <= 0) {
 
-#if defined(MCX_SAVE_SEED) || defined(__NVCC__)
-                    savedetphoton(n_det, camsignals, detectedphoton, ppath, &r, gmed, ((GPU_PARAM(gcfg, isextdet) && type[oldeid - 1] == GPU_PARAM(gcfg, maxmedia) + 1) ? oldeid : -1), gcfg, photonseed, initseed);
-#else
-                    savedetphoton(n_det, camsignals, detectedphoton, ppath, &r, gmed, ((GPU_PARAM(gcfg, isextdet) && type[oldeid - 1] == GPU_PARAM(gcfg, maxmedia) + 1) ? oldeid : -1), gcfg, photonseed, NULL);
-#endif
-                }
+            savedetphoton(n_det, camsignals, detimage, detectedphoton, ppath, r, gmed, ((GPU_PARAM(gcfg, isextdet) && ELEM_TYPE(exiteid - 1) == GPU_PARAM(gcfg, maxmedia) + 1) ? exiteid : -1), gcfg, photonseed, initseed, detgrid);
+        }
 
-#ifdef __NVCC__
-            }
+#ifdef MMC_CUDA_KERNEL
+    }
 
 #endif
 
 #endif
+}
 
-            break;  /*photon exits boundary*/
-        }
+/**
+ * @brief Move a photon to its next scattering site, or until it terminates
+ *
+ * One iteration of the propagation loop of onephoton(): photonmove(), followed
+ * by photonexit() if the photon leaves the domain.
+ *
+ * \param[in,out] r: the state of the photon
+ * \param[in,out] fixcount: number of retries after the photon hit an edge or a vertex
+ * \param[in,out] ppath: the partial-path record of the photon
+ * \param[in,out] ran: the random number generator states
+ * \param[in] initseed: the RNG states at the launch, saved with a detected photon
+ * \return 1 if the photon terminated, 0 if it reached its next scattering site
+ */
 
-        //if(GPU_PARAM(gcfg,debuglevel)&dlMove)
-        GPUDEBUG(("M %f %f %f %d %u %e\n", r.p0.x, r.p0.y, r.p0.z, r.eid, id, r.slen));
+__device__ int photonstep(ray* r, int* fixcount, __local float* ppath, __local uint* accumcache, __constant MCXParam* gcfg, __global FLOAT3* node, __global int* elem, __global float* weight, __global float* dref, __global float* camsignals, __global float* detimage,
+                          __mesh int* type, __mesh int* facenb, __mesh float4* normal, __constant Medium* gmed,
+                          __global float* n_det, __global uint* detectedphoton, __private RandType* ran, int* raytet,
+                          __global float* replayweight, __global float* replaytime, __global int* replaydetid, __global RandType* photonseed, RandType* initseed, __global MCXReporter* reporter, __global float* gdebugdata,
+                          __global float* invcdf, __global const int* detgrid, __global const Medium* elemmed) {
+    int exiteid = 0;
+    int ret = photonmove(r, fixcount, &exiteid, ppath, accumcache, gcfg, node, elem, weight, type, facenb, normal, gmed, ran, raytet,
+                         replayweight, replaytime, replaydetid, reporter, gdebugdata, invcdf, elemmed);
+
+    if (ret == 2) {
+        photonexit(r, exiteid, ppath, gcfg, dref, camsignals, detimage, type, normal, gmed, n_det, detectedphoton, photonseed, initseed, detgrid);
+    }
 
-        if (GPU_PARAM(gcfg, minenergy) > 0.f && r.weight < GPU_PARAM(gcfg, minenergy) && (gcfg->tend - gcfg->tstart)*GPU_PARAM(gcfg, Rtstep) <= 1.f) { /*Russian Roulette*/
-            if (rand_do_roulette(ran)*GPU_PARAM(gcfg, roulettesize) <= 1.f) {
-                r.weight *= GPU_PARAM(gcfg, roulettesize);
-                //if(GPU_PARAM(gcfg,debuglevel)&dlWeight)
-                GPUDEBUG(("Russian Roulette bumps r.weight to %f\n", r.weight));
-            } else {
-                break;
-            }
+    return (ret != 0);
+}
+
+/**
+ * @brief Add the escaped weight of a terminated photon
+ *
+ * \param[in] r: the state of the photon at its termination
+ * \param[in] ppath: the partial-path record of the photon
+ * \param[in,out] energyesc: the escaped weight of each source pattern, incremented
+ */
+
+__device__ void photonend(ray* r, __local float* ppath, __local float* energyesc, __constant MCXParam* gcfg, __global MCXReporter* reporter, __global float* gdebugdata) {
+    if (GPU_PARAM(gcfg, debuglevel) & dlTraj) {
+        savedebugdata(r, r->photonid, reporter, gdebugdata, gcfg);
+    }
+
+    if (GPU_PARAM(gcfg, srcnum) == 1) {
+        *energyesc += r->weight;
+    } else {
+        for (int i = 0; i < GPU_PARAM(gcfg, srcnum); i++) {
+            energyesc[i] += r->weight * ppath[GPU_PARAM(gcfg, reclen) + i];
         }
+    }
+}
+
+#if defined(MMC_CUDA_KERNEL) || defined(MCX_DO_SPLIT)
+
+#define MAX_SPLIT_CLONE            4  /**< maximum number of pending copies of the split photon of a thread */
+#define PHOTON_IMPORTANCE(eid)     (((eid) > 0) ? ((__constant float*)(gmed + GPU_PARAM(gcfg, importoffset)))[ELEM_TYPE((eid) - 1)] : 1.f)
+
+/**
+ * @brief Split or roulette a photon at a scattering site by the importance of its medium (--importance)
+ *
+ * Same scheme as photon_split() of the CPU tracer: with v the ratio of the new
+ * to the last importance, the photon survives a roulette with a probability of
+ * v if v<1, otherwise it is split into n=floor(v) or floor(v)+1 copies; the k
+ * copies kept, as many as clone holds, carry n/(v*k) of the weight each.
+ *
+ * \param[in,out] r: the state of the photon
+ * \param[in,out] clone: the pending copies of the photon
+ * \param[in,out] nclone: number of pending copies in clone
+ * \param[in,out] imp: the importance of the last check, updated to newimp
+ * \param[in] newimp: the importance of the medium of the photon
+ * \param[in,out] ran: the random number generator states
+ * \return 0 if the photon is terminated by the roulette, 1 otherwise
+ */
 
-        float mom = 0.f;
-        r.slen0 = mc_next_scatter(gmed[type[r.eid - 1]].g, &r.vec, ran, gcfg, &mom);
-        r.slen = r.slen0;
+__device__ int photonsplit(ray* r, ray* clone, int* nclone, float* imp, float newimp, __private RandType* ran) {
+    float ratio = newimp / *imp;
+    int n = 1, k = 1;
 
-        if (GPU_PARAM(gcfg, debuglevel) & dlTraj) {
-            savedebugdata(&r, id, reporter, gdebugdata, gcfg);
+    if (ratio == 1.f) {
+        return 1;
+    }
+
+    *imp = newimp;
+
+    if (ratio < 1.f) {
+        if (rand_do_roulette(ran) >= ratio) {
+            r->weight = 0.f;
+            return 0;
         }
+    } else {
+        n = (int)ratio;
+        n += (rand_do_roulette(ran) < ratio - n);
+        k = min(n, MAX_SPLIT_CLONE - *nclone + 1);
+    }
 
-#if defined(MCX_SAVE_DETECTORS) || defined(__NVCC__)
+    r->weight *= n / (ratio * k);
 
-        if (GPU_PARAM(gcfg, issavedet)) {
-            if (GPU_PARAM(gcfg, ismomentum) && type[r.eid - 1] > 0) {             /*when ismomentum is set to 1*/
-                ppath[(GPU_PARAM(gcfg, maxmedia) << 1) + type[r.eid - 1] - 1] += mom;    /*the third medianum block stores the momentum transfer*/
-            }
+    for (int i = 1; i < k; i++) {
+        clone[*nclone] = *r;
+        clone[(*nclone)++].oldweight = 0.f;
+    }
+
+    return 1;
+}
+
+#endif
 
-            if (GPU_PARAM(gcfg, issavedet)) {
-                ppath[type[r.eid - 1] - 1] += 1.f;    /*the first medianum block stores the scattering event counts*/
+/**
+ * @brief The core Monte Carlo function simulating a single photon (!!!Important!!!)
+ *
+ * This is the core Monte Carlo simulation function. It simulates the life-time
+ * of a single photon packet, from launching to termination.
+ *
+ * \param[in] id: the linear index of the current photon, starting from 0.
+ * \param[in] tracer: the ray-tracer aux data structure
+ * \param[in] mesh: the mesh data structure
+ * \param[in,out] ran: the random number generator states
+ * \param[in,out] cfg: simulation configuration structure
+ * \param[out] visit: statistics counters of this thread
+ */
+
+__device__ void onephoton(unsigned int id, __local float* ppath, __local uint* accumcache, __constant MCXParam* gcfg, __global FLOAT3* node, __global int* elem, __global float* weight, __global float* dref, __global float* camsignals, __global float* detimage,
+                          __mesh int* type, __mesh int* facenb,  __global int* srcelem, __mesh float4* normal, __constant Medium* gmed,
+                          __global float* n_det, __global uint* detectedphoton, __local float* energytot, __local float* energyesc, __private RandType* ran, int* raytet, __global float* srcpattern,
+                          __global float* replayweight, __global float* replaytime, __global int* replaydetid, __global RandType* photonseed, __global MCXReporter* reporter, __global float* gdebugdata,
+                          __global float* invcdf, __global const int* detgrid, __global const Medium* elemmed) {
+
+    ray r;
+    int fixcount = 0;
+#if defined(MCX_SAVE_SEED) || defined(MMC_CUDA_KERNEL)
+    RandType initseed[RAND_BUF_LEN] = {NULL};
+#else
+    RandType* initseed = NULL;
+#endif
+
+    clearpath(energytot, GPU_PARAM(gcfg, srcnum));
+    clearpath(energyesc, GPU_PARAM(gcfg, srcnum));
+
+    photonlaunch(id, &r, ppath, energytot, gcfg, node, elem, srcelem, ran, srcpattern, initseed, reporter, gdebugdata);
+
+    /*use Kahan summation to accumulate weight, otherwise, counter stops at 16777216*/
+    /*http://stackoverflow.com/questions/2148149/how-to-sum-a-large-number-of-float-number*/
+
+#if defined(MMC_CUDA_KERNEL) || defined(MCX_DO_SPLIT)
+    ray clone[MAX_SPLIT_CLONE];
+    int nclone = 0;
+    float imp = PHOTON_IMPORTANCE(r.eid);
+#endif
+
+    for (;;) {
+        /*propagate a photon until exit*/
+        while (!photonstep(&r, &fixcount, ppath, accumcache, gcfg, node, elem, weight, dref, camsignals, detimage, type, facenb, normal, gmed, n_det, detectedphoton, ran, raytet,
+                           replayweight, replaytime, replaydetid, photonseed, initseed, reporter, gdebugdata, invcdf, detgrid, elemmed)) {
+#if defined(MMC_CUDA_KERNEL) || defined(MCX_DO_SPLIT)
+
+            if (GPU_PARAM(gcfg, importoffset) && !photonsplit(&r, clone, &nclone, &imp, PHOTON_IMPORTANCE(r.eid), ran)) {
+                break;
             }
+
+#endif
+        }
+
+        photonend(&r, ppath, energyesc, gcfg, reporter, gdebugdata);
+
+#if defined(MMC_CUDA_KERNEL) || defined(MCX_DO_SPLIT)
+
+        /*the pending copies of a split photon share its partial-path record, which is only kept for the source patterns*/
+        if (nclone > 0) {
+            r = clone[--nclone];
+            imp = PHOTON_IMPORTANCE(r.eid);
+            fixcount = 0;
+            continue;
         }
 
 #endif
+        break;
     }
+}
 
-    if (GPU_PARAM(gcfg, debuglevel) & dlTraj) {
-        savedebugdata(&r, id, reporter, gdebugdata, gcfg);
+#if defined(MMC_CUDA_KERNEL) || defined(USE_LOCAL_MESH)
+
+/**
+ * @brief Copy the per-step mesh buffers of a small mesh to the local memory of the work-group
+ *
+ * The copy of the normal buffer, 4 float4 per element, is followed by those of type and facenb,
+ * which the packed mesh does not need. The host only sets islocalmesh (or USE_LOCAL_MESH) if
+ * they fit next to the other shared records.
+ *
+ * @param[in] cache: the local memory after the accumulation cache, aligned to a float4
+ * @return the copy of the normal buffer
+ */
+
+__device__ __local float4* cachemesh(__local float* cache, __constant MCXParam* gcfg, __global float4* normal, __global int* type, __global int* facenb) {
+    __local float4* meshnormal = (__local float4*)cache;
+    __local int* meshtype = (__local int*)(meshnormal + (gcfg->ne << 2));
+
+    for (int i = get_local_id(0); i < (gcfg->ne << 2); i += get_local_size(0)) {
+        meshnormal[i] = normal[i];
     }
 
-    if (GPU_PARAM(gcfg, srcnum) == 1) {
-        *energyesc += r.weight;
-    } else {
-        for (oldeid = 0; oldeid < GPU_PARAM(gcfg, srcnum); oldeid++) {
-            energyesc[oldeid] += r.weight * ppath[GPU_PARAM(gcfg, reclen) + oldeid];
+    if (!PACKED_MESH) {
+        for (int i = get_local_id(0); i < gcfg->ne; i += get_local_size(0)) {
+            meshtype[i] = type[i];
+        }
+
+        for (int i = get_local_id(0); i < gcfg->ne * GPU_PARAM(gcfg, elemlen); i += get_local_size(0)) {
+            meshtype[gcfg->ne + i] = facenb[i];
         }
     }
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+    return meshnormal;
 }
 
+#endif
+
 __kernel void mmc_main_loop(const int nphoton, const int ophoton,
-#ifndef __NVCC__
+#ifndef MMC_CUDA_KERNEL
     __constant__ MCXParam* gcfg, __local float* sharedmem, __constant__ Medium* gmed,
 #endif
                             __global FLOAT3* node, __global int* elem,  __global float* weight, __global float* dref, __global float* camsignals, __global int* type, __global int* facenb,  __global int* srcelem, __global float4* normal,
                             __global float* n_det, __global uint* detectedphoton,
                             __global uint* n_seed, __global int* progress, __global float* energy, __global MCXReporter* reporter, __global float* srcpattern,
-                            __global float* replayweight, __global float* replaytime, __global RandType* replayseed, __global RandType* photonseed, __global float* gdebugdata) {
+                            __global float* replayweight, __global float* replaytime, __global RandType* replayseed, __global RandType* photonseed, __global float* gdebugdata,
+                            __global float* detimage, __global int* replaydetid, __global float* invcdf, __global int* detgrid, __global Medium* elemmed) {
 
     RandType t[RAND_BUF_LEN];
     int idx = get_global_id(0);
     int raytet = 0;
 
-#ifdef __NVCC__
+#ifdef MMC_CUDA_KERNEL
     extern __shared__ float sharedmem[];
 #endif
 
-    if (GPU_PARAM(gcfg, seed) != SEED_FROM_FILE) {
+    /*the accumulation cache follows the per-thread energy and partial-path records*/
+    __local uint* accumcache = (__local uint*)(sharedmem + get_local_size(0) * ((GPU_PARAM(gcfg, srcnum) << 1) +
+                               GPU_PARAM(gcfg, reclen) + (GPU_PARAM(gcfg, srcnum) > 1) * GPU_PARAM(gcfg, srcnum)));
+
+#ifdef USE_ATOMIC
+
+    for (int i = get_local_id(0); i < MAX_ACCUM_CACHE; i += get_local_size(0)) {
+        accumcache[i] = ACCUM_CACHE_EMPTY;
+        ((__local float*)accumcache)[MAX_ACCUM_CACHE + i] = 0.f;
+    }
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+#endif
+
+    /*the mesh copy follows the accumulation cache, rounded up to a float4*/
+#if defined(MMC_CUDA_KERNEL) || defined(USE_LOCAL_MESH)
+    __local float* meshcache = (__local float*)accumcache;
+#ifdef USE_ATOMIC
+    meshcache += MAX_ACCUM_CACHE << 1;
+#endif
+    meshcache += (4 - ((meshcache - sharedmem) & 3)) & 3;
+#endif
+
+#if defined(USE_LOCAL_MESH) && !defined(MMC_CUDA_KERNEL)
+    __local float4* meshnormal = cachemesh(meshcache, gcfg, normal, type, facenb);
+    __local int* meshtype = (__local int*)(meshnormal + (gcfg->ne << 2)), *meshfacenb = meshtype + gcfg->ne;
+#else
+    __global float4* meshnormal = normal;
+    __global int* meshtype = type, *meshfacenb = facenb;
+#ifdef MMC_CUDA_KERNEL
+
+    if (LOCAL_MESH) {
+        meshnormal = cachemesh(meshcache, gcfg, normal, type, facenb);
+        meshtype = (int*)(meshnormal + (gcfg->ne << 2));
+        meshfacenb = meshtype + gcfg->ne;
+    }
+
+#endif
+#endif
+
+    if (gcfg->seed != SEED_FROM_FILE) {
         gpu_rng_init(t, n_seed, idx);
     }
 
-    /*launch photons*/
-    for (int i = 0; i < nphoton + (idx < ophoton); i++) {
-        if (GPU_PARAM(gcfg, seed) == SEED_FROM_FILE)
+    /*with the Philox RNG, a photon has the same stream whichever device, respin or thread runs it*/
+    uint photonoffset = reporter->photonoffset;
+
+    /*launch photons: either a fixed share per thread, or, in the persistent mode, the next
+      photon not yet taken by any thread until all nphoton*threads+ophoton are launched*/
+    for (int i = 0; ; i++) {
+        uint id;
+
+        if (GPU_PARAM(gcfg, ispersistent)) {
+#if defined(MCX_SAVE_DETECTORS) || defined(MMC_CUDA_KERNEL)
+
+            /*each thread has at most one photon in flight, detected at most once: stop while they all fit
+              in the detected photon buffer, the host drains it and launches the photons not taken*/
+            if (GPU_PARAM(gcfg, ispersistent) == 2 && atomic_add(detectedphoton, 0) + get_global_size(0) > GPU_PARAM(gcfg, maxdetphoton)) {
+                break;
+            }
+
+#endif
+            id = atomic_inc(&reporter->photonid);
+
+            if (id >= (uint)(nphoton * get_global_size(0) + ophoton)) {
+                break;
+            }
+        } else if (i < nphoton + (idx < ophoton)) {
+            id = idx * nphoton + MIN(idx, ophoton) + i;
+        } else {
+            break;
+        }
+
+        if (gcfg->seed == SEED_FROM_FILE) {
             for (int j = 0; j < RAND_BUF_LEN; j++) {
-                t[j] = replayseed[(idx * nphoton + MIN(idx, ophoton) + i) * RAND_BUF_LEN + j];
+                t[j] = replayseed[id * RAND_BUF_LEN + j];
             }
+        } else if (MCX_RNG_COUNTER) {
+            t[1] = (RandType)(photonoffset + id) << 32;
+        }
 
-        onephoton(idx * nphoton + MIN(idx, ophoton) + i, sharedmem + get_local_size(0) * (GPU_PARAM(gcfg, srcnum) << 1) +
-                  get_local_id(0) * (GPU_PARAM(gcfg, reclen) + (GPU_PARAM(gcfg, srcnum) > 1) * GPU_PARAM(gcfg, srcnum)), gcfg, node, elem,
-                  weight, dref, camsignals, type, facenb, srcelem, normal, gmed, n_det, detectedphoton, sharedmem + get_local_id(0) * GPU_PARAM(gcfg, srcnum),
+        onephoton(id, sharedmem + get_local_size(0) * (GPU_PARAM(gcfg, srcnum) << 1) +
+                  get_local_id(0) * (GPU_PARAM(gcfg, reclen) + (GPU_PARAM(gcfg, srcnum) > 1) * GPU_PARAM(gcfg, srcnum)), accumcache, gcfg, node, elem,
+                  weight, dref, camsignals, detimage, meshtype, meshfacenb, srcelem, meshnormal, gmed, n_det, detectedphoton, sharedmem + get_local_id(0) * GPU_PARAM(gcfg, srcnum),
                   sharedmem + (get_local_size(0) + get_local_id(0)) * GPU_PARAM(gcfg, srcnum), t, &raytet,
-                  srcpattern, replayweight, replaytime, photonseed, reporter, gdebugdata);
+                  srcpattern, replayweight, replaytime, replaydetid, photonseed, reporter, gdebugdata, invcdf, detgrid, elemmed);
+
+        if (GPU_PARAM(gcfg, ispersistent) && (GPU_PARAM(gcfg, debuglevel) & MCX_DEBUG_PROGRESS) && progress) {
+            atomic_inc(progress);
+        }
     }
 
     for (int i = 0; i < GPU_PARAM(gcfg, srcnum); i++) {
@@ -1909,9 +2593,431 @@ __kernel void mmc_main_loop(const int nphoton, const int ophoton,
         energy[((idx << 1) + 1) * GPU_PARAM(gcfg, srcnum) + i] += sharedmem[get_local_id(0) * GPU_PARAM(gcfg, srcnum) + i];
     }
 
-    if (GPU_PARAM(gcfg, debuglevel) & MCX_DEBUG_PROGRESS && progress) {
+#ifdef USE_ATOMIC
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for (int i = get_local_id(0); i < MAX_ACCUM_CACHE; i += get_local_size(0)) {
+        if (accumcache[i] != ACCUM_CACHE_EMPTY) {
+            atomicdeposit(weight, accumcache[i], ((__local float*)accumcache)[MAX_ACCUM_CACHE + i], gcfg->crop0.w);
+        }
+    }
+
+#endif
+
+    if (!GPU_PARAM(gcfg, ispersistent) && (GPU_PARAM(gcfg, debuglevel) & MCX_DEBUG_PROGRESS) && progress) {
         atomic_inc(progress);
     }
 
     atomicadd(&(reporter->raytet), raytet);
 }
+
+#ifdef MMC_CUDA_KERNEL
+
+/*the sorted mode (--gpusort), launched by the CUDA host only*/
+
+#define MMC_SORT_IDLE        0xFFFFFFFFU                           /**< photonid of a state slot without a photon in flight */
+#define MMC_SORT_LANES       ((int)(sizeof(ray) / sizeof(float4))) /**< float4 lanes of a photon state, followed by one lane of RNG states */
+#define MMC_SORT_SCAN_BLOCK  1024                                  /**< threads of the single-block scan of the bin counts */
+#define MMC_SORT_BINS        (1 << 16)                             /**< max element bins of the photon sort */
+
+/**
+ * @brief Advance the photons of the sorted mode by at most nstep scattering events
+ *
+ * The photon states outlive a launch in a structure-of-arrays buffer: lane k of
+ * slot s is state[k * nslot + s], followed by the RNG state in the last lane.
+ * Thread idx works on slot order[idx], which mmc_sort_scatter() groups by the
+ * enclosing element, so that the threads of a warp read nearby mesh elements.
+ * An idle slot first launches the next photon not yet taken from reporter->photonid,
+ * with the same photon-indexed Philox stream as mmc_main_loop. The element bin
+ * of each slot, nbin if it is idle, is counted in binhist for the next sort.
+ */
+
+__kernel void mmc_sort_loop(const int nphoton, const int ophoton, const int pass, const int nstep, __global uint* order,
+                            __global float4* state, __global int* statefix, __global float* stateppath, __global uint* statebin, __global uint* binhist, const uint nbin,
+                            __global FLOAT3* node, __global int* elem, __global float* weight, __global float* dref, __global float* camsignals, __global int* type, __global int* facenb,
+                            __global int* srcelem, __global float4* normal, __global float* n_det, __global uint* detectedphoton,
+                            __global uint* n_seed, __global int* progress, __global float* energy, __global MCXReporter* reporter, __global float* srcpattern,
+                            __global float* detimage, __global float* invcdf, __global int* detgrid, __global Medium* elemmed) {
+
+    RandType t[RAND_BUF_LEN];
+    ray r;
+    int idx = get_global_id(0), nslot = get_global_size(0);
+    int raytet = 0, fixcount = 0;
+    uint slot = (pass > 0) ? order[idx] : idx, bin;
+    uint ntotal = (uint)(nphoton * nslot + ophoton);
+    __global RandType* rngstate = (__global RandType*)(state + MMC_SORT_LANES * nslot);
+    __global float* ppath = stateppath + (size_t)slot * (GPU_PARAM(gcfg, reclen) + (GPU_PARAM(gcfg, srcnum) > 1) * GPU_PARAM(gcfg, srcnum));
+
+    extern __shared__ float sharedmem[];
+
+    /*the partial paths are kept with the photon states, the shared memory only holds the energy sums and the accumulation cache*/
+    __local float* energytot = sharedmem + get_local_id(0) * GPU_PARAM(gcfg, srcnum);
+    __local float* energyesc = sharedmem + (get_local_size(0) + get_local_id(0)) * GPU_PARAM(gcfg, srcnum);
+    __local uint* accumcache = (__local uint*)(sharedmem + get_local_size(0) * (GPU_PARAM(gcfg, srcnum) << 1));
+
+#ifdef USE_ATOMIC
+
+    for (int i = get_local_id(0); i < MAX_ACCUM_CACHE; i += get_local_size(0)) {
+        accumcache[i] = ACCUM_CACHE_EMPTY;
+        ((__local float*)accumcache)[MAX_ACCUM_CACHE + i] = 0.f;
+    }
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+#endif
+
+    clearpath(energytot, GPU_PARAM(gcfg, srcnum));
+    clearpath(energyesc, GPU_PARAM(gcfg, srcnum));
+
+    if (pass == 0) {
+        gpu_rng_init(t, n_seed, slot);
+        r.photonid = MMC_SORT_IDLE;
+    } else {
+        for (int i = 0; i < MMC_SORT_LANES; i++) {
+            ((float4*)&r)[i] = state[i * nslot + slot];
+        }
+
+        t[0] = rngstate[slot << 1];
+        t[1] = rngstate[(slot << 1) + 1];
+        fixcount = statefix[slot];
+    }
+
+    /*the counter is only bumped while photons are left, so that it can not wrap over many passes*/
+    if (r.photonid == MMC_SORT_IDLE && atomic_add(&reporter->photonid, 0) < ntotal) {
+        uint id = atomic_inc(&reporter->photonid);
+
+        if (id < ntotal) {
+            if (MCX_RNG_COUNTER) {
+                t[1] = (RandType)(reporter->photonoffset + id) << 32;
+            }
+
+            photonlaunch(id, &r, ppath, energytot, gcfg, node, elem, srcelem, t, srcpattern, NULL, reporter, NULL);
+            fixcount = 0;
+        }
+    }
+
+    for (int i = 0; i < nstep && r.photonid != MMC_SORT_IDLE; i++) {
+        if (photonstep(&r, &fixcount, ppath, accumcache, gcfg, node, elem, weight, dref, camsignals, detimage, type, facenb, normal, gmed, n_det, detectedphoton, t, &raytet,
+                       NULL, NULL, NULL, NULL, NULL, reporter, NULL, invcdf, detgrid, elemmed)) {
+            photonend(&r, ppath, energyesc, gcfg, reporter, NULL);
+            r.photonid = MMC_SORT_IDLE;
+
+            if ((GPU_PARAM(gcfg, debuglevel) & MCX_DEBUG_PROGRESS) && progress) {
+                atomic_inc(progress);
+            }
+        }
+    }
+
+    for (int i = 0; i < MMC_SORT_LANES; i++) {
+        state[i * nslot + slot] = ((float4*)&r)[i];
+    }
+
+    rngstate[slot << 1] = t[0];
+    rngstate[(slot << 1) + 1] = t[1];
+    statefix[slot] = fixcount;
+
+    /*the bins follow the element index, which is spatially coherent after --reorder*/
+    bin = (r.photonid == MMC_SORT_IDLE) ? nbin : MIN((uint)(((ulong)(r.eid - 1) * nbin) / GPU_PARAM(gcfg, ne)), nbin - 1);
+    statebin[slot] = bin;
+    atomic_inc(binhist + bin);
+
+    for (int i = 0; i < GPU_PARAM(gcfg, srcnum); i++) {
+        energy[(idx << 1) * GPU_PARAM(gcfg, srcnum) + i] += energyesc[i];
+        energy[((idx << 1) + 1) * GPU_PARAM(gcfg, srcnum) + i] += energytot[i];
+    }
+
+#ifdef USE_ATOMIC
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for (int i = get_local_id(0); i < MAX_ACCUM_CACHE; i += get_local_size(0)) {
+        if (accumcache[i] != ACCUM_CACHE_EMPTY) {
+            atomicdeposit(weight, accumcache[i], ((__local float*)accumcache)[MAX_ACCUM_CACHE + i], gcfg->crop0.w);
+        }
+    }
+
+#endif
+
+    atomicadd(&(reporter->raytet), raytet);
+}
+
+/**
+ * @brief Turn the counts of the nbin+1 element bins into the first slot position of each bin
+ *
+ * Runs as a single block of MMC_SORT_SCAN_BLOCK threads: each thread sums a
+ * contiguous range of bins, the block scans the partial sums, then each thread
+ * writes the exclusive prefix sums of its range.
+ */
+
+__kernel void mmc_sort_scan(__global uint* binhist, const uint nbin) {
+    __shared__ uint partial[MMC_SORT_SCAN_BLOCK];
+    int tid = get_local_id(0);
+    uint len = (nbin + MMC_SORT_SCAN_BLOCK) / MMC_SORT_SCAN_BLOCK;
+    uint first = tid * len, last = MIN(first + len, nbin + 1), sum = 0;
+
+    for (uint i = first; i < last; i++) {
+        sum += binhist[i];
+    }
+
+    partial[tid] = sum;
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for (int offset = 1; offset < MMC_SORT_SCAN_BLOCK; offset <<= 1) {
+        uint add = (tid >= offset) ? partial[tid - offset] : 0;
+        barrier(CLK_LOCAL_MEM_FENCE);
+        partial[tid] += add;
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    sum = partial[tid] - sum;
+
+    for (uint i = first; i < last; i++) {
+        uint count = binhist[i];
+        binhist[i] = sum;
+        sum += count;
+    }
+}
+
+/**
+ * @brief List the state slots bin by bin in order, where binhist holds the first position of each bin
+ */
+
+__kernel void mmc_sort_scatter(__global uint* statebin, __global uint* binhist, __global uint* order, const int nslot) {
+    int slot = get_global_id(0);
+
+    if (slot < nslot) {
+        order[atomic_inc(binhist + statebin[slot])] = slot;
+    }
+}
+
+/*
+   the split mode (--fission), launched by the CUDA host only: the photon launch, the propagation
+   and the boundary records run as 3 kernels, so that the propagation kernel, which runs the most,
+   does not hold the registers of the source and detector code; they share the sorted mode states
+*/
+
+#define MMC_FISSION_IDLE  0  /**< state flag of a slot without a photon in flight */
+#define MMC_FISSION_MOVE  1  /**< the photon of the slot is advanced by mmc_fission_move */
+#define MMC_FISSION_END   2  /**< the photon terminated, its escaped weight is added by mmc_fission_record */
+#define MMC_FISSION_EXIT  3  /**< the photon left the domain, mmc_fission_record also saves its exit records */
+
+/**
+ * @brief Launch the next photons not yet taken from reporter->photonid on the idle slots of the split mode
+ *
+ * The launched states are written to the structure-of-arrays buffers of the sorted
+ * mode, see mmc_sort_loop, and the launched weight to the per-thread energy counters.
+ */
+
+__kernel void mmc_fission_launch(const int nphoton, const int ophoton, const int pass, __global float4* state, __global int* statefix, __global float* stateppath, __global int* stateflag,
+                                 __global FLOAT3* node, __global int* elem, __global int* srcelem, __global uint* n_seed, __global float* energy, __global MCXReporter* reporter, __global float* srcpattern) {
+
+    RandType t[RAND_BUF_LEN];
+    ray r;
+    int slot = get_global_id(0), nslot = get_global_size(0);
+    uint ntotal = (uint)(nphoton * nslot + ophoton), id;
+    __global RandType* rngstate = (__global RandType*)(state + MMC_SORT_LANES * nslot);
+    __global float* ppath = stateppath + (size_t)slot * (GPU_PARAM(gcfg, reclen) + (GPU_PARAM(gcfg, srcnum) > 1) * GPU_PARAM(gcfg, srcnum));
+
+    extern __shared__ float sharedmem[];
+    __local float* energytot = sharedmem + get_local_id(0) * GPU_PARAM(gcfg, srcnum);
+
+    if (pass > 0 && stateflag[slot] != MMC_FISSION_IDLE) {
+        return;
+    }
+
+    stateflag[slot] = MMC_FISSION_IDLE;
+
+    /*the counter is only bumped while photons are left, so that it can not wrap over many passes*/
+    if (atomic_add(&reporter->photonid, 0) >= ntotal || (id = atomic_inc(&reporter->photonid)) >= ntotal) {
+        return;
+    }
+
+    if (pass == 0) {
+        gpu_rng_init(t, n_seed, slot);
+    } else {
+        t[0] = rngstate[slot << 1];
+        t[1] = rngstate[(slot << 1) + 1];
+    }
+
+    if (MCX_RNG_COUNTER) {
+        t[1] = (RandType)(reporter->photonoffset + id) << 32;
+    }
+
+    clearpath(energytot, GPU_PARAM(gcfg, srcnum));
+    photonlaunch(id, &r, ppath, energytot, gcfg, node, elem, srcelem, t, srcpattern, NULL, reporter, NULL);
+
+    for (int i = 0; i < MMC_SORT_LANES; i++) {
+        state[i * nslot + slot] = ((float4*)&r)[i];
+    }
+
+    rngstate[slot << 1] = t[0];
+    rngstate[(slot << 1) + 1] = t[1];
+    statefix[slot] = 0;
+    stateflag[slot] = MMC_FISSION_MOVE;
+
+    for (int i = 0; i < GPU_PARAM(gcfg, srcnum); i++) {
+        energy[((slot << 1) + 1) * GPU_PARAM(gcfg, srcnum) + i] += energytot[i];
+    }
+}
+
+/**
+ * @brief Advance the photons of the split mode by at most nstep scattering events
+ *
+ * Only the propagation, photonmove(), runs here; a photon that terminates is
+ * flagged for mmc_fission_record, and the last element of a photon leaving the
+ * domain takes the place of its retry count in statefix.
+ */
+
+__kernel void mmc_fission_move(const int nstep, __global float4* state, __global int* statefix, __global float* stateppath, __global int* stateflag,
+                               __global FLOAT3* node, __global int* elem, __global float* weight, __global int* type, __global int* facenb, __global float4* normal,
+                               __global MCXReporter* reporter, __global float* invcdf, __global Medium* elemmed) {
+
+    RandType t[RAND_BUF_LEN];
+    ray r;
+    int slot = get_global_id(0), nslot = get_global_size(0);
+    int raytet = 0, fixcount, exiteid = 0, ret = 0;
+    __global RandType* rngstate = (__global RandType*)(state + MMC_SORT_LANES * nslot);
+    __global float* ppath = stateppath + (size_t)slot * (GPU_PARAM(gcfg, reclen) + (GPU_PARAM(gcfg, srcnum) > 1) * GPU_PARAM(gcfg, srcnum));
+
+    extern __shared__ float sharedmem[];
+    __local uint* accumcache = (__local uint*)sharedmem;
+
+#ifdef USE_ATOMIC
+
+    for (int i = get_local_id(0); i < MAX_ACCUM_CACHE; i += get_local_size(0)) {
+        accumcache[i] = ACCUM_CACHE_EMPTY;
+        ((__local float*)accumcache)[MAX_ACCUM_CACHE + i] = 0.f;
+    }
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+#endif
+
+    if (stateflag[slot] == MMC_FISSION_MOVE) {
+        for (int i = 0; i < MMC_SORT_LANES; i++) {
+            ((float4*)&r)[i] = state[i * nslot + slot];
+        }
+
+        t[0] = rngstate[slot << 1];
+        t[1] = rngstate[(slot << 1) + 1];
+        fixcount = statefix[slot];
+
+        for (int i = 0; i < nstep && ret == 0; i++) {
+            ret = photonmove(&r, &fixcount, &exiteid, ppath, accumcache, gcfg, node, elem, weight, type, facenb, normal, gmed, t, &raytet,
+                             NULL, NULL, NULL, reporter, NULL, invcdf, elemmed);
+        }
+
+        for (int i = 0; i < MMC_SORT_LANES; i++) {
+            state[i * nslot + slot] = ((float4*)&r)[i];
+        }
+
+        rngstate[slot << 1] = t[0];
+        rngstate[(slot << 1) + 1] = t[1];
+        statefix[slot] = (ret == 2) ? exiteid : fixcount;
+        stateflag[slot] = (ret == 0) ? MMC_FISSION_MOVE : ((ret == 2) ? MMC_FISSION_EXIT : MMC_FISSION_END);
+    }
+
+#ifdef USE_ATOMIC
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for (int i = get_local_id(0); i < MAX_ACCUM_CACHE; i += get_local_size(0)) {
+        if (accumcache[i] != ACCUM_CACHE_EMPTY) {
+            atomicdeposit(weight, accumcache[i], ((__local float*)accumcache)[MAX_ACCUM_CACHE + i], gcfg->crop0.w);
+        }
+    }
+
+#endif
+
+    atomicadd(&(reporter->raytet), raytet);
+}
+
+/**
+ * @brief Save the boundary records and the escaped weight of the photons terminated in mmc_fission_move
+ *
+ * The slots are then idle; their number is counted in nidle, so that the host
+ * stops the passes once all slots are idle and no photon is left.
+ */
+
+__kernel void mmc_fission_record(__global float4* state, __global int* statefix, __global float* stateppath, __global int* stateflag, __global uint* nidle,
+                                 __global float* dref, __global float* camsignals, __global float* detimage, __global int* type, __global float4* normal,
+                                 __global float* n_det, __global uint* detectedphoton, __global int* progress, __global float* energy, __global MCXReporter* reporter, __global int* detgrid) {
+
+    ray r;
+    int slot = get_global_id(0), nslot = get_global_size(0), flag = stateflag[slot];
+    __global float* ppath = stateppath + (size_t)slot * (GPU_PARAM(gcfg, reclen) + (GPU_PARAM(gcfg, srcnum) > 1) * GPU_PARAM(gcfg, srcnum));
+
+    extern __shared__ float sharedmem[];
+    __local float* energyesc = sharedmem + get_local_id(0) * GPU_PARAM(gcfg, srcnum);
+
+    if (flag == MMC_FISSION_END || flag == MMC_FISSION_EXIT) {
+        for (int i = 0; i < MMC_SORT_LANES; i++) {
+            ((float4*)&r)[i] = state[i * nslot + slot];
+        }
+
+        if (flag == MMC_FISSION_EXIT) {
+            photonexit(&r, statefix[slot], ppath, gcfg, dref, camsignals, detimage, type, normal, gmed, n_det, detectedphoton, NULL, NULL, detgrid);
+        }
+
+        clearpath(energyesc, GPU_PARAM(gcfg, srcnum));
+        photonend(&r, ppath, energyesc, gcfg, reporter, NULL);
+
+        for (int i = 0; i < GPU_PARAM(gcfg, srcnum); i++) {
+            energy[(slot << 1) * GPU_PARAM(gcfg, srcnum) + i] += energyesc[i];
+        }
+
+        if ((GPU_PARAM(gcfg, debuglevel) & MCX_DEBUG_PROGRESS) && progress) {
+            atomic_inc(progress);
+        }
+
+        stateflag[slot] = flag = MMC_FISSION_IDLE;
+    }
+
+    if (flag == MMC_FISSION_IDLE) {
+        atomic_inc(nidle);
+    }
+}
+
+#endif
+
+#ifndef MMC_CUDA_KERNEL
+
+/**
+ * @brief Sum the per-thread energy counters of mmc_main_loop on the device
+ *
+ * Work-group g adds column g of the (nthread*2) x srcnum counters: the escaped
+ * (g < srcnum) or the launched (g >= srcnum) energy of source g % srcnum, so that
+ * the host reads 2*srcnum totals instead of the whole buffer. Double precision is
+ * optional in OpenCL, so each work-item keeps a compensated (Kahan) sum and the
+ * group merges them with the error-free two-sum; sum[g] holds the rounded total in
+ * .x and its residual in .y. The local size must be a power of 2.
+ */
+
+__kernel void mmc_sum_energy(__global const float* energy, __global float2* sum, const uint nthread, __local float2* partial) {
+    uint col = get_group_id(0), srcnum = get_num_groups(0) >> 1, tid = get_local_id(0);
+    float s = 0.f, c = 0.f, y, t;
+
+    for (uint i = tid; i < nthread; i += get_local_size(0)) {
+        y = energy[(i << 1) * srcnum + col] - c;
+        t = s + y;
+        c = (t - s) - y;
+        s = t;
+    }
+
+    partial[tid] = (float2)(s, -c);
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for (uint offset = get_local_size(0) >> 1; offset > 0; offset >>= 1) {
+        if (tid < offset) {
+            float2 a = partial[tid], b = partial[tid + offset];
+
+            s = a.x + b.x;
+            y = s - a.x;
+            partial[tid] = (float2)(s, ((a.x - (s - y)) + (b.x - y)) + (a.y + b.y));
+        }
+
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    if (tid == 0) {
+        sum[col] = partial[0];
+    }
+}
+
+#endif
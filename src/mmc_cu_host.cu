@@ -32,6 +32,7 @@
 
 #include "mmc_const.h"
 #include "mmc_cu_host.h"
+#include "mmc_hip.h"
 #include "mmc_tictoc.h"
 #include <stdint.h>
 #include <stdlib.h>
@@ -152,15 +153,24 @@ int mcx_list_cu_gpu(mcconfig* cfg, GPUInfo** info) {
         (*info)[dev].regcount = dp.regsPerBlock;
         (*info)[dev].clock = dp.clockRate;
         (*info)[dev].sm = dp.multiProcessorCount;
-        (*info)[dev].core =
-            dp.multiProcessorCount * mcx_corecount(dp.major, dp.minor);
         (*info)[dev].maxmpthread = dp.maxThreadsPerMultiProcessor;
         (*info)[dev].maxgate = cfg->maxgate;
+#ifdef __HIPCC__
+        /*AMD GPUs: 64 lanes per CU, a block of 4 wavefronts (wave64 on CDNA, wave32 on RDNA)*/
+        (*info)[dev].core = dp.multiProcessorCount * 64;
+        (*info)[dev].autoblock = dp.warpSize * 4;
+        (*info)[dev].autothread = (*info)[dev].maxmpthread * (*info)[dev].sm;
+        (*info)[dev].vendor = dvAMD;
+#else
+        (*info)[dev].core =
+            dp.multiProcessorCount * mcx_corecount(dp.major, dp.minor);
         (*info)[dev].autoblock =
             (*info)[dev].maxmpthread / mcx_smxblock(dp.major, dp.minor);
         (*info)[dev].autothread = (*info)[dev].autoblock *
                                   mcx_smxblock(dp.major, dp.minor) *
                                   (*info)[dev].sm;
+        (*info)[dev].vendor = dvNVIDIA;
+#endif
 
         if (strncmp(dp.name, "Device Emulation", 16)) {
             if (cfg->isgpuinfo) {
@@ -201,14 +211,293 @@ int mcx_list_cu_gpu(mcconfig* cfg, GPUInfo** info) {
 #endif
 }
 
+/**
+ * \brief Mesh buffers kept on a GPU between runs of the same mesh session
+ *
+ * When cfg->meshsession is non-zero, the node, elem, type, facenb and normal
+ * buffers outlive mmc_run_simulation(); a later run with the same session id,
+ * mesh dimensions and ray-tracing method uses them without uploading the mesh.
+ */
+
+typedef struct MMC_cumeshcache {
+    int session;                   /**< cfg->meshsession of the run that created the buffers, 0 if empty */
+    int nn;                        /**< number of nodes */
+    int ne;                        /**< number of elements */
+    int elemlen;                   /**< number of nodes per element */
+    int method;                    /**< ray-tracing method, determines the normal buffer */
+    int ispackmesh;                /**< 1 if the normal buffer holds the packed element records */
+    int halffacenum;               /**< number of faces in the shared face table of --halfface, 0 if not used */
+    float3* gnode;
+    int4* gelem, *gfacenb;
+    int* gtype;
+    float4* gnormal;
+} cumeshcache;
+
+static cumeshcache cumesh[MAX_DEVICE];
+
+#define MMC_REDUCE_BLOCK    256               /**< thread block size of the output accumulation kernels */
+#define MMC_REDUCE_GRID     4096              /**< max blocks of the grid-stride output accumulation kernels */
+#define MMC_PEER_CHUNK      (1 << 22)         /**< doubles per peer-to-peer copy when reducing the device outputs */
+
+/**
+ * \brief Double-precision output sums of one GPU, shared with the device reducing them
+ */
+
+typedef struct MMC_cuoutput {
+    int gpuid;                     /**< 0-based CUDA device that owns the buffers */
+    double* gfield;                /**< device sum of the fluence output of all respins */
+    double* gdref;                 /**< device sum of the surface diffuse reflectance of all respins */
+} cuoutput;
+
+static cuoutput cuout[MAX_DEVICE];
+
+static uint curngkey = 0;                     /**< the Philox key shared by all devices, set before the device threads start */
+
+/**
+ * @brief Add a float output buffer, and optionally its second half, to a double-precision sum and clear it
+ *
+ * @param[in,out] sum: the device-side double-precision sum of length len
+ * @param[in,out] buf: the float output buffer written by the kernel, zeroed on return
+ * @param[in] len: length of the sum
+ * @param[in] stride: if non-zero, buf[i+stride] is also added to sum[i]
+ */
+
+__global__ void mmc_accum_output(double* sum, float* buf, uint len, uint stride) {
+    for (uint i = blockIdx.x * blockDim.x + threadIdx.x; i < len; i += gridDim.x * blockDim.x) {
+        double val = buf[i];
+
+        buf[i] = 0.f;
+
+        if (stride) {
+            val += buf[i + stride];
+            buf[i + stride] = 0.f;
+        }
+
+        sum[i] += val;
+    }
+}
+
+/**
+ * @brief Sum the per-thread energy counters of a launch on the device
+ *
+ * Block g adds column g of the (nthread*2) x srcnum counters written by the kernel:
+ * the escaped (g < srcnum) or the launched (g >= srcnum) energy of source g % srcnum,
+ * so that only 2*srcnum totals are read back. Launched with MMC_REDUCE_BLOCK threads.
+ *
+ * @param[out] sum: the 2*srcnum double-precision totals
+ * @param[in] energy: the per-thread counters
+ * @param[in] nthread: the thread count of the simulation kernel
+ * @param[in] srcnum: the number of sources
+ */
+
+__global__ void mmc_sum_energy(double* sum, const float* energy, uint nthread, uint srcnum) {
+    __shared__ double partial[MMC_REDUCE_BLOCK];
+    uint col = blockIdx.x;
+    double val = 0.0;
+
+    for (uint i = threadIdx.x; i < nthread; i += blockDim.x) {
+        val += energy[(i << 1) * srcnum + col];
+    }
+
+    partial[threadIdx.x] = val;
+    __syncthreads();
+
+    for (uint offset = blockDim.x >> 1; offset > 0; offset >>= 1) {
+        if (threadIdx.x < offset) {
+            partial[threadIdx.x] += partial[threadIdx.x + offset];
+        }
+
+        __syncthreads();
+    }
+
+    if (threadIdx.x == 0) {
+        sum[col] = partial[0];
+    }
+}
+
+/**
+ * @brief Add a double-precision buffer copied from another device to the local sum
+ */
+
+__global__ void mmc_add_output(double* sum, const double* src, uint len) {
+    for (uint i = blockIdx.x * blockDim.x + threadIdx.x; i < len; i += gridDim.x * blockDim.x) {
+        sum[i] += src[i];
+    }
+}
+
+/**
+ * @brief Add the output sum of a peer GPU to that of the current GPU
+ *
+ * The peer buffer is copied in chunks with cudaMemcpyPeerAsync, which goes directly
+ * over NVLink/PCIe when peer access could be enabled, and is staged by the driver otherwise.
+ *
+ * @param[in,out] dst: the sum on the current device gpuid
+ * @param[in] gpuid: the current device
+ * @param[in] src: the sum on the peer device
+ * @param[in] peerid: the peer device
+ * @param[in] len: length of the sums
+ * @param[in] staging: a device buffer of MIN(len, MMC_PEER_CHUNK) doubles on the current device
+ * @param[in] stream: the stream of the current device
+ */
+
+static void mmc_cu_reducepeer(double* dst, int gpuid, const double* src, int peerid, uint len, double* staging, cudaStream_t stream) {
+    int canaccess = 0;
+
+    CUDA_ASSERT(cudaDeviceCanAccessPeer(&canaccess, gpuid, peerid));
+
+    if (canaccess) {
+        cudaError_t err = cudaDeviceEnablePeerAccess(peerid, 0);
+
+        if (err == cudaErrorPeerAccessAlreadyEnabled) {
+            cudaGetLastError();
+        } else {
+            CUDA_ASSERT(err);
+        }
+    }
+
+    for (uint offset = 0; offset < len; offset += MMC_PEER_CHUNK) {
+        uint count = MIN(len - offset, (uint)MMC_PEER_CHUNK);
+
+        CUDA_ASSERT(cudaMemcpyPeerAsync(staging, gpuid, src + offset, peerid, sizeof(double) * count, stream));
+        mmc_add_output <<< MIN((count + MMC_REDUCE_BLOCK - 1) / MMC_REDUCE_BLOCK, MMC_REDUCE_GRID), MMC_REDUCE_BLOCK, 0, stream >>> (dst + offset, staging, count);
+    }
+}
+
+/**
+ * @brief Upload the replay inputs of a chunk of photons to a replay buffer set
+ *
+ * The inputs are staged in the pinned buffer of the set, so that the copies run
+ * asynchronously on the replay stream; the caller must make sure that the kernel
+ * reading the previous chunk of the set has completed.
+ *
+ * @param[in] cfg: the simulation configuration structure, holding the inputs of all replayed photons
+ * @param[in] staging: the pinned buffer of the set, seeds, weights, times and detector ids of replaylen photons
+ * @param[in] gseed, gweight, gtime, gdetid: the device buffers of the set, gdetid is NULL without cfg->replaydetid
+ * @param[in] first: index of the first photon of the chunk
+ * @param[in] len: photons in the chunk
+ * @param[in] replaylen: the capacity of the set in photons
+ * @param[in] stream: the replay stream of the device
+ */
+
+static void mmc_cu_uploadreplay(mcconfig* cfg, char* staging, RandType* gseed, float* gweight, float* gtime, int* gdetid,
+                                uint first, uint len, uint replaylen, cudaStream_t stream) {
+    size_t seedlen = sizeof(RandType) * RAND_BUF_LEN;
+    char* weight = staging + seedlen * replaylen, *time = weight + sizeof(float) * replaylen, *detid = time + sizeof(float) * replaylen;
+
+    memcpy(staging, (char*)cfg->photonseed + seedlen * first, seedlen * len);
+    memcpy(weight, cfg->replayweight + first, sizeof(float) * len);
+    memcpy(time, cfg->replaytime + first, sizeof(float) * len);
+
+    CUDA_ASSERT(cudaMemcpyAsync(gseed, staging, seedlen * len, cudaMemcpyHostToDevice, stream));
+    CUDA_ASSERT(cudaMemcpyAsync(gweight, weight, sizeof(float) * len, cudaMemcpyHostToDevice, stream));
+    CUDA_ASSERT(cudaMemcpyAsync(gtime, time, sizeof(float) * len, cudaMemcpyHostToDevice, stream));
+
+    if (gdetid) {
+        memcpy(detid, cfg->replaydetid + first, sizeof(int) * len);
+        CUDA_ASSERT(cudaMemcpyAsync(gdetid, detid, sizeof(int) * len, cudaMemcpyHostToDevice, stream));
+    }
+}
+
+/**
+ * @brief Instantiate a captured graph, the signature of cudaGraphInstantiate changed in CUDA 12
+ */
+
+static void mmc_cu_instantiate(cudaGraphExec_t* exec, cudaGraph_t graph) {
+#if CUDART_VERSION >= 12000
+    CUDA_ASSERT(cudaGraphInstantiate(exec, graph, 0));
+#else
+    CUDA_ASSERT(cudaGraphInstantiate(exec, graph, NULL, NULL, 0));
+#endif
+}
+
+#define MMC_MEM_RESERVE     (64 << 20)        /**< device memory kept free for the runtime when checking if the buffers fit */
+
+/**
+ * \brief Placement of a device buffer, see mmc_cu_malloc()
+ */
+
+enum TCUMemType {cuMemDevice, cuMemManagedHot, cuMemManagedCold};
+
+/**
+ * @brief Allocate a buffer in device memory, or in managed memory for meshes larger than the device memory
+ *
+ * Managed buffers can exceed the device memory at reduced speed: the pages of the hot mesh
+ * buffers (cuMemManagedHot) prefer, and are prefetched to, the GPU; the colder output and replay
+ * buffers (cuMemManagedCold) migrate on demand and are the first to be paged out.
+ *
+ * @param[out] ptr: the allocated buffer
+ * @param[in] len: length of the buffer in bytes
+ * @param[in] memtype: one of cuMemDevice, cuMemManagedHot and cuMemManagedCold
+ * @param[in] gpuid: the current device
+ * @param[in] stream: the stream used to prefetch the hot buffers
+ */
+
+static void mmc_cu_malloc(void** ptr, size_t len, int memtype, int gpuid, cudaStream_t stream) {
+    if (memtype == cuMemDevice) {
+        CUDA_ASSERT(cudaMalloc(ptr, len));
+        return;
+    }
+
+    CUDA_ASSERT(cudaMallocManaged(ptr, len, cudaMemAttachGlobal));
+    CUDA_ASSERT(cudaMemAdvise(*ptr, len, cudaMemAdviseSetAccessedBy, gpuid));
+
+    if (memtype == cuMemManagedHot) {
+        CUDA_ASSERT(cudaMemAdvise(*ptr, len, cudaMemAdviseSetPreferredLocation, gpuid));
+        CUDA_ASSERT(cudaMemPrefetchAsync(*ptr, len, gpuid, stream));
+    }
+}
+
+/**
+ * @brief Free the mesh buffers kept on one GPU, the GPU must be the current device
+ *
+ * @param[in] gpuid: the 0-based device id
+ */
+
+static void mmc_cu_free_meshcache(int gpuid) {
+    if (cumesh[gpuid].session == 0) {
+        return;
+    }
+
+    CUDA_ASSERT(cudaFree(cumesh[gpuid].gnode));
+    CUDA_ASSERT(cudaFree(cumesh[gpuid].gelem));
+    CUDA_ASSERT(cudaFree(cumesh[gpuid].gtype));
+    CUDA_ASSERT(cudaFree(cumesh[gpuid].gfacenb));
+    CUDA_ASSERT(cudaFree(cumesh[gpuid].gnormal));
+    memset(cumesh + gpuid, 0, sizeof(cumeshcache));
+}
+
+/**
+ * @brief Host function queued behind a launch, flags its completion for the progress bar
+ */
+
+static void CUDART_CB mmc_cu_kerneldone(void* flag) {
+    *(volatile int*)flag = 1;
+}
+
+/**
+ * @brief Release the device-resident mesh buffers kept by a previous mesh session on all GPUs
+ */
+
+void mmc_cu_release_meshcache(void) {
+    int i;
+
+    for (i = 0; i < MAX_DEVICE; i++) {
+        if (cumesh[i].session) {
+            CUDA_ASSERT(cudaSetDevice(i));
+            mmc_cu_free_meshcache(i);
+        }
+    }
+}
+
 void mmc_run_simulation(mcconfig* cfg, tetmesh* mesh, raytracer* tracer, GPUInfo* gpu) {
     uint i, j;
     float t, twindow0, twindow1;
     float fullload = 0.f;
-    float* energy;
+    double* energy;
 
     uint detected = 0;
-    int gpuid, threadid = 0;
+    int gpuid, threadid = 0, ismeshcached = 0;
+    int hotmem = cuMemDevice, coldmem = cuMemDevice;
     uint tic, tic0, tic1, toc = 0, fieldlen, debuglen = MCX_DEBUG_REC_LEN;
     int threadphoton, oddphotons;
     dim3 mcgrid, mcblock;
@@ -219,26 +508,64 @@ void mmc_run_simulation(mcconfig* cfg, tetmesh* mesh, raytracer* tracer, GPUInfo
     int* gtype, *gsrcelem;
     uint* gseed, *gdetected;
     volatile int* progress, *gprogress;
-    float* gweight, *gdref, *gdetphoton, *genergy, *gsrcpattern, *gdebugdata;
-    RandType* gphotonseed = NULL, *greplayseed = NULL;
-    float*  greplayweight = NULL, *greplaytime = NULL;
+    volatile int kerneldone = 0;   /*set by mmc_cu_kerneldone when the launch of this device ends*/
+    double* genergysum;
+    float* gweight, *gdref, *gdetphoton, *genergy, *gsrcpattern, *gdebugdata, *gdetimage = NULL;
+    RandType* gphotonseed = NULL, *greplayseed[2] = {NULL, NULL};
+    float*  greplayweight[2] = {NULL, NULL}, *greplaytime[2] = {NULL, NULL}, *ginvcdf = NULL;
+    int*    gdetgrid = NULL;
+    Medium* gelemmed = NULL;
+    int* greplaydetid[2] = {NULL, NULL};
+    uint replaylen = (cfg->seed == SEED_FROM_FILE) ? MIN((uint)cfg->nphoton, MAX_REPLAY_CHUNK) : 0; /*photons per replay chunk*/
+    char* hostreplay[2] = {NULL, NULL};          /*pinned staging of the two replay buffer sets*/
+    cudaStream_t replaystream;                   /*uploads the next replay chunk while the kernel runs*/
+    cudaEvent_t replayup[2], replayend[2];       /*upload of each replay set, and the kernel of its last chunk*/
+    uint nreplay = 0;                            /*replay chunks launched, alternating the buffer sets*/
+    cudaEvent_t profev[3] = {NULL, NULL, NULL};  /*start and end of the kernels of a respin, and end of its read-back, for --saveprofile*/
+    int profingraph = 0;                         /*1 if the respin graph records the kernel start and end events itself*/
+    deviceprofile* prof = NULL;                  /*kernel timing and attributes of this device, for --saveprofile*/
+    float* gcamsignals = NULL;
+    uint camsignalslen = cfg->cam_image_width * cfg->cam_image_height + 2;  /*camera pixels, then the photon counters*/
+
+    int gpustate = (cfg->gpusort > 0 || cfg->gpufission > 0); /*1 if the photon states are kept on the GPU between launches*/
+    float4* gsortstate = NULL;                   /*the sorted (--gpusort) and split (--fission) modes: photon states of all thread slots*/
+    float* gsortppath = NULL;                    /*partial-path record of each slot*/
+    int* gsortfix = NULL;                        /*edge/vertex retries of each slot*/
+    uint* gsortorder = NULL, *gsortbin = NULL, *gsorthist = NULL, *hostsort = NULL;
+    int* gfissionflag = NULL;                    /*the split mode: state flag of each slot, MMC_FISSION_*/
+    uint sortbin = 0;                            /*element bins of the photon sort, an extra bin collects the idle slots*/
+    size_t sortsharedmem = 0;
 
     MCXReporter* greporter;
     uint meshlen = ((cfg->method == rtBLBadouelGrid) ? cfg->crop0.z : mesh->ne) * cfg->srcnum;
-    cfg->crop0.w = meshlen * cfg->maxgate; // offset for the second buffer
+    cfg->crop0.w = meshlen * (cfg->maxgate * cfg->replaydetnum + 2 * cfg->freqnum); // offset for the second buffer
 
-    float* field, *dref = NULL;
+    float* field;
+    double* dfield = NULL, *dref = NULL;         /*host sums of the output of all respins and devices*/
+    double* gfieldsum = NULL, *gdrefsum = NULL;  /*device sums of the output of all respins*/
 
     uint* Pseed = NULL;
     float* Pdet = NULL;
     RandType* Pphotonseed = NULL;
+    uint* hostdetected = NULL;
+    MCXReporter* hostrep = NULL;
+    uint* hostoffset = NULL;                     /*index of the first photon of a respin on this device, uploaded by the graph*/
+    uint devoffset = 0, respinphoton = 0;        /*first photon of this device in a respin, and the photons of a respin*/
+
+    cudaStream_t mcxstream;
+    cudaGraph_t respingraph, readgraph;
+    cudaGraphExec_t respinexec, readexec;
 
-    uint detreclen = (2 + ((cfg->ismomentum) > 0)) * mesh->prop +
-                     (cfg->issaveexit > 0) * 6 + 1;
-    uint hostdetreclen = detreclen + 1;
+    uint detreclen, hostdetreclen;
     // launch mcxkernel
     size_t sharedmemsize = 0;
     double energytot = 0.0, energyesc = 0.0;
+    int isenergyowner = (cfg->energytot == NULL); /*0 if the caller collects the energy totals, see mmc_run_hybrid*/
+
+    /*the GPU kernel always accumulates the per-medium scattering counts*/
+    cfg->savedetflag = SET_SAVE_NSCAT(cfg->savedetflag);
+    hostdetreclen = mcx_detreclen(cfg, mesh->prop);
+    detreclen = hostdetreclen - 1;
 
     MCXParam param = {make_float3(cfg->srcpos.x, cfg->srcpos.y, cfg->srcpos.z),
                       make_float3(cfg->srcdir.x, cfg->srcdir.y, cfg->srcdir.z),
@@ -290,6 +617,63 @@ void mmc_run_simulation(mcconfig* cfg, tetmesh* mesh, raytracer* tracer, GPUInfo
                      };
 
     MCXReporter reporter = {0.f, 0};
+    uint* packmesh = NULL;
+    int* halfface = NULL;
+    float4* halffacetable = NULL;
+
+    param.ispackmesh = cfg->ispackmesh;
+    param.patternbits = cfg->patternbits;
+    param.detparam1 = make_float4(cfg->detparam1.x, cfg->detparam1.y, cfg->detparam1.z, cfg->detparam1.w);
+    param.detparam2 = make_float4(cfg->detparam2.x, cfg->detparam2.y, cfg->detparam2.z, cfg->detparam2.w);
+    param.detorigin = make_float4((cfg->detpos) ? cfg->detpos[0].x : 0.f, (cfg->detpos) ? cfg->detpos[0].y : 0.f, (cfg->detpos) ? cfg->detpos[0].z : 0.f, 0.f);
+    param.freqnum = cfg->freqnum;
+    param.nphase = cfg->nphase;
+    param.ispersistent = cfg->ispersistent;
+    param.rngtype = (cfg->rngtype == rngPhilox);
+    param.trajsample = cfg->trajsample;
+    param.isdetstat = cfg->isdetstat;
+
+    /*the per-label importance of --importance follows the detectors in gmed, the normals are moved after it*/
+    if (cfg->importance) {
+        param.importoffset = param.maxpropdet;
+        param.maxpropdet += (mesh->prop + 4) >> 2;
+
+        if (param.maxpropdet > MAX_PROP) {
+            mcx_error(-5, "Total tissue type, detector and importance count is too large for the constant memory", __FILE__, __LINE__);
+        }
+
+        param.normbuf = MIN((MAX_PROP - param.maxpropdet), ((mesh->ne) << 2)) >> 2;
+    }
+
+    /*the half-face mesh has no per-element normals to copy to the constant memory*/
+    if (cfg->ishalfface) {
+        param.normbuf = 0;
+    }
+
+    param.cam_obj_dist = cfg->cam_obj_dist;
+    param.cam_proj_dist = cfg->cam_proj_dist;
+    param.cam_focal_length = cfg->cam_focal_length;
+    param.cam_aperture_radius = cfg->cam_aperture_radius;
+    param.cam_image_width = cfg->cam_image_width;
+    param.cam_image_height = cfg->cam_image_height;
+    param.cam_pixel_pitch = cfg->cam_pixel_pitch;
+
+    if (mesh->srcgrid) {
+        param.srcgridorig = make_float4(mesh->srcgrid->pmin.x, mesh->srcgrid->pmin.y, mesh->srcgrid->pmin.z, mesh->srcgrid->rcellsize);
+        param.srcgriddim = make_int4(mesh->srcgrid->dim[0], mesh->srcgrid->dim[1], mesh->srcgrid->dim[2], mesh->srcelemlen);
+    }
+
+    if (mesh->detgrid) {
+        param.detgridorig = make_float4(mesh->detgrid->pmin.x, mesh->detgrid->pmin.y, mesh->detgrid->pmin.z, mesh->detgrid->rcellsize);
+        param.detgriddim = make_int4(mesh->detgrid->dim[0], mesh->detgrid->dim[1], mesh->detgrid->dim[2], 0);
+    }
+
+    for (int k = 0; k < cfg->freqnum; k++) {
+        param.omega[k] = TWO_PI * cfg->freq[k];
+    }
+
+    size_t detimagesize = (cfg->issaveexit == 2) ? (size_t)cfg->detparam1.w * cfg->detparam2.w * cfg->maxgate :
+                          (cfg->isdetstat ? (size_t)cfg->detnum * mcx_detstatlen(cfg, mesh->prop) : 0);
 
     if (cfg->issavedet) {
         sharedmemsize = sizeof(float) * detreclen;
@@ -303,10 +687,6 @@ void mmc_run_simulation(mcconfig* cfg, tetmesh* mesh, raytracer* tracer, GPUInfo
         sharedmemsize += sizeof(float) * cfg->srcnum;
     }
 
-    gpuid = cfg->deviceid[threadid] - 1;
-
-    sharedmemsize *= ((int)gpu[gpuid].autoblock);
-
 #ifdef _OPENMP
     threadid = omp_get_thread_num();
 #endif
@@ -315,12 +695,21 @@ void mmc_run_simulation(mcconfig* cfg, tetmesh* mesh, raytracer* tracer, GPUInfo
         return;
     }
 
+    gpuid = cfg->deviceid[threadid] - 1;
+
     if (gpuid < 0) {
         mcx_error(-1, "GPU ID must be non-zero", __FILE__, __LINE__);
     }
 
     CUDA_ASSERT(cudaSetDevice(gpuid));
 
+    /*let the host thread sleep in cudaStreamSynchronize instead of spinning for the whole run*/
+    if (cudaSetDeviceFlags(cudaDeviceScheduleBlockingSync) != cudaSuccess) {
+        cudaGetLastError();
+    }
+
+    CUDA_ASSERT(cudaStreamCreateWithFlags(&mcxstream, cudaStreamNonBlocking));
+
     #pragma omp master
     {
         if (cfg->exportfield == NULL) {
@@ -335,8 +724,23 @@ void mmc_run_simulation(mcconfig* cfg, tetmesh* mesh, raytracer* tracer, GPUInfo
             cfg->exportseed = (unsigned char*)malloc(cfg->maxdetphoton * (sizeof(RandType) * RAND_BUF_LEN));
         }
 
-        cfg->energytot = (double*)calloc(cfg->srcnum, sizeof(double));
-        cfg->energyesc = (double*)calloc(cfg->srcnum, sizeof(double));
+        if (cfg->streamdet > 0) {
+            cfg->his.savedphoton = 0;
+        }
+
+        if (detimagesize) {
+            if (cfg->exportdetimage) {
+                free(cfg->exportdetimage);
+            }
+
+            cfg->exportdetimage = (float*)calloc(detimagesize, sizeof(float));
+        }
+
+        if (isenergyowner) {
+            cfg->energytot = (double*)calloc(cfg->srcnum, sizeof(double));
+            cfg->energyesc = (double*)calloc(cfg->srcnum, sizeof(double));
+        }
+
         cfg->runtime = 0;
     }
     #pragma omp barrier
@@ -369,8 +773,29 @@ void mmc_run_simulation(mcconfig* cfg, tetmesh* mesh, raytracer* tracer, GPUInfo
             (gpu[gpuid].autothread / gpu[gpuid].autoblock) * gpu[gpuid].autoblock;
     }
 
+    sharedmemsize *= ((int)gpu[gpuid].autoblock);
+    sharedmemsize += sizeof(uint) * (MAX_ACCUM_CACHE << 1);   /**< work-group cache merging the weight atomics, keys and values */
+
+    /*
+       a mesh fitting in the shared memory next to the records above is traced from a copy in each
+       block, see cachemesh(); the type and facenb buffers are not read with the packed mesh, 3 floats
+       align the copy to a float4; the sorted and split modes read the mesh from the global memory
+    */
+    if (cfg->islocalmesh && !gpustate && !cfg->ishalfface) {
+        size_t meshcachesize = sizeof(float4) * (mesh->ne << 2) + (cfg->ispackmesh ? 0 : sizeof(int) * mesh->ne * (mesh->elemlen + 1)) + sizeof(float) * 3;
+
+        if (sharedmemsize + meshcachesize <= gpu[gpuid].sharedmem) {
+            param.islocalmesh = 1;
+            sharedmemsize += meshcachesize;
+        }
+    }
+
     param.maxgate = gpu[gpuid].maxgate;
 
+    if (cfg->isdetstat && param.maxgate < (uint)cfg->maxgate) {
+        MMC_ERROR(-1, "--detstat needs all time gates in one launch, please reduce the number of time gates");
+    }
+
     uint nflen = mesh->nf * cfg->maxgate;
     #pragma omp master
     fullload = 0.f;
@@ -402,13 +827,24 @@ void mmc_run_simulation(mcconfig* cfg, tetmesh* mesh, raytracer* tracer, GPUInfo
     oddphotons =
         (int)(cfg->nphoton * cfg->workload[gpuid] / (fullload * cfg->respin) -
               threadphoton * gpu[gpuid].autothread);
-    field = (float*)calloc(sizeof(float) * meshlen * 2, cfg->maxgate);
-    dref = (float*)calloc(sizeof(float) * mesh->nf, cfg->maxgate);
-    Pdet = (float*)calloc(cfg->maxdetphoton * sizeof(float), hostdetreclen);
+
+    /*with the Philox RNG, the photons of a respin are indexed over the devices in order*/
+    for (i = 0; cfg->deviceid[i]; i++) {
+        int devthreadphoton = (int)(cfg->nphoton * cfg->workload[i] / (fullload * gpu[i].autothread * cfg->respin));
+        uint devphoton = devthreadphoton * gpu[i].autothread +
+                         (int)(cfg->nphoton * cfg->workload[i] / (fullload * cfg->respin) - devthreadphoton * gpu[i].autothread);
+
+        devoffset += ((int)i < gpuid) ? devphoton : 0;
+        respinphoton += devphoton;
+    }
+    field = (float*)calloc(sizeof(float) * meshlen * 2, cfg->maxgate * cfg->replaydetnum + 2 * cfg->freqnum);
+    dref = (double*)calloc(sizeof(double) * mesh->nf, cfg->maxgate);
+    CUDA_ASSERT(cudaMallocHost((void**)&Pdet, sizeof(float) * cfg->maxdetphoton * hostdetreclen));
 
     mcgrid.x = gpu[gpuid].autothread / gpu[gpuid].autoblock;
     mcblock.x = gpu[gpuid].autoblock;
-    fieldlen = meshlen * cfg->maxgate;
+    fieldlen = meshlen * (cfg->maxgate * cfg->replaydetnum + 2 * cfg->freqnum);
+    dfield = (double*)calloc(fieldlen, sizeof(double));
 
     if (cfg->seed > 0) {
         srand(cfg->seed);
@@ -416,57 +852,135 @@ void mmc_run_simulation(mcconfig* cfg, tetmesh* mesh, raytracer* tracer, GPUInfo
         srand(time(0));
     }
 
+    /*
+       the mesh buffers are read at every step and prefer the device; if all buffers
+       exceed the device memory, the output and replay buffers go to managed memory,
+       and so do the mesh buffers if they alone do not fit
+    */
+    if (cfg->unifiedmem) {
+        size_t meshmem = sizeof(float3) * mesh->nn + (sizeof(int4) * 2 + sizeof(int) + sizeof(float4) * (cfg->ishalfface ? 3 : 4)) * mesh->ne;
+        size_t outmem = sizeof(float) * fieldlen * 2 + sizeof(float) * mesh->nf * cfg->maxgate +
+                        (sizeof(double) * fieldlen) * cfg->issave2pt + (sizeof(double) * mesh->nf * cfg->maxgate) * cfg->issaveref +
+                        (sizeof(float) * hostdetreclen + sizeof(RandType) * RAND_BUF_LEN * cfg->issaveseed) * cfg->maxdetphoton +
+                        (sizeof(float) * 3 + sizeof(RandType) * RAND_BUF_LEN) * (size_t)replaylen * 2;
+
+        if (cfg->unifiedmem == 2 || meshmem + outmem + MMC_MEM_RESERVE > gpu[gpuid].globalmem) {
+            coldmem = cuMemManagedCold;
+            hotmem = (meshmem + MMC_MEM_RESERVE > gpu[gpuid].globalmem) ? cuMemManagedHot : cuMemDevice;
+            MMC_FPRINTF(cfg->flog, "- [device %d(%d): %s] %.1f MB of buffers exceed %.1f MB of device memory, using managed memory for the %s\n",
+                        gpuid + 1, gpu[gpuid].id, gpu[gpuid].name, (meshmem + outmem) / 1048576.0, gpu[gpuid].globalmem / 1048576.0,
+                        (hotmem == cuMemDevice) ? "output buffers" : "mesh and output buffers");
+        }
+    }
+
     // create gpu pointer
     // gnode,gelem,gtype,gfacenb,gsrcelem,gnormal,gdetpos,gproperty and copy the
     // data from cpu to gpu
-    CUDA_ASSERT(cudaMalloc((void**)&gnode, sizeof(float3) * (mesh->nn)));
-    CUDA_ASSERT(cudaMemcpy(gnode, mesh->node, sizeof(float3) * (mesh->nn),
-                           cudaMemcpyHostToDevice));
+    if (cumesh[gpuid].session != 0 && cumesh[gpuid].session == cfg->meshsession && cumesh[gpuid].nn == mesh->nn &&
+            cumesh[gpuid].ne == mesh->ne && cumesh[gpuid].elemlen == mesh->elemlen && cumesh[gpuid].method == cfg->method &&
+            cumesh[gpuid].ispackmesh == param.ispackmesh && (cumesh[gpuid].halffacenum > 0) == (cfg->ishalfface != 0)) {
+        param.halffacenum = cumesh[gpuid].halffacenum;
+        gnode = cumesh[gpuid].gnode;
+        gelem = cumesh[gpuid].gelem;
+        gtype = cumesh[gpuid].gtype;
+        gfacenb = cumesh[gpuid].gfacenb;
+        gnormal = cumesh[gpuid].gnormal;
+        ismeshcached = 1;
+        MMCDEBUG(cfg, dlTime, (cfg->flog, "reusing the device-resident mesh of session %d\n", cfg->meshsession));
+    } else {
+        mmc_cu_free_meshcache(gpuid);
+
+        mmc_cu_malloc((void**)&gnode, sizeof(float3) * (mesh->nn), hotmem, gpuid, mcxstream);
+        CUDA_ASSERT(cudaMemcpyAsync(gnode, mesh->node, sizeof(float3) * (mesh->nn),
+                                    cudaMemcpyHostToDevice, mcxstream));
+
+        mmc_cu_malloc((void**)&gelem, sizeof(int4) * (mesh->ne), hotmem, gpuid, mcxstream);
+        CUDA_ASSERT(cudaMemcpyAsync(gelem, mesh->elem, sizeof(int4) * (mesh->ne),
+                                    cudaMemcpyHostToDevice, mcxstream));
+
+        mmc_cu_malloc((void**)&gtype, sizeof(int) * (mesh->ne), hotmem, gpuid, mcxstream);
+        CUDA_ASSERT(cudaMemcpyAsync(gtype, mesh->type, sizeof(int) * (mesh->ne),
+                                    cudaMemcpyHostToDevice, mcxstream));
+
+        /*the half-face mesh replaces the per-element normals and facenb*/
+        if (cfg->ishalfface) {
+            halfface = (int*)malloc(sizeof(int) * (mesh->ne << 2));
+            param.halffacenum = tracer_packhalfface(tracer, halfface, &halffacetable);
+        }
 
-    CUDA_ASSERT(cudaMalloc((void**)&gelem, sizeof(int4) * (mesh->ne)));
-    CUDA_ASSERT(cudaMemcpy(gelem, mesh->elem, sizeof(int4) * (mesh->ne),
-                           cudaMemcpyHostToDevice));
+        mmc_cu_malloc((void**)&gfacenb, sizeof(int4) * (mesh->ne), hotmem, gpuid, mcxstream);
+        CUDA_ASSERT(cudaMemcpyAsync(gfacenb, (halfface ? (void*)halfface : (void*)mesh->facenb), sizeof(int4) * (mesh->ne),
+                                    cudaMemcpyHostToDevice, mcxstream));
 
-    CUDA_ASSERT(cudaMalloc((void**)&gtype, sizeof(int) * (mesh->ne)));
-    CUDA_ASSERT(cudaMemcpy(gtype, mesh->type, sizeof(int) * (mesh->ne),
-                           cudaMemcpyHostToDevice));
+        if (param.ispackmesh) {
+            packmesh = (uint*)malloc(sizeof(uint) * ((size_t)mesh->ne << 4));
+            tracer_packgpu(tracer, packmesh);
+        }
 
-    CUDA_ASSERT(cudaMalloc((void**)&gfacenb, sizeof(int4) * (mesh->ne)));
-    CUDA_ASSERT(cudaMemcpy(gfacenb, mesh->facenb, sizeof(int4) * (mesh->ne),
-                           cudaMemcpyHostToDevice));
+        if (halffacetable) {
+            size_t facetablelen = param.halffacenum + ((param.halffacenum + 1) >> 1);
+
+            mmc_cu_malloc((void**)&gnormal, sizeof(float4) * facetablelen, hotmem, gpuid, mcxstream);
+            CUDA_ASSERT(cudaMemcpyAsync(gnormal, halffacetable, sizeof(float4) * facetablelen,
+                                        cudaMemcpyHostToDevice, mcxstream));
+        } else {
+            mmc_cu_malloc((void**)&gnormal, sizeof(float4) * (mesh->ne) * 4, hotmem, gpuid, mcxstream);
+            CUDA_ASSERT(cudaMemcpyAsync(gnormal, (packmesh ? (void*)packmesh : (void*)tracer->n), sizeof(float4) * (mesh->ne) * 4,
+                                        cudaMemcpyHostToDevice, mcxstream));
+        }
+    }
 
     if (mesh->srcelemlen > 0) {
-        CUDA_ASSERT(cudaMalloc((void**)&gsrcelem, sizeof(int) * (mesh->srcelemlen)));
-        CUDA_ASSERT(cudaMemcpy(gsrcelem, mesh->srcelem,
-                               sizeof(int) * (mesh->srcelemlen),
-                               cudaMemcpyHostToDevice));
+        int srcelemlen;
+        int* srcelem = mesh_packgrid(mesh->srcgrid, mesh->srcelem, mesh->srcelemlen, &srcelemlen);
+
+        CUDA_ASSERT(cudaMalloc((void**)&gsrcelem, sizeof(int) * srcelemlen));
+
+        /*the packed copy is freed right away, so it is not copied asynchronously*/
+        if (srcelem != mesh->srcelem) {
+            CUDA_ASSERT(cudaMemcpy(gsrcelem, srcelem, sizeof(int) * srcelemlen, cudaMemcpyHostToDevice));
+            free(srcelem);
+        } else {
+            CUDA_ASSERT(cudaMemcpyAsync(gsrcelem, mesh->srcelem,
+                                        sizeof(int) * (mesh->srcelemlen),
+                                        cudaMemcpyHostToDevice, mcxstream));
+        }
     } else {
         gsrcelem = NULL;
     }
 
-    CUDA_ASSERT(cudaMalloc((void**)&gnormal, sizeof(float4) * (mesh->ne) * 4));
-    CUDA_ASSERT(cudaMemcpy(gnormal, tracer->n, sizeof(float4) * (mesh->ne) * 4,
-                           cudaMemcpyHostToDevice));
-
     // gparam
-    CUDA_ASSERT(cudaMemcpyToSymbol(gcfg, &param, sizeof(MCXParam), 0, cudaMemcpyHostToDevice));
-    CUDA_ASSERT(cudaMemcpyToSymbol(gmed, mesh->med,
+    CUDA_ASSERT(cudaMemcpyToSymbolAsync(gcfg, &param, sizeof(MCXParam), 0, cudaMemcpyHostToDevice, mcxstream));
+    CUDA_ASSERT(cudaMemcpyToSymbolAsync(gmed, mesh->med,
                                    (mesh->prop + 1 + cfg->isextdet) * sizeof(Medium), 0,
-                                   cudaMemcpyHostToDevice));
+                                   cudaMemcpyHostToDevice, mcxstream));
 
     if (cfg->detpos && cfg->detnum) {
         if ((mesh->prop + 1 + cfg->isextdet) + cfg->detnum >= MAX_PROP) {
             mcx_error(-5, "Total tissue type and detector count must be less than 2000", __FILE__, __LINE__);
         }
 
-        CUDA_ASSERT(cudaMemcpyToSymbol(gmed, cfg->detpos,
+        CUDA_ASSERT(cudaMemcpyToSymbolAsync(gmed, cfg->detpos,
                                        sizeof(float4)*cfg->detnum, (mesh->prop + 1 + cfg->isextdet) * sizeof(Medium),
-                                       cudaMemcpyHostToDevice));
+                                       cudaMemcpyHostToDevice, mcxstream));
     }
 
-    CUDA_ASSERT(cudaMemcpyToSymbol(gmed, tracer->n,
+    if (param.importoffset) {
+        float* importance = (float*)calloc(mesh->prop + 1, sizeof(float));
+
+        for (i = 0; i <= (uint)mesh->prop; i++) {
+            importance[i] = MESH_IMPORTANCE(cfg, i);
+        }
+
+        CUDA_ASSERT(cudaMemcpyToSymbolAsync(gmed, importance, (mesh->prop + 1) * sizeof(float), sizeof(float4)*param.importoffset,
+                                       cudaMemcpyHostToDevice, mcxstream));
+        CUDA_ASSERT(cudaStreamSynchronize(mcxstream));
+        free(importance);
+    }
+
+    CUDA_ASSERT(cudaMemcpyToSymbolAsync(gmed, tracer->n,
                                    (param.normbuf << 2) * (sizeof(float4)), sizeof(float4)*param.maxpropdet,
-                                   cudaMemcpyHostToDevice));
+                                   cudaMemcpyHostToDevice, mcxstream));
 
     // gprogress
     CUDA_ASSERT(
@@ -474,93 +988,288 @@ void mmc_run_simulation(mcconfig* cfg, tetmesh* mesh, raytracer* tracer, GPUInfo
     CUDA_ASSERT(cudaHostGetDevicePointer((int**)&gprogress, (int*)progress, 0));
     *progress = 0;
 
-    Pseed = (uint*)malloc(sizeof(uint) * gpu[gpuid].autothread * RAND_SEED_WORD_LEN);
-    energy = (float*)calloc(sizeof(float) * cfg->srcnum, gpu[gpuid].autothread << 1);
+    CUDA_ASSERT(cudaMallocHost((void**)&Pseed, sizeof(uint) * gpu[gpuid].autothread * RAND_SEED_WORD_LEN));
+    CUDA_ASSERT(cudaMallocHost((void**)&energy, sizeof(double) * (cfg->srcnum << 1)));
+    CUDA_ASSERT(cudaMallocHost((void**)&hostdetected, sizeof(uint)));
+    CUDA_ASSERT(cudaMallocHost((void**)&hostrep, sizeof(MCXReporter)));
+    CUDA_ASSERT(cudaMallocHost((void**)&hostoffset, sizeof(uint)));
+    *hostoffset = devoffset;
 
     for (j = 0; j < gpu[gpuid].autothread * RAND_SEED_WORD_LEN; j++) {
         Pseed[j] = rand();
     }
 
+    if (param.rngtype) {
+        Pseed[0] = curngkey;
+    }
+
     CUDA_ASSERT(cudaMalloc((void**)&gseed, sizeof(uint) * gpu[gpuid].autothread*
                            RAND_SEED_WORD_LEN));
-    CUDA_ASSERT(cudaMemcpy(
+    CUDA_ASSERT(cudaMemcpyAsync(
                     gseed, Pseed, sizeof(uint) * gpu[gpuid].autothread * RAND_SEED_WORD_LEN,
-                    cudaMemcpyHostToDevice));
+                    cudaMemcpyHostToDevice, mcxstream));
 
-    CUDA_ASSERT(cudaMalloc((void**)&gweight, sizeof(float) * fieldlen * 2));
-    CUDA_ASSERT(cudaMemcpy(gweight, field, sizeof(float) * fieldlen * 2,
-                           cudaMemcpyHostToDevice));
+    /*the accumulation buffers start from zero, no host copy is needed*/
+    mmc_cu_malloc((void**)&gweight, sizeof(float) * fieldlen * 2, coldmem, gpuid, mcxstream);
+    CUDA_ASSERT(cudaMemsetAsync(gweight, 0, sizeof(float) * fieldlen * 2, mcxstream));
 
-    CUDA_ASSERT(cudaMalloc((void**)&gdref, sizeof(float) * nflen));
-    CUDA_ASSERT(
-        cudaMemcpy(gdref, dref, sizeof(float) * nflen, cudaMemcpyHostToDevice));
+    mmc_cu_malloc((void**)&gdref, sizeof(float) * nflen, coldmem, gpuid, mcxstream);
+    CUDA_ASSERT(cudaMemsetAsync(gdref, 0, sizeof(float) * nflen, mcxstream));
 
-    CUDA_ASSERT(cudaMalloc((void**)&gdetphoton,
-                           sizeof(float) * cfg->maxdetphoton * hostdetreclen));
-    CUDA_ASSERT(cudaMemcpy(gdetphoton, Pdet,
-                           sizeof(float) * cfg->maxdetphoton * hostdetreclen,
-                           cudaMemcpyHostToDevice));
+    if (cfg->issave2pt) {
+        mmc_cu_malloc((void**)&gfieldsum, sizeof(double) * fieldlen, coldmem, gpuid, mcxstream);
+        CUDA_ASSERT(cudaMemsetAsync(gfieldsum, 0, sizeof(double) * fieldlen, mcxstream));
+    }
+
+    if (cfg->issaveref) {
+        mmc_cu_malloc((void**)&gdrefsum, sizeof(double) * nflen, coldmem, gpuid, mcxstream);
+        CUDA_ASSERT(cudaMemsetAsync(gdrefsum, 0, sizeof(double) * nflen, mcxstream));
+    }
+
+    mmc_cu_malloc((void**)&gdetphoton, sizeof(float) * cfg->maxdetphoton * hostdetreclen, coldmem, gpuid, mcxstream);
+    CUDA_ASSERT(cudaMemsetAsync(gdetphoton, 0, sizeof(float) * cfg->maxdetphoton * hostdetreclen, mcxstream));
 
     CUDA_ASSERT(cudaMalloc((void**)&genergy,
                            sizeof(float) * (gpu[gpuid].autothread << 1) * cfg->srcnum));
-    CUDA_ASSERT(cudaMemcpy(genergy, energy,
-                           sizeof(float) * (gpu[gpuid].autothread << 1) * cfg->srcnum,
-                           cudaMemcpyHostToDevice));
+    CUDA_ASSERT(cudaMemsetAsync(genergy, 0, sizeof(float) * (gpu[gpuid].autothread << 1) * cfg->srcnum, mcxstream));
+    CUDA_ASSERT(cudaMalloc((void**)&genergysum, sizeof(double) * (cfg->srcnum << 1)));
 
     CUDA_ASSERT(cudaMalloc((void**)&gdetected, sizeof(uint)));
-    CUDA_ASSERT(cudaMemcpy(gdetected, &detected, sizeof(uint), cudaMemcpyHostToDevice));
+    CUDA_ASSERT(cudaMemsetAsync(gdetected, 0, sizeof(uint), mcxstream));
 
     CUDA_ASSERT(cudaMalloc((void**)&greporter, sizeof(MCXReporter)));
-    CUDA_ASSERT(cudaMemcpy(greporter, &reporter, sizeof(MCXReporter),
-                           cudaMemcpyHostToDevice));
-
-    if (cfg->srctype == MCX_SRC_PATTERN) {
-        CUDA_ASSERT(cudaMalloc((void**)&gsrcpattern,
-                               sizeof(float) * (int)(cfg->srcparam1.w * cfg->srcparam2.w * cfg->srcnum)));
-        CUDA_ASSERT(cudaMemcpy(gsrcpattern, cfg->srcpattern,
-                               sizeof(float) * (int)(cfg->srcparam1.w * cfg->srcparam2.w * cfg->srcnum),
-                               cudaMemcpyHostToDevice));
-    } else if (cfg->srctype == MCX_SRC_PATTERN3D) {
-        CUDA_ASSERT(cudaMalloc((void**)&gsrcpattern,
-                               sizeof(float) * (int)(cfg->srcparam1.x * cfg->srcparam1.y*
-                                       cfg->srcparam1.z * cfg->srcnum)));
-        CUDA_ASSERT(cudaMemcpy(gsrcpattern, cfg->srcpattern,
-                               sizeof(float) * (int)(cfg->srcparam1.x * cfg->srcparam1.y*
-                                       cfg->srcparam1.z * cfg->srcnum),
-                               cudaMemcpyHostToDevice));
+    CUDA_ASSERT(cudaMemsetAsync(greporter, 0, sizeof(MCXReporter), mcxstream));
+
+    if (cfg->srctype == MCX_SRC_PATTERN || cfg->srctype == MCX_SRC_PATTERN3D) {
+        size_t srcpatternbytes = 0;
+        void* srcpattern = mcx_packpattern(cfg, &srcpatternbytes);
+
+        CUDA_ASSERT(cudaMalloc((void**)&gsrcpattern, srcpatternbytes));
+        /*a synchronous copy, the packed buffer is released right after*/
+        CUDA_ASSERT(cudaMemcpy(gsrcpattern, srcpattern, srcpatternbytes, cudaMemcpyHostToDevice));
+
+        if (srcpattern != cfg->srcpattern) {
+            free(srcpattern);
+        }
     } else {
         gsrcpattern = NULL;
     }
 
     if (cfg->issaveseed) {
-        Pphotonseed = (RandType*)calloc(cfg->maxdetphoton, (sizeof(RandType) * RAND_BUF_LEN));
-        CUDA_ASSERT(cudaMalloc((void**)&gphotonseed, cfg->maxdetphoton * (sizeof(RandType)*RAND_BUF_LEN)));
+        CUDA_ASSERT(cudaMallocHost((void**)&Pphotonseed, cfg->maxdetphoton * (sizeof(RandType) * RAND_BUF_LEN)));
+        mmc_cu_malloc((void**)&gphotonseed, cfg->maxdetphoton * (sizeof(RandType)*RAND_BUF_LEN), coldmem, gpuid, mcxstream);
     }
 
     if (cfg->debuglevel & dlTraj) {
         CUDA_ASSERT(cudaMalloc((void**) &gdebugdata, sizeof(float) * (debuglen * cfg->maxjumpdebug)));
     }
 
-    if (cfg->seed == SEED_FROM_FILE) {
-        CUDA_ASSERT(cudaMalloc((void**)&greplayweight, sizeof(float)*cfg->nphoton));
-        CUDA_ASSERT(cudaMemcpy(greplayweight, cfg->replayweight, sizeof(float)*cfg->nphoton, cudaMemcpyHostToDevice));
+    if (detimagesize) {
+        CUDA_ASSERT(cudaMalloc((void**) &gdetimage, sizeof(float) * detimagesize));
+        CUDA_ASSERT(cudaMemsetAsync(gdetimage, 0, sizeof(float) * detimagesize, mcxstream));
+    }
+
+    /*two replay buffer sets of one chunk each, filled by mmc_cu_uploadreplay() as the chunks are launched*/
+    if (replaylen) {
+        CUDA_ASSERT(cudaStreamCreateWithFlags(&replaystream, cudaStreamNonBlocking));
+
+        for (i = 0; i < 2; i++) {
+            mmc_cu_malloc((void**)&greplayseed[i], (sizeof(RandType)*RAND_BUF_LEN) * replaylen, coldmem, gpuid, mcxstream);
+            mmc_cu_malloc((void**)&greplayweight[i], sizeof(float) * replaylen, coldmem, gpuid, mcxstream);
+            mmc_cu_malloc((void**)&greplaytime[i], sizeof(float) * replaylen, coldmem, gpuid, mcxstream);
+
+            if (cfg->replaydetid) {
+                mmc_cu_malloc((void**)&greplaydetid[i], sizeof(int) * replaylen, coldmem, gpuid, mcxstream);
+            }
+
+            CUDA_ASSERT(cudaMallocHost((void**)&hostreplay[i], (sizeof(RandType) * RAND_BUF_LEN + sizeof(float) * 2 + sizeof(int)) * replaylen));
+            CUDA_ASSERT(cudaEventCreateWithFlags(replayup + i, cudaEventDisableTiming));
+            CUDA_ASSERT(cudaEventCreateWithFlags(replayend + i, cudaEventDisableTiming));
+        }
+    }
+
+    if (cfg->invcdf) {
+        CUDA_ASSERT(cudaMalloc((void**)&ginvcdf, sizeof(float) * cfg->nphase * (mesh->prop + cfg->isextdet)));
+        CUDA_ASSERT(cudaMemcpyAsync(ginvcdf, cfg->invcdf, sizeof(float) * cfg->nphase * (mesh->prop + cfg->isextdet), cudaMemcpyHostToDevice, mcxstream));
+    }
+
+    if (mesh->detgrid) {
+        int detgridlen;
+        int* detgrid = mesh_packgrid(mesh->detgrid, NULL, 0, &detgridlen);
 
-        CUDA_ASSERT(cudaMalloc((void**)&greplaytime, sizeof(float)*cfg->nphoton));
-        CUDA_ASSERT(cudaMemcpy(greplaytime, cfg->replaytime, sizeof(float)*cfg->nphoton, cudaMemcpyHostToDevice));
+        CUDA_ASSERT(cudaMalloc((void**)&gdetgrid, sizeof(int) * detgridlen));
+        CUDA_ASSERT(cudaMemcpy(gdetgrid, detgrid, sizeof(int) * detgridlen, cudaMemcpyHostToDevice));
+        free(detgrid);
+    }
+
+    /*the per-element media of --elemprop are read from the global memory, not limited by MAX_PROP*/
+    if (mesh->elemmed) {
+        CUDA_ASSERT(cudaMalloc((void**)&gelemmed, sizeof(Medium) * mesh->ne));
+        CUDA_ASSERT(cudaMemcpy(gelemmed, mesh->elemmed, sizeof(Medium) * mesh->ne, cudaMemcpyHostToDevice));
+    }
+
+    /*the camera image is not read back by the CUDA host, savedetphoton() only needs a buffer to write to*/
+    CUDA_ASSERT(cudaMalloc((void**)&gcamsignals, sizeof(float) * camsignalslen));
+    CUDA_ASSERT(cudaMemsetAsync(gcamsignals, 0, sizeof(float) * camsignalslen, mcxstream));
+
+    /*
+       the sorted mode keeps a photon in flight per thread slot: its ray and RNG lanes, its
+       partial path and retry count, and its element bin, from which the slots are regrouped
+       between launches; the partial paths move from the shared memory to these records.
+       The split mode has no bins: gsorthist only counts its idle slots, gfissionflag holds the
+       stage of each slot
+    */
+    if (gpustate) {
+        uint nslot = gpu[gpuid].autothread;
+
+        sortbin = (cfg->gpusort > 0) ? MIN((uint)mesh->ne, MMC_SORT_BINS) : 0;
+        sortsharedmem = sizeof(float) * (cfg->srcnum << 1) * gpu[gpuid].autoblock + sizeof(uint) * (MAX_ACCUM_CACHE << 1);
+
+        CUDA_ASSERT(cudaMalloc((void**)&gsortstate, sizeof(float4) * (MMC_SORT_LANES + 1) * nslot));
+        CUDA_ASSERT(cudaMalloc((void**)&gsortppath, sizeof(float) * (param.reclen + (cfg->srcnum > 1) * cfg->srcnum) * nslot));
+        CUDA_ASSERT(cudaMalloc((void**)&gsortfix, sizeof(int) * nslot));
+        CUDA_ASSERT(cudaMalloc((void**)&gsorthist, sizeof(uint) * (sortbin + 1)));
+        CUDA_ASSERT(cudaMallocHost((void**)&hostsort, sizeof(uint) * 2));
+
+        if (cfg->gpusort > 0) {
+            CUDA_ASSERT(cudaMalloc((void**)&gsortorder, sizeof(uint) * nslot));
+            CUDA_ASSERT(cudaMalloc((void**)&gsortbin, sizeof(uint) * nslot));
+        } else {
+            CUDA_ASSERT(cudaMalloc((void**)&gfissionflag, sizeof(int) * nslot));
+        }
+    }
+
+    if (cfg->issaveprofile) {
+        /*the split mode reports its propagation kernel*/
+        const void* kernel = (cfg->gpusort > 0) ? (const void*)mmc_sort_loop : ((cfg->gpufission > 0) ? (const void*)mmc_fission_move : (const void*)mmc_main_loop);
+        size_t kernelshared = gpustate ? sortsharedmem : sharedmemsize;
+        cudaFuncAttributes attr;
+        int nblock = 0;
+
+        prof = cfg->devprof + threadid;
+        prof->id = gpu[gpuid].id;
+        strncpy(prof->name, gpu[gpuid].name, MAX_SESSION_LENGTH - 1);
+        prof->block = gpu[gpuid].autoblock;
+        prof->thread = gpu[gpuid].autothread;
+
+        CUDA_ASSERT(cudaFuncGetAttributes(&attr, kernel));
+        prof->registers = attr.numRegs;
+        prof->privatemem = (long long)attr.localSizeBytes;
+        prof->sharedmem = (long long)(attr.sharedSizeBytes + kernelshared);
+
+        /*the theoretical occupancy, the achieved one is only reported by the profiling tools*/
+        CUDA_ASSERT(cudaOccupancyMaxActiveBlocksPerMultiprocessor(&nblock, kernel, gpu[gpuid].autoblock, kernelshared));
+        prof->occupancy = (gpu[gpuid].maxmpthread > 0) ? MIN((float)nblock * gpu[gpuid].autoblock / gpu[gpuid].maxmpthread, 1.f) : -1.f;
+
+        for (i = 0; i < 3; i++) {
+            CUDA_ASSERT(cudaEventCreate(profev + i));
+        }
+    }
+
+    /*
+       capture the work of one respin - the seed upload, the kernel and the read-back of all
+       outputs to pinned buffers - as a CUDA graph, and replay it for every respin
+    */
+    CUDA_ASSERT(cudaStreamBeginCapture(mcxstream, cudaStreamCaptureModeThreadLocal));
+
+    if (cfg->respin > 1 && RAND_SEED_WORD_LEN > 1) {
+        CUDA_ASSERT(cudaMemcpyAsync(gseed, Pseed, sizeof(uint) * gpu[gpuid].autothread * RAND_SEED_WORD_LEN,
+                                    cudaMemcpyHostToDevice, mcxstream));
+    }
 
-        CUDA_ASSERT(cudaMalloc((void**)&greplayseed, (sizeof(RandType)*RAND_BUF_LEN)*cfg->nphoton));
-        CUDA_ASSERT(cudaMemcpy(greplayseed, cfg->photonseed, (sizeof(RandType)*RAND_BUF_LEN)*cfg->nphoton, cudaMemcpyHostToDevice));
+    if (cfg->ispersistent || gpustate) {
+        CUDA_ASSERT(cudaMemsetAsync(&greporter->photonid, 0, sizeof(uint), mcxstream));
     }
 
-    free(Pseed);
-    free(energy);
+    if (param.rngtype) {
+        CUDA_ASSERT(cudaMemcpyAsync(&greporter->photonoffset, hostoffset, sizeof(uint), cudaMemcpyHostToDevice, mcxstream));
+    }
+
+    /*
+       the passes of the sorted mode depend on the photons left, and each replay chunk waits for its
+       upload: their kernels run between this graph and a second one of the read-backs
+    */
+    if (gpustate || replaylen) {
+        CUDA_ASSERT(cudaStreamEndCapture(mcxstream, &respingraph));
+        mmc_cu_instantiate(&respinexec, respingraph);
+        CUDA_ASSERT(cudaStreamBeginCapture(mcxstream, cudaStreamCaptureModeThreadLocal));
+    } else {
+        /*the kernel is inside the graph: time it by event nodes, or else time the whole graph*/
+#if !defined(__HIPCC__) && CUDART_VERSION >= 11010
+
+        if (prof) {
+            CUDA_ASSERT(cudaEventRecordWithFlags(profev[0], mcxstream, cudaEventRecordExternal));
+            profingraph = 1;
+        }
+
+#endif
+        mmc_main_loop <<< mcgrid, mcblock, sharedmemsize, mcxstream>>>(
+            threadphoton, oddphotons, gnode, (int*)gelem, gweight, gdref, gcamsignals,
+            gtype, (int*)gfacenb, gsrcelem, gnormal,
+            gdetphoton, gdetected, gseed, (int*)gprogress, genergy, greporter,
+            gsrcpattern, NULL, NULL, NULL, gphotonseed, gdebugdata, gdetimage, NULL, ginvcdf, gdetgrid, gelemmed);
+#if !defined(__HIPCC__) && CUDART_VERSION >= 11010
+
+        if (profingraph) {
+            CUDA_ASSERT(cudaEventRecordWithFlags(profev[1], mcxstream, cudaEventRecordExternal));
+        }
+
+#endif
+    }
+
+    CUDA_ASSERT(cudaMemcpyAsync(hostrep, greporter, sizeof(MCXReporter), cudaMemcpyDeviceToHost, mcxstream));
+    mmc_sum_energy <<< cfg->srcnum << 1, MMC_REDUCE_BLOCK, 0, mcxstream >>> (genergysum, genergy, (uint)gpu[gpuid].autothread, (uint)cfg->srcnum);
+    CUDA_ASSERT(cudaMemcpyAsync(energy, genergysum, sizeof(double) * (cfg->srcnum << 1), cudaMemcpyDeviceToHost, mcxstream));
+
+    if (cfg->issavedet) {
+        CUDA_ASSERT(cudaMemcpyAsync(hostdetected, gdetected, sizeof(uint), cudaMemcpyDeviceToHost, mcxstream));
+        CUDA_ASSERT(cudaMemcpyAsync(Pdet, gdetphoton, sizeof(float) * cfg->maxdetphoton * hostdetreclen,
+                                    cudaMemcpyDeviceToHost, mcxstream));
+
+        if (cfg->issaveseed) {
+            CUDA_ASSERT(cudaMemcpyAsync(Pphotonseed, gphotonseed, cfg->maxdetphoton * (sizeof(RandType)*RAND_BUF_LEN),
+                                        cudaMemcpyDeviceToHost, mcxstream));
+        }
+    }
+
+    /*
+       flush: the float outputs are added to double-precision sums kept on the device and
+       cleared, so they restart from zero in each respin and never accumulate the whole run;
+       the sums are only read back once, after those of all devices are reduced
+    */
+    if (cfg->issaveref) {
+        mmc_accum_output <<< MIN((nflen + MMC_REDUCE_BLOCK - 1) / MMC_REDUCE_BLOCK, MMC_REDUCE_GRID), MMC_REDUCE_BLOCK, 0, mcxstream >>> (gdrefsum, gdref, nflen, 0);
+    }
+
+    if (cfg->issave2pt) {
+        mmc_accum_output <<< MIN((fieldlen + MMC_REDUCE_BLOCK - 1) / MMC_REDUCE_BLOCK, MMC_REDUCE_GRID), MMC_REDUCE_BLOCK, 0, mcxstream >>> (gfieldsum, gweight, fieldlen, fieldlen);
+    }
+
+    if (cfg->respin > 1 && cfg->flushrespin > 0) {
+        CUDA_ASSERT(cudaMemsetAsync(genergy, 0, sizeof(float) * (gpu[gpuid].autothread << 1) * cfg->srcnum, mcxstream));
+    }
+
+    if (gpustate || replaylen) {
+        CUDA_ASSERT(cudaStreamEndCapture(mcxstream, &readgraph));
+        mmc_cu_instantiate(&readexec, readgraph);
+    } else {
+        CUDA_ASSERT(cudaStreamEndCapture(mcxstream, &respingraph));
+        mmc_cu_instantiate(&respinexec, respingraph);
+    }
+
+    /*the uploads above must be complete before the first respin*/
+    CUDA_ASSERT(cudaStreamSynchronize(mcxstream));
     tic = StartTimer();
 
     #pragma omp master
     {
         mcx_printheader(cfg);
 
-#ifdef MCX_TARGET_NAME
+#ifdef __HIPCC__
+        MMC_FPRINTF(
+            cfg->flog, "- code name: [MMC-Trinity] compiled by hipcc with HIP [%d.%d]\n",
+            HIP_VERSION_MAJOR, HIP_VERSION_MINOR);
+#elif defined(MCX_TARGET_NAME)
         MMC_FPRINTF(
             cfg->flog, "- code name: [%s] compiled by nvcc [%d.%d] with CUDA [%d]\n",
             "MMC-Trinity", __CUDACC_VER_MAJOR__, __CUDACC_VER_MINOR__, CUDART_VERSION);
@@ -570,7 +1279,7 @@ void mmc_run_simulation(mcconfig* cfg, tetmesh* mesh, raytracer* tracer, GPUInfo
             __CUDACC_VER_MAJOR__, __CUDACC_VER_MINOR__, CUDART_VERSION);
 #endif
         MMC_FPRINTF(cfg->flog, "- compiled with: [RNG] %s [Seed Length] %d\n",
-                    MCX_RNG_NAME, RAND_SEED_WORD_LEN);
+                    (param.rngtype ? "Philox2x32-10 RNG" : MCX_RNG_NAME), RAND_SEED_WORD_LEN);
         mcx_fflush(cfg->flog);
     }
     #pragma omp barrier
@@ -595,7 +1304,7 @@ void mmc_run_simulation(mcconfig* cfg, tetmesh* mesh, raytracer* tracer, GPUInfo
                     "lauching mcx_main_loop for time window [%.1fns %.1fns] ...\n",
                     twindow0 * 1e9, twindow1 * 1e9);
 
-        MMC_FPRINTF(cfg->flog, "requesting %ld bytes of shared memory\n", sharedmemsize);
+        MMC_FPRINTF(cfg->flog, "requesting %ld bytes of shared memory%s\n", sharedmemsize, (param.islocalmesh ? ", including a copy of the mesh" : ""));
 
         mcx_fflush(cfg->flog);
 
@@ -608,38 +1317,193 @@ void mmc_run_simulation(mcconfig* cfg, tetmesh* mesh, raytracer* tracer, GPUInfo
             param.tstart = twindow0;
             param.tend = twindow1;
 
+            /*new seeds for this respin, uploaded by the graph from the pinned seed buffer;
+              the Philox RNG keeps the key and continues the photon indices instead*/
+            if (param.rngtype) {
+                *hostoffset = iter * respinphoton + devoffset;
+            } else if (iter > 0 && RAND_SEED_WORD_LEN > 1) {
+                for (i = 0; i < gpu[gpuid].autothread * RAND_SEED_WORD_LEN; i++) {
+                    Pseed[i] = rand();
+                }
+            }
+
+            if (prof && !profingraph) {
+                CUDA_ASSERT(cudaEventRecord(profev[0], mcxstream));
+            }
+
+            CUDA_ASSERT(cudaGraphLaunch(respinexec, mcxstream));
+
+            if (prof && !(gpustate || replaylen)) {
+                prof->nlaunch++;
+            }
+
+            /*
+               sorted mode: launch short passes until no photon is in flight or left; after each
+               pass, the slots are listed by their element bin, so that a warp of the next pass
+               traces photons in nearby elements
+            */
+            if (cfg->gpusort > 0) {
+                for (int pass = 0; ; pass++) {
+                    CUDA_ASSERT(cudaMemsetAsync(gsorthist, 0, sizeof(uint) * (sortbin + 1), mcxstream));
+                    mmc_sort_loop <<< mcgrid, mcblock, sortsharedmem, mcxstream>>>(
+                        threadphoton, oddphotons, pass, cfg->gpusort, gsortorder, gsortstate, gsortfix, gsortppath, gsortbin, gsorthist, sortbin,
+                        gnode, (int*)gelem, gweight, gdref, gcamsignals, gtype, (int*)gfacenb, gsrcelem, gnormal, gdetphoton, gdetected,
+                        gseed, (int*)gprogress, genergy, greporter, gsrcpattern, gdetimage, ginvcdf, gdetgrid, gelemmed);
+                    CUDA_ASSERT(cudaMemcpyAsync(hostsort, gsorthist + sortbin, sizeof(uint), cudaMemcpyDeviceToHost, mcxstream));
+                    CUDA_ASSERT(cudaMemcpyAsync(hostsort + 1, &greporter->photonid, sizeof(uint), cudaMemcpyDeviceToHost, mcxstream));
+                    mmc_sort_scan <<< 1, MMC_SORT_SCAN_BLOCK, 0, mcxstream>>>(gsorthist, sortbin);
+                    mmc_sort_scatter <<< mcgrid, mcblock, 0, mcxstream>>>(gsortbin, gsorthist, gsortorder, gpu[gpuid].autothread);
+                    CUDA_ASSERT(cudaStreamSynchronize(mcxstream));
+
+                    if (prof) {
+                        prof->nlaunch++;
+                    }
+
+                    if (hostsort[0] == gpu[gpuid].autothread && hostsort[1] >= (uint)(threadphoton * gpu[gpuid].autothread + oddphotons)) {
+                        break;
+                    }
+                }
+
+                if (prof) {
+                    CUDA_ASSERT(cudaEventRecord(profev[1], mcxstream));
+                }
+
+                CUDA_ASSERT(cudaGraphLaunch(readexec, mcxstream));
+            }
+
+            /*
+               split mode: each pass launches photons on the idle slots, advances the photons in
+               flight by at most --fission scattering events, then saves the records of those that
+               terminated, until no photon is in flight or left
+            */
+            if (cfg->gpufission > 0) {
+                for (int pass = 0; ; pass++) {
+                    CUDA_ASSERT(cudaMemsetAsync(gsorthist, 0, sizeof(uint), mcxstream));
+                    mmc_fission_launch <<< mcgrid, mcblock, sortsharedmem, mcxstream>>>(
+                        threadphoton, oddphotons, pass, gsortstate, gsortfix, gsortppath, gfissionflag,
+                        gnode, (int*)gelem, gsrcelem, gseed, genergy, greporter, gsrcpattern);
+                    mmc_fission_move <<< mcgrid, mcblock, sortsharedmem, mcxstream>>>(
+                        cfg->gpufission, gsortstate, gsortfix, gsortppath, gfissionflag,
+                        gnode, (int*)gelem, gweight, gtype, (int*)gfacenb, gnormal, greporter, ginvcdf, gelemmed);
+                    mmc_fission_record <<< mcgrid, mcblock, sortsharedmem, mcxstream>>>(
+                        gsortstate, gsortfix, gsortppath, gfissionflag, gsorthist,
+                        gdref, gcamsignals, gdetimage, gtype, gnormal, gdetphoton, gdetected, (int*)gprogress, genergy, greporter, gdetgrid);
+                    CUDA_ASSERT(cudaMemcpyAsync(hostsort, gsorthist, sizeof(uint), cudaMemcpyDeviceToHost, mcxstream));
+                    CUDA_ASSERT(cudaMemcpyAsync(hostsort + 1, &greporter->photonid, sizeof(uint), cudaMemcpyDeviceToHost, mcxstream));
+                    CUDA_ASSERT(cudaStreamSynchronize(mcxstream));
+
+                    if (prof) {
+                        prof->nlaunch++;
+                    }
+
+                    if (hostsort[0] == gpu[gpuid].autothread && hostsort[1] >= (uint)(threadphoton * gpu[gpuid].autothread + oddphotons)) {
+                        break;
+                    }
+                }
+
+                if (prof) {
+                    CUDA_ASSERT(cudaEventRecord(profev[1], mcxstream));
+                }
+
+                CUDA_ASSERT(cudaGraphLaunch(readexec, mcxstream));
+            }
+
+            /*
+               replay: the photons of the launch, from its first index in the whole run, run in
+               chunks of replaylen; the host stages a chunk once the kernel that last read its
+               buffer set has completed, and the upload runs while the previous chunk is traced
+            */
+            if (replaylen) {
+                uint first = iter * respinphoton + devoffset, launchphoton = threadphoton * gpu[gpuid].autothread + oddphotons;
+
+                for (uint done = 0; done < launchphoton; done += replaylen) {
+                    uint len = MIN(replaylen, launchphoton - done), set = (nreplay++ & 1);
+                    int chunkthread = (int)(len / gpu[gpuid].autothread), chunkodd = (int)(len - chunkthread * gpu[gpuid].autothread);
+
+                    CUDA_ASSERT(cudaEventSynchronize(replayend[set]));
+                    mmc_cu_uploadreplay(cfg, hostreplay[set], greplayseed[set], greplayweight[set], greplaytime[set], greplaydetid[set], first + done, len, replaylen, replaystream);
+                    CUDA_ASSERT(cudaEventRecord(replayup[set], replaystream));
+                    CUDA_ASSERT(cudaStreamWaitEvent(mcxstream, replayup[set], 0));
+
+                    if (cfg->ispersistent && done > 0) {
+                        CUDA_ASSERT(cudaMemsetAsync(&greporter->photonid, 0, sizeof(uint), mcxstream));
+                    }
 
-            mmc_main_loop <<< mcgrid, mcblock, sharedmemsize>>>(
-                threadphoton, oddphotons, gnode, (int*)gelem, gweight, gdref,
-                gtype, (int*)gfacenb, gsrcelem, gnormal,
-                gdetphoton, gdetected, gseed, (int*)gprogress, genergy, greporter,
-                gsrcpattern, greplayweight, greplaytime, greplayseed, gphotonseed, gdebugdata);
+                    mmc_main_loop <<< mcgrid, mcblock, sharedmemsize, mcxstream>>>(
+                        chunkthread, chunkodd, gnode, (int*)gelem, gweight, gdref, gcamsignals,
+                        gtype, (int*)gfacenb, gsrcelem, gnormal,
+                        gdetphoton, gdetected, gseed, (int*)gprogress, genergy, greporter,
+                        gsrcpattern, greplayweight[set], greplaytime[set], greplayseed[set], gphotonseed, gdebugdata, gdetimage, greplaydetid[set], ginvcdf, gdetgrid, gelemmed);
+                    CUDA_ASSERT(cudaEventRecord(replayend[set], mcxstream));
+
+                    if (prof) {
+                        prof->nlaunch++;
+                    }
+                }
+
+                if (prof) {
+                    CUDA_ASSERT(cudaEventRecord(profev[1], mcxstream));
+                }
+
+                CUDA_ASSERT(cudaGraphLaunch(readexec, mcxstream));
+            }
+
+            /*without event nodes in the graph, the kernel time of the default mode includes the read-back*/
+            if (prof) {
+                if (!profingraph && !(gpustate || replaylen)) {
+                    CUDA_ASSERT(cudaEventRecord(profev[1], mcxstream));
+                }
+
+                CUDA_ASSERT(cudaEventRecord(profev[2], mcxstream));
+            }
+
+            if (MMC_HASPROGRESS(cfg)) {
+                kerneldone = 0;
+                CUDA_ASSERT(cudaLaunchHostFunc(mcxstream, mmc_cu_kerneldone, (void*)&kerneldone));
+            }
 
             #pragma omp master
             {
-                if ((cfg->debuglevel & MCX_DEBUG_PROGRESS)) {
+                if (MMC_HASPROGRESS(cfg)) {
                     int p0 = 0, ndone = -1;
+                    /*the counter is bumped once per thread, or once per photon in the persistent mode*/
+                    int ntotal = (cfg->ispersistent || gpustate) ? threadphoton * (int)gpu[gpuid].autothread + oddphotons : (int)gpu[0].autothread;
+
+                    /*each replay chunk is a launch of all threads*/
+                    if (replaylen && !cfg->ispersistent) {
+                        ntotal *= ((uint)(threadphoton * gpu[gpuid].autothread + oddphotons) + replaylen - 1) / replaylen;
+                    }
 
-                    mcx_progressbar(-0.f);
+                    mcx_reportprogress(cfg, -0.f);
 
                     do {
                         ndone = *progress;
 
                         if (ndone > p0) {
-                            mcx_progressbar((float)ndone / gpu[0].autothread);
+                            mcx_reportprogress(cfg, (iter + (float)ndone / ntotal) / cfg->respin);
                             p0 = ndone;
                         }
 
                         sleep_ms(100);
-                    } while (p0 < (int)gpu[0].autothread);
+                    } while (p0 < ntotal && !kerneldone);
 
-                    mcx_progressbar(1.f);
-                    MMC_FPRINTF(cfg->flog, "\n");
+                    mcx_reportprogress(cfg, (iter + 1.f) / cfg->respin);
+                    MMCDEBUG(cfg, dlProgress, (cfg->flog, "\n"));
                 }
             }
-            CUDA_ASSERT(cudaDeviceSynchronize());
+            CUDA_ASSERT(cudaStreamSynchronize(mcxstream));
             tic1 = GetTimeMillis();
             toc += tic1 - tic0;
+
+            if (prof) {
+                float kernelms = 0.f, copyms = 0.f;
+
+                CUDA_ASSERT(cudaEventElapsedTime(&kernelms, profev[0], profev[1]));
+                CUDA_ASSERT(cudaEventElapsedTime(&copyms, profev[1], profev[2]));
+                prof->kernel += (unsigned long long)(kernelms * 1e6);
+                prof->copy += (unsigned long long)(copyms * 1e6);
+            }
+
             MMC_FPRINTF(cfg->flog,
                         "kernel complete:  \t%d ms\nretrieving flux ... \t",
                         tic1 - tic);
@@ -650,32 +1514,20 @@ void mmc_run_simulation(mcconfig* cfg, tetmesh* mesh, raytracer* tracer, GPUInfo
                 cfg->runtime = tic1 - tic;
             }
 
-            MCXReporter rep;
-            CUDA_ASSERT(cudaMemcpy(&rep, greporter, sizeof(MCXReporter),
-                                   cudaMemcpyDeviceToHost));
-            reporter.raytet += rep.raytet;
-            reporter.jumpdebug += rep.jumpdebug;
-
-            energy = (float*)calloc(sizeof(float) * cfg->srcnum, gpu[gpuid].autothread << 1);
+            reporter.raytet += hostrep->raytet;
+            reporter.jumpdebug += hostrep->jumpdebug;
 
-            CUDA_ASSERT(cudaMemcpy(energy, genergy,
-                                   sizeof(float) * (gpu[gpuid].autothread << 1) * cfg->srcnum,
-                                   cudaMemcpyDeviceToHost));
             #pragma omp critical
             {
 
-                for (i = 0; i < gpu[gpuid].autothread; i++) {
-                    for (j = 0; j < (uint) cfg->srcnum; j++) {
-                        cfg->energyesc[j] += energy[(i << 1) * cfg->srcnum + j];
-                        cfg->energytot[j] += energy[((i << 1) + 1) * cfg->srcnum + j];
-                        energyesc += energy[(i << 1) * cfg->srcnum + j];
-                        energytot += energy[((i << 1) + 1) * cfg->srcnum + j];
-                    }
+                for (j = 0; j < (uint) cfg->srcnum; j++) {
+                    cfg->energyesc[j] += energy[j];
+                    cfg->energytot[j] += energy[cfg->srcnum + j];
+                    energyesc += energy[j];
+                    energytot += energy[cfg->srcnum + j];
                 }
             }
 
-            free(energy);
-
             /**
              * If '-D M' is specified, we retrieve photon trajectory data and store those to \c cfg.exportdebugdata and \c cfg.debugdatalen
              */
@@ -702,15 +1554,7 @@ are more than what your have specified (%d), please use the --maxjumpdebug optio
             }
 
             if (cfg->issavedet) {
-                CUDA_ASSERT(cudaMemcpy(&detected, gdetected, sizeof(uint), cudaMemcpyDeviceToHost));
-
-                CUDA_ASSERT(cudaMemcpy(Pdet, gdetphoton, sizeof(float) * cfg->maxdetphoton * hostdetreclen,
-                                       cudaMemcpyDeviceToHost));
-
-                if (cfg->issaveseed) {
-                    CUDA_ASSERT(cudaMemcpy(Pphotonseed, gphotonseed, cfg->maxdetphoton * (sizeof(RandType)*RAND_BUF_LEN),
-                                           cudaMemcpyDeviceToHost));
-                }
+                detected = *hostdetected;
 
                 if (detected > cfg->maxdetphoton) {
                     MMC_FPRINTF(cfg->flog, "WARNING: the detected photon (%d) \
@@ -718,14 +1562,22 @@ are more than what your have specified (%d), please use the --maxjumpdebug optio
                                 detected, cfg->maxdetphoton);
                 } else {
                     MMC_FPRINTF(cfg->flog, "detected %d photons, total: %d\t", detected,
-                                cfg->detectedcount + detected);
+                                cfg->detectedcount + ((cfg->streamdet > 0) ? cfg->his.savedphoton : 0) + detected);
                 }
 
                 #pragma omp atomic
                 cfg->his.detected += detected;
                 detected = MIN(detected, cfg->maxdetphoton);
 
-                if (cfg->exportdetected) {
+                if (cfg->streamdet > 0) {
+#ifndef MCX_CONTAINER
+                    #pragma omp critical
+                    {
+                        mesh_restoredetid(mesh, cfg, Pdet, detected, hostdetreclen);
+                        mesh_appenddetphoton(Pdet, detected, hostdetreclen, cfg);
+                    }
+#endif
+                } else if (cfg->exportdetected) {
                     #pragma omp critical
                     {
                         cfg->exportdetected = (float*)realloc(
@@ -744,54 +1596,76 @@ are more than what your have specified (%d), please use the --maxjumpdebug optio
                 }
             }
 
-            if (cfg->issaveref) {
-                float* rawdref = (float*)calloc(sizeof(float), nflen);
-
-                CUDA_ASSERT(cudaMemcpy(rawdref, gdref, sizeof(float) * nflen,
-                                       cudaMemcpyDeviceToHost));
-
-                for (i = 0; i < nflen; i++) { // accumulate field, can be done in the GPU
-                    dref[i] += rawdref[i];    //+rawfield[i+fieldlen];
-                }
-
-                free(rawdref);
-            }
-
-            // handling the 2pt distributions
             if (cfg->issave2pt) {
-                float* rawfield = (float*)malloc(sizeof(float) * fieldlen * 2);
-
-                CUDA_ASSERT(cudaMemcpy(rawfield, gweight, sizeof(float) * fieldlen * 2,
-                                       cudaMemcpyDeviceToHost));
                 MMC_FPRINTF(cfg->flog, "transfer complete:        %d ms\n",
                             GetTimeMillis() - tic);
                 mcx_fflush(cfg->flog);
+            }
 
-                for (i = 0; i < fieldlen; i++) { // accumulate field, can be done in the GPU
-                    field[i] += rawfield[i] + rawfield[i + fieldlen];    //+rawfield[i+fieldlen];
-                }
+            // loop over work devices
+        } // iteration
+    }   // time gates
 
-                free(rawfield);
+    /**
+     * In the wide-field detector mode (-x 2), the detector image was binned on the device
+     * across all respins, we only need to sum the images from all devices
+     */
+    if (detimagesize) {
+        float* rawdetimage = (float*)malloc(sizeof(float) * detimagesize);
+        CUDA_ASSERT(cudaMemcpy(rawdetimage, gdetimage, sizeof(float) * detimagesize, cudaMemcpyDeviceToHost));
+
+        #pragma omp critical
+        {
+            for (i = 0; i < detimagesize; i++) {
+                cfg->exportdetimage[i] += rawdetimage[i];
             }
+        }
 
-            if (cfg->respin > 1 && RAND_SEED_WORD_LEN > 1) {
-                Pseed = (uint*)malloc(sizeof(uint) * gpu[gpuid].autothread *
-                                      RAND_SEED_WORD_LEN);
+        free(rawdetimage);
+    }
 
-                for (i = 0; i < gpu[gpuid].autothread * RAND_SEED_WORD_LEN; i++) {
-                    Pseed[i] = rand();
-                }
+    cuout[threadid].gpuid = gpuid;
+    cuout[threadid].gfield = gfieldsum;
+    cuout[threadid].gdref = gdrefsum;
 
-                CUDA_ASSERT(cudaMemcpy(gseed, Pseed,
-                                       sizeof(uint) * gpu[gpuid].autothread*
-                                       RAND_SEED_WORD_LEN,
-                                       cudaMemcpyHostToDevice));
-                free(Pseed);
+    #pragma omp barrier
+
+    /*
+       the first device adds the output sums of the others to its own, so only one device
+       copies the output back to the host; the others keep theirs until the final barrier
+    */
+    #pragma omp master
+    {
+        double* staging = NULL;
+
+        if (cfg->deviceid[1] && (cfg->issave2pt || cfg->issaveref)) {
+            CUDA_ASSERT(cudaMalloc((void**)&staging, sizeof(double) * MIN(MAX(fieldlen, nflen), (uint)MMC_PEER_CHUNK)));
+        }
+
+        for (i = 1; i < MAX_DEVICE && cfg->deviceid[i]; i++) {
+            if (cfg->issave2pt) {
+                mmc_cu_reducepeer(gfieldsum, gpuid, cuout[i].gfield, cuout[i].gpuid, fieldlen, staging, mcxstream);
             }
 
-            // loop over work devices
-        } // iteration
-    }   // time gates
+            if (cfg->issaveref) {
+                mmc_cu_reducepeer(gdrefsum, gpuid, cuout[i].gdref, cuout[i].gpuid, nflen, staging, mcxstream);
+            }
+        }
+
+        if (cfg->issave2pt) {
+            CUDA_ASSERT(cudaMemcpyAsync(dfield, gfieldsum, sizeof(double) * fieldlen, cudaMemcpyDeviceToHost, mcxstream));
+        }
+
+        if (cfg->issaveref) {
+            CUDA_ASSERT(cudaMemcpyAsync(dref, gdrefsum, sizeof(double) * nflen, cudaMemcpyDeviceToHost, mcxstream));
+        }
+
+        CUDA_ASSERT(cudaStreamSynchronize(mcxstream));
+
+        if (staging) {
+            CUDA_ASSERT(cudaFree(staging));
+        }
+    }
 
     #pragma omp master
     {
@@ -801,12 +1675,12 @@ are more than what your have specified (%d), please use the --maxjumpdebug optio
             if (cfg->basisorder == 0 || cfg->method == rtBLBadouelGrid) {
                 for (uint i = 0; i < fieldlen; i++)
                     #pragma omp atomic
-                    cfg->exportfield[i] += field[i];
+                    cfg->exportfield[i] += dfield[i];
             } else {
-                for (i = 0; i < cfg->maxgate; i++) {
+                for (i = 0; i < cfg->maxgate * cfg->replaydetnum + 2 * cfg->freqnum; i++) {
                     for (j = 0; j < mesh->ne; j++) {
                         for (srcid = 0; srcid < cfg->srcnum; srcid++) {
-                            float ww = field[(i * mesh->ne + j) * cfg->srcnum + srcid] * 0.25f;
+                            double ww = dfield[(i * mesh->ne + j) * cfg->srcnum + srcid] * 0.25;
                             int k;
 
                             for (k = 0; k < mesh->elemlen; k++) {
@@ -838,8 +1712,33 @@ are more than what your have specified (%d), please use the --maxjumpdebug optio
             cfg->his.normalizer = sum_normalizer / cfg->srcnum; // average normalizer value for all simulated sources
         }
 
+        /*with --detstat, the detector image holds the per-detector sums of accumdetstat()*/
+        if (cfg->isdetstat) {
+            double* detsums = (double*)malloc(sizeof(double) * detimagesize);
+
+            for (size_t k = 0; k < detimagesize; k++) {
+                detsums[k] = cfg->exportdetimage[k];
+            }
+
+            mesh_normdetstat(mesh, cfg, detsums, (double)cfg->nphoton);
+            free(detsums);
+        }
+
 #ifndef MCX_CONTAINER
 
+        if (cfg->exportdetstat && cfg->parentid == mpStandalone) {
+            MMC_FPRINTF(cfg->flog, "saving detector statistics ...\n");
+            mesh_savedetstat(mesh, cfg);
+        }
+
+        if (cfg->issaveexit == 2 && cfg->parentid == mpStandalone) {
+            MMC_FPRINTF(cfg->flog, "saving detector image to file ...\t");
+            mesh_savedetimage(cfg->exportdetimage, cfg);
+            MMC_FPRINTF(cfg->flog, "saving data complete : %d ms\n\n",
+                        GetTimeMillis() - tic);
+            mcx_fflush(cfg->flog);
+        }
+
         if (cfg->issave2pt && cfg->parentid == mpStandalone) {
             MMC_FPRINTF(cfg->flog, "saving data to file ...\t");
             mesh_saveweight(mesh, cfg, 0);
@@ -848,13 +1747,16 @@ are more than what your have specified (%d), please use the --maxjumpdebug optio
             mcx_fflush(cfg->flog);
         }
 
-        if (cfg->issavedet && cfg->parentid == mpStandalone &&
-                cfg->exportdetected) {
+        if (cfg->streamdet > 0) {
+            mesh_appenddetphoton(NULL, 0, hostdetreclen, cfg);
+        } else if (cfg->issavedet && cfg->parentid == mpStandalone &&
+                   cfg->exportdetected) {
             cfg->his.totalphoton = cfg->nphoton;
             cfg->his.unitinmm = cfg->unitinmm;
             cfg->his.savedphoton = cfg->detectedcount;
             cfg->his.detected = cfg->detectedcount;
-            cfg->his.colcount = (2 + (cfg->ismomentum > 0)) * cfg->his.maxmedia + (cfg->issaveexit > 0) * 6 + 2; /*column count=maxmedia+3*/
+            cfg->his.colcount = hostdetreclen;
+            cfg->his.savedetflag = cfg->savedetflag;
             mesh_savedetphoton(cfg->exportdetected, (void*)(cfg->exportseed), cfg->detectedcount,
                                (sizeof(uint64_t) * RAND_BUF_LEN), cfg);
         }
@@ -877,6 +1779,13 @@ are more than what your have specified (%d), please use the --maxjumpdebug optio
             mesh_saveweight(mesh, cfg, 1);
         }
 
+        if (cfg->shmname[0] && cfg->parentid == mpStandalone) {
+            MMC_FPRINTF(cfg->flog, "saving outputs to shared memory ...\t");
+            mesh_saveshm(mesh, cfg, hostdetreclen);
+            MMC_FPRINTF(cfg->flog, "saving data complete : %d ms\n\n",
+                        GetTimeMillis() - tic);
+        }
+
 #endif
 
         // total energy here equals total simulated photons+unfinished photons for
@@ -894,33 +1803,69 @@ are more than what your have specified (%d), please use the --maxjumpdebug optio
         mcx_fflush(cfg->flog);
     }
     #pragma omp barrier
-    CUDA_ASSERT(cudaFree(gnode));
-    CUDA_ASSERT(cudaFree(gelem));
-    CUDA_ASSERT(cudaFree(gtype));
-    CUDA_ASSERT(cudaFree(gfacenb));
+
+    /*keep the mesh on the device for later runs of the same mesh session*/
+    if (cfg->meshsession) {
+        if (!ismeshcached) {
+            cumesh[gpuid].session = cfg->meshsession;
+            cumesh[gpuid].nn = mesh->nn;
+            cumesh[gpuid].ne = mesh->ne;
+            cumesh[gpuid].elemlen = mesh->elemlen;
+            cumesh[gpuid].method = cfg->method;
+            cumesh[gpuid].ispackmesh = param.ispackmesh;
+            cumesh[gpuid].halffacenum = param.halffacenum;
+            cumesh[gpuid].gnode = gnode;
+            cumesh[gpuid].gelem = gelem;
+            cumesh[gpuid].gtype = gtype;
+            cumesh[gpuid].gfacenb = gfacenb;
+            cumesh[gpuid].gnormal = gnormal;
+        }
+    } else {
+        CUDA_ASSERT(cudaFree(gnode));
+        CUDA_ASSERT(cudaFree(gelem));
+        CUDA_ASSERT(cudaFree(gtype));
+        CUDA_ASSERT(cudaFree(gfacenb));
+        CUDA_ASSERT(cudaFree(gnormal));
+    }
+
     CUDA_ASSERT(cudaFree(gsrcelem));
-    CUDA_ASSERT(cudaFree(gnormal));
+    free(packmesh);
+    free(halfface);
+    free(halffacetable);
     CUDA_ASSERT(cudaFree(gseed));
     CUDA_ASSERT(cudaFree(gdetphoton));
     CUDA_ASSERT(cudaFree(gweight));
     CUDA_ASSERT(cudaFree(gdref));
     CUDA_ASSERT(cudaFree(genergy));
+    CUDA_ASSERT(cudaFree(genergysum));
     CUDA_ASSERT(cudaFree(gdetected));
 
     if (gsrcpattern) {
         CUDA_ASSERT(cudaFree(gsrcpattern));
     }
 
-    if (greplayweight) {
-        CUDA_ASSERT(cudaFree(greplayweight));
-    }
+    if (replaylen) {
+        for (i = 0; i < 2; i++) {
+            CUDA_ASSERT(cudaFree(greplayweight[i]));
+            CUDA_ASSERT(cudaFree(greplayseed[i]));
+            CUDA_ASSERT(cudaFree(greplaytime[i]));
+
+            if (greplaydetid[i]) {
+                CUDA_ASSERT(cudaFree(greplaydetid[i]));
+            }
 
-    if (greplayseed) {
-        CUDA_ASSERT(cudaFree(greplayseed));
+            CUDA_ASSERT(cudaFreeHost(hostreplay[i]));
+            CUDA_ASSERT(cudaEventDestroy(replayup[i]));
+            CUDA_ASSERT(cudaEventDestroy(replayend[i]));
+        }
+
+        CUDA_ASSERT(cudaStreamDestroy(replaystream));
     }
 
-    if (greplaytime) {
-        CUDA_ASSERT(cudaFree(greplaytime));
+    if (prof) {
+        for (i = 0; i < 3; i++) {
+            CUDA_ASSERT(cudaEventDestroy(profev[i]));
+        }
     }
 
     if (gphotonseed) {
@@ -931,28 +1876,78 @@ are more than what your have specified (%d), please use the --maxjumpdebug optio
         CUDA_ASSERT(cudaFree(gdebugdata));
     }
 
+    if (gdetimage) {
+        CUDA_ASSERT(cudaFree(gdetimage));
+    }
+
+    if (ginvcdf) {
+        CUDA_ASSERT(cudaFree(ginvcdf));
+    }
+
+    if (gdetgrid) {
+        CUDA_ASSERT(cudaFree(gdetgrid));
+    }
+
+    if (gelemmed) {
+        CUDA_ASSERT(cudaFree(gelemmed));
+    }
+
+    CUDA_ASSERT(cudaFree(gcamsignals));
     CUDA_ASSERT(cudaFree(greporter));
 
+    if (gpustate) {
+        CUDA_ASSERT(cudaFree(gsortstate));
+        CUDA_ASSERT(cudaFree(gsortppath));
+        CUDA_ASSERT(cudaFree(gsortfix));
+        CUDA_ASSERT(cudaFree(gsortorder));
+        CUDA_ASSERT(cudaFree(gsortbin));
+        CUDA_ASSERT(cudaFree(gsorthist));
+        CUDA_ASSERT(cudaFree(gfissionflag));
+        CUDA_ASSERT(cudaFreeHost(hostsort));
+        CUDA_ASSERT(cudaGraphExecDestroy(readexec));
+        CUDA_ASSERT(cudaGraphDestroy(readgraph));
+    }
+
+    CUDA_ASSERT(cudaGraphExecDestroy(respinexec));
+    CUDA_ASSERT(cudaGraphDestroy(respingraph));
+    CUDA_ASSERT(cudaStreamDestroy(mcxstream));
+    CUDA_ASSERT(cudaFreeHost(Pseed));
+    CUDA_ASSERT(cudaFreeHost(energy));
+    CUDA_ASSERT(cudaFreeHost(hostdetected));
+    CUDA_ASSERT(cudaFreeHost(hostrep));
+    CUDA_ASSERT(cudaFreeHost(hostoffset));
+
+    if (gfieldsum) {
+        CUDA_ASSERT(cudaFree(gfieldsum));
+    }
+
+    if (gdrefsum) {
+        CUDA_ASSERT(cudaFree(gdrefsum));
+    }
+
     #pragma omp master
     {
         if (gpu) {
             free(gpu);
         }
 
-        free(cfg->energytot);
-        free(cfg->energyesc);
-        cfg->energytot = NULL;
-        cfg->energyesc = NULL;
+        if (isenergyowner) {
+            free(cfg->energytot);
+            free(cfg->energyesc);
+            cfg->energytot = NULL;
+            cfg->energyesc = NULL;
+        }
     }
 
     free(field);
+    free(dfield);
 
     if (Pdet) {
-        free(Pdet);
+        CUDA_ASSERT(cudaFreeHost(Pdet));
     }
 
     if (Pphotonseed) {
-        free(Pphotonseed);
+        CUDA_ASSERT(cudaFreeHost(Pphotonseed));
     }
 
     free(dref);
@@ -966,6 +1961,17 @@ void mmc_run_cu(mcconfig* cfg, tetmesh* mesh, raytracer* tracer) {
         mcx_error(-1, "No GPU device found\n", __FILE__, __LINE__);
     }
 
+    /*the first random number of the seed, as seeds[0] of the CPU threads*/
+    srand((cfg->seed > 0) ? cfg->seed : time(0));
+    curngkey = rand();
+
+    /*one entry per active device, in the order of the device threads*/
+    if (cfg->issaveprofile) {
+        cfg->devprof = (deviceprofile*)realloc(cfg->devprof, activedev * sizeof(deviceprofile));
+        cfg->profdev = activedev;
+        memset(cfg->devprof, 0, activedev * sizeof(deviceprofile));
+    }
+
 #ifdef _OPENMP
     /**
         Now we are ready to launch one thread for each involked GPU to run the simulation
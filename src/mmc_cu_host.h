@@ -32,7 +32,7 @@
 /***************************************************************************//**
 \file    mmc_cu_host.h
 
-\brief   CUDA host code for NVIDIA GPUs
+\brief   CUDA host code for NVIDIA GPUs, also built for AMD GPUs by hipcc (make hip)
 *******************************************************************************/
 
 #ifndef _MMCX_HOSTCODE_H
@@ -56,6 +56,7 @@ extern "C" {
 typedef unsigned char uchar;
 
 void mmc_run_cu(mcconfig* cfg, tetmesh* mesh, raytracer* tracer);
+void mmc_cu_release_meshcache(void);
 
 #ifdef  __cplusplus
 }
@@ -29,11 +29,7 @@
 **          GPL v3, see LICENSE.txt for details
 *******************************************************************************/
 
-#include <set>
-#include <list>
 #include <vector>
-#include <unordered_map>
-#include <array>
 #include <algorithm>
 #include <string>
 #include <string.h>
@@ -49,111 +45,236 @@ const int edgepair[TETEDGE][2] = {{0, 1}, {0, 2}, {0, 3}, {1, 2}, {1, 3}, {2, 3}
 
 const int facelist[4][3] = {{0, 1, 2}, {0, 1, 3}, {0, 2, 3}, {1, 2, 3}};
 
+/**
+ * @brief A tetrahedron edge keyed by its larger node index
+ *
+ * Edges are bucketed by their smaller node index, so the larger node index
+ * and the edge slot (element index * 6 + local edge index) identify the
+ * edge within a bucket.
+ */
+
+struct EdgeRecord {
+    int n2;              /**< larger node index of the edge */
+    unsigned int id;     /**< edge slot, element index * TETEDGE + local edge index */
+
+    bool operator<(const EdgeRecord& b) const {
+        return (n2 != b.n2) ? (n2 < b.n2) : (id < b.id);
+    }
+};
+
+/**
+ * @brief Add the edge mid-points of the tetrahedra to form 10-node elements
+ *
+ * The edge slots are counting-sorted by their smaller node index in parallel,
+ * each bucket is then sorted and scanned for unique edges. The unique edges
+ * are numbered in the order of their node pair, the mid-point of edge k is
+ * appended as node oldnn+k and mesh->elem2 stores k for each edge slot.
+ *
+ * @param[in,out] mesh: the mesh object, elem2, node and weight are (re)allocated
+ * @param[in] cfg: the simulation configuration structure
+ */
+
 #ifdef __cplusplus
     extern "C"
 #endif
 void mesh_10nodetet(tetmesh* mesh, mcconfig* cfg) {
-    int pos, n1, n2, oldnn = mesh->nn;
-    unsigned int setlen;
-    int* ee;
+    size_t nslot = (size_t)mesh->ne * TETEDGE, newnn;
+    int oldnn = mesh->nn;
+    std::vector<size_t> bucket(mesh->nn + 1, 0), cursor, edgestart(mesh->nn + 1, 0);
+    std::vector<EdgeRecord> edge(nslot);
 
-    std::set< std::pair<int, int> > edgeset;
-    std::set< std::pair<int, int> >::iterator iset;
-    std::list <std::pair<int, int> > edgelist;
-    std::list <std::pair<int, int> >::iterator it;
+    /*count the edges of each bucket, i.e. sharing the same smaller node*/
+    #pragma omp parallel for
+    for (int i = 0; i < mesh->ne; i++) {
+        int* ee = mesh->elem + i * mesh->elemlen;
 
-    std::pair<int, int> edge;
-    it = edgelist.begin();
-    iset = edgeset.begin();
+        for (int j = 0; j < TETEDGE; j++) {
+            int n1 = MIN(ee[edgepair[j][0]], ee[edgepair[j][1]]);
+            #pragma omp atomic
+            bucket[n1]++;
+        }
+    }
 
-    if (mesh->elem2 == NULL) {
-        mesh->elem2 = (int*)calloc(sizeof(int) * TETEDGE, mesh->ne);
+    for (int i = 0; i < mesh->nn; i++) {
+        bucket[i + 1] += bucket[i];
     }
 
-    for (int eid = 0; eid < mesh->ne; eid++)
-        for (int ed = 0; ed < TETEDGE; ed++) {
-            ee = (int*)(&mesh->elem[eid]);
-            n1 = MIN(ee[edgepair[ed][0]], ee[edgepair[ed][1]]);
-            n2 = MAX(ee[edgepair[ed][0]], ee[edgepair[ed][1]]);
-            edge = std::make_pair(n1, n2);
-            setlen = edgeset.size();
-            edgeset.insert(iset, edge);
-
-            if (setlen < edgeset.size()) { // if no previous edge
-                edgelist.insert(it, edge);
-                pos = edgelist.size() - 1;
-            } else {
-                std::list< std::pair<int, int> >::iterator edidx =
-                    std::find(edgelist.begin(), edgelist.end(), edge);
-                pos = std::distance( edgelist.begin(), edidx) ;
-            }
+    cursor.assign(bucket.begin(), bucket.end() - 1);
+
+    #pragma omp parallel for
+    for (int i = 0; i < mesh->ne; i++) {
+        int* ee = mesh->elem + i * mesh->elemlen;
 
-            mesh->elem2[eid * TETEDGE + ed] = pos;
+        for (int j = 0; j < TETEDGE; j++) {
+            int n1 = MIN(ee[edgepair[j][0]], ee[edgepair[j][1]]);
+            size_t pos;
+
+            #pragma omp atomic capture
+            pos = cursor[n1 - 1]++;
+
+            edge[pos].n2 = MAX(ee[edgepair[j][0]], ee[edgepair[j][1]]);
+            edge[pos].id = i * TETEDGE + j;
         }
+    }
+
+    std::vector<size_t>().swap(cursor);
 
-    pos = 0;
+    /*sort each bucket and count its unique edges*/
+    #pragma omp parallel for schedule(dynamic, 1024)
+    for (int i = 0; i < mesh->nn; i++) {
+        EdgeRecord* ebegin = &edge[0] + bucket[i], *eend = &edge[0] + bucket[i + 1];
+
+        std::sort(ebegin, eend);
+
+        for (EdgeRecord* e = ebegin; e < eend; e++) {
+            edgestart[i + 1] += (e == ebegin || e[-1].n2 != e->n2);
+        }
+    }
+
+    for (int i = 0; i < mesh->nn; i++) {
+        edgestart[i + 1] += edgestart[i];
+    }
+
+    newnn = edgestart[mesh->nn];
+
+    if (mesh->elem2 == NULL) {
+        mesh->elem2 = (int*)calloc(sizeof(int) * TETEDGE, mesh->ne);
+    }
 
-    mesh->nn += edgelist.size();
+    mesh->nn += newnn;
     mesh->node = (FLOAT3*)realloc((void*)mesh->node, sizeof(FLOAT3) * (mesh->nn));
     mesh->weight = (double*)realloc((void*)mesh->weight, sizeof(double) * mesh->nn * cfg->maxgate);
     memset(mesh->weight, 0, sizeof(double)*mesh->nn * cfg->maxgate); // if mesh->weight is filled, need to allocate a new buffer, and copy the old buffer gate by gate
 
-    for (it = edgelist.begin(); it != edgelist.end(); it++) {
-        for (int i = 0; i < 3; i++) {
-            ((float*)(&mesh->node[oldnn + pos]))[i] =
-                (((float*)(&mesh->node[it->first]))[i] + ((float*)(&mesh->node[it->second]))[i]) * 0.5f;
-        }
+    /*number the unique edges and append their mid-points*/
+    #pragma omp parallel for schedule(dynamic, 1024)
+    for (int i = 0; i < oldnn; i++) {
+        size_t pos = edgestart[i];
+
+        for (size_t k = bucket[i]; k < bucket[i + 1]; k++) {
+            if (k > bucket[i] && edge[k - 1].n2 == edge[k].n2) {
+                mesh->elem2[edge[k].id] = (int)(pos - 1);
+                continue;
+            }
+
+            float* p1 = (float*)(&mesh->node[i]), *p2 = (float*)(&mesh->node[edge[k].n2 - 1]);
+            float* pnew = (float*)(&mesh->node[oldnn + pos]);
 
-        pos++;
+            for (int j = 0; j < 3; j++) {
+                pnew[j] = (p1[j] + p2[j]) * 0.5f;
+            }
+
+            mesh->elem2[edge[k].id] = (int)(pos++);
+        }
     }
 }
 
 
-class Vec3Hash {
-  public:
-    std::size_t operator()(std::array<int, 3> const& vec) const {
-        std::size_t seed = 3;
+/**
+ * @brief A tetrahedron face keyed by its two larger node indices
+ *
+ * Faces are bucketed by their smallest node index, so the remaining two
+ * node indices and the face id (element index * 4 + local face index)
+ * identify the face within a bucket.
+ */
 
-        for (int i = 0; i < 3; i++) {
-            seed ^= vec[i] + 0x9e3779b9 + (seed << 6) + (seed >> 2);
-        }
+struct FaceRecord {
+    int n1;              /**< middle node index of the face */
+    int n2;              /**< largest node index of the face */
+    unsigned int id;     /**< face id, (element index << 2) + local face index */
 
-        return seed;
+    bool operator<(const FaceRecord& b) const {
+        return (n1 != b.n1) ? (n1 < b.n1) : ((n2 != b.n2) ? (n2 < b.n2) : (id < b.id));
     }
 };
 
+/**
+ * @brief Compute the face-neighbor table from the element list
+ *
+ * The faces are counting-sorted by their smallest node index in parallel,
+ * each bucket is then sorted and scanned for matching faces. Only 12 bytes
+ * per face and two counters per node are needed. If more than two elements
+ * share a face, the first and the last of them (in element order) are
+ * paired and the rest are left with no neighbor.
+ *
+ * @param[in,out] mesh: the mesh object, facenb is (re)allocated and filled
+ * @param[in] cfg: the simulation configuration structure
+ */
+
 #ifdef __cplusplus
     extern "C"
 #endif
 void mesh_getfacenb(tetmesh* mesh, mcconfig* cfg) {
-    std::unordered_map< std::array<int, 3>, std::pair<unsigned int, unsigned int>, Vec3Hash > facenb;
-    std::unordered_map< std::array<int, 3>, std::pair<unsigned int, unsigned int>, Vec3Hash > ::iterator it;
+    size_t nface = (size_t)mesh->ne * 4;
+    std::vector<size_t> bucket(mesh->nn + 1, 0), cursor;
+    std::vector<FaceRecord> face(nface);
 
+    /*count the faces of each bucket, i.e. sharing the same smallest node*/
+    #pragma omp parallel for
     for (int i = 0; i < mesh->ne; i++) {
         int* ee = mesh->elem + i * mesh->elemlen;
 
         for (int j = 0; j < 4; j++) {
-            std::array<int, 3> facevec = { ee[facelist[j][0]], ee[facelist[j][1]], ee[facelist[j][2]] };
-            std::sort (facevec.begin(), facevec.end());
+            int n0 = MIN(MIN(ee[facelist[j][0]], ee[facelist[j][1]]), ee[facelist[j][2]]);
+            #pragma omp atomic
+            bucket[n0]++;
+        }
+    }
 
-            if (facenb.find(facevec) != facenb.end()) {
-                facenb[facevec].second = (i << 2) + j + 1;
-            } else {
-                facenb[facevec] = std::make_pair((i << 2) + j, 0);
-            }
+    for (int i = 0; i < mesh->nn; i++) {
+        bucket[i + 1] += bucket[i];
+    }
+
+    cursor.assign(bucket.begin(), bucket.end() - 1);
+
+    /*scatter the faces to the buckets; the order within a bucket is fixed by the sort below*/
+    #pragma omp parallel for
+    for (int i = 0; i < mesh->ne; i++) {
+        int* ee = mesh->elem + i * mesh->elemlen;
+
+        for (int j = 0; j < 4; j++) {
+            int fv[3] = {ee[facelist[j][0]], ee[facelist[j][1]], ee[facelist[j][2]]};
+            size_t pos;
+
+            std::sort(fv, fv + 3);
+
+            #pragma omp atomic capture
+            pos = cursor[fv[0] - 1]++;
+
+            face[pos].n1 = fv[1];
+            face[pos].n2 = fv[2];
+            face[pos].id = (i << 2) + j;
         }
     }
 
+    std::vector<size_t>().swap(cursor);
+
     if (mesh->facenb) {
         free(mesh->facenb);
     }
 
     mesh->facenb = (int*)calloc(sizeof(int) * mesh->elemlen, mesh->ne);
 
-    for (it = facenb.begin(); it != facenb.end(); it++) {
-        if (it->second.second != 0) {
-            mesh->facenb[it->second.first] = ((it->second.second - 1) >> 2) + 1;
-            mesh->facenb[it->second.second - 1] = (it->second.first >> 2) + 1;
+    /*every face belongs to exactly one bucket, so the buckets are matched independently*/
+    #pragma omp parallel for schedule(dynamic, 1024)
+    for (int i = 0; i < mesh->nn; i++) {
+        FaceRecord* fbegin = &face[0] + bucket[i], *fend = &face[0] + bucket[i + 1];
+
+        std::sort(fbegin, fend);
+
+        for (FaceRecord* f = fbegin; f < fend;) {
+            FaceRecord* last = f;
+
+            while (last + 1 < fend && last[1].n1 == f->n1 && last[1].n2 == f->n2) {
+                last++;
+            }
+
+            if (last != f) {
+                mesh->facenb[f->id] = (last->id >> 2) + 1;
+                mesh->facenb[last->id] = (f->id >> 2) + 1;
+            }
+
+            f = last + 1;
         }
     }
 }
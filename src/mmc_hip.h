@@ -0,0 +1,120 @@
+/***************************************************************************//**
+**  \mainpage Mesh-based Monte Carlo (MMC) - a 3D photon simulator
+**
+**  \author Qianqian Fang <q.fang at neu.edu>
+**  \copyright Qianqian Fang, 2010-2025
+**
+**  \section sref Reference:
+**  \li \c (\b Fang2010) Qianqian Fang, <a href="http://www.opticsinfobase.org/abstract.cfm?uri=boe-1-1-165">
+**          "Mesh-based Monte Carlo Method Using Fast Ray-Tracing
+**          in Plucker Coordinates,"</a> Biomed. Opt. Express, 1(1) 165-175 (2010).
+**  \li \c (\b Fang2012) Qianqian Fang and David R. Kaeli,
+**           <a href="https://www.osapublishing.org/boe/abstract.cfm?uri=boe-3-12-3223">
+**          "Accelerating mesh-based Monte Carlo method on modern CPU architectures,"</a>
+**          Biomed. Opt. Express 3(12), 3223-3230 (2012)
+**  \li \c (\b Yao2016) Ruoyang Yao, Xavier Intes, and Qianqian Fang,
+**          <a href="https://www.osapublishing.org/boe/abstract.cfm?uri=boe-7-1-171">
+**          "Generalized mesh-based Monte Carlo for wide-field illumination and detection
+**           via mesh retessellation,"</a> Biomed. Optics Express, 7(1), 171-184 (2016)
+**  \li \c (\b Fang2019) Qianqian Fang and Shijie Yan,
+**          <a href="http://dx.doi.org/10.1117/1.JBO.24.11.115002">
+**          "Graphics processing unit-accelerated mesh-based Monte Carlo photon transport
+**           simulations,"</a> J. of Biomedical Optics, 24(11), 115002 (2019)
+**  \li \c (\b Yuan2021) Yaoshen Yuan, Shijie Yan, and Qianqian Fang,
+**          <a href="https://www.osapublishing.org/boe/fulltext.cfm?uri=boe-12-1-147">
+**          "Light transport modeling in highly complex tissues using the implicit
+**           mesh-based Monte Carlo algorithm,"</a> Biomed. Optics Express, 12(1) 147-161 (2021)
+**
+**  \section slicense License
+**          GPL v3, see LICENSE.txt for details
+*******************************************************************************/
+
+/***************************************************************************//**
+\file    mmc_hip.h
+
+\brief   CUDA to HIP aliases, to build the CUDA backend for AMD GPUs (make hip)
+
+hipcc compiles mmc_cu_host.cu and mmc_core.cu unchanged; the CUDA runtime
+calls and types used by them are mapped to their HIP equivalents here, which
+keeps the sources hipify-compatible. Under nvcc, this file is empty.
+*******************************************************************************/
+
+#ifndef _MMC_HIP_H
+#define _MMC_HIP_H
+
+#ifdef __HIPCC__
+
+#include <hip/hip_runtime.h>
+#include <hip/hip_fp16.h>
+
+#define cudaError_t                         hipError_t
+#define cudaSuccess                         hipSuccess
+#define cudaErrorPeerAccessAlreadyEnabled   hipErrorPeerAccessAlreadyEnabled
+#define cudaGetErrorString                  hipGetErrorString
+#define cudaGetLastError                    hipGetLastError
+
+#define cudaDeviceProp                      hipDeviceProp_t
+#define cudaGetDeviceCount                  hipGetDeviceCount
+#define cudaGetDeviceProperties             hipGetDeviceProperties
+#define cudaSetDevice                       hipSetDevice
+#define cudaSetDeviceFlags                  hipSetDeviceFlags
+#define cudaDeviceScheduleBlockingSync      hipDeviceScheduleBlockingSync
+#define cudaDeviceCanAccessPeer             hipDeviceCanAccessPeer
+#define cudaDeviceEnablePeerAccess          hipDeviceEnablePeerAccess
+#define cudaFuncAttributes                  hipFuncAttributes
+#define cudaFuncGetAttributes               hipFuncGetAttributes
+#define cudaOccupancyMaxActiveBlocksPerMultiprocessor hipOccupancyMaxActiveBlocksPerMultiprocessor
+
+#define cudaMalloc                          hipMalloc
+#define cudaFree                            hipFree
+#define cudaMallocHost(p,len)               hipHostMalloc(p, len, hipHostMallocDefault)
+#define cudaFreeHost                        hipHostFree
+#define cudaHostAlloc                       hipHostMalloc
+#define cudaHostAllocMapped                 hipHostMallocMapped
+#define cudaHostGetDevicePointer            hipHostGetDevicePointer
+#define cudaMallocManaged                   hipMallocManaged
+#define cudaMemAttachGlobal                 hipMemAttachGlobal
+#define cudaMemAdvise                       hipMemAdvise
+#define cudaMemAdviseSetAccessedBy          hipMemAdviseSetAccessedBy
+#define cudaMemAdviseSetPreferredLocation   hipMemAdviseSetPreferredLocation
+#define cudaMemPrefetchAsync                hipMemPrefetchAsync
+
+#define cudaMemcpy                          hipMemcpy
+#define cudaMemcpyAsync                     hipMemcpyAsync
+#define cudaMemcpyPeerAsync                 hipMemcpyPeerAsync
+#define cudaMemcpyToSymbolAsync             hipMemcpyToSymbolAsync
+#define cudaMemsetAsync                     hipMemsetAsync
+#define cudaMemcpyHostToDevice              hipMemcpyHostToDevice
+#define cudaMemcpyDeviceToHost              hipMemcpyDeviceToHost
+
+#define cudaStream_t                        hipStream_t
+#define cudaStreamNonBlocking               hipStreamNonBlocking
+#define cudaStreamCreateWithFlags           hipStreamCreateWithFlags
+#define cudaStreamSynchronize               hipStreamSynchronize
+#define cudaStreamDestroy                   hipStreamDestroy
+#define cudaStreamWaitEvent                 hipStreamWaitEvent
+#define cudaLaunchHostFunc                  hipLaunchHostFunc
+#define CUDART_CB                           /**< host callbacks need no calling convention under HIP */
+
+#define cudaEvent_t                         hipEvent_t
+#define cudaEventDisableTiming              hipEventDisableTiming
+#define cudaEventCreate                     hipEventCreate
+#define cudaEventCreateWithFlags            hipEventCreateWithFlags
+#define cudaEventRecord                     hipEventRecord
+#define cudaEventSynchronize                hipEventSynchronize
+#define cudaEventDestroy                    hipEventDestroy
+#define cudaEventElapsedTime                hipEventElapsedTime
+
+#define cudaGraph_t                         hipGraph_t
+#define cudaGraphExec_t                     hipGraphExec_t
+#define cudaStreamBeginCapture              hipStreamBeginCapture
+#define cudaStreamEndCapture                hipStreamEndCapture
+#define cudaStreamCaptureModeThreadLocal    hipStreamCaptureModeThreadLocal
+#define cudaGraphInstantiate                hipGraphInstantiate  /**< HIP keeps the 5-argument form, CUDART_VERSION is not defined */
+#define cudaGraphLaunch                     hipGraphLaunch
+#define cudaGraphExecDestroy                hipGraphExecDestroy
+#define cudaGraphDestroy                    hipGraphDestroy
+
+#endif
+
+#endif
@@ -37,6 +37,16 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+    #include <sys/utime.h>
+    #include <direct.h>
+#else
+    #include <utime.h>
+#endif
 #include "mmc_host.h"
 #include "mmc_tictoc.h"
 #include "mmc_const.h"
@@ -45,6 +55,12 @@
     #include <omp.h>
 #endif
 
+#ifdef MMC_USE_MPI
+    #include <mpi.h>
+
+    #define MMC_MPI_BLOCK  (1 << 28)   /**< element number of each MPI_Reduce call, keeps the counts within int */
+#endif
+
 /***************************************************************************//**
 In this unit, we first launch a master thread and initialize the
 necessary data structures. This include the command line options (cfg),
@@ -65,13 +81,43 @@ tetrahedral mesh (mesh) and the ray-tracer precomputed data (tracer).
  */
 
 int mmc_init_from_cmd(mcconfig* cfg, tetmesh* mesh, raytracer* tracer, int argc, char** argv) {
+    unsigned long long tphase = GetTimeNanos();
+
     mcx_initcfg(cfg);
+
+#ifdef MMC_USE_MPI
+    MPI_Comm_rank(MPI_COMM_WORLD, &cfg->mpirank);
+    MPI_Comm_size(MPI_COMM_WORLD, &cfg->mpisize);
+#endif
+
     mcx_parsecmd(argc, argv, cfg);
 
+    /*the session and the cache options do not change the outputs, the rest of the command line keys the result cache*/
+    if (cfg->resultcache[0]) {
+        int i;
+        cfg->cmdhash = 0xcbf29ce484222325ULL;
+
+        for (i = 1; i < argc; i++) {
+            if ((!strcmp(argv[i], "-s") || !strcmp(argv[i], "--session") || !strcmp(argv[i], "--resultcache")
+                    || !strcmp(argv[i], "--cachelimit")) && i + 1 < argc) {
+                i++;
+                continue;
+            }
+
+            cfg->cmdhash = mesh_hashbuffer(argv[i], strlen(argv[i]) + 1, cfg->cmdhash);
+        }
+    }
+
+    /*only rank 0 reports the timing and the progress*/
+    if (cfg->mpirank > 0) {
+        cfg->debuglevel &= ~(dlTime | dlProgress);
+    }
+
     if (cfg->isgpuinfo == 0) {
         mesh_init_from_cfg(mesh, cfg);
     }
 
+    cfg->profile[ppLoad] = GetTimeNanos() - tphase;
     return 0;
 }
 
@@ -134,309 +180,4251 @@ int mmc_cleanup(mcconfig* cfg, tetmesh* mesh, raytracer* tracer) {
  */
 
 int mmc_prep(mcconfig* cfg, tetmesh* mesh, raytracer* tracer) {
+    unsigned long long tphase = GetTimeNanos(), ttracer;
+
     mcx_prep(cfg);
-    tracer_init(tracer, mesh, cfg->method);
-    tracer_prep(tracer, cfg);
+
+    /*with --domain, the tracer is only built for the partition of this rank, after the source element is resolved*/
+    if (cfg->isdomain) {
+        tracer->d = tracer->m = tracer->n = NULL;
+        tracer->mesh = mesh;
+        tracer->method = cfg->method;
+        tracer_prep(tracer, cfg);
+        mesh_buildoutmask(mesh, cfg);
+        mesh_reorder(mesh, cfg);
+        mesh_partition(mesh, cfg);
+        ttracer = GetTimeNanos();
+        tracer_init_from_cache(tracer, mesh, cfg);
+        cfg->profile[ppTracer] = GetTimeNanos() - ttracer;
+    } else {
+        ttracer = GetTimeNanos();
+        tracer_init_from_cache(tracer, mesh, cfg);
+        cfg->profile[ppTracer] = GetTimeNanos() - ttracer;
+        tracer_prep(tracer, cfg);
+        mesh_buildoutmask(mesh, cfg);
+    }
+
+    /*renumber the mesh after the source element and ROI references are resolved, then rebuild the tracer*/
+    if (cfg->reorder && !cfg->isdomain) {
+        mesh_reorder(mesh, cfg);
+        tracer_clear(tracer);
+        ttracer = GetTimeNanos();
+        tracer_init_from_cache(tracer, mesh, cfg);
+        cfg->profile[ppTracer] += GetTimeNanos() - ttracer;
+    }
+
+    mesh_initsrclist(mesh, cfg);
+    mesh_buildsrcgrid(mesh, cfg);
+    mesh_buildsurfbvh(mesh, cfg);
+    mesh_buildroimask(mesh, cfg);
+    mesh_buildfacereflect(mesh, cfg);
+    mesh_builddetgrid(mesh, cfg);
+    mesh_packroi(mesh, cfg);
+    mesh_buildinvcdf(mesh, cfg);
+    mesh_builddiffusion(mesh, cfg);
+    cfg->profile[ppPrep] = GetTimeNanos() - tphase - cfg->profile[ppTracer];
     return 0;
 }
 
 /**
- * \brief Main function to launch CPU based MMC photon simulation
+ * \brief Prepare the next job of a batch without repeating the mesh setup
  *
- * This is the main loop of the Monte Carlo photon simulation. This function
- * run a complete photon simulation session based on one set of user input.
+ * A batch runs several jobs that only differ in the source, the detectors,
+ * the optical properties or the photon count on one mesh. The mesh, the
+ * ray-tracer and the element ordering prepared by mmc_prep for the first job
+ * are kept; this function only re-resolves the initial element of a moved
+ * point source (walking from the previous one), installs the new optical
+ * properties and clears the outputs accumulated by the previous job.
  *
- * \param[out] cfg: the simulation configuration structure
- * \param[out] mesh: the mesh data structure
- * \param[out] tracer: the ray-tracer data structure
+ * \param[in,out] cfg: the simulation configuration of the next job
+ * \param[in,out] mesh: the mesh data structure prepared by mmc_prep
+ * \param[in,out] tracer: the ray-tracer data structure prepared by mmc_prep
+ * \param[in] med: the new optical properties (mesh->prop+1 entries), NULL to keep the current ones
  */
 
-int mmc_run_mp(mcconfig* cfg, tetmesh* mesh, raytracer* tracer) {
-    RandType ran0[RAND_BUF_LEN] __attribute__ ((aligned(16)));
-    RandType ran1[RAND_BUF_LEN] __attribute__ ((aligned(16)));
-    unsigned int i, j;
-    float raytri = 0.f, raytri0 = 0.f;
-    unsigned int threadid = 0, ncomplete = 0, t0, dt, debuglevel = 0;
-    visitor master = {0.f, 0.f, 0.f, 0, 0, 0, NULL, NULL, NULL, NULL, NULL, NULL};
-    visitor_init(cfg, &master);
-
-    t0 = StartTimer();
+int mmc_prep_next(mcconfig* cfg, tetmesh* mesh, raytracer* tracer, const medium* med) {
+    if (cfg->nphoton <= 0) {
+        MMC_ERROR(-2, "cfg.nphoton must be a positive number");
+    }
 
-    mcx_printheader(cfg);
+    if (fabs(cfg->srcdir.x * cfg->srcdir.x + cfg->srcdir.y * cfg->srcdir.y + cfg->srcdir.z * cfg->srcdir.z - 1.f) > 1e-4) {
+        MMC_ERROR(-2, "field 'srcdir' must be a unitary vector (tolerance is 1e-4)");
+    }
 
-#if defined(MMC_LOGISTIC) || defined(MMC_SFMT)
-    cfg->issaveseed = 0;
-#endif
-    dt = GetTimeMillis();
-    MMCDEBUG(cfg, dlTime, (cfg->flog, "seed=%u\nsimulating ... \n", cfg->seed));
+    mcx_prep(cfg);
 
-    if (cfg->debugphoton >= 0) {
-        debuglevel = cfg->debuglevel;
-        cfg->debuglevel &= 0xFFFFEA00;
-#ifdef _OPENMP
-        omp_set_num_threads(1);
-#endif
+    if (med) {
+        mesh_updatemedia(mesh, cfg, med);
+        mesh_buildinvcdf(mesh, cfg);
     }
 
-    unsigned int* seeds = NULL;
+    mesh_buildfacereflect(mesh, cfg);
+    mesh_builddetgrid(mesh, cfg);
 
-    if (cfg->debuglevel & dlTraj) {
-        if (cfg->exportdebugdata == NULL) {
-            cfg->exportdebugdata = (float*)malloc(sizeof(float) * MCX_DEBUG_REC_LEN * cfg->maxjumpdebug);
+    if (cfg->srctype == stPencil || cfg->srctype == stIsotropic || cfg->srctype == stCone || cfg->srctype == stArcSin) {
+        if (cfg->e0 <= 0 || mesh_barycentric(cfg->e0, &cfg->bary0.x, (FLOAT3*) & (cfg->srcpos), tracer->mesh)) {
+            if (mesh_initelem(tracer->mesh, cfg)) {
+                cfg->e0 = 0;
+            }
         }
 
-        cfg->debugdatalen = 0;
+        mesh_initsrclist(mesh, cfg);
     }
 
-    /***************************************************************************//**
-    The master thread then spawn multiple work-threads depending on your
-    OpenMP settings. By default, the total thread number (master + work) is
-    your total CPU core number. For example, if you have a dual-core CPU,
-    the total thread number is 2; if you have two quad-core CPUs, the total
-    thread number is 8. If you want to set the total thread number manually,
-    you need to set the OMP_NUM_THREADS environment variable. For example,
-    \c OMP_NUM_THREADS=3 sets the total thread number to 3.
-    *******************************************************************************/
-
-    /** \subsection ssimu Parallel photon transport simulation */
+    mesh_buildsurfbvh(mesh, cfg);
 
-    #pragma omp parallel private(ran0,ran1,threadid,j)
-    {
-        visitor visit = {0.f, 0.f, 1.f / cfg->tstep, DET_PHOTON_BUF, 0, 0, NULL, NULL, NULL, NULL, NULL, NULL};
-        size_t id;
+    mesh_initweight(mesh, cfg);
 
-#ifdef _OPENMP
-        unsigned int threadnum = omp_get_num_threads();
-#else
-        unsigned int threadnum = 1;
-#endif
+    if (cfg->issaveref) {
+        if (mesh->dref) {
+            memset(mesh->dref, 0, sizeof(double) * mesh->nf * cfg->srcnum * cfg->maxgate);
+        } else {
+            mesh->dref = (double*)calloc(sizeof(double) * mesh->nf * cfg->srcnum, cfg->maxgate);
+        }
+    }
 
-        #pragma omp master
-        {
-            seeds = (unsigned int*)malloc(sizeof(int) * threadnum * RAND_SEED_WORD_LEN);
-            srand(cfg->seed);
+    cfg->detectedcount = 0;
+    cfg->debugdatalen = 0;
+    cfg->his.savedphoton = 0;
+    return 0;
+}
 
-            for (i = 0; i < threadnum * RAND_SEED_WORD_LEN; i++) {
-                seeds[i] = rand();
-            }
-        }
-        #pragma omp barrier
-        visit.reclen = (2 + ((cfg->ismomentum) > 0)) * mesh->prop + (cfg->issaveexit > 0) * 6 + 2;
-        visitor_init(cfg, &visit);
+#ifndef MCX_CONTAINER
 
-        if (cfg->issavedet) {
-            if (cfg->issaveseed) {
-                visit.photonseed = calloc(visit.detcount, (sizeof(RandType) * RAND_BUF_LEN));
-            }
+/**
+ * \brief Read one line of the job queue into a growing buffer
+ *
+ * \return the length of the line without the line break, -1 at the end of the queue
+ */
 
-            visit.partialpath = (float*)calloc(visit.detcount * visit.reclen, sizeof(float));
-        }
+static int mmc_readjob(FILE* fp, char** buf, size_t* buflen) {
+    size_t len = 0;
 
-#ifdef _OPENMP
-        threadid = omp_get_thread_num();
-#endif
+    if (*buf == NULL) {
+        *buflen = 4096;
+        *buf = (char*)malloc(*buflen);
+    }
 
-        rng_init(ran0, ran1, seeds, threadid);
+    while (fgets(*buf + len, (int)(*buflen - len), fp)) {
+        len += strlen(*buf + len);
 
-        if ((cfg->debuglevel & dlProgress) && threadid == 0) {
-            mcx_progressbar(-0.f);
+        if (len > 0 && (*buf)[len - 1] == '\n') {
+            (*buf)[--len] = '\0';
+            return (int)len;
         }
 
-        /*launch photons*/
-        #pragma omp for reduction(+:raytri,raytri0)
+        if (len + 1 == *buflen) {
+            *buflen <<= 1;
+            *buf = (char*)realloc(*buf, *buflen);
+        }
+    }
 
-        for (id = 0; id < cfg->nphoton; id++) {
-            visit.raytet = 0.f;
-            visit.raytet0 = 0.f;
+    return (len > 0) ? (int)len : -1;
+}
 
-            if (id == cfg->debugphoton) {
-                cfg->debuglevel = debuglevel;
-            }
+/**
+ * \brief Print the one-line JSON reply to a job of the queue
+ */
 
-            if (cfg->seed == SEED_FROM_FILE) {
-                onephoton(id, tracer, mesh, cfg, ((RandType*)cfg->photonseed) + id * RAND_BUF_LEN, ran1, &visit);
-            } else {
-                onephoton(id, tracer, mesh, cfg, ran0, ran1, &visit);
-            }
+static void mmc_replyjob(mcconfig* cfg, int jobid, const char* errmsg, unsigned int runtime) {
+    cJSON* reply = cJSON_CreateObject();
+    char* str;
 
-            raytri += visit.raytet;
-            raytri0 += visit.raytet0;
+    cJSON_AddNumberToObject(reply, "job", jobid);
+    cJSON_AddStringToObject(reply, "id", cfg->session);
+    cJSON_AddNumberToObject(reply, "status", errmsg ? -1 : 0);
 
-            if (id == cfg->debugphoton) {
-                cfg->debuglevel &= 0xFFFFEA00;
-            }
+    if (errmsg) {
+        cJSON_AddStringToObject(reply, "error", errmsg);
+    } else {
+        cJSON_AddNumberToObject(reply, "nphoton", (double)cfg->convphoton);
+        cJSON_AddNumberToObject(reply, "detected", cfg->detectedcount + ((cfg->streamdet > 0) ? cfg->his.savedphoton : 0));
+        cJSON_AddNumberToObject(reply, "runtime", runtime);
+        cJSON_AddStringToObject(reply, "root", cfg->rootpath);
+    }
 
-            #pragma omp atomic
-            ncomplete++;
+    str = cJSON_PrintUnformatted(reply);
+    fprintf(stdout, "%s\n", str);
+    fflush(stdout);
+    free(str);
+    cJSON_Delete(reply);
+}
 
-            if ((cfg->debuglevel & dlProgress) && threadid == 0) {
-                mcx_progressbar((float)ncomplete / cfg->nphoton);
-            }
-        }
+/**
+ * \struct MMC_pipejob mmc_host.c
+ * \brief A --serve job whose fluence and dref are saved while the next job runs (--pipeline)
+ */
 
-        for (j = 0; j < cfg->srcnum; j++) {
-            #pragma omp atomic
-            master.launchweight[j] += visit.launchweight[j];
-            #pragma omp atomic
-            master.absorbweight[j] += visit.absorbweight[j];
-        }
+typedef struct MMC_pipejob {
+    mcconfig cfg;                 /**< a copy of the settings of the job, names and formats its files, owns its detpos */
+    tetmesh mesh;                 /**< a copy of the mesh, owning the fluence, variance and dref of the job */
+    int jobid;                    /**< the index of the job in the queue */
+    unsigned int runtime;         /**< the run time of the job in ms, excluding the deferred saving */
+    int ispending;                /**< 1 if the outputs are waiting to be saved */
+} pipejob;
 
-        if (cfg->issavedet) {
-            #pragma omp atomic
-            master.detcount += visit.bufpos;
-            #pragma omp barrier
+/**
+ * \brief Save the fluence, variance and dref of a pipelined job, then release them
+ *
+ * \param[in,out] job: the job whose outputs were taken over from the mesh by mmc_serve
+ */
 
-            if (threadid == 0) {
-                master.partialpath = (float*)calloc(master.detcount * visit.reclen, sizeof(float));
+static void mmc_pipesave(pipejob* job) {
+    if (job->cfg.issave2pt) {
+        mesh_saveweight(&job->mesh, &job->cfg, 0);
+        mesh_savevariance(&job->mesh, &job->cfg);
+    }
 
-                if (cfg->issaveseed) {
-                    master.photonseed = calloc(master.detcount, (sizeof(RandType) * RAND_BUF_LEN));
-                }
-            }
+    if (job->cfg.issaveref && job->mesh.dref) {
+        mesh_saveweight(&job->mesh, &job->cfg, 1);
+    }
 
-            #pragma omp barrier
-            #pragma omp critical
-            {
-                memcpy(master.partialpath + master.bufpos * visit.reclen,
-                       visit.partialpath, visit.bufpos * visit.reclen * sizeof(float));
+    free(job->mesh.weight);
+    free(job->mesh.weightvar);
+    free(job->mesh.dref);
+    free(job->cfg.detpos);
+    job->mesh.weight = job->mesh.weightvar = job->mesh.dref = NULL;
+    job->cfg.detpos = NULL;
+}
 
-                if (cfg->issaveseed)
-                    memcpy((unsigned char*)master.photonseed + master.bufpos * (sizeof(RandType)*RAND_BUF_LEN),
-                           visit.photonseed, visit.bufpos * (sizeof(RandType)*RAND_BUF_LEN));
+/**
+ * \brief Save and reply a pipelined job that is still pending, keeping the replies in job order
+ *
+ * \param[in,out] job: the pending job, if any
+ */
 
-                master.bufpos += visit.bufpos;
-            }
-            #pragma omp master
-            cfg->detectedcount = master.detcount;
-        }
+static void mmc_pipeflush(pipejob* job) {
+    if (job->ispending) {
+        mmc_pipesave(job);
+        mmc_replyjob(&job->cfg, job->jobid, NULL, job->runtime);
+        job->ispending = 0;
+    }
+}
 
-        #pragma omp barrier
-        visitor_clear(&visit);
+/**
+ * \brief Run the jobs of a queue on a mesh prepared once (--serve)
+ *
+ * Each line of cfg->servefile is a JSON job read by mcx_loadjob. A job starts
+ * from the settings of the input, changes the fields it lists, and is then
+ * prepared by mmc_prep_next and simulated by run, which keeps the mesh, the
+ * ray-tracer and, for the GPU backends, the cached device context and kernel
+ * across jobs. The outputs are saved to files named by the job id, and a
+ * one-line JSON reply is printed to stdout when a job ends; the log is moved to
+ * stderr so that stdout only carries the replies. The server stops at the end
+ * of the queue, or at the first job that fails inside the simulation.
+ *
+ * With --pipeline, the backend leaves the fluence, variance and dref of a job
+ * in the mesh (cfg->ispipeline is 2 during the run); they are taken over by a
+ * pipejob and saved, with their compression, by a second thread while the
+ * next job is prepared and simulated. The reply of a job is printed once its
+ * files are written. The other outputs are saved by the backend as usual.
+ *
+ * \param[in,out] cfg: the simulation configuration, prepared by mmc_prep
+ * \param[in,out] mesh: the mesh data structure, prepared by mmc_prep
+ * \param[in,out] tracer: the ray-tracer data structure, prepared by mmc_prep
+ * \param[in] run: the backend running one simulation
+ */
 
-        if (visit.partialpath) {
-            free(visit.partialpath);
-        }
+int mmc_serve(mcconfig* cfg, tetmesh* mesh, raytracer* tracer, void (*run)(mcconfig*, tetmesh*, raytracer*)) {
+    FILE* fp = (strcmp(cfg->servefile, "-") == 0) ? stdin : fopen(cfg->servefile, "rt");
+    char* line = NULL, session[MAX_SESSION_LENGTH], errmsg[MAX_SESSION_LENGTH * 2];
+    size_t linelen = 0, nphoton = cfg->nphoton;
+    medium* basemed, *med;
+    float4* basedet = NULL, srcdir = cfg->srcdir, srcparam1 = cfg->srcparam1, srcparam2 = cfg->srcparam2;
+    float3 srcpos = cfg->srcpos;
+    int i, jobid = 0, seed = cfg->seed, e0 = cfg->e0, detnum = cfg->detnum, hasprop;
+    unsigned int runtime;
+    pipejob pending;
 
-        if (cfg->issaveseed && visit.photonseed) {
-            free(visit.photonseed);
-        }
+    if (fp == NULL) {
+        MMC_ERROR(-10, "can not open the job queue of --serve");
     }
 
-    if (seeds) {
-        free(seeds);
-    }
+    memset(&pending, 0, sizeof(pipejob));
 
-    /** \subsection sreport Post simulation */
+#ifdef _OPENMP
 
-    if ((cfg->debuglevel & dlProgress)) {
-        mcx_progressbar(1.f);
+    /*the backend opens its own parallel region in the section running the job*/
+    if (cfg->ispipeline && omp_get_max_active_levels() < omp_get_active_level() + 3) {
+        omp_set_max_active_levels(omp_get_active_level() + 3);
     }
 
-    dt = GetTimeMillis() - dt;
-    MMCDEBUG(cfg, dlProgress, (cfg->flog, "\n"));
-    MMCDEBUG(cfg, dlTime, (cfg->flog, "\tdone\t%d\n", dt));
-    MMCDEBUG(cfg, dlTime, (cfg->flog, "speed ...\t"S_BOLD""S_BLUE"%.2f photon/ms"S_RESET", %.0f ray-tetrahedron tests (%.0f overhead, %.2f test/ms)\n", (double)cfg->nphoton / dt, raytri, raytri0, raytri / dt));
+#endif
 
-    if (cfg->issavedet) {
-        MMC_FPRINTF(cfg->flog, "detected %d photons\n", cfg->detectedcount);
+    if (cfg->flog == stdout) {
+        cfg->flog = stderr;
     }
 
-    if (cfg->isnormalized) {
-        double cur_normalizer, sum_normalizer = 0;
+    /*a job starts from the input settings; mesh->med is scaled by unitinmm in the prepared mesh*/
+    basemed = (medium*)malloc(sizeof(medium) * (mesh->prop + 1));
+    med = (medium*)malloc(sizeof(medium) * (mesh->prop + 1));
+    memcpy(basemed, mesh->med, sizeof(medium) * (mesh->prop + 1));
 
-        for (j = 0; j < cfg->srcnum; j++) {
-            cur_normalizer = mesh_normalize(mesh, cfg, master.absorbweight[j], master.launchweight[j], j);
-            sum_normalizer += cur_normalizer;
-            MMCDEBUG(cfg, dlTime, (cfg->flog, "source %d\ttotal simulated energy: %f\tabsorbed: "S_BOLD""S_BLUE"%5.5f%%"S_RESET"\tnormalizor=%g\n",
-                                   j + 1, master.launchweight[j], 100.f * master.absorbweight[j] / master.launchweight[j], cur_normalizer));
+    if (cfg->method != rtBLBadouelGrid && cfg->unitinmm != 1.f) {
+        for (i = 1; i <= mesh->prop; i++) {
+            basemed[i].mus /= cfg->unitinmm;
+            basemed[i].mua /= cfg->unitinmm;
         }
-
-        cfg->his.normalizer = sum_normalizer / cfg->srcnum; // average normalizer value for all simulated sources
     }
 
-#ifndef MCX_CONTAINER
+    if (detnum > 0) {
+        basedet = (float4*)malloc(sizeof(float4) * detnum);
+        memcpy(basedet, cfg->detpos, sizeof(float4) * detnum);
+    }
 
-    if (cfg->issave2pt && cfg->parentid == mpStandalone) {
-        switch (cfg->outputtype) {
-            case otFlux:
-                MMCDEBUG(cfg, dlTime, (cfg->flog, "saving flux ..."));
-                break;
+    memcpy(session, cfg->session, MAX_SESSION_LENGTH);
 
-            case otFluence:
-                MMCDEBUG(cfg, dlTime, (cfg->flog, "saving fluence ..."));
-                break;
+    while (mmc_readjob(fp, &line, &linelen) >= 0) {
+        cJSON* job;
 
-            case otEnergy:
-                MMCDEBUG(cfg, dlTime, (cfg->flog, "saving energy deposit ..."));
-                break;
+        if (line[strspn(line, " \t\r")] == '\0') {
+            continue;
         }
 
-        mesh_saveweight(mesh, cfg, 0);
-    }
+        jobid++;
+        snprintf(cfg->session, MAX_SESSION_LENGTH, "%.48s%s%d", session, session[0] ? "_" : "job", jobid);
+        cfg->nphoton = nphoton;
+        cfg->seed = seed;
+        cfg->srcpos = srcpos;
+        cfg->e0 = e0;
+        cfg->srcdir = srcdir;
+        cfg->srcparam1 = srcparam1;
+        cfg->srcparam2 = srcparam2;
+        cfg->detnum = detnum;
+        cfg->detpos = (float4*)realloc(cfg->detpos, sizeof(float4) * MAX(detnum, 1));
 
-#endif
+        if (basedet) {
+            memcpy(cfg->detpos, basedet, sizeof(float4) * detnum);
+        }
 
-    if (cfg->exportdetected == NULL) {
-        cfg->exportdetected = master.partialpath;
-    }
+        memcpy(med, basemed, sizeof(medium) * (mesh->prop + 1));
 
-    if (cfg->issaveseed && master.photonseed) {
-        cfg->exportseed = (unsigned char*)malloc(cfg->detectedcount * sizeof(RandType) * RAND_BUF_LEN);
-        memcpy(cfg->exportseed, master.photonseed, cfg->detectedcount * sizeof(RandType)*RAND_BUF_LEN);
-        free(master.photonseed);
-    }
+        if ((job = cJSON_Parse(line)) == NULL) {
+            mmc_pipeflush(&pending);
+            mmc_replyjob(cfg, jobid, "the job is not valid JSON", 0);
+            continue;
+        }
 
-    if (cfg->issavedet && cfg->parentid == mpStandalone) {
-        MMCDEBUG(cfg, dlTime, (cfg->flog, "saving detected photons ..."));
+        hasprop = mcx_loadjob(job, cfg, mesh->prop, med, errmsg);
+        cJSON_Delete(job);
 
-#ifndef MCX_CONTAINER
+        if (hasprop < 0) {
+            mmc_pipeflush(&pending);
+            mmc_replyjob(cfg, jobid, errmsg, 0);
+            continue;
+        }
 
-        if (cfg->issaveexit) {
-            mesh_savedetphoton(cfg->exportdetected, (void*)(cfg->exportseed), cfg->detectedcount, (sizeof(RandType)*RAND_BUF_LEN), cfg);
+        runtime = GetTimeMillis();
+        mmc_prep_next(cfg, mesh, tracer, med);
+
+        /*the sparse output is not a single buffer that can be taken over*/
+        if (cfg->ispipeline && !cfg->issparsegate) {
+            cfg->ispipeline = 2;
         }
 
-#endif
+        if (pending.ispending) {
+            #pragma omp parallel sections num_threads(2)
+            {
+                #pragma omp section
+                {
+                    run(cfg, mesh, tracer);
+                    runtime = GetTimeMillis() - runtime;
+                }
+                #pragma omp section
+                mmc_pipesave(&pending);
+            }
 
-        if (cfg->issaveexit == 2) {
-            float* detimage = (float*)calloc(cfg->detparam1.w * cfg->detparam2.w * cfg->maxgate, sizeof(float));
-            mesh_getdetimage(detimage, cfg->exportdetected, cfg->detectedcount, cfg, mesh);
-#ifndef MCX_CONTAINER
-            mesh_savedetimage(detimage, cfg);
-#endif
-            free(detimage);
+            mmc_replyjob(&pending.cfg, pending.jobid, NULL, pending.runtime);
+            pending.ispending = 0;
+        } else {
+            if (cfg->resultcache[0]) {
+                mmc_cacherun(cfg, mesh, tracer, run);
+            } else {
+                run(cfg, mesh, tracer);
+            }
+
+            runtime = GetTimeMillis() - runtime;
         }
-    }
 
-    if ((cfg->debuglevel & dlTraj) && cfg->exportdebugdata) {
-        if (cfg->debugdatalen > cfg->maxjumpdebug) {
-            MMC_FPRINTF(cfg->flog, S_RED "WARNING: the saved trajectory positions (%d) \
-  are more than what your have specified (%d), please use the --maxjumpdebug option to specify a greater number\n" S_RESET
-                        , cfg->debugdatalen, cfg->maxjumpdebug);
-            cfg->debugdatalen = cfg->maxjumpdebug;
+        /*the outputs are taken over, mmc_prep_next allocates new ones for the next job*/
+        if (cfg->ispipeline == 2) {
+            cfg->ispipeline = 1;
+            pending.cfg = *cfg;
+            pending.mesh = *mesh;
+            pending.jobid = jobid;
+            pending.runtime = runtime;
+            pending.ispending = 1;
+            pending.cfg.detpos = (float4*)malloc(sizeof(float4) * MAX(cfg->detnum, 1));
+            memcpy(pending.cfg.detpos, cfg->detpos, sizeof(float4) * MAX(cfg->detnum, 1));
+            mesh->weight = mesh->weightvar = mesh->dref = NULL;
         } else {
-            MMC_FPRINTF(cfg->flog, "saved %u trajectory positions, total: %d\t", cfg->debugdatalen, cfg->debugdatalen);
+            mmc_replyjob(cfg, jobid, NULL, runtime);
         }
+
+        /*the outputs are saved to files, release the exported copies of this job*/
+        free(cfg->exportdetected);
+        free(cfg->exportseed);
+        free(cfg->exportdetimage);
+        cfg->exportdetected = NULL;
+        cfg->exportseed = NULL;
+        cfg->exportdetimage = NULL;
     }
 
-#ifndef MCX_CONTAINER
+    mmc_pipeflush(&pending);
 
-    if (cfg->issaveref) {
-        MMCDEBUG(cfg, dlTime, (cfg->flog, "saving surface diffuse reflectance ..."));
-        mesh_saveweight(mesh, cfg, 1);
+    if (fp != stdin) {
+        fclose(fp);
     }
 
-    if ((cfg->debuglevel & dlTraj) && cfg->parentid == mpStandalone && cfg->exportdebugdata) {
-        cfg->his.colcount = MCX_DEBUG_REC_LEN;
-        cfg->his.savedphoton = cfg->debugdatalen;
-        cfg->his.totalphoton = cfg->nphoton;
-        cfg->his.detected = 0;  // this flag tells mcx_savedetphoton that the data is trajectory
-        mesh_savedetphoton(cfg->exportdebugdata, NULL, cfg->debugdatalen, 0, cfg);
-    }
+    free(line);
+    free(basemed);
+    free(med);
+    free(basedet);
+    return 0;
+}
+
+/**
+ * \brief Report the projected memory and runtime of a prepared run (--estimate)
+ *
+ * The host and, for a GPU run, device bytes of each buffer are derived from
+ * the prepared mesh and the settings, following the allocations of
+ * mesh_initweight, mmc_run_share and mmc_run_cl. A calibration run of a
+ * fraction of the photons, whose outputs are not saved, is then timed: the
+ * setup time is kept and the simulation time (the kernel time on a GPU) is
+ * scaled to the full photon number. The same run projects the detected
+ * photons and trajectory positions, which are checked against --maxdetphoton
+ * and --maxjumpdebug. The report is written to the log and to
+ * <session>_estimate.json, all sizes in bytes and all times in ms.
+ *
+ * \param[in,out] cfg: the simulation configuration, prepared by mmc_prep
+ * \param[in,out] mesh: the mesh data structure, prepared by mmc_prep
+ * \param[in,out] tracer: the ray-tracer data structure, prepared by mmc_prep
+ * \param[in] run: the backend running one simulation
+ */
+
+int mmc_estimate(mcconfig* cfg, tetmesh* mesh, raytracer* tracer, void (*run)(mcconfig*, tetmesh*, raytracer*)) {
+    enum TEstimateBuffer {ebMesh, ebTracer, ebWeight, ebWeightVar, ebDref, ebDetPhoton, ebSeed, ebReplay, ebDebug, ebHeatmap, ebThread, ebBufferNum};
+    const char* names[ebBufferNum] = {"mesh", "tracer", "weight", "weightvar", "dref", "detphoton", "seed", "replay", "debug", "heatmap", "thread"};
+    double host[ebBufferNum] = {0.0}, device[ebBufferNum] = {0.0}, hosttotal = 0.0, devicetotal = 0.0;
+    double datalen = (cfg->method == rtBLBadouelGrid) ? cfg->crop0.z : ((cfg->basisorder) ? mesh->nn : MESH_ELEMOUT(mesh));
+    double framenum = (double)cfg->maxgate * cfg->replaydetnum * cfg->wavenum + 2 * cfg->freqnum;
+    double seedbyte = sizeof(RandType) * RAND_BUF_LEN, totalphoton, scale, projected, detected, trajpos;
+    int isgpu = (cfg->compute != cbSSE && cfg->gpuid <= MAX_DEVICE), reclen = mcx_detreclen(cfg, mesh->prop), threadnum = 1, i;
+    size_t nphoton = cfg->nphoton, ckptperiod = cfg->ckptperiod, calibphoton = MIN(nphoton, MAX(nphoton / 100, 10000));
+    int parentid = cfg->parentid, streamdet = cfg->streamdet, respin = cfg->respin;
+    char shm0 = cfg->shmname[0], fname[MAX_FULL_PATH], *jsonstr;
+    unsigned int wall, simtime;
+    cJSON* root, *obj, *info;
+    FILE* fp;
+    extern char pathsep;
 
+#ifdef _OPENMP
+    threadnum = omp_get_max_threads();
 #endif
 
-    MMCDEBUG(cfg, dlTime, (cfg->flog, "\tdone\t%d\n", GetTimeMillis() - t0));
-    visitor_clear(&master);
+    /*the memory of each buffer when the run is started*/
+    host[ebMesh] = (double)mesh->nn * (sizeof(FLOAT3) + (mesh->nvol ? sizeof(float) : 0))
+                   + (double)mesh->ne * (sizeof(int) * (mesh->elemlen + 5) + (mesh->evol ? sizeof(float) : 0));
+    host[ebTracer] = (tracer->method == rtPlucker) ? 16.0 : ((tracer->method == rtHavel || tracer->method == rtBadouel) ? 12.0 : 4.0);
+    host[ebTracer] *= (double)mesh->ne * sizeof(float3);
+
+    if (tracer->edge) {
+        host[ebTracer] = (double)mesh->ne * (4 * sizeof(float3) + 6 * sizeof(int)) + (double)tracer->nedge * 2 * sizeof(float3);
+    }
+    host[ebWeight] = datalen * cfg->srcnum * framenum * sizeof(double);
+
+    if (cfg->isatomic && cfg->isprivatebuf && threadnum > 1 && (double)threadnum * host[ebWeight] <= mcx_getsysmemory() * 0.25) {
+        host[ebWeight] *= threadnum + 1;
+    }
+
+    host[ebWeightVar] = (cfg->varbatch > 1) ? datalen * cfg->srcnum * cfg->maxgate * sizeof(double) : 0.0;
+    host[ebDref] = (cfg->issaveref) ? (double)mesh->nf * cfg->srcnum * cfg->maxgate * sizeof(double) : 0.0;
+
+    /*the detected photons are held by the run buffer and the merged copy of the reduction*/
+    host[ebDetPhoton] = (cfg->issavedet) ? 2.0 * cfg->maxdetphoton * reclen * sizeof(float) : 0.0;
+    host[ebSeed] = (cfg->issavedet && cfg->issaveseed) ? 2.0 * cfg->maxdetphoton * seedbyte : 0.0;
+    host[ebReplay] = (cfg->seed == SEED_FROM_FILE) ? (double)cfg->nphoton * (seedbyte + 2 * sizeof(float)) : 0.0;
+    host[ebDebug] = (cfg->debuglevel & dlTraj) ? (double)cfg->maxjumpdebug * MCX_DEBUG_REC_LEN * sizeof(float) : 0.0;
+    host[ebHeatmap] = (cfg->isheatmap) ? (double)mesh->ne * hmCounterNum * (sizeof(double) + threadnum * sizeof(unsigned int)) : 0.0;
+
+    /*the device buffers of mmc_run_cl/mmc_run_cu, the thread count is only known after listing the devices*/
+    if (isgpu) {
+        double meshlen = ((cfg->method == rtBLBadouelGrid) ? cfg->crop0.z : mesh->ne) * (double)cfg->srcnum;
+
+        device[ebMesh] = (double)mesh->nn * sizeof(float4) + (double)mesh->ne * (sizeof(int4) * 2 + sizeof(int) + sizeof(float4) * 4);
+        device[ebWeight] = meshlen * ((double)cfg->maxgate * cfg->replaydetnum + 2 * cfg->freqnum) * 2 * sizeof(float);
+        device[ebDref] = (cfg->issaveref) ? (double)mesh->nf * cfg->maxgate * sizeof(float) : 0.0;
+        device[ebDetPhoton] = (cfg->issavedet) ? (double)cfg->maxdetphoton * (reclen + 1) * sizeof(float) : 0.0;
+        device[ebSeed] = (cfg->issavedet && cfg->issaveseed) ? (double)cfg->maxdetphoton * seedbyte : 0.0;
+        device[ebReplay] = (cfg->seed == SEED_FROM_FILE) ? 2.0 * MIN(cfg->nphoton, MAX_REPLAY_CHUNK) * (seedbyte + 2 * sizeof(float) + sizeof(int)) : 0.0;
+        device[ebDebug] = host[ebDebug];
+        device[ebThread] = (double)cfg->nthread * (sizeof(float4) * 4 + sizeof(float) * 2 * cfg->srcnum);
+    }
+
+    for (i = 0; i < ebBufferNum; i++) {
+        hosttotal += host[i];
+        devicetotal += device[i];
+    }
+
+    /*the calibration run simulates a fraction of the photons, none of its outputs is saved*/
+    totalphoton = (double)nphoton * ((isgpu && respin > 1) ? respin : 1);
+    cfg->nphoton = calibphoton;
+    cfg->respin = 1;
+    cfg->parentid = mpMATLAB;
+    cfg->shmname[0] = '\0';
+    cfg->streamdet = 0;
+    cfg->ckptperiod = 0;
+    cfg->runtime = 0;
+
+    MMCDEBUG(cfg, dlTime, (cfg->flog, "calibrating the runtime with %zu photons ...\n", calibphoton));
+    wall = GetTimeMillis();
+    run(cfg, mesh, tracer);
+    wall = GetTimeMillis() - wall;
+
+    scale = totalphoton / calibphoton;
+    simtime = (cfg->runtime > 0 && cfg->runtime <= wall) ? cfg->runtime : wall;
+    projected = (wall - simtime) + simtime * scale;
+    detected = (cfg->detectedcount + ((cfg->streamdet > 0) ? cfg->his.savedphoton : 0)) * scale;
+    trajpos = cfg->debugdatalen * scale;
+
+    free(cfg->exportdetected);
+    free(cfg->exportseed);
+    free(cfg->exportdetimage);
+    cfg->exportdetected = NULL;
+    cfg->exportseed = NULL;
+    cfg->exportdetimage = NULL;
+
+    cfg->nphoton = nphoton;
+    cfg->respin = respin;
+    cfg->parentid = parentid;
+    cfg->shmname[0] = shm0;
+    cfg->streamdet = streamdet;
+    cfg->ckptperiod = ckptperiod;
+
+    /*the table lists the buffers used by the run, in MB*/
+    if (isgpu) {
+        MMC_FPRINTF(cfg->flog, "%-12s%16s%16s\n", "buffer", "host (MB)", "device (MB)");
+    } else {
+        MMC_FPRINTF(cfg->flog, "%-12s%16s\n", "buffer", "host (MB)");
+    }
+
+    for (i = 0; i <= ebBufferNum; i++) {
+        double h = (i < ebBufferNum) ? host[i] : hosttotal, d = (i < ebBufferNum) ? device[i] : devicetotal;
+
+        if (i == ebBufferNum || h > 0.0 || d > 0.0) {
+            if (isgpu) {
+                MMC_FPRINTF(cfg->flog, "%-12s%16.2f%16.2f\n", (i < ebBufferNum) ? names[i] : "total", h / (1 << 20), d / (1 << 20));
+            } else {
+                MMC_FPRINTF(cfg->flog, "%-12s%16.2f\n", (i < ebBufferNum) ? names[i] : "total", h / (1 << 20));
+            }
+        }
+    }
+
+    MMC_FPRINTF(cfg->flog, "calibration: %zu photons in %u ms, projected runtime of %.0f photons: %.0f ms\n", calibphoton, wall, totalphoton, projected);
+
+    if (hosttotal > mcx_getsysmemory()) {
+        MMC_FPRINTF(cfg->flog, "WARNING: the projected host memory exceeds the %zu bytes of the system memory\n", mcx_getsysmemory());
+    }
+
+    if (cfg->issavedet && detected > cfg->maxdetphoton) {
+        MMC_FPRINTF(cfg->flog, "WARNING: about %.0f photons will be detected, more than --maxdetphoton (%u)\n", detected, cfg->maxdetphoton);
+    }
+
+    if ((cfg->debuglevel & dlTraj) && trajpos > cfg->maxjumpdebug) {
+        MMC_FPRINTF(cfg->flog, "WARNING: about %.0f trajectory positions will be recorded, more than --maxjumpdebug (%u)\n", trajpos, cfg->maxjumpdebug);
+    }
+
+    fflush(cfg->flog);
+
+    root = cJSON_CreateObject();
+    cJSON_AddItemToObject(root, "MMCEstimate", info = cJSON_CreateObject());
+    cJSON_AddItemToObject(info, "Host", obj = cJSON_CreateObject());
+
+    for (i = 0; i < ebBufferNum; i++) {
+        cJSON_AddNumberToObject(obj, names[i], host[i]);
+    }
+
+    cJSON_AddNumberToObject(obj, "total", hosttotal);
+    cJSON_AddNumberToObject(obj, "system", (double)mcx_getsysmemory());
+
+    if (isgpu) {
+        cJSON_AddItemToObject(info, "Device", obj = cJSON_CreateObject());
+
+        for (i = 0; i < ebBufferNum; i++) {
+            cJSON_AddNumberToObject(obj, names[i], device[i]);
+        }
+
+        cJSON_AddNumberToObject(obj, "total", devicetotal);
+    }
+
+    cJSON_AddItemToObject(info, "Calibration", obj = cJSON_CreateObject());
+    cJSON_AddNumberToObject(obj, "photon", (double)calibphoton);
+    cJSON_AddNumberToObject(obj, "runtime", wall);
+    cJSON_AddNumberToObject(obj, "simulation", simtime);
+    cJSON_AddItemToObject(info, "Projected", obj = cJSON_CreateObject());
+    cJSON_AddNumberToObject(obj, "photon", totalphoton);
+    cJSON_AddNumberToObject(obj, "runtime", projected);
+    cJSON_AddNumberToObject(obj, "detected", detected);
+    cJSON_AddNumberToObject(obj, "trajectory", trajpos);
+
+    jsonstr = cJSON_Print(root);
+    cJSON_Delete(root);
+
+    if (cfg->rootpath[0]) {
+        sprintf(fname, "%s%c%s_estimate.json", cfg->rootpath, pathsep, cfg->session);
+    } else {
+        sprintf(fname, "%s_estimate.json", cfg->session);
+    }
+
+    if ((fp = fopen(fname, "wt")) == NULL) {
+        free(jsonstr);
+        MMC_ERROR(-2, "can not save data to disk");
+    }
+
+    fprintf(fp, "%s\n", jsonstr);
+    fclose(fp);
+    free(jsonstr);
+    return 0;
+}
+
+#define MMC_RESULT_MAGIC "MMCRES01"        /**< magic header of a result cache entry */
+
+/**
+ * \struct MMC_resultheader mmc_host.c
+ * \brief The header of a result cache entry, followed by the key and the output files
+ *
+ * Each output file is stored as its name length, its size, the name without
+ * the session prefix (e.g. ".mc2" or "_detp.jdat") and the file content.
+ */
+
+typedef struct MMC_resultheader {
+    char magic[8];                /**< must be MMC_RESULT_MAGIC */
+    unsigned long long hash;      /**< hash of the key, also the name of the entry */
+    unsigned long long keylen;    /**< length of the JSON settings following the header */
+    unsigned long long filenum;   /**< number of output files following the settings */
+} resultheader;
+
+/**
+ * \brief An entry of the result cache folder, sorted by the last access for eviction
+ */
+
+typedef struct MMC_resultentry {
+    char name[32];                /**< file name of the entry in the cache folder, <hash>.mmcr */
+    unsigned long long size;      /**< file size in bytes */
+    time_t atime;                 /**< time of the last hit or store */
+} resultentry;
+
+/**
+ * \brief Comparison function for qsort, the least recently used entry first
+ */
+
+static int mmc_compareentry(const void* a, const void* b) {
+    const resultentry* ea = (const resultentry*)a, *eb = (const resultentry*)b;
+
+    if (ea->atime != eb->atime) {
+        return (ea->atime < eb->atime) ? -1 : 1;
+    }
+
+    return strcmp(ea->name, eb->name);
+}
+
+/**
+ * \brief Compute the result cache key of a prepared run
+ *
+ * The key is the settings converted to JSON by mcx_jdataconfig, which is
+ * stored in the entry and compared on a hit; its hash further covers the
+ * command line, the prepared mesh and media, the source pattern and the
+ * mapping of the seed to the photons, i.e. the backend, the devices, the
+ * RNG and the thread and block numbers. Files named by the options (e.g.
+ * --elemprop) are part of the key by their names only.
+ *
+ * \param[in] cfg: the simulation configuration, prepared by mmc_prep
+ * \param[in] mesh: the mesh data structure, prepared by mmc_prep
+ * \param[out] head: the header of the entry, with the hash and the key length
+ * \return the JSON key, to be freed by the caller
+ */
+
+static char* mmc_resultkey(mcconfig* cfg, tetmesh* mesh, resultheader* head) {
+    char* key = mcx_jdataconfig(cfg, 1);
+    int layout[8] = {cfg->compute, (int)cfg->gpuid, cfg->nthread, cfg->nblocksize, cfg->rngtype, cfg->method, 1, cfg->mpisize};
+    unsigned long long hash;
+
+    if (key == NULL) {
+        MMC_ERROR(-1, "error when converting to JSON");
+    }
+
+#ifdef _OPENMP
+    layout[6] = omp_get_max_threads();
+#endif
+
+    hash = mesh_hashbuffer(&(cfg->cmdhash), sizeof(cfg->cmdhash), 0xcbf29ce484222325ULL);
+    hash = mesh_hashbuffer(key, strlen(key), hash);
+    hash = mesh_hashbuffer(layout, sizeof(layout), hash);
+    hash = mesh_hashbuffer(cfg->deviceid, MAX_DEVICE, hash);
+    hash = mesh_hashbuffer(cfg->workload, sizeof(float) * MAX_DEVICE, hash);
+    hash = mesh_hashbuffer(&(mesh->nn), sizeof(int), hash);
+    hash = mesh_hashbuffer(&(mesh->ne), sizeof(int), hash);
+    hash = mesh_hashbuffer(&(mesh->elemlen), sizeof(int), hash);
+    hash = mesh_hashbuffer(&(mesh->prop), sizeof(int), hash);
+    hash = mesh_hashbuffer(mesh->node, sizeof(FLOAT3) * mesh->nn, hash);
+    hash = mesh_hashbuffer(mesh->elem, sizeof(int) * mesh->elemlen * mesh->ne, hash);
+    hash = mesh_hashbuffer(mesh->type, sizeof(int) * mesh->ne, hash);
+    hash = mesh_hashbuffer(mesh->med, sizeof(medium) * (mesh->prop + 1), hash);
+
+    if (cfg->srcpattern && cfg->srctype == stPattern) {
+        hash = mesh_hashbuffer(cfg->srcpattern, sizeof(float) * (size_t)(cfg->srcparam1.w * cfg->srcparam2.w) * cfg->srcnum, hash);
+    }
+
+    memset(head, 0, sizeof(resultheader));
+    memcpy(head->magic, MMC_RESULT_MAGIC, sizeof(head->magic));
+    head->hash = hash;
+    head->keylen = strlen(key);
+    return key;
+}
+
+/**
+ * \brief Copy a block of bytes between two files, returns non-zero on an incomplete transfer
+ */
+
+static int mmc_copyblock(FILE* in, FILE* out, unsigned long long len) {
+    char buf[65536];
+    size_t count;
+
+    while (len > 0) {
+        count = (size_t)MIN(len, sizeof(buf));
+
+        if (fread(buf, count, 1, in) != 1 || fwrite(buf, count, 1, out) != 1) {
+            return 1;
+        }
+
+        len -= count;
+    }
+
+    return 0;
+}
+
+/**
+ * \brief Compose the path of an output file of the session, returns non-zero if it is too long
+ */
+
+static int mmc_resultname(mcconfig* cfg, const char* suffix, char* fname) {
+    extern char pathsep;
+
+    if (cfg->rootpath[0]) {
+        return snprintf(fname, MAX_FULL_PATH, "%s%c%s%s", cfg->rootpath, pathsep, cfg->session, suffix) >= MAX_FULL_PATH;
+    }
+
+    return snprintf(fname, MAX_FULL_PATH, "%s%s", cfg->session, suffix) >= MAX_FULL_PATH;
+}
+
+/**
+ * \brief Restore the output files of a result cache entry, returns 1 on a hit
+ *
+ * The entry must have the same header and key; the files are written under
+ * the current session name and the entry is marked as recently used.
+ */
+
+static int mmc_resultload(mcconfig* cfg, const char* fcache, resultheader* head, const char* key) {
+    resultheader filehead;
+    FILE* fp, *fout;
+    char* filekey, suffix[MAX_PATH_LENGTH], fname[MAX_FULL_PATH];
+    unsigned long long i, len[2];
+    int ishit = 0;
+
+    if ((fp = fopen(fcache, "rb")) == NULL) {
+        return 0;
+    }
+
+    filekey = (char*)calloc(head->keylen + 1, 1);
+
+    if (fread(&filehead, sizeof(resultheader), 1, fp) == 1 && memcmp(filehead.magic, head->magic, sizeof(head->magic)) == 0
+            && filehead.hash == head->hash && filehead.keylen == head->keylen
+            && fread(filekey, head->keylen, 1, fp) == 1 && memcmp(filekey, key, head->keylen) == 0) {
+        for (i = 0; i < filehead.filenum; i++) {
+            if (fread(len, sizeof(len), 1, fp) != 1 || len[0] >= MAX_PATH_LENGTH || fread(suffix, len[0], 1, fp) != 1) {
+                break;
+            }
+
+            suffix[len[0]] = '\0';
+
+            if (mmc_resultname(cfg, suffix, fname) || (fout = fopen(fname, "wb")) == NULL) {
+                break;
+            }
+
+            if (mmc_copyblock(fp, fout, len[1]) | fclose(fout)) {
+                break;
+            }
+        }
+
+        ishit = (i == filehead.filenum);
+    }
+
+    free(filekey);
+    fclose(fp);
+
+    if (ishit) {
+        utime(fcache, NULL);
+    }
+
+    return ishit;
+}
+
+/**
+ * \brief Save the output files written by a run to a result cache entry
+ *
+ * The outputs are the regular files of the output folder named after the
+ * session followed by '.' or '_', modified since the run started; the log
+ * is left out. A run with an output folder (e.g. the Zarr format) or whose
+ * outputs exceed --cachelimit is not cached.
+ */
+
+static void mmc_resultsave(mcconfig* cfg, const char* fcache, resultheader* head, const char* key, time_t tstart) {
+    char fname[MAX_FULL_PATH], ftmp[MAX_FULL_PATH + 4], (*suffix)[MAX_PATH_LENGTH] = NULL;
+    unsigned long long* size = NULL, total = sizeof(resultheader) + head->keylen, len[2], i;
+    size_t sessionlen = strlen(cfg->session);
+    struct dirent* ent;
+    struct stat st;
+    DIR* dir;
+    FILE* fp, *fin;
+    int iserror = 0;
+
+    if ((dir = opendir(cfg->rootpath[0] ? cfg->rootpath : ".")) == NULL) {
+        return;
+    }
+
+    head->filenum = 0;
+
+    while ((ent = readdir(dir)) != NULL && iserror == 0) {
+        const char* name = ent->d_name;
+
+        if (strncmp(name, cfg->session, sessionlen) || (name[sessionlen] != '.' && name[sessionlen] != '_')
+                || strlen(name + sessionlen) >= MAX_PATH_LENGTH || strcmp(name + sessionlen, ".log") == 0) {
+            continue;
+        }
+
+        if (mmc_resultname(cfg, name + sessionlen, fname) || stat(fname, &st) || st.st_mtime < tstart) {
+            continue;
+        }
+
+        if (!S_ISREG(st.st_mode)) {
+            iserror = 1;
+            break;
+        }
+
+        suffix = (char(*)[MAX_PATH_LENGTH])realloc(suffix, MAX_PATH_LENGTH * (head->filenum + 1));
+        size = (unsigned long long*)realloc(size, sizeof(unsigned long long) * (head->filenum + 1));
+        strcpy(suffix[head->filenum], name + sessionlen);
+        size[head->filenum] = st.st_size;
+        total += sizeof(len) + strlen(name + sessionlen) + st.st_size;
+        head->filenum++;
+    }
+
+    closedir(dir);
+
+    if (iserror || head->filenum == 0 || total > cfg->cachelimit * 1048576.0) {
+        MMCDEBUG(cfg, dlTime, (cfg->flog, "the outputs of %s are not cached: no output file, an output folder, or larger than --cachelimit\n", cfg->session));
+        free(suffix);
+        free(size);
+        return;
+    }
+
+    /*the first run creates the cache folder*/
+#ifdef _WIN32
+    _mkdir(cfg->resultcache);
+#else
+    mkdir(cfg->resultcache, 0755);
+#endif
+
+    /*write to a temporary file first, so that concurrent runs never read a partial entry*/
+    sprintf(ftmp, "%s.tmp", fcache);
+
+    if ((fp = fopen(ftmp, "wb")) == NULL) {
+        MMC_FPRINTF(cfg->flog, S_RED "WARNING: can not write the result cache %s\n" S_RESET, fcache);
+        free(suffix);
+        free(size);
+        return;
+    }
+
+    iserror = (fwrite(head, sizeof(resultheader), 1, fp) != 1 || fwrite(key, head->keylen, 1, fp) != 1);
+
+    for (i = 0; i < head->filenum && iserror == 0; i++) {
+        len[0] = strlen(suffix[i]);
+        len[1] = size[i];
+
+        if (mmc_resultname(cfg, suffix[i], fname) || (fin = fopen(fname, "rb")) == NULL) {
+            iserror = 1;
+            break;
+        }
+
+        iserror = (fwrite(len, sizeof(len), 1, fp) != 1 || fwrite(suffix[i], len[0], 1, fp) != 1 || mmc_copyblock(fin, fp, len[1]));
+        fclose(fin);
+    }
+
+    iserror |= fclose(fp);
+
+    if (iserror || rename(ftmp, fcache)) {
+        remove(ftmp);
+    } else {
+        MMCDEBUG(cfg, dlTime, (cfg->flog, "saved %llu output files to the result cache %s\n", head->filenum, fcache));
+    }
+
+    free(suffix);
+    free(size);
+}
+
+/**
+ * \brief Remove the least recently used result cache entries above --cachelimit
+ */
+
+static void mmc_resultevict(mcconfig* cfg) {
+    extern char pathsep;
+    char fname[MAX_FULL_PATH];
+    resultentry* entry = NULL;
+    unsigned long long total = 0;
+    size_t i, num = 0, namelen;
+    struct dirent* ent;
+    struct stat st;
+    DIR* dir;
+
+    if ((dir = opendir(cfg->resultcache)) == NULL) {
+        return;
+    }
+
+    while ((ent = readdir(dir)) != NULL) {
+        namelen = strlen(ent->d_name);
+
+        if (namelen < 5 || namelen >= sizeof(entry->name) || strcmp(ent->d_name + namelen - 5, ".mmcr")) {
+            continue;
+        }
+
+        entry = (resultentry*)realloc(entry, sizeof(resultentry) * (num + 1));
+        strcpy(entry[num].name, ent->d_name);
+        snprintf(fname, MAX_FULL_PATH, "%s%c%s", cfg->resultcache, pathsep, entry[num].name);
+
+        if (stat(fname, &st) == 0 && S_ISREG(st.st_mode)) {
+            entry[num].size = st.st_size;
+            entry[num].atime = st.st_mtime;
+            total += st.st_size;
+            num++;
+        }
+    }
+
+    closedir(dir);
+
+    if (num) {
+        qsort(entry, num, sizeof(resultentry), mmc_compareentry);
+    }
+
+    for (i = 0; i < num && total > cfg->cachelimit * 1048576.0; i++) {
+        snprintf(fname, MAX_FULL_PATH, "%s%c%s", cfg->resultcache, pathsep, entry[i].name);
+
+        if (remove(fname) == 0) {
+            total -= entry[i].size;
+            MMCDEBUG(cfg, dlTime, (cfg->flog, "removed the result cache entry %s\n", fname));
+        }
+    }
+
+    free(entry);
+}
+
+/**
+ * \brief Run one simulation through the result cache (--resultcache)
+ *
+ * The prepared run is keyed by mmc_resultkey. If the cache folder holds an
+ * entry of the same key, its output files are copied under the current
+ * session name instead of simulating; otherwise the run is simulated, its
+ * output files are stored as <hash>.mmcr in the cache folder, and the least
+ * recently used entries are removed above --cachelimit. With MPI, rank 0
+ * looks up and stores the entries.
+ *
+ * \param[in,out] cfg: the simulation configuration, prepared by mmc_prep
+ * \param[in,out] mesh: the mesh data structure, prepared by mmc_prep
+ * \param[in,out] tracer: the ray-tracer data structure, prepared by mmc_prep
+ * \param[in] run: the backend running one simulation
+ * \return 1 if the outputs were taken from the cache, 0 if simulated
+ */
+
+int mmc_cacherun(mcconfig* cfg, tetmesh* mesh, raytracer* tracer, void (*run)(mcconfig*, tetmesh*, raytracer*)) {
+    extern char pathsep;
+    char fcache[MAX_FULL_PATH], *key = NULL;
+    resultheader head;
+    time_t tstart = time(NULL);
+    int ishit = 0;
+
+    if (cfg->mpirank == 0) {
+        key = mmc_resultkey(cfg, mesh, &head);
+        snprintf(fcache, MAX_FULL_PATH, "%s%c%016llx.mmcr", cfg->resultcache, pathsep, head.hash);
+        ishit = mmc_resultload(cfg, fcache, &head, key);
+    }
+
+#ifdef MMC_USE_MPI
+    MPI_Bcast(&ishit, 1, MPI_INT, 0, MPI_COMM_WORLD);
+#endif
+
+    if (ishit) {
+        MMCDEBUG(cfg, dlTime, (cfg->flog, "loaded the outputs of %s from the result cache %s\n", cfg->session, fcache));
+    } else {
+        run(cfg, mesh, tracer);
+
+        if (cfg->mpirank == 0) {
+            mmc_resultsave(cfg, fcache, &head, key, tstart);
+            mmc_resultevict(cfg);
+        }
+    }
+
+    free(key);
+    return ishit;
+}
+
+#endif
+
+/**
+ * \brief Create the detected photon buffer shared by all threads of a run
+ *
+ * Each photon is detected at most once, so the segment table can hold the
+ * records of all photons of the run and is never resized while the threads
+ * reserve slots in it. The copies of a photon split by --importance can each
+ * be detected, so the table then spans the range of the 32-bit slot counter,
+ * with segments of at least MMC_DET_SEG_LEN records to bound its size; its
+ * entries stay zero until a segment is allocated.
+ *
+ * \param[out] buf: the shared detected photon buffer
+ * \param[in] cfg: the simulation configuration structure
+ * \param[in] reclen: the record length of a detected photon
+ * \param[in] photonnum: the largest photon index of the run
+ */
+
+static void mmc_initdetbuffer(detbuffer* buf, mcconfig* cfg, int reclen, size_t photonnum) {
+    memset(buf, 0, sizeof(detbuffer));
+
+    if (!cfg->issavedet) {
+        return;
+    }
+
+    buf->reclen = reclen;
+    buf->seedbyte = (cfg->issaveseed) ? sizeof(RandType) * RAND_BUF_LEN : 0;
+    buf->seglen = (cfg->streamdet > 0) ? (unsigned int)cfg->streamdet : MMC_DET_SEG_LEN;
+
+    if (cfg->importance) {
+        buf->seglen = MAX(buf->seglen, MMC_DET_SEG_LEN);
+    }
+
+    buf->segnum = ((cfg->importance) ? UINT_MAX : photonnum) / buf->seglen + 1;
+    buf->seg = (float**)calloc(buf->segnum, sizeof(float*));
+    buf->filled = (unsigned int*)calloc(buf->segnum, sizeof(unsigned int));
+
+    if (buf->seg == NULL || buf->filled == NULL) {
+        MMC_ERROR(-4, "can not allocate the detected photon buffer");
+    }
+}
+
+/**
+ * \brief Free the segments and the tables of the shared detected photon buffer
+ */
+
+static void mmc_cleardetbuffer(detbuffer* buf) {
+    size_t i;
+
+    for (i = 0; buf->seg && i < buf->segnum; i++) {
+        free(buf->seg[i]);
+    }
+
+    free(buf->seg);
+    free(buf->filled);
+    memset(buf, 0, sizeof(detbuffer));
+}
+
+/**
+ * \brief Append the completed segments of the shared detected photon buffer to the output file
+ *
+ * In the streaming mode (cfg->streamdet > 0), the segments hold cfg->streamdet
+ * records each. Once all records of the leading segment are written, the first
+ * thread finding it writes it out and frees it. The writes are serialized by a
+ * named critical section, so the other threads keep simulating while one is
+ * writing, and the records are appended in the order of their slots.
+ *
+ * \param[in] cfg: the simulation configuration structure
+ * \param[in] mesh: the mesh data structure
+ * \param[in,out] buf: the shared detected photon buffer
+ */
+
+static void mmc_flushdetected(mcconfig* cfg, tetmesh* mesh, detbuffer* buf) {
+#ifndef MCX_CONTAINER
+    unsigned int seg, filled;
+
+    if (cfg->streamdet <= 0) {
+        return;
+    }
+
+    #pragma omp atomic read
+    seg = buf->written;
+
+    #pragma omp atomic read
+    filled = buf->filled[seg];
+
+    if (filled < buf->seglen) {
+        return;
+    }
+
+    #pragma omp critical (mmc_streamdet)
+    {
+        for (seg = buf->written; seg < buf->segnum; seg++) {
+            #pragma omp atomic read
+            filled = buf->filled[seg];
+
+            if (filled < buf->seglen) {
+                break;
+            }
+
+            #pragma omp flush
+            mesh_restoredetid(mesh, cfg, buf->seg[seg], buf->seglen, buf->reclen);
+            mesh_appenddetphoton(buf->seg[seg], buf->seglen, buf->reclen, cfg);
+            free(buf->seg[seg]);
+            buf->seg[seg] = NULL;
+        }
+
+        #pragma omp atomic write
+        buf->written = seg;
+    }
+#endif
+}
+
+/**
+ * \brief Copy the records left in the shared detected photon buffer to the master visitor
+ *
+ * Called once after the parallel region; the records streamed with
+ * --streamdet are not included.
+ *
+ * \param[in,out] buf: the shared detected photon buffer, its segments are freed
+ * \param[out] master: receives partialpath, photonseed, and the record count in detcount and bufpos
+ */
+
+static void mmc_gatherdetbuffer(detbuffer* buf, visitor* master) {
+    size_t i, n, first = (size_t)buf->written * buf->seglen, count = buf->count - first;
+
+    master->detcount = master->bufpos = (int)count;
+    master->partialpath = (float*)calloc(count * buf->reclen, sizeof(float));
+
+    if (buf->seedbyte) {
+        master->photonseed = calloc(count, buf->seedbyte);
+    }
+
+    for (i = buf->written; i < buf->segnum && i * buf->seglen < buf->count; i++) {
+        n = MIN(buf->seglen, buf->count - i * buf->seglen);
+        memcpy(master->partialpath + (i * buf->seglen - first) * buf->reclen, buf->seg[i], n * buf->reclen * sizeof(float));
+
+        if (buf->seedbyte) {
+            memcpy((unsigned char*)master->photonseed + (i * buf->seglen - first) * buf->seedbyte,
+                   buf->seg[i] + (size_t)buf->seglen * buf->reclen, n * buf->seedbyte);
+        }
+
+        free(buf->seg[i]);
+        buf->seg[i] = NULL;
+    }
+}
+
+#define MMC_CKPT_MAGIC "MMCCKPT6"          /**< magic header of a checkpoint file */
+#define MMC_PROGRESS_STRIDE 8              /**< counters per thread in the progress array, one 64-byte cache line */
+#define MMC_PROGRESS_STEP   64             /**< photons simulated by thread 0 between two updates of the progress bar */
+#define MMC_NUMA_MAX_NODE   64             /**< maximum number of NUMA nodes used by --numa */
+#define MMC_NUMA_MAX_CPU    4096           /**< maximum number of CPUs used by --numa */
+
+/**
+ * \struct MMC_ckptheader mmc_host.c
+ * \brief The header of a checkpoint file, used to validate a resumed run
+ */
+
+typedef struct MMC_ckptheader {
+    char magic[8];                /**< must be MMC_CKPT_MAGIC */
+    unsigned long long nphoton;   /**< the total photon number of the run */
+    unsigned long long done;      /**< photons simulated before the checkpoint */
+    unsigned long long ncomplete; /**< the progress counter */
+    unsigned long long buflen;    /**< length of mesh->weight */
+    unsigned long long dreflen;   /**< length of mesh->dref, 0 if not saved */
+    double raytri;                /**< accumulated ray-tet tests */
+    double raytri0;               /**< accumulated ray-tet tests outside of the mesh */
+    int seed;                     /**< the RNG seed of the run */
+    int threadnum;                /**< number of threads, each stores its own state */
+    int srcnum;                   /**< number of sources */
+    int reclen;                   /**< length of a detected photon record */
+    int issaveseed;               /**< 1 if the seeds of the detected photons are saved */
+    int nquantity;                /**< number of quantities of the convergence test */
+    int varbatch;                 /**< cfg->varbatch, the variance sums follow the convergence state if >1 */
+    int rngtype;                  /**< the RNG of the run, the thread states are only valid for the same RNG */
+} ckptheader;
+
+/**
+ * \brief Read or write a block of a checkpoint file, stops on an incomplete transfer
+ */
+
+static void mmc_ckptio(void* buf, size_t size, size_t count, FILE* fp, int isload) {
+    if (count == 0) {
+        return;
+    }
+
+    if ((isload ? fread(buf, size, count, fp) : fwrite(buf, size, count, fp)) != count) {
+        MMC_ERROR(-10, isload ? "incomplete checkpoint file" : "failed to write the checkpoint file");
+    }
+}
+
+/**
+ * \brief Get the name of the checkpoint file, <rootpath>/<session>_ckpt.bin
+ */
+
+static void mmc_ckptname(mcconfig* cfg, char* fname) {
+    extern char pathsep;
+
+    if (cfg->rootpath[0]) {
+        sprintf(fname, "%s%c%s_ckpt.bin", cfg->rootpath, pathsep, cfg->session);
+    } else {
+        sprintf(fname, "%s_ckpt.bin", cfg->session);
+    }
+}
+
+/**
+ * \brief Return the last photon (exclusive) of the batch starting at batchstart
+ *
+ * A batch ends after batchlen photons, at the end of the run, or at the next
+ * checkpoint, whichever comes first.
+ */
+
+static size_t mmc_batchend(mcconfig* cfg, size_t batchstart, size_t batchlen) {
+    size_t batchend = MIN(batchstart + batchlen, cfg->nphoton);
+    int i;
+
+    if (cfg->ckptperiod > 0) {
+        batchend = MIN(batchend, (batchstart / cfg->ckptperiod + 1) * cfg->ckptperiod);
+    }
+
+    for (i = 0; i < MAX_CHECKPOINT; i++) {
+        if (cfg->checkpt[i] > batchstart && cfg->checkpt[i] < batchend) {
+            batchend = cfg->checkpt[i];
+        }
+    }
+
+    return batchend;
+}
+
+/**
+ * \brief Test if a checkpoint is saved once batchend photons are simulated
+ */
+
+static int mmc_ischeckpoint(mcconfig* cfg, size_t batchend) {
+    int i;
+
+    if (batchend >= cfg->nphoton) {
+        return 0;
+    }
+
+    if (cfg->ckptperiod > 0 && batchend % cfg->ckptperiod == 0) {
+        return 1;
+    }
+
+    for (i = 0; i < MAX_CHECKPOINT; i++) {
+        if (cfg->checkpt[i] == batchend) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * \brief Return the number of photons a CPU thread claims at once, 0 for an even split
+ *
+ * Claiming photons in blocks from a shared counter balances the load when the
+ * photons differ in cost, but changes which thread, and thus which random
+ * stream, simulates a photon. The automatic setting (-1) therefore only uses
+ * blocks with the counter-based RNG, where a photon draws from its own stream.
+ */
+
+static int mmc_photonblock(mcconfig* cfg) {
+    if (cfg->photonblock >= 0) {
+        return cfg->photonblock;
+    }
+
+    return (cfg->rngtype == rngPhilox) ? MMC_PHOTON_BLOCK : 0;
+}
+
+/**
+ * \brief List the CPUs of the NUMA nodes of the host
+ *
+ * Nodes without CPUs (memory-only nodes) are skipped.
+ *
+ * \param[out] cpus: the CPU indices of all nodes, node by node, MMC_NUMA_MAX_CPU entries
+ * \param[out] nodestart: the CPUs of the k-th node are cpus[nodestart[k]] to cpus[nodestart[k+1]-1]
+ * \return the number of NUMA nodes with CPUs, 0 if the topology is unknown
+ */
+
+static int mmc_numatopology(int* cpus, int* nodestart) {
+    int node, len, nodenum = 0;
+
+    nodestart[0] = 0;
+
+    for (node = 0; node < MMC_NUMA_MAX_NODE * 4 && nodenum < MMC_NUMA_MAX_NODE; node++) {
+        len = mcx_numacpus(node, cpus + nodestart[nodenum], MMC_NUMA_MAX_CPU - nodestart[nodenum]);
+
+        if (len > 0) {
+            nodestart[nodenum + 1] = nodestart[nodenum] + len;
+            nodenum++;
+        }
+    }
+
+    return nodenum;
+}
+
+/**
+ * \brief Bind the calling thread to a CPU of its NUMA node, return the node index
+ *
+ * The threads are split in contiguous blocks over the nodes, and take the CPUs
+ * of their node in turn; threads in excess of the CPUs of a node share them.
+ *
+ * \param[out] isleader: set to 1 if the thread is the first of its node, 0 otherwise
+ */
+
+static int mmc_numabind(unsigned int threadid, unsigned int threadnum, int* cpus, int* nodestart, int nodenum, int* isleader) {
+    int node = (int)((unsigned long long)threadid * nodenum / threadnum);
+    unsigned int first = (unsigned int)(((unsigned long long)node * threadnum + nodenum - 1) / nodenum);
+
+    mcx_pinthread(cpus[nodestart[node] + (threadid - first) % (nodestart[node + 1] - nodestart[node])]);
+    *isleader = (threadid == first);
+    return node;
+}
+
+/**
+ * \brief Add up the photons completed by all threads
+ *
+ * Each thread counts its photons in its own cache line of progress, so that
+ * the photon loops do not contend on one shared counter.
+ */
+
+static unsigned long long mmc_sumprogress(unsigned long long* progress, unsigned int threadnum) {
+    unsigned long long total = 0, done;
+    unsigned int i;
+
+    for (i = 0; i < threadnum; i++) {
+        #pragma omp atomic read
+        done = progress[i * MMC_PROGRESS_STRIDE];
+        total += done;
+    }
+
+    return total;
+}
+
+/**
+ * \brief Save or restore the state of one thread in the checkpoint file
+ *
+ * The state includes the RNG and the random numbers pre-computed from it by
+ * mc_next_scatter, the launched/absorbed weights and the counters, so that the
+ * thread continues its random sequence exactly where it stopped. The detected photons are shared by all threads and saved by
+ * mmc_ckptdetected.
+ *
+ * \param[in,out] fp: the checkpoint file, positioned at the state of this thread
+ * \param[in] isload: 1 to restore the state, 0 to save it
+ * \param[in] cfg: the simulation configuration structure
+ * \param[in,out] visit: the visitor of the thread
+ * \param[in,out] ran0: the RNG state of the thread
+ * \param[in,out] ran1: the RNG buffer of the thread
+ * \param[in,out] threadtet: the ray-tet test counter of the thread
+ * \param[in,out] threadtet0: the ray-tet test counter of the thread outside of the mesh
+ */
+
+static void mmc_ckptthread(FILE* fp, int isload, mcconfig* cfg, visitor* visit, RandType* ran0, RandType* ran1, double* threadtet, double* threadtet0) {
+    size_t scatterlen;
+
+    mmc_ckptio(ran0, sizeof(RandType), RAND_BUF_LEN, fp, isload);
+    mmc_ckptio(ran1, sizeof(RandType), RAND_BUF_LEN, fp, isload);
+
+    if ((scatterlen = mc_scatter_state(NULL, 0)) > 0) {
+        unsigned char* scatter = (unsigned char*)malloc(scatterlen);
+
+        if (!isload) {
+            mc_scatter_state(scatter, 0);
+        }
+
+        mmc_ckptio(scatter, 1, scatterlen, fp, isload);
+
+        if (isload) {
+            mc_scatter_state(scatter, 1);
+        }
+
+        free(scatter);
+    }
+
+    if (!isload) {
+        visitor_foldweight(cfg, visit);
+    }
+
+    mmc_ckptio(visit->launchweight, sizeof(double), cfg->srcnum, fp, isload);
+    mmc_ckptio(visit->absorbweight, sizeof(double), cfg->srcnum, fp, isload);
+
+    if (visit->detweight) {
+        mmc_ckptio(visit->detweight, sizeof(double), MAX(cfg->detnum, 1), fp, isload);
+    }
+
+    if (visit->detstat) {
+        mmc_ckptio(visit->detstat, sizeof(double), (size_t)cfg->detnum * visit->statlen, fp, isload);
+    }
+
+    if (visit->nee) {
+        mmc_ckptio(visit->nee, sizeof(double), (size_t)cfg->detnum * (cfg->maxgate + 1), fp, isload);
+    }
+
+    if (visit->camsignals) {
+        mmc_ckptio(visit->camsignals, sizeof(double), (size_t)cfg->cam_image_width * cfg->cam_image_height + 2, fp, isload);
+    }
+
+    mmc_ckptio(&visit->nphoton, sizeof(unsigned long long), 1, fp, isload);
+    mmc_ckptio(&visit->nreflect, sizeof(unsigned long long), 1, fp, isload);
+    mmc_ckptio(&visit->nroihit, sizeof(unsigned long long), 1, fp, isload);
+    mmc_ckptio(&visit->ndetected, sizeof(unsigned long long), 1, fp, isload);
+    mmc_ckptio(threadtet, sizeof(double), 1, fp, isload);
+    mmc_ckptio(threadtet0, sizeof(double), 1, fp, isload);
+}
+
+/**
+ * \brief Save or restore the shared detected photon buffer in the checkpoint file
+ *
+ * The checkpoints are taken between two batches, when all reserved slots are
+ * written; the streaming mode is disabled with checkpoints.
+ *
+ * \param[in,out] fp: the checkpoint file
+ * \param[in] isload: 1 to read from the file, 0 to write
+ * \param[in,out] buf: the shared detected photon buffer
+ */
+
+static void mmc_ckptdetected(FILE* fp, int isload, detbuffer* buf) {
+    size_t i, n;
+
+    if (buf->seg == NULL) {
+        return;
+    }
+
+    mmc_ckptio(&buf->count, sizeof(unsigned int), 1, fp, isload);
+
+    if (buf->count > buf->segnum * buf->seglen) {
+        MMC_ERROR(-10, "the checkpoint holds more detected photons than the run simulates");
+    }
+
+    for (i = 0; i * buf->seglen < buf->count; i++) {
+        n = MIN(buf->seglen, buf->count - i * buf->seglen);
+
+        if (isload) {
+            buf->seg[i] = (float*)malloc((size_t)buf->seglen * (buf->reclen * sizeof(float) + buf->seedbyte));
+            buf->filled[i] = n;
+        }
+
+        mmc_ckptio(buf->seg[i], sizeof(float), n * buf->reclen, fp, isload);
+
+        if (buf->seedbyte) {
+            mmc_ckptio(buf->seg[i] + (size_t)buf->seglen * buf->reclen, buf->seedbyte, n, fp, isload);
+        }
+    }
+}
+
+/**
+ * \brief Save or restore the accumulated output in the checkpoint file
+ *
+ * The saved output includes the thread-private buffers that have not yet been
+ * merged; on restore, all of it is loaded in mesh->weight.
+ *
+ * \param[in,out] fp: the checkpoint file, positioned after the header
+ * \param[in] isload: 1 to restore the output, 0 to save it
+ * \param[in] hdr: the checkpoint header
+ * \param[in,out] mesh: the mesh data structure
+ * \param[in] privweight: the thread-private output buffers, NULL if not used
+ */
+
+static void mmc_ckptoutput(FILE* fp, int isload, ckptheader* hdr, tetmesh* mesh, double** privweight) {
+    size_t k, len, block = 65536;
+    int t;
+    double* buf;
+
+    if (isload || privweight == NULL) {
+        mmc_ckptio(mesh->weight, sizeof(double), hdr->buflen, fp, isload);
+    } else {
+        buf = (double*)malloc(block * sizeof(double));
+
+        for (k = 0; k < hdr->buflen; k += block) {
+            len = MIN(block, hdr->buflen - k);
+            memcpy(buf, mesh->weight + k, len * sizeof(double));
+
+            for (t = 0; t < hdr->threadnum; t++) {
+                size_t m;
+
+                for (m = 0; privweight[t] && m < len; m++) {
+                    buf[m] += privweight[t][k + m];
+                }
+            }
+
+            mmc_ckptio(buf, sizeof(double), len, fp, isload);
+        }
+
+        free(buf);
+    }
+
+    if (hdr->dreflen) {
+        mmc_ckptio(mesh->dref, sizeof(double), hdr->dreflen, fp, isload);
+    }
+}
+
+/**
+ * \brief Sum the output at the monitored indices of the convergence-driven mode
+ *
+ * The output of each index is summed over all time gates and sources, including
+ * the thread-private buffers that have not yet been merged into mesh->weight.
+ *
+ * \param[in] cfg: the simulation configuration structure
+ * \param[in] mesh: the mesh data structure
+ * \param[in] privweight: the thread-private output buffers, NULL if not used
+ * \param[in] threadnum: the number of thread-private buffers
+ * \param[in] roiidx: the 0-based position of each monitored index in mesh->weight
+ * \param[out] total: the summed output of each monitored index
+ */
+
+static void mmc_convroitotal(mcconfig* cfg, tetmesh* mesh, double** privweight, unsigned int threadnum, int* roiidx, double* total) {
+    size_t datalen = (cfg->method == rtBLBadouelGrid) ? cfg->crop0.z : ( (cfg->basisorder) ? mesh->nn : MESH_ELEMOUT(mesh)), idx;
+    unsigned int i, j, t;
+    int k;
+
+    for (k = 0; k < cfg->convroinum; k++) {
+        total[k] = 0.0;
+
+        for (i = 0; i < cfg->maxgate; i++) {
+            for (j = 0; j < (unsigned int)cfg->srcnum; j++) {
+                idx = (roiidx[k] + i * datalen) * cfg->srcnum + j;
+                total[k] += mesh->weight[idx];
+
+                for (t = 0; privweight && t < threadnum; t++) {
+                    total[k] += (privweight[t]) ? privweight[t][idx] : 0.0;
+                }
+            }
+        }
+    }
+}
+
+/**
+ * \brief Add the output of the last batch to the batch-variance sums (--varbatch)
+ *
+ * The output of the batch is the change of the total output, including the
+ * thread-private buffers, since the end of the previous batch. This is called
+ * by all threads of the photon loop, which share the entries between them.
+ *
+ * \param[in] mesh: the mesh object, mesh->weightvar receives the sums
+ * \param[in] privweight: the thread-private output buffers, NULL if not used
+ * \param[in] threadnum: the number of thread-private buffers
+ * \param[in,out] varlast: the total output at the end of the previous batch
+ * \param[in] varlen: the entries of the time-gated output, see mesh_batchvariance
+ * \param[in] nphoton: the photon number of the batch
+ */
+
+static void mmc_varaddbatch(tetmesh* mesh, double** privweight, unsigned int threadnum, double* varlast, size_t varlen, double nphoton) {
+    size_t k;
+    unsigned int t;
+
+    #pragma omp for schedule(static)
+
+    for (k = 0; k < varlen; k++) {
+        double total = mesh->weight[k], delta;
+
+        for (t = 0; privweight && t < threadnum; t++) {
+            total += (privweight[t]) ? privweight[t][k] : 0.0;
+        }
+
+        delta = total - varlast[k];
+        varlast[k] = total;
+        mesh->weightvar[k] += delta * delta / nphoton;
+    }
+}
+
+#ifdef MMC_USE_MPI
+
+/**
+ * \brief Sum a buffer over all MPI ranks into rank 0
+ *
+ * \param[in,out] buf: the buffer to be summed, only holds the total on rank 0
+ * \param[in] len: the element number of the buffer
+ * \param[in] rank: the MPI rank of this process
+ */
+
+static void mmc_mpi_sum(double* buf, size_t len, int rank) {
+    size_t i, count;
+
+    for (i = 0; i < len; i += count) {
+        count = MIN(len - i, MMC_MPI_BLOCK);
+        MPI_Reduce((rank == 0) ? MPI_IN_PLACE : buf + i, buf + i, (int)count, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+    }
+}
+
+/**
+ * \brief Gather the records of all MPI ranks into a new buffer on rank 0
+ *
+ * \param[in] buf: the records of this rank
+ * \param[in] count: the record number of this rank
+ * \param[in] reclen: the byte length of each record
+ * \param[in] counts: the record number of each rank, only used on rank 0
+ * \param[in] total: the total record number, only used on rank 0
+ * \param[in] rank: the MPI rank of this process
+ * \param[in] size: the total MPI rank number
+ * \return the gathered records on rank 0, NULL on other ranks
+ */
+
+static void* mmc_mpi_gather(void* buf, int count, size_t reclen, int* counts, int total, int rank, int size) {
+    int i, *bytes = NULL, *offsets = NULL;
+    void* all = NULL;
+
+    if (rank == 0) {
+        bytes = (int*)malloc(size * sizeof(int));
+        offsets = (int*)malloc(size * sizeof(int));
+
+        for (i = 0; i < size; i++) {
+            bytes[i] = (int)(counts[i] * reclen);
+            offsets[i] = (i == 0) ? 0 : offsets[i - 1] + bytes[i - 1];
+        }
+
+        all = calloc(MAX(total, 1), reclen);
+    }
+
+    MPI_Gatherv(buf, (int)(count * reclen), MPI_BYTE, all, bytes, offsets, MPI_BYTE, 0, MPI_COMM_WORLD);
+
+    free(bytes);
+    free(offsets);
+    return all;
+}
+
+/**
+ * \brief Combine the outputs of all MPI ranks into rank 0
+ *
+ * The fluence, the diffuse reflectance, the energy totals and the ray-tet
+ * counters are summed, and the detected photons are appended in the rank order.
+ *
+ * \param[in,out] cfg: the simulation configuration structure
+ * \param[in,out] mesh: the mesh data structure
+ * \param[in,out] master: the visitor holding the combined output of all threads of this rank
+ * \param[in] buflen: the element number of mesh->weight
+ * \param[in] dreflen: the element number of mesh->dref, 0 if not saved
+ * \param[in] reclen: the float number of each detected photon record
+ * \param[in,out] raytri: the total number of ray-tet tests
+ * \param[in,out] raytri0: the total number of ray-tet tests outside of the mesh
+ */
+
+static void mmc_mpi_reduce(mcconfig* cfg, tetmesh* mesh, visitor* master, size_t buflen, size_t dreflen, int reclen, float* raytri, float* raytri0) {
+    double tet[2] = {*raytri, *raytri0};
+    int i, total = 0, *counts = NULL;
+    void* all;
+
+    mmc_mpi_sum(mesh->weight, buflen, cfg->mpirank);
+
+    if (dreflen) {
+        mmc_mpi_sum(mesh->dref, dreflen, cfg->mpirank);
+    }
+
+    mmc_mpi_sum(master->launchweight, cfg->srcnum, cfg->mpirank);
+    mmc_mpi_sum(master->absorbweight, cfg->srcnum, cfg->mpirank);
+
+    if (master->dcsg1) {
+        mmc_mpi_sum(master->dcsg1, (size_t)cfg->detnum * (cfg->dcstaunum + 1), cfg->mpirank);
+    }
+
+    if (master->detstat) {
+        mmc_mpi_sum(master->detstat, (size_t)cfg->detnum * master->statlen, cfg->mpirank);
+    }
+
+    if (master->nee) {
+        mmc_mpi_sum(master->nee, (size_t)cfg->detnum * (cfg->maxgate + 1), cfg->mpirank);
+    }
+
+    if (master->camsignals) {
+        mmc_mpi_sum(master->camsignals, (size_t)cfg->cam_image_width * cfg->cam_image_height + 2, cfg->mpirank);
+    }
+
+    if (master->dcsg1 || master->detstat) {
+        double ndetected = (double)master->ndetected;
+
+        mmc_mpi_sum(&ndetected, 1, cfg->mpirank);
+        master->ndetected = (unsigned long long)ndetected;
+    }
+    mmc_mpi_sum(tet, 2, cfg->mpirank);
+    *raytri = tet[0];
+    *raytri0 = tet[1];
+
+    if (cfg->issavedet == 0) {
+        return;
+    }
+
+    if (cfg->mpirank == 0) {
+        counts = (int*)malloc(cfg->mpisize * sizeof(int));
+    }
+
+    MPI_Gather(&master->bufpos, 1, MPI_INT, counts, 1, MPI_INT, 0, MPI_COMM_WORLD);
+
+    for (i = 0; cfg->mpirank == 0 && i < cfg->mpisize; i++) {
+        total += counts[i];
+    }
+
+    all = mmc_mpi_gather(master->partialpath, master->bufpos, reclen * sizeof(float), counts, total, cfg->mpirank, cfg->mpisize);
+
+    if (cfg->mpirank == 0) {
+        free(master->partialpath);
+        master->partialpath = (float*)all;
+    }
+
+    if (cfg->issaveseed) {
+        all = mmc_mpi_gather(master->photonseed, master->bufpos, sizeof(RandType) * RAND_BUF_LEN, counts, total, cfg->mpirank, cfg->mpisize);
+
+        if (cfg->mpirank == 0) {
+            free(master->photonseed);
+            master->photonseed = all;
+        }
+    }
+
+    if (cfg->mpirank == 0) {
+        master->detcount = master->bufpos = total;
+        cfg->detectedcount = total;
+        free(counts);
+    }
+}
+
+#endif
+
+#define MMC_INC_MAGIC "MMCINC01"           /**< magic header of an incremental re-simulation cache */
+
+/**
+ * \struct MMC_incheader mmc_host.c
+ * \brief The header of an incremental re-simulation cache, used to validate a later run
+ */
+
+typedef struct MMC_incheader {
+    char magic[8];                /**< must be MMC_INC_MAGIC */
+    unsigned long long nphoton;   /**< the total photon number of the run */
+    unsigned long long buflen;    /**< length of mesh->weight */
+    unsigned long long dreflen;   /**< length of mesh->dref, 0 if not saved */
+    unsigned long long nbatch;    /**< number of label masks, one per MMC_INC_BATCH photons */
+    int seed;                     /**< the RNG seed of the run */
+    int srcnum;                   /**< number of sources */
+    int prop;                     /**< number of media, the cached media list prop+1 entries */
+    int ne;                       /**< number of elements of the mesh */
+    int method;                   /**< the ray-tracing method */
+    int outputtype;               /**< the output type */
+    float unitinmm;               /**< the length unit of the mesh, the cached media are scaled by it */
+    float nout;                   /**< refractive index of the background */
+} incheader;
+
+/**
+ * \brief Fill the header of the incremental re-simulation cache of the current run
+ */
+
+static void mmc_incheader(incheader* hdr, mcconfig* cfg, tetmesh* mesh, size_t buflen, size_t dreflen) {
+    memset(hdr, 0, sizeof(incheader));
+    memcpy(hdr->magic, MMC_INC_MAGIC, sizeof(hdr->magic));
+    hdr->nphoton = cfg->nphoton;
+    hdr->buflen = buflen;
+    hdr->dreflen = dreflen;
+    hdr->nbatch = (cfg->nphoton + MMC_INC_BATCH - 1) / MMC_INC_BATCH;
+    hdr->seed = cfg->seed;
+    hdr->srcnum = cfg->srcnum;
+    hdr->prop = mesh->prop;
+    hdr->ne = mesh->ne;
+    hdr->method = cfg->method;
+    hdr->outputtype = cfg->outputtype;
+    hdr->unitinmm = cfg->unitinmm;
+    hdr->nout = cfg->nout;
+}
+
+/**
+ * \brief Combine the raw output of a pass of the incremental re-simulation with the cache
+ *
+ * After the pass with the cached media, the contribution of the re-simulated
+ * photons is subtracted from the cached raw output held in cfg->incbase. After
+ * the pass with the current media, the remaining cached output is added to the
+ * new contribution and the result, the current media and the label masks are
+ * saved to the cache before the output is normalized.
+ *
+ * \param[in,out] cfg: the simulation configuration structure
+ * \param[in,out] mesh: the mesh data structure
+ * \param[in,out] master: the visitor holding the launched and absorbed weights of the run
+ * \param[in] buflen: length of mesh->weight
+ * \param[in] dreflen: length of mesh->dref, 0 if not saved
+ * \return 1 after the pass with the cached media, which is not normalized or saved, 0 otherwise
+ */
+
+static int mmc_incmerge(mcconfig* cfg, tetmesh* mesh, visitor* master, size_t buflen, size_t dreflen) {
+    double* base = cfg->incbase;
+    size_t k;
+    int j;
+    incheader hdr;
+    FILE* fp;
+
+    if (cfg->incpass == 1) {
+        for (k = 0; k < buflen; k++) {
+            base[k] -= mesh->weight[k];
+        }
+
+        for (k = 0; k < dreflen; k++) {
+            base[buflen + k] -= mesh->dref[k];
+        }
+    } else if (base) {
+        for (k = 0; k < buflen; k++) {
+            mesh->weight[k] += base[k];
+        }
+
+        for (k = 0; k < dreflen; k++) {
+            mesh->dref[k] += base[buflen + k];
+        }
+    }
+
+    if (base) {
+        for (j = 0; j < cfg->srcnum; j++) {
+            double* launch = base + buflen + dreflen + j, *absorb = launch + cfg->srcnum;
+
+            if (cfg->incpass == 1) {
+                *launch -= master->launchweight[j];
+                *absorb -= master->absorbweight[j];
+            } else {
+                master->launchweight[j] += *launch;
+                master->absorbweight[j] += *absorb;
+            }
+        }
+    }
+
+    if (cfg->incpass == 1) {
+        return 1;
+    }
+
+    mmc_incheader(&hdr, cfg, mesh, buflen, dreflen);
+
+    if ((fp = fopen(cfg->inccache, "wb")) == NULL) {
+        MMC_ERROR(-10, "can not write the incremental re-simulation cache");
+    }
+
+    mmc_ckptio(&hdr, sizeof(incheader), 1, fp, 0);
+    mmc_ckptio(mesh->med, sizeof(medium), mesh->prop + 1, fp, 0);
+    mmc_ckptio(cfg->incmask, sizeof(unsigned long long), hdr.nbatch, fp, 0);
+    mmc_ckptio(mesh->weight, sizeof(double), buflen, fp, 0);
+    mmc_ckptio(mesh->dref, sizeof(double), dreflen, fp, 0);
+    mmc_ckptio(master->launchweight, sizeof(double), cfg->srcnum, fp, 0);
+    mmc_ckptio(master->absorbweight, sizeof(double), cfg->srcnum, fp, 0);
+    fclose(fp);
+    return 0;
+}
+
+/**
+ * \brief Incremental re-simulation: only re-simulate the photons that touched modified media
+ *
+ * In iterative reconstructions, only a few labels change between two runs.
+ * The photons are grouped in batches of MMC_INC_BATCH consecutive IDs, and a
+ * bit mask of the labels entered, or tested for reflection, by the photons of
+ * each batch is recorded during the run. With the counter-based RNG, a photon
+ * ID reproduces its path as long as the media it touched are the same, so the
+ * batches that did not touch a modified label contribute exactly what is in
+ * the cache of the previous run. The other batches are simulated twice: once
+ * with the cached media, to subtract their cached contribution, and once with
+ * the current media. A run without a matching cache simulates all photons and
+ * creates it.
+ *
+ * \param[in,out] cfg: the simulation configuration structure
+ * \param[in,out] mesh: the mesh data structure
+ * \param[in] tracer: the ray-tracer data structure
+ */
+
+static int mmc_run_incremental(mcconfig* cfg, tetmesh* mesh, raytracer* tracer) {
+    size_t datalen = (size_t)((cfg->method == rtBLBadouelGrid) ? cfg->crop0.z : ( (cfg->basisorder) ? mesh->nn : mesh->ne));
+    size_t buflen = datalen * cfg->srcnum * cfg->maxgate;
+    size_t dreflen = (cfg->issaveref && mesh->dref) ? (size_t)mesh->nf * cfg->srcnum * cfg->maxgate : 0;
+    size_t k, nbatch = (cfg->nphoton + MMC_INC_BATCH - 1) / MMC_INC_BATCH;
+    unsigned long long changed = 0;
+    incheader hdr, cached;
+    medium* oldmed = NULL, *newmed;
+    FILE* fp;
+    int i;
+
+    if (cfg->rngtype != rngPhilox) {
+        MMC_ERROR(-2, "the incremental re-simulation requires the counter-based RNG, use --rng philox");
+    }
+
+    mmc_incheader(&hdr, cfg, mesh, buflen, dreflen);
+    cfg->incmask = (unsigned long long*)realloc(cfg->incmask, MAX(nbatch, 1) * sizeof(unsigned long long));
+    memset(cfg->incmask, 0, MAX(nbatch, 1) * sizeof(unsigned long long));
+
+    if ((fp = fopen(cfg->inccache, "rb")) != NULL) {
+        if (fread(&cached, sizeof(incheader), 1, fp) != 1 || memcmp(&cached, &hdr, sizeof(incheader))) {
+            MMCDEBUG(cfg, dlTime, (cfg->flog, "the incremental cache %s was saved by a simulation with different settings, simulate all photons\n", cfg->inccache));
+            fclose(fp);
+            fp = NULL;
+        }
+    }
+
+    if (fp) {
+        oldmed = (medium*)malloc(sizeof(medium) * (mesh->prop + 1));
+        cfg->incbase = (double*)realloc(cfg->incbase, sizeof(double) * (buflen + dreflen + 2 * cfg->srcnum));
+        mmc_ckptio(oldmed, sizeof(medium), mesh->prop + 1, fp, 1);
+        mmc_ckptio(cfg->incmask, sizeof(unsigned long long), nbatch, fp, 1);
+        mmc_ckptio(cfg->incbase, sizeof(double), buflen + dreflen + 2 * cfg->srcnum, fp, 1);
+        fclose(fp);
+
+        for (i = 0; i <= mesh->prop; i++) {
+            if (memcmp(oldmed + i, mesh->med + i, sizeof(medium))) {
+                changed |= MMC_LABEL_BIT(i);
+            }
+        }
+
+        cfg->incbatch = (unsigned int*)realloc(cfg->incbatch, MAX(nbatch, 1) * sizeof(unsigned int));
+        cfg->incbatchnum = 0;
+
+        for (k = 0; k < nbatch; k++) {
+            if (cfg->incmask[k] & changed) {
+                cfg->incbatch[cfg->incbatchnum++] = k;
+            }
+        }
+
+        MMCDEBUG(cfg, dlTime, (cfg->flog, "incremental re-simulation of %u out of %zu photon batches\n", cfg->incbatchnum, nbatch));
+
+        /*subtract the cached contribution of the selected photons, simulated with the cached media*/
+        newmed = (medium*)malloc(sizeof(medium) * (mesh->prop + 1));
+        memcpy(newmed, mesh->med, sizeof(medium) * (mesh->prop + 1));
+        memcpy(mesh->med, oldmed, sizeof(medium) * (mesh->prop + 1));
+        memset(mesh->weight, 0, sizeof(double) * buflen);
+
+        if (dreflen) {
+            memset(mesh->dref, 0, sizeof(double) * dreflen);
+        }
+
+        if (cfg->incbatchnum > 0) {
+            cfg->incpass = 1;
+            mmc_run_mp(cfg, mesh, tracer);
+        }
+
+        memcpy(mesh->med, newmed, sizeof(medium) * (mesh->prop + 1));
+        memset(mesh->weight, 0, sizeof(double) * buflen);
+
+        if (dreflen) {
+            memset(mesh->dref, 0, sizeof(double) * dreflen);
+        }
+
+        /*the new paths of the selected photons replace their cached label masks*/
+        for (k = 0; k < cfg->incbatchnum; k++) {
+            cfg->incmask[cfg->incbatch[k]] = 0;
+        }
+
+        free(newmed);
+        free(oldmed);
+    }
+
+    cfg->incpass = 2;
+    mmc_run_mp(cfg, mesh, tracer);
+    cfg->incpass = 0;
+    return 0;
+}
+
+/**
+ * \struct MMC_hybridpeer mmc_host.c
+ * \brief The GPU share of a hybrid run (--hybrid), see mmc_run_hybrid
+ */
+
+typedef struct MMC_hybridpeer {
+    mcconfig cfg;                 /**< copy of the configuration, simulating the first photons */
+    tetmesh mesh;                 /**< shallow copy of the mesh, with its own output buffers */
+    int isseeded;                 /**< set once the CPU threads have drawn their seeds from rand() */
+    int isdone;                   /**< set once the GPU simulation has returned */
+} hybridpeer;
+
+/**
+ * \brief Wait for the GPU share of a hybrid run and add its output to that of the CPU
+ *
+ * The GPU output is neither normalized nor mapped to the input order, so its
+ * fluence, diffuse reflectance and detected photons are summed or appended as
+ * those of another MPI rank, and its energy totals are added to the launched
+ * and absorbed weights of the CPU threads before the normalization.
+ *
+ * \param[in,out] cfg: the simulation configuration structure
+ * \param[in,out] mesh: the mesh data structure
+ * \param[in,out] master: the visitor holding the combined output of the CPU threads
+ * \param[in] peer: the GPU share of the run
+ * \param[in] buflen: the element number of mesh->weight
+ * \param[in] dreflen: the element number of mesh->dref, 0 if not saved
+ * \param[in] reclen: the float number of each detected photon record
+ */
+
+static void mmc_hybridmerge(mcconfig* cfg, tetmesh* mesh, visitor* master, hybridpeer* peer, size_t buflen, size_t dreflen, int reclen) {
+    size_t i;
+    int isdone = 0, count;
+
+    while (1) {
+        #pragma omp atomic read
+        isdone = peer->isdone;
+
+        if (isdone) {
+            break;
+        }
+
+        sleep_ms(1);
+    }
+
+    count = peer->cfg.detectedcount;
+
+    for (i = 0; i < buflen; i++) {
+        mesh->weight[i] += peer->mesh.weight[i];
+    }
+
+    for (i = 0; i < dreflen; i++) {
+        mesh->dref[i] += peer->mesh.dref[i];
+    }
+
+    for (i = 0; i < (size_t)cfg->srcnum; i++) {
+        master->launchweight[i] += peer->cfg.energytot[i];
+        master->absorbweight[i] += peer->cfg.energytot[i] - peer->cfg.energyesc[i];
+    }
+
+    if (cfg->issavedet && count > 0 && peer->cfg.exportdetected) {
+        master->partialpath = (float*)realloc(master->partialpath, (size_t)(master->bufpos + count) * reclen * sizeof(float));
+        memcpy(master->partialpath + (size_t)master->bufpos * reclen, peer->cfg.exportdetected, (size_t)count * reclen * sizeof(float));
+        master->detcount = master->bufpos = master->bufpos + count;
+        cfg->detectedcount = master->bufpos;
+    }
+}
+
+/**
+ * \brief Main function to launch CPU based MMC photon simulation
+ *
+ * This is the main loop of the Monte Carlo photon simulation. This function
+ * run a complete photon simulation session based on one set of user input.
+ *
+ * \param[out] cfg: the simulation configuration structure
+ * \param[out] mesh: the mesh data structure
+ * \param[out] tracer: the ray-tracer data structure
+ * \param[in,out] peer: the GPU share of a hybrid run, merged before the normalization; NULL otherwise
+ */
+
+static int mmc_run_share(mcconfig* cfg, tetmesh* mesh, raytracer* tracer, hybridpeer* peer) {
+    RandType ran0[RAND_BUF_LEN] __attribute__ ((aligned(16)));
+    RandType ran1[RAND_BUF_LEN] __attribute__ ((aligned(16)));
+    unsigned int i, j;
+    float raytri = 0.f, raytri0 = 0.f;
+    unsigned int threadid = 0, t0, dt, debuglevel = 0;
+    unsigned long long ncomplete = 0, *progress = NULL;
+    int numanum = 0, *numacpu = NULL, numastart[MMC_NUMA_MAX_NODE + 1];
+    tetmesh* numamesh = NULL;
+    raytracer* numatracer = NULL;
+    visitor master = {0.f, 0.f, 0.f, 0, 0, 0, NULL, NULL, NULL, NULL, NULL, NULL, 0, NULL, NULL, 0, NULL};
+    double** privweight = NULL, *elemweight = NULL, *threadshare = NULL;
+    unsigned int** privheat = NULL;
+    unsigned long long tphase, tsimend = 0;
+    size_t datalen = (size_t)((cfg->method == rtBLBadouelGrid) ? cfg->crop0.z : ( (cfg->basisorder) ? mesh->nn : MESH_ELEMOUT(mesh)));
+    size_t buflen = datalen * cfg->srcnum * (cfg->maxgate * cfg->replaydetnum * cfg->wavenum + 2 * cfg->freqnum) + ((mesh->outmap) ? cfg->srcnum : 0);
+    size_t batchlen = cfg->nphoton;
+    int convdet = 0, convabs = 0, isconverged = 0, iscancelled = 0, *roiidx = NULL;
+    double* convtotal = NULL, *varlast = NULL;
+    size_t varlen = (mesh->weightvar) ? datalen * cfg->srcnum * cfg->maxgate : 0;
+    int nvarbatch = 0;
+    convstate conv;
+    detbuffer detbuf;
+    FILE* ckptfp = NULL;
+    ckptheader ckpt;
+    char ckptname[MAX_FULL_PATH], ckpttmp[MAX_FULL_PATH + 4];
+    size_t photonstart = cfg->nphoton * cfg->mpirank / cfg->mpisize;  /*each MPI rank simulates a contiguous range of photons*/
+    size_t photonend = cfg->nphoton * (cfg->mpirank + 1) / cfg->mpisize;
+    size_t photonnum = photonend - photonstart;
+    int isckpt = (cfg->ckptperiod > 0 || cfg->checkpt[0] > 0);
+    int photonblock = mmc_photonblock(cfg);
+    int reclen = mcx_detreclen(cfg, mesh->prop);
+    size_t dreflen = (cfg->issaveref && mesh->dref) ? (size_t)mesh->nf * cfg->srcnum * cfg->maxgate : 0;
+    /*the incremental mode runs one or two passes over selected photons, see mmc_run_incremental*/
+    if (cfg->inccache[0] && cfg->incpass == 0) {
+        return mmc_run_incremental(cfg, mesh, tracer);
+    }
+
+    if (cfg->incbatch) {
+        photonstart = 0;
+        photonend = (size_t)cfg->incbatchnum * MMC_INC_BATCH;
+
+        /*the last batch of the run is partial unless nphoton is a multiple of MMC_INC_BATCH*/
+        if (cfg->incbatchnum > 0 && ((size_t)cfg->incbatch[cfg->incbatchnum - 1] + 1) * MMC_INC_BATCH > cfg->nphoton) {
+            photonend -= ((size_t)cfg->incbatch[cfg->incbatchnum - 1] + 1) * MMC_INC_BATCH - cfg->nphoton;
+        }
+
+        photonnum = photonend;
+    }
+
+    /*in a hybrid run, the GPU simulates the first photons*/
+    if (peer) {
+        photonstart = peer->cfg.nphoton;
+        photonnum = photonend - photonstart;
+    }
+
+    master.statlen = mcx_detstatlen(cfg, mesh->prop);
+    visitor_init(cfg, &master);
+    mcx_convinit(&conv, 0);
+    cfg->convphoton = cfg->nphoton;
+    cfg->convrse = 0.f;
+
+    /*in the convergence-driven mode, photons are simulated in batches until the target precision is met*/
+    if (cfg->convtarget > 0.f) {
+        batchlen = (cfg->convbatch > 0) ? (size_t)cfg->convbatch : MAX(cfg->nphoton / 100, 1);
+        convdet = (cfg->issavedet) ? MAX(cfg->detnum, 1) : 0;
+        convabs = (convdet + cfg->convroinum == 0) ? cfg->srcnum : 0;
+
+        if (cfg->convroinum > 0) {
+            int* order = (cfg->method == rtBLBadouelGrid) ? NULL : ((cfg->basisorder) ? mesh->nodeorder : mesh->elemorder);
+
+            roiidx = (int*)malloc(cfg->convroinum * sizeof(int));
+
+            for (i = 0; i < (unsigned int)cfg->convroinum; i++) {
+                if (cfg->convroi[i] <= 0 || cfg->convroi[i] > ((mesh->outmap) ? mesh->ne : (int)datalen)) {
+                    MMC_ERROR(-2, "convroi contains an index outside of the output");
+                }
+
+                roiidx[i] = cfg->convroi[i] - 1;
+            }
+
+            /*with --outmask, the rows of the selected elements are in the input order*/
+            for (j = 0; mesh->outmap && j < (unsigned int)mesh->ne; j++) {
+                for (i = 0; i < (unsigned int)cfg->convroinum; i++) {
+                    if ((order ? order[j] : (int)j) == cfg->convroi[i] - 1) {
+                        if (mesh->outmap[j] < 0) {
+                            MMC_ERROR(-2, "convroi contains an element that is not selected by --outmask");
+                        }
+
+                        roiidx[i] = mesh->outmap[j];
+                    }
+                }
+            }
+
+            /*the output is in the reordered node/element order until the end of the run*/
+            for (j = 0; order && mesh->outmap == NULL && j < datalen; j++) {
+                for (i = 0; i < (unsigned int)cfg->convroinum; i++) {
+                    if (order[j] == cfg->convroi[i] - 1) {
+                        roiidx[i] = j;
+                    }
+                }
+            }
+        }
+
+        mcx_convinit(&conv, convdet + cfg->convroinum + convabs);
+        convtotal = (double*)calloc(conv.nquantity, sizeof(double));
+    } else if (varlen) {
+        /*for the batch variance, the photons of this run are split into varbatch batches, unless the convergence test sets the batches*/
+        batchlen = MAX((photonnum + cfg->varbatch - 1) / cfg->varbatch, 1);
+    }
+
+    t0 = StartTimer();
+
+    if (cfg->mpirank == 0) {
+        mcx_printheader(cfg);
+    }
+
+    if (cfg->streamdet > 0) {
+        cfg->his.savedphoton = 0;
+    }
+
+    dt = GetTimeMillis();
+    tphase = GetTimeNanos();
+    MMCDEBUG(cfg, dlTime, (cfg->flog, "seed=%u\nsimulating ... \n", cfg->seed));
+
+    if (cfg->debugphoton >= 0) {
+        debuglevel = cfg->debuglevel;
+        cfg->debuglevel &= 0xFFFFEA00;
+#ifdef _OPENMP
+        omp_set_num_threads(1);
+#endif
+    }
+
+    unsigned int* seeds = NULL;
+
+    if (cfg->debuglevel & dlTraj) {
+        /*a standalone single-process run streams the trajectories to the .mct file, see visitor_flushtraj()*/
+#ifdef MCX_CONTAINER
+        int trajstream = 0;
+#else
+        int trajstream = (cfg->parentid == mpStandalone && cfg->mpisize <= 1);
+#endif
+
+        if (cfg->exportdebugdata == NULL && !trajstream) {
+            cfg->exportdebugdata = (float*)malloc(sizeof(float) * MCX_DEBUG_REC_LEN * cfg->maxjumpdebug);
+        }
+
+        cfg->debugdatalen = 0;
+    }
+
+    mmc_ckptname(cfg, ckptname);
+    sprintf(ckpttmp, "%s.tmp", ckptname);
+    memset(&ckpt, 0, sizeof(ckptheader));
+    mmc_initdetbuffer(&detbuf, cfg, reclen, MAX(cfg->nphoton, photonend));
+
+    /*restore the output of a saved checkpoint, each thread then restores its own state*/
+    if (cfg->isresume) {
+        if ((ckptfp = fopen(ckptname, "rb")) == NULL) {
+            MMC_ERROR(-10, "can not open the checkpoint file to resume from");
+        }
+
+        mmc_ckptio(&ckpt, sizeof(ckptheader), 1, ckptfp, 1);
+
+        if (memcmp(ckpt.magic, MMC_CKPT_MAGIC, sizeof(ckpt.magic)) || ckpt.nphoton != cfg->nphoton || ckpt.buflen != buflen
+                || ckpt.dreflen != dreflen || ckpt.srcnum != cfg->srcnum || ckpt.reclen != reclen
+                || ckpt.issaveseed != cfg->issaveseed || ckpt.nquantity != conv.nquantity || ckpt.varbatch != cfg->varbatch
+                || ckpt.rngtype != cfg->rngtype) {
+            MMC_ERROR(-10, "the checkpoint was saved by a simulation with different settings");
+        }
+
+        mmc_ckptoutput(ckptfp, 1, &ckpt, mesh, NULL);
+        mmc_ckptdetected(ckptfp, 1, &detbuf);
+        photonstart = ckpt.done;
+        ncomplete = ckpt.ncomplete;
+        raytri = ckpt.raytri;
+        raytri0 = ckpt.raytri0;
+
+#ifdef _OPENMP
+        omp_set_num_threads(ckpt.threadnum);
+#endif
+        MMCDEBUG(cfg, dlTime, (cfg->flog, "resuming from %s after %llu photons\n", ckptname, ckpt.done));
+    }
+
+    /*the output at the start of the run, including that restored from a checkpoint, is the end of the batch before the first one*/
+    if (varlen) {
+        varlast = (double*)malloc(varlen * sizeof(double));
+        memcpy(varlast, mesh->weight, varlen * sizeof(double));
+    }
+
+    /***************************************************************************//**
+    The master thread then spawn multiple work-threads depending on your
+    OpenMP settings. By default, the total thread number (master + work) is
+    your total CPU core number. For example, if you have a dual-core CPU,
+    the total thread number is 2; if you have two quad-core CPUs, the total
+    thread number is 8. If you want to set the total thread number manually,
+    you need to set the OMP_NUM_THREADS environment variable. For example,
+    \c OMP_NUM_THREADS=3 sets the total thread number to 3.
+    *******************************************************************************/
+
+    /** \subsection ssimu Parallel photon transport simulation */
+
+    /*--autotune sets the thread number and, on a hybrid CPU, splits the photons by the speed of the cores, see mmc_cpu_autotune*/
+#ifdef _OPENMP
+
+    if (cfg->tunedthread > 0 && !cfg->isresume && cfg->debugphoton < 0) {
+        omp_set_num_threads(cfg->tunedthread);
+        threadshare = (photonblock == 0 && peer == NULL) ? cfg->tunedshare : NULL;
+    }
+
+#endif
+
+    /*the photon loops use the runtime schedule: an even split, or blocks claimed on demand (one packet at a time)*/
+#ifdef _OPENMP
+
+    if (threadshare) {
+        omp_set_schedule(omp_sched_static, 1);
+    } else if (photonblock > 0) {
+        omp_set_schedule(omp_sched_dynamic, (cfg->method == rtBLBadouelPacket || cfg->iswavefront) ? 1 : photonblock);
+    } else {
+        omp_set_schedule(omp_sched_static, 0);
+    }
+
+#endif
+
+    #pragma omp parallel private(ran0,ran1,threadid,j)
+    {
+        visitor visit = {0.f, 0.f, 1.f / cfg->tstep, 0, 0, 0, NULL, NULL, NULL, NULL, NULL, NULL, 0, NULL, NULL, 0, NULL};
+        size_t id, batchstart, batchend;
+        unsigned long long threaddone = 0;
+        double threadtet = 0.0, threadtet0 = 0.0;
+        tetmesh* threadmesh = mesh;
+        raytracer* threadtracer = tracer;
+        int t;
+
+#ifdef _OPENMP
+        unsigned int threadnum = omp_get_num_threads();
+#else
+        unsigned int threadnum = 1;
+#endif
+        double* share = (threadnum == (unsigned int)cfg->tunedthread) ? threadshare : NULL;
+
+        #pragma omp master
+        {
+            seeds = (unsigned int*)malloc(sizeof(int) * threadnum * RAND_SEED_WORD_LEN);
+            progress = (unsigned long long*)calloc(threadnum * MMC_PROGRESS_STRIDE, sizeof(unsigned long long));
+            srand(cfg->seed);
+
+            /*each MPI rank skips the seeds of the lower ranks to run unique random number streams*/
+            for (i = 0; i < cfg->mpirank * threadnum * RAND_SEED_WORD_LEN; i++) {
+                rand();
+            }
+
+            for (i = 0; i < threadnum * RAND_SEED_WORD_LEN; i++) {
+                seeds[i] = rand();
+            }
+
+            if (peer) {
+                #pragma omp atomic write
+                peer->isseeded = 1;
+            }
+
+            /*replicate the output per thread only if it fits in a quarter of the host memory*/
+            if (cfg->isatomic && cfg->isprivatebuf && threadnum > 1) {
+                if ((double)threadnum * buflen * sizeof(double) <= mcx_getsysmemory() * 0.25) {
+                    privweight = (double**)calloc(threadnum, sizeof(double*));
+                } else {
+                    MMCDEBUG(cfg, dlTime, (cfg->flog, "output is too large to be replicated per thread, use atomic operations\n"));
+                }
+            }
+
+            /*the atomic nodal output is accumulated at the tet corners, folded into the nodes after the run*/
+            if (cfg->iselemmoment && cfg->isatomic && privweight == NULL && threadnum > 1) {
+                elemweight = (double*)calloc(buflen / mesh->nn * mesh->ne * 4, sizeof(double));
+            }
+
+            if (cfg->issaveprofile) {
+                cfg->threadprof = (threadprofile*)realloc(cfg->threadprof, threadnum * sizeof(threadprofile));
+                cfg->profthread = threadnum;
+            }
+
+            /*the counters are kept per thread, in the mesh element order, and summed after the run*/
+            if (cfg->isheatmap) {
+                privheat = (unsigned int**)calloc(threadnum, sizeof(unsigned int*));
+                cfg->exportheatmap = (double*)realloc(cfg->exportheatmap, (size_t)mesh->ne * hmCounterNum * sizeof(double));
+                memset(cfg->exportheatmap, 0, (size_t)mesh->ne * hmCounterNum * sizeof(double));
+            }
+
+            if (cfg->isnuma) {
+                numacpu = (int*)malloc(sizeof(int) * MMC_NUMA_MAX_CPU);
+                numanum = mmc_numatopology(numacpu, numastart);
+
+                /*one mesh copy per node, unless the memory footprint is to be kept minimal*/
+                if (numanum > 1 && !cfg->isleanmem) {
+                    numamesh = (tetmesh*)calloc(numanum, sizeof(tetmesh));
+                    numatracer = (raytracer*)calloc(numanum, sizeof(raytracer));
+                }
+
+                MMCDEBUG(cfg, dlTime, (cfg->flog, "bind %u threads to %d NUMA node(s)%s\n", threadnum, numanum, numamesh ? ", one mesh copy per node" : ""));
+            }
+        }
+        #pragma omp barrier
+        visit.reclen = mcx_detreclen(cfg, mesh->prop);
+        visit.statlen = mcx_detstatlen(cfg, mesh->prop);
+        visitor_init(cfg, &visit);
+        visit.detbuf = (cfg->issavedet) ? &detbuf : NULL;
+
+#ifdef _OPENMP
+        threadid = omp_get_thread_num();
+#endif
+
+        rand_backend = cfg->rngtype;
+        rng_init(ran0, ran1, seeds, threadid);
+        mc_reset_scatter();
+        visit.weightpage = mesh->weightpage;
+        visit.elemweight = elemweight;
+
+        /*bind the thread before it first-touches its buffers; the first thread of each node copies the mesh for the node*/
+        if (cfg->tunedcpu && numanum == 0 && threadnum == (unsigned int)cfg->tunedthread) {
+            mcx_pinthread(cfg->tunedcpu[threadid]);
+        }
+
+        if (numanum > 0) {
+            int isleader, numaid = mmc_numabind(threadid, threadnum, numacpu, numastart, numanum, &isleader);
+
+            if (numamesh) {
+                if (isleader) {
+                    tracer_replicate(numatracer + numaid, numamesh + numaid, tracer);
+                }
+
+                threadmesh = numamesh + numaid;
+                threadtracer = numatracer + numaid;
+            }
+        }
+
+        if (cfg->isnuma) {
+            #pragma omp barrier
+        }
+
+        /*each thread allocates (and first-touches) its private output buffer*/
+        if (privweight) {
+            visit.weight = (double*)calloc(buflen, sizeof(double));
+            privweight[threadid] = visit.weight;
+        }
+
+        if (privheat) {
+            visit.heatmap = (unsigned int*)calloc((size_t)mesh->ne * hmCounterNum, sizeof(unsigned int));
+            privheat[threadid] = visit.heatmap;
+        }
+
+        /*the threads restore their states in the order they were saved*/
+        if (cfg->isresume) {
+            #pragma omp master
+            {
+                if ((int)threadnum != ckpt.threadnum) {
+                    MMC_ERROR(-10, "the checkpoint was saved by a simulation with a different thread number");
+                }
+            }
+            #pragma omp barrier
+
+            for (t = 0; t < (int)threadnum; t++) {
+                if (t == (int)threadid) {
+                    mmc_ckptthread(ckptfp, 1, cfg, &visit, ran0, ran1, &threadtet, &threadtet0);
+                }
+
+                #pragma omp barrier
+            }
+
+            #pragma omp master
+            {
+                if (conv.nquantity) {
+                    mmc_ckptio(&conv.nbatch, sizeof(int), 1, ckptfp, 1);
+                    mmc_ckptio(&conv.photon, sizeof(double), 1, ckptfp, 1);
+                    mmc_ckptio(conv.last, sizeof(double), conv.nquantity * 3, ckptfp, 1);
+                }
+
+                if (varlen) {
+                    mmc_ckptio(&nvarbatch, sizeof(int), 1, ckptfp, 1);
+                    mmc_ckptio(mesh->weightvar, sizeof(double), varlen, ckptfp, 1);
+                }
+
+                fclose(ckptfp);
+                ckptfp = NULL;
+            }
+            #pragma omp barrier
+        }
+
+        if (MMC_HASPROGRESS(cfg) && threadid == 0) {
+            mcx_reportprogress(cfg, -0.f);
+        }
+
+        /*launch the photons in one batch, or in batches of batchlen photons in the convergence-driven mode*/
+        for (batchstart = photonstart; batchstart < photonend; batchstart = batchend) {
+            batchend = MIN(mmc_batchend(cfg, batchstart, batchlen), photonend);
+
+            /*launch photons in packets or wavefronts, each keeps multiple photons in flight*/
+            if (cfg->method == rtBLBadouelPacket || cfg->iswavefront) {
+                size_t npacket = (batchend - batchstart + MMC_PACKET_CHUNK - 1) / MMC_PACKET_CHUNK;
+
+                #pragma omp for schedule(runtime) reduction(+:raytri,raytri0)
+
+                for (id = 0; id < npacket; id++) {
+                    size_t first = batchstart + id * MMC_PACKET_CHUNK;
+                    size_t count = MIN(MMC_PACKET_CHUNK, batchend - first);
+
+                    /*a cancelled run skips the remaining packets, the threads still meet at the end of the loop*/
+                    if (MMC_CANCELLED(cfg)) {
+                        continue;
+                    }
+
+                    visit.raytet = 0.f;
+                    visit.raytet0 = 0.f;
+
+                    if (cfg->iswavefront) {
+                        onewavefront(first, count, threadtracer, threadmesh, cfg, ran0, ran1, &visit);
+                    } else {
+                        onepacket(first, count, threadtracer, threadmesh, cfg, ran0, ran1, &visit);
+                    }
+
+                    raytri += visit.raytet;
+                    raytri0 += visit.raytet0;
+                    threadtet += visit.raytet;
+                    threadtet0 += visit.raytet0;
+                    mmc_flushdetected(cfg, mesh, &detbuf);
+
+                    threaddone += count;
+                    #pragma omp atomic write
+                    progress[threadid * MMC_PROGRESS_STRIDE] = threaddone;
+
+                    if (MMC_HASPROGRESS(cfg) && threadid == 0) {
+                        mcx_reportprogress(cfg, (float)(ncomplete + mmc_sumprogress(progress, threadnum)) / photonnum);
+                    }
+                }
+            } else {
+                /*with the photon shares of --autotune, slot t is the range of the photons of thread t*/
+                size_t slot, slotnum = (share) ? threadnum : batchend - batchstart;
+
+                /*launch photons*/
+                #pragma omp for schedule(runtime) reduction(+:raytri,raytri0)
+
+                for (slot = 0; slot < slotnum; slot++) {
+                    size_t idstart = batchstart + ((share) ? (size_t)(share[slot] * (batchend - batchstart)) : slot);
+                    size_t idend = (share) ? batchstart + (size_t)(share[slot + 1] * (batchend - batchstart)) : idstart + 1;
+
+                    for (id = idstart; id < idend; id++) {
+                        size_t pid = (cfg->incbatch) ? (size_t)cfg->incbatch[id / MMC_INC_BATCH] * MMC_INC_BATCH + id % MMC_INC_BATCH : id;
+
+                        if (pid >= cfg->nphoton) {
+                            continue;
+                        }
+
+                        if (MMC_CANCELLED(cfg)) {
+                            break;
+                        }
+
+                        visit.raytet = 0.f;
+                        visit.raytet0 = 0.f;
+
+                        if (id == cfg->debugphoton) {
+                            cfg->debuglevel = debuglevel;
+                        }
+
+                        if (cfg->seed == SEED_FROM_FILE) {
+                            onephoton(id, threadtracer, threadmesh, cfg, ((RandType*)cfg->photonseed) + id * RAND_BUF_LEN, ran1, &visit);
+                        } else {
+                            onephoton(pid, threadtracer, threadmesh, cfg, ran0, ran1, &visit);
+                        }
+
+                        raytri += visit.raytet;
+                        raytri0 += visit.raytet0;
+                        threadtet += visit.raytet;
+                        threadtet0 += visit.raytet0;
+
+                        if (id == cfg->debugphoton) {
+                            cfg->debuglevel &= 0xFFFFEA00;
+                        }
+
+                        mmc_flushdetected(cfg, mesh, &detbuf);
+
+                        threaddone++;
+                        #pragma omp atomic write
+                        progress[threadid * MMC_PROGRESS_STRIDE] = threaddone;
+
+                        if (MMC_HASPROGRESS(cfg) && threadid == 0 && threaddone % MMC_PROGRESS_STEP == 0) {
+                            mcx_reportprogress(cfg, (float)(ncomplete + mmc_sumprogress(progress, threadnum)) / photonnum);
+                        }
+                    }
+                }
+            }
+
+            /*at the end of a batch, the master adds up the monitored quantities of all threads and tests the convergence*/
+            if (conv.nquantity) {
+                visitor_foldweight(cfg, &visit);
+                #pragma omp master
+                memset(convtotal, 0, conv.nquantity * sizeof(double));
+                #pragma omp barrier
+                #pragma omp critical (mmc_convergence)
+                {
+                    for (j = 0; j < (unsigned int)convdet; j++) {
+                        convtotal[j] += visit.detweight[j];
+                    }
+
+                    for (j = 0; j < (unsigned int)convabs; j++) {
+                        convtotal[convdet + cfg->convroinum + j] += visit.absorbweight[j];
+                    }
+                }
+                #pragma omp barrier
+                #pragma omp master
+                {
+                    mmc_convroitotal(cfg, mesh, privweight, threadnum, roiidx, convtotal + convdet);
+                    mcx_convaddbatch(&conv, convtotal, (double)batchend);
+                    cfg->convrse = mcx_convrse(&conv);
+                    cfg->convphoton = batchend;
+                    isconverged = (cfg->convrse <= cfg->convtarget);
+                }
+                #pragma omp barrier
+            }
+
+            /*the output of the batch is added to the variance sums before a checkpoint saves them*/
+            if (varlen) {
+                mmc_varaddbatch(mesh, privweight, threadnum, varlast, varlen, (double)(batchend - batchstart));
+
+                #pragma omp master
+                nvarbatch++;
+            }
+
+            /*the master samples the cancel flag once, so that all threads leave the batch loop together*/
+            if (cfg->cancelflag) {
+                #pragma omp master
+                iscancelled = MMC_CANCELLED(cfg);
+                #pragma omp barrier
+            }
+
+            if (isconverged || iscancelled) {
+                break;
+            }
+
+            /*save a checkpoint: the master writes the output, then each thread its own state*/
+            if (isckpt && mmc_ischeckpoint(cfg, batchend)) {
+                #pragma omp master
+                {
+                    memcpy(ckpt.magic, MMC_CKPT_MAGIC, sizeof(ckpt.magic));
+                    ckpt.nphoton = cfg->nphoton;
+                    ckpt.done = batchend;
+                    ckpt.ncomplete = ncomplete + mmc_sumprogress(progress, threadnum);
+                    ckpt.buflen = buflen;
+                    ckpt.dreflen = dreflen;
+                    ckpt.raytri = raytri;
+                    ckpt.raytri0 = raytri0;
+                    ckpt.seed = cfg->seed;
+                    ckpt.threadnum = threadnum;
+                    ckpt.srcnum = cfg->srcnum;
+                    ckpt.reclen = reclen;
+                    ckpt.issaveseed = cfg->issaveseed;
+                    ckpt.nquantity = conv.nquantity;
+                    ckpt.varbatch = cfg->varbatch;
+                    ckpt.rngtype = cfg->rngtype;
+
+                    if ((ckptfp = fopen(ckpttmp, "wb")) == NULL) {
+                        MMC_ERROR(-10, "can not write the checkpoint file");
+                    }
+
+                    mmc_ckptio(&ckpt, sizeof(ckptheader), 1, ckptfp, 0);
+                    mmc_ckptoutput(ckptfp, 0, &ckpt, mesh, privweight);
+                    mmc_ckptdetected(ckptfp, 0, &detbuf);
+                }
+                #pragma omp barrier
+
+                for (t = 0; t < (int)threadnum; t++) {
+                    if (t == (int)threadid) {
+                        mmc_ckptthread(ckptfp, 0, cfg, &visit, ran0, ran1, &threadtet, &threadtet0);
+                    }
+
+                    #pragma omp barrier
+                }
+
+                #pragma omp master
+                {
+                    if (conv.nquantity) {
+                        mmc_ckptio(&conv.nbatch, sizeof(int), 1, ckptfp, 0);
+                        mmc_ckptio(&conv.photon, sizeof(double), 1, ckptfp, 0);
+                        mmc_ckptio(conv.last, sizeof(double), conv.nquantity * 3, ckptfp, 0);
+                    }
+
+                    if (varlen) {
+                        mmc_ckptio(&nvarbatch, sizeof(int), 1, ckptfp, 0);
+                        mmc_ckptio(mesh->weightvar, sizeof(double), varlen, ckptfp, 0);
+                    }
+
+                    /*replace the previous checkpoint only once the new one is complete*/
+                    if (fclose(ckptfp)) {
+                        MMC_ERROR(-10, "failed to write the checkpoint file");
+                    }
+
+                    ckptfp = NULL;
+#ifdef _WIN32
+                    remove(ckptname);
+#endif
+
+                    if (rename(ckpttmp, ckptname)) {
+                        MMC_ERROR(-10, "can not replace the checkpoint file");
+                    }
+
+                    MMCDEBUG(cfg, dlTime, (cfg->flog, "saved checkpoint %s at %zu photons\n", ckptname, batchend));
+                }
+                #pragma omp barrier
+            }
+        }
+
+        /*all threads have passed the implicit barrier of the photon loop*/
+        #pragma omp master
+        {
+            tsimend = GetTimeNanos();
+
+            /*the output of a cancelled run is normalized by the weight of the launched photons, only the photon count is updated*/
+            if (iscancelled) {
+                cfg->convphoton = ncomplete + mmc_sumprogress(progress, threadnum);
+            }
+        }
+
+        if (cfg->issaveprofile) {
+            threadprofile* tp = cfg->threadprof + threadid;
+
+            tp->nphoton = visit.nphoton;
+            tp->raytet = threadtet;
+            tp->raytet0 = threadtet0;
+            tp->nreflect = visit.nreflect;
+            tp->nroihit = visit.nroihit;
+            tp->ndetected = visit.ndetected;
+        }
+
+        /*merge the private output buffers using a pairwise tree reduction, split over all threads*/
+        if (privweight) {
+            size_t k;
+            unsigned int t, stride;
+
+            #pragma omp barrier
+            #pragma omp for
+
+            for (k = 0; k < buflen; k++) {
+                for (stride = 1; stride < threadnum; stride <<= 1) {
+                    for (t = 0; t + stride < threadnum; t += (stride << 1)) {
+                        privweight[t][k] += privweight[t + stride][k];
+                    }
+                }
+
+                mesh->weight[k] += privweight[0][k];
+            }
+
+            free(visit.weight);
+            visit.weight = NULL;
+        }
+
+        /*sum the heatmaps of all threads, one frame per counter in the input element order*/
+        if (privheat) {
+            int e, k;
+
+            #pragma omp barrier
+            #pragma omp for
+
+            for (e = 0; e < mesh->ne; e++) {
+                size_t row = (mesh->elemorder) ? (size_t)mesh->elemorder[e] : (size_t)e;
+
+                for (k = 0; k < hmCounterNum; k++) {
+                    double sum = 0.0;
+
+                    for (t = 0; t < (int)threadnum; t++) {
+                        sum += privheat[t][(size_t)e * hmCounterNum + k];
+                    }
+
+                    cfg->exportheatmap[(size_t)k * mesh->ne + row] = sum;
+                }
+            }
+
+            free(visit.heatmap);
+            visit.heatmap = NULL;
+        }
+
+        visitor_foldweight(cfg, &visit);
+
+        for (j = 0; j < cfg->srcnum; j++) {
+            #pragma omp atomic
+            master.launchweight[j] += visit.launchweight[j];
+            #pragma omp atomic
+            master.absorbweight[j] += visit.absorbweight[j];
+        }
+
+        for (j = 0; visit.dcsg1 && j < (unsigned int)cfg->detnum * (cfg->dcstaunum + 1); j++) {
+            #pragma omp atomic
+            master.dcsg1[j] += visit.dcsg1[j];
+        }
+
+        for (j = 0; visit.detstat && j < (unsigned int)cfg->detnum * visit.statlen; j++) {
+            #pragma omp atomic
+            master.detstat[j] += visit.detstat[j];
+        }
+
+        for (j = 0; visit.nee && j < (unsigned int)cfg->detnum * (cfg->maxgate + 1); j++) {
+            #pragma omp atomic
+            master.nee[j] += visit.nee[j];
+        }
+
+        for (j = 0; visit.camsignals && j < (unsigned int)(cfg->cam_image_width * cfg->cam_image_height + 2); j++) {
+            #pragma omp atomic
+            master.camsignals[j] += visit.camsignals[j];
+        }
+
+        if (visit.dcsg1 || visit.detstat) {
+            #pragma omp atomic
+            master.ndetected += visit.ndetected;
+        }
+
+        if (visit.trajlen) {
+            visitor_flushtraj(cfg, &visit);
+        }
+
+        visitor_clear(&visit);
+
+        if (visit.partialpath) {
+            free(visit.partialpath);
+        }
+
+        if (cfg->issaveseed && visit.photonseed) {
+            free(visit.photonseed);
+        }
+    }
+
+    /*the detected photons are already in one buffer, only the unstreamed records are copied out*/
+    if (cfg->issavedet) {
+        mmc_gatherdetbuffer(&detbuf, &master);
+        cfg->detectedcount = master.detcount;
+    }
+
+    mmc_cleardetbuffer(&detbuf);
+
+    if (elemweight) {
+        mesh_scatterelemweight(mesh, cfg, elemweight);
+        free(elemweight);
+    }
+
+    cfg->profile[ppSimulation] = tsimend - tphase;
+    cfg->profile[ppReduction] = GetTimeNanos() - tsimend;
+
+    if (conv.nquantity) {
+        MMCDEBUG(cfg, dlTime, (cfg->flog, "%s after %zu photons in %d batches, relative standard error %g (target %g)\n",
+                               isconverged ? "converged" : "did not converge", cfg->convphoton, conv.nbatch, cfg->convrse, cfg->convtarget));
+        free(convtotal);
+        free(roiidx);
+    }
+
+    mcx_convclear(&conv);
+
+    if (varlast) {
+        free(varlast);
+    }
+
+    if (seeds) {
+        free(seeds);
+    }
+
+    if (iscancelled) {
+        MMCDEBUG(cfg, dlTime, (cfg->flog, "cancelled after %zu of %zu photons\n", cfg->convphoton, (size_t)cfg->nphoton));
+    }
+
+    if (progress) {
+        free(progress);
+    }
+
+    if (numamesh) {
+        for (i = 0; i < (unsigned int)numanum; i++) {
+            tracer_clearreplica(numatracer + i);
+        }
+
+        free(numamesh);
+        free(numatracer);
+    }
+
+    if (numacpu) {
+        free(numacpu);
+    }
+
+    if (privweight) {
+        free(privweight);
+    }
+
+    if (privheat) {
+        free(privheat);
+    }
+
+#ifdef MMC_USE_MPI
+
+    /*rank 0 normalizes and saves the combined output of all ranks*/
+    if (cfg->mpisize > 1) {
+        mmc_mpi_reduce(cfg, mesh, &master, buflen, dreflen, reclen, &raytri, &raytri0);
+
+        if (varlen) {
+            double batchsum = nvarbatch;
+
+            mmc_mpi_sum(mesh->weightvar, varlen, cfg->mpirank);
+            mmc_mpi_sum(&batchsum, 1, cfg->mpirank);
+            nvarbatch = (int)batchsum;
+        }
+
+        if (cfg->mpirank > 0) {
+            free(master.partialpath);
+            free(master.photonseed);
+            master.partialpath = NULL;
+            visitor_clear(&master);
+            return 0;
+        }
+    }
+
+#endif
+
+    if (peer) {
+        mmc_hybridmerge(cfg, mesh, &master, peer, buflen, dreflen, reclen);
+    }
+
+    /** \subsection sreport Post simulation */
+
+    if (MMC_HASPROGRESS(cfg)) {
+        mcx_reportprogress(cfg, 1.f);
+    }
+
+    dt = GetTimeMillis() - dt;
+    MMCDEBUG(cfg, dlProgress, (cfg->flog, "\n"));
+    MMCDEBUG(cfg, dlTime, (cfg->flog, "\tdone\t%d\n", dt));
+    MMCDEBUG(cfg, dlTime, (cfg->flog, "speed ...\t"S_BOLD""S_BLUE"%.2f photon/ms"S_RESET", %.0f ray-tetrahedron tests (%.0f overhead, %.2f test/ms)\n", (double)cfg->convphoton / dt, raytri, raytri0, raytri / dt));
+
+    if (master.dcsg1 || master.detstat) {
+        MMC_FPRINTF(cfg->flog, "detected %llu photons, added to the sums of the detectors\n", master.ndetected);
+    } else if (cfg->issavedet) {
+        MMC_FPRINTF(cfg->flog, "detected %d photons\n", cfg->detectedcount + ((cfg->streamdet > 0) ? cfg->his.savedphoton : 0));
+    }
+
+    /*the pass with the cached media of the incremental mode is neither normalized nor saved*/
+    if (cfg->incpass && mmc_incmerge(cfg, mesh, &master, buflen, dreflen)) {
+        visitor_clear(&master);
+        return 0;
+    }
+
+    /*g1(tau) of each detector is normalized by its detected weight*/
+    if (master.dcsg1) {
+        cfg->exportdcs = (double*)realloc(cfg->exportdcs, sizeof(double) * cfg->detnum * cfg->dcstaunum);
+
+        for (i = 0; i < (unsigned int)cfg->detnum; i++) {
+            double* g1 = master.dcsg1 + (size_t)i * (cfg->dcstaunum + 1);
+
+            for (j = 0; j < (unsigned int)cfg->dcstaunum; j++) {
+                cfg->exportdcs[(size_t)i * cfg->dcstaunum + j] = (g1[cfg->dcstaunum] > 0.0) ? g1[j] / g1[cfg->dcstaunum] : 0.0;
+            }
+        }
+    }
+
+    if (master.detstat) {
+        mesh_normdetstat(mesh, cfg, master.detstat, (double)cfg->convphoton);
+    }
+
+    /*the next-event estimates are per launched photon, as the detected weights of --detstat*/
+    if (master.nee) {
+        cfg->exportnee = (double*)realloc(cfg->exportnee, sizeof(double) * cfg->detnum * (cfg->maxgate + 1));
+
+        for (j = 0; j < (unsigned int)cfg->detnum * (cfg->maxgate + 1); j++) {
+            cfg->exportnee[j] = master.nee[j] / cfg->convphoton;
+        }
+    }
+
+    /*the camera image is not normalized, same as the GPU output*/
+    if (master.camsignals) {
+        cfg->exportcamsignals = (float*)realloc(cfg->exportcamsignals, sizeof(float) * (cfg->cam_image_width * cfg->cam_image_height + 2));
+
+        for (j = 0; j < (unsigned int)(cfg->cam_image_width * cfg->cam_image_height + 2); j++) {
+            cfg->exportcamsignals[j] = (float)master.camsignals[j];
+        }
+    }
+
+    tphase = GetTimeNanos();
+    mesh_batchvariance(mesh, cfg, (double)cfg->convphoton, nvarbatch);
+
+    if (cfg->isnormalized) {
+        double cur_normalizer, sum_normalizer = 0;
+
+        for (j = 0; j < cfg->srcnum; j++) {
+            cur_normalizer = mesh_normalize(mesh, cfg, master.absorbweight[j], master.launchweight[j], j);
+            sum_normalizer += cur_normalizer;
+            MMCDEBUG(cfg, dlTime, (cfg->flog, "source %d\ttotal simulated energy: %f\tabsorbed: "S_BOLD""S_BLUE"%5.5f%%"S_RESET"\tnormalizor=%g\n",
+                                   j + 1, master.launchweight[j], 100.f * master.absorbweight[j] / master.launchweight[j], cur_normalizer));
+        }
+
+        cfg->his.normalizer = sum_normalizer / cfg->srcnum; // average normalizer value for all simulated sources
+    }
+
+    mesh_scalevariance(mesh, cfg);
+    cfg->profile[ppNormalize] = GetTimeNanos() - tphase;
+    tphase = GetTimeNanos();
+    mesh_restoreorder(mesh, cfg, master.partialpath, cfg->detectedcount, mcx_detreclen(cfg, mesh->prop));
+
+#ifndef MCX_CONTAINER
+
+    if (cfg->issave2pt && cfg->parentid == mpStandalone && cfg->ispipeline != 2) {
+        switch (cfg->outputtype) {
+            case otFlux:
+                MMCDEBUG(cfg, dlTime, (cfg->flog, "saving flux ..."));
+                break;
+
+            case otFluence:
+                MMCDEBUG(cfg, dlTime, (cfg->flog, "saving fluence ..."));
+                break;
+
+            case otEnergy:
+                MMCDEBUG(cfg, dlTime, (cfg->flog, "saving energy deposit ..."));
+                break;
+        }
+
+        mesh_saveweight(mesh, cfg, 0);
+
+        if (mesh->weightvar) {
+            MMCDEBUG(cfg, dlTime, (cfg->flog, "saving variance ..."));
+            mesh_savevariance(mesh, cfg);
+        }
+    }
+
+    if (cfg->exportdcs && cfg->parentid == mpStandalone) {
+        MMCDEBUG(cfg, dlTime, (cfg->flog, "saving g1(tau) ..."));
+        mesh_savedcs(cfg);
+    }
+
+    if (cfg->exportdetstat && cfg->parentid == mpStandalone) {
+        MMCDEBUG(cfg, dlTime, (cfg->flog, "saving detector statistics ..."));
+        mesh_savedetstat(mesh, cfg);
+    }
+
+    if (cfg->exportnee && cfg->parentid == mpStandalone) {
+        MMCDEBUG(cfg, dlTime, (cfg->flog, "saving next-event estimates ..."));
+        mesh_savenee(cfg);
+    }
+
+    if (cfg->exportcamsignals && cfg->parentid == mpStandalone) {
+        MMCDEBUG(cfg, dlTime, (cfg->flog, "saving camera image ..."));
+        mcx_savecamsignals(cfg->exportcamsignals, cfg->cam_image_width * cfg->cam_image_height + 2, cfg);
+    }
+
+    if (cfg->isheatmap && cfg->exportheatmap && cfg->parentid == mpStandalone) {
+        MMCDEBUG(cfg, dlTime, (cfg->flog, "saving the per-element heatmap ..."));
+        mesh_saveheatmap(mesh, cfg);
+    }
+
+#endif
+
+    if (cfg->exportdetected == NULL) {
+        cfg->exportdetected = master.partialpath;
+    }
+
+    if (cfg->issaveseed && master.photonseed) {
+        cfg->exportseed = (unsigned char*)malloc(cfg->detectedcount * sizeof(RandType) * RAND_BUF_LEN);
+        memcpy(cfg->exportseed, master.photonseed, cfg->detectedcount * sizeof(RandType)*RAND_BUF_LEN);
+        free(master.photonseed);
+    }
+
+    if (cfg->issavedet && cfg->parentid == mpStandalone) {
+        MMCDEBUG(cfg, dlTime, (cfg->flog, "saving detected photons ..."));
+
+#ifndef MCX_CONTAINER
+
+        if (cfg->streamdet > 0) {
+            mesh_appenddetphoton(cfg->exportdetected, cfg->detectedcount, mcx_detreclen(cfg, mesh->prop), cfg);
+        } else if (cfg->issaveexit) {
+            cfg->his.totalphoton = cfg->nphoton;
+            cfg->his.savedphoton = cfg->detectedcount;
+            cfg->his.detected = cfg->detectedcount;
+            cfg->his.colcount = mcx_detreclen(cfg, mesh->prop);
+            cfg->his.savedetflag = cfg->savedetflag;
+            mesh_savedetphoton(cfg->exportdetected, (void*)(cfg->exportseed), cfg->detectedcount, (sizeof(RandType)*RAND_BUF_LEN), cfg);
+        }
+
+#endif
+
+        if (cfg->issaveexit == 2) {
+            float* detimage = (float*)calloc(cfg->detparam1.w * cfg->detparam2.w * cfg->maxgate, sizeof(float));
+            mesh_getdetimage(detimage, cfg->exportdetected, cfg->detectedcount, cfg, mesh);
+#ifndef MCX_CONTAINER
+            mesh_savedetimage(detimage, cfg);
+#endif
+            free(detimage);
+        }
+    }
+
+    if (cfg->debuglevel & dlTraj) {
+        if (cfg->exportdebugdata && cfg->debugdatalen > cfg->maxjumpdebug) {
+            MMC_FPRINTF(cfg->flog, S_RED "WARNING: the saved trajectory positions (%d) \
+  are more than what your have specified (%d), please use the --maxjumpdebug option to specify a greater number\n" S_RESET
+                        , cfg->debugdatalen, cfg->maxjumpdebug);
+            cfg->debugdatalen = cfg->maxjumpdebug;
+        } else {
+            MMC_FPRINTF(cfg->flog, "saved %u trajectory positions, total: %d\t", cfg->debugdatalen, cfg->debugdatalen);
+        }
+    }
+
+#ifndef MCX_CONTAINER
+
+    if (cfg->issaveref && cfg->parentid == mpStandalone && cfg->ispipeline != 2) {
+        MMCDEBUG(cfg, dlTime, (cfg->flog, "saving surface diffuse reflectance ..."));
+        mesh_saveweight(mesh, cfg, 1);
+    }
+
+    if ((cfg->debuglevel & dlTraj) && cfg->exportdebugdata == NULL) {
+        mesh_appendtrajectory(NULL, 0, cfg);  // creates an empty .mct file if no position was streamed
+    } else if ((cfg->debuglevel & dlTraj) && cfg->parentid == mpStandalone) {
+        cfg->his.colcount = MCX_DEBUG_REC_LEN;
+        cfg->his.savedphoton = cfg->debugdatalen;
+        cfg->his.totalphoton = cfg->nphoton;
+        cfg->his.detected = 0;  // this flag tells mcx_savedetphoton that the data is trajectory
+        mesh_savedetphoton(cfg->exportdebugdata, NULL, cfg->debugdatalen, 0, cfg);
+    }
+
+    if (cfg->shmname[0] && cfg->parentid == mpStandalone) {
+        MMCDEBUG(cfg, dlTime, (cfg->flog, "saving outputs to shared memory ..."));
+        mesh_saveshm(mesh, cfg, mcx_detreclen(cfg, mesh->prop));
+    }
+
+#endif
+
+    cfg->profile[ppSave] = GetTimeNanos() - tphase;
+    MMCDEBUG(cfg, dlTime, (cfg->flog, "\tdone\t%d\n", GetTimeMillis() - t0));
+    visitor_clear(&master);
+
+    return 0;
+}
+
+#ifdef MMC_USE_MPI
+
+#define MMC_DOMAIN_BATCH  (1 << 14)       /**< photons launched by the rank holding the source in each round of --domain */
+#define MMC_DOMAIN_ALIGN  16              /**< byte alignment of the records of the migrating photons */
+
+/**
+ * \struct MMC_domainqueue mmc_host.c
+ * \brief The photons migrating between the partitions in one round of --domain, see mmc_run_domain
+ *
+ * Each record holds the photon state, with r.eid converted to the global
+ * element ID (from 0) while in transit, followed by its partial path and,
+ * with --saveseed, its launch seed.
+ */
+
+typedef struct MMC_domainqueue {
+    char* buf;                    /**< the records of the photons */
+    size_t recsize;               /**< byte length of each record, a multiple of MMC_DOMAIN_ALIGN */
+    size_t pathbyte;              /**< byte length of the partial path in each record */
+    size_t seedbyte;              /**< byte length of the seed in each record, 0 if not saved */
+    int len;                      /**< number of records */
+    int cap;                      /**< capacity of buf in records */
+} domainqueue;
+
+/**
+ * \brief Sum a value over all MPI ranks, used as meshpart::sumparts
+ */
+
+static double mmc_mpi_allsum(double val) {
+    MPI_Allreduce(MPI_IN_PLACE, &val, 1, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+    return val;
+}
+
+/**
+ * \brief Append a photon entering a ghost element to the outgoing queue
+ *
+ * \param[in,out] q: the outgoing queue, shared by all threads
+ * \param[in] ph: the photon, stopped in a ghost element by photon_propagate()
+ * \param[in] part: the partition of this rank
+ */
+
+static void mmc_domainpush(domainqueue* q, photonstate* ph, meshpart* part) {
+    #pragma omp critical (mmc_domainqueue)
+    {
+        char* rec;
+
+        if (q->len >= q->cap) {
+            q->cap = MAX(q->cap * 2, 1024);
+            q->buf = (char*)realloc(q->buf, (size_t)q->cap * q->recsize);
+
+            if (q->buf == NULL) {
+                MMC_ERROR(-4, "can not allocate the buffer of the migrating photons");
+            }
+        }
+
+        rec = q->buf + (size_t)(q->len++) * q->recsize;
+        memcpy(rec, ph, sizeof(photonstate));
+        ((photonstate*)rec)->r.eid = mesh_partglobal(part, ph->r.eid);
+        memcpy(rec + sizeof(photonstate), ph->r.partialpath, q->pathbyte);
+        memcpy(rec + sizeof(photonstate) + q->pathbyte, ph->r.photonseed, q->seedbyte);
+    }
+}
+
+/**
+ * \brief Resume a photon received from another rank, in place in its record
+ *
+ * The element ID is converted to the local ID, and the pointers to the
+ * partial path and the seed are set to the copies in the record. The
+ * references to the elements of the sending rank (the previous element, the
+ * pending neighbor and deposit row) are reset; they are all set again before
+ * their next use, and the pending deposit is always flushed when a photon
+ * crosses a face.
+ *
+ * \param[in,out] q: the incoming queue
+ * \param[in] idx: the index of the record
+ * \param[in] part: the partition of this rank
+ * \return the photon ready for photon_propagate()
+ */
+
+static photonstate* mmc_domainpop(domainqueue* q, int idx, meshpart* part) {
+    char* rec = q->buf + (size_t)idx * q->recsize;
+    photonstate* ph = (photonstate*)rec;
+
+    ph->r.eid = mesh_partlocal(part, ph->r.eid);
+    ph->r.partialpath = (float*)(rec + sizeof(photonstate));
+    ph->r.photonseed = (q->seedbyte) ? rec + sizeof(photonstate) + q->pathbyte : NULL;
+    ph->r.nexteid = 0;
+    ph->r.oldidx = 0xFFFFFFFF;
+    ph->oldeid = 0;
+    ph->heatmap = NULL;
+
+    if (ph->r.eid <= 0 || ph->r.eid > part->nown) {
+        MMC_ERROR(-6, "received a photon outside of the partition of this rank");
+    }
+
+    return ph;
+}
+
+/**
+ * \brief Hand the outgoing photons over to the ranks holding their elements
+ *
+ * The records are sorted by the destination rank, then exchanged by one
+ * all-to-all transfer, which replaces the content of the incoming queue.
+ *
+ * \param[in,out] out: the outgoing queue, emptied
+ * \param[in,out] in: the incoming queue, receives the photons sent to this rank
+ * \param[in] part: the partition of this rank
+ * \param[in] rectype: the MPI type of one record
+ * \return the total number of photons exchanged by all ranks
+ */
+
+static long long mmc_domainexchange(domainqueue* out, domainqueue* in, meshpart* part, MPI_Datatype rectype) {
+    int i, size = part->ranknum;
+    int* counts = (int*)calloc(size * 5, sizeof(int));
+    int* sdispl = counts + size, *fill = counts + 2 * size, *rcounts = counts + 3 * size, *rdispl = counts + 4 * size;
+    char* sorted = (char*)malloc((size_t)MAX(out->len, 1) * out->recsize);
+    long long total = out->len;
+
+    for (i = 0; i < out->len; i++) {
+        counts[mesh_partowner(part, ((photonstate*)(out->buf + (size_t)i * out->recsize))->r.eid)]++;
+    }
+
+    for (i = 1; i < size; i++) {
+        sdispl[i] = sdispl[i - 1] + counts[i - 1];
+    }
+
+    for (i = 0; i < out->len; i++) {
+        char* rec = out->buf + (size_t)i * out->recsize;
+        int dest = mesh_partowner(part, ((photonstate*)rec)->r.eid);
+
+        memcpy(sorted + (size_t)(sdispl[dest] + fill[dest]++) * out->recsize, rec, out->recsize);
+    }
+
+    MPI_Alltoall(counts, 1, MPI_INT, rcounts, 1, MPI_INT, MPI_COMM_WORLD);
+
+    for (i = 1; i < size; i++) {
+        rdispl[i] = rdispl[i - 1] + rcounts[i - 1];
+    }
+
+    in->len = rdispl[size - 1] + rcounts[size - 1];
+
+    if (in->len > in->cap) {
+        in->cap = in->len;
+        in->buf = (char*)realloc(in->buf, (size_t)in->cap * in->recsize);
+
+        if (in->buf == NULL) {
+            MMC_ERROR(-4, "can not allocate the buffer of the migrating photons");
+        }
+    }
+
+    MPI_Alltoallv(sorted, counts, sdispl, rectype, in->buf, rcounts, rdispl, rectype, MPI_COMM_WORLD);
+    MPI_Allreduce(MPI_IN_PLACE, &total, 1, MPI_LONG_LONG, MPI_SUM, MPI_COMM_WORLD);
+
+    out->len = 0;
+    free(sorted);
+    free(counts);
+    return total;
+}
+
+/**
+ * \brief Gather the normalized output of all partitions on rank 0
+ *
+ * The elemental output of each rank is a contiguous range of the rows of the
+ * reordered mesh; the nodal output of the nodes shared by several partitions
+ * is added up.
+ *
+ * \param[in] cfg: the simulation configuration structure
+ * \param[in] mesh: the partition of this rank
+ * \return the output of the whole mesh in the reordered numbering on rank 0, NULL on the other ranks
+ */
+
+static double* mmc_domaingather(mcconfig* cfg, tetmesh* mesh) {
+    meshpart* part = mesh->part;
+    size_t datalen = (cfg->basisorder) ? (size_t)mesh->nn : (size_t)mesh->ne, alllen = (cfg->basisorder) ? (size_t)part->nn : (size_t)part->ne;
+    int i, f, k, total = 0, *counts = NULL, *displs = NULL, *nodes = NULL, srcnum = cfg->srcnum;
+    double* all = NULL, *buf = NULL;
+
+    if (cfg->mpirank == 0) {
+        all = (double*)calloc(alllen * srcnum * cfg->maxgate, sizeof(double));
+        counts = (int*)malloc(sizeof(int) * cfg->mpisize);
+        displs = (int*)malloc(sizeof(int) * cfg->mpisize);
+    }
+
+    if (cfg->basisorder == 0) {
+        for (i = 0; cfg->mpirank == 0 && i < cfg->mpisize; i++) {
+            counts[i] = (part->elemstart[i + 1] - part->elemstart[i]) * srcnum;
+            displs[i] = part->elemstart[i] * srcnum;
+        }
+
+        for (f = 0; f < cfg->maxgate; f++) {
+            MPI_Gatherv(mesh->weight + f * datalen * srcnum, part->nown * srcnum, MPI_DOUBLE,
+                        (all) ? all + f * alllen * srcnum : NULL, counts, displs, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+        }
+    } else {
+        /*the nodes of each partition are listed once, then the frames are added to the whole mesh*/
+        MPI_Gather(&mesh->nn, 1, MPI_INT, counts, 1, MPI_INT, 0, MPI_COMM_WORLD);
+
+        for (i = 0; cfg->mpirank == 0 && i < cfg->mpisize; i++) {
+            displs[i] = total;
+            total += counts[i];
+        }
+
+        if (cfg->mpirank == 0) {
+            nodes = (int*)malloc(sizeof(int) * MAX(total, 1));
+            buf = (double*)malloc(sizeof(double) * MAX(total, 1) * srcnum);
+        }
+
+        MPI_Gatherv(part->nodeglobal, mesh->nn, MPI_INT, nodes, counts, displs, MPI_INT, 0, MPI_COMM_WORLD);
+
+        for (i = 0; cfg->mpirank == 0 && i < cfg->mpisize; i++) {
+            counts[i] *= srcnum;
+            displs[i] *= srcnum;
+        }
+
+        for (f = 0; f < cfg->maxgate; f++) {
+            MPI_Gatherv(mesh->weight + f * datalen * srcnum, mesh->nn * srcnum, MPI_DOUBLE, buf, counts, displs, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+
+            for (i = 0; cfg->mpirank == 0 && i < total; i++)
+                for (k = 0; k < srcnum; k++) {
+                    all[(f * alllen + nodes[i]) * srcnum + k] += buf[(size_t)i * srcnum + k];
+                }
+        }
+
+        free(nodes);
+        free(buf);
+    }
+
+    free(counts);
+    free(displs);
+    return all;
+}
+
+/**
+ * \brief Run a domain-decomposed simulation, each MPI rank tracing the photons in its partition (--domain)
+ *
+ * After mesh_partition(), each rank only holds a contiguous range of the
+ * reordered elements and their ghost elements. The simulation runs in
+ * rounds: the rank holding the source launches the next MMC_DOMAIN_BATCH
+ * photons, and all ranks propagate their photons, including those received
+ * in the previous round, until they terminate or enter a ghost element. The
+ * photons entering a ghost element are then sent, in one batch per rank pair,
+ * to the rank holding it, until no photon is left. With the counter-based
+ * RNG of --rng philox, a photon carries its own random number stream, so the
+ * result matches that of a run without --domain up to the rounding of sums.
+ *
+ * The outputs are normalized by each rank with the energies summed over all
+ * ranks, then gathered and saved by rank 0, which restores the input order.
+ *
+ * \param[in,out] cfg: the simulation configuration structure
+ * \param[in,out] mesh: the partition of this rank
+ * \param[in] tracer: the ray-tracer built for the partition
+ */
+
+static int mmc_run_domain(mcconfig* cfg, tetmesh* mesh, raytracer* tracer) {
+    RandType ran0[RAND_BUF_LEN] __attribute__ ((aligned(16)));
+    RandType ran1[RAND_BUF_LEN] __attribute__ ((aligned(16)));
+    meshpart* part = mesh->part;
+    visitor master = {0.f, 0.f, 0.f, 0, 0, 0, NULL, NULL, NULL, NULL, NULL, NULL, 0, NULL, NULL, 0, NULL};
+    float raytri = 0.f, raytri0 = 0.f;
+    unsigned int i, threadid = 0, t0, dt;
+    unsigned int* seeds = NULL;
+    unsigned long long tphase, tsimend = 0;
+    int reclen = mcx_detreclen(cfg, mesh->prop);
+    size_t dreflen = (cfg->issaveref && mesh->dref) ? (size_t)mesh->nf * cfg->srcnum * cfg->maxgate : 0;
+    size_t launched = 0, photonnum = (cfg->e0 > 0) ? cfg->nphoton : 0;
+    long long pending = 1;
+    int ne = mesh->ne, nn = mesh->nn;
+    double* all;
+    domainqueue out, in;
+    detbuffer detbuf;
+    MPI_Datatype rectype;
+
+    memset(&out, 0, sizeof(domainqueue));
+    out.pathbyte = (reclen > 1) ? (reclen - 1) * sizeof(float) : 0;
+    out.seedbyte = (cfg->issavedet && cfg->issaveseed) ? sizeof(RandType) * RAND_BUF_LEN : 0;
+    out.recsize = (sizeof(photonstate) + out.pathbyte + out.seedbyte + MMC_DOMAIN_ALIGN - 1) / MMC_DOMAIN_ALIGN * MMC_DOMAIN_ALIGN;
+    in = out;
+
+    MPI_Type_contiguous((int)out.recsize, MPI_BYTE, &rectype);
+    MPI_Type_commit(&rectype);
+
+    master.statlen = mcx_detstatlen(cfg, mesh->prop);
+    visitor_init(cfg, &master);
+    mmc_initdetbuffer(&detbuf, cfg, reclen, cfg->nphoton);
+
+    t0 = StartTimer();
+
+    if (cfg->mpirank == 0) {
+        mcx_printheader(cfg);
+    }
+
+    dt = GetTimeMillis();
+    tphase = GetTimeNanos();
+    MMCDEBUG(cfg, dlTime, (cfg->flog, "seed=%u\nsimulating ... \n", cfg->seed));
+
+    #pragma omp parallel private(ran0,ran1,threadid,i)
+    {
+        visitor visit = {0.f, 0.f, 1.f / cfg->tstep, 0, 0, 0, NULL, NULL, NULL, NULL, NULL, NULL, 0, NULL, NULL, 0, NULL};
+        size_t id, launchend;
+        int k;
+
+#ifdef _OPENMP
+        unsigned int threadnum = omp_get_num_threads();
+        threadid = omp_get_thread_num();
+#else
+        unsigned int threadnum = 1;
+#endif
+
+        /*all ranks share the seeds of a single-process run, the photons keep their streams when migrating*/
+        #pragma omp master
+        {
+            seeds = (unsigned int*)malloc(sizeof(int) * threadnum * RAND_SEED_WORD_LEN);
+            srand(cfg->seed);
+
+            for (i = 0; i < threadnum * RAND_SEED_WORD_LEN; i++) {
+                seeds[i] = rand();
+            }
+        }
+        #pragma omp barrier
+        visit.reclen = reclen;
+        visit.statlen = mcx_detstatlen(cfg, mesh->prop);
+        visitor_init(cfg, &visit);
+        visit.detbuf = (cfg->issavedet) ? &detbuf : NULL;
+
+        rand_backend = cfg->rngtype;
+        rng_init(ran0, ran1, seeds, threadid);
+        mc_reset_scatter();
+
+        while (pending > 0) {
+            launchend = MIN(launched + MMC_DOMAIN_BATCH, photonnum);
+
+            #pragma omp for schedule(dynamic, 64) reduction(+:raytri,raytri0)
+
+            for (id = launched; id < launchend; id++) {
+                photonstate ph;
+
+                visit.raytet = 0.f;
+                visit.raytet0 = 0.f;
+                photon_launch(&ph, id, 0, tracer, mesh, cfg, ran0, ran1, &visit);
+
+                if (photon_propagate(&ph, part->nown, tracer, mesh, cfg, ran0, ran1, &visit)) {
+                    mmc_domainpush(&out, &ph, part);
+                }
+
+                raytri += visit.raytet;
+                raytri0 += visit.raytet0;
+            }
+
+            #pragma omp for schedule(dynamic, 16) reduction(+:raytri,raytri0)
+
+            for (k = 0; k < in.len; k++) {
+                photonstate* ph = mmc_domainpop(&in, k, part);
+
+                visit.raytet = 0.f;
+                visit.raytet0 = 0.f;
+
+                if (photon_propagate(ph, part->nown, tracer, mesh, cfg, ran0, ran1, &visit)) {
+                    mmc_domainpush(&out, ph, part);
+                }
+
+                /*a rank without the source launches no photon, the received photons fold the float sums instead*/
+                if (++visit.blockcount >= MMC_WEIGHT_BLOCK) {
+                    visitor_foldweight(cfg, &visit);
+                }
+
+                raytri += visit.raytet;
+                raytri0 += visit.raytet0;
+            }
+
+            /*the round ends when no photon is left to launch or to hand over on any rank*/
+            #pragma omp master
+            {
+                launched = launchend;
+                pending = mmc_domainexchange(&out, &in, part, rectype);
+                pending += (long long)mmc_mpi_allsum((double)(photonnum - launched));
+            }
+            #pragma omp barrier
+        }
+
+        #pragma omp master
+        tsimend = GetTimeNanos();
+
+        visitor_foldweight(cfg, &visit);
+
+        for (i = 0; i < cfg->srcnum; i++) {
+            #pragma omp atomic
+            master.launchweight[i] += visit.launchweight[i];
+            #pragma omp atomic
+            master.absorbweight[i] += visit.absorbweight[i];
+        }
+
+        visitor_clear(&visit);
+    }
+
+    if (cfg->issavedet) {
+        mmc_gatherdetbuffer(&detbuf, &master);
+        cfg->detectedcount = master.detcount;
+    }
+
+    mmc_cleardetbuffer(&detbuf);
+    free(seeds);
+    free(out.buf);
+    free(in.buf);
+    MPI_Type_free(&rectype);
+
+    cfg->profile[ppSimulation] = tsimend - tphase;
+    tphase = GetTimeNanos();
+
+    /*each rank normalizes its partition by the energies of the whole run, then rank 0 assembles the output*/
+    if (cfg->isnormalized) {
+        double cur_normalizer, sum_normalizer = 0;
+
+        part->sumparts = mmc_mpi_allsum;
+
+        for (i = 0; i < cfg->srcnum; i++) {
+            double launchweight = mmc_mpi_allsum(master.launchweight[i]), absorbweight = mmc_mpi_allsum(master.absorbweight[i]);
+
+            cur_normalizer = mesh_normalize(mesh, cfg, absorbweight, launchweight, i);
+            sum_normalizer += cur_normalizer;
+            MMCDEBUG(cfg, dlTime, (cfg->flog, "source %d\ttotal simulated energy: %f\tabsorbed: "S_BOLD""S_BLUE"%5.5f%%"S_RESET"\tnormalizor=%g\n",
+                                   i + 1, launchweight, 100.f * absorbweight / launchweight, cur_normalizer));
+        }
+
+        part->sumparts = NULL;
+        cfg->his.normalizer = sum_normalizer / cfg->srcnum;
+    }
+
+    cfg->profile[ppNormalize] = GetTimeNanos() - tphase;
+    tphase = GetTimeNanos();
+
+    mmc_mpi_reduce(cfg, mesh, &master, 0, dreflen, reclen, &raytri, &raytri0);
+
+    all = mmc_domaingather(cfg, mesh);
+
+    if (cfg->mpirank == 0) {
+        free(mesh->weight);
+        mesh->weight = all;
+    }
+
+    cfg->profile[ppReduction] = GetTimeNanos() - tphase;
+
+    if (cfg->mpirank > 0) {
+        free(master.partialpath);
+        free(master.photonseed);
+        master.partialpath = NULL;
+        master.photonseed = NULL;
+        visitor_clear(&master);
+        return 0;
+    }
+
+    dt = GetTimeMillis() - dt;
+    MMCDEBUG(cfg, dlTime, (cfg->flog, "\tdone\t%d\n", dt));
+    MMCDEBUG(cfg, dlTime, (cfg->flog, "speed ...\t"S_BOLD""S_BLUE"%.2f photon/ms"S_RESET", %.0f ray-tetrahedron tests (%.0f overhead, %.2f test/ms)\n", (double)cfg->nphoton / dt, raytri, raytri0, raytri / dt));
+
+    if (cfg->issavedet) {
+        MMC_FPRINTF(cfg->flog, "detected %d photons\n", cfg->detectedcount);
+    }
+
+    /*rank 0 saves the output of the whole mesh, its partition is restored after saving*/
+    tphase = GetTimeNanos();
+
+    mesh->ne = part->ne;
+    mesh->nn = part->nn;
+    mesh->elemorder = part->elemorder;
+    mesh->nodeorder = part->nodeorder;
+
+    mesh_restoreorder(mesh, cfg, master.partialpath, cfg->detectedcount, reclen);
+
+#ifndef MCX_CONTAINER
+
+    if (cfg->issave2pt && cfg->parentid == mpStandalone) {
+        MMCDEBUG(cfg, dlTime, (cfg->flog, "saving %s ...", (cfg->outputtype == otFlux) ? "flux" : ((cfg->outputtype == otFluence) ? "fluence" : "energy deposit")));
+        mesh_saveweight(mesh, cfg, 0);
+    }
+
+    if (cfg->issaveref && cfg->parentid == mpStandalone) {
+        MMCDEBUG(cfg, dlTime, (cfg->flog, "saving surface diffuse reflectance ..."));
+        mesh_saveweight(mesh, cfg, 1);
+    }
+
+#endif
+
+    mesh->elemorder = NULL;
+    mesh->nodeorder = NULL;
+    mesh->ne = ne;
+    mesh->nn = nn;
+
+    if (cfg->exportdetected == NULL) {
+        cfg->exportdetected = master.partialpath;
+    }
+
+    if (cfg->issaveseed && master.photonseed) {
+        cfg->exportseed = (unsigned char*)malloc(cfg->detectedcount * sizeof(RandType) * RAND_BUF_LEN);
+        memcpy(cfg->exportseed, master.photonseed, cfg->detectedcount * sizeof(RandType)*RAND_BUF_LEN);
+        free(master.photonseed);
+    }
+
+#ifndef MCX_CONTAINER
+
+    if (cfg->issavedet && cfg->issaveexit && cfg->parentid == mpStandalone) {
+        MMCDEBUG(cfg, dlTime, (cfg->flog, "saving detected photons ..."));
+        cfg->his.totalphoton = cfg->nphoton;
+        cfg->his.savedphoton = cfg->detectedcount;
+        cfg->his.detected = cfg->detectedcount;
+        cfg->his.colcount = reclen;
+        cfg->his.savedetflag = cfg->savedetflag;
+        mesh_savedetphoton(cfg->exportdetected, (void*)(cfg->exportseed), cfg->detectedcount, (sizeof(RandType)*RAND_BUF_LEN), cfg);
+    }
+
+#endif
+
+    cfg->profile[ppSave] = GetTimeNanos() - tphase;
+    MMCDEBUG(cfg, dlTime, (cfg->flog, "\tdone\t%d\n", GetTimeMillis() - t0));
+    visitor_clear(&master);
+
+    return 0;
+}
+
+#endif
+
+#define MMC_CPUTUNE_PHOTON  100000         /**< photons of each calibration run of --autotune on the CPU, at most -n */
+#define MMC_CPUTUNE_MAX_CPU 4096           /**< maximum number of CPUs considered by --autotune */
+
+/**
+ * \brief Run a short CPU simulation at the given thread placement, see mmc_cpu_autotune
+ *
+ * The run is a copy of the configuration with its own output buffers, so that
+ * it leaves the outputs of cfg and mesh untouched; its log goes to a temporary
+ * file.
+ *
+ * \param[in] cfg: the simulation configuration
+ * \param[in] mesh: the mesh
+ * \param[in] tracer: the ray-tracer
+ * \param[in] nphoton: the photon number of the run
+ * \param[in] threadnum: the thread number
+ * \param[in] cpus: the CPU of each thread
+ * \param[in] share: the photon share before each thread, threadnum+1 entries, NULL for an even split
+ * \return the photon throughput in photon/ms
+ */
+
+static double mmc_cpu_trialrun(mcconfig* cfg, tetmesh* mesh, raytracer* tracer, size_t nphoton, int threadnum, int* cpus, double* share) {
+    mcconfig trial = *cfg;
+    tetmesh trialmesh = *mesh;
+    raytracer trialtracer = *tracer;
+    size_t datalen = (size_t)((cfg->method == rtBLBadouelGrid) ? cfg->crop0.z : ( (cfg->basisorder) ? mesh->nn : MESH_ELEMOUT(mesh)));
+    size_t buflen = datalen * cfg->srcnum * (cfg->maxgate * cfg->replaydetnum * cfg->wavenum + 2 * cfg->freqnum) + ((mesh->outmap) ? cfg->srcnum : 0);
+    unsigned int wall;
+
+    trial.nphoton = nphoton;
+    trial.tunedthread = threadnum;
+    trial.tunedcpu = cpus;
+    trial.tunedshare = share;
+    trial.parentid = mpMATLAB;
+    trial.isnormalized = 0;
+    trial.debuglevel &= ~(dlProgress | dlTraj);
+    trial.progressfun = NULL;
+    trial.cancelflag = NULL;
+    trial.issaveprofile = 0;
+    trial.isheatmap = 0;
+    trial.isnuma = 0;
+    trial.varbatch = 0;
+    trial.convtarget = 0.f;
+    trial.ckptperiod = 0;
+    trial.checkpt[0] = 0;
+    trial.streamdet = 0;
+    trial.shmname[0] = '\0';
+    trial.exportdetected = NULL;
+    trial.exportseed = NULL;
+    trial.exportdebugdata = NULL;
+    trial.exportdcs = NULL;
+    trial.exportdetstat = NULL;
+    trial.exportnee = NULL;
+    trial.exportcamsignals = NULL;
+    trial.exportheatmap = NULL;
+    trial.threadprof = NULL;
+    trialmesh.weight = (double*)calloc(buflen, sizeof(double));
+    trialmesh.dref = (mesh->dref) ? (double*)calloc((size_t)mesh->nf * cfg->srcnum * cfg->maxgate, sizeof(double)) : NULL;
+    trialmesh.weightvar = NULL;
+    trialtracer.mesh = &trialmesh; /*the ray-tracer deposits through its mesh pointer*/
+
+    if ((trial.flog = tmpfile()) == NULL) {
+        trial.flog = cfg->flog;
+    }
+
+    wall = GetTimeMillis();
+    mmc_run_share(&trial, &trialmesh, &trialtracer, NULL);
+    wall = GetTimeMillis() - wall;
+
+    if (trial.flog != cfg->flog) {
+        fclose(trial.flog);
+    }
+
+    free(trial.exportdetected);
+    free(trial.exportseed);
+    free(trial.exportdcs);
+    free(trial.exportdetstat);
+    free(trial.exportnee);
+    free(trial.exportcamsignals);
+    free(trialmesh.weight);
+    free(trialmesh.dref);
+
+    return nphoton / (double)MAX(wall, 1);
+}
+
+/**
+ * \brief Place n threads on the first n CPUs of the tuning order and weight their photon shares
+ *
+ * \param[in] n: the thread number
+ * \param[in] topo: the CPU index, core key and core type of each CPU, and the tuning order, see mmc_cpu_autotune
+ * \param[in] ncpu: the number of CPUs
+ * \param[in] typerate: the single-thread throughput of each core type, NULL for equal weights
+ * \param[out] tunedcpu: the CPU of each thread
+ * \param[out] weight: the relative photon share of each thread
+ */
+
+static void mmc_cpu_placement(int n, int* topo, int ncpu, double* typerate, int* tunedcpu, double* weight) {
+    int* cpus = topo, *coreid = topo + ncpu, *typeid = topo + 2 * ncpu, *order = topo + 3 * ncpu;
+    int i, k, sibling;
+
+    for (i = 0; i < n; i++) {
+        tunedcpu[i] = cpus[order[i]];
+
+        /*a thread shares the speed of its core with the SMT siblings in use*/
+        for (k = 0, sibling = 0; k < n; k++) {
+            sibling += (coreid[order[k]] == coreid[order[i]]);
+        }
+
+        weight[i] = (typerate) ? typerate[typeid[order[i]]] / sibling : 1.0;
+    }
+}
+
+/**
+ * \brief Pick the CPU thread number and placement by a short benchmark sweep, see --autotune
+ *
+ * The CPUs available to the process are ordered by their physical cores, the
+ * fastest core type first, followed by the SMT siblings of the cores. The
+ * sweep runs up to MMC_CPUTUNE_PHOTON photons of the same configuration on
+ * the first n CPUs of this order, n being the cores of the fastest type, half
+ * and all of the physical cores, and all CPUs, and keeps the fastest. On a
+ * hybrid CPU, a single-thread run on each core type first measures its speed,
+ * and the photons are split between the threads in proportion to the speed of
+ * their cores, shared by the SMT siblings in use, instead of evenly. The
+ * settings are keyed by the CPU topology and the kind of simulation, and are
+ * read from cputune_<hash>.txt in the root path, the thread number followed by
+ * one "cpu weight" line per thread.
+ *
+ * \param[in,out] cfg: the simulation configuration, receives tunedthread, tunedcpu and tunedshare
+ * \param[in] mesh: the mesh
+ * \param[in] tracer: the ray-tracer
+ */
+
+static void mmc_cpu_autotune(mcconfig* cfg, tetmesh* mesh, raytracer* tracer) {
+    int* cpus = (int*)malloc(sizeof(int) * MMC_CPUTUNE_MAX_CPU * 5);
+    int* coreid = cpus + MMC_CPUTUNE_MAX_CPU, *speed = coreid + MMC_CPUTUNE_MAX_CPU, *typeid, *order, *topo;
+    int i, j, k, ncpu, ncore = 0, nfast = 0, typenum = 0, best = 0, sizeclass = 1, trynum[4], typespeed[4] = {0};
+    double typerate[4] = {0.0}, *weight, rate, bestrate = 0.0;
+    size_t calibphoton = MIN(cfg->nphoton, MMC_CPUTUNE_PHOTON);
+    char kind[MAX_PATH_LENGTH], format[MAX_PATH_LENGTH], fcache[MAX_FULL_PATH];
+    unsigned long long hash;
+    FILE* fp;
+
+    ncpu = mcx_cputopology(cpus, coreid, speed, MMC_CPUTUNE_MAX_CPU);
+
+    if (ncpu < 2) {
+        MMCDEBUG(cfg, dlTime, (cfg->flog, "the CPU topology is unknown or has a single CPU, --autotune is skipped\n"));
+        free(cpus);
+        return;
+    }
+
+    /*pack the arrays as read by mmc_cpu_placement: cpus, coreid, typeid and order*/
+    memmove(cpus + ncpu, coreid, sizeof(int) * ncpu);
+    coreid = cpus + ncpu;
+    memmove(cpus + 4 * ncpu, speed, sizeof(int) * ncpu);
+    speed = cpus + 4 * ncpu;
+    topo = cpus;
+    typeid = cpus + 2 * ncpu;
+    order = cpus + 3 * ncpu;
+
+    /*the core types are the distinct speeds, fastest first; beyond 4, the slower ones are merged into the 4th*/
+    for (i = 0; i < ncpu; i++) {
+        for (j = 0; j < typenum && typespeed[j] != speed[i]; j++) {
+        }
+
+        if (j == typenum && typenum < 4) {
+            typespeed[typenum++] = speed[i];
+        }
+    }
+
+    for (i = 0; i < typenum; i++) {
+        for (j = i + 1; j < typenum; j++) {
+            if (typespeed[j] > typespeed[i]) {
+                k = typespeed[i];
+                typespeed[i] = typespeed[j];
+                typespeed[j] = k;
+            }
+        }
+    }
+
+    for (i = 0; i < ncpu; i++) {
+        for (typeid[i] = 0; typeid[i] < typenum - 1 && typespeed[typeid[i]] != speed[i]; typeid[i]++) {
+        }
+    }
+
+    /*the first CPU of each physical core by core type, then the k-th SMT siblings; speed is reused for the sibling rank*/
+    for (i = 0; i < ncpu; i++) {
+        for (j = 0, k = 0; j < i; j++) {
+            k += (coreid[j] == coreid[i]);
+        }
+
+        speed[i] = k;
+    }
+
+    for (k = 0; k < typenum; k++) {
+        for (i = 0; i < ncpu; i++) {
+            if (speed[i] == 0 && typeid[i] == k) {
+                order[ncore++] = i;
+                nfast += (k == 0);
+            }
+        }
+    }
+
+    for (k = 1, j = ncore; j < ncpu; k++) {
+        for (i = 0; i < ncpu; i++) {
+            if (speed[i] == k) {
+                order[j++] = i;
+            }
+        }
+    }
+
+    trynum[0] = nfast;
+    trynum[1] = MAX(ncore / 2, 1);
+    trynum[2] = ncore;
+    trynum[3] = ncpu;
+
+    /*the mesh size class tells the cache-resident meshes from the memory-bound ones*/
+    while ((1 << sizeclass) < mesh->ne && sizeclass < 31) {
+        sizeclass++;
+    }
+
+    sprintf(kind, "cputune %d %d %d %d %d %d %d %d %d %d %d %d %d", cfg->method, cfg->basisorder, cfg->outputtype, cfg->issave2pt,
+            cfg->issavedet, cfg->issaveref, cfg->srctype, cfg->srcnum, cfg->isatomic, cfg->rngtype, cfg->implicit, cfg->iswavefront, sizeclass);
+    hash = mesh_hashbuffer(kind, strlen(kind), 0xcbf29ce484222325ULL);
+    hash = mesh_hashbuffer(topo, sizeof(int) * 4 * ncpu, hash);
+    hash = mesh_hashbuffer(typespeed, sizeof(typespeed), hash);
+    sprintf(format, "cputune_%016llx.txt", hash);
+    mesh_filenames(format, fcache, cfg);
+
+    cfg->tunedcpu = (int*)malloc(sizeof(int) * ncpu);
+    weight = (double*)calloc(ncpu, sizeof(double));
+
+    if (cfg->autotune == 1 && (fp = fopen(fcache, "rt")) != NULL) {
+        i = -1;
+
+        if (fscanf(fp, "%d", &cfg->tunedthread) == 1 && cfg->tunedthread > 0 && cfg->tunedthread <= ncpu) {
+            for (i = 0; i < cfg->tunedthread; i++) {
+                if (fscanf(fp, "%d %lf", cfg->tunedcpu + i, weight + i) != 2 || weight[i] <= 0.0) {
+                    break;
+                }
+            }
+        }
+
+        fclose(fp);
+
+        if (i == cfg->tunedthread) {
+            MMCDEBUG(cfg, dlTime, (cfg->flog, "loaded the calibrated CPU thread settings from %s\n", fcache));
+        } else {
+            cfg->tunedthread = 0;
+        }
+    }
+
+    if (cfg->tunedthread == 0) {
+        MMC_FPRINTF(cfg->flog, "calibrating the CPU thread settings of %d CPUs (%d cores, %d core types), saved to %s\n", ncpu, ncore, typenum, fcache);
+
+        /*on a hybrid CPU, the speed of each core type is measured by a single thread on its first core*/
+        for (k = 0; k < typenum && typenum > 1; k++) {
+            for (i = 0; i < ncore - 1 && typeid[order[i]] != k; i++) {
+            }
+
+            typerate[k] = mmc_cpu_trialrun(cfg, mesh, tracer, MAX(calibphoton / 16, 1), 1, cpus + order[i], NULL);
+            MMC_FPRINTF(cfg->flog, "- core type %d (speed %d): %.1f photon/ms per thread\n", k, typespeed[k], typerate[k]);
+        }
+
+        for (j = 0; j < 4; j++) {
+            double* cumshare = NULL;
+            int n = trynum[j];
+
+            for (k = 0; k < j && trynum[k] != n; k++) {
+            }
+
+            if (n < 1 || k < j) {
+                continue;
+            }
+
+            mmc_cpu_placement(n, topo, ncpu, (typenum > 1) ? typerate : NULL, cfg->tunedcpu, weight);
+
+            if (typenum > 1) {
+                cumshare = (double*)malloc(sizeof(double) * (n + 1));
+                cumshare[0] = 0.0;
+
+                for (i = 0; i < n; i++) {
+                    cumshare[i + 1] = cumshare[i] + weight[i];
+                }
+
+                for (i = 1; i <= n; i++) {
+                    cumshare[i] /= cumshare[n];
+                }
+            }
+
+            rate = mmc_cpu_trialrun(cfg, mesh, tracer, calibphoton, n, cfg->tunedcpu, cumshare);
+            MMC_FPRINTF(cfg->flog, "- %d thread(s) on %d core(s): %.1f photon/ms\n", n, MIN(n, ncore), rate);
+            free(cumshare);
+
+            if (rate > bestrate) {
+                bestrate = rate;
+                best = n;
+            }
+        }
+
+        cfg->tunedthread = best;
+        mmc_cpu_placement(best, topo, ncpu, (typenum > 1) ? typerate : NULL, cfg->tunedcpu, weight);
+
+        if ((fp = fopen(fcache, "wt")) != NULL) {
+            fprintf(fp, "%d\n", best);
+
+            for (i = 0; i < best; i++) {
+                fprintf(fp, "%d %.6g\n", cfg->tunedcpu[i], weight[i]);
+            }
+
+            fclose(fp);
+        } else {
+            MMC_FPRINTF(cfg->flog, S_RED "WARNING: can not write the CPU thread settings to %s\n" S_RESET, fcache);
+        }
+    }
+
+    /*unequal weights replace the even split by the cumulative shares*/
+    for (i = 1; i < cfg->tunedthread && weight[i] == weight[0]; i++) {
+    }
+
+    if (i < cfg->tunedthread) {
+        cfg->tunedshare = (double*)malloc(sizeof(double) * (cfg->tunedthread + 1));
+        cfg->tunedshare[0] = 0.0;
+
+        for (i = 0; i < cfg->tunedthread; i++) {
+            cfg->tunedshare[i + 1] = cfg->tunedshare[i] + weight[i];
+        }
+
+        for (i = 1; i <= cfg->tunedthread; i++) {
+            cfg->tunedshare[i] /= cfg->tunedshare[cfg->tunedthread];
+        }
+    }
+
+    MMCDEBUG(cfg, dlTime, (cfg->flog, "run %d CPU thread(s)%s\n", cfg->tunedthread, cfg->tunedshare ? ", photons split by the core speed" : ""));
+    free(weight);
+    free(cpus);
+}
+
+/**
+ * \brief Main function to launch CPU based MMC photon simulation
+ *
+ * \param[out] cfg: the simulation configuration structure
+ * \param[out] mesh: the mesh data structure
+ * \param[out] tracer: the ray-tracer data structure
+ */
+
+int mmc_run_mp(mcconfig* cfg, tetmesh* mesh, raytracer* tracer) {
+#ifdef MMC_USE_MPI
+
+    if (cfg->isdomain) {
+        return mmc_run_domain(cfg, mesh, tracer);
+    }
+
+#endif
+
+    /*the thread placement is calibrated, or loaded, by the first run and kept by the later ones*/
+    if (cfg->autotune && cfg->tunedthread == 0 && cfg->mpisize <= 1 && !cfg->issparsegate && !cfg->isresume && !cfg->isnuma
+            && cfg->inccache[0] == '\0' && cfg->debugphoton < 0) {
+        mmc_cpu_autotune(cfg, mesh, tracer);
+    }
+
+    return mmc_run_share(cfg, mesh, tracer, NULL);
+}
+
+/**
+ * \brief Run a fused excitation-emission fluorescence simulation (--emission)
+ *
+ * The excitation stage simulates the source in the input media and keeps the
+ * raw energy absorbed in each element (-O E, -C 0, not normalized) in memory,
+ * without saving any output. Weighted by the fluorescence yield of the medium
+ * of each element, it forms the launch distribution of the emission stage
+ * (mesh->emitcdf), which simulates the same photon number in the emission
+ * media of cfg->emitfile with the output settings of the input, and saves
+ * the results. The emission photons start at t=0, i.e. the fluorescence
+ * lifetime is not modeled.
+ *
+ * \param[in,out] cfg: the simulation configuration structure
+ * \param[in,out] mesh: the mesh data structure, left with the emission media
+ * \param[in,out] tracer: the ray-tracer data structure
+ */
+
+int mmc_run_emission(mcconfig* cfg, tetmesh* mesh, raytracer* tracer) {
+    medium* emitmed = (medium*)malloc(sizeof(medium) * (mesh->prop + 1));
+    float* yield = (float*)calloc(mesh->prop + 1, sizeof(float));
+    int outputtype = cfg->outputtype, isnormalized = cfg->isnormalized, freqnum = cfg->freqnum;
+    char basisorder = cfg->basisorder, issave2pt = cfg->issave2pt, issavedet = cfg->issavedet, issaveexit = cfg->issaveexit, issaveref = cfg->issaveref, shm0 = cfg->shmname[0];
+    unsigned int debuglevel = cfg->debuglevel;
+    double total = 0.0;
+    int i, t;
+
+    mesh_loademission(mesh, cfg, emitmed, yield);
+
+    cfg->outputtype = otEnergy;
+    cfg->basisorder = 0;
+    cfg->isnormalized = 0;
+    cfg->freqnum = 0;
+    cfg->issave2pt = cfg->issavedet = cfg->issaveexit = cfg->issaveref = 0;
+    cfg->shmname[0] = '\0';
+    cfg->debuglevel &= ~dlTraj;
+
+    /*the output is resized from nodes to elements*/
+    free(mesh->weight);
+    mesh->weight = NULL;
+    mesh_initweight(mesh, cfg);
+
+    MMCDEBUG(cfg, dlTime, (cfg->flog, "simulating the fluorescence excitation ...\n"));
+    mmc_run_mp(cfg, mesh, tracer);
+
+    /*the output is in the input element order, the mesh may be renumbered*/
+    mesh->emitcdf = (double*)malloc(sizeof(double) * mesh->ne);
+
+    for (i = 0; i < mesh->ne; i++) {
+        size_t id = (mesh->elemorder) ? (size_t)mesh->elemorder[i] : (size_t)i;
+        double energy = 0.0;
+
+        for (t = 0; t < cfg->maxgate; t++) {
+            energy += mesh->weight[(size_t)t * mesh->ne + id];
+        }
+
+        total += energy * yield[mesh->type[i]];
+        mesh->emitcdf[i] = total;
+    }
+
+    if (total <= 0.0) {
+        MMC_ERROR(-2, "no fluorescence is emitted, the media absorbing the excitation have a zero yield in the --emission file");
+    }
+
+    for (i = 0; i < mesh->ne; i++) {
+        mesh->emitcdf[i] /= total;
+    }
+
+    MMCDEBUG(cfg, dlTime, (cfg->flog, "emitted fluorescence energy: %g per excitation photon\n", total / cfg->nphoton));
+
+    cfg->outputtype = outputtype;
+    cfg->basisorder = basisorder;
+    cfg->isnormalized = isnormalized;
+    cfg->freqnum = freqnum;
+    cfg->issave2pt = issave2pt;
+    cfg->issavedet = issavedet;
+    cfg->issaveexit = issaveexit;
+    cfg->issaveref = issaveref;
+    cfg->shmname[0] = shm0;
+    cfg->debuglevel = debuglevel;
+
+    free(mesh->weight);
+    mesh->weight = NULL;
+    mmc_prep_next(cfg, mesh, tracer, emitmed);
+
+    MMCDEBUG(cfg, dlTime, (cfg->flog, "simulating the fluorescence emission ...\n"));
+    mmc_run_mp(cfg, mesh, tracer);
+
+    free(mesh->emitcdf);
+    mesh->emitcdf = NULL;
+    free(emitmed);
+    free(yield);
+    return 0;
+}
+
+/**
+ * \brief Measure all pattern-detector pairs from the detector side (--reciprocal)
+ *
+ * When there are fewer detectors than source patterns, each detector is
+ * launched in turn as a uniform disk source of its radius (see
+ * mesh_detsource), and the surface diffuse reflectance of its run is kept in
+ * memory. By reciprocity, the fraction of the power of pattern s detected by
+ * detector d is the detector area times the exitance of the reversed run
+ * integrated over the power that pattern s delivers to the surface, i.e.
+ * \f$M_{sd}(t)=\pi r_d^2\sum_f R_d(f,t)\,q_s(f)\f$, where R_d is the
+ * normalized dref of face f and q_s comes from mesh_patternfaces. The
+ * measurements are saved to <session>_recip.dat; the fields and the dref of
+ * the detector runs are not saved.
+ *
+ * The disk is launched collimated instead of with the cosine profile of
+ * an exact adjoint source, which is accurate once the photons are diffuse.
+ *
+ * \param[in,out] cfg: the simulation configuration structure
+ * \param[in,out] mesh: the mesh data structure
+ * \param[in,out] tracer: the ray-tracer data structure
+ */
+
+int mmc_run_reciprocal(mcconfig* cfg, tetmesh* mesh, raytracer* tracer) {
+    int srcnum = cfg->srcnum, srctype = cfg->srctype, e0 = cfg->e0, parentid = cfg->parentid, isnormalized = cfg->isnormalized;
+    char issave2pt = cfg->issave2pt, issavedet = cfg->issavedet, issaveexit = cfg->issaveexit, issaveref = cfg->issaveref, shm0 = cfg->shmname[0];
+    unsigned int debuglevel = cfg->debuglevel;
+    float3 srcpos = cfg->srcpos;
+    float4 srcdir = cfg->srcdir, srcparam1 = cfg->srcparam1, bary0 = cfg->bary0;
+    int* srcelem = mesh->srcelem, srcelemlen = mesh->srcelemlen;
+    elemgrid* srcgrid = mesh->srcgrid;
+    size_t framelen = (size_t)cfg->maxgate + 1;
+    double* facew = (double*)malloc(sizeof(double) * mesh->nf * srcnum);
+    double* meas = (double*)calloc((size_t)cfg->detnum * srcnum * framelen, sizeof(double));
+    int d, s;
+
+    mesh_patternfaces(mesh, cfg, facew);
+
+    cfg->srcnum = 1;
+    cfg->isnormalized = 1;
+    cfg->parentid = mpMATLAB;              /*the outputs of the detector runs are not saved*/
+    cfg->issave2pt = cfg->issavedet = cfg->issaveexit = 0;
+    cfg->issaveref = 1;
+    cfg->shmname[0] = '\0';
+    cfg->debuglevel &= ~dlTraj;
+
+    mesh->srcelem = NULL;
+    mesh->srcelemlen = 0;
+    mesh->srcgrid = NULL;
+
+    /*the output is resized for a single source*/
+    free(mesh->weight);
+    mesh->weight = NULL;
+
+    for (d = 0; d < cfg->detnum; d++) {
+        double area = M_PI * cfg->detpos[d].w * cfg->detpos[d].w;
+
+        if (mesh_detsource(mesh, cfg, d)) {
+            MMC_ERROR(-2, "--reciprocal can not find the element enclosing the center of a detector");
+        }
+
+        mmc_prep_next(cfg, mesh, tracer, NULL);
+
+        MMCDEBUG(cfg, dlTime, (cfg->flog, "simulating detector %d of %d as the source ...\n", d + 1, cfg->detnum));
+        mmc_run_mp(cfg, mesh, tracer);
+
+        if (cfg->mpirank != 0) {
+            continue;
+        }
+
+        #pragma omp parallel for schedule(static)
+
+        for (s = 0; s < srcnum; s++) {
+            double* m = meas + ((size_t)d * srcnum + s) * framelen;
+            size_t f;
+            int t;
+
+            for (t = 0; t < cfg->maxgate; t++) {
+                double* dref = mesh->dref + (size_t)t * mesh->nf;
+
+                for (f = 0; f < (size_t)mesh->nf; f++) {
+                    m[t + 1] += area * dref[f] * facew[f * srcnum + s];
+                }
+
+                m[0] += m[t + 1];
+            }
+        }
+    }
+
+    free(mesh->srcelem);
+    mesh->srcelem = srcelem;
+    mesh->srcelemlen = srcelemlen;
+    mesh->srcgrid = srcgrid;
+
+    cfg->srcnum = srcnum;
+    cfg->srctype = srctype;
+    cfg->srcpos = srcpos;
+    cfg->srcdir = srcdir;
+    cfg->srcparam1 = srcparam1;
+    cfg->bary0 = bary0;
+    cfg->e0 = e0;
+    cfg->isnormalized = isnormalized;
+    cfg->parentid = parentid;
+    cfg->issave2pt = issave2pt;
+    cfg->issavedet = issavedet;
+    cfg->issaveexit = issaveexit;
+    cfg->issaveref = issaveref;
+    cfg->shmname[0] = shm0;
+    cfg->debuglevel = debuglevel;
+
+    /*the buffers of the detector runs hold a single source*/
+    free(mesh->weight);
+    mesh->weight = NULL;
+    free(mesh->dref);
+    mesh->dref = NULL;
+
+#ifndef MCX_CONTAINER
+
+    if (cfg->mpirank == 0) {
+        MMCDEBUG(cfg, dlTime, (cfg->flog, "saving the reciprocal measurements of %d patterns and %d detectors ...\n", srcnum, cfg->detnum));
+        mesh_savereciprocal(cfg, meas);
+    }
+
+#endif
+
+    free(meas);
+    free(facew);
+    return 0;
+}
+
+/**
+ * \brief Simulate a share of the photons on the CPU next to a GPU run (--hybrid)
+ *
+ * The GPU backend simulates the first (1-cfg->hybrid)*nphoton photons with a
+ * copy of cfg and a shallow copy of the mesh that has its own output buffers,
+ * in one thread of a 2-thread team. The other thread runs the CPU simulation of
+ * the remaining photons, which waits for the GPU, merges its output (see
+ * mmc_hybridmerge), and normalizes and saves the result as a CPU-only run does.
+ * Both seed their streams with rand(), so the GPU only starts after the CPU
+ * threads have drawn their seeds; with xorshift128+, the GPU gets a seed of
+ * its own, with Philox, the photon indices of the two shares do not overlap.
+ *
+ * \param[in,out] cfg: the simulation configuration structure
+ * \param[in,out] mesh: the mesh data structure
+ * \param[in,out] tracer: the ray-tracer data structure
+ * \param[in] run: the GPU backend, mmc_run_cl or mmc_run_cu
+ */
+
+int mmc_run_hybrid(mcconfig* cfg, tetmesh* mesh, raytracer* tracer, void (*run)(mcconfig*, tetmesh*, raytracer*)) {
+    hybridpeer peer;
+    size_t datalen = (size_t)((cfg->method == rtBLBadouelGrid) ? cfg->crop0.z : ( (cfg->basisorder) ? mesh->nn : mesh->ne));
+    size_t buflen = datalen * cfg->srcnum * (cfg->maxgate * cfg->replaydetnum * cfg->wavenum + 2 * cfg->freqnum);
+    size_t dreflen = (cfg->issaveref && mesh->dref) ? (size_t)mesh->nf * cfg->srcnum * cfg->maxgate : 0;
+
+#ifndef _OPENMP
+    MMC_ERROR(-2, "the hybrid mode requires a build with OpenMP");
+#endif
+
+    memcpy(&peer.cfg, cfg, sizeof(mcconfig));
+    memcpy(&peer.mesh, mesh, sizeof(tetmesh));
+    peer.isseeded = 0;
+    peer.isdone = 0;
+
+    peer.cfg.nphoton = cfg->nphoton - (size_t)((double)cfg->nphoton * cfg->hybrid);
+    peer.cfg.isnormalized = 0;
+    peer.cfg.parentid = mpMATLAB;          /*the GPU share is saved with the merged output*/
+    peer.cfg.debuglevel &= ~dlProgress;
+    peer.cfg.exportfield = NULL;
+    peer.cfg.exportdetected = NULL;
+    peer.cfg.detectedcount = 0;
+    peer.cfg.energytot = (double*)calloc(cfg->srcnum, sizeof(double));
+    peer.cfg.energyesc = (double*)calloc(cfg->srcnum, sizeof(double));
+    peer.mesh.weight = (double*)calloc(buflen, sizeof(double));
+    peer.mesh.weightvar = NULL;
+    peer.mesh.dref = (dreflen) ? (double*)calloc(dreflen, sizeof(double)) : NULL;
+    peer.mesh.elemorder = NULL;            /*the merged output is mapped to the input order once*/
+
+    if (cfg->rngtype != rngPhilox && cfg->seed > 0) {
+        srand(cfg->seed);
+        peer.cfg.seed = (rand() >> 1) + 1;
+    }
+
+    MMCDEBUG(cfg, dlTime, (cfg->flog, "hybrid run: %zu photons on the GPU, %zu on the CPU\n", peer.cfg.nphoton, cfg->nphoton - peer.cfg.nphoton));
+
+#ifdef _OPENMP
+
+    if (omp_get_max_active_levels() < omp_get_active_level() + 3) {
+        omp_set_max_active_levels(omp_get_active_level() + 3);
+    }
+
+#endif
+
+    #pragma omp parallel sections num_threads(2)
+    {
+        #pragma omp section
+        {
+            int isseeded = 0;
+
+#ifdef _OPENMP
+            isseeded = (omp_get_num_threads() == 1);  /*a team of one thread runs the sections in order*/
+#endif
+
+            while (!isseeded) {
+                #pragma omp atomic read
+                isseeded = peer.isseeded;
+
+                if (!isseeded) {
+                    sleep_ms(1);
+                }
+            }
+
+            run(&peer.cfg, &peer.mesh, tracer);
+
+            #pragma omp atomic write
+            peer.isdone = 1;
+        }
+
+        #pragma omp section
+        {
+            mmc_run_share(cfg, mesh, tracer, &peer);
+        }
+    }
+
+    free(peer.cfg.energytot);
+    free(peer.cfg.energyesc);
+    free(peer.cfg.exportdetected);
+    free(peer.mesh.weight);
+    free(peer.mesh.dref);
 
     return 0;
 }
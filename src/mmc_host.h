@@ -51,7 +51,14 @@ int mmc_init_from_json(mcconfig* cfg, tetmesh* mesh, raytracer* tracer, char* jc
 int mmc_reset(mcconfig* cfg, tetmesh* mesh, raytracer* tracer);
 int mmc_cleanup(mcconfig* cfg, tetmesh* mesh, raytracer* tracer);
 int mmc_prep(mcconfig* cfg, tetmesh* mesh, raytracer* tracer);
+int mmc_prep_next(mcconfig* cfg, tetmesh* mesh, raytracer* tracer, const medium* med);
 int mmc_run_mp(mcconfig* cfg, tetmesh* mesh, raytracer* tracer);
+int mmc_run_emission(mcconfig* cfg, tetmesh* mesh, raytracer* tracer);
+int mmc_run_reciprocal(mcconfig* cfg, tetmesh* mesh, raytracer* tracer);
+int mmc_run_hybrid(mcconfig* cfg, tetmesh* mesh, raytracer* tracer, void (*run)(mcconfig*, tetmesh*, raytracer*));
+int mmc_serve(mcconfig* cfg, tetmesh* mesh, raytracer* tracer, void (*run)(mcconfig*, tetmesh*, raytracer*));
+int mmc_estimate(mcconfig* cfg, tetmesh* mesh, raytracer* tracer, void (*run)(mcconfig*, tetmesh*, raytracer*));
+int mmc_cacherun(mcconfig* cfg, tetmesh* mesh, raytracer* tracer, void (*run)(mcconfig*, tetmesh*, raytracer*));
 
 #ifdef  __cplusplus
 }
@@ -39,8 +39,21 @@
 #include "mmc_const.h"
 #include "mmc_mesh.h"
 #include <string.h>
+#include <sys/stat.h>
 #include "mmc_highorder.h"
 
+#ifdef _WIN32
+    #include <direct.h>
+#else
+    #include <sys/mman.h>
+    #include <fcntl.h>
+    #include <unistd.h>
+#endif
+
+#ifdef _OPENMP
+    #include <omp.h>
+#endif
+
 #ifdef WIN32
     char pathsep = '\\'; /**< path separator on Windows */
 #else
@@ -58,6 +71,79 @@
 
 const int out[4][3] = {{0, 3, 1}, {3, 2, 1}, {0, 2, 3}, {0, 1, 2}};
 
+/**
+ * \brief Sections stored in a binary mesh container, in the order of the file
+ */
+
+enum TMeshSection {msNode, msElem, msType, msFacenb, msEvol, msTracerD, msTracerM, msTracerN, msSectionNum};
+
+/**
+ * \brief Header of the binary mesh container (mesh_<tag>.mmcb)
+ *
+ * The header is followed by the sections listed in TMeshSection, each starts
+ * at a 64-byte aligned offset. The data are stored in the native byte order
+ * and are memory-mapped by mesh_loadbinary() without any parsing.
+ */
+
+typedef struct MMC_meshheader {
+    char magic[8];                            /**< MMC_MESH_MAGIC */
+    unsigned int version;                     /**< container format version */
+    unsigned int headersize;                  /**< sizeof(meshheader), also guards the native layout */
+    int nn;                                   /**< number of nodes */
+    int ne;                                   /**< number of elements */
+    int elemlen;                              /**< number of nodes per element */
+    int tracermethod;                         /**< ray-tracing method of the tracer sections, -1 if not stored */
+    int tracerhasw;                           /**< 1 if the tracer sections contain the w components (SSE/OpenCL builds) */
+    unsigned long long offset[msSectionNum];  /**< byte offset of each section from the start of the file */
+    unsigned long long len[msSectionNum];     /**< byte length of each section, 0 if absent */
+} meshheader;
+
+#define MMC_MESH_MAGIC     "MMCMESH"
+#define MMC_MESH_VERSION   1
+#define MMC_MESH_ALIGN     64
+#define MMC_TEXT_CHUNK     (1 << 20)   /**< minimum byte length of a text mesh file chunk parsed by one thread */
+#define MMC_DETIMAGE_CHUNK (1 << 14)   /**< minimum number of detected photons binned into a detector image by one thread */
+#define MMC_NORM_BLOCK     1024        /**< elements/nodes normalized by one thread at a time, also the unit of the energy sums */
+#define MMC_ELEM_CHUNK     (1 << 16)   /**< minimum number of elements scanned by one thread when building the per-element lists of a mesh */
+#define MMC_BARY_BATCH     8           /**< candidate elements tested together against one point by mesh_barylocate */
+
+/**
+ * @brief Return the byte length of a precomputed tracer section (d, m or n) for a given method
+ *
+ * @param[in] method: the ray-tracing method
+ * @param[in] section: 0 for d, 1 for m, 2 for n
+ * @param[in] ne: number of elements
+ */
+
+static unsigned long long mesh_tracerlen(int method, int section, int ne) {
+    const int counts[3][3] = {{6, 6, 4}, {0, 12, 0}, {0, 0, 4}}; /*Plucker, Havel/Badouel, branch-less Badouel*/
+    int row = (method == rtPlucker) ? 0 : ((method == rtHavel || method == rtBadouel) ? 1 : 2);
+
+    return (unsigned long long)counts[row][section] * ne * sizeof(float3);
+}
+
+/**
+ * \brief Header of the on-disk ray-tracer cache (tracer_<tag>_<hash>.mmct)
+ *
+ * The header is followed by the d, m and n arrays of the ray-tracer; a cache
+ * file is used only if its header is identical to the expected one.
+ */
+
+typedef struct MMC_tracerheader {
+    char magic[8];                 /**< MMC_TRACER_MAGIC */
+    unsigned int version;          /**< cache format version */
+    unsigned int headersize;       /**< sizeof(tracerheader) */
+    unsigned long long hash;       /**< hash of the node/elem data and the tracer settings */
+    int ne;                        /**< number of elements */
+    int method;                    /**< ray-tracing method */
+    int hasw;                      /**< 1 if the data contain the w components (SSE/OpenCL builds) */
+    int reserved;                  /**< padding, always 0 */
+    unsigned long long len[3];     /**< byte length of the d, m and n arrays */
+} tracerheader;
+
+#define MMC_TRACER_MAGIC   "MMCTRCE"
+#define MMC_TRACER_VERSION 1
+
 /**
  * \brief The local index of the node with an opposite face to the i-th face defined in nc[][]
  *
@@ -102,6 +188,12 @@ const int faceorder[] = {1, 3, 2, 0, -1};
 
 const int ifaceorder[] = {3, 0, 2, 1};
 
+/**
+ * The random number generator of the calling thread, see mmc_rand_multi.c
+ */
+
+__thread int rand_backend = rngXorshift128p;
+
 /**
  * @brief Initializing the mesh data structure with default values
  *
@@ -128,10 +220,36 @@ void mesh_init(tetmesh* mesh) {
     mesh->facenb = NULL;
     mesh->type = NULL;
     mesh->med = NULL;
+    mesh->elemmed = NULL;
+    mesh->wavemed = NULL;
+    mesh->emitcdf = NULL;
     mesh->weight = NULL;
+    mesh->weightvar = NULL;
+    mesh->weightpage = NULL;
+    mesh->weightpagenum = 0;
+    mesh->weightbrick.x = mesh->weightbrick.y = mesh->weightbrick.z = 0;
     mesh->evol = NULL;
     mesh->nvol = NULL;
     mesh->dref = NULL;
+    mesh->elemorder = NULL;
+    mesh->nodeorder = NULL;
+    mesh->mmapbuf = NULL;
+    mesh->mmaplen = 0;
+    mesh->tracermethod = -1;
+    mesh->tracerdata[0] = mesh->tracerdata[1] = mesh->tracerdata[2] = NULL;
+    mesh->srcgrid = NULL;
+    mesh->surfbvh = NULL;
+    mesh->detgrid = NULL;
+    mesh->noroi = NULL;
+    mesh->facereflect = NULL;
+    mesh->roimap = NULL;
+    mesh->nroirec = 0;
+    mesh->diffradius = NULL;
+    mesh->difftau = NULL;
+    mesh->outmap = NULL;
+    mesh->outlen = 0;
+    mesh->outsink = 0;
+    mesh->part = NULL;
     mesh->nmin.x = VERY_BIG;
     mesh->nmin.y = VERY_BIG;
     mesh->nmin.z = VERY_BIG;
@@ -158,50 +276,89 @@ void mesh_clear(tetmesh* mesh, mcconfig* cfg) {
     mesh->detelemlen = 0;
 
     if (mesh->node && cfg->node == NULL) {
-        free(mesh->node);
+        if (!mesh_ismapped(mesh, mesh->node)) {
+            free(mesh->node);
+        }
+
         mesh->node = NULL;
     }
 
-    if (mesh->elem) {
+    if (mesh->elem && !mesh_ismapped(mesh, mesh->elem)) {
         free(mesh->elem);
-        mesh->elem = NULL;
     }
 
+    mesh->elem = NULL;
+
     if (mesh->elem2) {
         free(mesh->elem2);
         mesh->elem2 = NULL;
     }
 
-    if (mesh->facenb) {
+    if (mesh->facenb && !mesh_ismapped(mesh, mesh->facenb)) {
         free(mesh->facenb);
-        mesh->facenb = NULL;
     }
 
+    mesh->facenb = NULL;
+
     if (mesh->dref) {
         free(mesh->dref);
         mesh->dref = NULL;
     }
 
-    if (mesh->type) {
+    if (mesh->type && !mesh_ismapped(mesh, mesh->type)) {
         free(mesh->type);
-        mesh->type = NULL;
     }
 
+    mesh->type = NULL;
+
     if (mesh->med) {
         free(mesh->med);
         mesh->med = NULL;
     }
 
+    if (mesh->elemmed) {
+        free(mesh->elemmed);
+        mesh->elemmed = NULL;
+    }
+
+    if (mesh->wavemed) {
+        free(mesh->wavemed);
+        mesh->wavemed = NULL;
+    }
+
+    if (mesh->emitcdf) {
+        free(mesh->emitcdf);
+        mesh->emitcdf = NULL;
+    }
+
     if (mesh->weight) {
         free(mesh->weight);
         mesh->weight = NULL;
     }
 
-    if (mesh->evol) {
+    if (mesh->weightvar) {
+        free(mesh->weightvar);
+        mesh->weightvar = NULL;
+    }
+
+    if (mesh->weightpage) {
+        size_t i;
+
+        for (i = 0; i < mesh->weightpagenum; i++) {
+            free(mesh->weightpage[i]);
+        }
+
+        free(mesh->weightpage);
+        mesh->weightpage = NULL;
+        mesh->weightpagenum = 0;
+    }
+
+    if (mesh->evol && !mesh_ismapped(mesh, mesh->evol)) {
         free(mesh->evol);
-        mesh->evol = NULL;
     }
 
+    mesh->evol = NULL;
+
     if (mesh->nvol) {
         free(mesh->nvol);
         mesh->nvol = NULL;
@@ -231,6 +388,99 @@ void mesh_clear(tetmesh* mesh, mcconfig* cfg) {
         free(mesh->faceroi);
         mesh->faceroi = NULL;
     }
+
+    if (mesh->elemorder) {
+        free(mesh->elemorder);
+        mesh->elemorder = NULL;
+    }
+
+    if (mesh->nodeorder) {
+        free(mesh->nodeorder);
+        mesh->nodeorder = NULL;
+    }
+
+    if (mesh->mmapbuf) {
+#ifdef _WIN32
+        free(mesh->mmapbuf);
+#else
+        munmap(mesh->mmapbuf, mesh->mmaplen);
+#endif
+        mesh->mmapbuf = NULL;
+        mesh->mmaplen = 0;
+    }
+
+    if (mesh->noroi) {
+        free(mesh->noroi);
+        mesh->noroi = NULL;
+    }
+
+    if (mesh->facereflect) {
+        free(mesh->facereflect);
+        mesh->facereflect = NULL;
+    }
+
+    if (mesh->roimap) {
+        free(mesh->roimap);
+        mesh->roimap = NULL;
+    }
+
+    mesh->nroirec = 0;
+
+    if (mesh->diffradius) {
+        free(mesh->diffradius);
+        mesh->diffradius = NULL;
+    }
+
+    if (mesh->difftau) {
+        free(mesh->difftau);
+        mesh->difftau = NULL;
+    }
+
+    if (mesh->outmap) {
+        free(mesh->outmap);
+        mesh->outmap = NULL;
+    }
+
+    mesh->outlen = 0;
+
+    mesh_cleargrid(&(mesh->srcgrid));
+    mesh_cleargrid(&(mesh->detgrid));
+
+    if (mesh->surfbvh) {
+        free(mesh->surfbvh->node);
+        free(mesh->surfbvh->tri);
+        free(mesh->surfbvh->face);
+        free(mesh->surfbvh);
+        mesh->surfbvh = NULL;
+    }
+
+    if (mesh->part) {
+        free(mesh->part->elemstart);
+        free(mesh->part->ghost);
+        free(mesh->part->nodeglobal);
+        free(mesh->part->nodecoef);
+        free(mesh->part->elemorder);
+        free(mesh->part->nodeorder);
+        free(mesh->part->facemap);
+        free(mesh->part);
+        mesh->part = NULL;
+    }
+
+    mesh->tracermethod = -1;
+    mesh->tracerdata[0] = mesh->tracerdata[1] = mesh->tracerdata[2] = NULL;
+}
+
+/**
+ * @brief Test if a buffer points into the memory-mapped mesh container
+ *
+ * Such buffers are owned by the mapping and must not be freed individually.
+ *
+ * @param[in] mesh: the mesh object
+ * @param[in] ptr: the buffer to be tested
+ */
+
+int mesh_ismapped(tetmesh* mesh, void* ptr) {
+    return (mesh && mesh->mmapbuf && (char*)ptr >= (char*)mesh->mmapbuf && (char*)ptr < (char*)mesh->mmapbuf + mesh->mmaplen);
 }
 
 
@@ -244,8 +494,12 @@ void mesh_clear(tetmesh* mesh, mcconfig* cfg) {
 
 void mesh_init_from_cfg(tetmesh* mesh, mcconfig* cfg) {
     mesh_init(mesh);
-    mesh_loadnode(mesh, cfg);
-    mesh_loadelem(mesh, cfg);
+
+    if (mesh_loadbinary(mesh, cfg) == 0) {
+        mesh_loadnode(mesh, cfg);
+        mesh_loadelem(mesh, cfg);
+    }
+
     mesh_loadmedia(mesh, cfg);
 
     if (cfg->isdumpjson == 1) {
@@ -287,9 +541,20 @@ void mesh_init_from_cfg(tetmesh* mesh, mcconfig* cfg) {
         mesh_10nodetet(mesh, cfg);
     }
 
-    mesh_loadelemvol(mesh, cfg);
-    mesh_loadfaceneighbor(mesh, cfg);
+    if (mesh->nvol == NULL) {
+        mesh_loadelemvol(mesh, cfg);
+    }
+
+    if (mesh->facenb == NULL) {
+        mesh_loadfaceneighbor(mesh, cfg);
+    }
+
     mesh_loadroi(mesh, cfg);
+    mesh_loadelemprop(mesh, cfg);
+
+    if (cfg->isdumpmesh) {
+        mesh_savebinary(mesh, cfg);
+    }
 
     if (cfg->seed == SEED_FROM_FILE && cfg->seedfile[0]) {
         mesh_loadseedfile(mesh, cfg);
@@ -372,1613 +637,7912 @@ void mesh_createdualmesh(tetmesh* mesh, mcconfig* cfg) {
 /**
  * @brief Identify wide-field source and detector-related elements (type=-1 for source, type=-2 for det)
  *
+ * The labels are scanned once, in chunks of at least MMC_ELEM_CHUNK elements
+ * handled by different threads; each chunk collects its source and detector
+ * elements, which are then concatenated in the chunk order, so the lists are
+ * sorted as in a serial scan.
+ *
  * @param[in] mesh: the mesh object
  * @param[in] cfg: the simulation configuration structure
  */
 
 void mesh_srcdetelem(tetmesh* mesh, mcconfig* cfg) {
-    int i;
+    int nchunk = 1, i, is = 0, id = 0;
+    int** list;
+    int* count;
 
-    mesh->srcelemlen = 0;
-    mesh->detelemlen = 0;
+#ifdef _OPENMP
+    nchunk = MAX(1, MIN(omp_get_max_threads(), mesh->ne / MMC_ELEM_CHUNK));
+#endif
 
-    for (i = 0; i < mesh->ne; i++) {
-        if (mesh->type[i] == -1) { /*number of elements in the initial candidate list*/
-            mesh->srcelemlen++;
-            cfg->e0 = (cfg->e0 == 0) ? i + 1 : cfg->e0;
-        }
+    list = (int**)calloc(nchunk * 2, sizeof(int*));
+    count = (int*)calloc(nchunk * 2, sizeof(int));
+
+    #pragma omp parallel for
+
+    for (i = 0; i < nchunk; i++) {
+        int e, end = (int)((long long)mesh->ne * (i + 1) / nchunk), len[2] = {0, 0};
+
+        for (e = (int)((long long)mesh->ne * i / nchunk); e < end; e++) {
+            int* type = mesh->type + e, k = -1 - *type;
+
+            if (k != 0 && k != 1) {
+                continue;
+            }
+
+            if (count[i * 2 + k] == len[k]) {
+                len[k] = MAX(len[k] << 1, 64);
+                list[i * 2 + k] = (int*)realloc(list[i * 2 + k], len[k] * sizeof(int));
+            }
+
+            list[i * 2 + k][count[i * 2 + k]++] = e + 1;
 
-        if (mesh->type[i] == -2) { /*number of elements in the initial candidate list*/
-            mesh->detelemlen++;
-            cfg->isextdet = 1;
-            cfg->detnum = 0; // when detecting wide-field detectors, suppress point detectors
+            /*change the type of the source elements back to 0 to continue propagation, -2 is replaced by medianum+1 in loadmedia*/
+            if (k == 0) {
+                *type = 0;
+            }
         }
     }
 
+    mesh->srcelemlen = 0;
+    mesh->detelemlen = 0;
+
+    for (i = 0; i < nchunk; i++) {
+        mesh->srcelemlen += count[i * 2];
+        mesh->detelemlen += count[i * 2 + 1];
+    }
+
     /*Record the index of inital elements to initiate source search*/
-    /*Then change the type of initial elements back to 0 to continue propogation*/
     if (mesh->srcelemlen > 0 ||  mesh->detelemlen > 0) {
-        int is = 0, id = 0;
         mesh->srcelem = (int*)calloc(mesh->srcelemlen, sizeof(int));
         mesh->detelem = (int*)calloc(mesh->detelemlen, sizeof(int));
 
-        for (i = 0; i < mesh->ne; i++) {
-            if (mesh->type[i] < 0) {
-                if (mesh->type[i] == -1) {
-                    mesh->srcelem[is++] = i + 1;
-                    mesh->type[i] = 0;
-                } else if (mesh->type[i] == -2) { /*keep -2, will be replaced to medianum+1 in loadmedia*/
-                    mesh->detelem[id++] = i + 1;
-                }
+        for (i = 0; i < nchunk; i++) {
+            if (count[i * 2]) {
+                memcpy(mesh->srcelem + is, list[i * 2], count[i * 2] * sizeof(int));
+                is += count[i * 2];
+            }
+
+            if (count[i * 2 + 1]) {
+                memcpy(mesh->detelem + id, list[i * 2 + 1], count[i * 2 + 1] * sizeof(int));
+                id += count[i * 2 + 1];
             }
         }
     }
+
+    if (mesh->srcelemlen > 0) {
+        cfg->e0 = (cfg->e0 == 0) ? mesh->srcelem[0] : cfg->e0;
+    }
+
+    if (mesh->detelemlen > 0) {
+        cfg->isextdet = 1;
+        cfg->detnum = 0; // when detecting wide-field detectors, suppress point detectors
+    }
+
+    for (i = 0; i < nchunk * 2; i++) {
+        free(list[i]);
+    }
+
+    free(list);
+    free(count);
 }
 
 
 #ifndef MCX_CONTAINER
 
 /**
- * @brief Load node file and initialize the related mesh properties
+ * @brief Read a text mesh file into memory, memory-mapped if supported
  *
- * @param[in] mesh: the mesh object
- * @param[in] cfg: the simulation configuration structure
+ * @param[in] fname: the file name
+ * @param[out] len: the byte length of the file
+ *
+ * @return the file content, not null-terminated, or NULL if the file can not be opened
  */
 
-void mesh_loadnode(tetmesh* mesh, mcconfig* cfg) {
+static char* mesh_readtext(const char* fname, size_t* len) {
+    struct stat st;
+    char* buf;
+#ifdef _WIN32
     FILE* fp;
-    int tmp, len, i;
-    char fnode[MAX_FULL_PATH];
+#else
+    int fd;
+#endif
 
-    if (cfg->node && cfg->nodenum > 0) {
-        mesh->node = cfg->node;
-        mesh->nn = cfg->nodenum;
+    if (stat(fname, &st) != 0) {
+        return NULL;
+    }
 
-        if (cfg->method == rtBLBadouelGrid) {
-            mesh_createdualmesh(mesh, cfg);
-        }
+    *len = st.st_size;
 
-        return;
+#ifdef _WIN32
+
+    if ((fp = fopen(fname, "rb")) == NULL) {
+        return NULL;
     }
 
-    mesh_filenames("node_%s.dat", fnode, cfg);
+    buf = (char*)malloc(*len + 1);
 
-    if ((fp = fopen(fnode, "rt")) == NULL) {
-        MESH_ERROR("can not open node file");
+    if (*len && fread(buf, *len, 1, fp) != 1) {
+        MESH_ERROR("can not read the mesh file");
     }
 
-    len = fscanf(fp, "%d %d", &tmp, &(mesh->nn));
+    fclose(fp);
+#else
 
-    if (len != 2 || mesh->nn <= 0) {
-        MESH_ERROR("node file has wrong format");
+    if ((fd = open(fname, O_RDONLY)) < 0) {
+        return NULL;
     }
 
-    mesh->node = (FLOAT3*)calloc(sizeof(FLOAT3), mesh->nn);
+    buf = (*len) ? (char*)mmap(NULL, *len, PROT_READ, MAP_PRIVATE, fd, 0) : (char*)malloc(1);
+    close(fd);
 
-    for (i = 0; i < mesh->nn; i++) {
-        if (fscanf(fp, "%d %f %f %f", &tmp, &(mesh->node[i].x), &(mesh->node[i].y), &(mesh->node[i].z)) != 4) {
-            MESH_ERROR("node file has wrong format");
-        }
+    if (buf == MAP_FAILED) {
+        MESH_ERROR("can not map the mesh file");
     }
 
-    fclose(fp);
+#endif
+    return buf;
+}
 
-    if (cfg->method == rtBLBadouelGrid) {
-        mesh_createdualmesh(mesh, cfg);
+/**
+ * @brief Release a text mesh file read by mesh_readtext
+ */
+
+static void mesh_freetext(char* buf, size_t len) {
+#ifdef _WIN32
+    free(buf);
+#else
+
+    if (len) {
+        munmap(buf, len);
+    } else {
+        free(buf);
     }
+
+#endif
 }
 
 /**
- * @brief Load optical property file and initialize the related mesh properties
+ * @brief Parse a decimal integer of a text mesh file, leading white spaces are skipped
  *
- * @param[in] mesh: the mesh object
- * @param[in] cfg: the simulation configuration structure
+ * @return the position after the number, or NULL if no number is found
  */
 
-void mesh_loadmedia(tetmesh* mesh, mcconfig* cfg) {
-    FILE* fp = NULL;
-    int tmp, len, i;
-    char fmed[MAX_FULL_PATH];
+static const char* mesh_parseint(const char* p, const char* end, int* val) {
+    int sign = 1, v = 0;
+    const char* p0;
 
-    if (cfg->medianum == 0) {
-        mesh_filenames("prop_%s.dat", fmed, cfg);
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')) {
+        p++;
+    }
 
-        if ((fp = fopen(fmed, "rt")) == NULL) {
-            MESH_ERROR("can not open media property file");
+    if (p < end && (*p == '-' || *p == '+')) {
+        sign = (*p++ == '-') ? -1 : 1;
+    }
+
+    for (p0 = p; p < end && *p >= '0' && *p <= '9'; p++) {
+        v = v * 10 + (*p - '0');
+    }
+
+    if (p == p0) {
+        return NULL;
+    }
+
+    *val = sign * v;
+    return p;
+}
+
+/**
+ * @brief Parse a floating-point number of a text mesh file, leading white spaces are skipped
+ *
+ * Numbers with up to 19 significant digits and a decimal exponent within +/-22
+ * are converted with one exactly rounded double operation, and the rest (and
+ * the rare double values halfway between two floats) by strtof, so that the
+ * result always matches fscanf("%f").
+ *
+ * @return the position after the number, or NULL if no number is found
+ */
+
+static const char* mesh_parsefloat(const char* p, const char* end, float* val) {
+    static const double pow10[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+                                   1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+                                  };
+    const char* p0;
+    unsigned long long mant = 0;
+    int ndigit = 0, exp10 = 0, expval = 0, isneg = 0;
+    double v;
+    char token[64];
+
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')) {
+        p++;
+    }
+
+    p0 = p;
+
+    if (p < end && (*p == '-' || *p == '+')) {
+        isneg = (*p++ == '-');
+    }
+
+    for (; p < end && *p >= '0' && *p <= '9'; p++, ndigit++) {
+        mant = mant * 10 + (*p - '0');
+    }
+
+    if (p < end && *p == '.') {
+        for (p++; p < end && *p >= '0' && *p <= '9'; p++, ndigit++, exp10--) {
+            mant = mant * 10 + (*p - '0');
         }
+    }
 
-        len = fscanf(fp, "%d %d", &tmp, &(mesh->prop));
+    if (ndigit > 0 && p < end && (*p == 'e' || *p == 'E')) {
+        const char* pe = mesh_parseint(p + 1, end, &expval);
 
-        if (len != 2 || mesh->prop <= 0) {
-            MESH_ERROR("property file has wrong format");
+        if (pe && !(p[1] == ' ' || p[1] == '\t' || p[1] == '\n' || p[1] == '\r')) {
+            p = pe;
+            exp10 += expval;
         }
-    } else {
-        mesh->prop = cfg->medianum - 1;
     }
 
-    /*when there is an external detector, reindex the property to medianum+1*/
-    mesh->med = (medium*)calloc(sizeof(medium), mesh->prop + 1 + cfg->isextdet);
+    if (ndigit > 0 && ndigit <= 19 && exp10 >= -22 && exp10 <= 22 && mant < (1ULL << 53)) {
+        v = (exp10 >= 0) ? (double)mant * pow10[exp10] : (double)mant / pow10[-exp10];
+        union {
+            double d;
+            unsigned long long u;
+        } bits = {v};
+
+        /*a double exactly halfway between two floats would be rounded twice*/
+        if ((bits.u & 0x1FFFFFFFULL) != 0x10000000ULL) {
+            *val = (float)(isneg ? -v : v);
+            return p;
+        }
+    }
 
-    mesh->med[0].mua = 0.f;
-    mesh->med[0].mus = 0.f;
-    mesh->med[0].n = cfg->nout;
-    mesh->med[0].g = 1.f;
+    /*inf/nan, long or out-of-range numbers*/
+    ndigit = 0;
 
-    /*make medianum+1 the same as medium 0*/
-    if (cfg->isextdet) {
-        memcpy(mesh->med + mesh->prop + 1, mesh->med, sizeof(medium));
+    while (p0 + ndigit < end && ndigit < (int)sizeof(token) - 1 && !(p0[ndigit] == ' ' || p0[ndigit] == '\t' || p0[ndigit] == '\n' || p0[ndigit] == '\r')) {
+        token[ndigit] = p0[ndigit];
+        ndigit++;
+    }
 
-        for (i = 0; i < mesh->ne; i++) {
-            if (mesh->type[i] == -2) {
-                mesh->type[i] = mesh->prop + 1;
+    token[ndigit] = '\0';
+    *val = strtof(token, (char**)&p);
+
+    if (p == token) {
+        return NULL;
+    }
+
+    return p0 + (p - token);
+}
+
+/**
+ * @brief Parse the rows of a text mesh table
+ *
+ * Each row starts with skip integers (such as the row index) that are ignored,
+ * followed by ncol floats (stored in fval) or integers (stored in ival), and,
+ * if lastval is not NULL, one more integer stored in lastval. The values are
+ * separated by any white space, same as fscanf.
+ *
+ * @return the number of fully parsed rows
+ */
+
+static int mesh_parserows(const char* p, const char* end, int nrow, int skip, int ncol, float* fval, int* ival, int* lastval) {
+    int i, j, tmp;
+
+    for (i = 0; i < nrow; i++) {
+        for (j = 0; j < skip; j++) {
+            if ((p = mesh_parseint(p, end, &tmp)) == NULL) {
+                return i;
             }
         }
-    }
 
-    if (cfg->medianum == 0) {
-        for (i = 1; i <= mesh->prop; i++) {
-            if (fscanf(fp, "%d %f %f %f %f", &tmp, &(mesh->med[i].mua), &(mesh->med[i].mus),
-                       &(mesh->med[i].g), &(mesh->med[i].n)) != 5) {
-                MESH_ERROR("property file has wrong format");
+        for (j = 0; j < ncol; j++) {
+            p = (fval) ? mesh_parsefloat(p, end, fval + (size_t)i * ncol + j) : mesh_parseint(p, end, ival + (size_t)i * ncol + j);
+
+            if (p == NULL) {
+                return i;
             }
         }
 
-        fclose(fp);
-    } else {
-        memcpy(mesh->med, cfg->prop, sizeof(medium) * cfg->medianum);
+        if (lastval && (p = mesh_parseint(p, end, lastval + i)) == NULL) {
+            return i;
+        }
     }
 
-    if (cfg->method != rtBLBadouelGrid && cfg->unitinmm != 1.f) {
-        for (i = 1; i <= mesh->prop; i++) {
-            mesh->med[i].mus *= cfg->unitinmm;
-            mesh->med[i].mua *= cfg->unitinmm;
+    return i;
+}
+
+/**
+ * @brief Count the non-blank lines of a block of a text file
+ */
+
+static int mesh_countrows(const char* p, const char* end) {
+    int count = 0, isblank = 1;
+
+    for (; p < end; p++) {
+        if (*p == '\n') {
+            count += !isblank;
+            isblank = 1;
+        } else if (!(*p == ' ' || *p == '\t' || *p == '\r')) {
+            isblank = 0;
         }
     }
 
-    cfg->his.maxmedia = mesh->prop; /*skip media 0*/
+    return count + !isblank;
 }
 
 /**
- * @brief Load edge/node/face roi for implicit MMC
+ * @brief Parse a text mesh table in parallel
  *
- * @param[in] mesh: the mesh object
- * @param[in] cfg: the simulation configuration structure
+ * The text is split at line boundaries into one chunk per thread, and each chunk
+ * is parsed into its own rows. This requires one row per line; if the non-blank
+ * line number does not match nrow, the table is parsed sequentially instead.
+ *
+ * @return 0 if all nrow rows are parsed, 1 otherwise
  */
 
-void mesh_loadroi(tetmesh* mesh, mcconfig* cfg) {
-    FILE* fp;
-    int len, i, j, row, col;
-    float* pe = NULL;
-    char froi[MAX_FULL_PATH];
-
-    if (cfg->roidata && cfg->roitype != rtNone) {
-        if (cfg->roitype == rtEdge) {
-            row = mesh->ne;
-            col = 6;
-            mesh->edgeroi = (float*)malloc(sizeof(float) * row * col);
-            pe = mesh->edgeroi;
-            cfg->implicit = 1;
-        } else if (cfg->roitype == rtNode) {
-            row = mesh->nn;
-            col = 1;
-            mesh->noderoi = (float*)malloc(sizeof(float) * row * col);
-            pe = mesh->noderoi;
-            cfg->implicit = 1;
-        } else {
-            row = mesh->ne;
-            col = 4;
-            mesh->faceroi = (float*)malloc(sizeof(float) * row * col);
-            pe = mesh->faceroi;
-            cfg->implicit = 2;
-        }
+static int mesh_parsetable(const char* p, const char* end, int nrow, int skip, int ncol, float* fval, int* ival, int* lastval) {
+    int nchunk = 1, i, total = 0, err = 0;
+    const char** start;
+    int* rows;
 
-        memcpy(pe, cfg->roidata, sizeof(float) * row * col);
+#ifdef _OPENMP
+    nchunk = MAX(1, MIN(omp_get_max_threads(), (int)((end - p) / MMC_TEXT_CHUNK)));
+#endif
 
-        return;
+    if (nchunk == 1) {
+        return (mesh_parserows(p, end, nrow, skip, ncol, fval, ival, lastval) != nrow);
     }
 
-    mesh_filenames("roi_%s.dat", froi, cfg);
+    start = (const char**)malloc((nchunk + 1) * sizeof(char*));
+    rows = (int*)calloc(nchunk + 1, sizeof(int));
 
-    if ((fp = fopen(froi, "rt")) == NULL) {
-        return;
-    }
+    start[0] = p;
+    start[nchunk] = end;
 
-    len = fscanf(fp, "%d %d", &col, &row);
+    for (i = 1; i < nchunk; i++) {
+        const char* nl = p + (end - p) / nchunk * i;
 
-    if (len != 2 || (col != 1 && col != 4 && col != 6) || row <= 0) {
-        MESH_ERROR("roi file has wrong format");
+        nl = (nl < start[i - 1]) ? start[i - 1] : nl;
+        nl = (const char*)memchr(nl, '\n', end - nl);
+        start[i] = (nl) ? nl + 1 : end;
     }
 
-    if (col == 6) {
-        mesh->edgeroi = (float*)malloc(sizeof(float) * 6 * mesh->ne);
-        pe = mesh->edgeroi;
-        cfg->implicit = 1;
-    } else if (col == 1) {
-        mesh->noderoi = (float*)malloc(sizeof(float) * mesh->nn);
-        pe = mesh->noderoi;
-        cfg->implicit = 1;
-    } else if (col == 4) {
-        mesh->faceroi = (float*)malloc(sizeof(float) * 4 * mesh->ne);
-        pe = mesh->faceroi;
-        cfg->implicit = 2;
+    #pragma omp parallel for
+
+    for (i = 0; i < nchunk; i++) {
+        rows[i + 1] = mesh_countrows(start[i], start[i + 1]);
     }
 
-    for (i = 0; i < row; i++) {
-        for (j = 0; j < col; j++)
-            if (fscanf(fp, "%f", pe + j) != 1) {
-                break;
-            }
+    for (i = 0; i < nchunk; i++) {
+        total += rows[i + 1];
+        rows[i + 1] = total;
+    }
 
-        pe += col;
+    if (total != nrow) {
+        free(start);
+        free(rows);
+        return (mesh_parserows(p, end, nrow, skip, ncol, fval, ival, lastval) != nrow);
     }
 
-    fclose(fp);
+    #pragma omp parallel for reduction(|:err)
 
-    if (i < row) {
-        MESH_ERROR("roi file has wrong format");
+    for (i = 0; i < nchunk; i++) {
+        int len = rows[i + 1] - rows[i];
+
+        err |= (mesh_parserows(start[i], start[i + 1], len, skip, ncol,
+                               (fval) ? fval + (size_t)rows[i] * ncol : NULL, (ival) ? ival + (size_t)rows[i] * ncol : NULL,
+                               (lastval) ? lastval + rows[i] : NULL) != len);
     }
+
+    free(start);
+    free(rows);
+    return err;
 }
 
 /**
- * @brief Load element file and initialize the related mesh properties
+ * @brief Load node file and initialize the related mesh properties
  *
  * @param[in] mesh: the mesh object
  * @param[in] cfg: the simulation configuration structure
  */
 
-void mesh_loadelem(tetmesh* mesh, mcconfig* cfg) {
-    FILE* fp;
-    int tmp, len, i, j, datalen;
-    int* pe;
-    char felem[MAX_FULL_PATH];
+void mesh_loadnode(tetmesh* mesh, mcconfig* cfg) {
+    int tmp;
+    char fnode[MAX_FULL_PATH], *buf;
+    const char* p;
+    size_t len;
 
     if (cfg->node && cfg->nodenum > 0) {
-        mesh->ne = cfg->elemnum;
-        mesh->elemlen = cfg->elemlen;
-
-        mesh->elem = (int*)malloc(sizeof(int) * mesh->elemlen * mesh->ne);
-        mesh->type = (int*)malloc(sizeof(int ) * mesh->ne);
-
-        datalen = (cfg->method == rtBLBadouelGrid) ? cfg->crop0.z : ( (cfg->basisorder) ? mesh->nn : mesh->ne);
-        mesh->weight = (double*)calloc(sizeof(double) * datalen, cfg->maxgate * cfg->srcnum);
-
-        for (i = 0; i < mesh->ne; i++) {
-            for (j = 0; j < mesh->elemlen; j++) {
-                mesh->elem[i * mesh->elemlen + j] = cfg->elem[i * (mesh->elemlen + 1) + j];
-            }
+        mesh->node = cfg->node;
+        mesh->nn = cfg->nodenum;
 
-            mesh->type[i] = cfg->elem[i * (mesh->elemlen + 1) + mesh->elemlen];
+        if (cfg->method == rtBLBadouelGrid) {
+            mesh_createdualmesh(mesh, cfg);
         }
 
-        mesh_srcdetelem(mesh, cfg);
         return;
     }
 
-    mesh_filenames("elem_%s.dat", felem, cfg);
+    mesh_filenames("node_%s.dat", fnode, cfg);
 
-    if ((fp = fopen(felem, "rt")) == NULL) {
-        MESH_ERROR("can not open element file");
+    if ((buf = mesh_readtext(fnode, &len)) == NULL) {
+        MESH_ERROR("can not open node file");
     }
 
-    len = fscanf(fp, "%d %d", &(mesh->elemlen), &(mesh->ne));
-
-    if (len != 2 || mesh->ne <= 0) {
-        MESH_ERROR("element file has wrong format");
-    }
+    p = mesh_parseint(buf, buf + len, &tmp);
+    p = (p) ? mesh_parseint(p, buf + len, &(mesh->nn)) : NULL;
 
-    if (mesh->elemlen < 4) {
-        mesh->elemlen = 4;
+    if (p == NULL || mesh->nn <= 0) {
+        MESH_ERROR("node file has wrong format");
     }
 
-    mesh->elem = (int*)malloc(sizeof(int) * mesh->elemlen * mesh->ne);
-    mesh->type = (int*)malloc(sizeof(int ) * mesh->ne);
-
-    datalen = (cfg->method == rtBLBadouelGrid) ? cfg->crop0.z : ( (cfg->basisorder) ? mesh->nn : mesh->ne);
-    mesh->weight = (double*)calloc(sizeof(double) * datalen, cfg->maxgate * cfg->srcnum);
-
-    for (i = 0; i < mesh->ne; i++) {
-        pe = mesh->elem + i * mesh->elemlen;
-
-        if (fscanf(fp, "%d", &tmp) != 1) {
-            break;
-        }
-
-        for (j = 0; j < mesh->elemlen; j++)
-            if (fscanf(fp, "%d", pe + j) != 1) {
-                break;
-            }
+    mesh->node = (FLOAT3*)calloc(sizeof(FLOAT3), mesh->nn);
 
-        if (fscanf(fp, "%d", mesh->type + i) != 1) {
-            break;
-        }
+    if (mesh_parsetable(p, buf + len, mesh->nn, 1, 3, (float*)mesh->node, NULL, NULL)) {
+        MESH_ERROR("node file has wrong format");
     }
 
-    fclose(fp);
+    mesh_freetext(buf, len);
 
-    if (i < mesh->ne) {
-        MESH_ERROR("element file has wrong format");
+    if (cfg->method == rtBLBadouelGrid) {
+        mesh_createdualmesh(mesh, cfg);
     }
-
-    mesh_srcdetelem(mesh, cfg);
 }
 
 /**
- * @brief Load tet element volume file and initialize the related mesh properties
+ * @brief Load optical property file and initialize the related mesh properties
  *
  * @param[in] mesh: the mesh object
  * @param[in] cfg: the simulation configuration structure
  */
 
-void mesh_loadelemvol(tetmesh* mesh, mcconfig* cfg) {
-    FILE* fp;
-    int tmp, len, i, j, *ee;
-    char fvelem[MAX_FULL_PATH];
+void mesh_loadmedia(tetmesh* mesh, mcconfig* cfg) {
+    FILE* fp = NULL;
+    int tmp, len, i;
+    char fmed[MAX_FULL_PATH];
 
-    mesh_filenames("velem_%s.dat", fvelem, cfg);
+    if (cfg->medianum == 0) {
+        mesh_filenames("prop_%s.dat", fmed, cfg);
 
-    if ((cfg->elem && cfg->elemnum && cfg->node && cfg->nodenum) || (fp = fopen(fvelem, "rt")) == NULL) {
-        mesh_getvolume(mesh, cfg);
-        return;
-    }
+        if ((fp = fopen(fmed, "rt")) == NULL) {
+            MESH_ERROR("can not open media property file");
+        }
 
-    len = fscanf(fp, "%d %d", &tmp, &(mesh->ne));
+        len = fscanf(fp, "%d %d", &tmp, &(mesh->prop));
 
-    if (len != 2 || mesh->ne <= 0) {
-        MESH_ERROR("mesh file has wrong format");
+        if (len != 2 || mesh->prop <= 0) {
+            MESH_ERROR("property file has wrong format");
+        }
+    } else {
+        mesh->prop = cfg->medianum - 1;
     }
 
-    mesh->evol = (float*)malloc(sizeof(float) * mesh->ne);
-    mesh->nvol = (float*)calloc(sizeof(float), mesh->nn);
+    /*when there is an external detector, reindex the property to medianum+1*/
+    mesh->med = (medium*)calloc(sizeof(medium), mesh->prop + 1 + cfg->isextdet);
 
-    for (i = 0; i < mesh->ne; i++) {
-        if (fscanf(fp, "%d %f", &tmp, mesh->evol + i) != 2) {
-            MESH_ERROR("mesh file has wrong format");
+    mesh->med[0].mua = 0.f;
+    mesh->med[0].mus = 0.f;
+    mesh->med[0].n = cfg->nout;
+    mesh->med[0].g = 1.f;
+
+    /*make medianum+1 the same as medium 0*/
+    if (cfg->isextdet) {
+        memcpy(mesh->med + mesh->prop + 1, mesh->med, sizeof(medium));
+
+        #pragma omp parallel for schedule(static)
+
+        for (i = 0; i < mesh->ne; i++) {
+            if (mesh->type[i] == -2) {
+                mesh->type[i] = mesh->prop + 1;
+            }
         }
+    }
 
-        if (mesh->type[i] == 0) {
-            continue;
+    if (cfg->medianum == 0) {
+        for (i = 1; i <= mesh->prop; i++) {
+            if (fscanf(fp, "%d %f %f %f %f", &tmp, &(mesh->med[i].mua), &(mesh->med[i].mus),
+                       &(mesh->med[i].g), &(mesh->med[i].n)) != 5) {
+                MESH_ERROR("property file has wrong format");
+            }
         }
 
-        ee = (int*)(mesh->elem + i * mesh->elemlen);
+        fclose(fp);
+    } else {
+        memcpy(mesh->med, cfg->prop, sizeof(medium) * cfg->medianum);
+    }
 
-        for (j = 0; j < mesh->elemlen; j++) {
-            mesh->nvol[ee[j] - 1] += mesh->evol[i] * 0.25f;
+    if (cfg->method != rtBLBadouelGrid && cfg->unitinmm != 1.f) {
+        for (i = 1; i <= mesh->prop; i++) {
+            mesh->med[i].mus *= cfg->unitinmm;
+            mesh->med[i].mua *= cfg->unitinmm;
         }
     }
 
-    fclose(fp);
-}
+    cfg->his.maxmedia = mesh->prop; /*skip media 0*/
 
+    mesh_loadwavemedia(mesh, cfg);
+}
 
 /**
- * @brief Load face-neightbor element list and initialize the related mesh properties
+ * @brief Load the emission media and the fluorescence yields of --emission
+ *
+ * cfg->emitfile is a text file in the format of the property file, whose
+ * header is the media number, followed by "id mua mus g n yield" of each
+ * medium at the emission wavelength; yield is the share of the excitation
+ * energy absorbed in the medium that is re-emitted, i.e. the absorption of
+ * the fluorophore over the total absorption, times its quantum yield.
  *
  * @param[in] mesh: the mesh object
  * @param[in] cfg: the simulation configuration structure
+ * @param[out] med: the emission media, mesh->prop+1 entries, not scaled by cfg->unitinmm
+ * @param[out] yield: the fluorescence yield of each medium, mesh->prop+1 entries, 0 for medium 0
  */
 
-void mesh_loadfaceneighbor(tetmesh* mesh, mcconfig* cfg) {
+void mesh_loademission(tetmesh* mesh, mcconfig* cfg, medium* med, float* yield) {
     FILE* fp;
-    int len, i, j;
-    int* pe;
-    char ffacenb[MAX_FULL_PATH];
+    int i, tmp, nmed;
 
-    mesh_filenames("facenb_%s.dat", ffacenb, cfg);
-
-    if ((cfg->elem && cfg->elemnum) || (fp = fopen(ffacenb, "rt")) == NULL) {
-        mesh_getfacenb(mesh, cfg);
-        return;
-    }
-
-    len = fscanf(fp, "%d %d", &(mesh->elemlen), &(mesh->ne));
-
-    if (len != 2 || mesh->ne <= 0) {
-        MESH_ERROR("mesh file has wrong format");
+    if ((fp = fopen(cfg->emitfile, "rt")) == NULL) {
+        MESH_ERROR("can not open the emission property file");
     }
 
-    if (mesh->elemlen < 4) {
-        mesh->elemlen = 4;
+    if (fscanf(fp, "%d", &nmed) != 1 || nmed != mesh->prop) {
+        MESH_ERROR("emission property file has wrong format or a different media number");
     }
 
-    mesh->facenb = (int*)malloc(sizeof(int) * mesh->elemlen * mesh->ne);
-
-    for (i = 0; i < mesh->ne; i++) {
-        pe = mesh->facenb + i * mesh->elemlen;
+    memcpy(med, mesh->med, sizeof(medium));
+    yield[0] = 0.f;
 
-        for (j = 0; j < mesh->elemlen; j++)
-            if (fscanf(fp, "%d", pe + j) != 1) {
-                MESH_ERROR("face-neighbor list file has wrong format");
-            }
+    for (i = 1; i <= mesh->prop; i++) {
+        if (fscanf(fp, "%d %f %f %f %f %f", &tmp, &(med[i].mua), &(med[i].mus), &(med[i].g), &(med[i].n), yield + i) != 6 || yield[i] < 0.f) {
+            MESH_ERROR("emission property file has wrong format");
+        }
     }
 
     fclose(fp);
 }
 
 /**
- * @brief Load previously saved photon seeds from an .mch file for replay
+ * @brief Load the optical properties of the additional wavelengths
  *
- * @param[in] mesh: the mesh object
- * @param[in] cfg: the simulation configuration structure
+ * In the multi-wavelength mode, all wavelengths share the photon paths sampled
+ * with the media of the 1st wavelength (mesh->med), the mua/mus of the 2nd to
+ * the last wavelengths only rescale the photon weights. They are read from
+ * cfg->wavefile, a text file in the format of the property file whose header
+ * is "wavenum-1 medianum", or copied from cfg->waveprop, which lists medium 0
+ * in every block like cfg->prop. The output buffer is resized to hold one
+ * block of time gates per wavelength.
+ *
+ * @param[in,out] mesh: the mesh object
+ * @param[in,out] cfg: the simulation configuration structure
  */
 
-void mesh_loadseedfile(tetmesh* mesh, mcconfig* cfg) {
-    history his;
-    FILE* fp = fopen(cfg->seedfile, "rb");
-
-    if (fp == NULL) {
-        MESH_ERROR("can not open the specified history file");
-    }
-
-    if (fread(&his, sizeof(history), 1, fp) != 1) {
-        MESH_ERROR("error when reading the history file");
-    }
+void mesh_loadwavemedia(tetmesh* mesh, mcconfig* cfg) {
+    int i, k, tmp, nwave, medlen = mesh->prop + 1 + cfg->isextdet;
+    size_t datalen;
+    medium* med;
 
-    if (his.savedphoton == 0 || his.seedbyte == 0) {
-        fclose(fp);
+    if (cfg->wavefile[0] == '\0' && cfg->waveproplen == 0) {
         return;
     }
 
-    if (his.maxmedia != mesh->prop) {
-        MESH_ERROR("the history file was generated with a different media setting");
+    if (cfg->seed == SEED_FROM_FILE) {
+        MESH_ERROR("the multi-wavelength mode can not be used to replay photons");
     }
 
-    if (fseek(fp, his.savedphoton * his.colcount * sizeof(float), SEEK_CUR)) {
-        MESH_ERROR("illegal history file");
+    if ((cfg->compute != cbSSE && cfg->gpuid <= MAX_DEVICE) || cfg->method == rtBLBadouelGrid) {
+        MESH_ERROR("the multi-wavelength mode only supports the CPU simulation (-c sse) with the P, H, B or S ray-tracer (-M)");
     }
 
-    cfg->photonseed = malloc(his.savedphoton * his.seedbyte);
-
-    if (cfg->photonseed == NULL) {
-        MESH_ERROR("can not allocate memory");
+    if (cfg->mcmethod != mmMCX || cfg->srcnum > 1) {
+        MESH_ERROR("the multi-wavelength mode requires the MCX-style weight update (-m 0) and a single source pattern");
     }
 
-    if (fread(cfg->photonseed, his.seedbyte, his.savedphoton, fp) != his.savedphoton) {
-        MESH_ERROR("error when reading the seed data");
+    if (mesh->wavemed) {
+        free(mesh->wavemed);
+        mesh->wavemed = NULL;
     }
 
-    cfg->seed = SEED_FROM_FILE;
-    cfg->nphoton = his.savedphoton;
+    if (cfg->wavefile[0]) {
+        FILE* fp;
+        int nmed;
 
-    if (cfg->outputtype == otJacobian || cfg->outputtype == otWL || cfg->outputtype == otWP || cfg->replaydet > 0) {
-        int i, j;
-        float* ppath = (float*)malloc(his.savedphoton * his.colcount * sizeof(float));
-        cfg->replayweight = (float*)malloc(his.savedphoton * sizeof(float));
-        cfg->replaytime = (float*)malloc(his.savedphoton * sizeof(float));
-        fseek(fp, sizeof(his), SEEK_SET);
+        if ((fp = fopen(cfg->wavefile, "rt")) == NULL) {
+            MESH_ERROR("can not open multi-wavelength property file");
+        }
 
-        if (fread(ppath, his.colcount * sizeof(float), his.savedphoton, fp) != his.savedphoton) {
-            MESH_ERROR("error when reading the partial path data");
+        if (fscanf(fp, "%d %d", &nwave, &nmed) != 2 || nwave <= 0 || nmed != mesh->prop) {
+            MESH_ERROR("multi-wavelength property file has wrong format or a different media number");
         }
 
-        cfg->nphoton = 0;
+        mesh->wavemed = (medium*)calloc(sizeof(medium), nwave * medlen);
 
-        for (i = 0; i < his.savedphoton; i++)
-            if (cfg->replaydet == 0 || cfg->replaydet == (int)(ppath[i * his.colcount])) {
-                memcpy((char*)(cfg->photonseed) + cfg->nphoton * his.seedbyte, (char*)(cfg->photonseed) + i * his.seedbyte, his.seedbyte);
+        for (k = 0; k < nwave; k++) {
+            med = mesh->wavemed + k * medlen;
 
-                // replay with wide-field detection pattern, the partial path has to contain photon exit information
-                if ((cfg->detparam1.w * cfg->detparam2.w > 0) && (cfg->detpattern != NULL)) {
-                    cfg->replayweight[cfg->nphoton] = mesh_getdetweight(i, his.colcount, ppath, cfg);
-                } else {
-                    cfg->replayweight[cfg->nphoton] = ppath[(i + 1) * his.colcount - 1];
+            for (i = 1; i <= mesh->prop; i++) {
+                if (fscanf(fp, "%d %f %f %f %f", &tmp, &(med[i].mua), &(med[i].mus), &(med[i].g), &(med[i].n)) != 5) {
+                    MESH_ERROR("multi-wavelength property file has wrong format");
                 }
+            }
+        }
 
-                for (j = 2; j < his.maxmedia + 2; j++) {
-                    cfg->replayweight[cfg->nphoton] *= expf(-mesh->med[j - 1].mua * ppath[i * his.colcount + j] * his.unitinmm);
-                }
+        fclose(fp);
+    } else {
+        if (cfg->waveprop == NULL || cfg->waveproplen % (mesh->prop + 1)) {
+            MESH_ERROR("the length of waveprop must be a multiple of the media number");
+        }
 
-                cfg->replaytime[cfg->nphoton] = 0.f;
+        nwave = cfg->waveproplen / (mesh->prop + 1);
+        mesh->wavemed = (medium*)calloc(sizeof(medium), nwave * medlen);
 
-                for (j = 2; j < his.maxmedia + 2; j++) {
-                    cfg->replaytime[cfg->nphoton] += mesh->med[j - 1].n * ppath[i * his.colcount + j] * R_C0;
-                }
+        for (k = 0; k < nwave; k++) {
+            memcpy(mesh->wavemed + k * medlen, cfg->waveprop + k * (mesh->prop + 1), sizeof(medium) * (mesh->prop + 1));
+        }
+    }
 
-                cfg->nphoton++;
-            }
+    for (k = 0; k < nwave; k++) {
+        med = mesh->wavemed + k * medlen;
 
-        free(ppath);
-        cfg->photonseed = realloc(cfg->photonseed, cfg->nphoton * his.seedbyte);
-        cfg->replayweight = (float*)realloc(cfg->replayweight, cfg->nphoton * sizeof(float));
-        cfg->replaytime = (float*)realloc(cfg->replaytime, cfg->nphoton * sizeof(float));
-        cfg->minenergy = 0.f;
+        /*medium 0, and the external detector medium, stay the same as the 1st wavelength*/
+        memcpy(med, mesh->med, sizeof(medium));
+
+        if (cfg->isextdet) {
+            memcpy(med + mesh->prop + 1, mesh->med, sizeof(medium));
+        }
+
+        for (i = 1; i <= mesh->prop; i++) {
+            med[i].mus *= cfg->unitinmm;
+            med[i].mua *= cfg->unitinmm;
+        }
     }
 
-    fclose(fp);
-}
+    cfg->wavenum = nwave + 1;
 
-#endif
+    /*the output buffer was sized for one wavelength*/
+    if (mesh->weight) {
+        datalen = (cfg->basisorder) ? mesh->nn : mesh->ne;
+        free(mesh->weight);
+        mesh->weight = (double*)calloc(sizeof(double) * datalen * cfg->srcnum, cfg->maxgate * cfg->wavenum);
+    }
+}
 
 /**
- * @brief Compute the tetrahedron and nodal volumes if not provided
+ * @brief Load edge/node/face roi for implicit MMC
  *
  * @param[in] mesh: the mesh object
  * @param[in] cfg: the simulation configuration structure
  */
 
+void mesh_loadroi(tetmesh* mesh, mcconfig* cfg) {
+    FILE* fp;
+    int len, i, j, row, col;
+    float* pe = NULL;
+    char froi[MAX_FULL_PATH];
 
-void mesh_getvolume(tetmesh* mesh, mcconfig* cfg) {
-    float dx, dy, dz;
-    int i, j;
+    if (cfg->roidata && cfg->roitype != rtNone) {
+        if (cfg->roitype == rtEdge) {
+            row = mesh->ne;
+            col = 6;
+            mesh->edgeroi = (float*)malloc(sizeof(float) * row * col);
+            pe = mesh->edgeroi;
+            cfg->implicit = 1;
+        } else if (cfg->roitype == rtNode) {
+            row = mesh->nn;
+            col = 1;
+            mesh->noderoi = (float*)malloc(sizeof(float) * row * col);
+            pe = mesh->noderoi;
+            cfg->implicit = 1;
+        } else {
+            row = mesh->ne;
+            col = 4;
+            mesh->faceroi = (float*)malloc(sizeof(float) * row * col);
+            pe = mesh->faceroi;
+            cfg->implicit = 2;
+        }
 
-    mesh->evol = (float*)calloc(sizeof(float), mesh->ne);
-    mesh->nvol = (float*)calloc(sizeof(float), mesh->nn);
+        memcpy(pe, cfg->roidata, sizeof(float) * row * col);
 
-    for (i = 0; i < mesh->ne; i++) {
-        int* ee = (int*)(mesh->elem + i * mesh->elemlen);
+        return;
+    }
 
-        dx = mesh->node[ee[2] - 1].x - mesh->node[ee[3] - 1].x;
-        dy = mesh->node[ee[2] - 1].y - mesh->node[ee[3] - 1].y;
-        dz = mesh->node[ee[2] - 1].z - mesh->node[ee[3] - 1].z;
+    mesh_filenames("roi_%s.dat", froi, cfg);
 
-        mesh->evol[i] = mesh->node[ee[1] - 1].x * (mesh->node[ee[2] - 1].y * mesh->node[ee[3] - 1].z - mesh->node[ee[2] - 1].z * mesh->node[ee[3] - 1].y)
-                        - mesh->node[ee[1] - 1].y * (mesh->node[ee[2] - 1].x * mesh->node[ee[3] - 1].z - mesh->node[ee[2] - 1].z * mesh->node[ee[3] - 1].x)
-                        + mesh->node[ee[1] - 1].z * (mesh->node[ee[2] - 1].x * mesh->node[ee[3] - 1].y - mesh->node[ee[2] - 1].y * mesh->node[ee[3] - 1].x);
-        mesh->evol[i] += -mesh->node[ee[0] - 1].x * ((mesh->node[ee[2] - 1].y * mesh->node[ee[3] - 1].z - mesh->node[ee[2] - 1].z * mesh->node[ee[3] - 1].y) + mesh->node[ee[1] - 1].y * dz - mesh->node[ee[1] - 1].z * dy);
-        mesh->evol[i] += +mesh->node[ee[0] - 1].y * ((mesh->node[ee[2] - 1].x * mesh->node[ee[3] - 1].z - mesh->node[ee[2] - 1].z * mesh->node[ee[3] - 1].x) + mesh->node[ee[1] - 1].x * dz - mesh->node[ee[1] - 1].z * dx);
-        mesh->evol[i] += -mesh->node[ee[0] - 1].z * ((mesh->node[ee[2] - 1].x * mesh->node[ee[3] - 1].y - mesh->node[ee[2] - 1].y * mesh->node[ee[3] - 1].x) + mesh->node[ee[1] - 1].x * dy - mesh->node[ee[1] - 1].y * dx);
-        mesh->evol[i] = -mesh->evol[i];
+    if ((fp = fopen(froi, "rt")) == NULL) {
+        return;
+    }
 
-        if (mesh->evol[i] < 0.f) {
-            int e1 = ee[3];
-            ee[3] = ee [2];
-            ee[2] = e1;
-            mesh->evol[i] = -mesh->evol[i];
-        }
+    len = fscanf(fp, "%d %d", &col, &row);
 
-        mesh->evol[i] *= (1.f / 6.f);
+    if (len != 2 || (col != 1 && col != 4 && col != 6) || row <= 0) {
+        MESH_ERROR("roi file has wrong format");
+    }
 
-        if (mesh->type[i] == 0) {
-            continue;
-        }
+    if (col == 6) {
+        mesh->edgeroi = (float*)malloc(sizeof(float) * 6 * mesh->ne);
+        pe = mesh->edgeroi;
+        cfg->implicit = 1;
+    } else if (col == 1) {
+        mesh->noderoi = (float*)malloc(sizeof(float) * mesh->nn);
+        pe = mesh->noderoi;
+        cfg->implicit = 1;
+    } else if (col == 4) {
+        mesh->faceroi = (float*)malloc(sizeof(float) * 4 * mesh->ne);
+        pe = mesh->faceroi;
+        cfg->implicit = 2;
+    }
 
-        for (j = 0; j < mesh->elemlen; j++) {
-            mesh->nvol[ee[j] - 1] += mesh->evol[i] * 0.25f;
-        }
+    for (i = 0; i < row; i++) {
+        for (j = 0; j < col; j++)
+            if (fscanf(fp, "%f", pe + j) != 1) {
+                break;
+            }
+
+        pe += col;
+    }
+
+    fclose(fp);
+
+    if (i < row) {
+        MESH_ERROR("roi file has wrong format");
     }
 }
 
 /**
- * @brief Scan all tetrahedral elements to find the one enclosing the source
+ * @brief Load the per-element optical properties of --elemprop
+ *
+ * The text file starts with "4 len", followed by len rows of "mua mus g n"
+ * (mua and mus in 1/mm). If len is the element count, each row is the medium
+ * of an element; if len is the node count, the properties are given at the
+ * nodes and each element keeps their mean, i.e. the volume average of the
+ * linear interpolant in the element. The labels still tag the elements (ROIs,
+ * importance), but the media of mesh->elemmed replace those of
+ * the labels in the tracing and the normalization, and are read from the
+ * global memory on the GPU, so their number is not limited by MAX_PROP.
  *
  * @param[in] mesh: the mesh object
  * @param[in] cfg: the simulation configuration structure
- *
- * @return 0 if an enclosing element is found, 1 if not found
  */
 
-int mesh_initelem(tetmesh* mesh, mcconfig* cfg) {
-    FLOAT3* nodes = mesh->node;
-    int i, j;
+void mesh_loadelemprop(tetmesh* mesh, mcconfig* cfg) {
+    FILE* fp;
+    int col, row, i, j;
+    medium* buf;
 
-    for (i = 0; i < mesh->ne; i++) {
-        double pmin[3] = {VERY_BIG, VERY_BIG, VERY_BIG}, pmax[3] = {-VERY_BIG, -VERY_BIG, -VERY_BIG};
-        int* elems = (int*)(mesh->elem + i * mesh->elemlen); // convert int4* to int*
+    if (cfg->elempropfile[0] == '\0') {
+        return;
+    }
 
-        for (j = 0; j < mesh->elemlen; j++) {
-            pmin[0] = MIN(nodes[elems[j] - 1].x, pmin[0]);
-            pmin[1] = MIN(nodes[elems[j] - 1].y, pmin[1]);
-            pmin[2] = MIN(nodes[elems[j] - 1].z, pmin[2]);
+    if (cfg->implicit) {
+        MESH_ERROR("--elemprop does not support the implicit ROIs");
+    }
+
+    if ((fp = fopen(cfg->elempropfile, "rt")) == NULL) {
+        MESH_ERROR("can not open the per-element property file of --elemprop");
+    }
+
+    if (fscanf(fp, "%d %d", &col, &row) != 2 || col != 4 || (row != mesh->ne && row != mesh->nn)) {
+        fclose(fp);
+        MESH_ERROR("the --elemprop file must start with '4 len', len being the element or the node count");
+    }
+
+    buf = (medium*)malloc(sizeof(medium) * row);
+
+    for (i = 0; i < row; i++) {
+        if (fscanf(fp, "%f %f %f %f", &(buf[i].mua), &(buf[i].mus), &(buf[i].g), &(buf[i].n)) != 4) {
+            free(buf);
+            fclose(fp);
+            MESH_ERROR("the --elemprop file has wrong format");
+        }
 
-            pmax[0] = MAX(nodes[elems[j] - 1].x, pmax[0]);
-            pmax[1] = MAX(nodes[elems[j] - 1].y, pmax[1]);
-            pmax[2] = MAX(nodes[elems[j] - 1].z, pmax[2]);
+        if (buf[i].mua < 0.f || buf[i].mus < 0.f || buf[i].n <= 0.f || buf[i].g < -1.f || buf[i].g > 1.f) {
+            free(buf);
+            fclose(fp);
+            MESH_ERROR("the --elemprop file contains invalid optical properties");
         }
+    }
 
-        if (cfg->srcpos.x <= pmax[0] && cfg->srcpos.x >= pmin[0] &&
-                cfg->srcpos.y <= pmax[1] && cfg->srcpos.y >= pmin[1] &&
-                cfg->srcpos.z <= pmax[2] && cfg->srcpos.z >= pmin[2]) {
+    fclose(fp);
 
-            if (mesh_barycentric(i + 1, &(cfg->bary0.x), (FLOAT3*) & (cfg->srcpos), mesh) == 0) {
-                cfg->e0 = i + 1;
-                return 0;
+    if (row == mesh->ne) {
+        mesh->elemmed = buf;
+    } else {
+        mesh->elemmed = (medium*)calloc(mesh->ne, sizeof(medium));
+
+        for (i = 0; i < mesh->ne; i++) {
+            int* ee = mesh->elem + (size_t)i * mesh->elemlen;
+            medium* med = mesh->elemmed + i;
+
+            for (j = 0; j < 4; j++) {
+                med->mua += buf[ee[j] - 1].mua * 0.25f;
+                med->mus += buf[ee[j] - 1].mus * 0.25f;
+                med->g += buf[ee[j] - 1].g * 0.25f;
+                med->n += buf[ee[j] - 1].n * 0.25f;
             }
         }
+
+        free(buf);
     }
 
-    return 1;
-}
+    for (i = 0; i < mesh->ne; i++) {
+        mesh->elemmed[i].mua *= cfg->unitinmm;
+        mesh->elemmed[i].mus *= cfg->unitinmm;
+    }
 
+    MMCDEBUG(cfg, dlTime, (cfg->flog, "loaded the %s-based media of %d elements from %s\n", (row == mesh->ne) ? "element" : "node", mesh->ne, cfg->elempropfile));
+}
 
 /**
- * @brief Compute the barycentric coordinate of the source in the initial element
- *
- * @param[in] e0: the index (start from 1) of the initial element
- * @param[in] bary: the index (start from 1) of the initial element
- * @param[in] srcpos: the source position
- * @param[in] mesh: the mesh of the domain
+ * @brief Load element file and initialize the related mesh properties
  *
- * @return 0 if all barycentric coordinates are computed and all positive, or 1 any of those is negative
+ * @param[in] mesh: the mesh object
+ * @param[in] cfg: the simulation configuration structure
  */
 
-int mesh_barycentric(int e0, float* bary, FLOAT3* srcpos, tetmesh* mesh) {
-    int eid = e0 - 1, i;
-    FLOAT3 vecS = {0.f}, vecAB, vecAC, vecN;
-    FLOAT3* nodes = mesh->node;
-    int ea, eb, ec;
-    float s = 0.f;
-    int* elems = (int*)(mesh->elem + eid * mesh->elemlen); // convert int4* to int*
+void mesh_loadelem(tetmesh* mesh, mcconfig* cfg) {
+    int i, j;
+    char felem[MAX_FULL_PATH], *buf;
+    const char* p;
+    size_t len;
 
-    if (eid >= mesh->ne) {
-        MESH_ERROR("initial element index exceeds total element count");
+    if (cfg->node && cfg->nodenum > 0) {
+        mesh->ne = cfg->elemnum;
+        mesh->elemlen = cfg->elemlen;
+
+        mesh->elem = (int*)malloc(sizeof(int) * mesh->elemlen * mesh->ne);
+        mesh->type = (int*)malloc(sizeof(int ) * mesh->ne);
+
+        mesh_initweight(mesh, cfg);
+
+        for (i = 0; i < mesh->ne; i++) {
+            for (j = 0; j < mesh->elemlen; j++) {
+                mesh->elem[i * mesh->elemlen + j] = cfg->elem[i * (mesh->elemlen + 1) + j];
+            }
+
+            mesh->type[i] = cfg->elem[i * (mesh->elemlen + 1) + mesh->elemlen];
+        }
+
+        mesh_srcdetelem(mesh, cfg);
+        return;
     }
 
-    for (i = 0; i < 4; i++) {
-        ea = elems[out[i][0]] - 1;
-        eb = elems[out[i][1]] - 1;
-        ec = elems[out[i][2]] - 1;
-        vec_diff3(&nodes[ea], &nodes[eb], &vecAB);
-        vec_diff3(&nodes[ea], &nodes[ec], &vecAC);
-        vec_diff3(&nodes[ea], srcpos, &vecS);
-        vec_cross3(&vecAB, &vecAC, &vecN);
-        bary[facemap[i]] = -vec_dot3(&vecS, &vecN);
+    mesh_filenames("elem_%s.dat", felem, cfg);
+
+    if ((buf = mesh_readtext(felem, &len)) == NULL) {
+        MESH_ERROR("can not open element file");
     }
 
-    for (i = 0; i < 4; i++) {
-        if (bary[i] < 0.f) {
-            return 1;
-        }
+    p = mesh_parseint(buf, buf + len, &(mesh->elemlen));
+    p = (p) ? mesh_parseint(p, buf + len, &(mesh->ne)) : NULL;
 
-        s += bary[i];
+    if (p == NULL || mesh->ne <= 0) {
+        MESH_ERROR("element file has wrong format");
     }
 
-    for (i = 0; i < 4; i++) {
-        bary[i] /= s;
+    if (mesh->elemlen < 4) {
+        mesh->elemlen = 4;
     }
 
-    return 0;
-}
+    mesh->elem = (int*)malloc(sizeof(int) * mesh->elemlen * mesh->ne);
+    mesh->type = (int*)malloc(sizeof(int ) * mesh->ne);
 
-/**
- * @brief Initialize a data structure storing all pre-computed ray-tracing related data
- *
- * the pre-computed ray-tracing data include
- * d: the vector of the 6 edges
- * m: the cross-product of the end-nodes of the 6-edges n1 x n2
- * n: the normal vector of the 4 facets, pointing outwards
- *
- * @param[out] tracer: the ray-tracer data structure
- * @param[in] pmesh: the mesh object
- * @param[in] methodid: the ray-tracing algorithm to be used
- */
+    mesh_initweight(mesh, cfg);
 
-void tracer_init(raytracer* tracer, tetmesh* pmesh, char methodid) {
-    tracer->d = NULL;
-    tracer->m = NULL;
-    tracer->n = NULL;
-    tracer->mesh = pmesh;
-    tracer->method = methodid;
-    tracer_build(tracer);
-}
+    if (mesh_parsetable(p, buf + len, mesh->ne, 1, mesh->elemlen, NULL, mesh->elem, mesh->type)) {
+        MESH_ERROR("element file has wrong format");
+    }
 
+    mesh_freetext(buf, len);
+
+    mesh_srcdetelem(mesh, cfg);
+}
 
 /**
- * @brief Preparing for the ray-tracing calculations
- *
- * This function build the ray-tracing precomputed data and test if the initial
- * element (e0) encloses the photon launch position.
+ * @brief Load tet element volume file and initialize the related mesh properties
  *
- * @param[out] tracer: the ray-tracer data structure
+ * @param[in] mesh: the mesh object
  * @param[in] cfg: the simulation configuration structure
  */
 
-void tracer_prep(raytracer* tracer, mcconfig* cfg) {
-    int i, j, k, ne = tracer->mesh->ne;
+void mesh_loadelemvol(tetmesh* mesh, mcconfig* cfg) {
+    FILE* fp;
+    int tmp, len, i, j, *ee;
+    float vol;
+    char fvelem[MAX_FULL_PATH];
 
-    if (tracer->n == NULL && tracer->m == NULL && tracer->d == NULL) {
-        if (tracer->mesh != NULL) {
-            tracer_build(tracer);
-        } else {
-            MESH_ERROR("tracer is not associated with a mesh");
-        }
-    } else if ( (cfg->srctype == stPencil || cfg->srctype == stIsotropic || cfg->srctype == stCone || cfg->srctype == stArcSin) ) {
-        if (cfg->e0 <= 0 || mesh_barycentric(cfg->e0, &cfg->bary0.x, (FLOAT3*) & (cfg->srcpos), tracer->mesh)) {
-            if (mesh_initelem(tracer->mesh, cfg)) {
-                MESH_ERROR("initial element does not enclose the source!");
-            }
-        }
+    mesh_filenames("velem_%s.dat", fvelem, cfg);
 
-        if (cfg->debuglevel & dlWeight)
-            fprintf(cfg->flog, "initial bary-centric volumes [%e %e %e %e]\n",
-                    cfg->bary0.x / 6., cfg->bary0.y / 6., cfg->bary0.z / 6., cfg->bary0.w / 6.);
+    if ((cfg->elem && cfg->elemnum && cfg->node && cfg->nodenum) || (fp = fopen(fvelem, "rt")) == NULL) {
+        mesh_getvolume(mesh, cfg);
+        return;
     }
 
-    // TODO: this is a partial fix to the normalization bug described in https://github.com/fangq/mmc/issues/82
-    // basically, mmc surface node fluence is about 2x higher than expected, due to the division to the nodal-volume
-    // of surface nodes that is roughtly half of that in an interior node.
-    // To more carefully handle this, one should calculate the solid-angle S of any surface nodes and use the
-    // ratio (4*Pi/S) to scale nvol. Here, we simply multiply surface node nvol by 2x. Should work fine for
-    // flat surfaces, but will not be accurate for edge or corner nodes.
-    // one can disable this fix (i.e. restore to the old behavior) by setting cfg.isnormalized to 2
+    len = fscanf(fp, "%d %d", &tmp, &(mesh->ne));
 
-    if (cfg->isnormalized == 1 && cfg->method != rtBLBadouelGrid && cfg->basisorder) {
-        float* Reff = (float*)calloc(tracer->mesh->prop + 1, sizeof(float));
+    if (len != 2 || mesh->ne <= 0) {
+        MESH_ERROR("mesh file has wrong format");
+    }
 
-        if (cfg->isreflect) {
-            for (i = 1; i <= tracer->mesh->prop; i++) { // precompute the Reff for each non-zero label
-                for (j = 1; j < i; j++) {
-                    if (tracer->mesh->med[j].n == tracer->mesh->med[i].n) { // if such reflective index has been computed, copy the value
-                        Reff[i] = Reff[j];
-                        break;
-                    }
-                }
+    mesh->evol = (cfg->isleanmem) ? NULL : (float*)malloc(sizeof(float) * mesh->ne);
+    mesh->nvol = (float*)calloc(sizeof(float), mesh->nn);
 
-                if (Reff[i] == 0.f) {
-                    Reff[i] = mesh_getreff(tracer->mesh->med[i].n, tracer->mesh->med[0].n);
-                }
-            }
+    for (i = 0; i < mesh->ne; i++) {
+        if (fscanf(fp, "%d %f", &tmp, &vol) != 2) {
+            MESH_ERROR("mesh file has wrong format");
         }
 
-        for (i = 0; i < ne; i++) {
-            int* elems = tracer->mesh->elem + i * tracer->mesh->elemlen;   // element node indices
-            int* enb = tracer->mesh->facenb + i * tracer->mesh->elemlen;   // check facenb, find surface faces
-
-            for (j = 0; j < tracer->mesh->elemlen; j++) { // loop over my neighbors
-                if (enb[j] == 0) {                        // 0-valued face neighbor indicates an exterior triangle
-                    for (k = 0; k < 3; k++) {
-                        int nid = elems[out[ifaceorder[j]][k]] - 1;
+        if (mesh->evol) {
+            mesh->evol[i] = vol;
+        }
 
-                        if (tracer->mesh->nvol[nid] > 0.f && tracer->mesh->type[i] >= 0) {  // change sign to prevent it from changing again
-                            tracer->mesh->nvol[nid] *= -(2.f / (1.0 + Reff[tracer->mesh->type[i]])); // 2 accounts for the missing half of the solid angle, Reff is the effective reflection coeff
-                        }
-                    }
-                }
-            }
+        if (mesh->type[i] == 0) {
+            continue;
         }
 
-        free(Reff);
+        ee = (int*)(mesh->elem + i * mesh->elemlen);
 
-        for (i = 0; i < tracer->mesh->nn; i++) {
-            if (tracer->mesh->nvol[i] < 0.f) {
-                tracer->mesh->nvol[i] = -tracer->mesh->nvol[i];
-            }
+        for (j = 0; j < mesh->elemlen; j++) {
+            mesh->nvol[ee[j] - 1] += vol * 0.25f;
         }
     }
 
-    // build acceleration data structure to speed up first-neighbor immc edge-roi calculation
-    // loop over each edgeroi, count how many roi in each elem, and write to the first elem as negative integer
-    if (tracer->mesh->edgeroi) {
-        for (i = 0; i < ne; i++) {
-            int count = 0;
+    fclose(fp);
+}
 
-            for (j = 0; j < 6; j++)
-                if (tracer->mesh->edgeroi[(i * 6) + j] > 0.f) {
-                    count++;
-                }
 
-            if (count && fabs(tracer->mesh->edgeroi[i * 6]) < EPS) {
-                tracer->mesh->edgeroi[i * 6] = -count;    // number -1 to -6 indicates how many faces have ROIs
-            }
-        }
+/**
+ * @brief Load face-neightbor element list and initialize the related mesh properties
+ *
+ * @param[in] mesh: the mesh object
+ * @param[in] cfg: the simulation configuration structure
+ */
 
-        for (i = 0; i < ne; i++) {
-            if (fabs(tracer->mesh->edgeroi[i * 6]) < EPS) { // if I don't have roi
-                for (j = 0; j < tracer->mesh->elemlen; j++) { // loop over my neighbors
-                    int id = tracer->mesh->facenb[i * tracer->mesh->elemlen + j]; // loop over neighboring elements
+void mesh_loadfaceneighbor(tetmesh* mesh, mcconfig* cfg) {
+    char ffacenb[MAX_FULL_PATH], *buf;
+    const char* p;
+    size_t len;
 
-                    if (id > 0 && fabs(tracer->mesh->edgeroi[(id - 1) * 6]) > EPS) { // if I don't have roi, but neighbor has, set ref id as -elemid-6, only handle 1 roi neighbor case
-                        tracer->mesh->edgeroi[i * 6] = -id - 6;
-                        break;
-                    }
-                }
-            }
+    mesh_filenames("facenb_%s.dat", ffacenb, cfg);
 
-            if (fabs(tracer->mesh->edgeroi[i * 6]) < EPS) { // if I don't have roi
-                for (j = 0; j < tracer->mesh->elemlen; j++) { // loop over my neighbors
-                    int firstnbid = tracer->mesh->facenb[i * tracer->mesh->elemlen + j] - 1; // loop over neighboring elements
+    if ((cfg->elem && cfg->elemnum) || (buf = mesh_readtext(ffacenb, &len)) == NULL) {
+        mesh_getfacenb(mesh, cfg);
+        return;
+    }
 
-                    if (firstnbid < 0) {
-                        continue;
-                    }
+    p = mesh_parseint(buf, buf + len, &(mesh->elemlen));
+    p = (p) ? mesh_parseint(p, buf + len, &(mesh->ne)) : NULL;
 
-                    for (k = 0; k < tracer->mesh->elemlen; k++) { // loop over my j-th neighbor's neighbors
-                        int id = tracer->mesh->facenb[firstnbid * tracer->mesh->elemlen + k]; // loop over 2nd order neighboring elements
+    if (p == NULL || mesh->ne <= 0) {
+        MESH_ERROR("mesh file has wrong format");
+    }
 
-                        if (id > 0 && fabs(tracer->mesh->edgeroi[(id - 1) * 6]) > EPS) { // if I don't have roi, but neighbor has, set ref id as -elemid-6, only handle 1 roi neighbor case
-                            tracer->mesh->edgeroi[i * 6] = -id - 6;
-                            break;
-                        }
-                    }
-                }
-            }
-        }
+    if (mesh->elemlen < 4) {
+        mesh->elemlen = 4;
     }
 
-    // build acceleration data structure to speed up first-neighbor immc face-roi calculation
-    // loop over each faceroi, count how many roi in each elem, and write to the first elem as negative integer
-    if (tracer->mesh->faceroi) {
-        for (i = 0; i < ne; i++) {
-            int count = 0;
+    mesh->facenb = (int*)malloc(sizeof(int) * mesh->elemlen * mesh->ne);
 
-            for (j = 0; j < 4; j++)
-                if (tracer->mesh->faceroi[(i << 2) + j] > 0.f) {
-                    count++;
-                }
+    if (mesh_parsetable(p, buf + len, mesh->ne, 0, mesh->elemlen, NULL, mesh->facenb, NULL)) {
+        MESH_ERROR("face-neighbor list file has wrong format");
+    }
 
-            if (count && fabs(tracer->mesh->faceroi[i << 2]) < EPS) {
-                tracer->mesh->faceroi[i << 2] = -count;    // number -1 to -4 indicates how many faces have ROIs
-            }
-        }
+    mesh_freetext(buf, len);
+}
 
-        for (i = 0; i < ne; i++) {
-            if (fabs(tracer->mesh->faceroi[i << 2]) < EPS) { // if I don't have roi
-                for (j = 0; j < tracer->mesh->elemlen; j++) { // loop over my neighbors
-                    int id = tracer->mesh->facenb[i * tracer->mesh->elemlen + j]; // loop over neighboring elements
+/**
+ * @brief Memory-map a binary mesh container (mesh_<tag>.mmcb) saved by mesh_savebinary
+ *
+ * The node, element, media type, face-neighbor and element volume arrays of
+ * the mesh point directly into the mapped file, which is shared between all
+ * processes reading the same container; the mapping is copy-on-write, so later
+ * in-place changes are private to this process. The container is skipped if it
+ * does not exist, if any of the text mesh files is newer, or if the mesh is
+ * given in cfg.
+ *
+ * @param[in] mesh: the mesh object
+ * @param[in] cfg: the simulation configuration structure
+ *
+ * @return 1 if the mesh is loaded from the container, 0 otherwise
+ */
 
-                    if (id > 0 && fabs(tracer->mesh->faceroi[(id - 1) << 2]) > EPS) { // if I don't have roi, but neighbor has, set ref id as -elemid-4, only handle 1 roi neighbor case
-                        tracer->mesh->faceroi[i << 2] = -id - 4;
-                        break;
-                    }
-                }
-            }
-        }
+int mesh_loadbinary(tetmesh* mesh, mcconfig* cfg) {
+    const char* textfiles[] = {"node_%s.dat", "elem_%s.dat", "facenb_%s.dat", "velem_%s.dat"};
+    const int minlen[msTracerD] = {sizeof(FLOAT3), sizeof(int), sizeof(int), sizeof(int), sizeof(float)};
+    char fbin[MAX_FULL_PATH], ftext[MAX_FULL_PATH];
+    struct stat binstat, textstat;
+    meshheader* head;
+    char* buf;
+    int i;
+    unsigned long long explen[msTracerD];
+#ifdef _WIN32
+    FILE* fp;
+#else
+    int fd;
+#endif
+
+    if ((cfg->node && cfg->nodenum > 0) || cfg->isdumpmesh || cfg->basisorder == 2) {
+        return 0;
     }
 
-    // loop over each external surface triangle (facenb[]==0) and sequentially number them as negative integer
-    ne = tracer->mesh->ne * tracer->mesh->elemlen;
-    tracer->mesh->nf = 0;
+    mesh_filenames("mesh_%s.mmcb", fbin, cfg);
 
-    for (i = 0; i < ne; i++) {
-        if (tracer->mesh->facenb[i] == 0) {
-            tracer->mesh->facenb[i] = -(++tracer->mesh->nf);
+    if (stat(fbin, &binstat) != 0 || (size_t)binstat.st_size < sizeof(meshheader)) {
+        return 0;
+    }
+
+    for (i = 0; i < 4; i++) {
+        mesh_filenames(textfiles[i], ftext, cfg);
+
+        if (stat(ftext, &textstat) == 0 && textstat.st_mtime > binstat.st_mtime) {
+            MMC_FPRINTF(cfg->flog, S_RED "WARNING: %s is newer than %s, the binary mesh is ignored\n" S_RESET, ftext, fbin);
+            return 0;
         }
     }
 
-    if (tracer->mesh->dref) {
-        free(tracer->mesh->dref);
+#ifdef _WIN32
+
+    if ((fp = fopen(fbin, "rb")) == NULL) {
+        return 0;
     }
 
-    if (cfg->issaveref) {
-        tracer->mesh->dref = (double*)calloc(sizeof(double) * tracer->mesh->nf * cfg->srcnum, cfg->maxgate);
+    buf = (char*)malloc(binstat.st_size);
+
+    if (fread(buf, binstat.st_size, 1, fp) != 1) {
+        MESH_ERROR("can not read the binary mesh file");
     }
-}
 
-/**
- * @brief Pre-computed ray-tracing related data
- *
- * the pre-computed ray-tracing data include
- * d: the vector of the 6 edges: edge[i]=[ni1,ni2]: d[i]=ni2 - ni1
- * m: the cross-product of the end-nodes of the 6-edges: edge[i]=[ni1,ni2]: m[i]=ni1 x ni2
- * n: the normal vector of the 4 facets, pointing outwards
- *
- * @param[out] tracer: the ray-tracer data structure
- */
+    fclose(fp);
+#else
 
-void tracer_build(raytracer* tracer) {
-    int ne, i, j;
-    const int pairs[6][2] = {{0, 1}, {0, 2}, {0, 3}, {1, 2}, {1, 3}, {2, 3}};
+    if ((fd = open(fbin, O_RDONLY)) < 0) {
+        return 0;
+    }
 
-    FLOAT3* nodes;
-    int* elems, ebase;
-    int e1, e0;
-    float Rn2;
+    buf = (char*)mmap(NULL, binstat.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
 
-    if (tracer->d || tracer->m || tracer->n || tracer->mesh == NULL) {
-        return;
+    if (buf == MAP_FAILED) {
+        MESH_ERROR("can not map the binary mesh file");
     }
 
-    if (tracer->mesh->node == NULL || tracer->mesh->elem == NULL ||
-            tracer->mesh->facenb == NULL || tracer->mesh->med == NULL) {
-        MESH_ERROR("mesh is missing");
+#endif
+
+    mesh->mmapbuf = buf;
+    mesh->mmaplen = binstat.st_size;
+    head = (meshheader*)buf;
+
+    if (memcmp(head->magic, MMC_MESH_MAGIC, sizeof(MMC_MESH_MAGIC)) || head->version != MMC_MESH_VERSION ||
+            head->headersize != sizeof(meshheader) || head->nn <= 0 || head->ne <= 0 || head->elemlen < 4) {
+        MESH_ERROR("binary mesh file has wrong format");
     }
 
-    ne = tracer->mesh->ne;
-    nodes = tracer->mesh->node;
-    elems = (int*)(tracer->mesh->elem); // convert int4* to int*
+    explen[msNode] = (unsigned long long)head->nn * minlen[msNode];
+    explen[msElem] = explen[msFacenb] = (unsigned long long)head->ne * head->elemlen * minlen[msElem];
+    explen[msType] = explen[msEvol] = (unsigned long long)head->ne * minlen[msType];
 
-    if (tracer->method == rtPlucker) {
-        int ea, eb, ec;
-        FLOAT3 vecAB = {0.f}, vecAC = {0.f};
+    for (i = 0; i < msSectionNum; i++) {
+        if ((i < msTracerD && head->len[i] != explen[i]) || head->offset[i] % MMC_MESH_ALIGN ||
+                head->offset[i] + head->len[i] > (unsigned long long)binstat.st_size) {
+            MESH_ERROR("binary mesh file is truncated or has wrong format");
+        }
+    }
 
-        tracer->d = (float3*)calloc(sizeof(float3), ne * 6); // 6 edges/elem
-        tracer->m = (float3*)calloc(sizeof(float3), ne * 6); // 6 edges/elem
-        tracer->n = (float3*)calloc(sizeof(float3), ne * 4); // 4 face norms
+    mesh->nn = head->nn;
+    mesh->ne = head->ne;
+    mesh->elemlen = head->elemlen;
+    mesh->node = (FLOAT3*)(buf + head->offset[msNode]);
+    mesh->elem = (int*)(buf + head->offset[msElem]);
+    mesh->type = (int*)(buf + head->offset[msType]);
+    mesh->facenb = (int*)(buf + head->offset[msFacenb]);
+    mesh->evol = (float*)(buf + head->offset[msEvol]);
 
-        for (i = 0; i < ne; i++) {
-            ebase = i << 2;
+#if defined(MMC_USE_SSE) || defined(USE_OPENCL)
 
-            for (j = 0; j < 6; j++) {
-                e1 = elems[ebase + pairs[j][1]] - 1;
-                e0 = elems[ebase + pairs[j][0]] - 1;
-                vec_diff3(&nodes[e0], &nodes[e1], (FLOAT3*)(tracer->d + i * 6 + j));
-                vec_cross3(&nodes[e0], &nodes[e1], (FLOAT3*)(tracer->m + i * 6 + j));
-            }
+    if (head->tracermethod >= 0 && head->tracerhasw == 1) {
+#else
 
-            for (j = 0; j < 4; j++) {
-                ea = elems[ebase + out[j][0]] - 1;
-                eb = elems[ebase + out[j][1]] - 1;
-                ec = elems[ebase + out[j][2]] - 1;
-                vec_diff3(&nodes[ea], &nodes[eb], &vecAB);
-                vec_diff3(&nodes[ea], &nodes[ec], &vecAC);
-                vec_cross3(&vecAB, &vecAC, (FLOAT3*)(tracer->n + ebase + j));
-                Rn2 = 1.f / sqrt(vec_dot(tracer->n + ebase + j, tracer->n + ebase + j));
-                vec_mult(tracer->n + ebase + j, Rn2, tracer->n + ebase + j);
-            }
+    if (head->tracermethod >= 0 && head->tracerhasw == 0) {
+#endif
+        mesh->tracermethod = head->tracermethod;
+
+        for (i = 0; i < 3; i++) {
+            mesh->tracerdata[i] = (head->len[msTracerD + i]) ? (float3*)(buf + head->offset[msTracerD + i]) : NULL;
         }
-    } else if (tracer->method == rtHavel || tracer->method == rtBadouel) {
-        int ea, eb, ec;
-        float3 vecAB = {0.f}, vecAC = {0.f};
+    }
 
-        tracer->d = NULL;
-        tracer->m = (float3*)calloc(sizeof(float3), ne * 12);
+    if (cfg->method == rtBLBadouelGrid) {
+        mesh_createdualmesh(mesh, cfg);
+    }
 
-        for (i = 0; i < ne; i++) {
-            ebase = i << 2;
+    mesh_initweight(mesh, cfg);
 
-            for (j = 0; j < 4; j++) {
-                float3* vecN = tracer->m + 3 * (ebase + j);
+    mesh_srcdetelem(mesh, cfg);
 
-                ea = elems[ebase + out[j][0]] - 1;
-                eb = elems[ebase + out[j][1]] - 1;
-                ec = elems[ebase + out[j][2]] - 1;
-                vec_diff3(&nodes[ea], &nodes[eb], (FLOAT3*)&vecAB);
-                vec_diff3(&nodes[ea], &nodes[ec], (FLOAT3*)&vecAC);
-                vec_cross(&vecAB, &vecAC, vecN); /*N is defined as ACxAB in Jiri's code, but not the paper*/
-                vec_cross(&vecAC, vecN, vecN + 1);
-                vec_cross(vecN, &vecAB, vecN + 2);
+    mesh_getnodevolume(mesh, mesh->evol);
 
-                Rn2 = 1.f / sqrt(vec_dot(vecN, vecN));
+    MMCDEBUG(cfg, dlTime, (cfg->flog, "mapped binary mesh %s (%d nodes, %d elements)\n", fbin, mesh->nn, mesh->ne));
+    return 1;
+}
 
-                vec_mult(vecN, Rn2, vecN);
+/**
+ * @brief Save the loaded mesh and the precomputed ray-tracer data to a binary mesh container
+ *
+ * The container is written to mesh_<tag>.mmcb in the root path and is loaded by
+ * mesh_loadbinary() in later runs. The source and detector element markers
+ * (-1/-2) are restored in the saved media types.
+ *
+ * @param[in] mesh: the mesh object, must have node, elem, type, facenb and evol
+ * @param[in] cfg: the simulation configuration structure
+ */
 
-                Rn2 *= Rn2;
-                vec_mult(vecN + 1, Rn2, vecN + 1);
-                vec_mult(vecN + 2, Rn2, vecN + 2);
+void mesh_savebinary(tetmesh* mesh, mcconfig* cfg) {
+    FILE* fp;
+    char fbin[MAX_FULL_PATH];
+    const char padding[MMC_MESH_ALIGN] = {0};
+    meshheader head;
+    raytracer tracer;
+    void* data[msSectionNum];
+    unsigned long long pos;
+    int i, *type;
+
+    memset(&head, 0, sizeof(meshheader));
+    memcpy(head.magic, MMC_MESH_MAGIC, sizeof(MMC_MESH_MAGIC));
+    head.version = MMC_MESH_VERSION;
+    head.headersize = sizeof(meshheader);
+    head.nn = mesh->nn;
+    head.ne = mesh->ne;
+    head.elemlen = mesh->elemlen;
+    head.tracermethod = -1;
 #if defined(MMC_USE_SSE) || defined(USE_OPENCL)
-                vecN->w    = vec_dot3((FLOAT3*)vecN,  &nodes[ea]);
-                (vecN + 1)->w = -vec_dot3((FLOAT3*)(vecN + 1), &nodes[ea]);
-                (vecN + 2)->w = -vec_dot3((FLOAT3*)(vecN + 2), &nodes[ea]);
+    head.tracerhasw = 1;
 #endif
-            }
-        }
-    } else if (tracer->method == rtBLBadouel || tracer->method == rtBLBadouelGrid) {
-        int ea, eb, ec;
-        float3 vecAB = {0.f}, vecAC = {0.f}, vN = {0.f};
 
-        tracer->d = NULL;
-        tracer->n = (float3*)calloc(sizeof(float3), ne * 4);
+    type = (int*)malloc(sizeof(int) * mesh->ne);
+    memcpy(type, mesh->type, sizeof(int) * mesh->ne);
+
+    for (i = 0; i < mesh->srcelemlen; i++) {
+        type[mesh->srcelem[i] - 1] = -1;
+    }
+
+    for (i = 0; i < mesh->detelemlen; i++) {
+        type[mesh->detelem[i] - 1] = -2;
+    }
+
+    data[msNode] = mesh->node;
+    data[msElem] = mesh->elem;
+    data[msType] = type;
+    data[msFacenb] = mesh->facenb;
+    data[msEvol] = mesh->evol;
+
+    /*the container always stores the element volumes*/
+    if (mesh->evol == NULL) {
+        data[msEvol] = malloc(sizeof(float) * mesh->ne);
+
+        for (i = 0; i < mesh->ne; i++) {
+            ((float*)data[msEvol])[i] = mesh_elemvolume(mesh, i);
+        }
+    }
+    head.len[msNode] = (unsigned long long)mesh->nn * sizeof(FLOAT3);
+    head.len[msElem] = head.len[msFacenb] = (unsigned long long)mesh->ne * mesh->elemlen * sizeof(int);
+    head.len[msType] = (unsigned long long)mesh->ne * sizeof(int);
+    head.len[msEvol] = (unsigned long long)mesh->ne * sizeof(float);
+
+    /*10-node elements extend the node list at load time, do not store the tracer data*/
+    memset(&tracer, 0, sizeof(raytracer));
+
+    if (mesh->elem2 == NULL) {
+        tracer_init(&tracer, mesh, cfg->method);
+        head.tracermethod = cfg->method;
+    }
+
+    data[msTracerD] = tracer.d;
+    data[msTracerM] = tracer.m;
+    data[msTracerN] = tracer.n;
+
+    for (i = msTracerD; i < msSectionNum; i++) {
+        head.len[i] = (data[i]) ? mesh_tracerlen(cfg->method, i - msTracerD, mesh->ne) : 0;
+    }
+
+    pos = sizeof(meshheader);
+
+    for (i = 0; i < msSectionNum; i++) {
+        pos = (pos + MMC_MESH_ALIGN - 1) / MMC_MESH_ALIGN * MMC_MESH_ALIGN;
+        head.offset[i] = pos;
+        pos += head.len[i];
+    }
+
+    mesh_filenames("mesh_%s.mmcb", fbin, cfg);
+
+    if ((fp = fopen(fbin, "wb")) == NULL) {
+        MESH_ERROR("can not open the binary mesh file to write");
+    }
+
+    pos = sizeof(meshheader);
+
+    if (fwrite(&head, sizeof(meshheader), 1, fp) != 1) {
+        MESH_ERROR("can not write to the binary mesh file");
+    }
+
+    for (i = 0; i < msSectionNum; i++) {
+        if (head.offset[i] > pos && fwrite(padding, head.offset[i] - pos, 1, fp) != 1) {
+            MESH_ERROR("can not write to the binary mesh file");
+        }
+
+        if (head.len[i] && fwrite(data[i], head.len[i], 1, fp) != 1) {
+            MESH_ERROR("can not write to the binary mesh file");
+        }
+
+        pos = head.offset[i] + head.len[i];
+    }
+
+    fclose(fp);
+    free(type);
+
+    if (data[msEvol] != mesh->evol) {
+        free(data[msEvol]);
+    }
+
+    if (tracer.mesh) {
+        tracer_clear(&tracer);
+    }
+
+    MMCDEBUG(cfg, dlTime, (cfg->flog, "saved binary mesh to %s\n", fbin));
+}
+
+/**
+ * @brief Load previously saved photon seeds from an .mch file for replay
+ *
+ * @param[in] mesh: the mesh object
+ * @param[in] cfg: the simulation configuration structure
+ */
+
+void mesh_loadseedfile(tetmesh* mesh, mcconfig* cfg) {
+    history his;
+    FILE* fp = fopen(cfg->seedfile, "rb");
+
+    if (fp == NULL) {
+        MESH_ERROR("can not open the specified history file");
+    }
+
+    if (fread(&his, sizeof(history), 1, fp) != 1) {
+        MESH_ERROR("error when reading the history file");
+    }
+
+    if (his.savedphoton == 0 || his.seedbyte == 0) {
+        fclose(fp);
+        return;
+    }
+
+    if (his.maxmedia != mesh->prop) {
+        MESH_ERROR("the history file was generated with a different media setting");
+    }
+
+    if (his.seedrng && his.seedrng - 1 != cfg->rngtype) {
+        MESH_ERROR(his.seedrng - 1 == rngPhilox ? "the seeds were saved with a different RNG, replay with --rng philox" :
+                   (his.seedrng - 1 == rngPosix ? "the seeds were saved with a different RNG, replay with --rng posix" :
+                    "the seeds were saved with a different RNG, replay with --rng xorshift128p"));
+    }
+
+    if (fseek(fp, his.savedphoton * his.colcount * sizeof(float), SEEK_CUR)) {
+        MESH_ERROR("illegal history file");
+    }
+
+    cfg->photonseed = malloc(his.savedphoton * his.seedbyte);
+
+    if (cfg->photonseed == NULL) {
+        MESH_ERROR("can not allocate memory");
+    }
+
+    if (fread(cfg->photonseed, his.seedbyte, his.savedphoton, fp) != his.savedphoton) {
+        MESH_ERROR("error when reading the seed data");
+    }
+
+    cfg->seed = SEED_FROM_FILE;
+    cfg->nphoton = his.savedphoton;
+
+    if (cfg->outputtype == otJacobian || cfg->outputtype == otWL || cfg->outputtype == otWP || cfg->replaydet != 0) {
+        int i, err = 0, colcount = his.colcount, maxmedia = his.maxmedia;
+        float* ppath = (float*)malloc(his.savedphoton * his.colcount * sizeof(float));
+        float* mua = (float*)malloc(MAX(maxmedia, 1) * 2 * sizeof(float)), *nc0 = mua + MAX(maxmedia, 1);
+        unsigned char* keep = (unsigned char*)malloc(his.savedphoton);
+        int isdetpattern = ((cfg->detparam1.w * cfg->detparam2.w > 0) && (cfg->detpattern != NULL));
+
+        cfg->replayweight = (float*)malloc(his.savedphoton * sizeof(float));
+        cfg->replaytime = (float*)malloc(his.savedphoton * sizeof(float));
+
+        /*with -P -1, all detectors are replayed in one pass, each photon is tagged by its detector ID*/
+        if (cfg->replaydet == -1 && cfg->detnum > 1 && (cfg->outputtype == otWL || cfg->outputtype == otWP)) {
+            int datalen = (cfg->method == rtBLBadouelGrid) ? cfg->crop0.z : ( (cfg->basisorder) ? mesh->nn : mesh->ne);
+
+            cfg->replaydetid = (int*)malloc(his.savedphoton * sizeof(int));
+            cfg->replaydetnum = cfg->detnum;
+
+            /*the output buffer was allocated with the mesh, before the detector blocks were known*/
+            free(mesh->weight);
+            mesh->weight = (double*)calloc(sizeof(double) * datalen * cfg->srcnum, cfg->maxgate * cfg->replaydetnum);
+        }
+        fseek(fp, sizeof(his), SEEK_SET);
+
+        if (fread(ppath, his.colcount * sizeof(float), his.savedphoton, fp) != his.savedphoton) {
+            MESH_ERROR("error when reading the partial path data");
+        }
+
+        /*mua (per length unit of the history file) and n/c0 of the media in the partial-path column order*/
+        for (i = 0; i < maxmedia; i++) {
+            mua[i] = mesh->med[i + 1].mua * his.unitinmm;
+            nc0[i] = mesh->med[i + 1].n * R_C0;
+        }
+
+        /*the photons are filtered in parallel and compacted by mcx_replaycompact*/
+        #pragma omp parallel for schedule(static) reduction(|:err)
+
+        for (i = 0; i < (int)his.savedphoton; i++) {
+            const float* plen = ppath + (size_t)i * colcount + 2;
+            float att = 0.f, tof = 0.f;
+            int j;
+
+            keep[i] = (cfg->replaydet <= 0 || cfg->replaydet == (int)(ppath[(size_t)i * colcount]));
+
+            if (!keep[i]) {
+                continue;
+            }
+
+            if (cfg->replaydetid) {
+                cfg->replaydetid[i] = (int)(ppath[(size_t)i * colcount]);
+                err |= (cfg->replaydetid[i] < 1 || cfg->replaydetid[i] > cfg->detnum);
+            }
+
+            // replay with wide-field detection pattern, the partial path has to contain photon exit information
+            if (isdetpattern) {
+                cfg->replayweight[i] = mesh_getdetweight(i, colcount, ppath, cfg);
+                err |= (cfg->replayweight[i] < 0.f) << 1;
+            } else {
+                cfg->replayweight[i] = ppath[(size_t)(i + 1) * colcount - 1];
+            }
+
+            #pragma omp simd reduction(+:att,tof)
+
+            for (j = 0; j < maxmedia; j++) {
+                att += mua[j] * plen[j];
+                tof += nc0[j] * plen[j];
+            }
+
+            cfg->replayweight[i] *= expf(-att);
+            cfg->replaytime[i] = tof;
+        }
+
+        free(ppath);
+        free(mua);
+
+        if (err & 1) {
+            MESH_ERROR("the detector ID of a replayed photon exceeds the detector number");
+        }
+
+        if (err & 2) {
+            MESH_ERROR("photon location not within the detection plane");
+        }
+
+        mcx_replaycompact(cfg, keep, his.savedphoton, his.seedbyte);
+        free(keep);
+
+        cfg->minenergy = 0.f;
+    }
+
+    fclose(fp);
+}
+
+#endif
+
+/**
+ * @brief Compute six times the signed volume of a tetrahedron, positive if the nodes are in the expected order
+ *
+ * @param[in] mesh: the mesh object
+ * @param[in] ee: the 1-based node indices of the element
+ */
+
+static float mesh_signedvolume(tetmesh* mesh, int* ee) {
+    float dx, dy, dz, vol;
+
+    dx = mesh->node[ee[2] - 1].x - mesh->node[ee[3] - 1].x;
+    dy = mesh->node[ee[2] - 1].y - mesh->node[ee[3] - 1].y;
+    dz = mesh->node[ee[2] - 1].z - mesh->node[ee[3] - 1].z;
+
+    vol = mesh->node[ee[1] - 1].x * (mesh->node[ee[2] - 1].y * mesh->node[ee[3] - 1].z - mesh->node[ee[2] - 1].z * mesh->node[ee[3] - 1].y)
+          - mesh->node[ee[1] - 1].y * (mesh->node[ee[2] - 1].x * mesh->node[ee[3] - 1].z - mesh->node[ee[2] - 1].z * mesh->node[ee[3] - 1].x)
+          + mesh->node[ee[1] - 1].z * (mesh->node[ee[2] - 1].x * mesh->node[ee[3] - 1].y - mesh->node[ee[2] - 1].y * mesh->node[ee[3] - 1].x);
+    vol += -mesh->node[ee[0] - 1].x * ((mesh->node[ee[2] - 1].y * mesh->node[ee[3] - 1].z - mesh->node[ee[2] - 1].z * mesh->node[ee[3] - 1].y) + mesh->node[ee[1] - 1].y * dz - mesh->node[ee[1] - 1].z * dy);
+    vol += +mesh->node[ee[0] - 1].y * ((mesh->node[ee[2] - 1].x * mesh->node[ee[3] - 1].z - mesh->node[ee[2] - 1].z * mesh->node[ee[3] - 1].x) + mesh->node[ee[1] - 1].x * dz - mesh->node[ee[1] - 1].z * dx);
+    vol += -mesh->node[ee[0] - 1].z * ((mesh->node[ee[2] - 1].x * mesh->node[ee[3] - 1].y - mesh->node[ee[2] - 1].y * mesh->node[ee[3] - 1].x) + mesh->node[ee[1] - 1].x * dy - mesh->node[ee[1] - 1].y * dx);
+    return -vol;
+}
+
+/**
+ * @brief Compute the volume of a tetrahedron
+ *
+ * Used in place of mesh->evol when the element volumes are not stored (--leanmem).
+ *
+ * @param[in] mesh: the mesh object
+ * @param[in] eid: the index of the element, starting from 0
+ */
+
+float mesh_elemvolume(tetmesh* mesh, int eid) {
+    return (float)fabs(mesh_signedvolume(mesh, (int*)(mesh->elem + eid * mesh->elemlen))) * (1.f / 6.f);
+}
+
+/**
+ * @brief Compute the tetrahedron and nodal volumes if not provided
+ *
+ * The elements are also reoriented to have positive volumes. In the lean-memory
+ * mode, only the nodal volumes are stored.
+ *
+ * @param[in] mesh: the mesh object
+ * @param[in] cfg: the simulation configuration structure
+ */
+
+void mesh_getvolume(tetmesh* mesh, mcconfig* cfg) {
+    int i;
+    float* vol;
+
+    mesh->evol = (cfg->isleanmem) ? NULL : (float*)calloc(sizeof(float), mesh->ne);
+    vol = (mesh->evol) ? mesh->evol : (float*)malloc(sizeof(float) * mesh->ne);
+
+    /*each element only reorders its own nodes, so the volumes are computed in parallel*/
+    #pragma omp parallel for schedule(static)
+
+    for (i = 0; i < mesh->ne; i++) {
+        int* ee = (int*)(mesh->elem + i * mesh->elemlen);
+        float v = mesh_signedvolume(mesh, ee);
+
+        if (v < 0.f) {
+            int e1 = ee[3];
+            ee[3] = ee [2];
+            ee[2] = e1;
+            v = -v;
+        }
+
+        vol[i] = v * (1.f / 6.f);
+    }
+
+    mesh_getnodevolume(mesh, vol);
+
+    if (vol != mesh->evol) {
+        free(vol);
+    }
+}
+
+/**
+ * @brief Add a quarter of the volume of each labeled element to its nodes
+ *
+ * For large meshes, the elements of each node are counted and grouped into
+ * per-node lists in parallel, and each node then sums its list in the element
+ * order, so the sums are identical to those of a serial scatter for any
+ * thread count. Small meshes, or if the lists can not be allocated, are
+ * scattered serially.
+ *
+ * @param[in,out] mesh: the mesh object, nvol must be zeroed
+ * @param[in] vol: the element volumes
+ * @param[in] nodenum: the number of the first nodes of an element receiving its volume
+ * @param[in] ispositive: 1 to only count the elements of a positive label, 0 for any non-zero label
+ */
+
+static void mesh_scatternodevolume(tetmesh* mesh, const float* vol, int nodenum, int ispositive) {
+    int i, j, nchunk = 1;
+    size_t* first = NULL;
+    int* elist = NULL;
+
+#ifdef _OPENMP
+    nchunk = MAX(1, MIN(omp_get_max_threads(), mesh->ne / MMC_ELEM_CHUNK));
+#endif
+
+    if (nchunk > 1 && (first = (size_t*)calloc(mesh->nn + 1, sizeof(size_t))) != NULL) {
+        #pragma omp parallel for schedule(static) private(j)
+
+        for (i = 0; i < mesh->ne; i++) {
+            int* ee = mesh->elem + (size_t)i * mesh->elemlen;
+
+            if (mesh->type[i] == 0 || (ispositive && mesh->type[i] < 0)) {
+                continue;
+            }
+
+            for (j = 0; j < nodenum; j++) {
+                #pragma omp atomic
+                first[ee[j]]++;
+            }
+        }
+
+        for (i = 0; i < mesh->nn; i++) {
+            first[i + 1] += first[i];
+        }
+
+        elist = (int*)malloc(MAX(first[mesh->nn], 1) * sizeof(int));
+
+        if (elist == NULL) {
+            free(first);
+            first = NULL;
+        }
+    }
+
+    if (first == NULL) {
+        for (i = 0; i < mesh->ne; i++) {
+            int* ee = mesh->elem + (size_t)i * mesh->elemlen;
+
+            if (mesh->type[i] == 0 || (ispositive && mesh->type[i] < 0)) {
+                continue;
+            }
+
+            for (j = 0; j < nodenum; j++) {
+                mesh->nvol[ee[j] - 1] += vol[i] * 0.25f;
+            }
+        }
+
+        return;
+    }
+
+    /*first[k] is the start of the list of node k (from 0), the fill moves it to the end, i.e. the start of node k+1*/
+    #pragma omp parallel for schedule(static) private(j)
+
+    for (i = 0; i < mesh->ne; i++) {
+        int* ee = mesh->elem + (size_t)i * mesh->elemlen;
+
+        if (mesh->type[i] == 0 || (ispositive && mesh->type[i] < 0)) {
+            continue;
+        }
+
+        for (j = 0; j < nodenum; j++) {
+            size_t pos;
+
+            #pragma omp atomic capture
+            pos = first[ee[j] - 1]++;
+
+            elist[pos] = i;
+        }
+    }
+
+    #pragma omp parallel for schedule(static)
+
+    for (i = 0; i < mesh->nn; i++) {
+        int* list = elist + ((i > 0) ? first[i - 1] : 0);
+        int len = (int)(first[i] - ((i > 0) ? first[i - 1] : 0)), k, m;
+        float sum = 0.f;
+
+        /*the lists are short, sorting restores the order of the serial scatter*/
+        for (k = 1; k < len; k++) {
+            int e = list[k];
+
+            for (m = k; m > 0 && list[m - 1] > e; m--) {
+                list[m] = list[m - 1];
+            }
+
+            list[m] = e;
+        }
+
+        for (k = 0; k < len; k++) {
+            sum += vol[list[k]] * 0.25f;
+        }
+
+        mesh->nvol[i] = sum;
+    }
+
+    free(elist);
+    free(first);
+}
+
+/**
+ * @brief Compute the nodal volumes from the element volumes
+ *
+ * Each node receives a quarter of the volume of every labeled element it
+ * belongs to, see mesh_scatternodevolume.
+ *
+ * @param[in,out] mesh: the mesh object, nvol is (re)allocated
+ * @param[in] vol: the element volumes
+ */
+
+void mesh_getnodevolume(tetmesh* mesh, const float* vol) {
+    if (mesh->nvol) {
+        free(mesh->nvol);
+    }
+
+    mesh->nvol = (float*)calloc(sizeof(float), mesh->nn);
+    mesh_scatternodevolume(mesh, vol, mesh->elemlen, 0);
+}
+
+/**
+ * @brief Locate the element enclosing a point by walking across face neighbors
+ *
+ * Starting from element e, repeatedly step through the face that the point is
+ * the farthest outside of, until an element enclosing the point is reached.
+ * A walk that exits the mesh, exceeds the step limit or ends too close to a
+ * face (where the first match of a linear scan may be a different element
+ * sharing that face) is rejected so that the caller can fall back to a scan.
+ *
+ * @param[in] mesh: the mesh object
+ * @param[in] e: the index (start from 0) of the starting element
+ * @param[in] p: the point to be located
+ *
+ * @return the index (start from 1) of the enclosing element, 0 if the walk fails
+ */
+
+int mesh_walkelem(tetmesh* mesh, int e, FLOAT3* p) {
+    FLOAT3 vecS, vecAB, vecAC, vecN;
+    FLOAT3* nodes = mesh->node;
+    int i, step, ea, eb, ec, nb;
+
+    for (step = 0; step < mesh->ne; step++) {
+        int* elems = (int*)(mesh->elem + e * mesh->elemlen);
+        float bary[4], bmin = 0.f, s = 0.f;
+        int fmin = -1;
+
+        for (i = 0; i < 4; i++) {
+            ea = elems[out[i][0]] - 1;
+            eb = elems[out[i][1]] - 1;
+            ec = elems[out[i][2]] - 1;
+            vec_diff3(&nodes[ea], &nodes[eb], &vecAB);
+            vec_diff3(&nodes[ea], &nodes[ec], &vecAC);
+            vec_diff3(&nodes[ea], p, &vecS);
+            vec_cross3(&vecAB, &vecAC, &vecN);
+            bary[i] = -vec_dot3(&vecS, &vecN);
+            s += bary[i];
+
+            if (bary[i] < bmin) {
+                bmin = bary[i];
+                fmin = i;
+            }
+        }
+
+        if (fmin < 0) {
+            for (i = 0; i < 4; i++) {
+                if (bary[i] <= s * 1e-5f) {
+                    return 0;
+                }
+            }
+
+            return e + 1;
+        }
+
+        /*facenb is ordered by ifaceorder, map the face of out[fmin] to its neighbor*/
+        for (i = 0; i < 4; i++) {
+            if (ifaceorder[i] == fmin) {
+                break;
+            }
+        }
+
+        nb = mesh->facenb[e * mesh->elemlen + i];
+
+        if (nb <= 0) {
+            return 0;
+        }
+
+        e = nb - 1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Find the tetrahedral element enclosing the source
+ *
+ * The enclosing element is first searched by walking across face neighbors,
+ * starting from the user-supplied e0 if any; if the walk fails, all elements
+ * are scanned in order, those whose bounding box contains the source are
+ * tested in batches by mesh_barylocate.
+ *
+ * @param[in] mesh: the mesh object
+ * @param[in] cfg: the simulation configuration structure
+ *
+ * @return 0 if an enclosing element is found, 1 if not found
+ */
+
+int mesh_initelem(tetmesh* mesh, mcconfig* cfg) {
+    FLOAT3* nodes = mesh->node;
+    int i, j;
+
+    if (mesh->facenb && mesh->elemlen == 4 && mesh->ne > 0) {
+        i = mesh_walkelem(mesh, (cfg->e0 > 0 && cfg->e0 <= mesh->ne) ? cfg->e0 - 1 : 0, (FLOAT3*) & (cfg->srcpos));
+
+        if (i > 0 && mesh_barycentric(i, &(cfg->bary0.x), (FLOAT3*) & (cfg->srcpos), mesh) == 0) {
+            cfg->e0 = i;
+            return 0;
+        }
+    }
+
+    /*the elements whose bounding box contains the source are tested MMC_BARY_BATCH at a time, in order*/
+    {
+        int batch[MMC_BARY_BATCH], len = 0, k;
+        float bary[4];
+
+        for (i = 0; i <= mesh->ne; i++) {
+            if (i < mesh->ne) {
+                double pmin[3] = {VERY_BIG, VERY_BIG, VERY_BIG}, pmax[3] = {-VERY_BIG, -VERY_BIG, -VERY_BIG};
+                int* elems = (int*)(mesh->elem + i * mesh->elemlen); // convert int4* to int*
+
+                for (j = 0; j < mesh->elemlen; j++) {
+                    pmin[0] = MIN(nodes[elems[j] - 1].x, pmin[0]);
+                    pmin[1] = MIN(nodes[elems[j] - 1].y, pmin[1]);
+                    pmin[2] = MIN(nodes[elems[j] - 1].z, pmin[2]);
+
+                    pmax[0] = MAX(nodes[elems[j] - 1].x, pmax[0]);
+                    pmax[1] = MAX(nodes[elems[j] - 1].y, pmax[1]);
+                    pmax[2] = MAX(nodes[elems[j] - 1].z, pmax[2]);
+                }
+
+                if (cfg->srcpos.x <= pmax[0] && cfg->srcpos.x >= pmin[0] &&
+                        cfg->srcpos.y <= pmax[1] && cfg->srcpos.y >= pmin[1] &&
+                        cfg->srcpos.z <= pmax[2] && cfg->srcpos.z >= pmin[2]) {
+                    batch[len++] = i + 1;
+                }
+
+                if (len < MMC_BARY_BATCH) {
+                    continue;
+                }
+            }
+
+            if (len > 0 && (k = mesh_barylocate(mesh, batch, NULL, len, (FLOAT3*) & (cfg->srcpos), 0.f, bary)) >= 0) {
+                mesh_barycentric(batch[k], &(cfg->bary0.x), (FLOAT3*) & (cfg->srcpos), mesh);
+                cfg->e0 = batch[k];
+                return 0;
+            }
+
+            len = 0;
+        }
+    }
+
+    return 1;
+}
+
+
+/**
+ * @brief Locate the enclosing elements of all sources of a source list (--srclist)
+ *
+ * Each listed source is located by mesh_initelem, walking from the element of
+ * the previous source, and its element and barycentric coordinates are saved
+ * to cfg->srclistelem and cfg->srclistbary. The source position, e0 and bary0
+ * of the configuration are restored afterwards. It must be called after the
+ * mesh is reordered.
+ *
+ * @param[in] mesh: the mesh object
+ * @param[in,out] cfg: the simulation configuration structure
+ */
+
+void mesh_initsrclist(tetmesh* mesh, mcconfig* cfg) {
+    float3 srcpos = cfg->srcpos;
+    float4 bary0 = cfg->bary0;
+    int i, e0 = cfg->e0;
+
+    if (cfg->srclist == NULL) {
+        return;
+    }
+
+    free(cfg->srclistelem);
+    free(cfg->srclistbary);
+    cfg->srclistelem = (int*)malloc(sizeof(int) * cfg->srcnum);
+    cfg->srclistbary = (float4*)malloc(sizeof(float4) * cfg->srcnum);
+
+    for (i = 0; i < cfg->srcnum; i++) {
+        cfg->srcpos.x = cfg->srclist[i * 2].x;
+        cfg->srcpos.y = cfg->srclist[i * 2].y;
+        cfg->srcpos.z = cfg->srclist[i * 2].z;
+
+        if (mesh_initelem(mesh, cfg)) {
+            MMC_FPRINTF(cfg->flog, "source #%d at [%f %f %f] is outside of the mesh\n", i + 1, cfg->srcpos.x, cfg->srcpos.y, cfg->srcpos.z);
+            MESH_ERROR("initial element does not enclose the listed source!");
+        }
+
+        cfg->srclistelem[i] = cfg->e0;
+        cfg->srclistbary[i] = cfg->bary0;
+    }
+
+    cfg->srcpos = srcpos;
+    cfg->e0 = e0;
+    cfg->bary0 = bary0;
+}
+
+
+/**
+ * @brief Compute the barycentric coordinate of the source in the initial element
+ *
+ * @param[in] e0: the index (start from 1) of the initial element
+ * @param[in] bary: the index (start from 1) of the initial element
+ * @param[in] srcpos: the source position
+ * @param[in] mesh: the mesh of the domain
+ *
+ * @return 0 if all barycentric coordinates are computed and all positive, or 1 any of those is negative
+ */
+
+int mesh_barycentric(int e0, float* bary, FLOAT3* srcpos, tetmesh* mesh) {
+    int eid = e0 - 1, i;
+    FLOAT3 vecS = {0.f}, vecAB, vecAC, vecN;
+    FLOAT3* nodes = mesh->node;
+    int ea, eb, ec;
+    float s = 0.f;
+    int* elems = (int*)(mesh->elem + eid * mesh->elemlen); // convert int4* to int*
+
+    if (eid >= mesh->ne) {
+        MESH_ERROR("initial element index exceeds total element count");
+    }
+
+    for (i = 0; i < 4; i++) {
+        ea = elems[out[i][0]] - 1;
+        eb = elems[out[i][1]] - 1;
+        ec = elems[out[i][2]] - 1;
+        vec_diff3(&nodes[ea], &nodes[eb], &vecAB);
+        vec_diff3(&nodes[ea], &nodes[ec], &vecAC);
+        vec_diff3(&nodes[ea], srcpos, &vecS);
+        vec_cross3(&vecAB, &vecAC, &vecN);
+        bary[facemap[i]] = -vec_dot3(&vecS, &vecN);
+    }
+
+    for (i = 0; i < 4; i++) {
+        if (bary[i] < 0.f) {
+            return 1;
+        }
+
+        s += bary[i];
+    }
+
+    for (i = 0; i < 4; i++) {
+        bary[i] /= s;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Find the first of a list of candidate elements enclosing a point
+ *
+ * The candidates are tested MMC_BARY_BATCH at a time: the nodes of a batch
+ * are gathered into per-coordinate arrays, and the unnormalized barycentric
+ * coordinates of all candidates of the batch are computed in SIMD loops with
+ * the same arithmetic as mesh_barycentric, so the result matches a serial
+ * scan.
+ *
+ * @param[in] mesh: the mesh of the domain
+ * @param[in] list: the 1-based indices of the elements
+ * @param[in] cand: the k-th candidate is list[cand[k]] if not NULL, list[k] otherwise
+ * @param[in] n: the number of candidates
+ * @param[in] p: the point
+ * @param[in] tol: a candidate encloses the point if none of its barycentric coordinates is below tol
+ * @param[out] bary: the unnormalized barycentric coordinates of the enclosing candidate
+ *
+ * @return the index k of the first enclosing candidate, or -1 if none
+ */
+
+int mesh_barylocate(tetmesh* mesh, const int* list, const int* cand, int n, FLOAT3* p, float tol, float* bary) {
+    float x[4][MMC_BARY_BATCH], y[4][MMC_BARY_BATCH], z[4][MMC_BARY_BATCH], b[4][MMC_BARY_BATCH];
+    int start, i, j, len;
+
+    for (start = 0; start < n; start += MMC_BARY_BATCH) {
+        len = MIN(n - start, MMC_BARY_BATCH);
+
+        for (j = 0; j < len; j++) {
+            int* ee = (int*)(mesh->elem + (size_t)(list[cand ? cand[start + j] : start + j] - 1) * mesh->elemlen);
+
+            for (i = 0; i < 4; i++) {
+                x[i][j] = mesh->node[ee[i] - 1].x;
+                y[i][j] = mesh->node[ee[i] - 1].y;
+                z[i][j] = mesh->node[ee[i] - 1].z;
+            }
+        }
+
+        for (i = 0; i < 4; i++) {
+            const int ea = out[i][0], eb = out[i][1], ec = out[i][2];
+            float* res = b[facemap[i]];
+
+            #pragma omp simd
+
+            for (j = 0; j < len; j++) {
+                float abx = x[eb][j] - x[ea][j], aby = y[eb][j] - y[ea][j], abz = z[eb][j] - z[ea][j];
+                float acx = x[ec][j] - x[ea][j], acy = y[ec][j] - y[ea][j], acz = z[ec][j] - z[ea][j];
+                float sx = p->x - x[ea][j], sy = p->y - y[ea][j], sz = p->z - z[ea][j];
+
+                res[j] = -(sx * (aby * acz - abz * acy) + sy * (abz * acx - abx * acz) + sz * (abx * acy - aby * acx));
+            }
+        }
+
+        for (j = 0; j < len; j++) {
+            if (b[0][j] >= tol && b[1][j] >= tol && b[2][j] >= tol && b[3][j] >= tol) {
+                for (i = 0; i < 4; i++) {
+                    bary[i] = b[i][j];
+                }
+
+                return start + j;
+            }
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * @brief Mark the elements without any implicit-MMC ROI
+ *
+ * In a vessel or membrane model most elements carry no ROI, yet traceroi
+ * visits the 6 edges, 4 nodes or 4 faces of every element on the path. This
+ * function sets a bit in mesh->noroi for each element whose traceroi test can
+ * not find any ROI: no positive edge radius and no reference to a neighboring
+ * ROI element (edgeroi[0] is 0), no positive node radius, or for face-iMMC,
+ * no positive thickness and no reference element. traceroi and updateroi
+ * skip these elements. It must be called after the references are resolved
+ * in tracer_prep and after the mesh is reordered.
+ *
+ * @param[in,out] mesh: the mesh object
+ * @param[in] cfg: the simulation configuration structure
+ */
+
+void mesh_buildroimask(tetmesh* mesh, mcconfig* cfg) {
+    int i, j;
+
+    if (mesh->noroi) {
+        free(mesh->noroi);
+        mesh->noroi = NULL;
+    }
+
+    if (!cfg->implicit || (cfg->implicit == 1 && !mesh->edgeroi && !mesh->noderoi) || (cfg->implicit != 1 && !mesh->faceroi)) {
+        return;
+    }
+
+    mesh->noroi = (unsigned int*)calloc((mesh->ne + 31) >> 5, sizeof(unsigned int));
+
+    for (i = 0; i < mesh->ne; i++) {
+        int hasroi = 0;
+
+        if (cfg->implicit == 1) {
+            int* ee = (int*)(mesh->elem + i * mesh->elemlen);
+
+            if (mesh->edgeroi) {
+                float* roi = MESH_ROIREC(mesh, mesh->edgeroi, i, 6);
+
+                hasroi = (roi[0] != 0.f);
+
+                for (j = 1; j < 6; j++) {
+                    hasroi |= (roi[j] > 0.f);
+                }
+            }
+
+            if (mesh->noderoi) {
+                for (j = 0; j < 4; j++) {
+                    hasroi |= (mesh->noderoi[ee[j] - 1] > 0.f);
+                }
+            }
+        } else {
+            float* roi = MESH_ROIREC(mesh, mesh->faceroi, i, 4);
+
+            hasroi = (roi[0] < -4.f);
+
+            for (j = 0; j < 4; j++) {
+                hasroi |= (roi[j] > 0.f);
+            }
+        }
+
+        if (!hasroi) {
+            mesh->noroi[i >> 5] |= (1U << (i & 31));
+        }
+    }
+}
+
+/**
+ * @brief Mark the element faces where a photon crossing out calls reflectray
+ *
+ * photon_boundary looks up the refractive indices on both sides of every face
+ * a photon crosses, although most faces join index-matched media. This function
+ * evaluates the same test once per face: with reflection enabled, a face needs
+ * reflectray if the index changes across it, or, for an exterior face, unless
+ * the exterior is absorbing or index-matched and not a mirror. It must be called
+ * after the mesh is reordered, and again when the media or cfg->isreflect change.
+ * The implicit-MMC ROIs change the indices along the path, so no mask is built.
+ *
+ * @param[in,out] mesh: the mesh object
+ * @param[in] cfg: the simulation configuration structure
+ */
+
+void mesh_buildfacereflect(tetmesh* mesh, mcconfig* cfg) {
+    int i, j;
+
+    if (mesh->facereflect) {
+        free(mesh->facereflect);
+        mesh->facereflect = NULL;
+    }
+
+    if (!cfg->isreflect || cfg->implicit || mesh->elemlen > 8 || mesh->facenb == NULL) {
+        return;
+    }
+
+    mesh->facereflect = (unsigned char*)calloc(mesh->ne, sizeof(unsigned char));
+
+    for (i = 0; i < mesh->ne; i++) {
+        int* enb = mesh->facenb + i * mesh->elemlen;
+        float n1 = MESH_ELEMMED(mesh, i)->n;
+
+        for (j = 0; j < mesh->elemlen; j++) {
+            int isreflect;
+
+            if (enb[j] > 0) {
+                isreflect = (MESH_ELEMMED(mesh, enb[j] - 1)->n != n1);
+            } else {
+                isreflect = !((n1 == cfg->nout && cfg->isreflect != (int)bcMirror) || cfg->isreflect == (int)bcAbsorbExterior);
+            }
+
+            mesh->facereflect[i] |= (isreflect << j);
+        }
+    }
+}
+
+/**
+ * @brief Pack the per-element edge or face ROI records of implicit MMC
+ *
+ * edgeroi (6 floats) and faceroi (4 floats) are loaded for every element, but
+ * only the elements near a vessel or membrane carry non-zero values. This
+ * function keeps only the non-zero records in a packed array, with a shared
+ * all-zero record at index 0, and stores the record index of each element in
+ * mesh->roimap; edgeroi/faceroi then point to the packed array and must be
+ * read through MESH_ROIREC. The packing is skipped if it does not save memory.
+ * It must be called after tracer_prep and mesh_reorder, which write the
+ * per-element arrays.
+ *
+ * @param[in,out] mesh: the mesh object
+ * @param[in] cfg: the simulation configuration structure
+ */
+
+void mesh_packroi(tetmesh* mesh, mcconfig* cfg) {
+    float** roi;
+    float* packed;
+    int i, j, len;
+    unsigned int nrec = 1;
+
+    if (mesh->roimap || !cfg->implicit || mesh->ne <= 0) {
+        return;
+    }
+
+    if (cfg->implicit == 1 && mesh->edgeroi) {
+        roi = &mesh->edgeroi;
+        len = 6;
+    } else if (cfg->implicit != 1 && mesh->faceroi) {
+        roi = &mesh->faceroi;
+        len = 4;
+    } else {
+        return;
+    }
+
+    mesh->roimap = (unsigned int*)calloc(mesh->ne, sizeof(unsigned int));
+
+    for (i = 0; i < mesh->ne; i++) {
+        float* rec = *roi + (size_t)i * len;
+
+        for (j = 0; j < len; j++) {
+            if (rec[j] != 0.f) {
+                mesh->roimap[i] = nrec++;
+                break;
+            }
+        }
+    }
+
+    if ((size_t)nrec * len + mesh->ne >= (size_t)mesh->ne * len) { /** too many ROI elements, keep the per-element array */
+        free(mesh->roimap);
+        mesh->roimap = NULL;
+        return;
+    }
+
+    packed = (float*)calloc((size_t)nrec * len, sizeof(float));
+
+    for (i = 0; i < mesh->ne; i++) {
+        if (mesh->roimap[i]) {
+            memcpy(packed + (size_t)mesh->roimap[i] * len, *roi + (size_t)i * len, sizeof(float) * len);
+        }
+    }
+
+    free(*roi);
+    *roi = packed;
+    mesh->nroirec = nrec;
+
+    MMCDEBUG(cfg, dlTime, (cfg->flog, "packed %u of %d %s ROI records\n", nrec - 1, mesh->ne, (len == 6) ? "edge" : "face"));
+}
+
+/**
+ * @brief Release a uniform-grid index
+ *
+ * @param[in,out] grid: the grid to be released, set to NULL
+ */
+
+void mesh_cleargrid(elemgrid** grid) {
+    if (*grid) {
+        free((*grid)->cellstart);
+        free((*grid)->cellelem);
+        free(*grid);
+        *grid = NULL;
+    }
+}
+
+/**
+ * @brief Fill the cell lists of a uniform-grid index
+ *
+ * The i-th item is binned into the cells [range[6i],range[6i+3]] x [range[6i+1],range[6i+4]]
+ * x [range[6i+2],range[6i+5]]; the items are added in ascending order, so each cell list is
+ * ascending.
+ *
+ * @param[in,out] grid: the grid, with its dimensions set
+ * @param[in] range: the first and the last cell along x/y/z of each item
+ * @param[in] len: the number of items
+ */
+
+static void mesh_fillgrid(elemgrid* grid, const int* range, int len) {
+    int i, ix, iy, iz;
+    size_t ncell = (size_t)grid->dim[0] * grid->dim[1] * grid->dim[2], total;
+
+    grid->cellstart = (int*)calloc(ncell + 1, sizeof(int));
+
+    for (i = 0; i < len; i++) {
+        for (iz = range[i * 6 + 2]; iz <= range[i * 6 + 5]; iz++)
+            for (iy = range[i * 6 + 1]; iy <= range[i * 6 + 4]; iy++)
+                for (ix = range[i * 6]; ix <= range[i * 6 + 3]; ix++) {
+                    grid->cellstart[((size_t)iz * grid->dim[1] + iy) * grid->dim[0] + ix + 1]++;
+                }
+    }
+
+    for (total = 0; total < ncell; total++) {
+        grid->cellstart[total + 1] += grid->cellstart[total];
+    }
+
+    total = grid->cellstart[ncell];
+    grid->cellelem = (int*)malloc(sizeof(int) * (total > 0 ? total : 1));
+
+    for (i = 0; i < len; i++) {
+        for (iz = range[i * 6 + 2]; iz <= range[i * 6 + 5]; iz++)
+            for (iy = range[i * 6 + 1]; iy <= range[i * 6 + 4]; iy++)
+                for (ix = range[i * 6]; ix <= range[i * 6 + 3]; ix++) {
+                    grid->cellelem[grid->cellstart[((size_t)iz * grid->dim[1] + iy) * grid->dim[0] + ix]++] = i;
+                }
+    }
+
+    for (total = ncell; total > 0; total--) {
+        grid->cellstart[total] = grid->cellstart[total - 1];
+    }
+
+    grid->cellstart[0] = 0;
+}
+
+/**
+ * @brief Build a uniform-grid index over the wide-field source candidate elements
+ *
+ * For every wide-field launch, the enclosing element was found by a linear
+ * scan of mesh->srcelem. This function bins the candidates into a uniform grid
+ * so that a launch only tests the elements binned in the cell of the launch
+ * position. Each element is binned by the bounding box of the region accepted
+ * by the launch test (all barycentric volumes >= -1e-4, i.e. the element
+ * enlarged by its tolerance), so that the first match is unchanged.
+ *
+ * @param[in] mesh: the mesh object
+ * @param[in] cfg: the simulation configuration structure
+ */
+
+void mesh_buildsrcgrid(tetmesh* mesh, mcconfig* cfg) {
+    int i, j, k, len = mesh->srcelemlen;
+    float *box, gmin[3] = {VERY_BIG, VERY_BIG, VERY_BIG}, gmax[3] = {-VERY_BIG, -VERY_BIG, -VERY_BIG}, h;
+    int* range;
+    size_t ncell;
+    elemgrid* grid;
+
+    if (mesh->srcgrid || len < MMC_SRCGRID_MIN || mesh->elemlen != 4) {
+        return;
+    }
+
+    box = (float*)malloc(sizeof(float) * 6 * len);
+    range = (int*)malloc(sizeof(int) * 6 * len);
+
+    for (i = 0; i < len; i++) {
+        int* elems = (int*)(mesh->elem + (mesh->srcelem[i] - 1) * mesh->elemlen);
+        FLOAT3* v[4], vecAB, vecAC, vecAD, vecN;
+        float vol6, tau, sum[3] = {0.f}, pad = 0.f;
+
+        for (j = 0; j < 4; j++) {
+            v[j] = mesh->node + elems[j] - 1;
+            sum[0] += v[j]->x;
+            sum[1] += v[j]->y;
+            sum[2] += v[j]->z;
+
+            for (k = 0; k < 3; k++) {
+                gmin[k] = MIN(gmin[k], (&(v[j]->x))[k]);
+                gmax[k] = MAX(gmax[k], (&(v[j]->x))[k]);
+            }
+        }
+
+        vec_diff3(v[0], v[1], &vecAB);
+        vec_diff3(v[0], v[2], &vecAC);
+        vec_diff3(v[0], v[3], &vecAD);
+        vec_cross3(&vecAB, &vecAC, &vecN);
+        vol6 = fabs(vec_dot3(&vecN, &vecAD));
+
+        for (k = 0; k < 3; k++) {
+            box[i * 6 + k] = VERY_BIG;
+            box[i * 6 + k + 3] = -VERY_BIG;
+        }
+
+        /*the accepted region is the tetrahedron with vertices (1+4*tau)*v_k-tau*sum(v)*/
+        tau = (vol6 > 0.f) ? 1e-4f / vol6 : VERY_BIG;
+
+        /*a (nearly) degenerated element is accepted almost anywhere, bin it into all cells*/
+        if (tau > 1e3f) {
+            range[i * 6] = -1;
+            continue;
+        }
+
+        range[i * 6] = 0;
+
+        for (j = 0; j < 4; j++) {
+            float* pv = &(v[j]->x);
+
+            for (k = 0; k < 3; k++) {
+                float c = (1.f + 4.f * tau) * pv[k] - tau * sum[k];
+                box[i * 6 + k] = MIN(box[i * 6 + k], c);
+                box[i * 6 + k + 3] = MAX(box[i * 6 + k + 3], c);
+            }
+        }
+
+        /*pad the box to absorb the round-off of the single-precision launch test*/
+        for (k = 0; k < 3; k++) {
+            pad = MAX(pad, (box[i * 6 + k + 3] - box[i * 6 + k]) * 1e-3f);
+            pad = MAX(pad, fabs(box[i * 6 + k]) * 1e-5f);
+            pad = MAX(pad, fabs(box[i * 6 + k + 3]) * 1e-5f);
+        }
+
+        for (k = 0; k < 3; k++) {
+            box[i * 6 + k] -= pad;
+            box[i * 6 + k + 3] += pad;
+        }
+    }
+
+    /*the grid spans the candidate elements only; boxes and queries beyond it are clamped
+      to the boundary cells, which keeps every accepting element in the queried cell*/
+
+    /*pick the cell size so that the grid holds about one cell per candidate element*/
+    h = MAX(MAX(gmax[0] - gmin[0], gmax[1] - gmin[1]), gmax[2] - gmin[2]);
+
+    if (!(h > 0.f) || h >= VERY_BIG) {
+        free(box);
+        free(range);
+        return;
+    }
+
+    grid = (elemgrid*)calloc(1, sizeof(elemgrid));
+
+    for (i = 0; i < 64; i++) {
+        for (k = 0; k < 3; k++) {
+            grid->dim[k] = MIN((int)((gmax[k] - gmin[k]) / h) + 1, MMC_SRCGRID_MAXDIM);
+        }
+
+        ncell = (size_t)grid->dim[0] * grid->dim[1] * grid->dim[2];
+
+        if (ncell >= (size_t)len || grid->dim[0] * 2 > MMC_SRCGRID_MAXDIM || grid->dim[1] * 2 > MMC_SRCGRID_MAXDIM || grid->dim[2] * 2 > MMC_SRCGRID_MAXDIM) {
+            break;
+        }
+
+        h *= 0.5f;
+    }
+
+    grid->pmin.x = gmin[0];
+    grid->pmin.y = gmin[1];
+    grid->pmin.z = gmin[2];
+    grid->rcellsize = 1.f / h;
+
+    for (i = 0; i < len; i++) {
+        if (range[i * 6] < 0) {
+            for (k = 0; k < 3; k++) {
+                range[i * 6 + k] = 0;
+                range[i * 6 + k + 3] = grid->dim[k] - 1;
+            }
+        } else {
+            for (k = 0; k < 3; k++) {
+                range[i * 6 + k] = (int)MAX(0.f, MIN(floorf((box[i * 6 + k] - gmin[k]) * grid->rcellsize), grid->dim[k] - 1));
+                range[i * 6 + k + 3] = (int)MAX(0.f, MIN(floorf((box[i * 6 + k + 3] - gmin[k]) * grid->rcellsize), grid->dim[k] - 1));
+            }
+        }
+    }
+
+    mesh_fillgrid(grid, range, len);
+
+    free(box);
+    free(range);
+    mesh->srcgrid = grid;
+
+    if (cfg->debuglevel & dlTime) {
+        ncell = (size_t)grid->dim[0] * grid->dim[1] * grid->dim[2];
+        fprintf(cfg->flog, "source element grid: %d x %d x %d cells, %d elements, %d entries\n",
+                grid->dim[0], grid->dim[1], grid->dim[2], len, grid->cellstart[ncell]);
+    }
+}
+
+/**
+ * @brief Build a uniform-grid index over the detector spheres
+ *
+ * A photon exiting the domain was tested against all cfg->detnum detectors.
+ * This function bins the detectors into a uniform grid with a cell edge of
+ * about one detector diameter, so that a photon only tests the detectors binned
+ * in the cell of its exit position. Each detector is binned by the padded
+ * bounding box of its sphere, and the cell lists are ascending, so that the
+ * first detector enclosing the exit position is unchanged. The detectors may
+ * change between the jobs of a batch, so the grid is rebuilt on every call.
+ *
+ * @param[in,out] mesh: the mesh object
+ * @param[in] cfg: the simulation configuration structure
+ */
+
+void mesh_builddetgrid(tetmesh* mesh, mcconfig* cfg) {
+    int i, k, len = cfg->detnum, nzero = 0;
+    float gmin[3] = {VERY_BIG, VERY_BIG, VERY_BIG}, gmax[3] = {-VERY_BIG, -VERY_BIG, -VERY_BIG}, h = 0.f;
+    int* range;
+    size_t ncell;
+    elemgrid* grid;
+
+    mesh_cleargrid(&(mesh->detgrid));
+
+    if (!cfg->issavedet || len < MMC_DETGRID_MIN || cfg->detpos == NULL) {
+        return;
+    }
+
+    for (i = 0; i < len; i++) {
+        float* det = &(cfg->detpos[i].x);
+
+        if (!(det[3] > 0.f)) {
+            nzero++;
+            continue;
+        }
+
+        for (k = 0; k < 3; k++) {
+            gmin[k] = MIN(gmin[k], det[k] - det[3]);
+            gmax[k] = MAX(gmax[k], det[k] + det[3]);
+        }
+
+        h += 2.f * det[3];
+    }
+
+    if (nzero == len) {
+        return;
+    }
+
+    h /= (len - nzero);
+
+    /*coarsen the grid if the detectors are much smaller than their spread*/
+    for (i = 0; i < 64; i++) {
+        ncell = 1;
+
+        for (k = 0; k < 3; k++) {
+            ncell *= (size_t)MIN((int)((gmax[k] - gmin[k]) / h) + 1, MMC_SRCGRID_MAXDIM);
+        }
+
+        if (ncell <= ((size_t)len << 6)) {
+            break;
+        }
+
+        h *= 2.f;
+    }
+
+    grid = (elemgrid*)calloc(1, sizeof(elemgrid));
+    range = (int*)malloc(sizeof(int) * 6 * len);
+
+    for (k = 0; k < 3; k++) {
+        grid->dim[k] = MIN((int)((gmax[k] - gmin[k]) / h) + 1, MMC_SRCGRID_MAXDIM);
+    }
+
+    grid->pmin.x = gmin[0];
+    grid->pmin.y = gmin[1];
+    grid->pmin.z = gmin[2];
+    grid->rcellsize = 1.f / h;
+
+    for (i = 0; i < len; i++) {
+        float* det = &(cfg->detpos[i].x);
+
+        /*a detector of zero radius accepts no photon, it is not binned*/
+        if (!(det[3] > 0.f)) {
+            range[i * 6] = 1;
+            range[i * 6 + 3] = 0;
+            range[i * 6 + 1] = range[i * 6 + 2] = range[i * 6 + 4] = range[i * 6 + 5] = 0;
+            continue;
+        }
+
+        /*pad the box to absorb the round-off of the single-precision distance test*/
+        for (k = 0; k < 3; k++) {
+            float pad = MAX(det[3] * 1e-3f, fabs(det[k]) * 1e-5f);
+
+            range[i * 6 + k] = (int)MAX(0.f, MIN(floorf((det[k] - det[3] - pad - gmin[k]) * grid->rcellsize), grid->dim[k] - 1));
+            range[i * 6 + k + 3] = (int)MAX(0.f, MIN(floorf((det[k] + det[3] + pad - gmin[k]) * grid->rcellsize), grid->dim[k] - 1));
+        }
+    }
+
+    mesh_fillgrid(grid, range, len);
+
+    free(range);
+    mesh->detgrid = grid;
+
+    if (cfg->debuglevel & dlTime) {
+        ncell = (size_t)grid->dim[0] * grid->dim[1] * grid->dim[2];
+        fprintf(cfg->flog, "detector grid: %d x %d x %d cells, %d detectors, %d entries\n",
+                grid->dim[0], grid->dim[1], grid->dim[2], len, grid->cellstart[ncell]);
+    }
+}
+
+/**
+ * @brief Return the candidate elements binned in the grid cell enclosing a point
+ *
+ * @param[in] grid: the uniform-grid index built by mesh_buildsrcgrid
+ * @param[in] p: the query position
+ * @param[out] count: the number of candidates; p outside of the grid is clamped to the boundary cells
+ *
+ * @return the ascending positions (start from 0) of the candidates in the indexed element list
+ */
+
+int* mesh_gridquery(elemgrid* grid, FLOAT3* p, int* count) {
+    int ix = (int)MAX(0.f, MIN(floorf((p->x - grid->pmin.x) * grid->rcellsize), grid->dim[0] - 1));
+    int iy = (int)MAX(0.f, MIN(floorf((p->y - grid->pmin.y) * grid->rcellsize), grid->dim[1] - 1));
+    int iz = (int)MAX(0.f, MIN(floorf((p->z - grid->pmin.z) * grid->rcellsize), grid->dim[2] - 1));
+    size_t c = ((size_t)iz * grid->dim[1] + iy) * grid->dim[0] + ix;
+
+    *count = grid->cellstart[c + 1] - grid->cellstart[c];
+    return grid->cellelem + grid->cellstart[c];
+}
+
+/**
+ * @brief Append a uniform-grid index to a copy of its item list for the GPU
+ *
+ * The GPU reads an item list and its grid from one buffer: the list, followed
+ * by the ncell+1 cell starts, then the cell lists. The cell starts are shifted
+ * to index the packed buffer directly.
+ *
+ * @param[in] grid: the grid built by mesh_buildsrcgrid or mesh_builddetgrid
+ * @param[in] list: the items indexed by the grid, NULL to pack the grid alone
+ * @param[in] listlen: the length of list
+ * @param[out] len: the length of the returned buffer
+ *
+ * @return the packed buffer, to be freed by the caller, or list if grid is NULL
+ */
+
+int* mesh_packgrid(elemgrid* grid, int* list, int listlen, int* len) {
+    int* packed;
+    int i, ncell, offset;
+
+    *len = listlen;
+
+    if (grid == NULL) {
+        return list;
+    }
+
+    listlen = (list ? listlen : 0);
+    ncell = grid->dim[0] * grid->dim[1] * grid->dim[2];
+    offset = listlen + ncell + 1;
+    *len = offset + grid->cellstart[ncell];
+    packed = (int*)malloc(sizeof(int) * (*len));
+
+    if (list) {
+        memcpy(packed, list, sizeof(int) * listlen);
+    }
+
+    for (i = 0; i <= ncell; i++) {
+        packed[listlen + i] = grid->cellstart[i] + offset;
+    }
+
+    memcpy(packed + offset, grid->cellelem, sizeof(int) * grid->cellstart[ncell]);
+    return packed;
+}
+
+/**
+ * @brief Move the nth-smallest triangle along an axis to position nth of a list
+ *
+ * A quickselect over the triangle centroids, the triangles before nth are not
+ * larger and those after are not smaller along the axis.
+ *
+ * @param[in,out] order: the triangle indices to be partitioned
+ * @param[in] cent: 3 centroid coordinates per triangle
+ * @param[in] len: the length of order
+ * @param[in] nth: the position to be resolved
+ * @param[in] axis: the axis (0-2) of the sort key
+ */
+
+static void mesh_bvhselect(int* order, const float* cent, int len, int nth, int axis) {
+    int lo = 0, hi = len - 1;
+
+    while (lo < hi) {
+        float pivot = cent[order[(lo + hi) >> 1] * 3 + axis];
+        int i = lo, j = hi, tmp;
+
+        while (i <= j) {
+            while (cent[order[i] * 3 + axis] < pivot) {
+                i++;
+            }
+
+            while (cent[order[j] * 3 + axis] > pivot) {
+                j--;
+            }
+
+            if (i <= j) {
+                tmp = order[i];
+                order[i++] = order[j];
+                order[j--] = tmp;
+            }
+        }
+
+        if (nth <= j) {
+            hi = j;
+        } else if (nth >= i) {
+            lo = i;
+        } else {
+            break;
+        }
+    }
+}
+
+/**
+ * @brief Build a BVH over the exterior faces for a source outside of the mesh
+ *
+ * When a point source is not enclosed by any element, or a wide-field source
+ * has no element labeled with -1, the launched photons enter the mesh from
+ * the outside. Each launched ray then finds its entry face by a ray query in
+ * a binary tree of bounding boxes over the exterior triangles, split at the
+ * median centroid along the longest axis until a leaf holds at most
+ * MMC_SURFBVH_LEAF triangles. The tree is built once and kept across the jobs
+ * of a batch. A pencil beam must hit the mesh surface from the outside. The
+ * GPU backends still require a point source inside of the mesh.
+ *
+ * @param[in,out] mesh: the mesh object, with facenb numbered by tracer_prep
+ * @param[in] cfg: the simulation configuration structure
+ */
+
+void mesh_buildsurfbvh(tetmesh* mesh, mcconfig* cfg) {
+    int i, j, k, nf = 0, top = 0, *order, *face, stack[MMC_SURFBVH_DEPTH * 3];
+    float* cent;
+    FLOAT3* tri;
+    facebvh* bvh;
+    int ispoint = (cfg->srctype == stPencil || cfg->srctype == stIsotropic || cfg->srctype == stCone || cfg->srctype == stArcSin);
+
+    /*the source of a partitioned mesh is inside of the partition of one rank, see mesh_partition*/
+    if (ispoint ? (cfg->e0 > 0 || mesh->part) : (mesh->srcelemlen > 0 || mesh->elemlen != 4 || cfg->compute != cbSSE)) {
+        return;
+    }
+
+    if (mesh->facenb == NULL || mesh->elemlen != 4 || cfg->srclist) {
+        MESH_ERROR("initial element does not enclose the source!");
+    }
+
+    if (cfg->compute != cbSSE) {
+        MESH_ERROR("a source outside of the mesh is only supported by the CPU backend");
+    }
+
+    if (mesh->surfbvh == NULL) {
+        for (i = 0; i < mesh->ne * 4; i++) {
+            nf += (mesh->facenb[i] <= 0);
+        }
+
+        if (nf == 0) {
+            MESH_ERROR("the mesh has no exterior face to enter");
+        }
+
+        tri = (FLOAT3*)malloc(sizeof(FLOAT3) * 3 * nf);
+        face = (int*)malloc(sizeof(int) * nf);
+        order = (int*)malloc(sizeof(int) * nf);
+        cent = (float*)malloc(sizeof(float) * 3 * nf);
+
+        for (i = 0, nf = 0; i < mesh->ne; i++) {
+            int* ee = (int*)(mesh->elem + i * mesh->elemlen);
+
+            for (j = 0; j < 4; j++) {
+                const int* fn = out[ifaceorder[j]];
+                FLOAT3 *pa, *pb, *pc, *pd, vecN, vecD;
+
+                if (mesh->facenb[i * 4 + j] > 0) {
+                    continue;
+                }
+
+                pa = mesh->node + ee[fn[0]] - 1;
+                pb = mesh->node + ee[fn[1]] - 1;
+                pc = mesh->node + ee[fn[2]] - 1;
+                pd = mesh->node + ee[6 - fn[0] - fn[1] - fn[2]] - 1;
+
+                tri[nf * 3] = *pa;
+                vec_diff3(pa, pb, tri + nf * 3 + 1);
+                vec_diff3(pa, pc, tri + nf * 3 + 2);
+                vec_cross3(tri + nf * 3 + 1, tri + nf * 3 + 2, &vecN);
+                vec_diff3(pa, pd, &vecD);
+
+                /*orient AB x AC away from the 4th node of the element*/
+                if (vec_dot3(&vecN, &vecD) > 0.f) {
+                    vecD = tri[nf * 3 + 1];
+                    tri[nf * 3 + 1] = tri[nf * 3 + 2];
+                    tri[nf * 3 + 2] = vecD;
+                }
+
+                cent[nf * 3]     = (pa->x + pb->x + pc->x) * (1.f / 3.f);
+                cent[nf * 3 + 1] = (pa->y + pb->y + pc->y) * (1.f / 3.f);
+                cent[nf * 3 + 2] = (pa->z + pb->z + pc->z) * (1.f / 3.f);
+                face[nf] = i * 4 + j;
+                order[nf] = nf;
+                nf++;
+            }
+        }
+
+        bvh = (facebvh*)calloc(1, sizeof(facebvh));
+        bvh->trinum = nf;
+        bvh->node = (bvhnode*)malloc(sizeof(bvhnode) * 2 * nf);
+        bvh->nodenum = 1;
+
+        /*each stack entry is a node and its range of triangles in order*/
+        stack[0] = 0;
+        stack[1] = 0;
+        stack[2] = nf;
+        top = 1;
+
+        while (top > 0) {
+            int id, begin, end, axis = 0;
+            bvhnode* node;
+            float ext[3];
+
+            top--;
+            id = stack[top * 3];
+            begin = stack[top * 3 + 1];
+            end = stack[top * 3 + 2];
+            node = bvh->node + id;
+            node->pmin.x = node->pmin.y = node->pmin.z = VERY_BIG;
+            node->pmax.x = node->pmax.y = node->pmax.z = -VERY_BIG;
+
+            for (i = begin; i < end; i++) {
+                FLOAT3* t = tri + order[i] * 3;
+
+                for (k = 0; k < 3; k++) {
+                    float a = (&(t[0].x))[k], b = a + (&(t[1].x))[k], c = a + (&(t[2].x))[k];
+
+                    (&(node->pmin.x))[k] = MIN((&(node->pmin.x))[k], MIN(a, MIN(b, c)));
+                    (&(node->pmax.x))[k] = MAX((&(node->pmax.x))[k], MAX(a, MAX(b, c)));
+                }
+            }
+
+            if (end - begin <= MMC_SURFBVH_LEAF || top >= MMC_SURFBVH_DEPTH - 2) {
+                node->start = begin;
+                node->count = end - begin;
+                continue;
+            }
+
+            for (k = 0; k < 3; k++) {
+                ext[k] = (&(node->pmax.x))[k] - (&(node->pmin.x))[k];
+            }
+
+            axis = (ext[1] > ext[0]) ? 1 : 0;
+            axis = (ext[2] > ext[axis]) ? 2 : axis;
+
+            mesh_bvhselect(order + begin, cent, end - begin, (end - begin) >> 1, axis);
+
+            node->start = bvh->nodenum;
+            node->count = 0;
+            stack[top * 3] = bvh->nodenum;
+            stack[top * 3 + 1] = begin;
+            stack[top * 3 + 2] = begin + ((end - begin) >> 1);
+            top++;
+            stack[top * 3] = bvh->nodenum + 1;
+            stack[top * 3 + 1] = begin + ((end - begin) >> 1);
+            stack[top * 3 + 2] = end;
+            top++;
+            bvh->nodenum += 2;
+        }
+
+        /*store the triangles in the leaf order*/
+        bvh->tri = (FLOAT3*)malloc(sizeof(FLOAT3) * 3 * nf);
+        bvh->face = (int*)malloc(sizeof(int) * nf);
+
+        for (i = 0; i < nf; i++) {
+            memcpy(bvh->tri + i * 3, tri + order[i] * 3, sizeof(FLOAT3) * 3);
+            bvh->face[i] = face[order[i]];
+        }
+
+        free(tri);
+        free(face);
+        free(order);
+        free(cent);
+        mesh->surfbvh = bvh;
+
+        if (cfg->debuglevel & dlTime) {
+            fprintf(cfg->flog, "surface BVH: %d exterior faces, %d nodes\n", nf, bvh->nodenum);
+        }
+    }
+
+    if (cfg->srctype == stPencil) {
+        FLOAT3 vecN;
+        float dist;
+
+        i = mesh_surfhit(mesh->surfbvh, (FLOAT3*) & (cfg->srcpos), (FLOAT3*) & (cfg->srcdir), &dist);
+
+        if (i >= 0) {
+            vec_cross3(mesh->surfbvh->tri + i * 3 + 1, mesh->surfbvh->tri + i * 3 + 2, &vecN);
+        }
+
+        if (i < 0 || vec_dot3(&vecN, (FLOAT3*) & (cfg->srcdir)) >= 0.f) {
+            MESH_ERROR("the source is outside of the mesh and the pencil beam does not enter the mesh surface");
+        }
+    }
+}
+
+/**
+ * @brief Find the nearest exterior triangle hit by a ray
+ *
+ * @param[in] bvh: the BVH built by mesh_buildsurfbvh
+ * @param[in] p0: the origin of the ray
+ * @param[in] v: the unit direction of the ray
+ * @param[out] dist: the distance from p0 to the hit
+ *
+ * @return the index of the hit triangle in bvh->tri and bvh->face, -1 if the ray misses
+ */
+
+int mesh_surfhit(facebvh* bvh, FLOAT3* p0, FLOAT3* v, float* dist) {
+    int stack[MMC_SURFBVH_DEPTH], top = 1, hit = -1, i, k;
+    float rv[3], tbest = VERY_BIG;
+
+    for (k = 0; k < 3; k++) {
+        float c = (&(v->x))[k];
+        rv[k] = (c != 0.f) ? 1.f / c : ((c < 0.f) ? -VERY_BIG : VERY_BIG);
+    }
+
+    stack[0] = 0;
+
+    while (top > 0) {
+        bvhnode* node = bvh->node + stack[--top];
+        float tnear = 0.f, tfar = tbest;
+
+        /*slab test of the bounding box*/
+        for (k = 0; k < 3; k++) {
+            float t1 = ((&(node->pmin.x))[k] - (&(p0->x))[k]) * rv[k];
+            float t2 = ((&(node->pmax.x))[k] - (&(p0->x))[k]) * rv[k];
+
+            tnear = MAX(tnear, MIN(t1, t2));
+            tfar = MIN(tfar, MAX(t1, t2));
+        }
+
+        if (tnear > tfar) {
+            continue;
+        }
+
+        if (node->count == 0) {
+            stack[top++] = node->start;
+            stack[top++] = node->start + 1;
+            continue;
+        }
+
+        /*Moller-Trumbore ray-triangle test*/
+        for (i = node->start; i < node->start + node->count; i++) {
+            FLOAT3* t = bvh->tri + i * 3;
+            FLOAT3 pvec, tvec, qvec;
+            float det, u, w, d;
+
+            vec_cross3(v, t + 2, &pvec);
+            det = vec_dot3(t + 1, &pvec);
+
+            if (det == 0.f) {
+                continue;
+            }
+
+            det = 1.f / det;
+            vec_diff3(t, p0, &tvec);
+            u = vec_dot3(&tvec, &pvec) * det;
+
+            if (u < 0.f || u > 1.f) {
+                continue;
+            }
+
+            vec_cross3(&tvec, t + 1, &qvec);
+            w = vec_dot3(v, &qvec) * det;
+
+            if (w < 0.f || u + w > 1.f) {
+                continue;
+            }
+
+            d = vec_dot3(t + 2, &qvec) * det;
+
+            if (d > 0.f && d < tbest) {
+                tbest = d;
+                hit = i;
+            }
+        }
+    }
+
+    *dist = tbest;
+    return hit;
+}
+
+/**
+ * @brief Survival probability of a Brownian path started at the center of a sphere
+ *
+ * @param[in] tau: the dimensionless time D*t/R^2, D is the diffusion coefficient and R the sphere radius
+ *
+ * @return the probability 2*sum((-1)^(n+1)*exp(-n^2*pi^2*tau)) that the path has not reached the sphere
+ */
+
+static double mesh_diffsurvival(double tau) {
+    double s = 0.0, term;
+    int n;
+
+    for (n = 1; ; n++) {
+        term = 2.0 * exp(-n * n * M_PI * M_PI * tau);
+        s += (n & 1) ? term : -term;
+
+        if (term < 1e-12) {
+            break;
+        }
+    }
+
+    return MIN(MAX(s, 0.0), 1.0);
+}
+
+/**
+ * @brief Build the sphere radii and the first-passage time table of the --diffusion jumps
+ *
+ * A photon scattering inside a label of cfg->difflabel may jump, by the
+ * diffusion kernel, to the surface of a sphere around it, provided that the
+ * sphere stays inside its label. The label boundary is made of the faces
+ * whose neighbor is exterior or carries another label. These faces are binned
+ * by their centroids into a uniform grid; for each element of the labels, the
+ * grid shells around its centroid c are searched for the lower bound
+ * min(|c-cf|-rf) of the distance to the boundary, where cf and rf are the
+ * centroid and the circumradius (about cf) of a face. The radius stored in
+ * mesh->diffradius subtracts the distance from c to the farthest node, so
+ * that it holds for any point of the element. The search stops after
+ * MMC_DIFF_MAXSHELL shells, which caps the radius. mesh->difftau tabulates the
+ * quantiles of the dimensionless first-passage time from the sphere center.
+ * It must be called after tracer_prep and mesh_reorder.
+ *
+ * @param[in,out] mesh: the mesh object
+ * @param[in] cfg: the simulation configuration structure
+ */
+
+void mesh_builddiffusion(tetmesh* mesh, mcconfig* cfg) {
+    int i, j, k, len = 0, nbin = 0, *range;
+    float gmin[3] = {VERY_BIG, VERY_BIG, VERY_BIG}, gmax[3] = {-VERY_BIG, -VERY_BIG, -VERY_BIG}, h = 0.f, rmax = 0.f, maxradius = 0.f;
+    float4* face;
+    char* islabel;
+    size_t ncell;
+    elemgrid* grid;
+
+    if (mesh->diffradius) {
+        free(mesh->diffradius);
+        mesh->diffradius = NULL;
+    }
+
+    if (mesh->difftau) {
+        free(mesh->difftau);
+        mesh->difftau = NULL;
+    }
+
+    if (cfg->difflabel == NULL || mesh->elemlen != 4 || mesh->facenb == NULL || mesh->ne <= 0) {
+        return;
+    }
+
+    islabel = (char*)calloc(mesh->prop + 1, sizeof(char));
+
+    for (i = 0; i < cfg->diffnum; i++) {
+        if (cfg->difflabel[i] > 0 && cfg->difflabel[i] <= mesh->prop) {
+            islabel[cfg->difflabel[i]] = 1;
+        }
+    }
+
+    for (i = 0; i < mesh->ne; i++) {
+        int* enb = mesh->facenb + i * mesh->elemlen;
+
+        if (islabel[mesh->type[i]]) {
+            for (j = 0; j < 4; j++) {
+                len += (enb[j] <= 0 || mesh->type[enb[j] - 1] != mesh->type[i]);
+            }
+        }
+    }
+
+    if (len == 0) {
+        free(islabel);
+        return;
+    }
+
+    /*the centroid and circumradius of each boundary face, the grid also covers the element centroids*/
+    face = (float4*)malloc(sizeof(float4) * len);
+    len = 0;
+
+    for (i = 0; i < mesh->ne; i++) {
+        int* enb = mesh->facenb + i * mesh->elemlen;
+        int* ee = mesh->elem + i * mesh->elemlen;
+
+        if (!islabel[mesh->type[i]]) {
+            continue;
+        }
+
+        for (j = 0; j < 4; j++) {
+            FLOAT3* pn[3];
+            float4 f = {0.f, 0.f, 0.f, 0.f};
+
+            if (enb[j] > 0 && mesh->type[enb[j] - 1] == mesh->type[i]) {
+                continue;
+            }
+
+            /*facenb slot j holds the neighbor across the face out[ifaceorder[j]]*/
+            for (k = 0; k < 3; k++) {
+                pn[k] = mesh->node + ee[out[ifaceorder[j]][k]] - 1;
+                f.x += pn[k]->x * (1.f / 3.f);
+                f.y += pn[k]->y * (1.f / 3.f);
+                f.z += pn[k]->z * (1.f / 3.f);
+            }
+
+            for (k = 0; k < 3; k++) {
+                FLOAT3 d = {pn[k]->x - f.x, pn[k]->y - f.y, pn[k]->z - f.z};
+                f.w = MAX(f.w, sqrtf(d.x * d.x + d.y * d.y + d.z * d.z));
+            }
+
+            gmin[0] = MIN(gmin[0], f.x);
+            gmin[1] = MIN(gmin[1], f.y);
+            gmin[2] = MIN(gmin[2], f.z);
+            gmax[0] = MAX(gmax[0], f.x);
+            gmax[1] = MAX(gmax[1], f.y);
+            gmax[2] = MAX(gmax[2], f.z);
+            rmax = MAX(rmax, f.w);
+            h += 2.f * f.w;
+            face[len++] = f;
+        }
+
+        for (j = 0; j < 4; j++) {
+            gmin[0] = MIN(gmin[0], mesh->node[ee[j] - 1].x);
+            gmin[1] = MIN(gmin[1], mesh->node[ee[j] - 1].y);
+            gmin[2] = MIN(gmin[2], mesh->node[ee[j] - 1].z);
+            gmax[0] = MAX(gmax[0], mesh->node[ee[j] - 1].x);
+            gmax[1] = MAX(gmax[1], mesh->node[ee[j] - 1].y);
+            gmax[2] = MAX(gmax[2], mesh->node[ee[j] - 1].z);
+        }
+    }
+
+    h = MAX(h / len, EPS);
+
+    /*coarsen the grid to about one face per cell, without clamping any centroid to the last cell*/
+    for (k = 0; k < 3; k++) {
+        h = MAX(h, (gmax[k] - gmin[k]) / (MMC_SRCGRID_MAXDIM - 1));
+    }
+
+    for (i = 0; i < 64; i++) {
+        ncell = 1;
+
+        for (k = 0; k < 3; k++) {
+            ncell *= (size_t)((gmax[k] - gmin[k]) / h) + 1;
+        }
+
+        if (ncell <= (size_t)len) {
+            break;
+        }
+
+        h *= 2.f;
+    }
+
+    grid = (elemgrid*)calloc(1, sizeof(elemgrid));
+    range = (int*)malloc(sizeof(int) * 6 * len);
+
+    for (k = 0; k < 3; k++) {
+        grid->dim[k] = (int)((gmax[k] - gmin[k]) / h) + 1;
+    }
+
+    grid->pmin.x = gmin[0];
+    grid->pmin.y = gmin[1];
+    grid->pmin.z = gmin[2];
+    grid->rcellsize = 1.f / h;
+
+    for (i = 0; i < len; i++) {
+        range[i * 6] = range[i * 6 + 3] = (int)MAX(0.f, MIN(floorf((face[i].x - gmin[0]) * grid->rcellsize), grid->dim[0] - 1));
+        range[i * 6 + 1] = range[i * 6 + 4] = (int)MAX(0.f, MIN(floorf((face[i].y - gmin[1]) * grid->rcellsize), grid->dim[1] - 1));
+        range[i * 6 + 2] = range[i * 6 + 5] = (int)MAX(0.f, MIN(floorf((face[i].z - gmin[2]) * grid->rcellsize), grid->dim[2] - 1));
+    }
+
+    mesh_fillgrid(grid, range, len);
+    free(range);
+
+    mesh->diffradius = (float*)calloc(mesh->ne, sizeof(float));
+
+    #pragma omp parallel for schedule(dynamic, 256) private(j, k) reduction(+:nbin) reduction(max:maxradius)
+    for (i = 0; i < mesh->ne; i++) {
+        int* ee = mesh->elem + i * mesh->elemlen;
+        int c[3], shell, ix, iy, iz;
+        float p[3] = {0.f, 0.f, 0.f}, re = 0.f, best = VERY_BIG;
+
+        if (!islabel[mesh->type[i]]) {
+            continue;
+        }
+
+        for (j = 0; j < 4; j++) {
+            p[0] += mesh->node[ee[j] - 1].x * 0.25f;
+            p[1] += mesh->node[ee[j] - 1].y * 0.25f;
+            p[2] += mesh->node[ee[j] - 1].z * 0.25f;
+        }
+
+        for (j = 0; j < 4; j++) {
+            float dx = mesh->node[ee[j] - 1].x - p[0], dy = mesh->node[ee[j] - 1].y - p[1], dz = mesh->node[ee[j] - 1].z - p[2];
+            re = MAX(re, sqrtf(dx * dx + dy * dy + dz * dz));
+        }
+
+        for (k = 0; k < 3; k++) {
+            c[k] = (int)MAX(0.f, MIN(floorf((p[k] - gmin[k]) * grid->rcellsize), grid->dim[k] - 1));
+        }
+
+        /*a face outside of the searched shells is at least shell*h away from the element centroid*/
+        for (shell = 0; shell <= MMC_DIFF_MAXSHELL; shell++) {
+            for (iz = c[2] - shell; iz <= c[2] + shell; iz++) {
+                for (iy = c[1] - shell; iy <= c[1] + shell; iy++) {
+                    int step = (abs(iz - c[2]) == shell || abs(iy - c[1]) == shell) ? 1 : MAX(2 * shell, 1);
+
+                    if (iz < 0 || iz >= grid->dim[2] || iy < 0 || iy >= grid->dim[1]) {
+                        continue;
+                    }
+
+                    for (ix = c[0] - shell; ix <= c[0] + shell; ix += step) {
+                        size_t cell = ((size_t)iz * grid->dim[1] + iy) * grid->dim[0] + ix;
+
+                        if (ix < 0 || ix >= grid->dim[0]) {
+                            continue;
+                        }
+
+                        for (j = grid->cellstart[cell]; j < grid->cellstart[cell + 1]; j++) {
+                            float4* f = face + grid->cellelem[j];
+                            float dx = f->x - p[0], dy = f->y - p[1], dz = f->z - p[2];
+
+                            best = MIN(best, sqrtf(dx * dx + dy * dy + dz * dz) - f->w);
+                        }
+                    }
+                }
+            }
+
+            if (best <= shell * h - rmax) {
+                break;
+            }
+        }
+
+        best = MIN(best, MMC_DIFF_MAXSHELL * h - rmax) - re;
+
+        if (best > 0.f) {
+            mesh->diffradius[i] = best;
+            maxradius = MAX(maxradius, best);
+            nbin++;
+        }
+    }
+
+    /*the quantiles of the first-passage time at the centers of MMC_DIFF_CDF_LEN equal-probability bins*/
+    mesh->difftau = (float*)malloc(sizeof(float) * MMC_DIFF_CDF_LEN);
+
+    #pragma omp parallel for private(j)
+    for (i = 0; i < MMC_DIFF_CDF_LEN; i++) {
+        double lo = 1e-4, hi = 20.0, surv = 1.0 - (i + 0.5) / MMC_DIFF_CDF_LEN;
+
+        for (j = 0; j < 60; j++) {
+            double mid = 0.5 * (lo + hi);
+            *((mesh_diffsurvival(mid) > surv) ? &lo : &hi) = mid;
+        }
+
+        mesh->difftau[i] = (float)(0.5 * (lo + hi));
+    }
+
+    if (cfg->debuglevel & dlTime) {
+        ncell = (size_t)grid->dim[0] * grid->dim[1] * grid->dim[2];
+        fprintf(cfg->flog, "diffusion grid: %d x %d x %d cells, %d boundary faces, %d elements may jump up to %f\n",
+                grid->dim[0], grid->dim[1], grid->dim[2], len, nbin, maxradius);
+    }
+
+    mesh_cleargrid(&grid);
+    free(face);
+    free(islabel);
+}
+
+/**
+ * @brief Map the elements selected by --outmask to the rows of a compact output
+ *
+ * cfg->outmask holds one or more selections joined by ';': 'label:l1,l2,...'
+ * selects the elements of these labels, 'elem:i,j,...' (1-based) or
+ * 'elem:file' (one index per line) the listed elements, and
+ * 'box:x0,y0,z0,x1,y1,z1' the elements whose centroid is inside the box. The
+ * selected elements take the output rows 0 to outlen-1 in the input order, so
+ * that the saved frames only hold them; the deposits of the other elements go
+ * to one row after all frames, mesh->outsink, which the normalization adds to
+ * the deposited energy. The output buffer is reallocated to the compact size.
+ * It must be called before mesh_reorder, which renumbers mesh->outmap.
+ *
+ * @param[in,out] mesh: the mesh object
+ * @param[in] cfg: the simulation configuration structure
+ */
+
+void mesh_buildoutmask(tetmesh* mesh, mcconfig* cfg) {
+    char spec[MAX_PATH_LENGTH], *sel, *list, *next, *end;
+    int i, j;
+
+    if (mesh->outmap) {
+        free(mesh->outmap);
+        mesh->outmap = NULL;
+    }
+
+    mesh->outlen = 0;
+
+    if (cfg->outmask[0] == '\0') {
+        return;
+    }
+
+    if (mesh->elemorder) {
+        MESH_ERROR("the output mask must be built before the mesh is reordered");
+    }
+
+    mesh->outmap = (int*)malloc(sizeof(int) * mesh->ne);
+
+    for (i = 0; i < mesh->ne; i++) {
+        mesh->outmap[i] = -1;
+    }
+
+    strncpy(spec, cfg->outmask, MAX_PATH_LENGTH - 1);
+    spec[MAX_PATH_LENGTH - 1] = '\0';
+
+    /*mark the selected elements by 0*/
+    for (sel = spec; sel; sel = next) {
+        if ((next = strchr(sel, ';')) != NULL) {
+            *(next++) = '\0';
+        }
+
+        if ((list = strchr(sel, ':')) == NULL) {
+            MESH_ERROR("--outmask must be 'label:...', 'elem:...' or 'box:...'");
+        }
+
+        *(list++) = '\0';
+
+        if (strcmp(sel, "label") == 0) {
+            char* islabel = (char*)calloc(mesh->prop + 1, sizeof(char));
+
+            for (end = list; *list; list = end + strspn(end, ", ")) {
+                long label = strtol(list, &end, 10);
+
+                if (end == list || label <= 0 || label > mesh->prop) {
+                    free(islabel);
+                    MESH_ERROR("the labels of --outmask must be between 1 and the label count");
+                }
+
+                islabel[label] = 1;
+            }
+
+            for (i = 0; i < mesh->ne; i++) {
+                if (mesh->type[i] > 0 && islabel[mesh->type[i]]) {
+                    mesh->outmap[i] = 0;
+                }
+            }
+
+            free(islabel);
+        } else if (strcmp(sel, "elem") == 0) {
+            if (*list >= '0' && *list <= '9') {
+                for (end = list; *list; list = end + strspn(end, ", ")) {
+                    long eid = strtol(list, &end, 10);
+
+                    if (end == list || eid <= 0 || eid > mesh->ne) {
+                        MESH_ERROR("the element indices of --outmask must be between 1 and the element count");
+                    }
+
+                    mesh->outmap[eid - 1] = 0;
+                }
+            } else {
+                FILE* fp = fopen(list, "rt");
+
+                if (fp == NULL) {
+                    MESH_ERROR("can not open the element list of --outmask");
+                }
+
+                while (fscanf(fp, "%d", &j) == 1) {
+                    if (j <= 0 || j > mesh->ne) {
+                        fclose(fp);
+                        MESH_ERROR("the element indices of --outmask must be between 1 and the element count");
+                    }
+
+                    mesh->outmap[j - 1] = 0;
+                }
+
+                fclose(fp);
+            }
+        } else if (strcmp(sel, "box") == 0) {
+            float b[6];
+
+            if (sscanf(list, "%f,%f,%f,%f,%f,%f", b, b + 1, b + 2, b + 3, b + 4, b + 5) != 6) {
+                MESH_ERROR("the box of --outmask must be 'box:x0,y0,z0,x1,y1,z1'");
+            }
+
+            for (i = 0; i < mesh->ne; i++) {
+                int* ee = mesh->elem + (size_t)i * mesh->elemlen;
+                FLOAT3 c = {0.f, 0.f, 0.f};
+
+                for (j = 0; j < 4; j++) {
+                    c.x += mesh->node[ee[j] - 1].x * 0.25f;
+                    c.y += mesh->node[ee[j] - 1].y * 0.25f;
+                    c.z += mesh->node[ee[j] - 1].z * 0.25f;
+                }
+
+                if (c.x >= MIN(b[0], b[3]) && c.x <= MAX(b[0], b[3]) && c.y >= MIN(b[1], b[4]) && c.y <= MAX(b[1], b[4])
+                        && c.z >= MIN(b[2], b[5]) && c.z <= MAX(b[2], b[5])) {
+                    mesh->outmap[i] = 0;
+                }
+            }
+        } else {
+            MESH_ERROR("--outmask must be 'label:...', 'elem:...' or 'box:...'");
+        }
+    }
+
+    for (i = 0; i < mesh->ne; i++) {
+        if (mesh->outmap[i] == 0) {
+            mesh->outmap[i] = mesh->outlen++;
+        }
+    }
+
+    if (mesh->outlen == 0) {
+        MESH_ERROR("--outmask does not select any element");
+    }
+
+    /*the output was allocated for all elements when the mesh was loaded*/
+    free(mesh->weight);
+    mesh->weight = NULL;
+    free(mesh->weightvar);
+    mesh->weightvar = NULL;
+    mesh_initweight(mesh, cfg);
+
+    MMCDEBUG(cfg, dlTime, (cfg->flog, "output mask: %d of %d elements\n", mesh->outlen, mesh->ne));
+}
+
+/**
+ * @brief Initialize a data structure storing all pre-computed ray-tracing related data
+ *
+ * the pre-computed ray-tracing data include
+ * d: the vector of the 6 edges
+ * m: the cross-product of the end-nodes of the 6-edges n1 x n2
+ * n: the normal vector of the 4 facets, pointing outwards
+ *
+ * @param[out] tracer: the ray-tracer data structure
+ * @param[in] pmesh: the mesh object
+ * @param[in] methodid: the ray-tracing algorithm to be used
+ */
+
+void tracer_init(raytracer* tracer, tetmesh* pmesh, char methodid) {
+    tracer->d = NULL;
+    tracer->m = NULL;
+    tracer->n = NULL;
+    tracer->isedgetable = 0;
+    tracer->nedge = 0;
+    tracer->edge = NULL;
+    tracer->mesh = pmesh;
+    tracer->method = methodid;
+    tracer_build(tracer);
+}
+
+
+/**
+ * @brief Update a 64-bit hash with the content of a buffer
+ *
+ * A word-wise variant of FNV-1a, with an extra xor-shift to mix the high bits
+ *
+ * @param[in] buf: the buffer to be hashed
+ * @param[in] len: the length of the buffer in bytes
+ * @param[in] hash: the hash of the previous buffers, or the FNV offset basis
+ */
+
+unsigned long long mesh_hashbuffer(const void* buf, size_t len, unsigned long long hash) {
+    const unsigned char* p = (const unsigned char*)buf;
+    unsigned long long word;
+    size_t i;
+
+    for (i = 0; i + sizeof(word) <= len; i += sizeof(word)) {
+        memcpy(&word, p + i, sizeof(word));
+        hash = (hash ^ word) * 0x100000001b3ULL;
+        hash ^= hash >> 29;
+    }
+
+    for (; i < len; i++) {
+        hash = (hash ^ p[i]) * 0x100000001b3ULL;
+    }
+
+    return hash;
+}
+
+/**
+ * @brief Initialize the ray-tracer using the persistent on-disk cache
+ *
+ * When cfg->iscachetracer is set, the precomputed ray-tracing data are read
+ * from tracer_<tag>_<hash>.mmct in the root path, where hash is computed from
+ * the node coordinates, the element connectivity and the ray-tracing method;
+ * if the file does not exist, the data are built by tracer_build() and saved
+ * for later runs. Otherwise, this is identical to tracer_init().
+ *
+ * @param[out] tracer: the ray-tracer data structure
+ * @param[in] pmesh: the mesh object
+ * @param[in] cfg: the simulation configuration structure
+ */
+
+void tracer_init_from_cache(raytracer* tracer, tetmesh* pmesh, mcconfig* cfg) {
+    char format[MAX_PATH_LENGTH], fcache[MAX_FULL_PATH], ftmp[MAX_FULL_PATH + 4];
+    float3** data[3] = {&(tracer->d), &(tracer->m), &(tracer->n)};
+    tracerheader head, filehead;
+    FILE* fp;
+    int i;
+
+    tracer->d = NULL;
+    tracer->m = NULL;
+    tracer->n = NULL;
+    tracer->mesh = pmesh;
+    tracer->method = cfg->method;
+    tracer->isedgetable = (cfg->isedgetable && cfg->method == rtPlucker);
+    tracer->nedge = 0;
+    tracer->edge = NULL;
+
+    /*no cache is needed if the tracer data come with a mapped binary mesh; the edge table is rebuilt each time*/
+    if (cfg->iscachetracer == 0 || pmesh == NULL || pmesh->node == NULL || pmesh->elem == NULL || tracer->isedgetable ||
+            (pmesh->tracermethod == cfg->method && pmesh->elemorder == NULL)) {
+        tracer_build(tracer);
+        return;
+    }
+
+    memset(&head, 0, sizeof(tracerheader));
+    memcpy(head.magic, MMC_TRACER_MAGIC, sizeof(MMC_TRACER_MAGIC));
+    head.version = MMC_TRACER_VERSION;
+    head.headersize = sizeof(tracerheader);
+    head.ne = pmesh->ne;
+    head.method = cfg->method;
+#if defined(MMC_USE_SSE) || defined(USE_OPENCL)
+    head.hasw = 1;
+#endif
+
+    for (i = 0; i < 3; i++) {
+        head.len[i] = mesh_tracerlen(cfg->method, i, pmesh->ne);
+    }
+
+    head.hash = mesh_hashbuffer(&(pmesh->nn), sizeof(int), 0xcbf29ce484222325ULL);
+    head.hash = mesh_hashbuffer(&(pmesh->elemlen), sizeof(int), head.hash);
+    head.hash = mesh_hashbuffer(pmesh->node, sizeof(FLOAT3) * pmesh->nn, head.hash);
+    head.hash = mesh_hashbuffer(pmesh->elem, sizeof(int) * pmesh->elemlen * pmesh->ne, head.hash);
+    head.hash = mesh_hashbuffer(&(head.ne), (char*)(head.len + 3) - (char*)&(head.ne), head.hash);
+
+    sprintf(format, "tracer_%%s_%016llx.mmct", head.hash);
+    mesh_filenames(format, fcache, cfg);
+
+    if ((fp = fopen(fcache, "rb")) != NULL) {
+        i = -1;
+
+        if (fread(&filehead, sizeof(tracerheader), 1, fp) == 1 && memcmp(&filehead, &head, sizeof(tracerheader)) == 0) {
+            for (i = 0; i < 3; i++) {
+                if (head.len[i]) {
+                    *data[i] = (float3*)malloc(head.len[i]);
+
+                    if (fread(*data[i], head.len[i], 1, fp) != 1) {
+                        break;
+                    }
+                }
+            }
+        }
+
+        fclose(fp);
+
+        if (i == 3) {
+            MMCDEBUG(cfg, dlTime, (cfg->flog, "loaded ray-tracer data from %s\n", fcache));
+            return;
+        }
+
+        for (i = 0; i < 3; i++) {
+            if (*data[i]) {
+                free(*data[i]);
+                *data[i] = NULL;
+            }
+        }
+    }
+
+    tracer_build(tracer);
+
+    /*write to a temporary file first, so that concurrent runs never read a partial cache*/
+    sprintf(ftmp, "%s.tmp", fcache);
+
+    if ((fp = fopen(ftmp, "wb")) != NULL) {
+        int iserror = (fwrite(&head, sizeof(tracerheader), 1, fp) != 1);
+
+        for (i = 0; i < 3; i++) {
+            if (head.len[i]) {
+                iserror |= (fwrite(*data[i], head.len[i], 1, fp) != 1);
+            }
+        }
+
+        iserror |= fclose(fp);
+
+        if (iserror || rename(ftmp, fcache)) {
+            remove(ftmp);
+        }
+    } else {
+        MMC_FPRINTF(cfg->flog, S_RED "WARNING: can not write the ray-tracer cache %s\n" S_RESET, fcache);
+    }
+}
+
+/**
+ * @brief Sorting key of an element along a space-filling curve, or of a mesh edge
+ */
+
+typedef struct MMC_sortkey {
+    unsigned long long key;   /**< position of the element centroid along the curve, or the 2 node indices of an edge */
+    int id;                   /**< element (or element edge) index, start from 0 */
+} sortkey;
+
+/**
+ * @brief Comparison function for qsort, breaking ties by the original index
+ */
+
+static int mesh_comparekey(const void* a, const void* b) {
+    const sortkey* ka = (const sortkey*)a, *kb = (const sortkey*)b;
+
+    if (ka->key != kb->key) {
+        return (ka->key < kb->key) ? -1 : 1;
+    }
+
+    return ka->id - kb->id;
+}
+
+/**
+ * @brief Build the Plucker coordinates of the unique edges of the mesh
+ *
+ * An edge is shared by all elements around it, about 5 on average, but the default
+ * layout stores its displacement and moment 6 times per element. This function sorts
+ * the 6*ne element edges by their node pairs, stores the displacement and moment of
+ * each unique edge once, from the lower to the higher node index, and sets the j-th
+ * edge entry of the i-th element to edge[i*6+j] = (edge << 1) | reversed. Reversing
+ * an edge negates both vectors, so it only flips the sign of its Plucker product.
+ *
+ * @param[in,out] tracer: the ray-tracer data structure, with isedgetable set
+ */
+
+static void tracer_buildedge(raytracer* tracer) {
+    const int pairs[6][2] = {{0, 1}, {0, 2}, {0, 3}, {1, 2}, {1, 3}, {2, 3}};
+    int i, j, ne = tracer->mesh->ne, len = ne * 6;
+    int* elems = (int*)(tracer->mesh->elem);
+    FLOAT3* nodes = tracer->mesh->node;
+    sortkey* keys;
+
+    if (tracer->mesh->elemlen != 4) {
+        MESH_ERROR("--edgetable only supports 4-node tetrahedral meshes");
+    }
+
+    keys = (sortkey*)malloc(sizeof(sortkey) * len);
+    tracer->edge = (int*)malloc(sizeof(int) * len);
+
+    for (i = 0; i < ne; i++) {
+        for (j = 0; j < 6; j++) {
+            unsigned int e0 = elems[(i << 2) + pairs[j][0]], e1 = elems[(i << 2) + pairs[j][1]];
+
+            keys[i * 6 + j].key = (e0 < e1) ? (((unsigned long long)e0 << 32) | e1) : (((unsigned long long)e1 << 32) | e0);
+            keys[i * 6 + j].id = i * 6 + j;
+            tracer->edge[i * 6 + j] = (e0 > e1);
+        }
+    }
+
+    qsort(keys, len, sizeof(sortkey), mesh_comparekey);
+
+    tracer->nedge = 0;
+
+    for (i = 0; i < len; i++) {
+        tracer->nedge += (i == 0 || keys[i].key != keys[i - 1].key);
+    }
+
+    tracer->d = (float3*)calloc(sizeof(float3), tracer->nedge);
+    tracer->m = (float3*)calloc(sizeof(float3), tracer->nedge);
+
+    for (i = 0, j = -1; i < len; i++) {
+        if (i == 0 || keys[i].key != keys[i - 1].key) {
+            int e0 = (int)(keys[i].key >> 32) - 1, e1 = (int)(keys[i].key & 0xFFFFFFFFULL) - 1;
+
+            j++;
+            vec_diff3(&nodes[e0], &nodes[e1], (FLOAT3*)(tracer->d + j));
+            vec_cross3(&nodes[e0], &nodes[e1], (FLOAT3*)(tracer->m + j));
+        }
+
+        tracer->edge[keys[i].id] |= (j << 1);
+    }
+
+    free(keys);
+}
+
+/**
+ * @brief Preparing for the ray-tracing calculations
+ *
+ * This function build the ray-tracing precomputed data and test if the initial
+ * element (e0) encloses the photon launch position.
+ *
+ * @param[out] tracer: the ray-tracer data structure
+ * @param[in] cfg: the simulation configuration structure
+ */
+
+void tracer_prep(raytracer* tracer, mcconfig* cfg) {
+    int i, j, k, ne = tracer->mesh->ne;
+
+    /*with --domain, the tracer is only built for the partition of this rank, see mmc_prep*/
+    if (tracer->n == NULL && tracer->m == NULL && tracer->d == NULL && !cfg->isdomain) {
+        if (tracer->mesh != NULL) {
+            tracer_build(tracer);
+        } else {
+            MESH_ERROR("tracer is not associated with a mesh");
+        }
+    } else if ( (cfg->srctype == stPencil || cfg->srctype == stIsotropic || cfg->srctype == stCone || cfg->srctype == stArcSin) ) {
+        if (cfg->e0 <= 0 || mesh_barycentric(cfg->e0, &cfg->bary0.x, (FLOAT3*) & (cfg->srcpos), tracer->mesh)) {
+            if (mesh_initelem(tracer->mesh, cfg)) {
+                cfg->e0 = 0;    /*the source is outside of the mesh, see mesh_buildsurfbvh*/
+            }
+        }
+
+        if (cfg->debuglevel & dlWeight)
+            fprintf(cfg->flog, "initial bary-centric volumes [%e %e %e %e]\n",
+                    cfg->bary0.x / 6., cfg->bary0.y / 6., cfg->bary0.z / 6., cfg->bary0.w / 6.);
+    }
+
+    // TODO: this is a partial fix to the normalization bug described in https://github.com/fangq/mmc/issues/82
+    // basically, mmc surface node fluence is about 2x higher than expected, due to the division to the nodal-volume
+    // of surface nodes that is roughtly half of that in an interior node.
+    // To more carefully handle this, one should calculate the solid-angle S of any surface nodes and use the
+    // ratio (4*Pi/S) to scale nvol. Here, we simply multiply surface node nvol by 2x. Should work fine for
+    // flat surfaces, but will not be accurate for edge or corner nodes.
+    // one can disable this fix (i.e. restore to the old behavior) by setting cfg.isnormalized to 2
+
+    if (cfg->isnormalized == 1 && cfg->method != rtBLBadouelGrid && cfg->basisorder) {
+        float* Reff = (float*)calloc(tracer->mesh->prop + 1, sizeof(float));
+
+        if (cfg->isreflect) {
+            for (i = 1; i <= tracer->mesh->prop; i++) { // precompute the Reff for each non-zero label
+                for (j = 1; j < i; j++) {
+                    if (tracer->mesh->med[j].n == tracer->mesh->med[i].n) { // if such reflective index has been computed, copy the value
+                        Reff[i] = Reff[j];
+                        break;
+                    }
+                }
+
+                if (Reff[i] == 0.f) {
+                    Reff[i] = mesh_getreff(tracer->mesh->med[i].n, tracer->mesh->med[0].n);
+                }
+            }
+        }
+
+        for (i = 0; i < ne; i++) {
+            int* elems = tracer->mesh->elem + i * tracer->mesh->elemlen;   // element node indices
+            int* enb = tracer->mesh->facenb + i * tracer->mesh->elemlen;   // check facenb, find surface faces
+
+            for (j = 0; j < tracer->mesh->elemlen; j++) { // loop over my neighbors
+                if (enb[j] == 0) {                        // 0-valued face neighbor indicates an exterior triangle
+                    float reff = Reff[tracer->mesh->type[i]];
+
+                    if (tracer->mesh->elemmed && cfg->isreflect) { // per-element media of --elemprop
+                        reff = mesh_getreff(tracer->mesh->elemmed[i].n, tracer->mesh->med[0].n);
+                    }
+
+                    for (k = 0; k < 3; k++) {
+                        int nid = elems[out[ifaceorder[j]][k]] - 1;
+
+                        if (tracer->mesh->nvol[nid] > 0.f && tracer->mesh->type[i] >= 0) {  // change sign to prevent it from changing again
+                            tracer->mesh->nvol[nid] *= -(2.f / (1.0 + reff)); // 2 accounts for the missing half of the solid angle, Reff is the effective reflection coeff
+                        }
+                    }
+                }
+            }
+        }
+
+        free(Reff);
+
+        for (i = 0; i < tracer->mesh->nn; i++) {
+            if (tracer->mesh->nvol[i] < 0.f) {
+                tracer->mesh->nvol[i] = -tracer->mesh->nvol[i];
+            }
+        }
+    }
+
+    // build acceleration data structure to speed up first-neighbor immc edge-roi calculation
+    // loop over each edgeroi, count how many roi in each elem, and write to the first elem as negative integer
+    if (tracer->mesh->edgeroi) {
+        for (i = 0; i < ne; i++) {
+            int count = 0;
+
+            for (j = 0; j < 6; j++)
+                if (tracer->mesh->edgeroi[(i * 6) + j] > 0.f) {
+                    count++;
+                }
+
+            if (count && fabs(tracer->mesh->edgeroi[i * 6]) < EPS) {
+                tracer->mesh->edgeroi[i * 6] = -count;    // number -1 to -6 indicates how many faces have ROIs
+            }
+        }
+
+        for (i = 0; i < ne; i++) {
+            if (fabs(tracer->mesh->edgeroi[i * 6]) < EPS) { // if I don't have roi
+                for (j = 0; j < tracer->mesh->elemlen; j++) { // loop over my neighbors
+                    int id = tracer->mesh->facenb[i * tracer->mesh->elemlen + j]; // loop over neighboring elements
+
+                    if (id > 0 && fabs(tracer->mesh->edgeroi[(id - 1) * 6]) > EPS) { // if I don't have roi, but neighbor has, set ref id as -elemid-6, only handle 1 roi neighbor case
+                        tracer->mesh->edgeroi[i * 6] = -id - 6;
+                        break;
+                    }
+                }
+            }
+
+            if (fabs(tracer->mesh->edgeroi[i * 6]) < EPS) { // if I don't have roi
+                for (j = 0; j < tracer->mesh->elemlen; j++) { // loop over my neighbors
+                    int firstnbid = tracer->mesh->facenb[i * tracer->mesh->elemlen + j] - 1; // loop over neighboring elements
+
+                    if (firstnbid < 0) {
+                        continue;
+                    }
+
+                    for (k = 0; k < tracer->mesh->elemlen; k++) { // loop over my j-th neighbor's neighbors
+                        int id = tracer->mesh->facenb[firstnbid * tracer->mesh->elemlen + k]; // loop over 2nd order neighboring elements
+
+                        if (id > 0 && fabs(tracer->mesh->edgeroi[(id - 1) * 6]) > EPS) { // if I don't have roi, but neighbor has, set ref id as -elemid-6, only handle 1 roi neighbor case
+                            tracer->mesh->edgeroi[i * 6] = -id - 6;
+                            break;
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    // build acceleration data structure to speed up first-neighbor immc face-roi calculation
+    // loop over each faceroi, count how many roi in each elem, and write to the first elem as negative integer
+    if (tracer->mesh->faceroi) {
+        for (i = 0; i < ne; i++) {
+            int count = 0;
+
+            for (j = 0; j < 4; j++)
+                if (tracer->mesh->faceroi[(i << 2) + j] > 0.f) {
+                    count++;
+                }
+
+            if (count && fabs(tracer->mesh->faceroi[i << 2]) < EPS) {
+                tracer->mesh->faceroi[i << 2] = -count;    // number -1 to -4 indicates how many faces have ROIs
+            }
+        }
+
+        for (i = 0; i < ne; i++) {
+            if (fabs(tracer->mesh->faceroi[i << 2]) < EPS) { // if I don't have roi
+                for (j = 0; j < tracer->mesh->elemlen; j++) { // loop over my neighbors
+                    int id = tracer->mesh->facenb[i * tracer->mesh->elemlen + j]; // loop over neighboring elements
+
+                    if (id > 0 && fabs(tracer->mesh->faceroi[(id - 1) << 2]) > EPS) { // if I don't have roi, but neighbor has, set ref id as -elemid-4, only handle 1 roi neighbor case
+                        tracer->mesh->faceroi[i << 2] = -id - 4;
+                        break;
+                    }
+                }
+            }
+        }
+    }
+
+    // loop over each external surface triangle (facenb[]==0) and sequentially number them as negative integer
+    ne = tracer->mesh->ne * tracer->mesh->elemlen;
+    tracer->mesh->nf = 0;
+
+    for (i = 0; i < ne; i++) {
+        if (tracer->mesh->facenb[i] == 0) {
+            tracer->mesh->facenb[i] = -(++tracer->mesh->nf);
+        }
+    }
+
+    if (tracer->mesh->dref) {
+        free(tracer->mesh->dref);
+    }
+
+    if (cfg->issaveref) {
+        tracer->mesh->dref = (double*)calloc(sizeof(double) * tracer->mesh->nf * cfg->srcnum, cfg->maxgate);
+    }
+}
+
+/**
+ * @brief Pre-computed ray-tracing related data
+ *
+ * the pre-computed ray-tracing data include
+ * d: the vector of the 6 edges: edge[i]=[ni1,ni2]: d[i]=ni2 - ni1
+ * m: the cross-product of the end-nodes of the 6-edges: edge[i]=[ni1,ni2]: m[i]=ni1 x ni2
+ * n: the normal vector of the 4 facets, pointing outwards
+ *
+ * @param[out] tracer: the ray-tracer data structure
+ */
+
+void tracer_build(raytracer* tracer) {
+    int ne, i, j;
+    const int pairs[6][2] = {{0, 1}, {0, 2}, {0, 3}, {1, 2}, {1, 3}, {2, 3}};
+
+    FLOAT3* nodes;
+    int* elems, ebase;
+    int e1, e0;
+    float Rn2;
+
+    if (tracer->d || tracer->m || tracer->n || tracer->mesh == NULL) {
+        return;
+    }
+
+    if (tracer->mesh->node == NULL || tracer->mesh->elem == NULL ||
+            tracer->mesh->facenb == NULL || tracer->mesh->med == NULL) {
+        MESH_ERROR("mesh is missing");
+    }
+
+    /*use the precomputed data in the binary mesh container if it was built for the same method and mesh order*/
+    if (tracer->mesh->tracermethod == tracer->method && tracer->mesh->elemorder == NULL && !tracer->isedgetable) {
+        tracer->d = tracer->mesh->tracerdata[0];
+        tracer->m = tracer->mesh->tracerdata[1];
+        tracer->n = tracer->mesh->tracerdata[2];
+        return;
+    }
+
+    ne = tracer->mesh->ne;
+    nodes = tracer->mesh->node;
+    elems = (int*)(tracer->mesh->elem); // convert int4* to int*
+
+    if (tracer->method == rtPlucker) {
+        int ea, eb, ec;
+        FLOAT3 vecAB = {0.f}, vecAC = {0.f};
+
+        if (tracer->isedgetable) {
+            tracer_buildedge(tracer);
+        } else {
+            tracer->d = (float3*)calloc(sizeof(float3), ne * 6); // 6 edges/elem
+            tracer->m = (float3*)calloc(sizeof(float3), ne * 6); // 6 edges/elem
+        }
+
+        tracer->n = (float3*)calloc(sizeof(float3), ne * 4); // 4 face norms
+
+        for (i = 0; i < ne; i++) {
+            ebase = i << 2;
+
+            for (j = 0; j < 6 && tracer->edge == NULL; j++) { // the edge table is already filled by tracer_buildedge
+                e1 = elems[ebase + pairs[j][1]] - 1;
+                e0 = elems[ebase + pairs[j][0]] - 1;
+                vec_diff3(&nodes[e0], &nodes[e1], (FLOAT3*)(tracer->d + i * 6 + j));
+                vec_cross3(&nodes[e0], &nodes[e1], (FLOAT3*)(tracer->m + i * 6 + j));
+            }
+
+            for (j = 0; j < 4; j++) {
+                ea = elems[ebase + out[j][0]] - 1;
+                eb = elems[ebase + out[j][1]] - 1;
+                ec = elems[ebase + out[j][2]] - 1;
+                vec_diff3(&nodes[ea], &nodes[eb], &vecAB);
+                vec_diff3(&nodes[ea], &nodes[ec], &vecAC);
+                vec_cross3(&vecAB, &vecAC, (FLOAT3*)(tracer->n + ebase + j));
+                Rn2 = 1.f / sqrt(vec_dot(tracer->n + ebase + j, tracer->n + ebase + j));
+                vec_mult(tracer->n + ebase + j, Rn2, tracer->n + ebase + j);
+            }
+        }
+    } else if (tracer->method == rtHavel || tracer->method == rtBadouel) {
+        int ea, eb, ec;
+        float3 vecAB = {0.f}, vecAC = {0.f};
+
+        tracer->d = NULL;
+        tracer->m = (float3*)calloc(sizeof(float3), ne * 12);
+
+        for (i = 0; i < ne; i++) {
+            ebase = i << 2;
+
+            for (j = 0; j < 4; j++) {
+                float3* vecN = tracer->m + 3 * (ebase + j);
+
+                ea = elems[ebase + out[j][0]] - 1;
+                eb = elems[ebase + out[j][1]] - 1;
+                ec = elems[ebase + out[j][2]] - 1;
+                vec_diff3(&nodes[ea], &nodes[eb], (FLOAT3*)&vecAB);
+                vec_diff3(&nodes[ea], &nodes[ec], (FLOAT3*)&vecAC);
+                vec_cross(&vecAB, &vecAC, vecN); /*N is defined as ACxAB in Jiri's code, but not the paper*/
+                vec_cross(&vecAC, vecN, vecN + 1);
+                vec_cross(vecN, &vecAB, vecN + 2);
+
+                Rn2 = 1.f / sqrt(vec_dot(vecN, vecN));
+
+                vec_mult(vecN, Rn2, vecN);
+
+                Rn2 *= Rn2;
+                vec_mult(vecN + 1, Rn2, vecN + 1);
+                vec_mult(vecN + 2, Rn2, vecN + 2);
+#if defined(MMC_USE_SSE) || defined(USE_OPENCL)
+                vecN->w    = vec_dot3((FLOAT3*)vecN,  &nodes[ea]);
+                (vecN + 1)->w = -vec_dot3((FLOAT3*)(vecN + 1), &nodes[ea]);
+                (vecN + 2)->w = -vec_dot3((FLOAT3*)(vecN + 2), &nodes[ea]);
+#endif
+            }
+        }
+    } else if (tracer->method == rtBLBadouel || tracer->method == rtBLBadouelGrid || tracer->method == rtBLBadouelPacket) {
+        int ea, eb, ec;
+        float3 vecAB = {0.f}, vecAC = {0.f}, vN = {0.f};
+
+        tracer->d = NULL;
+        tracer->n = (float3*)calloc(sizeof(float3), ne * 4);
 
         for (i = 0; i < ne; i++) {
             ebase = i << 2;
             float* vecN = &(tracer->n[ebase].x);
 
-            for (j = 0; j < 4; j++) {
-                ea = elems[ebase + out[j][0]] - 1;
-                eb = elems[ebase + out[j][1]] - 1;
-                ec = elems[ebase + out[j][2]] - 1;
-                vec_diff3(&nodes[ea], &nodes[eb], (FLOAT3*)&vecAB);
-                vec_diff3(&nodes[ea], &nodes[ec], (FLOAT3*)&vecAC);
+            for (j = 0; j < 4; j++) {
+                ea = elems[ebase + out[j][0]] - 1;
+                eb = elems[ebase + out[j][1]] - 1;
+                ec = elems[ebase + out[j][2]] - 1;
+                vec_diff3(&nodes[ea], &nodes[eb], (FLOAT3*)&vecAB);
+                vec_diff3(&nodes[ea], &nodes[ec], (FLOAT3*)&vecAC);
+
+                vec_cross(&vecAB, &vecAC, &vN); /*N is defined as ACxAB in Jiri's code, but not the paper*/
+
+                Rn2 = 1.f / sqrt(vec_dot(&vN, &vN));
+                vec_mult(&vN, Rn2, &vN);
+                vecN[j] = vN.x;
+                vecN[j + 4] = vN.y;
+                vecN[j + 8] = vN.z;
+#if defined(MMC_USE_SSE) || defined(USE_OPENCL)
+                vecN[j + 12]    = vec_dot3((FLOAT3*)&vN, &nodes[ea]);
+#endif
+            }
+        }
+    }
+}
+
+/**
+ * @brief Convert an IEEE-754 half to a single-precision float
+ */
+
+static float mesh_half2float(unsigned short h) {
+    union {
+        float f;
+        unsigned int i;
+    } v;
+    unsigned int mant = h & 0x3FFu;
+    int exp = (h >> 10) & 0x1F;
+
+    if (exp == 0x1F) {
+        v.i = 0x7F800000u | (mant << 13);
+    } else if (exp == 0) {
+        v.f = mant * (1.f / 16777216.f);    /*subnormal, mant*2^-24*/
+    } else {
+        v.i = ((unsigned int)(exp - 15 + 127) << 23) | (mant << 13);
+    }
+
+    v.i |= (unsigned int)(h & 0x8000u) << 16;
+    return v.f;
+}
+
+/**
+ * @brief Pack the per-element data read by the GPU ray-tracer into one 64-byte record per element
+ *
+ * Each record holds 16 32-bit words: the x/y/z components of the 4 outward face normals
+ * and the offsets of the 4 face planes relative to the element centroid, all as
+ * half-precision floats (words 0-7), the centroid (words 8-10), the element type
+ * (word 11) and the 4 face neighbors (words 12-15). A ray-tracing step on the GPU
+ * then reads one cache line instead of touching the normal, type and facenb buffers.
+ *
+ * The plane offsets are computed from the rounded normals through the centroid of
+ * each face, so that the face planes stay within the half-precision rounding error
+ * (about 5e-4 of the element size) of the exact ones.
+ *
+ * @param[in] tracer: the ray-tracer data structure, built for a Badouel-based method
+ * @param[out] rec: the packed records, 16 words per element
+ */
+
+void tracer_packgpu(raytracer* tracer, unsigned int* rec) {
+    tetmesh* mesh = tracer->mesh;
+    int i, j, k;
+
+    if (tracer->n == NULL) {
+        MESH_ERROR("the ray-tracer data must be built before packing the mesh");
+    }
+
+    for (i = 0; i < mesh->ne; i++) {
+        const int* ee = mesh->elem + (size_t)i * mesh->elemlen;
+        const float* vecN = &(tracer->n[(size_t)i << 2].x);
+        unsigned int* erec = rec + ((size_t)i << 4);
+        unsigned short* hrec = (unsigned short*)erec;
+        float c[3] = {0.f, 0.f, 0.f}, nh[3], fc[3], offset;
+
+        for (j = 0; j < 4; j++) {
+            c[0] += mesh->node[ee[j] - 1].x * 0.25f;
+            c[1] += mesh->node[ee[j] - 1].y * 0.25f;
+            c[2] += mesh->node[ee[j] - 1].z * 0.25f;
+        }
+
+        for (j = 0; j < 4; j++) {
+            offset = 0.f;
+
+            for (k = 0; k < 3; k++) {
+                hrec[(k << 2) + j] = mcx_float2half(vecN[(k << 2) + j]);
+                nh[k] = mesh_half2float(hrec[(k << 2) + j]);
+            }
+
+            fc[0] = (mesh->node[ee[out[j][0]] - 1].x + mesh->node[ee[out[j][1]] - 1].x + mesh->node[ee[out[j][2]] - 1].x) * (1.f / 3.f);
+            fc[1] = (mesh->node[ee[out[j][0]] - 1].y + mesh->node[ee[out[j][1]] - 1].y + mesh->node[ee[out[j][2]] - 1].y) * (1.f / 3.f);
+            fc[2] = (mesh->node[ee[out[j][0]] - 1].z + mesh->node[ee[out[j][1]] - 1].z + mesh->node[ee[out[j][2]] - 1].z) * (1.f / 3.f);
+
+            for (k = 0; k < 3; k++) {
+                offset += nh[k] * (fc[k] - c[k]);
+            }
+
+            if (fabs(offset) > 65504.f) {
+                MESH_ERROR("the element size exceeds the half-precision range of the packed mesh");
+            }
+
+            hrec[12 + j] = mcx_float2half(offset);
+        }
+
+        memcpy(erec + 8, c, sizeof(float) * 3);
+        erec[11] = (unsigned int)mesh->type[i];
+
+        for (j = 0; j < 4; j++) {
+            erec[12 + j] = (unsigned int)mesh->facenb[(size_t)i * mesh->elemlen + j];
+        }
+    }
+}
+
+/**
+ * @brief Pack the face planes and neighbors of the GPU ray-tracer into a shared face table
+ *
+ * An interior face is shared by 2 elements, but the normal and facenb buffers hold it
+ * once for each. This function numbers the unique faces and stores, for the j-th face
+ * of the i-th element, a 32-bit half-face entry halfface[i*4+j] = (face << 1) | flip.
+ * The face table holds the plane of each face (x/y/z of the unit normal and the offset
+ * read by the Badouel ray-tracer) facing out of the element that first lists it, which
+ * is flipped (all 4 components negated) for the element with flip set; it is followed
+ * by an int2 per face, the first element (start from 1) and the facenb entry of the
+ * face in the first element, so the neighbor across a half-face is the element of the
+ * other side. This takes about 64 instead of 80 bytes per element.
+ *
+ * @param[in] tracer: the ray-tracer data structure, built for a Badouel-based method
+ * @param[out] halfface: the half-face entries, 4 per element
+ * @param[out] faces: the face table, nface float4 planes then nface int2, to be freed by the caller
+ *
+ * @return the number of unique faces, nface
+ */
+
+int tracer_packhalfface(raytracer* tracer, int* halfface, float4** faces) {
+    tetmesh* mesh = tracer->mesh;
+    int i, j, k, nface = 0;
+    int* faceelem;
+
+    if (tracer->n == NULL || tracer->method < rtBLBadouel || mesh->elemlen != 4) {
+        MESH_ERROR("the branch-less Badouel ray-tracer data must be built before packing the mesh");
+    }
+
+    /*an interior face is listed first by the element of the lower index*/
+    for (i = 0; i < mesh->ne * 4; i++) {
+        nface += (mesh->facenb[i] <= 0 || mesh->facenb[i] - 1 > (i >> 2));
+    }
+
+    *faces = (float4*)malloc(sizeof(float4) * (nface + ((nface + 1) >> 1)));
+    faceelem = (int*)(*faces + nface);
+    nface = 0;
+
+    for (i = 0; i < mesh->ne; i++) {
+        const float* vecN = &(tracer->n[i << 2].x);
+
+        for (j = 0; j < 4; j++) {
+            int nb = mesh->facenb[(i << 2) + j], id = ifaceorder[j];
+
+            if (nb <= 0 || nb - 1 > i) {
+                (*faces)[nface].x = vecN[id];
+                (*faces)[nface].y = vecN[id + 4];
+                (*faces)[nface].z = vecN[id + 8];
+#if defined(MMC_USE_SSE) || defined(USE_OPENCL)
+                (*faces)[nface].w = vecN[id + 12];
+#else
+                (*faces)[nface].w = 0.f;
+#endif
+                faceelem[nface << 1] = i + 1;
+                faceelem[(nface << 1) + 1] = nb;
+                halfface[(i << 2) + j] = nface << 1;
+                nface++;
+                continue;
+            }
+
+            for (k = 0; k < 4; k++) {
+                if (mesh->facenb[((nb - 1) << 2) + k] == i + 1) {
+                    break;
+                }
+            }
+
+            if (k == 4) {
+                MESH_ERROR("the face neighbors of the mesh are not symmetric");
+            }
+
+            halfface[(i << 2) + j] = halfface[((nb - 1) << 2) + k] | 1;
+        }
+    }
+
+    return nface;
+}
+
+/**
+ * @brief Return a copy of a buffer allocated by the calling thread, NULL if the buffer is NULL
+ */
+
+static void* mesh_duplicate(const void* buf, size_t len) {
+    void* copy;
+
+    if (buf == NULL) {
+        return NULL;
+    }
+
+    if ((copy = malloc(len)) == NULL) {
+        MESH_ERROR("not enough memory to replicate the mesh");
+    }
+
+    memcpy(copy, buf, len);
+    return copy;
+}
+
+/**
+ * @brief Replicate the read-only mesh and ray-tracer data for the threads of one NUMA node
+ *
+ * The node coordinates, elements, face neighbors, media labels, volumes and
+ * precomputed ray-tracer data are copied, all other fields (media, outputs,
+ * ROIs) are shared with the source mesh. The copies are first-touched by the
+ * calling thread, so they are placed on its NUMA node.
+ *
+ * @param[out] tracer: the replicated ray-tracer, linked to mesh
+ * @param[out] mesh: the replicated mesh
+ * @param[in] srctracer: the ray-tracer to replicate, linked to the source mesh
+ */
+
+void tracer_replicate(raytracer* tracer, tetmesh* mesh, raytracer* srctracer) {
+    tetmesh* src = srctracer->mesh;
+    size_t elemlen = sizeof(int) * src->elemlen * src->ne;
+
+    *mesh = *src;
+    mesh->node = (FLOAT3*)mesh_duplicate(src->node, sizeof(FLOAT3) * src->nn);
+    mesh->elem = (int*)mesh_duplicate(src->elem, elemlen);
+    mesh->facenb = (int*)mesh_duplicate(src->facenb, elemlen);
+    mesh->type = (int*)mesh_duplicate(src->type, sizeof(int) * src->ne);
+    mesh->evol = (float*)mesh_duplicate(src->evol, sizeof(float) * src->ne);
+    mesh->facereflect = (unsigned char*)mesh_duplicate(src->facereflect, sizeof(unsigned char) * src->ne);
+
+    *tracer = *srctracer;
+    tracer->mesh = mesh;
+    tracer->n = (float3*)mesh_duplicate(srctracer->n, mesh_tracerlen(srctracer->method, 2, src->ne));
+
+    if (srctracer->edge) {
+        tracer->d = (float3*)mesh_duplicate(srctracer->d, sizeof(float3) * srctracer->nedge);
+        tracer->m = (float3*)mesh_duplicate(srctracer->m, sizeof(float3) * srctracer->nedge);
+        tracer->edge = (int*)mesh_duplicate(srctracer->edge, sizeof(int) * 6 * src->ne);
+    } else {
+        tracer->d = (float3*)mesh_duplicate(srctracer->d, mesh_tracerlen(srctracer->method, 0, src->ne));
+        tracer->m = (float3*)mesh_duplicate(srctracer->m, mesh_tracerlen(srctracer->method, 1, src->ne));
+    }
+}
+
+/**
+ * @brief Release the data copied by tracer_replicate
+ *
+ * @param[in,out] tracer: the replicated ray-tracer, linked to its replicated mesh
+ */
+
+void tracer_clearreplica(raytracer* tracer) {
+    tetmesh* mesh = tracer->mesh;
+
+    free(tracer->d);
+    free(tracer->m);
+    free(tracer->n);
+    free(tracer->edge);
+    free(mesh->node);
+    free(mesh->elem);
+    free(mesh->facenb);
+    free(mesh->type);
+    free(mesh->evol);
+    free(mesh->facereflect);
+    memset(tracer, 0, sizeof(raytracer));
+    memset(mesh, 0, sizeof(tetmesh));
+}
+
+/**
+ * @brief Clear the ray-tracing data structure
+ *
+ * Deconstructor of the ray-tracing data structure
+ *
+ * @param[out] tracer: the ray-tracer data structure
+ */
+
+void tracer_clear(raytracer* tracer) {
+    if (tracer->d) {
+        if (!mesh_ismapped(tracer->mesh, tracer->d)) {
+            free(tracer->d);
+        }
+
+        tracer->d = NULL;
+    }
+
+    if (tracer->m) {
+        if (!mesh_ismapped(tracer->mesh, tracer->m)) {
+            free(tracer->m);
+        }
+
+        tracer->m = NULL;
+    }
+
+    if (tracer->n) {
+        if (!mesh_ismapped(tracer->mesh, tracer->n)) {
+            free(tracer->n);
+        }
+
+        tracer->n = NULL;
+    }
+
+    if (tracer->edge) {
+        free(tracer->edge);
+        tracer->edge = NULL;
+    }
+
+    tracer->nedge = 0;
+    tracer->mesh = NULL;
+}
+
+/**
+ * @brief Drop the random numbers pre-computed by mc_next_scatter for the calling thread
+ *
+ * The SSE math builds draw the scattering lengths and azimuthal angles in
+ * blocks kept per thread; a thread calls this after seeding its RNG, so that
+ * a run in a process that already ran a simulation (batch jobs, --serve) draws
+ * the same numbers as a fresh process.
+ */
+
+void mc_reset_scatter(void) {
+#if defined(MMC_USE_SSE_MATH)
+    rand_clear_blocks();
+#endif
+}
+
+/**
+ * @brief Save or restore the random numbers pre-computed by mc_next_scatter for the calling thread
+ *
+ * A checkpoint keeps them with the RNG state of the thread, so that a resumed
+ * run continues in the middle of the blocks, as the uninterrupted run does.
+ *
+ * @param[in,out] buf: holds the state, or NULL to only query its length
+ * @param[in] isload: 1 to restore the state from buf, 0 to save it to buf
+ * @return the bytes of the state, 0 if the build keeps no pre-computed blocks
+ */
+
+size_t mc_scatter_state(void* buf, int isload) {
+#if defined(MMC_USE_SSE_MATH)
+
+    if (buf) {
+        rand_copy_blocks((unsigned char*)buf, isload);
+    }
+
+    return RAND_BLOCK_BYTES;
+#else
+    return 0;
+#endif
+}
+
+/**
+ * @brief Sample cos(theta) of the Henyey-Greenstein function at a given CDF value
+ *
+ * This is the inverse CDF evaluated by mc_next_scatter, including its
+ * isotropic treatment of g<=EPS, so a table of it reproduces the direct sampling.
+ *
+ * @param[in] g: anisotropy of the medium
+ * @param[in] u: the cumulative probability, between 0 and 1
+ */
+
+static double mesh_hginvcdf(double g, double u) {
+    double tmp;
+
+    if (g <= EPS) {
+        return 2.0 * u - 1.0;
+    }
+
+    tmp = (1.0 - g * g) / (1.0 - g + 2.0 * g * u);
+    tmp = (1.0 + g * g - tmp * tmp) / (2.0 * g);
+    return (tmp > 1.0) ? 1.0 : ((tmp < -1.0) ? -1.0 : tmp);
+}
+
+/**
+ * @brief Load the tabulated phase functions of --phasefile
+ *
+ * Each non-empty row not starting with '#' or '%' holds cos(theta) followed
+ * by the phase function of labels 1, 2, ... at that angle; cos(theta) must
+ * increase from -1 to 1 and the phase functions must not be negative.
+ *
+ * @param[in] cfg: the simulation configuration
+ * @param[in] maxcol: the maximum number of phase function columns
+ * @param[out] nrow: the number of angles of the table
+ * @param[out] ncol: the number of labels with a tabulated phase function
+ * @return the nrow x (1+ncol) table
+ */
+
+static double* mesh_loadphasefile(mcconfig* cfg, int maxcol, int* nrow, int* ncol) {
+    FILE* fp;
+    size_t linelen = (size_t)(maxcol + 1) * 64 + 2;
+    char* line = (char*)malloc(linelen), *pos, *next;
+    double* table = NULL, val;
+    int col, maxrow = 0;
+
+    *nrow = *ncol = 0;
+
+    if ((fp = fopen(cfg->phasefile, "rt")) == NULL) {
+        MESH_ERROR("can not open the phase function file of --phasefile");
+    }
+
+    while (fgets(line, linelen, fp)) {
+        pos = line + strspn(line, " \t\r\n");
+
+        if (*pos == '\0' || *pos == '#' || *pos == '%') {
+            continue;
+        }
+
+        if (*nrow >= maxrow) {
+            maxrow = (maxrow) ? (maxrow << 1) : 1024;
+            table = (double*)realloc(table, sizeof(double) * maxrow * (maxcol + 1));
+        }
+
+        for (col = 0; col <= maxcol; col++, pos = next) {
+            val = strtod(pos, &next);
+
+            if (next == pos) {
+                break;
+            }
+
+            table[*nrow * (maxcol + 1) + col] = val;
+        }
+
+        if (*pos != '\0' && pos[strspn(pos, " \t\r\n")] != '\0') {
+            MESH_ERROR("the phase function file of --phasefile has an invalid row or more columns than labels");
+        }
+
+        if (*nrow == 0) {
+            *ncol = col - 1;
+        }
+
+        if (col < 2 || col - 1 != *ncol) {
+            MESH_ERROR("the rows of the phase function file of --phasefile must have the same number of columns");
+        }
+
+        if ((*nrow > 0 && table[*nrow * (maxcol + 1)] <= table[(*nrow - 1) * (maxcol + 1)]) || fabs(table[*nrow * (maxcol + 1)]) > 1.0) {
+            MESH_ERROR("the cos(theta) of --phasefile must increase from -1 to 1");
+        }
+
+        for (col = 1; col <= *ncol; col++) {
+            if (table[*nrow * (maxcol + 1) + col] < 0.0) {
+                MESH_ERROR("the phase functions of --phasefile can not be negative");
+            }
+        }
+
+        (*nrow)++;
+    }
+
+    fclose(fp);
+    free(line);
+
+    if (*nrow < 2 || table[0] > -1.0 + 1e-6 || table[(*nrow - 1) * (maxcol + 1)] < 1.0 - 1e-6) {
+        MESH_ERROR("the cos(theta) of --phasefile must increase from -1 to 1");
+    }
+
+    return table;
+}
+
+/**
+ * @brief Build the inverse CDF tables of cos(theta) sampled by mc_next_scatter
+ *
+ * With --phasetable N, each label k gets N values of cos(theta) at the equally
+ * spaced cumulative probabilities i/(N-1) in cfg->invcdf, and a scattering
+ * event interpolates between the two entries around a uniform random number
+ * instead of evaluating the phase function. The Henyey-Greenstein tables are
+ * filled with the exact inverse CDF; the two-term Henyey-Greenstein (--tthg)
+ * and the tabulated (--phasefile, linearly interpolated) phase functions are
+ * integrated on a fine grid of cos(theta) and inverted numerically. Called by
+ * mmc_prep and again by mmc_prep_next when the media change.
+ *
+ * @param[in] mesh: the mesh object
+ * @param[in,out] cfg: the simulation configuration
+ */
+
+void mesh_buildinvcdf(tetmesh* mesh, mcconfig* cfg) {
+    int i, j, k, nrow = 0, ncol = 0, nlabel = mesh->prop + cfg->isextdet, finelen = MAX(cfg->nphase << 2, 1 << 16);
+    double* table = NULL, *cdf = NULL, mu, pdf, pdf0 = 0.0, target;
+
+    if (cfg->nphase < 2) {
+        free(cfg->invcdf);
+        cfg->invcdf = NULL;
+        return;
+    }
+
+    cfg->invcdf = (float*)realloc(cfg->invcdf, sizeof(float) * cfg->nphase * MAX(nlabel, 1));
+
+    if (cfg->invcdf == NULL) {
+        MESH_ERROR("can not allocate the inverse CDF tables of --phasetable");
+    }
+
+    if (cfg->phasefile[0]) {
+        table = mesh_loadphasefile(cfg, nlabel, &nrow, &ncol);
+    }
+
+    for (k = 1; k <= nlabel; k++) {
+        float* invcdf = cfg->invcdf + (size_t)(k - 1) * cfg->nphase;
+        double g = mesh->med[k].g;
+
+        if (k > ncol && cfg->tthg[1] == 0.f) {
+            for (i = 0; i < cfg->nphase; i++) {
+                invcdf[i] = (float)mesh_hginvcdf(g, (double)i / (cfg->nphase - 1));
+            }
+
+            continue;
+        }
+
+        if (cdf == NULL) {
+            cdf = (double*)malloc(sizeof(double) * finelen);
+        }
+
+        /*integrate the phase function over cos(theta) with the trapezoidal rule*/
+        for (j = 0, i = 0; j < finelen; j++) {
+            mu = -1.0 + 2.0 * j / (finelen - 1);
+
+            if (k <= ncol) {
+                while (i < nrow - 2 && table[(i + 1) * (nlabel + 1)] < mu) {
+                    i++;
+                }
+
+                pdf = (mu - table[i * (nlabel + 1)]) / (table[(i + 1) * (nlabel + 1)] - table[i * (nlabel + 1)]);
+                pdf = MAX(0.0, MIN(1.0, pdf));
+                pdf = table[i * (nlabel + 1) + k] + pdf * (table[(i + 1) * (nlabel + 1) + k] - table[i * (nlabel + 1) + k]);
+            } else {
+                pdf = (1.0 - cfg->tthg[1]) * (1.0 - g * g) / pow(1.0 + g * g - 2.0 * g * mu, 1.5)
+                      + cfg->tthg[1] * (1.0 - cfg->tthg[0] * cfg->tthg[0]) / pow(1.0 + cfg->tthg[0] * cfg->tthg[0] - 2.0 * cfg->tthg[0] * mu, 1.5);
+            }
+
+            cdf[j] = (j == 0) ? 0.0 : cdf[j - 1] + (pdf + pdf0) * (1.0 / (finelen - 1));
+            pdf0 = pdf;
+        }
+
+        if (!(cdf[finelen - 1] > 0.0)) {
+            MESH_ERROR("the phase function of a medium is zero at all angles");
+        }
+
+        /*the first entry is the smallest cos(theta) with a non-zero probability*/
+        for (j = 0; j < finelen - 2 && cdf[j + 1] <= 0.0; j++);
+
+        invcdf[0] = (float)(-1.0 + 2.0 * j / (finelen - 1));
+
+        for (i = 1; i < cfg->nphase; i++) {
+            target = cdf[finelen - 1] * i / (cfg->nphase - 1);
+
+            while (j < finelen - 2 && cdf[j + 1] < target) {
+                j++;
+            }
+
+            mu = -1.0 + 2.0 * (j + (target - cdf[j]) / (cdf[j + 1] - cdf[j])) / (finelen - 1);
+            invcdf[i] = (float)MAX(-1.0, MIN(1.0, mu));
+        }
+    }
+
+    free(cdf);
+    free(table);
+}
+
+/**
+ * @brief Performing one scattering event of the photon
+ *
+ * This function updates the direction of the photon by performing a scattering calculation
+ *
+ * @param[in] g: anisotropy g
+ * @param[in] invcdf: the cfg->nphase entry inverse CDF of cos(theta) of the medium, NULL to sample Henyey-Greenstein
+ * @param[out] dir: current ray direction vector
+ * @param[out] ran: random number generator states
+ * @param[out] ran0: additional random number generator states
+ * @param[out] cfg: the simulation configuration
+ * @param[out] pmom: buffer to store momentum transfer data if needed
+ */
+
+float mc_next_scatter(float g, const float* invcdf, float3* dir, RandType* ran, RandType* ran0, mcconfig* cfg, float* pmom) {
+
+    float nextslen;
+    float sphi = 0.f, cphi = 0.f, tmp0, theta, stheta, ctheta, tmp1;
+    float3 p;
+
+    rand_need_more(ran, ran0);
+
+    /*the per-thread blocks of the SSE math mix the photons of a thread, counter-based RNGs draw one at a time*/
+#if defined(MMC_USE_SSE_MATH)
+    if (!rand_is_counter()) {
+        //random scattering length (normalized)
+        nextslen = rand_next_scatlen_ps(ran);
+
+        //random arimuthal angle
+        rand_next_aangle_sincos(ran, &sphi, &cphi);
+    } else
+#endif
+    {
+        nextslen = rand_next_scatlen(ran);
+        tmp0 = TWO_PI * rand_next_aangle(ran); //next arimuth angle
+        mmc_sincosf(tmp0, &sphi, &cphi);
+    }
+
+    //Henyey-Greenstein Phase Function, "Handbook of Optical Biomedical Diagnostics",2002,Chap3,p234
+    //see Boas2002
+
+    if (invcdf) { //tabulated phase function, see mesh_buildinvcdf
+        int idx;
+
+        tmp0 = rand_next_zangle(ran) * (cfg->nphase - 1);
+        idx = MIN((int)tmp0, cfg->nphase - 2);
+        tmp0 -= idx;
+        ctheta = invcdf[idx] + tmp0 * (invcdf[idx + 1] - invcdf[idx]);
+        stheta = sqrtf(MAX(1.f - ctheta * ctheta, 0.f));
+    } else if (g > EPS) { //if g is too small, the distribution of theta is bad
+        tmp0 = (1.f - g * g) / (1.f - g + 2.f * g * rand_next_zangle(ran));
+        tmp0 *= tmp0;
+        tmp0 = (1.f + g * g - tmp0) / (2.f * g);
+
+        // when ran=1, CUDA will give me 1.000002 for tmp0 which produces nan later
+        if (tmp0 > 1.f) {
+            tmp0 = 1.f;
+        }
+
+        if (tmp0 < -1.f) {
+            tmp0 = -1.f;
+        }
+
+        theta = acosf(tmp0);
+        stheta = sqrt(1.f - tmp0 * tmp0);
+        //stheta=sinf(theta);
+        ctheta = tmp0;
+    } else {
+        theta = acosf(2.f * rand_next_zangle(ran) - 1.f);
+        mmc_sincosf(theta, &stheta, &ctheta);
+    }
+
+    if ( dir->z > -1.f + EPS && dir->z < 1.f - EPS ) {
+        tmp0 = 1.f - dir->z * dir->z; //reuse tmp to minimize registers
+        tmp1 = 1.f / sqrtf(tmp0);
+        tmp1 = stheta * tmp1;
+
+        p.x = tmp1 * (dir->x * dir->z * cphi - dir->y * sphi) + dir->x * ctheta;
+        p.y = tmp1 * (dir->y * dir->z * cphi + dir->x * sphi) + dir->y * ctheta;
+        p.z = -tmp1 * tmp0 * cphi             + dir->z * ctheta;
+    } else {
+        p.x = stheta * cphi;
+        p.y = stheta * sphi;
+        p.z = (dir->z > 0.f) ? ctheta : -ctheta;
+    }
+
+    if (cfg->ismomentum) {
+        pmom[0] += (1.f - ctheta);
+    }
+
+    dir->x = p.x;
+    dir->y = p.y;
+    dir->z = p.z;
+    return nextslen;
+}
+
+/**
+ * @brief Allocate or clear the output buffer of the mesh
+ *
+ * By default, mesh->weight holds all frames (time gates, replayed detectors,
+ * wavelengths and the real/imaginary parts of each modulation frequency) of
+ * all elements/nodes and patterns. With --sparsegate, it is replaced by a
+ * table of pages of MMC_WEIGHT_PAGE_LEN consecutive rows (one row is an
+ * element/node of a frame), which are only allocated when a
+ * photon deposits weight in them, so the memory follows the support of the
+ * fluence in space and time. For the dual grid (-M G), a page is a brick of
+ * voxels, so that long, thin or sparse domains only allocate the bricks that
+ * the photons reach; see MESH_BRICKROW. With --outmask, a frame only holds
+ * the selected elements, see mesh_buildoutmask.
+ *
+ * @param[in,out] mesh: the mesh object
+ * @param[in] cfg: the simulation configuration
+ */
+
+void mesh_initweight(tetmesh* mesh, mcconfig* cfg) {
+    size_t i, datalen = (cfg->method == rtBLBadouelGrid) ? cfg->crop0.z : ( (cfg->basisorder) ? mesh->nn : MESH_ELEMOUT(mesh));
+    size_t framenum = (size_t)cfg->maxgate * cfg->replaydetnum * cfg->wavenum + 2 * cfg->freqnum;
+
+    mesh->weightbrick.x = mesh->weightbrick.y = mesh->weightbrick.z = 0;
+
+    if (cfg->issparsegate) {
+        if (mesh->weight) {
+            free(mesh->weight);
+            mesh->weight = NULL;
+        }
+
+        if (cfg->method == rtBLBadouelGrid) {
+            mesh->weightbrick.x = (cfg->dim.x + (1U << MMC_GRID_BRICK_XBITS) - 1) >> MMC_GRID_BRICK_XBITS;
+            mesh->weightbrick.y = (cfg->dim.y + (1U << MMC_GRID_BRICK_YBITS) - 1) >> MMC_GRID_BRICK_YBITS;
+            mesh->weightbrick.z = (cfg->dim.z + (1U << MMC_GRID_BRICK_ZBITS) - 1) >> MMC_GRID_BRICK_ZBITS;
+            datalen = MESH_BRICKFRAME(mesh);
+        }
+
+        if (mesh->weightpage) {
+            for (i = 0; i < mesh->weightpagenum; i++) {
+                free(mesh->weightpage[i]);
+            }
+
+            free(mesh->weightpage);
+        }
+
+        mesh->weightpagenum = (datalen * framenum + MMC_WEIGHT_PAGE_LEN - 1) >> MMC_WEIGHT_PAGE_BITS;
+        mesh->weightpage = (double**)calloc(mesh->weightpagenum, sizeof(double*));
+
+        if (mesh->weightpage == NULL) {
+            MESH_ERROR("can not allocate the sparse output page table");
+        }
+
+        return;
+    }
+
+    /*with --outmask, one more row after all frames sums the deposits of the unselected elements*/
+    mesh->outsink = datalen * framenum;
+
+    if (mesh->weight) {
+        memset(mesh->weight, 0, sizeof(double) * (datalen * cfg->srcnum * framenum + ((mesh->outmap) ? cfg->srcnum : 0)));
+    } else {
+        mesh->weight = (double*)calloc(datalen * cfg->srcnum * framenum + ((mesh->outmap) ? cfg->srcnum : 0), sizeof(double));
+    }
+
+    if (cfg->varbatch > 1) {
+        if (mesh->weightvar) {
+            memset(mesh->weightvar, 0, sizeof(double) * datalen * cfg->srcnum * cfg->maxgate);
+        } else {
+            mesh->weightvar = (double*)calloc(sizeof(double) * datalen * cfg->srcnum, cfg->maxgate);
+        }
+    } else if (mesh->weightvar) {
+        free(mesh->weightvar);
+        mesh->weightvar = NULL;
+    }
+}
+
+/**
+ * @brief Turn the per-batch sums of squares into the relative variance of the output
+ *
+ * With N photons split into B batches of n_i photons, each adding d_i to an
+ * entry of the output whose total is S, the batch-means estimate of the
+ * variance of S is N/(B-1)*(sum(d_i^2/n_i)-S^2/N). mesh->weightvar holds
+ * sum(d_i^2/n_i) on input, and Var(S)/S^2 on output, which is also the relative
+ * variance of the normalized output, as the normalization is linear in S.
+ * This must be called on the raw output, before mesh_normalize.
+ *
+ * @param[in,out] mesh: the mesh object
+ * @param[in] cfg: the simulation configuration
+ * @param[in] nphoton: the total photon number N of all batches
+ * @param[in] nbatch: the batch number B
+ */
+
+void mesh_batchvariance(tetmesh* mesh, mcconfig* cfg, double nphoton, int nbatch) {
+    size_t i, len;
+
+    if (mesh->weightvar == NULL) {
+        return;
+    }
+
+    len = (size_t)((cfg->method == rtBLBadouelGrid) ? cfg->crop0.z : ( (cfg->basisorder) ? mesh->nn : MESH_ELEMOUT(mesh))) * cfg->srcnum * cfg->maxgate;
+
+    if (nbatch < 2) {
+        MMC_FPRINTF(cfg->flog, S_YELLOW "WARNING: the variance needs at least 2 batches, only %d were simulated\n" S_RESET, nbatch);
+        memset(mesh->weightvar, 0, sizeof(double) * len);
+        return;
+    }
+
+    #pragma omp parallel for schedule(static)
+
+    for (i = 0; i < len; i++) {
+        double total = mesh->weight[i];
+
+        mesh->weightvar[i] = (total != 0.0) ? MAX((nphoton * mesh->weightvar[i] / (total * total) - 1.0) / (nbatch - 1), 0.0) : 0.0;
+    }
+}
+
+/**
+ * @brief Scale the relative variance of mesh_batchvariance by the squared normalized output
+ *
+ * @param[in,out] mesh: the mesh object
+ * @param[in] cfg: the simulation configuration
+ */
+
+void mesh_scalevariance(tetmesh* mesh, mcconfig* cfg) {
+    size_t i, len;
+
+    if (mesh->weightvar == NULL) {
+        return;
+    }
+
+    len = (size_t)((cfg->method == rtBLBadouelGrid) ? cfg->crop0.z : ( (cfg->basisorder) ? mesh->nn : MESH_ELEMOUT(mesh))) * cfg->srcnum * cfg->maxgate;
+
+    #pragma omp parallel for schedule(static)
+
+    for (i = 0; i < len; i++) {
+        mesh->weightvar[i] *= mesh->weight[i] * mesh->weight[i];
+    }
+}
+
+/**
+ * @brief Add the nodal output accumulated at the tet corners (--elemmoment) to the nodes
+ *
+ * The corners sharing a node are listed per node, so that the nodes are
+ * summed in parallel without atomic operations. This must be called on the
+ * raw output, before mesh_normalize.
+ *
+ * @param[in,out] mesh: the mesh object, mesh->weight receives the sums
+ * @param[in] cfg: the simulation configuration
+ * @param[in] elemweight: the corner output, [frame][elem][corner][pattern], in the frames of mesh->weight
+ */
+
+void mesh_scatterelemweight(tetmesh* mesh, mcconfig* cfg, double* elemweight) {
+    size_t i, framenum = (size_t)cfg->maxgate * cfg->replaydetnum * cfg->wavenum + 2 * cfg->freqnum;
+    size_t cornernum = (size_t)mesh->ne * 4;
+    int n, srcnum = cfg->srcnum;
+    int* start = (int*)calloc(mesh->nn + 1, sizeof(int));
+    int* corner = (int*)malloc(cornernum * sizeof(int));
+
+    for (i = 0; i < cornernum; i++) {
+        start[mesh->elem[(i >> 2) * mesh->elemlen + (i & 3)] - 1]++;
+    }
+
+    for (n = 1; n < mesh->nn; n++) {
+        start[n] += start[n - 1];
+    }
+
+    start[mesh->nn] = (int)cornernum;
+
+    /*fill each list from its end, leaving start[n] at its first corner*/
+    for (i = cornernum; i > 0; i--) {
+        corner[--start[mesh->elem[((i - 1) >> 2) * mesh->elemlen + ((i - 1) & 3)] - 1]] = (int)(i - 1);
+    }
+
+    #pragma omp parallel for schedule(static)
+
+    for (n = 0; n < mesh->nn; n++) {
+        size_t f;
+        int k, s;
+
+        for (f = 0; f < framenum; f++) {
+            double* dst = mesh->weight + (f * mesh->nn + n) * srcnum;
+            const double* src = elemweight + f * cornernum * srcnum;
+
+            for (k = start[n]; k < start[n + 1]; k++) {
+                for (s = 0; s < srcnum; s++) {
+                    dst[s] += src[(size_t)corner[k] * srcnum + s];
+                }
+            }
+        }
+    }
+
+    free(corner);
+    free(start);
+}
+
+/**
+ * @brief Allocate a page of the sparse output when it is first reached by a photon
+ *
+ * The ray-tracers only call this after finding the page missing; the page
+ * table is checked again inside a critical section so that racing threads
+ * share the same page.
+ *
+ * @param[in,out] weightpage: the page table of the sparse output
+ * @param[in] pageid: the index of the page
+ * @param[in] srcnum: the number of source patterns stored in each row
+ * @return the pointer to the zero-initialized page
+ */
+
+double* mesh_allocweightpage(double** weightpage, size_t pageid, int srcnum) {
+    double* page;
+
+    #pragma omp critical(mesh_weightpage)
+    {
+        page = weightpage[pageid];
+
+        if (page == NULL) {
+            page = (double*)calloc((size_t)MMC_WEIGHT_PAGE_LEN * srcnum, sizeof(double));
+
+            if (page == NULL) {
+                MESH_ERROR("can not allocate a page of the sparse output");
+            }
+
+            #pragma omp atomic write
+            weightpage[pageid] = page;
+        }
+    }
+
+    return page;
+}
+
+/**
+ * @brief Normalize the paged output, see mesh_normalize
+ *
+ * Only the allocated pages are visited; the nodal output is normalized by
+ * weighting each node with the absorption of the elements sharing it, which
+ * is the same energy balance mesh_normalize computes per element.
+ *
+ * @param[in] mesh: the mesh object
+ * @param[in] cfg: the simulation configuration
+ * @param[in] Eabsorb: total absorbed energy from ray-tracing accummulation
+ * @param[in] Etotal: total launched energy
+ * @param[in] pair: index of the source pattern
+ */
+
+static float mesh_normalizesparse(tetmesh* mesh, mcconfig* cfg, float Eabsorb, float Etotal, int pair) {
+    size_t p, r, row, rownum, datalen = (cfg->basisorder) ? mesh->nn : mesh->ne;
+    double energydeposit = 0.0, normalizor, *page, *nodeabs = NULL;
+    int i, k, *ee;
+
+    rownum = datalen * cfg->maxgate;
+
+    if (cfg->method == rtBLBadouelGrid) { /** the voxels of the dual grid are scaled as in mesh_normalize, including the padding of the bricks */
+        rownum = mesh->weightpagenum << MMC_WEIGHT_PAGE_BITS;
+        normalizor = (cfg->outputtype == otEnergy) ? 1.f / Etotal : 1.0 / (Etotal * cfg->unitinmm * cfg->unitinmm * cfg->unitinmm);
+
+        if (cfg->outputtype == otFlux) {
+            normalizor /= cfg->tstep;
+        }
+    } else if (cfg->outputtype == otEnergy) {
+        normalizor = 1.f / Etotal;
+    } else {
+        if (cfg->basisorder) {
+            nodeabs = (double*)calloc(mesh->nn, sizeof(double));
+
+            for (i = 0; i < mesh->ne; i++) {
+                ee = (int*)(mesh->elem + i * mesh->elemlen);
+
+                for (k = 0; k < 4; k++) {
+                    nodeabs[ee[k] - 1] += ((mesh->evol) ? mesh->evol[i] : mesh_elemvolume(mesh, i)) * MESH_ELEMMED(mesh, i)->mua;
+                }
+            }
+        }
+
+        for (p = 0; p < mesh->weightpagenum; p++) {
+            if ((page = mesh->weightpage[p]) == NULL) {
+                continue;
+            }
+
+            for (r = 0, row = p << MMC_WEIGHT_PAGE_BITS; r < MMC_WEIGHT_PAGE_LEN && row < rownum; r++, row++) {
+                double* w = page + r * cfg->srcnum + pair;
+                size_t j = row % datalen;
+
+                if (cfg->basisorder) {
+                    if (mesh->nvol[j] > 0.f) {
+                        *w /= mesh->nvol[j];
+                    }
+
+                    energydeposit += *w * nodeabs[j];
+                } else {
+                    energydeposit += *w;
+                    *w /= ((mesh->evol) ? mesh->evol[j] : mesh_elemvolume(mesh, j)) * MESH_ELEMMED(mesh, j)->mua;
+                }
+            }
+        }
+
+        normalizor = (cfg->basisorder) ? Eabsorb / (Etotal * energydeposit * 0.25f) : Eabsorb / (Etotal * energydeposit);
+
+        if (cfg->outputtype == otFlux) {
+            normalizor /= cfg->tstep;
+        }
+
+        free(nodeabs);
+    }
+
+    for (p = 0; p < mesh->weightpagenum; p++) {
+        if ((page = mesh->weightpage[p]) == NULL) {
+            continue;
+        }
+
+        for (r = 0, row = p << MMC_WEIGHT_PAGE_BITS; r < MMC_WEIGHT_PAGE_LEN && row < rownum; r++, row++) {
+            page[r * cfg->srcnum + pair] *= normalizor;
+        }
+    }
+
+    return normalizor;
+}
+
+#ifndef MCX_CONTAINER
+
+/**
+ * @brief Copy a time gate of the paged output to a dense frame, the missing pages are read as zeros
+ *
+ * @param[in] mesh: the mesh object
+ * @param[in] cfg: the simulation configuration
+ * @param[in] gate: the index of the time gate
+ * @param[out] frame: the dense frame, [elem/node/voxel][pattern] in the simulation numbering
+ */
+
+static void mesh_sparseframe(tetmesh* mesh, mcconfig* cfg, size_t gate, double* frame) {
+    size_t j, k, row, datalen = (cfg->method == rtBLBadouelGrid) ? cfg->crop0.z : ((cfg->basisorder) ? mesh->nn : mesh->ne);
+    double* page;
+
+    for (j = 0; j < datalen; j++) {
+        if (mesh->weightbrick.x) {
+            row = gate * MESH_BRICKFRAME(mesh) + MESH_BRICKROW(mesh, j % cfg->crop0.x, (j / cfg->crop0.x) % cfg->dim.y, j / cfg->crop0.y);
+        } else {
+            row = gate * datalen + j;
+        }
+
+        page = mesh->weightpage[row >> MMC_WEIGHT_PAGE_BITS];
+
+        for (k = 0; k < (size_t)cfg->srcnum; k++) {
+            frame[j * cfg->srcnum + k] = (page) ? page[(row & (MMC_WEIGHT_PAGE_LEN - 1)) * cfg->srcnum + k] : 0.0;
+        }
+    }
+}
+
+/**
+ * @brief Print a positive index into a text buffer, returns the number of characters
+ */
+
+static int mesh_printindex(char* buf, unsigned int val) {
+    char digit[12];
+    int len = 0, i;
+
+    do {
+        digit[len++] = '0' + (val % 10);
+        val /= 10;
+    } while (val);
+
+    for (i = 0; i < len; i++) {
+        buf[i] = digit[len - 1 - i];
+    }
+
+    return len;
+}
+
+/**
+ * @brief Write frames of the output in the text format of mesh_saveweight
+ *
+ * The lines "index\tvalue" (or "index\tsource\tvalue" for patterns) are
+ * formatted in blocks of MMC_TEXT_BLOCK lines by all threads into their own
+ * buffers and written in order, so the file is identical to one printed by
+ * a single fprintf per value. Zeros, common in time-resolved outputs, skip the
+ * %e conversion.
+ *
+ * @param[in] fp: the opened text file
+ * @param[in] data: framenum frames of datalen x srcnum values
+ * @param[in] datalen: the number of nodes, elements or faces per frame
+ * @param[in] framenum: the number of frames to write
+ * @param[in] srcnum: the number of sources of each node or element
+ */
+
+static void mesh_savetext(FILE* fp, const double* data, size_t datalen, size_t framenum, int srcnum) {
+    size_t linenum = datalen * framenum * srcnum;
+    int blocknum = (int)((linenum + MMC_TEXT_BLOCK - 1) / MMC_TEXT_BLOCK), err = 0;
+
+    #pragma omp parallel
+    {
+        char* buf = (char*)malloc(MMC_TEXT_BLOCK * MMC_TEXT_LINE_LEN);
+        int blockid;
+
+        #pragma omp for ordered schedule(static, 1)
+
+        for (blockid = 0; blockid < blocknum; blockid++) {
+            size_t line, last = ((size_t)blockid + 1) * MMC_TEXT_BLOCK, len = 0;
+
+            if (last > linenum) {
+                last = linenum;
+            }
+
+            for (line = (size_t)blockid * MMC_TEXT_BLOCK; buf && line < last; line++) {
+                size_t j = (line / srcnum) % datalen;
+                double val = data[line];
+
+                len += mesh_printindex(buf + len, (unsigned int)j + 1);
+                buf[len++] = '\t';
+
+                if (srcnum > 1) {
+                    len += mesh_printindex(buf + len, (unsigned int)(line % srcnum) + 1);
+                    buf[len++] = '\t';
+                }
+
+                if (val == 0.0 && !signbit(val)) {
+                    memcpy(buf + len, "0.000000e+00\n", 13);
+                    len += 13;
+                } else {
+                    len += snprintf(buf + len, 24, "%e\n", val);
+                }
+            }
+
+            #pragma omp ordered
+            {
+                if (buf == NULL || fwrite(buf, 1, len, fp) != len) {
+                    err = 1;
+                }
+            }
+        }
+
+        free(buf);
+    }
+
+    if (err) {
+        MESH_ERROR("can not write to weight file");
+    }
+}
+
+/**
+ * @brief Save frames of the output as a Zarr (v2) array directory
+ *
+ * The values are stored as an uncompressed C-order array of shape
+ * [framenum, datalen, srcnum] of doubles (halfs over a scale_factor attribute
+ * with --float16) in the directory <session>.zarr (or
+ * <session>_dref.zarr). Each chunk file holds all frames of a block of about
+ * MMC_ZARR_CHUNK bytes of nodes, elements or faces, so the time course of one
+ * index is read from one file, and an uncompressed chunk can be mapped into
+ * memory directly. The chunks are written by all threads in parallel; the
+ * last one is padded with zeros as the format requires.
+ *
+ * @param[in] data: framenum frames of datalen x srcnum values
+ * @param[in] datalen: the number of nodes, elements or faces per frame
+ * @param[in] framenum: the number of frames to write
+ * @param[in] srcnum: the number of sources of each node or element
+ * @param[in] isref: 1 for the surface diffuse reflectance, 0 for the fluence
+ * @param[in] cfg: the simulation configuration
+ */
+
+static void mesh_savezarr(const double* data, size_t datalen, size_t framenum, int srcnum, int isref, mcconfig* cfg) {
+    FILE* fp;
+    char fdir[MAX_FULL_PATH], fname[MAX_FULL_PATH + 32];
+    size_t valbytes = (cfg->isfloat16 ? sizeof(unsigned short) : sizeof(double)), rowbytes = valbytes * framenum * srcnum;
+    size_t chunklen = MAX(1, MIN(datalen, MMC_ZARR_CHUNK / MAX(rowbytes, 1)));
+    int chunknum = (int)((datalen + chunklen - 1) / chunklen), err = 0;
+    double scale = (cfg->isfloat16) ? mcx_float16scale(data, datalen * framenum * srcnum) : 1.0;
+    union {
+        unsigned short s;
+        char c;
+    } endian = {1};
+
+    if (cfg->rootpath[0]) {
+        sprintf(fdir, "%s%c%s%s.zarr", cfg->rootpath, pathsep, cfg->session, (isref ? "_dref" : ""));
+    } else {
+        sprintf(fdir, "%s%s.zarr", cfg->session, (isref ? "_dref" : ""));
+    }
+
+#ifdef _WIN32
+    _mkdir(fdir);
+#else
+    mkdir(fdir, 0755);
+#endif
+
+    sprintf(fname, "%s%c.zarray", fdir, pathsep);
+
+    if ((fp = fopen(fname, "wt")) == NULL) {
+        MESH_ERROR("can not create the Zarr output directory");
+    }
+
+    fprintf(fp, "{\n    \"zarr_format\": 2,\n    \"shape\": [%zu, %zu, %d],\n    \"chunks\": [%zu, %zu, %d],\n"
+            "    \"dtype\": \"%cf%zu\",\n    \"compressor\": null,\n    \"fill_value\": 0.0,\n    \"order\": \"C\",\n    \"filters\": null\n}\n",
+            framenum, datalen, srcnum, framenum, chunklen, srcnum, (endian.c ? '<' : '>'), valbytes);
+    fclose(fp);
+
+    sprintf(fname, "%s%c.zattrs", fdir, pathsep);
+
+    if ((fp = fopen(fname, "wt")) == NULL) {
+        MESH_ERROR("can not create the Zarr output directory");
+    }
+
+    fprintf(fp, "{\n    \"_ARRAY_DIMENSIONS\": [\"frame\", \"%s\", \"source\"],\n    \"tstart\": %e,\n    \"tstep\": %e",
+            (isref ? "face" : ((cfg->method == rtBLBadouelGrid) ? "voxel" : (cfg->basisorder ? "node" : "elem"))), cfg->tstart, cfg->tstep);
+
+    /*the CF convention, xarray multiplies the halfs back on reading*/
+    if (cfg->isfloat16) {
+        fprintf(fp, ",\n    \"scale_factor\": %.17g", scale);
+    }
+
+    fprintf(fp, "\n}\n");
+    fclose(fp);
+
+    #pragma omp parallel
+    {
+        double* buf = (double*)calloc(framenum * chunklen * srcnum, sizeof(double));
+        int chunkid;
+
+        #pragma omp for schedule(dynamic)
+
+        for (chunkid = 0; chunkid < chunknum; chunkid++) {
+            size_t f, first = chunkid * chunklen, len = MIN(chunklen, datalen - first);
+            char fchunk[MAX_FULL_PATH + 32];
+            FILE* fc;
+
+            if (buf == NULL) {
+                err = 1;
+                continue;
+            }
+
+            for (f = 0; f < framenum; f++) {
+                memcpy(buf + f * chunklen * srcnum, data + (f * datalen + first) * srcnum, sizeof(double) * len * srcnum);
+
+                if (len < chunklen) {
+                    memset(buf + (f * chunklen + len) * srcnum, 0, sizeof(double) * (chunklen - len) * srcnum);
+                }
+            }
+
+            /*--float16 packs the halfs into the front of the same chunk buffer*/
+            if (cfg->isfloat16) {
+                for (f = 0; f < framenum * chunklen * srcnum; f++) {
+                    ((unsigned short*)buf)[f] = mcx_float2half((float)(buf[f] / scale));
+                }
+            }
+
+            sprintf(fchunk, "%s%c0.%d.0", fdir, pathsep, chunkid);
+
+            if ((fc = fopen(fchunk, "wb")) == NULL || fwrite(buf, valbytes, framenum * chunklen * srcnum, fc) != framenum * chunklen * srcnum) {
+                err = 1;
+            }
+
+            if (fc) {
+                fclose(fc);
+            }
+        }
+
+        free(buf);
+    }
+
+    if (err) {
+        MESH_ERROR("can not write the Zarr output chunks");
+    }
+}
+
+/**
+ * @brief Save the paged output frame by frame, the missing pages are written as zeros
+ *
+ * The raw and text outputs are written one time gate at a time. The volume
+ * formats of the dual grid (nii, hdr, tx3, jnii, bnii) are written by
+ * mcx_savedata, which takes the whole grid; it is only assembled here.
+ *
+ * @param[in] mesh: the mesh object
+ * @param[in] cfg: the simulation configuration
+ * @param[in] fweight: the file name of the text output
+ */
+
+static void mesh_savesparseweight(tetmesh* mesh, mcconfig* cfg, const char* fweight) {
+    FILE* fp;
+    char fname[MAX_FULL_PATH];
+    size_t i, j, k, datalen = (cfg->method == rtBLBadouelGrid) ? cfg->crop0.z : ((cfg->basisorder) ? mesh->nn : mesh->ne), allocated = 0;
+    int* order = (cfg->method == rtBLBadouelGrid) ? NULL : ((cfg->basisorder) ? mesh->nodeorder : mesh->elemorder);
+    double* frame, *data;
+
+    for (i = 0; i < mesh->weightpagenum; i++) {
+        allocated += (mesh->weightpage[i] != NULL);
+    }
+
+    if (cfg->outputformat != ofASCII && cfg->outputformat != ofBin && cfg->outputformat != ofMC2) {
+        data = (double*)malloc(sizeof(double) * datalen * cfg->srcnum * cfg->maxgate);
+
+        if (data == NULL) {
+            MESH_ERROR("can not allocate the grid to save the sparse output");
+        }
+
+        for (i = 0; i < (size_t)cfg->maxgate; i++) {
+            mesh_sparseframe(mesh, cfg, i, data + i * datalen * cfg->srcnum);
+        }
+
+        if (cfg->outputformat == ofZarr) {
+            mesh_savezarr(data, datalen, cfg->maxgate, cfg->srcnum, 0, cfg);
+        } else {
+            uint3 dim0 = cfg->dim;
+
+            if (cfg->method != rtBLBadouelGrid) {
+                cfg->dim.z = datalen;
+            }
+
+            mcx_savedata(data, datalen * cfg->maxgate * cfg->srcnum, cfg, 0);
+            cfg->dim = dim0;
+        }
+
+        free(data);
+        MMCDEBUG(cfg, dlTime, (cfg->flog, "(%zu of %zu output pages allocated) ", allocated, mesh->weightpagenum));
+        return;
+    }
+
+    frame = (double*)malloc(sizeof(double) * datalen * cfg->srcnum);
+    data = (order) ? (double*)malloc(sizeof(double) * datalen * cfg->srcnum) : frame;
+
+    if (cfg->outputformat == ofASCII) {
+        fp = fopen(fweight, "wt");
+    } else {
+        if (cfg->rootpath[0]) {
+            sprintf(fname, "%s%c%s.%s", cfg->rootpath, pathsep, cfg->session, (cfg->outputformat == ofMC2) ? "mc2" : "bin");
+        } else {
+            sprintf(fname, "%s.%s", cfg->session, (cfg->outputformat == ofMC2) ? "mc2" : "bin");
+        }
+
+        fp = fopen(fname, "wb");
+    }
+
+    if (fp == NULL) {
+        MESH_ERROR("can not open weight file to write");
+    }
+
+    for (i = 0; i < (size_t)cfg->maxgate; i++) {
+        mesh_sparseframe(mesh, cfg, i, frame);
+
+        /*map the reordered mesh back to the input numbering, as mesh_restoreorder does for the dense output*/
+        if (order) {
+            for (j = 0; j < datalen; j++)
+                for (k = 0; k < (size_t)cfg->srcnum; k++) {
+                    data[order[j] * cfg->srcnum + k] = frame[j * cfg->srcnum + k];
+                }
+        }
+
+        if (cfg->outputformat != ofASCII) {
+            if (fwrite(data, sizeof(double), datalen * cfg->srcnum, fp) != datalen * cfg->srcnum) {
+                MESH_ERROR("can not write to weight file");
+            }
+
+            continue;
+        }
+
+        mesh_savetext(fp, data, datalen, 1, cfg->srcnum);
+    }
+
+    fclose(fp);
+
+    if (order) {
+        free(data);
+    }
+
+    free(frame);
+
+    MMCDEBUG(cfg, dlTime, (cfg->flog, "(%zu of %zu output pages allocated) ", allocated, mesh->weightpagenum));
+}
+
+void mcx_savecamsignals(float* camsignals, size_t len, mcconfig* cfg)
+{
+    char* file_suffix = ".bin";
+    size_t filepathlen = strlen(cfg->session) + strlen(file_suffix) + 1;
+    char* filepath = malloc(filepathlen);
+
+    strcpy(filepath, cfg->session);
+    strcat(filepath, file_suffix);
+
+    FILE *f = fopen(filepath, "wb");
+    fwrite(camsignals, sizeof(float), len, f);
+    fclose(f);
+}
+
+/**
+ * @brief Save the fluence output to a file
+ *
+ * Text outputs longer than MMC_TEXT_MAX_LEN values are saved as -F bin with a warning.
+ *
+ * @param[in] mesh: the mesh object
+ * @param[in] cfg: the simulation configuration
+ */
+
+void mesh_saveweight(tetmesh* mesh, mcconfig* cfg, int isref) {
+    FILE* fp;
+    int datalen = (cfg->method == rtBLBadouelGrid) ? cfg->crop0.z : ( (cfg->basisorder) ? mesh->nn : MESH_ELEMOUT(mesh));
+    int framenum = cfg->maxgate * cfg->replaydetnum * cfg->wavenum + 2 * cfg->freqnum; /*per-detector Jacobians, per-wavelength or frequency-domain outputs are stacked after the time gates*/
+    char fweight[MAX_FULL_PATH];
+    double* data = mesh->weight;
+
+    if (isref) {
+        data = mesh->dref;
+        datalen = mesh->nf;
+        framenum = cfg->maxgate;
+    }
+
+    if (cfg->rootpath[0]) {
+        sprintf(fweight, "%s%c%s%s.dat", cfg->rootpath, pathsep, cfg->session, (isref ? "_dref" : ""));
+    } else {
+        sprintf(fweight, "%s%s.dat", cfg->session, (isref ? "_dref" : ""));
+    }
+
+    /*a text file of this size takes longer to write and load than the simulation, save it as raw doubles instead*/
+    if (cfg->outputformat == ofASCII && (size_t)datalen * ((!isref && mesh->weightpage) ? cfg->maxgate : framenum) * cfg->srcnum > MMC_TEXT_MAX_LEN) {
+        MMC_FPRINTF(cfg->flog, S_RED "WARNING: the %s output has more than %d values, it is saved in the binary format (-F bin) instead of text\n" S_RESET,
+                    (isref ? "dref" : "fluence"), MMC_TEXT_MAX_LEN);
+        cfg->outputformat = ofBin;
+        mesh_saveweight(mesh, cfg, isref);
+        cfg->outputformat = ofASCII;
+        return;
+    }
+
+    if (!isref && mesh->weightpage) {
+        mesh_savesparseweight(mesh, cfg, fweight);
+        return;
+    }
+
+    if (cfg->outputformat == ofZarr) {
+        mesh_savezarr(data, datalen, framenum, cfg->srcnum, isref, cfg);
+        return;
+    }
+
+    if (cfg->outputformat >= ofBin && cfg->outputformat <= ofBJNifti) {
+        uint3 dim0 = cfg->dim;
+
+        if (cfg->method != rtBLBadouelGrid) {
+            cfg->dim.x = cfg->srcnum;
+            cfg->dim.y = cfg->maxgate + ((isref) ? 0 : 2 * cfg->freqnum);
+            cfg->dim.z = datalen;
+        }
+
+        mcx_savedata(data, datalen * framenum * cfg->srcnum, cfg, isref);
+        cfg->dim = dim0;
+        return;
+    }
+
+    if ((fp = fopen(fweight, "wt")) == NULL) {
+        MESH_ERROR("can not open weight file to write");
+    }
+
+    mesh_savetext(fp, data, datalen, framenum, cfg->srcnum);
+
+    fclose(fp);
+}
+
+/**
+ * @brief Save the variance of the output over the batches (--varbatch) to <session>_var.<ext>
+ *
+ * The variance has the layout of the first maxgate frames of the output and
+ * is saved by mesh_saveweight in the same format.
+ *
+ * @param[in] mesh: the mesh object
+ * @param[in] cfg: the simulation configuration
+ */
+
+void mesh_savevariance(tetmesh* mesh, mcconfig* cfg) {
+    char session[MAX_SESSION_LENGTH];
+    double* weight = mesh->weight;
+    int replaydetnum = cfg->replaydetnum, wavenum = cfg->wavenum, freqnum = cfg->freqnum;
+
+    if (mesh->weightvar == NULL) {
+        return;
+    }
+
+    memcpy(session, cfg->session, MAX_SESSION_LENGTH);
+    cfg->session[MAX_SESSION_LENGTH - 5] = '\0';
+    strcat(cfg->session, "_var");
+    mesh->weight = mesh->weightvar;
+    cfg->replaydetnum = cfg->wavenum = 1;
+    cfg->freqnum = 0;
+
+    mesh_saveweight(mesh, cfg, 0);
+
+    mesh->weight = weight;
+    cfg->replaydetnum = replaydetnum;
+    cfg->wavenum = wavenum;
+    cfg->freqnum = freqnum;
+    memcpy(cfg->session, session, MAX_SESSION_LENGTH);
+}
+
+/**
+ * @brief Save the per-element counters of --heatmap to <session>_heat.<ext>
+ *
+ * The counters of cfg->exportheatmap are saved by mesh_saveweight as an
+ * elemental output of hmCounterNum frames, in the input element order: the
+ * ray-tet tests, the edge/vertex fixes and the reflections/refractions at
+ * the faces of each element, summed over all photons.
+ *
+ * @param[in] mesh: the mesh object
+ * @param[in] cfg: the simulation configuration
+ */
+
+void mesh_saveheatmap(tetmesh* mesh, mcconfig* cfg) {
+    mcconfig heatcfg = *cfg;
+    tetmesh heatmesh = *mesh;
+
+    if (cfg->exportheatmap == NULL) {
+        return;
+    }
+
+    heatcfg.session[MAX_SESSION_LENGTH - 6] = '\0';
+    strcat(heatcfg.session, "_heat");
+    heatcfg.srcnum = heatcfg.replaydetnum = heatcfg.wavenum = 1;
+    heatcfg.maxgate = hmCounterNum;
+    heatcfg.freqnum = 0;
+    heatcfg.basisorder = 0;
+
+    if (heatcfg.method == rtBLBadouelGrid) {
+        heatcfg.method = rtBLBadouel;
+    }
+
+    heatmesh.weight = cfg->exportheatmap;
+    heatmesh.weightpage = NULL;
+    heatmesh.outmap = NULL;
+
+    mesh_saveweight(&heatmesh, &heatcfg, 0);
+}
+
+/**
+ * @brief Copy the fluence output to a buffer in the input numbering, as saved by mesh_saveweight
+ *
+ * @param[in] mesh: the mesh object
+ * @param[in] cfg: the simulation configuration
+ * @param[out] buf: the buffer receiving datalen x srcnum values per saved frame
+ * @param[in] datalen: the number of nodes, elements or grid voxels per frame
+ */
+
+static void mesh_copyweight(tetmesh* mesh, mcconfig* cfg, double* buf, size_t datalen) {
+    size_t i, j, k;
+    int* order = (cfg->method == rtBLBadouelGrid) ? NULL : ((cfg->basisorder) ? mesh->nodeorder : mesh->elemorder);
+    double* frame;
+
+    if (mesh->weightpage == NULL) {
+        memcpy(buf, mesh->weight, sizeof(double) * datalen * cfg->srcnum * (cfg->maxgate * cfg->replaydetnum * cfg->wavenum + 2 * cfg->freqnum));
+        return;
+    }
+
+    if (order == NULL) {
+        for (i = 0; i < (size_t)cfg->maxgate; i++) {
+            mesh_sparseframe(mesh, cfg, i, buf + i * datalen * cfg->srcnum);
+        }
+
+        return;
+    }
+
+    frame = (double*)malloc(sizeof(double) * datalen * cfg->srcnum);
+
+    if (frame == NULL) {
+        MESH_ERROR("can not allocate the frame to copy the sparse output");
+    }
+
+    for (i = 0; i < (size_t)cfg->maxgate; i++) {
+        double* dest = buf + i * datalen * cfg->srcnum;
+
+        mesh_sparseframe(mesh, cfg, i, frame);
+
+        for (j = 0; j < datalen; j++)
+            for (k = 0; k < (size_t)cfg->srcnum; k++) {
+                dest[order[j] * cfg->srcnum + k] = frame[j * cfg->srcnum + k];
+            }
+    }
+
+    free(frame);
+}
+
+/**
+ * @brief Add the description of one array of the shared-memory segment to its header
+ *
+ * @param[in] data: the Data object of the header
+ * @param[in] name: the name of the array
+ * @param[in] type: the element type, "double" or "float"
+ * @param[in] dims: the dimensions, fastest-varying first
+ * @param[in] ndim: the number of dimensions
+ * @param[in] offset: the byte offset of the array from the start of the segment
+ * @param[in] bytes: the byte length of the array
+ */
+
+static void mesh_shmarray(cJSON* data, const char* name, const char* type, size_t* dims, int ndim, size_t offset, size_t bytes) {
+    cJSON* obj = cJSON_CreateObject(), *dim = cJSON_CreateArray();
+    int i;
+
+    for (i = 0; i < ndim; i++) {
+        cJSON_AddItemToArray(dim, cJSON_CreateNumber((double)dims[i]));
+    }
+
+    cJSON_AddStringToObject(obj, "Type", type);
+    cJSON_AddItemToObject(obj, "Dims", dim);
+    cJSON_AddNumberToObject(obj, "Offset", (double)offset);
+    cJSON_AddNumberToObject(obj, "Bytes", (double)bytes);
+    cJSON_AddItemToObject(data, name, obj);
+}
+
+/**
+ * @brief Publish the outputs of a run in a named POSIX shared-memory segment
+ *
+ * The segment is created by --shm name after the regular outputs are saved,
+ * so that a downstream process can map the results instead of re-reading the
+ * files. Its first MMC_SHM_HEADER_LEN bytes hold the MMC_SHM_MAGIC tag, the
+ * 64-bit length of the header text and a JSON header; the arrays follow at
+ * the byte offsets listed under "Data" in the header, each aligned to
+ * MMC_SHM_ALIGN bytes:
+ *  fluence: double, [srcnum, frames, nodes or elements], or [nx, ny, nz, frames, srcnum] for the dual grid
+ *  dref: double, [srcnum, maxgate, faces], only with -X 1
+ *  detected: float, [columns, detected photons], only with -d 1, the same records as the .mch file
+ * An existing segment of the same name is unlinked first, processes already
+ * mapping it keep their copy. The tag is written last, a reader may wait for
+ * it to appear before trusting the header.
+ *
+ * @param[in] mesh: the mesh object
+ * @param[in] cfg: the simulation configuration
+ * @param[in] detreclen: the number of floats per record of cfg->exportdetected
+ */
+
+void mesh_saveshm(tetmesh* mesh, mcconfig* cfg, int detreclen) {
+#ifdef _WIN32
+    MESH_ERROR("the shared-memory output is not supported on Windows");
+#else
+    char name[MAX_PATH_LENGTH + 1];
+    size_t datalen = (cfg->method == rtBLBadouelGrid) ? cfg->crop0.z : ((cfg->basisorder) ? mesh->nn : MESH_ELEMOUT(mesh));
+    size_t framenum = (mesh->weightpage) ? (size_t)cfg->maxgate : (size_t)(cfg->maxgate * cfg->replaydetnum * cfg->wavenum + 2 * cfg->freqnum);
+    size_t dims[5], weightpos = 0, refpos = 0, detpos = 0, len = MMC_SHM_HEADER_LEN, hdrlen;
+    int hasweight = (cfg->issave2pt && (mesh->weight || mesh->weightpage));
+    int hasref = (cfg->issaveref && mesh->dref);
+    int hasdet = (cfg->issavedet && cfg->exportdetected && cfg->detectedcount > 0);
+    cJSON* root = cJSON_CreateObject(), *data = cJSON_CreateObject();
+    char* hdr;
+    unsigned char* seg;
+    unsigned long long textlen;
+    int fd;
+
+    snprintf(name, sizeof(name), "%s%s", (cfg->shmname[0] == '/') ? "" : "/", cfg->shmname);
+
+    cJSON_AddStringToObject(root, "Session", cfg->session);
+    cJSON_AddNumberToObject(root, "Photons", (double)cfg->nphoton);
+    cJSON_AddNumberToObject(root, "SourceNum", cfg->srcnum);
+    cJSON_AddNumberToObject(root, "TimeGates", cfg->maxgate);
+    cJSON_AddNumberToObject(root, "TimeStep", cfg->tstep);
+    cJSON_AddNumberToObject(root, "Normalizer", cfg->his.normalizer);
+
+    if (hasweight) {
+        weightpos = len;
+
+        if (cfg->method == rtBLBadouelGrid) {
+            dims[0] = cfg->dim.x;
+            dims[1] = cfg->dim.y;
+            dims[2] = cfg->dim.z;
+            dims[3] = framenum;
+            dims[4] = cfg->srcnum;
+        } else {
+            dims[0] = cfg->srcnum;
+            dims[1] = framenum;
+            dims[2] = datalen;
+        }
+
+        mesh_shmarray(data, "fluence", "double", dims, (cfg->method == rtBLBadouelGrid) ? 5 : 3, weightpos, sizeof(double) * datalen * cfg->srcnum * framenum);
+        len += (sizeof(double) * datalen * cfg->srcnum * framenum + MMC_SHM_ALIGN - 1) & ~((size_t)MMC_SHM_ALIGN - 1);
+    }
+
+    if (hasref) {
+        refpos = len;
+        dims[0] = cfg->srcnum;
+        dims[1] = cfg->maxgate;
+        dims[2] = mesh->nf;
+        mesh_shmarray(data, "dref", "double", dims, 3, refpos, sizeof(double) * mesh->nf * cfg->srcnum * cfg->maxgate);
+        len += (sizeof(double) * mesh->nf * cfg->srcnum * cfg->maxgate + MMC_SHM_ALIGN - 1) & ~((size_t)MMC_SHM_ALIGN - 1);
+    }
+
+    if (hasdet) {
+        detpos = len;
+        dims[0] = detreclen;
+        dims[1] = cfg->detectedcount;
+        mesh_shmarray(data, "detected", "float", dims, 2, detpos, sizeof(float) * detreclen * cfg->detectedcount);
+        len += (sizeof(float) * detreclen * cfg->detectedcount + MMC_SHM_ALIGN - 1) & ~((size_t)MMC_SHM_ALIGN - 1);
+    }
+
+    cJSON_AddItemToObject(root, "Data", data);
+    hdr = cJSON_PrintUnformatted(root);
+    cJSON_Delete(root);
+
+    if (hdr == NULL || (hdrlen = strlen(hdr) + 1) > MMC_SHM_HEADER_LEN - 16) {
+        MESH_ERROR("the header of the shared-memory output is too long");
+    }
+
+    shm_unlink(name);
+
+    if ((fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600)) < 0) {
+        MESH_ERROR("can not create the shared-memory segment of --shm");
+    }
+
+    if (ftruncate(fd, (off_t)len) != 0) {
+        close(fd);
+        shm_unlink(name);
+        MESH_ERROR("can not resize the shared-memory segment of --shm");
+    }
+
+    seg = (unsigned char*)mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (seg == MAP_FAILED) {
+        shm_unlink(name);
+        MESH_ERROR("can not map the shared-memory segment of --shm");
+    }
+
+    textlen = hdrlen;
+    memcpy(seg + 8, &textlen, sizeof(textlen));
+    memcpy(seg + 16, hdr, hdrlen);
+    free(hdr);
+
+    if (hasweight) {
+        mesh_copyweight(mesh, cfg, (double*)(seg + weightpos), datalen);
+    }
+
+    if (hasref) {
+        memcpy(seg + refpos, mesh->dref, sizeof(double) * mesh->nf * cfg->srcnum * cfg->maxgate);
+    }
+
+    if (hasdet) {
+        memcpy(seg + detpos, cfg->exportdetected, sizeof(float) * detreclen * cfg->detectedcount);
+    }
+
+    __sync_synchronize();
+    memcpy(seg, MMC_SHM_MAGIC, 8);
+    munmap(seg, len);
+#endif
+}
+
+/**
+ * @brief Save detected photon data into an .mch history file
+ *
+ * With -F jnii or bnii, the records are instead saved to a _detp.jdat file, one
+ * (optionally -Z compressed) array per field of cfg->his.savedetflag.
+ *
+ * @param[in] ppath: buffer points to the detected photon data (partial-path, det id, etc)
+ * @param[in] seeds: buffer points to the detected photon seeds
+ * @param[in] count: how many photons are detected
+ * @param[in] seedbyte: how many bytes per detected photon seed
+ * @param[in] cfg: the simulation configuration
+ */
+
+void mesh_savedetphoton(float* ppath, void* seeds, int count, int seedbyte, mcconfig* cfg) {
+    FILE* fp;
+    char fhistory[MAX_FULL_PATH], filetag;
+
+    filetag = ((cfg->his.detected == 0  && cfg->his.savedphoton) ? 't' : 'h');
+
+    cfg->his.unitinmm = 1.f;
+
+    if (cfg->method != rtBLBadouelGrid) {
+        cfg->his.unitinmm = cfg->unitinmm;
+    }
+
+    cfg->his.srcnum = cfg->srcnum;
+    cfg->his.detnum = cfg->detnum;
+
+    if (cfg->issaveseed && seeds != NULL) {
+        cfg->his.seedbyte = seedbyte;
+        cfg->his.seedrng = cfg->rngtype + 1;
+    }
+
+#ifndef MCX_CONTAINER
+
+    /*with -F jnii/bnii, write a compressed JData file (-Z) if the host described the record fields*/
+    if (filetag == 'h' && cfg->his.savedetflag && (cfg->outputformat == ofJNifti || cfg->outputformat == ofBJNifti)) {
+        mcx_savejdet(ppath, seeds, count, 0, cfg);
+        return;
+    }
+
+#endif
+
+    if (cfg->rootpath[0]) {
+        sprintf(fhistory, "%s%c%s.mc%c", cfg->rootpath, pathsep, cfg->session, filetag);
+    } else {
+        sprintf(fhistory, "%s.mc%c", cfg->session, filetag);
+    }
+
+    if ((fp = fopen(fhistory, "wb")) == NULL) {
+        MESH_ERROR("can not open history file to write");
+    }
+
+    /*
+        if (count > 0 && cfg->exportdetected == NULL) {
+            cfg->detectedcount = count;
+            cfg->exportdetected = (float*)malloc(cfg->his.colcount * cfg->detectedcount * sizeof(float));
+        }
+
+        if (cfg->exportdetected != ppath) {
+            memcpy(cfg->exportdetected, ppath, count * cfg->his.colcount * sizeof(float));
+        }
+    */
+    //fwrite(&(cfg->his), sizeof(history), 1, fp);
+    fwrite(ppath, sizeof(float), count * cfg->his.colcount, fp);
+
+    //if (cfg->issaveseed && seeds != NULL) {
+    //    fwrite(seeds, seedbyte, count, fp);
+    //}
+
+    fclose(fp);
+}
+
+/**
+ * @brief Append a chunk of detected photon records to the .mch history file
+ *
+ * Used when cfg->streamdet is set: the first chunk of a run truncates the
+ * file and later ones are appended, so that the hosts only hold one chunk of
+ * records per thread or device. cfg->his.savedphoton counts the records
+ * written so far and must be reset to 0 before a run. The calls must be
+ * serialized by the caller.
+ *
+ * @param[in] ppath: buffer points to the detected photon data (partial-path, det id, etc)
+ * @param[in] count: how many photons are in the chunk
+ * @param[in] colcount: the number of floats per detected photon record
+ * @param[in] cfg: the simulation configuration
+ */
+
+void mesh_appenddetphoton(float* ppath, int count, int colcount, mcconfig* cfg) {
+    FILE* fp;
+    char fhistory[MAX_FULL_PATH];
+
+    if (count <= 0 && cfg->his.savedphoton > 0) {
+        return;
+    }
+
+    if (cfg->rootpath[0]) {
+        sprintf(fhistory, "%s%c%s.mch", cfg->rootpath, pathsep, cfg->session);
+    } else {
+        sprintf(fhistory, "%s.mch", cfg->session);
+    }
+
+    if ((fp = fopen(fhistory, (cfg->his.savedphoton == 0) ? "wb" : "ab")) == NULL) {
+        MESH_ERROR("can not open history file to write");
+    }
+
+    if (count > 0 && fwrite(ppath, sizeof(float) * colcount, count, fp) != (size_t)count) {
+        MESH_ERROR("can not write to history file");
+    }
+
+    fclose(fp);
+    cfg->his.savedphoton += count;
+}
+
+/**
+ * @brief Append a chunk of trajectory positions to the .mct file
+ *
+ * Used to stream the sampled photon trajectories of a standalone run: the
+ * first chunk of a run truncates the file and later ones are appended.
+ * cfg->debugdatalen counts the positions written so far and must be reset
+ * to 0 before a run. The calls must be serialized by the caller.
+ *
+ * @param[in] traj: buffer of the trajectory positions, MCX_DEBUG_REC_LEN floats each
+ * @param[in] count: how many positions are in the chunk
+ * @param[in] cfg: the simulation configuration
+ */
+
+void mesh_appendtrajectory(float* traj, int count, mcconfig* cfg) {
+    FILE* fp;
+    char ftraj[MAX_FULL_PATH];
+
+    if (count <= 0 && cfg->debugdatalen > 0) {
+        return;
+    }
+
+    if (cfg->rootpath[0]) {
+        sprintf(ftraj, "%s%c%s.mct", cfg->rootpath, pathsep, cfg->session);
+    } else {
+        sprintf(ftraj, "%s.mct", cfg->session);
+    }
+
+    if ((fp = fopen(ftraj, (cfg->debugdatalen == 0) ? "wb" : "ab")) == NULL) {
+        MESH_ERROR("can not open trajectory file to write");
+    }
+
+    if (count > 0 && fwrite(traj, sizeof(float) * MCX_DEBUG_REC_LEN, count, fp) != (size_t)count) {
+        MESH_ERROR("can not write to trajectory file");
+    }
+
+    fclose(fp);
+    cfg->debugdatalen += count;
+}
+
+#endif
+
+/**
+ * @brief Save binned detected photon data over an area-detector as time-resolved 2D images
+ *
+ * When an area detector is used (such as a CCD), storing all detected photons can generate
+ * a huge output file. This can be mitigated by accumulate the data first to a rasterized
+ * detector grid, and then save only the integrated data.
+ *
+ * @param[out] detmap: buffer points to the output detector data array
+ * @param[in] ppath: buffer points to the detected photon data (partial-path, det id, etc)
+ * @param[in] count: how many photons are detected
+ * @param[in] cfg: the simulation configuration
+ * @param[in] mesh: the mesh object
+ */
+
+void mesh_getdetimage(float* detmap, float* ppath, int count, mcconfig* cfg, tetmesh* mesh) {
+    // cfg->issaveexit is 2 for this mode
+    int colcount = mcx_detreclen(cfg, cfg->his.maxmedia);
+    int pathpos = SAVE_NSCAT(cfg->savedetflag) * cfg->his.maxmedia;
+    float x0 = cfg->detpos[0].x;
+    float y0 = cfg->detpos[0].y;
+    float xrange = cfg->detparam1.x + cfg->detparam2.x;
+    float yrange = cfg->detparam1.y + cfg->detparam2.y;
+    int xsize = cfg->detparam1.w;
+    int ysize = cfg->detparam2.w;
+    size_t imgsize = (size_t)xsize * ysize * cfg->maxgate;
+    int i, nthread = 1;
+    float unitinmm = (cfg->method != rtBLBadouelGrid) ? cfg->his.unitinmm : 1.f;
+    float* partial = NULL;
+
+#ifdef _OPENMP
+    /*the per-thread partial images never take more memory than the detected photon data*/
+    nthread = MAX(1, MIN(omp_get_max_threads(), count / MMC_DETIMAGE_CHUNK));
+    nthread = (int)MAX(1, MIN((size_t)nthread, (size_t)count * colcount / MAX(imgsize, 1) + 1));
+#endif
+
+    if (nthread > 1) {
+        partial = (float*)calloc(imgsize * (nthread - 1), sizeof(float));
+    }
+
+    #pragma omp parallel num_threads(nthread)
+    {
+        int tid = 0, p, j, xindex, yindex, ntg;
+        float xloc, yloc, weight, path, atten, * image;
+
+#ifdef _OPENMP
+        tid = omp_get_thread_num();
+#endif
+        image = (tid == 0) ? detmap : partial + (tid - 1) * imgsize;
+
+        #pragma omp for schedule(static)
+
+        for (p = 0; p < count; p++) {
+            float* rec = ppath + (size_t)p * colcount;
+
+            path = 0.f;
+            atten = 0.f;
+            weight = rec[colcount - 1];
+
+            for (j = 1; j <= cfg->his.maxmedia; j++) {
+                path += rec[j + pathpos] * mesh->med[j].n;
+                atten += rec[j + pathpos] * mesh->med[j].mua;
+            }
+
+            weight *= expf(-atten * unitinmm);
+            ntg = (int) path * R_C0 / cfg->tstep;
+
+            if (ntg > cfg->maxgate - 1) {
+                ntg = cfg->maxgate - 1;
+            }
+
+            xloc = rec[colcount - 7];
+            yloc = rec[colcount - 6];
+            xindex = (xloc - x0) / xrange * xsize;
+
+            if (xindex < 0 || xindex > xsize - 1) {
+                continue;
+            }
+
+            yindex = (yloc - y0) / yrange * ysize;
+
+            if (yindex < 0 || yindex > ysize - 1) {
+                continue;
+            }
+
+            image[(size_t)ntg * xsize * ysize + yindex * xsize + xindex] += weight;
+        }
+    }
+
+    /*the partial images are added in the thread order, so that the image only depends on the thread number*/
+    if (partial) {
+        #pragma omp parallel for schedule(static)
+
+        for (i = 0; i < (int)imgsize; i++) {
+            for (int t = 0; t < nthread - 1; t++) {
+                detmap[i] += partial[t * imgsize + i];
+            }
+        }
+
+        free(partial);
+    }
+}
+
+#ifndef MCX_CONTAINER
+
+/**
+ * @brief Save binned detected photon data over an area-detector
+ *
+ * function for saving binned detected photon data into time-resolved 2D images
+ *
+ * @param[in] detmap: buffer points to the output detector data array
+ * @param[in] cfg: the simulation configuration
+ */
+
+void mesh_savedetimage(float* detmap, mcconfig* cfg) {
+
+    FILE* fp;
+    char fhistory[MAX_FULL_PATH];
+
+    if (cfg->rootpath[0]) {
+        sprintf(fhistory, "%s%c%s.img", cfg->rootpath, pathsep, cfg->session);
+    } else {
+        sprintf(fhistory, "%s.img", cfg->session);
+    }
+
+    if ((fp = fopen(fhistory, "wb")) == NULL) {
+        MESH_ERROR("can not open detector image file to write");
+    }
+
+    fwrite(detmap, sizeof(float), cfg->detparam1.w * cfg->detparam2.w * cfg->maxgate, fp);
+    fclose(fp);
+}
+
+#endif
+
+/**
+ * @brief Re-weight detected photons for new optical properties by perturbation Monte Carlo
+ *
+ * With the MCX-style weight update (-m 0), a detected photon carries its launch
+ * weight times exp(-sum(mua_m*L_m)), and the probability of its path scales with
+ * prod((mus'_m/mus_m)^n_m * exp(-(mus'_m-mus_m)*L_m)) when the scattering
+ * coefficients change, where L_m and n_m are the partial path and the scattering
+ * count in medium m. The stored records therefore give the detector readings
+ * W = sum(w)/nphoton and their derivatives dW/dmua_m = -sum(w*L_m)/nphoton and
+ * dW/dmus_m = sum(w*(n_m/mus'_m-L_m))/nphoton of every property set in
+ * cfg->pmcprop without a new simulation; the anisotropy and the refractive index
+ * must stay at the baseline.
+ *
+ * The records are regrouped by detector into one array per column, so that the
+ * loops over the photons vectorize, and the property sets are shared by the
+ * OpenMP threads.
+ *
+ * @param[out] out: pmcsetnum x detnum x (1+2*medianum) readings, each followed by its mua and mus derivatives
+ * @param[in] ppath: buffer points to the detected photon data (det id, scattering counts, partial-paths, ..., launch weight)
+ * @param[in] count: how many photons are in ppath
+ * @param[in] colcount: the number of floats per detected photon record
+ * @param[in] detnum: the number of detectors
+ * @param[in] unitinmm: the length unit of the partial-paths in mm
+ * @param[in] nphoton: the number of launched photons to normalize the readings
+ * @param[in] cfg: the simulation configuration, provides pmcsetnum and pmcprop
+ * @param[in] mesh: the mesh object, mesh->med are the baseline media of the records
+ */
+
+void mesh_pmcreweight(double* out, float* ppath, int count, int colcount, int detnum, float unitinmm, double nphoton, mcconfig* cfg, tetmesh* mesh) {
+    int i, d, m, medianum = mesh->prop, outlen = 1 + 2 * medianum;
+    int* detstart, *pos;
+    float* logw0, *plen, *nscat, * basemus;
+    float medunit = (cfg->method != rtBLBadouelGrid) ? cfg->unitinmm : 1.f;
+
+    if (cfg->pmcsetnum <= 0 || cfg->pmcprop == NULL) {
+        MESH_ERROR("no property set is given for the perturbation MC re-weighting");
+    }
+
+    if (colcount < 2 * medianum + 2 || detnum <= 0 || nphoton <= 0.0) {
+        MESH_ERROR("the detected photon data can not be re-weighted");
+    }
+
+    basemus = (float*)malloc(sizeof(float) * medianum);
+
+    for (m = 0; m < medianum; m++) {
+        basemus[m] = mesh->med[m + 1].mus / medunit;
+    }
+
+    for (i = 0; i < cfg->pmcsetnum * medianum; i++) {
+        float mua = cfg->pmcprop[i << 1], mus = cfg->pmcprop[(i << 1) + 1];
+
+        if (mua < 0.f || mus < 0.f || (mus > 0.f) != (basemus[i % medianum] > 0.f)) {
+            MESH_ERROR("the re-weighted mua/mus must not be negative, and mus can only be zero where the baseline mus is zero");
+        }
+    }
+
+    /*counting sort of the records by detector, one array per column*/
+    detstart = (int*)calloc(detnum + 1, sizeof(int));
+    pos = (int*)calloc(detnum, sizeof(int));
+
+    for (i = 0; i < count; i++) {
+        d = (int)ppath[(size_t)i * colcount];
+
+        if (d < 1 || d > detnum) {
+            MESH_ERROR("the detector ID of a detected photon exceeds the detector number");
+        }
+
+        detstart[d]++;
+    }
+
+    for (d = 0; d < detnum; d++) {
+        detstart[d + 1] += detstart[d];
+        pos[d] = detstart[d];
+    }
+
+    logw0 = (float*)malloc(sizeof(float) * MAX(count, 1));
+    plen = (float*)malloc(sizeof(float) * MAX(count, 1) * medianum);
+    nscat = (float*)malloc(sizeof(float) * MAX(count, 1) * medianum);
+
+    for (i = 0; i < count; i++) {
+        float* rec = ppath + (size_t)i * colcount;
+        int k = pos[(int)rec[0] - 1]++;
+
+        /*a zero launch weight gives exp(-inf)=0*/
+        logw0[k] = (rec[colcount - 1] > 0.f) ? logf(rec[colcount - 1]) : -INFINITY;
+
+        for (m = 0; m < medianum; m++) {
+            nscat[(size_t)m * count + k] = rec[1 + m];
+            plen[(size_t)m * count + k] = rec[1 + medianum + m] * unitinmm;
+        }
+    }
+
+    free(pos);
+
+    #pragma omp parallel
+    {
+        int s, j, dd, mm;
+        float* w = (float*)malloc(sizeof(float) * MAX(count, 1));
+        float* att = (float*)malloc(sizeof(float) * medianum * 2);
+        float* lograt = att + medianum;
+
+        #pragma omp for schedule(dynamic)
+
+        for (s = 0; s < cfg->pmcsetnum; s++) {
+            float* prop = cfg->pmcprop + (size_t)s * medianum * 2;
+
+            for (mm = 0; mm < medianum; mm++) {
+                att[mm] = -(prop[mm << 1] + prop[(mm << 1) + 1] - basemus[mm]);
+                lograt[mm] = (basemus[mm] > 0.f) ? logf(prop[(mm << 1) + 1] / basemus[mm]) : 0.f;
+            }
+
+            for (dd = 0; dd < detnum; dd++) {
+                int start = detstart[dd], end = detstart[dd + 1];
+                double sumw = 0.0, * res = out + ((size_t)s * detnum + dd) * outlen;
+
+                #pragma omp simd
+
+                for (j = start; j < end; j++) {
+                    float e = logw0[j];
+
+                    for (int k = 0; k < medianum; k++) {
+                        e += att[k] * plen[(size_t)k * count + j] + lograt[k] * nscat[(size_t)k * count + j];
+                    }
+
+                    w[j] = expf(e);
+                }
+
+                #pragma omp simd reduction(+:sumw)
+
+                for (j = start; j < end; j++) {
+                    sumw += w[j];
+                }
+
+                res[0] = sumw / nphoton;
+
+                for (mm = 0; mm < medianum; mm++) {
+                    float* pl = plen + (size_t)mm * count, *ns = nscat + (size_t)mm * count;
+                    double suml = 0.0, sumn = 0.0;
+
+                    #pragma omp simd reduction(+:suml,sumn)
+
+                    for (j = start; j < end; j++) {
+                        suml += w[j] * pl[j];
+                        sumn += w[j] * ns[j];
+                    }
+
+                    res[1 + mm] = -suml / nphoton;
+                    res[1 + medianum + mm] = ((prop[(mm << 1) + 1] > 0.f) ? sumn / prop[(mm << 1) + 1] - suml : 0.0) / nphoton;
+                }
+            }
+        }
+
+        free(att);
+        free(w);
+    }
+
+    free(nscat);
+    free(plen);
+    free(logw0);
+    free(detstart);
+    free(basemus);
+}
+
+/**
+ * @brief Normalize the detector statistics accumulated during the simulation (--detstat)
+ *
+ * The sums of each detector, laid out as given by mcx_detstatlen, are converted
+ * to the detected weight per launched photon of each time gate (TPSF), the mean
+ * partial path (mm) and the mean scattering count of each medium weighted by the
+ * detected weight, same as matlab/mmcdettpsf.m, mmcmeanpath.m and mmcmeanscat.m,
+ * and the total detected weight per launched photon; the results are stored in
+ * cfg->exportdetstat in the same layout.
+ *
+ * @param[in] mesh: the mesh object
+ * @param[in,out] cfg: the simulation configuration structure
+ * @param[in] sums: detnum x mcx_detstatlen() raw sums of the detected photons
+ * @param[in] nphoton: the number of launched photons
+ */
+
+void mesh_normdetstat(tetmesh* mesh, mcconfig* cfg, double* sums, double nphoton) {
+    int i, j, statlen = mcx_detstatlen(cfg, mesh->prop);
+    double lenunit = (cfg->method != rtBLBadouelGrid) ? cfg->unitinmm : 1.0;
+
+    cfg->exportdetstat = (double*)realloc(cfg->exportdetstat, sizeof(double) * cfg->detnum * statlen);
+
+    for (i = 0; i < cfg->detnum; i++) {
+        double* in = sums + (size_t)i * statlen, *out = cfg->exportdetstat + (size_t)i * statlen;
+        double w = in[statlen - 1];
+
+        for (j = 0; j < cfg->maxgate; j++) {
+            out[j] = in[j] / nphoton;
+        }
+
+        for (j = 0; j < mesh->prop; j++) {
+            out[cfg->maxgate + j] = (w > 0.0) ? in[cfg->maxgate + j] / w * lenunit : 0.0;
+            out[cfg->maxgate + mesh->prop + j] = (w > 0.0) ? in[cfg->maxgate + mesh->prop + j] / w : 0.0;
+        }
+
+        out[statlen - 1] = w / nphoton;
+    }
+}
+
+#ifndef MCX_CONTAINER
+
+/**
+ * @brief Save the detector statistics of --detstat
+ *
+ * The normalized statistics of cfg->exportdetstat, see mesh_normdetstat, are
+ * saved to session_detstat.dat as one row per detector: the detector ID, the
+ * detected weight, the TPSF, the mean partial paths and scattering counts.
+ *
+ * @param[in] mesh: the mesh object
+ * @param[in] cfg: the simulation configuration structure
+ */
+
+void mesh_savedetstat(tetmesh* mesh, mcconfig* cfg) {
+    FILE* fp;
+    char fstat[MAX_FULL_PATH];
+    int i, j, statlen = mcx_detstatlen(cfg, mesh->prop);
+
+    if (cfg->rootpath[0]) {
+        sprintf(fstat, "%s%c%s_detstat.dat", cfg->rootpath, pathsep, cfg->session);
+    } else {
+        sprintf(fstat, "%s_detstat.dat", cfg->session);
+    }
+
+    if ((fp = fopen(fstat, "wt")) == NULL) {
+        MESH_ERROR("can not open the detector statistics file to write");
+    }
+
+    fprintf(fp, "%% det W TPSF[1..%d] meanpath[1..%d](mm) meanscat[1..%d], per launched photon (W, TPSF) or detected weight\n", cfg->maxgate, mesh->prop, mesh->prop);
+
+    for (i = 0; i < cfg->detnum; i++) {
+        double* stat = cfg->exportdetstat + (size_t)i * statlen;
+
+        fprintf(fp, "%d\t%e", i + 1, stat[statlen - 1]);
+
+        for (j = 0; j < statlen - 1; j++) {
+            fprintf(fp, "\t%e", stat[j]);
+        }
+
+        fprintf(fp, "\n");
+    }
+
+    fclose(fp);
+}
+
+/**
+ * @brief Save the next-event estimates of the detectors (--nextevent)
+ *
+ * The estimates of cfg->exportnee, per launched photon, are saved to
+ * session_nee.dat as one row per detector: the detector ID, the total
+ * estimated weight and that of each time gate (TPSF), the same columns as
+ * the first ones of session_detstat.dat.
+ *
+ * @param[in] cfg: the simulation configuration structure
+ */
+
+void mesh_savenee(mcconfig* cfg) {
+    FILE* fp;
+    char fnee[MAX_FULL_PATH];
+    int i, j;
+
+    if (cfg->rootpath[0]) {
+        sprintf(fnee, "%s%c%s_nee.dat", cfg->rootpath, pathsep, cfg->session);
+    } else {
+        sprintf(fnee, "%s_nee.dat", cfg->session);
+    }
+
+    if ((fp = fopen(fnee, "wt")) == NULL) {
+        MESH_ERROR("can not open the next-event estimate file to write");
+    }
+
+    fprintf(fp, "%% det W TPSF[1..%d], next-event estimates per launched photon\n", cfg->maxgate);
+
+    for (i = 0; i < cfg->detnum; i++) {
+        double* nee = cfg->exportnee + (size_t)i * (cfg->maxgate + 1);
+
+        fprintf(fp, "%d\t%e", i + 1, nee[cfg->maxgate]);
+
+        for (j = 0; j < cfg->maxgate; j++) {
+            fprintf(fp, "\t%e", nee[j]);
+        }
+
+        fprintf(fp, "\n");
+    }
+
+    fclose(fp);
+}
+
+/**
+ * @brief Compute the centroid and the outward unit normal of a face of an element
+ *
+ * @param[in] mesh: the mesh object
+ * @param[in] eid: the index (start from 0) of the element
+ * @param[in] j: the face index in facenb, the face nodes are out[ifaceorder[j]]
+ * @param[out] c: the centroid of the face
+ * @param[out] n: the unit normal of the face, pointing away from the 4th node of the element
+ */
+
+static void mesh_faceframe(tetmesh* mesh, int eid, int j, double c[3], double n[3]) {
+    int k, *ee = mesh->elem + (size_t)eid * mesh->elemlen;
+    const int* fn = out[ifaceorder[j]];
+    FLOAT3* a = mesh->node + ee[fn[0]] - 1, *b = mesh->node + ee[fn[1]] - 1, *d = mesh->node + ee[fn[2]] - 1;
+    FLOAT3* opp = mesh->node + ee[6 - fn[0] - fn[1] - fn[2]] - 1;
+    double ab[3] = {b->x - a->x, b->y - a->y, b->z - a->z}, ad[3] = {d->x - a->x, d->y - a->y, d->z - a->z}, len;
+
+    n[0] = ab[1] * ad[2] - ab[2] * ad[1];
+    n[1] = ab[2] * ad[0] - ab[0] * ad[2];
+    n[2] = ab[0] * ad[1] - ab[1] * ad[0];
+    len = sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+
+    if (n[0] * (opp->x - a->x) + n[1] * (opp->y - a->y) + n[2] * (opp->z - a->z) > 0.0) {
+        len = -len;
+    }
+
+    for (k = 0; k < 3; k++) {
+        n[k] = (len != 0.0) ? n[k] / len : 0.0;
+    }
+
+    c[0] = (a->x + b->x + d->x) * (1.0 / 3.0);
+    c[1] = (a->y + b->y + d->y) * (1.0 / 3.0);
+    c[2] = (a->z + b->z + d->z) * (1.0 / 3.0);
+}
+
+/**
+ * @brief Compute the power each source pattern delivers to the exterior faces (--reciprocal)
+ *
+ * The rays of the pattern source run along srcdir from the pattern plane. An
+ * exterior face facing the source, whose centroid projects along srcdir into
+ * the pattern rectangle, receives the power density of the covering pixel,
+ * normalized so that each pattern launches a unit power, times the cosine
+ * of its incidence angle. Shadowing by other faces is not considered, and the
+ * pattern is sampled at the face centroids, so the surface faces should be
+ * smaller than the pattern pixels.
+ *
+ * The faces are numbered as in mesh->dref after mesh_restoreorder, i.e. in
+ * the original element order.
+ *
+ * @param[in] mesh: the mesh object
+ * @param[in] cfg: the simulation configuration structure, with the pattern source
+ * @param[out] facew: mesh->nf x cfg->srcnum power densities (1/mesh unit^2) times the cosine, the pattern index running fastest
+ */
+
+void mesh_patternfaces(tetmesh* mesh, mcconfig* cfg, double* facew) {
+    int i, j, k, s, nf = 0, srcnum = cfg->srcnum, xsize = (int)cfg->srcparam1.w, ysize = (int)cfg->srcparam2.w;
+    int* neworder = (int*)malloc(sizeof(int) * mesh->ne);
+    double p1[3] = {cfg->srcparam1.x, cfg->srcparam1.y, cfg->srcparam1.z}, p2[3] = {cfg->srcparam2.x, cfg->srcparam2.y, cfg->srcparam2.z};
+    double dir[3] = {cfg->srcdir.x, cfg->srcdir.y, cfg->srcdir.z}, cr[3], det, area;
+    double* scale = (double*)calloc(srcnum, sizeof(double));
+
+    /*the pattern plane and the beam direction span the space, see launchphoton*/
+    cr[0] = p2[1] * dir[2] - p2[2] * dir[1];
+    cr[1] = p2[2] * dir[0] - p2[0] * dir[2];
+    cr[2] = p2[0] * dir[1] - p2[1] * dir[0];
+    det = p1[0] * cr[0] + p1[1] * cr[1] + p1[2] * cr[2];
+    area = sqrt((p1[1] * p2[2] - p1[2] * p2[1]) * (p1[1] * p2[2] - p1[2] * p2[1]) + (p1[2] * p2[0] - p1[0] * p2[2]) * (p1[2] * p2[0] - p1[0] * p2[2])
+                + (p1[0] * p2[1] - p1[1] * p2[0]) * (p1[0] * p2[1] - p1[1] * p2[0]));
+
+    memset(facew, 0, sizeof(double) * mesh->nf * srcnum);
+
+    if (det == 0.0 || area == 0.0 || xsize <= 0 || ysize <= 0) {
+        free(scale);
+        free(neworder);
+        return;
+    }
+
+    /*a pixel value over the pattern sum is its share of the launched power, spread over the pixel area*/
+    for (i = 0; i < xsize * ysize; i++)
+        for (s = 0; s < srcnum; s++) {
+            scale[s] += cfg->srcpattern[(size_t)i * srcnum + s];
+        }
+
+    for (s = 0; s < srcnum; s++) {
+        scale[s] = (scale[s] > 0.0) ? (double)xsize * ysize / (scale[s] * area) : 0.0;
+    }
+
+    for (i = 0; i < mesh->ne; i++) {
+        neworder[mesh->elemorder ? mesh->elemorder[i] : i] = i;
+    }
+
+    for (i = 0; i < mesh->ne; i++) {
+        int* enb = mesh->facenb + (size_t)neworder[i] * mesh->elemlen;
+
+        for (j = 0; j < 4; j++) {
+            double c[3], n[3], v[3], u[3], cosi;
+            int px, py;
+
+            if (enb[j] >= 0) {
+                continue;
+            }
+
+            mesh_faceframe(mesh, neworder[i], j, c, n);
+            cosi = -(n[0] * dir[0] + n[1] * dir[1] + n[2] * dir[2]);
+
+            if (cosi <= 0.0) {
+                nf++;
+                continue;
+            }
+
+            /*solve c-srcpos=u[0]*p1+u[1]*p2+u[2]*dir by the Cramer's rule*/
+            v[0] = c[0] - cfg->srcpos.x;
+            v[1] = c[1] - cfg->srcpos.y;
+            v[2] = c[2] - cfg->srcpos.z;
+            u[0] = (v[0] * cr[0] + v[1] * cr[1] + v[2] * cr[2]) / det;
+            u[1] = (p1[0] * (v[1] * dir[2] - v[2] * dir[1]) + p1[1] * (v[2] * dir[0] - v[0] * dir[2]) + p1[2] * (v[0] * dir[1] - v[1] * dir[0])) / det;
+            u[2] = (p1[0] * (p2[1] * v[2] - p2[2] * v[1]) + p1[1] * (p2[2] * v[0] - p2[0] * v[2]) + p1[2] * (p2[0] * v[1] - p2[1] * v[0])) / det;
+
+            if (u[0] >= 0.0 && u[0] < 1.0 && u[1] >= 0.0 && u[1] < 1.0 && u[2] >= 0.0) {
+                px = MIN((int)(u[0] * xsize), xsize - 1);
+                py = MIN((int)(u[1] * ysize), ysize - 1);
+
+                for (k = 0; k < srcnum; k++) {
+                    facew[(size_t)nf * srcnum + k] = cfg->srcpattern[((size_t)py * xsize + px) * srcnum + k] * scale[k] * cosi;
+                }
+            }
+
+            nf++;
+        }
+    }
+
+    free(scale);
+    free(neworder);
+}
+
+/**
+ * @brief Turn a detector into the disk source of a reciprocal run (--reciprocal)
+ *
+ * The disk has the radius of the detector and is launched along the inward
+ * normal of the exterior face nearest to the detector. It is centered on the
+ * plane of that face and moved inward by a tenth of its radius, so that it
+ * stays inside the mesh where the surface curvature radius is at least 5
+ * times the detector radius. The elements whose bounding boxes overlap the
+ * bounding box of the disk become the launch candidates in mesh->srcelem.
+ *
+ * @param[in,out] mesh: the mesh object, mesh->srcelem is replaced
+ * @param[in,out] cfg: the simulation configuration structure, the source is replaced
+ * @param[in] detid: the index (start from 0) of the detector
+ * @return 0 if the disk center is enclosed by an element, 1 if not
+ */
+
+int mesh_detsource(tetmesh* mesh, mcconfig* cfg, int detid) {
+    float4 det = cfg->detpos[detid];
+    double dist, mindist = VERY_BIG, c[3], n[3], nin[3] = {0.0, 0.0, -1.0}, h = 0.0, depth = det.w * 0.1f + EPS;
+    float pmin[3], pmax[3];
+    int i, j, len = 0;
+
+    for (i = 0; i < mesh->ne; i++) {
+        for (j = 0; j < 4; j++) {
+            if (mesh->facenb[(size_t)i * mesh->elemlen + j] >= 0) {
+                continue;
+            }
+
+            mesh_faceframe(mesh, i, j, c, n);
+            dist = (c[0] - det.x) * (c[0] - det.x) + (c[1] - det.y) * (c[1] - det.y) + (c[2] - det.z) * (c[2] - det.z);
+
+            if (dist < mindist) {
+                mindist = dist;
+                h = (det.x - c[0]) * n[0] + (det.y - c[1]) * n[1] + (det.z - c[2]) * n[2] + depth;
+                nin[0] = -n[0];
+                nin[1] = -n[1];
+                nin[2] = -n[2];
+            }
+        }
+    }
+
+    if (mindist == VERY_BIG) {
+        return 1;
+    }
+
+    cfg->srctype = stDisk;
+    cfg->srcpos.x = det.x + h * nin[0];
+    cfg->srcpos.y = det.y + h * nin[1];
+    cfg->srcpos.z = det.z + h * nin[2];
+    cfg->srcdir.x = nin[0];
+    cfg->srcdir.y = nin[1];
+    cfg->srcdir.z = nin[2];
+    cfg->srcdir.w = 0.f;
+    cfg->srcparam1.x = det.w;
+    cfg->srcparam1.y = cfg->srcparam1.z = cfg->srcparam1.w = 0.f;
+
+    pmin[0] = cfg->srcpos.x - det.w;
+    pmin[1] = cfg->srcpos.y - det.w;
+    pmin[2] = cfg->srcpos.z - det.w;
+    pmax[0] = cfg->srcpos.x + det.w;
+    pmax[1] = cfg->srcpos.y + det.w;
+    pmax[2] = cfg->srcpos.z + det.w;
+
+    free(mesh->srcelem);
+    mesh->srcelem = (int*)malloc(sizeof(int) * mesh->ne);
+
+    for (i = 0; i < mesh->ne; i++) {
+        int* ee = mesh->elem + (size_t)i * mesh->elemlen, isout = 0;
+        float emin[3] = {VERY_BIG, VERY_BIG, VERY_BIG}, emax[3] = {-VERY_BIG, -VERY_BIG, -VERY_BIG};
+
+        for (j = 0; j < 4; j++) {
+            FLOAT3* p = mesh->node + ee[j] - 1;
+
+            emin[0] = MIN(emin[0], p->x);
+            emin[1] = MIN(emin[1], p->y);
+            emin[2] = MIN(emin[2], p->z);
+            emax[0] = MAX(emax[0], p->x);
+            emax[1] = MAX(emax[1], p->y);
+            emax[2] = MAX(emax[2], p->z);
+        }
+
+        for (j = 0; j < 3; j++) {
+            isout |= (emax[j] < pmin[j] || emin[j] > pmax[j]);
+        }
+
+        if (!isout) {
+            mesh->srcelem[len++] = i + 1;
+        }
+    }
+
+    mesh->srcelemlen = len;
+    return mesh_initelem(mesh, cfg);
+}
+
+/**
+ * @brief Save the source-detector measurements of a reciprocal run (--reciprocal)
+ *
+ * @param[in] cfg: the simulation configuration structure
+ * @param[in] meas: detnum x srcnum x (maxgate+1) measurements, the total followed by the TPSF, the pattern index running fastest
+ */
+
+void mesh_savereciprocal(mcconfig* cfg, double* meas) {
+    FILE* fp;
+    char frecip[MAX_FULL_PATH];
+    int i, j, t;
+
+    if (cfg->rootpath[0]) {
+        sprintf(frecip, "%s%c%s_recip.dat", cfg->rootpath, pathsep, cfg->session);
+    } else {
+        sprintf(frecip, "%s_recip.dat", cfg->session);
+    }
+
+    if ((fp = fopen(frecip, "wt")) == NULL) {
+        MESH_ERROR("can not open the reciprocal measurement file to write");
+    }
+
+    fprintf(fp, "%% src det W TPSF[1..%d], detected fraction of the power of each pattern\n", cfg->maxgate);
+
+    for (j = 0; j < cfg->detnum; j++) {
+        for (i = 0; i < cfg->srcnum; i++) {
+            double* m = meas + ((size_t)j * cfg->srcnum + i) * (cfg->maxgate + 1);
+
+            fprintf(fp, "%d\t%d\t%e", i + 1, j + 1, m[0]);
+
+            for (t = 0; t < cfg->maxgate; t++) {
+                fprintf(fp, "\t%e", m[t + 1]);
+            }
+
+            fprintf(fp, "\n");
+        }
+    }
+
+    fclose(fp);
+}
+
+/**
+ * @brief Save the adjoint Jacobians of all source-detector pairs (--adjoint)
+ *
+ * The last cfg->adjointnum source patterns of a multi-pattern run are the
+ * adjoint sources placed at the detectors, the others are the forward sources.
+ * For each pair, the time-integrated fields of the two patterns are integrated
+ * over each element with the linear basis, where
+ * \f$\int_e N_i N_j dV = V_e(1+\delta_{ij})/20\f$, giving the mua sensitivity
+ * \f$J_{\mu_a}=-\int_e \phi_s\phi_d dV\f$. With the nodal output, the mus'
+ * sensitivity of the diffusion approximation,
+ * \f$J_{\mu_s'}=3D^2\int_e \nabla\phi_s\cdot\nabla\phi_d dV\f$, is also
+ * computed from the constant gradients of the fields in each element.
+ *
+ * The pairs are processed one at a time, the forward source running fastest,
+ * and each row of mesh->ne doubles (in the original element order) is appended
+ * to <session>_jmua.bin (and <session>_jmus.bin) before the next pair, so only
+ * the fields and one row per Jacobian are held in memory.
+ *
+ * @param[in] mesh: the mesh object, mesh->weight holds the normalized fields
+ * @param[in] cfg: the simulation configuration structure
+ */
+
+void mesh_savejacobian(tetmesh* mesh, mcconfig* cfg) {
+    FILE* fp[2] = {NULL, NULL};
+    char fjacob[MAX_FULL_PATH];
+    const char* suffix[2] = {"jmua", "jmus"};
+    int i, s, d, srcnum = cfg->srcnum, fwdnum = cfg->srcnum - cfg->adjointnum, isnodal = (cfg->basisorder != 0);
+    size_t j, t, datalen = isnodal ? mesh->nn : mesh->ne;
+    double unit = cfg->unitinmm, dt = (cfg->outputtype == otFlux) ? cfg->tstep : 1.0;
+    double* cw, *row, *edgeinv = NULL;
+
+    if (mesh->weight == NULL || cfg->adjointnum <= 0) {
+        return;
+    }
+
+    /* the time-integrated fields of all patterns, in the layout of a time gate of mesh->weight */
+    cw = (double*)calloc(datalen * srcnum, sizeof(double));
+
+    for (t = 0; t < (size_t)cfg->maxgate; t++) {
+        double* gate = mesh->weight + t * datalen * srcnum;
+
+        for (j = 0; j < datalen * srcnum; j++) {
+            cw[j] += gate[j] * dt;
+        }
+    }
+
+    /* the inverse of the edge matrix of each element, mapping the nodal differences to the gradient in 1/mm */
+    if (isnodal) {
+        edgeinv = (double*)calloc(mesh->ne * 9, sizeof(double));
+
+        #pragma omp parallel for schedule(static)
+
+        for (i = 0; i < mesh->ne; i++) {
+            int k, *ee = mesh->elem + (size_t)i * mesh->elemlen;
+            double e[3][3], det, *inv = edgeinv + (size_t)i * 9;
+
+            for (k = 0; k < 3; k++) {
+                e[k][0] = (mesh->node[ee[k + 1] - 1].x - mesh->node[ee[0] - 1].x) * unit;
+                e[k][1] = (mesh->node[ee[k + 1] - 1].y - mesh->node[ee[0] - 1].y) * unit;
+                e[k][2] = (mesh->node[ee[k + 1] - 1].z - mesh->node[ee[0] - 1].z) * unit;
+            }
+
+            det = e[0][0] * (e[1][1] * e[2][2] - e[1][2] * e[2][1]) - e[0][1] * (e[1][0] * e[2][2] - e[1][2] * e[2][0])
+                  + e[0][2] * (e[1][0] * e[2][1] - e[1][1] * e[2][0]);
+
+            if (det == 0.0) {
+                continue;
+            }
+
+            det = 1.0 / det;
+            inv[0] = (e[1][1] * e[2][2] - e[1][2] * e[2][1]) * det;
+            inv[1] = (e[0][2] * e[2][1] - e[0][1] * e[2][2]) * det;
+            inv[2] = (e[0][1] * e[1][2] - e[0][2] * e[1][1]) * det;
+            inv[3] = (e[1][2] * e[2][0] - e[1][0] * e[2][2]) * det;
+            inv[4] = (e[0][0] * e[2][2] - e[0][2] * e[2][0]) * det;
+            inv[5] = (e[0][2] * e[1][0] - e[0][0] * e[1][2]) * det;
+            inv[6] = (e[1][0] * e[2][1] - e[1][1] * e[2][0]) * det;
+            inv[7] = (e[0][1] * e[2][0] - e[0][0] * e[2][1]) * det;
+            inv[8] = (e[0][0] * e[1][1] - e[0][1] * e[1][0]) * det;
+        }
+    }
+
+    for (i = 0; i <= isnodal; i++) {
+        if (cfg->rootpath[0]) {
+            sprintf(fjacob, "%s%c%s_%s.bin", cfg->rootpath, pathsep, cfg->session, suffix[i]);
+        } else {
+            sprintf(fjacob, "%s_%s.bin", cfg->session, suffix[i]);
+        }
+
+        if ((fp[i] = fopen(fjacob, "wb")) == NULL) {
+            MESH_ERROR("can not open the Jacobian file to write");
+        }
+    }
+
+    row = (double*)calloc((size_t)mesh->ne * 2, sizeof(double));
+
+    for (d = fwdnum; d < srcnum; d++) {
+        for (s = 0; s < fwdnum; s++) {
+            #pragma omp parallel for schedule(static)
+
+            for (i = 0; i < mesh->ne; i++) {
+                int k, *ee = mesh->elem + (size_t)i * mesh->elemlen;
+                int eid = (mesh->elemorder) ? mesh->elemorder[i] : i;
+                double vol = ((mesh->evol) ? mesh->evol[i] : mesh_elemvolume(mesh, i)) * unit * unit * unit;
+                medium* prop = MESH_ELEMMED(mesh, i);
+
+                row[eid] = row[mesh->ne + eid] = 0.0;
+
+                if (mesh->type[i] <= 0) {
+                    continue;
+                }
+
+                if (isnodal) {
+                    double a[4], b[4], ab = 0.0, sa = 0.0, sb = 0.0, ga[3], gb[3], D, *inv = edgeinv + (size_t)i * 9;
+
+                    for (k = 0; k < 4; k++) {
+                        int nid = (mesh->nodeorder) ? mesh->nodeorder[ee[k] - 1] : ee[k] - 1;
+
+                        a[k] = cw[(size_t)nid * srcnum + s];
+                        b[k] = cw[(size_t)nid * srcnum + d];
+                        ab += a[k] * b[k];
+                        sa += a[k];
+                        sb += b[k];
+                    }
+
+                    row[eid] = -vol * (ab + sa * sb) * (1.0 / 20.0);
+
+                    for (k = 0; k < 3; k++) {
+                        ga[k] = inv[k * 3] * (a[1] - a[0]) + inv[k * 3 + 1] * (a[2] - a[0]) + inv[k * 3 + 2] * (a[3] - a[0]);
+                        gb[k] = inv[k * 3] * (b[1] - b[0]) + inv[k * 3 + 1] * (b[2] - b[0]) + inv[k * 3 + 2] * (b[3] - b[0]);
+                    }
+
+                    /* mua/mus of mesh->med are in 1/grid-unit */
+                    D = unit / (3.0 * (prop->mua + prop->mus * (1.0 - prop->g)));
+                    row[mesh->ne + eid] = 3.0 * D * D * vol * (ga[0] * gb[0] + ga[1] * gb[1] + ga[2] * gb[2]);
+                } else {
+                    row[eid] = -vol * cw[(size_t)eid * srcnum + s] * cw[(size_t)eid * srcnum + d];
+                }
+            }
+
+            fwrite(row, sizeof(double), mesh->ne, fp[0]);
+
+            if (isnodal) {
+                fwrite(row + mesh->ne, sizeof(double), mesh->ne, fp[1]);
+            }
+        }
+    }
+
+    for (i = 0; i <= isnodal; i++) {
+        fclose(fp[i]);
+    }
+
+    MMCDEBUG(cfg, dlTime, (cfg->flog, "saved the Jacobians of %d sources and %d detectors\n", fwdnum, cfg->adjointnum));
+
+    free(row);
+    free(edgeinv);
+    free(cw);
+}
+
+/**
+ * @brief Re-weight the detected photons of an .mch file for the property sets of --pmcprop
+ *
+ * This is the standalone perturbation MC mode (--pmc): the records and the photon
+ * count are read from an .mch file with a header, the property sets from
+ * cfg->pmcpropfile, a text file in the format of --waveprop whose header is
+ * "setnum medianum", and the media of the input are the baseline. The readings and
+ * their derivatives, see mesh_pmcreweight, are saved to session_pmc.dat as one row
+ * per set and detector.
+ *
+ * @param[in] mesh: the mesh object
+ * @param[in,out] cfg: the simulation configuration structure
+ */
+
+void mesh_runpmc(tetmesh* mesh, mcconfig* cfg) {
+    history his;
+    FILE* fp;
+    float* ppath;
+    char fpmc[MAX_FULL_PATH];
+    int i, k, tmp, nmed, outlen = 1 + 2 * mesh->prop;
+    medium prop;
+
+    if ((fp = fopen(cfg->pmcpropfile, "rt")) == NULL) {
+        MESH_ERROR("can not open the property file of --pmcprop");
+    }
+
+    if (fscanf(fp, "%d %d", &(cfg->pmcsetnum), &nmed) != 2 || cfg->pmcsetnum <= 0 || nmed != mesh->prop) {
+        MESH_ERROR("the property file of --pmcprop has wrong format or a different media number");
+    }
+
+    cfg->pmcprop = (float*)realloc(cfg->pmcprop, sizeof(float) * cfg->pmcsetnum * nmed * 2);
+
+    for (k = 0; k < cfg->pmcsetnum; k++) {
+        for (i = 1; i <= nmed; i++) {
+            if (fscanf(fp, "%d %f %f %f %f", &tmp, &(prop.mua), &(prop.mus), &(prop.g), &(prop.n)) != 5) {
+                MESH_ERROR("the property file of --pmcprop has wrong format");
+            }
+
+            if (fabs(prop.g - mesh->med[i].g) > 1e-5f || fabs(prop.n - mesh->med[i].n) > 1e-5f) {
+                MESH_ERROR("perturbation MC can not re-weight the photons for a different g or n");
+            }
+
+            cfg->pmcprop[((k * nmed) + i - 1) << 1] = prop.mua;
+            cfg->pmcprop[(((k * nmed) + i - 1) << 1) + 1] = prop.mus;
+        }
+    }
+
+    fclose(fp);
+
+    if ((fp = fopen(cfg->pmcfile, "rb")) == NULL) {
+        MESH_ERROR("can not open the history file of --pmc");
+    }
+
+    if (fread(&his, sizeof(history), 1, fp) != 1 || memcmp(his.magic, "MCXH", 4) != 0) {
+        MESH_ERROR("the history file of --pmc has no valid header");
+    }
+
+    if (his.maxmedia != mesh->prop || his.detnum == 0 || his.totalphoton == 0) {
+        MESH_ERROR("the history file was generated with a different media setting");
+    }
+
+    ppath = (float*)malloc(sizeof(float) * MAX(his.savedphoton, 1) * his.colcount);
+
+    if (fread(ppath, his.colcount * sizeof(float), his.savedphoton, fp) != his.savedphoton) {
+        MESH_ERROR("error when reading the partial path data");
+    }
+
+    fclose(fp);
+
+    cfg->exportpmc = (double*)realloc(cfg->exportpmc, sizeof(double) * cfg->pmcsetnum * his.detnum * outlen);
+    mesh_pmcreweight(cfg->exportpmc, ppath, his.savedphoton, his.colcount, his.detnum, his.unitinmm,
+                     (double)his.totalphoton * MAX(his.respin, 1), cfg, mesh);
+    free(ppath);
+
+    if (cfg->rootpath[0]) {
+        sprintf(fpmc, "%s%c%s_pmc.dat", cfg->rootpath, pathsep, cfg->session);
+    } else {
+        sprintf(fpmc, "%s_pmc.dat", cfg->session);
+    }
+
+    if ((fp = fopen(fpmc, "wt")) == NULL) {
+        MESH_ERROR("can not open the perturbation MC output file to write");
+    }
+
+    fprintf(fp, "%% set detector W dW/dmua[1..%d] dW/dmus[1..%d], %u of %u photons re-weighted\n", mesh->prop, mesh->prop, his.savedphoton, his.totalphoton);
+
+    for (k = 0; k < cfg->pmcsetnum * (int)his.detnum; k++) {
+        fprintf(fp, "%d\t%d", k / (int)his.detnum + 1, k % (int)his.detnum + 1);
+
+        for (i = 0; i < outlen; i++) {
+            fprintf(fp, "\t%e", cfg->exportpmc[(size_t)k * outlen + i]);
+        }
+
+        fprintf(fp, "\n");
+    }
+
+    fclose(fp);
+    MMC_FPRINTF(cfg->flog, "re-weighted %u detected photons for %d property sets, saved to %s\n", his.savedphoton, cfg->pmcsetnum, fpmc);
+}
+
+/**
+ * @brief Save the DCS field autocorrelation g1(tau) accumulated during the simulation (--dcs)
+ *
+ * The normalized g1 of cfg->exportdcs is saved to session_dcs.dat as one row
+ * per correlation time: tau followed by g1 of each detector.
+ *
+ * @param[in] cfg: the simulation configuration structure
+ */
+
+void mesh_savedcs(mcconfig* cfg) {
+    FILE* fp;
+    char fdcs[MAX_FULL_PATH];
+    int i, j;
+
+    if (cfg->rootpath[0]) {
+        sprintf(fdcs, "%s%c%s_dcs.dat", cfg->rootpath, pathsep, cfg->session);
+    } else {
+        sprintf(fdcs, "%s_dcs.dat", cfg->session);
+    }
+
+    if ((fp = fopen(fdcs, "wt")) == NULL) {
+        MESH_ERROR("can not open the DCS output file to write");
+    }
+
+    fprintf(fp, "%% tau(s) g1[1..%d], %s model, DV=%g, lambda=%g nm\n", cfg->detnum, (cfg->dcsmodel == 'b') ? "brownian" : "flow", cfg->dcsdv, cfg->dcslambda);
+
+    for (i = 0; i < cfg->dcstaunum; i++) {
+        fprintf(fp, "%e", cfg->dcstau[i]);
+
+        for (j = 0; j < cfg->detnum; j++) {
+            fprintf(fp, "\t%e", cfg->exportdcs[(size_t)j * cfg->dcstaunum + i]);
+        }
+
+        fprintf(fp, "\n");
+    }
+
+    fclose(fp);
+}
+
+#endif
+
+/**
+ * @brief Recompute the detected photon weight from the partial-pathlengths
+ *
+ * This function currently does not consider the final transmission coeff before
+ * the photon being detected.
+ *
+ * @param[in] photonid: index of the detected photon
+ * @param[in] colcount: how many 4-byte records per detected photon
+ * @param[in] ppath: buffer points to the detected photon data (partial-path, det id, etc)
+ * @param[in] cfg: the simulation configuration
+ * @return the detection pattern weight, or -1 if the photon exits outside of the detection plane
+ */
+
+float mesh_getdetweight(int photonid, int colcount, float* ppath, mcconfig* cfg) {
+
+    float x0 = cfg->detpos[0].x;
+    float y0 = cfg->detpos[0].y;
+    float xrange = cfg->detparam1.x + cfg->detparam2.x;
+    float yrange = cfg->detparam1.y + cfg->detparam2.y;
+    int xsize = cfg->detparam1.w;
+    int ysize = cfg->detparam2.w;
+    float xloc = ppath[(photonid + 1) * colcount - 7];
+    float yloc = ppath[(photonid + 1) * colcount - 6];
+    int xindex = (xloc - x0) / xrange * xsize;
+    int yindex = (yloc - y0) / yrange * ysize;
+
+    if (xindex < 0 || xindex > xsize - 1 || yindex < 0 || yindex > ysize - 1) {
+        return -1.f;
+    }
+
+    return cfg->detpattern[yindex * xsize + xindex];
+}
+
+/**
+ * @brief Scale a range of time gates of one source pattern, block by block
+ *
+ * Every value is divided by a per-element/node volume and multiplied by scale.
+ * The volume is evol*mua of the element for voltype 1, the nodal volume (if
+ * positive) for voltype 2 and 1 otherwise. The threads share blocks of
+ * MMC_NORM_BLOCK elements/nodes, and the volumes of a block are computed once
+ * for all gates, so the output is read and written only once.
+ *
+ * @param[in] mesh: the mesh object
+ * @param[in] cfg: the simulation configuration
+ * @param[in] datalen: the number of elements/nodes/voxels per gate
+ * @param[in] gate0: the first time gate to scale
+ * @param[in] gate1: one past the last time gate to scale
+ * @param[in] voltype: 0: no volume, 1: element volume times mua, 2: nodal volume
+ * @param[in] scale: the scaling factor
+ * @param[in] pair: index of the source pattern
+ */
+
+static void mesh_scaleweight(tetmesh* mesh, mcconfig* cfg, int datalen, int gate0, int gate1, int voltype, double scale, int pair) {
+    int b, blocknum = (datalen + MMC_NORM_BLOCK - 1) / MMC_NORM_BLOCK, *rowelem = NULL;
+    size_t stride = cfg->srcnum;
+
+    /*with --outmask, the rows are the selected elements in the input order*/
+    if (voltype == 1 && mesh->outmap) {
+        rowelem = (int*)malloc(sizeof(int) * mesh->outlen);
+
+        for (b = 0; b < mesh->ne; b++) {
+            if (mesh->outmap[b] >= 0) {
+                rowelem[mesh->outmap[b]] = b;
+            }
+        }
+    }
+
+    #pragma omp parallel for schedule(static)
+
+    for (b = 0; b < blocknum; b++) {
+        double vol[MMC_NORM_BLOCK];
+        int i, j, j0 = b * MMC_NORM_BLOCK, len = MIN(MMC_NORM_BLOCK, datalen - j0);
+
+        for (j = 0; j < len; j++) {
+            if (voltype == 1) {
+                int eid = (rowelem) ? rowelem[j0 + j] : j0 + j;
+                vol[j] = ((mesh->evol) ? mesh->evol[eid] : mesh_elemvolume(mesh, eid)) * MESH_ELEMMED(mesh, eid)->mua;
+            } else if (voltype == 2 && mesh->nvol[j0 + j] > 0.f) {
+                vol[j] = mesh->nvol[j0 + j];
+            } else {
+                vol[j] = 1.0;
+            }
+        }
+
+        for (i = gate0; i < gate1; i++) {
+            double* w = mesh->weight + ((size_t)i * datalen + j0) * stride + pair;
+
+            #pragma omp simd
+
+            for (j = 0; j < len; j++) {
+                w[j * stride] = w[j * stride] / vol[j] * scale;
+            }
+        }
+    }
+
+    free(rowelem);
+}
+
+/**
+ * @brief Sum the energy deposited by one source pattern over all time gates
+ *
+ * For elemental outputs, this is the sum of the raw deposits. For nodal
+ * outputs, the nodal values divided by the nodal volumes are integrated over
+ * the labeled elements, weighted by evol*mua (times 4, the 1/4 factor is
+ * applied by the caller). The partial sums of fixed blocks are added in order,
+ * so the total does not depend on the thread count. For a partition of
+ * --domain, the sums of all ranks are added by mesh->part->sumparts.
+ *
+ * @param[in] mesh: the mesh object
+ * @param[in] cfg: the simulation configuration
+ * @param[in] datalen: the number of elements/nodes per gate
+ * @param[in] pair: index of the source pattern
+ */
+
+static double mesh_energydeposit(tetmesh* mesh, mcconfig* cfg, int datalen, int pair) {
+    int b, len = (cfg->basisorder && mesh->part == NULL) ? mesh->ne : datalen;
+    int blocknum = (len + MMC_NORM_BLOCK - 1) / MMC_NORM_BLOCK;
+    double energydeposit = 0.0, *blocksum = (double*)calloc(blocknum, sizeof(double));
+    size_t stride = cfg->srcnum;
+
+    #pragma omp parallel for schedule(static)
+
+    for (b = 0; b < blocknum; b++) {
+        int i, j, k, iend = MIN((b + 1) * MMC_NORM_BLOCK, len);
+        double sum = 0.0;
+
+        for (i = b * MMC_NORM_BLOCK; i < iend; i++) {
+            if (cfg->basisorder && mesh->part) {
+                /*a partition holds a share of the deposits of its boundary nodes, so the sum goes node by node*/
+                double w = 0.0;
+
+                for (j = 0; j < cfg->maxgate; j++) {
+                    w += mesh->weight[((size_t)j * mesh->nn + i) * stride + pair];
+                }
+
+                sum += ((mesh->nvol[i] > 0.f) ? w / mesh->nvol[i] : w) * mesh->part->nodecoef[i];
+            } else if (cfg->basisorder) {
+                int* ee = (int*)(mesh->elem + i * mesh->elemlen);
+                double energyelem = 0.0;
+
+                for (j = 0; j < cfg->maxgate; j++)
+                    for (k = 0; k < 4; k++) {
+                        double w = mesh->weight[((size_t)j * mesh->nn + ee[k] - 1) * stride + pair];
+                        energyelem += (mesh->nvol[ee[k] - 1] > 0.f) ? w / mesh->nvol[ee[k] - 1] : w;
+                    }
+
+                sum += energyelem * ((mesh->evol) ? mesh->evol[i] : mesh_elemvolume(mesh, i)) * MESH_ELEMMED(mesh, i)->mua; /**mesh->med[mesh->type[i]].n;*/
+            } else {
+                for (j = 0; j < cfg->maxgate; j++) {
+                    sum += mesh->weight[((size_t)j * datalen + i) * stride + pair];
+                }
+            }
+        }
+
+        blocksum[b] = sum;
+    }
+
+    for (b = 0; b < blocknum; b++) {
+        energydeposit += blocksum[b];
+    }
+
+    /*the unselected elements of --outmask only add their sum*/
+    if (mesh->outmap && !cfg->basisorder) {
+        energydeposit += mesh->weight[mesh->outsink * stride + pair];
+    }
+
+    if (mesh->part && mesh->part->sumparts) {
+        energydeposit = mesh->part->sumparts(energydeposit);
+    }
+
+    free(blocksum);
+    return energydeposit;
+}
+
+/**
+ * @brief Normalize the outputs of the 2nd to the last wavelengths in the multi-wavelength mode
+ *
+ * These blocks store the path-length integral of the photon weight (or the
+ * absorbed energy for -O E) in each element or node, they are divided by the
+ * element/nodal volumes (unless the output is energy) and scaled by normalizor.
+ *
+ * @param[in] mesh: the mesh object
+ * @param[in] cfg: the simulation configuration
+ * @param[in] normalizor: the scaling factor
+ * @param[in] pair: index of the source pattern
+ */
+
+static void mesh_normalizewave(tetmesh* mesh, mcconfig* cfg, double normalizor, int pair) {
+    int j, datalen = (cfg->basisorder) ? mesh->nn : mesh->ne;
+
+    #pragma omp parallel for schedule(static)
+
+    for (j = 0; j < datalen; j++) {
+        int i;
+        double vol = 1.0;
+
+        if (cfg->outputtype != otEnergy) {
+            vol = (cfg->basisorder) ? mesh->nvol[j] : ((mesh->evol) ? mesh->evol[j] : mesh_elemvolume(mesh, j));
+        }
+
+        if (vol <= 0.0) {
+            continue;
+        }
+
+        for (i = cfg->maxgate; i < cfg->maxgate * cfg->wavenum; i++) {
+            mesh->weight[((size_t)i * datalen + j)*cfg->srcnum + pair] *= normalizor / vol;
+        }
+    }
+}
+
+/**
+ * @brief Normalize the frequency-domain outputs appended after the time gates
+ *
+ * The real and imaginary frames of each modulation frequency hold the same
+ * deposits as the time gates, weighted by cos(wt) and -sin(wt), so they are
+ * divided by the same element/nodal volumes and scaled by normalizor, which
+ * must not include the 1/tstep factor of -O F: the result is the Fourier
+ * transform of the time-resolved output, and equals the CW output at 0 Hz.
+ *
+ * @param[in] mesh: the mesh object
+ * @param[in] cfg: the simulation configuration
+ * @param[in] normalizor: the scaling factor
+ * @param[in] pair: index of the source pattern
+ */
+
+static void mesh_normalizefreq(tetmesh* mesh, mcconfig* cfg, double normalizor, int pair) {
+    int j, datalen = (cfg->method == rtBLBadouelGrid) ? cfg->crop0.z : ( (cfg->basisorder) ? mesh->nn : mesh->ne);
+
+    #pragma omp parallel for schedule(static)
+
+    for (j = 0; j < datalen; j++) {
+        int i;
+        double vol = 1.0;
+
+        if (cfg->outputtype != otEnergy && cfg->method != rtBLBadouelGrid) {
+            vol = (cfg->basisorder) ? mesh->nvol[j] : ((mesh->evol) ? mesh->evol[j] : mesh_elemvolume(mesh, j)) * MESH_ELEMMED(mesh, j)->mua;
+        }
+
+        if (vol <= 0.0) {
+            continue;
+        }
 
-                vec_cross(&vecAB, &vecAC, &vN); /*N is defined as ACxAB in Jiri's code, but not the paper*/
+        for (i = cfg->maxgate; i < cfg->maxgate + 2 * cfg->freqnum; i++) {
+            mesh->weight[((size_t)i * datalen + j)*cfg->srcnum + pair] *= normalizor / vol;
+        }
+    }
+}
 
-                Rn2 = 1.f / sqrt(vec_dot(&vN, &vN));
-                vec_mult(&vN, Rn2, &vN);
-                vecN[j] = vN.x;
-                vecN[j + 4] = vN.y;
-                vecN[j + 8] = vN.z;
-#if defined(MMC_USE_SSE) || defined(USE_OPENCL)
-                vecN[j + 12]    = vec_dot3((FLOAT3*)&vN, &nodes[ea]);
-#endif
+/**
+ * @brief Function to normalize the fluence and remove influence from photon number and volume
+ *
+ * This function outputs the Green's function from the raw simulation data. This needs
+ * to divide the total simulated photon energy, normalize the volumes of each node/elem,
+ * and consider the length unit and time-gates
+ *
+ * @param[in] mesh: the mesh object
+ * @param[in] cfg: the simulation configuration
+ * @param[in] Eabsorb: total absorbed energy from ray-tracing accummulation
+ * @param[in] Etotal: total launched energy, equal to photon number if not pattern-source
+ */
+
+/*see Eq (1) in Fang&Boas, Opt. Express, vol 17, No.22, pp. 20178-20190, Oct 2009*/
+float mesh_normalize(tetmesh* mesh, mcconfig* cfg, float Eabsorb, float Etotal, int pair) {
+    int i, j, k;
+    double normalizor;
+    int datalen = (cfg->method == rtBLBadouelGrid) ? cfg->crop0.z : ( (cfg->basisorder) ? mesh->nn : MESH_ELEMOUT(mesh));
+
+    if (cfg->issaveref && mesh->dref) {
+        float normalizor = 1.f / Etotal;
+
+        #pragma omp parallel for collapse(2) schedule(static)
+
+        for (i = 0; i < cfg->maxgate; i++)
+            for (j = 0; j < mesh->nf; j++) {
+                mesh->dref[i * mesh->nf + j] *= normalizor;
+            }
+    }
+
+    if (mesh->weightpage) {
+        return mesh_normalizesparse(mesh, cfg, Eabsorb, Etotal, pair);
+    }
+
+    if (cfg->seed == SEED_FROM_FILE && (cfg->outputtype == otJacobian || cfg->outputtype == otWL || cfg->outputtype == otWP)) {
+        float normalizor = 1.f / (DELTA_MUA * cfg->nphoton);
+
+        if (cfg->outputtype == otWL || cfg->outputtype == otWP) {
+            normalizor = 1.f / Etotal;    /*Etotal is total detected photon weight in the replay mode*/
+        }
+
+        /*when replaying all detectors at once, each Jacobian is normalized by the weight detected by its own detector*/
+        if (cfg->replaydetnum > 1 && cfg->replaydetid) {
+            double* detweight = (double*)calloc(cfg->replaydetnum, sizeof(double));
+
+            for (i = 0; i < (int)cfg->nphoton; i++) {
+                detweight[cfg->replaydetid[i] - 1] += cfg->replayweight[i];
+            }
+
+            for (k = 0; k < cfg->replaydetnum; k++) {
+                mesh_scaleweight(mesh, cfg, datalen, k * cfg->maxgate, (k + 1) * cfg->maxgate, 0, (detweight[k] > 0.0) ? 1.0 / detweight[k] : 0.0, pair);
             }
+
+            free(detweight);
+            return normalizor;
+        }
+
+        mesh_scaleweight(mesh, cfg, datalen, 0, cfg->maxgate, 0, normalizor, pair);
+        return normalizor;
+    }
+
+    if (cfg->outputtype == otEnergy) {
+        normalizor = 1.f / Etotal;
+
+        mesh_scaleweight(mesh, cfg, datalen, 0, cfg->maxgate, 0, normalizor, pair);
+
+        if (cfg->wavenum > 1) {
+            mesh_normalizewave(mesh, cfg, normalizor, pair);
+        }
+
+        if (cfg->freqnum > 0) {
+            mesh_normalizefreq(mesh, cfg, normalizor, pair);
         }
+
+        return normalizor;
+    }
+
+    /*the volume division and the final scaling are fused into one pass over the output after the energy sum*/
+    if (cfg->method == rtBLBadouelGrid) {
+        normalizor = 1.0 / (Etotal * cfg->unitinmm * cfg->unitinmm * cfg->unitinmm); /*scaling factor*/
+    } else if (cfg->basisorder) {
+        normalizor = Eabsorb / (Etotal * mesh_energydeposit(mesh, cfg, datalen, pair) * 0.25f); /*scaling factor, 1/4 of the nodal sums*/
+    } else {
+        normalizor = Eabsorb / (Etotal * mesh_energydeposit(mesh, cfg, datalen, pair)); /*scaling factor*/
+    }
+
+    if (cfg->freqnum > 0) {
+        mesh_normalizefreq(mesh, cfg, normalizor, pair);
+    }
+
+    if (cfg->outputtype == otFlux) {
+        normalizor /= cfg->tstep;
+    }
+
+    mesh_scaleweight(mesh, cfg, datalen, 0, cfg->maxgate, (cfg->method == rtBLBadouelGrid) ? 0 : ((cfg->basisorder) ? 2 : 1), normalizor, pair);
+
+    /*the nodal outputs reuse the energy-conserving scaling of the 1st wavelength, which corrects the projection to the nodes*/
+    if (cfg->wavenum > 1) {
+        mesh_normalizewave(mesh, cfg, (cfg->basisorder) ? normalizor : ((cfg->outputtype == otFlux) ? 1.0 / (Etotal * cfg->tstep) : 1.0 / Etotal), pair);
     }
+
+    return normalizor;
 }
 
+
 /**
- * @brief Clear the ray-tracing data structure
+ * @brief Compute the effective reflection coefficient Reff using approximated formula
  *
- * Deconstructor of the ray-tracing data structure
+ * accuracy is limited
+ * see https://www.ncbi.nlm.nih.gov/pmc/articles/PMC4482362/
  *
  * @param[out] tracer: the ray-tracer data structure
+ * @param[in] pmesh: the mesh object
+ * @param[in] methodid: the ray-tracing algorithm to be used
  */
 
-void tracer_clear(raytracer* tracer) {
-    if (tracer->d) {
-        free(tracer->d);
-        tracer->d = NULL;
+double mesh_getreff_approx(double n_in, double n_out) {
+    double nn = n_in / n_out;
+    return -1.440 / (nn * nn) + 0.710 / nn + 0.668 + 0.0636 * nn;
+}
+
+/**
+ * @brief Compute the effective reflection coefficient Reff
+ *
+ * @param[in] n_in: refractive index of the diffusive medium
+ * @param[in] n_out: refractive index of the non-diffusive medium
+ */
+
+double mesh_getreff(double n_in, double n_out) {
+    double oc = asin(1.0 / n_in); // critical angle
+    const double count = 1000.0;
+    const double ostep = (M_PI / (2.0 * count));
+    double r_phi = 0.0, r_j = 0.0;
+    double o, cosop, coso, r_fres, tmp;
+    int i;
+
+    for (i = 0; i < count; i++) {
+        o = i * ostep;
+        coso = cos(o);
+
+        if (o < oc) {
+            cosop = n_in * sin(o);
+            cosop = sqrt(1. - cosop * cosop);
+            tmp = (n_in * cosop - n_out * coso) / (n_in * cosop + n_out * coso);
+            r_fres = 0.5 * tmp * tmp;
+            tmp = (n_in * coso - n_out * cosop) / (n_in * coso + n_out * cosop);
+            r_fres += 0.5 * tmp * tmp;
+        } else {
+            r_fres = 1.f;
+        }
+
+        r_phi += 2.0 * sin(o) * coso * r_fres;
+        r_j += 3.0 * sin(o) * coso * coso * r_fres;
+    }
+
+    r_phi *= ostep;
+    r_j *= ostep;
+    return (r_phi + r_j) / (2.0 - r_phi + r_j);
+}
+
+
+/**
+ * @brief Validate all input fields, and warn incompatible inputs
+ *
+ * Perform self-checking and raise exceptions or warnings when input error is detected
+ *
+ * @param[in,out] cfg: the simulation configuration structure
+ * @param[out] mesh: the mesh data structure
+ */
+
+void mesh_validate(tetmesh* mesh, mcconfig* cfg) {
+    int i;
+
+    if (mesh->prop == 0) {
+        MMC_ERROR(999, "you must define the 'prop' field in the input structure");
+    }
+
+    if (mesh->nn == 0 || mesh->ne == 0 || mesh->evol == NULL || mesh->facenb == NULL) {
+        MMC_ERROR(999, "a complete input mesh include 'node','elem','facenb' and 'evol'");
+    }
+
+    if (mesh->node == NULL || mesh->elem == NULL || mesh->prop == 0) {
+        MMC_ERROR(999, "You must define 'mesh' and 'prop' fields.");
+    }
+
+    if (mesh->nvol) {
+        free(mesh->nvol);
+    }
+
+    mesh->nvol = (float*)calloc(sizeof(float), mesh->nn);
+    mesh_scatternodevolume(mesh, mesh->evol, 4, 1);
+
+    if (mesh->weight) {
+        free(mesh->weight);
+    }
+
+    if (cfg->method == rtBLBadouelGrid) {
+        mesh_createdualmesh(mesh, cfg);
+        cfg->basisorder = 0;
+    }
+
+    mesh->weight = NULL;
+    mesh_initweight(mesh, cfg);
+
+    if (cfg->method != rtBLBadouelGrid && cfg->unitinmm != 1.f) {
+        for (i = 1; i <= mesh->prop; i++) {
+            mesh->med[i].mus *= cfg->unitinmm;
+            mesh->med[i].mua *= cfg->unitinmm;
+        }
     }
 
-    if (tracer->m) {
-        free(tracer->m);
-        tracer->m = NULL;
+    /*make medianum+1 the same as medium 0*/
+    if (cfg->isextdet) {
+        mesh->med = (medium*)realloc(mesh->med, sizeof(medium) * (mesh->prop + 2));
+        memcpy(mesh->med + mesh->prop + 1, mesh->med, sizeof(medium));
+
+        for (i = 0; i < mesh->ne; i++) {
+            if (mesh->type[i] == -2) {
+                mesh->type[i] = mesh->prop + 1;
+            }
+        }
+    }
+
+    mesh_loadwavemedia(mesh, cfg);
+}
+
+/**
+ * @brief Replace the optical properties of a mesh that has been validated
+ *
+ * Used between the jobs of a batch run that share one mesh: the new medium
+ * table is copied over mesh->med and converted exactly like mesh_validate
+ * does, i.e. mus/mua are scaled by cfg->unitinmm and the external-detector
+ * medium (mesh->prop+1) mirrors medium 0. The surface nodal volumes computed
+ * by tracer_prep depend on the refractive indices, therefore a batch can not
+ * change them when the surface normalization is active.
+ *
+ * @param[in,out] mesh: the mesh object
+ * @param[in] cfg: the simulation configuration structure
+ * @param[in] med: the new optical properties, mesh->prop+1 entries in the input unit
+ */
+
+void mesh_updatemedia(tetmesh* mesh, mcconfig* cfg, const medium* med) {
+    int i;
+
+    if (cfg->isnormalized == 1 && cfg->isreflect && cfg->method != rtBLBadouelGrid && cfg->basisorder) {
+        for (i = 0; i <= mesh->prop; i++) {
+            if (med[i].n != mesh->med[i].n) {
+                MESH_ERROR("a batch job can not change the refractive index when cfg.isnormalized=1 and cfg.isreflect=1");
+            }
+        }
+    }
+
+    memcpy(mesh->med, med, sizeof(medium) * (mesh->prop + 1));
+
+    if (cfg->method != rtBLBadouelGrid && cfg->unitinmm != 1.f) {
+        for (i = 1; i <= mesh->prop; i++) {
+            mesh->med[i].mus *= cfg->unitinmm;
+            mesh->med[i].mua *= cfg->unitinmm;
+        }
+    }
+
+    if (cfg->isextdet) {
+        memcpy(mesh->med + mesh->prop + 1, mesh->med, sizeof(medium));
+    }
+}
+
+#define MMC_CURVE_BITS  21  /**< bits per axis of the space-filling curve index, 3x21 fits in 64 bits */
+
+/**
+ * @brief Interleave the lower 21 bits of three integers to form a 63-bit Morton code
+ *
+ * @param[in] p: the quantized x/y/z coordinates
+ */
+
+static unsigned long long mesh_mortonkey(unsigned int p[3]) {
+    unsigned long long key = 0ULL;
+    int i, j;
+
+    for (i = MMC_CURVE_BITS - 1; i >= 0; i--)
+        for (j = 0; j < 3; j++) {
+            key = (key << 1) | ((p[j] >> i) & 1U);
+        }
+
+    return key;
+}
+
+/**
+ * @brief Compute the 63-bit index of a point along a 3D Hilbert curve
+ *
+ * This uses Skilling's in-place conversion of the axes to the transposed
+ * Hilbert index (AIP Conf. Proc. 707, 381, 2004), followed by bit interleaving
+ *
+ * @param[in] p: the quantized x/y/z coordinates, overwritten on return
+ */
+
+static unsigned long long mesh_hilbertkey(unsigned int p[3]) {
+    unsigned int q, t, mask = 1U << (MMC_CURVE_BITS - 1);
+    int i;
+
+    /*inverse undo*/
+    for (q = mask; q > 1; q >>= 1) {
+        for (i = 0; i < 3; i++) {
+            if (p[i] & q) {
+                p[0] ^= q - 1;
+            } else {
+                t = (p[0] ^ p[i]) & (q - 1);
+                p[0] ^= t;
+                p[i] ^= t;
+            }
+        }
+    }
+
+    /*Gray encode*/
+    for (i = 1; i < 3; i++) {
+        p[i] ^= p[i - 1];
+    }
+
+    t = 0;
+
+    for (q = mask; q > 1; q >>= 1) {
+        if (p[2] & q) {
+            t ^= q - 1;
+        }
     }
 
-    if (tracer->n) {
-        free(tracer->n);
-        tracer->n = NULL;
+    for (i = 0; i < 3; i++) {
+        p[i] ^= t;
     }
 
-    tracer->mesh = NULL;
+    return mesh_mortonkey(p);
 }
 
 /**
- * @brief Performing one scattering event of the photon
+ * @brief Renumber elements and nodes along a space-filling curve to improve memory locality
  *
- * This function updates the direction of the photon by performing a scattering calculation
+ * Elements are sorted by the Morton (cfg->reorder=1) or Hilbert (cfg->reorder=2)
+ * index of their centroids; nodes are then renumbered in the order they are
+ * first referenced by the sorted elements. All element- and node-based mesh
+ * data, as well as cfg->e0, are permuted accordingly. The original indices are
+ * kept in mesh->elemorder and mesh->nodeorder so that the outputs can be mapped
+ * back with mesh_restoreorder(). This function must be called after
+ * tracer_prep(), so that the source element, the surface triangle IDs and the
+ * iMMC ROI references are resolved in the original order, and the ray-tracer
+ * must be rebuilt afterwards.
  *
- * @param[in] g: anisotropy g
- * @param[out] dir: current ray direction vector
- * @param[out] ran: random number generator states
- * @param[out] ran0: additional random number generator states
- * @param[out] cfg: the simulation configuration
- * @param[out] pmom: buffer to store momentum transfer data if needed
+ * @param[in,out] mesh: the mesh object
+ * @param[in,out] cfg: the simulation configuration structure
  */
 
-float mc_next_scatter(float g, float3* dir, RandType* ran, RandType* ran0, mcconfig* cfg, float* pmom) {
+void mesh_reorder(tetmesh* mesh, mcconfig* cfg) {
+    int i, j, ne = mesh->ne, nn = mesh->nn, elemlen = mesh->elemlen;
+    int* newelem, *newnode;
+    sortkey* keys;
+    float3 pmin = {VERY_BIG, VERY_BIG, VERY_BIG}, pmax = {-VERY_BIG, -VERY_BIG, -VERY_BIG}, scale;
 
-    float nextslen;
-    float sphi = 0.f, cphi = 0.f, tmp0, theta, stheta, ctheta, tmp1;
-    float3 p;
+    if (cfg->reorder == 0 || ne <= 1 || mesh->elemorder) {
+        return;
+    }
 
-    rand_need_more(ran, ran0);
+    if (cfg->basisorder == 2 || mesh->elem2) {
+        MMCDEBUG(cfg, dlTime, (cfg->flog, "mesh reordering does not support 10-node elements, skipped\n"));
+        return;
+    }
 
-    //random scattering length (normalized)
-#ifdef MMC_USE_SSE_MATH
-    nextslen = rand_next_scatlen_ps(ran);
-#else
-    nextslen = rand_next_scatlen(ran);
-#endif
+    for (i = 0; i < nn; i++) {
+        pmin.x = MIN(mesh->node[i].x, pmin.x);
+        pmin.y = MIN(mesh->node[i].y, pmin.y);
+        pmin.z = MIN(mesh->node[i].z, pmin.z);
+        pmax.x = MAX(mesh->node[i].x, pmax.x);
+        pmax.y = MAX(mesh->node[i].y, pmax.y);
+        pmax.z = MAX(mesh->node[i].z, pmax.z);
+    }
 
-    //random arimuthal angle
-#ifdef MMC_USE_SSE_MATH
-    rand_next_aangle_sincos(ran, &sphi, &cphi);
-#else
-    tmp0 = TWO_PI * rand_next_aangle(ran); //next arimuth angle
-    mmc_sincosf(tmp0, &sphi, &cphi);
-#endif
+    /*map the element centroids (sum of 4 nodes) to the integer grid of the curve*/
+    scale.x = (pmax.x > pmin.x) ? ((1U << MMC_CURVE_BITS) - 1) / (4.f * (pmax.x - pmin.x)) : 0.f;
+    scale.y = (pmax.y > pmin.y) ? ((1U << MMC_CURVE_BITS) - 1) / (4.f * (pmax.y - pmin.y)) : 0.f;
+    scale.z = (pmax.z > pmin.z) ? ((1U << MMC_CURVE_BITS) - 1) / (4.f * (pmax.z - pmin.z)) : 0.f;
 
-    //Henyey-Greenstein Phase Function, "Handbook of Optical Biomedical Diagnostics",2002,Chap3,p234
-    //see Boas2002
+    keys = (sortkey*)malloc(sizeof(sortkey) * ne);
 
-    if (g > EPS) { //if g is too small, the distribution of theta is bad
-        tmp0 = (1.f - g * g) / (1.f - g + 2.f * g * rand_next_zangle(ran));
-        tmp0 *= tmp0;
-        tmp0 = (1.f + g * g - tmp0) / (2.f * g);
+    for (i = 0; i < ne; i++) {
+        int* ee = mesh->elem + i * elemlen;
+        float3 c = {0.f, 0.f, 0.f};
+        unsigned int p[3];
 
-        // when ran=1, CUDA will give me 1.000002 for tmp0 which produces nan later
-        if (tmp0 > 1.f) {
-            tmp0 = 1.f;
+        for (j = 0; j < 4; j++) {
+            c.x += mesh->node[ee[j] - 1].x - pmin.x;
+            c.y += mesh->node[ee[j] - 1].y - pmin.y;
+            c.z += mesh->node[ee[j] - 1].z - pmin.z;
         }
 
-        if (tmp0 < -1.f) {
-            tmp0 = -1.f;
-        }
+        p[0] = MIN((unsigned int)(c.x * scale.x), (1U << MMC_CURVE_BITS) - 1);
+        p[1] = MIN((unsigned int)(c.y * scale.y), (1U << MMC_CURVE_BITS) - 1);
+        p[2] = MIN((unsigned int)(c.z * scale.z), (1U << MMC_CURVE_BITS) - 1);
 
-        theta = acosf(tmp0);
-        stheta = sqrt(1.f - tmp0 * tmp0);
-        //stheta=sinf(theta);
-        ctheta = tmp0;
-    } else {
-        theta = acosf(2.f * rand_next_zangle(ran) - 1.f);
-        mmc_sincosf(theta, &stheta, &ctheta);
+        keys[i].key = (cfg->reorder == 2) ? mesh_hilbertkey(p) : mesh_mortonkey(p);
+        keys[i].id = i;
     }
 
-    if ( dir->z > -1.f + EPS && dir->z < 1.f - EPS ) {
-        tmp0 = 1.f - dir->z * dir->z; //reuse tmp to minimize registers
-        tmp1 = 1.f / sqrtf(tmp0);
-        tmp1 = stheta * tmp1;
+    qsort(keys, ne, sizeof(sortkey), mesh_comparekey);
 
-        p.x = tmp1 * (dir->x * dir->z * cphi - dir->y * sphi) + dir->x * ctheta;
-        p.y = tmp1 * (dir->y * dir->z * cphi + dir->x * sphi) + dir->y * ctheta;
-        p.z = -tmp1 * tmp0 * cphi             + dir->z * ctheta;
-    } else {
-        p.x = stheta * cphi;
-        p.y = stheta * sphi;
-        p.z = (dir->z > 0.f) ? ctheta : -ctheta;
+    /*elemorder[new]=old, newelem[old]=new*/
+    mesh->elemorder = (int*)malloc(sizeof(int) * ne);
+    newelem = (int*)malloc(sizeof(int) * ne);
+
+    for (i = 0; i < ne; i++) {
+        mesh->elemorder[i] = keys[i].id;
+        newelem[keys[i].id] = i;
     }
 
-    if (cfg->ismomentum) {
-        pmom[0] += (1.f - ctheta);
+    free(keys);
+
+    /*nodes are numbered by the first sorted element that uses them, unused nodes are appended*/
+    mesh->nodeorder = (int*)malloc(sizeof(int) * nn);
+    newnode = (int*)malloc(sizeof(int) * nn);
+
+    for (i = 0; i < nn; i++) {
+        newnode[i] = -1;
     }
 
-    dir->x = p.x;
-    dir->y = p.y;
-    dir->z = p.z;
-    return nextslen;
-}
+    j = 0;
 
-#ifndef MCX_CONTAINER
+    for (i = 0; i < ne * elemlen; i++) {
+        int nid = mesh->elem[mesh->elemorder[i / elemlen] * elemlen + (i % elemlen)] - 1;
 
-void mcx_savecamsignals(float* camsignals, size_t len, mcconfig* cfg)
-{
-    char* file_suffix = ".bin";
-    size_t filepathlen = strlen(cfg->session) + strlen(file_suffix) + 1;
-    char* filepath = malloc(filepathlen);
+        if (newnode[nid] < 0) {
+            newnode[nid] = j;
+            mesh->nodeorder[j++] = nid;
+        }
+    }
 
-    strcpy(filepath, cfg->session);
-    strcat(filepath, file_suffix);
+    for (i = 0; i < nn; i++) {
+        if (newnode[i] < 0) {
+            newnode[i] = j;
+            mesh->nodeorder[j++] = i;
+        }
+    }
 
-    FILE *f = fopen(filepath, "wb");
-    fwrite(camsignals, sizeof(float), len, f);
-    fclose(f);
-}
+    /*permute the element-based data*/
+    {
+        int* ibuf = (int*)malloc(sizeof(int) * ne * elemlen);
+        float* fbuf = (float*)malloc(sizeof(float) * ne * 6);
 
-/**
- * @brief Save the fluence output to a file
- *
- * @param[in] mesh: the mesh object
- * @param[in] cfg: the simulation configuration
- */
+        for (i = 0; i < ne; i++)
+            for (j = 0; j < elemlen; j++) {
+                ibuf[i * elemlen + j] = newnode[mesh->elem[mesh->elemorder[i] * elemlen + j] - 1] + 1;
+            }
 
-void mesh_saveweight(tetmesh* mesh, mcconfig* cfg, int isref) {
-    FILE* fp;
-    int i, j, datalen = (cfg->method == rtBLBadouelGrid) ? cfg->crop0.z : ( (cfg->basisorder) ? mesh->nn : mesh->ne);
-    char fweight[MAX_FULL_PATH];
-    double* data = mesh->weight;
+        memcpy(mesh->elem, ibuf, sizeof(int) * ne * elemlen);
 
-    if (isref) {
-        data = mesh->dref;
-        datalen = mesh->nf;
-    }
+        for (i = 0; i < ne; i++)
+            for (j = 0; j < elemlen; j++) {
+                int nb = mesh->facenb[mesh->elemorder[i] * elemlen + j];
+                ibuf[i * elemlen + j] = (nb > 0) ? newelem[nb - 1] + 1 : nb;
+            }
 
-    if (cfg->rootpath[0]) {
-        sprintf(fweight, "%s%c%s%s.dat", cfg->rootpath, pathsep, cfg->session, (isref ? "_dref" : ""));
-    } else {
-        sprintf(fweight, "%s%s.dat", cfg->session, (isref ? "_dref" : ""));
-    }
+        memcpy(mesh->facenb, ibuf, sizeof(int) * ne * elemlen);
 
-    if (cfg->outputformat >= ofBin && cfg->outputformat <= ofBJNifti) {
-        uint3 dim0 = cfg->dim;
+        for (i = 0; i < ne; i++) {
+            ibuf[i] = mesh->type[mesh->elemorder[i]];
+        }
 
-        if (cfg->method != rtBLBadouelGrid) {
-            cfg->dim.x = cfg->srcnum;
-            cfg->dim.y = cfg->maxgate;
-            cfg->dim.z = datalen;
+        memcpy(mesh->type, ibuf, sizeof(int) * ne);
+
+        if (mesh->outmap) {
+            for (i = 0; i < ne; i++) {
+                ibuf[i] = mesh->outmap[mesh->elemorder[i]];
+            }
+
+            memcpy(mesh->outmap, ibuf, sizeof(int) * ne);
         }
 
-        mcx_savedata(mesh->weight, datalen * cfg->maxgate * cfg->srcnum, cfg, isref);
-        cfg->dim = dim0;
-        return;
-    }
+        if (mesh->elemmed) {
+            medium* mbuf = (medium*)fbuf;
 
-    if ((fp = fopen(fweight, "wt")) == NULL) {
-        MESH_ERROR("can not open weight file to write");
-    }
+            for (i = 0; i < ne; i++) {
+                mbuf[i] = mesh->elemmed[mesh->elemorder[i]];
+            }
+
+            memcpy(mesh->elemmed, mbuf, sizeof(medium) * ne);
+        }
+
+        if (mesh->evol) {
+            for (i = 0; i < ne; i++) {
+                fbuf[i] = mesh->evol[mesh->elemorder[i]];
+            }
 
-    for (i = 0; i < cfg->maxgate; i++) {
-        for (j = 0; j < datalen; j++) {
-            if (1 == cfg->srcnum) {
-                if (fprintf(fp, "%d\t%e\n", j + 1, data[i * datalen + j]) == 0) {
-                    MESH_ERROR("can not write to weight file");
+            memcpy(mesh->evol, fbuf, sizeof(float) * ne);
+        }
+
+        /*tracer_prep() stores referenced ROI elements as -eid-6 (edge) or -eid-4 (face)*/
+        if (mesh->edgeroi) {
+            for (i = 0; i < ne; i++) {
+                memcpy(fbuf + i * 6, mesh->edgeroi + mesh->elemorder[i] * 6, sizeof(float) * 6);
+
+                if (fbuf[i * 6] < -6.f) {
+                    fbuf[i * 6] = -(newelem[(int)(-fbuf[i * 6]) - 7] + 1) - 6;
                 }
-            } else { // multiple sources for pattern illumination type
-                int k, shift;
+            }
 
-                for (k = 0; k < cfg->srcnum; k++) {
-                    shift = (i * datalen + j) * cfg->srcnum + k;
+            memcpy(mesh->edgeroi, fbuf, sizeof(float) * ne * 6);
+        }
 
-                    if (fprintf(fp, "%d\t%d\t%e\n", j + 1, k + 1, data[shift]) == 0) {
-                        MESH_ERROR("can not write to weight file");
-                    }
+        if (mesh->faceroi) {
+            for (i = 0; i < ne; i++) {
+                memcpy(fbuf + i * 4, mesh->faceroi + mesh->elemorder[i] * 4, sizeof(float) * 4);
+
+                if (fbuf[i * 4] < -4.f) {
+                    fbuf[i * 4] = -(newelem[(int)(-fbuf[i * 4]) - 5] + 1) - 4;
                 }
             }
+
+            memcpy(mesh->faceroi, fbuf, sizeof(float) * ne * 4);
         }
+
+        free(ibuf);
+        free(fbuf);
     }
 
-    fclose(fp);
+    for (i = 0; i < mesh->srcelemlen; i++) {
+        mesh->srcelem[i] = newelem[mesh->srcelem[i] - 1] + 1;
+    }
+
+    for (i = 0; i < mesh->detelemlen; i++) {
+        mesh->detelem[i] = newelem[mesh->detelem[i] - 1] + 1;
+    }
+
+    if (cfg->e0 > 0 && cfg->e0 <= ne) {
+        cfg->e0 = newelem[cfg->e0 - 1] + 1;
+    }
+
+    /*permute the node-based data in place, mesh->node may be owned by cfg->node*/
+    {
+        FLOAT3* nbuf = (FLOAT3*)malloc(sizeof(FLOAT3) * nn);
+        float* fbuf = (float*)malloc(sizeof(float) * nn);
+
+        for (i = 0; i < nn; i++) {
+            nbuf[i] = mesh->node[mesh->nodeorder[i]];
+        }
+
+        memcpy(mesh->node, nbuf, sizeof(FLOAT3) * nn);
+
+        if (mesh->nvol) {
+            for (i = 0; i < nn; i++) {
+                fbuf[i] = mesh->nvol[mesh->nodeorder[i]];
+            }
+
+            memcpy(mesh->nvol, fbuf, sizeof(float) * nn);
+        }
+
+        if (mesh->noderoi) {
+            for (i = 0; i < nn; i++) {
+                fbuf[i] = mesh->noderoi[mesh->nodeorder[i]];
+            }
+
+            memcpy(mesh->noderoi, fbuf, sizeof(float) * nn);
+        }
+
+        free(nbuf);
+        free(fbuf);
+    }
+
+    free(newelem);
+    free(newnode);
+
+    MMCDEBUG(cfg, dlTime, (cfg->flog, "reordered %d elements and %d nodes along a %s curve\n", ne, nn, (cfg->reorder == 2) ? "Hilbert" : "Morton"));
 }
 
 /**
- * @brief Save detected photon data into an .mch history file
+ * @brief Compute the index of each exterior face of a reordered mesh in the input order
  *
- * @param[in] ppath: buffer points to the detected photon data (partial-path, det id, etc)
- * @param[in] seeds: buffer points to the detected photon seeds
- * @param[in] count: how many photons are detected
- * @param[in] seedbyte: how many bytes per detected photon seed
- * @param[in] cfg: the simulation configuration
+ * The exterior faces are numbered by tracer_prep() in the order of the input
+ * elements; after mesh_reorder(), this maps the ID of each face (-facenb-1)
+ * to the index the face had before the reordering.
+ *
+ * @param[in] mesh: the reordered mesh object
+ * @return an array of mesh->nf indices, to be freed by the caller
  */
 
-void mesh_savedetphoton(float* ppath, void* seeds, int count, int seedbyte, mcconfig* cfg) {
-    FILE* fp;
-    char fhistory[MAX_FULL_PATH], filetag;
-
-    filetag = ((cfg->his.detected == 0  && cfg->his.savedphoton) ? 't' : 'h');
+static int* mesh_facemap(tetmesh* mesh) {
+    int* neworder = (int*)malloc(sizeof(int) * mesh->ne), *facemap = (int*)malloc(sizeof(int) * mesh->nf), nf = 0;
+    int i, j;
 
-    if (cfg->rootpath[0]) {
-        sprintf(fhistory, "%s%c%s.mc%c", cfg->rootpath, pathsep, cfg->session, filetag);
-    } else {
-        sprintf(fhistory, "%s.mc%c", cfg->session, filetag);
+    for (i = 0; i < mesh->ne; i++) {
+        neworder[mesh->elemorder[i]] = i;
     }
 
-    if ((fp = fopen(fhistory, "wb")) == NULL) {
-        MESH_ERROR("can not open history file to write");
+    for (i = 0; i < mesh->ne; i++) {
+        int* enb = mesh->facenb + neworder[i] * mesh->elemlen;
+
+        for (j = 0; j < mesh->elemlen; j++) {
+            if (enb[j] < 0) {
+                facemap[-enb[j] - 1] = nf++;
+            }
+        }
     }
 
-    cfg->his.unitinmm = 1.f;
+    free(neworder);
+    return facemap;
+}
 
-    if (cfg->method != rtBLBadouelGrid) {
-        cfg->his.unitinmm = cfg->unitinmm;
-    }
+/**
+ * @brief Map the outputs of a reordered mesh back to the original element and node numbering
+ *
+ * This permutes mesh->weight (element- or node-based), mesh->dref (surface
+ * triangles, numbered in the original element order) and the element-based
+ * detector IDs of the detected photons, and must be called after the output
+ * is normalized. It does nothing if the mesh was not reordered.
+ *
+ * @param[in,out] mesh: the mesh object
+ * @param[in] cfg: the simulation configuration structure
+ * @param[in,out] ppath: buffer points to the detected photon data, can be NULL
+ * @param[in] count: how many photons are detected
+ * @param[in] colcount: the number of floats per detected photon record
+ */
 
-    cfg->his.srcnum = cfg->srcnum;
-    cfg->his.detnum = cfg->detnum;
+void mesh_restoreorder(tetmesh* mesh, mcconfig* cfg, float* ppath, int count, int colcount) {
+    int i, nblock, datalen;
+    size_t j, k;
+    double* buf;
 
-    if (cfg->issaveseed && seeds != NULL) {
-        cfg->his.seedbyte = seedbyte;
+    if (mesh->elemorder == NULL) {
+        return;
     }
 
-    /*
-        if (count > 0 && cfg->exportdetected == NULL) {
-            cfg->detectedcount = count;
-            cfg->exportdetected = (float*)malloc(cfg->his.colcount * cfg->detectedcount * sizeof(float));
+    /*the rows of --outmask are already in the input order*/
+    if (mesh->weight && cfg->method != rtBLBadouelGrid && mesh->outmap == NULL) {
+        int* order = (cfg->basisorder) ? mesh->nodeorder : mesh->elemorder;
+
+        datalen = (cfg->basisorder) ? mesh->nn : mesh->ne;
+        buf = (double*)malloc(sizeof(double) * datalen * cfg->srcnum);
+
+        for (i = 0; i < (int)(cfg->maxgate * cfg->replaydetnum * cfg->wavenum + 2 * cfg->freqnum); i++) {
+            double* data = mesh->weight + (size_t)i * datalen * cfg->srcnum;
+
+            for (j = 0; j < (size_t)datalen; j++)
+                for (k = 0; k < (size_t)cfg->srcnum; k++) {
+                    buf[order[j] * cfg->srcnum + k] = data[j * cfg->srcnum + k];
+                }
+
+            memcpy(data, buf, sizeof(double) * datalen * cfg->srcnum);
         }
 
-        if (cfg->exportdetected != ppath) {
-            memcpy(cfg->exportdetected, ppath, count * cfg->his.colcount * sizeof(float));
+        for (i = 0; mesh->weightvar && i < (int)cfg->maxgate; i++) {
+            double* data = mesh->weightvar + (size_t)i * datalen * cfg->srcnum;
+
+            for (j = 0; j < (size_t)datalen; j++)
+                for (k = 0; k < (size_t)cfg->srcnum; k++) {
+                    buf[order[j] * cfg->srcnum + k] = data[j * cfg->srcnum + k];
+                }
+
+            memcpy(data, buf, sizeof(double) * datalen * cfg->srcnum);
         }
-    */
-    //fwrite(&(cfg->his), sizeof(history), 1, fp);
-    fwrite(ppath, sizeof(float), count * cfg->his.colcount, fp);
 
-    //if (cfg->issaveseed && seeds != NULL) {
-    //    fwrite(seeds, seedbyte, count, fp);
-    //}
+        free(buf);
+    }
 
-    fclose(fp);
-}
+    if (mesh->dref && mesh->nf > 0) {
+        int* facemap = (mesh->part) ? mesh->part->facemap : mesh_facemap(mesh);
 
-#endif
+        nblock = cfg->maxgate * cfg->srcnum;
+        buf = (double*)malloc(sizeof(double) * mesh->nf);
+
+        for (i = 0; i < nblock; i++) {
+            double* data = mesh->dref + (size_t)i * mesh->nf;
+
+            for (j = 0; j < (size_t)mesh->nf; j++) {
+                buf[facemap[j]] = data[j];
+            }
+
+            memcpy(data, buf, sizeof(double) * mesh->nf);
+        }
+
+        free(buf);
+
+        if (mesh->part == NULL) {
+            free(facemap);
+        }
+    }
+
+    mesh_restoredetid(mesh, cfg, ppath, count, colcount);
+}
 
 /**
- * @brief Save binned detected photon data over an area-detector as time-resolved 2D images
- *
- * When an area detector is used (such as a CCD), storing all detected photons can generate
- * a huge output file. This can be mitigated by accumulate the data first to a rasterized
- * detector grid, and then save only the integrated data.
+ * @brief Map the element-based detector IDs of detected photons back to the original order
  *
- * @param[out] detmap: buffer points to the output detector data array
- * @param[in] ppath: buffer points to the detected photon data (partial-path, det id, etc)
- * @param[in] count: how many photons are detected
- * @param[in] cfg: the simulation configuration
- * @param[in] mesh: the mesh object
- */
-
-void mesh_getdetimage(float* detmap, float* ppath, int count, mcconfig* cfg, tetmesh* mesh) {
-    // cfg->issaveexit is 2 for this mode
-    int colcount = (2 + (cfg->ismomentum > 0)) * cfg->his.maxmedia + 6 + 2;
-    float x0 = cfg->detpos[0].x;
-    float y0 = cfg->detpos[0].y;
-    float xrange = cfg->detparam1.x + cfg->detparam2.x;
-    float yrange = cfg->detparam1.y + cfg->detparam2.y;
-    int xsize = cfg->detparam1.w;
-    int ysize = cfg->detparam2.w;
-    int i, j, xindex, yindex, ntg, offset;
-    float unitinmm = (cfg->method != rtBLBadouelGrid) ? cfg->his.unitinmm : 1.f;
+ * Wide-field detectors store the exiting element ID as the detector ID; this
+ * converts them from the reordered to the input element numbering. It does
+ * nothing if the mesh was not reordered.
+ *
+ * @param[in] mesh: the mesh object
+ * @param[in] cfg: the simulation configuration structure
+ * @param[in,out] ppath: buffer points to the detected photon data, can be NULL
+ * @param[in] count: how many photons are detected
+ * @param[in] colcount: the number of floats per detected photon record
+ */
+
+void mesh_restoredetid(tetmesh* mesh, mcconfig* cfg, float* ppath, int count, int colcount) {
+    int i;
 
-    float xloc, yloc, weight, path;
+    if (mesh->elemorder == NULL || ppath == NULL || !cfg->isextdet || cfg->detnum != 0) {
+        return;
+    }
 
     for (i = 0; i < count; i++) {
-        path = 0;
-        weight = ppath[(i + 1) * colcount - 1];
+        int eid = (int)ppath[(size_t)i * colcount];
 
-        for (j = 1; j <= cfg->his.maxmedia; j++) {
-            path += ppath[i * colcount + j + cfg->his.maxmedia] * mesh->med[j].n;
-            weight *= expf(-ppath[i * colcount + j + cfg->his.maxmedia] * mesh->med[j].mua * unitinmm);
+        if (eid > 0 && eid <= mesh->ne) {
+            ppath[(size_t)i * colcount] = mesh->elemorder[eid - 1] + 1;
         }
+    }
+}
 
-        ntg = (int) path * R_C0 / cfg->tstep;
+/**
+ * @brief Compare two integers, used to sort the ghost elements
+ */
 
-        if (ntg > cfg->maxgate - 1) {
-            ntg = cfg->maxgate - 1;
-        }
+static int mesh_compareint(const void* a, const void* b) {
+    int x = *(const int*)a, y = *(const int*)b;
+    return (x > y) - (x < y);
+}
 
-        xloc = ppath[(i + 1) * colcount - 7];
-        yloc = ppath[(i + 1) * colcount - 6];
-        xindex = (xloc - x0) / xrange * xsize;
+/**
+ * @brief Find the rank holding an element of a partitioned mesh
+ *
+ * @param[in] part: the partition of this rank
+ * @param[in] eid: the global element ID, starting from 0
+ * @return the rank whose range of elements includes eid
+ */
 
-        if (xindex < 0 || xindex > xsize - 1) {
-            continue;
-        }
+int mesh_partowner(meshpart* part, int eid) {
+    int lo = 0, hi = part->ranknum;
 
-        yindex = (yloc - y0) / yrange * ysize;
+    while (hi - lo > 1) {
+        int mid = (lo + hi) >> 1;
 
-        if (yindex < 0 || yindex > ysize - 1) {
-            continue;
+        if (eid >= part->elemstart[mid]) {
+            lo = mid;
+        } else {
+            hi = mid;
         }
-
-        offset = ntg * xsize * ysize;
-        detmap[offset + yindex * xsize + xindex] += weight;
     }
-}
 
-#ifndef MCX_CONTAINER
+    return lo;
+}
 
 /**
- * @brief Save binned detected photon data over an area-detector
- *
- * function for saving binned detected photon data into time-resolved 2D images
+ * @brief Convert a global element ID to the local ID of this partition
  *
- * @param[in] detmap: buffer points to the output detector data array
- * @param[in] cfg: the simulation configuration
+ * @param[in] part: the partition of this rank
+ * @param[in] eid: the global element ID, starting from 0
+ * @return the local element ID (from 1), 0 if the element is neither held nor a ghost
  */
 
-void mesh_savedetimage(float* detmap, mcconfig* cfg) {
-
-    FILE* fp;
-    char fhistory[MAX_FULL_PATH];
-
-    if (cfg->rootpath[0]) {
-        sprintf(fhistory, "%s%c%s.img", cfg->rootpath, pathsep, cfg->session);
-    } else {
-        sprintf(fhistory, "%s.img", cfg->session);
-    }
+int mesh_partlocal(meshpart* part, int eid) {
+    int* ghost;
 
-    if ((fp = fopen(fhistory, "wb")) == NULL) {
-        MESH_ERROR("can not open detector image file to write");
+    if (eid >= part->elemstart[part->rank] && eid < part->elemstart[part->rank + 1]) {
+        return eid - part->elemstart[part->rank] + 1;
     }
 
-    fwrite(detmap, sizeof(float), cfg->detparam1.w * cfg->detparam2.w * cfg->maxgate, fp);
-    fclose(fp);
+    ghost = (int*)bsearch(&eid, part->ghost, part->nghost, sizeof(int), mesh_compareint);
+    return (ghost) ? part->nown + (int)(ghost - part->ghost) + 1 : 0;
 }
 
-#endif
-
 /**
- * @brief Recompute the detected photon weight from the partial-pathlengths
+ * @brief Convert a local element ID of this partition to the global element ID
  *
- * This function currently does not consider the final transmission coeff before
- * the photon being detected.
- *
- * @param[in] photonid: index of the detected photon
- * @param[in] colcount: how many 4-byte records per detected photon
- * @param[in] ppath: buffer points to the detected photon data (partial-path, det id, etc)
- * @param[in] cfg: the simulation configuration
+ * @param[in] part: the partition of this rank
+ * @param[in] eid: the local element ID, starting from 1
+ * @return the global element ID, starting from 0
  */
 
-float mesh_getdetweight(int photonid, int colcount, float* ppath, mcconfig* cfg) {
+int mesh_partglobal(meshpart* part, int eid) {
+    return (eid <= part->nown) ? part->elemstart[part->rank] + eid - 1 : part->ghost[eid - part->nown - 1];
+}
 
-    float x0 = cfg->detpos[0].x;
-    float y0 = cfg->detpos[0].y;
-    float xrange = cfg->detparam1.x + cfg->detparam2.x;
-    float yrange = cfg->detparam1.y + cfg->detparam2.y;
-    int xsize = cfg->detparam1.w;
-    int ysize = cfg->detparam2.w;
-    float xloc = ppath[(photonid + 1) * colcount - 7];
-    float yloc = ppath[(photonid + 1) * colcount - 6];
-    int xindex = (xloc - x0) / xrange * xsize;
-    int yindex = (yloc - y0) / yrange * ysize;
+/**
+ * @brief Replace a mesh array by the array of a partition
+ *
+ * An array owned by the mesh is freed; an array in the memory-mapped container
+ * or owned by cfg is overwritten by the shorter partition array instead.
+ *
+ * @param[in] mesh: the mesh object
+ * @param[in] buf: the array of the whole mesh
+ * @param[in] data: the array of the partition, freed if copied
+ * @param[in] len: the byte length of data
+ * @param[in] isforeign: 1 if buf is not owned by the mesh
+ * @return the array to be used by the mesh
+ */
 
-    if (xindex < 0 || xindex > xsize - 1 || yindex < 0 || yindex > ysize - 1) {
-        MESH_ERROR("photon location not within the detection plane");
+static void* mesh_partarray(tetmesh* mesh, void* buf, void* data, size_t len, int isforeign) {
+    if (isforeign || mesh_ismapped(mesh, buf)) {
+        memcpy(buf, data, len);
+        free(data);
+        return buf;
     }
 
-    return cfg->detpattern[yindex * xsize + xindex];
+    free(buf);
+    return data;
 }
 
 /**
- * @brief Function to normalize the fluence and remove influence from photon number and volume
+ * @brief Keep only the partition of the mesh traced by this MPI rank (--domain)
  *
- * This function outputs the Green's function from the raw simulation data. This needs
- * to divide the total simulated photon energy, normalize the volumes of each node/elem,
- * and consider the length unit and time-gates
+ * The reordered elements are split in mpisize contiguous ranges of equal
+ * length, so each rank holds a compact piece of the space-filling curve. This
+ * rank keeps its elements and the ghost elements (the face neighbors of its
+ * elements on other ranks), in which the photons leaving the partition are
+ * handed over to their ranks, and the nodes used by both; all element and
+ * node data are renumbered to the local IDs, see meshpart. The face neighbors
+ * of the ghost elements outside of the partition are set to 0. The exterior
+ * faces keep their IDs, so that dref is summed over the ranks as a whole.
+ * cfg->e0 is converted to the local ID on the rank holding the source, 0 on
+ * the other ranks, which do not launch photons.
  *
- * @param[in] mesh: the mesh object
- * @param[in] cfg: the simulation configuration
- * @param[in] Eabsorb: total absorbed energy from ray-tracing accummulation
- * @param[in] Etotal: total launched energy, equal to photon number if not pattern-source
+ * Every rank has loaded and reordered the whole mesh before this call, so the
+ * partition only shrinks the memory held while tracing, not the peak memory
+ * of a rank. Rank 0 keeps the maps of the whole mesh to the input order to
+ * save the gathered output. This function must be called after mesh_reorder(), before
+ * the ray-tracer is built for the partition.
+ *
+ * @param[in,out] mesh: the reordered mesh object, replaced by the partition
+ * @param[in,out] cfg: the simulation configuration structure
  */
 
-/*see Eq (1) in Fang&Boas, Opt. Express, vol 17, No.22, pp. 20178-20190, Oct 2009*/
-float mesh_normalize(tetmesh* mesh, mcconfig* cfg, float Eabsorb, float Etotal, int pair) {
-    int i, j, k;
-    double energydeposit = 0.f, energyelem, normalizor;
-    int* ee;
-    int datalen = (cfg->method == rtBLBadouelGrid) ? cfg->crop0.z : ( (cfg->basisorder) ? mesh->nn : mesh->ne);
-
-    if (cfg->issaveref && mesh->dref) {
-        float normalizor = 1.f / Etotal;
+void mesh_partition(tetmesh* mesh, mcconfig* cfg) {
+    int i, j, ne = mesh->ne, nn = mesh->nn, elemlen = mesh->elemlen, nlocal, nnode = 0, lo, hi;
+    int* nodemap, *elem, *facenb, *type;
+    float* evol = NULL, *nvol = NULL;
+    FLOAT3* node;
+    meshpart* part;
 
-        for (i = 0; i < cfg->maxgate; i++)
-            for (j = 0; j < mesh->nf; j++) {
-                mesh->dref[i * mesh->nf + j] *= normalizor;
-            }
+    if (!cfg->isdomain || mesh->part) {
+        return;
     }
 
-    if (cfg->seed == SEED_FROM_FILE && (cfg->outputtype == otJacobian || cfg->outputtype == otWL || cfg->outputtype == otWP)) {
-        float normalizor = 1.f / (DELTA_MUA * cfg->nphoton);
-
-        if (cfg->outputtype == otWL || cfg->outputtype == otWP) {
-            normalizor = 1.f / Etotal;    /*Etotal is total detected photon weight in the replay mode*/
-        }
-
-        for (i = 0; i < cfg->maxgate; i++)
-            for (j = 0; j < datalen; j++) {
-                mesh->weight[(i * datalen + j)*cfg->srcnum + pair] *= normalizor;
-            }
+    if (mesh->elemorder == NULL) {
+        MESH_ERROR("--domain needs the mesh to be reordered along a space-filling curve");
+    }
 
-        return normalizor;
+    if (cfg->e0 <= 0) {
+        MESH_ERROR("--domain needs the source to be inside of the mesh");
     }
 
-    if (cfg->outputtype == otEnergy) {
-        normalizor = 1.f / Etotal;
+    if (cfg->isextdet || mesh->srcelemlen > 0 || mesh->detelemlen > 0) {
+        MESH_ERROR("--domain does not support wide-field sources or detectors labeled in the mesh");
+    }
 
-        for (i = 0; i < cfg->maxgate; i++)
-            for (j = 0; j < datalen; j++) {
-                mesh->weight[(i * datalen + j)*cfg->srcnum + pair] *= normalizor;
-            }
+    part = (meshpart*)calloc(1, sizeof(meshpart));
+    part->ne = ne;
+    part->nn = nn;
+    part->nf = mesh->nf;
+    part->rank = cfg->mpirank;
+    part->ranknum = cfg->mpisize;
+    part->elemstart = (int*)malloc(sizeof(int) * (cfg->mpisize + 1));
 
-        return normalizor;
+    for (i = 0; i <= cfg->mpisize; i++) {
+        part->elemstart[i] = (int)((long long)ne * i / cfg->mpisize);
     }
 
-    if (cfg->method == rtBLBadouelGrid) {
-        normalizor = 1.0 / (Etotal * cfg->unitinmm * cfg->unitinmm * cfg->unitinmm); /*scaling factor*/
-    } else {
-        if (cfg->basisorder) {
-            for (i = 0; i < cfg->maxgate; i++)
-                for (j = 0; j < datalen; j++)
-                    if (mesh->nvol[j] > 0.f) {
-                        mesh->weight[(i * datalen + j)*cfg->srcnum + pair] /= mesh->nvol[j];
-                    }
+    lo = part->elemstart[cfg->mpirank];
+    hi = part->elemstart[cfg->mpirank + 1];
+    part->nown = hi - lo;
 
-            for (i = 0; i < mesh->ne; i++) {
-                ee = (int*)(mesh->elem + i * mesh->elemlen);
-                energyelem = 0.f;
+    /*the ghost elements are the face neighbors held by the other ranks*/
+    part->ghost = (int*)malloc(sizeof(int) * MAX(part->nown * 4, 1));
 
-                for (j = 0; j < cfg->maxgate; j++)
-                    for (k = 0; k < 4; k++) {
-                        energyelem += mesh->weight[(j * mesh->nn + ee[k] - 1) * cfg->srcnum + pair];    /*1/4 factor is absorbed two lines below*/
-                    }
+    for (i = lo; i < hi; i++) {
+        for (j = 0; j < 4; j++) {
+            int nb = mesh->facenb[i * elemlen + j] - 1;
 
-                energydeposit += energyelem * mesh->evol[i] * mesh->med[mesh->type[i]].mua; /**mesh->med[mesh->type[i]].n;*/
+            if (nb >= 0 && (nb < lo || nb >= hi)) {
+                part->ghost[part->nghost++] = nb;
             }
+        }
+    }
 
-            normalizor = Eabsorb / (Etotal * energydeposit * 0.25f); /*scaling factor*/
-        } else {
-            for (i = 0; i < datalen; i++)
-                for (j = 0; j < cfg->maxgate; j++) {
-                    energydeposit += mesh->weight[(j * datalen + i) * cfg->srcnum + pair];
-                }
-
-            for (i = 0; i < datalen; i++) {
-                energyelem = mesh->evol[i] * mesh->med[mesh->type[i]].mua;
-
-                for (j = 0; j < cfg->maxgate; j++) {
-                    mesh->weight[(j * datalen + i)*cfg->srcnum + pair] /= energyelem;
-                }
-            }
+    qsort(part->ghost, part->nghost, sizeof(int), mesh_compareint);
 
-            normalizor = Eabsorb / (Etotal * energydeposit); /*scaling factor*/
+    for (i = 0, j = 0; i < part->nghost; i++) {
+        if (j == 0 || part->ghost[i] != part->ghost[j - 1]) {
+            part->ghost[j++] = part->ghost[i];
         }
     }
 
-    if (cfg->outputtype == otFlux) {
-        normalizor /= cfg->tstep;
-    }
+    part->nghost = j;
+    part->ghost = (int*)realloc(part->ghost, sizeof(int) * MAX(part->nghost, 1));
+    nlocal = part->nown + part->nghost;
+
+    /*the local nodes keep the global order*/
+    nodemap = (int*)calloc(nn, sizeof(int));
 
-    for (i = 0; i < cfg->maxgate; i++)
-        for (j = 0; j < datalen; j++) {
-            mesh->weight[(i * datalen + j)*cfg->srcnum + pair] *= normalizor;
+    for (i = 1; i <= nlocal; i++) {
+        int* ee = mesh->elem + (size_t)mesh_partglobal(part, i) * elemlen;
+
+        for (j = 0; j < elemlen; j++) {
+            nodemap[ee[j] - 1] = 1;
         }
+    }
 
-    return normalizor;
-}
+    for (i = 0; i < nn; i++) {
+        if (nodemap[i]) {
+            nodemap[i] = ++nnode;
+        }
+    }
 
+    part->nodeglobal = (int*)malloc(sizeof(int) * MAX(nnode, 1));
 
-/**
- * @brief Compute the effective reflection coefficient Reff using approximated formula
- *
- * accuracy is limited
- * see https://www.ncbi.nlm.nih.gov/pmc/articles/PMC4482362/
- *
- * @param[out] tracer: the ray-tracer data structure
- * @param[in] pmesh: the mesh object
- * @param[in] methodid: the ray-tracing algorithm to be used
- */
+    for (i = 0; i < nn; i++) {
+        if (nodemap[i]) {
+            part->nodeglobal[nodemap[i] - 1] = i;
+        }
+    }
 
-double mesh_getreff_approx(double n_in, double n_out) {
-    double nn = n_in / n_out;
-    return -1.440 / (nn * nn) + 0.710 / nn + 0.668 + 0.0636 * nn;
-}
+    /*a partition holds a share of the deposits at its boundary nodes, see mesh_energydeposit*/
+    if (cfg->basisorder) {
+        double* coef = (double*)calloc(nn, sizeof(double));
 
-/**
- * @brief Compute the effective reflection coefficient Reff
- *
- * @param[in] n_in: refractive index of the diffusive medium
- * @param[in] n_out: refractive index of the non-diffusive medium
- */
+        for (i = 0; i < ne; i++) {
+            double c = ((mesh->evol) ? mesh->evol[i] : mesh_elemvolume(mesh, i)) * MESH_ELEMMED(mesh, i)->mua;
 
-double mesh_getreff(double n_in, double n_out) {
-    double oc = asin(1.0 / n_in); // critical angle
-    const double count = 1000.0;
-    const double ostep = (M_PI / (2.0 * count));
-    double r_phi = 0.0, r_j = 0.0;
-    double o, cosop, coso, r_fres, tmp;
-    int i;
+            for (j = 0; j < 4; j++) {
+                coef[mesh->elem[(size_t)i * elemlen + j] - 1] += c;
+            }
+        }
 
-    for (i = 0; i < count; i++) {
-        o = i * ostep;
-        coso = cos(o);
+        part->nodecoef = (double*)malloc(sizeof(double) * MAX(nnode, 1));
 
-        if (o < oc) {
-            cosop = n_in * sin(o);
-            cosop = sqrt(1. - cosop * cosop);
-            tmp = (n_in * cosop - n_out * coso) / (n_in * cosop + n_out * coso);
-            r_fres = 0.5 * tmp * tmp;
-            tmp = (n_in * coso - n_out * cosop) / (n_in * coso + n_out * cosop);
-            r_fres += 0.5 * tmp * tmp;
-        } else {
-            r_fres = 1.f;
+        for (i = 0; i < nnode; i++) {
+            part->nodecoef[i] = coef[part->nodeglobal[i]];
         }
 
-        r_phi += 2.0 * sin(o) * coso * r_fres;
-        r_j += 3.0 * sin(o) * coso * coso * r_fres;
+        free(coef);
     }
 
-    r_phi *= ostep;
-    r_j *= ostep;
-    return (r_phi + r_j) / (2.0 - r_phi + r_j);
-}
+    if (cfg->mpirank == 0) {
+        part->elemorder = mesh->elemorder;
+        part->nodeorder = mesh->nodeorder;
 
+        if (mesh->dref && mesh->nf > 0) {
+            part->facemap = mesh_facemap(mesh);
+        }
+    } else {
+        free(mesh->elemorder);
+        free(mesh->nodeorder);
+    }
 
-/**
- * @brief Validate all input fields, and warn incompatible inputs
- *
- * Perform self-checking and raise exceptions or warnings when input error is detected
- *
- * @param[in,out] cfg: the simulation configuration structure
- * @param[out] mesh: the mesh data structure
- */
+    mesh->elemorder = NULL;
+    mesh->nodeorder = NULL;
 
-void mesh_validate(tetmesh* mesh, mcconfig* cfg) {
-    int i, j, *ee, datalen;
+    /*copy the element and node data of the partition*/
+    elem = (int*)malloc(sizeof(int) * nlocal * elemlen);
+    facenb = (int*)malloc(sizeof(int) * nlocal * elemlen);
+    type = (int*)malloc(sizeof(int) * nlocal);
+    node = (FLOAT3*)malloc(sizeof(FLOAT3) * MAX(nnode, 1));
 
-    if (mesh->prop == 0) {
-        MMC_ERROR(999, "you must define the 'prop' field in the input structure");
+    if (mesh->evol) {
+        evol = (float*)malloc(sizeof(float) * nlocal);
     }
 
-    if (mesh->nn == 0 || mesh->ne == 0 || mesh->evol == NULL || mesh->facenb == NULL) {
-        MMC_ERROR(999, "a complete input mesh include 'node','elem','facenb' and 'evol'");
+    if (mesh->nvol) {
+        nvol = (float*)malloc(sizeof(float) * MAX(nnode, 1));
     }
 
-    if (mesh->node == NULL || mesh->elem == NULL || mesh->prop == 0) {
-        MMC_ERROR(999, "You must define 'mesh' and 'prop' fields.");
-    }
+    for (i = 0; i < nlocal; i++) {
+        int g = mesh_partglobal(part, i + 1);
 
-    if (mesh->nvol) {
-        free(mesh->nvol);
-    }
+        for (j = 0; j < elemlen; j++) {
+            int nb = mesh->facenb[(size_t)g * elemlen + j];
 
-    mesh->nvol = (float*)calloc(sizeof(float), mesh->nn);
+            elem[i * elemlen + j] = nodemap[mesh->elem[(size_t)g * elemlen + j] - 1];
+            facenb[i * elemlen + j] = (nb > 0) ? mesh_partlocal(part, nb - 1) : nb;
+        }
 
-    for (i = 0; i < mesh->ne; i++) {
-        if (mesh->type[i] <= 0) {
-            continue;
+        type[i] = mesh->type[g];
+
+        if (evol) {
+            evol[i] = mesh->evol[g];
         }
+    }
 
-        ee = (int*)(mesh->elem + i * mesh->elemlen);
+    for (i = 0; i < nnode; i++) {
+        node[i] = mesh->node[part->nodeglobal[i]];
 
-        for (j = 0; j < 4; j++) {
-            mesh->nvol[ee[j] - 1] += mesh->evol[i] * 0.25f;
+        if (nvol) {
+            nvol[i] = mesh->nvol[part->nodeglobal[i]];
         }
     }
 
-    if (mesh->weight) {
-        free(mesh->weight);
+    free(nodemap);
+
+    mesh->elem = (int*)mesh_partarray(mesh, mesh->elem, elem, sizeof(int) * nlocal * elemlen, 0);
+    mesh->facenb = (int*)mesh_partarray(mesh, mesh->facenb, facenb, sizeof(int) * nlocal * elemlen, 0);
+    mesh->type = (int*)mesh_partarray(mesh, mesh->type, type, sizeof(int) * nlocal, 0);
+    mesh->node = (FLOAT3*)mesh_partarray(mesh, mesh->node, node, sizeof(FLOAT3) * nnode, cfg->node != NULL);
+
+    if (evol) {
+        mesh->evol = (float*)mesh_partarray(mesh, mesh->evol, evol, sizeof(float) * nlocal, 0);
     }
 
-    if (cfg->method == rtBLBadouelGrid) {
-        mesh_createdualmesh(mesh, cfg);
-        cfg->basisorder = 0;
+    if (nvol) {
+        free(mesh->nvol);
+        mesh->nvol = nvol;
     }
 
-    datalen = (cfg->method == rtBLBadouelGrid) ? cfg->crop0.z : ( (cfg->basisorder) ? mesh->nn : mesh->ne);
-    mesh->weight = (double*)calloc(sizeof(double) * datalen * cfg->srcnum, cfg->maxgate);
+    /*the precomputed tracer of a mapped container is for the whole mesh*/
+    mesh->tracermethod = -1;
+    mesh->tracerdata[0] = mesh->tracerdata[1] = mesh->tracerdata[2] = NULL;
 
-    if (cfg->method != rtBLBadouelGrid && cfg->unitinmm != 1.f) {
-        for (i = 1; i <= mesh->prop; i++) {
-            mesh->med[i].mus *= cfg->unitinmm;
-            mesh->med[i].mua *= cfg->unitinmm;
-        }
-    }
+    cfg->e0 = (cfg->e0 - 1 >= lo && cfg->e0 - 1 < hi) ? cfg->e0 - lo : 0;
 
-    /*make medianum+1 the same as medium 0*/
-    if (cfg->isextdet) {
-        mesh->med = (medium*)realloc(mesh->med, sizeof(medium) * (mesh->prop + 2));
-        memcpy(mesh->med + mesh->prop + 1, mesh->med, sizeof(medium));
+    mesh->ne = nlocal;
+    mesh->nn = nnode;
+    mesh->part = part;
 
-        for (i = 0; i < mesh->ne; i++) {
-            if (mesh->type[i] == -2) {
-                mesh->type[i] = mesh->prop + 1;
-            }
-        }
+    if (mesh->weight) {
+        free(mesh->weight);
+        mesh->weight = NULL;
     }
-}
\ No newline at end of file
+
+    mesh_initweight(mesh, cfg);
+
+    MMCDEBUG(cfg, dlTime, (cfg->flog, "rank %d holds %d of %d elements, %d ghost elements and %d of %d nodes\n",
+                           cfg->mpirank, part->nown, ne, part->nghost, nnode, nn));
+}
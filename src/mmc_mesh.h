@@ -43,23 +43,13 @@
 #include "mmc_utils.h"
 
 #ifdef MMC_USE_SSE
-    #include <smmintrin.h>
+    #include "mmc_simd.h"
 #endif
 
-#if !defined(USE_OPENCL) && !defined(__NVCC__)
-
-    #ifdef MMC_SFMT
-        #include "mmc_rand_sfmt.c"
-    #elif defined MMC_XORSHIFT
-        #include "mmc_rand_xorshift128p.c"
-    #else
-        #include "mmc_rand_posix.c"
-    #endif
-
-#elif defined(__NVCC__)
+#if defined(__NVCC__)
     #include "mmc_rand_xorshift128p.h"
 #else
-    #include "mmc_rand_xorshift128p.c"
+    #include "mmc_rand_multi.c"
 #endif
 
 #define MMC_UNDEFINED (3.40282347e+38F)
@@ -73,7 +63,117 @@
 #define DELTA_MUA  1e-4f
 #define VERY_BIG   1e30f
 
+#define MMC_SRCGRID_MIN    16   /**< minimum srcelem length to build a wide-field source grid */
+#define MMC_SRCGRID_MAXDIM 1024 /**< maximum number of source grid cells along each axis */
+#define MMC_DETGRID_MIN    16   /**< minimum detector number to build a detector grid */
+#define MMC_SURFBVH_LEAF   4    /**< maximum number of triangles in a leaf of the surface BVH */
+#define MMC_SURFBVH_DEPTH  64   /**< maximum depth of the surface BVH, the size of the traversal stack */
+#define MMC_DIFF_CDF_LEN   1024 /**< length of the inverse-CDF table of the diffusion first-passage time, see mesh_builddiffusion */
+#define MMC_DIFF_MAXSHELL  8    /**< shells of grid cells searched for the nearest label boundary, the jump radius is capped by them */
+
+#define MMC_WEIGHT_PAGE_BITS 10                          /**< log2 of the elements/nodes per page of the sparse output */
+#define MMC_WEIGHT_PAGE_LEN  (1 << MMC_WEIGHT_PAGE_BITS) /**< elements/nodes (of all patterns) per page of the sparse output */
+#define MMC_GRID_BRICK_XBITS 4                          /**< log2 of the voxels along x of a brick (one page) of the sparse dual-grid output */
+#define MMC_GRID_BRICK_YBITS 3                          /**< log2 of the voxels along y of a brick of the sparse dual-grid output */
+#define MMC_GRID_BRICK_ZBITS (MMC_WEIGHT_PAGE_BITS - MMC_GRID_BRICK_XBITS - MMC_GRID_BRICK_YBITS) /**< log2 of the voxels along z of a brick */
+
+#define MMC_TEXT_BLOCK     4096       /**< lines formatted by a thread at a time when saving a text output */
+#define MMC_TEXT_LINE_LEN  48         /**< bytes reserved per line of a text output */
+#define MMC_TEXT_MAX_LEN   (1 << 24)  /**< text outputs with more values are saved in the binary format instead */
+#define MMC_ZARR_CHUNK     (1 << 22)  /**< bytes of all frames of the nodes or elements stored in one chunk of a Zarr output */
+
+#define MMC_SHM_MAGIC      "MMCSHM01" /**< 8-byte tag at the start of a complete --shm segment */
+#define MMC_SHM_HEADER_LEN 4096       /**< bytes reserved for the tag, the header length and the JSON header of a --shm segment */
+#define MMC_SHM_ALIGN      64         /**< byte alignment of each array of a --shm segment */
+
 #define MESH_ERROR(a)  mesh_error((a),__FILE__,__LINE__)
+#define MESH_NOROI(mesh, eid)  ((mesh)->noroi && (((mesh)->noroi[(eid) >> 5] >> ((eid) & 31)) & 1U)) /**< test if element eid (from 0) has no iMMC ROI */
+#define MESH_ROIREC(mesh, roi, eid, len) ((roi) + (size_t)((mesh)->roimap ? (mesh)->roimap[(eid)] : (unsigned int)(eid)) * (len)) /**< pointer to the len-float edge/face ROI record of element eid (from 0) */
+#define MESH_IMPORTANCE(cfg, type) (((cfg)->importance && (type) > 0 && (type) <= (cfg)->importnum) ? (cfg)->importance[(type) - 1] : 1.f) /**< the importance of label type, see --importance */
+#define MESH_ELEMMED(mesh, eid) ((mesh)->elemmed ? (mesh)->elemmed + (eid) : (mesh)->med + (mesh)->type[(eid)]) /**< pointer to the medium of element eid (from 0) */
+#define MESH_INVCDF(cfg, type) (((cfg)->invcdf && (type) > 0) ? (cfg)->invcdf + (size_t)((type) - 1) * (cfg)->nphase : NULL) /**< the inverse CDF of cos(theta) of label type, NULL to sample Henyey-Greenstein */
+#define MESH_BRICKROW(mesh, ix, iy, iz) ((((((unsigned int)(iz) >> MMC_GRID_BRICK_ZBITS) * (mesh)->weightbrick.y + ((unsigned int)(iy) >> MMC_GRID_BRICK_YBITS)) * (mesh)->weightbrick.x \
+            + ((unsigned int)(ix) >> MMC_GRID_BRICK_XBITS)) << MMC_WEIGHT_PAGE_BITS) | (((unsigned int)(iz) & ((1U << MMC_GRID_BRICK_ZBITS) - 1)) << (MMC_GRID_BRICK_XBITS + MMC_GRID_BRICK_YBITS)) \
+            | (((unsigned int)(iy) & ((1U << MMC_GRID_BRICK_YBITS) - 1)) << MMC_GRID_BRICK_XBITS) | ((unsigned int)(ix) & ((1U << MMC_GRID_BRICK_XBITS) - 1))) /**< row of voxel (ix,iy,iz) in a frame of the bricked dual-grid output */
+#define MESH_BRICKFRAME(mesh) (((size_t)(mesh)->weightbrick.x * (mesh)->weightbrick.y * (mesh)->weightbrick.z) << MMC_WEIGHT_PAGE_BITS) /**< rows per frame of the bricked dual-grid output */
+#define MESH_ELEMOUT(mesh) ((mesh)->outmap ? (mesh)->outlen : (mesh)->ne) /**< rows per frame of the elemental output, see --outmask */
+#define MESH_OUTROW(mesh, eid, tshift) ((mesh)->outmap ? (((mesh)->outmap[(eid)] < 0) ? (mesh)->outsink : (size_t)(mesh)->outmap[(eid)] + (tshift)) : (size_t)(eid) + (tshift)) /**< output row of element eid (from 0) in the frame starting at tshift */
+
+/***************************************************************************//**
+\struct MMC_elemgrid mmc_mesh.h
+\brief  Uniform-grid point-location index over a candidate element list
+
+Each element is binned into all cells overlapped by its (padded) bounding box,
+stored in a compressed-row layout; within a cell, the element list is sorted
+by the position in the candidate list so that a query returns the same first
+match as a linear scan of the full list.
+
+*******************************************************************************/
+
+typedef struct MMC_elemgrid {
+    float3 pmin;           /**< lower corner of the grid */
+    float rcellsize;       /**< inverse of the edge length of the cubic cells */
+    int dim[3];            /**< number of cells along x/y/z */
+    int* cellstart;        /**< elements of cell c are stored in cellelem[cellstart[c]] to cellelem[cellstart[c+1]-1] */
+    int* cellelem;         /**< positions (start from 0) in the candidate element list */
+} elemgrid;
+
+/***************************************************************************//**
+\struct MMC_facebvh mmc_mesh.h
+\brief  Bounding volume hierarchy over the exterior triangles of the mesh
+
+The exterior faces are stored in the leaf order of the tree, each as its first
+vertex and two edges oriented so that their cross product points out of the
+mesh. A node is either a leaf holding node[i].count triangles from
+node[i].start, or an inner node (count is 0) whose children are node[i].start
+and node[i].start+1.
+
+*******************************************************************************/
+
+typedef struct MMC_bvhnode {
+    FLOAT3 pmin;           /**< lower corner of the bounding box */
+    int start;             /**< leaf: first triangle; inner node: index of the first child */
+    FLOAT3 pmax;           /**< upper corner of the bounding box */
+    int count;             /**< number of triangles of a leaf, 0 for an inner node */
+} bvhnode;
+
+typedef struct MMC_facebvh {
+    int nodenum;           /**< number of tree nodes, node[0] is the root */
+    int trinum;            /**< number of exterior triangles */
+    bvhnode* node;         /**< tree nodes */
+    FLOAT3* tri;           /**< 3 vectors per triangle: vertex A, edges AB and AC, AB x AC points outward */
+    int* face;             /**< exterior face of each triangle, (element id - 1) * 4 + facenb slot */
+} facebvh;
+
+/***************************************************************************//**
+\struct MMC_meshpart mmc_mesh.h
+\brief  The partition of a mesh held by one MPI rank (--domain)
+
+After mesh_reorder, the elements of the whole mesh are split in contiguous
+ranges of the curve order, one per rank. A rank keeps its elements (local IDs
+1 to nown, in the global order), followed by the ghost elements, which are the
+face neighbors of its elements held by the other ranks, and the nodes used by
+both. The exterior faces keep their global IDs, so dref is not partitioned.
+
+*******************************************************************************/
+
+typedef struct MMC_meshpart {
+    int ne;                /**< number of elements of the whole mesh */
+    int nn;                /**< number of nodes of the whole mesh */
+    int nf;                /**< number of exterior faces of the whole mesh */
+    int nown;              /**< number of elements of this rank, local IDs 1 to nown */
+    int nghost;            /**< number of ghost elements, local IDs nown+1 to nown+nghost */
+    int rank;              /**< MPI rank holding this partition */
+    int ranknum;           /**< number of MPI ranks, i.e. of partitions */
+    int* elemstart;        /**< mpisize+1 entries, rank r holds the global elements (from 0) elemstart[r] to elemstart[r+1]-1 */
+    int* ghost;            /**< global ID (from 0) of each ghost element, in ascending order */
+    int* nodeglobal;       /**< global ID (from 0) of each local node */
+    double* nodecoef;      /**< for the nodal output, the sum of evol*mua over the elements of the whole mesh using each local node, NULL otherwise */
+    int* elemorder;        /**< on rank 0, the input index (from 0) of each global element, see mesh_reorder; NULL on the other ranks */
+    int* nodeorder;        /**< on rank 0, the input index (from 0) of each global node; NULL on the other ranks */
+    int* facemap;          /**< on rank 0 with dref, the input order index of each exterior face, see mesh_restoreorder; NULL otherwise */
+    double (*sumparts)(double val); /**< sums a value over the partitions of all ranks, set by the run, NULL to use the local value */
+} meshpart;
 
 /***************************************************************************//**
 \struct MMC_mesh simpmesh.h
@@ -101,14 +201,40 @@ typedef struct MMC_mesh {
     int*  detelem;         /**< candidate list of elements containing a widefield detector*/
     int  detelemlen;       /**< length of the elements that may contain the detector*/
     int*  type;            /**< element-based media index */
-    int*  facenb;          /**< face neighbors, idx of the element sharing a face */
+    int*  facenb;          /**< face neighbors, idx of the element sharing a face; after tracer_prep, -(surface triangle id, start from 1) for an exterior face */
     medium* med;           /**< optical property of different media */
+    medium* elemmed;       /**< with --elemprop, optical property of each element, used instead of med[type[i]], NULL if the labels decide the media */
+    medium* wavemed;       /**< optical property of the 2nd to the last wavelengths, wavenum-1 blocks of prop+1 media, NULL if single-wavelength */
+    double* emitcdf;       /**< in the emission stage of --emission, the cumulative share of the emitted energy up to each element, NULL to launch from the source */
     double* weight;        /**< volumetric fluence for all nodes at all time-gates */
-    double* dref;          /**< surface diffuse reflectance */
+    double* dref;          /**< surface diffuse reflectance, nf entries per source and time gate, indexed by the negated exterior facenb entries */
+    double* weightvar;     /**< with cfg->varbatch, the squared output of each batch over its photon number summed over the batches, the variance of the first maxgate frames of weight after mesh_batchvariance */
+    double** weightpage;   /**< page table of the sparse output (--sparsegate), each page holds MMC_WEIGHT_PAGE_LEN consecutive rows of weight, NULL if dense */
+    size_t weightpagenum;  /**< length of the weightpage table */
+    uint3 weightbrick;     /**< number of bricks along x/y/z if the paged output holds the dual grid (-M G), where each page is a brick of voxels; all 0 otherwise */
     float* evol;           /**< volume of an element */
     float* nvol;           /**< voronoi volume of a node */
     float4 nmin;           /**< lower-corner of the mesh bounding box */
     float4 nmax;           /**< upper-corner of the mesh bounding box */
+    int* elemorder;        /**< if reordered, the original index (start from 0) of each element, NULL otherwise */
+    int* nodeorder;        /**< if reordered, the original index (start from 0) of each node, NULL otherwise */
+    void* mmapbuf;         /**< memory-mapped binary mesh container, NULL if the mesh is loaded from text files */
+    size_t mmaplen;        /**< length in bytes of mmapbuf */
+    int tracermethod;      /**< ray-tracing method of the precomputed tracer data in the container, -1 if none */
+    float3* tracerdata[3]; /**< precomputed tracer d/m/n data stored in the container */
+    elemgrid* srcgrid;     /**< uniform-grid index of srcelem for wide-field launch, NULL if not built */
+    elemgrid* detgrid;     /**< uniform-grid index of cfg->detpos for the exiting photons, NULL if not built */
+    facebvh* surfbvh;      /**< BVH over the exterior faces to find where the photons from a source outside of the mesh enter, NULL if not built */
+    unsigned int* noroi;   /**< immc: bit (i&31) of noroi[i>>5] is set if the i-th element has no ROI to test, NULL if not built */
+    unsigned char* facereflect; /**< bit j of facereflect[i] is set if a photon leaving the i-th element through face j calls reflectray, NULL if not built */
+    unsigned int* roimap;  /**< immc: record index of each element in the packed edgeroi/faceroi, record 0 is all zeros; NULL if edgeroi/faceroi are per-element */
+    unsigned int nroirec;  /**< immc: number of records in the packed edgeroi/faceroi, including the zero record */
+    float* diffradius;     /**< radius of a sphere around any point of each element that stays inside its label, 0 outside of cfg->difflabel, NULL if not built */
+    float* difftau;        /**< MMC_DIFF_CDF_LEN quantiles of the dimensionless first-passage time D*t/R^2 from the center of a sphere, NULL if not built */
+    int* outmap;           /**< with --outmask, the output row of each element (from 0, in the input order), -1 if not selected; NULL to output all elements */
+    int outlen;            /**< with --outmask, the number of selected elements, i.e. the rows of an output frame */
+    size_t outsink;        /**< with --outmask, the row after all frames of weight that sums the deposits of the unselected elements for the normalization */
+    meshpart* part;        /**< with --domain, the partition of the mesh held by this MPI rank, see mesh_partition; NULL if the whole mesh is held */
 } tetmesh;
 
 /***************************************************************************//**
@@ -117,7 +243,8 @@ typedef struct MMC_mesh {
 
 We define the precomputed data in a ray-tracer structure. For the case of
 Plucker-based ray-tracing, this structure contains the displacement and
-moment vectors for each edge in a tetrahedron.
+moment vectors for each edge in a tetrahedron, or for each unique edge of the
+mesh, referenced by the edge entries of the elements, with --edgetable.
 
 *******************************************************************************/
 
@@ -127,6 +254,9 @@ typedef struct MMC_raytracer {
     float3* d;              /**< precomputed data: for Pluckers, this is displacement */
     float3* m;              /**< precomputed data: for Pluckers, this is moment */
     float3* n;              /**< precomputed data: for Pluckers, face norm */
+    char isedgetable;       /**< 1 if d and m are stored once per unique edge (--edgetable) */
+    int nedge;              /**< number of unique edges in d and m if isedgetable is set */
+    int* edge;              /**< 6 entries per element, (edge << 1) | 1 if the edge is reversed in the element */
 } raytracer;
 #ifdef  __cplusplus
 extern "C" {
@@ -137,36 +267,96 @@ void mesh_loadnode(tetmesh* mesh, mcconfig* cfg);
 void mesh_loadelem(tetmesh* mesh, mcconfig* cfg);
 void mesh_loadfaceneighbor(tetmesh* mesh, mcconfig* cfg);
 void mesh_loadmedia(tetmesh* mesh, mcconfig* cfg);
+void mesh_loadwavemedia(tetmesh* mesh, mcconfig* cfg);
+void mesh_loademission(tetmesh* mesh, mcconfig* cfg, medium* med, float* yield);
 void mesh_loadelemvol(tetmesh* mesh, mcconfig* cfg);
+void mesh_loadelemprop(tetmesh* mesh, mcconfig* cfg);
 void mesh_loadseedfile(tetmesh* mesh, mcconfig* cfg);
 
 void mesh_clear(tetmesh* mesh, mcconfig* cfg);
+void mesh_partition(tetmesh* mesh, mcconfig* cfg);
+int  mesh_partowner(meshpart* part, int eid);
+int  mesh_partlocal(meshpart* part, int eid);
+int  mesh_partglobal(meshpart* part, int eid);
 float mesh_normalize(tetmesh* mesh, mcconfig* cfg, float Eabsorb, float Etotal, int pair);
 void mesh_build(tetmesh* mesh);
 void mesh_error(const char* msg, const char* file, const int linenum);
 void mesh_filenames(const char* format, char* foutput, mcconfig* cfg);
 void mcx_savecamsignals(float* camsignals, size_t len, mcconfig* cfg);
 void mesh_saveweight(tetmesh* mesh, mcconfig* cfg, int isref);
+void mesh_saveshm(tetmesh* mesh, mcconfig* cfg, int detreclen);
+void mesh_initweight(tetmesh* mesh, mcconfig* cfg);
+void mesh_batchvariance(tetmesh* mesh, mcconfig* cfg, double nphoton, int nbatch);
+void mesh_scalevariance(tetmesh* mesh, mcconfig* cfg);
+void mesh_scatterelemweight(tetmesh* mesh, mcconfig* cfg, double* elemweight);
+void mesh_savevariance(tetmesh* mesh, mcconfig* cfg);
+void mesh_saveheatmap(tetmesh* mesh, mcconfig* cfg);
+double* mesh_allocweightpage(double** weightpage, size_t pageid, int srcnum);
 void mesh_savedetphoton(float* ppath, void* seeds, int count, int seedbyte, mcconfig* cfg);
+void mesh_appenddetphoton(float* ppath, int count, int colcount, mcconfig* cfg);
+void mesh_appendtrajectory(float* traj, int count, mcconfig* cfg);
 void mesh_getdetimage(float* detmap, float* ppath, int count, mcconfig* cfg, tetmesh* mesh);
 void mesh_savedetimage(float* detmap, mcconfig* cfg);
 float mesh_getdetweight(int photonid, int colcount, float* ppath, mcconfig* cfg);
+void mesh_pmcreweight(double* out, float* ppath, int count, int colcount, int detnum, float unitinmm, double nphoton, mcconfig* cfg, tetmesh* mesh);
+void mesh_runpmc(tetmesh* mesh, mcconfig* cfg);
+void mesh_savedcs(mcconfig* cfg);
+void mesh_normdetstat(tetmesh* mesh, mcconfig* cfg, double* sums, double nphoton);
+void mesh_savedetstat(tetmesh* mesh, mcconfig* cfg);
+void mesh_savenee(mcconfig* cfg);
+void mesh_savejacobian(tetmesh* mesh, mcconfig* cfg);
+void mesh_patternfaces(tetmesh* mesh, mcconfig* cfg, double* facew);
+int mesh_detsource(tetmesh* mesh, mcconfig* cfg, int detid);
+void mesh_savereciprocal(mcconfig* cfg, double* meas);
 void mesh_srcdetelem(tetmesh* mesh, mcconfig* cfg);
 void mesh_createdualmesh(tetmesh* mesh, mcconfig* cfg);
 void mesh_loadroi(tetmesh* mesh, mcconfig* cfg);
 double mesh_getreff_approx(double n_in, double n_out);
 double mesh_getreff(double n_in, double n_out);
 int mesh_barycentric(int e0, float* bary, FLOAT3* srcpos, tetmesh* mesh);
+int mesh_barylocate(tetmesh* mesh, const int* list, const int* cand, int n, FLOAT3* p, float tol, float* bary);
 int mesh_initelem(tetmesh* mesh, mcconfig* cfg);
+void mesh_initsrclist(tetmesh* mesh, mcconfig* cfg);
+void mesh_buildsrcgrid(tetmesh* mesh, mcconfig* cfg);
+void mesh_buildroimask(tetmesh* mesh, mcconfig* cfg);
+void mesh_buildfacereflect(tetmesh* mesh, mcconfig* cfg);
+void mesh_packroi(tetmesh* mesh, mcconfig* cfg);
+void mesh_builddiffusion(tetmesh* mesh, mcconfig* cfg);
+void mesh_buildoutmask(tetmesh* mesh, mcconfig* cfg);
+int mesh_walkelem(tetmesh* mesh, int e, FLOAT3* p);
+int* mesh_gridquery(elemgrid* grid, FLOAT3* p, int* count);
+int* mesh_packgrid(elemgrid* grid, int* list, int listlen, int* len);
+void mesh_builddetgrid(tetmesh* mesh, mcconfig* cfg);
+void mesh_cleargrid(elemgrid** grid);
+void mesh_buildsurfbvh(tetmesh* mesh, mcconfig* cfg);
+int mesh_surfhit(facebvh* bvh, FLOAT3* p0, FLOAT3* v, float* dist);
 void mesh_validate(tetmesh* mesh, mcconfig* cfg);
+void mesh_updatemedia(tetmesh* mesh, mcconfig* cfg, const medium* med);
 void mesh_getvolume(tetmesh* mesh, mcconfig* cfg);
+void mesh_getnodevolume(tetmesh* mesh, const float* vol);
+float mesh_elemvolume(tetmesh* mesh, int eid);
+void mesh_reorder(tetmesh* mesh, mcconfig* cfg);
+int mesh_loadbinary(tetmesh* mesh, mcconfig* cfg);
+void mesh_savebinary(tetmesh* mesh, mcconfig* cfg);
+int mesh_ismapped(tetmesh* mesh, void* ptr);
+void mesh_restoreorder(tetmesh* mesh, mcconfig* cfg, float* ppath, int count, int colcount);
+void mesh_restoredetid(tetmesh* mesh, mcconfig* cfg, float* ppath, int count, int colcount);
 
 void tracer_init(raytracer* tracer, tetmesh* mesh, char methodid);
+void tracer_init_from_cache(raytracer* tracer, tetmesh* pmesh, mcconfig* cfg);
+unsigned long long mesh_hashbuffer(const void* buf, size_t len, unsigned long long hash);
 void tracer_build(raytracer* tracer);
+void tracer_packgpu(raytracer* tracer, unsigned int* rec);
+int tracer_packhalfface(raytracer* tracer, int* halfface, float4** faces);
 void tracer_prep(raytracer* tracer, mcconfig* cfg);
 void tracer_clear(raytracer* tracer);
+void tracer_replicate(raytracer* tracer, tetmesh* mesh, raytracer* srctracer);
+void tracer_clearreplica(raytracer* tracer);
 
-float mc_next_scatter(float g, float3* dir, RandType* ran, RandType* ran0, mcconfig* cfg, float* pmom);
+float mc_next_scatter(float g, const float* invcdf, float3* dir, RandType* ran, RandType* ran0, mcconfig* cfg, float* pmom);
+void mesh_buildinvcdf(tetmesh* mesh, mcconfig* cfg);
+void mc_reset_scatter(void);
+size_t mc_scatter_state(void* buf, int isload);
 #ifdef MCX_CONTAINER
 #ifdef __cplusplus
 extern "C"
@@ -32,18 +32,40 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include "mmc_neurojson.h"
 
 #define ALLOC_CHUNK  4096
+#define STDIN_CHUNK  (1 << 20)
 
 #ifdef _WIN32
+    #include <direct.h>
     #define popen   _popen
     #define pclose  _pclose
+    #define PATH_SEP '\\'
+    #ifndef S_ISREG
+        #define S_ISREG(m) (((m) & S_IFMT) == S_IFREG)
+    #endif
+#else
+    #define PATH_SEP '/'
 #endif
 
+/**
+ * @brief Run a shell command and capture its standard output
+ *
+ * The output buffer grows geometrically, so a multi-MB download is read in
+ * a time linear to its size; the standard input starts from a 1 MB buffer,
+ * or the full size of the file when it is redirected from one.
+ *
+ * @param[in] cmd: the command, an empty string reads the standard input
+ * @param[in] param: a string appended to the command
+ * @param[out] output: receives a null-terminated buffer, must be freed by the caller
+ * @return the byte length of the output, or -1 if the command can not be run
+ */
+
 int runcommand(char* cmd, char* param, char** output) {
-    int len = ALLOC_CHUNK, pos = 0;
-    char buffer[256] = {'\0'}, fullcmd[ALLOC_CHUNK] = {'\0'};
+    size_t len = ALLOC_CHUNK, pos = 0, got;
+    char fullcmd[ALLOC_CHUNK] = {'\0'};
     FILE* pipe = NULL;
 
     snprintf(fullcmd, ALLOC_CHUNK, "%s%s", cmd, param);
@@ -53,22 +75,180 @@ int runcommand(char* cmd, char* param, char** output) {
         return -1;
     }
 
+    if (pipe == stdin) {
+        struct stat st;
+
+        /*a redirected file is read in a single block*/
+        if (fstat(fileno(stdin), &st) == 0 && S_ISREG(st.st_mode) && (size_t)st.st_size >= len) {
+            len = (size_t)st.st_size + 2;
+        } else {
+            len = STDIN_CHUNK;
+        }
+    }
+
     free(*output);
-    *output = (char*)calloc(ALLOC_CHUNK, 1);
+    *output = (char*)malloc(len);
 
-    while (fgets(buffer, sizeof(buffer), pipe) != NULL) {
-        int buflen = strlen(buffer);
+    while ((got = fread(*output + pos, 1, len - pos - 1, pipe)) > 0) {
+        pos += got;
 
-        if (buflen > len - pos - 1) {
-            *output = (char*)realloc(*output, len + ALLOC_CHUNK);
-            len += ALLOC_CHUNK;
+        if (len - pos - 1 == 0) {
+            len <<= 1;
+            *output = (char*)realloc(*output, len);
         }
-
-        strncpy(*output + pos, buffer, len - pos - 1);
-        pos += buflen;
     }
 
+    (*output)[pos] = '\0';
     *output = (char*)realloc(*output, pos + 1);
-    pclose(pipe);
-    return pos;
-}
\ No newline at end of file
+
+    if (pipe != stdin) {
+        pclose(pipe);
+    }
+
+    return (int)pos;
+}
+
+/**
+ * @brief Return the directory of the downloaded documents, created if needed
+ *
+ * $MMC_CACHE_DIR if set, otherwise $XDG_CACHE_HOME/mmc or $HOME/.cache/mmc
+ * (%LOCALAPPDATA%\mmc on Windows).
+ *
+ * @param[out] dir: receives the path, at least ALLOC_CHUNK bytes
+ * @return 0 on success, -1 if no cache directory is available
+ */
+
+static int netcachedir(char* dir) {
+    const char* env;
+
+    if ((env = getenv("MMC_CACHE_DIR")) != NULL && env[0]) {
+        snprintf(dir, ALLOC_CHUNK, "%s", env);
+    } else if ((env = getenv("XDG_CACHE_HOME")) != NULL && env[0]) {
+        snprintf(dir, ALLOC_CHUNK, "%s%cmmc", env, PATH_SEP);
+#ifdef _WIN32
+    } else if ((env = getenv("LOCALAPPDATA")) != NULL && env[0]) {
+        snprintf(dir, ALLOC_CHUNK, "%s%cmmc", env, PATH_SEP);
+#else
+    } else if ((env = getenv("HOME")) != NULL && env[0]) {
+        snprintf(dir, ALLOC_CHUNK, "%s%c.cache", env, PATH_SEP);
+        mkdir(dir, 0755);
+        snprintf(dir, ALLOC_CHUNK, "%s%c.cache%cmmc", env, PATH_SEP, PATH_SEP);
+#endif
+    } else {
+        return -1;
+    }
+
+#ifdef _WIN32
+    _mkdir(dir);
+#else
+    mkdir(dir, 0755);
+#endif
+    return 0;
+}
+
+/**
+ * @brief Read a whole file into a null-terminated buffer
+ */
+
+static int readcache(const char* fname, char** output) {
+    FILE* fp = fopen(fname, "rb");
+    long len;
+
+    if (fp == NULL) {
+        return -1;
+    }
+
+    fseek(fp, 0, SEEK_END);
+    len = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    free(*output);
+    *output = (char*)malloc(len + 1);
+
+    if (*output == NULL || fread(*output, 1, len, fp) != (size_t)len) {
+        fclose(fp);
+        return -1;
+    }
+
+    (*output)[len] = '\0';
+    fclose(fp);
+    return (int)len;
+}
+
+/**
+ * @brief Download a JSON document with curl, through a local cache keyed by the URL and its revision
+ *
+ * The cache entry of a URL is named after the 64bit FNV-1a hash of the URL.
+ * A HEAD request reads the ETag of the document (the revision of a NeuroJSON/
+ * CouchDB document); the cached copy is used while its stored ETag matches,
+ * and also when the server can not be reached. Documents without an ETag are
+ * downloaded every time.
+ *
+ * @param[in] url: the URL of the document
+ * @param[out] output: receives a null-terminated buffer, must be freed by the caller
+ * @return the byte length of the document, or -1 if it can not be obtained
+ */
+
+int fetchurl(const char* url, char** output) {
+    char dir[ALLOC_CHUNK], fdoc[ALLOC_CHUNK + 32], ftag[ALLOC_CHUNK + 32], cmd[ALLOC_CHUNK];
+    char* head = NULL, *etag = NULL, *oldtag = NULL, *p;
+    unsigned long long hash = 14695981039346656037ULL;
+    int len, iscached;
+    FILE* fp;
+
+    for (p = (char*)url; *p; p++) {
+        hash = (hash ^ (unsigned char)*p) * 1099511628211ULL;
+    }
+
+    iscached = (netcachedir(dir) == 0);
+
+    if (iscached) {
+        snprintf(fdoc, sizeof(fdoc), "%s%c%016llx.json", dir, PATH_SEP, hash);
+        snprintf(ftag, sizeof(ftag), "%s%c%016llx.etag", dir, PATH_SEP, hash);
+    }
+
+    snprintf(cmd, ALLOC_CHUNK, "curl -s -I \"%s\"", url);
+
+    if (iscached && runcommand(cmd, (char*)"", &head) > 0) {
+        for (p = head; p && *p; p = strchr(p, '\n'), p += (p != NULL)) {
+            if (strncmp(p, "ETag:", 5) == 0 || strncmp(p, "etag:", 5) == 0) {
+                size_t n;
+
+                p += 5;
+                p += strspn(p, " \"");
+                n = strcspn(p, "\"\r\n");
+                etag = (char*)calloc(n + 1, 1);
+                memcpy(etag, p, n);
+                break;
+            }
+        }
+    }
+
+    free(head);
+
+    if (iscached && (etag == NULL || (readcache(ftag, &oldtag) >= 0 && strcmp(oldtag, etag) == 0))) {
+        /*unchanged, or offline: any cached copy will do*/
+        if ((len = readcache(fdoc, output)) > 0) {
+            free(etag);
+            free(oldtag);
+            return len;
+        }
+    }
+
+    free(oldtag);
+    snprintf(cmd, ALLOC_CHUNK, "curl -s -X GET \"%s\"", url);
+    len = runcommand(cmd, (char*)"", output);
+
+    if (iscached && etag && len > 0 && (fp = fopen(fdoc, "wb")) != NULL) {
+        int ok = (fwrite(*output, 1, len, fp) == (size_t)len);
+
+        fclose(fp);
+
+        if (ok && (fp = fopen(ftag, "wb")) != NULL) {
+            fputs(etag, fp);
+            fclose(fp);
+        }
+    }
+
+    free(etag);
+    return len;
+}
@@ -36,6 +36,7 @@
 extern "C" {
 #endif
 int runcommand(char* cmd, char* param, char** output);
+int fetchurl(const char* url, char** output);
 
 #ifdef __cplusplus
 }
@@ -68,57 +68,109 @@ inlinefun float rand_do_roulette(RandType t[RAND_BUF_LEN]) {
 }
 #ifdef MMC_USE_SSE_MATH      //! when SSE Math functions are used
 
+#include <string.h>
+#include "sse_math/avx_math.h"
+
 #define MATH_BLOCK 8
 
+#ifndef MMC_RAND_HAS_FILL
+//! fill a buffer with n [0,1] random numbers, in the same order as n calls to rand_uniform01
+inlinefun void rand_uniform01_fill(RandType t[RAND_BUF_LEN], float* buf, int n) {
+    int i;
+
+    for (i = 0; i < n; i++) {
+        buf[i] = rand_uniform01(t);
+    }
+}
+#endif
+
+static __thread V4SF rand_sine[MATH_BLOCK], rand_cosine[MATH_BLOCK];  /**< per-thread block of sin/cos of the azimuthal angles */
+static __thread V4SF rand_logval[MATH_BLOCK];                        /**< per-thread block of log of the scattering length randoms */
+static __thread int rand_sincospos = (MATH_BLOCK << 2), rand_logpos = (MATH_BLOCK << 2);
+
+//! drop the pre-computed blocks of the calling thread, so that a reseeded RNG starts a fresh block
+inlinefun void rand_clear_blocks(void) {
+    rand_sincospos = (MATH_BLOCK << 2);
+    rand_logpos = (MATH_BLOCK << 2);
+}
+
+#define RAND_BLOCK_BYTES  (sizeof(V4SF) * MATH_BLOCK * 3 + sizeof(int) * 2)  /**< bytes of the pre-computed blocks of a thread */
+
+//! copy the pre-computed blocks of the calling thread to (isload=0) or from (isload=1) buf, so that a checkpoint resumes mid-block
+inlinefun void rand_copy_blocks(unsigned char* buf, int isload) {
+    void* field[5] = {rand_sine, rand_cosine, rand_logval, &rand_sincospos, &rand_logpos};
+    size_t len[5] = {sizeof(rand_sine), sizeof(rand_cosine), sizeof(rand_logval), sizeof(int), sizeof(int)};
+    int i;
+
+    for (i = 0; i < 5; i++) {
+        if (isload) {
+            memcpy(field[i], buf, len[i]);
+        } else {
+            memcpy(buf, field[i], len[i]);
+        }
+
+        buf += len[i];
+    }
+}
+
 //! generate [0,1] random number for the sin/cos of arimuthal angles
 inlinefun void rand_next_aangle_sincos(RandType t[RAND_BUF_LEN], float* si, float* co) {
-    static __thread V4SF sine[MATH_BLOCK], cosine[MATH_BLOCK];
-    static __thread int pos = (MATH_BLOCK << 2);
+    V4SF* sine = rand_sine, *cosine = rand_cosine;
 
-    if (pos >= (MATH_BLOCK << 2)) {
+    if (rand_sincospos >= (MATH_BLOCK << 2)) {
         V4SF ran[MATH_BLOCK];
-        int i, j;
+        float* buf = (float*)ran;
+        int i;
 
-        for (i = 0; i < MATH_BLOCK; i++)
-            for (j = 0; j < 4; j++) {
-                ran[i].f[j] = TWO_PI * rand_uniform01(t);
-            }
+        rand_uniform01_fill(t, buf, (MATH_BLOCK << 2));
 
-        for (i = 0; i < MATH_BLOCK; i++) {
-            sincos_ps(ran[i].v, &(sine[i].v), &(cosine[i].v));
+        for (i = 0; i < (MATH_BLOCK << 2); i++) {
+            buf[i] = TWO_PI * buf[i];
         }
 
-        pos = 0;
+#ifdef MMC_USE_AVX_MATH
+
+        if (mmc_has_avx2()) {
+            sincos256_ps_block(buf, (float*)sine, (float*)cosine, (MATH_BLOCK << 2));
+        } else
+#endif
+            for (i = 0; i < MATH_BLOCK; i++) {
+                sincos_ps(ran[i].v, &(sine[i].v), &(cosine[i].v));
+            }
+
+        rand_sincospos = 0;
     }
 
-    *si = sine[0].f[pos];
-    *co = cosine[0].f[pos++];
+    *si = sine[0].f[rand_sincospos];
+    *co = cosine[0].f[rand_sincospos++];
 }
 
 //! generate [0,1] random number for the next scattering length
 inlinefun float rand_next_scatlen_ps(RandType t[RAND_BUF_LEN]) {
-    static __thread V4SF logval[MATH_BLOCK];
-    static __thread int pos = (MATH_BLOCK << 2);
+    V4SF* logval = rand_logval;
     float res;
 
-    if (pos >= (MATH_BLOCK << 2)) {
+    if (rand_logpos >= (MATH_BLOCK << 2)) {
         V4SF ran[MATH_BLOCK];
-        int i, j;
+        int i;
 
-        for (i = 0; i < MATH_BLOCK; i++)
-            for (j = 0; j < 4; j++) {
-                ran[i].f[j] = rand_uniform01(t);
-            }
+        rand_uniform01_fill(t, (float*)ran, (MATH_BLOCK << 2));
 
-        for (i = 0; i < MATH_BLOCK; i++) {
-            logval[i].v = log_ps(ran[i].v);
-        }
+#ifdef MMC_USE_AVX_MATH
+
+        if (mmc_has_avx2()) {
+            log256_ps_block((float*)ran, (float*)logval, (MATH_BLOCK << 2));
+        } else
+#endif
+            for (i = 0; i < MATH_BLOCK; i++) {
+                logval[i].v = log_ps(ran[i].v);
+            }
 
-        pos = 0;
+        rand_logpos = 0;
     }
 
-    res = ((logval[0].f[pos] != logval[0].f[pos]) ? LOG_RNG_MAX : (-logval[0].f[pos]));
-    pos++;
+    res = ((logval[0].f[rand_logpos] != logval[0].f[rand_logpos]) ? LOG_RNG_MAX : (-logval[0].f[rand_logpos]));
+    rand_logpos++;
     return res;
 }
 #endif
@@ -47,6 +47,7 @@
 
 //typedef unsigned long long uint64_t
 
+#ifdef _WIN32
 typedef signed __int8 sint8;
 typedef unsigned __int8 uint8;
 typedef signed __int16 sint16;
@@ -55,6 +56,27 @@ typedef signed __int32 sint32;
 typedef unsigned __int32 uint32;
 typedef signed __int64 sint64;
 typedef unsigned __int64 uint64;
+#else
+#include <stdint.h>
+
+typedef int8_t sint8;
+typedef uint8_t uint8;
+typedef int16_t sint16;
+typedef uint16_t uint16;
+typedef int32_t sint32;
+typedef uint32_t uint32;
+typedef int64_t sint64;
+typedef uint64_t uint64;
+
+/* libc has its own drand48 family, the port is renamed to test it side by side (-DMMC_DRAND48) */
+#define drand48_data         mmc_drand48_data
+#define __libc_drand48_data  mmc_libc_drand48_data
+#define __drand48_iterate    mmc_drand48_iterate
+#define __erand48_r          mmc_erand48_r
+#define drand48_r            mmc_drand48_r
+#define seed48_r             mmc_seed48_r
+#define erand48              mmc_erand48
+#endif
 
 
 /**
@@ -0,0 +1,126 @@
+/***************************************************************************//**
+**  \mainpage Mesh-based Monte Carlo (MMC) - a 3D photon simulator
+**
+**  \author Qianqian Fang <q.fang at neu.edu>
+**  \copyright Qianqian Fang, 2010-2025
+**
+**  \section sref Reference:
+**  \li \c (\b Fang2010) Qianqian Fang, <a href="http://www.opticsinfobase.org/abstract.cfm?uri=boe-1-1-165">
+**          "Mesh-based Monte Carlo Method Using Fast Ray-Tracing
+**          in Plucker Coordinates,"</a> Biomed. Opt. Express, 1(1) 165-175 (2010).
+**  \li \c (\b Fang2012) Qianqian Fang and David R. Kaeli,
+**           <a href="https://www.osapublishing.org/boe/abstract.cfm?uri=boe-3-12-3223">
+**          "Accelerating mesh-based Monte Carlo method on modern CPU architectures,"</a>
+**          Biomed. Opt. Express 3(12), 3223-3230 (2012)
+**  \li \c (\b Yao2016) Ruoyang Yao, Xavier Intes, and Qianqian Fang,
+**          <a href="https://www.osapublishing.org/boe/abstract.cfm?uri=boe-7-1-171">
+**          "Generalized mesh-based Monte Carlo for wide-field illumination and detection
+**           via mesh retessellation,"</a> Biomed. Optics Express, 7(1), 171-184 (2016)
+**  \li \c (\b Fang2019) Qianqian Fang and Shijie Yan,
+**          <a href="http://dx.doi.org/10.1117/1.JBO.24.11.115002">
+**          "Graphics processing unit-accelerated mesh-based Monte Carlo photon transport
+**           simulations,"</a> J. of Biomedical Optics, 24(11), 115002 (2019)
+**  \li \c (\b Yuan2021) Yaoshen Yuan, Shijie Yan, and Qianqian Fang,
+**          <a href="https://www.osapublishing.org/boe/fulltext.cfm?uri=boe-12-1-147">
+**          "Light transport modeling in highly complex tissues using the implicit
+**           mesh-based Monte Carlo algorithm,"</a> Biomed. Optics Express, 12(1) 147-161 (2021)
+**
+**  \section slicense License
+**          GPL v3, see LICENSE.txt for details
+*******************************************************************************/
+
+/***************************************************************************//**
+\file    mmc_rand_multi.c
+
+\brief   Random number generators selectable at run time
+
+All RNGs compiled in here keep their state in the same two 64-bit words, so
+that the per-thread and per-photon states, the saved seeds of the detected
+photons and the checkpoints have the same layout for all of them:
+
+- xorshift128+ (rngXorshift128p): the default, the same RNG as the GPU kernels
+- Philox2x32-10 (rngPhilox): counter-based, t[0] is the key and t[1] the
+  counter, each photon owns a stream so the results do not depend on the threads
+- POSIX erand48 (rngPosix): the 48-bit linear congruential generator of
+  erand48(), the state is the low 48 bits of t[0]
+
+Each call dispatches on the thread-local rand_backend; the branch takes the
+same direction for a whole simulation, so it is predicted at no cost.
+*******************************************************************************/
+
+#ifndef _MMC_MULTI_RAND_C
+#define _MMC_MULTI_RAND_C
+
+#include "mmc_rand_multi.h"
+#include "mmc_rand_xorshift128p.c"
+#include "mmc_rand_philox.c"
+
+#define POSIX_RAND_MULT     0x5DEECE66DULL        /* multiplier of the erand48 LCG */
+#define POSIX_RAND_ADD      0xBULL                /* increment of the erand48 LCG */
+#define POSIX_RAND_MASK     0xFFFFFFFFFFFFULL     /* the state has 48 bits */
+#define POSIX_RAND_SCALE    (1.0 / 281474976710656.0) /* 2^-48 */
+
+// one step of erand48, gives the same sequence as erand48() of the C library
+static inline float posix_nextf(RandType t[RAND_BUF_LEN]) {
+    t[0] = (t[0] * POSIX_RAND_MULT + POSIX_RAND_ADD) & POSIX_RAND_MASK;
+    return (float)(t[0] * POSIX_RAND_SCALE);
+}
+
+// take the 48 bit state from the first 3 16-bit words of the seed, as mmc_rand_posix.c
+static inline void posix_seed(uint* seed, RandType t[RAND_BUF_LEN]) {
+    t[0] = ((RandType)(seed[1] & 0xFFFF) << 32) | seed[0];
+    t[1] = 0;
+    posix_nextf(t);
+    posix_nextf(t);
+    posix_nextf(t);
+}
+
+// transform into [0,1] random number
+inlinefun float rand_uniform01(RandType t[RAND_BUF_LEN]) {
+    switch (rand_backend) {
+        case rngPhilox:
+            return philox2x32_nextf(t);
+
+        case rngPosix:
+            return posix_nextf(t);
+
+        default:
+            return xorshift128p_nextf(t);
+    }
+}
+inlinefun void rng_init(RandType t[RAND_BUF_LEN], RandType tnew[RAND_BUF_LEN], uint* n_seed, int idx) {
+    switch (rand_backend) {
+        case rngPhilox:
+            t[0] = n_seed[0];   // all threads share the key, photons are told apart by the counter
+            t[1] = 0;
+            break;
+
+        case rngPosix:
+            posix_seed(n_seed + idx * RAND_SEED_WORD_LEN, t);
+            break;
+
+        default:
+            xorshift128p_seed(n_seed + idx * RAND_SEED_WORD_LEN, t);
+    }
+}
+inlinefun void rand_need_more(RandType t[RAND_BUF_LEN], RandType tbuf[RAND_BUF_LEN]) {
+}
+
+#define MMC_RAND_HAS_FILL
+// fill a buffer with n [0,1] random numbers, in the same order as n calls to rand_uniform01
+inlinefun void rand_uniform01_fill(RandType t[RAND_BUF_LEN], float* buf, int n) {
+    int i;
+
+    if (rand_backend == rngXorshift128p) {
+        xorshift128p_fill(t, buf, n);
+        return;
+    }
+
+    for (i = 0; i < n; i++) {
+        buf[i] = rand_uniform01(t);
+    }
+}
+
+#include "mmc_rand_common.h"
+
+#endif
@@ -0,0 +1,64 @@
+/***************************************************************************//**
+**  \mainpage Mesh-based Monte Carlo (MMC) - a 3D photon simulator
+**
+**  \author Qianqian Fang <q.fang at neu.edu>
+**  \copyright Qianqian Fang, 2010-2025
+**
+**  \section sref Reference:
+**  \li \c (\b Fang2010) Qianqian Fang, <a href="http://www.opticsinfobase.org/abstract.cfm?uri=boe-1-1-165">
+**          "Mesh-based Monte Carlo Method Using Fast Ray-Tracing
+**          in Plucker Coordinates,"</a> Biomed. Opt. Express, 1(1) 165-175 (2010).
+**  \li \c (\b Fang2012) Qianqian Fang and David R. Kaeli,
+**           <a href="https://www.osapublishing.org/boe/abstract.cfm?uri=boe-3-12-3223">
+**          "Accelerating mesh-based Monte Carlo method on modern CPU architectures,"</a>
+**          Biomed. Opt. Express 3(12), 3223-3230 (2012)
+**  \li \c (\b Yao2016) Ruoyang Yao, Xavier Intes, and Qianqian Fang,
+**          <a href="https://www.osapublishing.org/boe/abstract.cfm?uri=boe-7-1-171">
+**          "Generalized mesh-based Monte Carlo for wide-field illumination and detection
+**           via mesh retessellation,"</a> Biomed. Optics Express, 7(1), 171-184 (2016)
+**  \li \c (\b Fang2019) Qianqian Fang and Shijie Yan,
+**          <a href="http://dx.doi.org/10.1117/1.JBO.24.11.115002">
+**          "Graphics processing unit-accelerated mesh-based Monte Carlo photon transport
+**           simulations,"</a> J. of Biomedical Optics, 24(11), 115002 (2019)
+**  \li \c (\b Yuan2021) Yaoshen Yuan, Shijie Yan, and Qianqian Fang,
+**          <a href="https://www.osapublishing.org/boe/fulltext.cfm?uri=boe-12-1-147">
+**          "Light transport modeling in highly complex tissues using the implicit
+**           mesh-based Monte Carlo algorithm,"</a> Biomed. Optics Express, 12(1) 147-161 (2021)
+**
+**  \section slicense License
+**          GPL v3, see LICENSE.txt for details
+*******************************************************************************/
+
+/***************************************************************************//**
+\file    mmc_rand_multi.h
+
+\brief   An interface to the random number generators selectable at run time
+*******************************************************************************/
+
+#ifndef _MMC_MULTI_RAND_H
+#define _MMC_MULTI_RAND_H
+
+#define MMC_RAND_MULTI
+
+#include "mmc_utils.h"
+#include "mmc_rand_xorshift128p.h"
+#include "mmc_rand_philox.h"
+
+#define MCX_RNG_NAME       "xorshift128+ RNG"   //of the GPU kernels, the CPU RNG is selected by cfg->rngtype
+
+/**
+ * the RNG of the calling thread, one of TRNGType; a thread sets it to
+ * cfg->rngtype before seeding, so that concurrent simulations can use
+ * different RNGs
+ */
+
+extern __thread int rand_backend;
+
+//! 1 if the RNG of the calling thread is counter-based, i.e. each photon owns a stream
+#define rand_is_counter()  (rand_backend == rngPhilox)
+
+inlinefun float rand_uniform01(RandType t[RAND_BUF_LEN]);
+inlinefun void rng_init(RandType t[RAND_BUF_LEN], RandType tnew[RAND_BUF_LEN], uint* n_seed, int idx);
+inlinefun void rand_need_more(RandType t[RAND_BUF_LEN], RandType tbuf[RAND_BUF_LEN]);
+
+#endif
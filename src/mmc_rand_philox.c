@@ -0,0 +1,109 @@
+/***************************************************************************//**
+**  \mainpage Mesh-based Monte Carlo (MMC) - a 3D photon simulator
+**
+**  \author Qianqian Fang <q.fang at neu.edu>
+**  \copyright Qianqian Fang, 2010-2025
+**
+**  \section sref Reference:
+**  \li \c (\b Fang2010) Qianqian Fang, <a href="http://www.opticsinfobase.org/abstract.cfm?uri=boe-1-1-165">
+**          "Mesh-based Monte Carlo Method Using Fast Ray-Tracing
+**          in Plucker Coordinates,"</a> Biomed. Opt. Express, 1(1) 165-175 (2010).
+**  \li \c (\b Fang2012) Qianqian Fang and David R. Kaeli,
+**           <a href="https://www.osapublishing.org/boe/abstract.cfm?uri=boe-3-12-3223">
+**          "Accelerating mesh-based Monte Carlo method on modern CPU architectures,"</a>
+**          Biomed. Opt. Express 3(12), 3223-3230 (2012)
+**  \li \c (\b Yao2016) Ruoyang Yao, Xavier Intes, and Qianqian Fang,
+**          <a href="https://www.osapublishing.org/boe/abstract.cfm?uri=boe-7-1-171">
+**          "Generalized mesh-based Monte Carlo for wide-field illumination and detection
+**           via mesh retessellation,"</a> Biomed. Optics Express, 7(1), 171-184 (2016)
+**  \li \c (\b Fang2019) Qianqian Fang and Shijie Yan,
+**          <a href="http://dx.doi.org/10.1117/1.JBO.24.11.115002">
+**          "Graphics processing unit-accelerated mesh-based Monte Carlo photon transport
+**           simulations,"</a> J. of Biomedical Optics, 24(11), 115002 (2019)
+**  \li \c (\b Yuan2021) Yaoshen Yuan, Shijie Yan, and Qianqian Fang,
+**          <a href="https://www.osapublishing.org/boe/fulltext.cfm?uri=boe-12-1-147">
+**          "Light transport modeling in highly complex tissues using the implicit
+**           mesh-based Monte Carlo algorithm,"</a> Biomed. Optics Express, 12(1) 147-161 (2021)
+**
+**  \section slicense License
+**          GPL v3, see LICENSE.txt for details
+*******************************************************************************/
+
+/***************************************************************************//**
+\file    mmc_rand_philox.c
+
+\brief   A counter-based Philox2x32-10 random number generator
+
+The n-th random number of a photon is a pure function of the key (derived
+from the user seed), the photon index and n, i.e. the state is just
+t[0]=key and t[1]=(photon index<<32)+n. Results are therefore independent of
+the thread count and the photon-to-thread assignment, and the state saved
+for a detected photon is simply its key and index. Reference:
+J. K. Salmon et al., "Parallel random numbers: as easy as 1, 2, 3," SC'11.
+*******************************************************************************/
+
+#ifndef _MMC_PHILOX_RAND_C
+#define _MMC_PHILOX_RAND_C
+
+#include <math.h>
+#include <stdio.h>
+#include "mmc_rand_philox.h"
+#include "mmc_fastmath.h"
+
+#ifdef MMC_USE_SSE_MATH
+    #include "sse_math/sse_math.h"
+    #include "mmc_simd.h"
+#endif
+
+#define LOG_RNG_MAX         22.1807097779182f
+
+#define PHILOX_M2x32        0xD256D193U
+#define PHILOX_W32          0x9E3779B9U
+#define PHILOX_ROUNDS       10
+
+static float philox2x32_nextf (RandType t[RAND_BUF_LEN]) {
+    union {
+        uint  u;
+        float f;
+    } s1;
+    uint key = (uint)t[0], c0 = (uint)t[1], c1 = (uint)(t[1] >> 32);
+    int i;
+
+    for (i = 0; i < PHILOX_ROUNDS; i++) {
+        unsigned long long prod = (unsigned long long)PHILOX_M2x32 * c0;
+        c0 = (uint)(prod >> 32) ^ key ^ c1;
+        c1 = (uint)prod;
+        key += PHILOX_W32;
+    }
+
+    t[1]++;
+    s1.u = 0x3F800000U | (c0 >> 9);
+
+    return s1.f - 1.0f;
+}
+
+// move to the first random number of photon id
+inlinefun void rng_seek_photon(RandType t[RAND_BUF_LEN], RandType tseed[RAND_BUF_LEN], size_t id) {
+    t[0] = tseed[0];
+    t[1] = (RandType)id << 32;
+}
+
+/*with MMC_RAND_MULTI, the interface is provided by mmc_rand_multi.c*/
+#ifndef MMC_RAND_MULTI
+
+// transform into [0,1] random number
+inlinefun float rand_uniform01(RandType t[RAND_BUF_LEN]) {
+    return philox2x32_nextf(t);
+}
+inlinefun void rng_init(RandType t[RAND_BUF_LEN], RandType tnew[RAND_BUF_LEN], uint* n_seed, int idx) {
+    t[0] = n_seed[0];   // all threads share the key, photons are told apart by the counter
+    t[1] = 0;
+}
+inlinefun void rand_need_more(RandType t[RAND_BUF_LEN], RandType tbuf[RAND_BUF_LEN]) {
+}
+
+#include "mmc_rand_common.h"
+
+#endif
+
+#endif
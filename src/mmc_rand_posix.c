@@ -44,7 +44,7 @@
 
 #ifdef MMC_USE_SSE_MATH
     #include "sse_math/sse_math.h"
-    #include <smmintrin.h>
+    #include "mmc_simd.h"
 #endif
 
 #define LOG_RNG_MAX          22.1807097779182f
@@ -68,6 +68,6 @@ __device__ void rng_init(RandType t[RAND_BUF_LEN], RandType tnew[RAND_BUF_LEN],
 __device__ void rand_need_more(RandType t[RAND_BUF_LEN], RandType tbuf[RAND_BUF_LEN]) {
 }
 
-#include "rng_common.h"
+#include "mmc_rand_common.h"
 
 #endif
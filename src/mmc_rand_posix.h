@@ -42,6 +42,10 @@
 
 #define __device__  static inline
 
+#ifndef inlinefun
+    #define inlinefun static inline
+#endif
+
 #define MCX_RNG_NAME       "POSIX Multi-threaded RNG"
 
 #define RAND_BUF_LEN       3        //register arrays
@@ -49,7 +53,7 @@
 
 typedef unsigned int uint;
 
-#ifdef _WIN32
+#if defined(_WIN32) || defined(MMC_DRAND48)
     #include "mmc_rand_drand48.h"
 #endif
 
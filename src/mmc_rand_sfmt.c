@@ -43,7 +43,7 @@
 
 #ifdef MMC_USE_SSE_MATH
     #include "sse_math/sse_math.h"
-    #include <smmintrin.h>
+    #include "mmc_simd.h"
 #endif
 
 #define MAX_SFMT_RAND        4294967296           //2^32
@@ -44,10 +44,14 @@
 
 #define __device__ static inline
 
+#ifndef inlinefun
+    #define inlinefun static inline
+#endif
+
 typedef unsigned int RandType;
 typedef unsigned int uint;
 
-#define MCX_RNG_NAME       "xorshift128+ RNG"
+#define MCX_RNG_NAME       "SFMT-19937 RNG"
 
 #define RAND_BUF_LEN       1248    //buffer length
 #define RAND_SEED_WORD_LEN      2       //
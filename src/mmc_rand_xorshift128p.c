@@ -35,8 +35,8 @@
 \brief   A POSIX Random Number Generator for multi-threaded applications
 *******************************************************************************/
 
-#ifndef _MMC_POSIX_RAND_H
-#define _MMC_POSIX_RAND_H
+#ifndef _MMC_XORSHIFT128P_RAND_C
+#define _MMC_XORSHIFT128P_RAND_C
 
 #include <math.h>
 #include <stdio.h>
@@ -45,7 +45,7 @@
 
 #ifdef MMC_USE_SSE_MATH
     #include "sse_math/sse_math.h"
-    #include <smmintrin.h>
+    #include "mmc_simd.h"
 #endif
 
 #define LOG_RNG_MAX         22.1807097779182f
@@ -73,6 +73,34 @@ static void xorshift128p_seed (uint* seed, RandType t[RAND_BUF_LEN]) {
     t[1] = (ulong)seed[2] << 32 | seed[3];
 }
 
+// fill a buffer with n [0,1] random numbers, keeping the state in registers
+static inline void xorshift128p_fill(RandType t[RAND_BUF_LEN], float* buf, int n) {
+    union {
+        ulong  i;
+        float f[2];
+        uint  u[2];
+    } s1;
+    ulong x = t[0], y = t[1];
+    int i;
+
+    for (i = 0; i < n; i++) {
+        const ulong s0 = y;
+        s1.i = x;
+        x = s0;
+        s1.i ^= s1.i << 23; // a
+        y = s1.i ^ s0 ^ (s1.i >> 18) ^ (s0 >> 5); // b, c
+        s1.i = y + s0;
+        s1.u[0] = 0x3F800000U | (s1.u[0] >> 9);
+        buf[i] = s1.f[0] - 1.0f;
+    }
+
+    t[0] = x;
+    t[1] = y;
+}
+
+/*with MMC_RAND_MULTI, the interface is provided by mmc_rand_multi.c*/
+#ifndef MMC_RAND_MULTI
+
 // transform into [0,1] random number
 inlinefun float rand_uniform01(RandType t[RAND_BUF_LEN]) {
     return xorshift128p_nextf(t);
@@ -83,6 +111,13 @@ inlinefun void rng_init(RandType t[RAND_BUF_LEN], RandType tnew[RAND_BUF_LEN], u
 inlinefun void rand_need_more(RandType t[RAND_BUF_LEN], RandType tbuf[RAND_BUF_LEN]) {
 }
 
+#define MMC_RAND_HAS_FILL
+inlinefun void rand_uniform01_fill(RandType t[RAND_BUF_LEN], float* buf, int n) {
+    xorshift128p_fill(t, buf, n);
+}
+
 #include "mmc_rand_common.h"
 
 #endif
+
+#endif
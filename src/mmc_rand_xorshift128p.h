@@ -32,11 +32,11 @@
 /***************************************************************************//**
 \file    mmc_rand_xorshift128p.h
 
-\brief   An interface to use the SFMT-19937 random number generator
+\brief   An interface to use the xorshift128+ random number generator
 *******************************************************************************/
 
-#ifndef _MCEXTREME_SFMT_RAND_H
-#define _MCEXTREME_SFMT_RAND_H
+#ifndef _MMC_XORSHIFT128P_RAND_H
+#define _MMC_XORSHIFT128P_RAND_H
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -53,7 +53,9 @@ typedef unsigned int uint;
     typedef unsigned long long ulong;
 #endif
 
-#define MCX_RNG_NAME       "xorshift128+ RNG"
+#ifndef MMC_RAND_MULTI
+    #define MCX_RNG_NAME       "xorshift128+ RNG"
+#endif
 #define RAND_BUF_LEN       2        //register arrays
 #define RAND_SEED_WORD_LEN      4        //48 bit packed with 64bit length
 
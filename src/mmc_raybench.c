@@ -0,0 +1,599 @@
+/***************************************************************************//**
+**  \mainpage Mesh-based Monte Carlo (MMC) - a 3D photon simulator
+**
+**  \author Qianqian Fang <q.fang at neu.edu>
+**  \copyright Qianqian Fang, 2010-2025
+**
+**  \section sref Reference:
+**  \li \c (\b Fang2010) Qianqian Fang, <a href="http://www.opticsinfobase.org/abstract.cfm?uri=boe-1-1-165">
+**          "Mesh-based Monte Carlo Method Using Fast Ray-Tracing
+**          in Plucker Coordinates,"</a> Biomed. Opt. Express, 1(1) 165-175 (2010).
+**  \li \c (\b Fang2012) Qianqian Fang and David R. Kaeli,
+**           <a href="https://www.osapublishing.org/boe/abstract.cfm?uri=boe-3-12-3223">
+**          "Accelerating mesh-based Monte Carlo method on modern CPU architectures,"</a>
+**          Biomed. Opt. Express 3(12), 3223-3230 (2012)
+**  \li \c (\b Yao2016) Ruoyang Yao, Xavier Intes, and Qianqian Fang,
+**          <a href="https://www.osapublishing.org/boe/abstract.cfm?uri=boe-7-1-171">
+**          "Generalized mesh-based Monte Carlo for wide-field illumination and detection
+**           via mesh retessellation,"</a> Biomed. Optics Express, 7(1), 171-184 (2016)
+**  \li \c (\b Fang2019) Qianqian Fang and Shijie Yan,
+**          <a href="http://dx.doi.org/10.1117/1.JBO.24.11.115002">
+**          "Graphics processing unit-accelerated mesh-based Monte Carlo photon transport
+**           simulations,"</a> J. of Biomedical Optics, 24(11), 115002 (2019)
+**  \li \c (\b Yuan2021) Yaoshen Yuan, Shijie Yan, and Qianqian Fang,
+**          <a href="https://www.osapublishing.org/boe/fulltext.cfm?uri=boe-12-1-147">
+**          "Light transport modeling in highly complex tissues using the implicit
+**           mesh-based Monte Carlo algorithm,"</a> Biomed. Optics Express, 12(1) 147-161 (2021)
+**
+**  \section slicense License
+**          GPL v3, see LICENSE.txt for details
+*******************************************************************************/
+
+/***************************************************************************//**
+\file    mmc_raybench.c
+
+\brief   << Microbenchmark of the individual ray-tetrahedron test engines >>
+
+This program records a stream of (ray, element) states from a random walk in
+the mesh of an MMC simulation, and replays the same stream through each of
+the ray-tet test engines, so that the cost of one test can be measured without
+the random number generation, scattering and boundary handling of a full
+simulation. The format is
+
+    mmc_raybench <benchmark options> -- <mmc options>
+
+for example
+
+    mmc_raybench -n 1e6 -r 5 -- --bench scale-1e6
+*******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#if defined(__linux__)
+    #include <unistd.h>
+    #include <sys/ioctl.h>
+    #include <sys/syscall.h>
+    #include <linux/perf_event.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+    #include <x86intrin.h>
+#endif
+
+#include "mmc_host.h"
+#include "mmc_tictoc.h"
+
+#define RAYBENCH_MAGIC     "MMCRAYS1"             /**< magic header of a saved ray stream */
+#define RAYBENCH_MAX_STEP  100000                 /**< max number of recorded steps per photon */
+
+extern const int faceorder[5];
+
+#ifdef MMC_USE_SSE
+    #include "mmc_simd.h"
+    extern __m128 int_coef;
+#endif
+
+/**
+ * \brief One recorded ray-tet test: the ray entering the test and the exit face found by the recording engine
+ */
+
+typedef struct MMC_rayrecord {
+    float p0[3];                  /**< ray origin */
+    float vec[3];                 /**< ray direction */
+    float slen;                   /**< remaining unitless scattering length */
+    int eid;                      /**< enclosing element, starting from 1 */
+    int faceid;                   /**< exit face found by the recording engine */
+    int isend;                    /**< 1 if the scattering length ends inside the element */
+} rayrecord;
+
+/**
+ * \brief Hardware cycle and instruction counters of the calling thread, where available
+ */
+
+typedef struct MMC_perfcounter {
+    int fd[2];                    /**< file descriptors of the cycle and instruction counters, -1 if not available */
+    unsigned long long value[2];  /**< counter values of the last measurement */
+} perfcounter;
+
+typedef float (*raytetfun)(ray* r, raytracer* tracer, mcconfig* cfg, visitor* visit);
+
+/**
+ * \brief The ray-tet test engines, indexed by the -M flag of mmc
+ */
+
+static const struct {
+    char flag;
+    int method;
+    const char* name;
+    raytetfun fun;
+} engines[] = {
+    {'P', rtPlucker, "plucker_raytet", plucker_raytet},
+    {'H', rtHavel, "havel_raytet", havel_raytet},
+    {'B', rtBadouel, "badouel_raytet", badouel_raytet},
+    {'S', rtBLBadouel, "branchless_badouel_raytet", branchless_badouel_raytet},
+    {'K', rtBLBadouel, "packet_raytet", NULL}
+};
+
+/**
+ * \brief A small xorshift64* generator so that the recorded stream only depends on the seed
+ */
+
+static double raybench_rand(unsigned long long* state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return ((*state * 2685821657736338717ULL) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/**
+ * \brief Open the hardware cycle and instruction counters, left closed if the kernel denies access
+ */
+
+static void perf_open(perfcounter* pc) {
+    pc->fd[0] = pc->fd[1] = -1;
+#if defined(__linux__)
+    {
+        struct perf_event_attr attr;
+        unsigned long long config[2] = {PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS};
+        int i;
+
+        for (i = 0; i < 2; i++) {
+            memset(&attr, 0, sizeof(attr));
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.size = sizeof(attr);
+            attr.config = config[i];
+            attr.disabled = 1;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            pc->fd[i] = (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+        }
+    }
+#endif
+}
+
+static void perf_start(perfcounter* pc) {
+#if defined(__linux__)
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        if (pc->fd[i] >= 0) {
+            ioctl(pc->fd[i], PERF_EVENT_IOC_RESET, 0);
+            ioctl(pc->fd[i], PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+
+#endif
+}
+
+static void perf_stop(perfcounter* pc) {
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        pc->value[i] = 0;
+#if defined(__linux__)
+
+        if (pc->fd[i] >= 0) {
+            ioctl(pc->fd[i], PERF_EVENT_IOC_DISABLE, 0);
+
+            if (read(pc->fd[i], pc->value + i, sizeof(unsigned long long)) != sizeof(unsigned long long)) {
+                pc->value[i] = 0;
+            }
+        }
+
+#endif
+    }
+}
+
+static void perf_close(perfcounter* pc) {
+#if defined(__linux__)
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        if (pc->fd[i] >= 0) {
+            close(pc->fd[i]);
+        }
+    }
+
+#endif
+}
+
+/**
+ * \brief Read the time-stamp counter, used as the cycle count if the hardware counters are not available
+ */
+
+static unsigned long long raybench_tsc(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+/**
+ * \brief Load the ray-tet engine data of a ray-tracing method, releasing those of the previous method
+ */
+
+static void raybench_settracer(raytracer* tracer, tetmesh* mesh, mcconfig* cfg, int method) {
+    if (tracer->method != method || (tracer->d == NULL && tracer->m == NULL && tracer->n == NULL)) {
+        tracer_clear(tracer);
+        tracer_init(tracer, mesh, method);
+    }
+
+    cfg->method = method;
+}
+
+/**
+ * \brief Set the state of a ray from a recorded test
+ */
+
+static void raybench_loadray(ray* r, const rayrecord* rec) {
+    r->p0.x = rec->p0[0];
+    r->p0.y = rec->p0[1];
+    r->p0.z = rec->p0[2];
+    r->vec.x = rec->vec[0];
+    r->vec.y = rec->vec[1];
+    r->vec.z = rec->vec[2];
+    r->eid = rec->eid;
+    r->slen = rec->slen;
+    r->weight = 1.f;
+    r->photontimer = 0.f;
+    r->Eabsorb = 0.0;
+}
+
+/**
+ * \brief Record a stream of ray-tet tests from a random walk in the mesh
+ *
+ * Photons start from the source and are traced with the Branch-less Badouel
+ * engine. A photon scatters isotropically when its scattering length ends,
+ * moves across the exit face otherwise, and ends when it leaves the mesh. The
+ * time-of-flight is reset at each step so that photons are not stopped by the
+ * time gate. Boundary reflection is not modeled.
+ *
+ * \param[out] rec: the recorded tests, count records are written
+ * \param[in] count: number of tests to record
+ * \param[in] tracer: the ray-tracer data structure
+ * \param[in] mesh: the mesh data structure
+ * \param[in] cfg: simulation configuration structure
+ * \param[in] visit: the visitor of the calling thread
+ */
+
+static void raybench_record(rayrecord* rec, size_t count, raytracer* tracer, tetmesh* mesh, mcconfig* cfg, visitor* visit) {
+    ray r;
+    unsigned long long seed = 0x9E3779B97F4A7C15ULL ^ (unsigned int)cfg->seed;
+    size_t len = 0, step = 0;
+    int i, *ee;
+
+    raybench_settracer(tracer, mesh, cfg, rtBLBadouel);
+    memset(&r, 0, sizeof(ray));
+    r.eid = 0;
+
+    while (len < count) {
+        if (r.eid <= 0 || step++ > RAYBENCH_MAX_STEP) {
+            /*launch a new photon from the source, or from the center of the initial element*/
+            r.eid = cfg->e0;
+            ee = mesh->elem + (r.eid - 1) * mesh->elemlen;
+
+            if (cfg->srctype == stPencil || cfg->srctype == stIsotropic || cfg->srctype == stCone || cfg->srctype == stArcSin) {
+                r.p0 = cfg->srcpos;
+            } else {
+                memset(&r.p0, 0, sizeof(r.p0));
+
+                for (i = 0; i < 4; i++) {
+                    vec_add(&r.p0, (float3*)(mesh->node + ee[i] - 1), &r.p0);
+                }
+
+                vec_mult(&r.p0, 0.25f, &r.p0);
+            }
+
+            r.vec.x = cfg->srcdir.x;
+            r.vec.y = cfg->srcdir.y;
+            r.vec.z = cfg->srcdir.z;
+            r.slen = -logf(raybench_rand(&seed) + 1e-12f);
+            step = 0;
+        }
+
+        rec[len].p0[0] = r.p0.x;
+        rec[len].p0[1] = r.p0.y;
+        rec[len].p0[2] = r.p0.z;
+        rec[len].vec[0] = r.vec.x;
+        rec[len].vec[1] = r.vec.y;
+        rec[len].vec[2] = r.vec.z;
+        rec[len].slen = r.slen;
+        rec[len].eid = r.eid;
+
+        r.weight = 1.f;
+        r.photontimer = 0.f;
+        r.slen = branchless_badouel_raytet(&r, tracer, cfg, visit);
+
+        if (r.pout.x == MMC_UNDEFINED || r.faceid < 0) {
+            r.eid = 0;
+            continue;
+        }
+
+        rec[len].faceid = r.faceid;
+        rec[len].isend = r.isend;
+        len++;
+
+        if (r.isend) {
+            double ct = 2.0 * raybench_rand(&seed) - 1.0, phi = TWO_PI * raybench_rand(&seed), st = sqrt(1.0 - ct * ct);
+
+            r.vec.x = st * cos(phi);
+            r.vec.y = st * sin(phi);
+            r.vec.z = ct;
+            r.slen = -logf(raybench_rand(&seed) + 1e-12f);
+        } else {
+            memcpy(&r.p0, &r.pout, sizeof(r.p0));
+            r.eid = mesh->facenb[(r.eid - 1) * mesh->elemlen + r.faceid];
+        }
+    }
+}
+
+/**
+ * \brief Replay a recorded stream through a single-ray engine
+ *
+ * \return number of tests giving the same exit face and end flag as the recording engine
+ */
+
+static size_t raybench_replay(const rayrecord* rec, size_t count, raytetfun fun, raytracer* tracer, mcconfig* cfg, visitor* visit) {
+    ray r;
+    size_t i, match = 0;
+
+    memset(&r, 0, sizeof(ray));
+
+    for (i = 0; i < count; i++) {
+        raybench_loadray(&r, rec + i);
+        fun(&r, tracer, cfg, visit);
+        match += (r.faceid == rec[i].faceid && r.isend == rec[i].isend);
+    }
+
+    return match;
+}
+
+/**
+ * \brief Replay a recorded stream through the packet engine, MMC_PACKET_LEN rays per call
+ *
+ * Only the intersection is computed, the photon is not advanced.
+ *
+ * \return number of tests giving the same exit face as the recording engine
+ */
+
+static size_t raybench_replaypacket(const rayrecord* rec, size_t count, raytracer* tracer) {
+    raypacket pk __attribute__ ((aligned(64)));
+    size_t i, j, len, match = 0;
+
+    for (i = 0; i < count; i += MMC_PACKET_LEN) {
+        len = MIN(MMC_PACKET_LEN, count - i);
+
+        for (j = 0; j < len; j++) {
+            pk.px[j] = rec[i + j].p0[0];
+            pk.py[j] = rec[i + j].p0[1];
+            pk.pz[j] = rec[i + j].p0[2];
+            pk.vx[j] = rec[i + j].vec[0];
+            pk.vy[j] = rec[i + j].vec[1];
+            pk.vz[j] = rec[i + j].vec[2];
+            pk.eid[j] = rec[i + j].eid - 1;
+        }
+
+        pk.mask = (1u << len) - 1u;
+        packet_raytet(&pk, tracer);
+
+        for (j = 0; j < len; j++) {
+            match += (pk.faceidx[j] < 4 && faceorder[pk.faceidx[j]] == rec[i + j].faceid);
+        }
+    }
+
+    return match;
+}
+
+/**
+ * \brief Save a recorded stream to a binary file
+ */
+
+static void raybench_save(const char* fname, const rayrecord* rec, size_t count, tetmesh* mesh) {
+    FILE* fp = fopen(fname, "wb");
+    unsigned int head[2] = {(unsigned int)count, (unsigned int)mesh->ne};
+
+    if (fp == NULL) {
+        MMC_ERROR(-2, "can not save the ray stream to disk");
+    }
+
+    fwrite(RAYBENCH_MAGIC, 1, 8, fp);
+    fwrite(head, sizeof(unsigned int), 2, fp);
+    fwrite(rec, sizeof(rayrecord), count, fp);
+    fclose(fp);
+}
+
+/**
+ * \brief Load a recorded stream from a binary file, the stream must be recorded on the same mesh
+ */
+
+static rayrecord* raybench_load(const char* fname, size_t* count, tetmesh* mesh) {
+    FILE* fp = fopen(fname, "rb");
+    char magic[8];
+    unsigned int head[2];
+    rayrecord* rec;
+
+    if (fp == NULL) {
+        MMC_ERROR(-2, "can not open the ray stream file");
+    }
+
+    if (fread(magic, 1, 8, fp) != 8 || memcmp(magic, RAYBENCH_MAGIC, 8) || fread(head, sizeof(unsigned int), 2, fp) != 2) {
+        MMC_ERROR(-2, "the ray stream file is corrupted");
+    }
+
+    if (head[1] != mesh->ne) {
+        MMC_ERROR(-2, "the ray stream was recorded on a different mesh");
+    }
+
+    *count = head[0];
+    rec = (rayrecord*)malloc(sizeof(rayrecord) * (*count));
+
+    if (fread(rec, sizeof(rayrecord), *count, fp) != *count) {
+        MMC_ERROR(-2, "the ray stream file is truncated");
+    }
+
+    fclose(fp);
+    return rec;
+}
+
+static void raybench_usage(char* exename) {
+    printf("\
+usage: %s <benchmark options> -- <mmc options>\n\
+where the benchmark options include (the first item in [] is the default value)\n\
+ -n [1000000]  number of ray-tet tests to record\n\
+ -r [3]        number of timed replays of the stream for each engine\n\
+ -e [PHBSK]    engines to test: P-Plucker, H-Havel, B-Badouel, S-Branch-less\n\
+               Badouel, K-packet (intersection only, no photon advance)\n\
+ -o file       save the recorded stream to a file\n\
+ -i file       replay a saved stream instead of recording one\n\
+and the mmc options define the mesh and the source, for example\n\
+       %s -n 1e6 -- --bench scale-1e6\n", exename, exename);
+}
+
+int main(int argc, char** argv) {
+    mcconfig cfg;
+    tetmesh mesh;
+    raytracer tracer = {NULL, 0, NULL, NULL, NULL};
+    visitor visit = {0.f, 0.f, 0.f, 0, 0, 0, NULL, NULL, NULL, NULL, NULL, NULL, 0, NULL, NULL, 0, NULL};
+    perfcounter pc;
+    rayrecord* rec = NULL;
+    size_t count = 1000000, match, datalen;
+    int i, j, repeat = 3, mmcargc = 1;
+    char* engineflag = "PHBSK", *fout = NULL, *fin = NULL;
+    char** mmcargv = NULL;
+
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--") == 0) {
+            mmcargc = argc - i;
+            mmcargv = argv + i;
+            break;
+        } else if (argv[i][0] == '-' && argv[i][1] != '\0' && argv[i][2] == '\0' && i < argc - 1 && strchr("nreoi", argv[i][1])) {
+            switch (argv[i++][1]) {
+                case 'n':
+                    count = (size_t)atof(argv[i]);
+                    break;
+
+                case 'r':
+                    repeat = atoi(argv[i]);
+                    break;
+
+                case 'e':
+                    engineflag = argv[i];
+                    break;
+
+                case 'o':
+                    fout = argv[i];
+                    break;
+
+                case 'i':
+                    fin = argv[i];
+                    break;
+            }
+        } else {
+            raybench_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (mmcargv == NULL || mmcargc < 2 || count == 0 || repeat <= 0) {
+        raybench_usage(argv[0]);
+        return 1;
+    }
+
+    /*the program name is passed to the mmc command line parser in place of "--"*/
+    mmcargv[0] = argv[0];
+    mmc_init_from_cmd(&cfg, &mesh, &tracer, mmcargc, mmcargv);
+
+    /*all engines deposit the energy loss to the elements, so they do the same work*/
+    cfg.basisorder = 0;
+    cfg.method = rtBLBadouel;
+    mmc_prep(&cfg, &mesh, &tracer);
+
+    datalen = (size_t)mesh.ne * cfg.srcnum * cfg.maxgate;
+    free(mesh.weight);
+    mesh.weight = (double*)calloc(datalen, sizeof(double));
+
+    visit.rtstep = 1.f / cfg.tstep;
+    visitor_init(&cfg, &visit);
+
+#ifdef MMC_USE_SSE
+    {
+        /*the SSE4 engines use this constant, it is otherwise set when a photon is launched*/
+        const float int_coef_arr[4] = { -1.f, -1.f, -1.f, 1.f };
+        int_coef = _mm_loadu_ps(int_coef_arr);
+    }
+#endif
+
+    if (fin) {
+        rec = raybench_load(fin, &count, &mesh);
+    } else {
+        rec = (rayrecord*)malloc(sizeof(rayrecord) * count);
+        raybench_record(rec, count, &tracer, &mesh, &cfg, &visit);
+    }
+
+    if (fout) {
+        raybench_save(fout, rec, count, &mesh);
+    }
+
+    perf_open(&pc);
+
+    MMC_FPRINTF(stdout, "mesh: %d nodes, %d elements; stream: %zu tests, %d replays\n", mesh.nn, mesh.ne, count, repeat);
+    MMC_FPRINTF(stdout, "cycles are %s\n", (pc.fd[0] >= 0) ? "counted by the hardware performance counters" : "time-stamp counter ticks (no access to the hardware counters)");
+    MMC_FPRINTF(stdout, "%-28s %10s %12s %12s %8s\n", "engine", "ns/test", "cycles/test", "instr/test", "match");
+
+    for (j = 0; j < sizeof(engines) / sizeof(engines[0]); j++) {
+        unsigned long long t0, tsc0, dt, dtsc, ncycle = 0, ninstr = 0;
+        double ntest = (double)count * repeat;
+
+        if (strchr(engineflag, engines[j].flag) == NULL) {
+            continue;
+        }
+
+        raybench_settracer(&tracer, &mesh, &cfg, engines[j].method);
+
+        /*warm up the caches and branch predictors, and check the exit faces*/
+        if (engines[j].fun) {
+            match = raybench_replay(rec, count, engines[j].fun, &tracer, &cfg, &visit);
+        } else {
+            match = raybench_replaypacket(rec, count, &tracer);
+        }
+
+        perf_start(&pc);
+        tsc0 = raybench_tsc();
+        t0 = GetTimeNanos();
+
+        for (i = 0; i < repeat; i++) {
+            if (engines[j].fun) {
+                raybench_replay(rec, count, engines[j].fun, &tracer, &cfg, &visit);
+            } else {
+                raybench_replaypacket(rec, count, &tracer);
+            }
+        }
+
+        dt = GetTimeNanos() - t0;
+        dtsc = raybench_tsc() - tsc0;
+        perf_stop(&pc);
+
+        ncycle = (pc.fd[0] >= 0) ? pc.value[0] : dtsc;
+        ninstr = pc.value[1];
+
+        MMC_FPRINTF(stdout, "%-28s %10.2f %12.2f ", engines[j].name, dt / ntest, ncycle / ntest);
+
+        if (pc.fd[1] >= 0) {
+            MMC_FPRINTF(stdout, "%12.2f ", ninstr / ntest);
+        } else {
+            MMC_FPRINTF(stdout, "%12s ", "-");
+        }
+
+        MMC_FPRINTF(stdout, "%7.3f%%\n", 100.0 * match / count);
+    }
+
+    perf_close(&pc);
+    free(rec);
+    visitor_clear(&visit);
+    mmc_cleanup(&cfg, &mesh, &tracer);
+    return 0;
+}
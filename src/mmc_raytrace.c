@@ -44,13 +44,53 @@
 /**<  Macro to enable SSE4 based ray-tracers */
 
 #ifdef MMC_USE_SSE
-    #include <smmintrin.h>
-    __m128 int_coef;                            /**<  a global variable used for SSE4 ray-tracers */
+    #include "mmc_simd.h"
+    __m128 int_coef = {-1.f, -1.f, -1.f, 1.f};  /**<  a global variable used for SSE4 ray-tracers, not set at launch as a --domain rank may only receive photons */
+#endif
+
+/**<  Macro to enable the AVX2/AVX-512 packet ray-tracers, selected at runtime via CPUID */
+
+#if defined(MMC_USE_SSE) && !defined(__EMSCRIPTEN__) && !defined(MMC_SIMD_PORTABLE) && (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+    #define MMC_USE_AVX_PACKET
+    #include <immintrin.h>
 #endif
 
 #define F32N(a) ((a) & 0x80000000)          /**<  Macro to test if a floating point is negative */
 #define F32P(a) ((a) ^ 0x80000000)          /**<  Macro to test if a floating point is positive */
 
+/**
+ * Feature bits of the specialized ray-tet advance functions: a cleared bit
+ * removes the run-time test of that feature from the specialized copy
+ */
+
+#define MMC_SPEC_IMPLICIT  0x01   /**< implicit ROIs (cfg->implicit) */
+#define MMC_SPEC_NODAL     0x02   /**< nodal output (cfg->basisorder) */
+#define MMC_SPEC_GRID      0x04   /**< dual-grid output (-M G) */
+#define MMC_SPEC_REPLAY    0x08   /**< replay outputs (-O J/L/P) */
+#define MMC_SPEC_PATTERN   0x10   /**< multiple source patterns */
+#define MMC_SPEC_FREQ      0x20   /**< frequency-domain outputs */
+#define MMC_SPEC_ALBEDO    0x40   /**< albedo-weight (MCML) photon weight update */
+#define MMC_SPEC_DEBUG     0x80   /**< accumulation debug output (-D A) */
+#define MMC_SPEC_TRACE     0x100  /**< per-photon trace output of the photon stages (-D M/W/X/E, trajectories) */
+#define MMC_SPEC_TIME      0x200  /**< time-resolved output (cfg->maxgate > 1), a cleared bit gives the continuous-wave copy */
+#define MMC_SPEC_ALL       0x3FF  /**< the generic copy, testing all features at run-time */
+
+#define MMC_TRACE_FLAGS    (dlMove | dlWeight | dlEdge | dlExit | dlTraj)                     /**< debug flags tested by the photon stages */
+#define MMC_TRACE(spec, cfg, flag) (((spec) & MMC_SPEC_TRACE) && ((cfg)->debuglevel & (flag))) /**< 1 if the trace output flag is set */
+#define MMC_STAGE(spec, fun)  (((spec) & MMC_SPEC_TRACE) ? fun : fun##_release)               /**< the instrumented or the release copy of a photon stage */
+
+#define SPEC_MCX(spec, cfg)   (!((spec) & MMC_SPEC_ALBEDO) || (cfg)->mcmethod == mmMCX) /**< 1 if the photon weight decays along the path */
+#define SPEC_NODAL(spec, cfg) (((spec) & MMC_SPEC_NODAL) && (cfg)->basisorder)         /**< 1 if the output is nodal */
+#define SPEC_TIME(spec, cfg)  (((spec) & MMC_SPEC_TIME) && (cfg)->maxgate > 1)           /**< 1 if the output has more than one time gate */
+
+#if defined(__GNUC__) || defined(__clang__)
+    #define MMC_SPEC_INLINE static inline __attribute__((always_inline))
+#elif defined(_MSC_VER)
+    #define MMC_SPEC_INLINE static __forceinline
+#else
+    #define MMC_SPEC_INLINE static inline
+#endif
+
 /**
  * \mapping from edge index to node index
  */
@@ -140,6 +180,258 @@ extern const int ifaceorder[4];
 
 const char maskmap[16] = {4, 0, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 3, 3};
 
+/**
+ * \brief Return the address of a row of the sparse output, allocating its page if needed
+ *
+ * \param[in,out] weightpage: the page table of the sparse output, i.e. mesh->weightpage
+ * \param[in] idx: the index of the output element/node, excluding the pattern dimension
+ * \param[in] srcnum: the number of patterns stored in each row
+ */
+
+static inline double* pagedweight(double** weightpage, size_t idx, int srcnum) {
+    double* page;
+
+    #pragma omp atomic read
+    page = weightpage[idx >> MMC_WEIGHT_PAGE_BITS];
+
+    if (page == NULL) {
+        page = mesh_allocweightpage(weightpage, idx >> MMC_WEIGHT_PAGE_BITS, srcnum);
+    }
+
+    return page + (idx & (MMC_WEIGHT_PAGE_LEN - 1)) * srcnum;
+}
+
+/**
+ * \brief Accumulate the energy loss to the output buffer
+ *
+ * If the thread owns a private output buffer (visit->weight), the value is
+ * added without synchronization; otherwise, it is atomically added to the
+ * shared output buffer, or to its page if the output is sparse.
+ *
+ * \param[in,out] weight: the shared output buffer, i.e. mesh->weight
+ * \param[in] visit: statistics counters of this thread
+ * \param[in] idx: the index of the output element
+ * \param[in] val: the value to be added
+ */
+
+static inline void accumweight(double* weight, visitor* visit, size_t idx, double val) {
+    if (visit->weight) {
+        visit->weight[idx] += val;
+    } else {
+        double* dst = (visit->weightpage) ? pagedweight(visit->weightpage, idx, 1) : weight + idx;
+
+        #pragma omp atomic
+        *dst += val;
+    }
+}
+
+/**
+ * \brief Accumulate the energy loss of a photon shared by all source patterns
+ *
+ * The outputs of all patterns of an element/node are stored contiguously,
+ * i.e. [frame][elem][pattern], and so is the launch pattern row of a photon,
+ * therefore the loop over the patterns is vectorized when the thread owns a
+ * private output buffer; otherwise each pattern is added atomically.
+ *
+ * \param[in,out] weight: the shared output buffer, i.e. mesh->weight
+ * \param[in] visit: statistics counters of this thread
+ * \param[in] idx: the index of the output element/node, excluding the pattern dimension
+ * \param[in] val: the value to be added, scaled by the pattern weights
+ * \param[in] pattern: the weights of all patterns at the launch position of the photon
+ * \param[in] srcnum: the number of patterns
+ */
+
+static inline void accumpattern(double* weight, visitor* visit, size_t idx, double val, const float* pattern, int srcnum) {
+    int i;
+
+    if (visit->weight) {
+        double* dst = visit->weight + idx * srcnum;
+
+        #pragma omp simd
+        for (i = 0; i < srcnum; i++) {
+            dst[i] += val * pattern[i];
+        }
+    } else {
+        double* dst = (visit->weightpage) ? pagedweight(visit->weightpage, idx, srcnum) : weight + idx * srcnum;
+
+        /*the rows of a source list (and of sparse patterns) are mostly zero, skip their atomics*/
+        for (i = 0; i < srcnum; i++) {
+            if (pattern[i] != 0.f) {
+                #pragma omp atomic
+                dst[i] += val * pattern[i];
+            }
+        }
+    }
+}
+
+/**
+ * \brief Accumulate the share of a node of the enclosing tet in the nodal output
+ *
+ * With --elemmoment, the shares are added to the 4 corners of the tet in
+ * visit->elemweight, [frame][elem][corner][pattern], instead of the shared
+ * nodes, which are the most contended addresses of the atomic output; the
+ * corners are summed to the nodes by mesh_scatterelemweight() after the run.
+ *
+ * \param[in] mesh: the mesh data structure
+ * \param[in] visit: statistics counters of this thread
+ * \param[in] tshift: the index of the 1st node of the output frame, a multiple of mesh->nn
+ * \param[in] eid: the index of the enclosing tet, starting from 0
+ * \param[in] corner: the local index (0-3) of the node in the tet
+ * \param[in] val: the value to be added
+ * \param[in] pattern: the weights of all patterns at the launch position of the photon, NULL for a single source
+ * \param[in] srcnum: the number of patterns
+ */
+
+static inline void accumnode(tetmesh* mesh, visitor* visit, size_t tshift, int eid, int corner, double val, const float* pattern, int srcnum) {
+    if (visit->elemweight) {
+        double* dst = visit->elemweight + (((tshift / mesh->nn) * mesh->ne + eid) * 4 + corner) * (pattern ? srcnum : 1);
+        int i;
+
+        if (pattern == NULL) {
+            #pragma omp atomic
+            *dst += val;
+            return;
+        }
+
+        for (i = 0; i < srcnum; i++) {
+            if (pattern[i] != 0.f) {
+                #pragma omp atomic
+                dst[i] += val * pattern[i];
+            }
+        }
+    } else if (pattern) {
+        accumpattern(mesh->weight, visit, tshift + mesh->elem[eid * mesh->elemlen + corner] - 1, val, pattern, srcnum);
+    } else {
+        accumweight(mesh->weight, visit, tshift + mesh->elem[eid * mesh->elemlen + corner] - 1, val);
+    }
+}
+
+/**
+ * \brief Return the output frame of a replayed photon in the wl/wp Jacobian mode
+ *
+ * The frame is the time gate of the recorded time-of-flight; when all detectors
+ * are replayed in one pass (-P -1), each detector owns cfg->maxgate frames.
+ *
+ * \param[in] cfg: simulation configuration
+ * \param[in] r: the current ray
+ * \param[in] visit: statistics counters of this thread
+ */
+
+static inline int replayframe(mcconfig* cfg, ray* r, visitor* visit) {
+    int frame = MIN( ((int)(cfg->replaytime[r->photonid] * visit->rtstep)), cfg->maxgate - 1 );
+
+    if (cfg->replaydetid) {
+        frame += (cfg->replaydetid[r->photonid] - 1) * cfg->maxgate;
+    }
+
+    return frame;
+}
+
+/**
+ * \brief Attenuate the weights of the additional wavelengths over the last move and accumulate their losses
+ *
+ * In the multi-wavelength mode, the path is sampled with the scattering coefficient
+ * of the 1st wavelength, so the weight of wavelength k is attenuated by
+ * exp(-(mua_k+mus_k-mus)*L) over a move of length L; the path-length integral
+ * of the weight (or the absorbed energy for -O E) is added to the output block
+ * of that wavelength.
+ *
+ * \param[in,out] r: the current ray, after r->Lmove and r->photontimer are updated for this move
+ * \param[in] mesh: the mesh data structure
+ * \param[in] cfg: simulation configuration
+ * \param[in] visit: statistics counters of this thread
+ * \param[in] prop: the medium of the 1st wavelength along the move
+ * \param[in] eid: the index of the enclosing tet, starting from 0
+ * \param[in] nodew: with the nodal basis, the share of each node of the tet, NULL for the element basis
+ */
+
+static void accumwave(ray* r, tetmesh* mesh, mcconfig* cfg, visitor* visit, medium* prop, int eid, float* nodew) {
+    int k, i, medlen = mesh->prop + 1 + cfg->isextdet;
+    int datalen = (cfg->basisorder) ? mesh->nn : mesh->ne;
+    size_t idx;
+    float mua, dmus, tot, plen;
+
+    idx = (size_t)MIN( ((int)((r->photontimer - cfg->tstart) * visit->rtstep)), cfg->maxgate - 1 ) * datalen;
+
+    for (k = 0; k < cfg->wavenum - 1; k++) {
+        medium* med = mesh->wavemed + k * medlen + (prop - mesh->med);
+
+        mua = med->mua;
+        dmus = med->mus - prop->mus;
+        tot = mua + dmus;
+        plen = (fabsf(tot * r->Lmove) > EPS) ? (1.f - expf(-tot * r->Lmove)) / tot : r->Lmove;
+        plen *= r->wavew[k];
+        r->wavew[k] *= expf(-tot * r->Lmove);
+
+        if (cfg->outputtype == otEnergy) {
+            plen *= mua;
+        }
+
+        idx += (size_t)cfg->maxgate * datalen;
+
+        if (nodew == NULL) {
+            accumweight(mesh->weight, visit, idx + eid, plen);
+        } else {
+            for (i = 0; i < 4; i++) {
+                if (nodew[i] != 0.f) {
+                    accumnode(mesh, visit, idx, eid, i, plen * nodew[i], NULL, 1);
+                }
+            }
+        }
+    }
+}
+
+/**
+ * \brief Accumulate a deposit to the frequency-domain outputs
+ *
+ * The value deposited to a time gate is also added to the real and imaginary
+ * frames of each modulation frequency, weighted by exp(-i*w*t) at the time t
+ * when the deposit is made, so the output is the Fourier transform of the
+ * time-resolved output regardless of the time gate width.
+ *
+ * \param[in] r: the current ray
+ * \param[in] mesh: the mesh data structure
+ * \param[in] cfg: simulation configuration
+ * \param[in] visit: statistics counters of this thread
+ * \param[in] idx: the index of the output element (tet or grid voxel), starting from 0
+ * \param[in] nodew: with the nodal basis, the share of each node of tet idx, NULL for the element basis
+ * \param[in] val: the value deposited to the time gate
+ * \param[in] t: the time of the deposit
+ */
+
+static void accumfreq(ray* r, tetmesh* mesh, mcconfig* cfg, visitor* visit, size_t idx, float* nodew, float val, float t) {
+    int k, i, j, datalen = (cfg->method == rtBLBadouelGrid) ? cfg->crop0.z : ( (cfg->basisorder) ? mesh->nn : mesh->ne);
+    float* pattern = MMC_MULTISRC(cfg) ? cfg->srcpattern + r->posidx * cfg->srcnum : NULL;
+    double phase, part[2];
+    size_t frame;
+
+    for (k = 0; k < cfg->freqnum; k++) {
+        phase = TWO_PI * cfg->freq[k] * t;
+        part[0] = val * cos(phase);
+        part[1] = -val * sin(phase);
+
+        for (j = 0; j < 2; j++) {
+            frame = (size_t)(cfg->maxgate + 2 * k + j) * datalen;
+
+            for (i = 0; i < ((nodew) ? 4 : 1); i++) {
+                double dw = (nodew) ? part[j] * nodew[i] : part[j];
+
+                if (dw == 0.0) {
+                    continue;
+                }
+
+                if (nodew) {
+                    accumnode(mesh, visit, frame, (int)idx, i, dw, pattern, cfg->srcnum);
+                } else if (pattern) {
+                    accumpattern(mesh->weight, visit, frame + idx, dw, pattern, cfg->srcnum);
+                } else {
+                    accumweight(mesh->weight, visit, frame + idx, dw);
+                }
+            }
+        }
+    }
+}
+
 /**
  * \brief function to linearly interpolate between 3 3D points (p1,p2,p3) using weight (w)
  *
@@ -217,7 +509,7 @@ float plucker_raytet(ray* r, raytracer* tracer, mcconfig* cfg, visitor* visit) {
 
     float3 pcrx = {0.f}, p1 = {0.f};
     medium* prop;
-    int* ee;
+    int* ee, *edge = NULL;
     int i, tshift, eid, faceidx = -1;
     float w[6] = {0.f}, Rv, ww, currweight, dlen = 0.f, rc, mus; /*dlen is the physical distance*/
     unsigned int* wi = (unsigned int*)w;
@@ -235,19 +527,26 @@ float plucker_raytet(ray* r, raytracer* tracer, mcconfig* cfg, visitor* visit) {
     vec_add(&(r->p0), &(r->vec), &p1);
     vec_cross(&(r->p0), &p1, &pcrx);
     ee = (int*)(tracer->mesh->elem + eid * tracer->mesh->elemlen);
-    prop = tracer->mesh->med + (tracer->mesh->type[eid]);
+    prop = MESH_ELEMMED(tracer->mesh, eid);
     rc = prop->n * R_C0;
     currweight = r->weight;
     mus = (cfg->mcmethod == mmMCX) ? prop->mus : (prop->mua + prop->mus);
 
+    /*with --edgetable, the 6 edges are looked up in the unique edge table, see tracer_buildedge*/
+    if (tracer->edge) {
+        edge = tracer->edge + eid * 6;
+    }
+
 #ifdef MMC_USE_SSE
     {
         __m128 O = _mm_load_ps(&(r->vec.x));
         __m128 M, D, T = _mm_load_ps(&(pcrx.x));
 
         for (i = 0; i < 6; i++) {
-            D = _mm_load_ps(&(tracer->d[(eid) * 6 + i].x));
-            M = _mm_load_ps(&(tracer->m[(eid) * 6 + i].x));
+            int id = (edge ? (edge[i] >> 1) : (eid) * 6 + i);
+
+            D = _mm_load_ps(&(tracer->d[id].x));
+            M = _mm_load_ps(&(tracer->m[id].x));
 #ifdef __SSE4_1__
             w[i] = _mm_cvtss_f32(_mm_add_ss(_mm_dp_ps(O, M, 0x7F), _mm_dp_ps(T, D, 0x7F)));
 #else
@@ -264,11 +563,20 @@ float plucker_raytet(ray* r, raytracer* tracer, mcconfig* cfg, visitor* visit) {
 #else
 
     for (i = 0; i < 6; i++) {
-        w[i] = pinner(&(r->vec), &pcrx, tracer->d + (eid) * 6 + i, tracer->m + (eid) * 6 + i);
+        int id = (edge ? (edge[i] >> 1) : (eid) * 6 + i);
+
+        w[i] = pinner(&(r->vec), &pcrx, tracer->d + id, tracer->m + id);
     }
 
 #endif
 
+    /*a reversed edge negates both d and m, thus the sign of the Plucker product*/
+    for (i = 0; i < 6 && edge; i++) {
+        if (edge[i] & 1) {
+            w[i] = -w[i];
+        }
+    }
+
     //exit(1);
     if (cfg->debuglevel & dlTracing) {
         MMC_FPRINTF(cfg->flog, "%d \n", eid);
@@ -310,11 +618,13 @@ float plucker_raytet(ray* r, raytracer* tracer, mcconfig* cfg, visitor* visit) {
 #ifdef MMC_USE_SSE
                 int nexteid = (r->nexteid - 1) * 6;
 
-                if (r->nexteid > 0) {
+                if (r->nexteid > 0 && edge) {
+                    _mm_prefetch((char*)(tracer->edge + nexteid), _MM_HINT_T0);
+                } else if (r->nexteid > 0) {
                     _mm_prefetch((char*) & ((tracer->m + nexteid)->x), _MM_HINT_T0);
-                    _mm_prefetch((char*) & ((tracer->m + (nexteid) * 6 + 4)->x), _MM_HINT_T0);
-                    _mm_prefetch((char*) & ((tracer->d + (nexteid) * 6)->x), _MM_HINT_T0);
-                    _mm_prefetch((char*) & ((tracer->d + (nexteid) * 6 + 4)->x), _MM_HINT_T0);
+                    _mm_prefetch((char*) & ((tracer->m + nexteid + 4)->x), _MM_HINT_T0);
+                    _mm_prefetch((char*) & ((tracer->d + nexteid)->x), _MM_HINT_T0);
+                    _mm_prefetch((char*) & ((tracer->d + nexteid + 4)->x), _MM_HINT_T0);
                 }
 
 #endif
@@ -326,6 +636,7 @@ float plucker_raytet(ray* r, raytracer* tracer, mcconfig* cfg, visitor* visit) {
     }
 
     visit->raytet++;
+    MMC_HEAT(visit->heatmap, eid, hmRayTet);
 
     if (tracer->mesh->type[eid] == 0) {
         visit->raytet0++;
@@ -376,23 +687,25 @@ float plucker_raytet(ray* r, raytracer* tracer, mcconfig* cfg, visitor* visit) {
             r->photontimer += r->Lmove * rc;
 
             if (cfg->outputtype == otWL || cfg->outputtype == otWP) {
-                tshift = MIN( ((int)(cfg->replaytime[r->photonid] * visit->rtstep)), cfg->maxgate - 1 ) * tracer->mesh->ne;
+                tshift = replayframe(cfg, r, visit) * MESH_ELEMOUT(tracer->mesh);
             } else {
-                tshift = MIN( ((int)((r->photontimer - cfg->tstart) * visit->rtstep)), cfg->maxgate - 1 ) * tracer->mesh->ne;
+                tshift = MIN( ((int)((r->photontimer - cfg->tstart) * visit->rtstep)), cfg->maxgate - 1 ) * MESH_ELEMOUT(tracer->mesh);
             }
 
             if (cfg->mcmethod == mmMCX) {
-                if (cfg->srctype != stPattern || cfg->srcnum == 1) {
-                    #pragma omp atomic
-                    tracer->mesh->weight[eid + tshift] += ww;
-                } else if (cfg->srctype == stPattern) { // must be pattern and srcnum more than 1
-                    int pidx; // pattern index
-
-                    for (pidx = 0; pidx < cfg->srcnum; pidx++) {
-                        #pragma omp atomic
-                        tracer->mesh->weight[(eid + tshift)*cfg->srcnum + pidx] += ww * cfg->srcpattern[r->posidx * cfg->srcnum + pidx];
-                    }
+                if (!MMC_MULTISRC(cfg)) {
+                    accumweight(tracer->mesh->weight, visit, MESH_OUTROW(tracer->mesh, eid, tshift), ww);
+                } else { // multiple source patterns or listed sources
+                    accumpattern(tracer->mesh->weight, visit, MESH_OUTROW(tracer->mesh, eid, tshift), ww, cfg->srcpattern + r->posidx * cfg->srcnum, cfg->srcnum);
                 }
+
+                if (cfg->freqnum > 0) {
+                    accumfreq(r, tracer->mesh, cfg, visit, eid, NULL, ww, r->photontimer - 0.5f * r->Lmove * rc);
+                }
+            }
+
+            if (r->wavew) {
+                accumwave(r, tracer->mesh, cfg, visit, prop, eid, NULL);
             }
         } else {
             if (cfg->debuglevel & dlBary) MMC_FPRINTF(cfg->flog, "Y [%f %f %f %f]\n",
@@ -411,7 +724,7 @@ float plucker_raytet(ray* r, raytracer* tracer, mcconfig* cfg, visitor* visit) {
                     }
 
                     if (cfg->outputtype == otWL || cfg->outputtype == otWP) {
-                        tshift = MIN( ((int)(cfg->replaytime[r->photonid] * visit->rtstep)), cfg->maxgate - 1 ) * tracer->mesh->nn;
+                        tshift = replayframe(cfg, r, visit) * tracer->mesh->nn;
                     } else {
                         tshift = MIN( ((int)((r->photontimer - cfg->tstart) * visit->rtstep)), cfg->maxgate - 1 ) * tracer->mesh->nn;
                     }
@@ -430,28 +743,46 @@ float plucker_raytet(ray* r, raytracer* tracer, mcconfig* cfg, visitor* visit) {
                     }
 
                     if (cfg->mcmethod == mmMCX) {
-                        if (cfg->srctype != stPattern || cfg->srcnum == 1) {
+                        if (!MMC_MULTISRC(cfg)) {
                             for (i = 0; i < 4; i++) {
-                                #pragma omp atomic
-                                tracer->mesh->weight[ee[i] - 1 + tshift] += ww * (baryp0[i] + baryout[i]);
+                                accumnode(tracer->mesh, visit, tshift, eid, i, ww * (baryp0[i] + baryout[i]), NULL, 1);
                             }
-                        } else if (cfg->srctype == stPattern) { // must be pattern and srcnum more than 1
-                            int pidx; // pattern index
+                        } else { // multiple source patterns or listed sources
+                            for (i = 0; i < 4; i++) {
+                                accumnode(tracer->mesh, visit, tshift, eid, i, ww * (baryp0[i] + baryout[i]), cfg->srcpattern + r->posidx * cfg->srcnum, cfg->srcnum);
+                            }
+                        }
 
-                            for (pidx = 0; pidx < cfg->srcnum; pidx++) {
-                                for (i = 0; i < 4; i++) {
-                                    #pragma omp atomic
-                                    tracer->mesh->weight[(ee[i] - 1 + tshift)*cfg->srcnum + pidx] += ww * cfg->srcpattern[r->posidx * cfg->srcnum + pidx] * (baryp0[i] + baryout[i]);
-                                }
+                        if (cfg->freqnum > 0) {
+                            float nodew[4];
+
+                            for (i = 0; i < 4; i++) {
+                                nodew[i] = baryp0[i] + baryout[i];
                             }
+
+                            accumfreq(r, tracer->mesh, cfg, visit, eid, nodew, ww, r->photontimer - 0.5f * r->Lmove * rc);
                         }
                     }
                 }
 
-                if (r->isend) {
+                if (r->wavew) {
+                    float nodew[4];
+
+                    /*baryout is only moved to the end of a partial move above if mua>0*/
+                    ratio = (r->isend && prop->mua <= 0.f) ? r->Lmove / Lp0 : 1.f;
+
+                    for (i = 0; i < 4; i++) {
+                        nodew[i] = 0.5f * (baryp0[i] + (1.f - ratio) * baryp0[i] + ratio * baryout[i]);
+                    }
+
+                    accumwave(r, tracer->mesh, cfg, visit, prop, eid, nodew);
+                }
+
+                /*at an exterior face (nexteid<0), the photon exits or is reflected back into this element, as in havel_raytet*/
+                if (r->isend || r->nexteid <= 0) {
                     memcpy(baryp0, baryout, sizeof(float4));
                 } else {
-                    if (r->nexteid && faceidx >= 0) {
+                    if (faceidx >= 0) {
                         int j, k, *nextenb = (int*)(tracer->mesh->elem + (r->nexteid - 1) * tracer->mesh->elemlen);
                         memset(baryp0, 0, sizeof(float4));
 
@@ -482,7 +813,8 @@ inline __m128 rcp_nr(const __m128 a) {
     return _mm_sub_ps(_mm_add_ps(r, r), _mm_mul_ps(_mm_mul_ps(r, a), r));
 }
 
-#if !defined(__EMSCRIPTEN__)
+/*emscripten maps the SSE4 intrinsics to wasm SIMD128 when built with -msimd128 -msse4.1 (make web)*/
+#if !defined(__EMSCRIPTEN__) || defined(__SSE4_1__)
 
 /**
  * \brief Havel-based SSE4 ray-triangle intersection test
@@ -561,7 +893,7 @@ float havel_raytet(ray* r, raytracer* tracer, mcconfig* cfg, visitor* visit) {
 
     medium* prop;
     int* ee = (int*)(tracer->mesh->elem + eid * tracer->mesh->elemlen);
-    prop = tracer->mesh->med + (tracer->mesh->type[eid]);
+    prop = MESH_ELEMMED(tracer->mesh, eid);
     rc = prop->n * R_C0;
     currweight = r->weight;
     mus = (cfg->mcmethod == mmMCX) ? prop->mus : (prop->mua + prop->mus);
@@ -647,9 +979,9 @@ float havel_raytet(ray* r, raytracer* tracer, mcconfig* cfg, visitor* visit) {
             }
 
             if (cfg->outputtype == otWL || cfg->outputtype == otWP) {
-                tshift = MIN( ((int)(cfg->replaytime[r->photonid] * visit->rtstep)), cfg->maxgate - 1 ) * (cfg->basisorder ? tracer->mesh->nn : tracer->mesh->ne);
+                tshift = replayframe(cfg, r, visit) * (cfg->basisorder ? tracer->mesh->nn : MESH_ELEMOUT(tracer->mesh));
             } else {
-                tshift = MIN( ((int)((r->photontimer - cfg->tstart) * visit->rtstep)), cfg->maxgate - 1 ) * (cfg->basisorder ? tracer->mesh->nn : tracer->mesh->ne);
+                tshift = MIN( ((int)((r->photontimer - cfg->tstart) * visit->rtstep)), cfg->maxgate - 1 ) * (cfg->basisorder ? tracer->mesh->nn : MESH_ELEMOUT(tracer->mesh));
             }
 
             if (cfg->debuglevel & dlAccum) MMC_FPRINTF(cfg->flog, "A %f %f %f %e %d %e\n",
@@ -710,43 +1042,52 @@ float havel_raytet(ray* r, raytracer* tracer, mcconfig* cfg, visitor* visit) {
             //    MMC_FPRINTF(cfg->flog,"new bary0=[%f %f %f %f]\n",r->bary0.x,r->bary0.y,r->bary0.z,r->bary0.w);
             if (cfg->mcmethod == mmMCX) {
                 if (!cfg->basisorder) {
-                    if (cfg->srctype != stPattern || cfg->srcnum == 1) {
-                        #pragma omp atomic
-                        tracer->mesh->weight[eid + tshift] += ww;
-                    } else if (cfg->srctype == stPattern) { // must be pattern and srcnum more than 1
-                        int pidx; // pattern index
-
-                        for (pidx = 0; pidx < cfg->srcnum; pidx++) {
-                            #pragma omp atomic
-                            tracer->mesh->weight[(eid + tshift)*cfg->srcnum + pidx] += ww * cfg->srcpattern[r->posidx * cfg->srcnum + pidx];
-                        }
+                    if (!MMC_MULTISRC(cfg)) {
+                        accumweight(tracer->mesh->weight, visit, MESH_OUTROW(tracer->mesh, eid, tshift), ww);
+                    } else { // multiple source patterns or listed sources
+                        accumpattern(tracer->mesh->weight, visit, MESH_OUTROW(tracer->mesh, eid, tshift), ww, cfg->srcpattern + r->posidx * cfg->srcnum, cfg->srcnum);
                     }
                 } else {
                     T = _mm_mul_ps(_mm_add_ps(O, S), _mm_set1_ps(ww * 0.5f));
                     _mm_store_ps(barypout, T);
 
-                    if (cfg->srctype != stPattern || cfg->srcnum == 1) {
+                    if (!MMC_MULTISRC(cfg)) {
                         for (j = 0; j < 4; j++) {
-                            #pragma omp atomic
-                            tracer->mesh->weight[ee[j] - 1 + tshift] += barypout[j];
+                            accumnode(tracer->mesh, visit, tshift, eid, j, barypout[j], NULL, 1);
                         }
-                    } else if (cfg->srctype == stPattern) {
-                        int pidx; // pattern index
-
-                        for (pidx = 0; pidx < cfg->srcnum; pidx++) {
-                            for (j = 0; j < 4; j++) {
-                                #pragma omp atomic
-                                tracer->mesh->weight[(ee[j] - 1 + tshift)*cfg->srcnum + pidx] += barypout[j] * cfg->srcpattern[r->posidx * cfg->srcnum + pidx];
-                            }
+                    } else {
+                        for (j = 0; j < 4; j++) {
+                            accumnode(tracer->mesh, visit, tshift, eid, j, barypout[j], cfg->srcpattern + r->posidx * cfg->srcnum, cfg->srcnum);
                         }
                     }
                 }
+
+                if (cfg->freqnum > 0) {
+                    float nodew[4];
+
+                    if (cfg->basisorder) {
+                        _mm_storeu_ps(nodew, _mm_mul_ps(_mm_add_ps(O, S), _mm_set1_ps(0.5f)));
+                    }
+
+                    accumfreq(r, tracer->mesh, cfg, visit, eid, (cfg->basisorder ? nodew : NULL), ww, r->photontimer - 0.5f * r->Lmove * rc);
+                }
+            }
+
+            if (r->wavew) {
+                float nodew[4];
+
+                if (cfg->basisorder) {
+                    _mm_storeu_ps(nodew, _mm_mul_ps(_mm_add_ps(O, S), _mm_set1_ps(0.5f)));
+                }
+
+                accumwave(r, tracer->mesh, cfg, visit, prop, eid, (cfg->basisorder ? nodew : NULL));
             }
 
             break;
         }
 
     visit->raytet++;
+    MMC_HEAT(visit->heatmap, eid, hmRayTet);
 
     if (tracer->mesh->type[eid] == 0) {
         visit->raytet0++;
@@ -821,7 +1162,7 @@ float badouel_raytet(ray* r, raytracer* tracer, mcconfig* cfg, visitor* visit) {
         medium* prop;
         int* ee = (int*)(tracer->mesh->elem + eid * tracer->mesh->elemlen);
         float mus;
-        prop = tracer->mesh->med + (tracer->mesh->type[eid]);
+        prop = MESH_ELEMMED(tracer->mesh, eid);
         rc = prop->n * R_C0;
         currweight = r->weight;
 
@@ -875,9 +1216,9 @@ float badouel_raytet(ray* r, raytracer* tracer, mcconfig* cfg, visitor* visit) {
             r->photontimer += r->Lmove * rc;
 
             if (cfg->outputtype == otWL || cfg->outputtype == otWP) {
-                tshift = MIN( ((int)(cfg->replaytime[r->photonid] * visit->rtstep)), cfg->maxgate - 1 ) * (cfg->basisorder ? tracer->mesh->nn : tracer->mesh->ne);
+                tshift = replayframe(cfg, r, visit) * (cfg->basisorder ? tracer->mesh->nn : MESH_ELEMOUT(tracer->mesh));
             } else {
-                tshift = MIN( ((int)((r->photontimer - cfg->tstart) * visit->rtstep)), cfg->maxgate - 1 ) * (cfg->basisorder ? tracer->mesh->nn : tracer->mesh->ne);
+                tshift = MIN( ((int)((r->photontimer - cfg->tstart) * visit->rtstep)), cfg->maxgate - 1 ) * (cfg->basisorder ? tracer->mesh->nn : MESH_ELEMOUT(tracer->mesh));
             }
 
             if (cfg->debuglevel & dlAccum) MMC_FPRINTF(cfg->flog, "A %f %f %f %e %d %e\n",
@@ -889,11 +1230,12 @@ float badouel_raytet(ray* r, raytracer* tracer, mcconfig* cfg, visitor* visit) {
 
             if (cfg->mcmethod == mmMCX) {
                 if (!cfg->basisorder) {
-                    if (cfg->isatomic)
-                        #pragma omp atomic
-                        tracer->mesh->weight[eid + tshift] += ww;
+                    if (MMC_MULTISRC(cfg)) {
+                        accumpattern(tracer->mesh->weight, visit, MESH_OUTROW(tracer->mesh, eid, tshift), ww, cfg->srcpattern + r->posidx * cfg->srcnum, cfg->srcnum);
+                    } else if (cfg->isatomic)
+                        accumweight(tracer->mesh->weight, visit, MESH_OUTROW(tracer->mesh, eid, tshift), ww);
                     else {
-                        tracer->mesh->weight[eid + tshift] += ww;
+                        tracer->mesh->weight[MESH_OUTROW(tracer->mesh, eid, tshift)] += ww;
                     }
                 } else {
                     if (cfg->outputtype != otEnergy && cfg->outputtype != otWP) {
@@ -902,20 +1244,44 @@ float badouel_raytet(ray* r, raytracer* tracer, mcconfig* cfg, visitor* visit) {
 
                     ww *= 1.f / 3.f;
 
-                    if (cfg->isatomic)
+                    if (MMC_MULTISRC(cfg))
+                        for (i = 0; i < 3; i++) {
+                            accumnode(tracer->mesh, visit, tshift, eid, out[faceidx][i], ww, cfg->srcpattern + r->posidx * cfg->srcnum, cfg->srcnum);
+                        }
+                    else if (cfg->isatomic)
                         for (i = 0; i < 3; i++)
-                            #pragma omp atomic
-                            tracer->mesh->weight[ee[out[faceidx][i]] - 1 + tshift] += ww;
+                            accumnode(tracer->mesh, visit, tshift, eid, out[faceidx][i], ww, NULL, 1);
                     else
                         for (i = 0; i < 3; i++) {
                             tracer->mesh->weight[ee[out[faceidx][i]] - 1 + tshift] += ww;
                         }
                 }
+
+                if (cfg->freqnum > 0) {
+                    float nodew[4] = {0.f, 0.f, 0.f, 0.f};
+
+                    for (i = 0; i < 3; i++) {
+                        nodew[out[faceidx][i]] = 1.f;
+                    }
+
+                    accumfreq(r, tracer->mesh, cfg, visit, eid, (cfg->basisorder ? nodew : NULL), ww, r->photontimer - 0.5f * r->Lmove * rc);
+                }
+            }
+
+            if (r->wavew) {
+                float nodew[4] = {0.f, 0.f, 0.f, 0.f};
+
+                for (i = 0; i < 3; i++) {
+                    nodew[out[faceidx][i]] = 1.f / 3.f;
+                }
+
+                accumwave(r, tracer->mesh, cfg, visit, prop, eid, (cfg->basisorder ? nodew : NULL));
             }
         }
     }
 
     visit->raytet++;
+    MMC_HEAT(visit->heatmap, eid, hmRayTet);
 
     if (tracer->mesh->type[eid] == 0) {
         visit->raytet0++;
@@ -939,8 +1305,31 @@ float havel_raytet(ray* r, raytracer* tracer, mcconfig* cfg, visitor* visit) {
     MMC_ERROR(-6, "wrong option, please recompile with SSE4 enabled");
     return MMC_UNDEFINED;
 }
-#endif  /* #if !defined(__EMSCRIPTEN__) */
+#endif  /* #if !defined(__EMSCRIPTEN__) || defined(__SSE4_1__) */
+
+
+/**
+ * \brief Classify a path segment against an edge (cylinder) or node (sphere) ROI
+ *
+ * \param[in] d0: squared distance of the ray-start (P0) to the edge or node
+ * \param[in] d1: squared distance of the ray-end (P1) to the edge or node
+ * \param[in] r2: squared radius of the ROI
+ * \return the hit status, one of htOutIn, htInOut, htNoHitOut, htNoHitIn or htNone
+ */
+
+static inline int roi_hitstatus(float d0, float d1, float r2) {
+    if (d0 > r2 + EPS2 && d1 < r2 - EPS2) {
+        return htOutIn;
+    } else if (d0 < r2 - EPS2 && d1 > r2 + EPS2) {
+        return htInOut;
+    } else if (d1 > r2 + EPS2) {
+        return htNoHitOut;
+    } else if (d1 < r2 - EPS2) {
+        return htNoHitIn;
+    }
 
+    return htNone;
+}
 
 /**
  * \brief Compute distances to edge (infinite cylindrical) ROIs in the element
@@ -977,17 +1366,7 @@ void compute_distances_to_edge(ray* r, raytracer* tracer, int* ee, int edgeid, f
 
     r2 = r->roisize[edgeid] * r->roisize[edgeid]; // squared radius of the edge-roi
 
-    *hitstatus = htNone;
-
-    if (d2d[0] > r2 + EPS2 && d2d[1] < r2 - EPS2) {
-        *hitstatus = htOutIn;
-    } else if (d2d[0] < r2 - EPS2 && d2d[1] > r2 + EPS2) {
-        *hitstatus = htInOut;
-    } else if (d2d[1] > r2 + EPS2) {
-        *hitstatus = htNoHitOut;
-    } else if (d2d[1] < r2 - EPS2) {
-        *hitstatus = htNoHitIn;
-    }
+    *hitstatus = roi_hitstatus(d2d[0], d2d[1], r2);
 }
 
 /**
@@ -1072,17 +1451,7 @@ void compute_distances_to_node(ray* r, raytracer* tracer, int* ee, int index, fl
     vec_add3((FLOAT3*)&r->p0, &PP, &PP);
     npdist1 = dist2_3(&PP, *center);      // P1
 
-    if (npdist0 > nr + EPS2 && npdist1 < nr - EPS2) {
-        *hitstatus = htOutIn;
-    } else if (npdist0 < nr - EPS2 && npdist1 > nr + EPS2) {
-        *hitstatus = htInOut;
-    } else if (npdist1 > nr + EPS2) {
-        *hitstatus = htNoHitOut;
-    } else if (npdist1 < nr - EPS2) {
-        *hitstatus = htNoHitIn;
-    } else {
-        *hitstatus = htNone;
-    }
+    *hitstatus = roi_hitstatus(npdist0, npdist1, nr);
 }
 
 /**
@@ -1105,12 +1474,42 @@ float ray_sphere_intersect(ray* r, int index, FLOAT3* center, float nr, int hits
     return r->Lmove;
 }
 
+/**
+ * \brief Classify a path segment against a face (slab) ROI
+ *
+ * \param[in] distf0: signed distance of the ray-start (P0) to the face
+ * \param[in] distf1: signed distance of the ray-end (P1) to the face
+ * \param[in] thick: thickness of the face ROI
+ * \param[out] hitstatus: the hit status
+ * \return the fraction of the path segment before the intersection, 1 if no hit
+ */
+
+static inline float roi_facestatus(float distf0, float distf1, float thick, int* hitstatus) {
+    float ratio = 1.f;
+
+    *hitstatus = htNone;
+
+    if (distf0 > thick + EPS2 && distf1 < thick - EPS2) { // hit: out->in
+        ratio = 1.f - (thick - distf1) / (distf0 - distf1);
+        *hitstatus = htOutIn;
+    } else if (distf0 < thick - EPS2 && distf1 > thick + EPS2) { // hit: in->out
+        ratio = (thick - distf0) / (distf1 - distf0);
+        *hitstatus = htInOut;
+    } else if ((distf0 <= thick && distf1 >= thick) || (distf0 > thick && distf1 > thick)) {
+        *hitstatus = htNoHitOut;
+    } else if ((distf0 >= thick && distf1 <= thick) || (distf0 < thick && distf1 < thick)) {
+        *hitstatus = htNoHitIn;
+    }
+
+    return ratio;
+}
+
 /**
  * \brief Compute the next step length for the face-based iMMC
  */
 float ray_face_intersect(ray* r, raytracer* tracer, int* ee, int faceid, int baseid, int eid, int* hitstatus) {
     FLOAT3 pf1, pv, fnorm, ptemp;
-    float distf0, distf1, thick, ratio = 1.f;
+    float distf0, distf1, thick;
 
     thick = r->roisize[faceid];
 
@@ -1128,64 +1527,279 @@ float ray_face_intersect(ray* r, raytracer* tracer, int* ee, int faceid, int bas
     vec_diff3(&ptemp, &pf1, &pv);
     distf1 = vec_dot3(&pv, &fnorm);
 
-    *hitstatus = htNone;
+    return roi_facestatus(distf0, distf1, thick, hitstatus);
+}
 
-    if (distf0 > thick + EPS2 && distf1 < thick - EPS2) { // hit: out->in
-        ratio = 1.f - (thick - distf1) / (distf0 - distf1);
-        *hitstatus = htOutIn;
-    } else if (distf0 < thick - EPS2 && distf1 > thick + EPS2) { // hit: in->out
-        ratio = (thick - distf0) / (distf1 - distf0);
-        *hitstatus = htInOut;
-    } else if ((distf0 <= thick && distf1 >= thick) || (distf0 > thick && distf1 > thick)) {
-        *hitstatus = htNoHitOut;
-    } else if ((distf0 >= thick && distf1 <= thick) || (distf0 < thick && distf1 < thick)) {
-        *hitstatus = htNoHitIn;
-    }
+#ifdef MMC_USE_SSE
 
-    return ratio;
+/**
+ * \brief Load one coordinate (0:x, 1:y, 2:z) of 4 points into the lanes of an SSE register
+ */
+
+static inline __m128 roi_gather(FLOAT3* p[4], int axis) {
+    float v[4] __attribute__ ((aligned(16))) = {(&(p[0]->x))[axis], (&(p[1]->x))[axis], (&(p[2]->x))[axis], (&(p[3]->x))[axis]};
+    return _mm_load_ps(v);
 }
 
 /**
- * \brief Implicit MMC ray-tracing core function
+ * \brief Dot products of 4 pairs of vectors stored as x/y/z registers, summed in the order of vec_dot3
+ */
+
+static inline __m128 roi_dot(__m128 ax, __m128 ay, __m128 az, __m128 bx, __m128 by, __m128 bz) {
+    return _mm_add_ps(_mm_add_ps(_mm_mul_ps(ax, bx), _mm_mul_ps(ay, by)), _mm_mul_ps(az, bz));
+}
+
+/**
+ * \brief Compute the distances of the ray-start and ray-end to all edges of an element in SSE lanes
  *
- * if doinit is set to 1, this function only initialize r->inroi for 3 roi types
- * if doinit is set to 0, this function only updates r->{Lmove, roiidx, inroi}. r->roitype update is not necessary
- * in the latter case, if reference element is found, it also updates r->refeid and r->roisize pointers
+ * The 6 edges are tested in 2 sets of 4 lanes, a set is skipped if none of its
+ * edges has a ROI. Each lane repeats the operations of compute_distances_to_edge
+ * in the same order, so that the results are bitwise identical.
+ *
+ * \param[in] r: the current ray, r->roisize points to the edge radii
+ * \param[in] tracer: the ray-tracer aux data structure
+ * \param[in] ee: the node indices of the element
+ * \param[out] d2d: the squared distances of P0 and P1 to each edge
+ * \param[out] p2d: the projections of P0 and P1 on the plane orthogonal to each edge
  */
-void traceroi(ray* r, raytracer* tracer, int roitype, int doinit) {
-    int eid = r->eid - 1;
-    int* ee = (int*)(tracer->mesh->elem + eid * tracer->mesh->elemlen);
 
-    if (roitype == 1) { /** edge and node immc - edge also depends on node, only test intersection with an infinite cylinder */
-        int neweid = -1;
-        int* newee;
-        int i;
-        float minratio = 1.f;
-        int hitstatus = htNone, firsthit = htNone, firstinout = htNone;
+static void compute_distances_to_edges(ray* r, raytracer* tracer, int* ee, float d2d[6][2], FLOAT3 p2d[6][2]) {
+    float buf[8][4] __attribute__ ((aligned(16)));
+    FLOAT3* e1[4], *e0[4], mv, p1;
+    __m128 ux, uy, uz, ox, oy, oz, qx, qy, qz, e1x, e1y, e1z, d1;
+    int i, j, first, len;
 
-        if (tracer->mesh->edgeroi) { /** if edge roi is defined */
-            // edge-based iMMC  - ray-cylinder intersection test
-            float distdata[2];
-            FLOAT3 projdata[2];
+    vec_mult3((FLOAT3*)&r->vec, r->Lmove, &mv);
+    vec_add3((FLOAT3*)&r->p0, &mv, &p1);  // P1, ray-end
 
-            if (r->roisize[0] != 0.f) {
-                // test if this is a reference element, indicated by a negative radius
-                if (r->roisize[0] < -6.f) {
-                    neweid = (int)(-r->roisize[0]) - 6;
+    for (first = 0; first < 6; first += 4) {
+        len = MIN(6 - first, 4);
+
+        for (i = 0; i < len; i++) {
+            if (r->roisize[first + i] > 0.f) {
+                break;
+            }
+        }
+
+        if (i == len) {
+            continue;
+        }
+
+        for (i = 0; i < 4; i++) {
+            j = first + ((i < len) ? i : i - len);
+            e1[i] = tracer->mesh->node + ee[e2n[j][0]] - 1; // end node of the edge, E1
+            e0[i] = tracer->mesh->node + ee[e2n[j][1]] - 1; // start node of the edge, E0
+        }
+
+        e1x = roi_gather(e1, 0);
+        e1y = roi_gather(e1, 1);
+        e1z = roi_gather(e1, 2);
+        ux = _mm_sub_ps(roi_gather(e0, 0), e1x);
+        uy = _mm_sub_ps(roi_gather(e0, 1), e1y);
+        uz = _mm_sub_ps(roi_gather(e0, 2), e1z);
+
+        d1 = _mm_div_ps(_mm_set1_ps(1.f), _mm_sqrt_ps(roi_dot(ux, uy, uz, ux, uy, uz)));
+        ux = _mm_mul_ps(d1, ux); // normalized vector of the edge
+        uy = _mm_mul_ps(d1, uy);
+        uz = _mm_mul_ps(d1, uz);
+
+        ox = _mm_sub_ps(_mm_set1_ps(r->p0.x), e1x); // OP = <P0 -> E1>
+        oy = _mm_sub_ps(_mm_set1_ps(r->p0.y), e1y);
+        oz = _mm_sub_ps(_mm_set1_ps(r->p0.z), e1z);
+        d1 = roi_dot(ox, oy, oz, ux, uy, uz);
+        qx = _mm_sub_ps(ox, _mm_mul_ps(d1, ux)); // PP0: P0 projection on plane
+        qy = _mm_sub_ps(oy, _mm_mul_ps(d1, uy));
+        qz = _mm_sub_ps(oz, _mm_mul_ps(d1, uz));
+        _mm_store_ps(buf[0], roi_dot(qx, qy, qz, qx, qy, qz));
+        _mm_store_ps(buf[1], qx);
+        _mm_store_ps(buf[2], qy);
+        _mm_store_ps(buf[3], qz);
+
+        ox = _mm_sub_ps(_mm_set1_ps(p1.x), e1x); // OP = <P1 -> E1>
+        oy = _mm_sub_ps(_mm_set1_ps(p1.y), e1y);
+        oz = _mm_sub_ps(_mm_set1_ps(p1.z), e1z);
+        d1 = roi_dot(ox, oy, oz, ux, uy, uz);
+        qx = _mm_sub_ps(ox, _mm_mul_ps(d1, ux)); // PP1: P1 projection on plane
+        qy = _mm_sub_ps(oy, _mm_mul_ps(d1, uy));
+        qz = _mm_sub_ps(oz, _mm_mul_ps(d1, uz));
+        _mm_store_ps(buf[4], roi_dot(qx, qy, qz, qx, qy, qz));
+        _mm_store_ps(buf[5], qx);
+        _mm_store_ps(buf[6], qy);
+        _mm_store_ps(buf[7], qz);
+
+        for (i = 0; i < len; i++) {
+            for (j = 0; j < 2; j++) {
+                d2d[first + i][j] = buf[j * 4][i];
+                p2d[first + i][j].x = buf[j * 4 + 1][i];
+                p2d[first + i][j].y = buf[j * 4 + 2][i];
+                p2d[first + i][j].z = buf[j * 4 + 3][i];
+            }
+        }
+    }
+}
+
+/**
+ * \brief Compute the squared distances of the ray-start and ray-end to the 4 nodes of an element in SSE lanes
+ *
+ * Each lane repeats the operations of compute_distances_to_node in the same order.
+ *
+ * \param[in] r: the current ray
+ * \param[in] tracer: the ray-tracer aux data structure
+ * \param[in] ee: the node indices of the element
+ * \param[out] npdist: the squared distances of P0 and P1 to each node
+ */
+
+static void compute_distances_to_nodes(ray* r, raytracer* tracer, int* ee, float npdist[4][2]) {
+    float buf[2][4] __attribute__ ((aligned(16)));
+    FLOAT3* c[4], mv, p1;
+    __m128 cx, cy, cz, dx, dy, dz;
+    int i;
+
+    vec_mult3((FLOAT3*)&r->vec, r->Lmove, &mv);
+    vec_add3((FLOAT3*)&r->p0, &mv, &p1);
+
+    for (i = 0; i < 4; i++) {
+        c[i] = tracer->mesh->node + ee[i] - 1;
+    }
+
+    cx = roi_gather(c, 0);
+    cy = roi_gather(c, 1);
+    cz = roi_gather(c, 2);
+
+    dx = _mm_sub_ps(cx, _mm_set1_ps(r->p0.x));
+    dy = _mm_sub_ps(cy, _mm_set1_ps(r->p0.y));
+    dz = _mm_sub_ps(cz, _mm_set1_ps(r->p0.z));
+    _mm_store_ps(buf[0], roi_dot(dx, dy, dz, dx, dy, dz));
+
+    dx = _mm_sub_ps(cx, _mm_set1_ps(p1.x));
+    dy = _mm_sub_ps(cy, _mm_set1_ps(p1.y));
+    dz = _mm_sub_ps(cz, _mm_set1_ps(p1.z));
+    _mm_store_ps(buf[1], roi_dot(dx, dy, dz, dx, dy, dz));
+
+    for (i = 0; i < 4; i++) {
+        npdist[i][0] = buf[0][i];
+        npdist[i][1] = buf[1][i];
+    }
+}
+
+/**
+ * \brief Compute the signed distances of the ray-start and ray-end to the 4 faces of an element in SSE lanes
+ *
+ * Each lane repeats the operations of ray_face_intersect in the same order.
+ *
+ * \param[in] r: the current ray
+ * \param[in] tracer: the ray-tracer aux data structure
+ * \param[in] ee: the node indices of the element
+ * \param[in] baseid: the index of the face normals of the element in tracer->n
+ * \param[out] distf: the distances of P0 and P1 to each face
+ */
+
+static void compute_distances_to_faces(ray* r, raytracer* tracer, int* ee, int baseid, float distf[4][2]) {
+    float buf[2][4] __attribute__ ((aligned(16)));
+    float* nvec = &(tracer->n[baseid].x);
+    FLOAT3* pf[4], mv, p1;
+    __m128 fx, fy, fz, nx, ny, nz, dx, dy, dz;
+    int i;
+
+    vec_mult3((FLOAT3*)&r->vec, r->Lmove, &mv);
+    vec_add3((FLOAT3*)&r->p0, &mv, &p1);
+
+    for (i = 0; i < 4; i++) {
+        pf[i] = tracer->mesh->node + ee[nc[ifaceorder[i]][0]] - 1; // any point on face
+        buf[0][i] = nvec[ifaceorder[i]];
+        buf[1][i] = nvec[ifaceorder[i] + 4];
+    }
+
+    nx = _mm_load_ps(buf[0]);
+    ny = _mm_load_ps(buf[1]);
+
+    for (i = 0; i < 4; i++) {
+        buf[0][i] = nvec[ifaceorder[i] + 8];
+    }
+
+    nz = _mm_load_ps(buf[0]);
+    fx = roi_gather(pf, 0);
+    fy = roi_gather(pf, 1);
+    fz = roi_gather(pf, 2);
+
+    dx = _mm_sub_ps(fx, _mm_set1_ps(r->p0.x));
+    dy = _mm_sub_ps(fy, _mm_set1_ps(r->p0.y));
+    dz = _mm_sub_ps(fz, _mm_set1_ps(r->p0.z));
+    _mm_store_ps(buf[0], roi_dot(dx, dy, dz, nx, ny, nz));
+
+    dx = _mm_sub_ps(fx, _mm_set1_ps(p1.x));
+    dy = _mm_sub_ps(fy, _mm_set1_ps(p1.y));
+    dz = _mm_sub_ps(fz, _mm_set1_ps(p1.z));
+    _mm_store_ps(buf[1], roi_dot(dx, dy, dz, nx, ny, nz));
+
+    for (i = 0; i < 4; i++) {
+        distf[i][0] = buf[0][i];
+        distf[i][1] = buf[1][i];
+    }
+}
+
+#endif
+
+/**
+ * \brief Implicit MMC ray-tracing core function
+ *
+ * if doinit is set to 1, this function only initialize r->inroi for 3 roi types
+ * if doinit is set to 0, this function only updates r->{Lmove, roiidx, inroi}. r->roitype update is not necessary
+ * in the latter case, if reference element is found, it also updates r->refeid and r->roisize pointers
+ */
+void traceroi(ray* r, raytracer* tracer, int roitype, int doinit) {
+    int eid = r->eid - 1;
+    int* ee = (int*)(tracer->mesh->elem + eid * tracer->mesh->elemlen);
+
+    if (MESH_NOROI(tracer->mesh, eid)) { /** no ROI in this element, only reset the states as the tests below would */
+        if (roitype != 1 || tracer->mesh->noderoi) {
+            r->inroi = (doinit) ? r->inroi : 0;
+            r->roitype = rtNone;
+        }
+
+        return;
+    }
+
+    if (roitype == 1) { /** edge and node immc - edge also depends on node, only test intersection with an infinite cylinder */
+        int neweid = -1;
+        int* newee;
+        int i;
+        float minratio = 1.f;
+        int hitstatus = htNone, firsthit = htNone, firstinout = htNone;
+
+        if (tracer->mesh->edgeroi) { /** if edge roi is defined */
+            // edge-based iMMC  - ray-cylinder intersection test
+            float distdata[6][2];
+            FLOAT3 projdata[6][2];
+
+            if (r->roisize[0] != 0.f) {
+                // test if this is a reference element, indicated by a negative radius
+                if (r->roisize[0] < -6.f) {
+                    neweid = (int)(-r->roisize[0]) - 6;
                     r->refeid = neweid;
                     newee = (int*)(tracer->mesh->elem + (neweid - 1) * tracer->mesh->elemlen);
-                    r->roisize = (float*)(tracer->mesh->edgeroi + (neweid - 1) * 6); // update r->roisize array to the referenced element
+                    r->roisize = MESH_ROIREC(tracer->mesh, tracer->mesh->edgeroi, neweid - 1, 6); // update r->roisize array to the referenced element
                 }
 
+#ifdef MMC_USE_SSE
+                compute_distances_to_edges(r, tracer, (neweid < 0) ? ee : newee, distdata, projdata);
+#endif
+
                 for (i = 0; i < 6; i++) { /** loop over each edge in current element, find the closest hit */
                     if (r->roisize[i] > 0.f) {
                         /** decide if photon is in the roi or not */
+#ifdef MMC_USE_SSE
+                        hitstatus = roi_hitstatus(distdata[i][0], distdata[i][1], r->roisize[i] * r->roisize[i]);
+#else
+
                         if (neweid < 0) {
-                            compute_distances_to_edge(r, tracer, ee, i, distdata, projdata, &hitstatus);
+                            compute_distances_to_edge(r, tracer, ee, i, distdata[i], projdata[i], &hitstatus);
                         } else {
-                            compute_distances_to_edge(r, tracer, newee, i, distdata, projdata, &hitstatus);
+                            compute_distances_to_edge(r, tracer, newee, i, distdata[i], projdata[i], &hitstatus);
                         }
 
+#endif
+
 
                         /**
                          *  hitstatus has 4 possible outputs:
@@ -1200,7 +1814,7 @@ void traceroi(ray* r, raytracer* tracer, int roitype, int doinit) {
                         } else {
                             if (hitstatus == htInOut || hitstatus == htOutIn) { /** if intersection is found */
                                 /** calculate the first intersection distance normalied by path seg length */
-                                float lratio = ray_cylinder_intersect(r, i, distdata, projdata, hitstatus);
+                                float lratio = ray_cylinder_intersect(r, i, distdata[i], projdata[i], hitstatus);
 
                                 if (lratio < minratio) { /** find the closest hit */
                                     minratio = lratio;
@@ -1231,6 +1845,11 @@ void traceroi(ray* r, raytracer* tracer, int roitype, int doinit) {
             // not hit any edgeroi in the current element, then go for node-based iMMC
             float nr;
             FLOAT3* center;
+#ifdef MMC_USE_SSE
+            float npdist[4][2];
+
+            compute_distances_to_nodes(r, tracer, ee, npdist);
+#endif
 
             minratio = r->Lmove;
             hitstatus = htNone;
@@ -1241,7 +1860,12 @@ void traceroi(ray* r, raytracer* tracer, int roitype, int doinit) {
                 nr = tracer->mesh->noderoi[ee[i] - 1];
 
                 if (nr > 0.f) {
+#ifdef MMC_USE_SSE
+                    center = tracer->mesh->node + ee[i] - 1;
+                    hitstatus = roi_hitstatus(npdist[i][0], npdist[i][1], nr * nr);
+#else
                     compute_distances_to_node(r, tracer, ee, i, nr, &center, &hitstatus);
+#endif
 
                     if (doinit) {
                         r->inroi |= (hitstatus == htInOut || hitstatus == htNoHitIn);
@@ -1285,18 +1909,30 @@ void traceroi(ray* r, raytracer* tracer, int roitype, int doinit) {
             r->refeid = neweid;
             newbaseid = (neweid - 1) << 2;
             newee = (int*)(tracer->mesh->elem + (neweid - 1) * tracer->mesh->elemlen);
-            r->roisize = (float*)(tracer->mesh->faceroi + (neweid - 1) * 4);
+            r->roisize = MESH_ROIREC(tracer->mesh, tracer->mesh->faceroi, neweid - 1, 4);
         }
 
+#ifdef MMC_USE_SSE
+        float distf[4][2];
+
+        compute_distances_to_faces(r, tracer, (neweid < 0) ? ee : newee, (neweid < 0) ? eid << 2 : newbaseid, distf);
+#endif
+
         // test if the ray intersect with a face ROI (slab)
         for (i = 0; i < 4; i++) {
             if (r->roisize[i] > 0.f) {
+#ifdef MMC_USE_SSE
+                lratio = roi_facestatus(distf[i][0], distf[i][1], r->roisize[i], &hitstatus);
+#else
+
                 if (neweid < 0) {
                     lratio = ray_face_intersect(r, tracer, ee, i, eid << 2, eid, &hitstatus);
                 } else {
                     lratio = ray_face_intersect(r, tracer, newee, i, newbaseid, neweid, &hitstatus);
                 }
 
+#endif
+
                 if (doinit) {
                     r->inroi |= (hitstatus == htInOut || hitstatus == htNoHitIn);
                 } else {
@@ -1326,6 +1962,55 @@ void traceroi(ray* r, raytracer* tracer, int roitype, int doinit) {
     }
 }
 
+/**
+ * \brief Branch-less Badouel-based SSE4 ray-tet test for a single ray
+ *
+ * \param[in] tracer: the ray-tracer aux data structure
+ * \param[in] eid: the index of the enclosing tet, starting from 0
+ * \param[in] p0: the ray origin
+ * \param[in] vec: the ray direction
+ * \param[out] tmin: distance from the ray origin to the exit face
+ * \return the local index of the exit face, as defined by maskmap
+ */
+
+static inline int badouel_intersect(raytracer* tracer, int eid, float3* p0, float3* vec, float* tmin) {
+    float3 bary = {1e10f, 0.f, 0.f, 0.f};
+    size_t baseid = (size_t)eid << 2;
+    __m128 O, T, S;
+
+    const __m128 Nx = _mm_load_ps(&(tracer->n[baseid].x));
+    const __m128 Ny = _mm_load_ps(&(tracer->n[baseid + 1].x));
+    const __m128 Nz = _mm_load_ps(&(tracer->n[baseid + 2].x));
+    const __m128 dd = _mm_load_ps(&(tracer->n[baseid + 3].x));
+
+    O = _mm_set1_ps(p0->x);
+    T = _mm_mul_ps(Nx, O);
+    O = _mm_set1_ps(p0->y);
+    T = _mm_add_ps(T, _mm_mul_ps(Ny, O));
+    O = _mm_set1_ps(p0->z);
+    T = _mm_add_ps(T, _mm_mul_ps(Nz, O));
+    T = _mm_sub_ps(dd, T);
+
+    O = _mm_set1_ps(vec->x);
+    S = _mm_mul_ps(Nx, O);
+    O = _mm_set1_ps(vec->y);
+    S = _mm_add_ps(S, _mm_mul_ps(Ny, O));
+    O = _mm_set1_ps(vec->z);
+    S = _mm_add_ps(S, _mm_mul_ps(Nz, O));
+    T = _mm_div_ps(T, S);
+
+    O = _mm_cmpgt_ps(S, _mm_set1_ps(0.f));
+    T = _mm_add_ps(_mm_andnot_ps(O, _mm_set1_ps(1e10f)), _mm_and_ps(O, T));
+    S = _mm_movehl_ps(T, T);
+    O = _mm_min_ps(T, S);
+    S = _mm_shuffle_ps(O, O, _MM_SHUFFLE(1, 1, 1, 1));
+    O = _mm_min_ss(O, S);
+
+    _mm_store_ss(&(bary.x), O);
+    *tmin = bary.x;
+    return maskmap[_mm_movemask_ps(_mm_cmpeq_ps(T, _mm_set1_ps(bary.x)))];
+}
+
 /**
  * \brief Branch-less Badouel-based SSE4 ray-tracer to advance photon by one step
  *
@@ -1342,21 +2027,47 @@ void traceroi(ray* r, raytracer* tracer, int roitype, int doinit) {
  */
 
 float branchless_badouel_raytet(ray* r, raytracer* tracer, mcconfig* cfg, visitor* visit) {
-
-    float3 bary = {1e10f, 0.f, 0.f, 0.f};
-    float Lp0 = 0.f, rc, currweight, dlen, ww, totalloss = 0.f;
-    int tshift, faceidx = -1, baseid, eid;
-    __m128 O, T, S;
-    __m128i P;
+    float tmin;
+    int faceidx;
 
     if (tracer->mesh == NULL || tracer->n == NULL || r->eid <= 0 || r->eid > tracer->mesh->ne) {
         return -1;
     }
 
+    faceidx = badouel_intersect(tracer, r->eid - 1, &(r->p0), &(r->vec), &tmin);
+
+    return (visit->advance) ? visit->advance(r, tracer, cfg, visit, tmin, faceidx) : branchless_badouel_advance(r, tracer, cfg, visit, tmin, faceidx);
+}
+
+/**
+ * \brief Advance photon by one step using the exit face found by the Badouel ray-tet test
+ *
+ * This function performs the second half of branchless_badouel_raytet(): given
+ * the distance to, and the local index of, the exit face of the enclosing tet,
+ * it moves the photon and accumulates the energy loss. It is inlined into one
+ * copy per feature combination: the features not in spec are known to be off,
+ * so their tests and the code they guard are removed from that copy.
+ *
+ * \param[in,out] r: the current ray
+ * \param[in] tracer: the ray-tracer aux data structure
+ * \param[in] cfg: simulation configuration structure
+ * \param[out] visit: statistics counters of this thread
+ * \param[in] tmin: distance from the ray origin to the exit face
+ * \param[in] faceidx: local index of the exit face, as returned by maskmap
+ * \param[in] spec: the MMC_SPEC_* features tested at run-time, a compile-time constant
+ */
+
+MMC_SPEC_INLINE float badouel_advance_spec(ray* r, raytracer* tracer, mcconfig* cfg, visitor* visit, float tmin, int faceidx, const unsigned int spec) {
+
+    float3 bary = {tmin, 0.f, 0.f, 0.f};
+    float Lp0 = 0.f, rc, currweight, dlen, ww, totalloss = 0.f;
+    int tshift, eid;
+    __m128 O, T, S;
+    __m128i P;
+
     r->p0.w = 1.f;
     r->vec.w = 0.f;
     eid = r->eid - 1;
-    baseid = eid << 2;
 
     r->pout.x = MMC_UNDEFINED;
     r->faceid = -1;
@@ -1365,57 +2076,26 @@ float branchless_badouel_raytet(ray* r, raytracer* tracer, mcconfig* cfg, visito
     r->refeid = -1;
     r->roiidx = -1;
 
-    const __m128 Nx = _mm_load_ps(&(tracer->n[baseid].x));
-    const __m128 Ny = _mm_load_ps(&(tracer->n[baseid + 1].x));
-    const __m128 Nz = _mm_load_ps(&(tracer->n[baseid + 2].x));
-    const __m128 dd = _mm_load_ps(&(tracer->n[baseid + 3].x));
-
-    O = _mm_set1_ps(r->p0.x);
-    T = _mm_mul_ps(Nx, O);
-    O = _mm_set1_ps(r->p0.y);
-    T = _mm_add_ps(T, _mm_mul_ps(Ny, O));
-    O = _mm_set1_ps(r->p0.z);
-    T = _mm_add_ps(T, _mm_mul_ps(Nz, O));
-    T = _mm_sub_ps(dd, T);
-
-    O = _mm_set1_ps(r->vec.x);
-    S = _mm_mul_ps(Nx, O);
-    O = _mm_set1_ps(r->vec.y);
-    S = _mm_add_ps(S, _mm_mul_ps(Ny, O));
-    O = _mm_set1_ps(r->vec.z);
-    S = _mm_add_ps(S, _mm_mul_ps(Nz, O));
-    T = _mm_div_ps(T, S);
-
-    O = _mm_cmpgt_ps(S, _mm_set1_ps(0.f));
-    T = _mm_add_ps(_mm_andnot_ps(O, _mm_set1_ps(1e10f)), _mm_and_ps(O, T));
-    S = _mm_movehl_ps(T, T);
-    O = _mm_min_ps(T, S);
-    S = _mm_shuffle_ps(O, O, _MM_SHUFFLE(1, 1, 1, 1));
-    O = _mm_min_ss(O, S);
-
-    _mm_store_ss(&(bary.x), O);
-    faceidx = maskmap[_mm_movemask_ps(_mm_cmpeq_ps(T, _mm_set1_ps(bary.x)))];
     r->faceid = faceorder[faceidx];
 
     if (r->faceid >= 0 && bary.x >= 0) {
         medium* prop;
-        int* enb, *ee = (int*)(tracer->mesh->elem + eid * tracer->mesh->elemlen);
+        int* enb;
         float mus;
-        int pidx; // pattern index
 
-        if (cfg->implicit == 1 && r->inroi && tracer->mesh->edgeroi && fabs(tracer->mesh->edgeroi[eid * 6]) < EPS) {
+        if ((spec & MMC_SPEC_IMPLICIT) && cfg->implicit == 1 && r->inroi && tracer->mesh->edgeroi && fabs(MESH_ROIREC(tracer->mesh, tracer->mesh->edgeroi, eid, 6)[0]) < EPS) {
             r->inroi = 0;
         }
 
-        if (cfg->implicit && r->inroi) {
+        if ((spec & MMC_SPEC_IMPLICIT) && cfg->implicit && r->inroi) {
             prop = tracer->mesh->med + tracer->mesh->prop;
         } else {
-            prop = tracer->mesh->med + (tracer->mesh->type[eid]);
+            prop = MESH_ELEMMED(tracer->mesh, eid);
         }
 
         rc = prop->n * R_C0;
         currweight = r->weight;
-        mus = (cfg->mcmethod == mmMCX) ? prop->mus : (prop->mua + prop->mus);
+        mus = SPEC_MCX(spec, cfg) ? prop->mus : (prop->mua + prop->mus);
 
         enb = (int*)(tracer->mesh->facenb + eid * tracer->mesh->elemlen);
         r->nexteid = enb[r->faceid]; // if I use nexteid-1, the speed got slower, strange!
@@ -1430,7 +2110,7 @@ float branchless_badouel_raytet(ray* r, raytracer* tracer, mcconfig* cfg, visito
         r->Lmove = ((r->isend) ? dlen : Lp0);
 
         // implicit MMC - test if ray intersects with edge/face/node ROI boundaries
-        if (cfg->implicit) {
+        if ((spec & MMC_SPEC_IMPLICIT) && cfg->implicit) {
             traceroi(r, tracer, cfg->implicit, 0);
         }
 
@@ -1441,24 +2121,26 @@ float branchless_badouel_raytet(ray* r, raytracer* tracer, mcconfig* cfg, visito
         T = _mm_add_ps(T, S);
         _mm_store_ps(&(r->pout.x), T);
 
-        if ((int)((r->photontimer + r->Lmove * rc - cfg->tstart)*visit->rtstep) > cfg->maxgate - 1) { /*exit time window*/
+        /*a continuous-wave run has one gate, the photon leaves it once the scaled time reaches 1, no float-to-int conversion is needed*/
+        if (SPEC_TIME(spec, cfg) ? ((int)((r->photontimer + r->Lmove * rc - cfg->tstart)*visit->rtstep) > cfg->maxgate - 1)
+                : ((r->photontimer + r->Lmove * rc - cfg->tstart)*visit->rtstep >= 1.f)) { /*exit time window*/
             r->faceid = -2;
             r->pout.x = MMC_UNDEFINED;
             r->Lmove = (cfg->tend - r->photontimer) / (prop->n * R_C0) - 1e-4f;
         }
 
-        if (cfg->mcmethod == mmMCX) {
+        if (SPEC_MCX(spec, cfg)) {
             totalloss = expf(-prop->mua * r->Lmove);
             r->weight *= totalloss;
         }
 
         totalloss = 1.f - totalloss;
 
-        if (cfg->seed == SEED_FROM_FILE && cfg->outputtype == otJacobian) {
+        if ((spec & MMC_SPEC_REPLAY) && cfg->seed == SEED_FROM_FILE && cfg->outputtype == otJacobian) {
             currweight = expf(-DELTA_MUA * r->Lmove);
             currweight *= cfg->replayweight[r->photonid];
             currweight += r->weight;
-        } else if (cfg->seed == SEED_FROM_FILE && cfg->outputtype == otWL) {
+        } else if ((spec & MMC_SPEC_REPLAY) && cfg->seed == SEED_FROM_FILE && cfg->outputtype == otWL) {
             currweight = r->Lmove;
             currweight *= cfg->replayweight[r->photonid];
             currweight += r->weight;
@@ -1466,7 +2148,7 @@ float branchless_badouel_raytet(ray* r, raytracer* tracer, mcconfig* cfg, visito
 
         r->slen -= r->Lmove * mus;
 
-        if (cfg->seed == SEED_FROM_FILE && cfg->outputtype == otWP) {
+        if ((spec & MMC_SPEC_REPLAY) && cfg->seed == SEED_FROM_FILE && cfg->outputtype == otWP) {
             if (r->slen0 < EPS) {
                 currweight = 1;
             } else {
@@ -1478,22 +2160,24 @@ float branchless_badouel_raytet(ray* r, raytracer* tracer, mcconfig* cfg, visito
         }
 
         if (bary.x >= 0.f) {
-            int framelen = (cfg->basisorder ? tracer->mesh->nn : tracer->mesh->ne);
+            int framelen = (SPEC_NODAL(spec, cfg) ? tracer->mesh->nn : MESH_ELEMOUT(tracer->mesh));
 
-            if (cfg->method == rtBLBadouelGrid) {
-                framelen = cfg->crop0.z;
+            if ((spec & MMC_SPEC_GRID) && cfg->method == rtBLBadouelGrid) {
+                framelen = (tracer->mesh->weightbrick.x) ? (int)MESH_BRICKFRAME(tracer->mesh) : (int)cfg->crop0.z;
             }
 
             ww = currweight - r->weight;
             r->photontimer += r->Lmove * rc;
 
-            if (cfg->outputtype == otWL || cfg->outputtype == otWP) {
-                tshift = MIN( ((int)(cfg->replaytime[r->photonid] * visit->rtstep)), cfg->maxgate - 1 ) * framelen;
-            } else {
+            if ((spec & MMC_SPEC_REPLAY) && (cfg->outputtype == otWL || cfg->outputtype == otWP)) {
+                tshift = replayframe(cfg, r, visit) * framelen;
+            } else if (SPEC_TIME(spec, cfg)) {
                 tshift = MIN( ((int)((r->photontimer - cfg->tstart) * visit->rtstep)), cfg->maxgate - 1 ) * framelen;
+            } else {
+                tshift = 0;
             }
 
-            if (cfg->debuglevel & dlAccum) MMC_FPRINTF(cfg->flog, "A %f %f %f %e %d %e\n",
+            if ((spec & MMC_SPEC_DEBUG) && (cfg->debuglevel & dlAccum)) MMC_FPRINTF(cfg->flog, "A %f %f %f %e %d %e\n",
                         r->p0.x, r->p0.y, r->p0.z, bary.x, eid + 1, dlen);
 
             if (prop->mua > 0.f) {
@@ -1508,21 +2192,17 @@ float branchless_badouel_raytet(ray* r, raytracer* tracer, mcconfig* cfg, visito
             T = _mm_add_ps(S, _mm_mul_ps(O, T));
             _mm_store_ps(&(r->p0.x), T);
 
-            if (cfg->mcmethod == mmMCX) {
-                if (!cfg->basisorder) {
-                    if (cfg->method == rtBLBadouel) {
-                        unsigned int newidx = eid + tshift;
+            if (SPEC_MCX(spec, cfg)) {
+                if (!SPEC_NODAL(spec, cfg)) {
+                    if (!(spec & MMC_SPEC_GRID) || cfg->method == rtBLBadouel || cfg->method == rtBLBadouelPacket) {
+                        unsigned int newidx = MESH_OUTROW(tracer->mesh, eid, tshift);
                         r->oldidx = (r->oldidx == 0xFFFFFFFF) ? newidx : r->oldidx;
 
                         if (newidx != r->oldidx) {
-                            if (cfg->srctype != stPattern || cfg->srcnum == 1) {
-                                #pragma omp atomic
-                                tracer->mesh->weight[r->oldidx] += r->oldweight;
-                            } else if (cfg->srctype == stPattern) {
-                                for (pidx = 0; pidx < cfg->srcnum; pidx++) {
-                                    #pragma omp atomic
-                                    tracer->mesh->weight[r->oldidx * cfg->srcnum + pidx] += r->oldweight * cfg->srcpattern[r->posidx * cfg->srcnum + pidx];
-                                }
+                            if (!(spec & MMC_SPEC_PATTERN) || !MMC_MULTISRC(cfg)) {
+                                accumweight(tracer->mesh->weight, visit, r->oldidx, r->oldweight);
+                            } else {
+                                accumpattern(tracer->mesh->weight, visit, r->oldidx, r->oldweight, cfg->srcpattern + r->posidx * cfg->srcnum, cfg->srcnum);
                             }
 
                             r->oldidx = newidx;
@@ -1532,24 +2212,27 @@ float branchless_badouel_raytet(ray* r, raytracer* tracer, mcconfig* cfg, visito
                         }
 
                         if (r->faceid == -2 || !r->isend) {
-                            if (cfg->srctype != stPattern || cfg->srcnum == 1) {
-                                #pragma omp atomic
-                                tracer->mesh->weight[newidx] += r->oldweight;
-                            } else if (cfg->srctype == stPattern) {
-                                for (pidx = 0; pidx < cfg->srcnum; pidx++) {
-                                    #pragma omp atomic
-                                    tracer->mesh->weight[newidx * cfg->srcnum + pidx] += r->oldweight * cfg->srcpattern[r->posidx * cfg->srcnum + pidx];
-                                }
+                            if (!(spec & MMC_SPEC_PATTERN) || !MMC_MULTISRC(cfg)) {
+                                accumweight(tracer->mesh->weight, visit, newidx, r->oldweight);
+                            } else {
+                                accumpattern(tracer->mesh->weight, visit, newidx, r->oldweight, cfg->srcpattern + r->posidx * cfg->srcnum, cfg->srcnum);
                             }
 
                             r->oldweight = 0.f;
                         }
+
+                        /*the frequency-domain deposits depend on the time of each move, so they are not merged*/
+                        if ((spec & MMC_SPEC_FREQ) && cfg->freqnum > 0) {
+                            accumfreq(r, tracer->mesh, cfg, visit, eid, NULL, ww, r->photontimer - 0.5f * r->Lmove * rc);
+                        }
                     } else {
-                        float dstep, segloss, w0;
+                        float dstep, segloss, w0, tseg, dtseg;
                         int4 idx __attribute__ ((aligned(16)));
                         int i, seg = (int)(r->Lmove / cfg->steps.x) + 1;
                         seg = (seg << 1);
                         dstep = r->Lmove / seg;
+                        dtseg = dstep * rc;
+                        tseg = r->photontimer - r->Lmove * rc + 0.5f * dtseg; /*time at the center of the 1st segment*/
                         segloss = expf(-prop->mua * dstep);
                         T =  _mm_mul_ps(O, _mm_set1_ps(dstep)); /*step*/
                         O =  _mm_sub_ps(S, _mm_load_ps(&(tracer->mesh->nmin.x)));
@@ -1561,20 +2244,14 @@ float branchless_badouel_raytet(ray* r, raytracer* tracer, mcconfig* cfg, visito
                         for (i = 0; i < seg; i++) {
                             P = _mm_cvttps_epi32(_mm_mul_ps(S, _mm_set1_ps(dstep)));
                             _mm_store_si128((__m128i*) & (idx.x), P);
-                            unsigned int newidx = idx.z * cfg->crop0.y + idx.y * cfg->crop0.x + idx.x + tshift;
+                            unsigned int newidx = ((tracer->mesh->weightbrick.x) ? MESH_BRICKROW(tracer->mesh, idx.x, idx.y, idx.z) : idx.z * cfg->crop0.y + idx.y * cfg->crop0.x + idx.x) + tshift;
                             r->oldidx = (r->oldidx == 0xFFFFFFFF) ? newidx : r->oldidx;
 
                             if (newidx != r->oldidx) {
-                                if (cfg->srctype != stPattern || cfg->srcnum == 1) {
-                                    #pragma omp atomic
-                                    tracer->mesh->weight[r->oldidx] += r->oldweight;
-                                } else if (cfg->srctype == stPattern) {
-                                    for (pidx = 0; pidx < cfg->srcnum; pidx++) {
-                                        for (pidx = 0; pidx < cfg->srcnum; pidx++) {
-                                            #pragma omp atomic
-                                            tracer->mesh->weight[r->oldidx * cfg->srcnum + pidx] += r->oldweight * cfg->srcpattern[r->posidx * cfg->srcnum + pidx];
-                                        }
-                                    }
+                                if (!(spec & MMC_SPEC_PATTERN) || !MMC_MULTISRC(cfg)) {
+                                    accumweight(tracer->mesh->weight, visit, r->oldidx, r->oldweight);
+                                } else {
+                                    accumpattern(tracer->mesh->weight, visit, r->oldidx, r->oldweight, cfg->srcpattern + r->posidx * cfg->srcnum, cfg->srcnum);
                                 }
 
                                 r->oldidx = newidx;
@@ -1584,21 +2261,20 @@ float branchless_badouel_raytet(ray* r, raytracer* tracer, mcconfig* cfg, visito
                             }
 
                             if (r->faceid == -2 || !r->isend) {
-                                if (cfg->srctype != stPattern || cfg->srcnum == 1) {
-                                    #pragma omp atomic
-                                    tracer->mesh->weight[newidx] += r->oldweight;
-                                } else if (cfg->srctype == stPattern) {
-                                    for (pidx = 0; pidx < cfg->srcnum; pidx++) {
-                                        for (pidx = 0; pidx < cfg->srcnum; pidx++) {
-                                            #pragma omp atomic
-                                            tracer->mesh->weight[newidx * cfg->srcnum + pidx] += r->oldweight * cfg->srcpattern[r->posidx * cfg->srcnum + pidx];
-                                        }
-                                    }
+                                if (!(spec & MMC_SPEC_PATTERN) || !MMC_MULTISRC(cfg)) {
+                                    accumweight(tracer->mesh->weight, visit, newidx, r->oldweight);
+                                } else {
+                                    accumpattern(tracer->mesh->weight, visit, newidx, r->oldweight, cfg->srcpattern + r->posidx * cfg->srcnum, cfg->srcnum);
                                 }
 
                                 r->oldweight = 0.f;
                             }
 
+                            if ((spec & MMC_SPEC_FREQ) && cfg->freqnum > 0) {
+                                accumfreq(r, tracer->mesh, cfg, visit, newidx - tshift, NULL, w0 * totalloss, tseg);
+                                tseg += dtseg;
+                            }
+
                             w0 *= segloss;
                             S = _mm_add_ps(S, T);
                         }
@@ -1607,25 +2283,43 @@ float branchless_badouel_raytet(ray* r, raytracer* tracer, mcconfig* cfg, visito
                     int i;
                     ww *= 1.f / 3.f;
 
-                    if (cfg->srctype != stPattern || cfg->srcnum == 1) {
+                    if (!(spec & MMC_SPEC_PATTERN) || !MMC_MULTISRC(cfg)) {
                         for (i = 0; i < 3; i++) {
-                            #pragma omp atomic
-                            tracer->mesh->weight[ee[out[faceidx][i]] - 1 + tshift] += ww;
+                            accumnode(tracer->mesh, visit, tshift, eid, out[faceidx][i], ww, NULL, 1);
                         }
-                    } else if (cfg->srctype == stPattern) {
-                        for (pidx = 0; pidx < cfg->srcnum; pidx++) {
-                            for (i = 0; i < 3; i++) {
-                                #pragma omp atomic
-                                tracer->mesh->weight[(ee[out[faceidx][i]] - 1 + tshift)*cfg->srcnum + pidx] += ww * cfg->srcpattern[r->posidx * cfg->srcnum + pidx];
-                            }
+                    } else {
+                        for (i = 0; i < 3; i++) {
+                            accumnode(tracer->mesh, visit, tshift, eid, out[faceidx][i], ww, cfg->srcpattern + r->posidx * cfg->srcnum, cfg->srcnum);
+                        }
+                    }
+
+                    if ((spec & MMC_SPEC_FREQ) && cfg->freqnum > 0) {
+                        float nodew[4] = {0.f, 0.f, 0.f, 0.f};
+
+                        for (i = 0; i < 3; i++) {
+                            nodew[out[faceidx][i]] = 1.f;
                         }
+
+                        accumfreq(r, tracer->mesh, cfg, visit, eid, nodew, ww, r->photontimer - 0.5f * r->Lmove * rc);
                     }
                 }
             }
+
+            if (r->wavew) {
+                float nodew[4] = {0.f, 0.f, 0.f, 0.f};
+                int i;
+
+                for (i = 0; i < 3; i++) {
+                    nodew[out[faceidx][i]] = 1.f / 3.f;
+                }
+
+                accumwave(r, tracer->mesh, cfg, visit, prop, eid, (SPEC_NODAL(spec, cfg) ? nodew : NULL));
+            }
         }
     }
 
     visit->raytet++;
+    MMC_HEAT(visit->heatmap, eid, hmRayTet);
 
     if (tracer->mesh->type[eid] == 0) {
         visit->raytet0++;
@@ -1639,399 +2333,2160 @@ float branchless_badouel_raytet(ray* r, raytracer* tracer, mcconfig* cfg, visito
 
     return r->slen;
 }
-#else
 
 /**
- * Havel, Badouel and Branch-less Badouel-based SSE4 ray-tracer require to compile
- * with SSE4 only. Give an error if not compiled with SSE.
+ * Specialized copies of the ray-tet advance step for the common feature
+ * combinations, the feature tests with a cleared bit are folded at compile time
  */
 
+#define MMC_ADVANCE_SPEC(name, spec) \
+    static float name(ray* r, raytracer* tracer, mcconfig* cfg, visitor* visit, float tmin, int faceidx) { \
+        return badouel_advance_spec(r, tracer, cfg, visit, tmin, faceidx, (spec)); \
+    }
 
-float havel_raytet(ray* r, raytracer* tracer, mcconfig* cfg, visitor* visit) {
-    MMC_ERROR(-6, "wrong option, please recompile with SSE4 enabled");
-    return MMC_UNDEFINED;
-}
-float badouel_raytet(ray* r, raytracer* tracer, mcconfig* cfg, visitor* visit) {
-    MMC_ERROR(-6, "wrong option, please recompile with SSE4 enabled");
-    return MMC_UNDEFINED;
-}
-float branchless_badouel_raytet(ray* r, raytracer* tracer, mcconfig* cfg, visitor* visit) {
-    MMC_ERROR(-6, "wrong option, please recompile with SSE4 enabled");
-    return MMC_UNDEFINED;
-}
-#endif
+MMC_ADVANCE_SPEC(badouel_advance_elem_cw, 0)
+MMC_ADVANCE_SPEC(badouel_advance_node_cw, MMC_SPEC_NODAL)
+MMC_ADVANCE_SPEC(badouel_advance_grid_cw, MMC_SPEC_GRID)
+MMC_ADVANCE_SPEC(badouel_advance_elem_albedo_cw, MMC_SPEC_ALBEDO)
+MMC_ADVANCE_SPEC(badouel_advance_node_albedo_cw, MMC_SPEC_NODAL | MMC_SPEC_ALBEDO)
+MMC_ADVANCE_SPEC(badouel_advance_elem_implicit_cw, MMC_SPEC_IMPLICIT)
+MMC_ADVANCE_SPEC(badouel_advance_node_implicit_cw, MMC_SPEC_NODAL | MMC_SPEC_IMPLICIT)
+MMC_ADVANCE_SPEC(badouel_advance_elem, MMC_SPEC_TIME)
+MMC_ADVANCE_SPEC(badouel_advance_node, MMC_SPEC_TIME | MMC_SPEC_NODAL)
+MMC_ADVANCE_SPEC(badouel_advance_grid, MMC_SPEC_TIME | MMC_SPEC_GRID)
+MMC_ADVANCE_SPEC(badouel_advance_elem_albedo, MMC_SPEC_TIME | MMC_SPEC_ALBEDO)
+MMC_ADVANCE_SPEC(badouel_advance_node_albedo, MMC_SPEC_TIME | MMC_SPEC_NODAL | MMC_SPEC_ALBEDO)
+MMC_ADVANCE_SPEC(badouel_advance_elem_implicit, MMC_SPEC_TIME | MMC_SPEC_IMPLICIT)
+MMC_ADVANCE_SPEC(badouel_advance_node_implicit, MMC_SPEC_TIME | MMC_SPEC_NODAL | MMC_SPEC_IMPLICIT)
 
 /**
- * @brief Saving photon trajectory data for debugging purposes
- * @param[in] p: the position/weight of the current photon packet
- * @param[in] id: the global index of the photon
- * @param[in] gdebugdata: pointer to the global-memory buffer to store the trajectory info
+ * \brief Advance photon by one step using the exit face found by the Badouel ray-tet test
+ *
+ * The generic copy of the advance step, testing all features at run-time. It
+ * is shared by the single-ray SSE4 tracer and the wide-SIMD packet tracer, see
+ * badouel_advance_spec() for details, and branchless_badouel_select() for the
+ * specialized copies.
  */
 
-void savedebugdata(ray* r, unsigned int id, mcconfig* cfg) {
-    unsigned int pos;
-    float* gdebugdata = cfg->exportdebugdata;
-
-    #pragma omp atomic capture
-    pos = cfg->debugdatalen++;
-
-    if (pos < cfg->maxjumpdebug) {
-        pos *= MCX_DEBUG_REC_LEN;
-        ((unsigned int*)gdebugdata)[pos++] = id;
-        gdebugdata[pos++] = r->p0.x;
-        gdebugdata[pos++] = r->p0.y;
-        gdebugdata[pos++] = r->p0.z;
-        gdebugdata[pos++] = r->weight;
-        ((unsigned int*)gdebugdata)[pos++] = r->eid;
-    }
+float branchless_badouel_advance(ray* r, raytracer* tracer, mcconfig* cfg, visitor* visit, float tmin, int faceidx) {
+    return badouel_advance_spec(r, tracer, cfg, visit, tmin, faceidx, MMC_SPEC_ALL);
 }
 
 /**
- * @brief The core Monte Carlo function simulating a single photon (!!!Important!!!)
+ * \brief Select the ray-tet advance step specialized for the features used by a simulation
  *
- * This is the core Monte Carlo simulation function. It simulates the life-time
- * of a single photon packet, from launching to termination.
+ * The dispatch table is ordered from the most to the least specialized copy,
+ * the first copy supporting all features enabled in cfg is returned.
  *
- * \param[in] id: the linear index of the current photon, starting from 0.
- * \param[in] tracer: the ray-tracer aux data structure
+ * \param[in] cfg: simulation configuration structure
+ * \return the advance function to be stored in visitor.advance
+ */
+
+raytetadvance branchless_badouel_select(mcconfig* cfg) {
+    const struct {
+        unsigned int spec;
+        raytetadvance advance;
+    } table[] = {
+        {0, badouel_advance_elem_cw},
+        {MMC_SPEC_NODAL, badouel_advance_node_cw},
+        {MMC_SPEC_GRID, badouel_advance_grid_cw},
+        {MMC_SPEC_ALBEDO, badouel_advance_elem_albedo_cw},
+        {MMC_SPEC_IMPLICIT, badouel_advance_elem_implicit_cw},
+        {MMC_SPEC_NODAL | MMC_SPEC_ALBEDO, badouel_advance_node_albedo_cw},
+        {MMC_SPEC_NODAL | MMC_SPEC_IMPLICIT, badouel_advance_node_implicit_cw},
+        {MMC_SPEC_TIME, badouel_advance_elem},
+        {MMC_SPEC_TIME | MMC_SPEC_NODAL, badouel_advance_node},
+        {MMC_SPEC_TIME | MMC_SPEC_GRID, badouel_advance_grid},
+        {MMC_SPEC_TIME | MMC_SPEC_ALBEDO, badouel_advance_elem_albedo},
+        {MMC_SPEC_TIME | MMC_SPEC_IMPLICIT, badouel_advance_elem_implicit},
+        {MMC_SPEC_TIME | MMC_SPEC_NODAL | MMC_SPEC_ALBEDO, badouel_advance_node_albedo},
+        {MMC_SPEC_TIME | MMC_SPEC_NODAL | MMC_SPEC_IMPLICIT, badouel_advance_node_implicit},
+        {MMC_SPEC_ALL, branchless_badouel_advance}
+    };
+    unsigned int i, need = 0;
+
+    need |= (cfg->implicit) ? MMC_SPEC_IMPLICIT : 0;
+    need |= (cfg->basisorder) ? MMC_SPEC_NODAL : 0;
+    need |= (cfg->method == rtBLBadouelGrid) ? MMC_SPEC_GRID : 0;
+    need |= (cfg->seed == SEED_FROM_FILE || cfg->outputtype == otJacobian || cfg->outputtype == otWL || cfg->outputtype == otWP) ? MMC_SPEC_REPLAY : 0;
+    need |= MMC_MULTISRC(cfg) ? MMC_SPEC_PATTERN : 0;
+    need |= (cfg->freqnum > 0) ? MMC_SPEC_FREQ : 0;
+    need |= (cfg->mcmethod != mmMCX) ? MMC_SPEC_ALBEDO : 0;
+    need |= (cfg->debuglevel & dlAccum) ? MMC_SPEC_DEBUG : 0;
+    need |= (cfg->maxgate > 1) ? MMC_SPEC_TIME : 0;
+
+    for (i = 0; i < sizeof(table) / sizeof(table[0]); i++) {
+        if ((need & ~table[i].spec) == 0) {
+            return table[i].advance;
+        }
+    }
+
+    return branchless_badouel_advance;
+}
+
+#ifdef MMC_USE_AVX_PACKET
+
+/**
+ * \brief AVX-512 packet ray-tet test, tracing 16 rays against their own tets
+ *
+ * The per-face normals of the enclosing tets are fetched using masked gathers
+ * from tracer->n; inactive lanes are masked out and produce no memory access.
+ *
+ * \param[in,out] pk: the SoA ray packet, tmin and faceidx are updated for active lanes
+ * \param[in] tracer: the ray-tracer aux data structure
+ */
+
+__attribute__((target("avx512f")))
+static void packet_raytet_avx512(raypacket* pk, raytracer* tracer) {
+    const float* nbase = &(tracer->n[0].x);
+    const __mmask16 active = (__mmask16)(pk->mask & 0xFFFF);
+    const __m512 zero = _mm512_setzero_ps(), big = _mm512_set1_ps(1e10f);
+    __m512 px, py, pz, vx, vy, vz, Nx, Ny, Nz, dd, T, S, tmin = big;
+    __m512i base, faceidx = _mm512_setzero_si512();
+    __mmask16 m;
+    int f;
+
+    if (!active) {
+        return;
+    }
+
+    base = _mm512_slli_epi32(_mm512_loadu_si512((void*)pk->eid), 4);
+    px = _mm512_loadu_ps(pk->px);
+    py = _mm512_loadu_ps(pk->py);
+    pz = _mm512_loadu_ps(pk->pz);
+    vx = _mm512_loadu_ps(pk->vx);
+    vy = _mm512_loadu_ps(pk->vy);
+    vz = _mm512_loadu_ps(pk->vz);
+
+    for (f = 0; f < 4; f++) {
+        __m512i idx = _mm512_add_epi32(base, _mm512_set1_epi32(f));
+        Nx = _mm512_mask_i32gather_ps(zero, active, idx, nbase, 4);
+        Ny = _mm512_mask_i32gather_ps(zero, active, _mm512_add_epi32(idx, _mm512_set1_epi32(4)), nbase, 4);
+        Nz = _mm512_mask_i32gather_ps(zero, active, _mm512_add_epi32(idx, _mm512_set1_epi32(8)), nbase, 4);
+        dd = _mm512_mask_i32gather_ps(zero, active, _mm512_add_epi32(idx, _mm512_set1_epi32(12)), nbase, 4);
+
+        T = _mm512_mul_ps(Nx, px);
+        T = _mm512_add_ps(T, _mm512_mul_ps(Ny, py));
+        T = _mm512_add_ps(T, _mm512_mul_ps(Nz, pz));
+        T = _mm512_sub_ps(dd, T);
+
+        S = _mm512_mul_ps(Nx, vx);
+        S = _mm512_add_ps(S, _mm512_mul_ps(Ny, vy));
+        S = _mm512_add_ps(S, _mm512_mul_ps(Nz, vz));
+
+        m = _mm512_cmp_ps_mask(S, zero, _CMP_GT_OQ) & active;
+        T = _mm512_mask_div_ps(big, m, T, S);
+
+        /*the last face with the minimal distance wins, consistent with maskmap*/
+        m = (f == 0) ? active : (_mm512_cmp_ps_mask(T, tmin, _CMP_LE_OQ) & active);
+        tmin = _mm512_mask_blend_ps(m, tmin, T);
+        faceidx = _mm512_mask_blend_epi32(m, faceidx, _mm512_set1_epi32(f));
+    }
+
+    _mm512_mask_storeu_ps(pk->tmin, active, tmin);
+    _mm512_mask_storeu_epi32(pk->faceidx, active, faceidx);
+}
+
+/**
+ * \brief AVX2 packet ray-tet test, tracing 8 rays at a time against their own tets
+ *
+ * \param[in,out] pk: the SoA ray packet, tmin and faceidx are updated for active lanes
+ * \param[in] tracer: the ray-tracer aux data structure
+ */
+
+__attribute__((target("avx2")))
+static void packet_raytet_avx2(raypacket* pk, raytracer* tracer) {
+    const float* nbase = &(tracer->n[0].x);
+    const __m256i lanebit = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+    const __m256 zero = _mm256_setzero_ps(), big = _mm256_set1_ps(1e10f);
+    int i, f;
+
+    for (i = 0; i < MMC_PACKET_LEN; i += 8) {
+        int lanes = (pk->mask >> i) & 0xFF;
+        __m256 px, py, pz, vx, vy, vz, Nx, Ny, Nz, dd, T, S, m, active, tmin = big;
+        __m256i base, faceidx = _mm256_setzero_si256();
+
+        if (!lanes) {
+            continue;
+        }
+
+        active = _mm256_castsi256_ps(_mm256_cmpeq_epi32(_mm256_and_si256(_mm256_set1_epi32(lanes), lanebit), lanebit));
+        base = _mm256_slli_epi32(_mm256_loadu_si256((__m256i*)(pk->eid + i)), 4);
+        px = _mm256_loadu_ps(pk->px + i);
+        py = _mm256_loadu_ps(pk->py + i);
+        pz = _mm256_loadu_ps(pk->pz + i);
+        vx = _mm256_loadu_ps(pk->vx + i);
+        vy = _mm256_loadu_ps(pk->vy + i);
+        vz = _mm256_loadu_ps(pk->vz + i);
+
+        for (f = 0; f < 4; f++) {
+            __m256i idx = _mm256_add_epi32(base, _mm256_set1_epi32(f));
+            Nx = _mm256_mask_i32gather_ps(zero, nbase, idx, active, 4);
+            Ny = _mm256_mask_i32gather_ps(zero, nbase, _mm256_add_epi32(idx, _mm256_set1_epi32(4)), active, 4);
+            Nz = _mm256_mask_i32gather_ps(zero, nbase, _mm256_add_epi32(idx, _mm256_set1_epi32(8)), active, 4);
+            dd = _mm256_mask_i32gather_ps(zero, nbase, _mm256_add_epi32(idx, _mm256_set1_epi32(12)), active, 4);
+
+            T = _mm256_mul_ps(Nx, px);
+            T = _mm256_add_ps(T, _mm256_mul_ps(Ny, py));
+            T = _mm256_add_ps(T, _mm256_mul_ps(Nz, pz));
+            T = _mm256_sub_ps(dd, T);
+
+            S = _mm256_mul_ps(Nx, vx);
+            S = _mm256_add_ps(S, _mm256_mul_ps(Ny, vy));
+            S = _mm256_add_ps(S, _mm256_mul_ps(Nz, vz));
+            T = _mm256_div_ps(T, S);
+
+            m = _mm256_cmp_ps(S, zero, _CMP_GT_OQ);
+            T = _mm256_blendv_ps(big, T, m);
+
+            /*the last face with the minimal distance wins, consistent with maskmap*/
+            m = (f == 0) ? active : _mm256_cmp_ps(T, tmin, _CMP_LE_OQ);
+            tmin = _mm256_blendv_ps(tmin, T, m);
+            faceidx = _mm256_castps_si256(_mm256_blendv_ps(_mm256_castsi256_ps(faceidx), _mm256_castsi256_ps(_mm256_set1_epi32(f)), m));
+        }
+
+        _mm256_maskstore_ps(pk->tmin + i, _mm256_castps_si256(active), tmin);
+        _mm256_maskstore_epi32(pk->faceidx + i, _mm256_castps_si256(active), faceidx);
+    }
+}
+
+#endif
+
+/**
+ * \brief SSE4 fallback of the packet ray-tet test, tracing one active lane at a time
+ *
+ * \param[in,out] pk: the SoA ray packet, tmin and faceidx are updated for active lanes
+ * \param[in] tracer: the ray-tracer aux data structure
+ */
+
+static void packet_raytet_sse4(raypacket* pk, raytracer* tracer) {
+    int i;
+
+    for (i = 0; i < MMC_PACKET_LEN; i++) {
+        if (pk->mask & (1u << i)) {
+            float3 p0 = {pk->px[i], pk->py[i], pk->pz[i], 0.f};
+            float3 vec = {pk->vx[i], pk->vy[i], pk->vz[i], 0.f};
+            pk->faceidx[i] = badouel_intersect(tracer, pk->eid[i], &p0, &vec, pk->tmin + i);
+        }
+    }
+}
+
+/**
+ * \brief Detect the widest SIMD instruction set supported by the running CPU
+ *
+ * \return 16 if AVX-512F is available, 8 if AVX2 is available, 4 otherwise
+ */
+
+int packet_width(void) {
+    static int width = 0;
+
+    if (width == 0) {
+        int simdwidth = 4;
+#ifdef MMC_USE_AVX_PACKET
+        __builtin_cpu_init();
+
+        if (__builtin_cpu_supports("avx512f")) {
+            simdwidth = 16;
+        } else if (__builtin_cpu_supports("avx2")) {
+            simdwidth = 8;
+        }
+
+#endif
+        width = simdwidth;
+    }
+
+    return width;
+}
+
+/**
+ * \brief Packet ray-tet test dispatcher
+ *
+ * Calls the AVX-512, AVX2 or SSE4 implementation depending on the instruction
+ * sets supported by the running CPU, so that the same binary can run on both
+ * new and old processors. Meshes with more than MMC_PACKET_MAXNE elements use
+ * the SSE4 path, as the gather indices are signed 32-bit.
+ *
+ * \param[in,out] pk: the SoA ray packet, tmin and faceidx are updated for active lanes
+ * \param[in] tracer: the ray-tracer aux data structure
+ */
+
+void packet_raytet(raypacket* pk, raytracer* tracer) {
+#ifdef MMC_USE_AVX_PACKET
+    int width = (tracer->mesh->ne <= MMC_PACKET_MAXNE) ? packet_width() : 4;
+
+    if (width == 16) {
+        packet_raytet_avx512(pk, tracer);
+        return;
+    } else if (width == 8) {
+        packet_raytet_avx2(pk, tracer);
+        return;
+    }
+
+#endif
+    packet_raytet_sse4(pk, tracer);
+}
+#else
+
+/**
+ * Havel, Badouel and Branch-less Badouel-based SSE4 ray-tracer require to compile
+ * with SSE4 only. Give an error if not compiled with SSE.
+ */
+
+
+float havel_raytet(ray* r, raytracer* tracer, mcconfig* cfg, visitor* visit) {
+    MMC_ERROR(-6, "wrong option, please recompile with SSE4 enabled");
+    return MMC_UNDEFINED;
+}
+float badouel_raytet(ray* r, raytracer* tracer, mcconfig* cfg, visitor* visit) {
+    MMC_ERROR(-6, "wrong option, please recompile with SSE4 enabled");
+    return MMC_UNDEFINED;
+}
+float branchless_badouel_raytet(ray* r, raytracer* tracer, mcconfig* cfg, visitor* visit) {
+    MMC_ERROR(-6, "wrong option, please recompile with SSE4 enabled");
+    return MMC_UNDEFINED;
+}
+float branchless_badouel_advance(ray* r, raytracer* tracer, mcconfig* cfg, visitor* visit, float tmin, int faceidx) {
+    MMC_ERROR(-6, "wrong option, please recompile with SSE4 enabled");
+    return MMC_UNDEFINED;
+}
+raytetadvance branchless_badouel_select(mcconfig* cfg) {
+    return branchless_badouel_advance;
+}
+void packet_raytet(raypacket* pk, raytracer* tracer) {
+    MMC_ERROR(-6, "wrong option, please recompile with SSE4 enabled");
+}
+int packet_width(void) {
+    return 1;
+}
+#endif
+
+/**
+ * @brief Saving photon trajectory data for debugging purposes
+ *
+ * Only the photons with an index divisible by cfg->trajsample are recorded.
+ * The positions are buffered in the thread's visitor, and handed over in
+ * blocks of MMC_TRAJ_BUF_LEN by visitor_flushtraj().
+ *
+ * @param[in] r: the position/weight of the current photon packet
+ * @param[in] id: the global index of the photon
+ * @param[in] cfg: simulation configuration structure
+ * @param[in,out] visit: statistics counters of this thread, holding the trajectory buffer
+ */
+
+void savedebugdata(ray* r, unsigned int id, mcconfig* cfg, visitor* visit) {
+    float* rec;
+
+    if (cfg->trajsample > 1 && id % cfg->trajsample) {
+        return;
+    }
+
+    if (visit->trajbuf == NULL) {
+        visit->trajbuf = (float*)malloc(sizeof(float) * MCX_DEBUG_REC_LEN * MMC_TRAJ_BUF_LEN);
+    }
+
+    rec = visit->trajbuf + (visit->trajlen++) * MCX_DEBUG_REC_LEN;
+    ((unsigned int*)rec)[0] = id;
+    rec[1] = r->p0.x;
+    rec[2] = r->p0.y;
+    rec[3] = r->p0.z;
+    rec[4] = r->weight;
+    ((unsigned int*)rec)[5] = r->eid;
+
+    if (visit->trajlen == MMC_TRAJ_BUF_LEN) {
+        visitor_flushtraj(cfg, visit);
+    }
+}
+
+/**
+ * @brief Fold the float block sums of the launched and absorbed weights into double
+ *
+ * Summing a block of at most MMC_WEIGHT_BLOCK photons in float keeps the
+ * round-off of the block small, and the double totals do not saturate, so
+ * the per-photon update needs no Kahan compensation and vectorizes across
+ * the source patterns. The totals round differently from a Kahan sum, so
+ * the normalizer differs from it by about 1e-7 relative. This is called
+ * every MMC_WEIGHT_BLOCK launched photons, and must be called before
+ * launchweight/absorbweight are read.
+ *
+ * @param[in] cfg: simulation configuration structure
+ * @param[in,out] visit: statistics counters of this thread
+ */
+
+void visitor_foldweight(mcconfig* cfg, visitor* visit) {
+    int i;
+
+    for (i = 0; i < cfg->srcnum; i++) {
+        visit->launchweight[i] += visit->launchblock[i];
+        visit->absorbweight[i] += visit->absorbblock[i];
+        visit->launchblock[i] = 0.f;
+        visit->absorbblock[i] = 0.f;
+    }
+
+    visit->blockcount = 0;
+}
+
+/**
+ * @brief Hand the buffered trajectory positions of a thread over to the host
+ *
+ * If cfg->exportdebugdata is NULL (a standalone run), the positions are
+ * appended to the .mct file; otherwise a block of cfg->exportdebugdata is
+ * reserved with a single atomic update of cfg->debugdatalen, and the
+ * positions beyond cfg->maxjumpdebug are dropped, but still counted.
+ *
+ * @param[in,out] cfg: simulation configuration structure
+ * @param[in,out] visit: statistics counters of this thread, holding the trajectory buffer
+ */
+
+void visitor_flushtraj(mcconfig* cfg, visitor* visit) {
+    unsigned int pos;
+
+    if (visit->trajlen == 0) {
+        return;
+    }
+
+#ifndef MCX_CONTAINER
+
+    if (cfg->exportdebugdata == NULL) {
+        #pragma omp critical (mmc_streamtraj)
+        mesh_appendtrajectory(visit->trajbuf, visit->trajlen, cfg);
+
+        visit->trajlen = 0;
+        return;
+    }
+
+#endif
+
+    #pragma omp atomic capture
+    {
+        pos = cfg->debugdatalen;
+        cfg->debugdatalen += visit->trajlen;
+    }
+
+    if (pos < cfg->maxjumpdebug) {
+        memcpy(cfg->exportdebugdata + (size_t)pos * MCX_DEBUG_REC_LEN, visit->trajbuf,
+               sizeof(float) * MCX_DEBUG_REC_LEN * MIN(visit->trajlen, cfg->maxjumpdebug - pos));
+    }
+
+    visit->trajlen = 0;
+}
+
+/**
+ * @brief Launch a photon and prepare its state for the first ray-tet test
+ *
+ * This function initializes the photon state, launches the photon from the
+ * source and accumulates the launched weight.
+ *
+ * \param[out] ph: the state of the photon to be launched
+ * \param[in] id: the linear index of the current photon, starting from 0.
+ * \param[in] slot: the index of the visitor scratch arena slot used by this photon
+ * \param[in] tracer: the ray-tracer aux data structure
  * \param[in] mesh: the mesh data structure
+ * \param[in,out] cfg: simulation configuration structure
  * \param[in,out] ran: the random number generator states
  * \param[in,out] ran0: the additional random number generator states
- * \param[in,out] cfg: simulation configuration structure
  * \param[out] visit: statistics counters of this thread
+ * \param[in] spec: MMC_SPEC_TRACE to enable the trace output, a compile-time constant
  */
 
-void onephoton(size_t id, raytracer* tracer, tetmesh* mesh, mcconfig* cfg,
-               RandType* ran, RandType* ran0, visitor* visit) {
+MMC_SPEC_INLINE void photon_launch_spec(photonstate* ph, size_t id, int slot, raytracer* tracer, tetmesh* mesh, mcconfig* cfg,
+                                        RandType* ran, RandType* ran0, visitor* visit, const unsigned int spec) {
 
-    int oldeid, fixcount = 0, exitdet = 0;
-    int* enb;
-    float mom;
-    float kahany, kahant;
-    ray r = {cfg->srcpos, {cfg->srcdir.x, cfg->srcdir.y, cfg->srcdir.z}, {MMC_UNDEFINED, 0.f, 0.f}, cfg->bary0, cfg->e0, cfg->dim.y - 1, 0, 0, 1.f, 0.f, 0.f, 0.f, 0.f, 0., 0, NULL, NULL, cfg->srcdir.w, 0, 0xFFFFFFFF, 0.0, NULL, 0, 0, 0, 0};
+    int pidx;
+    ray r0 = {cfg->srcpos, {cfg->srcdir.x, cfg->srcdir.y, cfg->srcdir.z}, {MMC_UNDEFINED, 0.f, 0.f}, cfg->bary0, cfg->e0, cfg->dim.y - 1, 0, 0, 1.f, 0.f, 0.f, 0.f, 0.f, 0., 0, NULL, NULL, cfg->srcdir.w, 0, 0xFFFFFFFF, 0.0, NULL, 0, 0, 0, 0};
+    ray* r = &(ph->r);
+
+    *r = r0;
+
+    /*the listed sources take turns, the photon carries the row of its source in the identity srcpattern*/
+    if (cfg->srclist) {
+        int src = (int)(id % cfg->srcnum);
+
+        r->p0.x = cfg->srclist[src * 2].x;
+        r->p0.y = cfg->srclist[src * 2].y;
+        r->p0.z = cfg->srclist[src * 2].z;
+        r->vec.x = cfg->srclist[src * 2 + 1].x;
+        r->vec.y = cfg->srclist[src * 2 + 1].y;
+        r->vec.z = cfg->srclist[src * 2 + 1].z;
+        r->focus = cfg->srclist[src * 2 + 1].w;
+        r->eid = cfg->srclistelem[src];
+        r->bary0 = cfg->srclistbary[src];
+        r->posidx = src;
+    }
 
-    float (*engines[5])(ray * r, raytracer * tracer, mcconfig * cfg, visitor * visit) =
-    {plucker_raytet, havel_raytet, badouel_raytet, branchless_badouel_raytet, branchless_badouel_raytet};
-    float (*tracercore)(ray * r, raytracer * tracer, mcconfig * cfg, visitor * visit);
+    ph->id = id;
+    ph->stage = psOuter;
+    ph->oldeid = 0;
+    ph->fixcount = 0;
+    ph->exitdet = 0;
+    ph->nreflect = 0;
+    ph->nroihit = 0;
+    ph->labelmask = 0;
+    ph->heatmap = visit->heatmap;
+
+    /*reuse the per-thread scratch arena, no heap allocation is needed per photon*/
+    r->partialpath = visit->scratchpath + slot * (visit->reclen - 1);
+    memset(r->partialpath, 0, (visit->reclen - 1) * sizeof(float));
+    r->photonid = id;
+
+    /*position the photon's own stream, the result does not depend on the thread running it*/
+    if (rand_is_counter()) {
+        if (cfg->seed == SEED_FROM_FILE && cfg->photonseed) {
+            memcpy(ph->ran, ((RandType*)cfg->photonseed) + id * RAND_BUF_LEN, sizeof(RandType) * RAND_BUF_LEN);
+        } else {
+            rng_seek_photon(ph->ran, ran, id);
+        }
 
-    r.partialpath = (float*)calloc(visit->reclen - 1, sizeof(float));
-    r.photonid = id;
+        ran = ph->ran;
+    }
 
     if (cfg->issavedet && cfg->issaveseed) {
-        r.photonseed = (void*)calloc(1, (sizeof(RandType) * RAND_BUF_LEN));
-        memcpy(r.photonseed, (void*)ran, (sizeof(RandType)*RAND_BUF_LEN));
+        r->photonseed = (char*)visit->scratchseed + slot * (sizeof(RandType) * RAND_BUF_LEN);
+        memcpy(r->photonseed, (void*)ran, (sizeof(RandType)*RAND_BUF_LEN));
     }
 
-    tracercore = engines[0];
+    /*initialize the photon parameters*/
+    launchphoton(cfg, r, mesh, ran, ran0);
 
-    if (cfg->method >= rtPlucker && cfg->method <= rtBLBadouelGrid) {
-        tracercore = engines[(int)(cfg->method)];
-    } else {
-        MMC_ERROR(-6, "specified ray-tracing algorithm is not defined");
+    if (r->eid > 0) {
+        ph->labelmask = MMC_LABEL_BIT(mesh->type[r->eid - 1]);
     }
 
-    /*initialize the photon parameters*/
-    launchphoton(cfg, &r, mesh, ran, ran0);
+    ph->importance = (r->eid > 0) ? MESH_IMPORTANCE(cfg, mesh->type[r->eid - 1]) : 1.f;
 
-    if (cfg->debuglevel & dlTraj) {
-        savedebugdata(&r, (unsigned int)id, cfg);
+    if (visit->scratchwave) {
+        r->wavew = visit->scratchwave + slot * (cfg->wavenum - 1);
+
+        for (pidx = 0; pidx < cfg->wavenum - 1; pidx++) {
+            r->wavew[pidx] = r->weight;
+        }
     }
 
-    /*use Kahan summation to accumulate weight, otherwise, counter stops at 16777216*/
-    /*http://stackoverflow.com/questions/2148149/how-to-sum-a-large-number-of-float-number*/
-    int pidx;
+    if (MMC_TRACE(spec, cfg, dlTraj)) {
+        savedebugdata(r, (unsigned int)id, cfg, visit);
+    }
 
-    if (cfg->srctype != stPattern || cfg->srcnum == 1) {
-        r.partialpath[visit->reclen - 2] = r.weight;
+    /*the launched weight is summed in float over a block of photons, then folded into double by visitor_foldweight()*/
+
+    if (!MMC_MULTISRC(cfg)) {
+        r->partialpath[visit->reclen - 2] = r->weight;
 
         if (cfg->seed == SEED_FROM_FILE && (cfg->outputtype == otWL || cfg->outputtype == otWP)) {
-            kahany = cfg->replayweight[r.photonid] - visit->kahanc0[0];    /* when replay mode, accumulate detected photon weight */
+            visit->launchblock[0] += cfg->replayweight[r->photonid];    /* when replay mode, accumulate detected photon weight */
         } else {
-            kahany = r.weight - visit->kahanc0[0];
+            visit->launchblock[0] += r->weight;
         }
+    } else {
+        *((int*)(r->partialpath + visit->reclen - 2)) = r->posidx;
 
-        kahant = visit->launchweight[0] + kahany;
-        visit->kahanc0[0] = (kahant - visit->launchweight[0]) - kahany;
-        visit->launchweight[0] = kahant;
-    } else if (cfg->srctype == stPattern) {
-        *((int*)(r.partialpath + visit->reclen - 2)) = r.posidx;
+        if (cfg->seed == SEED_FROM_FILE && (cfg->outputtype == otWL || cfg->outputtype == otWP)) {
+            float w = cfg->replayweight[r->photonid];
 
-        for (pidx = 0; pidx < cfg->srcnum; pidx++) {
-            if (cfg->seed == SEED_FROM_FILE && (cfg->outputtype == otWL || cfg->outputtype == otWP)) {
-                kahany = cfg->replayweight[r.photonid] - visit->kahanc0[pidx];    /* when replay mode, accumulate detected photon weight */
-            } else {
-                kahany = r.weight * cfg->srcpattern[r.posidx * cfg->srcnum + pidx] - visit->kahanc0[pidx];
+            #pragma omp simd
+            for (pidx = 0; pidx < cfg->srcnum; pidx++) {
+                visit->launchblock[pidx] += w;
             }
+        } else {
+            const float* pattern = cfg->srcpattern + r->posidx * cfg->srcnum;
+            float w = r->weight;
 
-            kahant = visit->launchweight[pidx] + kahany;
-            visit->kahanc0[pidx] = (kahant - visit->launchweight[pidx]) - kahany;
-            visit->launchweight[pidx] = kahant;
+            #pragma omp simd
+            for (pidx = 0; pidx < cfg->srcnum; pidx++) {
+                visit->launchblock[pidx] += w * pattern[pidx];
+            }
         }
     }
 
-#ifdef MMC_USE_SSE
-    const float int_coef_arr[4] = { -1.f, -1.f, -1.f, 1.f };
-    int_coef = _mm_load_ps(int_coef_arr);
+    if (++visit->blockcount >= MMC_WEIGHT_BLOCK) {
+        visitor_foldweight(cfg, visit);
+    }
+
+#ifdef MMC_USE_SSE
+    /** retrieve the iMMC ROI size and ray location at initial launch */
+    if (cfg->implicit) {
+        updateroi(cfg->implicit, r, tracer->mesh);
+        traceroi(r, tracer, cfg->implicit, 1);
+    }
+
+#endif
+
+    if (cfg->implicit) {
+        updateroi(cfg->implicit, r, tracer->mesh);
+    }
+}
+
+/**
+ * @brief Request the ray-tet test that starts a new scattering path
+ *
+ * \param[in,out] ph: the state of the photon
+ * \param[in] tracer: the ray-tracer aux data structure
+ * \param[in] cfg: simulation configuration structure
+ * \return peTrace
+ */
+
+static inline int photon_nexttrace(photonstate* ph, raytracer* tracer, mcconfig* cfg) {
+    if (cfg->implicit) {
+        updateroi(cfg->implicit, &(ph->r), tracer->mesh);
+    }
+
+    ph->stage = psOuter;
+    return peTrace;
+}
+
+/**
+ * @brief Decide if a photon exits the domain or continues to scatter at the end of a path
+ *
+ * \param[in] r: the current ray
+ * \return peExit if the photon leaves the mesh or misses, peScatter otherwise
+ */
+
+static inline int photon_endpath(ray* r) {
+    return (r->eid <= 0 || r->pout.x == MMC_UNDEFINED) ? peExit : peScatter;
+}
+
+/**
+ * @brief Process the result of the ray-tet test requested by ph->stage
+ *
+ * This function accumulates the partial path of the last ray-tet test and
+ * retries the test when the photon hits an edge or a vertex.
+ *
+ * \param[in,out] ph: the state of the photon
+ * \param[in] tracer: the ray-tracer aux data structure
+ * \param[in] mesh: the mesh data structure
+ * \param[in,out] cfg: simulation configuration structure
+ * \param[in,out] ran: the random number generator states
+ * \return the next event of the photon, see TPhotonEvent
+ */
+
+int photon_traced(photonstate* ph, raytracer* tracer, tetmesh* mesh, mcconfig* cfg, RandType* ran) {
+    ray* r = &(ph->r);
+
+    switch (ph->stage) {
+        case psOuter:
+            if (r->eid <= 0) {
+                ph->stage = psDone;
+                return peDone;    /*launched outside of the mesh and missed it*/
+            }
+
+            if (r->pout.x == MMC_UNDEFINED) {
+                if (r->faceid == -2) {
+                    ph->stage = psDone;
+                    return peDone;    /*reaches the time limit*/
+                }
+
+                MMC_HEAT(ph->heatmap, r->eid - 1, hmFix);
+
+                if (ph->fixcount++ < MAX_TRIAL) {
+                    fixphoton((FLOAT3*)&r->p0, mesh->node, (int*)(mesh->elem + (r->eid - 1)*mesh->elemlen));
+                    return photon_nexttrace(ph, tracer, cfg);
+                }
+
+                r->eid = ID_UNDEFINED;
+                r->faceid = -1;
+            }
+
+            if (cfg->issavedet && r->Lmove > 0.f && mesh->type[r->eid - 1] > 0 && r->faceid >= 0) {
+                r->partialpath[SAVE_NSCAT(cfg->savedetflag) * mesh->prop - 1 + mesh->type[r->eid - 1]] += r->Lmove;    /*the partial path block follows the optional scattering counts*/
+            }
+
+            if (cfg->implicit && cfg->isreflect && r->roitype && r->roiidx >= 0 && (mesh->med[cfg->his.maxmedia].n != MESH_ELEMMED(mesh, r->eid - 1)->n)) {
+                reflectrayroi(cfg, (FLOAT3*)&r->vec, (FLOAT3*)&r->p0, tracer, &r->eid, &r->inroi, ran, r->roitype, r->roiidx, r->refeid);
+                vec_mult_add(&r->p0, &r->vec, 1.0f, 10 * EPS, &r->p0);
+                ph->nreflect++;
+                ph->nroihit++;
+                MMC_HEAT(ph->heatmap, r->eid - 1, hmReflect);
+                return photon_nexttrace(ph, tracer, cfg);
+            } else if (cfg->implicit && r->roitype) {
+                ph->nroihit++;
+                return photon_nexttrace(ph, tracer, cfg);
+            }
+
+            break;
+
+        case psInner:
+            if (cfg->issavedet && r->Lmove > 0.f && mesh->type[r->eid - 1] > 0) {
+                r->partialpath[SAVE_NSCAT(cfg->savedetflag) * mesh->prop - 1 + mesh->type[r->eid - 1]] += r->Lmove;
+            }
+
+            if (r->faceid == -2) {
+                return photon_endpath(r);
+            }
+
+            ph->fixcount = 0;
+            break;
+
+        case psFix:
+            if (cfg->issavedet && r->Lmove > 0.f && mesh->type[r->eid - 1] > 0) {
+                r->partialpath[SAVE_NSCAT(cfg->savedetflag) * mesh->prop - 1 + mesh->type[r->eid - 1]] += r->Lmove;
+            }
+
+            break;
+
+        default:
+            return peDone;
+    }
+
+    if (ph->stage != psOuter) {
+        if (r->pout.x == MMC_UNDEFINED) {
+            MMC_HEAT(ph->heatmap, r->eid - 1, hmFix);
+        }
+
+        if (r->pout.x == MMC_UNDEFINED && ph->fixcount++ < MAX_TRIAL) {
+            fixphoton((FLOAT3*)&r->p0, mesh->node, (int*)(mesh->elem + (r->eid - 1)*mesh->elemlen));
+            ph->stage = psFix;
+            return peTrace;
+        }
+
+        if (r->pout.x == MMC_UNDEFINED) {
+            /*possibily hit an edge or miss*/
+            r->eid = ID_UNDEFINED;
+            return photon_endpath(r);
+        }
+    }
+
+    /*move a photon until the end of the current scattering path*/
+    if (r->faceid >= 0 && !r->isend && !r->roitype) {
+        return peBoundary;
+    }
+
+    return photon_endpath(r);
+}
+
+/**
+ * @brief Move a photon across the exit face into the neighboring tet
+ *
+ * This function handles the reflection/transmission at the face, as well as
+ * entering or exiting the domain from/into the background.
+ *
+ * \param[in,out] ph: the state of the photon
+ * \param[in] tracer: the ray-tracer aux data structure
+ * \param[in] mesh: the mesh data structure
+ * \param[in,out] cfg: simulation configuration structure
+ * \param[in,out] ran: the random number generator states
+ * \param[in] spec: MMC_SPEC_TRACE to enable the trace output, a compile-time constant
+ * \return the next event of the photon, see TPhotonEvent
+ */
+
+MMC_SPEC_INLINE int photon_boundary_spec(photonstate* ph, raytracer* tracer, tetmesh* mesh, mcconfig* cfg, RandType* ran, const unsigned int spec) {
+    ray* r = &(ph->r);
+    int* enb;
+
+    memcpy((void*)&r->p0, (void*)&r->pout, sizeof(r->p0));
+
+    enb = (int*)(mesh->facenb + (r->eid - 1) * mesh->elemlen);
+    ph->oldeid = r->eid;
+    r->eid = enb[r->faceid];
+
+    /*the neighbor's media decide the reflection even if the photon does not enter it*/
+    if (r->eid > 0) {
+        ph->labelmask |= MMC_LABEL_BIT(mesh->type[r->eid - 1]);
+    }
+
+    if (cfg->implicit) {
+        if (cfg->isreflect && (r->eid <= 0 || MESH_ELEMMED(mesh, r->eid - 1)->n != MESH_ELEMMED(mesh, ph->oldeid - 1)->n )) {
+            if (! (!r->inroi && r->eid <= 0 && ((MESH_ELEMMED(mesh, ph->oldeid - 1)->n == cfg->nout && cfg->isreflect != (int)bcMirror) || cfg->isreflect == (int)bcAbsorbExterior) ) ) {
+                reflectray(cfg, &r->vec, tracer, &ph->oldeid, &r->eid, r->faceid, ran, r->inroi);
+                ph->nreflect++;
+                MMC_HEAT(ph->heatmap, ph->oldeid - 1, hmReflect);
+            }
+        }
+    } else if (mesh->facereflect) {
+        if (mesh->facereflect[ph->oldeid - 1] & (1 << r->faceid)) {
+            reflectray(cfg, &r->vec, tracer, &ph->oldeid, &r->eid, r->faceid, ran, r->inroi);
+            ph->nreflect++;
+            MMC_HEAT(ph->heatmap, ph->oldeid - 1, hmReflect);
+        }
+    } else {
+        if (cfg->isreflect && (r->eid <= 0 || MESH_ELEMMED(mesh, r->eid - 1)->n != MESH_ELEMMED(mesh, ph->oldeid - 1)->n )) {
+            if (! (r->eid <= 0 && ((MESH_ELEMMED(mesh, ph->oldeid - 1)->n == cfg->nout && cfg->isreflect != (int)bcMirror) || cfg->isreflect == (int)bcAbsorbExterior) ) ) {
+                reflectray(cfg, &r->vec, tracer, &ph->oldeid, &r->eid, r->faceid, ran, r->inroi);
+                ph->nreflect++;
+                MMC_HEAT(ph->heatmap, ph->oldeid - 1, hmReflect);
+            }
+        }
+    }
+
+    if (r->eid <= 0) {
+        return photon_endpath(r);
+    }
+
+    /*when a photon enters the domain from the background*/
+    if (mesh->type[ph->oldeid - 1] == 0 && mesh->type[r->eid - 1]) {
+        if (MMC_TRACE(spec, cfg, dlExit))
+            MMC_FPRINTF(cfg->flog, "e %f %f %f %f %f %f %f %d\n", r->p0.x, r->p0.y, r->p0.z,
+                        r->vec.x, r->vec.y, r->vec.z, r->weight, r->eid);
+
+        if (!cfg->voidtime) {
+            r->photontimer = 0.f;
+        }
+    }
+
+    /*when a photon exits the domain into the background*/
+    if (mesh->type[ph->oldeid - 1] && mesh->type[r->eid - 1] == 0) {
+        if (MMC_TRACE(spec, cfg, dlExit))
+            MMC_FPRINTF(cfg->flog, "x %f %f %f %f %f %f %f %d\n", r->p0.x, r->p0.y, r->p0.z,
+                        r->vec.x, r->vec.y, r->vec.z, r->weight, r->eid);
+
+        if (!cfg->isextdet) {
+            r->eid = 0;
+            return photon_endpath(r);
+        }
+    }
+
+    if (r->pout.x != MMC_UNDEFINED && MMC_TRACE(spec, cfg, dlMove)) {
+        MMC_FPRINTF(cfg->flog, "P %f %f %f %d %zu %e\n", r->pout.x, r->pout.y, r->pout.z, r->eid, ph->id, r->slen);
+    }
+
+    if (cfg->implicit) {
+        updateroi(cfg->implicit, r, tracer->mesh);
+    }
+
+    ph->stage = psInner;
+    return peTrace;
+}
+
+/**
+ * @brief Project a detected photon through the camera lens onto the sensor (Camera)
+ *
+ * The same thin-lens model as map_photon_to_camera_sensor() in mmc_core.cl:
+ * a photon exiting towards -z is traced to the lens plane, refracted if it
+ * passes the aperture, traced to the sensor and its exit weight is added to
+ * the hit pixel. The last two entries count the projected and the detected
+ * photons, as in the GPU kernel.
+ *
+ * \param[in] r: the detected photon at its exit position
+ * \param[in] cfg: simulation configuration structure
+ * \param[in,out] visit: statistics counters of this thread, the image is visit->camsignals
+ */
+
+static void accumcamera(ray* r, mcconfig* cfg, visitor* visit) {
+    int dimx = cfg->cam_image_width, dimy = cfg->cam_image_height, pixelnum = dimx * dimy, ix, iy;
+    float len, tlens, tsensor, magnification, lensx, lensy, dx, dy, vx, vy, vz;
+
+    if (r->vec.z >= 0.f) {
+        return;
+    }
+
+    visit->camsignals[pixelnum + 1]++;
+
+    if (cfg->cam_focal_length < 0.f || cfg->cam_obj_dist < 0.f || cfg->cam_proj_dist < 0.f || cfg->cam_aperture_radius < 0.f) {
+        return;
+    }
+
+    visit->camsignals[pixelnum]++;
+
+    len = 1.f / sqrtf(r->vec.x * r->vec.x + r->vec.y * r->vec.y + r->vec.z * r->vec.z);
+    vx = r->vec.x * len;
+    vy = r->vec.y * len;
+    vz = r->vec.z * len;
+    magnification = -cfg->cam_proj_dist / cfg->cam_obj_dist;
+
+    /*hit point on the lens, relative to the lens center at the image center*/
+    tlens = (cfg->cam_obj_dist + r->p0.z) / fabsf(r->p0.z);
+    lensx = r->p0.x + vx * tlens;
+    lensy = r->p0.y + vy * tlens;
+    dx = lensx - dimx * 0.5f;
+    dy = lensy - dimy * 0.5f;
+
+    if (dx * dx + dy * dy > cfg->cam_aperture_radius * cfg->cam_aperture_radius) {
+        return;
+    }
+
+    /*refract by the lens, trace to the sensor, then undo the magnification around the sensor center*/
+    vx -= dx * fabsf(vz) / cfg->cam_focal_length;
+    vy -= dy * fabsf(vz) / cfg->cam_focal_length;
+    tsensor = cfg->cam_proj_dist / fabsf(vz);
+    ix = (int)floorf((lensx + vx * tsensor - dimx * 0.5f) / magnification + dimx * 0.5f);
+    iy = (int)floorf((lensy + vy * tsensor - dimy * 0.5f) / magnification + dimy * 0.5f);
+
+    if (ix < 0 || ix >= dimx || iy < 0 || iy >= dimy) {
+        return;
+    }
+
+    visit->camsignals[iy * dimx + ix] += r->weight;
+}
+
+/**
+ * @brief Handle a photon leaving the mesh: save exit info, diffuse reflectance and detector id
+ *
+ * \param[in,out] ph: the state of the photon
+ * \param[in] mesh: the mesh data structure
+ * \param[in,out] cfg: simulation configuration structure
+ * \param[out] visit: statistics counters of this thread
+ * \param[in] spec: MMC_SPEC_TRACE to enable the trace output, a compile-time constant
+ * \return peDone
+ */
+
+MMC_SPEC_INLINE int photon_exit_spec(photonstate* ph, tetmesh* mesh, mcconfig* cfg, visitor* visit, const unsigned int spec) {
+    ray* r = &(ph->r);
+
+    if (r->eid != ID_UNDEFINED && MMC_TRACE(spec, cfg, dlMove)) {
+        MMC_FPRINTF(cfg->flog, "B %f %f %f %d %zu %e\n", r->p0.x, r->p0.y, r->p0.z, r->eid, ph->id, r->slen);
+    }
+
+    if (r->eid != ID_UNDEFINED) {
+        if (MMC_TRACE(spec, cfg, dlExit))
+            MMC_FPRINTF(cfg->flog, "E %f %f %f %f %f %f %f %d\n", r->p0.x, r->p0.y, r->p0.z,
+                        r->vec.x, r->vec.y, r->vec.z, r->weight, r->eid);
+
+        if (cfg->issavedet && cfg->issaveexit) {                                   /*when issaveexit is set to 1*/
+            memcpy(r->partialpath + (visit->reclen - 2 - 6), &(r->p0.x), sizeof(float) * 3); /*columns 7-5 from the right store the exit positions*/
+            memcpy(r->partialpath + (visit->reclen - 2 - 3), &(r->vec.x), sizeof(float) * 3); /*columns 4-2 from the right store the exit dirs*/
+        }
+
+        if (cfg->issaveref && r->eid < 0 && mesh->dref) {
+            int tshift = MIN( ((int)((r->photontimer - cfg->tstart) * visit->rtstep)), cfg->maxgate - 1 ) * mesh->nf;
+            mesh->dref[((-r->eid) - 1) + tshift] += r->weight;
+        }
+    } else if (r->faceid == -2 && MMC_TRACE(spec, cfg, dlMove)) {
+        MMC_FPRINTF(cfg->flog, "T %f %f %f %d %zu %e\n", r->p0.x, r->p0.y, r->p0.z, r->eid, ph->id, r->slen);
+    } else if (r->eid && r->faceid != -2  && MMC_TRACE(spec, cfg, dlEdge)) {
+        MMC_FPRINTF(cfg->flog, "X %f %f %f %d %zu %e\n", r->p0.x, r->p0.y, r->p0.z, r->eid, ph->id, r->slen);
+    }
+
+    if (cfg->issavedet && r->eid <= 0) {
+        int i;
+
+        if (cfg->detnum == 0 && cfg->isextdet && mesh->type[ph->oldeid - 1] == mesh->prop + 1) {
+            ph->exitdet = ph->oldeid;
+        } else {
+            int k, candlen = cfg->detnum, *cand = NULL;
+
+            /*only test the detectors binned in the grid cell enclosing the exit position*/
+            if (mesh->detgrid) {
+                cand = mesh_gridquery(mesh->detgrid, (FLOAT3*) & (r->p0), &candlen);
+            }
+
+            for (k = 0; k < candlen; k++) {
+                i = (cand ? cand[k] : k);
+
+                if ((cfg->detpos[i].x - r->p0.x) * (cfg->detpos[i].x - r->p0.x) +
+                        (cfg->detpos[i].y - r->p0.y) * (cfg->detpos[i].y - r->p0.y) +
+                        (cfg->detpos[i].z - r->p0.z) * (cfg->detpos[i].z - r->p0.z) < cfg->detpos[i].w * cfg->detpos[i].w) {
+                    ph->exitdet = i + 1;
+                    break;
+                }
+            }
+        }
+
+        if (ph->exitdet > 0 && visit->camsignals) {
+            accumcamera(r, cfg, visit);
+        }
+    }
+
+    ph->stage = psDone;
+    return peDone;  /*photon exits boundary*/
+}
+
+/**
+ * @brief Walk a straight path from a point in a tet to the boundary of the domain
+ *
+ * The exit face of each tet is the nearest face ahead of the path, the path
+ * then enters the face neighbor, until it leaves the mesh or enters the
+ * background (label 0), or its optical depth exceeds MMC_NEE_MAXTAU.
+ *
+ * \param[in] mesh: the mesh data structure
+ * \param[in] e: the index (start from 0) of the tet enclosing the starting point
+ * \param[in,out] p: the starting point, moved to the exit point
+ * \param[in] u: the unit direction of the path
+ * \param[out] tau: the optical depth, sum((mua+mus)*l) over the crossed tets
+ * \param[in,out] tof: the time of flight, incremented by those of the crossed tets
+ * \param[out] nf: the unit outward normal of the exit face
+ * \return the refractive index of the last tet if the path leaves the domain, 0 otherwise
+ */
+
+static float nexteventwalk(tetmesh* mesh, int e, FLOAT3* p, FLOAT3* u, float* tau, float* tof, FLOAT3* nf) {
+    FLOAT3* nodes = mesh->node;
+    int j, k;
+
+    *tau = 0.f;
+
+    for (k = 0; k < mesh->ne && *tau < MMC_NEE_MAXTAU; k++) {
+        int* ee = (int*)(mesh->elem + e * mesh->elemlen);
+        medium* prop = MESH_ELEMMED(mesh, e);
+        float tmin = 1e10f;
+        int face = -1, nb;
+
+        for (j = 0; j < 4; j++) {
+            FLOAT3 ab, ac, ap, fn;
+            float un;
+
+            vec_diff3(&nodes[ee[out[j][0]] - 1], &nodes[ee[out[j][1]] - 1], &ab);
+            vec_diff3(&nodes[ee[out[j][0]] - 1], &nodes[ee[out[j][2]] - 1], &ac);
+            vec_cross3(&ab, &ac, &fn);
+            un = vec_dot3(u, &fn);
+
+            if (un > 0.f) {
+                float t;
+
+                vec_diff3(p, &nodes[ee[out[j][0]] - 1], &ap);
+                t = vec_dot3(&ap, &fn) / un;
+
+                if (t < tmin) {
+                    tmin = t;
+                    face = j;
+                    *nf = fn;
+                }
+            }
+        }
+
+        if (face < 0) {
+            return 0.f;
+        }
+
+        tmin = MAX(tmin, 0.f);
+        *tau += (prop->mua + prop->mus) * tmin;
+        *tof += tmin * prop->n * R_C0;
+        vec_mult_add3(u, p, tmin, 1.f, p);
+
+        nb = mesh->facenb[e * mesh->elemlen + faceorder[face]];
+
+        if (nb <= 0 || mesh->type[nb - 1] == 0) {
+            vec_mult3(nf, 1.f / sqrtf(vec_dot3(nf, nf)), nf);
+            return prop->n;
+        }
+
+        e = nb - 1;
+    }
+
+    return 0.f;
+}
+
+/**
+ * @brief Score the next-event estimate of the detectors at a scattering event (--nextevent)
+ *
+ * Before the new direction is sampled, each detector within cfg->nextevent mm
+ * scores the weight that would leave the domain through it if the photon
+ * scattered into the cone that encloses the detector disk (the sphere of the
+ * detector radius around its center) and crossed the mesh on a straight path:
+ * w*p(cos(theta))*exp(-sum((mua+mus)*l))*T*Omega, where p is the phase function
+ * (per sr) of the medium, the sum runs over the tets crossed by the path (see
+ * nexteventwalk), T is the Fresnel transmission of the exit face with -b 1 and
+ * Omega is the solid angle of the cone; a path scores only if it leaves the
+ * domain within the detector radius, as a detected photon. Aiming in solid
+ * angle keeps the score bounded by w*p*Omega at the sites next to a detector.
+ * The directions run over a spherical Fibonacci lattice of the cone, which
+ * keeps the RNG streams of the photons untouched, and the whole sphere is
+ * used at the sites inside that of the detector. The score is added to the
+ * time gate of its arrival. The refraction and reflection at the internal
+ * interfaces are not followed.
+ *
+ * \param[in] r: the photon at the scattering site, before its direction is updated
+ * \param[in] mesh: the mesh data structure
+ * \param[in] cfg: simulation configuration structure
+ * \param[in,out] visit: statistics counters of this thread, the scores are added to visit->nee
+ */
+
+static void nexteventscore(ray* r, tetmesh* mesh, mcconfig* cfg, visitor* visit) {
+    float lenunit = (cfg->method != rtBLBadouelGrid) ? cfg->unitinmm : 1.f;
+    int type = mesh->type[r->eid - 1], i, k;
+    medium* prop = MESH_ELEMMED(mesh, r->eid - 1);
+    float g = prop->g, w = r->weight;
+    const float* invcdf = MESH_INVCDF(cfg, type);
+
+    if (type == 0 || prop->mus <= 0.f) {
+        return;
+    }
+
+    if (cfg->mcmethod != mmMCX) {  /*the albedo weight of the scattered photon, see albedoweight()*/
+        w *= prop->mus / (prop->mua + prop->mus);
+    }
+
+    for (i = 0; i < cfg->detnum; i++) {
+        float4* det = cfg->detpos + i;
+        FLOAT3 p = {r->p0.x, r->p0.y, r->p0.z}, u, nf;
+        float dist, calpha, ctheta, phase, trans = 1.f, tau, tof = r->photontimer, n1, score;
+        int ntg;
+
+        vec_diff3(&p, (FLOAT3*)det, &u);
+        dist = sqrtf(vec_dot3(&u, &u));
+
+        if (dist * lenunit > cfg->nextevent) {
+            continue;
+        }
+
+        /*the next direction of the spherical Fibonacci lattice of the cone around the detector center*/
+        calpha = (dist > det->w) ? sqrtf(1.f - (det->w * det->w) / (dist * dist)) : -1.f;
+        {
+            FLOAT3 e1, e2, a = {0.f, 0.f, 0.f}, axis = {0.f, 0.f, 1.f};
+            float ct, st, phi, sphi, cphi;
+
+            if (dist > EPS) {
+                vec_mult3(&u, 1.f / dist, &axis);
+            }
+
+            k = (int)(visit->neecount++ % MMC_NEE_LATTICE);
+            ct = 1.f - (1.f - calpha) * (k + 0.5f) / MMC_NEE_LATTICE;
+            st = sqrtf(MAX(1.f - ct * ct, 0.f));
+            phi = k * 2.39996323f;
+            mmc_sincosf(phi, &sphi, &cphi);
+
+            *((fabsf(axis.x) < 0.9f) ? &a.x : &a.y) = 1.f;
+            vec_cross3(&a, &axis, &e1);
+            vec_mult3(&e1, 1.f / sqrtf(vec_dot3(&e1, &e1)), &e1);
+            vec_cross3(&axis, &e1, &e2);
+            vec_mult3(&axis, ct, &u);
+            vec_mult_add3(&e1, &u, st * cphi, 1.f, &u);
+            vec_mult_add3(&e2, &u, st * sphi, 1.f, &u);
+        }
+
+        ctheta = u.x * r->vec.x + u.y * r->vec.y + u.z * r->vec.z;
+
+        if (invcdf) { /*the piecewise-linear inverse CDF of mesh_buildinvcdf has a piecewise-constant density*/
+            int lo = 0, hi = cfg->nphase - 1;
+
+            if (ctheta < invcdf[lo] || ctheta >= invcdf[hi]) {
+                continue;
+            }
+
+            while (hi - lo > 1) {
+                k = (lo + hi) >> 1;
+                *((invcdf[k] <= ctheta) ? &lo : &hi) = k;
+            }
+
+            phase = (invcdf[hi] > invcdf[lo]) ? 1.f / ((cfg->nphase - 1) * (invcdf[hi] - invcdf[lo]) * TWO_PI) : 0.f;
+        } else if (g > EPS) {
+            phase = (1.f - g * g) / (2.f * TWO_PI * powf(1.f + g * g - 2.f * g * ctheta, 1.5f));
+        } else {
+            phase = 1.f / (2.f * TWO_PI);
+        }
+
+        if ((n1 = nexteventwalk(mesh, r->eid - 1, &p, &u, &tau, &tof, &nf)) == 0.f || tof >= cfg->tend) {
+            continue;
+        }
+
+        /*the path must leave the domain through the detector, as a detected photon*/
+        vec_diff3(&p, (FLOAT3*)det, &p);
+
+        if (vec_dot3(&p, &p) > det->w * det->w) {
+            continue;
+        }
+
+        if (cfg->isreflect && n1 != cfg->nout) {
+            float cosq = vec_dot3(&u, &nf), tmp0 = n1 * n1, tmp1 = cfg->nout * cfg->nout, tmp2 = 1.f - tmp0 / tmp1 * (1.f - cosq * cosq), Re, Im, Rtotal;
+
+            if (tmp2 <= 0.f) {
+                continue;  /*total internal reflection*/
+            }
+
+            Re = tmp0 * cosq * cosq + tmp1 * tmp2;
+            tmp2 = sqrtf(tmp2);
+            Im = 2.f * n1 * cfg->nout * cosq * tmp2;
+            Rtotal = (Re - Im) / (Re + Im);
+            Re = tmp1 * cosq * cosq + tmp0 * tmp2 * tmp2;
+            trans = 1.f - (Rtotal + (Re - Im) / (Re + Im)) * 0.5f;
+        }
+
+        ntg = MIN(MAX((int)((tof - cfg->tstart) * visit->rtstep), 0), cfg->maxgate - 1);
+        score = w * phase * expf(-tau) * trans * TWO_PI * (1.f - calpha);
+        visit->nee[(size_t)i * (cfg->maxgate + 1) + ntg] += score;
+        visit->nee[(size_t)i * (cfg->maxgate + 1) + cfg->maxgate] += score;
+    }
+}
+
+/**
+ * @brief Move a photon deep inside a --diffusion label across a sphere by the diffusion kernel
+ *
+ * Instead of scattering, a photon at least cfg->diffmin transport mean free
+ * paths away from the boundary of its label (see mesh_builddiffusion) jumps
+ * to a uniform random point of the sphere of radius R = mesh->diffradius
+ * around it. The path length L = 3*tau*R^2*mutr is drawn from the quantiles
+ * of the dimensionless first-passage time tau = D*t/R^2 of the diffusion
+ * equation, D = 1/(3*mutr), mutr = mua+mus*(1-g); the weight absorbed along
+ * L, w*(1-exp(-mua*L)), is deposited in the start element (or shared by its
+ * nodes) at the time gate of the middle of the jump. The photon leaves the
+ * sphere in a cosine-weighted direction about the outward normal and
+ * starts a new scattering path. A jump crossing the end of the time window
+ * deposits the weight absorbed until then and terminates the photon.
+ *
+ * \param[in,out] ph: the state of the photon
+ * \param[in] tracer: the ray-tracer aux data structure
+ * \param[in] mesh: the mesh data structure
+ * \param[in] cfg: simulation configuration structure
+ * \param[in,out] ran: the random number generator states
+ * \param[in,out] visit: statistics counters of this thread
+ * \return -1 if the photon scatters explicitly, otherwise the next event of the photon
+ */
+
+static int diffusionjump(photonstate* ph, raytracer* tracer, tetmesh* mesh, mcconfig* cfg, RandType* ran, visitor* visit) {
+    ray* r = &(ph->r);
+    int eid = r->eid - 1, type = mesh->type[eid], i, k, e1 = 0, datalen = (cfg->basisorder) ? mesh->nn : MESH_ELEMOUT(mesh);
+    medium* prop = mesh->med + type;
+    float radius = mesh->diffradius[eid], mutr = prop->mua + prop->mus * (1.f - prop->g), rc = prop->n * R_C0;
+    float u, len, ww, ct, st, sphi, cphi;
+    const float* pattern = MMC_MULTISRC(cfg) ? cfg->srcpattern + r->posidx * cfg->srcnum : NULL;
+    FLOAT3 dir, p1;
+    size_t tshift;
+
+    if (radius * mutr < cfg->diffmin) {
+        return -1;
+    }
+
+    u = rand_uniform01(ran) * MMC_DIFF_CDF_LEN - 0.5f;
+    k = MIN(MAX((int)floorf(u), 0), MMC_DIFF_CDF_LEN - 2);
+    u = MIN(MAX(u - k, 0.f), 1.f);
+    len = 3.f * (mesh->difftau[k] + u * (mesh->difftau[k + 1] - mesh->difftau[k])) * radius * radius * mutr;
+
+    ct = 2.f * rand_uniform01(ran) - 1.f;
+    st = sqrtf(MAX(1.f - ct * ct, 0.f));
+    mmc_sincosf(TWO_PI * rand_uniform01(ran), &sphi, &cphi);
+    dir.x = st * cphi;
+    dir.y = st * sphi;
+    dir.z = ct;
+    p1.x = r->p0.x + radius * dir.x;
+    p1.y = r->p0.y + radius * dir.y;
+    p1.z = r->p0.z + radius * dir.z;
+
+    if (r->photontimer + len * rc >= cfg->tend) {
+        len = MAX((cfg->tend - r->photontimer) / rc, 0.f);
+    } else if ((e1 = mesh_walkelem(mesh, eid, &p1)) == 0) {
+        return -1;    /*the landing point is too close to a face, scatter explicitly*/
+    }
+
+    ww = r->weight * (1.f - expf(-prop->mua * len));
+    r->weight -= ww;
+    r->Eabsorb += ww;
+    tshift = (size_t)MIN(((int)((r->photontimer + 0.5f * len * rc - cfg->tstart) * visit->rtstep)), cfg->maxgate - 1) * datalen;
+
+    if (prop->mua > 0.f && cfg->outputtype != otEnergy && cfg->outputtype != otWP) {
+        ww /= prop->mua;
+    }
+
+    if (!cfg->basisorder) {
+        if (pattern) {
+            accumpattern(mesh->weight, visit, MESH_OUTROW(mesh, eid, tshift), ww, pattern, cfg->srcnum);
+        } else {
+            accumweight(mesh->weight, visit, MESH_OUTROW(mesh, eid, tshift), ww);
+        }
+    } else {
+        for (i = 0; i < 4; i++) {
+            accumnode(mesh, visit, tshift, eid, i, ww * 0.25f, pattern, (pattern ? cfg->srcnum : 1));
+        }
+    }
+
+    if (cfg->issavedet && type > 0) {
+        r->partialpath[SAVE_NSCAT(cfg->savedetflag) * mesh->prop - 1 + type] += len;
+
+        if (SAVE_NSCAT(cfg->savedetflag)) {
+            r->partialpath[type - 1] += prop->mus * len;      /*the expected number of scattering events of the jump*/
+        }
+    }
+
+    r->photontimer += len * rc;
+
+    if (e1 == 0) {
+        ph->stage = psDone;
+        return peDone;
+    }
+
+    /*leave the sphere in a cosine-weighted direction about the outward normal dir*/
+    {
+        FLOAT3 e2, e3, a = {0.f, 0.f, 0.f};
+
+        *((fabsf(dir.x) < 0.9f) ? &a.x : &a.y) = 1.f;
+        vec_cross3(&a, &dir, &e2);
+        vec_mult3(&e2, 1.f / sqrtf(vec_dot3(&e2, &e2)), &e2);
+        vec_cross3(&dir, &e2, &e3);
+        ct = sqrtf(rand_uniform01(ran));
+        st = sqrtf(MAX(1.f - ct * ct, 0.f));
+        mmc_sincosf(TWO_PI * rand_uniform01(ran), &sphi, &cphi);
+        r->vec.x = ct * dir.x + st * (cphi * e2.x + sphi * e3.x);
+        r->vec.y = ct * dir.y + st * (cphi * e2.y + sphi * e3.y);
+        r->vec.z = ct * dir.z + st * (cphi * e2.z + sphi * e3.z);
+    }
+
+    r->p0.x = p1.x;
+    r->p0.y = p1.y;
+    r->p0.z = p1.z;
+    r->eid = e1;
+    mesh_barycentric(e1, &(r->bary0.x), &p1, mesh);
+    r->slen0 = rand_next_scatlen(ran);
+    r->slen = r->slen0;
+
+    return photon_nexttrace(ph, tracer, cfg);
+}
+
+/**
+ * @brief Perform Russian roulette and sample a new scattering direction and path length
+ *
+ * \param[in,out] ph: the state of the photon
+ * \param[in] tracer: the ray-tracer aux data structure
+ * \param[in] mesh: the mesh data structure
+ * \param[in,out] cfg: simulation configuration structure
+ * \param[in,out] ran: the random number generator states
+ * \param[in,out] ran0: the additional random number generator states
+ * \param[out] visit: statistics counters of this thread
+ * \param[in] spec: MMC_SPEC_TRACE to enable the trace output, a compile-time constant
+ * \return peTrace if the photon survives, peDone if it is terminated by the roulette
+ */
+
+MMC_SPEC_INLINE int photon_scatter_spec(photonstate* ph, raytracer* tracer, tetmesh* mesh, mcconfig* cfg,
+                                        RandType* ran, RandType* ran0, visitor* visit, const unsigned int spec) {
+    ray* r = &(ph->r);
+    float mom;
+
+    if (MMC_TRACE(spec, cfg, dlMove)) {
+        MMC_FPRINTF(cfg->flog, "M %f %f %f %d %zu %e\n", r->p0.x, r->p0.y, r->p0.z, r->eid, ph->id, r->slen);
+    }
+
+    if (cfg->minenergy > 0.f && r->weight < cfg->minenergy && (cfg->tend - cfg->tstart)*visit->rtstep <= 1.f) { /*Russian Roulette*/
+        if (rand_do_roulette(ran)*cfg->roulettesize <= 1.f) {
+            r->weight *= cfg->roulettesize;
+
+            if (r->wavew) {
+                int k;
+
+                for (k = 0; k < cfg->wavenum - 1; k++) {
+                    r->wavew[k] *= cfg->roulettesize;
+                }
+            }
+
+            if (MMC_TRACE(spec, cfg, dlWeight)) {
+                MMC_FPRINTF(cfg->flog, "Russian Roulette bumps r->weight to %f\n", r->weight);
+            }
+        } else {
+            ph->stage = psDone;
+            return peDone;
+        }
+    }
+
+    if (cfg->implicit && cfg->isreflect && r->roitype && r->roiidx >= 0 && (mesh->med[cfg->his.maxmedia].n != MESH_ELEMMED(mesh, r->eid - 1)->n)) {
+        reflectrayroi(cfg, (FLOAT3*)&r->vec, (FLOAT3*)&r->p0, tracer, &r->eid, &r->inroi, ran, r->roitype, r->roiidx, r->refeid);
+        vec_mult_add(&r->p0, &r->vec, 1.0f, 10 * EPS, &r->p0);
+        ph->nreflect++;
+        ph->nroihit++;
+        MMC_HEAT(ph->heatmap, r->eid - 1, hmReflect);
+        return photon_nexttrace(ph, tracer, cfg);
+    } else if (cfg->implicit && r->roitype) {
+        ph->nroihit++;
+        return photon_nexttrace(ph, tracer, cfg);
+    }
+
+    /*the scattering event is sampled with the mus of the 1st wavelength, weight the others by their mus ratio*/
+    if (r->wavew) {
+        int k, medlen = mesh->prop + 1 + cfg->isextdet, type = (cfg->implicit && r->inroi) ? mesh->prop : mesh->type[r->eid - 1];
+        float mus = mesh->med[type].mus;
+
+        for (k = 0; k < cfg->wavenum - 1; k++) {
+            r->wavew[k] *= (mus > 0.f) ? mesh->wavemed[k * medlen + type].mus / mus : 1.f;
+        }
+    }
+
+    if (mesh->diffradius && mesh->diffradius[r->eid - 1] > 0.f) {
+        int event = diffusionjump(ph, tracer, mesh, cfg, ran, visit);
+
+        if (event >= 0) {
+            return event;
+        }
+    }
+
+    if (visit->nee) {
+        nexteventscore(r, mesh, cfg, visit);
+    }
+
+    mom = 0.f;
+    r->slen0 = mc_next_scatter(MESH_ELEMMED(mesh, r->eid - 1)->g, MESH_INVCDF(cfg, mesh->type[r->eid - 1]), &r->vec, ran, ran0, cfg, &mom);
+    r->slen = r->slen0;
+
+    if (MMC_TRACE(spec, cfg, dlTraj)) {
+        savedebugdata(r, (unsigned int)ph->id, cfg, visit);
+    }
+
+    if (cfg->mcmethod != mmMCX) {
+        albedoweight(r, mesh, cfg, visit);
+    }
+
+    if (cfg->ismomentum && mesh->type[r->eid - 1] > 0) {              /*when ismomentum is set to 1*/
+        r->partialpath[(SAVE_NSCAT(cfg->savedetflag) + 1) * mesh->prop - 1 + mesh->type[r->eid - 1]] += mom;    /*the momentum transfer block follows the partial paths*/
+    }
+
+    if (SAVE_NSCAT(cfg->savedetflag)) {
+        r->partialpath[mesh->type[r->eid - 1] - 1]++;                  /*the first medianum block stores the scattering event counts*/
+    }
+
+    return photon_nexttrace(ph, tracer, cfg);
+}
+
+/**
+ * @brief Reserve the slot of a detected photon in the buffer shared by all threads
+ *
+ * The slot index is taken with an atomic increment; the segment holding it is
+ * allocated by the first thread reaching it, the segment table is checked
+ * again inside a critical section so that racing threads share the segment.
+ *
+ * @param[in,out] buf: the shared detected photon buffer
+ * @param[out] seg: the index of the segment holding the slot
+ * @param[out] seed: the address of the seed of the record, only valid if buf->seedbyte > 0
+ * @return the address of the record
+ */
+
+static inline float* detslot(detbuffer* buf, unsigned int* seg, unsigned char** seed) {
+    unsigned int slot, pos;
+    float* segment;
+
+    #pragma omp atomic capture
+    slot = buf->count++;
+
+    *seg = slot / buf->seglen;
+
+    if (*seg >= buf->segnum) {
+        MMC_ERROR(-4, "the detected photon buffer is full");
+    }
+
+    #pragma omp atomic read
+    segment = buf->seg[*seg];
+
+    if (segment == NULL) {
+        #pragma omp critical(mmc_detbuffer)
+        {
+            segment = buf->seg[*seg];
+
+            if (segment == NULL) {
+                segment = (float*)malloc((size_t)buf->seglen * (buf->reclen * sizeof(float) + buf->seedbyte));
+
+                if (segment == NULL) {
+                    MMC_ERROR(-4, "can not allocate a segment of the detected photon buffer");
+                }
+
+                #pragma omp atomic write
+                buf->seg[*seg] = segment;
+            }
+        }
+    }
+
+    pos = slot % buf->seglen;
+    *seed = (unsigned char*)(segment + (size_t)buf->seglen * buf->reclen) + (size_t)pos * buf->seedbyte;
+    return segment + (size_t)pos * buf->reclen;
+}
+
+/**
+ * @brief Return the weight of a detected photon, from the partial paths of its record
+ *
+ * \param[in] r: the detected photon, r->partialpath holds its record without the detector ID
+ * \param[in] mesh: the mesh data structure
+ * \param[in] cfg: simulation configuration structure
+ * \param[in] visit: statistics counters of this thread, provides the record length
+ */
+
+static inline float detectedweight(ray* r, tetmesh* mesh, mcconfig* cfg, visitor* visit) {
+    float detw = MMC_MULTISRC(cfg) ? 1.f : r->partialpath[visit->reclen - 2];
+    int pidx;
+
+    for (pidx = 1; pidx <= mesh->prop; pidx++) {
+        detw *= expf(-mesh->med[pidx].mua * r->partialpath[SAVE_NSCAT(cfg->savedetflag) * mesh->prop - 1 + pidx]);
+    }
+
+    return detw;
+}
+
+/**
+ * @brief Add a detected photon to the DCS field autocorrelation g1(tau) of its detector (--dcs)
+ *
+ * A photon of weight w and momentum transfer Y_m in medium m adds
+ * w*exp(-sum_m(k0_m^2*Y_m)*<dr^2(tau)>/3) to each correlation time, where
+ * k0_m=2*pi*n_m/lambda and the mean square displacement <dr^2(tau)> is
+ * 6*Db*tau (Brownian) or (V*tau)^2 (random flow), as in matlab/generate_g1.m;
+ * w is also added to the normalizer of the detector.
+ *
+ * \param[in] r: the detected photon, r->partialpath holds its record without the detector ID
+ * \param[in] mesh: the mesh data structure
+ * \param[in] cfg: simulation configuration structure
+ * \param[in,out] visit: statistics counters of this thread, the sums are added to visit->dcsg1
+ * \param[in] detid: the 1-based detector ID
+ * \param[in] detw: the detected weight of the photon
+ */
+
+static void accumdcs(ray* r, tetmesh* mesh, mcconfig* cfg, visitor* visit, int detid, float detw) {
+    double* g1 = visit->dcsg1 + (size_t)(detid - 1) * (cfg->dcstaunum + 1);
+    float* mom = r->partialpath + (SAVE_NSCAT(cfg->savedetflag) + 1) * mesh->prop;
+    double k0 = TWO_PI / (cfg->dcslambda * 1e-6), k2y = 0.0;
+    int i;
+
+    for (i = 0; i < mesh->prop; i++) {
+        k2y += k0 * k0 * mesh->med[i + 1].n * mesh->med[i + 1].n * mom[i];
+    }
+
+    for (i = 0; i < cfg->dcstaunum; i++) {
+        double tau = cfg->dcstau[i], msd = (cfg->dcsmodel == 'b') ? 6.0 * cfg->dcsdv * tau : (cfg->dcsdv * tau) * (cfg->dcsdv * tau);
+
+        g1[i] += detw * exp(-k2y * msd / 3.0);
+    }
+
+    g1[cfg->dcstaunum] += detw;
+}
+
+/**
+ * @brief Add a detected photon to the statistics of its detector (--detstat)
+ *
+ * The weight is added to the time gate of the photon, and, multiplied by the
+ * partial path and the scattering count of each medium, to the sums of the
+ * mean partial paths and scattering counts; see mcx_detstatlen for the layout.
+ *
+ * \param[in] r: the detected photon, r->partialpath holds its record without the detector ID
+ * \param[in] mesh: the mesh data structure
+ * \param[in] cfg: simulation configuration structure
+ * \param[in,out] visit: statistics counters of this thread, the sums are added to visit->detstat
+ * \param[in] detid: the 1-based detector ID
+ * \param[in] detw: the detected weight of the photon
+ */
+
+static void accumdetstat(ray* r, tetmesh* mesh, mcconfig* cfg, visitor* visit, int detid, float detw) {
+    int i, ntg = (int)((r->photontimer - cfg->tstart) / cfg->tstep);
+    double* stat = visit->detstat + (size_t)(detid - 1) * visit->statlen;
+    float* nscat = r->partialpath, *plen = r->partialpath + SAVE_NSCAT(cfg->savedetflag) * mesh->prop;
+
+    stat[MIN(MAX(ntg, 0), cfg->maxgate - 1)] += detw;
+
+    for (i = 0; i < mesh->prop; i++) {
+        stat[cfg->maxgate + i] += detw * plen[i];
+        stat[cfg->maxgate + mesh->prop + i] += detw * nscat[i];
+    }
+
+    stat[visit->statlen - 1] += detw;
+}
+
+/**
+ * @brief Terminate a photon, saving the detected photon data and absorbed weight
+ *
+ * \param[in,out] ph: the state of the terminated photon
+ * \param[in] tracer: the ray-tracer aux data structure
+ * \param[in] mesh: the mesh data structure
+ * \param[in,out] cfg: simulation configuration structure
+ * \param[out] visit: statistics counters of this thread
+ * \param[in] spec: MMC_SPEC_TRACE to enable the trace output, a compile-time constant
+ */
+
+MMC_SPEC_INLINE void photon_finish_spec(photonstate* ph, raytracer* tracer, tetmesh* mesh, mcconfig* cfg, visitor* visit, const unsigned int spec) {
+    ray* r = &(ph->r);
+    int pidx;
+
+    visit->nphoton++;
+    visit->nreflect += ph->nreflect;
+    visit->nroihit += ph->nroihit;
+
+    if (cfg->incmask) {
+        #pragma omp atomic
+        cfg->incmask[ph->id / MMC_INC_BATCH] |= ph->labelmask;
+    }
+
+    /*with --dcs or --detstat, a detected photon only adds to the sums of its detector, no record is kept*/
+    if (cfg->issavedet && ph->exitdet > 0 && (visit->dcsg1 || visit->detstat)) {
+        float detw = detectedweight(r, mesh, cfg, visit);
+
+        visit->ndetected++;
+
+        if (visit->dcsg1) {
+            accumdcs(r, mesh, cfg, visit, ph->exitdet, detw);
+        }
+
+        if (visit->detstat) {
+            accumdetstat(r, mesh, cfg, visit, ph->exitdet, detw);
+        }
+    } else if (cfg->issavedet && ph->exitdet > 0) {
+        float* rec;
+        unsigned char* seed = NULL;
+        unsigned int seg = 0;
+
+        visit->ndetected++;
+
+        if (visit->detbuf) {
+            rec = detslot(visit->detbuf, &seg, &seed);
+        } else {
+            if (visit->bufpos >= visit->detcount) {
+                visit->detcount += DET_PHOTON_BUF;
+                visit->partialpath = (float*)realloc(visit->partialpath,
+                                                     visit->detcount * visit->reclen * sizeof(float));
+
+                if (cfg->issaveseed) {
+                    visit->photonseed = realloc(visit->photonseed, visit->detcount * (sizeof(RandType) * RAND_BUF_LEN));
+                }
+            }
+
+            rec = visit->partialpath + visit->bufpos * visit->reclen;
+
+            if (cfg->issaveseed) {
+                seed = (unsigned char*)visit->photonseed + visit->bufpos * (sizeof(RandType) * RAND_BUF_LEN);
+            }
+
+            visit->bufpos++;
+        }
+
+        rec[0] = ph->exitdet;
+        memcpy(rec + 1, r->partialpath, (visit->reclen - 1)*sizeof(float));
+
+        /*detected weight, as computed from the partial paths of the saved record*/
+        if (visit->detweight) {
+            visit->detweight[(ph->exitdet <= cfg->detnum) ? ph->exitdet - 1 : 0] += detectedweight(r, mesh, cfg, visit);
+        }
+
+        if (cfg->issaveseed) {
+            memcpy(seed, r->photonseed, (sizeof(RandType)*RAND_BUF_LEN));
+        }
+
+        /*publish the record, a segment is streamed out once all its records are written*/
+        if (visit->detbuf) {
+            #pragma omp flush
+            #pragma omp atomic update
+            visit->detbuf->filled[seg]++;
+        }
+    }
+
+    r->partialpath = NULL;
+    r->photonseed = NULL;
+
+    if (MMC_TRACE(spec, cfg, dlTraj)) {
+        savedebugdata(r, (unsigned int)ph->id, cfg, visit);
+    }
+
+    if (!MMC_MULTISRC(cfg)) {
+        visit->absorbblock[0] += r->Eabsorb;
+    } else {
+        const float* pattern = cfg->srcpattern + r->posidx * cfg->srcnum;
+        float w = r->Eabsorb;
+
+        #pragma omp simd
+        for (pidx = 0; pidx < cfg->srcnum; pidx++) {
+            visit->absorbblock[pidx] += w * pattern[pidx];
+        }
+    }
+}
+
+/**
+ * Instrumented and release copies of the photon stages, see MMC_STAGE(). The
+ * photon drivers run the release copies, in which the trace output tests are
+ * folded at compile time, unless one of MMC_TRACE_FLAGS is set when a photon
+ * (or a group of photons) is started
+ */
+
+void photon_launch(photonstate* ph, size_t id, int slot, raytracer* tracer, tetmesh* mesh, mcconfig* cfg,
+                   RandType* ran, RandType* ran0, visitor* visit) {
+    photon_launch_spec(ph, id, slot, tracer, mesh, cfg, ran, ran0, visit, MMC_SPEC_TRACE);
+}
+
+static void photon_launch_release(photonstate* ph, size_t id, int slot, raytracer* tracer, tetmesh* mesh, mcconfig* cfg,
+                                  RandType* ran, RandType* ran0, visitor* visit) {
+    photon_launch_spec(ph, id, slot, tracer, mesh, cfg, ran, ran0, visit, 0);
+}
+
+int photon_boundary(photonstate* ph, raytracer* tracer, tetmesh* mesh, mcconfig* cfg, RandType* ran) {
+    return photon_boundary_spec(ph, tracer, mesh, cfg, ran, MMC_SPEC_TRACE);
+}
+
+static int photon_boundary_release(photonstate* ph, raytracer* tracer, tetmesh* mesh, mcconfig* cfg, RandType* ran) {
+    return photon_boundary_spec(ph, tracer, mesh, cfg, ran, 0);
+}
+
+int photon_exit(photonstate* ph, tetmesh* mesh, mcconfig* cfg, visitor* visit) {
+    return photon_exit_spec(ph, mesh, cfg, visit, MMC_SPEC_TRACE);
+}
+
+static int photon_exit_release(photonstate* ph, tetmesh* mesh, mcconfig* cfg, visitor* visit) {
+    return photon_exit_spec(ph, mesh, cfg, visit, 0);
+}
+
+int photon_scatter(photonstate* ph, raytracer* tracer, tetmesh* mesh, mcconfig* cfg,
+                   RandType* ran, RandType* ran0, visitor* visit) {
+    return photon_scatter_spec(ph, tracer, mesh, cfg, ran, ran0, visit, MMC_SPEC_TRACE);
+}
+
+static int photon_scatter_release(photonstate* ph, raytracer* tracer, tetmesh* mesh, mcconfig* cfg,
+                                  RandType* ran, RandType* ran0, visitor* visit) {
+    return photon_scatter_spec(ph, tracer, mesh, cfg, ran, ran0, visit, 0);
+}
+
+void photon_finish(photonstate* ph, raytracer* tracer, tetmesh* mesh, mcconfig* cfg, visitor* visit) {
+    photon_finish_spec(ph, tracer, mesh, cfg, visit, MMC_SPEC_TRACE);
+}
+
+static void photon_finish_release(photonstate* ph, raytracer* tracer, tetmesh* mesh, mcconfig* cfg, visitor* visit) {
+    photon_finish_spec(ph, tracer, mesh, cfg, visit, 0);
+}
+
+/**
+ * @brief Advance a photon after a ray-tet test until the next ray-tet test is needed
+ *
+ * This function runs the photon events (face crossing, exiting, scattering)
+ * following the ray-tet test stored in ph->r in the same order as the
+ * original propagation loop, and stops as soon as a new ray-tet test is needed.
+ *
+ * \param[in,out] ph: the state of the photon
+ * \param[in] tracer: the ray-tracer aux data structure
+ * \param[in] mesh: the mesh data structure
+ * \param[in,out] cfg: simulation configuration structure
+ * \param[in,out] ran: the random number generator states
+ * \param[in,out] ran0: the additional random number generator states
+ * \param[out] visit: statistics counters of this thread
+ * \param[in] spec: MMC_SPEC_TRACE to enable the trace output, a compile-time constant
+ * \return 1 if a new ray-tet test is requested, 0 if the photon is terminated
+ */
+
+MMC_SPEC_INLINE int photon_advance_spec(photonstate* ph, raytracer* tracer, tetmesh* mesh, mcconfig* cfg,
+                                        RandType* ran, RandType* ran0, visitor* visit, const unsigned int spec) {
+
+    int event = photon_traced(ph, tracer, mesh, cfg, ran);
+
+    while (event != peTrace && event != peDone) {
+        switch (event) {
+            case peBoundary:
+                event = MMC_STAGE(spec, photon_boundary)(ph, tracer, mesh, cfg, ran);
+                break;
+
+            case peScatter:
+                event = MMC_STAGE(spec, photon_scatter)(ph, tracer, mesh, cfg, ran, ran0, visit);
+                break;
+
+            default:
+                event = MMC_STAGE(spec, photon_exit)(ph, mesh, cfg, visit);
+                break;
+        }
+    }
+
+    return (event == peTrace);
+}
+
+int photon_advance(photonstate* ph, raytracer* tracer, tetmesh* mesh, mcconfig* cfg,
+                   RandType* ran, RandType* ran0, visitor* visit) {
+    return photon_advance_spec(ph, tracer, mesh, cfg, ran, ran0, visit, MMC_SPEC_TRACE);
+}
+
+static int photon_advance_release(photonstate* ph, raytracer* tracer, tetmesh* mesh, mcconfig* cfg,
+                                  RandType* ran, RandType* ran0, visitor* visit) {
+    return photon_advance_spec(ph, tracer, mesh, cfg, ran, ran0, visit, 0);
+}
+
+/**
+ * @brief Split or roulette a photon by the importance of its medium (--importance)
+ *
+ * The importance I of the medium of the photon is compared to that of its last
+ * check, I0. If v=I/I0>1, the photon is split into n copies, n being floor(v)+1
+ * with a probability of v-floor(v) and floor(v) otherwise, and the extra copies
+ * are pushed to visit->splitstack, as many as it holds; if v<1, the photon
+ * survives a roulette with a probability of v. Each of the k copies kept
+ * carries n/(v*k) of the weight, so the expected weight, and with it the
+ * fluence and the detected photon estimates, is unchanged. Deciding on the
+ * current state only, the check can be deferred to a later ray-tet test.
+ *
+ * \param[in,out] ph: the state of the photon between two ray-tet tests
+ * \param[in] mesh: the mesh data structure
+ * \param[in] cfg: simulation configuration structure
+ * \param[in,out] ran: the random number generator states
+ * \param[in,out] visit: statistics counters of this thread, holds the pending copies
+ * \return 0 if the photon is terminated by the roulette, 1 otherwise
+ */
+
+static int photon_split(photonstate* ph, tetmesh* mesh, mcconfig* cfg, RandType* ran, visitor* visit) {
+    ray* r = &(ph->r);
+    float imp = MESH_IMPORTANCE(cfg, (cfg->implicit && r->inroi) ? mesh->prop : mesh->type[r->eid - 1]);
+    float ratio = imp / ph->importance, scale;
+    int i, n = 1, k = 1;
+
+    /*a pending deposit is owned by the current weight, the check waits until it is flushed*/
+    if (ratio == 1.f || r->oldweight > 0.f) {
+        return 1;
+    }
+
+    ph->importance = imp;
+
+    if (ratio < 1.f) {
+        if (rand_do_roulette(ran) >= ratio) {
+            ph->stage = psDone;
+            return 0;
+        }
+    } else {
+        n = (int)ratio;
+        n += (rand_do_roulette(ran) < ratio - n);
+        k = MIN(n, MMC_SPLIT_STACK - visit->splitlen + 1);
+    }
+
+    scale = n / (ratio * k);
+    r->weight *= scale;
+
+    if (r->wavew) {
+        for (i = 0; i < cfg->wavenum - 1; i++) {
+            r->wavew[i] *= scale;
+        }
+    }
+
+    /*the detected weight is computed from the launch weight saved in the record*/
+    if (!MMC_MULTISRC(cfg)) {
+        r->partialpath[visit->reclen - 2] *= scale;
+    }
+
+    for (i = 1; i < k; i++) {
+        photonstate* copy = visit->splitstack + visit->splitlen++;
+        ray* rc = &(copy->r);
+
+        *copy = *ph;
+        rc->Eabsorb = 0.0;
+        rc->oldweight = 0.0;
+        copy->nreflect = 0;
+        copy->nroihit = 0;
+        rc->partialpath = visit->scratchpath + visit->splitlen * (visit->reclen - 1);
+        memcpy(rc->partialpath, r->partialpath, (visit->reclen - 1) * sizeof(float));
+
+        if (r->wavew) {
+            rc->wavew = visit->scratchwave + visit->splitlen * (cfg->wavenum - 1);
+            memcpy(rc->wavew, r->wavew, (cfg->wavenum - 1) * sizeof(float));
+        }
+
+        /*a counter-based stream is owned by the photon, each copy gets its own key*/
+        if (rand_is_counter()) {
+            copy->ran[0] = (unsigned int)copy->ran[0] ^ (0x9E3779B9u * (++visit->nsplit));
+        }
+    }
+
+    return 1;
+}
+
+/**
+ * @brief Move the last pending split copy of visit->splitstack to ph, using slot 0 of the scratch arenas
+ *
+ * \param[out] ph: the state of the photon to be propagated next
+ * \param[in] cfg: simulation configuration structure
+ * \param[in,out] visit: statistics counters of this thread, holds the pending copies
+ * \return 1
+ */
+
+static int photon_resume(photonstate* ph, mcconfig* cfg, visitor* visit) {
+    photonstate* copy = visit->splitstack + (--visit->splitlen);
+
+    visit->nphoton--;  /*a copy is finished as a photon, but is not a new one*/
+    *ph = *copy;
+    ph->r.partialpath = visit->scratchpath;
+    memcpy(ph->r.partialpath, copy->r.partialpath, (visit->reclen - 1) * sizeof(float));
+
+    if (copy->r.wavew) {
+        ph->r.wavew = visit->scratchwave;
+        memcpy(ph->r.wavew, copy->r.wavew, (cfg->wavenum - 1) * sizeof(float));
+    }
+
+    return 1;
+}
+
+/**
+ * @brief The core Monte Carlo function simulating a single photon (!!!Important!!!)
+ *
+ * This is the core Monte Carlo simulation function. It simulates the life-time
+ * of a single photon packet, from launching to termination.
+ *
+ * \param[in] id: the linear index of the current photon, starting from 0.
+ * \param[in] tracer: the ray-tracer aux data structure
+ * \param[in] mesh: the mesh data structure
+ * \param[in,out] ran: the random number generator states
+ * \param[in,out] ran0: the additional random number generator states
+ * \param[in,out] cfg: simulation configuration structure
+ * \param[out] visit: statistics counters of this thread
+ * \param[in] spec: MMC_SPEC_TRACE to enable the trace output, a compile-time constant
+ */
+
+MMC_SPEC_INLINE void onephoton_spec(size_t id, raytracer* tracer, tetmesh* mesh, mcconfig* cfg,
+                                    RandType* ran, RandType* ran0, visitor* visit, const unsigned int spec) {
+
+    photonstate ph;
+
+    float (*engines[6])(ray * r, raytracer * tracer, mcconfig * cfg, visitor * visit) =
+    {plucker_raytet, havel_raytet, badouel_raytet, branchless_badouel_raytet, branchless_badouel_raytet, branchless_badouel_raytet};
+    float (*tracercore)(ray * r, raytracer * tracer, mcconfig * cfg, visitor * visit);
+
+    tracercore = engines[0];
+
+    if (cfg->method >= rtPlucker && cfg->method <= rtBLBadouelPacket) {
+        tracercore = engines[(int)(cfg->method)];
+    } else {
+        MMC_ERROR(-6, "specified ray-tracing algorithm is not defined");
+    }
+
+    MMC_STAGE(spec, photon_launch)(&ph, id, 0, tracer, mesh, cfg, ran, ran0, visit);
 
-    /** retrieve the iMMC ROI size and ray location at initial launch */
-    if (cfg->implicit) {
-        updateroi(cfg->implicit, &r, tracer->mesh);
-        traceroi(&r, tracer, cfg->implicit, 1);
-    }
+    do { /*the photon, then its pending split copies, are each propagated until exit*/
+        do {
+            ph.r.slen = (*tracercore)(&ph.r, tracer, cfg, visit);
+        } while (MMC_STAGE(spec, photon_advance)(&ph, tracer, mesh, cfg, PHOTON_RAN(&ph, ran), ran0, visit)
+                 && (visit->splitstack == NULL || photon_split(&ph, mesh, cfg, PHOTON_RAN(&ph, ran), visit)));
 
-#endif
+        MMC_STAGE(spec, photon_finish)(&ph, tracer, mesh, cfg, visit);
+    } while (visit->splitlen > 0 && photon_resume(&ph, cfg, visit));
+}
 
-    while (1) { /*propagate a photon until exit*/
-        if (cfg->implicit) {
-            updateroi(cfg->implicit, &r, tracer->mesh);
-        }
+void onephoton(size_t id, raytracer* tracer, tetmesh* mesh, mcconfig* cfg,
+               RandType* ran, RandType* ran0, visitor* visit) {
+    if (cfg->debuglevel & MMC_TRACE_FLAGS) {
+        onephoton_spec(id, tracer, mesh, cfg, ran, ran0, visit, MMC_SPEC_TRACE);
+    } else {
+        onephoton_spec(id, tracer, mesh, cfg, ran, ran0, visit, 0);
+    }
+}
 
-        r.slen = (*tracercore)(&r, tracer, cfg, visit);
+/**
+ * @brief Propagate a launched or received photon until it terminates or leaves the first elemend elements
+ *
+ * In the domain-decomposed mode (--domain), a rank only holds a partition of
+ * the mesh, with local element IDs 1 to elemend, followed by the ghost
+ * elements of the other ranks. This runs the loop of onephoton() for a photon
+ * prepared by photon_launch(), or received from another rank, until it is
+ * terminated and finished by photon_finish(), or enters a ghost element, where
+ * it stops before the next ray-tet test so that its state can be handed over.
+ *
+ * \param[in,out] ph: the state of the photon
+ * \param[in] elemend: the last element of the partition, the photon stops in any element above it
+ * \param[in] tracer: the ray-tracer aux data structure
+ * \param[in] mesh: the mesh data structure
+ * \param[in,out] cfg: simulation configuration structure
+ * \param[in,out] ran: the random number generator states
+ * \param[in,out] ran0: the additional random number generator states
+ * \param[out] visit: statistics counters of this thread
+ * \param[in] spec: MMC_SPEC_TRACE to enable the trace output, a compile-time constant
+ * \return 1 if the photon entered an element above elemend, 0 if it is terminated
+ */
 
-        if (r.pout.x == MMC_UNDEFINED) {
-            if (r.faceid == -2) {
-                break;    /*reaches the time limit*/
-            }
+MMC_SPEC_INLINE int photon_propagate_spec(photonstate* ph, int elemend, raytracer* tracer, tetmesh* mesh, mcconfig* cfg,
+        RandType* ran, RandType* ran0, visitor* visit, const unsigned int spec) {
 
-            if (fixcount++ < MAX_TRIAL) {
-                fixphoton((FLOAT3*)&r.p0, mesh->node, (int*)(mesh->elem + (r.eid - 1)*mesh->elemlen));
-                continue;
-            }
+    float (*engines[6])(ray * r, raytracer * tracer, mcconfig * cfg, visitor * visit) =
+    {plucker_raytet, havel_raytet, badouel_raytet, branchless_badouel_raytet, branchless_badouel_raytet, branchless_badouel_raytet};
+    float (*tracercore)(ray * r, raytracer * tracer, mcconfig * cfg, visitor * visit) = engines[(int)(cfg->method)];
 
-            r.eid = ID_UNDEFINED;
-            r.faceid = -1;
-        }
+    while (ph->r.eid <= elemend) {
+        ph->r.slen = (*tracercore)(&ph->r, tracer, cfg, visit);
 
-        if (cfg->issavedet && r.Lmove > 0.f && mesh->type[r.eid - 1] > 0 && r.faceid >= 0) {
-            r.partialpath[mesh->prop - 1 + mesh->type[r.eid - 1]] += r.Lmove;    /*second medianum block is the partial path*/
+        if (!MMC_STAGE(spec, photon_advance)(ph, tracer, mesh, cfg, PHOTON_RAN(ph, ran), ran0, visit)) {
+            MMC_STAGE(spec, photon_finish)(ph, tracer, mesh, cfg, visit);
+            return 0;
         }
+    }
 
-        if (cfg->implicit && cfg->isreflect && r.roitype && r.roiidx >= 0 && (mesh->med[cfg->his.maxmedia].n != mesh->med[mesh->type[r.eid - 1]].n)) {
-            reflectrayroi(cfg, (FLOAT3*)&r.vec, (FLOAT3*)&r.p0, tracer, &r.eid, &r.inroi, ran, r.roitype, r.roiidx, r.refeid);
-            vec_mult_add(&r.p0, &r.vec, 1.0f, 10 * EPS, &r.p0);
-            continue;
-        } else if (cfg->implicit && r.roitype) {
-            continue;
-        }
+    return 1;
+}
 
-        /*move a photon until the end of the current scattering path*/
-        while (r.faceid >= 0 && !r.isend && !r.roitype) {
-            memcpy((void*)&r.p0, (void*)&r.pout, sizeof(r.p0));
+int photon_propagate(photonstate* ph, int elemend, raytracer* tracer, tetmesh* mesh, mcconfig* cfg,
+                     RandType* ran, RandType* ran0, visitor* visit) {
+    if (cfg->debuglevel & MMC_TRACE_FLAGS) {
+        return photon_propagate_spec(ph, elemend, tracer, mesh, cfg, ran, ran0, visit, MMC_SPEC_TRACE);
+    }
 
-            enb = (int*)(mesh->facenb + (r.eid - 1) * mesh->elemlen);
-            oldeid = r.eid;
-            r.eid = enb[r.faceid];
+    return photon_propagate_spec(ph, elemend, tracer, mesh, cfg, ran, ran0, visit, 0);
+}
 
-            if (cfg->implicit) {
-                if (cfg->isreflect && (r.eid <= 0 || mesh->med[mesh->type[r.eid - 1]].n != mesh->med[mesh->type[oldeid - 1]].n )) {
-                    if (! (!r.inroi && r.eid <= 0 && ((mesh->med[mesh->type[oldeid - 1]].n == cfg->nout && cfg->isreflect != (int)bcMirror) || cfg->isreflect == (int)bcAbsorbExterior) ) ) {
-                        reflectray(cfg, &r.vec, tracer, &oldeid, &r.eid, r.faceid, ran, r.inroi);
-                    }
-                }
-            } else {
-                if (cfg->isreflect && (r.eid <= 0 || mesh->med[mesh->type[r.eid - 1]].n != mesh->med[mesh->type[oldeid - 1]].n )) {
-                    if (! (r.eid <= 0 && ((mesh->med[mesh->type[oldeid - 1]].n == cfg->nout && cfg->isreflect != (int)bcMirror) || cfg->isreflect == (int)bcAbsorbExterior) ) ) {
-                        reflectray(cfg, &r.vec, tracer, &oldeid, &r.eid, r.faceid, ran, r.inroi);
-                    }
-                }
-            }
+/**
+ * @brief Trace a group of photons against their enclosing tets using one packet ray-tet test
+ *
+ * \param[in,out] ph: the photon state pool
+ * \param[in] slot: indices of the photons in ph to be traced
+ * \param[in] len: number of photons to be traced, no more than MMC_PACKET_LEN
+ * \param[in] tracer: the ray-tracer aux data structure
+ * \param[in] cfg: simulation configuration structure
+ * \param[out] visit: statistics counters of this thread
+ */
 
-            if (r.eid <= 0) {
-                break;
-            }
+static void packet_trace(photonstate* ph, int* slot, int len, raytracer* tracer, mcconfig* cfg, visitor* visit) {
+    raypacket pk;
+    int i;
 
-            /*when a photon enters the domain from the background*/
-            if (mesh->type[oldeid - 1] == 0 && mesh->type[r.eid - 1]) {
-                if (cfg->debuglevel & dlExit)
-                    MMC_FPRINTF(cfg->flog, "e %f %f %f %f %f %f %f %d\n", r.p0.x, r.p0.y, r.p0.z,
-                                r.vec.x, r.vec.y, r.vec.z, r.weight, r.eid);
+    pk.mask = 0;
+
+    /*pack the rays into the SoA packet, invalid rays are handled by the scalar tracer*/
+    for (i = 0; i < len; i++) {
+        ray* r = &(ph[slot[i]].r);
+
+        if (r->eid > 0 && r->eid <= tracer->mesh->ne) {
+            pk.px[i] = r->p0.x;
+            pk.py[i] = r->p0.y;
+            pk.pz[i] = r->p0.z;
+            pk.vx[i] = r->vec.x;
+            pk.vy[i] = r->vec.y;
+            pk.vz[i] = r->vec.z;
+            pk.eid[i] = r->eid - 1;
+            pk.mask |= (1u << i);
+        } else {
+            pk.eid[i] = 0;
+        }
+    }
 
-                if (!cfg->voidtime) {
-                    r.photontimer = 0.f;
-                }
-            }
+    for (; i < MMC_PACKET_LEN; i++) {
+        pk.eid[i] = 0;
+    }
 
-            /*when a photon exits the domain into the background*/
-            if (mesh->type[oldeid - 1] && mesh->type[r.eid - 1] == 0) {
-                if (cfg->debuglevel & dlExit)
-                    MMC_FPRINTF(cfg->flog, "x %f %f %f %f %f %f %f %d\n", r.p0.x, r.p0.y, r.p0.z,
-                                r.vec.x, r.vec.y, r.vec.z, r.weight, r.eid);
+    packet_raytet(&pk, tracer);
 
-                if (!cfg->isextdet) {
-                    r.eid = 0;
-                    break;
-                }
-            }
+    for (i = 0; i < len; i++) {
+        ray* r = &(ph[slot[i]].r);
 
-            //          if(r.eid!=ID_UNDEFINED && mesh->med[mesh->type[oldeid-1]].n == cfg->nout ) break;
-            if (r.pout.x != MMC_UNDEFINED && (cfg->debuglevel & dlMove)) {
-                MMC_FPRINTF(cfg->flog, "P %f %f %f %d %zu %e\n", r.pout.x, r.pout.y, r.pout.z, r.eid, id, r.slen);
-            }
+        if (pk.mask & (1u << i)) {
+            r->slen = (visit->advance) ? visit->advance(r, tracer, cfg, visit, pk.tmin[i], pk.faceidx[i]) : branchless_badouel_advance(r, tracer, cfg, visit, pk.tmin[i], pk.faceidx[i]);
+        } else {
+            r->slen = branchless_badouel_raytet(r, tracer, cfg, visit);
+        }
+    }
+}
 
-            if (cfg->implicit) {
-                updateroi(cfg->implicit, &r, tracer->mesh);
-            }
+/**
+ * @brief Simulating a group of photons using the packet ray-tracer
+ *
+ * This function keeps up to packet_width() photons in flight, and traces all
+ * photons in the packet against their enclosing tets using a single wide-SIMD
+ * ray-tet test. Once a photon terminates, its lane is refilled with the next
+ * photon in the group until all count photons are simulated.
+ *
+ * \param[in] id: the linear index of the first photon in the group
+ * \param[in] count: the total number of photons in the group
+ * \param[in] tracer: the ray-tracer aux data structure
+ * \param[in] mesh: the mesh data structure
+ * \param[in,out] cfg: simulation configuration structure
+ * \param[in,out] ran: the random number generator states
+ * \param[in,out] ran0: the additional random number generator states
+ * \param[out] visit: statistics counters of this thread
+ * \param[in] spec: MMC_SPEC_TRACE to enable the trace output, a compile-time constant
+ */
 
-            r.slen = (*tracercore)(&r, tracer, cfg, visit);
+MMC_SPEC_INLINE void onepacket_spec(size_t id, size_t count, raytracer* tracer, tetmesh* mesh, mcconfig* cfg,
+                                    RandType* ran, RandType* ran0, visitor* visit, const unsigned int spec) {
 
-            if (cfg->issavedet && r.Lmove > 0.f && mesh->type[r.eid - 1] > 0) {
-                r.partialpath[mesh->prop - 1 + mesh->type[r.eid - 1]] += r.Lmove;
-            }
+    photonstate ph[MMC_PACKET_LEN];
+    int slot[MMC_PACKET_LEN];
+    size_t next = id, last = id + count;
+    int i, len = 0, width = MIN(packet_width(), MMC_PACKET_LEN);
 
-            if (r.faceid == -2) {
-                break;
-            }
+    for (i = 0; i < width && next < last; i++) {
+        MMC_STAGE(spec, photon_launch)(ph + i, next++, i, tracer, mesh, cfg, ran, ran0, visit);
+        slot[len++] = i;
+    }
 
-            fixcount = 0;
+    while (len) {
+        packet_trace(ph, slot, len, tracer, cfg, visit);
 
-            while (r.pout.x == MMC_UNDEFINED && fixcount++ < MAX_TRIAL) {
-                fixphoton((FLOAT3*)&r.p0, mesh->node, (int*)(mesh->elem + (r.eid - 1)*mesh->elemlen));
-                r.slen = (*tracercore)(&r, tracer, cfg, visit);
+        for (i = 0; i < len; i++) {
+            if (!MMC_STAGE(spec, photon_advance)(ph + slot[i], tracer, mesh, cfg, PHOTON_RAN(ph + slot[i], ran), ran0, visit)) {
+                MMC_STAGE(spec, photon_finish)(ph + slot[i], tracer, mesh, cfg, visit);
 
-                if (cfg->issavedet && r.Lmove > 0.f && mesh->type[r.eid - 1] > 0) {
-                    r.partialpath[mesh->prop - 1 + mesh->type[r.eid - 1]] += r.Lmove;
+                if (next < last) {
+                    MMC_STAGE(spec, photon_launch)(ph + slot[i], next++, slot[i], tracer, mesh, cfg, ran, ran0, visit);
+                } else {
+                    slot[i--] = slot[--len];
                 }
             }
-
-            if (r.pout.x == MMC_UNDEFINED) {
-                /*possibily hit an edge or miss*/
-                r.eid = ID_UNDEFINED;
-                break;
-            }
         }
+    }
+}
 
-        if (r.eid <= 0 || r.pout.x == MMC_UNDEFINED) {
-            if (r.eid != ID_UNDEFINED && (cfg->debuglevel & dlMove)) {
-                MMC_FPRINTF(cfg->flog, "B %f %f %f %d %zu %e\n", r.p0.x, r.p0.y, r.p0.z, r.eid, id, r.slen);
-            }
+void onepacket(size_t id, size_t count, raytracer* tracer, tetmesh* mesh, mcconfig* cfg,
+               RandType* ran, RandType* ran0, visitor* visit) {
+    if (cfg->debuglevel & MMC_TRACE_FLAGS) {
+        onepacket_spec(id, count, tracer, mesh, cfg, ran, ran0, visit, MMC_SPEC_TRACE);
+    } else {
+        onepacket_spec(id, count, tracer, mesh, cfg, ran, ran0, visit, 0);
+    }
+}
+
+/**
+ * @brief Simulating a group of photons using the wavefront scheduler
+ *
+ * Instead of running each photon to completion, this function keeps a pool of
+ * MMC_WAVEFRONT_LEN photons in flight and groups them into queues by their
+ * next event (ray-tet test, face crossing, scattering and exiting). Each stage
+ * then processes all photons in its queue in a tight loop, which keeps the
+ * branches of each loop predictable and allows the ray-tet tests to be batched
+ * into ray packets when the packet ray-tracer (-M V) is selected. Terminated
+ * photons are removed from the pool and replaced by newly launched photons.
+ *
+ * \param[in] id: the linear index of the first photon in the group
+ * \param[in] count: the total number of photons in the group
+ * \param[in] tracer: the ray-tracer aux data structure
+ * \param[in] mesh: the mesh data structure
+ * \param[in,out] cfg: simulation configuration structure
+ * \param[in,out] ran: the random number generator states
+ * \param[in,out] ran0: the additional random number generator states
+ * \param[out] visit: statistics counters of this thread
+ * \param[in] spec: MMC_SPEC_TRACE to enable the trace output, a compile-time constant
+ */
 
-            if (r.eid != ID_UNDEFINED) {
-                if (cfg->debuglevel & dlExit)
-                    MMC_FPRINTF(cfg->flog, "E %f %f %f %f %f %f %f %d\n", r.p0.x, r.p0.y, r.p0.z,
-                                r.vec.x, r.vec.y, r.vec.z, r.weight, r.eid);
+MMC_SPEC_INLINE void onewavefront_spec(size_t id, size_t count, raytracer* tracer, tetmesh* mesh, mcconfig* cfg,
+                                       RandType* ran, RandType* ran0, visitor* visit, const unsigned int spec) {
 
-                if (cfg->issavedet && cfg->issaveexit) {                                   /*when issaveexit is set to 1*/
-                    memcpy(r.partialpath + (visit->reclen - 2 - 6), &(r.p0.x), sizeof(float) * 3); /*columns 7-5 from the right store the exit positions*/
-                    memcpy(r.partialpath + (visit->reclen - 2 - 3), &(r.vec.x), sizeof(float) * 3); /*columns 4-2 from the right store the exit dirs*/
-                }
+    photonstate ph[MMC_WAVEFRONT_LEN];
+    int queue[peDone][MMC_WAVEFRONT_LEN], qlen[peDone] = {0};
+    int batch[MMC_WAVEFRONT_LEN], freeslot[MMC_WAVEFRONT_LEN], nfree = 0;
+    int i, j, len, event, width = MIN(packet_width(), MMC_PACKET_LEN);
+    size_t next = id, last = id + count;
 
-                if (cfg->issaveref && r.eid < 0 && mesh->dref) {
-                    int tshift = MIN( ((int)((r.photontimer - cfg->tstart) * visit->rtstep)), cfg->maxgate - 1 ) * mesh->nf;
-                    mesh->dref[((-r.eid) - 1) + tshift] += r.weight;
-                }
-            } else if (r.faceid == -2 && (cfg->debuglevel & dlMove)) {
-                MMC_FPRINTF(cfg->flog, "T %f %f %f %d %zu %e\n", r.p0.x, r.p0.y, r.p0.z, r.eid, id, r.slen);
-            } else if (r.eid && r.faceid != -2  && cfg->debuglevel & dlEdge) {
-                MMC_FPRINTF(cfg->flog, "X %f %f %f %d %zu %e\n", r.p0.x, r.p0.y, r.p0.z, r.eid, id, r.slen);
-            }
+    float (*engines[6])(ray * r, raytracer * tracer, mcconfig * cfg, visitor * visit) =
+    {plucker_raytet, havel_raytet, badouel_raytet, branchless_badouel_raytet, branchless_badouel_raytet, branchless_badouel_raytet};
+    float (*tracercore)(ray * r, raytracer * tracer, mcconfig * cfg, visitor * visit) = engines[0];
 
-            if (cfg->issavedet && r.eid <= 0) {
-                int i;
+    if (cfg->method >= rtPlucker && cfg->method <= rtBLBadouelPacket) {
+        tracercore = engines[(int)(cfg->method)];
+    } else {
+        MMC_ERROR(-6, "specified ray-tracing algorithm is not defined");
+    }
 
-                if (cfg->detnum == 0 && cfg->isextdet && mesh->type[oldeid - 1] == mesh->prop + 1) {
-                    exitdet = oldeid;
-                } else
-                    for (i = 0; i < cfg->detnum; i++) {
-                        if ((cfg->detpos[i].x - r.p0.x) * (cfg->detpos[i].x - r.p0.x) +
-                                (cfg->detpos[i].y - r.p0.y) * (cfg->detpos[i].y - r.p0.y) +
-                                (cfg->detpos[i].z - r.p0.z) * (cfg->detpos[i].z - r.p0.z) < cfg->detpos[i].w * cfg->detpos[i].w) {
-                            exitdet = i + 1;
-                            break;
-                        }
-                    }
-            }
+    for (i = MMC_WAVEFRONT_LEN - 1; i >= 0; i--) {
+        freeslot[nfree++] = i;
+    }
 
-            break;  /*photon exits boundary*/
+    while (1) {
+        /*launch stage: refill the pool with new photons*/
+        while (nfree > 0 && next < last) {
+            i = freeslot[--nfree];
+            MMC_STAGE(spec, photon_launch)(ph + i, next++, i, tracer, mesh, cfg, ran, ran0, visit);
+            queue[peTrace][qlen[peTrace]++] = i;
         }
 
-        if (cfg->debuglevel & dlMove) {
-            MMC_FPRINTF(cfg->flog, "M %f %f %f %d %zu %e\n", r.p0.x, r.p0.y, r.p0.z, r.eid, id, r.slen);
+        if (nfree == MMC_WAVEFRONT_LEN) {
+            break;
         }
 
-        if (cfg->minenergy > 0.f && r.weight < cfg->minenergy && (cfg->tend - cfg->tstart)*visit->rtstep <= 1.f) { /*Russian Roulette*/
-            if (rand_do_roulette(ran)*cfg->roulettesize <= 1.f) {
-                r.weight *= cfg->roulettesize;
+        for (event = peTrace; event < peDone; event++) {
+            len = qlen[event];
+            memcpy(batch, queue[event], len * sizeof(int));
+            qlen[event] = 0;
 
-                if (cfg->debuglevel & dlWeight) {
-                    MMC_FPRINTF(cfg->flog, "Russian Roulette bumps r.weight to %f\n", r.weight);
+            /*trace stage: ray-tet tests, batched into packets if possible*/
+            if (event == peTrace && cfg->method == rtBLBadouelPacket) {
+                for (i = 0; i < len; i += width) {
+                    packet_trace(ph, batch + i, MIN(width, len - i), tracer, cfg, visit);
+                }
+            } else if (event == peTrace) {
+                for (i = 0; i < len; i++) {
+                    ph[batch[i]].r.slen = (*tracercore)(&(ph[batch[i]].r), tracer, cfg, visit);
                 }
-            } else {
-                break;
             }
-        }
-
-        if (cfg->implicit && cfg->isreflect && r.roitype && r.roiidx >= 0 && (mesh->med[cfg->his.maxmedia].n != mesh->med[mesh->type[r.eid - 1]].n)) {
-            reflectrayroi(cfg, (FLOAT3*)&r.vec, (FLOAT3*)&r.p0, tracer, &r.eid, &r.inroi, ran, r.roitype, r.roiidx, r.refeid);
-            vec_mult_add(&r.p0, &r.vec, 1.0f, 10 * EPS, &r.p0);
-            continue;
-        } else if (cfg->implicit && r.roitype) {
-            continue;
-        }
-
-        mom = 0.f;
-        r.slen0 = mc_next_scatter(mesh->med[mesh->type[r.eid - 1]].g, &r.vec, ran, ran0, cfg, &mom);
-        r.slen = r.slen0;
-
-        if (cfg->debuglevel & dlTraj) {
-            savedebugdata(&r, (unsigned int)id, cfg);
-        }
 
-        if (cfg->mcmethod != mmMCX) {
-            albedoweight(&r, mesh, cfg, visit);
-        }
+            for (i = 0; i < len; i++) {
+                photonstate* p = ph + batch[i];
 
-        if (cfg->ismomentum && mesh->type[r.eid - 1] > 0) {              /*when ismomentum is set to 1*/
-            r.partialpath[(mesh->prop << 1) - 1 + mesh->type[r.eid - 1]] += mom;    /*the third medianum block stores the momentum transfer*/
-        }
+                switch (event) {
+                    case peTrace:
+                        j = photon_traced(p, tracer, mesh, cfg, PHOTON_RAN(p, ran));
+                        break;
 
-        r.partialpath[mesh->type[r.eid - 1] - 1]++;                      /*the first medianum block stores the scattering event counts*/
-    }
+                    case peBoundary:
+                        j = MMC_STAGE(spec, photon_boundary)(p, tracer, mesh, cfg, PHOTON_RAN(p, ran));
+                        break;
 
-    if (cfg->issavedet && exitdet > 0) {
-        int offset = visit->bufpos * visit->reclen;
+                    case peScatter:
+                        j = MMC_STAGE(spec, photon_scatter)(p, tracer, mesh, cfg, PHOTON_RAN(p, ran), ran0, visit);
+                        break;
 
-        if (visit->bufpos >= visit->detcount) {
-            visit->detcount += DET_PHOTON_BUF;
-            visit->partialpath = (float*)realloc(visit->partialpath,
-                                                 visit->detcount * visit->reclen * sizeof(float));
+                    default:
+                        j = MMC_STAGE(spec, photon_exit)(p, mesh, cfg, visit);
+                        break;
+                }
 
-            if (cfg->issaveseed) {
-                visit->photonseed = realloc(visit->photonseed, visit->detcount * (sizeof(RandType) * RAND_BUF_LEN));
+                if (j == peDone) {
+                    MMC_STAGE(spec, photon_finish)(p, tracer, mesh, cfg, visit);
+                    freeslot[nfree++] = batch[i];
+                } else {
+                    queue[j][qlen[j]++] = batch[i];
+                }
             }
         }
-
-        visit->partialpath[offset] = exitdet;
-        memcpy(visit->partialpath + offset + 1, r.partialpath, (visit->reclen - 1)*sizeof(float));
-
-        if (cfg->issaveseed) {
-            memcpy(visit->photonseed + visit->bufpos * (sizeof(RandType)*RAND_BUF_LEN), r.photonseed, (sizeof(RandType)*RAND_BUF_LEN));
-        }
-
-        visit->bufpos++;
-    }
-
-    free(r.partialpath);
-
-    if (r.photonseed) {
-        free(r.photonseed);
-    }
-
-    if (cfg->debuglevel & dlTraj) {
-        savedebugdata(&r, (unsigned int)id, cfg);
     }
+}
 
-    if (cfg->srctype != stPattern || cfg->srcnum == 1) {
-        kahany = r.Eabsorb - visit->kahanc1[0];
-        kahant = visit->absorbweight[0] + kahany;
-        visit->kahanc1[0] = (kahant - visit->absorbweight[0]) - kahany;
-        visit->absorbweight[0] = kahant;
-    } else if (cfg->srctype == stPattern) {
-        for (pidx = 0; pidx < cfg->srcnum; pidx++) {
-            kahany = r.Eabsorb * cfg->srcpattern[r.posidx * cfg->srcnum + pidx] - visit->kahanc1[pidx];
-            kahant = visit->absorbweight[pidx] + kahany;
-            visit->kahanc1[pidx] = (kahant - visit->absorbweight[pidx]) - kahany;
-            visit->absorbweight[pidx] = kahant;
-        }
+void onewavefront(size_t id, size_t count, raytracer* tracer, tetmesh* mesh, mcconfig* cfg,
+                  RandType* ran, RandType* ran0, visitor* visit) {
+    if (cfg->debuglevel & MMC_TRACE_FLAGS) {
+        onewavefront_spec(id, count, tracer, mesh, cfg, ran, ran0, visit, MMC_SPEC_TRACE);
+    } else {
+        onewavefront_spec(id, count, tracer, mesh, cfg, ran, ran0, visit, 0);
     }
 }
 
@@ -2090,7 +4545,7 @@ float reflectrayroi(mcconfig* cfg, FLOAT3* c0, FLOAT3* ph, raytracer* tracer, in
     Icos = fabs(vec_dot3(c0, pn));
 
     if (*inroi) { // out->in
-        n1 = tracer->mesh->med[tracer->mesh->type[*eid - 1]].n;
+        n1 = MESH_ELEMMED(tracer->mesh, *eid - 1)->n;
         n2 = tracer->mesh->med[cfg->his.maxmedia].n;
 
         if (roitype == rtEdge || roitype == rtNode) {
@@ -2098,7 +4553,7 @@ float reflectrayroi(mcconfig* cfg, FLOAT3* c0, FLOAT3* ph, raytracer* tracer, in
         }
     } else {     // in->out
         n1 = tracer->mesh->med[cfg->his.maxmedia].n;
-        n2 = tracer->mesh->med[tracer->mesh->type[*eid - 1]].n;
+        n2 = MESH_ELEMMED(tracer->mesh, *eid - 1)->n;
 
         if (roitype == rtFace) {
             vec_mult3(pn, -1.f, pn);
@@ -2166,7 +4621,7 @@ float reflectray(mcconfig* cfg, float3* c0, raytracer* tracer, int* oldeid, int*
         pn = tracer->n + (offs) + faceid;
     } else if (cfg->method < rtBLBadouel) {
         pn = tracer->m + (offs + faceid) * 3;
-    } else if (cfg->method == rtBLBadouel || cfg->method == rtBLBadouelGrid) {
+    } else if (cfg->method == rtBLBadouel || cfg->method == rtBLBadouelGrid || cfg->method == rtBLBadouelPacket) {
         pnorm.x = (&(tracer->n[offs].x))[faceid];
         pnorm.y = (&(tracer->n[offs].x))[faceid + 4];
         pnorm.z = (&(tracer->n[offs].x))[faceid + 8];
@@ -2181,8 +4636,8 @@ float reflectray(mcconfig* cfg, float3* c0, raytracer* tracer, int* oldeid, int*
         n1 = tracer->mesh->med[cfg->his.maxmedia].n;
         n2 = n1;
     } else {
-        n1 = (*oldeid != *eid) ? tracer->mesh->med[tracer->mesh->type[*oldeid - 1]].n : cfg->nout;
-        n2 = (*eid > 0) ? tracer->mesh->med[tracer->mesh->type[*eid - 1]].n : cfg->nout;
+        n1 = (*oldeid != *eid) ? MESH_ELEMMED(tracer->mesh, *oldeid - 1)->n : cfg->nout;
+        n2 = (*eid > 0) ? MESH_ELEMMED(tracer->mesh, *eid - 1)->n : cfg->nout;
     }
 
     tmp0 = n1 * n1;
@@ -2223,6 +4678,184 @@ float reflectray(mcconfig* cfg, float3* c0, raytracer* tracer, int* oldeid, int*
     return 1.f;
 }
 
+/**
+ * @brief Launch a fluorescence photon in the emission stage of --emission
+ *
+ * The launch element is sampled from mesh->emitcdf, i.e. by its share of the
+ * emitted energy, the position uniformly in the tet by folding a point of the
+ * unit cube into the unit simplex (Rocchini2000), and the direction uniformly
+ * on the sphere.
+ *
+ * \param[in,out] r: the current ray
+ * \param[in] mesh: the mesh data structure
+ * \param[in,out] ran: the random number generator states
+ */
+
+static void launchemission(ray* r, tetmesh* mesh, RandType* ran) {
+    double u = rand_uniform01(ran);
+    int lo = 0, hi = mesh->ne - 1, i;
+    float s, t, v, tmp, ang, stheta, ctheta, bary[4];
+    int* ee;
+
+    /*the first element whose cumulative share exceeds u*/
+    while (lo < hi) {
+        int mid = (lo + hi) >> 1;
+
+        if (mesh->emitcdf[mid] <= u) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    s = rand_uniform01(ran);
+    t = rand_uniform01(ran);
+    v = rand_uniform01(ran);
+
+    if (s + t > 1.f) {
+        s = 1.f - s;
+        t = 1.f - t;
+    }
+
+    if (t + v > 1.f) {
+        tmp = v;
+        v = 1.f - s - t;
+        t = 1.f - tmp;
+    } else if (s + t + v > 1.f) {
+        tmp = v;
+        v = s + t + v - 1.f;
+        s = 1.f - t - tmp;
+    }
+
+    bary[0] = 1.f - s - t - v;
+    bary[1] = s;
+    bary[2] = t;
+    bary[3] = v;
+
+    ee = (int*)(mesh->elem + lo * mesh->elemlen);
+    r->p0.x = r->p0.y = r->p0.z = 0.f;
+
+    for (i = 0; i < 4; i++) {
+        FLOAT3* p = mesh->node + ee[i] - 1;
+
+        r->p0.x += bary[i] * p->x;
+        r->p0.y += bary[i] * p->y;
+        r->p0.z += bary[i] * p->z;
+    }
+
+    r->eid = lo + 1;
+    r->bary0.x = bary[0];
+    r->bary0.y = bary[1];
+    r->bary0.z = bary[2];
+    r->bary0.w = bary[3];
+
+    ang = TWO_PI * rand_uniform01(ran);
+    ctheta = 2.f * rand_uniform01(ran) - 1.f;
+    stheta = sqrtf(1.f - ctheta * ctheta);
+    r->vec.x = stheta * cosf(ang);
+    r->vec.y = stheta * sinf(ang);
+    r->vec.z = ctheta;
+}
+
+/**
+ * @brief Move a photon launched outside of the mesh to where it enters the mesh
+ *
+ * The entry face is the nearest exterior face hit by the launched ray, found
+ * in the surface BVH (see mesh_buildsurfbvh). With cfg->isspecular, the
+ * specular reflection at the entry reduces the photon weight and the photon
+ * is refracted into the mesh. A photon missing the mesh gets an eid of 0 and
+ * is terminated by photon_traced.
+ *
+ * \param[in] cfg: simulation configuration structure
+ * \param[in,out] r: the current ray, p0 and vec are the launch position and direction
+ * \param[in] mesh: the mesh data structure
+ * \return 0 if the photon enters or misses the mesh, 1 if the launch position is inside of the mesh
+ */
+
+static int launchentry(mcconfig* cfg, ray* r, tetmesh* mesh) {
+    FLOAT3 vecN, vecS, vecAB, vecAC, *nodes = mesh->node;
+    float dist, bary[4], s = 0.f;
+    int i, k, face, *elems;
+
+    k = mesh_surfhit(mesh->surfbvh, (FLOAT3*) & (r->p0), (FLOAT3*) & (r->vec), &dist);
+
+    if (k < 0) {
+        r->eid = 0;
+        return 0;
+    }
+
+    vec_cross3(mesh->surfbvh->tri + k * 3 + 1, mesh->surfbvh->tri + k * 3 + 2, &vecN);
+
+    /*the nearest face is hit from the inside*/
+    if (vec_dot3(&vecN, (FLOAT3*) & (r->vec)) >= 0.f) {
+        return 1;
+    }
+
+    face = mesh->surfbvh->face[k];
+    r->eid = (face >> 2) + 1;
+    vec_mult_add(&(r->p0), &(r->vec), 1.f, dist, &(r->p0));
+
+    if (cfg->voidtime) {
+        r->photontimer += dist * cfg->nout * R_C0;
+    }
+
+    if (cfg->isspecular) {
+        float n1 = cfg->nout, n2 = MESH_ELEMMED(mesh, r->eid - 1)->n;
+
+        if (n1 != n2) {
+            float Icos, tmp0, tmp1, tmp2, Re, Im, Rtotal;
+
+            tmp0 = 1.f / sqrtf(vec_dot3(&vecN, &vecN));
+            vec_mult_add3(&vecN, &vecN, tmp0, 0.f, &vecN);
+            Icos = -vec_dot3(&vecN, (FLOAT3*) & (r->vec));
+            tmp0 = n1 * n1;
+            tmp1 = n2 * n2;
+            tmp2 = 1.f - tmp0 / tmp1 * (1.f - Icos * Icos); /*cos(ti)^2*/
+
+            if (tmp2 > 0.f) {
+                tmp2 = sqrtf(tmp2);
+                Re = tmp0 * Icos * Icos + tmp1 * tmp2 * tmp2;
+                Im = 2.f * n1 * n2 * Icos * tmp2;
+                Rtotal = (Re - Im) / (Re + Im);
+                Re = tmp1 * Icos * Icos + tmp0 * tmp2 * tmp2;
+                Rtotal = (Rtotal + (Re - Im) / (Re + Im)) * 0.5f; /*(Rp+Rs)/2*/
+                r->weight *= 1.f - Rtotal;
+                vec_mult_add3(&vecN, (FLOAT3*) & (r->vec), n1 / n2 * Icos - tmp2, n1 / n2, &vecS);
+                tmp0 = 1.f / sqrtf(vec_dot3(&vecS, &vecS));
+                r->vec.x = vecS.x * tmp0;
+                r->vec.y = vecS.y * tmp0;
+                r->vec.z = vecS.z * tmp0;
+            }
+        }
+    }
+
+    vec_mult_add(&(r->p0), &(r->vec), 1.f, EPS, &(r->p0));
+
+    elems = (int*)(mesh->elem + (r->eid - 1) * mesh->elemlen);
+
+    for (i = 0; i < 4; i++) {
+        vec_diff3(&nodes[elems[out[i][0]] - 1], &nodes[elems[out[i][1]] - 1], &vecAB);
+        vec_diff3(&nodes[elems[out[i][0]] - 1], &nodes[elems[out[i][2]] - 1], &vecAC);
+        vec_diff3(&nodes[elems[out[i][0]] - 1], (FLOAT3*) & (r->p0), &vecS);
+        vec_cross3(&vecAB, &vecAC, &vecN);
+        bary[facemap[i]] = MAX(-vec_dot3(&vecS, &vecN), 0.f);
+        s += bary[facemap[i]];
+    }
+
+    s = (s > 0.f) ? 1.f / s : 0.f;
+    r->bary0.x = bary[0] * s;
+    r->bary0.y = bary[1] * s;
+    r->bary0.z = bary[2] * s;
+    r->bary0.w = bary[3] * s;
+    for (i = 0; i < 4; i++) {
+        if (bary[i] * s < 1e-4f) {
+            r->faceid = ifacemap[i] + 1;
+        }
+    }
+
+    return 0;
+}
+
 /**
  * @brief Launch a new photon
  *
@@ -2242,6 +4875,11 @@ void launchphoton(mcconfig* cfg, ray* r, tetmesh* mesh, RandType* ran, RandType*
     r->slen = rand_next_scatlen(ran);
     r->inroi = 0;
 
+    if (mesh->emitcdf) {
+        launchemission(r, mesh, ran);
+        return;
+    }
+
     if (cfg->srctype == stPencil) { // pencil beam, use the old workflow, except when eid is not given
         if (r->eid > 0) {
             return;
@@ -2406,66 +5044,44 @@ void launchphoton(mcconfig* cfg, ray* r, tetmesh* mesh, RandType* ran, RandType*
     vec_mult_add(&(r->p0), &(r->vec), 1.f, EPS, &(r->p0));
 
     /*Caluclate intial element id and bary-centric coordinates for area sources - position changes everytime*/
-    FLOAT3 vecS = {0.f}, vecAB, vecAC, vecN;
-    FLOAT3* nodes = mesh->node;
-    int is, i, ea, eb, ec;
+    int is = -1, i;
     float bary[4] = {0.f};
+    int candlen = mesh->srcelemlen, *cand = NULL;
 
-    for (is = -1; is < mesh->srcelemlen; is++) {
-        int include = 1;
-        int* elems = NULL;
-
-        if(is < 0) {
-            if(r->eid >= 0) {
-                elems = (int*)(mesh->elem + (r->eid - 1) * mesh->elemlen);
-            } else {
-                continue;
-            }
-        } else {
-            elems = (int*)(mesh->elem + (mesh->srcelem[is] - 1) * mesh->elemlen);
+    /*the element of the previous launch is tried first*/
+    if (r->eid <= 0 || mesh_barylocate(mesh, &(r->eid), NULL, 1, (FLOAT3*) & (r->p0), -1e-4f, bary) < 0) {
+        /*narrow the candidates down to those binned in the grid cell enclosing the launch position*/
+        if (mesh->srcgrid) {
+            cand = mesh_gridquery(mesh->srcgrid, (FLOAT3*) & (r->p0), &candlen);
         }
 
-        for (i = 0; i < 4; i++) {
-            ea = elems[out[i][0]] - 1;
-            eb = elems[out[i][1]] - 1;
-            ec = elems[out[i][2]] - 1;
-            vec_diff3(&nodes[ea], &nodes[eb], &vecAB); //repeated for all photons
-            vec_diff3(&nodes[ea], &nodes[ec], &vecAC); //repeated for all photons
-            vec_diff3(&nodes[ea], (FLOAT3*) & (r->p0), &vecS);
-            vec_cross3(&vecAB, &vecAC, &vecN); //repeated for all photons, vecN can be precomputed
-            bary[facemap[i]] = -vec_dot3(&vecS, &vecN);
-        }
+        /*the candidates are tested in batches, the first enclosing one in the list order is taken*/
+        is = mesh_barylocate(mesh, mesh->srcelem, cand, candlen, (FLOAT3*) & (r->p0), -1e-4f, bary);
+        is = (is < 0) ? candlen : is;
+    }
+
+    if (is < candlen) {
+        r->eid = (is >= 0 ? mesh->srcelem[cand ? cand[is] : is] : r->eid);
+        float s = 0.f;
 
         for (i = 0; i < 4; i++) {
-            if (bary[i] < -1e-4f) {
-                include = 0;
-            }
+            s += bary[i];
         }
 
-        if (include) {
-            r->eid = (is >= 0 ? mesh->srcelem[is] : r->eid);
-            float s = 0.f;
-
-            for (i = 0; i < 4; i++) {
-                s += bary[i];
-            }
-
-            r->bary0.x = bary[0] / s;
-            r->bary0.y = bary[1] / s;
-            r->bary0.z = bary[2] / s;
-            r->bary0.w = bary[3] / s;
+        r->bary0.x = bary[0] / s;
+        r->bary0.y = bary[1] / s;
+        r->bary0.z = bary[2] / s;
+        r->bary0.w = bary[3] / s;
 
-            for (i = 0; i < 4; i++) {
-                if ((bary[i] / s) < 1e-4f) {
-                    r->faceid = ifacemap[i] + 1;
-                }
+        for (i = 0; i < 4; i++) {
+            if ((bary[i] / s) < 1e-4f) {
+                r->faceid = ifacemap[i] + 1;
             }
-
-            break;
         }
     }
 
-    if (is == mesh->srcelemlen) {
+    /*a launch position enclosed by no candidate may be outside of the mesh, then it enters through the surface*/
+    if (is == candlen && (mesh->surfbvh == NULL || launchentry(cfg, r, mesh))) {
         #pragma omp critical
         {
             MMC_FPRINTF(cfg->flog, "all tetrahedra (%d) labeled with -1 do not enclose the source!\n", mesh->srcelemlen);
@@ -2501,9 +5117,9 @@ void albedoweight(ray* r, tetmesh* mesh, mcconfig* cfg, visitor* visit) {
     float* baryp0 = &(r->bary0.x);
     int eid = r->eid - 1;
     int* ee = (int*)(mesh->elem + eid * mesh->elemlen);
-    int i, tshift, datalen = (cfg->method == rtBLBadouelGrid) ? cfg->crop0.z : ( (cfg->basisorder) ? mesh->nn : mesh->ne);;
+    int i, tshift, datalen = (cfg->method == rtBLBadouelGrid) ? cfg->crop0.z : ( (cfg->basisorder) ? mesh->nn : MESH_ELEMOUT(mesh));
 
-    medium* prop = mesh->med + (mesh->type[eid]);
+    medium* prop = MESH_ELEMMED(mesh, eid);
     float ww = r->weight;
 
     r->weight *= prop->mus / (prop->mua + prop->mus);
@@ -2518,29 +5134,72 @@ void albedoweight(ray* r, tetmesh* mesh, mcconfig* cfg, visitor* visit) {
     } else {
         if (!cfg->basisorder) {
             if (cfg->isatomic)
-                #pragma omp atomic
-                mesh->weight[eid + tshift] += ww;
+                accumweight(mesh->weight, visit, MESH_OUTROW(mesh, eid, tshift), ww);
             else {
-                mesh->weight[eid + tshift] += ww;
+                mesh->weight[MESH_OUTROW(mesh, eid, tshift)] += ww;
             }
         } else {
             if (cfg->isatomic)
                 for (i = 0; i < 4; i++)
-                    #pragma omp atomic
-                    mesh->weight[ee[i] - 1 + tshift] += ww * baryp0[i];
+                    accumnode(mesh, visit, tshift, eid, i, ww * baryp0[i], NULL, 1);
             else
                 for (i = 0; i < 4; i++) {
                     mesh->weight[ee[i] - 1 + tshift] += ww * baryp0[i];
                 }
         }
+
+        if (cfg->freqnum > 0) {
+            accumfreq(r, mesh, cfg, visit, eid, (cfg->basisorder ? baryp0 : NULL), ww, r->photontimer);
+        }
     }
 }
 
 void visitor_init(mcconfig* cfg, visitor* visit) {
+    visit->advance = branchless_badouel_select(cfg);
     visit->launchweight = (double*)calloc(cfg->srcnum, sizeof(double));
     visit->absorbweight = (double*)calloc(cfg->srcnum, sizeof(double));
-    visit->kahanc0 = (double*)calloc(cfg->srcnum, sizeof(double));
-    visit->kahanc1 = (double*)calloc(cfg->srcnum, sizeof(double));
+    visit->launchblock = (float*)calloc(cfg->srcnum, sizeof(float));
+    visit->absorbblock = (float*)calloc(cfg->srcnum, sizeof(float));
+    visit->blockcount = 0;
+
+    /*scratch arena for the in-flight photons, reused across all photons of a thread; slot 0 is followed by the pending split copies*/
+    visit->scratchlen = (cfg->method == rtBLBadouelPacket || cfg->iswavefront) ? MMC_WAVEFRONT_LEN : 1 + (cfg->importance ? MMC_SPLIT_STACK : 0);
+
+    if (cfg->importance) {
+        visit->splitstack = (photonstate*)calloc(MMC_SPLIT_STACK, sizeof(photonstate));
+    }
+
+    if (visit->reclen > 1) {
+        visit->scratchpath = (float*)calloc(visit->scratchlen * (visit->reclen - 1), sizeof(float));
+
+        if (cfg->issavedet && cfg->issaveseed) {
+            visit->scratchseed = calloc(visit->scratchlen, (sizeof(RandType) * RAND_BUF_LEN));
+        }
+    }
+
+    if (cfg->convtarget > 0.f && cfg->issavedet) {
+        visit->detweight = (double*)calloc(MAX(cfg->detnum, 1), sizeof(double));
+    }
+
+    if (cfg->dcsmodel) {
+        visit->dcsg1 = (double*)calloc((size_t)cfg->detnum * (cfg->dcstaunum + 1), sizeof(double));
+    }
+
+    if (cfg->isdetstat && visit->statlen > 0) {
+        visit->detstat = (double*)calloc((size_t)cfg->detnum * visit->statlen, sizeof(double));
+    }
+
+    if (cfg->nextevent > 0.f && cfg->detnum > 0) {
+        visit->nee = (double*)calloc((size_t)cfg->detnum * (cfg->maxgate + 1), sizeof(double));
+    }
+
+    if (cfg->cam_focal_length > 0.f && cfg->issavedet) {
+        visit->camsignals = (double*)calloc((size_t)cfg->cam_image_width * cfg->cam_image_height + 2, sizeof(double));
+    }
+
+    if (cfg->wavenum > 1) {
+        visit->scratchwave = (float*)calloc(visit->scratchlen * (cfg->wavenum - 1), sizeof(float));
+    }
 }
 
 void visitor_clear(visitor* visit) {
@@ -2548,10 +5207,34 @@ void visitor_clear(visitor* visit) {
     visit->launchweight = NULL;
     free(visit->absorbweight);
     visit->absorbweight = NULL;
-    free(visit->kahanc0);
-    visit->kahanc0 = NULL;
-    free(visit->kahanc1);
-    visit->kahanc1 = NULL;
+    free(visit->launchblock);
+    visit->launchblock = NULL;
+    free(visit->absorbblock);
+    visit->absorbblock = NULL;
+    visit->blockcount = 0;
+    free(visit->scratchpath);
+    visit->scratchpath = NULL;
+    free(visit->scratchseed);
+    visit->scratchseed = NULL;
+    visit->scratchlen = 0;
+    free(visit->detweight);
+    visit->detweight = NULL;
+    free(visit->dcsg1);
+    visit->dcsg1 = NULL;
+    free(visit->detstat);
+    visit->detstat = NULL;
+    free(visit->nee);
+    visit->nee = NULL;
+    free(visit->camsignals);
+    visit->camsignals = NULL;
+    free(visit->scratchwave);
+    visit->scratchwave = NULL;
+    free(visit->trajbuf);
+    visit->trajbuf = NULL;
+    visit->trajlen = 0;
+    free(visit->splitstack);
+    visit->splitstack = NULL;
+    visit->splitlen = 0;
 }
 
 /**
@@ -2565,9 +5248,13 @@ void visitor_clear(visitor* visit) {
  */
 
 void updateroi(int immctype, ray* r, tetmesh* mesh) {
+    if (r->eid > 0 && MESH_NOROI(mesh, r->eid - 1)) { // r->roisize is only read by traceroi, which skips this element
+        return;
+    }
+
     if (immctype == 1 && mesh->edgeroi) {
-        r->roisize = (float*)(mesh->edgeroi + (r->eid - 1) * 6);
+        r->roisize = MESH_ROIREC(mesh, mesh->edgeroi, r->eid - 1, 6);
     } else if (mesh->faceroi) {
-        r->roisize = (float*)(mesh->faceroi + (r->eid - 1) * 4);
+        r->roisize = MESH_ROIREC(mesh, mesh->faceroi, r->eid - 1, 4);
     }
 }
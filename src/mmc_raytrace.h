@@ -43,6 +43,18 @@
 
 #define MAX_TRIAL          3          /**< number of fixes when a photon hits an edge/vertex */
 #define FIX_PHOTON         1e-3f      /**< offset to the ray to avoid edge/vertex */
+#define MMC_PACKET_LEN     16         /**< maximum number of photons traced together in a ray packet */
+#define MMC_PACKET_CHUNK   1024       /**< number of photons handed to a packet in one work unit */
+#define MMC_PACKET_MAXNE   0x7FFFFFF  /**< largest element count of the AVX packet gathers, their 32-bit float index eid*16 must not overflow */
+#define MMC_PHOTON_BLOCK   64         /**< photons claimed at once by a thread with the block scheduler (--photonblock -1) */
+#define MMC_WAVEFRONT_LEN  256        /**< number of photons kept in flight by the wavefront scheduler */
+#define MMC_SPLIT_STACK    64         /**< maximum number of pending copies of the split photons of a thread, see --importance */
+#define MMC_NEE_LATTICE    64         /**< number of directions of the spherical Fibonacci lattice of the cone aimed at a detector by the next-event estimator */
+#define MMC_NEE_MAXTAU     50.f       /**< paths of the next-event estimator are dropped once their optical depth exceeds this */
+#define MMC_INC_BATCH      64         /**< number of photons sharing one label mask in the incremental re-simulation */
+#define MMC_DET_SEG_LEN    4096       /**< detected photon records per segment of the shared buffer, unless streamed in chunks of --streamdet */
+#define MMC_TRAJ_BUF_LEN   4096       /**< trajectory positions buffered by a thread before being streamed or copied to cfg->exportdebugdata */
+#define MMC_LABEL_BIT(t)   (1ULL << MIN((t), 63))  /**< bit of label t in a label mask, labels above 63 share bit 63 */
 
 /***************************************************************************//**
 \struct MMC_ray tettracing.h
@@ -77,8 +89,31 @@ typedef struct MMC_ray {
     int inroi;            /**< if 1, inside edgeroi for the NEXT position; if 0, outside edgeroi */
     int roiidx;           /**< edge(0-5), node (0-4) or face (0-4) index in a local element with ROIs */
     int refeid;           /**< reference element id that is used for face-based implicit MMC*/
+    float* wavew;                 /**< weights of the 2nd to the last wavelengths sharing this path, NULL if single-wavelength */
 } ray;
 
+/***************************************************************************//**
+\struct MMC_detbuffer mmc_raytrace.h
+\brief  The detected photon records shared by all threads of a CPU simulation
+
+Each detected photon reserves the next slot with an atomic increment of count.
+The slots are stored in segments of seglen records, each followed by the seeds
+of its records, which are allocated when their first slot is reserved. With
+--streamdet, the leading segments are written out once all their slots are
+filled, while the other threads keep simulating.
+*******************************************************************************/
+
+typedef struct MMC_detbuffer {
+    float** seg;                  /**< segment table, each segment holds seglen records of reclen floats followed by their seeds */
+    unsigned int* filled;         /**< number of records written to each segment */
+    size_t segnum;                /**< length of the segment table */
+    unsigned int seglen;          /**< records per segment */
+    unsigned int count;           /**< number of reserved slots, i.e. detected photons */
+    unsigned int written;         /**< number of leading segments already streamed to the output file */
+    int reclen;                   /**< record length (4-byte per record) of a detected photon */
+    int seedbyte;                 /**< bytes of the seed of a detected photon, 0 if not saved */
+} detbuffer;
+
 /***************************************************************************//**
 \struct MMC_visitor tettracing.h
 \brief  A structure that accumulates the statistics about the simulation
@@ -96,10 +131,98 @@ typedef struct MMC_visitor {
     void*  photonseed;            /**< pointer to store the photon seed */
     double* launchweight;         /**< pointer to accumulated launched photon weight */
     double* absorbweight;         /**< pointer to accumulated absorbed photon weight */
-    double* kahanc0;              /**< temp variable to enable Kahan summation to reduce round-off error */
-    double* kahanc1;              /**< temp variable to enable Kahan summation to reduce round-off error */
+    float* launchblock;           /**< launched weight of the last photons, folded into launchweight every MMC_WEIGHT_BLOCK photons */
+    float* absorbblock;           /**< absorbed weight of the last photons, folded into absorbweight with launchblock */
+    int   blockcount;             /**< number of photons launched since the last fold */
+    float* scratchpath;           /**< per-thread scratch arena for the partial path data of the in-flight photons */
+    void*  scratchseed;           /**< per-thread scratch arena for the seeds of the in-flight photons */
+    int   scratchlen;             /**< number of in-flight photon slots in the scratch arena */
+    double* weight;               /**< thread-private output buffer, NULL if depositing atomically into mesh->weight */
+    unsigned long long nphoton;   /**< number of photons finished by this thread */
+    unsigned long long nreflect;  /**< total number of reflections of the finished photons */
+    unsigned long long nroihit;   /**< total number of implicit ROI hits of the finished photons */
+    unsigned long long ndetected; /**< total number of detected photons, including those beyond the buffer */
+    double* detweight;            /**< accumulated detected weight of each detector, only allocated in the convergence-driven mode */
+    double* dcsg1;                /**< detnum x (dcstaunum+1) unnormalized g1(tau) of each detector followed by its detected weight (--dcs), NULL otherwise */
+    double* detstat;              /**< detnum x statlen unnormalized statistics of each detector (--detstat), NULL otherwise */
+    int   statlen;                /**< statistics per detector of --detstat, mcx_detstatlen(), set before visitor_init() */
+    double* nee;                  /**< detnum x (maxgate+1) unnormalized next-event estimates of the detectors (--nextevent), the TPSF followed by the total, NULL otherwise */
+    double* camsignals;           /**< cam_image_width x cam_image_height unnormalized camera image followed by the projected and detected photon counts (Camera), NULL otherwise */
+    unsigned int neecount;        /**< number of paths aimed at the detectors, the index of the next direction of the cone lattice */
+    float* scratchwave;           /**< per-thread scratch arena for the weights of the additional wavelengths of the in-flight photons */
+    double** weightpage;          /**< page table of the sparse output (--sparsegate), NULL if the output is dense */
+    double* elemweight;           /**< nodal output shared by all threads, accumulated per tet corner (--elemmoment), NULL to add to the nodes */
+    detbuffer* detbuf;            /**< detected photon buffer shared by all threads, NULL to use partialpath/photonseed of this visitor */
+    float* trajbuf;               /**< per-thread buffer of MMC_TRAJ_BUF_LEN trajectory positions, allocated at the first saved position */
+    unsigned int trajlen;         /**< number of positions held in trajbuf */
+    struct MMC_photonstate* splitstack; /**< pending copies of the split photons (--importance), their partial paths follow slot 0 of the scratch arenas, NULL if not splitting */
+    int   splitlen;               /**< number of pending copies in splitstack */
+    unsigned int nsplit;          /**< number of copies made by this thread, tells apart the RNG streams of the copies */
+    float (*advance)(ray* r, raytracer* tracer, mcconfig* cfg, struct MMC_visitor* visit, float tmin, int faceidx); /**< Badouel advance step specialized for cfg, NULL for the generic one */
+    unsigned int* heatmap;        /**< per-thread ne x hmCounterNum counters of --heatmap, indexed by the element from 0, NULL if not counting */
 } visitor;
 
+typedef float (*raytetadvance)(ray* r, raytracer* tracer, mcconfig* cfg, visitor* visit, float tmin, int faceidx); /**< a ray-tet advance step, see branchless_badouel_select() */
+
+/***************************************************************************//**
+\struct MMC_photonstate tettracing.h
+\brief  The resumable state of a photon between two ray-tet tests
+
+The propagation loop of onephoton() is split into a sequence of stages, each
+ending with a ray-tet test. Storing the stage allows multiple photons to be
+advanced in an interleaved fashion, as needed by the packet ray-tracer.
+*******************************************************************************/
+
+typedef struct MMC_photonstate {
+    ray r;                        /**< the ray associated with the photon */
+    size_t id;                    /**< the linear index of the photon */
+    int stage;                    /**< stage of the pending ray-tet test, see TPhotonStage */
+    int oldeid;                   /**< the element from which the photon entered the current element */
+    int fixcount;                 /**< number of attempts to fix a photon hitting an edge/vertex */
+    int exitdet;                  /**< index of the detector capturing the photon, 0 if not detected */
+    int nreflect;                 /**< number of reflections at element faces or ROI surfaces of this photon */
+    int nroihit;                  /**< number of implicit ROI surface hits of this photon */
+    unsigned long long labelmask; /**< labels of the elements entered or tested for reflection, see MMC_LABEL_BIT */
+    float importance;             /**< importance of the medium at the last split or roulette of the photon, see photon_split() */
+    unsigned int* heatmap;        /**< the --heatmap counters of the thread running the photon, see visitor */
+    RandType ran[RAND_BUF_LEN];   /**< the RNG stream owned by this photon, only used by the counter-based RNGs */
+} photonstate;
+
+/**
+ * counter-based RNGs keep one stream per photon so that photons in flight
+ * together in a packet or wavefront do not share random numbers
+ */
+
+#define PHOTON_RAN(ph, ran)  (rand_is_counter() ? (ph)->ran : (ran))
+
+/**
+ * count an event of the --heatmap counters in the element eid (from 0), if counting
+ */
+
+#define MMC_HEAT(heatmap, eid, counter)  do { if (heatmap) { (heatmap)[(size_t)(eid) * hmCounterNum + (counter)]++; } } while (0)
+
+/***************************************************************************//**
+\struct MMC_raypacket tettracing.h
+\brief  Structure-of-arrays ray packet for the wide-SIMD ray-tet tests
+
+*******************************************************************************/
+
+typedef struct MMC_raypacket {
+    float px[MMC_PACKET_LEN];     /**< x-coordinates of the ray origins */
+    float py[MMC_PACKET_LEN];     /**< y-coordinates of the ray origins */
+    float pz[MMC_PACKET_LEN];     /**< z-coordinates of the ray origins */
+    float vx[MMC_PACKET_LEN];     /**< x-components of the ray directions */
+    float vy[MMC_PACKET_LEN];     /**< y-components of the ray directions */
+    float vz[MMC_PACKET_LEN];     /**< z-components of the ray directions */
+    int   eid[MMC_PACKET_LEN];    /**< the enclosing tet of each ray, starting from 0 */
+    float tmin[MMC_PACKET_LEN];   /**< output: distance to the exit face */
+    int   faceidx[MMC_PACKET_LEN];/**< output: local index of the exit face, see maskmap */
+    unsigned int mask;            /**< bit mask of the active lanes */
+} raypacket;
+
+enum TPhotonStage {psOuter, psInner, psFix, psDone};  /**< the ray-tet test that a photon is waiting for */
+enum TPhotonEvent {peTrace, peBoundary, peScatter, peExit, peDone};  /**< the next event of a photon, used by the wavefront scheduler */
+
 #ifdef  __cplusplus
 extern "C" {
 #endif
@@ -112,8 +235,28 @@ float reflectray(mcconfig* cfg, float3* c0, raytracer* tracer, int* oldeid, int*
 float reflectrayroi(mcconfig* cfg, FLOAT3* c0, FLOAT3* ph, raytracer* tracer, int* eid, int* inroi, RandType* ran, int roitype, int roiidx, int refeid);
 void save_scatter_events(ray* r, tetmesh* mesh, mcconfig* cfg, visitor* visit);
 void albedoweight(ray* r, tetmesh* mesh, mcconfig* cfg, visitor* visit);
+void onewavefront(size_t id, size_t count, raytracer* tracer, tetmesh* mesh, mcconfig* cfg, RandType* ran, RandType* ran0, visitor* visit);
+void onepacket(size_t id, size_t count, raytracer* tracer, tetmesh* mesh, mcconfig* cfg, RandType* ran, RandType* ran0, visitor* visit);
+void photon_launch(photonstate* ph, size_t id, int slot, raytracer* tracer, tetmesh* mesh, mcconfig* cfg, RandType* ran, RandType* ran0, visitor* visit);
+int  photon_advance(photonstate* ph, raytracer* tracer, tetmesh* mesh, mcconfig* cfg, RandType* ran, RandType* ran0, visitor* visit);
+int  photon_traced(photonstate* ph, raytracer* tracer, tetmesh* mesh, mcconfig* cfg, RandType* ran);
+int  photon_boundary(photonstate* ph, raytracer* tracer, tetmesh* mesh, mcconfig* cfg, RandType* ran);
+int  photon_scatter(photonstate* ph, raytracer* tracer, tetmesh* mesh, mcconfig* cfg, RandType* ran, RandType* ran0, visitor* visit);
+int  photon_exit(photonstate* ph, tetmesh* mesh, mcconfig* cfg, visitor* visit);
+void photon_finish(photonstate* ph, raytracer* tracer, tetmesh* mesh, mcconfig* cfg, visitor* visit);
+int  photon_propagate(photonstate* ph, int elemend, raytracer* tracer, tetmesh* mesh, mcconfig* cfg, RandType* ran, RandType* ran0, visitor* visit);
+float plucker_raytet(ray* r, raytracer* tracer, mcconfig* cfg, visitor* visit);
+float havel_raytet(ray* r, raytracer* tracer, mcconfig* cfg, visitor* visit);
+float badouel_raytet(ray* r, raytracer* tracer, mcconfig* cfg, visitor* visit);
+float branchless_badouel_raytet(ray* r, raytracer* tracer, mcconfig* cfg, visitor* visit);
+float branchless_badouel_advance(ray* r, raytracer* tracer, mcconfig* cfg, visitor* visit, float tmin, int faceidx);
+raytetadvance branchless_badouel_select(mcconfig* cfg);
+void  packet_raytet(raypacket* pk, raytracer* tracer);
+int   packet_width(void);
 void visitor_init(mcconfig* cfg, visitor* visit);
 void visitor_clear(visitor* visit);
+void visitor_flushtraj(mcconfig* cfg, visitor* visit);
+void visitor_foldweight(mcconfig* cfg, visitor* visit);
 void updateroi(int immctype, ray* r, tetmesh* mesh);
 void traceroi(ray* r, raytracer* tracer, int roitype, int doinit);
 void compute_distances_to_edge(ray* r, raytracer* tracer, int* ee, int edgeid, float d2d[2], FLOAT3 p2d[2], int* hitstatus);
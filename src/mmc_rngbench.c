@@ -0,0 +1,473 @@
+/***************************************************************************//**
+**  \mainpage Mesh-based Monte Carlo (MMC) - a 3D photon simulator
+**
+**  \author Qianqian Fang <q.fang at neu.edu>
+**  \copyright Qianqian Fang, 2010-2025
+**
+**  \section sref Reference:
+**  \li \c (\b Fang2010) Qianqian Fang, <a href="http://www.opticsinfobase.org/abstract.cfm?uri=boe-1-1-165">
+**          "Mesh-based Monte Carlo Method Using Fast Ray-Tracing
+**          in Plucker Coordinates,"</a> Biomed. Opt. Express, 1(1) 165-175 (2010).
+**  \li \c (\b Fang2012) Qianqian Fang and David R. Kaeli,
+**           <a href="https://www.osapublishing.org/boe/abstract.cfm?uri=boe-3-12-3223">
+**          "Accelerating mesh-based Monte Carlo method on modern CPU architectures,"</a>
+**          Biomed. Opt. Express 3(12), 3223-3230 (2012)
+**  \li \c (\b Yao2016) Ruoyang Yao, Xavier Intes, and Qianqian Fang,
+**          <a href="https://www.osapublishing.org/boe/abstract.cfm?uri=boe-7-1-171">
+**          "Generalized mesh-based Monte Carlo for wide-field illumination and detection
+**           via mesh retessellation,"</a> Biomed. Optics Express, 7(1), 171-184 (2016)
+**  \li \c (\b Fang2019) Qianqian Fang and Shijie Yan,
+**          <a href="http://dx.doi.org/10.1117/1.JBO.24.11.115002">
+**          "Graphics processing unit-accelerated mesh-based Monte Carlo photon transport
+**           simulations,"</a> J. of Biomedical Optics, 24(11), 115002 (2019)
+**  \li \c (\b Yuan2021) Yaoshen Yuan, Shijie Yan, and Qianqian Fang,
+**          <a href="https://www.osapublishing.org/boe/fulltext.cfm?uri=boe-12-1-147">
+**          "Light transport modeling in highly complex tissues using the implicit
+**           mesh-based Monte Carlo algorithm,"</a> Biomed. Optics Express, 12(1) 147-161 (2021)
+**
+**  \section slicense License
+**          GPL v3, see LICENSE.txt for details
+*******************************************************************************/
+
+/***************************************************************************//**
+\file    mmc_rngbench.c
+
+\brief   << Throughput and quality benchmark of the random number generators >>
+
+This program is built once for each RNG backend (make rngbench), selected by
+-DMMC_XORSHIFT (default), -DMMC_PHILOX, -DMMC_SFMT, -DMMC_LOGISTIC, -DMMC_POSIX
+(erand48 of libc) or -DMMC_DRAND48 (the portable erand48 used on Windows). It
+draws the random numbers through the same rand_next_* transforms as one
+scattering event of mmc (mc_next_scatter) followed by a reflection and a
+roulette test, and reports the throughput per thread and the basic statistics
+of each transform: the mean and variance, a chi-square test of uniformity, the
+lag-1 serial correlation, and the correlation between the azimuthal and zenith
+angles and between the streams of two threads. The format is
+
+    mmc_rngbench_<backend> <benchmark options>
+
+for example
+
+    mmc_rngbench_xorshift128p -n 1e7 -t 4
+*******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#ifdef _OPENMP
+    #include <omp.h>
+#endif
+
+#include "mmc_utils.h"
+#include "mmc_tictoc.h"
+
+/*the backend is chosen as in mmc_mesh.h, the drand48 and posix backends take precedence over the default MMC_XORSHIFT*/
+#if defined(MMC_PHILOX)
+    #define RNGBENCH_BACKEND "philox"
+    #include "mmc_rand_philox.c"
+#elif defined(MMC_SFMT)
+    #define RNGBENCH_BACKEND "sfmt"
+    #include "mmc_rand_sfmt.c"
+    #include "SFMT/SFMT.c"
+#elif defined(MMC_LOGISTIC)
+    #define RNGBENCH_BACKEND "logistic"
+    #include "mmc_rand_logistic.c"
+#elif defined(MMC_DRAND48)
+    #define RNGBENCH_BACKEND "drand48"
+    #include "mmc_rand_posix.c"
+    #include "mmc_rand_drand48.c"
+#elif defined(MMC_POSIX)
+    #define RNGBENCH_BACKEND "posix"
+    #include "mmc_rand_posix.c"
+#else
+    #define RNGBENCH_BACKEND "xorshift128p"
+    #include "mmc_rand_xorshift128p.c"
+#endif
+
+/*mc_next_scatter uses the block transforms with SSE math, except for the counter-based RNGs*/
+#if defined(MMC_USE_SSE_MATH) && !defined(MMC_RNG_COUNTER) && !defined(MMC_LOGISTIC)
+    #define RNGBENCH_SSE_MATH
+#endif
+
+#ifndef TWO_PI
+    #define TWO_PI     (M_PI*2.0)
+    #define EPS        1e-6f
+#endif
+
+#define RNGBENCH_BINS      100       /**< number of bins of the chi-square uniformity test */
+#define RNGBENCH_ZMAX      4.0       /**< largest |z| score of a statistic to pass */
+#define RNGBENCH_PER_STEP  5         /**< random numbers drawn per step */
+
+/**
+ * \brief Running statistics of a stream of [0,1] random numbers
+ */
+
+typedef struct MMC_rngstat {
+    double n;                     /**< number of accepted samples */
+    double sum;                   /**< sum of the samples */
+    double sum2;                  /**< sum of the squared samples */
+    double lag;                   /**< sum of the products of consecutive centered samples */
+    double prev;                  /**< the previous sample */
+    double minv;                  /**< smallest transform output */
+    double maxv;                  /**< largest transform output */
+    double nbad;                  /**< number of samples outside of [0,1], inf or nan */
+    double bin[RNGBENCH_BINS];    /**< histogram of the samples */
+} rngstat;
+
+static void rngstat_init(rngstat* st) {
+    memset(st, 0, sizeof(rngstat));
+    st->minv = 1e30;
+    st->maxv = -1e30;
+}
+
+/**
+ * \brief Add a sample to the statistics
+ *
+ * \param[in] st: the running statistics
+ * \param[in] u: the sample mapped to [0,1]
+ * \param[in] v: the raw output of the transform, used for the reported range
+ */
+
+static void rngstat_add(rngstat* st, double u, double v) {
+    if (!(u >= 0.0 && u <= 1.0) || !isfinite(v)) {
+        st->nbad++;
+        return;
+    }
+
+    if (st->n > 0) {
+        st->lag += (u - 0.5) * (st->prev - 0.5);
+    }
+
+    st->n++;
+    st->sum += u;
+    st->sum2 += u * u;
+    st->prev = u;
+    st->minv = (v < st->minv) ? v : st->minv;
+    st->maxv = (v > st->maxv) ? v : st->maxv;
+    st->bin[(u >= 1.0) ? RNGBENCH_BINS - 1 : (int)(u * RNGBENCH_BINS)]++;
+}
+
+/**
+ * \brief Print the statistics of a transform, and return 1 if all tests pass
+ *
+ * The mean, chi-square and lag-1 correlation are printed as z scores, the
+ * variance is scaled by 12 so that a uniform stream gives 1. The chi-square is
+ * converted by the Wilson-Hilferty approximation.
+ */
+
+static int rngstat_report(const char* name, rngstat* st) {
+    double n = st->n, mean, var, chi2 = 0.0, df = RNGBENCH_BINS - 1, expect, zmean, zchi2, zlag;
+    int i, pass;
+
+    if (n < 2) {
+        MMC_FPRINTF(stdout, "%-16s no valid samples\n", name);
+        return 0;
+    }
+
+    mean = st->sum / n;
+    var = st->sum2 / n - mean * mean;
+    expect = n / RNGBENCH_BINS;
+
+    for (i = 0; i < RNGBENCH_BINS; i++) {
+        chi2 += (st->bin[i] - expect) * (st->bin[i] - expect) / expect;
+    }
+
+    zmean = (mean - 0.5) * sqrt(12.0 * n);
+    zchi2 = (cbrt(chi2 / df) - (1.0 - 2.0 / (9.0 * df))) / sqrt(2.0 / (9.0 * df));
+    zlag = 12.0 * st->lag / (n - 1) * sqrt(n - 1);
+    pass = (fabs(zmean) < RNGBENCH_ZMAX && fabs(zchi2) < RNGBENCH_ZMAX && fabs(zlag) < RNGBENCH_ZMAX && st->nbad == 0);
+
+    MMC_FPRINTF(stdout, "%-16s %9.6f %8.5f %8.2f %8.2f %8.2f %12.6g %12.6g %8.0f  %s\n", name, mean, var * 12.0,
+                zmean, zchi2, zlag, st->minv, st->maxv, st->nbad, pass ? "pass" : "FAIL");
+    return pass;
+}
+
+/**
+ * \brief Print the correlation of two streams of [0,1] random numbers as a z score, and return 1 if it passes
+ */
+
+static int rngstat_reportcorr(const char* name, double cross, double n) {
+    double z = 12.0 * cross / n * sqrt(n);
+    int pass = (fabs(z) < RNGBENCH_ZMAX);
+
+    MMC_FPRINTF(stdout, "%-16s %9s %8s %8s %8s %8.2f %12s %12s %8s  %s\n", name, "-", "-", "-", "-", z, "-", "-", "-", pass ? "pass" : "FAIL");
+    return pass;
+}
+
+static inline void rngbench_sincosf(float x, float* sine, float* cosine) {
+#if defined(__GNUC__) && defined(__linux__) && !defined(__clang__)
+    __builtin_sincosf(x, sine, cosine);
+#else
+    *sine = sinf(x);
+    *cosine = cosf(x);
+#endif
+}
+
+#ifdef RNGBENCH_SSE_MATH
+
+/**
+ * \brief Map the sin/cos of an azimuthal angle back to a [0,1] random number
+ */
+
+static double rngbench_angle01(float si, float co) {
+    double u = atan2(si, co) / TWO_PI;
+
+    return (u < 0.0) ? u + 1.0 : u;
+}
+
+#endif
+
+/**
+ * \brief Initialize the RNG of a thread, the counter-based RNGs start at photon idx of the shared key
+ */
+
+static void rngbench_init(RandType* ran, RandType* ran0, unsigned int* seeds, int idx) {
+    rng_init(ran, ran0, seeds, idx);
+#ifdef MMC_RNG_COUNTER
+    memcpy(ran0, ran, sizeof(RandType) * RAND_BUF_LEN);
+    rng_seek_photon(ran, ran0, idx);
+#endif
+}
+
+/**
+ * \brief Draw the random numbers of count steps, as mc_next_scatter, the reflection and the roulette test do
+ *
+ * \return the sum of the outputs, so that the loop is not optimized out
+ */
+
+static float rngbench_run(RandType* ran, RandType* ran0, size_t count) {
+    float sum = 0.f, si, co;
+    size_t i;
+
+    for (i = 0; i < count; i++) {
+        rand_need_more(ran, ran0);
+#ifdef RNGBENCH_SSE_MATH
+        sum += rand_next_scatlen_ps(ran);
+        rand_next_aangle_sincos(ran, &si, &co);
+#else
+        sum += rand_next_scatlen(ran);
+        rngbench_sincosf(TWO_PI * rand_next_aangle(ran), &si, &co);
+#endif
+        sum += si + co + rand_next_zangle(ran);
+        sum += rand_next_reflect(ran) + rand_do_roulette(ran);
+    }
+
+    return sum;
+}
+
+/**
+ * \brief Test the transforms of the streams of the first two threads, and return 1 if all tests pass
+ *
+ * The scattering length s is tested as exp(-s), which is uniform in [0,1].
+ */
+
+static int rngbench_quality(unsigned int* seeds, size_t count) {
+    RandType ran[RAND_BUF_LEN] __attribute__ ((aligned(16)));
+    RandType ran0[RAND_BUF_LEN] __attribute__ ((aligned(16)));
+    RandType ranb[RAND_BUF_LEN] __attribute__ ((aligned(16)));
+    RandType ranb0[RAND_BUF_LEN] __attribute__ ((aligned(16)));
+    rngstat st[RNGBENCH_PER_STEP];
+    const char* names[RNGBENCH_PER_STEP] = {"scatlen", "aangle", "zangle", "reflect", "roulette"};
+    double crossaz = 0.0, crossab = 0.0;
+    size_t i;
+    int j, pass = 1;
+
+    for (j = 0; j < RNGBENCH_PER_STEP; j++) {
+        rngstat_init(st + j);
+    }
+
+    rngbench_init(ran, ran0, seeds, 0);
+
+    for (i = 0; i < count; i++) {
+        float v[RNGBENCH_PER_STEP];
+
+        rand_need_more(ran, ran0);
+        v[0] = rand_next_scatlen(ran);
+        v[1] = rand_next_aangle(ran);
+        v[2] = rand_next_zangle(ran);
+        v[3] = rand_next_reflect(ran);
+        v[4] = rand_do_roulette(ran);
+
+        rngstat_add(st, (v[0] >= -EPS) ? MIN(exp(-v[0]), 1.0) : -1.0, v[0]);
+
+        for (j = 1; j < RNGBENCH_PER_STEP; j++) {
+            rngstat_add(st + j, v[j], v[j]);
+        }
+
+        crossaz += (v[1] - 0.5) * (v[2] - 0.5);
+    }
+
+    MMC_FPRINTF(stdout, "%-16s %9s %8s %8s %8s %8s %12s %12s %8s  %s\n", "transform", "mean", "var*12", "z-mean", "z-chi2", "z-lag1", "min", "max", "invalid", "result");
+
+    for (j = 0; j < RNGBENCH_PER_STEP; j++) {
+        pass &= rngstat_report(names[j], st + j);
+    }
+
+    pass &= rngstat_reportcorr("aangle~zangle", crossaz, (double)count);
+
+#ifdef RNGBENCH_SSE_MATH
+    /*the block transforms used by mc_next_scatter with SSE math*/
+    rngstat_init(st);
+    rngstat_init(st + 1);
+    rand_clear_blocks();
+    rngbench_init(ran, ran0, seeds, 0);
+
+    for (i = 0; i < count; i++) {
+        float s, si, co;
+
+        rand_need_more(ran, ran0);
+        s = rand_next_scatlen_ps(ran);
+        rand_next_aangle_sincos(ran, &si, &co);
+        rngstat_add(st, (s >= -EPS) ? MIN(exp(-s), 1.0) : -1.0, s);
+        rngstat_add(st + 1, (fabsf(si * si + co * co - 1.f) < 1e-3f) ? rngbench_angle01(si, co) : -1.0, si);
+    }
+
+    pass &= rngstat_report("scatlen_ps", st);
+    pass &= rngstat_report("aangle_sincos", st + 1);
+#endif
+
+    /*streams of two threads, drawn alternately as the threads would*/
+    rngbench_init(ran, ran0, seeds, 0);
+    rngbench_init(ranb, ranb0, seeds, 1);
+
+    for (i = 0; i < count; i++) {
+        float a, b;
+
+        rand_need_more(ran, ran0);
+        a = rand_next_aangle(ran);
+        rand_need_more(ranb, ranb0);
+        b = rand_next_aangle(ranb);
+        crossab += (a - 0.5) * (b - 0.5);
+    }
+
+    pass &= rngstat_reportcorr("thread0~thread1", crossab, (double)count);
+
+    return pass;
+}
+
+static void rngbench_usage(char* exename) {
+    printf("\
+usage: %s <benchmark options>\n\
+where the benchmark options include (the first item in [] is the default value)\n\
+ -n [10000000] number of steps per thread for the throughput test, each step\n\
+               draws %d random numbers: scattering length, azimuthal and zenith\n\
+               angles of mc_next_scatter, a reflection and a roulette test\n\
+ -r [3]        number of timed repeats of the throughput test\n\
+ -q [1000000]  number of steps for the quality tests\n\
+ -t [nthread]  number of threads, the OpenMP default if not given\n\
+ -E [1648335518] seed of the per-thread RNG seeds, as the -E flag of mmc\n\
+for example\n\
+       %s -n 1e7 -t 4\n", exename, RNGBENCH_PER_STEP, exename);
+}
+
+int main(int argc, char** argv) {
+    size_t count = 10000000, qcount = 1000000;
+    int i, repeat = 3, threadnum = 1, seed = 1648335518, pass;
+    unsigned int* seeds;
+    unsigned long long dt = 0;
+    float sink = 0.f;
+    double nnum;
+
+#ifdef _OPENMP
+    threadnum = omp_get_max_threads();
+#endif
+
+    for (i = 1; i < argc; i++) {
+        if (argv[i][0] == '-' && argv[i][1] != '\0' && argv[i][2] == '\0' && i < argc - 1 && strchr("nrqtE", argv[i][1])) {
+            switch (argv[i++][1]) {
+                case 'n':
+                    count = (size_t)atof(argv[i]);
+                    break;
+
+                case 'r':
+                    repeat = atoi(argv[i]);
+                    break;
+
+                case 'q':
+                    qcount = (size_t)atof(argv[i]);
+                    break;
+
+                case 't':
+                    threadnum = atoi(argv[i]);
+                    break;
+
+                case 'E':
+                    seed = atoi(argv[i]);
+                    break;
+            }
+        } else {
+            rngbench_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (count == 0 || qcount < 2 || repeat <= 0 || threadnum <= 0) {
+        rngbench_usage(argv[0]);
+        return 1;
+    }
+
+    /*the per-thread seeds are generated the same way as in mmc_run_mp, at least two for the quality tests*/
+    seeds = (unsigned int*)malloc(sizeof(int) * MAX(threadnum, 2) * RAND_SEED_WORD_LEN);
+    srand(seed);
+
+    for (i = 0; i < MAX(threadnum, 2) * RAND_SEED_WORD_LEN; i++) {
+        seeds[i] = rand();
+    }
+
+    MMC_FPRINTF(stdout, "backend: %s (%s), state: %d x %d bytes, %s transforms\n", RNGBENCH_BACKEND, MCX_RNG_NAME,
+                RAND_BUF_LEN, (int)sizeof(RandType),
+#ifdef RNGBENCH_SSE_MATH
+                "SSE math"
+#else
+                "scalar"
+#endif
+               );
+
+    #pragma omp parallel num_threads(threadnum) reduction(+:sink)
+    {
+        RandType ran[RAND_BUF_LEN] __attribute__ ((aligned(16)));
+        RandType ran0[RAND_BUF_LEN] __attribute__ ((aligned(16)));
+        int threadid = 0, j;
+
+#ifdef _OPENMP
+        threadid = omp_get_thread_num();
+#endif
+        rngbench_init(ran, ran0, seeds, threadid);
+
+        /*warm up the caches and fill the transform blocks*/
+        sink += rngbench_run(ran, ran0, MIN(count, 100000));
+
+        #pragma omp barrier
+        #pragma omp master
+        {
+            dt = GetTimeNanos();
+        }
+        #pragma omp barrier
+
+        for (j = 0; j < repeat; j++) {
+            sink += rngbench_run(ran, ran0, count);
+        }
+
+        #pragma omp barrier
+        #pragma omp master
+        {
+            dt = GetTimeNanos() - dt;
+        }
+    }
+
+    nnum = (double)count * repeat * RNGBENCH_PER_STEP;
+
+    MMC_FPRINTF(stdout, "throughput: %d threads, %zu steps x %d repeats per thread, %d numbers per step\n", threadnum, count, repeat, RNGBENCH_PER_STEP);
+    MMC_FPRINTF(stdout, "%14s %18s %18s %14s\n", "ns/step", "ns/number/thread", "numbers/ns/thread", "numbers/ns");
+    MMC_FPRINTF(stdout, "%14.3f %18.3f %18.4f %14.4f\n", dt / (nnum / RNGBENCH_PER_STEP), dt / nnum, nnum / dt, nnum * threadnum / dt);
+    MMC_FPRINTF(stdout, "(checksum %g)\n", (double)sink);
+
+    MMC_FPRINTF(stdout, "quality: %zu steps of thread 0, %d bins, |z| < %g to pass\n", qcount, RNGBENCH_BINS, RNGBENCH_ZMAX);
+    pass = rngbench_quality(seeds, qcount);
+    MMC_FPRINTF(stdout, "overall: %s\n", pass ? "pass" : "FAIL");
+
+    free(seeds);
+    return pass ? 0 : 2;
+}
@@ -0,0 +1,325 @@
+/***************************************************************************//**
+**  \mainpage Mesh-based Monte Carlo (MMC) - a 3D photon simulator
+**
+**  \author Qianqian Fang <q.fang at neu.edu>
+**  \copyright Qianqian Fang, 2010-2025
+**
+**  \section sref Reference:
+**  \li \c (\b Fang2010) Qianqian Fang, <a href="http://www.opticsinfobase.org/abstract.cfm?uri=boe-1-1-165">
+**          "Mesh-based Monte Carlo Method Using Fast Ray-Tracing
+**          in Plucker Coordinates,"</a> Biomed. Opt. Express, 1(1) 165-175 (2010).
+**  \li \c (\b Fang2012) Qianqian Fang and David R. Kaeli,
+**           <a href="https://www.osapublishing.org/boe/abstract.cfm?uri=boe-3-12-3223">
+**          "Accelerating mesh-based Monte Carlo method on modern CPU architectures,"</a>
+**          Biomed. Opt. Express 3(12), 3223-3230 (2012)
+**  \li \c (\b Yao2016) Ruoyang Yao, Xavier Intes, and Qianqian Fang,
+**          <a href="https://www.osapublishing.org/boe/abstract.cfm?uri=boe-7-1-171">
+**          "Generalized mesh-based Monte Carlo for wide-field illumination and detection
+**           via mesh retessellation,"</a> Biomed. Optics Express, 7(1), 171-184 (2016)
+**  \li \c (\b Fang2019) Qianqian Fang and Shijie Yan,
+**          <a href="http://dx.doi.org/10.1117/1.JBO.24.11.115002">
+**          "Graphics processing unit-accelerated mesh-based Monte Carlo photon transport
+**           simulations,"</a> J. of Biomedical Optics, 24(11), 115002 (2019)
+**  \li \c (\b Yuan2021) Yaoshen Yuan, Shijie Yan, and Qianqian Fang,
+**          <a href="https://www.osapublishing.org/boe/fulltext.cfm?uri=boe-12-1-147">
+**          "Light transport modeling in highly complex tissues using the implicit
+**           mesh-based Monte Carlo algorithm,"</a> Biomed. Optics Express, 12(1) 147-161 (2021)
+**
+**  \section slicense License
+**          GPL v3, see LICENSE.txt for details
+*******************************************************************************/
+
+/***************************************************************************//**
+\file    mmc_simd.h
+
+\brief   Portable 4-wide SIMD layer for the SSE ray-tracers and sse_math
+
+On x86 (and with emscripten) this header simply includes the SSE4.1
+intrinsics. On all other CPUs, such as the AArch64 (NEON) processors of
+Graviton and Apple-silicon machines, the subset of the _mm_* intrinsics
+used by MMC is implemented on top of the GCC/clang generic vector
+extensions, which the compiler lowers to the native 128-bit SIMD
+instructions of the target. The SSE4 engines (Havel, Badouel, branchless
+Badouel) and the vectorized sse_math functions are then built unchanged.
+
+The emulated intrinsics follow the SSE semantics, including the operand
+returned by _mm_min/max_ps when one input is NaN and the summation order
+of _mm_dp_ps and _mm_hadd_ps, so that the ray-tracers take the same
+branches as on x86. _mm_rcp_ps and _mm_rsqrt_ss return the exact values
+rather than the 12-bit approximations of x86.
+
+Define MMC_SIMD_PORTABLE to force the generic layer on x86 for testing
+(without the AVX2 packet engines).
+*******************************************************************************/
+
+#ifndef _MMC_SIMD_H
+#define _MMC_SIMD_H
+
+#if !defined(MMC_SIMD_PORTABLE) && (defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86) || defined(__EMSCRIPTEN__))
+
+#include <smmintrin.h>
+
+#else
+
+#ifndef MMC_SIMD_PORTABLE
+    #define MMC_SIMD_PORTABLE
+#endif
+
+#include <string.h>
+#include <math.h>
+
+typedef float __m128 __attribute__((__vector_size__(16), __aligned__(16), __may_alias__));        /**< 4 packed floats */
+typedef int __m128i __attribute__((__vector_size__(16), __aligned__(16), __may_alias__));         /**< 4 packed 32bit integers */
+typedef unsigned int mmc_v4su __attribute__((__vector_size__(16), __aligned__(16), __may_alias__)); /**< 4 packed unsigned integers */
+
+/*like the x86 intrinsics, the functions are always inlined and never emitted, so they can be called from non-static inline functions*/
+#define MMC_SIMD_INLINE  extern __inline __attribute__((__gnu_inline__, __always_inline__, __artificial__))
+
+#define _MM_SHUFFLE(z, y, x, w)  (((z) << 6) | ((y) << 4) | ((x) << 2) | (w))
+
+#define _MM_HINT_T0   3
+#define _MM_HINT_T1   2
+#define _MM_HINT_T2   1
+#define _MM_HINT_NTA  0
+
+#define _mm_prefetch(p, hint)  __builtin_prefetch((const void*)(p), 0, 3)
+
+/*select a where the mask lanes are all ones, b elsewhere*/
+MMC_SIMD_INLINE __m128 mmc_simd_select(__m128i mask, __m128 a, __m128 b) {
+    return (__m128)((mask & (__m128i)a) | (~mask & (__m128i)b));
+}
+
+/*load, store and set*/
+
+MMC_SIMD_INLINE __m128 _mm_set1_ps(float a) {
+    __m128 r = {a, a, a, a};
+    return r;
+}
+
+MMC_SIMD_INLINE __m128 _mm_set_ss(float a) {
+    __m128 r = {a, 0.f, 0.f, 0.f};
+    return r;
+}
+
+MMC_SIMD_INLINE __m128 _mm_setzero_ps(void) {
+    return _mm_set1_ps(0.f);
+}
+
+MMC_SIMD_INLINE __m128 _mm_load_ps(const float* p) {
+    return *(const __m128*)p;
+}
+
+MMC_SIMD_INLINE __m128 _mm_loadu_ps(const float* p) {
+    __m128 r;
+    memcpy(&r, p, sizeof(__m128));
+    return r;
+}
+
+MMC_SIMD_INLINE __m128 _mm_load_ss(const float* p) {
+    return _mm_set_ss(*p);
+}
+
+MMC_SIMD_INLINE void _mm_store_ps(float* p, __m128 a) {
+    *(__m128*)p = a;
+}
+
+MMC_SIMD_INLINE void _mm_storeu_ps(float* p, __m128 a) {
+    memcpy(p, &a, sizeof(__m128));
+}
+
+MMC_SIMD_INLINE void _mm_store_ss(float* p, __m128 a) {
+    *p = a[0];
+}
+
+MMC_SIMD_INLINE float _mm_cvtss_f32(__m128 a) {
+    return a[0];
+}
+
+/*arithmetic*/
+
+MMC_SIMD_INLINE __m128 _mm_add_ps(__m128 a, __m128 b) {
+    return a + b;
+}
+
+MMC_SIMD_INLINE __m128 _mm_sub_ps(__m128 a, __m128 b) {
+    return a - b;
+}
+
+MMC_SIMD_INLINE __m128 _mm_mul_ps(__m128 a, __m128 b) {
+    return a * b;
+}
+
+MMC_SIMD_INLINE __m128 _mm_div_ps(__m128 a, __m128 b) {
+    return a / b;
+}
+
+MMC_SIMD_INLINE __m128 _mm_add_ss(__m128 a, __m128 b) {
+    a[0] += b[0];
+    return a;
+}
+
+MMC_SIMD_INLINE __m128 _mm_sub_ss(__m128 a, __m128 b) {
+    a[0] -= b[0];
+    return a;
+}
+
+MMC_SIMD_INLINE __m128 _mm_mul_ss(__m128 a, __m128 b) {
+    a[0] *= b[0];
+    return a;
+}
+
+MMC_SIMD_INLINE __m128 _mm_min_ps(__m128 a, __m128 b) {
+    return mmc_simd_select((__m128i)(a < b), a, b);
+}
+
+MMC_SIMD_INLINE __m128 _mm_max_ps(__m128 a, __m128 b) {
+    return mmc_simd_select((__m128i)(a > b), a, b);
+}
+
+MMC_SIMD_INLINE __m128 _mm_min_ss(__m128 a, __m128 b) {
+    a[0] = (a[0] < b[0]) ? a[0] : b[0];
+    return a;
+}
+
+MMC_SIMD_INLINE __m128 _mm_sqrt_ps(__m128 a) {
+    __m128 r = {sqrtf(a[0]), sqrtf(a[1]), sqrtf(a[2]), sqrtf(a[3])};
+    return r;
+}
+
+MMC_SIMD_INLINE __m128 _mm_rcp_ps(__m128 a) {
+    return _mm_set1_ps(1.f) / a;
+}
+
+MMC_SIMD_INLINE __m128 _mm_rsqrt_ss(__m128 a) {
+    a[0] = 1.f / sqrtf(a[0]);
+    return a;
+}
+
+/*horizontal operations, the pairwise sums are taken in the SSE order*/
+
+MMC_SIMD_INLINE __m128 _mm_hadd_ps(__m128 a, __m128 b) {
+    __m128 r = {a[0] + a[1], a[2] + a[3], b[0] + b[1], b[2] + b[3]};
+    return r;
+}
+
+MMC_SIMD_INLINE __m128 _mm_dp_ps(__m128 a, __m128 b, const int imm) {
+    __m128 p = a * b, r;
+    float s = (((imm & 0x10) ? p[0] : 0.f) + ((imm & 0x20) ? p[1] : 0.f))
+              + (((imm & 0x40) ? p[2] : 0.f) + ((imm & 0x80) ? p[3] : 0.f));
+
+    r[0] = (imm & 0x1) ? s : 0.f;
+    r[1] = (imm & 0x2) ? s : 0.f;
+    r[2] = (imm & 0x4) ? s : 0.f;
+    r[3] = (imm & 0x8) ? s : 0.f;
+    return r;
+}
+
+MMC_SIMD_INLINE __m128 _mm_shuffle_ps(__m128 a, __m128 b, const int imm) {
+    __m128 r = {a[imm & 3], a[(imm >> 2) & 3], b[(imm >> 4) & 3], b[(imm >> 6) & 3]};
+    return r;
+}
+
+MMC_SIMD_INLINE __m128 _mm_movehl_ps(__m128 a, __m128 b) {
+    __m128 r = {b[2], b[3], a[2], a[3]};
+    return r;
+}
+
+MMC_SIMD_INLINE int _mm_movemask_ps(__m128 a) {
+    mmc_v4su u = (mmc_v4su)a >> 31;
+    return (int)(u[0] | (u[1] << 1) | (u[2] << 2) | (u[3] << 3));
+}
+
+/*comparisons and bitwise logic*/
+
+MMC_SIMD_INLINE __m128 _mm_cmpeq_ps(__m128 a, __m128 b) {
+    return (__m128)(a == b);
+}
+
+MMC_SIMD_INLINE __m128 _mm_cmplt_ps(__m128 a, __m128 b) {
+    return (__m128)(a < b);
+}
+
+MMC_SIMD_INLINE __m128 _mm_cmple_ps(__m128 a, __m128 b) {
+    return (__m128)(a <= b);
+}
+
+MMC_SIMD_INLINE __m128 _mm_cmpgt_ps(__m128 a, __m128 b) {
+    return (__m128)(a > b);
+}
+
+MMC_SIMD_INLINE __m128 _mm_and_ps(__m128 a, __m128 b) {
+    return (__m128)((__m128i)a & (__m128i)b);
+}
+
+MMC_SIMD_INLINE __m128 _mm_andnot_ps(__m128 a, __m128 b) {
+    return (__m128)(~(__m128i)a & (__m128i)b);
+}
+
+MMC_SIMD_INLINE __m128 _mm_or_ps(__m128 a, __m128 b) {
+    return (__m128)((__m128i)a | (__m128i)b);
+}
+
+MMC_SIMD_INLINE __m128 _mm_xor_ps(__m128 a, __m128 b) {
+    return (__m128)((__m128i)a ^ (__m128i)b);
+}
+
+/*32bit integer vectors*/
+
+MMC_SIMD_INLINE __m128i _mm_castps_si128(__m128 a) {
+    return (__m128i)a;
+}
+
+MMC_SIMD_INLINE __m128 _mm_castsi128_ps(__m128i a) {
+    return (__m128)a;
+}
+
+MMC_SIMD_INLINE __m128i _mm_setzero_si128(void) {
+    __m128i r = {0, 0, 0, 0};
+    return r;
+}
+
+MMC_SIMD_INLINE void _mm_store_si128(__m128i* p, __m128i a) {
+    *p = a;
+}
+
+MMC_SIMD_INLINE __m128i _mm_cvttps_epi32(__m128 a) {
+    __m128i r = {(int)a[0], (int)a[1], (int)a[2], (int)a[3]};
+    return r;
+}
+
+MMC_SIMD_INLINE __m128 _mm_cvtepi32_ps(__m128i a) {
+    __m128 r = {(float)a[0], (float)a[1], (float)a[2], (float)a[3]};
+    return r;
+}
+
+MMC_SIMD_INLINE __m128i _mm_add_epi32(__m128i a, __m128i b) {
+    return (__m128i)((mmc_v4su)a + (mmc_v4su)b);
+}
+
+MMC_SIMD_INLINE __m128i _mm_sub_epi32(__m128i a, __m128i b) {
+    return (__m128i)((mmc_v4su)a - (mmc_v4su)b);
+}
+
+MMC_SIMD_INLINE __m128i _mm_and_si128(__m128i a, __m128i b) {
+    return a & b;
+}
+
+MMC_SIMD_INLINE __m128i _mm_andnot_si128(__m128i a, __m128i b) {
+    return ~a & b;
+}
+
+MMC_SIMD_INLINE __m128i _mm_cmpeq_epi32(__m128i a, __m128i b) {
+    return (__m128i)(a == b);
+}
+
+MMC_SIMD_INLINE __m128i _mm_slli_epi32(__m128i a, const int n) {
+    return (n > 31) ? _mm_setzero_si128() : (__m128i)((mmc_v4su)a << n);
+}
+
+MMC_SIMD_INLINE __m128i _mm_srli_epi32(__m128i a, const int n) {
+    return (n > 31) ? _mm_setzero_si128() : (__m128i)((mmc_v4su)a >> n);
+}
+
+#endif
+
+#endif
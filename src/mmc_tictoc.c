@@ -193,6 +193,7 @@ void CleanupMillisTimer(void) {
     #include <time.h>   // for nanosleep
 #else
     #include <unistd.h> // for usleep
+    #include <sys/time.h>
 #endif
 
 /**
@@ -212,6 +213,32 @@ void sleep_ms(int milliseconds) {
 #endif
 }
 
+/**
+  @brief Cross-platform monotonic timer with nanosecond resolution, from an arbitrary origin
+*/
+
+unsigned long long GetTimeNanos(void) {
+#ifdef _WIN32
+    static LARGE_INTEGER freq;
+    LARGE_INTEGER counter;
+
+    if (freq.QuadPart == 0) {
+        QueryPerformanceFrequency(&freq);
+    }
+
+    QueryPerformanceCounter(&counter);
+    return (unsigned long long)((double)counter.QuadPart * (1e9 / (double)freq.QuadPart));
+#elif _POSIX_C_SOURCE >= 199309L
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#else
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (unsigned long long)tv.tv_sec * 1000000000ULL + tv.tv_usec * 1000ULL;
+#endif
+}
+
 
 #if defined(_WIN32) && defined(USE_OS_TIMER) && !defined(MCX_CONTAINER)
 
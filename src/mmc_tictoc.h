@@ -44,6 +44,7 @@ extern "C" {
 
 unsigned int StartTimer ();
 unsigned int GetTimeMillis ();
+unsigned long long GetTimeNanos(void);
 void sleep_ms(int milliseconds);
 
 #if defined(_WIN32) && defined(USE_OS_TIMER) && !defined(MCX_CONTAINER)
@@ -35,15 +35,32 @@
 \brief   MC simulation settings and command line option processing unit
 *******************************************************************************/
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+    #define _GNU_SOURCE    /*for CPU_SET and sched_setaffinity*/
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
 #include <ctype.h>
 #include <time.h>
+#include <float.h>
+#include <limits.h>
+#ifdef _WIN32
+    #include <windows.h>
+#else
+    #include <unistd.h>
+    #include <sys/mman.h>
+#endif
 #ifdef _POSIX_SOURCE
     #include <sys/ioctl.h>
 #endif
+#ifdef __linux__
+    #include <sched.h>
+#endif
+#ifdef _OPENMP
+    #include <omp.h>
+#endif
 #include "mmc_utils.h"
 #include "mmc_const.h"
 #include "mmc_bench.h"
@@ -106,7 +123,7 @@
 const char shortopt[] = {'h', 'E', 'f', 'n', 'A', 't', 'T', 's', 'a', 'g', 'b', 'D', 'G',
                          'd', 'r', 'S', 'e', 'U', 'R', 'l', 'L', 'I', '-', 'u', 'C', 'M',
                          'i', 'V', 'O', '-', 'F', 'q', 'x', 'P', 'k', 'v', 'm', '-', '-',
-                         'J', 'o', 'H', '-', 'W', 'X', '-', 'c', 'Q', '-', 'Z', 'N', '\0'
+                         'J', 'o', 'H', '-', 'W', 'X', '-', 'c', 'Q', '-', 'Z', 'N', '-', '-', '-', '-', '-', '-', '-', '-', '-', '-', '-', '-', '-', '-', '-', '-', '-', '-', '-', '-', '-', '-', '-', '-', '-', '-', '-', '-', '-', '-', '-', '-', '-', '-', '-', '-', '-', '-', '-', '-', '-', '-', '-', '-', '-', '-', '-', '-', '-', '-', '-', '-', '-', '-', '-', '-', '-', '-', '-', '-', '-', '-', '-', '-', '-', '-', '\0'
                         };
 
 /**
@@ -125,7 +142,11 @@ const char* fullopt[] = {"--help", "--seed", "--input", "--photon", "--autopilot
                          "--replaydet", "--voidtime", "--version", "--mc", "--atomic",
                          "--debugphoton", "--compileropt", "--optlevel", "--maxdetphoton",
                          "--buffer", "--workload", "--saveref", "--gridsize", "--compute",
-                         "--bench", "--dumpjson", "--zip", "--net", ""
+                         "--bench", "--dumpjson", "--zip", "--net", "--wavefront", "--photonblock",
+                         "--privatebuf", "--numa", "--reorder", "--dumpmesh",
+                         "--cachetracer", "--cachekernel", "--dynload", "--packmesh", "--streamdet", "--saveprofile",
+                         "--convtarget", "--convbatch", "--convroi", "--checkpoint", "--resume", "--leanmem", "--waveprop", "--sparsegate", "--freq",
+                         "--pmc", "--pmcprop", "--incache", "--serve", "--shm", "--phasetable", "--phasefile", "--tthg", "--flushrespin", "--persistent", "--unifiedmem", "--savedetflag", "--varbatch", "--rng", "--maxjumpdebug", "--trajsample", "--hybrid", "--gpusort", "--localmesh", "--elemmoment", "--emission", "--dcs", "--dcstau", "--detstat", "--adjoint", "--importance", "--nextevent", "--reciprocal", "--diffusion", "--diffmin", "--srclist", "--elemprop", "--halfface", "--outmask", "--float16", "--patternbits", "--autotune", "--heatmap", "--estimate", "--domain", "--pipeline", "--edgetable", "--fission", "--resultcache", "--cachelimit", ""
                         };
 
 extern char pathsep;
@@ -139,6 +160,14 @@ extern char pathsep;
 
 const char debugflag[] = {'S', 'C', 'B', 'W', 'D', 'I', 'O', 'X', 'A', 'T', 'R', 'P', 'E', 'M', '\0'};
 
+/**
+ * Detected photon data fields
+ * D: detector ID, S: partial scattering counts, P: partial path lengths, M: momentum transfer,
+ * X: exit position, V: exit direction, W: initial weight
+ */
+
+const char saveflag[] = {'D', 'S', 'P', 'M', 'X', 'V', 'W', '\0'};
+
 /**
  * Selecting mesh-based ray-tracing algorithm:
  * p: Plucker-based ray-tracer, see Fang2010
@@ -146,9 +175,10 @@ const char debugflag[] = {'S', 'C', 'B', 'W', 'D', 'I', 'O', 'X', 'A', 'T', 'R',
  * b: Badouel ray-tracing algorithm, see Fang2011
  * s: branch-less Badouel SSE4 ray-tracer, see Fang2011
  * g: grid-output using dual-mesh MMC
+ * v: branch-less Badouel ray-tracer using AVX2/AVX-512 ray packets
  */
 
-const char raytracing[] = {'p', 'h', 'b', 's', 'g', '\0'};
+const char raytracing[] = {'p', 'h', 'b', 's', 'g', 'v', '\0'};
 
 /**
  * Output data types
@@ -169,7 +199,7 @@ const char outputtype[] = {'x', 'f', 'e', 'j', 'l', 'p', '\0'};
  * ubj: output volume in unversal binary json format (not implemented)
  */
 
-const char* outputformat[] = {"ascii", "bin", "nii", "hdr", "mc2", "tx3", "jnii", "bnii", ""};
+const char* outputformat[] = {"ascii", "bin", "nii", "hdr", "mc2", "tx3", "jnii", "bnii", "zarr", ""};
 
 /**
  * Source type specifier
@@ -199,6 +229,12 @@ const char* zipformat[] = {"zlib", "gzip", "base64", "lzip", "lzma", "lz4", "lz4
 
 const char* computebackend[] = {"sse", "opencl", "cuda", ""};
 
+/**
+ * CPU random number generators selectable by --rng, in the order of TRNGType
+ */
+
+const char* rngtypename[] = {"xorshift128p", "philox", "posix", ""};
+
 /**
  * @brief Initializing the simulation configuration with default values
  *
@@ -231,10 +267,34 @@ void mcx_initcfg(mcconfig* cfg) {
     cfg->issave2pt = 1;
     cfg->isgpuinfo = 0;
     cfg->basisorder = 1;
+#ifdef USE_OPENCL
     cfg->compute = cbOpenCL;
+#else
+    cfg->compute = cbSSE;   /*builds without OpenCL, such as make web, only have the CPU engine*/
+#endif
 
     cfg->isdumpjson = 0;
+    cfg->isdumpmesh = 0;
+    cfg->iscachetracer = 0;
+    cfg->iscachekernel = 0;
+    cfg->isdynload = 0;
+    cfg->autotune = 0;
+    cfg->tunedthread = 0;
+    cfg->tunedcpu = NULL;
+    cfg->tunedshare = NULL;
+    cfg->hybrid = 0.f;
+    cfg->ispersistent = 0;
+    cfg->gpusort = 0;
+    cfg->gpufission = 0;
+    cfg->unifiedmem = 1;
+    cfg->ispackmesh = 0;
+    cfg->islocalmesh = 1;
+    cfg->ishalfface = 0;
+    cfg->patternbits = 32;
+    cfg->flushrespin = 1;
+    cfg->meshsession = 0;
     cfg->zipid = zmZlib;
+    cfg->isfloat16 = 0;
     memset(cfg->jsonfile, 0, MAX_PATH_LENGTH);
     cfg->shapedata = NULL;
 
@@ -274,9 +334,28 @@ void mcx_initcfg(mcconfig* cfg) {
     cfg->replaydet = 0;
     cfg->replayweight = NULL;
     cfg->replaytime = NULL;
+    cfg->replaydetid = NULL;
+    cfg->replaydetnum = 1;
+    cfg->wavenum = 1;
+    cfg->waveproplen = 0;
+    cfg->waveprop = NULL;
+    cfg->wavefile[0] = '\0';
+    cfg->emitfile[0] = '\0';
     cfg->isextdet = 0;
     cfg->srcdir.w = 0.f;
     cfg->isatomic = 1;
+    cfg->iswavefront = 0;
+    cfg->photonblock = -1;
+    cfg->isprivatebuf = 0;
+    cfg->iselemmoment = 0;
+    cfg->isnuma = 0;
+    cfg->isleanmem = 0;
+    cfg->issparsegate = 0;
+    cfg->nphase = 0;
+    cfg->tthg[0] = 0.f;
+    cfg->tthg[1] = 0.f;
+    cfg->invcdf = NULL;
+    cfg->reorder = 0;
     cfg->debugphoton = -1;
     cfg->savedetflag = 0x47;
     cfg->mediabyte = 1;
@@ -303,8 +382,18 @@ void mcx_initcfg(mcconfig* cfg) {
     memset(&(cfg->srcparam1), 0, sizeof(float4));
     memset(&(cfg->srcparam2), 0, sizeof(float4));
     cfg->srcpattern = NULL;
+    cfg->srclist = NULL;
+    cfg->srclistelem = NULL;
+    cfg->srclistbary = NULL;
+    cfg->srclistfile[0] = '\0';
+    cfg->elempropfile[0] = '\0';
+    cfg->outmask[0] = '\0';
     cfg->voidtime = 1;
     memset(cfg->checkpt, 0, sizeof(unsigned int)*MAX_CHECKPOINT);
+    cfg->ckptperiod = 0;
+    cfg->isresume = 0;
+    cfg->mpirank = 0;
+    cfg->mpisize = 1;
 
     memset(&(cfg->detparam1), 0, sizeof(float4));
     memset(&(cfg->detparam2), 0, sizeof(float4));
@@ -318,8 +407,70 @@ void mcx_initcfg(mcconfig* cfg) {
     memset(cfg->compileropt, 0, MAX_PATH_LENGTH);
     memset(cfg->kernelfile, 0, MAX_SESSION_LENGTH);
     cfg->maxdetphoton = 1000000;
+    cfg->streamdet = 0;
+    cfg->issaveprofile = 0;
+    cfg->isheatmap = 0;
+    cfg->exportheatmap = NULL;
+    memset(cfg->profile, 0, sizeof(cfg->profile));
+    cfg->threadprof = NULL;
+    cfg->profthread = 0;
+    cfg->devprof = NULL;
+    cfg->profdev = 0;
+    cfg->convtarget = 0.f;
+    cfg->convbatch = 0;
+    cfg->varbatch = 0;
+    cfg->rngtype = rngXorshift128p;
+    cfg->convroinum = 0;
+    cfg->convroi = NULL;
+    cfg->convphoton = 0;
+    cfg->convrse = 0.f;
+    cfg->progressfun = NULL;
+    cfg->progressdata = NULL;
+    cfg->cancelflag = NULL;
+    cfg->freqnum = 0;
+    cfg->freq = NULL;
+    cfg->pmcfile[0] = '\0';
+    cfg->pmcpropfile[0] = '\0';
+    cfg->pmcsetnum = 0;
+    cfg->pmcprop = NULL;
+    cfg->exportpmc = NULL;
+    cfg->dcsmodel = 0;
+    cfg->dcsdv = 0.f;
+    cfg->dcslambda = 0.f;
+    cfg->dcstaunum = 0;
+    cfg->dcstau = NULL;
+    cfg->exportdcs = NULL;
+    cfg->isdetstat = 0;
+    cfg->exportdetstat = NULL;
+    cfg->adjointnum = 0;
+    cfg->importnum = 0;
+    cfg->importance = NULL;
+    cfg->nextevent = 0.f;
+    cfg->exportnee = NULL;
+    cfg->exportcamsignals = NULL;
+    cfg->isreciprocal = 0;
+    cfg->diffnum = 0;
+    cfg->difflabel = NULL;
+    cfg->diffmin = 10.f;
+    cfg->inccache[0] = '\0';
+    cfg->servefile[0] = '\0';
+    cfg->isestimate = 0;
+    cfg->isdomain = 0;
+    cfg->ispipeline = 0;
+    cfg->isedgetable = 0;
+    cfg->shmname[0] = '\0';
+    cfg->resultcache[0] = '\0';
+    cfg->cachelimit = 1024.f;
+    cfg->cmdhash = 0;
+    cfg->phasefile[0] = '\0';
+    cfg->incpass = 0;
+    cfg->incbatchnum = 0;
+    cfg->incbatch = NULL;
+    cfg->incmask = NULL;
+    cfg->incbase = NULL;
     cfg->exportfield = NULL;
     cfg->exportdetected = NULL;
+    cfg->exportdetimage = NULL;
     cfg->exportseed = NULL;
     cfg->detectedcount = 0;
     cfg->energytot = NULL;
@@ -328,6 +479,7 @@ void mcx_initcfg(mcconfig* cfg) {
     cfg->autopilot = 1;
     cfg->gpuid = 0;
     cfg->maxjumpdebug = 10000000;
+    cfg->trajsample = 1;
     cfg->exportdebugdata = NULL;
     cfg->debugdatalen = 0;
     cfg->nodenum = 0;
@@ -368,6 +520,10 @@ void mcx_clearcfg(mcconfig* cfg) {
         free(cfg->prop);
     }
 
+    if (cfg->waveprop) {
+        free(cfg->waveprop);
+    }
+
     if (cfg->detnum) {
         free(cfg->detpos);
     }
@@ -380,6 +536,18 @@ void mcx_clearcfg(mcconfig* cfg) {
         free(cfg->srcpattern);
     }
 
+    if (cfg->srclist) {
+        free(cfg->srclist);
+    }
+
+    if (cfg->srclistelem) {
+        free(cfg->srclistelem);
+    }
+
+    if (cfg->srclistbary) {
+        free(cfg->srclistbary);
+    }
+
     if (cfg->detpattern) {
         free(cfg->detpattern);
     }
@@ -396,6 +564,10 @@ void mcx_clearcfg(mcconfig* cfg) {
         free(cfg->replaytime);
     }
 
+    if (cfg->replaydetid) {
+        free(cfg->replaydetid);
+    }
+
     if (cfg->exportseed) {
         free(cfg->exportseed);
     }
@@ -404,10 +576,94 @@ void mcx_clearcfg(mcconfig* cfg) {
         free(cfg->exportdetected);
     }
 
+    if (cfg->exportdetimage) {
+        free(cfg->exportdetimage);
+    }
+
     if (cfg->exportdebugdata) {
         free(cfg->exportdebugdata);
     }
 
+    if (cfg->threadprof) {
+        free(cfg->threadprof);
+    }
+
+    if (cfg->tunedcpu) {
+        free(cfg->tunedcpu);
+    }
+
+    if (cfg->tunedshare) {
+        free(cfg->tunedshare);
+    }
+
+    if (cfg->devprof) {
+        free(cfg->devprof);
+    }
+
+    if (cfg->exportheatmap) {
+        free(cfg->exportheatmap);
+    }
+
+    if (cfg->convroi) {
+        free(cfg->convroi);
+    }
+
+    if (cfg->freq) {
+        free(cfg->freq);
+    }
+
+    if (cfg->pmcprop) {
+        free(cfg->pmcprop);
+    }
+
+    if (cfg->invcdf) {
+        free(cfg->invcdf);
+    }
+
+    if (cfg->exportpmc) {
+        free(cfg->exportpmc);
+    }
+
+    if (cfg->dcstau) {
+        free(cfg->dcstau);
+    }
+
+    if (cfg->importance) {
+        free(cfg->importance);
+    }
+
+    if (cfg->difflabel) {
+        free(cfg->difflabel);
+    }
+
+    if (cfg->exportdcs) {
+        free(cfg->exportdcs);
+    }
+
+    if (cfg->exportdetstat) {
+        free(cfg->exportdetstat);
+    }
+
+    if (cfg->exportnee) {
+        free(cfg->exportnee);
+    }
+
+    if (cfg->exportcamsignals) {
+        free(cfg->exportcamsignals);
+    }
+
+    if (cfg->incbatch) {
+        free(cfg->incbatch);
+    }
+
+    if (cfg->incmask) {
+        free(cfg->incmask);
+    }
+
+    if (cfg->incbase) {
+        free(cfg->incbase);
+    }
+
     if (cfg->flog && cfg->flog != stdout && cfg->flog != stderr) {
         fclose(cfg->flog);
     }
@@ -577,10 +833,11 @@ void mcx_savenii(OutputType* dat, size_t len, char* name, int type32bit, int out
  * @param[in] name: output file name (will append '.nii')
  * @param[in] type32bit: type of the data, only support 32bit per record
  * @param[in] outputformatid: decide if save as nii or analyze format
+ * @param[in] slope: the saved values times slope give the output, stored as ScaleSlope
  * @param[in] cfg: simulation configuration
  */
 
-void mcx_savebnii(OutputType* vol, int ndim, uint* dims, float* voxelsize, char* name, int isfloat, int iscol, mcconfig* cfg) {
+void mcx_savebnii(OutputType* vol, int ndim, uint* dims, float* voxelsize, char* name, int isfloat, int iscol, double slope, mcconfig* cfg) {
     FILE* fp;
     char fname[MAX_FULL_PATH] = {'\0'};
     int affine[] = {0, 0, 1, 0, 0, 0};
@@ -588,6 +845,8 @@ void mcx_savebnii(OutputType* vol, int ndim, uint* dims, float* voxelsize, char*
 
     ubjw_context_t* root = NULL;
     uchar* jsonstr = NULL;
+    const char* dtype = cfg->isfloat16 ? "half" : (sizeof(OutputType) == 8 ? "double" : (isfloat ? "single" : "uint32"));
+    int dbytes = cfg->isfloat16 ? sizeof(unsigned short) : sizeof(OutputType);
 
     for (int i = 0; i < ndim; i++) {
         datalen *= dims[i];
@@ -636,8 +895,8 @@ void mcx_savebnii(OutputType* vol, int ndim, uint* dims, float* voxelsize, char*
     UBJ_WRITE_KEY(root, "Param2", uint8, 0);
     UBJ_WRITE_KEY(root, "Param3", uint8, 0);
     UBJ_WRITE_KEY(root, "Intent", uint8, 0);
-    UBJ_WRITE_KEY(root, "DataType", string, (sizeof(OutputType) == 8 ? "double" : (isfloat ? "single" : "uint32")));
-    UBJ_WRITE_KEY(root, "BitDepth", uint8, sizeof(OutputType) * 8);
+    UBJ_WRITE_KEY(root, "DataType", string, dtype);
+    UBJ_WRITE_KEY(root, "BitDepth", uint8, dbytes * 8);
     UBJ_WRITE_KEY(root, "FirstSliceID", uint8, 0);
     ubjw_write_key(root, "VoxelSize");
     UBJ_WRITE_ARRAY(root, single, ndim, voxelsize);
@@ -647,8 +906,8 @@ void mcx_savebnii(OutputType* vol, int ndim, uint* dims, float* voxelsize, char*
     UBJ_WRITE_KEY(root, "y", char, 'a');
     UBJ_WRITE_KEY(root, "z", char, 's');
     ubjw_end(root);
-    UBJ_WRITE_KEY(root, "ScaleSlope", uint8, 1);
-    UBJ_WRITE_KEY(root, "ScaleOffset", uint8, 1);
+    UBJ_WRITE_KEY(root, "ScaleSlope", double, slope);
+    UBJ_WRITE_KEY(root, "ScaleOffset", uint8, 0);
     UBJ_WRITE_KEY(root, "LastSliceID", uint32, cfg->maxgate);
     UBJ_WRITE_KEY(root, "SliceType", uint8, 1);
     ubjw_write_key(root, "Unit");
@@ -701,7 +960,7 @@ void mcx_savebnii(OutputType* vol, int ndim, uint* dims, float* voxelsize, char*
     /* the "NIFTIData" section stores volumetric data */
     ubjw_begin_object(root, UBJ_MIXED, 0);
 
-    if (mcx_jdataencode(vol, ndim, dims, (sizeof(OutputType) == 8 ? "double" : (isfloat ? "single" : "uint32")), sizeof(OutputType), cfg->zipid, root, 1, iscol, cfg)) {
+    if (mcx_jdataencode(vol, ndim, dims, (char*)dtype, dbytes, cfg->zipid, root, 1, iscol, cfg)) {
         MMC_ERROR(-1, "error when converting to JSON");
     }
 
@@ -740,10 +999,11 @@ void mcx_savebnii(OutputType* vol, int ndim, uint* dims, float* voxelsize, char*
  * @param[in] name: output file name (will append '.nii')
  * @param[in] type32bit: type of the data, only support 32bit per record
  * @param[in] outputformatid: decide if save as nii or analyze format
+ * @param[in] slope: the saved values times slope give the output, stored as ScaleSlope
  * @param[in] cfg: simulation configuration
  */
 
-void mcx_savejnii(OutputType* vol, int ndim, uint* dims, float* voxelsize, char* name, int isfloat, int iscol, mcconfig* cfg) {
+void mcx_savejnii(OutputType* vol, int ndim, uint* dims, float* voxelsize, char* name, int isfloat, int iscol, double slope, mcconfig* cfg) {
     FILE* fp;
     char fname[MAX_FULL_PATH] = {'\0'};
     int affine[] = {0, 0, 1, 0, 0, 0};
@@ -754,6 +1014,8 @@ void mcx_savejnii(OutputType* vol, int ndim, uint* dims, float* voxelsize, char*
 
     cJSON* root = NULL, *hdr = NULL, *dat = NULL, *sub = NULL, *info = NULL, *parser = NULL;
     char* jsonstr = NULL;
+    const char* dtype = cfg->isfloat16 ? "half" : (sizeof(OutputType) == 8 ? "double" : (isfloat ? "single" : "uint32"));
+    int dbytes = cfg->isfloat16 ? sizeof(unsigned short) : sizeof(OutputType);
     root = cJSON_CreateObject();
 
     /* the "_DataInfo_" section */
@@ -777,15 +1039,15 @@ void mcx_savejnii(OutputType* vol, int ndim, uint* dims, float* voxelsize, char*
     cJSON_AddNumberToObject(hdr, "Param2", 0);
     cJSON_AddNumberToObject(hdr, "Param3", 0);
     cJSON_AddNumberToObject(hdr, "Intent", 0);
-    cJSON_AddStringToObject(hdr, "DataType", (sizeof(OutputType) == 8 ? "double" : (isfloat ? "single" : "uint32")));
-    cJSON_AddNumberToObject(hdr, "BitDepth", sizeof(OutputType) * 8);
+    cJSON_AddStringToObject(hdr, "DataType", dtype);
+    cJSON_AddNumberToObject(hdr, "BitDepth", dbytes * 8);
     cJSON_AddNumberToObject(hdr, "FirstSliceID", 0);
     cJSON_AddItemToObject(hdr, "VoxelSize", cJSON_CreateFloatArray(voxelsize, ndim));
     cJSON_AddItemToObject(hdr, "Orientation", sub = cJSON_CreateObject());
     cJSON_AddStringToObject(sub, "x", "r");
     cJSON_AddStringToObject(sub, "y", "a");
     cJSON_AddStringToObject(sub, "z", "s");
-    cJSON_AddNumberToObject(hdr, "ScaleSlope", 1);
+    cJSON_AddNumberToObject(hdr, "ScaleSlope", slope);
     cJSON_AddNumberToObject(hdr, "ScaleOffset", 0);
     cJSON_AddNumberToObject(hdr, "LastSliceID", cfg->maxgate);
     cJSON_AddNumberToObject(hdr, "SliceType", 1);
@@ -828,7 +1090,7 @@ void mcx_savejnii(OutputType* vol, int ndim, uint* dims, float* voxelsize, char*
     /* the "NIFTIData" section stores volumetric data */
     cJSON_AddItemToObject(root, "NIFTIData",   dat = cJSON_CreateObject());
 
-    if (mcx_jdataencode(vol, ndim, dims, (sizeof(OutputType) == 8 ? "double" : (isfloat ? "single" : "uint32")), sizeof(OutputType), cfg->zipid, dat, 0, iscol, cfg)) {
+    if (mcx_jdataencode(vol, ndim, dims, (char*)dtype, dbytes, cfg->zipid, dat, 0, iscol, cfg)) {
         MMC_ERROR(-1, "error when converting to JSON");
     }
 
@@ -859,6 +1121,166 @@ void mcx_savejnii(OutputType* vol, int ndim, uint* dims, float* voxelsize, char*
     }
 }
 
+/**
+ * @brief Convert a single-precision float to an IEEE-754 half, rounding to the nearest even
+ *
+ * The normal, subnormal and overflow results are all computed and one is selected,
+ * so a loop over this function has no branches and can be vectorized. Values from
+ * 65520 up become infinity, those below 2^-25 become zero.
+ */
+
+unsigned short mcx_float2half(float f) {
+    union {
+        float f;
+        unsigned int i;
+    } v, sub;
+    unsigned int sign, x, inf, norm;
+
+    v.f = f;
+    sign = (v.i >> 16) & 0x8000u;
+    x = v.i & 0x7FFFFFFFu;
+    inf = (x > 0x7F800000u) ? 0x7E00u : 0x7C00u;
+
+    /*rebias the exponent by (15-127)<<23 and round the 13 dropped mantissa bits to even*/
+    norm = (x + 0xC8000FFFu + ((x >> 13) & 1u)) >> 13;
+
+    /*adding 0.5f aligns a subnormal half mantissa with the last bits of the float, the FPU rounds*/
+    sub.i = x;
+    sub.f += 0.5f;
+
+    return (unsigned short)(sign | ((x >= 0x47800000u) ? inf : ((x < 0x38800000u) ? sub.i - 0x3F000000u : norm)));
+}
+
+/**
+ * @brief Choose the power-of-two scale of the half-precision output, see --float16
+ *
+ * The fluence rate is often far above the half range (65504), the values are
+ * therefore divided by 2^k so that the largest one lands in [2^14, 2^15). A power
+ * of two keeps the division exact, and the ~40 bits of half dynamic range then
+ * cover everything above about 1e-12 of the peak.
+ *
+ * @param[in] dat: the output values
+ * @param[in] len: the number of values
+ * @return the scale, the saved halfs times the scale give the values
+ */
+
+double mcx_float16scale(const OutputType* dat, size_t len) {
+    double maxval = 0.0;
+    long long i;
+    int exponent;
+
+    #pragma omp parallel for schedule(static) reduction(max:maxval)
+
+    for (i = 0; i < (long long)len; i++) {
+        maxval = MAX(maxval, fabs(dat[i]));
+    }
+
+    if (maxval == 0.0 || !isfinite(maxval)) {
+        return 1.0;
+    }
+
+    frexp(maxval, &exponent);
+    return ldexp(1.0, exponent - 15);
+}
+
+/**
+ * @brief Convert an output buffer to IEEE-754 half precision, see --float16
+ *
+ * The conversion runs on all threads before the data are compressed and written.
+ *
+ * @param[in] dat: the output values
+ * @param[in] len: the number of values
+ * @param[in] scale: the values are divided by this power of two, see mcx_float16scale
+ * @return a buffer of len half-precision values, to be freed by the caller
+ */
+
+unsigned short* mcx_tofloat16(const OutputType* dat, size_t len, double scale) {
+    unsigned short* half = (unsigned short*)malloc(sizeof(unsigned short) * MAX(len, 1));
+    double invscale = 1.0 / scale;
+    long long i;
+
+    if (half == NULL) {
+        MMC_ERROR(-1, "can not allocate the half-precision output");
+    }
+
+    #pragma omp parallel for schedule(static)
+
+    for (i = 0; i < (long long)len; i++) {
+        half[i] = mcx_float2half((float)(dat[i] * invscale));
+    }
+
+    return half;
+}
+
+/**
+ * @brief Pack the weights of the pattern source uploaded to the GPU, see --patternbits
+ *
+ * The weights of all patterns at a launch position are contiguous, the row a
+ * photon copies at its launch. With 16 or 8 bits, the buffer starts with one
+ * float scale per pattern, padded to a multiple of 4, followed by the rows of
+ * halfs or unsigned bytes; a weight is the scale of its pattern times the stored
+ * value. The scale is the largest weight of the pattern, divided by 255 for 8 bits.
+ *
+ * @param[in] cfg: the simulation configuration
+ * @param[out] bytes: the length of the returned buffer in bytes
+ * @return the packed buffer to be freed by the caller, cfg->srcpattern itself for 32 bits
+ */
+
+void* mcx_packpattern(mcconfig* cfg, size_t* bytes) {
+    size_t len = (cfg->srctype == MCX_SRC_PATTERN3D) ? (size_t)(cfg->srcparam1.x * cfg->srcparam1.y * cfg->srcparam1.z) : (size_t)(cfg->srcparam1.w * cfg->srcparam2.w);
+    size_t srcnum = cfg->srcnum, scalelen = (srcnum + 3) & ~(size_t)3, i, j;
+    float* scale;
+    unsigned char* packed;
+    int isneg = 0;
+
+    if (cfg->patternbits == 32) {
+        *bytes = sizeof(float) * len * srcnum;
+        return cfg->srcpattern;
+    }
+
+    *bytes = sizeof(float) * scalelen + (size_t)(cfg->patternbits >> 3) * len * srcnum;
+    packed = (unsigned char*)calloc(*bytes, 1);
+
+    if (packed == NULL) {
+        MMC_ERROR(-1, "can not allocate the packed source pattern");
+    }
+
+    scale = (float*)packed;
+
+    for (i = 0; i < len; i++)
+        for (j = 0; j < srcnum; j++) {
+            scale[j] = MAX(scale[j], fabsf(cfg->srcpattern[i * srcnum + j]));
+            isneg |= (cfg->srcpattern[i * srcnum + j] < 0.f);
+        }
+
+    if (isneg && cfg->patternbits == 8) {
+        free(packed);
+        MMC_ERROR(-2, "the 8-bit pattern (--patternbits 8) can not store negative weights, use 16");
+    }
+
+    for (j = 0; j < srcnum; j++) {
+        scale[j] = (scale[j] > 0.f) ? scale[j] / ((cfg->patternbits == 8) ? 255.f : 1.f) : 1.f;
+    }
+
+    if (cfg->patternbits == 16) {
+        unsigned short* half = (unsigned short*)(scale + scalelen);
+
+        for (i = 0; i < len; i++)
+            for (j = 0; j < srcnum; j++) {
+                half[i * srcnum + j] = mcx_float2half(cfg->srcpattern[i * srcnum + j] / scale[j]);
+            }
+    } else {
+        unsigned char* q = (unsigned char*)(scale + scalelen);
+
+        for (i = 0; i < len; i++)
+            for (j = 0; j < srcnum; j++) {
+                q[i * srcnum + j] = (unsigned char)MIN(255.f, cfg->srcpattern[i * srcnum + j] / scale[j] + 0.5f);
+            }
+    }
+
+    return packed;
+}
+
 /**
  * @brief Save volumetric output (fluence etc) to mc2 format binary file
  *
@@ -888,32 +1310,48 @@ void mcx_savedata(OutputType* dat, size_t len, mcconfig* cfg, int isref) {
     if (!isref && (cfg->outputformat == ofNifti || cfg->outputformat == ofAnalyze)) {
         mcx_savenii(dat, len, name, NIFTI_TYPE_FLOAT64, cfg->outputformat, cfg);
         return;
-    } else if (cfg->outputformat == ofJNifti || cfg->outputformat == ofBJNifti) {
+    }
+
+    if (cfg->outputformat == ofJNifti || cfg->outputformat == ofBJNifti) {
         uint dims[6] = {cfg->dim.x, cfg->dim.y, cfg->dim.z, cfg->maxgate, cfg->srcnum, 1}, lastdim = 5;
         float voxelsize[6] = {cfg->steps.x, cfg->steps.y, cfg->steps.z, cfg->tstep, 1, 1};
+        unsigned short* half = NULL;
+        double slope = 1.0;
 
         if (cfg->method != rtBLBadouelGrid) {
-            dims[0] = cfg->nodenum;
-            dims[1] = cfg->maxgate;
+            /*the mesh output is a row-major [frame, node/elem/face, source] array, mesh_saveweight passes the middle length in dim.z*/
+            dims[0] = (uint)(len / ((size_t)cfg->dim.z * cfg->srcnum));
+            dims[1] = cfg->dim.z;
             dims[2] = cfg->srcnum;
             dims[3] = 1;
-            lastdim = 3;
-            voxelsize[0] = 1.f;
-            voxelsize[1] = cfg->tstep;
+            lastdim = 2;
+            voxelsize[0] = cfg->tstep;
+            voxelsize[1] = 1.f;
             voxelsize[2] = 1.f;
-            voxelsize[3] = 1.f;
+        } else {
+            if (cfg->replaydetnum * cfg->wavenum > 1) {
+                dims[lastdim] *= cfg->replaydetnum * cfg->wavenum;
+            }
+
+            /*the real and imaginary frames of each modulation frequency follow the time gates*/
+            if (!isref) {
+                dims[3] += 2 * cfg->freqnum;
+            }
         }
 
-        if (cfg->seed == SEED_FROM_FILE && (cfg->replaydet == -1 && cfg->detnum > 1)) {
-            dims[lastdim] *= cfg->detnum;
+        /*the jnii/bnii writers read the halfs through the same pointer, the scale is saved as ScaleSlope*/
+        if (cfg->isfloat16) {
+            slope = mcx_float16scale(dat, len);
+            half = mcx_tofloat16(dat, len, slope);
         }
 
         if (cfg->outputformat == ofJNifti) {
-            mcx_savejnii(dat, lastdim + (dims[lastdim] > 1), dims, voxelsize, name, 1, (cfg->method == rtBLBadouelGrid), cfg);
+            mcx_savejnii((half ? (OutputType*)half : dat), lastdim + (dims[lastdim] > 1), dims, voxelsize, name, 1, (cfg->method == rtBLBadouelGrid), slope, cfg);
         } else {
-            mcx_savebnii(dat, lastdim + (dims[lastdim] > 1), dims, voxelsize, name, 1, (cfg->method == rtBLBadouelGrid), cfg);
+            mcx_savebnii((half ? (OutputType*)half : dat), lastdim + (dims[lastdim] > 1), dims, voxelsize, name, 1, (cfg->method == rtBLBadouelGrid), slope, cfg);
         }
 
+        free(half);
         return;
     }
 
@@ -964,6 +1402,11 @@ void mcx_savejdet(float* ppath, void* seeds, uint count, int doappend, mcconfig*
     cJSON_AddNumberToObject(hdr, "SavedPhoton", cfg->his.savedphoton);
     cJSON_AddNumberToObject(hdr, "LengthUnit", cfg->his.unitinmm);
     cJSON_AddNumberToObject(hdr, "SeedByte", cfg->his.seedbyte);
+
+    if (cfg->his.seedrng > 0) {
+        cJSON_AddStringToObject(hdr, "SeedRNG", rngtypename[cfg->his.seedrng - 1]);
+    }
+
     cJSON_AddNumberToObject(hdr, "Normalizer", cfg->his.normalizer);
     cJSON_AddNumberToObject(hdr, "Repeat", cfg->his.respin);
     cJSON_AddNumberToObject(hdr, "SrcNum", cfg->his.srcnum);
@@ -987,6 +1430,7 @@ void mcx_savejdet(float* ppath, void* seeds, uint count, int doappend, mcconfig*
         for (id = 0; id < sizeof(colnum); id++) {
             uint dims[2] = {count, colnum[id]};
             float* buf = (float*)calloc(dims[0] * dims[1], sizeof(float));
+            int ishalf = (cfg->isfloat16 && !strcmp(dtype[id], "single"));
 
             for (i = 0; i < dims[0]; i++)
                 for (j = 0; j < dims[1]; j++) {
@@ -995,7 +1439,13 @@ void mcx_savejdet(float* ppath, void* seeds, uint count, int doappend, mcconfig*
 
             cJSON_AddItemToObject(dat, dname[id], sub = cJSON_CreateObject());
 
-            if (mcx_jdataencode(buf, 2, dims, dtype[id], 4, cfg->zipid, sub, 0, 1, cfg)) {
+            if (ishalf) {
+                for (i = 0; i < dims[0] * dims[1]; i++) {
+                    ((unsigned short*)buf)[i] = mcx_float2half(buf[i]);
+                }
+            }
+
+            if (mcx_jdataencode(buf, 2, dims, (ishalf ? "half" : dtype[id]), (ishalf ? 2 : 4), cfg->zipid, sub, 0, 1, cfg)) {
                 MMC_ERROR(-1, "error when converting to JSON");
             }
 
@@ -1003,26 +1453,60 @@ void mcx_savejdet(float* ppath, void* seeds, uint count, int doappend, mcconfig*
             col += dims[1];
         }
     } else {
-        char colnum[] = {1, cfg->his.maxmedia, cfg->his.maxmedia, cfg->his.maxmedia, 3, 3, 1};
+        int colnum[] = {1, cfg->his.maxmedia, cfg->his.maxmedia, cfg->his.maxmedia, 3, 3, 1};
         char* dtype[] = {"uint32", "uint32", "single", "single", "single", "single", "single"};
         char* dname[] = {"detid", "nscat", "ppath", "mom", "p", "v", "w0"};
+        int colstart[sizeof(colnum) / sizeof(colnum[0])];
+        cJSON* subs[sizeof(colnum) / sizeof(colnum[0])] = {NULL};
+        int fieldnum = sizeof(colnum) / sizeof(colnum[0]), failed = 0;
 
         cJSON_AddItemToObject(obj, "PhotonData", dat = cJSON_CreateObject());
 
-        for (id = 0; id < sizeof(colnum); id++) {
-            if ((cfg->savedetflag >> id) & 0x1) {
-                uint dims[2] = {count, colnum[id]};
+        for (id = 0; id < fieldnum; id++) {
+            colstart[id] = col;
+            col += ((cfg->his.savedetflag >> id) & 0x1) ? colnum[id] : 0;
+        }
+
+        if (!cfg->isdumpjson) {
+            MMC_FPRINTF(cfg->flog, "compressing detected photon data [%s] ...", zipformat[cfg->zipid]);
+        }
+
+        /*the fields are copied and compressed independently, one thread per field; only the attachment is ordered*/
+        #pragma omp parallel for schedule(dynamic) private(i, j) reduction(|:failed)
+
+        for (id = 0; id < fieldnum; id++) {
+            if ((cfg->his.savedetflag >> id) & 0x1) {
+                uint dims[2] = {count, (uint)colnum[id]};
                 void* val = NULL;
                 float* fbuf = NULL;
                 uint*  ibuf = NULL;
+                char* type = dtype[id];
+                int bytes = 4;
 
                 if (!strcmp(dtype[id], "uint32")) {
+                    uint maxval = 0;
+
                     ibuf = (uint*)calloc(dims[0] * dims[1], sizeof(uint));
 
                     for (i = 0; i < dims[0]; i++)
                         for (j = 0; j < dims[1]; j++) {
-                            ibuf[i * dims[1] + j] = ppath[i * cfg->his.colcount + col + j];
+                            ibuf[i * dims[1] + j] = ppath[i * cfg->his.colcount + colstart[id] + j];
+                            maxval = MAX(maxval, ibuf[i * dims[1] + j]);
+                        }
+
+                    /*detector IDs and scattering counts are small, store them in the narrowest unsigned type, in place*/
+                    if (maxval <= 0xFFFF) {
+                        bytes = (maxval <= 0xFF) ? 1 : 2;
+                        type = (bytes == 1) ? "uint8" : "uint16";
+
+                        for (i = 0; i < dims[0] * dims[1]; i++) {
+                            if (bytes == 1) {
+                                ((unsigned char*)ibuf)[i] = (unsigned char)ibuf[i];
+                            } else {
+                                ((unsigned short*)ibuf)[i] = (unsigned short)ibuf[i];
+                            }
                         }
+                    }
 
                     val = (void*)ibuf;
                 } else {
@@ -1030,20 +1514,35 @@ void mcx_savejdet(float* ppath, void* seeds, uint count, int doappend, mcconfig*
 
                     for (i = 0; i < dims[0]; i++)
                         for (j = 0; j < dims[1]; j++) {
-                            fbuf[i * dims[1] + j] = ppath[i * cfg->his.colcount + col + j];
+                            fbuf[i * dims[1] + j] = ppath[i * cfg->his.colcount + colstart[id] + j];
                         }
 
-                    val = (void*)fbuf;
-                }
+                    /*--float16 stores the float fields as halfs, also in place*/
+                    if (cfg->isfloat16) {
+                        for (i = 0; i < dims[0] * dims[1]; i++) {
+                            ((unsigned short*)fbuf)[i] = mcx_float2half(fbuf[i]);
+                        }
 
-                cJSON_AddItemToObject(dat, dname[id], sub = cJSON_CreateObject());
+                        type = "half";
+                        bytes = 2;
+                    }
 
-                if (mcx_jdataencode(val, 2, dims, dtype[id], 4, cfg->zipid, sub, 0, 1, cfg)) {
-                    MMC_ERROR(-1, "error when converting to JSON");
+                    val = (void*)fbuf;
                 }
 
+                subs[id] = cJSON_CreateObject();
+                failed |= mcx_jdataencode(val, 2, dims, type, bytes, cfg->zipid, subs[id], 0, 1, cfg);
                 free(val);
-                col += dims[1];
+            }
+        }
+
+        if (failed) {
+            MMC_ERROR(-1, "error when converting to JSON");
+        }
+
+        for (id = 0; id < fieldnum; id++) {
+            if (subs[id]) {
+                cJSON_AddItemToObject(dat, dname[id], subs[id]);
             }
         }
     }
@@ -1057,8 +1556,10 @@ void mcx_savejdet(float* ppath, void* seeds, uint count, int doappend, mcconfig*
         }
     }
 
-    /* now save JSON to file */
+    /* now save JSON to file, the document is released first to keep only one copy of the encoded data */
     jsonstr = cJSON_Print(root);
+    cJSON_Delete(root);
+    root = NULL;
 
     if (jsonstr == NULL) {
         MMC_ERROR(-1, "error when converting to JSON");
@@ -1094,1888 +1595,4320 @@ void mcx_savejdet(float* ppath, void* seeds, uint count, int doappend, mcconfig*
     }
 }
 
-#endif
-
 /**
- * @brief Print a message to the console or a log file
+ * @brief Save the profile of the last run to <session>_profile.json
  *
  * @param[in] cfg: simulation configuration
- * @param[in] str: a string to be printed
  */
 
-void mcx_printlog(mcconfig* cfg, char* str) {
-    if (cfg->flog > 0) { /*stdout is 1*/
-        MMC_FPRINTF(cfg->flog, "%s\n", str);
+void mcx_saveprofile(mcconfig* cfg) {
+    FILE* fp;
+    char fname[MAX_FULL_PATH];
+    char* jsonstr = mcx_profilejson(cfg);
+
+    if (cfg->rootpath[0]) {
+        sprintf(fname, "%s%c%s_profile.json", cfg->rootpath, pathsep, cfg->session);
+    } else {
+        sprintf(fname, "%s_profile.json", cfg->session);
+    }
+
+    fp = fopen(fname, "wt");
+
+    if (fp == NULL) {
+        free(jsonstr);
+        MMC_ERROR(-2, "can not save data to disk");
     }
+
+    fprintf(fp, "%s\n", jsonstr);
+    fclose(fp);
+    free(jsonstr);
 }
 
+#endif
+
 /**
- * @brief Normalize the solution by multiplying a scaling factor
+ * @brief Convert the per-phase timing and per-thread counters of the last run to a JSON string
  *
- * @param[in,out] field: volumetric data before normalization
- * @param[in] scale: the scaling factor (or normalization factor) to be applied
- * @param[in] fieldlen: the length (floating point) of elements in the volume
+ * The returned string has the form {"MMCProfile":{"Phase":{...},"Thread":[...],"Device":[...],"Total":{...}}},
+ * all times are in nanoseconds. A phase that is not timed by the backend is 0. The "Device"
+ * array lists the kernel time, read-back time and kernel attributes of each GPU of a GPU run.
+ *
+ * @param[in] cfg: simulation configuration
+ * @return a JSON string that must be freed by the caller
  */
 
-void mcx_normalize(float field[], float scale, int fieldlen) {
+char* mcx_profilejson(mcconfig* cfg) {
+    const char* phasename[] = {"load", "prep", "tracer_build", "simulation", "reduction", "normalization", "save"};
+    cJSON* root, *obj, *sub, *item;
+    threadprofile total = {0};
+    char* jsonstr;
     int i;
 
-    for (i = 0; i < fieldlen; i++) {
-        field[i] *= scale;
+    root = cJSON_CreateObject();
+    cJSON_AddItemToObject(root, "MMCProfile", obj = cJSON_CreateObject());
+    cJSON_AddStringToObject(obj, "Session", cfg->session);
+    cJSON_AddStringToObject(obj, "Version", MMC_VERSION);
+    cJSON_AddNumberToObject(obj, "Photon", (cfg->convphoton) ? cfg->convphoton : cfg->nphoton);
+    cJSON_AddNumberToObject(obj, "Compute", cfg->compute);
+    cJSON_AddStringToObject(obj, "RNG", rngtypename[cfg->rngtype]);
+    cJSON_AddNumberToObject(obj, "Method", cfg->method);
+    cJSON_AddItemToObject(obj, "Phase", sub = cJSON_CreateObject());
+
+    for (i = 0; i < ppPhaseNum; i++) {
+        cJSON_AddNumberToObject(sub, phasename[i], (double)cfg->profile[i]);
+    }
+
+    cJSON_AddItemToObject(obj, "Thread", sub = cJSON_CreateArray());
+
+    for (i = 0; i < cfg->profthread; i++) {
+        threadprofile* tp = cfg->threadprof + i;
+
+        cJSON_AddItemToArray(sub, item = cJSON_CreateObject());
+        cJSON_AddNumberToObject(item, "photon", (double)tp->nphoton);
+        cJSON_AddNumberToObject(item, "raytet", tp->raytet);
+        cJSON_AddNumberToObject(item, "raytet0", tp->raytet0);
+        cJSON_AddNumberToObject(item, "reflect", (double)tp->nreflect);
+        cJSON_AddNumberToObject(item, "roihit", (double)tp->nroihit);
+        cJSON_AddNumberToObject(item, "detected", (double)tp->ndetected);
+
+        total.nphoton += tp->nphoton;
+        total.raytet += tp->raytet;
+        total.raytet0 += tp->raytet0;
+        total.nreflect += tp->nreflect;
+        total.nroihit += tp->nroihit;
+        total.ndetected += tp->ndetected;
+    }
+
+    if (cfg->profdev > 0) {
+        cJSON_AddItemToObject(obj, "Device", sub = cJSON_CreateArray());
+
+        for (i = 0; i < cfg->profdev; i++) {
+            deviceprofile* dp = cfg->devprof + i;
+
+            cJSON_AddItemToArray(sub, item = cJSON_CreateObject());
+            cJSON_AddStringToObject(item, "name", dp->name);
+            cJSON_AddNumberToObject(item, "id", dp->id);
+            cJSON_AddNumberToObject(item, "block", dp->block);
+            cJSON_AddNumberToObject(item, "thread", dp->thread);
+            cJSON_AddNumberToObject(item, "launch", dp->nlaunch);
+            cJSON_AddNumberToObject(item, "kernel", (double)dp->kernel);
+            cJSON_AddNumberToObject(item, "copy", (double)dp->copy);
+            cJSON_AddNumberToObject(item, "registers", dp->registers);
+            cJSON_AddNumberToObject(item, "private_bytes", (double)dp->privatemem);
+            cJSON_AddNumberToObject(item, "shared_bytes", (double)dp->sharedmem);
+            cJSON_AddNumberToObject(item, "occupancy", dp->occupancy);
+        }
+    }
+
+    cJSON_AddItemToObject(obj, "Total", item = cJSON_CreateObject());
+    cJSON_AddNumberToObject(item, "photon", (double)total.nphoton);
+    cJSON_AddNumberToObject(item, "raytet", total.raytet);
+    cJSON_AddNumberToObject(item, "raytet0", total.raytet0);
+    cJSON_AddNumberToObject(item, "reflect", (double)total.nreflect);
+    cJSON_AddNumberToObject(item, "roihit", (double)total.nroihit);
+    cJSON_AddNumberToObject(item, "detected", (double)total.ndetected);
+
+    jsonstr = cJSON_Print(root);
+    cJSON_Delete(root);
+
+    if (jsonstr == NULL) {
+        MMC_ERROR(-1, "error when converting to JSON");
     }
+
+    return jsonstr;
 }
 
 /**
- * @brief Error reporting function
+ * @brief Allocate the batch statistics of the convergence-driven mode
  *
- * @param[in] id: a single integer for the types of the error
- * @param[in] msg: the error message string
- * @param[in] file: the unit file name where this error is raised
- * @param[in] linenum: the line number in the file where this error is raised
+ * @param[out] cs: the batch statistics
+ * @param[in] nquantity: the number of monitored quantities
  */
 
-void mcx_error(const int id, const char* msg, const char* file, const int linenum) {
-    #pragma omp critical
-    {
-#ifdef MCX_CONTAINER
-        mmc_throw_exception(id, msg, file, linenum);
-#else
-
-        if (id == MMC_INFO) {
-            MMC_FPRINTF(stdout, "%s\n", msg);
-        } else {
-            MMC_FPRINTF(stdout, S_RED"\nMMC ERROR(%d):%s in unit %s:%d\n"S_RESET, id, msg, file, linenum);
-        }
+void mcx_convinit(convstate* cs, int nquantity) {
+    memset(cs, 0, sizeof(convstate));
+    cs->nquantity = nquantity;
 
-        exit(id);
-#endif
+    if (nquantity > 0) {
+        cs->last = (double*)calloc(nquantity * 3, sizeof(double));
+        cs->sum = cs->last + nquantity;
+        cs->sum2 = cs->sum + nquantity;
     }
 }
 
 /**
- * @brief Function to test return value and raise an error
+ * @brief Add the result of one batch to the statistics
  *
- * @param[in] ret: function return value, non-zero means an error
- * @param[in] file: the unit file name where this error is raised
- * @param[in] linenum: the line number in the file where this error is raised
+ * @param[in,out] cs: the batch statistics
+ * @param[in] total: the accumulated value of each quantity from the start of the run
+ * @param[in] photon: the number of photons simulated from the start of the run
  */
 
-void mcx_assert(const int ret, const char* file, const int linenum) {
-    if (!ret) {
-        mcx_error(ret, "input error", file, linenum);
+void mcx_convaddbatch(convstate* cs, const double* total, double photon) {
+    int i;
+    double nbatch = photon - cs->photon, mean;
+
+    if (nbatch <= 0.0) {
+        return;
     }
-}
 
-#ifndef MCX_CONTAINER
+    for (i = 0; i < cs->nquantity; i++) {
+        mean = (total[i] - cs->last[i]) / nbatch;
+        cs->sum[i] += mean;
+        cs->sum2[i] += mean * mean;
+        cs->last[i] = total[i];
+    }
+
+    cs->photon = photon;
+    cs->nbatch++;
+}
 
 /**
- * @brief Read simulation settings from a configuration file (.inp or .json)
+ * @brief Compute the largest relative standard error of the monitored quantities
  *
- * @param[in] fname: the name of the input file (.inp or .json)
- * @param[in] cfg: simulation configuration
+ * The standard error of the mean of the per-photon batch means, divided by the
+ * mean, estimates the relative error of the accumulated quantity. A quantity that
+ * has not been hit by any photon is not converged.
+ *
+ * @param[in] cs: the batch statistics
+ * @return the largest relative standard error, or FLT_MAX before MIN_CONV_BATCH batches
  */
 
-void mcx_readconfig(char* fname, mcconfig* cfg) {
-    if (fname[0] == 0) {
-        mcx_loadconfig(stdin, cfg);
+float mcx_convrse(convstate* cs) {
+    int i;
+    double mean, var, rse, maxrse = 0.0;
 
-        if (cfg->session[0] == '\0') {
-            strcpy(cfg->session, "default");
-        }
-    } else {
-        FILE* fp = fopen(fname, "rt");
+    if (cs->nbatch < MIN_CONV_BATCH || cs->nquantity == 0) {
+        return FLT_MAX;
+    }
 
-        if (fp == NULL) {
-            MMC_ERROR(-2, "can not load the specified config file");
+    for (i = 0; i < cs->nquantity; i++) {
+        mean = cs->sum[i] / cs->nbatch;
+
+        if (mean == 0.0) {
+            return FLT_MAX;
         }
 
-        if (strstr(fname, ".json") != NULL) {
-            char* jbuf;
-            int len;
+        var = (cs->sum2[i] - cs->nbatch * mean * mean) / (cs->nbatch - 1);
+        rse = sqrt(MAX(var, 0.0) / cs->nbatch) / fabs(mean);
+        maxrse = MAX(maxrse, rse);
+    }
 
-            fclose(fp);
-            fp = fopen(fname, "rb");
-            fseek (fp, 0, SEEK_END);
-            len = ftell(fp) + 1;
-            jbuf = (char*)malloc(len);
-            rewind(fp);
+    return (float)maxrse;
+}
 
-            if (fread(jbuf, len - 1, 1, fp) != 1) {
-                MMC_ERROR(-2, "reading input file is terminated");
-            }
+/**
+ * @brief Release the batch statistics
+ *
+ * @param[in,out] cs: the batch statistics
+ */
 
-            jbuf[len - 1] = '\0';
+void mcx_convclear(convstate* cs) {
+    if (cs->last) {
+        free(cs->last);
+    }
 
-            if (mcx_loadfromjson(jbuf, cfg)) {
-                fclose(fp);
-                free(jbuf);
-                MMC_ERROR(-9, "invalid JSON input file");
-            }
+    memset(cs, 0, sizeof(convstate));
+}
 
-            free(jbuf);
+/**
+ * @brief Print a message to the console or a log file
+ *
+ * @param[in] cfg: simulation configuration
+ * @param[in] str: a string to be printed
+ */
+
+void mcx_printlog(mcconfig* cfg, char* str) {
+    if (cfg->flog > 0) { /*stdout is 1*/
+        MMC_FPRINTF(cfg->flog, "%s\n", str);
+    }
+}
+
+/**
+ * @brief Normalize the solution by multiplying a scaling factor
+ *
+ * @param[in,out] field: volumetric data before normalization
+ * @param[in] scale: the scaling factor (or normalization factor) to be applied
+ * @param[in] fieldlen: the length (floating point) of elements in the volume
+ */
+
+void mcx_normalize(float field[], float scale, int fieldlen) {
+    int i;
+
+    for (i = 0; i < fieldlen; i++) {
+        field[i] *= scale;
+    }
+}
+
+/**
+ * @brief Error reporting function
+ *
+ * @param[in] id: a single integer for the types of the error
+ * @param[in] msg: the error message string
+ * @param[in] file: the unit file name where this error is raised
+ * @param[in] linenum: the line number in the file where this error is raised
+ */
+
+void mcx_error(const int id, const char* msg, const char* file, const int linenum) {
+    #pragma omp critical
+    {
+#ifdef MCX_CONTAINER
+        mmc_throw_exception(id, msg, file, linenum);
+#else
+
+        if (id == MMC_INFO) {
+            MMC_FPRINTF(stdout, "%s\n", msg);
         } else {
-            mcx_loadconfig(fp, cfg);
+            MMC_FPRINTF(stdout, S_RED"\nMMC ERROR(%d):%s in unit %s:%d\n"S_RESET, id, msg, file, linenum);
         }
 
-        fclose(fp);
+        exit(id);
+#endif
+    }
+}
 
-        if (cfg->session[0] == '\0') {
-            strncpy(cfg->session, fname, MAX_SESSION_LENGTH - 1);
-        }
+/**
+ * @brief Function to test return value and raise an error
+ *
+ * @param[in] ret: function return value, non-zero means an error
+ * @param[in] file: the unit file name where this error is raised
+ * @param[in] linenum: the line number in the file where this error is raised
+ */
+
+void mcx_assert(const int ret, const char* file, const int linenum) {
+    if (!ret) {
+        mcx_error(ret, "input error", file, linenum);
     }
 }
 
+#ifndef MCX_CONTAINER
+
 /**
- * @brief Load a .json input file into memory
+ * @brief Parse one number of an inline JSON mesh array
  *
- * This function loads a JSON file using cJSON
+ * Integers are converted the same way as cJSON's valueint, floating-point
+ * values are read as double then rounded, as done by cJSON.
  *
- * @param[out] jbuf: json data structure pointer
- * @param[in] cfg: simulation configuration
+ * @return the pointer after the number, NULL if no number is found
  */
 
-int mcx_loadfromjson(char* jbuf, mcconfig* cfg) {
-    cJSON* jroot;
-    jroot = cJSON_Parse(jbuf);
+static const char* mcx_jsonnumber(const char* p, float* fval, int* ival) {
+    char* pe;
+    double val;
 
-    if (jroot) {
-        mcx_loadjson(jroot, cfg);
-        cJSON_Delete(jroot);
-    } else {
-        char* ptrold, *ptr = (char*)cJSON_GetErrorPtr();
+    while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n') {
+        p++;
+    }
 
-        if (ptr) {
-            ptrold = strstr(jbuf, ptr);
+    if (ival) {
+        const char* s = p + (*p == '-');
+        int n = 0, digit = 0;
+
+        while (digit < 9 && *s >= '0' && *s <= '9') {
+            n = n * 10 + (*s++ - '0');
+            digit++;
         }
 
-        if (ptr && ptrold) {
-            char* offs = (ptrold - jbuf >= 50) ? ptrold - 50 : jbuf;
+        if (digit && (*s == ',' || *s == ']' || *s == ' ' || *s == '\t' || *s == '\r' || *s == '\n')) {
+            *ival = (*p == '-') ? -n : n;
+            return s;
+        }
+    }
 
-            while (offs < ptrold) {
-                MMC_FPRINTF(stderr, "%c", *offs);
-                offs++;
-            }
+    val = strtod(p, &pe);
 
-            MMC_FPRINTF(stderr, S_RED"<error>%.50s\n"S_RESET, ptrold);
-        }
+    if (pe == p) {
+        return NULL;
+    }
 
-        return 1;
+    if (fval) {
+        *fval = (float)val;
+    } else {
+        *ival = (val >= INT_MAX) ? INT_MAX : ((val <= (double)INT_MIN) ? INT_MIN : (int)val);
     }
 
-    return 0;
+    return pe;
 }
 
 /**
- * @brief Load user inputs from a .json input file
+ * @brief Parse nrow rows of ncol numbers, each row in a pair of brackets
  *
- * This function loads user input from a JSON format in a .json extension
- *
- * @param[out] root: json data structure pointer
- * @param[in] cfg: simulation configuration
+ * @return the number of complete rows
  */
 
-int mcx_loadjson(cJSON* root, mcconfig* cfg) {
-    int i;
-    cJSON* Mesh, *Optode, *Forward, *Session, *Domain, *Camera, *tmp, *subitem;
+static int mcx_jsonrows(const char* p, const char* end, int nrow, int ncol, float* fval, int* ival) {
+    int i, j;
 
-    Mesh    = cJSON_GetObjectItem(root, "Mesh");
+    for (i = 0; i < nrow; i++) {
+        while (p < end && (*p == ',' || *p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')) {
+            p++;
+        }
 
-    if (!Mesh) {
-        Mesh    = cJSON_GetObjectItem(root, "Shapes");
-    }
+        if (p >= end || *p++ != '[') {
+            return i;
+        }
 
-    Optode  = cJSON_GetObjectItem(root, "Optode");
-    Session = cJSON_GetObjectItem(root, "Session");
-    Forward = cJSON_GetObjectItem(root, "Forward");
-    Domain  = cJSON_GetObjectItem(root, "Domain");
-    Camera  = cJSON_GetObjectItem(root, "Camera");
+        for (j = 0; j < ncol; j++) {
+            p = mcx_jsonnumber(p, (fval) ? fval + (size_t)i * ncol + j : NULL, (ival) ? ival + (size_t)i * ncol + j : NULL);
 
-    if (Camera)
-    {
-        cfg->cam_obj_dist = FIND_JSON_KEY("ObjectDistance", "Camera.ObjectDistance", Camera, cfg->cam_obj_dist, valuedouble);
-        cfg->cam_focal_length = FIND_JSON_KEY("FocalLength", "Camera.FocalLength", Camera, cfg->cam_focal_length, valuedouble);
-        cfg->cam_proj_dist = FIND_JSON_KEY("ProjectionDistance", "Camera.ProjectionDistance", Camera, cfg->cam_proj_dist, valuedouble);
-        cfg->cam_aperture_radius = FIND_JSON_KEY("ApertureRadius", "Camera.ApertureRadius", Camera, cfg->cam_aperture_radius, valuedouble);
-        cfg->cam_image_height = FIND_JSON_KEY("Height", "Camera.Height", Camera, cfg->cam_image_height, valueint);
-        cfg->cam_image_width = FIND_JSON_KEY("Width", "Camera.Width", Camera, cfg->cam_image_width, valueint);
-        cfg->cam_pixel_pitch = FIND_JSON_KEY("PixelPitch", "Camera.PixelPitch", Camera, cfg->cam_pixel_pitch, valueint);
+            if (p == NULL) {
+                return i;
+            }
 
-        if (cfg->cam_obj_dist <= 0 || cfg->cam_focal_length <= 0 || cfg->cam_proj_dist <= 0 || cfg->cam_aperture_radius <= 0 || cfg->cam_image_height <= 0 || cfg->cam_image_width <= 0 || cfg->cam_pixel_pitch <= 0) {
-                MMC_ERROR(-1, "Missing or invalid camera parameters!");
+            while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n') {
+                p++;
             }
 
+            if (*p++ != ((j < ncol - 1) ? ',' : ']')) {
+                return i;
+            }
+        }
     }
 
-    if (Mesh) {
-        subitem = FIND_JSON_OBJ("MeshID", "Mesh.MeshID", Mesh);
+    return i;
+}
 
-        if (subitem) {
-            strncpy(cfg->meshtag, FIND_JSON_KEY("MeshID", "Mesh.MeshID", Mesh, (MMC_ERROR(-1, "You must specify mesh files"), ""), valuestring), MAX_SESSION_LENGTH - 1);
+/**
+ * @brief Count the numbers in the bracket pair starting at p
+ */
+
+static int mcx_jsoncolumns(const char* p) {
+    int count = 0, isblank = 1;
+
+    for (p++; *p && *p != ']'; p++) {
+        if (*p == ',') {
+            count++;
+        } else if (!(*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')) {
+            isblank = 0;
         }
+    }
 
-        //< reading mesh node and elem mesh data from JSON file
-        {
-            int ndim;
-            uint dims[3] = {1, 1, 1};
-            char* type = NULL;
+    return (isblank) ? 0 : count + 1;
+}
 
-            subitem = FIND_JSON_OBJ("MeshNode", "Mesh.MeshNode", Mesh);
+/**
+ * @brief Decode an inline 1D or 2D numeric JSON array without building cJSON nodes
+ *
+ * The text is split at row boundaries into one chunk per thread, each chunk is
+ * parsed into its own rows.
+ *
+ * @param[in] p: pointer to the opening bracket of the array
+ * @param[in] end: pointer to the closing bracket of the array
+ * @param[out] nrow: number of rows, 0 for a 1D array
+ * @param[out] ncol: number of numbers per row
+ * @param[out] fval: the decoded array if isint is 0, to be freed by the caller
+ * @param[out] ival: the decoded array if isint is 1, to be freed by the caller
+ * @return 0 if successful, 1 if the rows have different lengths
+ */
 
-            if (subitem) {
-                if (cfg->node) {
-                    free(cfg->node);
-                    cfg->node = NULL;
-                }
+static int mcx_jsontable(const char* p, const char* end, int* nrow, int* ncol, float** fval, int** ival, int isint) {
+    int nchunk = 1, i, total = 0, err = 0;
+    const char** start, *row = p + 1, *q;
+    int* rows;
 
-                if (cJSON_IsArray(subitem)) {
-                    cfg->nodenum = cJSON_GetArraySize(subitem);
-                    subitem = subitem->child;
-                    cfg->node = (FLOAT3*)malloc(sizeof(FLOAT3) * cfg->nodenum);
+    while (*row == ' ' || *row == '\t' || *row == '\r' || *row == '\n') {
+        row++;
+    }
 
-                    for (int i = 0; i < cfg->nodenum; i++) {
-                        if (cJSON_GetArraySize(subitem) != 3) {
-                            MMC_ERROR(-1, "Each element in MeshNode must have 3 numbers");
-                        }
+    if (*row != '[') {
+        row = p;
+    }
 
-                        cfg->node[i].x = subitem->child->valuedouble;
-                        cfg->node[i].y = subitem->child->next->valuedouble;
-                        cfg->node[i].z = subitem->child->next->next->valuedouble;
-                        subitem = subitem->next;
-                    }
-                } else {
-                    mcx_jdatadecode((void**)&cfg->node, &ndim, dims, 2, &type, subitem, cfg);
+    *ncol = mcx_jsoncolumns(row);
 
-                    if (strcmp(type, "single") || ndim != 2 || (ndim >= 2 && dims[1] != 3)) {
-                        if (cfg->node) {
-                            free(cfg->node);
-                        }
+#ifdef _OPENMP
 
-                        MMC_ERROR(-1, "Mesh.MeshNode JData-annotated array must be in the 'single' format");
-                    } else {
-                        cfg->nodenum = dims[0];
-                    }
-                }
-            }
+    if (row != p) {
+        nchunk = MAX(1, MIN(omp_get_max_threads(), (int)((end - row) / MAX_JSON_CHUNK)));
+    }
 
-            subitem = FIND_JSON_OBJ("MeshElem", "Mesh.MeshElem", Mesh);
+#endif
 
-            if (subitem) {
-                if (cfg->elem) {
-                    free(cfg->elem);
-                    cfg->elem = NULL;
-                }
+    start = (const char**)malloc((nchunk + 1) * sizeof(char*));
+    rows = (int*)calloc(nchunk + 1, sizeof(int));
 
-                if (cJSON_IsArray(subitem)) {
-                    cfg->elemnum = cJSON_GetArraySize(subitem);
-                    subitem = subitem->child;
-                    cfg->elemlen = cJSON_GetArraySize(subitem);
-                    cfg->elem = (int*)malloc(sizeof(int) * cfg->elemnum * cfg->elemlen);
+    start[0] = row;
+    start[nchunk] = end;
 
-                    for (int i = 0; i < cfg->elemnum; i++) {
-                        if (cJSON_GetArraySize(subitem) != 5) {
-                            MMC_ERROR(-1, "Each element in MeshElem must have 5 integers");
-                        }
+    for (i = 1; i < nchunk; i++) {
+        q = row + (end - row) / nchunk * i;
+        q = (q < start[i - 1]) ? start[i - 1] : q;
+        q = (const char*)memchr(q, '[', end - q);
+        start[i] = (q) ? q : end;
+    }
 
-                        tmp = subitem->child;
+    if (row == p) {
+        rows[1] = 1;
+    } else {
+        #pragma omp parallel for
 
-                        for (int j = 0; j < 5; j++) {
-                            cfg->elem[ i * cfg->elemlen + j ] = tmp->valueint;
-                            tmp = tmp->next;
-                        }
+        for (i = 0; i < nchunk; i++) {
+            int count = 0;
 
-                        subitem = subitem->next;
-                    }
+            for (const char* c = start[i]; c < start[i + 1]; c++) {
+                count += (*c == '[');
+            }
 
-                    cfg->elemlen--; // to make cfg->elemlen and mesh->elemlen the same - cfg->elem contains 1 extra column for mesh->type
-                } else {
-                    mcx_jdatadecode((void**)&cfg->elem, &ndim, dims, 2, &type, subitem, cfg);
+            rows[i + 1] = count;
+        }
+    }
 
-                    if (!strstr(type, "int32") || ndim != 2 || (ndim >= 2 && dims[1] != 5 && dims[1] != 11)) {
-                        if (cfg->elem) {
-                            free(cfg->elem);
-                        }
+    for (i = 0; i < nchunk; i++) {
+        total += rows[i + 1];
+        rows[i + 1] = total;
+    }
 
-                        MMC_ERROR(-1, "Mesh.MeshElem JData-annotated array must be in the 'int32' format");
-                    } else {
-                        cfg->elemnum = dims[0];
-                        cfg->elemlen = dims[1] - 1;
-                    }
-                }
-            }
+    *nrow = (row == p) ? 0 : total;
 
-            subitem = FIND_JSON_OBJ("MeshROI", "Mesh.MeshROI", Mesh);
+    if (isint) {
+        *ival = (int*)malloc(sizeof(int) * (size_t)total * (*ncol));
+    } else {
+        *fval = (float*)malloc(sizeof(float) * (size_t)total * (*ncol));
+    }
 
-            if (subitem) {
-                if (cfg->roidata) {
-                    free(cfg->roidata);
-                    cfg->roidata = NULL;
-                }
+    #pragma omp parallel for reduction(|:err)
 
-                if (cJSON_IsArray(subitem)) {
-                    int collen, rowlen = cJSON_GetArraySize(subitem);
-                    subitem = subitem->child;
+    for (i = 0; i < nchunk; i++) {
+        int len = rows[i + 1] - rows[i];
 
-                    if (cJSON_IsArray(subitem)) {
-                        collen = cJSON_GetArraySize(subitem);
-                    } else {
-                        collen = rowlen;
-                        rowlen = 1;
-                    }
+        err |= (mcx_jsonrows(start[i], start[i + 1], len, *ncol,
+                             (isint) ? NULL : *fval + (size_t)rows[i] * (*ncol),
+                             (isint) ? *ival + (size_t)rows[i] * (*ncol) : NULL) != len);
+    }
 
-                    cfg->roitype = (collen == 6) ? rtEdge : ((collen == 1 || rowlen == 1) ? rtNode : (collen == 4 ? rtFace : rtNone));
-                    cfg->roidata = (float*)malloc(sizeof(float) * rowlen * collen);
-                    cfg->implicit = (cfg->roitype != rtNone) + (cfg->roitype == rtFace);
+    free(start);
+    free(rows);
+    return err;
+}
 
-                    for (int i = 0; i < rowlen; i++) {
-                        if (cJSON_GetArraySize(subitem) != collen) {
-                            MMC_ERROR(-1, "Each element in MeshROI must have the same length");
-                        }
+/**
+ * @brief Decode the inline MeshNode, MeshElem and MeshROI arrays before parsing the JSON text
+ *
+ * A cJSON tree holding a large inline mesh takes 5-10 times the memory of the
+ * mesh itself. This scans the text for plain numeric MeshNode/MeshElem/MeshROI
+ * arrays in the Mesh (or Shapes) section, decodes them directly into cfg->node,
+ * cfg->elem and cfg->roidata, and overwrites them with null in jbuf, which
+ * mcx_loadjson then skips. Annotated and otherwise unusual arrays are left to
+ * mcx_loadjson.
+ *
+ * @param[in,out] jbuf: the JSON text, decoded arrays are replaced by null
+ * @param[in] cfg: simulation configuration
+ */
 
-                        tmp = subitem->child;
+static void mcx_loadjsonmesh(char* jbuf, mcconfig* cfg) {
+    const char* meshkeys[] = {"MeshNode", "MeshElem", "MeshROI", ""};
+    char* p = jbuf, *q, *end;
+    int depth = 0, meshdepth = 0, id, depth2, nrow, ncol;
+
+    while (*p) {
+        if (*p != '"') {
+            if (*p == '{' || *p == '[') {
+                depth++;
+            } else if ((*p == '}' || *p == ']') && depth-- == meshdepth) {
+                meshdepth = 0;
+            }
 
-                        for (int j = 0; j < collen; j++) {
-                            cfg->roidata[ i * collen + j ] = tmp->valuedouble;
-                            tmp = tmp->next;
-                        }
+            p++;
+            continue;
+        }
 
-                        subitem = subitem->next;
-                    }
-                } else {
-                    mcx_jdatadecode((void**)&cfg->roidata, &ndim, dims, 2, &type, subitem, cfg);
+        /*locate the end of the string and test if it is a key*/
+        for (q = p + 1; *q && *q != '"'; q++) {
+            q += (*q == '\\' && q[1]);
+        }
 
-                    if (strcmp(type, "single") || ndim > 2 || (ndim >= 2 && dims[1] != 6 && dims[1] != 4)) {
-                        free(cfg->roidata);
-                        MMC_ERROR(-1, "Mesh.MeshROI JData-annotated array must be in the 'single' format");
-                    } else {
-                        cfg->roitype = (dims[1] == 6) ? rtEdge : ((ndim == 1 || dims[0] == 1 || dims[1] == 1) ? rtNode : (dims[1] == 4 ? rtFace : rtNone));
-                    }
-                }
-            }
+        if (*q == '\0') {
+            return;
         }
 
-        cfg->e0 = FIND_JSON_KEY("InitElem", "Mesh.InitElem", Mesh, (MMC_ERROR(-1, "InitElem must be given"), 0.0), valueint);
+        end = q + 1;
 
-        if (!flagset['u']) {
-            cfg->unitinmm = FIND_JSON_KEY("LengthUnit", "Mesh.LengthUnit", Mesh, 1.0, valuedouble);
+        while (isspace((unsigned char)*end)) {
+            end++;
         }
-    }
 
-    if (Domain) {
-        cJSON* val, *meds = FIND_JSON_OBJ("Media", "Domain.Media", Domain);
+        if (*end != ':') {
+            p = q + 1;
+            continue;
+        }
 
-        if (meds) {
-            cJSON* med = meds->child;
+        end++;
 
-            if (med) {
-                cfg->medianum = cJSON_GetArraySize(meds);
+        while (isspace((unsigned char)*end)) {
+            end++;
+        }
 
-                if (cfg->prop) {
-                    free(cfg->prop);
-                }
+        if (depth == 1 && *end == '{' && ((q - p == 5 && strncmp(p + 1, "Mesh", 4) == 0) || (q - p == 7 && strncmp(p + 1, "Shapes", 6) == 0))) {
+            meshdepth = 2;
+        }
 
-                cfg->prop = (medium*)malloc(sizeof(medium) * cfg->medianum);
+        id = -1;
 
-                for (i = 0; i < cfg->medianum; i++) {
-                    if (cJSON_IsObject(med)) {
-                        val = FIND_JSON_OBJ("mua", (MMC_ERROR(-1, "You must specify absorption coeff, default in 1/mm"), ""), med);
+        if (meshdepth && depth == meshdepth && *end == '[') {
+            for (id = 0; meshkeys[id][0]; id++) {
+                if ((size_t)(q - p - 1) == strlen(meshkeys[id]) && strncmp(p + 1, meshkeys[id], q - p - 1) == 0) {
+                    break;
+                }
+            }
 
-                        if (val) {
-                            cfg->prop[i].mua = val->valuedouble;
-                        }
+            id = (meshkeys[id][0]) ? id : -1;
+        }
 
-                        val = FIND_JSON_OBJ("mus", (MMC_ERROR(-1, "You must specify scattering coeff, default in 1/mm"), ""), med);
+        p = end;
 
-                        if (val) {
-                            cfg->prop[i].mus = val->valuedouble;
-                        }
+        if (id < 0) {
+            continue;
+        }
 
-                        val = FIND_JSON_OBJ("g", (MMC_ERROR(-1, "You must specify anisotropy [0-1]"), ""), med);
+        /*find the closing bracket; only numbers are accepted, in at most 2 levels*/
+        for (q = end, depth2 = 0; *q; q++) {
+            if (*q == '[') {
+                if (++depth2 > 2) {
+                    break;
+                }
+            } else if (*q == ']') {
+                if (--depth2 == 0) {
+                    break;
+                }
+            } else if (!(isdigit((unsigned char)*q) || isspace((unsigned char)*q) || *q == ',' || *q == '-' || *q == '+' || *q == '.' || *q == 'e' || *q == 'E')) {
+                break;
+            }
+        }
 
-                        if (val) {
-                            cfg->prop[i].g = val->valuedouble;
-                        }
+        if (*q != ']' || depth2 != 0 || q - end < 3) {
+            continue;
+        }
 
-                        val = FIND_JSON_OBJ("n", (MMC_ERROR(-1, "You must specify refractive index"), ""), med);
+        if (id == 0) {
+            if (cfg->node) {
+                free(cfg->node);
+                cfg->node = NULL;
+            }
 
-                        if (val) {
-                            cfg->prop[i].n = val->valuedouble;
-                        }
-                    } else if (cJSON_IsArray(med)) {
-                        cfg->prop[i].mua = med->child->valuedouble;
-                        cfg->prop[i].mus = med->child->next->valuedouble;
-                        cfg->prop[i].g = med->child->next->next->valuedouble;
-                        cfg->prop[i].n = med->child->next->next->next->valuedouble;
-                    } else {
-                        MMC_ERROR(-1, "Session.Media must be either an array of objects or array of 4-elem numerical arrays");
-                    }
+            if (mcx_jsontable(end, q, &nrow, &ncol, (float**)&cfg->node, NULL, 0) || ncol != 3 || nrow == 0) {
+                MMC_ERROR(-1, "Each element in MeshNode must have 3 numbers");
+            }
 
-                    med = med->next;
+            cfg->nodenum = nrow;
+        } else if (id == 1) {
+            if (cfg->elem) {
+                free(cfg->elem);
+                cfg->elem = NULL;
+            }
 
-                    if (med == NULL) {
-                        break;
-                    }
-                }
+            if (mcx_jsontable(end, q, &nrow, &ncol, NULL, &cfg->elem, 1) || ncol != 5 || nrow == 0) {
+                MMC_ERROR(-1, "Each element in MeshElem must have 5 integers");
             }
-        }
 
-        val = FIND_JSON_OBJ("Step", "Domain.Step", Domain);
+            cfg->elemnum = nrow;
+            cfg->elemlen = ncol - 1;
+        } else {
+            if (cfg->roidata) {
+                free(cfg->roidata);
+                cfg->roidata = NULL;
+            }
 
-        if (val) {
-            if (cJSON_GetArraySize(val) >= 1) {
-                cfg->steps.x = val->child->valuedouble;
-                cfg->steps.y = cfg->steps.x;
-                cfg->steps.z = cfg->steps.x;
-            } else {
-                MMC_ERROR(-1, "Domain::Step has incorrect element numbers");
+            if (mcx_jsontable(end, q, &nrow, &ncol, &cfg->roidata, NULL, 0)) {
+                MMC_ERROR(-1, "Each element in MeshROI must have the same length");
             }
-        }
 
-        if (!flagset['u']) {
-            cfg->unitinmm = FIND_JSON_KEY("LengthUnit", "Domain.LengthUnit", Domain, 1.0, valuedouble);
+            cfg->roitype = (ncol == 6) ? rtEdge : ((ncol == 1 || nrow <= 1) ? rtNode : (ncol == 4 ? rtFace : rtNone));
+            cfg->implicit = (cfg->roitype != rtNone) + (cfg->roitype == rtFace);
         }
+
+        /*the decoded array is replaced by null of the same length*/
+        memcpy(end, "null", 4);
+        memset(end + 4, ' ', q - end - 3);
+        p = q + 1;
     }
+}
 
-    if (Optode) {
-        cJSON* dets, *src = FIND_JSON_OBJ("Source", "Optode.Source", Optode);
+#define BJD_MAX_DIM   8            /**< max dimensions of an N-D typed array in a binary JData input */
 
-        if (src) {
-            subitem = FIND_JSON_OBJ("Pos", "Optode.Source.Pos", src);
+/**
+ * \struct MMC_bjdreader mmc_utils.c
+ * \brief The read position in a binary JData (BJData) input file, see mcx_loadbjdata
+ */
 
-            if (subitem) {
-                cfg->srcpos.x = subitem->child->valuedouble;
-                cfg->srcpos.y = subitem->child->next->valuedouble;
-                cfg->srcpos.z = subitem->child->next->next->valuedouble;
-            }
+typedef struct MMC_bjdreader {
+    const unsigned char* pos;      /**< the next byte to read */
+    const unsigned char* end;      /**< the end of the input */
+    mcconfig* cfg;                 /**< receives the mesh arrays decoded without a cJSON copy */
+    long long annotdims[2];        /**< _ArraySize_ of the JData-annotated mesh array being read */
+    int annotndim;                 /**< number of dimensions in annotdims, 0 if not yet read */
+} bjdreader;
 
-            subitem = FIND_JSON_OBJ("Dir", "Optode.Source.Dir", src);
+/**
+ * @brief Stop with an error if fewer than len bytes are left in a binary JData input
+ */
 
-            if (subitem) {
-                cfg->srcdir.x = subitem->child->valuedouble;
-                cfg->srcdir.y = subitem->child->next->valuedouble;
-                cfg->srcdir.z = subitem->child->next->next->valuedouble;
+static void mcx_bjdneed(bjdreader* r, size_t len) {
+    if ((size_t)(r->end - r->pos) < len) {
+        MMC_ERROR(-9, "the binary JData input file is truncated");
+    }
+}
 
-                if (subitem->child->next->next->next) {
-                    cfg->srcdir.w = subitem->child->next->next->next->valuedouble;
-                }
-            }
+/**
+ * @brief The byte length of a numeric BJData type marker, 0 for other markers
+ */
 
-            subitem = FIND_JSON_OBJ("Type", "Optode.Source.Type", src);
+static int mcx_bjdbytes(int type) {
+    switch (type) {
+        case 'i':
+        case 'U':
+        case 'C':
+        case 'B':
+            return 1;
+
+        case 'I':
+        case 'u':
+        case 'h':
+            return 2;
+
+        case 'l':
+        case 'm':
+        case 'd':
+            return 4;
+
+        case 'L':
+        case 'M':
+        case 'D':
+            return 8;
+
+        default:
+            return 0;
+    }
+}
 
-            if (subitem) {
-                cfg->srctype = mcx_keylookup(subitem->valuestring, srctypeid);
-            }
+/**
+ * @brief Read a number of a given BJData type, stored in the little-endian byte order
+ *
+ * Like the BJData writer used for the .bnii outputs, this assumes a little-endian host.
+ */
 
-            subitem = FIND_JSON_OBJ("Param1", "Optode.Source.Param1", src);
+static double mcx_bjdscalar(const unsigned char* p, int type) {
+    union {
+        char i8;
+        unsigned char u8;
+        short i16;
+        unsigned short u16;
+        int i32;
+        unsigned int u32;
+        long long i64;
+        unsigned long long u64;
+        float f32;
+        double f64;
+    } v;
 
-            if (subitem && cJSON_GetArraySize(subitem) == 4) {
-                cfg->srcparam1.x = subitem->child->valuedouble;
+    memcpy(&v, p, mcx_bjdbytes(type));
 
-                if (subitem->child->next) {
-                    cfg->srcparam1.y = subitem->child->next->valuedouble;
+    switch (type) {
+        case 'i':
+            return v.i8;
 
-                    if (subitem->child->next->next) {
-                        cfg->srcparam1.z = subitem->child->next->next->valuedouble;
+        case 'I':
+            return v.i16;
 
-                        if (subitem->child->next->next->next) {
-                            cfg->srcparam1.w = subitem->child->next->next->next->valuedouble;
-                        }
-                    }
-                }
-            }
+        case 'u':
+            return v.u16;
 
-            subitem = FIND_JSON_OBJ("Param2", "Optode.Source.Param2", src);
+        case 'l':
+            return v.i32;
 
-            if (subitem && cJSON_GetArraySize(subitem) == 4) {
-                cfg->srcparam2.x = subitem->child->valuedouble;
+        case 'm':
+            return v.u32;
 
-                if (subitem->child->next) {
-                    cfg->srcparam2.y = subitem->child->next->valuedouble;
+        case 'L':
+            return (double)v.i64;
 
-                    if (subitem->child->next->next) {
-                        cfg->srcparam2.z = subitem->child->next->next->valuedouble;
+        case 'M':
+            return (double)v.u64;
 
-                        if (subitem->child->next->next->next) {
-                            cfg->srcparam2.w = subitem->child->next->next->next->valuedouble;
-                        }
-                    }
-                }
-            }
+        case 'd':
+            return v.f32;
 
-            subitem = FIND_JSON_OBJ("Pattern", "Optode.Source.Pattern", src);
+        case 'D':
+            return v.f64;
 
-            if (subitem) {
-                if (FIND_JSON_OBJ("_ArrayZipData_", "Optode.Source.Pattern._ArrayZipData_", subitem)) {
-                    int ndim;
-                    uint dims[3] = {1, 1, 1};
-                    char* type = NULL;
+        case 'h': {
+            int e = (v.u16 >> 10) & 0x1F, m = v.u16 & 0x3FF;
+            double val = (e == 0) ? ldexp(m, -24) : ((e == 31) ? (m ? NAN : INFINITY) : ldexp(m + 1024, e - 25));
+            return (v.u16 & 0x8000) ? -val : val;
+        }
 
-                    if (cfg->srcpattern) {
-                        free(cfg->srcpattern);
-                    }
+        default:
+            return v.u8;
+    }
+}
 
-                    mcx_jdatadecode((void**)&cfg->srcpattern, &ndim, dims, 3, &type, subitem, cfg);
+/**
+ * @brief Read an integer with its type marker, such as a length or a count
+ */
 
-                    if (strcmp(type, "single")) {
-                        if (cfg->srcpattern) {
-                            free(cfg->srcpattern);
-                        }
+static long long mcx_bjdint(bjdreader* r) {
+    int type;
+    double val;
 
-                        MMC_ERROR(-1, "Optode.Source.Pattern JData-annotated array must be in the 'single' format");
-                    }
+    mcx_bjdneed(r, 1);
+    type = *r->pos++;
 
-                    if (ndim == 3 && dims[2] > 1 && dims[0] > 1 && cfg->srctype == MCX_SRC_PATTERN) {
-                        cfg->srcnum = dims[0];
-                    }
+    if (type == 0 || !strchr("iUIulmLM", type)) {
+        MMC_ERROR(-9, "a length in the binary JData input file is not an integer");
+    }
 
-                    mcx_convertrow2col(cfg->srcpattern, (uint3*)dims);
-                } else {
-                    int nx = FIND_JSON_KEY("Nx", "Optode.Source.Pattern.Nx", subitem, 0, valueint);
-                    int ny = FIND_JSON_KEY("Ny", "Optode.Source.Pattern.Ny", subitem, 0, valueint);
-                    int nz = FIND_JSON_KEY("Nz", "Optode.Source.Pattern.Nz", subitem, 1, valueint);
+    mcx_bjdneed(r, mcx_bjdbytes(type));
+    val = mcx_bjdscalar(r->pos, type);
+    r->pos += mcx_bjdbytes(type);
 
-                    if (nx > 0 && ny > 0) {
-                        cJSON* pat = FIND_JSON_OBJ("Data", "Optode.Source.Pattern.Data", subitem);
+    if (val < 0) {
+        MMC_ERROR(-9, "a length in the binary JData input file is negative");
+    }
 
-                        if (pat && pat->child) {
-                            int i;
-                            pat = pat->child;
+    return (long long)val;
+}
 
-                            if (cfg->srcpattern) {
-                                free(cfg->srcpattern);
-                            }
+/**
+ * @brief Read the optional type ($) and count (#) of a BJData array or object
+ *
+ * The count may be a list of N-D dimensions, whose product is returned.
+ *
+ * @param[in,out] r: the reader, positioned after the opening marker
+ * @param[out] type: the type marker of all elements, 0 if the container is not typed
+ * @param[out] dims: the dimensions of an N-D array, dims[0] is the count otherwise
+ * @param[out] ndim: the number of dimensions, 0 if the container is not counted
+ * @return the element count, -1 if the container ends with a closing marker
+ */
 
-                            cfg->srcpattern = (float*)calloc(nx * ny * nz * cfg->srcnum, sizeof(float));
+static long long mcx_bjdheader(bjdreader* r, int* type, long long* dims, int* ndim) {
+    long long count = -1;
 
-                            for (i = 0; i < nx * ny * nz * cfg->srcnum; i++) {
-                                if (pat == NULL) {
-                                    MMC_ERROR(-1, "Incomplete pattern data");
-                                }
+    *type = 0;
+    *ndim = 0;
 
-                                cfg->srcpattern[i] = pat->valuedouble;
-                                pat = pat->next;
-                            }
-                        } else if (pat) {
-                            FILE* fid = fopen(pat->valuestring, "rb");
+    if (r->pos < r->end && *r->pos == '$') {
+        mcx_bjdneed(r, 2);
+        *type = r->pos[1];
+        r->pos += 2;
+    }
 
-                            if (fid != NULL) {
-                                if (cfg->srcpattern) {
-                                    free(cfg->srcpattern);
-                                }
+    if (r->pos < r->end && *r->pos == '#') {
+        r->pos++;
+        mcx_bjdneed(r, 1);
 
-                                cfg->srcpattern = (float*)calloc(nx * ny * nz * cfg->srcnum, sizeof(float));
+        if (*r->pos == '[') {
+            int dimtype, dimndim;
+            long long dimdims[BJD_MAX_DIM], dimnum;
 
-                                if (fread((void*)cfg->srcpattern, sizeof(float) * nx * ny * nz * cfg->srcnum, 1, fid) != 1) {
-                                    fclose(fid);
-                                    MMC_ERROR(-1, "Fail to read pattern input file");
-                                }
+            r->pos++;
+            dimnum = mcx_bjdheader(r, &dimtype, dimdims, &dimndim);
+            count = 1;
 
-                                fclose(fid);
-                            }
-                        }
+            while (1) {
+                if (dimnum < 0) {
+                    mcx_bjdneed(r, 1);
+
+                    if (*r->pos == ']') {
+                        r->pos++;
+                        break;
                     }
+                } else if (*ndim >= dimnum) {
+                    break;
                 }
-            }
-        }
 
-        dets = FIND_JSON_OBJ("Detector", "Optode.Detector", Optode);
+                if (*ndim >= BJD_MAX_DIM) {
+                    MMC_ERROR(-9, "an array in the binary JData input file has too many dimensions");
+                }
 
-        if (dets) {
-            cJSON* det = dets;
+                if (dimtype) {
+                    mcx_bjdneed(r, mcx_bjdbytes(dimtype));
+                    dims[*ndim] = (long long)mcx_bjdscalar(r->pos, dimtype);
+                    r->pos += mcx_bjdbytes(dimtype);
+                } else {
+                    dims[*ndim] = mcx_bjdint(r);
+                }
 
-            if (!FIND_JSON_OBJ("Pos", "Optode.Detector.Pos", dets)) {
-                det = dets->child;
+                count *= dims[(*ndim)++];
             }
+        } else {
+            count = dims[0] = mcx_bjdint(r);
+            *ndim = 1;
+        }
+    } else if (*type) {
+        MMC_ERROR(-9, "a typed container in the binary JData input file has no count");
+    }
 
-            if (det) {
-                cfg->detnum = cJSON_GetArraySize(dets);
-                cfg->detpos = (float4*)malloc(sizeof(float4) * cfg->detnum);
-
-                for (i = 0; i < cfg->detnum; i++) {
-                    cJSON* pos = dets, *rad = NULL;
-                    rad = FIND_JSON_OBJ("R", "Optode.Detector.R", det);
-
-                    if (cJSON_GetArraySize(det) == 2) {
-                        pos = FIND_JSON_OBJ("Pos", "Optode.Detector.Pos", det);
-                    }
+    return count;
+}
 
-                    if (pos) {
-                        cfg->detpos[i].x = pos->child->valuedouble;
-                        cfg->detpos[i].y = pos->child->next->valuedouble;
-                        cfg->detpos[i].z = pos->child->next->next->valuedouble;
-                    }
+static cJSON* mcx_bjdvalue(bjdreader* r, int marker, const char* key, int level, int context);
 
-                    if (rad) {
-                        cfg->detpos[i].w = rad->valuedouble;
-                    }
+/**
+ * @brief Read the numbers of an N-D typed array into nested cJSON arrays
+ */
 
-                    det = det->next;
+static cJSON* mcx_bjdtyped(bjdreader* r, int type, const long long* dims, int ndim) {
+    cJSON* arr = cJSON_CreateArray();
+    long long i;
 
-                    if (det == NULL) {
-                        break;
-                    }
-                }
-            }
+    for (i = 0; i < dims[0]; i++) {
+        if (ndim > 1) {
+            cJSON_AddItemToArray(arr, mcx_bjdtyped(r, type, dims + 1, ndim - 1));
+        } else {
+            mcx_bjdneed(r, mcx_bjdbytes(type));
+            cJSON_AddItemToArray(arr, cJSON_CreateNumber(mcx_bjdscalar(r->pos, type)));
+            r->pos += mcx_bjdbytes(type);
         }
     }
 
-    if (Session) {
-        char val[2] = {'\0', '\0'};
-        cJSON* ck;
-
-        if (!flagset['E']) {
-            cfg->seed = FIND_JSON_KEY("RNGSeed", "Session.RNGSeed", Session, -1, valueint);
-        }
+    return arr;
+}
 
-        if (!flagset['n']) {
-            cfg->nphoton = FIND_JSON_KEY("Photons", "Session.Photons", Session, 0, valueint);
-        }
+/**
+ * @brief Decode a numeric array of the Mesh section directly into cfg->node, cfg->elem or cfg->roidata
+ *
+ * Arrays already in the type of the destination (single for the nodes and
+ * the ROIs, int32 for the elements) are copied in one block from the input.
+ *
+ * @param[in,out] r: the reader, positioned at the first number
+ * @param[in] id: 0 for MeshNode, 1 for MeshElem, 2 for MeshROI
+ * @param[in] type: the BJData type of the numbers
+ * @param[in] count: the number of values
+ * @param[in] nrow: the number of rows, 1 for a 1-D array
+ * @param[in] ncol: the number of columns
+ */
 
-        if (cfg->session[0] == '\0') {
-            strncpy(cfg->session, FIND_JSON_KEY("ID", "Session.ID", Session, "default", valuestring), MAX_SESSION_LENGTH);
-        }
+static void mcx_bjdmesh(bjdreader* r, int id, int type, long long count, long long nrow, long long ncol) {
+    mcconfig* cfg = r->cfg;
+    int bytes = mcx_bjdbytes(type), target = (id == 1) ? 'l' : 'd';
+    void* dst;
+    long long i;
 
-        if (!flagset['b']) {
-            cfg->isreflect = FIND_JSON_KEY("DoMismatch", "Session.DoMismatch", Session, cfg->isreflect, valueint);
-        }
+    if (nrow * ncol != count || count > 0x7FFFFFFF) {
+        MMC_ERROR(-9, "the size of a mesh array in the binary JData input file does not match its length");
+    }
 
-        if (!flagset['S']) {
-            cfg->issave2pt = FIND_JSON_KEY("DoSaveVolume", "Session.DoSaveVolume", Session, cfg->issave2pt, valueint);
-        }
+    mcx_bjdneed(r, (size_t)count * bytes);
 
-        if (!flagset['U']) {
-            cfg->isnormalized = FIND_JSON_KEY("DoNormalize", "Session.DoNormalize", Session, cfg->isnormalized, valueint);
+    if (id == 0) {
+        if (ncol != 3 || nrow == 0) {
+            MMC_ERROR(-1, "Each element in MeshNode must have 3 numbers");
         }
 
-        if (!flagset['d']) {
-            cfg->issavedet = FIND_JSON_KEY("DoPartialPath", "Session.DoPartialPath", Session, cfg->issavedet, valueint);
+        free(cfg->node);
+        cfg->node = (FLOAT3*)malloc(sizeof(FLOAT3) * nrow);
+        cfg->nodenum = nrow;
+        dst = cfg->node;
+    } else if (id == 1) {
+        if ((ncol != 5 && ncol != 11) || nrow == 0) {
+            MMC_ERROR(-1, "Each element in MeshElem must have 5 integers");
         }
 
-        if (!flagset['V']) {
-            cfg->isspecular = FIND_JSON_KEY("DoSpecular", "Session.DoSpecular", Session, cfg->isspecular, valueint);
-        }
+        free(cfg->elem);
+        cfg->elem = (int*)malloc(sizeof(int) * count);
+        cfg->elemnum = nrow;
+        cfg->elemlen = ncol - 1;
+        dst = cfg->elem;
+    } else {
+        free(cfg->roidata);
+        cfg->roidata = (float*)malloc(sizeof(float) * MAX(count, 1));
+        cfg->roitype = (ncol == 6) ? rtEdge : ((ncol == 1 || nrow <= 1) ? rtNode : (ncol == 4 ? rtFace : rtNone));
+        cfg->implicit = (cfg->roitype != rtNone) + (cfg->roitype == rtFace);
+        dst = cfg->roidata;
+    }
 
-        if (!flagset['m']) {
-            cfg->ismomentum = FIND_JSON_KEY("DoDCS", "Session.DoDCS", Session, cfg->ismomentum, valueint);
+    if (type == target) {
+        memcpy(dst, r->pos, (size_t)count * bytes);
+    } else {
+        for (i = 0; i < count; i++) {
+            if (target == 'l') {
+                ((int*)dst)[i] = (int)mcx_bjdscalar(r->pos + i * bytes, type);
+            } else {
+                ((float*)dst)[i] = (float)mcx_bjdscalar(r->pos + i * bytes, type);
+            }
         }
+    }
 
-        if (!flagset['x']) {
-            cfg->issaveexit = FIND_JSON_KEY("DoSaveExit", "Session.DoSaveExit", Session, cfg->issaveexit, valueint);
-        }
+    r->pos += (size_t)count * bytes;
+}
 
-        if (!flagset['q']) {
-            cfg->issaveseed = FIND_JSON_KEY("DoSaveSeed", "Session.DoSaveSeed", Session, cfg->issaveseed, valueint);
-        }
+/**
+ * @brief Read a BJData array or object into a cJSON tree
+ *
+ * Numeric arrays of MeshNode, MeshElem and MeshROI in the Mesh (or Shapes)
+ * section, plain or as the _ArrayData_ of a JData-annotated array, are
+ * decoded by mcx_bjdmesh and returned as null, which mcx_loadjson skips. A
+ * binary _ArrayZipData_ is returned as the base64 string of the JSON form.
+ *
+ * @param[in,out] r: the reader, positioned after the opening marker
+ * @param[in] isobject: 1 for an object, 0 for an array
+ * @param[in] key: the key of the container in its parent object, NULL if none
+ * @param[in] level: the nesting level of the container, 0 for the root object
+ * @param[in] context: 1 in the Mesh section, 2+id in an annotated mesh array (see mcx_bjdmesh), 0 otherwise
+ */
 
-        if (!flagset['C']) {
-            cfg->basisorder = FIND_JSON_KEY("BasisOrder", "Session.BasisOrder", Session, cfg->basisorder, valueint);
-        }
+static cJSON* mcx_bjdcontainer(bjdreader* r, int isobject, const char* key, int level, int context) {
+    const char* meshkeys[] = {"MeshNode", "MeshElem", "MeshROI", ""};
+    int type, ndim, id = -1;
+    long long dims[BJD_MAX_DIM], count = mcx_bjdheader(r, &type, dims, &ndim), i;
+    cJSON* obj;
 
-        if (!flagset['F']) {
-            cfg->outputformat = mcx_keylookup((char*)FIND_JSON_KEY("OutputFormat", "Session.OutputFormat", Session, "ascii", valuestring), outputformat);
-        }
+    if (!isobject && key && count >= 0 && mcx_bjdbytes(type) && type != 'C') {
+        if (context == 1) {
+            for (id = 0; meshkeys[id][0] && strcmp(key, meshkeys[id]); id++);
 
-        if (cfg->outputformat < 0) {
-            MMC_ERROR(-2, "the specified output format is not recognized");
+            id = (meshkeys[id][0]) ? id : -1;
+        } else if (context >= 2 && strcmp(key, "_ArrayData_") == 0) {
+            id = context - 2;
         }
 
-        if (!flagset['D']) {
-            if (FIND_JSON_KEY("DebugFlag", "Session.DebugFlag", Session, "", valuestring)) {
-                cfg->debuglevel = mcx_parsedebugopt(FIND_JSON_KEY("DebugFlag", "Session.DebugFlag", Session, "", valuestring), debugflag);
+        if (id >= 0) {
+            if (context >= 2 && r->annotndim == 2) {
+                mcx_bjdmesh(r, id, type, count, r->annotdims[0], r->annotdims[1]);
+            } else if (ndim == 2 || (context >= 2 && r->annotndim == 1)) {
+                mcx_bjdmesh(r, id, type, count, (ndim == 2) ? dims[0] : 1, (ndim == 2) ? dims[1] : count);
             } else {
-                cfg->debuglevel = FIND_JSON_KEY("DebugFlag", "Session.DebugFlag", Session, 0, valueint);
+                mcx_bjdmesh(r, id, type, count, 1, count);
             }
+
+            return cJSON_CreateNull();
         }
 
-        if (!flagset['M']) {
-            strncpy(val, FIND_JSON_KEY("RayTracer", "Session.RayTracer", Session, raytracing + cfg->method, valuestring), 1);
+        if (strcmp(key, "_ArrayZipData_") == 0 && mcx_bjdbytes(type) == 1) {
+            size_t len = 0;
+            int status = 0;
+            uchar* buf = NULL;
 
-            if (mcx_lookupindex(val, raytracing)) {
-                MMC_ERROR(-2, "the specified ray-tracing method is not recognized");
+            mcx_bjdneed(r, (size_t)count);
+
+            if (zmat_encode((size_t)count, (uchar*)r->pos, &len, &buf, zmBase64, &status)) {
+                MMC_ERROR(-9, "can not encode the _ArrayZipData_ of the binary JData input file");
             }
 
-            cfg->method = val[0];
+            r->pos += count;
+            buf = (uchar*)realloc(buf, len + 1);
+            buf[len] = '\0';
+            obj = cJSON_CreateString((char*)buf);
+            free(buf);
+            return obj;
         }
+    }
 
-        if (!flagset['O']) {
-            strncpy(val, FIND_JSON_KEY("OutputType", "Session.OutputType", Session, outputtype + cfg->outputtype, valuestring), 1);
+    if (!isobject && count >= 0 && mcx_bjdbytes(type) && type != 'C') {
+        return (ndim > 1) ? mcx_bjdtyped(r, type, dims, ndim) : mcx_bjdtyped(r, type, &count, 1);
+    }
 
-            if (mcx_lookupindex(val, outputtype)) {
-                MMC_ERROR(-2, "the specified output data type is not recognized");
+    obj = isobject ? cJSON_CreateObject() : cJSON_CreateArray();
+
+    for (i = 0; count < 0 || i < count; i++) {
+        int marker = type;
+        char* name = NULL;
+        cJSON* item;
+
+        if (count < 0) {
+            mcx_bjdneed(r, 1);
+
+            while (*r->pos == 'N') {
+                r->pos++;
+                mcx_bjdneed(r, 1);
             }
 
-            cfg->outputtype = val[0];
+            if (*r->pos == (isobject ? '}' : ']')) {
+                r->pos++;
+                break;
+            }
         }
 
-        ck = FIND_JSON_OBJ("Checkpoints", "Session.Checkpoints", Session);
+        if (isobject) {
+            long long len = mcx_bjdint(r);
 
-        if (ck) {
-            int num = MIN(cJSON_GetArraySize(ck), MAX_CHECKPOINT);
-            ck = ck->child;
+            mcx_bjdneed(r, (size_t)len);
+            name = (char*)malloc(len + 1);
+            memcpy(name, r->pos, len);
+            name[len] = '\0';
+            r->pos += len;
+        }
 
-            for (i = 0; i < num; i++) {
-                cfg->checkpt[i] = ck->valueint;
-                ck = ck->next;
+        if (!marker) {
+            mcx_bjdneed(r, 1);
+            marker = *r->pos++;
+        }
 
-                if (ck == NULL) {
-                    break;
-                }
+        if (isobject) {
+            int childcontext = 0;
+
+            if (level == 0 && (strcmp(name, "Mesh") == 0 || strcmp(name, "Shapes") == 0)) {
+                childcontext = 1;
+            } else if (context == 1) {
+                for (id = 0; meshkeys[id][0] && strcmp(name, meshkeys[id]); id++);
+
+                childcontext = meshkeys[id][0] ? ((marker == '{') ? 2 + id : 1) : 0;
+                r->annotndim = 0;
+            } else if (context >= 2) {
+                childcontext = context;
             }
-        }
-    }
 
-    if (Forward) {
-        cfg->tstart = FIND_JSON_KEY("T0", "Forward.T0", Forward, 0.0, valuedouble);
-        cfg->tend  = FIND_JSON_KEY("T1", "Forward.T1", Forward, 0.0, valuedouble);
-        cfg->tstep = FIND_JSON_KEY("Dt", "Forward.Dt", Forward, 0.0, valuedouble);
-        cfg->nout = FIND_JSON_KEY("N0", "Forward.N0", Forward, cfg->nout, valuedouble);
+            item = mcx_bjdvalue(r, marker, name, level + 1, childcontext);
 
-        cfg->maxgate = (int)((cfg->tend - cfg->tstart) / cfg->tstep + 0.5);
-    }
+            /*remember the size of an annotated mesh array for its _ArrayData_*/
+            if (context >= 2 && strcmp(name, "_ArraySize_") == 0) {
+                cJSON* dim;
 
-    if (cfg->meshtag[0] == '\0' && cfg->nodenum == 0) {
-        MMC_ERROR(-1, "You must specify mesh files");
-    }
+                r->annotndim = 0;
 
-    if (cfg->e0 == 0) {
-        MMC_ERROR(-1, "InitElem must be given");
+                if (cJSON_IsNumber(item)) {
+                    r->annotdims[r->annotndim++] = item->valueint;
+                } else {
+                    cJSON_ArrayForEach(dim, item) {
+                        if (r->annotndim < 2) {
+                            r->annotdims[r->annotndim] = (long long)dim->valuedouble;
+                        }
+
+                        r->annotndim++;
+                    }
+                }
+            }
+
+            cJSON_AddItemToObject(obj, name, item);
+            free(name);
+        } else {
+            cJSON_AddItemToArray(obj, mcx_bjdvalue(r, marker, NULL, level + 1, 0));
+        }
     }
 
-    if (cfg->isdumpjson == 3) {
-        mcx_savejdata(cfg->jsonfile, cfg);
-        exit(0);
+    /*an annotated mesh array whose data went to cfg is skipped as a whole*/
+    if (isobject && context >= 2 && cJSON_IsNull(cJSON_GetObjectItem(obj, "_ArrayData_"))) {
+        cJSON_Delete(obj);
+        return cJSON_CreateNull();
     }
 
-    return 0;
+    return obj;
 }
 
 /**
- * @brief Write simulation settings to an inp file
- *
- * @param[in] fname: the name of the output file
- * @param[in] cfg: simulation configuration
+ * @brief Read a BJData value of a given marker into a cJSON item
  */
 
-void mcx_writeconfig(char* fname, mcconfig* cfg) {
-    if (fname[0] == 0) {
-        mcx_saveconfig(stdout, cfg);
-    } else {
-        FILE* fp = fopen(fname, "wt");
+static cJSON* mcx_bjdvalue(bjdreader* r, int marker, const char* key, int level, int context) {
+    switch (marker) {
+        case 'Z':
+            return cJSON_CreateNull();
 
-        if (fp == NULL) {
-            MMC_ERROR(-2, "can not write to the specified config file");
+        case 'T':
+            return cJSON_CreateTrue();
+
+        case 'F':
+            return cJSON_CreateFalse();
+
+        case 'C': {
+            char str[2] = {0, 0};
+
+            mcx_bjdneed(r, 1);
+            str[0] = (char)(*r->pos++);
+            return cJSON_CreateString(str);
         }
 
-        mcx_saveconfig(fp, cfg);
-        fclose(fp);
+        case 'S':
+        case 'H': {
+            long long len = mcx_bjdint(r);
+            char* str;
+            cJSON* item;
+
+            mcx_bjdneed(r, (size_t)len);
+            str = (char*)malloc(len + 1);
+            memcpy(str, r->pos, len);
+            str[len] = '\0';
+            r->pos += len;
+            item = (marker == 'H') ? cJSON_CreateNumber(atof(str)) : cJSON_CreateString(str);
+            free(str);
+            return item;
+        }
+
+        case '[':
+        case '{':
+            return mcx_bjdcontainer(r, marker == '{', key, level, context);
+
+        default: {
+            double val;
+
+            if (mcx_bjdbytes(marker) == 0) {
+                MMC_ERROR(-9, "the binary JData input file has an unknown type marker");
+            }
+
+            mcx_bjdneed(r, mcx_bjdbytes(marker));
+            val = mcx_bjdscalar(r->pos, marker);
+            r->pos += mcx_bjdbytes(marker);
+            return cJSON_CreateNumber(val);
+        }
     }
 }
 
 /**
- * @brief Load user inputs from a .inp input file
+ * @brief Load the settings from a binary JData (BJData) input file
  *
- * This function loads user input from a simple text input format in a .inp extension
+ * The binary form of a .json input, as written by the JSONLab savebj or the
+ * Python bjdata modules. Large numeric arrays of the Mesh section are copied
+ * from the input buffer into cfg, skipping the text parsing and the base64
+ * decoding of the JSON form; the other settings go through mcx_loadjson.
  *
- * @param[in] in: file handle to the .inp file
+ * @param[in] buf: the content of the input file
+ * @param[in] len: the length of buf in bytes
  * @param[in] cfg: simulation configuration
  */
 
-void mcx_loadconfig(FILE* in, mcconfig* cfg) {
-    int i, gates, srctype, itmp;
-    size_t nphoton;
-    float dtmp;
-    char comment[MAX_FULL_PATH], *comm, srctypestr[MAX_SESSION_LENGTH] = {'\0'};
+void mcx_loadbjdata(const unsigned char* buf, size_t len, mcconfig* cfg) {
+    bjdreader r = {buf, buf + len, cfg, {0, 0}, 0};
+    cJSON* root;
 
-    if (in == stdin) {
-        MMC_FPRINTF(stdout, "Please specify the total number of photons: [1000000]\n\t");
+    while (r.pos < r.end && *r.pos == 'N') {
+        r.pos++;
     }
 
-    MMC_ASSERT(fscanf(in, "%zu", &(nphoton) ) == 1);
+    mcx_bjdneed(&r, 1);
 
-    if (cfg->nphoton == 0) {
-        cfg->nphoton = nphoton;
+    if (*r.pos++ != '{') {
+        MMC_ERROR(-9, "the binary JData input file must contain an object");
     }
 
-    comm = fgets(comment, MAX_PATH_LENGTH, in);
+    root = mcx_bjdcontainer(&r, 1, NULL, 0, 0);
+    mcx_loadjson(root, cfg);
+    cJSON_Delete(root);
+}
 
-    if (in == stdin) {
-        MMC_FPRINTF(stdout, ">> %zu\nPlease specify the random number generator seed: [123456789]\n\t", cfg->nphoton);
-    }
+/**
+ * @brief Read simulation settings from a configuration file (.inp, .json or binary JData)
+ *
+ * @param[in] fname: the name of the input file (.inp, .json, or .bjd/.bmsh for binary JData)
+ * @param[in] cfg: simulation configuration
+ */
 
-    if (cfg->seed == 0x623F9A9E) {
-        MMC_ASSERT(fscanf(in, "%d", &(cfg->seed) ) == 1);
+void mcx_readconfig(char* fname, mcconfig* cfg) {
+    if (fname[0] == 0) {
+        mcx_loadconfig(stdin, cfg);
+
+        if (cfg->session[0] == '\0') {
+            strcpy(cfg->session, "default");
+        }
     } else {
-        MMC_ASSERT(fscanf(in, "%d", &itmp ) == 1);
-    }
+        FILE* fp = fopen(fname, "rt");
 
-    comm = fgets(comment, MAX_PATH_LENGTH, in);
+        if (fp == NULL) {
+            MMC_ERROR(-2, "can not load the specified config file");
+        }
 
-    if (in == stdin) {
-        MMC_FPRINTF(stdout, ">> %d\nPlease specify the position of the source: [10 10 5]\n\t", cfg->seed);
-    }
+        if (strstr(fname, ".json") != NULL) {
+            char* jbuf;
+            int len;
 
-    MMC_ASSERT(fscanf(in, "%f %f %f", &(cfg->srcpos.x), &(cfg->srcpos.y), &(cfg->srcpos.z) ) == 3);
-    comm = fgets(comment, MAX_PATH_LENGTH, in);
+            fclose(fp);
+            fp = fopen(fname, "rb");
+            fseek (fp, 0, SEEK_END);
+            len = ftell(fp) + 1;
+            jbuf = (char*)malloc(len);
+            rewind(fp);
 
-    if (in == stdin)
-        MMC_FPRINTF(stdout, ">> %f %f %f\nPlease specify the normal direction of the source: [0 0 1]\n\t",
-                    cfg->srcpos.x, cfg->srcpos.y, cfg->srcpos.z);
-
-    MMC_ASSERT(fscanf(in, "%f %f %f", &(cfg->srcdir.x), &(cfg->srcdir.y), &(cfg->srcdir.z)));
-    comm = fgets(comment, MAX_PATH_LENGTH, in);
+            if (fread(jbuf, len - 1, 1, fp) != 1) {
+                MMC_ERROR(-2, "reading input file is terminated");
+            }
 
-    if (comm != NULL && sscanf(comm, "%f", &dtmp) == 1) {
-        cfg->srcdir.w = dtmp;
-    }
+            jbuf[len - 1] = '\0';
+            mcx_loadjsonmesh(jbuf, cfg);
 
-    if (in == stdin)
-        MMC_FPRINTF(stdout, ">> %f %f %f %f\nPlease specify the time gates in seconds (start end step) [0.0 1e-9 1e-10]\n\t",
-                    cfg->srcdir.x, cfg->srcdir.y, cfg->srcdir.z, cfg->srcdir.w);
+            if (mcx_loadfromjson(jbuf, cfg)) {
+                fclose(fp);
+                free(jbuf);
+                MMC_ERROR(-9, "invalid JSON input file");
+            }
 
-    MMC_ASSERT(fscanf(in, "%f %f %f", &(cfg->tstart), &(cfg->tend), &(cfg->tstep) ) == 3);
-    comm = fgets(comment, MAX_PATH_LENGTH, in);
+            free(jbuf);
+        } else if (strstr(fname, ".bjd") != NULL || strstr(fname, ".bmsh") != NULL) {
+            unsigned char* bbuf;
+            size_t len;
 
-    if (in == stdin)
-        MMC_FPRINTF(stdout, ">> %f %f %f\nPlease specify the mesh file key {node,elem,velem,facenb}_key.dat :\n\t",
-                    cfg->tstart, cfg->tend, cfg->tstep);
+            fclose(fp);
+            fp = fopen(fname, "rb");
+            fseek(fp, 0, SEEK_END);
+            len = ftell(fp);
+            rewind(fp);
 
-    if (cfg->tstart > cfg->tend || cfg->tstep == 0.f) {
-        MMC_ERROR(-9, "incorrect time gate settings");
-    }
+            /*the mesh arrays are copied straight from the mapped file*/
+#ifdef _WIN32
+            bbuf = (unsigned char*)malloc(len + 1);
 
-    if (cfg->tstep > cfg->tend - cfg->tstart) {
-        cfg->tstep = cfg->tend - cfg->tstart;
-    }
+            if (len && fread(bbuf, len, 1, fp) != 1) {
+                MMC_ERROR(-2, "reading input file is terminated");
+            }
 
-    gates = (int)((cfg->tend - cfg->tstart) / cfg->tstep + 0.5);
-    /*if(cfg->maxgate>gates)*/
-    cfg->maxgate = gates;
+#else
+            bbuf = (len) ? (unsigned char*)mmap(NULL, len, PROT_READ, MAP_PRIVATE, fileno(fp), 0) : NULL;
 
-    MMC_ASSERT(fscanf(in, "%s", cfg->meshtag) == 1);
+            if (bbuf == MAP_FAILED) {
+                MMC_ERROR(-2, "can not map the binary JData input file");
+            }
 
-    if (cfg->rootpath[0]) {
-#ifdef WIN32
-        sprintf(comment, "%s\\%s", cfg->rootpath, cfg->meshtag);
-#else
-        sprintf(comment, "%s/%s", cfg->rootpath, cfg->meshtag);
 #endif
-        memcpy(cfg->meshtag, comment, MAX_SESSION_LENGTH);
-    }
+            mcx_loadbjdata(bbuf, len, cfg);
+#ifdef _WIN32
+            free(bbuf);
+#else
 
-    comm = fgets(comment, MAX_PATH_LENGTH, in);
+            if (len) {
+                munmap(bbuf, len);
+            }
 
-    if (in == stdin) {
-        MMC_FPRINTF(stdout, ">> %s\nPlease specify the index to the tetrahedral element enclosing the source [start from 1]:\n\t", cfg->meshtag);
-    }
+#endif
+        } else {
+            mcx_loadconfig(fp, cfg);
+        }
 
-    MMC_ASSERT(fscanf(in, "%d", &(cfg->e0)) == 1);
-    comm = fgets(comment, MAX_PATH_LENGTH, in);
+        fclose(fp);
 
-    if (in == stdin) {
-        MMC_FPRINTF(stdout, ">> %d\nPlease specify the total number of detectors and detector diameter (in mm):\n\t", cfg->e0);
+        if (cfg->session[0] == '\0') {
+            strncpy(cfg->session, fname, MAX_SESSION_LENGTH - 1);
+        }
     }
+}
 
-    MMC_ASSERT(fscanf(in, "%d %f", &(cfg->detnum), &(cfg->detradius)) == 2);
-    comm = fgets(comment, MAX_PATH_LENGTH, in);
-
-    if (in == stdin) {
-        MMC_FPRINTF(stdout, ">> %d %f\n", cfg->detnum, cfg->detradius);
-    }
+/**
+ * @brief Load a .json input file into memory
+ *
+ * This function loads a JSON file using cJSON
+ *
+ * @param[out] jbuf: json data structure pointer
+ * @param[in] cfg: simulation configuration
+ */
 
-    cfg->detpos = (float4*)malloc(sizeof(float4) * cfg->detnum);
+int mcx_loadfromjson(char* jbuf, mcconfig* cfg) {
+    cJSON* jroot;
+    jroot = cJSON_Parse(jbuf);
 
-    if (cfg->issavedet) {
-        cfg->issavedet = (cfg->detpos > 0);
-    }
+    if (jroot) {
+        mcx_loadjson(jroot, cfg);
+        cJSON_Delete(jroot);
+    } else {
+        char* ptrold, *ptr = (char*)cJSON_GetErrorPtr();
 
-    for (i = 0; i < cfg->detnum; i++) {
-        if (in == stdin) {
-            MMC_FPRINTF(stdout, "Please define detector #%d: x,y,z (in mm): [5 5 5 1]\n\t", i);
+        if (ptr) {
+            ptrold = strstr(jbuf, ptr);
         }
 
-        MMC_ASSERT(fscanf(in, "%f %f %f", &(cfg->detpos[i].x), &(cfg->detpos[i].y), &(cfg->detpos[i].z)) == 3);
-        comm = fgets(comment, MAX_PATH_LENGTH, in);
+        if (ptr && ptrold) {
+            char* offs = (ptrold - jbuf >= 50) ? ptrold - 50 : jbuf;
 
-        if (comm != NULL && sscanf(comm, "%f", &dtmp) == 1) {
-            cfg->detpos[i].w = dtmp;
-        } else {
-            cfg->detpos[i].w = cfg->detradius;
-        }
+            while (offs < ptrold) {
+                MMC_FPRINTF(stderr, "%c", *offs);
+                offs++;
+            }
 
-        if (in == stdin) {
-            MMC_FPRINTF(stdout, ">> %f %f %f\n", cfg->detpos[i].x, cfg->detpos[i].y, cfg->detpos[i].z);
+            MMC_FPRINTF(stderr, S_RED"<error>%.50s\n"S_RESET, ptrold);
         }
-    }
 
-    if (in == stdin) {
-        MMC_FPRINTF(stdout, "Please specify the source type [pencil|isotropic|cone|gaussian|planar|pattern|fourier|arcsine|disk|fourierx|fourierx2d|zgaussian|line|slit]:\n\t");
+        return 1;
     }
 
-    if (fscanf(in, "%s", srctypestr) == 1 && srctypestr[0]) {
-        srctype = mcx_keylookup(srctypestr, srctypeid);
-
-        if (srctype == -1) {
-            MMC_ERROR(-6, "the specified source type is not supported");
-        }
-
-        if (srctype >= 0) {
-            comm = fgets(comment, MAX_PATH_LENGTH, in);
-            cfg->srctype = srctype;
+    return 0;
+}
 
-            if (in == stdin) {
-                MMC_FPRINTF(stdout, ">> %d\nPlease specify the source parameters set 1 (4 floating-points):\n\t", cfg->srctype);
-            }
+/**
+ * @brief Generate a box-shaped tetrahedral mesh in cfg->node and cfg->elem
+ *
+ * The box is made of dim.x*dim.y*dim.z cubic voxels, each split into 6
+ * tetrahedra sharing its main diagonal, so the mesh has 6*dim.x*dim.y*dim.z
+ * elements. The voxels in the bottom srclayer z-layers are labeled -1 to
+ * host wide-field sources, all other elements are labeled 1.
+ *
+ * @param[out] cfg: simulation configuration, node and elem are replaced
+ * @param[in] dim: number of voxels along x/y/z
+ * @param[in] step: voxel edge length in mm
+ * @param[in] origin: position of the lower corner of the box
+ * @param[in] srclayer: number of voxel layers at z=origin.z labeled as the source domain
+ */
 
-            MMC_ASSERT(fscanf(in, "%f %f %f %f", &(cfg->srcparam1.x), &(cfg->srcparam1.y), &(cfg->srcparam1.z), &(cfg->srcparam1.w)) == 4);
-            comm = fgets(comment, MAX_PATH_LENGTH, in);
+void mcx_genboxmesh(mcconfig* cfg, uint3 dim, float step, FLOAT3 origin, int srclayer) {
+    const int tet[6][4] = {{0, 1, 7, 3}, {0, 2, 3, 7}, {0, 1, 5, 7}, {0, 4, 7, 5}, {0, 2, 7, 6}, {0, 4, 6, 7}};
+    size_t nx = dim.x + 1, nxy = (size_t)(dim.x + 1) * (dim.y + 1), nodenum, elemnum, idx;
+    uint i, j, k, t, c;
 
-            if (in == stdin)
-                MMC_FPRINTF(stdout, ">> %f %f %f %f\nPlease specify the source parameters set 2 (4 floating-points):\n\t",
-                            cfg->srcparam1.x, cfg->srcparam1.y, cfg->srcparam1.z, cfg->srcparam1.w);
+    if (dim.x == 0 || dim.y == 0 || dim.z == 0 || step <= 0.f) {
+        MMC_ERROR(-1, "Mesh.MeshGen requires a positive Size and Step");
+    }
 
-            if (fscanf(in, "%f %f %f %f", &(cfg->srcparam2.x), &(cfg->srcparam2.y), &(cfg->srcparam2.z), &(cfg->srcparam2.w)) == 4) {
-                comm = fgets(comment, MAX_PATH_LENGTH, in);
+    nodenum = nxy * (dim.z + 1);
+    elemnum = (size_t)dim.x * dim.y * dim.z * 6;
 
-                if (in == stdin) {
-                    MMC_FPRINTF(stdout, ">> %f %f %f %f\n", cfg->srcparam2.x, cfg->srcparam2.y, cfg->srcparam2.z, cfg->srcparam2.w);
-                }
+    if (nodenum > 0x7FFFFFFF || elemnum > 0x7FFFFFFF) {
+        MMC_ERROR(-1, "Mesh.MeshGen generates too many nodes or elements");
+    }
 
-                if (cfg->srctype == stPattern && cfg->srcparam1.w * cfg->srcparam2.w > 0) {
-                    char srcpatternfile[MAX_PATH_LENGTH];
-                    FILE* fp;
+    if (cfg->node) {
+        free(cfg->node);
+    }
 
-                    if (in == stdin) {
-                        MMC_FPRINTF(stdout, "Please specify the number of source patterns and source pattern file name:\n\t");
-                    }
+    if (cfg->elem) {
+        free(cfg->elem);
+    }
 
-                    if (cfg->srcpattern) {
-                        free(cfg->srcpattern);
-                    }
+    cfg->nodenum = nodenum;
+    cfg->elemnum = elemnum;
+    cfg->elemlen = 4;
+    cfg->node = (FLOAT3*)malloc(sizeof(FLOAT3) * nodenum);
+    cfg->elem = (int*)malloc(sizeof(int) * elemnum * (cfg->elemlen + 1));
 
-                    // in case only one parameter is provided, use the default srcnum value (1)
-                    MMC_ASSERT(fscanf(in, "%s %d", srcpatternfile, &(cfg->srcnum)) >= 1);
+    if (cfg->node == NULL || cfg->elem == NULL) {
+        MMC_ERROR(-1, "not enough memory for the generated mesh");
+    }
 
-                    if (cfg->srcnum < 1) {
-                        MMC_ERROR(-6, "the number of patterns cannot be smaller than 1");
-                    }
+    for (k = 0, idx = 0; k <= dim.z; k++)
+        for (j = 0; j <= dim.y; j++)
+            for (i = 0; i <= dim.x; i++, idx++) {
+                cfg->node[idx].x = origin.x + i * step;
+                cfg->node[idx].y = origin.y + j * step;
+                cfg->node[idx].z = origin.z + k * step;
+            }
 
-                    cfg->srcpattern = (float*)calloc((cfg->srcparam1.w * cfg->srcparam2.w * cfg->srcnum), sizeof(float));
-                    comm = fgets(comment, MAX_PATH_LENGTH, in);
-                    fp = fopen(srcpatternfile, "rb");
+    for (k = 0, idx = 0; k < dim.z; k++)
+        for (j = 0; j < dim.y; j++)
+            for (i = 0; i < dim.x; i++) {
+                /*1-based indices of the voxel corners, x changes the fastest*/
+                size_t base = k * nxy + j * nx + i + 1;
+                int corner[8] = {(int)base, (int)(base + 1), (int)(base + nx), (int)(base + nx + 1),
+                                 (int)(base + nxy), (int)(base + nxy + 1), (int)(base + nxy + nx), (int)(base + nxy + nx + 1)
+                                };
 
-                    if (fp == NULL) {
-                        MMC_ERROR(-6, "source pattern file can not be opened");
+                for (t = 0; t < 6; t++, idx++) {
+                    for (c = 0; c < 4; c++) {
+                        cfg->elem[idx * 5 + c] = corner[tet[t][c]];
                     }
 
-                    MMC_ASSERT(fread(cfg->srcpattern, cfg->srcparam1.w * cfg->srcparam2.w * cfg->srcnum, sizeof(float), fp) == sizeof(float));
-                    fclose(fp);
+                    cfg->elem[idx * 5 + 4] = ((int)k < srclayer) ? -1 : 1;
                 }
             }
+}
 
-            if (cfg->detnum == 1 && cfg->detpos[0].w == 0.0) {
-                // only one detector and its radius is 0, indicates that we are using a wide-field detector
-                if (in == stdin) {
-                    MMC_FPRINTF(stdout, ">> \nPlease specify the detector parameters set 1 (4 floating-points):\n\t");
-                }
+/**
+ * @brief Load user inputs from a .json input file
+ *
+ * This function loads user input from a JSON format in a .json extension
+ *
+ * @param[out] root: json data structure pointer
+ * @param[in] cfg: simulation configuration
+ */
 
-                MMC_ASSERT(fscanf(in, "%f %f %f %f", &(cfg->detparam1.x), &(cfg->detparam1.y), &(cfg->detparam1.z), &(cfg->detparam1.w)) == 4);
-                comm = fgets(comment, MAX_PATH_LENGTH, in);
+int mcx_loadjson(cJSON* root, mcconfig* cfg) {
+    int i;
+    cJSON* Mesh, *Optode, *Forward, *Session, *Domain, *Camera, *tmp, *subitem;
+    uint3 gendim = {0, 0, 0};
+    FLOAT3 genorigin = {0.f, 0.f, 0.f};
+    float genstep = 1.f;
 
-                if (in == stdin)
-                    MMC_FPRINTF(stdout, ">> %f %f %f %f\nPlease specify the detector parameters set 2 (4 floating-points):\n\t",
-                                cfg->detparam1.x, cfg->detparam1.y, cfg->detparam1.z, cfg->detparam1.w);
+    Mesh    = cJSON_GetObjectItem(root, "Mesh");
 
-                MMC_ASSERT(fscanf(in, "%f %f %f %f", &(cfg->detparam2.x), &(cfg->detparam2.y), &(cfg->detparam2.z), &(cfg->detparam2.w)) == 4);
-                comm = fgets(comment, MAX_PATH_LENGTH, in);
+    if (!Mesh) {
+        Mesh    = cJSON_GetObjectItem(root, "Shapes");
+    }
 
-                if (in == stdin) {
-                    MMC_FPRINTF(stdout, ">> %f %f %f %f\n", cfg->detparam2.x, cfg->detparam2.y, cfg->detparam2.z, cfg->detparam2.w);
-                }
+    Optode  = cJSON_GetObjectItem(root, "Optode");
+    Session = cJSON_GetObjectItem(root, "Session");
+    Forward = cJSON_GetObjectItem(root, "Forward");
+    Domain  = cJSON_GetObjectItem(root, "Domain");
+    Camera  = cJSON_GetObjectItem(root, "Camera");
 
-                // only load detection pattern under replay mode
-                if (cfg->seed == SEED_FROM_FILE && (cfg->outputtype == otWL || cfg->outputtype == otWP) && cfg->detparam1.w * cfg->detparam2.w > 0) {
-                    if (in == stdin) {
-                        MMC_FPRINTF(stdout, "Please specify the detector pattern file name:\n\t");
-                    }
+    if (Camera)
+    {
+        cfg->cam_obj_dist = FIND_JSON_KEY("ObjectDistance", "Camera.ObjectDistance", Camera, cfg->cam_obj_dist, valuedouble);
+        cfg->cam_focal_length = FIND_JSON_KEY("FocalLength", "Camera.FocalLength", Camera, cfg->cam_focal_length, valuedouble);
+        cfg->cam_proj_dist = FIND_JSON_KEY("ProjectionDistance", "Camera.ProjectionDistance", Camera, cfg->cam_proj_dist, valuedouble);
+        cfg->cam_aperture_radius = FIND_JSON_KEY("ApertureRadius", "Camera.ApertureRadius", Camera, cfg->cam_aperture_radius, valuedouble);
+        cfg->cam_image_height = FIND_JSON_KEY("Height", "Camera.Height", Camera, cfg->cam_image_height, valueint);
+        cfg->cam_image_width = FIND_JSON_KEY("Width", "Camera.Width", Camera, cfg->cam_image_width, valueint);
+        cfg->cam_pixel_pitch = FIND_JSON_KEY("PixelPitch", "Camera.PixelPitch", Camera, cfg->cam_pixel_pitch, valueint);
 
-                    char detpatternfile[MAX_PATH_LENGTH];
-                    FILE* fp;
+        if (cfg->cam_obj_dist <= 0 || cfg->cam_focal_length <= 0 || cfg->cam_proj_dist <= 0 || cfg->cam_aperture_radius <= 0 || cfg->cam_image_height <= 0 || cfg->cam_image_width <= 0 || cfg->cam_pixel_pitch <= 0) {
+                MMC_ERROR(-1, "Missing or invalid camera parameters!");
+            }
 
-                    if (cfg->detpattern) {
-                        free(cfg->detpattern);
-                    }
+    }
 
-                    cfg->detpattern = (float*)calloc((cfg->detparam1.w * cfg->detparam2.w), sizeof(float));
-                    MMC_ASSERT(fscanf(in, "%s", detpatternfile) == 1);
-                    comm = fgets(comment, MAX_PATH_LENGTH, in);
-                    fp = fopen(detpatternfile, "rb");
+    if (Mesh) {
+        subitem = FIND_JSON_OBJ("MeshID", "Mesh.MeshID", Mesh);
 
-                    if (fp == NULL) {
-                        MMC_ERROR(-6, "detector pattern file can not be opened");
-                    }
+        if (subitem) {
+            strncpy(cfg->meshtag, FIND_JSON_KEY("MeshID", "Mesh.MeshID", Mesh, (MMC_ERROR(-1, "You must specify mesh files"), ""), valuestring), MAX_SESSION_LENGTH - 1);
+        }
 
-                    MMC_ASSERT(fread(cfg->detpattern, cfg->detparam1.w * cfg->detparam2.w, sizeof(float), fp) == sizeof(float));
-                    fclose(fp);
-                }
+        //< reading mesh node and elem mesh data from JSON file
+        {
+            int ndim;
+            uint dims[3] = {1, 1, 1};
+            char* type = NULL;
+
+            subitem = FIND_JSON_OBJ("MeshNode", "Mesh.MeshNode", Mesh);
+
+            if (subitem && !cJSON_IsNull(subitem)) {
+                if (cfg->node) {
+                    free(cfg->node);
+                    cfg->node = NULL;
+                }
+
+                if (cJSON_IsArray(subitem)) {
+                    cfg->nodenum = cJSON_GetArraySize(subitem);
+                    subitem = subitem->child;
+                    cfg->node = (FLOAT3*)malloc(sizeof(FLOAT3) * cfg->nodenum);
+
+                    for (int i = 0; i < cfg->nodenum; i++) {
+                        if (cJSON_GetArraySize(subitem) != 3) {
+                            MMC_ERROR(-1, "Each element in MeshNode must have 3 numbers");
+                        }
+
+                        cfg->node[i].x = subitem->child->valuedouble;
+                        cfg->node[i].y = subitem->child->next->valuedouble;
+                        cfg->node[i].z = subitem->child->next->next->valuedouble;
+                        subitem = subitem->next;
+                    }
+                } else {
+                    mcx_jdatadecode((void**)&cfg->node, &ndim, dims, 2, &type, subitem, cfg);
+
+                    if (strcmp(type, "single") || ndim != 2 || (ndim >= 2 && dims[1] != 3)) {
+                        if (cfg->node) {
+                            free(cfg->node);
+                        }
+
+                        MMC_ERROR(-1, "Mesh.MeshNode JData-annotated array must be in the 'single' format");
+                    } else {
+                        cfg->nodenum = dims[0];
+                    }
+                }
+            }
+
+            subitem = FIND_JSON_OBJ("MeshElem", "Mesh.MeshElem", Mesh);
+
+            if (subitem && !cJSON_IsNull(subitem)) {
+                if (cfg->elem) {
+                    free(cfg->elem);
+                    cfg->elem = NULL;
+                }
+
+                if (cJSON_IsArray(subitem)) {
+                    cfg->elemnum = cJSON_GetArraySize(subitem);
+                    subitem = subitem->child;
+                    cfg->elemlen = cJSON_GetArraySize(subitem);
+                    cfg->elem = (int*)malloc(sizeof(int) * cfg->elemnum * cfg->elemlen);
+
+                    for (int i = 0; i < cfg->elemnum; i++) {
+                        if (cJSON_GetArraySize(subitem) != 5) {
+                            MMC_ERROR(-1, "Each element in MeshElem must have 5 integers");
+                        }
+
+                        tmp = subitem->child;
+
+                        for (int j = 0; j < 5; j++) {
+                            cfg->elem[ i * cfg->elemlen + j ] = tmp->valueint;
+                            tmp = tmp->next;
+                        }
+
+                        subitem = subitem->next;
+                    }
+
+                    cfg->elemlen--; // to make cfg->elemlen and mesh->elemlen the same - cfg->elem contains 1 extra column for mesh->type
+                } else {
+                    mcx_jdatadecode((void**)&cfg->elem, &ndim, dims, 2, &type, subitem, cfg);
+
+                    if (!strstr(type, "int32") || ndim != 2 || (ndim >= 2 && dims[1] != 5 && dims[1] != 11)) {
+                        if (cfg->elem) {
+                            free(cfg->elem);
+                        }
+
+                        MMC_ERROR(-1, "Mesh.MeshElem JData-annotated array must be in the 'int32' format");
+                    } else {
+                        cfg->elemnum = dims[0];
+                        cfg->elemlen = dims[1] - 1;
+                    }
+                }
+            }
+
+            subitem = FIND_JSON_OBJ("MeshGen", "Mesh.MeshGen", Mesh);
+
+            if (subitem) {
+                cJSON* gen = subitem;
+                int gensrclayer = FIND_JSON_KEY("SrcLayer", "Mesh.MeshGen.SrcLayer", gen, 0, valueint);
+
+                genstep = FIND_JSON_KEY("Step", "Mesh.MeshGen.Step", gen, 1.0, valuedouble);
+                subitem = FIND_JSON_OBJ("Size", "Mesh.MeshGen.Size", gen);
+
+                if (subitem && cJSON_GetArraySize(subitem) == 3) {
+                    gendim.x = subitem->child->valueint;
+                    gendim.y = subitem->child->next->valueint;
+                    gendim.z = subitem->child->next->next->valueint;
+                }
+
+                subitem = FIND_JSON_OBJ("Origin", "Mesh.MeshGen.Origin", gen);
+
+                if (subitem && cJSON_GetArraySize(subitem) == 3) {
+                    genorigin.x = subitem->child->valuedouble;
+                    genorigin.y = subitem->child->next->valuedouble;
+                    genorigin.z = subitem->child->next->next->valuedouble;
+                }
+
+                mcx_genboxmesh(cfg, gendim, genstep, genorigin, gensrclayer);
+            }
+
+            subitem = FIND_JSON_OBJ("MeshROI", "Mesh.MeshROI", Mesh);
+
+            if (subitem && !cJSON_IsNull(subitem)) {
+                if (cfg->roidata) {
+                    free(cfg->roidata);
+                    cfg->roidata = NULL;
+                }
+
+                if (cJSON_IsArray(subitem)) {
+                    int collen, rowlen = cJSON_GetArraySize(subitem);
+                    subitem = subitem->child;
+
+                    if (cJSON_IsArray(subitem)) {
+                        collen = cJSON_GetArraySize(subitem);
+                    } else {
+                        collen = rowlen;
+                        rowlen = 1;
+                    }
+
+                    cfg->roitype = (collen == 6) ? rtEdge : ((collen == 1 || rowlen == 1) ? rtNode : (collen == 4 ? rtFace : rtNone));
+                    cfg->roidata = (float*)malloc(sizeof(float) * rowlen * collen);
+                    cfg->implicit = (cfg->roitype != rtNone) + (cfg->roitype == rtFace);
+
+                    for (int i = 0; i < rowlen; i++) {
+                        if (cJSON_GetArraySize(subitem) != collen) {
+                            MMC_ERROR(-1, "Each element in MeshROI must have the same length");
+                        }
+
+                        tmp = subitem->child;
+
+                        for (int j = 0; j < collen; j++) {
+                            cfg->roidata[ i * collen + j ] = tmp->valuedouble;
+                            tmp = tmp->next;
+                        }
+
+                        subitem = subitem->next;
+                    }
+                } else {
+                    mcx_jdatadecode((void**)&cfg->roidata, &ndim, dims, 2, &type, subitem, cfg);
+
+                    if (strcmp(type, "single") || ndim > 2 || (ndim >= 2 && dims[1] != 6 && dims[1] != 4)) {
+                        free(cfg->roidata);
+                        MMC_ERROR(-1, "Mesh.MeshROI JData-annotated array must be in the 'single' format");
+                    } else {
+                        cfg->roitype = (dims[1] == 6) ? rtEdge : ((ndim == 1 || dims[0] == 1 || dims[1] == 1) ? rtNode : (dims[1] == 4 ? rtFace : rtNone));
+                    }
+                }
             }
+        }
+
+        if (gendim.x > 0) {
+            cfg->e0 = FIND_JSON_KEY("InitElem", "Mesh.InitElem", Mesh, 0, valueint);
         } else {
-            return;
+            cfg->e0 = FIND_JSON_KEY("InitElem", "Mesh.InitElem", Mesh, (MMC_ERROR(-1, "InitElem must be given"), 0.0), valueint);
+        }
+
+        if (!flagset['u']) {
+            cfg->unitinmm = FIND_JSON_KEY("LengthUnit", "Mesh.LengthUnit", Mesh, 1.0, valuedouble);
+        }
+    }
+
+    if (Domain) {
+        cJSON* val, *meds = FIND_JSON_OBJ("Media", "Domain.Media", Domain);
+
+        if (meds) {
+            cJSON* med = meds->child;
+
+            if (med) {
+                cfg->medianum = cJSON_GetArraySize(meds);
+
+                if (cfg->prop) {
+                    free(cfg->prop);
+                }
+
+                cfg->prop = (medium*)malloc(sizeof(medium) * cfg->medianum);
+
+                for (i = 0; i < cfg->medianum; i++) {
+                    if (cJSON_IsObject(med)) {
+                        val = FIND_JSON_OBJ("mua", (MMC_ERROR(-1, "You must specify absorption coeff, default in 1/mm"), ""), med);
+
+                        if (val) {
+                            cfg->prop[i].mua = val->valuedouble;
+                        }
+
+                        val = FIND_JSON_OBJ("mus", (MMC_ERROR(-1, "You must specify scattering coeff, default in 1/mm"), ""), med);
+
+                        if (val) {
+                            cfg->prop[i].mus = val->valuedouble;
+                        }
+
+                        val = FIND_JSON_OBJ("g", (MMC_ERROR(-1, "You must specify anisotropy [0-1]"), ""), med);
+
+                        if (val) {
+                            cfg->prop[i].g = val->valuedouble;
+                        }
+
+                        val = FIND_JSON_OBJ("n", (MMC_ERROR(-1, "You must specify refractive index"), ""), med);
+
+                        if (val) {
+                            cfg->prop[i].n = val->valuedouble;
+                        }
+                    } else if (cJSON_IsArray(med)) {
+                        cfg->prop[i].mua = med->child->valuedouble;
+                        cfg->prop[i].mus = med->child->next->valuedouble;
+                        cfg->prop[i].g = med->child->next->next->valuedouble;
+                        cfg->prop[i].n = med->child->next->next->next->valuedouble;
+                    } else {
+                        MMC_ERROR(-1, "Session.Media must be either an array of objects or array of 4-elem numerical arrays");
+                    }
+
+                    med = med->next;
+
+                    if (med == NULL) {
+                        break;
+                    }
+                }
+            }
+        }
+
+        meds = FIND_JSON_OBJ("WaveMedia", "Domain.WaveMedia", Domain);
+
+        /*each element of WaveMedia lists all media of one additional wavelength, in the format of Domain.Media*/
+        if (meds && meds->child) {
+            cJSON* wave;
+            int medlen = cJSON_GetArraySize(meds->child);
+
+            for (wave = meds->child; wave; wave = wave->next) {
+                if (!cJSON_IsArray(wave) || cJSON_GetArraySize(wave) != medlen || (cfg->medianum && medlen != cfg->medianum)) {
+                    MMC_ERROR(-1, "each element of Domain.WaveMedia must list the same number of media as Domain.Media");
+                }
+            }
+
+            cfg->waveproplen = 0;
+            cfg->waveprop = (medium*)realloc(cfg->waveprop, sizeof(medium) * cJSON_GetArraySize(meds) * medlen);
+
+            for (wave = meds->child; wave; wave = wave->next) {
+                cJSON* med = wave->child;
+
+                for (; med; med = med->next, cfg->waveproplen++) {
+                    medium* prop = cfg->waveprop + cfg->waveproplen;
+
+                    if (cJSON_IsObject(med)) {
+                        prop->mua = FIND_JSON_KEY("mua", "Domain.WaveMedia.mua", med, 0.f, valuedouble);
+                        prop->mus = FIND_JSON_KEY("mus", "Domain.WaveMedia.mus", med, 0.f, valuedouble);
+                        prop->g = FIND_JSON_KEY("g", "Domain.WaveMedia.g", med, 1.f, valuedouble);
+                        prop->n = FIND_JSON_KEY("n", "Domain.WaveMedia.n", med, 1.f, valuedouble);
+                    } else if (cJSON_IsArray(med) && cJSON_GetArraySize(med) >= 2) {
+                        prop->mua = med->child->valuedouble;
+                        prop->mus = med->child->next->valuedouble;
+                        prop->g = (med->child->next->next) ? med->child->next->next->valuedouble : 1.f;
+                        prop->n = (med->child->next->next && med->child->next->next->next) ? med->child->next->next->next->valuedouble : 1.f;
+                    } else {
+                        MMC_ERROR(-1, "Domain.WaveMedia must contain arrays of objects or of numerical arrays");
+                    }
+                }
+            }
+        }
+
+        val = FIND_JSON_OBJ("Step", "Domain.Step", Domain);
+
+        if (val) {
+            if (cJSON_GetArraySize(val) >= 1) {
+                cfg->steps.x = val->child->valuedouble;
+                cfg->steps.y = cfg->steps.x;
+                cfg->steps.z = cfg->steps.x;
+            } else {
+                MMC_ERROR(-1, "Domain::Step has incorrect element numbers");
+            }
+        }
+
+        if (!flagset['u']) {
+            cfg->unitinmm = FIND_JSON_KEY("LengthUnit", "Domain.LengthUnit", Domain, 1.0, valuedouble);
+        }
+    }
+
+    if (Optode) {
+        cJSON* dets, *src = FIND_JSON_OBJ("Source", "Optode.Source", Optode);
+
+        if (src) {
+            subitem = FIND_JSON_OBJ("Pos", "Optode.Source.Pos", src);
+
+            if (subitem) {
+                cfg->srcpos.x = subitem->child->valuedouble;
+                cfg->srcpos.y = subitem->child->next->valuedouble;
+                cfg->srcpos.z = subitem->child->next->next->valuedouble;
+            }
+
+            subitem = FIND_JSON_OBJ("Dir", "Optode.Source.Dir", src);
+
+            if (subitem) {
+                cfg->srcdir.x = subitem->child->valuedouble;
+                cfg->srcdir.y = subitem->child->next->valuedouble;
+                cfg->srcdir.z = subitem->child->next->next->valuedouble;
+
+                if (subitem->child->next->next->next) {
+                    cfg->srcdir.w = subitem->child->next->next->next->valuedouble;
+                }
+            }
+
+            subitem = FIND_JSON_OBJ("Type", "Optode.Source.Type", src);
+
+            if (subitem) {
+                cfg->srctype = mcx_keylookup(subitem->valuestring, srctypeid);
+            }
+
+            subitem = FIND_JSON_OBJ("Param1", "Optode.Source.Param1", src);
+
+            if (subitem && cJSON_GetArraySize(subitem) == 4) {
+                cfg->srcparam1.x = subitem->child->valuedouble;
+
+                if (subitem->child->next) {
+                    cfg->srcparam1.y = subitem->child->next->valuedouble;
+
+                    if (subitem->child->next->next) {
+                        cfg->srcparam1.z = subitem->child->next->next->valuedouble;
+
+                        if (subitem->child->next->next->next) {
+                            cfg->srcparam1.w = subitem->child->next->next->next->valuedouble;
+                        }
+                    }
+                }
+            }
+
+            subitem = FIND_JSON_OBJ("Param2", "Optode.Source.Param2", src);
+
+            if (subitem && cJSON_GetArraySize(subitem) == 4) {
+                cfg->srcparam2.x = subitem->child->valuedouble;
+
+                if (subitem->child->next) {
+                    cfg->srcparam2.y = subitem->child->next->valuedouble;
+
+                    if (subitem->child->next->next) {
+                        cfg->srcparam2.z = subitem->child->next->next->valuedouble;
+
+                        if (subitem->child->next->next->next) {
+                            cfg->srcparam2.w = subitem->child->next->next->next->valuedouble;
+                        }
+                    }
+                }
+            }
+
+            subitem = FIND_JSON_OBJ("Pattern", "Optode.Source.Pattern", src);
+
+            if (subitem) {
+                if (FIND_JSON_OBJ("_ArrayZipData_", "Optode.Source.Pattern._ArrayZipData_", subitem)) {
+                    int ndim;
+                    uint dims[3] = {1, 1, 1};
+                    char* type = NULL;
+
+                    if (cfg->srcpattern) {
+                        free(cfg->srcpattern);
+                    }
+
+                    mcx_jdatadecode((void**)&cfg->srcpattern, &ndim, dims, 3, &type, subitem, cfg);
+
+                    if (strcmp(type, "single")) {
+                        if (cfg->srcpattern) {
+                            free(cfg->srcpattern);
+                        }
+
+                        MMC_ERROR(-1, "Optode.Source.Pattern JData-annotated array must be in the 'single' format");
+                    }
+
+                    if (ndim == 3 && dims[2] > 1 && dims[0] > 1 && cfg->srctype == MCX_SRC_PATTERN) {
+                        cfg->srcnum = dims[0];
+                    }
+
+                    mcx_convertrow2col(cfg->srcpattern, (uint3*)dims);
+                } else {
+                    int nx = FIND_JSON_KEY("Nx", "Optode.Source.Pattern.Nx", subitem, 0, valueint);
+                    int ny = FIND_JSON_KEY("Ny", "Optode.Source.Pattern.Ny", subitem, 0, valueint);
+                    int nz = FIND_JSON_KEY("Nz", "Optode.Source.Pattern.Nz", subitem, 1, valueint);
+
+                    if (nx > 0 && ny > 0) {
+                        cJSON* pat = FIND_JSON_OBJ("Data", "Optode.Source.Pattern.Data", subitem);
+
+                        if (pat && pat->child) {
+                            int i;
+                            pat = pat->child;
+
+                            if (cfg->srcpattern) {
+                                free(cfg->srcpattern);
+                            }
+
+                            cfg->srcpattern = (float*)calloc(nx * ny * nz * cfg->srcnum, sizeof(float));
+
+                            for (i = 0; i < nx * ny * nz * cfg->srcnum; i++) {
+                                if (pat == NULL) {
+                                    MMC_ERROR(-1, "Incomplete pattern data");
+                                }
+
+                                cfg->srcpattern[i] = pat->valuedouble;
+                                pat = pat->next;
+                            }
+                        } else if (pat) {
+                            FILE* fid = fopen(pat->valuestring, "rb");
+
+                            if (fid != NULL) {
+                                if (cfg->srcpattern) {
+                                    free(cfg->srcpattern);
+                                }
+
+                                cfg->srcpattern = (float*)calloc(nx * ny * nz * cfg->srcnum, sizeof(float));
+
+                                if (fread((void*)cfg->srcpattern, sizeof(float) * nx * ny * nz * cfg->srcnum, 1, fid) != 1) {
+                                    fclose(fid);
+                                    MMC_ERROR(-1, "Fail to read pattern input file");
+                                }
+
+                                fclose(fid);
+                            }
+                        }
+                    }
+                }
+            }
+        }
+
+        dets = FIND_JSON_OBJ("Detector", "Optode.Detector", Optode);
+
+        if (dets) {
+            cJSON* det = dets;
+
+            if (!FIND_JSON_OBJ("Pos", "Optode.Detector.Pos", dets)) {
+                det = dets->child;
+            }
+
+            if (det) {
+                cfg->detnum = cJSON_GetArraySize(dets);
+                cfg->detpos = (float4*)malloc(sizeof(float4) * cfg->detnum);
+
+                for (i = 0; i < cfg->detnum; i++) {
+                    cJSON* pos = dets, *rad = NULL;
+                    rad = FIND_JSON_OBJ("R", "Optode.Detector.R", det);
+
+                    if (cJSON_GetArraySize(det) == 2) {
+                        pos = FIND_JSON_OBJ("Pos", "Optode.Detector.Pos", det);
+                    }
+
+                    if (pos) {
+                        cfg->detpos[i].x = pos->child->valuedouble;
+                        cfg->detpos[i].y = pos->child->next->valuedouble;
+                        cfg->detpos[i].z = pos->child->next->next->valuedouble;
+                    }
+
+                    if (rad) {
+                        cfg->detpos[i].w = rad->valuedouble;
+                    }
+
+                    det = det->next;
+
+                    if (det == NULL) {
+                        break;
+                    }
+                }
+            }
+        }
+    }
+
+    if (Session) {
+        char val[2] = {'\0', '\0'};
+        cJSON* ck;
+
+        if (!flagset['E']) {
+            cfg->seed = FIND_JSON_KEY("RNGSeed", "Session.RNGSeed", Session, -1, valueint);
+        }
+
+        if (!flagset['n']) {
+            cfg->nphoton = FIND_JSON_KEY("Photons", "Session.Photons", Session, 0, valueint);
+        }
+
+        if (cfg->session[0] == '\0') {
+            strncpy(cfg->session, FIND_JSON_KEY("ID", "Session.ID", Session, "default", valuestring), MAX_SESSION_LENGTH);
+        }
+
+        if (!flagset['b']) {
+            cfg->isreflect = FIND_JSON_KEY("DoMismatch", "Session.DoMismatch", Session, cfg->isreflect, valueint);
+        }
+
+        if (!flagset['S']) {
+            cfg->issave2pt = FIND_JSON_KEY("DoSaveVolume", "Session.DoSaveVolume", Session, cfg->issave2pt, valueint);
+        }
+
+        if (!flagset['U']) {
+            cfg->isnormalized = FIND_JSON_KEY("DoNormalize", "Session.DoNormalize", Session, cfg->isnormalized, valueint);
+        }
+
+        if (!flagset['d']) {
+            cfg->issavedet = FIND_JSON_KEY("DoPartialPath", "Session.DoPartialPath", Session, cfg->issavedet, valueint);
+        }
+
+        if (!flagset['V']) {
+            cfg->isspecular = FIND_JSON_KEY("DoSpecular", "Session.DoSpecular", Session, cfg->isspecular, valueint);
+        }
+
+        if (!flagset['m']) {
+            cfg->ismomentum = FIND_JSON_KEY("DoDCS", "Session.DoDCS", Session, cfg->ismomentum, valueint);
+        }
+
+        if (!flagset['x']) {
+            cfg->issaveexit = FIND_JSON_KEY("DoSaveExit", "Session.DoSaveExit", Session, cfg->issaveexit, valueint);
+        }
+
+        if (!flagset['q']) {
+            cfg->issaveseed = FIND_JSON_KEY("DoSaveSeed", "Session.DoSaveSeed", Session, cfg->issaveseed, valueint);
+        }
+
+        if (!flagset['C']) {
+            cfg->basisorder = FIND_JSON_KEY("BasisOrder", "Session.BasisOrder", Session, cfg->basisorder, valueint);
+        }
+
+        if (!flagset['F']) {
+            cfg->outputformat = mcx_keylookup((char*)FIND_JSON_KEY("OutputFormat", "Session.OutputFormat", Session, "ascii", valuestring), outputformat);
+        }
+
+        if (cfg->outputformat < 0) {
+            MMC_ERROR(-2, "the specified output format is not recognized");
+        }
+
+        if (!flagset['D']) {
+            if (FIND_JSON_KEY("DebugFlag", "Session.DebugFlag", Session, "", valuestring)) {
+                cfg->debuglevel = mcx_parsedebugopt(FIND_JSON_KEY("DebugFlag", "Session.DebugFlag", Session, "", valuestring), debugflag);
+            } else {
+                cfg->debuglevel = FIND_JSON_KEY("DebugFlag", "Session.DebugFlag", Session, 0, valueint);
+            }
+        }
+
+        /*the flag given on the command line takes precedence*/
+        ck = FIND_JSON_OBJ("SaveDetFlag", "Session.SaveDetFlag", Session);
+
+        if (ck && cfg->savedetflag == 0x47) {
+            cfg->savedetflag = cJSON_IsString(ck) ? mcx_parsedebugopt(ck->valuestring, saveflag) : (unsigned int)ck->valueint;
+        }
+
+        if (!flagset['M']) {
+            strncpy(val, FIND_JSON_KEY("RayTracer", "Session.RayTracer", Session, raytracing + cfg->method, valuestring), 1);
+
+            if (mcx_lookupindex(val, raytracing)) {
+                MMC_ERROR(-2, "the specified ray-tracing method is not recognized");
+            }
+
+            cfg->method = val[0];
+        }
+
+        if (!flagset['O']) {
+            strncpy(val, FIND_JSON_KEY("OutputType", "Session.OutputType", Session, outputtype + cfg->outputtype, valuestring), 1);
+
+            if (mcx_lookupindex(val, outputtype)) {
+                MMC_ERROR(-2, "the specified output data type is not recognized");
+            }
+
+            cfg->outputtype = val[0];
+        }
+
+        ck = FIND_JSON_OBJ("Checkpoints", "Session.Checkpoints", Session);
+
+        if (ck) {
+            int num = MIN(cJSON_GetArraySize(ck), MAX_CHECKPOINT);
+            ck = ck->child;
+
+            for (i = 0; i < num; i++) {
+                cfg->checkpt[i] = ck->valueint;
+                ck = ck->next;
+
+                if (ck == NULL) {
+                    break;
+                }
+            }
+        }
+
+        if (cfg->ckptperiod == 0) {
+            cfg->ckptperiod = FIND_JSON_KEY("CheckpointPeriod", "Session.CheckpointPeriod", Session, 0.0, valuedouble);
+        }
+
+        /*the convergence settings given on the command line take precedence*/
+        if (cfg->convtarget == 0.f) {
+            cfg->convtarget = FIND_JSON_KEY("ConvTarget", "Session.ConvTarget", Session, 0.0, valuedouble);
+        }
+
+        if (cfg->convbatch == 0) {
+            cfg->convbatch = FIND_JSON_KEY("ConvBatch", "Session.ConvBatch", Session, 0, valueint);
+        }
+
+        if (cfg->varbatch == 0) {
+            cfg->varbatch = FIND_JSON_KEY("VarBatch", "Session.VarBatch", Session, 0, valueint);
+        }
+
+        if (cfg->hybrid == 0.f) {
+            cfg->hybrid = FIND_JSON_KEY("Hybrid", "Session.Hybrid", Session, 0.0, valuedouble);
+        }
+
+        if (cfg->trajsample == 1) {
+            cfg->trajsample = FIND_JSON_KEY("TrajSample", "Session.TrajSample", Session, 1, valueint);
+        }
+
+        if (cfg->rngtype == rngXorshift128p) {
+            cfg->rngtype = mcx_keylookup((char*)FIND_JSON_KEY("RNG", "Session.RNG", Session, rngtypename[rngXorshift128p], valuestring), rngtypename);
+
+            if (cfg->rngtype < 0) {
+                MMC_ERROR(-2, "the specified RNG is not recognized");
+            }
+        }
+
+        ck = FIND_JSON_OBJ("ConvROI", "Session.ConvROI", Session);
+
+        if (ck && cfg->convroi == NULL) {
+            cfg->convroinum = cJSON_GetArraySize(ck);
+            cfg->convroi = (int*)malloc(MAX(cfg->convroinum, 1) * sizeof(int));
+            ck = ck->child;
+
+            for (i = 0; i < cfg->convroinum && ck; i++) {
+                cfg->convroi[i] = ck->valueint;
+                ck = ck->next;
+            }
+        }
+
+        if (!cfg->isfloat16) {
+            cfg->isfloat16 = FIND_JSON_KEY("Float16", "Session.Float16", Session, cfg->isfloat16, valueint);
+        }
+
+        /*the output mask given on the command line takes precedence*/
+        if (cfg->outmask[0] == '\0') {
+            strncpy(cfg->outmask, FIND_JSON_KEY("OutputMask", "Session.OutputMask", Session, "", valuestring), MAX_PATH_LENGTH - 1);
+        }
+    }
+
+    if (Forward) {
+        cJSON* ck;
+
+        cfg->tstart = FIND_JSON_KEY("T0", "Forward.T0", Forward, 0.0, valuedouble);
+        cfg->tend  = FIND_JSON_KEY("T1", "Forward.T1", Forward, 0.0, valuedouble);
+        cfg->tstep = FIND_JSON_KEY("Dt", "Forward.Dt", Forward, 0.0, valuedouble);
+        cfg->nout = FIND_JSON_KEY("N0", "Forward.N0", Forward, cfg->nout, valuedouble);
+
+        cfg->maxgate = (int)((cfg->tend - cfg->tstart) / cfg->tstep + 0.5);
+
+        /*the modulation frequencies given on the command line take precedence*/
+        ck = FIND_JSON_OBJ("Freq", "Forward.Freq", Forward);
+
+        if (ck && cfg->freq == NULL) {
+            cfg->freqnum = (cJSON_IsArray(ck)) ? cJSON_GetArraySize(ck) : 1;
+            cfg->freq = (float*)malloc(MAX(cfg->freqnum, 1) * sizeof(float));
+
+            if (cJSON_IsArray(ck)) {
+                ck = ck->child;
+
+                for (i = 0; i < cfg->freqnum && ck; i++) {
+                    cfg->freq[i] = ck->valuedouble;
+                    ck = ck->next;
+                }
+            } else {
+                cfg->freq[0] = ck->valuedouble;
+            }
+        }
+    }
+
+    if (cfg->meshtag[0] == '\0' && cfg->nodenum == 0) {
+        MMC_ERROR(-1, "You must specify mesh files");
+    }
+
+    /*start from the voxel enclosing the source in a generated mesh, the exact element is located in tracer_prep*/
+    if (cfg->e0 == 0 && gendim.x > 0) {
+        int ix = MIN(MAX((int)((cfg->srcpos.x - genorigin.x) / genstep), 0), (int)gendim.x - 1);
+        int iy = MIN(MAX((int)((cfg->srcpos.y - genorigin.y) / genstep), 0), (int)gendim.y - 1);
+        int iz = MIN(MAX((int)((cfg->srcpos.z - genorigin.z) / genstep), 0), (int)gendim.z - 1);
+
+        cfg->e0 = (((size_t)iz * gendim.y + iy) * gendim.x + ix) * 6 + 1;
+    }
+
+    if (cfg->e0 == 0) {
+        MMC_ERROR(-1, "InitElem must be given");
+    }
+
+    if (cfg->isdumpjson == 3) {
+        mcx_savejdata(cfg->jsonfile, cfg);
+        exit(0);
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Read a numeric JSON array of exactly len elements, return 0 on success
+ */
+
+static int mcx_jobvector(cJSON* item, float* val, int len) {
+    cJSON* elem;
+    int i = 0;
+
+    if (!cJSON_IsArray(item) || cJSON_GetArraySize(item) != len) {
+        return -1;
+    }
+
+    cJSON_ArrayForEach(elem, item) {
+        if (!cJSON_IsNumber(elem)) {
+            return -1;
+        }
+
+        val[i++] = (float)elem->valuedouble;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Apply one job of the --serve queue to the simulation settings
+ *
+ * A job is a JSON object that may only change the fields a prepared mesh can
+ * be reused with, named as in the batch jobs of mmclab/pmmc: "nphoton",
+ * "seed", "srcpos", "srcdir", "srcparam1", "srcparam2", "detpos" (a list of
+ * [x,y,z,r]) and "prop" (medianum+1 rows of [mua,mus,g,n]), plus "id", the
+ * session name of the output files. Errors are reported in errmsg instead of
+ * terminating, so that one bad job does not stop the server.
+ *
+ * @param[in] job: the parsed JSON job
+ * @param[in,out] cfg: the simulation configuration, holding the base settings
+ * @param[in] medianum: the number of media of the mesh, excluding the background
+ * @param[out] med: receives the optical properties of the job if "prop" is given
+ * @param[out] errmsg: receives the error message, at least MAX_SESSION_LENGTH*2 characters
+ * @return 1 if the job changes the optical properties, 0 if not, -1 if the job is invalid
+ */
+
+int mcx_loadjob(cJSON* job, mcconfig* cfg, int medianum, medium* med, char* errmsg) {
+    const char* jobfields[] = {"id", "nphoton", "seed", "srcpos", "srcdir", "srcparam1", "srcparam2", "detpos", "prop"};
+    cJSON* item;
+    float4 vec;
+    int i, k, hasprop = 0;
+
+    if (!cJSON_IsObject(job)) {
+        strcpy(errmsg, "a job must be a JSON object");
+        return -1;
+    }
+
+    cJSON_ArrayForEach(item, job) {
+        for (k = 0; k < (int)(sizeof(jobfields) / sizeof(jobfields[0])); k++) {
+            if (strcmp(item->string, jobfields[k]) == 0) {
+                break;
+            }
+        }
+
+        if (k == (int)(sizeof(jobfields) / sizeof(jobfields[0]))) {
+            snprintf(errmsg, MAX_SESSION_LENGTH * 2, "unsupported job field '%.*s'", MAX_SESSION_LENGTH, item->string);
+            return -1;
+        }
+
+        if (k == 0) {
+            /*the id names the output files, so it must not contain a path*/
+            if (!cJSON_IsString(item) || item->valuestring[0] == '\0' || strlen(item->valuestring) >= MAX_SESSION_LENGTH
+                    || strspn(item->valuestring, "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789_-.") != strlen(item->valuestring)
+                    || item->valuestring[0] == '.') {
+                strcpy(errmsg, "the job id must be a file name of letters, digits, '_', '-' or '.'");
+                return -1;
+            }
+
+            strcpy(cfg->session, item->valuestring);
+        } else if (k == 1 || k == 2) {
+            if (!cJSON_IsNumber(item) || item->valuedouble < (k == 1)) {
+                strcpy(errmsg, (k == 1) ? "nphoton must be a positive number" : "seed must be a non-negative number");
+                return -1;
+            }
+
+            if (k == 1) {
+                cfg->nphoton = (size_t)item->valuedouble;
+            } else {
+                cfg->seed = (int)item->valuedouble;
+            }
+        } else if (k <= 6) {
+            if (mcx_jobvector(item, &vec.x, (k <= 4) ? 3 : 4)) {
+                snprintf(errmsg, MAX_SESSION_LENGTH * 2, "%s must be a list of %d numbers", jobfields[k], (k <= 4) ? 3 : 4);
+                return -1;
+            }
+
+            if (k == 3) {
+                memcpy(&cfg->srcpos, &vec, sizeof(float3));
+            } else if (k == 4) {
+                if (fabs(vec.x * vec.x + vec.y * vec.y + vec.z * vec.z - 1.f) > 1e-4) {
+                    strcpy(errmsg, "srcdir must be a unitary vector (tolerance is 1e-4)");
+                    return -1;
+                }
+
+                memcpy(&cfg->srcdir, &vec, sizeof(float3));
+            } else if (k == 5) {
+                cfg->srcparam1 = vec;
+            } else {
+                cfg->srcparam2 = vec;
+            }
+        } else if (k == 7) {
+            int detnum = cJSON_GetArraySize(item);
+            float4* detpos;
+
+            if (!cJSON_IsArray(item)) {
+                strcpy(errmsg, "detpos must be a list of [x,y,z,r] detectors");
+                return -1;
+            }
+
+            detpos = (float4*)malloc(sizeof(float4) * MAX(detnum, 1));
+
+            for (i = 0; i < detnum; i++) {
+                if (mcx_jobvector(cJSON_GetArrayItem(item, i), &detpos[i].x, 4)) {
+                    free(detpos);
+                    strcpy(errmsg, "detpos must be a list of [x,y,z,r] detectors");
+                    return -1;
+                }
+            }
+
+            free(cfg->detpos);
+            cfg->detpos = detpos;
+            cfg->detnum = detnum;
+        } else {
+            if (!cJSON_IsArray(item) || cJSON_GetArraySize(item) != medianum + 1) {
+                strcpy(errmsg, "prop must have the same number of media as the base input and 4 columns (mua,mus,g,n)");
+                return -1;
+            }
+
+            for (i = 0; i <= medianum; i++) {
+                if (mcx_jobvector(cJSON_GetArrayItem(item, i), &med[i].mua, 4)) {
+                    strcpy(errmsg, "prop must have the same number of media as the base input and 4 columns (mua,mus,g,n)");
+                    return -1;
+                }
+            }
+
+            hasprop = 1;
+        }
+    }
+
+    return hasprop;
+}
+
+/**
+ * @brief Write simulation settings to an inp file
+ *
+ * @param[in] fname: the name of the output file
+ * @param[in] cfg: simulation configuration
+ */
+
+void mcx_writeconfig(char* fname, mcconfig* cfg) {
+    if (fname[0] == 0) {
+        mcx_saveconfig(stdout, cfg);
+    } else {
+        FILE* fp = fopen(fname, "wt");
+
+        if (fp == NULL) {
+            MMC_ERROR(-2, "can not write to the specified config file");
+        }
+
+        mcx_saveconfig(fp, cfg);
+        fclose(fp);
+    }
+}
+
+/**
+ * @brief Load user inputs from a .inp input file
+ *
+ * This function loads user input from a simple text input format in a .inp extension
+ *
+ * @param[in] in: file handle to the .inp file
+ * @param[in] cfg: simulation configuration
+ */
+
+void mcx_loadconfig(FILE* in, mcconfig* cfg) {
+    int i, gates, srctype, itmp;
+    size_t nphoton;
+    float dtmp;
+    char comment[MAX_FULL_PATH], *comm, srctypestr[MAX_SESSION_LENGTH] = {'\0'};
+
+    if (in == stdin) {
+        MMC_FPRINTF(stdout, "Please specify the total number of photons: [1000000]\n\t");
+    }
+
+    MMC_ASSERT(fscanf(in, "%zu", &(nphoton) ) == 1);
+
+    if (cfg->nphoton == 0) {
+        cfg->nphoton = nphoton;
+    }
+
+    comm = fgets(comment, MAX_PATH_LENGTH, in);
+
+    if (in == stdin) {
+        MMC_FPRINTF(stdout, ">> %zu\nPlease specify the random number generator seed: [123456789]\n\t", cfg->nphoton);
+    }
+
+    if (cfg->seed == 0x623F9A9E) {
+        MMC_ASSERT(fscanf(in, "%d", &(cfg->seed) ) == 1);
+    } else {
+        MMC_ASSERT(fscanf(in, "%d", &itmp ) == 1);
+    }
+
+    comm = fgets(comment, MAX_PATH_LENGTH, in);
+
+    if (in == stdin) {
+        MMC_FPRINTF(stdout, ">> %d\nPlease specify the position of the source: [10 10 5]\n\t", cfg->seed);
+    }
+
+    MMC_ASSERT(fscanf(in, "%f %f %f", &(cfg->srcpos.x), &(cfg->srcpos.y), &(cfg->srcpos.z) ) == 3);
+    comm = fgets(comment, MAX_PATH_LENGTH, in);
+
+    if (in == stdin)
+        MMC_FPRINTF(stdout, ">> %f %f %f\nPlease specify the normal direction of the source: [0 0 1]\n\t",
+                    cfg->srcpos.x, cfg->srcpos.y, cfg->srcpos.z);
+
+    MMC_ASSERT(fscanf(in, "%f %f %f", &(cfg->srcdir.x), &(cfg->srcdir.y), &(cfg->srcdir.z)));
+    comm = fgets(comment, MAX_PATH_LENGTH, in);
+
+    if (comm != NULL && sscanf(comm, "%f", &dtmp) == 1) {
+        cfg->srcdir.w = dtmp;
+    }
+
+    if (in == stdin)
+        MMC_FPRINTF(stdout, ">> %f %f %f %f\nPlease specify the time gates in seconds (start end step) [0.0 1e-9 1e-10]\n\t",
+                    cfg->srcdir.x, cfg->srcdir.y, cfg->srcdir.z, cfg->srcdir.w);
+
+    MMC_ASSERT(fscanf(in, "%f %f %f", &(cfg->tstart), &(cfg->tend), &(cfg->tstep) ) == 3);
+    comm = fgets(comment, MAX_PATH_LENGTH, in);
+
+    if (in == stdin)
+        MMC_FPRINTF(stdout, ">> %f %f %f\nPlease specify the mesh file key {node,elem,velem,facenb}_key.dat :\n\t",
+                    cfg->tstart, cfg->tend, cfg->tstep);
+
+    if (cfg->tstart > cfg->tend || cfg->tstep == 0.f) {
+        MMC_ERROR(-9, "incorrect time gate settings");
+    }
+
+    if (cfg->tstep > cfg->tend - cfg->tstart) {
+        cfg->tstep = cfg->tend - cfg->tstart;
+    }
+
+    gates = (int)((cfg->tend - cfg->tstart) / cfg->tstep + 0.5);
+    /*if(cfg->maxgate>gates)*/
+    cfg->maxgate = gates;
+
+    MMC_ASSERT(fscanf(in, "%s", cfg->meshtag) == 1);
+
+    if (cfg->rootpath[0]) {
+#ifdef WIN32
+        sprintf(comment, "%s\\%s", cfg->rootpath, cfg->meshtag);
+#else
+        sprintf(comment, "%s/%s", cfg->rootpath, cfg->meshtag);
+#endif
+        memcpy(cfg->meshtag, comment, MAX_SESSION_LENGTH);
+    }
+
+    comm = fgets(comment, MAX_PATH_LENGTH, in);
+
+    if (in == stdin) {
+        MMC_FPRINTF(stdout, ">> %s\nPlease specify the index to the tetrahedral element enclosing the source [start from 1]:\n\t", cfg->meshtag);
+    }
+
+    MMC_ASSERT(fscanf(in, "%d", &(cfg->e0)) == 1);
+    comm = fgets(comment, MAX_PATH_LENGTH, in);
+
+    if (in == stdin) {
+        MMC_FPRINTF(stdout, ">> %d\nPlease specify the total number of detectors and detector diameter (in mm):\n\t", cfg->e0);
+    }
+
+    MMC_ASSERT(fscanf(in, "%d %f", &(cfg->detnum), &(cfg->detradius)) == 2);
+    comm = fgets(comment, MAX_PATH_LENGTH, in);
+
+    if (in == stdin) {
+        MMC_FPRINTF(stdout, ">> %d %f\n", cfg->detnum, cfg->detradius);
+    }
+
+    cfg->detpos = (float4*)malloc(sizeof(float4) * cfg->detnum);
+
+    if (cfg->issavedet) {
+        cfg->issavedet = (cfg->detpos > 0);
+    }
+
+    for (i = 0; i < cfg->detnum; i++) {
+        if (in == stdin) {
+            MMC_FPRINTF(stdout, "Please define detector #%d: x,y,z (in mm): [5 5 5 1]\n\t", i);
+        }
+
+        MMC_ASSERT(fscanf(in, "%f %f %f", &(cfg->detpos[i].x), &(cfg->detpos[i].y), &(cfg->detpos[i].z)) == 3);
+        comm = fgets(comment, MAX_PATH_LENGTH, in);
+
+        if (comm != NULL && sscanf(comm, "%f", &dtmp) == 1) {
+            cfg->detpos[i].w = dtmp;
+        } else {
+            cfg->detpos[i].w = cfg->detradius;
+        }
+
+        if (in == stdin) {
+            MMC_FPRINTF(stdout, ">> %f %f %f\n", cfg->detpos[i].x, cfg->detpos[i].y, cfg->detpos[i].z);
+        }
+    }
+
+    if (in == stdin) {
+        MMC_FPRINTF(stdout, "Please specify the source type [pencil|isotropic|cone|gaussian|planar|pattern|fourier|arcsine|disk|fourierx|fourierx2d|zgaussian|line|slit]:\n\t");
+    }
+
+    if (fscanf(in, "%s", srctypestr) == 1 && srctypestr[0]) {
+        srctype = mcx_keylookup(srctypestr, srctypeid);
+
+        if (srctype == -1) {
+            MMC_ERROR(-6, "the specified source type is not supported");
+        }
+
+        if (srctype >= 0) {
+            comm = fgets(comment, MAX_PATH_LENGTH, in);
+            cfg->srctype = srctype;
+
+            if (in == stdin) {
+                MMC_FPRINTF(stdout, ">> %d\nPlease specify the source parameters set 1 (4 floating-points):\n\t", cfg->srctype);
+            }
+
+            MMC_ASSERT(fscanf(in, "%f %f %f %f", &(cfg->srcparam1.x), &(cfg->srcparam1.y), &(cfg->srcparam1.z), &(cfg->srcparam1.w)) == 4);
+            comm = fgets(comment, MAX_PATH_LENGTH, in);
+
+            if (in == stdin)
+                MMC_FPRINTF(stdout, ">> %f %f %f %f\nPlease specify the source parameters set 2 (4 floating-points):\n\t",
+                            cfg->srcparam1.x, cfg->srcparam1.y, cfg->srcparam1.z, cfg->srcparam1.w);
+
+            if (fscanf(in, "%f %f %f %f", &(cfg->srcparam2.x), &(cfg->srcparam2.y), &(cfg->srcparam2.z), &(cfg->srcparam2.w)) == 4) {
+                comm = fgets(comment, MAX_PATH_LENGTH, in);
+
+                if (in == stdin) {
+                    MMC_FPRINTF(stdout, ">> %f %f %f %f\n", cfg->srcparam2.x, cfg->srcparam2.y, cfg->srcparam2.z, cfg->srcparam2.w);
+                }
+
+                if (cfg->srctype == stPattern && cfg->srcparam1.w * cfg->srcparam2.w > 0) {
+                    char srcpatternfile[MAX_PATH_LENGTH];
+                    FILE* fp;
+
+                    if (in == stdin) {
+                        MMC_FPRINTF(stdout, "Please specify the number of source patterns and source pattern file name:\n\t");
+                    }
+
+                    if (cfg->srcpattern) {
+                        free(cfg->srcpattern);
+                    }
+
+                    // in case only one parameter is provided, use the default srcnum value (1)
+                    MMC_ASSERT(fscanf(in, "%s %d", srcpatternfile, &(cfg->srcnum)) >= 1);
+
+                    if (cfg->srcnum < 1) {
+                        MMC_ERROR(-6, "the number of patterns cannot be smaller than 1");
+                    }
+
+                    cfg->srcpattern = (float*)calloc((cfg->srcparam1.w * cfg->srcparam2.w * cfg->srcnum), sizeof(float));
+                    comm = fgets(comment, MAX_PATH_LENGTH, in);
+                    fp = fopen(srcpatternfile, "rb");
+
+                    if (fp == NULL) {
+                        MMC_ERROR(-6, "source pattern file can not be opened");
+                    }
+
+                    MMC_ASSERT(fread(cfg->srcpattern, cfg->srcparam1.w * cfg->srcparam2.w * cfg->srcnum, sizeof(float), fp) == sizeof(float));
+                    fclose(fp);
+                }
+            }
+
+            if (cfg->detnum == 1 && cfg->detpos[0].w == 0.0) {
+                // only one detector and its radius is 0, indicates that we are using a wide-field detector
+                if (in == stdin) {
+                    MMC_FPRINTF(stdout, ">> \nPlease specify the detector parameters set 1 (4 floating-points):\n\t");
+                }
+
+                MMC_ASSERT(fscanf(in, "%f %f %f %f", &(cfg->detparam1.x), &(cfg->detparam1.y), &(cfg->detparam1.z), &(cfg->detparam1.w)) == 4);
+                comm = fgets(comment, MAX_PATH_LENGTH, in);
+
+                if (in == stdin)
+                    MMC_FPRINTF(stdout, ">> %f %f %f %f\nPlease specify the detector parameters set 2 (4 floating-points):\n\t",
+                                cfg->detparam1.x, cfg->detparam1.y, cfg->detparam1.z, cfg->detparam1.w);
+
+                MMC_ASSERT(fscanf(in, "%f %f %f %f", &(cfg->detparam2.x), &(cfg->detparam2.y), &(cfg->detparam2.z), &(cfg->detparam2.w)) == 4);
+                comm = fgets(comment, MAX_PATH_LENGTH, in);
+
+                if (in == stdin) {
+                    MMC_FPRINTF(stdout, ">> %f %f %f %f\n", cfg->detparam2.x, cfg->detparam2.y, cfg->detparam2.z, cfg->detparam2.w);
+                }
+
+                // only load detection pattern under replay mode
+                if (cfg->seed == SEED_FROM_FILE && (cfg->outputtype == otWL || cfg->outputtype == otWP) && cfg->detparam1.w * cfg->detparam2.w > 0) {
+                    if (in == stdin) {
+                        MMC_FPRINTF(stdout, "Please specify the detector pattern file name:\n\t");
+                    }
+
+                    char detpatternfile[MAX_PATH_LENGTH];
+                    FILE* fp;
+
+                    if (cfg->detpattern) {
+                        free(cfg->detpattern);
+                    }
+
+                    cfg->detpattern = (float*)calloc((cfg->detparam1.w * cfg->detparam2.w), sizeof(float));
+                    MMC_ASSERT(fscanf(in, "%s", detpatternfile) == 1);
+                    comm = fgets(comment, MAX_PATH_LENGTH, in);
+                    fp = fopen(detpatternfile, "rb");
+
+                    if (fp == NULL) {
+                        MMC_ERROR(-6, "detector pattern file can not be opened");
+                    }
+
+                    MMC_ASSERT(fread(cfg->detpattern, cfg->detparam1.w * cfg->detparam2.w, sizeof(float), fp) == sizeof(float));
+                    fclose(fp);
+                }
+            }
+        } else {
+            return;
+        }
+    } else {
+        return;
+    }
+}
+
+/**
+ * @brief Save simulation settings to an inp file
+ *
+ * @param[in] out: handle to the output file
+ * @param[in] cfg: simulation configuration
+ */
+
+void mcx_saveconfig(FILE* out, mcconfig* cfg) {
+    int i;
+
+    MMC_FPRINTF(out, "%zu\n", (cfg->nphoton) );
+    MMC_FPRINTF(out, "%d\n", (cfg->seed) );
+    MMC_FPRINTF(out, "%f %f %f\n", (cfg->srcpos.x), (cfg->srcpos.y), (cfg->srcpos.z) );
+    MMC_FPRINTF(out, "%f %f %f\n", (cfg->srcdir.x), (cfg->srcdir.y), (cfg->srcdir.z) );
+    MMC_FPRINTF(out, "%f %f %f\n", (cfg->tstart), (cfg->tend), (cfg->tstep) );
+    MMC_FPRINTF(out, "%f %d %d %d\n", (cfg->steps.x), (cfg->dim.x), (cfg->crop0.x), (cfg->crop1.x));
+    MMC_FPRINTF(out, "%f %d %d %d\n", (cfg->steps.y), (cfg->dim.y), (cfg->crop0.y), (cfg->crop1.y));
+    MMC_FPRINTF(out, "%f %d %d %d\n", (cfg->steps.z), (cfg->dim.z), (cfg->crop0.z), (cfg->crop1.z));
+    MMC_FPRINTF(out, "%d", (cfg->medianum));
+
+    for (i = 0; i < cfg->medianum; i++) {
+        MMC_FPRINTF(out, "%f %f %f %f\n", (cfg->prop[i].mus), (cfg->prop[i].g), (cfg->prop[i].mua), (cfg->prop[i].n));
+    }
+
+    MMC_FPRINTF(out, "%d", (cfg->detnum));
+
+    for (i = 0; i < cfg->detnum; i++) {
+        MMC_FPRINTF(out, "%f %f %f %f\n", (cfg->detpos[i].x), (cfg->detpos[i].y), (cfg->detpos[i].z), (cfg->detpos[i].w));
+    }
+}
+
+
+/**
+ * @brief Convert the simulation settings to a JSON string
+ *
+ * With iskey set, the string is the compact form used as a key of the result
+ * cache (--resultcache): the session ID, the root path and the mesh data,
+ * which are hashed separately from the prepared mesh, are left out.
+ *
+ * @param[in] cfg: simulation configuration
+ * @param[in] iskey: 0 for the indented JSON input file, 1 for the cache key
+ * @return the JSON string, to be freed by the caller, or NULL on failure
+ */
+
+char* mcx_jdataconfig(mcconfig* cfg, int iskey) {
+    cJSON* root = NULL, *obj = NULL, *sub = NULL, *tmp = NULL;
+    char* jsonstr = NULL;
+    int i;
+    root = cJSON_CreateObject();
+
+    /* the "Session" section */
+    cJSON_AddItemToObject(root, "Session", obj = cJSON_CreateObject());
+
+    if (!iskey) {
+        cJSON_AddStringToObject(obj, "ID", cfg->session);
+    }
+
+    cJSON_AddNumberToObject(obj, "Photons", cfg->nphoton);
+    cJSON_AddNumberToObject(obj, "RNGSeed", (uint)cfg->seed);
+
+    if (cfg->isreflect > 1) {
+        cJSON_AddNumberToObject(obj, "DoMismatch", cfg->isreflect);
+    } else {
+        cJSON_AddBoolToObject(obj, "DoMismatch", cfg->isreflect);
+    }
+
+    cJSON_AddBoolToObject(obj, "DoSaveVolume", cfg->issave2pt);
+
+    if (cfg->isreflect > 1) {
+        cJSON_AddNumberToObject(obj, "DoNormalize", cfg->isnormalized);
+    } else {
+        cJSON_AddBoolToObject(obj, "DoNormalize", cfg->isnormalized);
+    }
+
+    cJSON_AddBoolToObject(obj, "DoPartialPath", cfg->issavedet);
+
+    if (cfg->issaveref) {
+        cJSON_AddNumberToObject(obj, "DoSaveRef", cfg->issaveref);
+    } else {
+        cJSON_AddBoolToObject(obj, "DoSaveRef", cfg->issaveref);
+    }
+
+    cJSON_AddBoolToObject(obj, "DoSaveExit", cfg->issaveexit);
+    cJSON_AddBoolToObject(obj, "DoSaveSeed", cfg->issaveseed);
+    cJSON_AddBoolToObject(obj, "DoAutoThread", cfg->autopilot);
+    cJSON_AddBoolToObject(obj, "DoDCS", cfg->ismomentum);
+    cJSON_AddBoolToObject(obj, "DoSpecular", cfg->isspecular);
+
+    if (cfg->rootpath[0] != '\0' && !iskey) {
+        cJSON_AddStringToObject(obj, "RootPath", cfg->rootpath);
+    }
+
+    cJSON_AddNumberToObject(obj, "DebugFlag", cfg->debuglevel);
+    cJSON_AddNumberToObject(obj, "SaveDetFlag", cfg->savedetflag);
+    cJSON_AddNumberToObject(obj, "BasisOrder", cfg->basisorder);
+
+    {
+        char cflag[2] = {'\0', '\0'};
+        cflag[0] = raytracing[(int)cfg->method];
+        cJSON_AddStringToObject(obj, "RayTracer", cflag);
+    }
+
+    if (cfg->outputformat >= 0) {
+        cJSON_AddStringToObject(obj, "OutputFormat", outputformat[(int)cfg->outputformat]);
+    }
+
+    if (cfg->outputtype >= 0) {
+        char outputtypestr[2] = {'\0'};
+        outputtypestr[0] = outputtype[(int)cfg->outputtype];
+        cJSON_AddStringToObject(obj, "OutputType", outputtypestr);
+    }
+
+    if (cfg->isfloat16) {
+        cJSON_AddNumberToObject(obj, "Float16", cfg->isfloat16);
+    }
+
+    /* the "Forward" section */
+    cJSON_AddItemToObject(root, "Forward", obj = cJSON_CreateObject());
+    cJSON_AddNumberToObject(obj, "T0", cfg->tstart);
+    cJSON_AddNumberToObject(obj, "T1", cfg->tend);
+    cJSON_AddNumberToObject(obj, "Dt", cfg->tstep);
+
+    if (cfg->nout > 1.f) {
+        cJSON_AddNumberToObject(obj, "N0", cfg->nout);
+    }
+
+    if (cfg->freqnum > 0) {
+        cJSON_AddItemToObject(obj, "Freq", cJSON_CreateFloatArray(cfg->freq, cfg->freqnum));
+    }
+
+    /* the "Domain" section */
+    cJSON_AddItemToObject(root, "Domain", obj = cJSON_CreateObject());
+    cJSON_AddNumberToObject(obj, "LengthUnit", cfg->unitinmm);
+    cJSON_AddItemToObject(obj, "Media", sub = cJSON_CreateArray());
+
+    for (i = 0; i < cfg->medianum; i++) {
+        cJSON_AddItemToArray(sub, tmp = cJSON_CreateObject());
+        cJSON_AddNumberToObject(tmp, "mua", cfg->prop[i].mua / cfg->unitinmm);
+        cJSON_AddNumberToObject(tmp, "mus", cfg->prop[i].mus / cfg->unitinmm);
+        cJSON_AddNumberToObject(tmp, "g",   cfg->prop[i].g);
+        cJSON_AddNumberToObject(tmp, "n",   cfg->prop[i].n);
+    }
+
+    cJSON_AddItemToObject(obj, "Dim", cJSON_CreateIntArray((int*) & (cfg->dim.x), 3));
+
+    /* the "Optode" section */
+    cJSON_AddItemToObject(root, "Optode", obj = cJSON_CreateObject());
+    cJSON_AddItemToObject(obj, "Source", sub = cJSON_CreateObject());
+
+    if (cfg->srctype >= 0) {
+        cJSON_AddStringToObject(sub, "Type", srctypeid[(int)cfg->srctype]);
+    }
+
+    cJSON_AddItemToObject(sub, "Pos", cJSON_CreateFloatArray(&(cfg->srcpos.x), 3));
+    cJSON_AddItemToObject(sub, "Dir", cJSON_CreateFloatArray(&(cfg->srcdir.x), 4));
+    cJSON_AddItemToObject(sub, "Param1", cJSON_CreateFloatArray(&(cfg->srcparam1.x), 4));
+    cJSON_AddItemToObject(sub, "Param2", cJSON_CreateFloatArray(&(cfg->srcparam2.x), 4));
+    cJSON_AddNumberToObject(sub, "SrcNum", cfg->srcnum);
+
+    cJSON_AddItemToObject(obj, "Detector", sub = cJSON_CreateArray());
+
+    for (i = 0; i < cfg->detnum; i++) {
+        cJSON_AddItemToArray(sub, tmp = cJSON_CreateObject());
+        cJSON_AddItemToObject(tmp, "Pos", cJSON_CreateFloatArray(&(cfg->detpos[i].x), 3));
+        cJSON_AddNumberToObject(tmp, "R", cfg->detpos[i].w);
+    }
+
+    /* save "Shapes" constructs, containing InitElem, MeshNode, MeshElem, and MeshROI */
+    cJSON_AddItemToObject(root, "Shapes", obj = cJSON_CreateObject());
+
+    if (iskey) {
+        /* the mesh is part of the key by the content of the prepared mesh */
+    } else if (cfg->meshtag[0] && cfg->nodenum == 0) {
+        cJSON_AddStringToObject(obj, "MeshID", cfg->meshtag);
+    } else if (cfg->nodenum && cfg->elemnum) {
+        uint dims[2] = {0};
+        cJSON_AddItemToObject(obj, "MeshNode", sub = cJSON_CreateObject());
+
+        dims[0] = cfg->nodenum;
+        dims[1] = 3;
+
+        if (mcx_jdataencode((void*)cfg->node, 2, dims, "single", 4, cfg->zipid, sub, 0, 0, cfg)) {
+            MMC_ERROR(-10, "saving node data to JSON failed");
+        }
+
+        cJSON_AddItemToObject(obj, "MeshElem", sub = cJSON_CreateObject());
+
+        dims[0] = cfg->elemnum;
+        dims[1] = cfg->elemlen + 1;
+
+        if (mcx_jdataencode((void*)cfg->elem, 2, dims, "int32", 4, cfg->zipid, sub, 0, 0, cfg)) {
+            MMC_ERROR(-10, "saving elem data to JSON failed");
+        }
+
+        if (cfg->roidata) {
+            cJSON_AddItemToObject(obj, "MeshROI", sub = cJSON_CreateObject());
+
+            dims[0] = (cfg->roitype == rtNode ? cfg->nodenum : cfg->elemnum);
+            dims[1] = (cfg->roitype == rtNode ? 1 : (cfg->roitype == rtEdge ? 6 : 4));
+
+            if (mcx_jdataencode((void*)cfg->roidata, 2, dims, "single", 4, cfg->zipid, sub, 0, 0, cfg)) {
+                MMC_ERROR(-10, "saving mesh ROI data to JSON failed");
+            }
+        }
+    } else {
+        MMC_ERROR(-10, "incomplete mesh data");
+    }
+
+    cJSON_AddNumberToObject(obj, "InitElem", cfg->e0);
+
+    jsonstr = iskey ? cJSON_PrintUnformatted(root) : cJSON_Print(root);
+    cJSON_Delete(root);
+    return jsonstr;
+}
+
+/**
+ * @brief Save simulation settings to a JSON input file
+ *
+ * @param[in] filename: the output file name, or - to print to the log
+ * @param[in] cfg: simulation configuration
+ */
+
+void mcx_savejdata(char* filename, mcconfig* cfg) {
+    /* now save JSON to file */
+    char* jsonstr = mcx_jdataconfig(cfg, 0);
+
+    if (jsonstr == NULL) {
+        MMC_ERROR(-1, "error when converting to JSON");
+    }
+
+    if (!strcmp(filename, "-")) {
+        fprintf(cfg->flog, "%s\n", jsonstr);
+    } else {
+        FILE* fp = fopen(filename, "wt");
+
+        if (fp == NULL) {
+            MMC_ERROR(-1, "error opening file to write");
+        }
+
+        fprintf(fp, "%s\n", jsonstr);
+        fclose(fp);
+    }
+
+    free(jsonstr);
+}
+
+#endif
+
+/**
+ * @brief Convert a column-major (MATLAB/FORTRAN) array to a row-major (C/C++) array
+ *
+ * @param[in,out] vol: a 3D array (wrapped in 1D) to be converted
+ * @param[in] dim: the dimensions of the 3D array
+ */
+
+void  mcx_convertcol2row(unsigned int** vol, uint3* dim) {
+    uint x, y, z;
+    unsigned int dimxy, dimyz;
+    unsigned int* newvol = NULL;
+
+    if (*vol == NULL || dim->x == 0 || dim->y == 0 || dim->z == 0) {
+        return;
+    }
+
+    newvol = (unsigned int*)malloc(sizeof(unsigned int) * dim->x * dim->y * dim->z);
+    dimxy = dim->x * dim->y;
+    dimyz = dim->y * dim->z;
+
+    for (z = 0; z < dim->z; z++)
+        for (y = 0; y < dim->y; y++)
+            for (x = 0; x < dim->x; x++) {
+                newvol[x * dimyz + y * dim->z + z] = (*vol)[z * dimxy + y * dim->x + x];
+            }
+
+    free(*vol);
+    *vol = newvol;
+}
+
+/**
+ * @brief Convert a column-major (MATLAB/FORTRAN) array to a row-major (C/C++) array
+ *
+ * @param[in,out] vol: a 3D array (wrapped in 1D) to be converted
+ * @param[in] dim: the dimensions of the 3D array
+ */
+
+void  mcx_convertcol2row4d(unsigned int** vol, uint4* dim) {
+    uint x, y, z, w;
+    unsigned int dimxyz, dimyzw, dimxy, dimzw;
+    unsigned int* newvol = NULL;
+
+    if (*vol == NULL || dim->x == 0 || dim->y == 0 || dim->z == 0 || dim->w == 0) {
+        return;
+    }
+
+    newvol = (unsigned int*)malloc(sizeof(unsigned int) * dim->x * dim->y * dim->z * dim->w);
+    dimxyz = dim->x * dim->y * dim->z;
+    dimyzw = dim->y * dim->z * dim->w;
+    dimxy = dim->x * dim->y;
+    dimzw = dim->z * dim->w;
+
+    for (w = 0; w < dim->w; w++)
+        for (z = 0; z < dim->z; z++)
+            for (y = 0; y < dim->y; y++)
+                for (x = 0; x < dim->x; x++) {
+                    newvol[x * dimyzw + y * dimzw + z * dim->w + w] = (*vol)[w * dimxyz + z * dimxy + y * dim->x + x];
+                }
+
+    free(*vol);
+    *vol = newvol;
+}
+
+#ifndef MCX_CONTAINER
+
+
+/**
+ * @brief Decode an ND array from JSON/JData construct and output to a volumetric array
+ *
+ * The JData specification defines a portable way to encode and share volumetric
+ * ND arrays and other complex data structures, such as trees, graphs and tables.
+ * This function is capable of importing any ND numerical arrays in the JData
+ * construct in to a generic array, permitting data decompression and base64 decoding.
+ *
+ * @param[in] vol: a pointer that points to the ND array buffer
+ * @param[in] ndim: the number of dimensions
+ * @param[in] dims: an integer pointer that points to the dimensional vector
+ * @param[in] type: a string of JData data types, such as "uint8" "float32", "int32" etc
+ * @param[in] byte: number of byte per voxel
+ * @param[in] zipid: zip method: 0:zlib,1:gzip,2:base64,3:lzma,4:lzip,5:lz4,6:lz4hc
+ * @param[in] obj: a pre-created cJSON object to store the output JData fields
+ */
+
+int  mcx_jdatadecode(void** vol, int* ndim, uint* dims, int maxdim, char** type, cJSON* obj, mcconfig* cfg) {
+    int ret = 0;
+    cJSON* ztype = NULL;
+    cJSON* vsize = cJSON_GetObjectItem(obj, "_ArraySize_");
+    cJSON* vtype = cJSON_GetObjectItem(obj, "_ArrayType_");
+    cJSON* vdata = cJSON_GetObjectItem(obj, "_ArrayData_");
+
+    if (!vdata) {
+        ztype = cJSON_GetObjectItem(obj, "_ArrayZipType_");
+        vdata = cJSON_GetObjectItem(obj, "_ArrayZipData_");
+    }
+
+    if (!flagset['K'] && vtype) {
+        *type = vtype->valuestring;
+
+        if (strstr(*type, "int8")) {
+            cfg->mediabyte = 1;
+        } else if (strstr(*type, "int16")) {
+            cfg->mediabyte = 2;
+        } else if (strstr(*type, "double") || strstr(*type, "int64")) {
+            MMC_ERROR(-1, "8-byte volume array is not supported");
+        } else {
+            cfg->mediabyte = 4;
+        }
+    }
+
+    if (vdata) {
+        if (vsize) {
+            cJSON* tmp = vsize->child;
+            *ndim = cJSON_GetArraySize(vsize);
+
+            for (int i = 0; i < MIN(maxdim, *ndim); i++) {
+                dims[i] = tmp->valueint;
+                tmp = tmp->next;
+            }
+        }
+
+        if (ztype) {
+            size_t len, newlen;
+            int status = 0;
+            char* buf = NULL;
+            int zipid = mcx_keylookup((char*)(ztype->valuestring), zipformat);
+            ret = zmat_decode(strlen(vdata->valuestring), (uchar*)vdata->valuestring, &len, (uchar**)&buf, zmBase64, &status);
+
+            if (!ret && vsize) {
+                if (*vol) {
+                    free(*vol);
+                }
+
+                ret = zmat_decode(len, (uchar*)buf, &newlen, (uchar**)(vol), zipid, &status);
+            }
+
+            if (buf) {
+                free(buf);
+            }
+
+            cfg->isrowmajor = 1;
+        } else {
+            MMC_ERROR(-1, "Only compressed JData array constructs are supported");
+        }
+    } else {
+        MMC_ERROR(-1, "No _ArrayZipData_ field is found");
+    }
+
+    return ret;
+}
+
+/**
+ * @brief Compress a data buffer for a JData construct
+ *
+ * zlib and gzip outputs larger than MAX_ZIP_BLOCK bytes are cut into blocks
+ * compressed independently by the OpenMP threads and joined into a single
+ * standard stream, which zmat and any other zlib/gzip decoder can read. Other
+ * methods, small buffers and single-threaded runs use zmat_encode directly.
+ *
+ * @param[in] totalbytes: the length of the input buffer in bytes
+ * @param[in] vol: the input buffer
+ * @param[out] compressedbytes: the length of the compressed buffer
+ * @param[out] compressed: the compressed buffer, to be freed by the caller
+ * @param[in] zipid: zip method, see mcx_jdataencode
+ * @param[out] status: encoder specific error code
+ * @return the zmat error code, 0 if successful
+ */
+
+static int mcx_zipencode(size_t totalbytes, uchar* vol, size_t* compressedbytes, uchar** compressed, int zipid, int* status) {
+    int nblock = (int)((totalbytes + MAX_ZIP_BLOCK - 1) / MAX_ZIP_BLOCK), nthread = 1, ret = 0, i;
+    size_t* blocklen;
+    uchar** block;
+    unsigned long* checksum;
+
+#ifdef _OPENMP
+    nthread = omp_get_max_threads();
+#endif
+
+    if ((zipid != zmZlib && zipid != zmGzip) || nblock < 2 || nthread < 2) {
+        return zmat_encode(totalbytes, vol, compressedbytes, compressed, zipid, status);
+    }
+
+    blocklen = (size_t*)calloc(nblock << 1, sizeof(size_t)); /*uncompressed lengths, followed by compressed lengths*/
+    block = (uchar**)calloc(nblock, sizeof(uchar*));
+    checksum = (unsigned long*)calloc(nblock, sizeof(unsigned long));
+
+    #pragma omp parallel for schedule(dynamic, 1)
+
+    for (i = 0; i < nblock; i++) {
+        int blockstatus = 0, blockret;
+
+        blocklen[i] = MIN(MAX_ZIP_BLOCK, totalbytes - (size_t)i * MAX_ZIP_BLOCK);
+        blockret = zmat_encodeblock(blocklen[i], vol + (size_t)i * MAX_ZIP_BLOCK, blocklen + nblock + i, block + i, zipid, (i == nblock - 1), checksum + i, &blockstatus);
+
+        if (blockret) {
+            #pragma omp critical
+            {
+                ret = blockret;
+                *status = blockstatus;
+            }
+        }
+    }
+
+    if (!ret) {
+        ret = zmat_joinblocks(nblock, blocklen, blocklen + nblock, block, checksum, compressedbytes, compressed, zipid);
+    }
+
+    for (i = 0; i < nblock; i++) {
+        free(block[i]);
+    }
+
+    free(blocklen);
+    free(block);
+    free(checksum);
+    return ret;
+}
+
+/**
+ * @brief Export an ND volumetric image to JSON/JData encoded construct
+ *
+ * The JData specification defines a portable way to encode and share volumetric
+ * ND arrays and other complex data structures, such as trees, graphs and tables.
+ * This function is capable of exporting any ND numerical arrays into a JData
+ * construct, permitting data compression and base64 encoding.
+ *
+ * @param[in] vol: a pointer that points to the ND array buffer
+ * @param[in] ndim: the number of dimensions
+ * @param[in] dims: an integer pointer that points to the dimensional vector
+ * @param[in] type: a string of JData data types, such as "uint8" "float32", "int32" etc
+ * @param[in] byte: number of byte per voxel
+ * @param[in] zipid: zip method: 0:zlib,1:gzip,2:base64,3:lzma,4:lzip,5:lz4,6:lz4hc
+ * @param[in] obj: a pre-created cJSON or UBJ object to store the output JData fields
+ * @param[in] isubj: 1 if obj is a binary JSON (UBJ) object, 0 if obj is a cJSON object
+ * @param[in] cfg: mcx config struct
+ */
+
+int  mcx_jdataencode(void* vol, int ndim, uint* dims, char* type, int byte, int zipid, void* obj, int isubj, int iscol, mcconfig* cfg) {
+    uint datalen = 1;
+    size_t compressedbytes, totalbytes;
+    uchar* compressed = NULL, *buf = NULL;
+    int ret = 0, status = 0, isquiet = cfg->isdumpjson;
+
+#ifdef _OPENMP
+    /*the concurrent encoders of mcx_savejdet would interleave the progress messages*/
+    isquiet |= omp_in_parallel();
+#endif
+
+    for (int i = 0; i < ndim; i++) {
+        datalen *= dims[i];
+    }
+
+    totalbytes = (size_t)datalen * byte;
+
+    if (!isquiet) {
+        MMC_FPRINTF(cfg->flog, "compressing data [%s] ...", zipformat[zipid]);
+    }
+
+    /*compress data using zlib*/
+    if (zipid != zmBase64) {
+        ret = mcx_zipencode(totalbytes, (uchar*)vol, &compressedbytes, &compressed, zipid, &status);
+    } else {
+        compressed = (uchar*)vol;
+        compressedbytes = totalbytes;
+    }
+
+    if (!ret) {
+        if (!isquiet) {
+            MMC_FPRINTF(cfg->flog, "compression ratio: %.1f%%\t", compressedbytes * 100.f / totalbytes);
+        }
+
+        if (isubj) {
+            ubjw_context_t* item = (ubjw_context_t*)obj;
+            UBJ_WRITE_KEY(item, "_ArrayType_", string, type);
+            ubjw_write_key(item, "_ArraySize_");
+            UBJ_WRITE_ARRAY(item, uint32, ndim, dims);
+
+            if (iscol) {
+                UBJ_WRITE_KEY(item, "_ArrayOrder_", string, "c");
+            }
+
+            UBJ_WRITE_KEY(item, "_ArrayZipType_", string, zipformat[zipid]);
+            UBJ_WRITE_KEY(item, "_ArrayZipSize_", uint32, datalen);
+            ubjw_write_key(item, "_ArrayZipData_");
+            ubjw_write_buffer(item, compressed, UBJ_UINT8, compressedbytes);
+        } else {
+            totalbytes = 0;
+            /*encode data using base64*/
+            ret = zmat_encode(compressedbytes, compressed, &totalbytes, (uchar**)&buf, zmBase64, &status);
+
+            if (!isquiet) {
+                MMC_FPRINTF(cfg->flog, "after encoding: %.1f%%\n", totalbytes * 100.f / (datalen * byte));
+            }
+
+            if (!ret) {
+                cJSON_AddStringToObject((cJSON*)obj, "_ArrayType_", type);
+                cJSON_AddItemToObject((cJSON*)obj,   "_ArraySize_", cJSON_CreateIntArray((int*)dims, ndim));
+
+                if (iscol) {
+                    cJSON_AddStringToObject((cJSON*)obj, "_ArrayOrder_", "c");
+                }
+
+                cJSON_AddStringToObject((cJSON*)obj, "_ArrayZipType_", zipformat[zipid]);
+                cJSON_AddNumberToObject((cJSON*)obj, "_ArrayZipSize_", datalen);
+                cJSON_AddStringToObject((cJSON*)obj, "_ArrayZipData_", (char*)buf);
+            }
+        }
+    }
+
+    if (compressed && zipid != zmBase64) {
+        free(compressed);
+    }
+
+    if (buf) {
+        free(buf);
+    }
+
+    return ret;
+}
+
+#endif
+
+/**
+ * @brief Parse the debug flag in the letter format
+ *
+ * The debug flag following the -D can be either a string format, or numerical format.
+ * This function converts the string debug flags into number format
+ *
+ * @param[in] debugopt: string following the -D parameter
+ * @param[out] debugflag: the numerical format of the debug flag
+ */
+
+int mcx_parsedebugopt(char* debugopt, const char* debugflag) {
+    char* c = debugopt, *p;
+    int debuglevel = 0;
+
+    while (*c) {
+        p = strchr((char*)debugflag, ((*c <= 'z' && *c >= 'a') ? *c - 'a' + 'A' : *c) );
+
+        if (p != NULL) {
+            debuglevel |= (1 << (p - debugflag));
+        }
+
+        c++;
+    }
+
+    return debuglevel;
+}
+
+
+/**
+ * @brief Flush command line output
+ *
+ * @param[in] out: the stream to be flushed
+ */
+
+void mcx_fflush(FILE* out) {
+#if defined(MCX_CONTAINER) && (defined(MATLAB_MEX_FILE) || defined(OCTAVE_API_VERSION_NUMBER))
+    mcx_matlab_flush();
+#elif defined(PYBIND11_VERSION_MAJOR)
+    mcx_python_flush();
+#else
+    fflush(out);
+#endif
+}
+
+/**
+ * @brief Return the total physical memory of the host in bytes
+ *
+ * Returns 1 GB if the size can not be determined.
+ */
+
+size_t mcx_getsysmemory(void) {
+#ifdef _WIN32
+    MEMORYSTATUSEX status;
+    status.dwLength = sizeof(status);
+
+    if (GlobalMemoryStatusEx(&status)) {
+        return (size_t)status.ullTotalPhys;
+    }
+
+#elif defined(_SC_PHYS_PAGES) && defined(_SC_PAGE_SIZE)
+    long pages = sysconf(_SC_PHYS_PAGES), pagesize = sysconf(_SC_PAGE_SIZE);
+
+    if (pages > 0 && pagesize > 0) {
+        return (size_t)pages * (size_t)pagesize;
+    }
+
+#endif
+    return (size_t)1 << 30;
+}
+
+/**
+ * @brief List the CPUs of a NUMA node of the host
+ *
+ * Parses /sys/devices/system/node/node<node>/cpulist (e.g. "0-15,32-47") on
+ * Linux; other systems report no NUMA node.
+ *
+ * @param[in] node: the NUMA node index
+ * @param[out] cpus: receives the CPU indices of the node
+ * @param[in] maxcpu: the length of cpus
+ * @return the number of CPUs (at most maxcpu) of the node, -1 if the node does not exist
+ */
+
+int mcx_numacpus(int node, int* cpus, int maxcpu) {
+#ifdef __linux__
+    char fname[64];
+    FILE* fp;
+    int first, last, len = 0;
+
+    snprintf(fname, sizeof(fname), "/sys/devices/system/node/node%d/cpulist", node);
+
+    if ((fp = fopen(fname, "rt")) == NULL) {
+        return -1;
+    }
+
+    while (fscanf(fp, "%d", &first) == 1) {
+        if (fscanf(fp, "-%d", &last) != 1) {
+            last = first;
+        }
+
+        for (; first <= last && len < maxcpu; first++) {
+            cpus[len++] = first;
+        }
+
+        if (fgetc(fp) != ',') {
+            break;
+        }
+    }
+
+    fclose(fp);
+    return len;
+#else
+    (void)node;
+    (void)cpus;
+    (void)maxcpu;
+    return -1;
+#endif
+}
+
+/**
+ * @brief Read an integer attribute of a CPU from /sys/devices/system/cpu/cpu<cpu>/<attr>
+ */
+
+#ifdef __linux__
+static int mcx_cpuattr(int cpu, const char* attr, int defval) {
+    char fname[128];
+    FILE* fp;
+    int val = defval;
+
+    snprintf(fname, sizeof(fname), "/sys/devices/system/cpu/cpu%d/%s", cpu, attr);
+
+    if ((fp = fopen(fname, "rt")) != NULL) {
+        if (fscanf(fp, "%d", &val) != 1) {
+            val = defval;
+        }
+
+        fclose(fp);
+    }
+
+    return val;
+}
+#endif
+
+/**
+ * @brief List the CPUs available to the process with their physical cores and core speeds
+ *
+ * The SMT siblings of a physical core share the same core key. The speed is
+ * the capacity the kernel reports for a CPU of an asymmetric system (e.g. ARM
+ * big.LITTLE), or else its maximum frequency in kHz, which tells the core
+ * types of a hybrid CPU apart; 0 if unknown. Linux only.
+ *
+ * @param[out] cpus: receives the CPU indices
+ * @param[out] coreid: receives the package and core index of each CPU, as package*65536+core
+ * @param[out] speed: receives the speed of each CPU
+ * @param[in] maxcpu: the length of the arrays
+ * @return the number of CPUs (at most maxcpu), -1 if the topology is unknown
+ */
+
+int mcx_cputopology(int* cpus, int* coreid, int* speed, int maxcpu) {
+#ifdef __linux__
+    cpu_set_t mask;
+    int cpu, len = 0;
+
+    if (sched_getaffinity(0, sizeof(mask), &mask)) {
+        return -1;
+    }
+
+    for (cpu = 0; cpu < CPU_SETSIZE && len < maxcpu; cpu++) {
+        if (CPU_ISSET(cpu, &mask)) {
+            cpus[len] = cpu;
+            coreid[len] = (mcx_cpuattr(cpu, "topology/physical_package_id", 0) << 16) | (mcx_cpuattr(cpu, "topology/core_id", cpu) & 0xFFFF);
+            speed[len] = mcx_cpuattr(cpu, "cpu_capacity", mcx_cpuattr(cpu, "cpufreq/cpuinfo_max_freq", 0));
+            len++;
+        }
+    }
+
+    return len;
+#else
+    (void)cpus;
+    (void)coreid;
+    (void)speed;
+    (void)maxcpu;
+    return -1;
+#endif
+}
+
+/**
+ * @brief Bind the calling thread to one CPU
+ *
+ * @param[in] cpu: the CPU index
+ * @return 0 if the thread is bound, -1 if binding is not supported or failed
+ */
+
+int mcx_pinthread(int cpu) {
+#ifdef __linux__
+    cpu_set_t mask;
+
+    if (cpu < 0 || cpu >= CPU_SETSIZE) {
+        return -1;
+    }
+
+    CPU_ZERO(&mask);
+    CPU_SET(cpu, &mask);
+    return sched_setaffinity(0, sizeof(mask), &mask) ? -1 : 0;
+#else
+    (void)cpu;
+    return -1;
+#endif
+}
+
+/**
+ * @brief Print a progress bar
+ *
+ * When -D P is specified, this function prints and update a progress bar.
+ *
+ * @param[in] n: the number of completed photons
+ * @param[in] cfg: simulation configuration
+ */
+
+void mcx_progressbar(float percent) {
+    unsigned int percentage, j, colwidth = 79;
+    static unsigned int oldmarker = 0xFFFFFFFF;
+
+#ifndef MCX_CONTAINER
+#ifdef TIOCGWINSZ
+    struct winsize ttys = {0, 0, 0, 0};
+    ioctl(0, TIOCGWINSZ, &ttys);
+    colwidth = ttys.ws_col;
+#elif defined(NCURSES_CONST)
+    colwidth = tgetnum("co");
+#endif
+
+    if (colwidth == 0) {
+        colwidth = 79;
+    }
+
+#endif
+
+    percent = MIN(percent, 1.f);
+
+    percentage = percent * (colwidth - 18);
+
+    if (percentage != oldmarker) {
+        if (percent != -0.f)
+            for (j = 0; j < colwidth; j++) {
+                MMC_FPRINTF(stdout, "\b");
+            }
+
+        oldmarker = percentage;
+        MMC_FPRINTF(stdout, S_YELLOW"Progress: [");
+
+        for (j = 0; j < percentage; j++) {
+            MMC_FPRINTF(stdout, "=");
+        }
+
+        MMC_FPRINTF(stdout, (percentage < colwidth - 18) ? ">" : "=");
+
+        for (j = percentage; j < colwidth - 18; j++) {
+            MMC_FPRINTF(stdout, " ");
+        }
+
+        MMC_FPRINTF(stdout, "] %3d%%" S_RESET, (int)(percent * 100));
+
+        mcx_fflush(stdout);
+    }
+}
+
+/**
+ * @brief Report the progress of a run
+ *
+ * Prints the progress bar if -D P is specified, and passes the completed
+ * fraction, clamped to [0, 1], to cfg->progressfun if a language binding
+ * has set it. It is called from one thread of the run at a time.
+ *
+ * @param[in] cfg: simulation configuration
+ * @param[in] percent: the completed fraction, -0.f to start the progress bar
+ */
+
+void mcx_reportprogress(mcconfig* cfg, float percent) {
+    if (cfg->debuglevel & dlProgress) {
+        mcx_progressbar(percent);
+    }
+
+    if (cfg->progressfun) {
+        cfg->progressfun(cfg->progressdata, MAX(MIN(percent, 1.f), 0.f));
+    }
+}
+
+#ifndef MCX_CONTAINER
+
+/**
+ * @brief Function to read a single parameter value followed by a command line option
+ *
+ * This function reads different types of parameter values following a command line option.
+ *
+ * @param[in] argc: the number of total command line parameters
+ * @param[in] argv: the pointer to all command line options
+ * @param[in] id: which parameter to be parsed
+ * @param[out] output: the pointer to which the parsed value to be written
+ * @param[in] type: the type of data support char, int, float, string, bytenumlist, floatlist
+ */
+
+int mcx_readarg(int argc, char* argv[], int id, void* output, const char* type) {
+    /*
+        when a binary option is given without a following number (0~1),
+        we assume it is 1
+    */
+    if (strcmp(type, "bool") == 0 && (id >= argc - 1 || (argv[id + 1][0] < '0' || argv[id + 1][0] > '9'))) {
+        *((char*)output) = 1;
+        return id;
+    }
+
+    if (id < argc - 1) {
+        if (strcmp(type, "bool") == 0) {
+            *((char*)output) = atoi(argv[id + 1]);
+        } else if (strcmp(type, "char") == 0) {
+            *((char*)output) = argv[id + 1][0];
+        } else if (strcmp(type, "int") == 0) {
+            *((int*)output) = atoi(argv[id + 1]);
+        } else if (strcmp(type, "float") == 0) {
+            *((float*)output) = atof(argv[id + 1]);
+        } else if (strcmp(type, "string") == 0) {
+            strcpy((char*)output, argv[id + 1]);
+        } else if (strcmp(type, "bytenumlist") == 0) {
+            char* nexttok, *numlist = (char*)output;
+            int len = 0, i;
+            nexttok = strtok(argv[id + 1], " ,;");
+
+            while (nexttok) {
+                numlist[len++] = (char)(atoi(nexttok)); /*device id<256*/
+
+                for (i = 0; i < len - 1; i++) /* remove duplicaetd ids */
+                    if (numlist[i] == numlist[len - 1]) {
+                        numlist[--len] = '\0';
+                        break;
+                    }
+
+                nexttok = strtok(NULL, " ,;");
+                /*if(len>=MAX_DEVICE) break;*/
+            }
+        } else if (strcmp(type, "floatlist") == 0) {
+            char* nexttok;
+            float* numlist = (float*)output;
+            int len = 0;
+            nexttok = strtok(argv[id + 1], " ,;");
+
+            while (nexttok) {
+                numlist[len++] = atof(nexttok); /*device id<256*/
+                nexttok = strtok(NULL, " ,;");
+            }
         }
     } else {
-        return;
+        MMC_ERROR(-1, "incomplete input");
     }
+
+    return id + 1;
 }
 
+#endif
+
 /**
- * @brief Save simulation settings to an inp file
+ * @brief Test if a long command line option is supported
  *
- * @param[in] out: handle to the output file
- * @param[in] cfg: simulation configuration
+ * This function returns 1 if a long option is found, and 0 otherwise
+ *
+ * @param[in] opt: the long command line option string
  */
 
-void mcx_saveconfig(FILE* out, mcconfig* cfg) {
-    int i;
+int mcx_remap(char* opt) {
+    int i = 0;
 
-    MMC_FPRINTF(out, "%zu\n", (cfg->nphoton) );
-    MMC_FPRINTF(out, "%d\n", (cfg->seed) );
-    MMC_FPRINTF(out, "%f %f %f\n", (cfg->srcpos.x), (cfg->srcpos.y), (cfg->srcpos.z) );
-    MMC_FPRINTF(out, "%f %f %f\n", (cfg->srcdir.x), (cfg->srcdir.y), (cfg->srcdir.z) );
-    MMC_FPRINTF(out, "%f %f %f\n", (cfg->tstart), (cfg->tend), (cfg->tstep) );
-    MMC_FPRINTF(out, "%f %d %d %d\n", (cfg->steps.x), (cfg->dim.x), (cfg->crop0.x), (cfg->crop1.x));
-    MMC_FPRINTF(out, "%f %d %d %d\n", (cfg->steps.y), (cfg->dim.y), (cfg->crop0.y), (cfg->crop1.y));
-    MMC_FPRINTF(out, "%f %d %d %d\n", (cfg->steps.z), (cfg->dim.z), (cfg->crop0.z), (cfg->crop1.z));
-    MMC_FPRINTF(out, "%d", (cfg->medianum));
+    while (shortopt[i] != '\0') {
+        if (strcmp(opt, fullopt[i]) == 0) {
+            opt[1] = shortopt[i];
 
-    for (i = 0; i < cfg->medianum; i++) {
-        MMC_FPRINTF(out, "%f %f %f %f\n", (cfg->prop[i].mus), (cfg->prop[i].g), (cfg->prop[i].mua), (cfg->prop[i].n));
-    }
+            if (shortopt[i] != '-') {
+                opt[2] = '\0';
+            }
 
-    MMC_FPRINTF(out, "%d", (cfg->detnum));
+            return 0;
+        }
 
-    for (i = 0; i < cfg->detnum; i++) {
-        MMC_FPRINTF(out, "%f %f %f %f\n", (cfg->detpos[i].x), (cfg->detpos[i].y), (cfg->detpos[i].z), (cfg->detpos[i].w));
+        i++;
     }
-}
 
+    return 1;
+}
 
 /**
- * @brief Save simulation settings to an inp file
+ * @brief Look up a single character in a string
  *
- * @param[in] out: handle to the output file
- * @param[in] cfg: simulation configuration
+ * @param[in] key: character to be looked up
+ * @param[out] index: the dictionary string where the char is searched
+ * @return if found, return 0; otherwise, return 1
  */
 
-void mcx_savejdata(char* filename, mcconfig* cfg) {
-    cJSON* root = NULL, *obj = NULL, *sub = NULL, *tmp = NULL;
-    char* jsonstr = NULL;
-    int i;
-    root = cJSON_CreateObject();
+int mcx_lookupindex(char* key, const char* index) {
+    int i = 0;
 
-    /* the "Session" section */
-    cJSON_AddItemToObject(root, "Session", obj = cJSON_CreateObject());
-    cJSON_AddStringToObject(obj, "ID", cfg->session);
-    cJSON_AddNumberToObject(obj, "Photons", cfg->nphoton);
-    cJSON_AddNumberToObject(obj, "RNGSeed", (uint)cfg->seed);
+    while (index[i] != '\0') {
+        if (tolower(*key) == index[i]) {
+            *key = i;
+            return 0;
+        }
 
-    if (cfg->isreflect > 1) {
-        cJSON_AddNumberToObject(obj, "DoMismatch", cfg->isreflect);
-    } else {
-        cJSON_AddBoolToObject(obj, "DoMismatch", cfg->isreflect);
+        i++;
     }
 
-    cJSON_AddBoolToObject(obj, "DoSaveVolume", cfg->issave2pt);
+    return 1;
+}
 
-    if (cfg->isreflect > 1) {
-        cJSON_AddNumberToObject(obj, "DoNormalize", cfg->isnormalized);
-    } else {
-        cJSON_AddBoolToObject(obj, "DoNormalize", cfg->isnormalized);
-    }
+/**
+ * @brief Look up a string in a string list and return the index
+ *
+ * @param[in] key: string to be looked up
+ * @param[out] table: the dictionary where the string is searched
+ * @return if found, return the index of the string in the dictionary, otherwise -1.
+ */
 
-    cJSON_AddBoolToObject(obj, "DoPartialPath", cfg->issavedet);
+int mcx_keylookup(char* origkey, const char* table[]) {
+    int i = 0;
+    char* key = malloc(strlen(origkey) + 1);
+    memcpy(key, origkey, strlen(origkey) + 1);
 
-    if (cfg->issaveref) {
-        cJSON_AddNumberToObject(obj, "DoSaveRef", cfg->issaveref);
-    } else {
-        cJSON_AddBoolToObject(obj, "DoSaveRef", cfg->issaveref);
+    while (key[i]) {
+        key[i] = tolower(key[i]);
+        i++;
     }
 
-    cJSON_AddBoolToObject(obj, "DoSaveExit", cfg->issaveexit);
-    cJSON_AddBoolToObject(obj, "DoSaveSeed", cfg->issaveseed);
-    cJSON_AddBoolToObject(obj, "DoAutoThread", cfg->autopilot);
-    cJSON_AddBoolToObject(obj, "DoDCS", cfg->ismomentum);
-    cJSON_AddBoolToObject(obj, "DoSpecular", cfg->isspecular);
+    i = 0;
 
-    if (cfg->rootpath[0] != '\0') {
-        cJSON_AddStringToObject(obj, "RootPath", cfg->rootpath);
+    while (table[i] && table[i][0] != '\0') {
+        if (strcmp(key, table[i]) == 0) {
+            free(key);
+            return i;
+        }
+
+        i++;
     }
 
-    cJSON_AddNumberToObject(obj, "DebugFlag", cfg->debuglevel);
-    cJSON_AddNumberToObject(obj, "BasisOrder", cfg->basisorder);
+    free(key);
+    return -1;
+}
 
-    {
-        char cflag[2] = {'\0', '\0'};
-        cflag[0] = raytracing[(int)cfg->method];
-        cJSON_AddStringToObject(obj, "RayTracer", cflag);
-    }
+int mcx_isbinstr(const char* str) {
+    int i, len = strlen(str);
 
-    if (cfg->outputformat >= 0) {
-        cJSON_AddStringToObject(obj, "OutputFormat", outputformat[(int)cfg->outputformat]);
+    if (len == 0) {
+        return 0;
     }
 
-    if (cfg->outputtype >= 0) {
-        char outputtypestr[2] = {'\0'};
-        outputtypestr[0] = outputtype[(int)cfg->outputtype];
-        cJSON_AddStringToObject(obj, "OutputType", outputtypestr);
-    }
+    for (i = 0; i < len; i++)
+        if (str[i] != '0' && str[i] != '1') {
+            return 0;
+        }
 
-    /* the "Forward" section */
-    cJSON_AddItemToObject(root, "Forward", obj = cJSON_CreateObject());
-    cJSON_AddNumberToObject(obj, "T0", cfg->tstart);
-    cJSON_AddNumberToObject(obj, "T1", cfg->tend);
-    cJSON_AddNumberToObject(obj, "Dt", cfg->tstep);
+    return 1;
+}
 
-    if (cfg->nout > 1.f) {
-        cJSON_AddNumberToObject(obj, "N0", cfg->nout);
-    }
+/**
+ * @brief Convert a row-major (C/C++) array to a column-major (MATLAB/FORTRAN) array
+ *
+ * @param[in,out] vol: a 3D array (wrapped in 1D) to be converted
+ * @param[in] dim: the dimensions of the 3D array
+ */
 
-    /* the "Domain" section */
-    cJSON_AddItemToObject(root, "Domain", obj = cJSON_CreateObject());
-    cJSON_AddNumberToObject(obj, "LengthUnit", cfg->unitinmm);
-    cJSON_AddItemToObject(obj, "Media", sub = cJSON_CreateArray());
+void  mcx_convertrow2col(float* vol, uint3* dim) {
+    uint x, y, z;
+    unsigned int dimxy, dimyz;
+    float* newvol = NULL;
 
-    for (i = 0; i < cfg->medianum; i++) {
-        cJSON_AddItemToArray(sub, tmp = cJSON_CreateObject());
-        cJSON_AddNumberToObject(tmp, "mua", cfg->prop[i].mua / cfg->unitinmm);
-        cJSON_AddNumberToObject(tmp, "mus", cfg->prop[i].mus / cfg->unitinmm);
-        cJSON_AddNumberToObject(tmp, "g",   cfg->prop[i].g);
-        cJSON_AddNumberToObject(tmp, "n",   cfg->prop[i].n);
+    if (vol == NULL || dim->x == 0 || dim->y == 0 || dim->z == 0) {
+        return;
     }
 
-    cJSON_AddItemToObject(obj, "Dim", cJSON_CreateIntArray((int*) & (cfg->dim.x), 3));
+    newvol = (float*)malloc(sizeof(float) * dim->x * dim->y * dim->z);
+    dimxy = dim->x * dim->y;
+    dimyz = dim->y * dim->z;
 
-    /* the "Optode" section */
-    cJSON_AddItemToObject(root, "Optode", obj = cJSON_CreateObject());
-    cJSON_AddItemToObject(obj, "Source", sub = cJSON_CreateObject());
+    for (x = 0; x < dim->x; x++)
+        for (y = 0; y < dim->y; y++)
+            for (z = 0; z < dim->z; z++) {
+                newvol[z * dimxy + y * dim->x + x] = vol[x * dimyz + y * dim->z + z];
+            }
 
-    if (cfg->srctype >= 0) {
-        cJSON_AddStringToObject(sub, "Type", srctypeid[(int)cfg->srctype]);
-    }
+    memcpy(vol, newvol, sizeof(float) * dim->x * dim->y * dim->z);
+    free(newvol);
+}
 
-    cJSON_AddItemToObject(sub, "Pos", cJSON_CreateFloatArray(&(cfg->srcpos.x), 3));
-    cJSON_AddItemToObject(sub, "Dir", cJSON_CreateFloatArray(&(cfg->srcdir.x), 4));
-    cJSON_AddItemToObject(sub, "Param1", cJSON_CreateFloatArray(&(cfg->srcparam1.x), 4));
-    cJSON_AddItemToObject(sub, "Param2", cJSON_CreateFloatArray(&(cfg->srcparam2.x), 4));
-    cJSON_AddNumberToObject(sub, "SrcNum", cfg->srcnum);
+/**
+ * @brief Load the source list of --srclist
+ *
+ * Each non-empty row of the text file, except those starting with #, lists a
+ * source as "x y z vx vy vz [focal]". The sources share cfg->srctype and
+ * cfg->srcparam1/2 and fill srcnum output slices, as the source patterns do:
+ * cfg->srcpattern is set to the srcnum x srcnum identity, and a photon
+ * launched from the i-th source carries its i-th row.
+ *
+ * @param[in,out] cfg: the simulation configuration structure
+ */
 
-    cJSON_AddItemToObject(obj, "Detector", sub = cJSON_CreateArray());
+void mcx_loadsrclist(mcconfig* cfg) {
+    FILE* fp;
+    char line[MAX_PATH_LENGTH];
+    int len = 0, maxlen = 16, i;
 
-    for (i = 0; i < cfg->detnum; i++) {
-        cJSON_AddItemToArray(sub, tmp = cJSON_CreateObject());
-        cJSON_AddItemToObject(tmp, "Pos", cJSON_CreateFloatArray(&(cfg->detpos[i].x), 3));
-        cJSON_AddNumberToObject(tmp, "R", cfg->detpos[i].w);
+    if ((fp = fopen(cfg->srclistfile, "rt")) == NULL) {
+        MMC_ERROR(-2, "can not open the source list of --srclist");
     }
 
-    /* save "Shapes" constructs, containing InitElem, MeshNode, MeshElem, and MeshROI */
-    cJSON_AddItemToObject(root, "Shapes", obj = cJSON_CreateObject());
-
-    if (cfg->meshtag[0] && cfg->nodenum == 0) {
-        cJSON_AddStringToObject(obj, "MeshID", cfg->meshtag);
-    } else if (cfg->nodenum && cfg->elemnum) {
-        uint dims[2] = {0};
-        cJSON_AddItemToObject(obj, "MeshNode", sub = cJSON_CreateObject());
+    free(cfg->srclist);
+    cfg->srclist = (float4*)malloc(sizeof(float4) * 2 * maxlen);
 
-        dims[0] = cfg->nodenum;
-        dims[1] = 3;
+    while (fgets(line, MAX_PATH_LENGTH, fp)) {
+        float4 pos = {0.f, 0.f, 0.f, 1.f}, dir = {0.f, 0.f, 1.f, 0.f};
+        float norm;
+        int count = sscanf(line, "%f %f %f %f %f %f %f", &pos.x, &pos.y, &pos.z, &dir.x, &dir.y, &dir.z, &dir.w);
 
-        if (mcx_jdataencode((void*)cfg->node, 2, dims, "single", 4, cfg->zipid, sub, 0, 0, cfg)) {
-            MMC_ERROR(-10, "saving node data to JSON failed");
+        if (count <= 0 || line[strspn(line, " \t")] == '#') {
+            continue;
         }
 
-        cJSON_AddItemToObject(obj, "MeshElem", sub = cJSON_CreateObject());
+        if (count < 6) {
+            fclose(fp);
+            MMC_ERROR(-2, "each row of --srclist must be 'x y z vx vy vz [focal]'");
+        }
 
-        dims[0] = cfg->elemnum;
-        dims[1] = cfg->elemlen + 1;
+        norm = sqrtf(dir.x * dir.x + dir.y * dir.y + dir.z * dir.z);
 
-        if (mcx_jdataencode((void*)cfg->elem, 2, dims, "int32", 4, cfg->zipid, sub, 0, 0, cfg)) {
-            MMC_ERROR(-10, "saving elem data to JSON failed");
+        if (norm < 1e-6f) {
+            fclose(fp);
+            MMC_ERROR(-2, "a source of --srclist has a zero direction");
         }
 
-        if (cfg->roidata) {
-            cJSON_AddItemToObject(obj, "MeshROI", sub = cJSON_CreateObject());
-
-            dims[0] = (cfg->roitype == rtNode ? cfg->nodenum : cfg->elemnum);
-            dims[1] = (cfg->roitype == rtNode ? 1 : (cfg->roitype == rtEdge ? 6 : 4));
+        dir.x /= norm;
+        dir.y /= norm;
+        dir.z /= norm;
 
-            if (mcx_jdataencode((void*)cfg->roidata, 2, dims, "single", 4, cfg->zipid, sub, 0, 0, cfg)) {
-                MMC_ERROR(-10, "saving mesh ROI data to JSON failed");
-            }
+        if (len == maxlen) {
+            maxlen <<= 1;
+            cfg->srclist = (float4*)realloc(cfg->srclist, sizeof(float4) * 2 * maxlen);
         }
-    } else {
-        MMC_ERROR(-10, "incomplete mesh data");
+
+        cfg->srclist[len * 2] = pos;
+        cfg->srclist[len * 2 + 1] = dir;
+        len++;
     }
 
-    cJSON_AddNumberToObject(obj, "InitElem", cfg->e0);
+    fclose(fp);
 
-    /* now save JSON to file */
-    jsonstr = cJSON_Print(root);
+    if (len == 0) {
+        MMC_ERROR(-2, "the source list of --srclist is empty");
+    }
 
-    if (jsonstr == NULL) {
-        MMC_ERROR(-1, "error when converting to JSON");
+    cfg->srcnum = len;
+    free(cfg->srcpattern);
+    cfg->srcpattern = (float*)calloc((size_t)len * len, sizeof(float));
+
+    for (i = 0; i < len; i++) {
+        cfg->srcpattern[(size_t)i * len + i] = 1.f;
     }
 
-    if (!strcmp(filename, "-")) {
-        fprintf(cfg->flog, "%s\n", jsonstr);
-    } else {
-        FILE* fp = fopen(filename, "wt");
+    /*the first source fills the scalar source fields read by the rest of the setup*/
+    cfg->srcpos.x = cfg->srclist[0].x;
+    cfg->srcpos.y = cfg->srclist[0].y;
+    cfg->srcpos.z = cfg->srclist[0].z;
+    cfg->srcdir = cfg->srclist[1];
+}
+
+/**
+ * @brief Validate all input fields, and warn incompatible inputs
+ *
+ * Perform self-checking and raise exceptions or warnings when input error is detected
+ *
+ * @param[in,out] cfg: the simulation configuration structure
+ */
 
-        if (fp == NULL) {
-            MMC_ERROR(-1, "error opening file to write");
-        }
+void mcx_validatecfg(mcconfig* cfg) {
+    int i;
 
-        fprintf(fp, "%s\n", jsonstr);
-        fclose(fp);
+    if (cfg->nphoton <= 0) {
+        MMC_ERROR(-2, "cfg.nphoton must be a positive number");
     }
 
-    if (jsonstr) {
-        free(jsonstr);
+    if (cfg->tstart > cfg->tend || cfg->tstep == 0.f) {
+        MMC_ERROR(-2, "incorrect time gate settings or missing tstart/tend/tstep fields");
     }
 
-    if (root) {
-        cJSON_Delete(root);
+    if (cfg->tstep > cfg->tend - cfg->tstart) {
+        cfg->tstep = cfg->tend - cfg->tstart;
     }
-}
-
-#endif
 
-/**
- * @brief Convert a column-major (MATLAB/FORTRAN) array to a row-major (C/C++) array
- *
- * @param[in,out] vol: a 3D array (wrapped in 1D) to be converted
- * @param[in] dim: the dimensions of the 3D array
- */
+    if (cfg->steps.x != cfg->steps.y || cfg->steps.y != cfg->steps.z) {
+        MMC_ERROR(-2, "MMC dual-grid algorithm currently does not support anisotropic voxels");
+    }
 
-void  mcx_convertcol2row(unsigned int** vol, uint3* dim) {
-    uint x, y, z;
-    unsigned int dimxy, dimyz;
-    unsigned int* newvol = NULL;
+    if (fabs(cfg->srcdir.x * cfg->srcdir.x + cfg->srcdir.y * cfg->srcdir.y + cfg->srcdir.z * cfg->srcdir.z - 1.f) > 1e-4) {
+        MMC_ERROR(-2, "field 'srcdir' must be a unitary vector (tolerance is 1e-4)");
+    }
 
-    if (*vol == NULL || dim->x == 0 || dim->y == 0 || dim->z == 0) {
-        return;
+    if (cfg->tend <= cfg->tstart) {
+        MMC_ERROR(-2, "field 'tend' must be greater than field 'tstart'");
     }
 
-    newvol = (unsigned int*)malloc(sizeof(unsigned int) * dim->x * dim->y * dim->z);
-    dimxy = dim->x * dim->y;
-    dimyz = dim->y * dim->z;
+    cfg->maxgate = (int)((cfg->tend - cfg->tstart) / cfg->tstep + 0.5);
+    cfg->tend = cfg->tstart + cfg->tstep * cfg->maxgate;
 
-    for (z = 0; z < dim->z; z++)
-        for (y = 0; y < dim->y; y++)
-            for (x = 0; x < dim->x; x++) {
-                newvol[x * dimyz + y * dim->z + z] = (*vol)[z * dimxy + y * dim->x + x];
-            }
+    /*the listed sources share the launch of a point source, each resolves its own initial element, see mesh_initsrclist*/
+    if (cfg->srclistfile[0]) {
+        if (cfg->srctype != stPencil && cfg->srctype != stIsotropic && cfg->srctype != stCone && cfg->srctype != stArcSin) {
+            MMC_ERROR(-2, "--srclist only supports the pencil, isotropic, cone and arcsine sources");
+        }
 
-    free(*vol);
-    *vol = newvol;
-}
+        if (cfg->compute != cbSSE && cfg->gpuid <= MAX_DEVICE) {
+            MMC_ERROR(-2, "--srclist only runs on the CPU (-c sse)");
+        }
 
-/**
- * @brief Convert a column-major (MATLAB/FORTRAN) array to a row-major (C/C++) array
- *
- * @param[in,out] vol: a 3D array (wrapped in 1D) to be converted
- * @param[in] dim: the dimensions of the 3D array
- */
+        if (cfg->srclist == NULL) {
+            mcx_loadsrclist(cfg);
+        }
+    }
 
-void  mcx_convertcol2row4d(unsigned int** vol, uint4* dim) {
-    uint x, y, z, w;
-    unsigned int dimxyz, dimyzw, dimxy, dimzw;
-    unsigned int* newvol = NULL;
+    if (cfg->srctype == stPattern && cfg->srcpattern == NULL) {
+        MMC_ERROR(-2, "the 'srcpattern' field can not be empty when your 'srctype' is 'pattern'");
+    }
 
-    if (*vol == NULL || dim->x == 0 || dim->y == 0 || dim->z == 0 || dim->w == 0) {
-        return;
+    if (cfg->srcnum > 1 && cfg->seed == SEED_FROM_FILE) {
+        MMC_ERROR(-2, "multiple source simulation is currently not supported under replay mode");
     }
 
-    newvol = (unsigned int*)malloc(sizeof(unsigned int) * dim->x * dim->y * dim->z * dim->w);
-    dimxyz = dim->x * dim->y * dim->z;
-    dimyzw = dim->y * dim->z * dim->w;
-    dimxy = dim->x * dim->y;
-    dimzw = dim->z * dim->w;
+    /*the result cache keys a run by its seed, a time-based seed never repeats*/
+    if (cfg->resultcache[0]) {
+        if (cfg->seed == SEED_FROM_FILE || cfg->ispipeline || cfg->shmname[0] || cfg->inccache[0] || cfg->isresume
+                || cfg->ckptperiod > 0 || cfg->checkpt[0] > 0) {
+            MMC_ERROR(-2, "--resultcache can not be combined with the replay, --pipeline, --shm, --incache, checkpoints or resume");
+        }
 
-    for (w = 0; w < dim->w; w++)
-        for (z = 0; z < dim->z; z++)
-            for (y = 0; y < dim->y; y++)
-                for (x = 0; x < dim->x; x++) {
-                    newvol[x * dimyzw + y * dimzw + z * dim->w + w] = (*vol)[w * dimxyz + z * dimxy + y * dim->x + x];
-                }
+        if (cfg->cachelimit <= 0.f) {
+            MMC_ERROR(-2, "--cachelimit must be positive");
+        }
 
-    free(*vol);
-    *vol = newvol;
-}
+        if (cfg->seed < 0) {
+            MMC_FPRINTF(cfg->flog, S_YELLOW "WARNING: --resultcache needs a fixed seed (-E), the cache is disabled\n" S_RESET);
+            cfg->resultcache[0] = '\0';
+        }
+    }
 
-#ifndef MCX_CONTAINER
+    if (cfg->seed < 0 && cfg->seed != SEED_FROM_FILE) {
+        cfg->seed = time(NULL);
+    }
 
+    if (cfg->compute != cbSSE && cfg->gpuid <= MAX_DEVICE && cfg->rngtype == rngPosix) {
+        MMC_ERROR(-2, "the GPU only supports the xorshift128p and philox RNGs, use -c sse or -G -1 for --rng posix");
+    }
 
-/**
- * @brief Decode an ND array from JSON/JData construct and output to a volumetric array
- *
- * The JData specification defines a portable way to encode and share volumetric
- * ND arrays and other complex data structures, such as trees, graphs and tables.
- * This function is capable of importing any ND numerical arrays in the JData
- * construct in to a generic array, permitting data decompression and base64 decoding.
- *
- * @param[in] vol: a pointer that points to the ND array buffer
- * @param[in] ndim: the number of dimensions
- * @param[in] dims: an integer pointer that points to the dimensional vector
- * @param[in] type: a string of JData data types, such as "uint8" "float32", "int32" etc
- * @param[in] byte: number of byte per voxel
- * @param[in] zipid: zip method: 0:zlib,1:gzip,2:base64,3:lzma,4:lzip,5:lz4,6:lz4hc
- * @param[in] obj: a pre-created cJSON object to store the output JData fields
- */
+    if (cfg->compute != cbSSE && (cfg->method != rtBLBadouelGrid && cfg->method != rtBLBadouel)
+            && !(cfg->method == rtBLBadouelPacket && cfg->gpuid > MAX_DEVICE)) {
+        cfg->method = rtBLBadouel;
+    }
 
-int  mcx_jdatadecode(void** vol, int* ndim, uint* dims, int maxdim, char** type, cJSON* obj, mcconfig* cfg) {
-    int ret = 0;
-    cJSON* ztype = NULL;
-    cJSON* vsize = cJSON_GetObjectItem(obj, "_ArraySize_");
-    cJSON* vtype = cJSON_GetObjectItem(obj, "_ArrayType_");
-    cJSON* vdata = cJSON_GetObjectItem(obj, "_ArrayData_");
+#ifndef MMC_USE_SSE
 
-    if (!vdata) {
-        ztype = cJSON_GetObjectItem(obj, "_ArrayZipType_");
-        vdata = cJSON_GetObjectItem(obj, "_ArrayZipData_");
+    if (cfg->gpuid > MAX_DEVICE) {
+        cfg->method = rtPlucker;
     }
 
-    if (!flagset['K'] && vtype) {
-        *type = vtype->valuestring;
+#endif
 
-        if (strstr(*type, "int8")) {
-            cfg->mediabyte = 1;
-        } else if (strstr(*type, "int16")) {
-            cfg->mediabyte = 2;
-        } else if (strstr(*type, "double") || strstr(*type, "int64")) {
-            MMC_ERROR(-1, "8-byte volume array is not supported");
-        } else {
-            cfg->mediabyte = 4;
-        }
+    /*the emission launch distribution and the --adjoint Jacobians are built from the mesh output, not the grid output*/
+    if ((cfg->emitfile[0] || cfg->adjointnum > 0) && cfg->method == rtBLBadouelGrid) {
+        cfg->method = rtBLBadouel;
     }
 
-    if (vdata) {
-        if (vsize) {
-            cJSON* tmp = vsize->child;
-            *ndim = cJSON_GetArraySize(vsize);
+    if (cfg->method == rtBLBadouelGrid) {
+        cfg->basisorder = 0;
+    }
 
-            for (int i = 0; i < MIN(maxdim, *ndim); i++) {
-                dims[i] = tmp->valueint;
-                tmp = tmp->next;
+    /*the copies of a split photon are traced one after the other by onephoton(), see photon_split()*/
+    if (cfg->importance) {
+        for (i = 0; i < cfg->importnum; i++) {
+            if (cfg->importance[i] <= 0.f) {
+                MMC_ERROR(-2, "--importance must be positive");
             }
         }
 
-        if (ztype) {
-            size_t len, newlen;
-            int status = 0;
-            char* buf = NULL;
-            int zipid = mcx_keylookup((char*)(ztype->valuestring), zipformat);
-            ret = zmat_decode(strlen(vdata->valuestring), (uchar*)vdata->valuestring, &len, (uchar**)&buf, zmBase64, &status);
-
-            if (!ret && vsize) {
-                if (*vol) {
-                    free(*vol);
-                }
+        if (cfg->seed == SEED_FROM_FILE || cfg->issaveseed) {
+            MMC_ERROR(-2, "--importance can not be combined with the replay or saving the photon seeds (-q)");
+        }
 
-                ret = zmat_decode(len, (uchar*)buf, &newlen, (uchar**)(vol), zipid, &status);
-            }
+        if (cfg->issavedet && MMC_MULTISRC(cfg)) {
+            MMC_ERROR(-2, "--importance can not save the detected photons of multiple patterns");
+        }
 
-            if (buf) {
-                free(buf);
-            }
+        if (cfg->issavedet && cfg->compute != cbSSE && cfg->gpuid <= MAX_DEVICE) {
+            MMC_ERROR(-2, "--importance can only save the detected photons in the CPU simulation (-c sse)");
+        }
 
-            cfg->isrowmajor = 1;
-        } else {
-            MMC_ERROR(-1, "Only compressed JData array constructs are supported");
+        if (cfg->method == rtBLBadouelPacket) {
+            cfg->method = rtBLBadouel;
         }
-    } else {
-        MMC_ERROR(-1, "No _ArrayZipData_ field is found");
-    }
 
-    return ret;
-}
+        cfg->iswavefront = 0;
+    }
 
-/**
- * @brief Export an ND volumetric image to JSON/JData encoded construct
- *
- * The JData specification defines a portable way to encode and share volumetric
- * ND arrays and other complex data structures, such as trees, graphs and tables.
- * This function is capable of exporting any ND numerical arrays into a JData
- * construct, permitting data compression and base64 encoding.
- *
- * @param[in] vol: a pointer that points to the ND array buffer
- * @param[in] ndim: the number of dimensions
- * @param[in] dims: an integer pointer that points to the dimensional vector
- * @param[in] type: a string of JData data types, such as "uint8" "float32", "int32" etc
- * @param[in] byte: number of byte per voxel
- * @param[in] zipid: zip method: 0:zlib,1:gzip,2:base64,3:lzma,4:lzip,5:lz4,6:lz4hc
- * @param[in] obj: a pre-created cJSON or UBJ object to store the output JData fields
- * @param[in] isubj: 1 if obj is a binary JSON (UBJ) object, 0 if obj is a cJSON object
- * @param[in] cfg: mcx config struct
- */
+    /*the detectors are scored at the scattering events of the CPU tracer, see nexteventscore()*/
+    if (cfg->nextevent < 0.f) {
+        MMC_ERROR(-2, "--nextevent must be 0 or a positive distance");
+    }
 
-int  mcx_jdataencode(void* vol, int ndim, uint* dims, char* type, int byte, int zipid, void* obj, int isubj, int iscol, mcconfig* cfg) {
-    uint datalen = 1;
-    size_t compressedbytes, totalbytes;
-    uchar* compressed = NULL, *buf = NULL;
-    int ret = 0, status = 0;
+    if (cfg->nextevent > 0.f) {
+        if (cfg->detnum == 0 || cfg->isextdet || (cfg->compute != cbSSE && cfg->gpuid <= MAX_DEVICE) || cfg->hybrid > 0.f || cfg->implicit) {
+            MMC_ERROR(-2, "--nextevent needs disk/planar detectors, only runs on the CPU (-c sse) and does not support the implicit ROIs");
+        }
 
-    for (int i = 0; i < ndim; i++) {
-        datalen *= dims[i];
+        if (cfg->seed == SEED_FROM_FILE || cfg->srcnum > 1 || cfg->wavefile[0] || cfg->waveproplen > 0 || cfg->inccache[0] || cfg->pmcfile[0]) {
+            MMC_ERROR(-2, "--nextevent can not be combined with the replay, multiple patterns, --waveprop, --incache or --pmc");
+        }
     }
 
-    totalbytes = datalen * byte;
+    /*the diffusion jumps deposit into the mesh output of the CPU tracer, see diffusionjump()*/
+    if (cfg->difflabel) {
+        for (i = 0; i < cfg->diffnum; i++) {
+            if (cfg->difflabel[i] <= 0) {
+                MMC_ERROR(-2, "--diffusion only accepts positive labels");
+            }
+        }
 
-    if (!cfg->isdumpjson) {
-        MMC_FPRINTF(cfg->flog, "compressing data [%s] ...", zipformat[zipid]);
-    }
+        if (!(cfg->diffmin > 0.f)) {
+            MMC_ERROR(-2, "--diffmin must be a positive number of transport mean free paths");
+        }
 
-    /*compress data using zlib*/
-    if (zipid != zmBase64) {
-        ret = zmat_encode(totalbytes, (uchar*)vol, &compressedbytes, (uchar**)&compressed, zipid, &status);
-    } else {
-        compressed = (uchar*)vol;
-        compressedbytes = totalbytes;
-    }
+        if ((cfg->compute != cbSSE && cfg->gpuid <= MAX_DEVICE) || cfg->hybrid > 0.f || cfg->implicit) {
+            MMC_ERROR(-2, "--diffusion only runs on the CPU (-c sse) and does not support the implicit ROIs");
+        }
 
-    if (!ret) {
-        if (!cfg->isdumpjson) {
-            MMC_FPRINTF(cfg->flog, "compression ratio: %.1f%%\t", compressedbytes * 100.f / totalbytes);
+        if (cfg->seed == SEED_FROM_FILE || cfg->wavefile[0] || cfg->waveproplen > 0 || cfg->ismomentum || cfg->dcsmodel || cfg->freqnum > 0) {
+            MMC_ERROR(-2, "--diffusion can not be combined with the replay, the multi-wavelength, momentum transfer, DCS or frequency-domain outputs");
         }
 
-        if (isubj) {
-            ubjw_context_t* item = (ubjw_context_t*)obj;
-            UBJ_WRITE_KEY(item, "_ArrayType_", string, type);
-            ubjw_write_key(item, "_ArraySize_");
-            UBJ_WRITE_ARRAY(item, uint32, ndim, dims);
+        if (cfg->method == rtBLBadouelGrid || cfg->method == rtBLBadouelPacket) {
+            cfg->method = rtBLBadouel;
+        }
 
-            if (iscol) {
-                UBJ_WRITE_KEY(item, "_ArrayOrder_", string, "c");
-            }
+        cfg->iswavefront = 0;
+    }
 
-            UBJ_WRITE_KEY(item, "_ArrayZipType_", string, zipformat[zipid]);
-            UBJ_WRITE_KEY(item, "_ArrayZipSize_", uint32, datalen);
-            ubjw_write_key(item, "_ArrayZipData_");
-            ubjw_write_buffer(item, compressed, UBJ_UINT8, compressedbytes);
-        } else {
-            totalbytes = 0;
-            /*encode data using base64*/
-            ret = zmat_encode(compressedbytes, compressed, &totalbytes, (uchar**)&buf, zmBase64, &status);
+    /*the masked output is indexed by the element rows of the CPU tracers, see mesh_buildoutmask()*/
+    if (cfg->outmask[0]) {
+        if ((cfg->compute != cbSSE && cfg->gpuid <= MAX_DEVICE) || cfg->hybrid > 0.f || cfg->basisorder) {
+            MMC_ERROR(-2, "--outmask selects the elements of the output, it needs -C 0 and only runs on the CPU (-c sse)");
+        }
 
-            if (!cfg->isdumpjson) {
-                MMC_FPRINTF(cfg->flog, "after encoding: %.1f%%\n", totalbytes * 100.f / (datalen * byte));
-            }
+        if (cfg->issparsegate || cfg->wavefile[0] || cfg->waveproplen > 0 || cfg->freqnum > 0 || cfg->emitfile[0] || cfg->inccache[0] || cfg->adjointnum > 0) {
+            MMC_ERROR(-2, "--outmask can not be combined with --sparsegate, the multi-wavelength or frequency-domain outputs, --emission, --incache or --adjoint");
+        }
 
-            if (!ret) {
-                cJSON_AddStringToObject((cJSON*)obj, "_ArrayType_", type);
-                cJSON_AddItemToObject((cJSON*)obj,   "_ArraySize_", cJSON_CreateIntArray((int*)dims, ndim));
+        if (cfg->method == rtBLBadouelGrid) {
+            cfg->method = rtBLBadouel;
+        }
+    }
 
-                if (iscol) {
-                    cJSON_AddStringToObject((cJSON*)obj, "_ArrayOrder_", "c");
-                }
+    /*the halfs are saved with a scale (see mcx_float16scale), only the JNIfTI header and the Zarr attributes can hold it*/
+    if (cfg->isfloat16 && cfg->outputformat != ofJNifti && cfg->outputformat != ofBJNifti && cfg->outputformat != ofZarr) {
+        MMC_ERROR(-2, "--float16 needs the output format (-F) to be jnii, bnii or zarr, which record the scale of the halfs");
+    }
 
-                cJSON_AddStringToObject((cJSON*)obj, "_ArrayZipType_", zipformat[zipid]);
-                cJSON_AddNumberToObject((cJSON*)obj, "_ArrayZipSize_", datalen);
-                cJSON_AddStringToObject((cJSON*)obj, "_ArrayZipData_", (char*)buf);
-            }
+    /*photons in a packet or a wavefront share one RNG stream, which can not be replayed per photon*/
+    if (cfg->issaveseed || cfg->seed == SEED_FROM_FILE || cfg->debugphoton >= 0) {
+        if (cfg->method == rtBLBadouelPacket) {
+            cfg->method = rtBLBadouel;
         }
-    }
 
-    if (compressed && zipid != zmBase64) {
-        free(compressed);
+        cfg->iswavefront = 0;
     }
 
-    if (buf) {
-        free(buf);
+    if (cfg->implicit && (int)(cfg->gpuid) >= 0) {
+        MMC_ERROR(-2, "Implicit MMC is currently only supported in the CPU, please set -G -1 or cfg.gpuid=-1");
     }
 
-    return ret;
-}
+    /*the paged output is only filled by the CPU ray-tracers; mesh_saveweight writes the mesh outputs to raw/text files*/
+    if (cfg->issparsegate) {
+        if (cfg->compute != cbSSE) {
+            MMC_ERROR(-2, "--sparsegate only supports the CPU simulation (-c sse)");
+        }
 
-#endif
+        if (cfg->seed == SEED_FROM_FILE || cfg->wavefile[0] || cfg->waveproplen > 0) {
+            MMC_ERROR(-2, "--sparsegate can not be combined with the replay or the multi-wavelength mode");
+        }
 
-/**
- * @brief Parse the debug flag in the letter format
- *
- * The debug flag following the -D can be either a string format, or numerical format.
- * This function converts the string debug flags into number format
- *
- * @param[in] debugopt: string following the -D parameter
- * @param[out] debugflag: the numerical format of the debug flag
- */
+        if (cfg->ckptperiod > 0 || cfg->checkpt[0] > 0 || cfg->isresume || cfg->convtarget > 0.f || cfg->mpisize > 1) {
+            MMC_ERROR(-2, "--sparsegate can not be combined with checkpoints, the convergence target or the MPI mode");
+        }
 
-int mcx_parsedebugopt(char* debugopt, const char* debugflag) {
-    char* c = debugopt, *p;
-    int debuglevel = 0;
+        if (cfg->parentid != mpStandalone || (cfg->method != rtBLBadouelGrid && cfg->outputformat != ofASCII && cfg->outputformat != ofBin && cfg->outputformat != ofMC2)) {
+            MMC_ERROR(-2, "--sparsegate only saves the mesh output to ascii, bin or mc2 files");
+        }
 
-    while (*c) {
-        p = strchr((char*)debugflag, ((*c <= 'z' && *c >= 'a') ? *c - 'a' + 'A' : *c) );
+        cfg->isatomic = 1;      /*the pages are shared by all threads*/
+        cfg->isprivatebuf = 0;
+    }
 
-        if (p != NULL) {
-            debuglevel |= (1 << (p - debugflag));
+    /*the frequency-domain frames are appended to a single block of time gates*/
+    if (cfg->freqnum > 0) {
+        if (cfg->freqnum > MAX_FREQ_NUM) {
+            MMC_ERROR(-2, "too many modulation frequencies in --freq");
         }
 
-        c++;
+        if (cfg->seed == SEED_FROM_FILE || cfg->wavefile[0] || cfg->waveproplen > 0 || cfg->issparsegate) {
+            MMC_ERROR(-2, "--freq can not be combined with the replay, the multi-wavelength or the sparse output mode");
+        }
     }
 
-    return debuglevel;
-}
-
+    /*the batch variance is kept for the time gates of the dense output, see mesh_batchvariance*/
+    if (cfg->varbatch > 1 && (cfg->issparsegate || cfg->inccache[0] || cfg->pmcfile[0])) {
+        MMC_ERROR(-2, "--varbatch can not be combined with the sparse output, incremental or perturbation MC modes");
+    }
 
-/**
- * @brief Flush command line output
- *
- * @param[in] out: the stream to be flushed
- */
+    /*the perturbation MC mode re-weights the photons of an .mch file instead of simulating*/
+    if (cfg->pmcfile[0] && cfg->pmcpropfile[0] == '\0') {
+        MMC_ERROR(-2, "--pmc requires the property sets given by --pmcprop");
+    }
 
-void mcx_fflush(FILE* out) {
-#if defined(MCX_CONTAINER) && (defined(MATLAB_MEX_FILE) || defined(OCTAVE_API_VERSION_NUMBER))
-    mcx_matlab_flush();
-#elif defined(PYBIND11_VERSION_MAJOR)
-    mcx_python_flush();
-#else
-    fflush(out);
-#endif
-}
+    /*the incremental mode re-simulates selected photons by their IDs*/
+    if (cfg->inccache[0]) {
+        if ((cfg->compute != cbSSE && cfg->gpuid <= MAX_DEVICE) || cfg->method == rtBLBadouelPacket || cfg->iswavefront) {
+            MMC_ERROR(-2, "--incache only supports the CPU simulation (-c sse) with the P, H, B, S or G ray-tracer (-M)");
+        }
 
-/**
- * @brief Print a progress bar
- *
- * When -D P is specified, this function prints and update a progress bar.
- *
- * @param[in] n: the number of completed photons
- * @param[in] cfg: simulation configuration
- */
+        if (cfg->issavedet || cfg->seed == SEED_FROM_FILE || cfg->debugphoton >= 0 || (cfg->debuglevel & dlTraj)) {
+            MMC_ERROR(-2, "--incache can not save or replay detected photons or trajectories");
+        }
 
-void mcx_progressbar(float percent) {
-    unsigned int percentage, j, colwidth = 79;
-    static unsigned int oldmarker = 0xFFFFFFFF;
+        if (cfg->ckptperiod > 0 || cfg->checkpt[0] > 0 || cfg->isresume || cfg->convtarget > 0.f || cfg->mpisize > 1
+                || cfg->wavefile[0] || cfg->waveproplen > 0 || cfg->freqnum > 0 || cfg->issparsegate) {
+            MMC_ERROR(-2, "--incache can not be combined with checkpoints, the convergence target, MPI, or the multi-wavelength, frequency-domain or sparse output modes");
+        }
+    }
 
-#ifndef MCX_CONTAINER
-#ifdef TIOCGWINSZ
-    struct winsize ttys = {0, 0, 0, 0};
-    ioctl(0, TIOCGWINSZ, &ttys);
-    colwidth = ttys.ws_col;
-#elif defined(NCURSES_CONST)
-    colwidth = tgetnum("co");
-#endif
+    /*the server mode reuses the prepared mesh for every job of the queue*/
+    if (cfg->servefile[0]) {
+        if (cfg->seed == SEED_FROM_FILE || cfg->isresume || cfg->inccache[0] || cfg->pmcfile[0] || cfg->mpisize > 1) {
+            MMC_ERROR(-2, "--serve can not be combined with the replay, resume, incremental, perturbation MC or MPI modes");
+        }
+    } else {
+        cfg->ispipeline = 0;
+    }
 
-    if (colwidth == 0) {
-        colwidth = 79;
+    /*the estimate mode runs a calibration batch of the prepared input, see mmc_estimate*/
+    if (cfg->isestimate && (cfg->servefile[0] || cfg->pmcfile[0] || cfg->isresume || cfg->inccache[0] || cfg->mpisize > 1)) {
+        MMC_ERROR(-2, "--estimate can not be combined with the server, perturbation MC, resume, incremental or MPI modes");
     }
 
-#endif
+    /*the domain-decomposed mode moves the photon states between the partitions of the ranks, see mmc_run_domain*/
+    if (cfg->isdomain) {
+        if (cfg->mpisize <= 1 || cfg->compute != cbSSE) {
+            MMC_ERROR(-2, "--domain needs an MPI build started by mpirun with more than one rank, and -c sse");
+        }
 
-    percent = MIN(percent, 1.f);
+        if (cfg->rngtype != rngPhilox) {
+            MMC_ERROR(-2, "--domain needs --rng philox, whose per-photon stream moves with the photon between the ranks");
+        }
 
-    percentage = percent * (colwidth - 18);
+        if (cfg->srctype != stPencil && cfg->srctype != stIsotropic && cfg->srctype != stCone && cfg->srctype != stArcSin) {
+            MMC_ERROR(-2, "--domain only supports the pencil, isotropic, cone and arcsine sources");
+        }
 
-    if (percentage != oldmarker) {
-        if (percent != -0.f)
-            for (j = 0; j < colwidth; j++) {
-                MMC_FPRINTF(stdout, "\b");
-            }
+        if (cfg->method == rtBLBadouelGrid || cfg->basisorder == 2 || cfg->implicit || cfg->seed == SEED_FROM_FILE || cfg->srclist
+                || cfg->wavefile[0] || cfg->waveproplen > 0 || cfg->freqnum > 0 || cfg->issparsegate || cfg->varbatch > 1
+                || cfg->inccache[0] || cfg->pmcfile[0] || cfg->servefile[0] || cfg->isestimate || cfg->emitfile[0]
+                || cfg->dcsmodel || cfg->isdetstat || cfg->nextevent > 0.f || cfg->importance || cfg->isreciprocal || cfg->difflabel
+                || cfg->elempropfile[0] || cfg->outmask[0] || cfg->adjointnum > 0 || cfg->isheatmap || cfg->isnuma
+                || cfg->debugphoton >= 0 || (cfg->debuglevel & dlTraj) || cfg->issaveexit == 2 || cfg->hybrid > 0.f
+                || cfg->convtarget > 0.f || cfg->ckptperiod > 0 || cfg->checkpt[0] > 0 || cfg->isresume || cfg->shmname[0] || cfg->cam_focal_length > 0) {
+            MMC_ERROR(-2, "--domain can not be combined with -M G, -b 2, implicit MMC, the replay, --srclist, --waveprop, --freq, --sparsegate, --varbatch, --incache, --pmc, --serve, --estimate, --emission, --dcs, --detstat, --nextevent, --importance, --reciprocal, --diffusion, --elemprop, --outmask, --adjoint, --heatmap, --numa, --debugphoton, trajectories, detector images, --hybrid, the convergence target, checkpoints, --shm or the camera");
+        }
 
-        oldmarker = percentage;
-        MMC_FPRINTF(stdout, S_YELLOW"Progress: [");
+        /*the partitions are contiguous ranges of a space-filling curve order*/
+        if (cfg->reorder == 0) {
+            cfg->reorder = 2;
+        }
 
-        for (j = 0; j < percentage; j++) {
-            MMC_FPRINTF(stdout, "=");
+        if (cfg->method == rtBLBadouelPacket) {
+            cfg->method = rtBLBadouel;
         }
 
-        MMC_FPRINTF(stdout, (percentage < colwidth - 18) ? ">" : "=");
+        /*the threads of a rank add to one shared output, the detected photons are gathered at the end*/
+        cfg->iswavefront = 0;
+        cfg->isatomic = 1;
+        cfg->isprivatebuf = 0;
+        cfg->iselemmoment = 0;
+        cfg->streamdet = 0;
+    }
 
-        for (j = percentage; j < colwidth - 18; j++) {
-            MMC_FPRINTF(stdout, " ");
+    /*the hybrid mode merges the CPU share into the output of one GPU run, see mmc_run_hybrid*/
+    if (cfg->hybrid < 0.f || cfg->hybrid >= 1.f) {
+        MMC_ERROR(-2, "--hybrid must be 0 or a fraction below 1");
+    }
+
+    if (cfg->compute == cbSSE || cfg->gpuid > MAX_DEVICE) {
+        cfg->hybrid = 0.f;
+    }
+
+    if (cfg->hybrid > 0.f) {
+        if (cfg->seed == SEED_FROM_FILE || cfg->convtarget > 0.f || cfg->ckptperiod > 0 || cfg->checkpt[0] > 0 || cfg->isresume
+                || cfg->varbatch > 1 || cfg->issparsegate || cfg->inccache[0] || cfg->pmcfile[0] || cfg->issaveseed || (cfg->debuglevel & dlTraj)
+                || cfg->issaveexit == 2 || cfg->cam_focal_length > 0 || cfg->mpisize > 1) {
+            MMC_ERROR(-2, "--hybrid can not be combined with the replay, the convergence target, checkpoints, --varbatch, --sparsegate, --incache, --pmc, saved seeds, trajectories, detector images, the camera or MPI");
         }
 
-        MMC_FPRINTF(stdout, "] %3d%%" S_RESET, (int)(percent * 100));
+        /*the OpenCL records only hold the exit position and direction*/
+        if (cfg->issavedet && cfg->compute != cbCUDA) {
+            MMC_ERROR(-2, "--hybrid can only save the detected photons with -c cuda");
+        }
 
-        mcx_fflush(stdout);
+        cfg->streamdet = 0;
     }
-}
 
-#ifndef MCX_CONTAINER
+    /*the sorted mode keeps the photon states on the GPU between short launches, see mmc_sort_loop*/
+    if (cfg->gpusort < 0) {
+        MMC_ERROR(-2, "--gpusort must be 0 or a positive number of scattering events");
+    }
 
-/**
- * @brief Function to read a single parameter value followed by a command line option
- *
- * This function reads different types of parameter values following a command line option.
- *
- * @param[in] argc: the number of total command line parameters
- * @param[in] argv: the pointer to all command line options
- * @param[in] id: which parameter to be parsed
- * @param[out] output: the pointer to which the parsed value to be written
- * @param[in] type: the type of data support char, int, float, string, bytenumlist, floatlist
- */
+    if (cfg->compute == cbSSE || cfg->gpuid > MAX_DEVICE) {
+        cfg->gpusort = 0;
+    }
 
-int mcx_readarg(int argc, char* argv[], int id, void* output, const char* type) {
-    /*
-        when a binary option is given without a following number (0~1),
-        we assume it is 1
-    */
-    if (strcmp(type, "bool") == 0 && (id >= argc - 1 || (argv[id + 1][0] < '0' || argv[id + 1][0] > '9'))) {
-        *((char*)output) = 1;
-        return id;
+    if (cfg->gpusort > 0 && (cfg->compute != cbCUDA || cfg->seed == SEED_FROM_FILE || cfg->issaveseed || (cfg->debuglevel & dlTraj))) {
+        MMC_ERROR(-2, "--gpusort only supports -c cuda, and can not replay photons or save their seeds or trajectories");
     }
 
-    if (id < argc - 1) {
-        if (strcmp(type, "bool") == 0) {
-            *((char*)output) = atoi(argv[id + 1]);
-        } else if (strcmp(type, "char") == 0) {
-            *((char*)output) = argv[id + 1][0];
-        } else if (strcmp(type, "int") == 0) {
-            *((int*)output) = atoi(argv[id + 1]);
-        } else if (strcmp(type, "float") == 0) {
-            *((float*)output) = atof(argv[id + 1]);
-        } else if (strcmp(type, "string") == 0) {
-            strcpy((char*)output, argv[id + 1]);
-        } else if (strcmp(type, "bytenumlist") == 0) {
-            char* nexttok, *numlist = (char*)output;
-            int len = 0, i;
-            nexttok = strtok(argv[id + 1], " ,;");
+    /*the split mode shares the photon states of the sorted mode, see mmc_fission_launch*/
+    if (cfg->gpufission < 0) {
+        MMC_ERROR(-2, "--fission must be 0 or a positive number of scattering events");
+    }
 
-            while (nexttok) {
-                numlist[len++] = (char)(atoi(nexttok)); /*device id<256*/
+    if (cfg->compute == cbSSE || cfg->gpuid > MAX_DEVICE) {
+        cfg->gpufission = 0;
+    }
 
-                for (i = 0; i < len - 1; i++) /* remove duplicaetd ids */
-                    if (numlist[i] == numlist[len - 1]) {
-                        numlist[--len] = '\0';
-                        break;
-                    }
+    if (cfg->gpufission > 0 && (cfg->compute != cbCUDA || cfg->gpusort > 0 || cfg->seed == SEED_FROM_FILE || cfg->issaveseed || (cfg->debuglevel & dlTraj))) {
+        MMC_ERROR(-2, "--fission only supports -c cuda without --gpusort, and can not replay photons or save their seeds or trajectories");
+    }
 
-                nexttok = strtok(NULL, " ,;");
-                /*if(len>=MAX_DEVICE) break;*/
-            }
-        } else if (strcmp(type, "floatlist") == 0) {
-            char* nexttok;
-            float* numlist = (float*)output;
-            int len = 0;
-            nexttok = strtok(argv[id + 1], " ,;");
+    /*the emission stage is launched from the excitation output of the same process, see mmc_run_emission*/
+    if (cfg->emitfile[0]) {
+        if ((cfg->compute != cbSSE && cfg->gpuid <= MAX_DEVICE) || cfg->parentid != mpStandalone) {
+            MMC_ERROR(-2, "--emission only supports the CPU simulation (-c sse) from the command line");
+        }
 
-            while (nexttok) {
-                numlist[len++] = atof(nexttok); /*device id<256*/
-                nexttok = strtok(NULL, " ,;");
-            }
+        if (cfg->seed == SEED_FROM_FILE || cfg->srcnum > 1 || cfg->wavefile[0] || cfg->waveproplen > 0 || cfg->issparsegate || cfg->varbatch > 1
+                || cfg->ckptperiod > 0 || cfg->checkpt[0] > 0 || cfg->isresume || cfg->convtarget > 0.f || cfg->mpisize > 1 || cfg->inccache[0] || cfg->pmcfile[0]) {
+            MMC_ERROR(-2, "--emission can not be combined with the replay, multiple patterns, --waveprop, --sparsegate, --varbatch, checkpoints, the convergence target, MPI, --incache or --pmc");
         }
-    } else {
-        MMC_ERROR(-1, "incomplete input");
     }
 
-    return id + 1;
-}
-
-#endif
+    /*the detected photons only add to g1(tau) of their detectors, see accumdcs*/
+    if (cfg->dcsmodel) {
+        if ((cfg->compute != cbSSE && cfg->gpuid <= MAX_DEVICE) || cfg->detnum == 0 || cfg->isextdet) {
+            MMC_ERROR(-2, "--dcs only supports the CPU simulation (-c sse) with disk/planar detectors");
+        }
 
-/**
- * @brief Test if a long command line option is supported
- *
- * This function returns 1 if a long option is found, and 0 otherwise
- *
- * @param[in] opt: the long command line option string
- */
+        if ((cfg->dcsmodel != 'b' && cfg->dcsmodel != 'f') || cfg->dcsdv < 0.f || cfg->dcslambda <= 0.f) {
+            MMC_ERROR(-2, "--dcs expects a brownian or flow model, a non-negative DV and a positive wavelength");
+        }
 
-int mcx_remap(char* opt) {
-    int i = 0;
+        if (cfg->seed == SEED_FROM_FILE || cfg->srcnum > 1 || cfg->wavefile[0] || cfg->waveproplen > 0 || cfg->issaveexit || cfg->issaveseed
+                || cfg->ckptperiod > 0 || cfg->checkpt[0] > 0 || cfg->isresume || cfg->inccache[0] || cfg->pmcfile[0] || cfg->emitfile[0]) {
+            MMC_ERROR(-2, "--dcs can not be combined with the replay, multiple patterns, --waveprop, -x, -q, checkpoints, --incache, --pmc or --emission");
+        }
 
-    while (shortopt[i] != '\0') {
-        if (strcmp(opt, fullopt[i]) == 0) {
-            opt[1] = shortopt[i];
+        if (cfg->dcstaunum == 0) {
+            cfg->dcstaunum = MMC_DCS_TAU_NUM;
+            cfg->dcstau = (float*)malloc(cfg->dcstaunum * sizeof(float));
 
-            if (shortopt[i] != '-') {
-                opt[2] = '\0';
+            for (i = 0; i < cfg->dcstaunum; i++) {
+                cfg->dcstau[i] = powf(10.f, -7.f + 6.f * i / (cfg->dcstaunum - 1));
             }
+        }
 
-            return 0;
+        for (i = 0; i < cfg->dcstaunum; i++) {
+            if (cfg->dcstau[i] < 0.f) {
+                MMC_ERROR(-2, "the correlation times of --dcstau must not be negative");
+            }
         }
 
-        i++;
+        cfg->issavedet = 1;
+        cfg->ismomentum = 1;
+        cfg->streamdet = 0;
     }
 
-    return 1;
-}
-
-/**
- * @brief Look up a single character in a string
- *
- * @param[in] key: character to be looked up
- * @param[out] index: the dictionary string where the char is searched
- * @return if found, return 0; otherwise, return 1
- */
-
-int mcx_lookupindex(char* key, const char* index) {
-    int i = 0;
+    /*the detected photons only add to the statistics of their detectors, see accumdetstat and savedetphoton*/
+    if (cfg->isdetstat) {
+        if (cfg->detnum == 0 || cfg->isextdet || cfg->hybrid > 0.f) {
+            MMC_ERROR(-2, "--detstat needs disk/planar detectors, and does not support the hybrid CPU-GPU mode");
+        }
 
-    while (index[i] != '\0') {
-        if (tolower(*key) == index[i]) {
-            *key = i;
-            return 0;
+        if (cfg->seed == SEED_FROM_FILE || cfg->srcnum > 1 || cfg->wavefile[0] || cfg->waveproplen > 0 || cfg->issaveexit || cfg->issaveseed
+                || cfg->inccache[0] || cfg->pmcfile[0] || cfg->emitfile[0]) {
+            MMC_ERROR(-2, "--detstat can not be combined with the replay, multiple patterns, --waveprop, -x, -q, --incache, --pmc or --emission");
         }
 
-        i++;
+        cfg->issavedet = 1;
+        cfg->streamdet = 0;
     }
 
-    return 1;
-}
-
-/**
- * @brief Look up a string in a string list and return the index
- *
- * @param[in] key: string to be looked up
- * @param[out] table: the dictionary where the string is searched
- * @return if found, return the index of the string in the dictionary, otherwise -1.
- */
-
-int mcx_keylookup(char* origkey, const char* table[]) {
-    int i = 0;
-    char* key = malloc(strlen(origkey) + 1);
-    memcpy(key, origkey, strlen(origkey) + 1);
+    /*the Jacobians are integrated from the dense fields of the patterns after the run, see mesh_savejacobian*/
+    if (cfg->adjointnum < 0 || (cfg->adjointnum > 0 && cfg->adjointnum >= cfg->srcnum)) {
+        MMC_ERROR(-2, "--adjoint must be less than the number of source patterns");
+    }
 
-    while (key[i]) {
-        key[i] = tolower(key[i]);
-        i++;
+    if (cfg->adjointnum > 0 && (cfg->issparsegate || cfg->seed == SEED_FROM_FILE || (cfg->outputtype != otFlux && cfg->outputtype != otFluence))) {
+        MMC_ERROR(-2, "--adjoint needs the fluence (-O F) or fluence rate (-O X), and can not be used with --sparsegate or the replay");
     }
 
-    i = 0;
+    /*the detectors are launched one after the other by the same process, see mmc_run_reciprocal*/
+    if (cfg->isreciprocal) {
+        if (cfg->srctype != stPattern || cfg->detnum == 0 || cfg->isextdet) {
+            MMC_ERROR(-2, "--reciprocal needs a pattern source (-P) and disk detectors");
+        }
 
-    while (table[i] && table[i][0] != '\0') {
-        if (strcmp(key, table[i]) == 0) {
-            free(key);
-            return i;
+        if ((cfg->compute != cbSSE && cfg->gpuid <= MAX_DEVICE) || cfg->hybrid > 0.f || cfg->parentid != mpStandalone) {
+            MMC_ERROR(-2, "--reciprocal only supports the CPU simulation (-c sse) from the command line");
         }
 
-        i++;
+        if (cfg->seed == SEED_FROM_FILE || cfg->wavefile[0] || cfg->waveproplen > 0 || cfg->issparsegate || cfg->varbatch > 1 || cfg->ckptperiod > 0 || cfg->checkpt[0] > 0
+                || cfg->isresume || cfg->convtarget > 0.f || cfg->inccache[0] || cfg->pmcfile[0] || cfg->emitfile[0] || cfg->adjointnum > 0 || cfg->nextevent > 0.f || cfg->dcsmodel || cfg->isdetstat) {
+            MMC_ERROR(-2, "--reciprocal can not be combined with the replay, --waveprop, --sparsegate, --varbatch, checkpoints, the convergence target, --incache, --pmc, --emission, --adjoint, --nextevent, --dcs or --detstat");
+        }
     }
 
-    free(key);
-    return -1;
-}
+    /*the corners are only added to the nodes at the end of the run, see mesh_scatterelemweight*/
+    if (cfg->basisorder == 0 || cfg->issparsegate || cfg->ckptperiod > 0 || cfg->checkpt[0] > 0 || cfg->convtarget > 0.f || cfg->varbatch > 1) {
+        cfg->iselemmoment = 0;
+    }
 
-int mcx_isbinstr(const char* str) {
-    int i, len = strlen(str);
+    /*a phase function other than Henyey-Greenstein is only sampled through its inverse CDF*/
+    if ((cfg->tthg[1] != 0.f || cfg->phasefile[0]) && cfg->nphase == 0) {
+        cfg->nphase = MMC_PHASE_TABLE_LEN;
+    }
 
-    if (len == 0) {
-        return 0;
+    if (cfg->ishalfface && cfg->ispackmesh) {
+        MMC_ERROR(-2, "--halfface and --packmesh are two different GPU mesh layouts, only one can be used");
     }
 
-    for (i = 0; i < len; i++)
-        if (str[i] != '0' && str[i] != '1') {
-            return 0;
-        }
+    if (cfg->patternbits != 32 && cfg->patternbits != 16 && cfg->patternbits != 8) {
+        MMC_ERROR(-2, "--patternbits must be 32, 16 or 8");
+    }
 
-    return 1;
-}
+    /*the per-element media replace those of the labels, the features built on the per-label media are not supported*/
+    if (cfg->elempropfile[0]) {
+        if (cfg->issavedet || cfg->seed == SEED_FROM_FILE || cfg->pmcfile[0]) {
+            MMC_ERROR(-2, "--elemprop can not save, replay or re-weight the detected photons, whose partial paths are kept per label");
+        }
 
-/**
- * @brief Convert a row-major (C/C++) array to a column-major (MATLAB/FORTRAN) array
- *
- * @param[in,out] vol: a 3D array (wrapped in 1D) to be converted
- * @param[in] dim: the dimensions of the 3D array
- */
+        if (cfg->difflabel || cfg->waveproplen > 0 || cfg->emitfile[0] || cfg->nphase > 0 || cfg->inccache[0]) {
+            MMC_ERROR(-2, "--elemprop can not be combined with --diffusion, --waveprop, --emission, the tabulated phase functions or --incache");
+        }
+    }
 
-void  mcx_convertrow2col(float* vol, uint3* dim) {
-    uint x, y, z;
-    unsigned int dimxy, dimyz;
-    float* newvol = NULL;
+    if (cfg->nphase < 0 || cfg->nphase == 1 || cfg->nphase > MMC_PHASE_TABLE_MAX) {
+        MMC_ERROR(-2, "--phasetable must be 0 or between 2 and 1048576");
+    }
 
-    if (vol == NULL || dim->x == 0 || dim->y == 0 || dim->z == 0) {
-        return;
+    if (cfg->tthg[0] <= -1.f || cfg->tthg[0] >= 1.f || cfg->tthg[1] < 0.f || cfg->tthg[1] > 1.f) {
+        MMC_ERROR(-2, "--tthg needs an anisotropy in (-1,1) and a weight in [0,1]");
     }
 
-    newvol = (float*)malloc(sizeof(float) * dim->x * dim->y * dim->z);
-    dimxy = dim->x * dim->y;
-    dimyz = dim->y * dim->z;
+    if (cfg->shmname[0]) {
+#ifdef _WIN32
+        MMC_ERROR(-2, "--shm needs POSIX shared memory, it is not supported on Windows");
+#else
+        const char* shmid = cfg->shmname + (cfg->shmname[0] == '/');
 
-    for (x = 0; x < dim->x; x++)
-        for (y = 0; y < dim->y; y++)
-            for (z = 0; z < dim->z; z++) {
-                newvol[z * dimxy + y * dim->x + x] = vol[x * dimyz + y * dim->z + z];
-            }
+        if (shmid[0] == '\0' || shmid[strspn(shmid, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_-.")] || strlen(shmid) > 200) {
+            MMC_ERROR(-2, "the --shm segment name may only contain letters, digits, '_', '-' and '.'");
+        }
 
-    memcpy(vol, newvol, sizeof(float) * dim->x * dim->y * dim->z);
-    free(newvol);
+#endif
+    }
+
+    for (i = 0; i < MAX_DEVICE; i++)
+        if (cfg->deviceid[i] == '0') {
+            cfg->deviceid[i] = '\0';
+        }
 }
 
 /**
- * @brief Validate all input fields, and warn incompatible inputs
+ * @brief Compact the replayed photons after the detected photons are filtered
  *
- * Perform self-checking and raise exceptions or warnings when input error is detected
+ * The weight, time and detector ID of every detected photon are first written
+ * at its own index of cfg->replayweight/replaytime/replaydetid. The kept
+ * photons are counted in chunks of at least MIN_REPLAY_CHUNK photons by
+ * different threads, and a prefix sum of the counts gives the output offset of
+ * each chunk, so the photons are gathered in parallel, in the original order.
+ * If all photons are kept, nothing is copied and the loaded seeds are used in place.
  *
- * @param[in,out] cfg: the simulation configuration structure
+ * @param[in,out] cfg: simulation configuration, cfg->nphoton is set to the kept photon number
+ * @param[in] keep: 1 for each detected photon to be replayed, 0 otherwise
+ * @param[in] len: the number of detected photons
+ * @param[in] seedbyte: the number of bytes per RNG seed
  */
 
-void mcx_validatecfg(mcconfig* cfg) {
-    int i;
+void mcx_replaycompact(mcconfig* cfg, const unsigned char* keep, int len, int seedbyte) {
+    int nchunk = 1, c, total;
+    int* start;
+    float* weight, *tof;
+    int* detid = NULL;
+    char* seed;
 
-    if (cfg->nphoton <= 0) {
-        MMC_ERROR(-2, "cfg.nphoton must be a positive number");
-    }
+#ifdef _OPENMP
+    nchunk = MAX(1, MIN(omp_get_max_threads(), len / MIN_REPLAY_CHUNK));
+#endif
 
-    if (cfg->tstart > cfg->tend || cfg->tstep == 0.f) {
-        MMC_ERROR(-2, "incorrect time gate settings or missing tstart/tend/tstep fields");
-    }
+    start = (int*)calloc(nchunk + 1, sizeof(int));
 
-    if (cfg->tstep > cfg->tend - cfg->tstart) {
-        cfg->tstep = cfg->tend - cfg->tstart;
-    }
+    #pragma omp parallel for
 
-    if (cfg->steps.x != cfg->steps.y || cfg->steps.y != cfg->steps.z) {
-        MMC_ERROR(-2, "MMC dual-grid algorithm currently does not support anisotropic voxels");
-    }
+    for (c = 0; c < nchunk; c++) {
+        int i, end = (int)((long long)len * (c + 1) / nchunk), count = 0;
 
-    if (fabs(cfg->srcdir.x * cfg->srcdir.x + cfg->srcdir.y * cfg->srcdir.y + cfg->srcdir.z * cfg->srcdir.z - 1.f) > 1e-4) {
-        MMC_ERROR(-2, "field 'srcdir' must be a unitary vector (tolerance is 1e-4)");
+        for (i = (int)((long long)len * c / nchunk); i < end; i++) {
+            count += keep[i];
+        }
+
+        start[c + 1] = count;
     }
 
-    if (cfg->tend <= cfg->tstart) {
-        MMC_ERROR(-2, "field 'tend' must be greater than field 'tstart'");
+    for (c = 0; c < nchunk; c++) {
+        start[c + 1] += start[c];
     }
 
-    cfg->maxgate = (int)((cfg->tend - cfg->tstart) / cfg->tstep + 0.5);
-    cfg->tend = cfg->tstart + cfg->tstep * cfg->maxgate;
+    total = start[nchunk];
+    cfg->nphoton = total;
 
-    if (cfg->srctype == stPattern && cfg->srcpattern == NULL) {
-        MMC_ERROR(-2, "the 'srcpattern' field can not be empty when your 'srctype' is 'pattern'");
+    if (total == len) {
+        free(start);
+        return;
     }
 
-    if (cfg->srcnum > 1 && cfg->seed == SEED_FROM_FILE) {
-        MMC_ERROR(-2, "multiple source simulation is currently not supported under replay mode");
-    }
+    weight = (float*)malloc(MAX(total, 1) * sizeof(float));
+    tof = (float*)malloc(MAX(total, 1) * sizeof(float));
+    seed = (char*)malloc((size_t)MAX(total, 1) * seedbyte);
 
-    if (cfg->seed < 0 && cfg->seed != SEED_FROM_FILE) {
-        cfg->seed = time(NULL);
+    if (cfg->replaydetid) {
+        detid = (int*)malloc(MAX(total, 1) * sizeof(int));
     }
 
-    if (cfg->compute != cbSSE && (cfg->method != rtBLBadouelGrid && cfg->method != rtBLBadouel)) {
-        cfg->method = rtBLBadouel;
-    }
+    #pragma omp parallel for
 
-#ifndef MMC_USE_SSE
+    for (c = 0; c < nchunk; c++) {
+        int i, j = start[c], end = (int)((long long)len * (c + 1) / nchunk);
 
-    if (cfg->gpuid > MAX_DEVICE) {
-        cfg->method = rtPlucker;
-    }
+        for (i = (int)((long long)len * c / nchunk); i < end; i++) {
+            if (!keep[i]) {
+                continue;
+            }
 
-#endif
+            memcpy(seed + (size_t)j * seedbyte, (char*)(cfg->photonseed) + (size_t)i * seedbyte, seedbyte);
+            weight[j] = cfg->replayweight[i];
+            tof[j] = cfg->replaytime[i];
 
-    if (cfg->method == rtBLBadouelGrid) {
-        cfg->basisorder = 0;
-    }
+            if (detid) {
+                detid[j] = cfg->replaydetid[i];
+            }
 
-    if (cfg->implicit && (int)(cfg->gpuid) >= 0) {
-        MMC_ERROR(-2, "Implicit MMC is currently only supported in the CPU, please set -G -1 or cfg.gpuid=-1");
+            j++;
+        }
     }
 
-    for (i = 0; i < MAX_DEVICE; i++)
-        if (cfg->deviceid[i] == '0') {
-            cfg->deviceid[i] = '\0';
-        }
+    free(cfg->photonseed);
+    free(cfg->replayweight);
+    free(cfg->replaytime);
+    free(cfg->replaydetid);
+    cfg->photonseed = seed;
+    cfg->replayweight = weight;
+    cfg->replaytime = tof;
+    cfg->replaydetid = detid;
+    free(start);
 }
 
 /**
  * @brief Initialize the replay data structure from detected photon data - in embedded mode (MATLAB/Python)
  *
+ * The detected photons are filtered in parallel, see mcx_replaycompact. The
+ * attenuation of a photon is computed from the sum of mua*L over all media,
+ * with a single expf call.
+ *
  * @param[in,out] cfg: simulation configuration
  * @param[in] detps: detected photon data
  * @param[in] dimdetps: the dimension vector of the detected photon data
@@ -2983,8 +5916,9 @@ void mcx_validatecfg(mcconfig* cfg) {
  */
 
 void mcx_replayinit(mcconfig* cfg, float* detps, int dimdetps[2], int seedbyte) {
-    int i, j, hasdetid = 0, offset;
-    float plen;
+    int i, hasdetid = 0, offset, medianum = cfg->medianum - 1, err = 0;
+    float* mua, *nc0;
+    unsigned char* keep;
 
     if (cfg->seed == SEED_FROM_FILE && detps == NULL) {
         MMC_ERROR(-6, "you give cfg.seed for replay, but did not specify cfg.detphotons.\nPlease define it as the detphoton output from the baseline simulation\n");
@@ -3011,38 +5945,62 @@ void mcx_replayinit(mcconfig* cfg, float* detps, int dimdetps[2], int seedbyte)
 
     cfg->replayweight = (float*) malloc(cfg->nphoton * sizeof(float));
     cfg->replaytime = (float*) calloc(cfg->nphoton, sizeof(float));
+    keep = (unsigned char*) malloc(cfg->nphoton);
 
-    cfg->nphoton = 0;
+    if (cfg->replaydet == -1 && cfg->detnum > 1 && (cfg->outputtype == otWL || cfg->outputtype == otWP)) {
+        cfg->replaydetid = (int*) malloc(cfg->nphoton * sizeof(int));
+        cfg->replaydetnum = cfg->detnum;
+    }
+
+    /*mua and n/c0 of the media in the partial-path column order*/
+    mua = (float*) malloc(MAX(medianum, 1) * 2 * sizeof(float));
+    nc0 = mua + MAX(medianum, 1);
+
+    for (i = 0; i < medianum; i++) {
+        mua[i] = cfg->prop[i + 1].mua;
+        nc0[i] = cfg->unitinmm * R_C0 * cfg->prop[i + 1].n;
+    }
+
+    #pragma omp parallel for schedule(static) reduction(|:err)
 
     for (i = 0; i < dimdetps[1]; i++) {
-        if (cfg->replaydet <= 0 || cfg->replaydet == (int) (detps[i * dimdetps[0]])) {
-            if (i != cfg->nphoton) {
-                memcpy((char*) (cfg->photonseed) + cfg->nphoton * seedbyte,
-                       (char*) (cfg->photonseed) + i * seedbyte,
-                       seedbyte);
-            }
+        const float* ppath = detps + (size_t)i * dimdetps[0];
+        const float* plen = ppath + offset + hasdetid;
+        float att = 0.f, tof = 0.f;
+        int j;
 
-            cfg->replayweight[cfg->nphoton] = 1.f;
-            cfg->replaytime[cfg->nphoton] = 0.f;
+        keep[i] = (cfg->replaydet <= 0 || cfg->replaydet == (int) (ppath[0]));
 
-            for (j = hasdetid; j < cfg->medianum - 1 + hasdetid; j++) {
-                plen = detps[i * dimdetps[0] + offset + j];
-                cfg->replayweight[cfg->nphoton] *= expf(-cfg->prop[j - hasdetid + 1].mua * plen);
-                plen *= cfg->unitinmm;
-                cfg->replaytime[cfg->nphoton] += plen * R_C0 * cfg->prop[j - hasdetid + 1].n;
-            }
+        if (!keep[i]) {
+            continue;
+        }
 
-            if (cfg->replaytime[cfg->nphoton] < cfg->tstart
-                    || cfg->replaytime[cfg->nphoton] > cfg->tend) { /*need to consider -g*/
-                continue;
-            }
+        if (cfg->replaydetid) {
+            cfg->replaydetid[i] = (int) (ppath[0]);
+            err |= (cfg->replaydetid[i] < 1 || cfg->replaydetid[i] > cfg->detnum);
+        }
+
+        #pragma omp simd reduction(+:att,tof)
 
-            cfg->nphoton++;
+        for (j = 0; j < medianum; j++) {
+            att += mua[j] * plen[j];
+            tof += nc0[j] * plen[j];
         }
+
+        cfg->replayweight[i] = expf(-att);
+        cfg->replaytime[i] = tof;
+        keep[i] = (tof >= cfg->tstart && tof <= cfg->tend); /*need to consider -g*/
+    }
+
+    free(mua);
+
+    if (err) {
+        free(keep);
+        MMC_ERROR(-6, "the detector ID of a replayed photon exceeds the detector number");
     }
 
-    cfg->replayweight = (float*) realloc(cfg->replayweight, cfg->nphoton * sizeof(float));
-    cfg->replaytime = (float*) realloc(cfg->replaytime, cfg->nphoton * sizeof(float));
+    mcx_replaycompact(cfg, keep, dimdetps[1], seedbyte);
+    free(keep);
 }
 
 /**
@@ -3088,6 +6046,15 @@ void mmc_validate_config(mcconfig* cfg, float* detps, int dimdetps[2], int seedb
 
     cfg->his.unitinmm = cfg->unitinmm;
 
+    /*the detected photons only add to the statistics of their detectors, see mesh_normdetstat*/
+    if (cfg->isdetstat) {
+        if (cfg->detnum == 0 || cfg->isextdet || cfg->seed == SEED_FROM_FILE || cfg->srcnum > 1 || cfg->issaveexit) {
+            MMC_ERROR(999, "cfg.isdetstat needs disk/planar detectors, and can not be used with replay, multiple patterns or cfg.issaveexit");
+        }
+
+        cfg->issavedet = 1;
+    }
+
     if (cfg->steps.x != cfg->steps.y || cfg->steps.y != cfg->steps.z) {
         MMC_ERROR(999, "MMC dual-grid algorithm currently does not support anisotropic voxels");
     }
@@ -3096,6 +6063,44 @@ void mmc_validate_config(mcconfig* cfg, float* detps, int dimdetps[2], int seedb
         cfg->issavedet = 0;
     }
 
+    if (cfg->ishalfface && cfg->ispackmesh) {
+        MMC_ERROR(-2, "--halfface and --packmesh are two different GPU mesh layouts, only one can be used");
+    }
+
+    if (cfg->patternbits != 32 && cfg->patternbits != 16 && cfg->patternbits != 8) {
+        MMC_ERROR(-2, "--patternbits must be 32, 16 or 8");
+    }
+
+    /*the per-element media replace those of the labels, the features built on the per-label media are not supported*/
+    if (cfg->elempropfile[0]) {
+        if (cfg->issavedet || cfg->seed == SEED_FROM_FILE || cfg->pmcfile[0]) {
+            MMC_ERROR(-2, "--elemprop can not save, replay or re-weight the detected photons, whose partial paths are kept per label");
+        }
+
+        if (cfg->difflabel || cfg->waveproplen > 0 || cfg->emitfile[0] || cfg->nphase > 0 || cfg->inccache[0]) {
+            MMC_ERROR(-2, "--elemprop can not be combined with --diffusion, --waveprop, --emission, the tabulated phase functions or --incache");
+        }
+    }
+
+    /*the per-element counters are collected by the CPU ray-tracers*/
+    if (cfg->isheatmap && ((cfg->compute != cbSSE && cfg->gpuid <= MAX_DEVICE) || cfg->hybrid > 0.f)) {
+        MMC_ERROR(-2, "--heatmap only counts the ray-tet tests of the CPU simulation, please use -c sse");
+    }
+
+    if (cfg->outmask[0]) {
+        if ((cfg->compute != cbSSE && cfg->gpuid <= MAX_DEVICE) || cfg->basisorder) {
+            MMC_ERROR(999, "cfg.outmask selects the elements of the output, it needs cfg.basisorder=0 and only runs on the CPU (cfg.gpuid=-1)");
+        }
+
+        if (cfg->issparsegate || cfg->waveproplen > 0 || cfg->freqnum > 0 || cfg->adjointnum > 0) {
+            MMC_ERROR(999, "cfg.outmask can not be combined with the sparse, multi-wavelength, frequency-domain or adjoint outputs");
+        }
+
+        if (cfg->method == rtBLBadouelGrid) {
+            cfg->method = rtBLBadouel;
+        }
+    }
+
     if (cfg->seed < 0 && cfg->seed != SEED_FROM_FILE) {
         cfg->seed = time(NULL);
     }
@@ -3105,6 +6110,126 @@ void mmc_validate_config(mcconfig* cfg, float* detps, int dimdetps[2], int seedb
         cfg->issaveexit = 0;
     }
 
+    /*the detector image and the MATLAB/Python outputs need all records in memory*/
+    if (cfg->streamdet < 0 || cfg->issavedet == 0 || cfg->issaveexit == 2 || cfg->parentid != mpStandalone) {
+        cfg->streamdet = 0;
+    }
+
+    if (cfg->flushrespin < 0) {
+        cfg->flushrespin = 0;
+    }
+
+    /*in the MPI mode, each rank simulates a share of the photons, which can not be streamed, checkpointed or tested for convergence alone*/
+    if (cfg->mpisize > 1) {
+        if (cfg->compute != cbSSE) {
+            MMC_ERROR(-2, "the MPI mode only supports the CPU simulation, please use -c sse");
+        }
+
+        if (cfg->mpirank == 0 && (cfg->ckptperiod > 0 || cfg->checkpt[0] > 0 || cfg->isresume || cfg->convtarget > 0.f)) {
+            MMC_FPRINTF(cfg->flog, S_YELLOW "WARNING: checkpoints and the convergence target are not supported in the MPI mode, ignored\n" S_RESET);
+        }
+
+        cfg->ckptperiod = 0;
+        cfg->checkpt[0] = 0;
+        cfg->isresume = 0;
+        cfg->convtarget = 0.f;
+        cfg->streamdet = 0;
+    }
+
+    /*the per-thread output copies multiply the largest buffer of the run*/
+    if (cfg->isleanmem) {
+        cfg->isprivatebuf = 0;
+    }
+
+    /*a replay must process every stored photon*/
+    if (cfg->convtarget < 0.f || cfg->seed == SEED_FROM_FILE) {
+        cfg->convtarget = 0.f;
+    }
+
+    if (cfg->convbatch < 0) {
+        MMC_ERROR(-2, "convbatch must be a non-negative number");
+    }
+
+    if (cfg->varbatch < 0 || cfg->varbatch == 1) {
+        MMC_ERROR(-2, "varbatch must be 0 or at least 2");
+    }
+
+    if (cfg->freqnum > MAX_FREQ_NUM || (cfg->freqnum > 0 && cfg->seed == SEED_FROM_FILE)) {
+        MMC_ERROR(999, "cfg.freq supports up to 16 frequencies and can not be used in the replay mode");
+    }
+
+    if (cfg->pmcsetnum > 0 && (cfg->mcmethod != mmMCX || cfg->issaveexit == 2 || cfg->seed == SEED_FROM_FILE)) {
+        MMC_ERROR(999, "cfg.pmcprop requires cfg.mcmethod=0 and can not be used in the replay mode or with cfg.issaveexit=2");
+    }
+
+    /*the checkpoints hold all detected photons of a thread, the streamed records can not be rolled back*/
+    if (cfg->ckptperiod > 0 || cfg->checkpt[0] > 0 || cfg->isresume) {
+        cfg->streamdet = 0;
+    }
+
+    /*on the GPU, each respin is a batch*/
+    if (cfg->convtarget > 0.f && cfg->compute != cbSSE && cfg->issavedet && cfg->respin == 1) {
+        cfg->respin = (cfg->convbatch > 0) ? MAX((int)(cfg->nphoton / cfg->convbatch), 1) : 100;
+    }
+
+    if (cfg->varbatch > 1 && cfg->compute != cbSSE && cfg->respin == 1) {
+        cfg->respin = cfg->varbatch;
+    }
+
+    /*the hybrid mode merges the CPU share into the output of one GPU run, see mmc_run_hybrid*/
+    if (cfg->hybrid < 0.f || cfg->hybrid >= 1.f) {
+        MMC_ERROR(-2, "hybrid must be 0 or a fraction below 1");
+    }
+
+    if (cfg->compute == cbSSE || cfg->gpuid > MAX_DEVICE) {
+        cfg->hybrid = 0.f;
+    }
+
+    if (cfg->hybrid > 0.f) {
+        if (cfg->seed == SEED_FROM_FILE || cfg->convtarget > 0.f || cfg->ckptperiod > 0 || cfg->checkpt[0] > 0 || cfg->isresume
+                || cfg->varbatch > 1 || cfg->issparsegate || cfg->inccache[0] || cfg->issaveseed || (cfg->debuglevel & dlTraj)
+                || cfg->issaveexit == 2 || cfg->cam_focal_length > 0) {
+            MMC_ERROR(-2, "the hybrid mode can not be used with the replay, a convergence target, checkpoints, the variance, sparse gates, the incremental mode, saved seeds, trajectories, detector images or the camera");
+        }
+
+        /*the OpenCL records only hold the exit position and direction*/
+        if (cfg->issavedet && cfg->compute != cbCUDA) {
+            MMC_ERROR(-2, "the hybrid mode can only save the detected photons with -c cuda");
+        }
+
+        cfg->streamdet = 0;
+    }
+
+    /*the sorted mode keeps the photon states on the GPU between short launches, see mmc_sort_loop*/
+    if (cfg->gpusort < 0) {
+        MMC_ERROR(-2, "gpusort must be 0 or a positive number of scattering events");
+    }
+
+    if (cfg->compute == cbSSE || cfg->gpuid > MAX_DEVICE) {
+        cfg->gpusort = 0;
+    }
+
+    if (cfg->gpusort > 0 && (cfg->compute != cbCUDA || cfg->seed == SEED_FROM_FILE || cfg->issaveseed || (cfg->debuglevel & dlTraj))) {
+        MMC_ERROR(-2, "gpusort only supports -c cuda, and can not replay photons or save their seeds or trajectories");
+    }
+
+    /*the split mode shares the photon states of the sorted mode, see mmc_fission_launch*/
+    if (cfg->gpufission < 0) {
+        MMC_ERROR(-2, "gpufission must be 0 or a positive number of scattering events");
+    }
+
+    if (cfg->compute == cbSSE || cfg->gpuid > MAX_DEVICE) {
+        cfg->gpufission = 0;
+    }
+
+    if (cfg->gpufission > 0 && (cfg->compute != cbCUDA || cfg->gpusort > 0 || cfg->seed == SEED_FROM_FILE || cfg->issaveseed || (cfg->debuglevel & dlTraj))) {
+        MMC_ERROR(-2, "gpufission only supports -c cuda without gpusort, and can not replay photons or save their seeds or trajectories");
+    }
+
+    if (cfg->basisorder == 0 || cfg->method == rtBLBadouelGrid || cfg->issparsegate || cfg->ckptperiod > 0 || cfg->checkpt[0] > 0 || cfg->convtarget > 0.f || cfg->varbatch > 1) {
+        cfg->iselemmoment = 0;
+    }
+
     if (cfg->seed == SEED_FROM_FILE && cfg->his.detected != cfg->nphoton) {
         cfg->his.detected = 0;
 
@@ -3141,7 +6266,12 @@ void mcx_prep(mcconfig* cfg) {
         cfg->issaveexit = 0;
     }
 
-    cfg->savedetflag = 0x47;
+    /*only the scattering counts are optional, the other fields follow -m and -x; pmc re-weighting needs the counts*/
+    cfg->savedetflag = 0x45 | (cfg->savedetflag & 0x2);
+
+    if (cfg->pmcsetnum > 0 || cfg->isdetstat) {
+        cfg->savedetflag = SET_SAVE_NSCAT(cfg->savedetflag);
+    }
 
     if (cfg->ismomentum) {
         cfg->savedetflag = SET_SAVE_MOM(cfg->savedetflag);
@@ -3154,6 +6284,34 @@ void mcx_prep(mcconfig* cfg) {
 
 }
 
+/**
+ * @brief Return the float number of a detected photon record on the host
+ *
+ * A record stores the detector ID, the optional per-medium scattering counts, the per-medium
+ * partial paths, the optional momentum transfers and exit position/direction, and the initial weight
+ *
+ * @param[in] cfg: simulation configuration, after mcx_prep
+ * @param[in] medianum: the number of media, excluding medium 0
+ */
+
+int mcx_detreclen(mcconfig* cfg, int medianum) {
+    return (1 + SAVE_NSCAT(cfg->savedetflag) + (cfg->ismomentum > 0)) * medianum + (cfg->issaveexit > 0) * 6 + 2;
+}
+
+/**
+ * @brief Return the number of statistics accumulated per detector with --detstat
+ *
+ * The detected weight of each time gate is followed by the weighted sums of the
+ * partial paths and of the scattering counts of each medium, and the detected weight
+ *
+ * @param[in] cfg: simulation configuration
+ * @param[in] medianum: the number of media, excluding medium 0
+ */
+
+int mcx_detstatlen(mcconfig* cfg, int medianum) {
+    return cfg->maxgate + 2 * medianum + 1;
+}
+
 #ifndef MCX_CONTAINER
 
 /**
@@ -3317,12 +6475,8 @@ void mcx_parsecmd(int argc, char* argv[], mcconfig* cfg) {
 
                 case 'E':
                     if (i + 1 < argc && strstr(argv[i + 1], ".mch") != NULL) { /*give an mch file to initialize the seed*/
-#if defined(MMC_LOGISTIC) || defined(MMC_SFMT)
-                        MMC_ERROR(-1, "seeding file is not supported in this binary");
-#else
                         i = mcx_readarg(argc, argv, i, cfg->seedfile, "string");
                         cfg->seed = SEED_FROM_FILE;
-#endif
                     } else {
                         i = mcx_readarg(argc, argv, i, &(cfg->seed), "int");
                     }
@@ -3507,14 +6661,18 @@ void mcx_parsecmd(int argc, char* argv[], mcconfig* cfg) {
                         free(jbuf);
                         exit(0);
                     } else {
+                        char docurl[MAX_PATH_LENGTH];
+
                         if (strstr(argv[i + 1], "http") == argv[i + 1]) {
-                            runcommand("curl -s -X GET ", argv[i + 1], &jsoninput);
+                            snprintf(docurl, MAX_PATH_LENGTH, "%s", argv[i + 1]);
                         } else if (strchr(argv[i + 1], '/')) {
-                            runcommand("curl -s -X GET https://neurojson.io:7777/", argv[i + 1], &jsoninput);
+                            snprintf(docurl, MAX_PATH_LENGTH, "https://neurojson.io:7777/%s", argv[i + 1]);
                         } else {
-                            runcommand("curl -s -X GET https://neurojson.io:7777/mmc/", argv[i + 1], &jsoninput);
+                            snprintf(docurl, MAX_PATH_LENGTH, "https://neurojson.io:7777/mmc/%s", argv[i + 1]);
                         }
 
+                        fetchurl(docurl, &jsoninput);
+
                         isinteractive = 2;
                     }
 
@@ -3529,6 +6687,233 @@ void mcx_parsecmd(int argc, char* argv[], mcconfig* cfg) {
                         }
                     } else if (strcmp(argv[i] + 2, "atomic") == 0) {
                         i = mcx_readarg(argc, argv, i, &(cfg->isatomic), "bool");
+                    } else if (strcmp(argv[i] + 2, "wavefront") == 0) {
+                        i = mcx_readarg(argc, argv, i, &(cfg->iswavefront), "bool");
+                    } else if (strcmp(argv[i] + 2, "photonblock") == 0) {
+                        i = mcx_readarg(argc, argv, i, &(cfg->photonblock), "int");
+                    } else if (strcmp(argv[i] + 2, "privatebuf") == 0) {
+                        i = mcx_readarg(argc, argv, i, &(cfg->isprivatebuf), "bool");
+                    } else if (strcmp(argv[i] + 2, "elemmoment") == 0) {
+                        i = mcx_readarg(argc, argv, i, &(cfg->iselemmoment), "bool");
+                    } else if (strcmp(argv[i] + 2, "numa") == 0) {
+                        i = mcx_readarg(argc, argv, i, &(cfg->isnuma), "bool");
+                    } else if (strcmp(argv[i] + 2, "leanmem") == 0) {
+                        i = mcx_readarg(argc, argv, i, &(cfg->isleanmem), "bool");
+                    } else if (strcmp(argv[i] + 2, "sparsegate") == 0) {
+                        i = mcx_readarg(argc, argv, i, &(cfg->issparsegate), "bool");
+                    } else if (strcmp(argv[i] + 2, "reorder") == 0) {
+                        i = mcx_readarg(argc, argv, i, &(cfg->reorder), "bool");
+                    } else if (strcmp(argv[i] + 2, "dumpmesh") == 0) {
+                        i = mcx_readarg(argc, argv, i, &(cfg->isdumpmesh), "bool");
+                    } else if (strcmp(argv[i] + 2, "cachetracer") == 0) {
+                        i = mcx_readarg(argc, argv, i, &(cfg->iscachetracer), "bool");
+                    } else if (strcmp(argv[i] + 2, "cachekernel") == 0) {
+                        i = mcx_readarg(argc, argv, i, &(cfg->iscachekernel), "bool");
+                    } else if (strcmp(argv[i] + 2, "dynload") == 0) {
+                        i = mcx_readarg(argc, argv, i, &(cfg->isdynload), "bool");
+                    } else if (strcmp(argv[i] + 2, "autotune") == 0) {
+                        i = mcx_readarg(argc, argv, i, &(cfg->autotune), "bool");
+                    } else if (strcmp(argv[i] + 2, "hybrid") == 0) {
+                        i = mcx_readarg(argc, argv, i, &(cfg->hybrid), "float");
+                    } else if (strcmp(argv[i] + 2, "persistent") == 0) {
+                        i = mcx_readarg(argc, argv, i, &(cfg->ispersistent), "bool");
+                    } else if (strcmp(argv[i] + 2, "gpusort") == 0) {
+                        i = mcx_readarg(argc, argv, i, &(cfg->gpusort), "int");
+                    } else if (strcmp(argv[i] + 2, "fission") == 0) {
+                        i = mcx_readarg(argc, argv, i, &(cfg->gpufission), "int");
+                    } else if (strcmp(argv[i] + 2, "unifiedmem") == 0) {
+                        i = mcx_readarg(argc, argv, i, &(cfg->unifiedmem), "bool");
+                    } else if (strcmp(argv[i] + 2, "savedetflag") == 0) {
+                        if (i + 1 < argc && isalpha((int)argv[i + 1][0]) ) {
+                            cfg->savedetflag = mcx_parsedebugopt(argv[++i], saveflag);
+                        } else {
+                            i = mcx_readarg(argc, argv, i, &(cfg->savedetflag), "int");
+                        }
+                    } else if (strcmp(argv[i] + 2, "flushrespin") == 0) {
+                        i = mcx_readarg(argc, argv, i, &(cfg->flushrespin), "int");
+                    } else if (strcmp(argv[i] + 2, "packmesh") == 0) {
+                        i = mcx_readarg(argc, argv, i, &(cfg->ispackmesh), "bool");
+                    } else if (strcmp(argv[i] + 2, "localmesh") == 0) {
+                        i = mcx_readarg(argc, argv, i, &(cfg->islocalmesh), "bool");
+                    } else if (strcmp(argv[i] + 2, "halfface") == 0) {
+                        i = mcx_readarg(argc, argv, i, &(cfg->ishalfface), "bool");
+                    } else if (strcmp(argv[i] + 2, "patternbits") == 0) {
+                        i = mcx_readarg(argc, argv, i, &(cfg->patternbits), "int");
+                    } else if (strcmp(argv[i] + 2, "streamdet") == 0) {
+                        i = mcx_readarg(argc, argv, i, &(cfg->streamdet), "int");
+                    } else if (strcmp(argv[i] + 2, "saveprofile") == 0) {
+                        i = mcx_readarg(argc, argv, i, &(cfg->issaveprofile), "bool");
+                    } else if (strcmp(argv[i] + 2, "heatmap") == 0) {
+                        i = mcx_readarg(argc, argv, i, &(cfg->isheatmap), "bool");
+                    } else if (strcmp(argv[i] + 2, "estimate") == 0) {
+                        i = mcx_readarg(argc, argv, i, &(cfg->isestimate), "bool");
+                    } else if (strcmp(argv[i] + 2, "domain") == 0) {
+                        i = mcx_readarg(argc, argv, i, &(cfg->isdomain), "bool");
+                    } else if (strcmp(argv[i] + 2, "checkpoint") == 0) {
+                        i = mcx_readarg(argc, argv, i, &np, "float");
+                        cfg->ckptperiod = (size_t)np;
+                    } else if (strcmp(argv[i] + 2, "resume") == 0) {
+                        i = mcx_readarg(argc, argv, i, &(cfg->isresume), "bool");
+                    } else if (strcmp(argv[i] + 2, "convtarget") == 0) {
+                        i = mcx_readarg(argc, argv, i, &(cfg->convtarget), "float");
+                    } else if (strcmp(argv[i] + 2, "convbatch") == 0) {
+                        i = mcx_readarg(argc, argv, i, &(cfg->convbatch), "int");
+                    } else if (strcmp(argv[i] + 2, "varbatch") == 0) {
+                        i = mcx_readarg(argc, argv, i, &(cfg->varbatch), "int");
+                    } else if (strcmp(argv[i] + 2, "rng") == 0) {
+                        if (i + 1 >= argc) {
+                            MMC_ERROR(-1, "incomplete input");
+                        }
+
+                        cfg->rngtype = mcx_keylookup(argv[++i], rngtypename);
+
+                        if (cfg->rngtype < 0) {
+                            MMC_ERROR(-2, "the specified RNG is not recognized, use xorshift128p, philox or posix");
+                        }
+                    } else if (strcmp(argv[i] + 2, "convroi") == 0) {
+                        char* nexttok;
+
+                        if (i + 1 >= argc) {
+                            MMC_ERROR(-1, "incomplete input");
+                        }
+
+                        i++;
+                        cfg->convroinum = 0;
+                        cfg->convroi = (int*)realloc(cfg->convroi, (strlen(argv[i]) / 2 + 1) * sizeof(int));
+                        nexttok = strtok(argv[i], " ,;");
+
+                        while (nexttok) {
+                            cfg->convroi[cfg->convroinum++] = atoi(nexttok);
+                            nexttok = strtok(NULL, " ,;");
+                        }
+                    } else if (strcmp(argv[i] + 2, "freq") == 0) {
+                        char* nexttok;
+
+                        if (i + 1 >= argc) {
+                            MMC_ERROR(-1, "incomplete input");
+                        }
+
+                        i++;
+                        cfg->freqnum = 0;
+                        cfg->freq = (float*)realloc(cfg->freq, (strlen(argv[i]) / 2 + 1) * sizeof(float));
+                        nexttok = strtok(argv[i], " ,;");
+
+                        while (nexttok) {
+                            cfg->freq[cfg->freqnum++] = atof(nexttok);
+                            nexttok = strtok(NULL, " ,;");
+                        }
+                    } else if (strcmp(argv[i] + 2, "waveprop") == 0) {
+                        i = mcx_readarg(argc, argv, i, cfg->wavefile, "string");
+                    } else if (strcmp(argv[i] + 2, "emission") == 0) {
+                        i = mcx_readarg(argc, argv, i, cfg->emitfile, "string");
+                    } else if (strcmp(argv[i] + 2, "pmc") == 0) {
+                        i = mcx_readarg(argc, argv, i, cfg->pmcfile, "string");
+                    } else if (strcmp(argv[i] + 2, "pmcprop") == 0) {
+                        i = mcx_readarg(argc, argv, i, cfg->pmcpropfile, "string");
+                    } else if (strcmp(argv[i] + 2, "dcs") == 0) {
+                        char model[MAX_SESSION_LENGTH] = {'\0'};
+
+                        if (i + 1 >= argc) {
+                            MMC_ERROR(-1, "incomplete input");
+                        }
+
+                        i++;
+
+                        if (sscanf(argv[i], "%63[^,],%f,%f", model, &(cfg->dcsdv), &(cfg->dcslambda)) != 3) {
+                            MMC_ERROR(-1, "--dcs expects 'model,DV,lambda', such as 'brownian,1e-6,785'");
+                        }
+
+                        cfg->dcsmodel = tolower(model[0]);
+                    } else if (strcmp(argv[i] + 2, "detstat") == 0) {
+                        i = mcx_readarg(argc, argv, i, &(cfg->isdetstat), "bool");
+                    } else if (strcmp(argv[i] + 2, "adjoint") == 0) {
+                        i = mcx_readarg(argc, argv, i, &(cfg->adjointnum), "int");
+                    } else if (strcmp(argv[i] + 2, "nextevent") == 0) {
+                        i = mcx_readarg(argc, argv, i, &(cfg->nextevent), "float");
+                    } else if (strcmp(argv[i] + 2, "reciprocal") == 0) {
+                        i = mcx_readarg(argc, argv, i, &(cfg->isreciprocal), "bool");
+                    } else if (strcmp(argv[i] + 2, "srclist") == 0) {
+                        i = mcx_readarg(argc, argv, i, cfg->srclistfile, "string");
+                    } else if (strcmp(argv[i] + 2, "elemprop") == 0) {
+                        i = mcx_readarg(argc, argv, i, cfg->elempropfile, "string");
+                    } else if (strcmp(argv[i] + 2, "outmask") == 0) {
+                        i = mcx_readarg(argc, argv, i, cfg->outmask, "string");
+                    } else if (strcmp(argv[i] + 2, "float16") == 0) {
+                        i = mcx_readarg(argc, argv, i, &(cfg->isfloat16), "bool");
+                    } else if (strcmp(argv[i] + 2, "diffmin") == 0) {
+                        i = mcx_readarg(argc, argv, i, &(cfg->diffmin), "float");
+                    } else if (strcmp(argv[i] + 2, "diffusion") == 0) {
+                        char* nexttok;
+
+                        if (i + 1 >= argc) {
+                            MMC_ERROR(-1, "incomplete input");
+                        }
+
+                        i++;
+                        cfg->diffnum = 0;
+                        cfg->difflabel = (int*)realloc(cfg->difflabel, (strlen(argv[i]) / 2 + 1) * sizeof(int));
+                        nexttok = strtok(argv[i], " ,;");
+
+                        while (nexttok) {
+                            cfg->difflabel[cfg->diffnum++] = atoi(nexttok);
+                            nexttok = strtok(NULL, " ,;");
+                        }
+                    } else if (strcmp(argv[i] + 2, "importance") == 0) {
+                        char* nexttok;
+
+                        if (i + 1 >= argc) {
+                            MMC_ERROR(-1, "incomplete input");
+                        }
+
+                        i++;
+                        cfg->importnum = 0;
+                        cfg->importance = (float*)realloc(cfg->importance, (strlen(argv[i]) / 2 + 1) * sizeof(float));
+                        nexttok = strtok(argv[i], " ,;");
+
+                        while (nexttok) {
+                            cfg->importance[cfg->importnum++] = atof(nexttok);
+                            nexttok = strtok(NULL, " ,;");
+                        }
+                    } else if (strcmp(argv[i] + 2, "dcstau") == 0) {
+                        char* nexttok;
+
+                        if (i + 1 >= argc) {
+                            MMC_ERROR(-1, "incomplete input");
+                        }
+
+                        i++;
+                        cfg->dcstaunum = 0;
+                        cfg->dcstau = (float*)realloc(cfg->dcstau, (strlen(argv[i]) / 2 + 1) * sizeof(float));
+                        nexttok = strtok(argv[i], " ,;");
+
+                        while (nexttok) {
+                            cfg->dcstau[cfg->dcstaunum++] = atof(nexttok);
+                            nexttok = strtok(NULL, " ,;");
+                        }
+                    } else if (strcmp(argv[i] + 2, "incache") == 0) {
+                        i = mcx_readarg(argc, argv, i, cfg->inccache, "string");
+                    } else if (strcmp(argv[i] + 2, "serve") == 0) {
+                        i = mcx_readarg(argc, argv, i, cfg->servefile, "string");
+                    } else if (strcmp(argv[i] + 2, "pipeline") == 0) {
+                        i = mcx_readarg(argc, argv, i, &(cfg->ispipeline), "bool");
+                    } else if (strcmp(argv[i] + 2, "edgetable") == 0) {
+                        i = mcx_readarg(argc, argv, i, &(cfg->isedgetable), "bool");
+                    } else if (strcmp(argv[i] + 2, "shm") == 0) {
+                        i = mcx_readarg(argc, argv, i, cfg->shmname, "string");
+                    } else if (strcmp(argv[i] + 2, "resultcache") == 0) {
+                        i = mcx_readarg(argc, argv, i, cfg->resultcache, "string");
+                    } else if (strcmp(argv[i] + 2, "cachelimit") == 0) {
+                        i = mcx_readarg(argc, argv, i, &(cfg->cachelimit), "float");
+                    } else if (strcmp(argv[i] + 2, "phasetable") == 0) {
+                        i = mcx_readarg(argc, argv, i, &(cfg->nphase), "int");
+                    } else if (strcmp(argv[i] + 2, "phasefile") == 0) {
+                        i = mcx_readarg(argc, argv, i, cfg->phasefile, "string");
+                    } else if (strcmp(argv[i] + 2, "tthg") == 0) {
+                        float lobe[MAX_DEVICE] = {0.f};
+
+                        i = mcx_readarg(argc, argv, i, lobe, "floatlist");
+                        cfg->tthg[0] = lobe[0];
+                        cfg->tthg[1] = lobe[1];
                     } else if (strcmp(argv[i] + 2, "root") == 0) {
                         i = mcx_readarg(argc, argv, i, cfg->rootpath, "string");
                     } else if (strcmp(argv[i] + 2, "dumpjson") == 0) {
@@ -3548,6 +6933,8 @@ void mcx_parsecmd(int argc, char* argv[], mcconfig* cfg) {
                         i = mcx_readarg(argc, argv, i, &(cfg->debugphoton), "int");
                     } else if (strcmp(argv[i] + 2, "maxjumpdebug") == 0) {
                         i = mcx_readarg(argc, argv, i, &(cfg->maxjumpdebug), "int");
+                    } else if (strcmp(argv[i] + 2, "trajsample") == 0) {
+                        i = mcx_readarg(argc, argv, i, &(cfg->trajsample), "int");
                     } else if (strcmp(argv[i] + 2, "gridsize") == 0) {
                         i = mcx_readarg(argc, argv, i, &(cfg->steps.x), "float");
                         cfg->steps.y = cfg->steps.x;
@@ -3708,11 +7095,14 @@ where possible parameters include (the first item in [] is the default value)\n\
  -f config     (--input)       read an input file in the .json format,if config\n\
                                string starts with '{',it is parsed as an inline\n\
                                JSON input file; if -f is followed by nothing or\n\
-                               a single '-', it reads input from stdin via pipe\n\
+                               a single '-', it reads input from stdin via pipe;\n\
+                               .bjd/.bmsh files are read as binary JData (BJData)\n\
  -Q benchmark  (--bench)       run a built-in benchmark, -Q only to list\n\
  -N benchmark  (--net)         get benchmark from NeuroJSON.io, -N only to list\n\
                                benchmark can be dataset URL,or dbname/benchname\n\
                                requires 'curl', install from https://curl.se/\n\
+                               downloads are cached in $XDG_CACHE_HOME/mmc (or\n\
+                               $MMC_CACHE_DIR) and reused until the ETag changes\n\
 \n"S_BOLD S_CYAN"\
 == MC options ==\n"S_RESET"\
  -n [0.|float] (--photon)      total photon number, max allowed value is 2^32-1\n\
@@ -3725,17 +7115,32 @@ where possible parameters include (the first item in [] is the default value)\n\
                                if an mch file is followed, MMC \"replays\" \n\
                                the detected photons; the replay mode can be used\n\
                                to calculate the mua/mus Jacobian matrices\n\
+ --rng [xorshift128p|philox|posix] random number generator: xorshift128p\n\
+                               (default), philox (counter-based, a photon has\n\
+                               the same stream whichever thread, device or\n\
+                               respin runs it, on the CPU and the GPU) or posix\n\
+                               (erand48 LCG, CPU only); the RNG of the saved\n\
+                               seeds (-q) is recorded and must match in the\n\
+                               replay (-E mch)\n\
  -P [0|int]    (--replaydet)   replay only the detected photons from a given \n\
                                detector (det ID starts from 1), use with -E \n\
+                               -1 replays all detectors in one pass; with -O L/P,\n\
+                               the Jacobian of each detector is appended after\n\
+                               the time gates of the previous one\n\
  -M [%c|SG]    (--method)      choose ray-tracing algorithm (only use 1 letter)\n\
                                P - Plucker-coordinate ray-tracing algorithm\n\
                                H - Havel's SSE4 ray-tracing algorithm\n\
                                B - partial Badouel's method (used by TIM-OS)\n\
                                S - branch-less Badouel's method with SSE\n\
                                G - dual-grid MMC (DMMC) with voxel data output\n\
+                               V - branch-less Badouel's method using 8/16-wide\n\
+                                   AVX2/AVX-512 ray packets (detected at runtime)\n\
  -e [1e-6|float](--minenergy)  minimum energy level to trigger Russian roulette\n\
  -V [0|1]      (--specular)    1 source located in the background,0 inside mesh\n\
  -k [1|0]      (--voidtime)    when src is outside, 1 enables timer inside void\n\
+ --edgetable [0|1]             1 to store the Plucker coordinates of -M P once\n\
+                               per unique edge, shared by the elements through\n\
+                               signed edge indices; over 50%% less tracer memory\n\
 \n"S_BOLD S_CYAN"\
 == GPU options ==\n"S_RESET"\
  -A [0|int]    (--autopilot)   auto thread config:1 enable;0 disable\n\
@@ -3745,7 +7150,43 @@ where possible parameters include (the first item in [] is the default value)\n\
       or                       if set to -1, CPU-based SSE mmc will be used\n\
  -G '1101'     (--gpu)         using multiple devices (1 enable, 0 disable)\n\
  -W '50,30,20' (--workload)    workload for active devices; normalized by sum\n\
+ --dynload [0|1]               1 to let devices pull photons in chunks sized by\n\
+                               their measured speed instead of the -W split\n\
+ --hybrid [0|float]            if in (0,1), the CPU simulates this fraction of\n\
+                               the photons next to the GPU (-c opencl/cuda), and\n\
+                               its output is merged with that of the GPU\n\
+ --persistent [0|1]            1 to let each GPU thread take the next photon from\n\
+                               a device-side counter instead of a fixed share;\n\
+                               with -d 1, OpenCL launches stop before -H is full\n\
+                               and resume after reading the detected photons\n\
+ --gpusort [0|int]             >0: CUDA photons advance this many scattering\n\
+                               events per launch, then the threads are regrouped\n\
+                               by the element of their photon, so that a warp\n\
+                               reads nearby elements (best with --reorder 1)\n\
+ --fission [0|int]             >0: CUDA photons are launched, propagated and\n\
+                               recorded by 3 kernels, so that the propagation\n\
+                               kernel uses fewer registers; each pass advances\n\
+                               the photons this many scattering events\n\
+ --unifiedmem [1|0|2]          1 to move the output, detected photon and replay\n\
+                               buffers to host memory shared with the GPU (CUDA\n\
+                               managed memory) when the mesh does not fit in the\n\
+                               device memory, 2 always, 0 never; unless 0, the\n\
+                               outputs of OpenCL devices sharing the host memory\n\
+                               (integrated GPUs) are mapped instead of copied\n\
+ --flushrespin [1|int]         move the GPU output into the double-precision host\n\
+                               sum every this many respins (-r), using a 2nd\n\
+                               device buffer in OpenCL; 0 to read it at the end\n\
  --atomic [1|0]                1 use atomic operations, 0 use non-atomic ones\n\
+ --packmesh [0|1]              1 to pack normals (half precision), type and\n\
+                               face neighbors in one record per element on GPU\n\
+ --localmesh [1|0]             1 to trace a mesh fitting in the GPU shared\n\
+                               memory from a copy in each work-group, 0 never\n\
+ --halfface [0|1]              1 to store each face plane once on GPU, shared\n\
+                               by its 2 elements through 32-bit half-face\n\
+                               entries; about 20%% less mesh memory\n\
+ --patternbits [32|16|8]       bits per weight of the pattern source on GPU,\n\
+                               16 (half) or 8 store each pattern over its own\n\
+                               scale, 1/2 or 1/4 of the memory and launch reads\n\
 \n"S_BOLD S_CYAN"\
 == Output options ==\n"S_RESET"\
  -s sessionid  (--session)     a string used to tag all output file names\n\
@@ -3754,9 +7195,39 @@ where possible parameters include (the first item in [] is the default value)\n\
                                weighted scattering count (J,L,P: replay mode)\n\
  -d [0|1]      (--savedet)     1 to save photon info at detectors,0 not to save\n\
  -H [1000000] (--maxdetphoton) max number of detected photons\n\
+ --streamdet [0|int]           if >0, append detected photons to the .mch file\n\
+                               in chunks of this many records during the run\n\
+ --saveprofile [0|1]           1 to save the timing of each phase (ns), the\n\
+                               per-thread counters and the kernel timing and\n\
+                               occupancy of each GPU to *_profile.json\n\
+ --heatmap [0|1]               1 to count the ray-tet tests, edge/vertex fixes\n\
+                               and reflections in each element (CPU only), saved\n\
+                               as 3 frames of an element output to *_heat.*\n\
+ --checkpoint [0|float]        if >0, save the state of the simulation to\n\
+                               <session>_ckpt.bin every this many photons\n\
+ --resume [0|1]                1 to continue from <session>_ckpt.bin, the run must\n\
+                               use the same options and thread number\n\
+ --convtarget [0|float]        if >0, simulate photons in batches and stop once\n\
+                               the relative standard error of the detected weight\n\
+                               of each detector, and of the output at --convroi,\n\
+                               is below this value (-n is the max photon number);\n\
+                               the absorbed fraction is used if neither is set\n\
+ --convbatch [0|int]           photons per batch, 0 for 1/100 of -n on the CPU;\n\
+                               the GPU runs -r batches (100 if -r is 1)\n\
+ --convroi 'i,j,k'             1-based node (-C 1) or element (-C 0) indices of\n\
+                               the output to monitor, summed over time gates\n\
+ --varbatch [0|int]            if >1, split the photons into this many batches\n\
+                               and save the variance of the time-resolved output\n\
+                               over the batches to <session>_var.<ext>; on the\n\
+                               GPU, each -r respin (this many if -r is 1) is a batch\n\
  -S [1|0]      (--save2pt)     1 to save the fluence field, 0 do not save\n\
  -x [0|1]      (--saveexit)    1 to save photon exit positions and directions\n\
                                setting -x to 1 also implies setting '-d' to 1\n\
+ --savedetflag ['DSPW'|int]   letters of the detected photon fields: D detector\n\
+                               ID, S scattering counts, P partial paths, M momentum\n\
+                               transfer, X/V exit position/direction, W weight;\n\
+                               only dropping S shrinks the CPU records, the rest\n\
+                               follow -m/-x; the GPU and --pmc always keep S\n\
  -X [0|1]      (--saveref)     save diffuse reflectance/transmittance on the \n\
                                exterior surface. The output is stored in a \n\
                                file named *_dref.dat, and the 2nd column of \n\
@@ -3775,7 +7246,16 @@ where possible parameters include (the first item in [] is the default value)\n\
                                bnii - Binary JNIfTI (https://neurojson.org)\n\
                                nii - NIfTI format\n\
                                hdr - Analyze 7.5 hdr/img format\n\
+                               zarr - Zarr v2 directory, uncompressed chunks of\n\
+                               all time gates of a node block, written in parallel\n\
+ --float16 [0|1]               1 to save the -F jnii/bnii/zarr output and the\n\
+                               float fields of the jdat detected photons as\n\
+                               IEEE-754 halfs (3 significant digits); the output\n\
+                               is divided by a power of 2 saved as ScaleSlope or\n\
+                               scale_factor, values below ~1e-12 of the peak are 0\n\
     the bnii/jnii formats support compression (-Z) and generate small files\n\
+    with jnii/bnii, the CPU and CUDA detected photons go to a *_detp.jdat\n\
+    file, one compressed array per field, IDs/counts in the narrowest uint\n\
     load jnii (JSON) and bnii (UBJSON) files using below lightweight libs:\n\
       MATLAB/Octave: JNIfTI toolbox   https://github.com/NeuroJSON/jnifti, \n\
       MATLAB/Octave: JSONLab toolbox  https://github.com/fangq/jsonlab, \n\
@@ -3798,6 +7278,27 @@ where possible parameters include (the first item in [] is the default value)\n\
                           name is specified; by default, prints settings\n\
                           after pre-processing; '--dumpjson 2' prints \n\
                           raw inputs before pre-processing\n\
+ --dumpmesh [0|1]         1 to save the loaded mesh and the ray-tracer data\n\
+                          to a binary file mesh_<tag>.mmcb in the root path;\n\
+                          later runs memory-map this file instead of reading\n\
+                          the .dat files, unless those are newer\n\
+ --cachetracer [0|1]      1 to save the precomputed ray-tracer data to\n\
+                          tracer_<tag>_<hash>.mmct in the root path and reuse\n\
+                          it in later runs of the same mesh and method\n\
+ --cachekernel [0|1]      1 to save the compiled OpenCL program binaries to\n\
+                          kernel_<hash>.clbin in the root path and skip the\n\
+                          kernel compilation in later runs with the same\n\
+                          source, build options, devices and drivers\n\
+ --autotune [0|1|2]       1 to replace the autopilot thread/block heuristics\n\
+                          (-A) by the fastest settings of a short benchmark\n\
+                          sweep, run on the first use of each OpenCL device,\n\
+                          driver and kind of simulation and then loaded from\n\
+                          autotune_<hash>.txt in the root path; 2 to re-run it;\n\
+                          with -c sse, the sweep picks the CPU thread number\n\
+                          and placement (with or without SMT siblings or the\n\
+                          slower cores of a hybrid CPU) and weights the photon\n\
+                          share of each thread by its core type, cached in\n\
+                          cputune_<hash>.txt\n\
 \n"S_BOLD S_CYAN"\
 == User IO options ==\n"S_RESET"\
  -h            (--help)        print this message\n\
@@ -3829,9 +7330,219 @@ where possible parameters include (the first item in [] is the default value)\n\
 == Additional options ==\n"S_RESET"\
  --momentum     [0|1]          1 to save photon momentum transfer,0 not to save\n\
  --gridsize     [1|float]      if -M G is used, this sets the grid size in mm\n\
+ --wavefront    [0|1]          1 to group photons by their next event (trace,\n\
+                               scatter, boundary, exit) and process each group\n\
+                               in a batch on the CPU; 0 to simulate one photon\n\
+                               at a time\n\
+ --photonblock  [-1|0|int]     >0: CPU threads claim this many photons at a time\n\
+                               from a shared counter, so that fast threads take\n\
+                               over the work of slow ones; 0: split the photons\n\
+                               evenly between the threads; -1: 64 with the\n\
+                               counter-based RNG (--rng philox), whose results do\n\
+                               not depend on the thread of a photon, else 0\n\
+ --privatebuf   [0|1]          1 to accumulate fluence in per-thread buffers\n\
+                               merged at the end, instead of atomic operations;\n\
+                               falls back to atomics if the buffers do not fit\n\
+                               in 1/4 of the host memory; 0 always use atomics\n\
+ --elemmoment   [0|1]          1 to accumulate the atomic nodal output (-C 1) at\n\
+                               the 4 corners of each tet, summed to the nodes\n\
+                               after the run, so that the threads do not contend\n\
+                               for the shared nodes; needs 4*elem/node times the\n\
+                               output memory; 0 add to the nodes directly\n\
+ --numa         [0|1]          1 to bind the CPU threads to the cores of their\n\
+                               NUMA nodes (Linux) and give each node its own\n\
+                               copy of the mesh and ray-tracer data (unless\n\
+                               --leanmem); with --privatebuf, each output copy\n\
+                               is then local to its thread; 0 leave the threads\n\
+                               to the OS or OMP_PROC_BIND\n\
+ --phasetable   [0|int]        >1: sample cos(theta) of each scattering event\n\
+                               from an inverse CDF table of this many entries\n\
+                               per medium, built before the run from the\n\
+                               phase function of the medium; 0: evaluate the\n\
+                               Henyey-Greenstein function, the default unless\n\
+                               --tthg or --phasefile are given (then 1024)\n\
+ --tthg         g2,w           use the two-term Henyey-Greenstein function\n\
+                               (1-w)*HG(g)+w*HG(g2) for all media, g being the\n\
+                               anisotropy of the medium, sampled from tables\n\
+ --phasefile    file           tabulated phase functions (e.g. Mie), one row\n\
+                               \"cos(theta) p1 p2 ...\" per angle from -1 to 1,\n\
+                               column k gives the unnormalized phase function\n\
+                               of label k, the other labels use HG/--tthg;\n\
+                               sampled from tables\n\
+ --reorder      [0|1|2]        renumber elements/nodes along a space-filling\n\
+                               curve before simulation to improve cache reuse\n\
+                               0: keep the input order, 1: Morton, 2: Hilbert;\n\
+                               outputs remain in the original numbering\n\
+ --domain       [0|1]          1 to split the mesh over the MPI ranks along the\n\
+                               curve of --reorder (Hilbert if not set), each\n\
+                               rank only traces its partition and a layer of\n\
+                               ghost elements, photons crossing into another\n\
+                               partition are sent to its rank; every rank\n\
+                               still loads the whole mesh before keeping its\n\
+                               partition, so the peak memory of a rank does not\n\
+                               shrink with the rank number; needs mpirun -np N\n\
+                               (N>1), -c sse, --rng philox and a point-like\n\
+                               source\n\
+ --leanmem      [0|1]          1 to reduce the host memory of large meshes: the\n\
+                               element volumes are computed when needed instead\n\
+                               of stored, --privatebuf is disabled\n\
+ --sparsegate   [0|1]          1 to allocate the output in blocks of elements/\n\
+                               nodes of a time gate when first reached, so that\n\
+                               the memory scales with the nonzero fluence of\n\
+                               long time windows; with -M G, the grid is allocated\n\
+                               in bricks of 16x8x8 voxels; CPU only, the mesh\n\
+                               output is saved as ascii/bin/mc2\n\
+ --waveprop     file           simulate additional wavelengths along the photon\n\
+                               paths of the media in the property file; the file\n\
+                               starts with \"wavenum-1 medianum\", followed by\n\
+                               \"id mua mus g n\" of all media per wavelength;\n\
+                               the outputs of the wavelengths follow the time\n\
+                               gates of the 1st one (CPU only)\n\
+ --emission     file           fused fluorescence simulation: the absorbed\n\
+                               excitation energy of each element, kept in\n\
+                               memory, times the yield of its medium launches\n\
+                               isotropic emission photons traced in the media of\n\
+                               the file; it starts with the media number, then\n\
+                               \"id mua mus g n yield\" per medium, yield being\n\
+                               the absorption share of the fluorophore times\n\
+                               its quantum yield; only the emission output is\n\
+                               saved, normalized by the emitted energy (CPU only)\n\
+ --freq         'f1,f2,...'    modulation frequencies (Hz, up to 16) of the\n\
+                               frequency-domain output, accumulated from the\n\
+                               photon time-of-flight during the simulation; the\n\
+                               real and imaginary parts of each frequency follow\n\
+                               the time gates, use one gate to keep the output\n\
+                               small (not with replay, --waveprop, --sparsegate)\n\
+ --pmc          file.mch       re-weight the detected photons stored in an .mch\n\
+                               file (with header, MCX-style weights, -m 0) for\n\
+                               the property sets of --pmcprop instead of running\n\
+                               a simulation; the media of the input are the\n\
+                               baseline; saves session_pmc.dat, one row per set\n\
+                               and detector: set, det, W, dW/dmua, dW/dmus\n\
+ --pmcprop      file           property sets of --pmc in the format of --waveprop:\n\
+                               \"setnum medianum\", followed by \"id mua mus g n\"\n\
+                               of all media per set; g and n must stay the same\n\
+                               as the baseline\n\
+ --dcs          'model,DV,nm'  accumulate the DCS field autocorrelation g1(tau)\n\
+                               of each detector from the momentum transfer of\n\
+                               the detected photons during the simulation, as\n\
+                               matlab/generate_g1.m, without storing them;\n\
+                               model is brownian (DV: Db in mm^2/s) or flow (DV:\n\
+                               speed in mm/s), nm the wavelength; saves\n\
+                               session_dcs.dat, one row per tau (CPU only)\n\
+ --dcstau       't1,t2,...'    correlation times (s) of --dcs, 200 log-spaced\n\
+                               values from 1e-7 to 1e-1 by default\n\
+ --detstat      [0|1]          1 to accumulate the statistics of each detector\n\
+                               during the simulation instead of saving the\n\
+                               detected photons: the detected weight per time\n\
+                               gate (TPSF), the mean partial path (mm) and the\n\
+                               mean scattering count per medium, as in\n\
+                               matlab/mmcdettpsf.m/mmcmeanpath.m/mmcmeanscat.m;\n\
+                               saves session_detstat.dat, one row per detector\n\
+ --adjoint      n              the last n patterns of a multi-pattern run are\n\
+                               the adjoint sources of the detectors; after the\n\
+                               run, the mua (and with nodal output, the mus')\n\
+                               Jacobians of all source-detector pairs are\n\
+                               integrated from the time-integrated fields, as\n\
+                               in matlab/mmcjmua.m/mmcjmus.m, and streamed to\n\
+                               session_jmua.bin/session_jmus.bin, one row of\n\
+                               ne doubles per pair\n\
+ --importance   'i1,i2,...'    importance of labels 1,2,... (others are 1): a\n\
+                               photon moving to a label of a higher importance\n\
+                               is split into copies of a lower weight by their\n\
+                               ratio, one moving to a lower importance is\n\
+                               rouletted by their ratio; the expected fluence\n\
+                               and detected weights are unchanged; the GPU can\n\
+                               not save the detected photons with it\n\
+ --nextevent    d              next-event estimate of the detectors: at each\n\
+                               scattering event, the weight expected to reach\n\
+                               each detector within d mm on a straight path is\n\
+                               scored, attenuated along the tets it crosses;\n\
+                               saves the TPSF to session_nee.dat; CPU only\n\
+ --reciprocal   [0|1]          1 to measure all source pattern-detector pairs\n\
+                               by reciprocity when there are fewer detectors\n\
+                               than patterns: each detector is launched as a\n\
+                               disk source into the mesh, and its surface\n\
+                               diffuse reflectance is projected onto the\n\
+                               patterns; saves session_recip.dat, one row per\n\
+                               pair; CPU only, the fields are not saved\n\
+ --diffusion    'l1,l2,...'    hybrid MC-diffusion: a photon scattering deep\n\
+                               inside one of these labels jumps to a random\n\
+                               point of the largest sphere around it that\n\
+                               stays inside the label, after a path length\n\
+                               drawn from the diffusion first-passage time;\n\
+                               its absorbed weight is deposited where it\n\
+                               jumps from; explicit MC resumes near the\n\
+                               label boundaries; CPU only\n\
+ --diffmin      r  (10)        smallest sphere radius of a --diffusion jump,\n\
+                               in transport mean free paths 1/(mua+mus(1-g))\n\
+ --srclist      file           simulate many point-like sources (-t 0/1/2/3)\n\
+                               in one run, one per line of the file as\n\
+                               \"x y z vx vy vz [focal]\"; photons are dealt to\n\
+                               the sources in turn, each has its own output\n\
+                               slice, normalization and detected-photon tag as\n\
+                               the patterns of -P; CPU only\n\
+ --elemprop     file           per-element optical properties, not limited by\n\
+                               the label count: the text file starts with\n\
+                               \"4 len\", followed by len rows of \"mua mus g n\"\n\
+                               (1/mm), len being the element count, or the node\n\
+                               count to average the nodal values per element;\n\
+                               the labels only tag the elements, the detected\n\
+                               photons can not be saved\n\
+ --outmask      'spec'         only output the selected elements: spec is\n\
+                               'label:l1,l2,...', 'elem:i,j,...' (1-based),\n\
+                               'elem:file' (one index per line) or\n\
+                               'box:x0,y0,z0,x1,y1,z1' (the element centroids\n\
+                               inside the box), several joined by ';' select\n\
+                               their union; the output rows are the selected\n\
+                               elements in the input order, the others are not\n\
+                               deposited; element output (-C 0) on the CPU only\n\
+ --incache      file           incremental re-simulation for iterative solvers:\n\
+                               the raw output, the media and the labels touched\n\
+                               by each batch of photons are cached in the file;\n\
+                               a later run with the same settings only\n\
+                               re-simulates the batches that touched modified\n\
+                               media; CPU only, needs --rng philox\n\
+ --serve        file|-         server mode: load and prepare the input once,\n\
+                               then run one job per line of the file (a named\n\
+                               pipe, or - for stdin); a job is a JSON object\n\
+                               with any of id (output name), nphoton, seed,\n\
+                               srcpos, srcdir, srcparam1, srcparam2, detpos\n\
+                               [[x,y,z,r],...] and prop [[mua,mus,g,n],...],\n\
+                               unset fields keep the input values; one JSON\n\
+                               reply per job is printed to stdout, the log\n\
+                               goes to stderr\n\
+ --pipeline     [0|1]          1 to save the fluence and dref of a --serve job\n\
+                               while the next job is simulated, the reply of a\n\
+                               job is printed once its files are written\n\
+ --shm          name           after the run, also publish the outputs in the\n\
+                               POSIX shared-memory segment /dev/shm/name: the\n\
+                               8-byte tag MMCSHM01, the 64-bit length and the\n\
+                               text of a JSON header in the first 4096 bytes,\n\
+                               then the fluence (double), dref (double, -X 1)\n\
+                               and detected photons (float, the .mch records,\n\
+                               -d 1), each 64-byte aligned at the Offset, Dims\n\
+                               and Bytes listed under Data in the header; the\n\
+                               tag is written last; not on Windows\n\
+ --estimate [0|1]              1 to report the host and device memory of each\n\
+                               buffer and the runtime projected from a short\n\
+                               calibration run to the log and *_estimate.json,\n\
+                               without running the simulation\n\
+ --resultcache  folder         keep the output files of each run (or --serve\n\
+                               job) in this folder, created if missing, keyed\n\
+                               by a hash of the prepared mesh, the settings,\n\
+                               the seed and the thread layout; an identical\n\
+                               later run copies the saved outputs instead of\n\
+                               simulating\n\
+ --cachelimit   [1024|float]   size limit of --resultcache in MB, the least\n\
+                               recently used entries are removed above it\n\
  --maxjumpdebug [10000000|int] when trajectory is requested (i.e. -D S),\n\
                                use this parameter to set the maximum positions\n\
                                stored (default: 1e7)\n\
+ --trajsample  [1|int]         only save the trajectories of every n-th photon\n\
+                               (photon index divisible by n); a standalone\n\
+                               run streams them to the .mct file while\n\
+                               simulating, with no --maxjumpdebug limit\n\
 \n"S_BOLD S_CYAN"\
 == Example ==\n"S_RESET"\
 example: (list built-in benchmarks: -Q/--bench)\n"S_CYAN"\
@@ -46,7 +46,7 @@
     #include <omp.h>
 #endif
 
-#ifdef __NVCC__
+#if defined(__NVCC__) || defined(__HIPCC__)
     #define FLOAT3 float3           ///< FLOAT3 is the true float3; in OpenCL, float3 is actually float4; but CUDA supports true float3
 #endif
 
@@ -54,11 +54,15 @@
 #define MAX_PATH_LENGTH     1024                         /**< max characters in a full file name string */
 #define MAX_SESSION_LENGTH  64                           /**< max session name length */
 #define MAX_CHECKPOINT      16                           /**< max number of photon save points */
+#define MIN_CONV_BATCH      4                            /**< min number of batches before testing the convergence */
 #define DET_PHOTON_BUF      100000                       /**< initialize number of detected photons */
 #define SEED_FROM_FILE      -999                         /**< special flag indicating to load seeds from history file */
 #define MIN(a,b)            ((a)<(b)?(a):(b))            /**< macro to get the min values of two numbers */
 #define MMC_ERROR(id,msg)   mcx_error(id,msg,__FILE__,__LINE__)
 #define MMC_INFO            -99999
+#define MMC_MULTISRC(cfg)   ((cfg)->srcnum > 1 && ((cfg)->srctype == stPattern || (cfg)->srclist)) /**< photons carry a row of cfg->srcpattern and fill srcnum output slices */
+#define MMC_CANCELLED(cfg)  ((cfg)->cancelflag && *((cfg)->cancelflag))          /**< 1 if the caller asked the running simulation to stop */
+#define MMC_HASPROGRESS(cfg) (((cfg)->debuglevel & dlProgress) || (cfg)->progressfun) /**< 1 if the progress is printed or reported to the caller */
 #define MAX_DEVICE          256
 
 #ifndef MCX_CONTAINER
@@ -94,22 +98,25 @@ enum TDebugLevel {dlMove = 1, dlTracing = 2, dlBary = 4, dlWeight = 8, dlDist =
                   dlProgress = 2048, dlExit = 4096, dlTraj = 8192
                  };
 
-enum TRTMethod {rtPlucker, rtHavel, rtBadouel, rtBLBadouel, rtBLBadouelGrid};
+enum TRTMethod {rtPlucker, rtHavel, rtBadouel, rtBLBadouel, rtBLBadouelGrid, rtBLBadouelPacket};
 enum TMCMethod {mmMCX, mmMCML};
 enum TComputeBackend {cbSSE, cbOpenCL, cbCUDA};
+enum TRNGType {rngXorshift128p, rngPhilox, rngPosix};   /**< CPU random number generators, see mmc_rand_multi.c */
 
 enum TSrcType {stPencil, stIsotropic, stCone, stGaussian, stPlanar,
                stPattern, stFourier, stArcSin, stDisk, stFourierX,
                stFourier2D, stZGaussian, stLine, stSlit
               };
 enum TOutputType {otFlux, otFluence, otEnergy, otJacobian, otWL, otWP};
-enum TOutputFormat {ofASCII, ofBin, ofNifti, ofAnalyze, ofMC2, ofTX3, ofJNifti, ofBJNifti};
+enum TOutputFormat {ofASCII, ofBin, ofNifti, ofAnalyze, ofMC2, ofTX3, ofJNifti, ofBJNifti, ofZarr};
 enum TOutputDomain {odMesh, odGrid};
 enum TDeviceVendor {dvUnknown, dvNVIDIA, dvAMD, dvIntel, dvIntelGPU, dvAppleCPU, dvAppleGPU};
 enum TMCXParent  {mpStandalone, mpMATLAB};
 enum TBoundary {bcNoReflect, bcReflect, bcAbsorbExterior, bcMirror /*, bcCylic*/};
 enum TRayHitType {htNone, htInOut, htOutIn, htNoHitIn, htNoHitOut};
 enum TROIType {rtNone, rtEdge, rtNode, rtFace};
+enum TProfilePhase {ppLoad, ppPrep, ppTracer, ppSimulation, ppReduction, ppNormalize, ppSave, ppPhaseNum};
+enum THeatCounter {hmRayTet, hmFix, hmReflect, hmCounterNum};  /**< per-element counters of --heatmap, see MMC_HEAT */
 
 enum TBJData {JDB_mixed, JDB_nulltype, JDB_noop, JDB_true, JDB_false,
               JDB_char, JDB_string, JDB_hp, JDB_int8, JDB_uint8, JDB_int16, JDB_int32,
@@ -161,9 +168,60 @@ typedef struct MMC_history {
     unsigned int  srcnum;          /**< number of sources in the simulation*/
     int respin;                    /**< if positive, repeat count so total photon=totalphoton*respin; if negative, total number is processed in respin subset */
     unsigned int  savedetflag;     /**<  */
-    int reserved[2];               /**< reserved fields for future extension */
+    int seedrng;                   /**< 1 + the RNG (TRNGType) of the saved seeds, 0 if not recorded */
+    int reserved;                  /**< reserved field for future extension */
 } history;
 
+/**
+ * \struct MMC_threadprofile mmc_utils.h
+ * \brief Counters collected by one CPU thread for the profile report
+ */
+
+typedef struct MMC_threadprofile {
+    unsigned long long nphoton;    /**< number of photons simulated by this thread */
+    double raytet;                 /**< number of ray-tet tests */
+    double raytet0;                /**< number of ray-tet tests outside of the object mesh */
+    unsigned long long nreflect;   /**< number of reflection/refraction events at media or exterior boundaries */
+    unsigned long long nroihit;    /**< number of photon interactions with implicit (iMMC) ROIs */
+    unsigned long long ndetected;  /**< number of detected photons */
+} threadprofile;
+
+/**
+ * \struct MMC_deviceprofile mmc_utils.h
+ * \brief Kernel timing and attributes collected by one GPU for the profile report
+ */
+
+typedef struct MMC_deviceprofile {
+    int id;                        /**< device index as listed by -L, starting from 1 */
+    char name[MAX_SESSION_LENGTH]; /**< device name */
+    unsigned int block;            /**< thread block (work group) size */
+    unsigned int thread;           /**< total thread number */
+    unsigned int nlaunch;          /**< number of kernel launches */
+    unsigned long long kernel;     /**< accumulated kernel execution time in ns */
+    unsigned long long copy;       /**< accumulated time of the output read-back in ns */
+    int registers;                 /**< registers per thread, -1 if not reported by the runtime */
+    long long privatemem;          /**< private (local) memory per thread in bytes, -1 if unknown */
+    long long sharedmem;           /**< shared (local) memory per block in bytes, including the dynamic part */
+    float occupancy;               /**< theoretical occupancy, active threads over the maximum per multiprocessor, -1 if unknown */
+} deviceprofile;
+
+/**
+ * \struct MMC_convstate mmc_utils.h
+ * \brief Batch statistics of the monitored quantities in the convergence-driven mode
+ *
+ * Each quantity is accumulated over the whole run; after each batch, the increment
+ * divided by the photons of the batch gives one sample of its per-photon mean, and
+ * the spread of these samples gives the standard error of the running total.
+ */
+
+typedef struct MMC_convstate {
+    int nquantity;                 /**< number of monitored quantities */
+    int nbatch;                    /**< number of completed batches */
+    double photon;                 /**< photons simulated in the completed batches */
+    double* last;                  /**< accumulated value of each quantity after the previous batch */
+    double* sum;                   /**< sum of the per-photon batch means of each quantity */
+    double* sum2;                  /**< sum of the squared per-photon batch means of each quantity */
+} convstate;
 
 typedef struct MCXGPUInfo {
     char name[MAX_SESSION_LENGTH];
@@ -178,6 +236,7 @@ typedef struct MCXGPUInfo {
     size_t autoblock, autothread;
     int maxgate;
     int maxmpthread;               /**< maximum thread number per multi-processor */
+    int isunified;                 /**< 1 if the device shares the physical memory of the host, as integrated GPUs */
     enum TDeviceVendor vendor;
 } GPUInfo;
 
@@ -193,13 +252,17 @@ typedef struct MMC_config {
     int nblocksize;                /**<thread block size*/
     int nthread;                   /**<num of total threads, multiple of 128*/
     int seed;                      /**<random number generator seed*/
+    int rngtype;                   /**<CPU random number generator, see TRNGType; the GPU always uses xorshift128+*/
     int e0;                        /**<initial element id*/
     float3 srcpos;                 /**<src position in mm*/
     float4 srcdir;                 /**<src normal direction*/
     int srctype;                   /**<src type: 0 - pencil beam, 1 - isotropic ... */
     float4 srcparam1;              /**<source parameters set 1*/
     float4 srcparam2;              /**<source parameters set 2*/
-    float* srcpattern;             /**<source pattern*/
+    float* srcpattern;             /**<source pattern; with srclist, the srcnum x srcnum identity so that each source fills its own output slice*/
+    float4* srclist;               /**<2 x srcnum entries of a source list, the position (x,y,z) and the direction (x,y,z, focal length in w) of each source, NULL otherwise, see --srclist*/
+    int* srclistelem;              /**<internal: initial element (start from 1) of each listed source, see mesh_initsrclist*/
+    float4* srclistbary;           /**<internal: barycentric coordinates of each listed source in its initial element*/
     int voidtime;                  /**<1 start counting photon time when moves inside 0 voxels; 0: count time only after enters non-zero voxel*/
     float4 bary0;                  /**<initial bary centric coordinates of the source*/
     float tstart;                  /**<start time in second*/
@@ -210,7 +273,7 @@ typedef struct MMC_config {
     uint4 crop0;                   /**<sub-volume for cache*/
     uint4 crop1;                   /**<the other end of the caching box*/
     int medianum;                  /**<total types of media*/
-    int srcnum;                    /**<total number of sources, could be larger than 1 only with pattern illumination*/
+    int srcnum;                    /**<total number of sources, could be larger than 1 only with pattern illumination or a source list*/
     int detnum;                    /**<total detector numbers*/
     float detradius;               /**<detector radius*/
     float sradius;                 /**<source region radius: if set to non-zero, accumulation \
@@ -226,7 +289,7 @@ typedef struct MMC_config {
     int respin;                    /**<number of repeatitions*/
     int printnum;                  /**<number of printed threads (for debugging)*/
     int replaydet;                 /**<the detector id for which to replay the detected photons, start from 1 \
-                                       0 for wide-field detection pattern*/
+                                       0 for wide-field detection pattern, -1 for all detectors at once*/
     unsigned char* vol;            /**<pointer to the volume*/
     char session[MAX_SESSION_LENGTH];/**<session id, a string*/
     char meshtag[MAX_SESSION_LENGTH];/**<a string to tag all input mesh files*/
@@ -244,6 +307,17 @@ typedef struct MMC_config {
     char issaveseed;               /**<1 save the seed for a detected photon, 0 do not save*/
     char issaveref;                /**<1 to save diffuse reflectance on surface, 0 no save*/
     char isatomic;                 /**<1 use atomic operations for weight accumulation, 0 do not use*/
+    char iswavefront;              /**<1 use the wavefront photon scheduler on the CPU, 0 simulate one photon at a time*/
+    int photonblock;               /**<photons claimed at once by a CPU thread, 0 to split the photons evenly, -1 to use blocks only with the counter-based RNG*/
+    char isprivatebuf;             /**<1 accumulate fluence in per-thread buffers and reduce at the end, 0 use atomics*/
+    char iselemmoment;             /**<1 accumulate the atomic nodal output (-C 1) at the tet corners, added to the nodes after the run*/
+    char isnuma;                   /**<1 bind the CPU threads to their NUMA nodes and replicate the mesh per node, 0 do not*/
+    char reorder;                  /**<renumber the mesh along a space-filling curve: 0 no, 1 Morton, 2 Hilbert*/
+    char isleanmem;                /**<1 to compute the element volumes on demand instead of storing them, and never replicate the output per thread*/
+    char issparsegate;             /**<1 to allocate the output in pages on first deposit, for long time windows, 0 dense output*/
+    int nphase;                    /**<entries of the per-medium inverse CDF of cos(theta) sampled at each scattering event, 0 to evaluate Henyey-Greenstein directly, see --phasetable*/
+    float tthg[2];                 /**<second lobe of a two-term Henyey-Greenstein phase function: its anisotropy and its weight, the weight is 0 for one term, see --tthg*/
+    float* invcdf;                 /**<internal: mesh->prop x nphase inverse CDF tables of cos(theta) of labels 1 to prop, built by mesh_buildinvcdf*/
     char method;                   /**<0-Plucker 1-Havel, 2-Badouel, 3-branchless Badouel*/
     int implicit;                  /**<1 for edge- or node-based implicit MMC, 2 for face-based implicit MMC*/
     char basisorder;               /**<0 to use piece-wise-constant basis for fluence, 1, linear*/
@@ -260,10 +334,21 @@ typedef struct MMC_config {
     int debugphoton;               /**<if negative, print debug info for all photons, otherwise, only print for the selected one*/
     float unitinmm;                /**<define the length unit in mm*/
     history his;                   /**<header info of the history file*/
-    unsigned int checkpt[MAX_CHECKPOINT]; /**<a list of photon numbers at which a snapshot of the weights will be saved*/
+    unsigned int checkpt[MAX_CHECKPOINT]; /**<a list of photon numbers at which a checkpoint of the simulation will be saved*/
+    size_t ckptperiod;             /**<if >0, save a checkpoint of the simulation every this many photons*/
+    char isresume;                 /**<1 to resume the simulation from the last saved checkpoint*/
+    int mpirank;                   /**<the MPI rank of this process, 0 if not built with MPI*/
+    int mpisize;                   /**<the total MPI rank number, 1 if not built with MPI*/
     void* photonseed;              /**< pointer to the seeds of the replayed photon */
     float* replayweight;           /**< pointer to the detected photon weight array */
     float* replaytime;             /**< pointer to the detected photon time-of-fly array */
+    int* replaydetid;              /**< pointer to the 1-based detector ID of each replayed photon, only set if replaydet is -1 */
+    int replaydetnum;              /**< number of per-detector output blocks, detnum if replaying all detectors (-P -1), otherwise 1 */
+    int wavenum;                   /**< number of wavelengths sharing the photon paths, 1 for a single-wavelength simulation */
+    int waveproplen;               /**< number of media records in waveprop, (wavenum-1) blocks of medianum media */
+    medium* waveprop;              /**< optical properties of the 2nd to the last wavelengths, the 1st wavelength uses prop */
+    char wavefile[MAX_PATH_LENGTH];/**< file storing the optical properties of the 2nd to the last wavelengths, see --waveprop */
+    char emitfile[MAX_PATH_LENGTH];/**< file storing the emission media and fluorescence yields of the fused fluorescence mode, see --emission */
     char seedfile[MAX_PATH_LENGTH];/**<if the seed is specified as a file (mch), mcx will replay the photons*/
     char deviceid[MAX_DEVICE];
     float workload[MAX_DEVICE];
@@ -273,22 +358,107 @@ typedef struct MMC_config {
     int parentid;
     int optlevel;
     unsigned int maxdetphoton;     /*anticipated maximum detected photons*/
+    int streamdet;                 /**<if >0, the detected photons are appended to the output file in chunks of this many records*/
     unsigned int maxjumpdebug;     /**<num of  photon scattering events to save when saving photon trajectory is enabled*/
+    unsigned int trajsample;       /**<only the trajectories of every trajsample-th photon are saved, 1 to save all*/
     unsigned int debugdatalen;     /**<max number of photon trajectory position length*/
     double* exportfield;           /*memory buffer when returning the flux to external programs such as matlab*/
     unsigned char* exportseed;     /*memory buffer when returning the RNG seed to matlab*/
     float* exportdetected;         /*memory buffer when returning the partial length info to external programs such as matlab*/
+    float* exportdetimage;         /**<time-resolved area-detector image binned on the GPU when issaveexit is 2*/
     float* exportdebugdata;        /**<pointer to the buffer where the photon trajectory data are stored*/
     double* energytot;             /**<total energy launched for each source, a buffer of length srcnum */
     double* energyesc;             /**<total energy escaped for each source, a buffer of length srcnum */
     unsigned int detectedcount;    /**<total number of detected photons*/
     unsigned int runtime;          /**<total simulation runtime in ms*/
+    char issaveprofile;            /**<1 to save the per-phase timing and per-thread counters to <session>_profile.json */
+    unsigned long long profile[ppPhaseNum]; /**<elapsed time of each phase of the last run in ns, indexed by TProfilePhase */
+    threadprofile* threadprof;     /**<per-thread counters of the last CPU run, profthread entries */
+    int profthread;                /**<number of entries in threadprof */
+    deviceprofile* devprof;        /**<per-device kernel timing and attributes of the last GPU run, profdev entries */
+    int profdev;                   /**<number of entries in devprof */
+    char isheatmap;                /**<1 to count the ray-tet tests, edge/vertex fixes and reflections of each element (--heatmap) */
+    double* exportheatmap;         /**<hmCounterNum x ne counters of --heatmap, one frame per counter, in the input element order */
+    char isestimate;               /**<1 to report the projected memory and runtime of the run instead of running it (--estimate) */
+    char ispipeline;               /**<1 to save the fluence and dref of a --serve job while the next job is simulated (--pipeline), 2 while a job leaves them to mmc_serve */
+    char isedgetable;              /**<1 to store the Plucker coordinates of -M P once per unique edge instead of 6 times per element (--edgetable)*/
+    char isdomain;                 /**<1 to partition the mesh over the MPI ranks, each tracing the photons in its own partition (--domain), see mesh_partition */
+    float convtarget;              /**<if >0, stop once the relative standard error of all monitored quantities is below this value*/
+    int convbatch;                 /**<photons per batch in the convergence-driven mode, 0 to use 1/100 of nphoton*/
+    int varbatch;                  /**<if >1, split the photons into this many batches and compute the variance of the output over the batches*/
+    int convroinum;                /**<number of node/element indices in convroi*/
+    int* convroi;                  /**<1-based node (basisorder=1) or element (basisorder=0) indices whose output is monitored*/
+    size_t convphoton;             /**<photons simulated by the last run, fewer than nphoton if it converged early*/
+    float convrse;                 /**<the largest relative standard error of the monitored quantities at the end of the last run*/
+    void (*progressfun)(void* progressdata, float percent); /**<if set by a language binding, called with the completed fraction of the run, see mcx_reportprogress*/
+    void* progressdata;            /**<the user data passed to progressfun*/
+    volatile int* cancelflag;      /**<if set by a language binding, the run stops launching photons once it is non-zero and returns the output of the launched photons*/
+    int freqnum;                   /**<number of modulation frequencies in freq, 0 to disable the frequency-domain output*/
+    float* freq;                   /**<modulation frequencies in Hz, each adds a real and an imaginary output frame*/
+    char pmcfile[MAX_PATH_LENGTH]; /**<.mch file of the detected photons re-weighted by perturbation MC instead of a simulation, see --pmc*/
+    char pmcpropfile[MAX_PATH_LENGTH];/**<text file listing the property sets of the perturbation MC re-weighting, see --pmcprop*/
+    int pmcsetnum;                 /**<number of property sets in pmcprop, 0 to disable the perturbation MC re-weighting*/
+    float* pmcprop;                /**<pmcsetnum x medianum x {mua,mus} (1/mm) property sets of media 1..medianum*/
+    double* exportpmc;             /**<pmcsetnum x detnum x (1+2*medianum) re-weighted detector readings and their mua/mus derivatives*/
+    char dcsmodel;                 /**<'b' Brownian or 'f' random flow displacement model of the DCS g1(tau) accumulated per detector, 0 to disable, see --dcs*/
+    float dcsdv;                   /**<displacement variable of dcsmodel, the Brownian diffusion coefficient Db (mm^2/s) or the flow speed V (mm/s)*/
+    float dcslambda;               /**<wavelength (nm) of the DCS light source*/
+    int dcstaunum;                 /**<number of correlation times in dcstau*/
+    float* dcstau;                 /**<correlation times (s) of the accumulated g1(tau), see --dcstau*/
+    double* exportdcs;             /**<detnum x dcstaunum g1(tau) of each detector, normalized by its detected weight*/
+    char isdetstat;                /**<1 to accumulate the TPSF, mean partial paths and scattering counts of each detector instead of saving the detected photons, see --detstat*/
+    double* exportdetstat;         /**<detnum x mcx_detstatlen() detector statistics, see mesh_normdetstat*/
+    int adjointnum;                /**<number of the last source patterns that are the adjoint sources of the detectors, >0 to save the Jacobians of all pairs, see --adjoint*/
+    int importnum;                 /**<number of labels in importance*/
+    float* importance;             /**<importance of labels 1..importnum, the photons are split or rouletted by their ratio when moving between labels, NULL to disable, see --importance*/
+    float nextevent;               /**<largest distance (mm) from a scattering site to a detector scored by the next-event estimator, 0 to disable, see --nextevent*/
+    double* exportnee;             /**<detnum x (maxgate+1) next-event estimates of the detectors per launched photon, the TPSF followed by the total*/
+    float* exportcamsignals;       /**<cam_image_width x cam_image_height camera image of the CPU simulation followed by the projected and detected photon counts, see mcx_savecamsignals*/
+    char srclistfile[MAX_PATH_LENGTH];/**<text file of the listed sources, one row "x y z vx vy vz" per source, empty to disable, see --srclist*/
+    char elempropfile[MAX_PATH_LENGTH];/**<text file of the per-element (or per-node) optical properties, empty to use the media of the labels, see --elemprop*/
+    char outmask[MAX_PATH_LENGTH]; /**<elements whose output is saved, 'label:l1,l2', 'elem:i,j,k' or 'elem:file', 'box:x0,y0,z0,x1,y1,z1', joined by ';', empty to save all, see --outmask*/
+    char isreciprocal;             /**<1 to launch from the detectors instead of the source patterns when there are fewer detectors, see --reciprocal*/
+    int diffnum;                   /**<number of labels in difflabel*/
+    int* difflabel;                /**<labels in which the photons deep inside jump to a sphere around them by the diffusion first-passage kernel, NULL to disable, see --diffusion*/
+    float diffmin;                 /**<smallest sphere radius, in transport mean free paths, of a diffusion jump, see --diffmin*/
+    char inccache[MAX_PATH_LENGTH];/**<cache file of the incremental re-simulation, only photons that touched modified labels are re-simulated, see --incache*/
+    char servefile[MAX_PATH_LENGTH];/**<job queue (file, named pipe or - for stdin) read by the server mode, empty to run the input once, see --serve*/
+    char shmname[MAX_PATH_LENGTH]; /**<POSIX shared-memory segment receiving the fluence, dref and detected photons after the run, empty to disable, see --shm*/
+    char resultcache[MAX_PATH_LENGTH];/**<folder of the result cache returning the saved outputs of an identical earlier run, empty to disable, see --resultcache*/
+    float cachelimit;              /**<size limit of the result cache in MB, the least recently used entries are removed above it, see --cachelimit*/
+    unsigned long long cmdhash;    /**<internal: hash of the command line options, part of the result cache key*/
+    char phasefile[MAX_PATH_LENGTH];/**<text file of tabulated (e.g. Mie) phase functions of the media, one row "cos(theta) p1 p2 ..." per angle, see --phasefile*/
+    int incpass;                   /**<internal: 1 when re-simulating with the cached media, 2 with the current media, 0 otherwise*/
+    unsigned int incbatchnum;      /**<internal: number of photon batches in incbatch*/
+    unsigned int* incbatch;        /**<internal: indices of the batches of MMC_INC_BATCH photons to simulate, NULL to simulate all photons*/
+    unsigned long long* incmask;   /**<internal: bit i is set if a photon of the batch touched label i, labels above 63 share bit 63*/
+    double* incbase;               /**<internal: cached raw output minus the cached contribution of the re-simulated photons*/
     char autopilot;                /**<1 optimal setting for dedicated card, 2, for non dedicated card*/
     float normalizer;              /**<normalization factor*/
     unsigned int gpuid;            /**<positive integer denotes the 1st/2nd/... OpenCL or CUDA devices, 0xFFFFFFFF for CPU only*/
     int compute;                   /**<0: sse, 1: opencl or 2: cuda*/
     char isdumpjson;               /**<1 to save json */
+    char isdumpmesh;               /**<1 to save the loaded mesh to a binary container mesh_<tag>.mmcb */
+    char iscachetracer;            /**<1 to load/save the precomputed ray-tracer data from/to an on-disk cache */
+    char iscachekernel;            /**<1 to load/save the compiled OpenCL program binaries from/to an on-disk cache */
+    char isdynload;                /**<1 to let devices pull photons in adaptive chunks from a shared queue instead of the static -W split */
+    char autotune;                 /**<1 to load the OpenCL autopilot thread/block settings, or with -c sse the CPU thread placement, measured by a calibration run, calibrating on a cache miss; 2 to calibrate again */
+    int  tunedthread;              /**<internal: number of CPU threads picked by --autotune for -c sse, 0 to use the OpenMP default */
+    int* tunedcpu;                 /**<internal: CPU bound to each thread picked by --autotune, tunedthread entries */
+    double* tunedshare;            /**<internal: photon share of the threads before each thread, tunedthread+1 entries from 0 to 1, NULL for an even split */
+    float hybrid;                  /**<if in (0,1), the fraction of the photons simulated by the CPU next to the GPU, see mmc_run_hybrid*/
+    char ispersistent;             /**<1 to let GPU threads take photon IDs from a device-side counter instead of a fixed per-thread share */
+    int  gpusort;                  /**<if >0, CUDA photons advance this many scattering events per launch and are then sorted by element*/
+    int  gpufission;               /**<if >0, CUDA photons run through split launch, propagation and record kernels, advancing this many scattering events per pass*/
+    char unifiedmem;               /**<0: all GPU buffers in device memory; 1: move the large output/replay buffers to host-visible memory if they do not fit; 2: always */
+    char ispackmesh;               /**<1 to upload the mesh to the GPU as one packed record per element with half-precision normals*/
+    char islocalmesh;              /**<1 to trace a mesh fitting in the GPU shared memory from a per-work-group copy, 0 never*/
+    char ishalfface;               /**<1 to upload the mesh to the GPU as a shared face table and 32-bit half-face entries instead of per-element normals and facenb*/
+    int  patternbits;              /**<bits per weight of the pattern source on the GPU: 32 (float), 16 (half) or 8, see mcx_packpattern*/
+    int  flushrespin;              /**<if >0, move the GPU output into the double-precision host accumulator every this many respins*/
+    int  meshsession;              /**<non-zero id to keep the mesh buffers resident on the devices for later in-process runs of the same id*/
     int  zipid;                    /**<data zip method "zlib","gzip","base64","lzip","lzma","lz4","lz4hc"*/
+    char isfloat16;                /**<1 to save the jnii/bnii/zarr output (scaled by a power of 2) and the float fields of the jdat detected photon data as IEEE-754 halfs, see --float16*/
     unsigned int savedetflag;      /**<a flag to control the output fields of detected photon data*/
     uint mediabyte;                /**<not used*/
     char* shapedata;               /**<a pointer points to a string defining the JSON-formatted shape data*/
@@ -313,6 +483,10 @@ typedef struct MMC_config {
 extern "C" {
 #endif
 void mcx_savedata(OutputType* dat, size_t len, mcconfig* cfg, int isref);
+unsigned short mcx_float2half(float f);
+double mcx_float16scale(const OutputType* dat, size_t len);
+unsigned short* mcx_tofloat16(const OutputType* dat, size_t len, double scale);
+void* mcx_packpattern(mcconfig* cfg, size_t* bytes);
 void mcx_savenii(OutputType* dat, size_t len, char* name, int type32bit, int outputformatid, mcconfig* cfg);
 void mcx_error(const int id, const char* msg, const char* file, const int linenum);
 void mcx_loadconfig(FILE* in, mcconfig* cfg);
@@ -322,6 +496,7 @@ void mcx_writeconfig(char* fname, mcconfig* cfg);
 void mcx_initcfg(mcconfig* cfg);
 void mcx_clearcfg(mcconfig* cfg);
 void mcx_validatecfg(mcconfig* cfg);
+void mcx_loadsrclist(mcconfig* cfg);
 void mcx_parsecmd(int argc, char* argv[], mcconfig* cfg);
 void mcx_usage(char* exename, mcconfig* cfg);
 void mcx_loadvolume(char* filename, mcconfig* cfg, int isbuf);
@@ -333,27 +508,45 @@ int  mcx_lookupindex(char* key, const char* index);
 int  mcx_keylookup(char* key, const char* table[]);
 int  mcx_parsedebugopt(char* debugopt, const char* debugflag);
 void mcx_progressbar(float percent);
+void mcx_reportprogress(mcconfig* cfg, float percent);
+size_t mcx_getsysmemory(void);
+int  mcx_numacpus(int node, int* cpus, int maxcpu);
+int  mcx_cputopology(int* cpus, int* coreid, int* speed, int maxcpu);
+int  mcx_pinthread(int cpu);
 int  mcx_loadjson(cJSON* root, mcconfig* cfg);
+int  mcx_loadjob(cJSON* job, mcconfig* cfg, int medianum, medium* med, char* errmsg);
+void mcx_genboxmesh(mcconfig* cfg, uint3 dim, float step, FLOAT3 origin, int srclayer);
 void mcx_version(mcconfig* cfg);
 int  mcx_loadfromjson(char* jbuf, mcconfig* cfg);
+void mcx_loadbjdata(const unsigned char* buf, size_t len, mcconfig* cfg);
 void mcx_prep(mcconfig* cfg);
+int  mcx_detreclen(mcconfig* cfg, int medianum);
+int  mcx_detstatlen(mcconfig* cfg, int medianum);
 void mcx_printheader(mcconfig* cfg);
 void mcx_cleargpuinfo(GPUInfo** gpuinfo);
 void mcx_convertcol2row(unsigned int** vol, uint3* dim);
 void mcx_convertcol2row4d(unsigned int** vol, uint4* dim);
 void mcx_savejdata(char* filename, mcconfig* cfg);
+char* mcx_jdataconfig(mcconfig* cfg, int iskey);
 int  mcx_jdataencode(void* vol,  int ndim, uint* dims, char* type, int byte, int zipid, void* obj, int isubj, int iscol, mcconfig* cfg);
 int  mcx_jdatadecode(void** vol, int* ndim, uint* dims, int maxdim, char** type, cJSON* obj, mcconfig* cfg);
 void mcx_convertrow2col(float* vol, uint3* dim);
-void mcx_savejnii(OutputType* vol, int ndim, uint* dims, float* voxelsize, char* name, int isfloat, int iscol, mcconfig* cfg);
-void mcx_savebnii(OutputType* vol, int ndim, uint* dims, float* voxelsize, char* name, int isfloat, int iscol, mcconfig* cfg);
+void mcx_savejnii(OutputType* vol, int ndim, uint* dims, float* voxelsize, char* name, int isfloat, int iscol, double slope, mcconfig* cfg);
+void mcx_savebnii(OutputType* vol, int ndim, uint* dims, float* voxelsize, char* name, int isfloat, int iscol, double slope, mcconfig* cfg);
 void mcx_savejdet(float* ppath, void* seeds, uint count, int doappend, mcconfig* cfg);
+char* mcx_profilejson(mcconfig* cfg);
+void mcx_saveprofile(mcconfig* cfg);
+void mcx_convinit(convstate* cs, int nquantity);
+void mcx_convaddbatch(convstate* cs, const double* total, double photon);
+float mcx_convrse(convstate* cs);
+void mcx_convclear(convstate* cs);
 void mcx_fflush(FILE* out);
+void mcx_replaycompact(mcconfig* cfg, const unsigned char* keep, int len, int seedbyte);
 void mmc_validate_config(mcconfig* cfg, float* detps, int dimdetps[2], int seedbyte);
 
 #if defined(MCX_CONTAINER) && (defined(MATLAB_MEX_FILE) || defined(OCTAVE_API_VERSION_NUMBER))
 #ifdef _OPENMP
-#define MMC_FPRINTF(fp,...) {if(omp_get_thread_num()==0) {(fp==stderr) ? mexPrintf(__VA_ARGS__) : fprintf(fp,__VA_ARGS__);}}  /**< macro to print messages, calls mexPrint if inside MATLAB */
+#define MMC_FPRINTF(fp,...) {if(omp_get_thread_num()==0 && omp_get_ancestor_thread_num(1)<=0) {(fp==stderr) ? mexPrintf(__VA_ARGS__) : fprintf(fp,__VA_ARGS__);}}  /**< macro to print messages, calls mexPrint if inside MATLAB */
 #else
 #define MMC_FPRINTF(fp,...) {(fp==stderr) ? mexPrintf(__VA_ARGS__) : fprintf(fp,__VA_ARGS__);} /**< macro to print messages, calls mexPrint in MATLAB */
 #endif
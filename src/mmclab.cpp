@@ -82,13 +82,93 @@
 typedef mwSize dimtype;                                   //! MATLAB type alias for integer type to use for array sizes and dimensions
 
 void mmc_set_field(const mxArray* root, const mxArray* item, int idx, mcconfig* cfg, tetmesh* mesh);
+int mmc_set_job(const mxArray* jobs, int jjob, mcconfig* cfg, tetmesh* mesh, medium* med, int isstrict);
+int mmc_same_setup(const mxArray* root, int jbase, int jcfg);
 void mmclab_usage();
 
 extern const char debugflag[];
+extern const char saveflag[];
+
+//! the cfg fields that a batch job may change, see mmc_set_job
+const char* jobfields[] = {"nphoton", "seed", "srcpos", "srcdir", "srcparam1", "srcparam2", "detpos", "prop"};
 
 float* detps = NULL;       //! buffer to receive data from cfg.detphotons field
 int    dimdetps[2] = {0, 0}; //! dimensions of the cfg.detphotons array
 int    seedbyte = 0;
+int    pmcmedianum = 0;    //! media number of the cfg.pmcprop array
+
+/** @brief Release the device-resident mesh of cfg.meshsession when the mex file is cleared
+ */
+
+static void mmclab_release_mesh(void) {
+#ifdef USE_OPENCL
+    mmc_cl_release_meshcache();
+#endif
+#ifdef USE_CUDA
+    mmc_cu_release_meshcache();
+#endif
+}
+
+/**
+ * @brief The state of one of the simulations of a struct array running at the same time
+ */
+
+typedef struct MMCLAB_Slot {
+    mcconfig cfg;                    /**< simulation settings */
+    tetmesh mesh;                    /**< the mesh of the simulation */
+    raytracer tracer;                /**< the ray-tracer precomputed data */
+    unsigned int t0;                 /**< start time of the preparation in ms */
+    unsigned int dt;                 /**< start time, then run time of the simulation in ms */
+    int status;                      /**< 0: prepared or done, 1: failed in the preparation, 2: failed in the simulation, 3: failed in saving the outputs */
+    char errmsg[MAX_PATH_LENGTH];    /**< the error message of a failed simulation */
+} mmcslot;
+
+/**
+ * @brief Run one prepared simulation, returns 2 and the message in errmsg if it fails
+ *
+ * Several slots may run at the same time in worker threads, so no MATLAB API
+ * is called here; the errors are printed after all slots of a round are done.
+ *
+ * @param[in,out] slot: the prepared simulation
+ * @param[in] slotid: the index of the slot in a round
+ */
+
+static int mmc_run_slot(mmcslot* slot, int slotid) {
+    mcconfig* cfg = &slot->cfg;
+
+    slot->errmsg[0] = '\0';
+
+    try {
+        if (cfg->compute == cbSSE || cfg->gpuid > MAX_DEVICE) {
+            mmc_run_mp(cfg, &slot->mesh, &slot->tracer);
+        }
+
+#ifdef USE_CUDA
+        else if (cfg->compute == cbCUDA && cfg->hybrid > 0.f) {
+            mmc_run_hybrid(cfg, &slot->mesh, &slot->tracer, mmc_run_cu);
+        } else if (cfg->compute == cbCUDA) {
+            mmc_run_cu(cfg, &slot->mesh, &slot->tracer);
+        }
+
+#endif
+#ifdef USE_OPENCL
+        else if (cfg->hybrid > 0.f) {
+            mmc_run_hybrid(cfg, &slot->mesh, &slot->tracer, mmc_run_cl);
+        } else {
+            mmc_run_cl(cfg, &slot->mesh, &slot->tracer);
+        }
+
+#endif
+    } catch (const char* err) {
+        snprintf(slot->errmsg, MAX_PATH_LENGTH, "Error from thread (%d): %s\n", slotid, err);
+    } catch (const std::exception& err) {
+        snprintf(slot->errmsg, MAX_PATH_LENGTH, "C++ Error from thread (%d): %s\n", slotid, err.what());
+    } catch (...) {
+        snprintf(slot->errmsg, MAX_PATH_LENGTH, "Unknown Exception from thread (%d)", slotid);
+    }
+
+    return (slot->errmsg[0] != '\0') ? 2 : 0;
+}
 
 /** @brief Mex function for the MMC host function for MATLAB/Octave
  *  This is the master function to interface all MMC features inside MATLAB.
@@ -98,20 +178,20 @@ int    seedbyte = 0;
 
 void mexFunction(int nlhs, mxArray* plhs[], int nrhs, const mxArray* prhs[]) {
     mcconfig cfg;
-    tetmesh mesh;
-    raytracer tracer = {NULL, 0, NULL, NULL, NULL};
-    unsigned int threadid = 0, t0, dt;
+    mmcslot*   slot = NULL;
     GPUInfo* gpuinfo = NULL;
 
     mxArray*    tmp;
-    int        ifield, jstruct;
-    int        ncfg, nfields;
+    int        ifield, jstruct, jwave, jbase, nrun, iskept;
+    int        ncfg, nfields, nslot = 1, *reuse = NULL;
     dimtype     fielddim[5];
-    int        errorflag = 0;
+    int        errorflag = 0, batchfailed = 0;
     cl_uint    workdev;
+    const mxArray* jobs = NULL;
+    medium*    jobmed = NULL;
 
     const char*       outputtag[] = {"data"};
-    const char*       datastruct[] = {"data", "dref"};
+    const char*       datastruct[] = {"data", "dref", "pmc", "var", "heat"};
     const char*       gpuinfotag[] = {"name", "id", "devcount", "major", "minor", "globalmem",
                                       "constmem", "sharedmem", "regcount", "clock", "sm", "core",
                                       "autoblock", "autothread", "maxgate"
@@ -125,6 +205,8 @@ void mexFunction(int nlhs, mxArray* plhs[], int nrhs, const mxArray* prhs[]) {
         return;
     }
 
+    mexAtExit(mmclab_release_mesh);
+
     /**
      * If a single string is passed, and if this string is 'gpuinfo', this function
      * returns the list of GPUs on this host and return.
@@ -194,11 +276,25 @@ void mexFunction(int nlhs, mxArray* plhs[], int nrhs, const mxArray* prhs[]) {
     nfields = mxGetNumberOfFields(prhs[0]);
     ncfg = mxGetNumberOfElements(prhs[0]);
 
+    /**
+     * If a struct array of jobs is given as the 2nd input, the mesh of the single cfg is prepared
+     * once and each job, which only changes the source, detectors, media or photon number, is
+     * simulated on it; the outputs have one element per job
+     */
+    if (nrhs >= 2 && mxIsStruct(prhs[1])) {
+        if (ncfg != 1) {
+            MEXERROR("a batch run requires a single base cfg structure");
+        }
+
+        jobs = prhs[1];
+        ncfg = mxGetNumberOfElements(jobs);
+    }
+
     /**
      * The function can return 1-3 outputs (i.e. the LHS)
      */
     if (nlhs >= 1) {
-        plhs[0] = mxCreateStructMatrix(ncfg, 1, 2, datastruct);
+        plhs[0] = mxCreateStructMatrix(ncfg, 1, 5, datastruct);
     }
 
     if (nlhs >= 2) {
@@ -213,219 +309,366 @@ void mexFunction(int nlhs, mxArray* plhs[], int nrhs, const mxArray* prhs[]) {
         plhs[3] = mxCreateStructMatrix(ncfg, 1, 1, outputtag);
     }
 
+    /**
+     * The simulations of a struct array are run cfg(1).concurrent at a time, a batch shares one mesh and runs in turn
+     */
+    if (jobs == NULL && ncfg > 1 && (tmp = mxGetField(prhs[0], 0, "concurrent")) != NULL && !mxIsEmpty(tmp)) {
+        nslot = MAX(1, MIN((int)mxGetScalar(tmp), ncfg));
+    }
+
+    slot = new mmcslot[nslot]();
+
+    /**
+     * Along a struct array run in turn, an element that only differs from the one whose mesh is prepared
+     * in the fields of a batch job is simulated as a batch job, reusing the mesh and the ray-tracer
+     */
+    reuse = (int*)calloc(ncfg, sizeof(int));
+
+    for (jstruct = 1, jbase = 0; jobs == NULL && nslot == 1 && jstruct < ncfg; jstruct++) {
+        reuse[jstruct] = mmc_same_setup(prhs[0], jbase, jstruct);
+        jbase = reuse[jstruct] ? jbase : jstruct;
+    }
+
     /**
      * Loop over each element of the struct if it is an array, each element is a simulation
      */
-    for (jstruct = 0; jstruct < ncfg; jstruct++) {  /* how many configs */
+    for (jwave = 0; jwave < ncfg && !(jobs && batchfailed); jwave += nrun) {
+        int isconcurrent = 1;
 
-        /** Enclose all simulation calls inside a try/catch construct for exception handling */
-        try {
-            printf("Running simulations for configuration #%d ...\n", jstruct + 1);
+        nrun = MIN(nslot, ncfg - jwave);
 
-            /** Initialize cfg with default values first */
-            t0 = StartTimer();
-            mcx_initcfg(&cfg);
-            MMCDEBUG(&cfg, dlTime, (cfg.flog, "initializing ... "));
-            mesh_init(&mesh);
+        /** Prepare the simulations of this round in turn, the MATLAB API is only called from this thread */
+        for (jstruct = jwave; jstruct < jwave + nrun; jstruct++) {
+            mcconfig& cfg = slot[jstruct - jwave].cfg;
+            tetmesh& mesh = slot[jstruct - jwave].mesh;
+            raytracer& tracer = slot[jstruct - jwave].tracer;
+            unsigned int& t0 = slot[jstruct - jwave].t0;
 
-            /** Read each struct element from input and set value to the cfg configuration */
-            for (ifield = 0; ifield < nfields; ifield++) { /* how many input struct fields */
-                tmp = mxGetFieldByNumber(prhs[0], jstruct, ifield);
+            slot[jstruct - jwave].status = 1;
 
-                if (tmp == NULL) {
-                    continue;
-                }
+            /** Enclose all simulation calls inside a try/catch construct for exception handling */
+            try {
+                printf("Running simulations for configuration #%d ...\n", jstruct + 1);
 
-                mmc_set_field(prhs[0], tmp, ifield, &cfg, &mesh);
-            }
+                /** Initialize cfg with default values first; a batch, or an element with the same setup, reuses the mesh and the settings of its first job */
+                t0 = StartTimer();
 
-            mexEvalString("pause(.001);");
+                if (jobs ? (jstruct == 0) : !reuse[jstruct]) {
+                    mcx_initcfg(&cfg);
+                    MMCDEBUG(&cfg, dlTime, (cfg.flog, "initializing ... "));
+                    mesh_init(&mesh);
 
-            /** Overwite the output flags using the number of output present */
-            cfg.issave2pt = (nlhs >= 1); /** save fluence rate to the 1st output if present */
-            cfg.issavedet = (nlhs >= 2); /** save detected photon data to the 2nd output if present */
-            cfg.issaveseed = (nlhs >= 3); /** save detected photon seeds to the 3rd output if present */
+                    /** Read each struct element from input and set value to the cfg configuration */
+                    for (ifield = 0; ifield < nfields; ifield++) { /* how many input struct fields */
+                        tmp = mxGetFieldByNumber(prhs[0], jstruct, ifield);
 
-            if (nlhs >= 4) {
-                cfg.exportdebugdata = (float*)malloc(cfg.maxjumpdebug * sizeof(float) * MCX_DEBUG_REC_LEN);
-                cfg.debuglevel |= dlTraj;
-            }
+                        if (tmp == NULL) {
+                            continue;
+                        }
 
-#if defined(MMC_LOGISTIC) || defined(MMC_SFMT)
-            cfg.issaveseed = 0;
-#endif
-            mesh_srcdetelem(&mesh, &cfg);
+                        mmc_set_field(prhs[0], tmp, ifield, &cfg, &mesh);
+                    }
 
-            /** Validate all input fields, and warn incompatible inputs */
-            mmc_validate_config(&cfg, detps, dimdetps, seedbyte);
-            mesh_validate(&mesh, &cfg);
+                    mexEvalString("pause(.001);");
 
-            if (cfg.isgpuinfo == 0) {
-                mmc_prep(&cfg, &mesh, &tracer);
-            }
+                    /** Overwite the output flags using the number of output present */
+                    cfg.issave2pt = (nlhs >= 1); /** save fluence rate to the 1st output if present */
+                    cfg.issavedet = (nlhs >= 2 || cfg.pmcsetnum > 0); /** save detected photon data to the 2nd output if present, or to re-weight them for cfg.pmcprop */
+                    cfg.issaveseed = (nlhs >= 3); /** save detected photon seeds to the 3rd output if present */
 
-            dt = GetTimeMillis();
-            MMCDEBUG(&cfg, dlTime, (cfg.flog, "\tdone\t%d\nsimulating ... \n", dt - t0));
+                    if (nlhs >= 4) {
+                        cfg.exportdebugdata = (float*)malloc(cfg.maxjumpdebug * sizeof(float) * MCX_DEBUG_REC_LEN);
+                        cfg.debuglevel |= dlTraj;
+                    }
 
+                    mesh_srcdetelem(&mesh, &cfg);
 
-            /** \subsection ssimu Parallel photon transport simulation */
+                    if (cfg.pmcsetnum > 0 && pmcmedianum != mesh.prop) {
+                        MEXERROR("the 2nd dimension of cfg.pmcprop must match the media number");
+                    }
 
-            try {
-                if (cfg.compute == cbSSE || cfg.gpuid > MAX_DEVICE) {
-                    mmc_run_mp(&cfg, &mesh, &tracer);
-                }
+                    /** Validate all input fields, and warn incompatible inputs */
+                    mmc_validate_config(&cfg, detps, dimdetps, seedbyte);
+                    mesh_validate(&mesh, &cfg);
 
-#ifdef USE_CUDA
-                else if (cfg.compute == cbCUDA) {
-                    mmc_run_cu(&cfg, &mesh, &tracer);
+                    if (cfg.isgpuinfo == 0) {
+                        mmc_prep(&cfg, &mesh, &tracer);
+                    }
                 }
 
-#endif
-#ifdef USE_OPENCL
-                else {
-                    mmc_run_cl(&cfg, &mesh, &tracer);
+                if (jobs || reuse[jstruct]) {
+                    if (cfg.seed == SEED_FROM_FILE) {
+                        MEXERROR("photon replay is not supported in batch runs");
+                    }
+
+                    if (nlhs >= 4 && cfg.exportdebugdata == NULL) {
+                        cfg.exportdebugdata = (float*)malloc(cfg.maxjumpdebug * sizeof(float) * MCX_DEBUG_REC_LEN);
+                    }
+
+                    if (jobmed == NULL) {
+                        jobmed = (medium*)calloc(sizeof(medium), mesh.prop + 1);
+                    }
+
+                    int hasprop = mmc_set_job(jobs ? jobs : prhs[0], jstruct, &cfg, &mesh, jobmed, jobs != NULL);
+                    mmc_prep_next(&cfg, &mesh, &tracer, hasprop ? jobmed : NULL);
                 }
 
-#endif
+                slot[jstruct - jwave].dt = GetTimeMillis();
+                MMCDEBUG(&cfg, dlTime, (cfg.flog, "\tdone\t%d\nsimulating ... \n", slot[jstruct - jwave].dt - t0));
+                slot[jstruct - jwave].status = 0;
             } catch (const char* err) {
-                mexPrintf("Error from thread (%d): %s\n", threadid, err);
-                errorflag++;
+                mexPrintf("Error: %s\n", err);
+                batchfailed = 1;
             } catch (const std::exception& err) {
-                mexPrintf("C++ Error from thread (%d): %s\n", threadid, err.what());
-                errorflag++;
+                mexPrintf("C++ Error: %s\n", err.what());
+                batchfailed = 1;
             } catch (...) {
-                mexPrintf("Unknown Exception from thread (%d)", threadid);
-                errorflag++;
+                mexPrintf("Unknown Exception");
+                batchfailed = 1;
             }
 
-            /** \subsection sreport Post simulation */
+            /** GPU simulations hold per-process device states, only CPU simulations run at the same time */
+            isconcurrent &= (nrun > 1 && (slot[jstruct - jwave].status || cfg.compute == cbSSE || cfg.gpuid > MAX_DEVICE));
+        }
+
+        /** \subsection ssimu Parallel photon transport simulation */
 
-            dt = GetTimeMillis() - dt;
+        if (isconcurrent) {
+#ifdef _OPENMP
+            int nthread = MAX(1, omp_get_max_threads() / nrun), maxlevel = omp_get_max_active_levels();
 
-            /** Clear up simulation data structures by calling the destructors */
+            omp_set_max_active_levels(MAX(maxlevel, 2));
+#endif
 
-            tracer_clear(&tracer);
-            MMCDEBUG(&cfg, dlTime, (cfg.flog, "\tdone\t%d\n", GetTimeMillis() - t0));
-
-            /** if 5th output presents, output the photon trajectory data */
-            if (nlhs >= 4) {
-                int outputidx = 3;
-                fielddim[0] = MCX_DEBUG_REC_LEN;
-                fielddim[1] = cfg.debugdatalen; // his.savedphoton is for one repetition, should correct
-                fielddim[2] = 0;
-                fielddim[3] = 0;
-                mxSetFieldByNumber(plhs[outputidx], jstruct, 0, mxCreateNumericArray(2, fielddim, mxSINGLE_CLASS, mxREAL));
-
-                if ((cfg.debuglevel & dlTraj) && cfg.exportdebugdata) {
-                    memcpy((float*)mxGetPr(mxGetFieldByNumber(plhs[outputidx], jstruct, 0)), cfg.exportdebugdata, fielddim[0]*fielddim[1]*sizeof(float));
+            #pragma omp parallel for num_threads(nrun) schedule(static, 1)
+            for (int k = 0; k < nrun; k++) {
+#ifdef _OPENMP
+                omp_set_num_threads(nthread);
+#endif
+
+                if (slot[k].status == 0) {
+                    slot[k].status = mmc_run_slot(slot + k, k);
                 }
             }
 
-            if (cfg.exportdebugdata) {
-                free(cfg.exportdebugdata);
-                cfg.exportdebugdata = NULL;
+#ifdef _OPENMP
+            omp_set_max_active_levels(maxlevel);
+#endif
+        } else {
+            for (int k = 0; k < nrun; k++) {
+                if (slot[k].status == 0) {
+                    slot[k].status = mmc_run_slot(slot + k, 0);
+                }
             }
+        }
 
-            if (nlhs >= 3) {
-                fielddim[0] = (sizeof(RandType) * RAND_BUF_LEN);
-                fielddim[1] = cfg.detectedcount;
-                fielddim[2] = 0;
-                fielddim[3] = 0;
-                mxSetFieldByNumber(plhs[2], jstruct, 0, mxCreateNumericArray(2, fielddim, mxUINT8_CLASS, mxREAL));
-                memcpy((unsigned char*)mxGetPr(mxGetFieldByNumber(plhs[2], jstruct, 0)), cfg.exportseed, fielddim[0]*fielddim[1]);
-            }
+        /** Save the outputs of this round in turn */
+        for (jstruct = jwave; jstruct < jwave + nrun; jstruct++) {
+            mcconfig& cfg = slot[jstruct - jwave].cfg;
+            tetmesh& mesh = slot[jstruct - jwave].mesh;
+            raytracer& tracer = slot[jstruct - jwave].tracer;
+            unsigned int& t0 = slot[jstruct - jwave].t0;
+            unsigned int& dt = slot[jstruct - jwave].dt;
 
-            if (cfg.exportseed) {
-                free(cfg.exportseed);
-                cfg.exportseed = NULL;
+            if (slot[jstruct - jwave].status == 2) {
+                mexPrintf("%s", slot[jstruct - jwave].errmsg);
+                errorflag++;
             }
 
-            /** if the 2nd output presents, output the detected photon partialpath data */
-            if (nlhs >= 2) {
-                if (cfg.issaveexit != 2) {
-                    int hostdetreclen = (2 + ((cfg.ismomentum) > 0)) * mesh.prop + (cfg.issaveexit > 0) * 6 + 2;
-                    fielddim[0] = hostdetreclen;
-                    fielddim[1] = cfg.detectedcount;
-                    fielddim[2] = 0;
-                    fielddim[3] = 0;
-
-                    if (cfg.detectedcount > 0) {
-                        mxSetFieldByNumber(plhs[1], jstruct, 0, mxCreateNumericArray(2, fielddim, mxSINGLE_CLASS, mxREAL));
-                        memcpy((float*)mxGetPr(mxGetFieldByNumber(plhs[1], jstruct, 0)), cfg.exportdetected,
-                               fielddim[0]*fielddim[1]*sizeof(float));
+            /** a batch keeps its mesh until the last job or the first error, a struct array while the next element has the same setup */
+            iskept = (jstruct < ncfg - 1) && (jobs ? !batchfailed : (reuse[jstruct + 1] && slot[jstruct - jwave].status == 0));
+
+            if (slot[jstruct - jwave].status != 1) {
+                try {
+                    /** \subsection sreport Post simulation */
+
+                    dt = GetTimeMillis() - dt;
+
+                    /** Clear up simulation data structures by calling the destructors */
+
+                    if (jobs == NULL && !iskept) {
+                        tracer_clear(&tracer);
                     }
-                } else {
-                    fielddim[0] = cfg.detparam1.w;
-                    fielddim[1] = cfg.detparam2.w;
-                    fielddim[2] = cfg.maxgate;
-                    fielddim[3] = 0;
-                    mxSetFieldByNumber(plhs[1], jstruct, 0, mxCreateNumericArray(3, fielddim, mxSINGLE_CLASS, mxREAL));
-                    float* detmap = (float*)mxGetPr(mxGetFieldByNumber(plhs[1], jstruct, 0));
-                    memset(detmap, cfg.detparam1.w * cfg.detparam2.w * cfg.maxgate, sizeof(float));
-                    mesh_getdetimage(detmap, cfg.exportdetected, cfg.detectedcount, &cfg, &mesh);
-                }
-            }
 
-            if (cfg.exportdetected) {
-                free(cfg.exportdetected);
-                cfg.exportdetected = NULL;
-            }
+                    MMCDEBUG(&cfg, dlTime, (cfg.flog, "\tdone\t%d\n", GetTimeMillis() - t0));
 
-            if (nlhs >= 1) {
-                int datalen = (cfg.method == rtBLBadouelGrid) ? cfg.crop0.z : ( (cfg.basisorder) ? mesh.nn : mesh.ne);
-                fielddim[0] = cfg.srcnum;
-                fielddim[1] = datalen;
-                fielddim[2] = cfg.maxgate;
-                fielddim[3] = 0;
-                fielddim[4] = 0;
-
-                if (cfg.method == rtBLBadouelGrid) {
-                    fielddim[0] = cfg.srcnum;
-                    fielddim[1] = cfg.dim.x;
-                    fielddim[2] = cfg.dim.y;
-                    fielddim[3] = cfg.dim.z;
-                    fielddim[4] = cfg.maxgate;
-
-                    if (cfg.srcnum > 1) {
-                        mxSetFieldByNumber(plhs[0], jstruct, 0, mxCreateNumericArray(5, fielddim, mxDOUBLE_CLASS, mxREAL));
-                    } else {
-                        mxSetFieldByNumber(plhs[0], jstruct, 0, mxCreateNumericArray(4, &fielddim[1], mxDOUBLE_CLASS, mxREAL));
+                    /** if 5th output presents, output the photon trajectory data */
+                    if (nlhs >= 4) {
+                        int outputidx = 3;
+                        fielddim[0] = MCX_DEBUG_REC_LEN;
+                        fielddim[1] = cfg.debugdatalen; // his.savedphoton is for one repetition, should correct
+                        fielddim[2] = 0;
+                        fielddim[3] = 0;
+                        mxSetFieldByNumber(plhs[outputidx], jstruct, 0, mxCreateNumericArray(2, fielddim, mxSINGLE_CLASS, mxREAL));
+
+                        if ((cfg.debuglevel & dlTraj) && cfg.exportdebugdata) {
+                            memcpy((float*)mxGetPr(mxGetFieldByNumber(plhs[outputidx], jstruct, 0)), cfg.exportdebugdata, fielddim[0]*fielddim[1]*sizeof(float));
+                        }
                     }
-                } else {
-                    if (cfg.srcnum > 1) {
-                        mxSetFieldByNumber(plhs[0], jstruct, 0, mxCreateNumericArray(3, fielddim, mxDOUBLE_CLASS, mxREAL));
-                    } else {
-                        mxSetFieldByNumber(plhs[0], jstruct, 0, mxCreateNumericArray(2, &fielddim[1], mxDOUBLE_CLASS, mxREAL));
+
+                    if (cfg.exportdebugdata) {
+                        free(cfg.exportdebugdata);
+                        cfg.exportdebugdata = NULL;
+                    }
+
+                    if (nlhs >= 3) {
+                        fielddim[0] = (sizeof(RandType) * RAND_BUF_LEN);
+                        fielddim[1] = cfg.detectedcount;
+                        fielddim[2] = 0;
+                        fielddim[3] = 0;
+                        mxSetFieldByNumber(plhs[2], jstruct, 0, mxCreateNumericArray(2, fielddim, mxUINT8_CLASS, mxREAL));
+                        memcpy((unsigned char*)mxGetPr(mxGetFieldByNumber(plhs[2], jstruct, 0)), cfg.exportseed, fielddim[0]*fielddim[1]);
+                    }
+
+                    if (cfg.exportseed) {
+                        free(cfg.exportseed);
+                        cfg.exportseed = NULL;
+                    }
+
+                    /** if the 2nd output presents, output the detected photon partialpath data */
+                    if (nlhs >= 2) {
+                        if (cfg.issaveexit != 2) {
+                            int hostdetreclen = mcx_detreclen(&cfg, mesh.prop);
+                            fielddim[0] = hostdetreclen;
+                            fielddim[1] = cfg.detectedcount;
+                            fielddim[2] = 0;
+                            fielddim[3] = 0;
+
+                            if (cfg.detectedcount > 0) {
+                                mxSetFieldByNumber(plhs[1], jstruct, 0, mxCreateNumericArray(2, fielddim, mxSINGLE_CLASS, mxREAL));
+                                memcpy((float*)mxGetPr(mxGetFieldByNumber(plhs[1], jstruct, 0)), cfg.exportdetected,
+                                       fielddim[0]*fielddim[1]*sizeof(float));
+                            }
+                        } else {
+                            fielddim[0] = cfg.detparam1.w;
+                            fielddim[1] = cfg.detparam2.w;
+                            fielddim[2] = cfg.maxgate;
+                            fielddim[3] = 0;
+                            mxSetFieldByNumber(plhs[1], jstruct, 0, mxCreateNumericArray(3, fielddim, mxSINGLE_CLASS, mxREAL));
+                            float* detmap = (float*)mxGetPr(mxGetFieldByNumber(plhs[1], jstruct, 0));
+                            memset(detmap, cfg.detparam1.w * cfg.detparam2.w * cfg.maxgate, sizeof(float));
+
+                            if (cfg.exportdetimage) {
+                                memcpy(detmap, cfg.exportdetimage, fielddim[0]*fielddim[1]*fielddim[2]*sizeof(float));
+                            } else {
+                                mesh_getdetimage(detmap, cfg.exportdetected, cfg.detectedcount, &cfg, &mesh);
+                            }
+                        }
+                    }
+
+                    /** re-weight the detected photons for the property sets of cfg.pmcprop, saved to the pmc field of the 1st output */
+                    if (nlhs >= 1 && cfg.pmcsetnum > 0) {
+                        int hostdetreclen = mcx_detreclen(&cfg, mesh.prop);
+                        fielddim[0] = 1 + 2 * mesh.prop;
+                        fielddim[1] = cfg.detnum;
+                        fielddim[2] = cfg.pmcsetnum;
+                        mxSetFieldByNumber(plhs[0], jstruct, 2, mxCreateNumericArray(3, fielddim, mxDOUBLE_CLASS, mxREAL));
+                        mesh_pmcreweight((double*)mxGetPr(mxGetFieldByNumber(plhs[0], jstruct, 2)), cfg.exportdetected, cfg.detectedcount, hostdetreclen,
+                                         cfg.detnum, (cfg.method != rtBLBadouelGrid) ? cfg.unitinmm : 1.f, (cfg.convphoton > 0) ? cfg.convphoton : cfg.nphoton, &cfg, &mesh);
+                    }
+
+                    if (cfg.exportdetimage) {
+                        free(cfg.exportdetimage);
+                        cfg.exportdetimage = NULL;
+                    }
+
+                    if (cfg.exportdetected) {
+                        free(cfg.exportdetected);
+                        cfg.exportdetected = NULL;
                     }
-                }
 
-                double* output = (double*)mxGetPr(mxGetFieldByNumber(plhs[0], jstruct, 0));
-                memcpy(output, mesh.weight, cfg.srcnum * datalen * cfg.maxgate * sizeof(double));
+                    if (nlhs >= 1) {
+                        int datalen = (cfg.method == rtBLBadouelGrid) ? cfg.crop0.z : ( (cfg.basisorder) ? mesh.nn : MESH_ELEMOUT(&mesh));
+                        fielddim[0] = cfg.srcnum;
+                        fielddim[1] = datalen;
+                        fielddim[2] = cfg.maxgate * cfg.replaydetnum * cfg.wavenum + 2 * cfg.freqnum; /** per-detector replay Jacobians, per-wavelength or frequency-domain outputs follow one another along the time dimension */
+                        fielddim[3] = 0;
+                        fielddim[4] = 0;
+
+                        if (cfg.method == rtBLBadouelGrid) {
+                            fielddim[0] = cfg.srcnum;
+                            fielddim[1] = cfg.dim.x;
+                            fielddim[2] = cfg.dim.y;
+                            fielddim[3] = cfg.dim.z;
+                            fielddim[4] = cfg.maxgate * cfg.replaydetnum + 2 * cfg.freqnum;
+
+                            if (cfg.srcnum > 1) {
+                                mxSetFieldByNumber(plhs[0], jstruct, 0, mxCreateNumericArray(5, fielddim, mxDOUBLE_CLASS, mxREAL));
+                            } else {
+                                mxSetFieldByNumber(plhs[0], jstruct, 0, mxCreateNumericArray(4, &fielddim[1], mxDOUBLE_CLASS, mxREAL));
+                            }
+                        } else {
+                            if (cfg.srcnum > 1) {
+                                mxSetFieldByNumber(plhs[0], jstruct, 0, mxCreateNumericArray(3, fielddim, mxDOUBLE_CLASS, mxREAL));
+                            } else {
+                                mxSetFieldByNumber(plhs[0], jstruct, 0, mxCreateNumericArray(2, &fielddim[1], mxDOUBLE_CLASS, mxREAL));
+                            }
+                        }
+
+                        double* output = (double*)mxGetPr(mxGetFieldByNumber(plhs[0], jstruct, 0));
+                        memcpy(output, mesh.weight, cfg.srcnum * datalen * (cfg.maxgate * cfg.replaydetnum * cfg.wavenum + 2 * cfg.freqnum) * sizeof(double));
+
+                        if (mesh.weightvar) {     /** batch variance of the time gates, in the layout of the data field */
+                            int ndim = (cfg.method == rtBLBadouelGrid) ? 5 : 3;
+
+                            fielddim[ndim - 1] = cfg.maxgate;
+                            mxSetFieldByNumber(plhs[0], jstruct, 3, mxCreateNumericArray(ndim - (cfg.srcnum == 1), &fielddim[cfg.srcnum == 1], mxDOUBLE_CLASS, mxREAL));
+                            memcpy((double*)mxGetPr(mxGetFieldByNumber(plhs[0], jstruct, 3)), mesh.weightvar, cfg.srcnum * datalen * cfg.maxgate * sizeof(double));
+                        }
+
+                        if (cfg.issaveref) {      /** save diffuse reflectance */
+                            fielddim[1] = mesh.nf;
+                            fielddim[2] = cfg.maxgate;
+                            mxSetFieldByNumber(plhs[0], jstruct, 1, mxCreateNumericArray(2, &fielddim[1], mxDOUBLE_CLASS, mxREAL));
+                            memcpy((double*)mxGetPr(mxGetFieldByNumber(plhs[0], jstruct, 1)), mesh.dref, fielddim[1]*fielddim[2]*sizeof(double));
+                        }
+
+                        if (cfg.isheatmap && cfg.exportheatmap) {     /** per-element counters of cfg.heatmap, one column per counter */
+                            mwSize heatdim[2] = {(mwSize)mesh.ne, hmCounterNum};
+
+                            mxSetFieldByNumber(plhs[0], jstruct, 4, mxCreateNumericArray(2, heatdim, mxDOUBLE_CLASS, mxREAL));
+                            memcpy((double*)mxGetPr(mxGetFieldByNumber(plhs[0], jstruct, 4)), cfg.exportheatmap, heatdim[0]*heatdim[1]*sizeof(double));
+                        }
+                    }
 
-                if (cfg.issaveref) {      /** save diffuse reflectance */
-                    fielddim[1] = mesh.nf;
-                    fielddim[2] = cfg.maxgate;
-                    mxSetFieldByNumber(plhs[0], jstruct, 1, mxCreateNumericArray(2, &fielddim[1], mxDOUBLE_CLASS, mxREAL));
-                    memcpy((double*)mxGetPr(mxGetFieldByNumber(plhs[0], jstruct, 1)), mesh.dref, fielddim[1]*fielddim[2]*sizeof(double));
+                    if (errorflag) {
+                        mexErrMsgTxt("MMCLAB Terminated due to exception!");
+                    }
+                } catch (const char* err) {
+                    mexPrintf("Error: %s\n", err);
+                    batchfailed = 1;
+                    slot[jstruct - jwave].status = 3;
+                } catch (const std::exception& err) {
+                    mexPrintf("C++ Error: %s\n", err.what());
+                    batchfailed = 1;
+                    slot[jstruct - jwave].status = 3;
+                } catch (...) {
+                    mexPrintf("Unknown Exception");
+                    batchfailed = 1;
+                    slot[jstruct - jwave].status = 3;
                 }
             }
 
-            if (errorflag) {
-                mexErrMsgTxt("MMCLAB Terminated due to exception!");
+            /** \subsection sclean End the simulation, unless the mesh is kept for the next job */
+            if (iskept && slot[jstruct - jwave].status != 3) {
+                continue;
             }
-        } catch (const char* err) {
-            mexPrintf("Error: %s\n", err);
-        } catch (const std::exception& err) {
-            mexPrintf("C++ Error: %s\n", err.what());
-        } catch (...) {
-            mexPrintf("Unknown Exception");
-        }
 
-        /** \subsection sclean End the simulation */
-        mesh_clear(&mesh, &cfg);
-        mcx_clearcfg(&cfg);
+            tracer_clear(&tracer);
+            mesh_clear(&mesh, &cfg);
+            mcx_clearcfg(&cfg);
+            free(jobmed);
+            jobmed = NULL;
+
+            if (jstruct < ncfg - 1) {
+                reuse[jstruct + 1] = 0;   /*the next element prepares its own mesh*/
+            }
+        }
     }
 
+    delete [] slot;
+    free(reuse);
+
     return;
 }
 
@@ -466,6 +709,35 @@ void mmc_set_field(const mxArray* root, const mxArray* item, int idx, mcconfig*
     GET_ONE_FIELD(cfg, issaveseed)
     GET_ONE_FIELD(cfg, optlevel)
     GET_ONE_FIELD(cfg, isatomic)
+    GET_ONE_FIELD(cfg, iswavefront)
+    GET_ONE_FIELD(cfg, photonblock)
+    GET_ONE_FIELD(cfg, isprivatebuf)
+    GET_ONE_FIELD(cfg, iselemmoment)
+    GET_ONE_FIELD(cfg, isnuma)
+    GET_ONE_FIELD(cfg, nphase)
+    GET_ONE_FIELD(cfg, reorder)
+    GET_ONE_FIELD(cfg, isleanmem)
+    GET_ONE_FIELD(cfg, iscachetracer)
+    GET_ONE_FIELD(cfg, iscachekernel)
+    GET_ONE_FIELD(cfg, isdynload)
+    GET_ONE_FIELD(cfg, autotune)
+    GET_ONE_FIELD(cfg, isheatmap)
+    GET_ONE_FIELD(cfg, hybrid)
+    GET_ONE_FIELD(cfg, ispersistent)
+    GET_ONE_FIELD(cfg, gpusort)
+    GET_ONE_FIELD(cfg, gpufission)
+    GET_ONE_FIELD(cfg, unifiedmem)
+    GET_ONE_FIELD(cfg, ispackmesh)
+    GET_ONE_FIELD(cfg, islocalmesh)
+    GET_ONE_FIELD(cfg, ishalfface)
+    GET_ONE_FIELD(cfg, patternbits)
+    GET_ONE_FIELD(cfg, flushrespin)
+    GET_ONE_FIELD(cfg, convtarget)
+    GET_ONE_FIELD(cfg, convbatch)
+    GET_ONE_FIELD(cfg, varbatch)
+    GET_ONE_FIELD(cfg, ckptperiod)
+    GET_ONE_FIELD(cfg, isresume)
+    GET_ONE_FIELD(cfg, meshsession)
     GET_ONE_FIELD(cfg, basisorder)
     GET_ONE_FIELD(cfg, outputformat)
     GET_ONE_FIELD(cfg, roulettesize)
@@ -481,6 +753,7 @@ void mmc_set_field(const mxArray* root, const mxArray* item, int idx, mcconfig*
     GET_ONE_FIELD(cfg, mcmethod)
     GET_ONE_FIELD(cfg, maxdetphoton)
     GET_ONE_FIELD(cfg, maxjumpdebug)
+    GET_ONE_FIELD(cfg, trajsample)
     GET_VEC3_FIELD(cfg, srcpos)
     GET_VEC34_FIELD(cfg, srcdir)
     GET_VEC3_FIELD(cfg, steps)
@@ -715,6 +988,28 @@ void mmc_set_field(const mxArray* root, const mxArray* item, int idx, mcconfig*
 
         cfg->his.maxmedia = mesh->prop;
         printf("mmc.prop=%d;\n", mesh->prop);
+    } else if (strcmp(name, "waveprop") == 0) {
+        arraydim = mxGetDimensions(item);
+
+        if (arraydim[0] > 0 && arraydim[1] != 4) {
+            MEXERROR("the 'waveprop' field must have 4 columns (mua,mus,g,n)");
+        }
+
+        double* val = mxGetPr(item);
+        cfg->waveproplen = arraydim[0];
+
+        if (cfg->waveprop) {
+            free(cfg->waveprop);
+        }
+
+        cfg->waveprop = (medium*)calloc(sizeof(medium), MAX(cfg->waveproplen, 1));
+
+        for (j = 0; j < 4; j++)
+            for (i = 0; i < cfg->waveproplen; i++) {
+                ((float*)(&cfg->waveprop[i]))[j] = val[j * cfg->waveproplen + i];
+            }
+
+        printf("mmc.waveprop=%d;\n", cfg->waveproplen);
     } else if (strcmp(name, "debuglevel") == 0) {
         int len = mxGetNumberOfElements(item);
         char buf[MAX_SESSION_LENGTH];
@@ -735,6 +1030,25 @@ void mmc_set_field(const mxArray* root, const mxArray* item, int idx, mcconfig*
 
         cfg->debuglevel = mcx_parsedebugopt(buf, debugflag);
         printf("mmc.debuglevel='%s';\n", buf);
+    } else if (strcmp(name, "savedetflag") == 0) {
+        int len = mxGetNumberOfElements(item);
+        char buf[MAX_SESSION_LENGTH];
+
+        if (!mxIsChar(item)) {
+            cfg->savedetflag = (unsigned int)mxGetScalar(item);
+            printf("mmc.savedetflag=%u;\n", cfg->savedetflag);
+        } else {
+            if (len == 0 || len > MAX_SESSION_LENGTH) {
+                MEXERROR("the 'savedetflag' field must be a non-empty string");
+            }
+
+            if (mxGetString(item, buf, MAX_SESSION_LENGTH) != 0) {
+                mexWarnMsgTxt("not enough space. string is truncated.");
+            }
+
+            cfg->savedetflag = mcx_parsedebugopt(buf, saveflag);
+            printf("mmc.savedetflag='%s';\n", buf);
+        }
     } else if (strcmp(name, "srctype") == 0) {
         int len = mxGetNumberOfElements(item);
         const char* srctypeid[] = {"pencil", "isotropic", "cone", "gaussian", "planar", "pattern", "fourier", "arcsine", "disk", "fourierx", "fourierx2d", "zgaussian", "line", "slit", ""};
@@ -779,6 +1093,22 @@ void mmc_set_field(const mxArray* root, const mxArray* item, int idx, mcconfig*
         }
 
         printf("mmc.session='%s';\n", cfg->session);
+    } else if (strcmp(name, "outmask") == 0) {
+        int len = mxGetNumberOfElements(item);
+
+        if (!mxIsChar(item)) {
+            MEXERROR("the 'outmask' field must be a string");
+        }
+
+        if (len >= MAX_PATH_LENGTH) {
+            MEXERROR("the 'outmask' field is too long");
+        }
+
+        if (len > 0 && mxGetString(item, cfg->outmask, MAX_PATH_LENGTH) != 0) {
+            mexWarnMsgTxt("not enough space. string is truncated.");
+        }
+
+        printf("mmc.outmask='%s';\n", cfg->outmask);
     } else if (strcmp(name, "srcpattern") == 0) {
         arraydim = mxGetDimensions(item);
         dimtype dimz = 1, k;
@@ -803,7 +1133,7 @@ void mmc_set_field(const mxArray* root, const mxArray* item, int idx, mcconfig*
         printf("mmc.srcpattern=[%ld %ld %ld];\n", arraydim[0], arraydim[1], dimz);
     } else if (strcmp(name, "method") == 0) {
         int len = mxGetNumberOfElements(item);
-        const char* methods[] = {"plucker", "havel", "badouel", "elem", "grid", ""};
+        const char* methods[] = {"plucker", "havel", "badouel", "elem", "grid", "packet", ""};
         char methodstr[MAX_SESSION_LENGTH] = {'\0'};
 
         if (!mxIsChar(item) || len == 0) {
@@ -879,6 +1209,32 @@ void mmc_set_field(const mxArray* root, const mxArray* item, int idx, mcconfig*
         }
 
         printf("mmc.compute='%s';\n", computestr);
+    } else if (strcmp(name, "rng") == 0) {
+        int len = mxGetNumberOfElements(item);
+        const char* rngtypename[] = {"xorshift128p", "philox", "posix", ""};
+        char rngstr[MAX_SESSION_LENGTH] = {'\0'};
+
+        if (!mxIsChar(item) || len == 0) {
+            mexErrMsgTxt("the 'rng' field must be a non-empty string");
+        }
+
+        if (len > MAX_SESSION_LENGTH) {
+            mexErrMsgTxt("the 'rng' field is too long");
+        }
+
+        int status = mxGetString(item, rngstr, MAX_SESSION_LENGTH);
+
+        if (status != 0) {
+            mexWarnMsgTxt("not enough space. string is truncated.");
+        }
+
+        cfg->rngtype = mcx_keylookup(rngstr, rngtypename);
+
+        if (cfg->rngtype == -1) {
+            mexErrMsgTxt("the specified rng is not supported, use xorshift128p, philox or posix");
+        }
+
+        printf("mmc.rng='%s';\n", rngstr);
     } else if (strcmp(name, "shapes") == 0) {
         int len = mxGetNumberOfElements(item);
 
@@ -992,8 +1348,56 @@ void mmc_set_field(const mxArray* root, const mxArray* item, int idx, mcconfig*
         }
 
         printf("mmc.workload=<<%.0f>>;\n", (double)arraydim[0]*arraydim[1]);
+    } else if (strcmp(name, "convroi") == 0) {
+        double* val = mxGetPr(item);
+        arraydim = mxGetDimensions(item);
+
+        cfg->convroinum = arraydim[0] * arraydim[1];
+        cfg->convroi = (int*)realloc(cfg->convroi, MAX(cfg->convroinum, 1) * sizeof(int));
+
+        for (dimtype i = 0; i < arraydim[0]*arraydim[1]; i++) {
+            cfg->convroi[i] = (int)val[i];
+        }
+
+        printf("mmc.convroi=<<%d>>;\n", cfg->convroinum);
+    } else if (strcmp(name, "freq") == 0) {
+        double* val = mxGetPr(item);
+        arraydim = mxGetDimensions(item);
+
+        if (arraydim[0] * arraydim[1] > MAX_FREQ_NUM) {
+            mexErrMsgTxt("the freq list can not be longer than 16");
+        }
+
+        cfg->freqnum = arraydim[0] * arraydim[1];
+        cfg->freq = (float*)realloc(cfg->freq, MAX(cfg->freqnum, 1) * sizeof(float));
+
+        for (dimtype i = 0; i < arraydim[0]*arraydim[1]; i++) {
+            cfg->freq[i] = val[i];
+        }
+
+        printf("mmc.freq=<<%d>>;\n", cfg->freqnum);
+    } else if (strcmp(name, "pmcprop") == 0) {
+        double* val = mxGetPr(item);
+        size_t ndim = mxGetNumberOfDimensions(item);
+        arraydim = mxGetDimensions(item);
+
+        if (arraydim[0] != 2 || ndim > 3) {
+            MEXERROR("the 'pmcprop' field must be a 2 x medianum x setnum array of mua/mus");
+        }
+
+        pmcmedianum = arraydim[1];
+        cfg->pmcsetnum = (ndim == 3) ? arraydim[2] : 1;
+        cfg->pmcprop = (float*)realloc(cfg->pmcprop, MAX(mxGetNumberOfElements(item), 1) * sizeof(float));
+
+        for (dimtype i = 0; i < mxGetNumberOfElements(item); i++) {
+            cfg->pmcprop[i] = val[i];
+        }
+
+        printf("mmc.pmcprop=[2 %d %d];\n", pmcmedianum, cfg->pmcsetnum);
     } else if (strcmp(name, "isreoriented") == 0) {
         /*internal flag, don't need to do anything*/
+    } else if (strcmp(name, "concurrent") == 0) {
+        /*read by mexFunction for the whole struct array*/
     } else {
         printf("WARNING: redundant field '%s'\n", name);
     }
@@ -1003,6 +1407,131 @@ void mmc_set_field(const mxArray* root, const mxArray* item, int idx, mcconfig*
     }
 }
 
+/**
+ * @brief Function to read the settings of one job of a batch run
+ *
+ * A job may only change the source, the detectors, the optical properties or
+ * the photon number of the base cfg, so that the prepared mesh can be reused.
+ * The optical properties are not installed to the mesh here, but returned in
+ * med, to be passed to mmc_prep_next.
+ *
+ * @param[in] jobs: the struct array of jobs
+ * @param[in] jjob: the index of the job (starting from 0)
+ * @param[out] cfg: the simulation configuration structure to be updated
+ * @param[in] mesh: the mesh data structure prepared by the first job
+ * @param[out] med: the buffer (mesh->prop+1 entries) to receive the optical properties
+ * @param[in] isstrict: 1 to raise an error for other fields, 0 to skip them (an element
+ *            of a cfg struct array with the same setup, see mmc_same_setup)
+ * @return 1 if the job changes the optical properties, 0 otherwise
+ */
+
+int mmc_set_job(const mxArray* jobs, int jjob, mcconfig* cfg, tetmesh* mesh, medium* med, int isstrict) {
+    int ifield, i, j, k, hasprop = 0;
+
+    for (ifield = 0; ifield < mxGetNumberOfFields(jobs); ifield++) {
+        const char* name = mxGetFieldNameByNumber(jobs, ifield);
+        const mxArray* item = mxGetFieldByNumber(jobs, jjob, ifield);
+
+        if (item == NULL || mxIsEmpty(item)) {
+            continue;
+        }
+
+        for (k = 0; k < (int)(sizeof(jobfields) / sizeof(jobfields[0])); k++) {
+            if (strcmp(name, jobfields[k]) == 0) {
+                break;
+            }
+        }
+
+        if (k == (int)(sizeof(jobfields) / sizeof(jobfields[0]))) {
+            if (!isstrict) {
+                continue;
+            }
+
+            MEXERROR("a batch job can only change nphoton, seed, srcpos, srcdir, srcparam1, srcparam2, detpos and prop");
+        }
+
+        if (strcmp(name, "prop") == 0) {
+            const dimtype* arraydim = mxGetDimensions(item);
+            double* val = mxGetPr(item);
+
+            if (arraydim[0] != (dimtype)(mesh->prop + 1) || arraydim[1] != 4) {
+                MEXERROR("the 'prop' field of a batch job must have the same number of media as the base cfg and 4 columns (mua,mus,g,n)");
+            }
+
+            for (j = 0; j < 4; j++)
+                for (i = 0; i <= mesh->prop; i++) {
+                    ((float*)(&med[i]))[j] = val[j * (mesh->prop + 1) + i];
+                }
+
+            hasprop = 1;
+        } else if (strcmp(name, "seed") == 0 && mxIsUint8(item)) {
+            MEXERROR("the seed of a batch job must be a number");
+        } else {
+            mmc_set_field(jobs, item, ifield, cfg, mesh);
+        }
+    }
+
+    return hasprop;
+}
+
+
+/**
+ * @brief Test if an element of a cfg struct array can reuse the mesh prepared for another one
+ *
+ * All fields other than those of a batch job and e0 must have identical contents,
+ * and each job field must be given in both elements or in neither of them, so
+ * that the element can be run as a batch job of the one whose mesh was prepared.
+ *
+ * @param[in] root: the cfg struct array
+ * @param[in] jbase: the index of the element whose mesh is prepared
+ * @param[in] jcfg: the index of the element to be tested
+ * @return 1 if jcfg can be run as a batch job of jbase, 0 otherwise
+ */
+
+int mmc_same_setup(const mxArray* root, int jbase, int jcfg) {
+    int ifield, k;
+
+    for (ifield = 0; ifield < mxGetNumberOfFields(root); ifield++) {
+        const char* name = mxGetFieldNameByNumber(root, ifield);
+        const mxArray* a = mxGetFieldByNumber(root, jbase, ifield);
+        const mxArray* b = mxGetFieldByNumber(root, jcfg, ifield);
+
+        for (k = 0; k < (int)(sizeof(jobfields) / sizeof(jobfields[0])); k++) {
+            if (strcmp(name, jobfields[k]) == 0) {
+                break;
+            }
+        }
+
+        if (k < (int)(sizeof(jobfields) / sizeof(jobfields[0]))) {
+            if ((a == NULL || mxIsEmpty(a)) != (b == NULL || mxIsEmpty(b))) {
+                return 0;
+            }
+
+            if (a && b && !mxIsEmpty(a) && strcmp(name, "seed") == 0 && (mxIsUint8(a) || mxIsUint8(b))) {
+                return 0;   /*photon replay is not supported in batch runs*/
+            }
+
+            if (a && b && !mxIsEmpty(a) && strcmp(name, "prop") == 0 && mxGetNumberOfElements(a) != mxGetNumberOfElements(b)) {
+                return 0;
+            }
+
+            continue;
+        }
+
+        if (a == b || strcmp(name, "e0") == 0) { /*mmc_prep_next locates the source element of a job*/
+            continue;
+        }
+
+        if (a == NULL || b == NULL || mxIsCell(a) || mxIsStruct(a) || mxGetClassID(a) != mxGetClassID(b)
+                || mxGetNumberOfDimensions(a) != mxGetNumberOfDimensions(b)
+                || memcmp(mxGetDimensions(a), mxGetDimensions(b), mxGetNumberOfDimensions(a) * sizeof(dimtype))
+                || memcmp(mxGetData(a), mxGetData(b), mxGetNumberOfElements(a) * mxGetElementSize(a))) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
 
 /**
  * @brief Error reporting function in the mex function, equivallent to mcx_error in binary mode
@@ -1032,6 +1561,13 @@ void mmclab_usage() {
  */
 
 extern "C" void mcx_matlab_flush() {
+#ifdef _OPENMP
+
+    if (omp_get_ancestor_thread_num(1) > 0) { /*a concurrent simulation in a worker thread*/
+        return;
+    }
+
+#endif
 #if defined(MATLAB_MEX_FILE)
     mexEvalString("pause(.0001);");
 #else
@@ -41,6 +41,13 @@
 #include <stdio.h>
 #include <string.h>
 #include <string>
+#include <vector>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <memory>
 #include <pybind11/iostream.h>
 
 #include "mmc_const.h"
@@ -50,6 +57,7 @@
     #include "mmc_cl_host.h"
 #endif
 #ifdef USE_CUDA
+    #include <cuda_runtime.h>
     #include "mmc_cu_host.h"
 #endif
 #include "mmc_tictoc.h"
@@ -97,6 +105,7 @@ int seed_byte = 0;
 #define MEXERROR(a)  mcx_error(999,a,__FILE__,__LINE__)   //! Macro to add unit name and line number in error printing
 
 extern const char debugflag[];
+extern const char saveflag[];
 
 /**
  * @brief Force matlab refresh the command window to print all buffered messages
@@ -107,6 +116,409 @@ extern "C" void mcx_python_flush() {
 }
 
 
+/**
+ * @brief Get a numerical array field from the user input without converting C-ordered arrays
+ *
+ * A C-contiguous array of the requested type, the NumPy default, is returned
+ * as is; any other input is converted to a Fortran-ordered array of that type.
+ *
+ * @param[in] obj: the Python object to be converted
+ */
+
+template <typename T>
+py::array get_array_field(const py::object& obj) {
+    if (py::isinstance<py::array_t<T, py::array::c_style>>(obj)) {
+        return py::array_t<T, py::array::c_style>::ensure(obj);
+    }
+
+    return py::array_t < T, py::array::f_style | py::array::forcecast >::ensure(obj);
+}
+
+/**
+ * @brief Copy an array from get_array_field into a row-major C buffer
+ *
+ * C-ordered inputs are copied with a single memcpy, Fortran-ordered ones are transposed.
+ *
+ * @param[out] dest: the output buffer of nrow*ncol elements
+ * @param[in] src: the input array
+ * @param[in] nrow: the number of rows
+ * @param[in] ncol: the number of columns
+ */
+
+template <typename T>
+void copy_rowmajor(T* dest, const py::array& src, size_t nrow, size_t ncol) {
+    const T* val = static_cast<const T*>(src.data());
+
+    if (src.flags() & py::array::c_style) {
+        memcpy(dest, val, nrow * ncol * sizeof(T));
+        return;
+    }
+
+    for (size_t j = 0; j < ncol; j++)
+        for (size_t i = 0; i < nrow; i++) {
+            dest[i * ncol + j] = val[j * nrow + i];
+        }
+}
+
+/**
+ * @brief Hand a malloc-ed output buffer over to a Fortran-ordered NumPy array without copying
+ *
+ * The returned array frees the buffer when it is garbage-collected, and buf is
+ * reset so that the MMC destructors do not free it again.
+ *
+ * @param[in,out] buf: the output buffer, set to NULL on return
+ * @param[in] dims: the dimensions of the array
+ */
+
+template <typename T>
+py::array_t<T, py::array::f_style> wrap_output(T*& buf, const std::vector<size_t>& dims) {
+    std::vector<size_t> strides(dims.size());
+    size_t stride = sizeof(T);
+    T* data = buf;
+
+    if (data == nullptr) {
+        return py::array_t<T, py::array::f_style>(dims);
+    }
+
+    for (size_t i = 0; i < dims.size(); i++) {
+        strides[i] = stride;
+        stride *= dims[i];
+    }
+
+    py::capsule owner(data, [](void* ptr) {
+        free(ptr);
+    });
+    buf = nullptr;
+    return py::array_t<T, py::array::f_style>(dims, strides, data, owner);
+}
+
+
+/**
+ * The DLPack tensor structures (ABI of dlpack.h v0.8), used to exchange arrays with
+ * CuPy, PyTorch and other array libraries without copying through NumPy
+ */
+
+enum {dlCPU = 1, dlCUDA = 2, dlCUDAHost = 3};
+
+typedef struct {
+    int32_t device_type;
+    int32_t device_id;
+} DLDevice;
+
+typedef struct {
+    uint8_t code;          /**< 0: int, 1: uint, 2: float */
+    uint8_t bits;
+    uint16_t lanes;
+} DLDataType;
+
+typedef struct {
+    void* data;
+    DLDevice device;
+    int32_t ndim;
+    DLDataType dtype;
+    int64_t* shape;
+    int64_t* strides;      /**< in elements, NULL for a C-ordered tensor */
+    uint64_t byte_offset;
+} DLTensor;
+
+typedef struct DLManagedTensor {
+    DLTensor dl_tensor;
+    void* manager_ctx;
+    void (*deleter)(struct DLManagedTensor* self);
+} DLManagedTensor;
+
+/** Output modes of the 'dlpack' field: NumPy arrays, or DLPack capsules on the host or the CUDA device */
+enum TDLPackMode {dlpNone = 0, dlpHost = 1, dlpCUDA = 2};
+
+/**
+ * @brief The owner of an output buffer handed over as a DLPack tensor
+ */
+
+typedef struct {
+    DLManagedTensor tensor;
+    std::vector<int64_t> shape;
+    std::vector<int64_t> strides;
+} DLPackOutput;
+
+/**
+ * @brief Release a DLPack output, called by the consumer or by an unused capsule
+ */
+
+void dlpack_free(DLManagedTensor* self) {
+    DLPackOutput* out = (DLPackOutput*)self->manager_ctx;
+
+#ifdef USE_CUDA
+
+    if (self->dl_tensor.device.device_type == dlCUDA) {
+        cudaFree(self->dl_tensor.data);
+    } else
+#endif
+        free(self->dl_tensor.data);
+
+    delete out;
+}
+
+/**
+ * @brief Hand a malloc-ed output buffer over to a Fortran-ordered DLPack capsule
+ *
+ * In the dlpCUDA mode, the buffer is moved to the current CUDA device first, so that
+ * torch.from_dlpack() or cupy.from_dlpack() use the output in place on the GPU.
+ * buf is reset so that the MMC destructors do not free it again.
+ *
+ * @param[in,out] buf: the output buffer, set to NULL on return
+ * @param[in] dims: the dimensions of the array
+ * @param[in] mode: dlpHost or dlpCUDA
+ */
+
+template <typename T>
+py::object wrap_dlpack(T*& buf, const std::vector<size_t>& dims, int mode) {
+    DLPackOutput* out = new DLPackOutput;
+    size_t len = 1;
+
+    for (size_t i = 0; i < dims.size(); i++) {
+        out->shape.push_back((int64_t)dims[i]);
+        out->strides.push_back((int64_t)len);
+        len *= dims[i];
+    }
+
+    out->tensor.dl_tensor.data = buf;
+    out->tensor.dl_tensor.device = {dlCPU, 0};
+
+    if (buf == nullptr) {
+        out->tensor.dl_tensor.data = calloc(len + 1, sizeof(T));
+    }
+
+#ifdef USE_CUDA
+
+    if (mode == dlpCUDA) {
+        void* dev = nullptr;
+
+        if (cudaGetDevice(&out->tensor.dl_tensor.device.device_id) != cudaSuccess || cudaMalloc(&dev, (len + 1) * sizeof(T)) != cudaSuccess) {
+            free(out->tensor.dl_tensor.data);
+            delete out;
+            throw py::runtime_error("can not allocate the CUDA output buffer");
+        }
+
+        cudaMemcpy(dev, out->tensor.dl_tensor.data, len * sizeof(T), cudaMemcpyHostToDevice);
+        free(out->tensor.dl_tensor.data);
+        out->tensor.dl_tensor.data = dev;
+        out->tensor.dl_tensor.device.device_type = dlCUDA;
+    }
+
+#endif
+
+    out->tensor.dl_tensor.ndim = (int32_t)dims.size();
+    out->tensor.dl_tensor.dtype = {(uint8_t)(std::is_floating_point<T>::value ? 2 : (std::is_signed<T>::value ? 0 : 1)), (uint8_t)(sizeof(T) * 8), 1};
+    out->tensor.dl_tensor.shape = out->shape.data();
+    out->tensor.dl_tensor.strides = out->strides.data();
+    out->tensor.dl_tensor.byte_offset = 0;
+    out->tensor.manager_ctx = out;
+    out->tensor.deleter = dlpack_free;
+    buf = nullptr;
+
+    PyObject* capsule = PyCapsule_New(&out->tensor, "dltensor", [](PyObject * cap) {
+        if (PyCapsule_IsValid(cap, "dltensor")) {  // a consumer renames the capsule to "used_dltensor"
+            DLManagedTensor* tensor = (DLManagedTensor*)PyCapsule_GetPointer(cap, "dltensor");
+            tensor->deleter(tensor);
+        }
+    });
+
+    if (capsule == nullptr) {
+        dlpack_free(&out->tensor);
+        throw py::error_already_set();
+    }
+
+    return py::reinterpret_steal<py::object>(capsule);
+}
+
+/**
+ * @brief Hand an output buffer over to NumPy, or to DLPack if requested by the 'dlpack' field
+ */
+
+template <typename T>
+py::object wrap_field(T*& buf, const std::vector<size_t>& dims, int mode) {
+    if (mode == dlpNone) {
+        return wrap_output(buf, dims);
+    }
+
+    return wrap_dlpack(buf, dims, mode);
+}
+
+/**
+ * @brief Copy an input array held on a GPU, such as a CuPy array or a CUDA PyTorch tensor, to a NumPy array
+ *
+ * Host arrays are returned as they are. A CUDA build copies device arrays with cudaMemcpy;
+ * otherwise the producer is asked for a host copy through __dlpack__(dl_device=(kDLCPU, 0), copy=True).
+ *
+ * @param[in] obj: the user input
+ */
+
+py::object host_field(const py::object& obj) {
+    if (py::isinstance<py::array>(obj) || !py::hasattr(obj, "__dlpack_device__")) {
+        return obj;
+    }
+
+    int devtype = obj.attr("__dlpack_device__")().cast<py::tuple>()[0].cast<int>();
+
+    if (devtype == dlCPU || devtype == dlCUDAHost) {
+        return obj;
+    }
+
+    py::object capsule;
+
+#ifdef USE_CUDA
+
+    if (devtype == dlCUDA) {
+        capsule = obj.attr("__dlpack__")();
+    } else
+#endif
+    {
+        try {
+            capsule = obj.attr("__dlpack__")(py::arg("dl_device") = py::make_tuple((int)dlCPU, 0), py::arg("copy") = true);
+        } catch (py::error_already_set& err) {
+            throw py::value_error(std::string("can not copy a device array to the host: ") + err.what());
+        }
+    }
+
+    DLManagedTensor* tensor = (DLManagedTensor*)PyCapsule_GetPointer(capsule.ptr(), "dltensor");
+
+    if (tensor == nullptr) {
+        throw py::error_already_set();
+    }
+
+    DLTensor& t = tensor->dl_tensor;
+    std::string fmt = (t.dtype.code == 2) ? "f" : ((t.dtype.code == 1) ? "u" : "i");
+    py::dtype dtype = py::dtype::from_args(py::str(fmt + std::to_string(t.dtype.bits / 8)));
+    std::vector<py::ssize_t> shape(t.shape, t.shape + t.ndim), strides(t.ndim);
+    py::ssize_t len = 1, cstride = 1, fstride = 1;
+    bool isc = true, isf = true;
+
+    for (int i = 0; i < t.ndim; i++) {
+        int j = t.ndim - 1 - i;
+        isc = isc && (!t.strides || shape[j] == 1 || t.strides[j] == cstride);
+        isf = isf && (!t.strides || shape[i] == 1 || t.strides[i] == fstride);
+        cstride *= shape[j];
+        fstride *= shape[i];
+        len *= shape[i];
+    }
+
+    if (!isc && !isf) {
+        PyCapsule_SetName(capsule.ptr(), "used_dltensor");
+
+        if (tensor->deleter) {
+            tensor->deleter(tensor);
+        }
+
+        throw py::value_error("device arrays must be C- or Fortran-contiguous");
+    }
+
+    for (py::ssize_t i = 0, stride = dtype.itemsize(); i < t.ndim; i++) {
+        py::ssize_t j = isc ? t.ndim - 1 - i : i;
+        strides[j] = stride;
+        stride *= shape[j];
+    }
+
+    py::array host(dtype, shape, strides);
+    const char* src = (const char*)t.data + t.byte_offset;
+
+#ifdef USE_CUDA
+
+    if (t.device.device_type == dlCUDA) {
+        cudaMemcpy(host.mutable_data(), src, len * dtype.itemsize(), cudaMemcpyDeviceToHost);
+    } else
+#endif
+        memcpy(host.mutable_data(), src, len * dtype.itemsize());
+
+    PyCapsule_SetName(capsule.ptr(), "used_dltensor");
+
+    if (tensor->deleter) {
+        tensor->deleter(tensor);
+    }
+
+    return host;
+}
+
+/**
+ * @brief Return a copy of a config or job dictionary with all device arrays copied to the host, see host_field
+ */
+
+py::dict host_fields(const py::dict& user_cfg) {
+    py::dict cfg;
+
+    for (auto item : user_cfg) {
+        cfg[item.first] = host_field(py::reinterpret_borrow<py::object>(item.second));
+    }
+
+    return cfg;
+}
+
+/**
+ * @brief Parse the 'dlpack' field: False/0 for NumPy outputs, True/1/'cpu' for host and 'cuda'/2 for device DLPack capsules
+ */
+
+int parse_dlpack_mode(const py::dict& user_cfg) {
+    if (!user_cfg.contains("dlpack")) {
+        return dlpNone;
+    }
+
+    py::object val = user_cfg["dlpack"];
+    int mode = dlpNone;
+
+    if (py::isinstance<py::str>(val)) {
+        std::string dev = val.cast<std::string>();
+
+        if (dev != "cpu" && dev != "cuda") {
+            throw py::value_error("the 'dlpack' field must be 'cpu', 'cuda' or a boolean");
+        }
+
+        mode = (dev == "cuda") ? dlpCUDA : dlpHost;
+    } else {
+        mode = val.cast<int>();
+
+        if (mode < dlpNone || mode > dlpCUDA) {
+            throw py::value_error("the 'dlpack' field must be 'cpu', 'cuda' or a boolean");
+        }
+    }
+
+#ifndef USE_CUDA
+
+    if (mode == dlpCUDA) {
+        throw py::value_error("dlpack='cuda' requires pmmc to be built with CUDA");
+    }
+
+#endif
+    return mode;
+}
+
+/**
+ * Read the detector positions from a user supplied detpos array
+ * @param obj the detpos field, an N by 4 array (x,y,z,radius)
+ * @param mcx_config mcconfig object receiving the detectors
+ */
+
+void parse_detpos(const py::object& obj, mcconfig& mcx_config) {
+    auto volume = get_array_field<float>(obj);
+
+    if (!volume) {
+        throw py::value_error("Invalid detpos field value");
+    }
+
+    auto buffer_info = volume.request();
+
+    if ((buffer_info.shape.size() > 1 && buffer_info.shape.at(0) > 0 && buffer_info.shape.at(1) != 4) || (buffer_info.shape.size() == 1 && buffer_info.shape.at(0) != 4)) {
+        throw py::value_error("the 'detpos' field must have 4 columns (x,y,z,radius)");
+    }
+
+    mcx_config.detnum = (buffer_info.shape.size() == 1) ? 1 : buffer_info.shape.at(0);
+
+    if (mcx_config.detpos) {
+        free(mcx_config.detpos);
+    }
+
+    mcx_config.detpos = (float4*) malloc(mcx_config.detnum * sizeof(float4));
+    copy_rowmajor((float*)mcx_config.detpos, volume, mcx_config.detnum, 4);
+}
+
 /**
  * Parse user input cfg object and convert to to MMC's mcconfig object.
  * @param user_cfg
@@ -115,6 +527,8 @@ extern "C" void mcx_python_flush() {
 
 
 void parse_config(const py::dict& user_cfg, mcconfig& mcx_config, tetmesh& mesh) {
+    unsigned long long tphase = GetTimeNanos();
+
     mcx_initcfg(&mcx_config);
     mesh_init(&mesh);
 
@@ -135,6 +549,36 @@ void parse_config(const py::dict& user_cfg, mcconfig& mcx_config, tetmesh& mesh)
     GET_SCALAR_FIELD(user_cfg, mcx_config, issaveseed, py::bool_);
     GET_SCALAR_FIELD(user_cfg, mcx_config, optlevel, py::int_);
     GET_SCALAR_FIELD(user_cfg, mcx_config, isatomic, py::bool_);
+    GET_SCALAR_FIELD(user_cfg, mcx_config, iswavefront, py::bool_);
+    GET_SCALAR_FIELD(user_cfg, mcx_config, photonblock, py::int_);
+    GET_SCALAR_FIELD(user_cfg, mcx_config, isprivatebuf, py::bool_);
+    GET_SCALAR_FIELD(user_cfg, mcx_config, iselemmoment, py::bool_);
+    GET_SCALAR_FIELD(user_cfg, mcx_config, isnuma, py::bool_);
+    GET_SCALAR_FIELD(user_cfg, mcx_config, nphase, py::int_);
+    GET_SCALAR_FIELD(user_cfg, mcx_config, reorder, py::int_);
+    GET_SCALAR_FIELD(user_cfg, mcx_config, isleanmem, py::bool_);
+    GET_SCALAR_FIELD(user_cfg, mcx_config, iscachetracer, py::bool_);
+    GET_SCALAR_FIELD(user_cfg, mcx_config, iscachekernel, py::bool_);
+    GET_SCALAR_FIELD(user_cfg, mcx_config, issaveprofile, py::bool_);
+    GET_SCALAR_FIELD(user_cfg, mcx_config, isheatmap, py::bool_);
+    GET_SCALAR_FIELD(user_cfg, mcx_config, convtarget, py::float_);
+    GET_SCALAR_FIELD(user_cfg, mcx_config, convbatch, py::int_);
+    GET_SCALAR_FIELD(user_cfg, mcx_config, varbatch, py::int_);
+    GET_SCALAR_FIELD(user_cfg, mcx_config, ckptperiod, py::int_);
+    GET_SCALAR_FIELD(user_cfg, mcx_config, isresume, py::bool_);
+    GET_SCALAR_FIELD(user_cfg, mcx_config, isdynload, py::bool_);
+    GET_SCALAR_FIELD(user_cfg, mcx_config, autotune, py::int_);
+    GET_SCALAR_FIELD(user_cfg, mcx_config, hybrid, py::float_);
+    GET_SCALAR_FIELD(user_cfg, mcx_config, ispersistent, py::bool_);
+    GET_SCALAR_FIELD(user_cfg, mcx_config, gpusort, py::int_);
+    GET_SCALAR_FIELD(user_cfg, mcx_config, gpufission, py::int_);
+    GET_SCALAR_FIELD(user_cfg, mcx_config, unifiedmem, py::int_);
+    GET_SCALAR_FIELD(user_cfg, mcx_config, ispackmesh, py::bool_);
+    GET_SCALAR_FIELD(user_cfg, mcx_config, islocalmesh, py::bool_);
+    GET_SCALAR_FIELD(user_cfg, mcx_config, ishalfface, py::bool_);
+    GET_SCALAR_FIELD(user_cfg, mcx_config, patternbits, py::int_);
+    GET_SCALAR_FIELD(user_cfg, mcx_config, flushrespin, py::int_);
+    GET_SCALAR_FIELD(user_cfg, mcx_config, meshsession, py::int_);
     GET_SCALAR_FIELD(user_cfg, mcx_config, basisorder, py::int_);
     GET_SCALAR_FIELD(user_cfg, mcx_config, roulettesize, py::float_);
     GET_SCALAR_FIELD(user_cfg, mcx_config, nout, py::float_);
@@ -149,6 +593,7 @@ void parse_config(const py::dict& user_cfg, mcconfig& mcx_config, tetmesh& mesh)
     GET_SCALAR_FIELD(user_cfg, mcx_config, mcmethod, py::bool_);
     GET_SCALAR_FIELD(user_cfg, mcx_config, maxdetphoton, py::int_);
     GET_SCALAR_FIELD(user_cfg, mcx_config, maxjumpdebug, py::int_);
+    GET_SCALAR_FIELD(user_cfg, mcx_config, trajsample, py::int_);
     GET_SCALAR_FIELD(user_cfg, mcx_config, e0, py::int_);
     GET_VEC3_FIELD(user_cfg, mcx_config, srcpos, float);
     GET_VEC34_FIELD(user_cfg, mcx_config, srcdir, float);
@@ -159,13 +604,13 @@ void parse_config(const py::dict& user_cfg, mcconfig& mcx_config, tetmesh& mesh)
     GET_VEC4_FIELD(user_cfg, mcx_config, detparam2, float);
 
     if (user_cfg.contains("node")) {
-        auto f_style_volume = py::array_t < float, py::array::f_style | py::array::forcecast >::ensure(user_cfg["node"]);
+        auto volume = get_array_field<float>(user_cfg["node"]);
 
-        if (!f_style_volume) {
+        if (!volume) {
             throw py::value_error("Invalid node field value");
         }
 
-        auto buffer_info = f_style_volume.request();
+        auto buffer_info = volume.request();
 
         if ((buffer_info.shape.size() > 1 && (buffer_info.shape.at(0) < 4 || buffer_info.shape.at(1) != 3)) || (buffer_info.shape.size() == 1)) {
             throw py::value_error("the 'node' field must have 3 columns (x,y,z) and minimum 4 nodes");
@@ -178,23 +623,18 @@ void parse_config(const py::dict& user_cfg, mcconfig& mcx_config, tetmesh& mesh)
         }
 
         mesh.node = (FLOAT3*) malloc(mesh.nn * sizeof(FLOAT3));
-        auto val = static_cast<float*>(buffer_info.ptr);
-
-        for (int j = 0; j < 3; j++)
-            for (int i = 0; i < mesh.nn; i++) {
-                ((float*) (&mesh.node[i]))[j] = val[j * mesh.nn + i];
-            }
+        copy_rowmajor((float*)mesh.node, volume, mesh.nn, 3);
     }
 
 
     if (user_cfg.contains("elem")) {
-        auto f_style_volume = py::array_t < int, py::array::f_style | py::array::forcecast >::ensure(user_cfg["elem"]);
+        auto volume = get_array_field<int>(user_cfg["elem"]);
 
-        if (!f_style_volume) {
+        if (!volume) {
             throw py::value_error("Invalid elem field value");
         }
 
-        auto buffer_info = f_style_volume.request();
+        auto buffer_info = volume.request();
 
         if ((buffer_info.shape.size() > 1 && (buffer_info.shape.at(0) == 0 || (buffer_info.shape.at(1) != 4 && buffer_info.shape.at(1) != 10))) || (buffer_info.shape.size() == 1)) {
             throw py::value_error("the 'elem' field must have 4 or 10 columns");
@@ -208,12 +648,7 @@ void parse_config(const py::dict& user_cfg, mcconfig& mcx_config, tetmesh& mesh)
         }
 
         mesh.elem = (int*) malloc(mesh.ne * mesh.elemlen * sizeof(int));
-        auto val = static_cast<int*>(buffer_info.ptr);
-
-        for (int j = 0; j < mesh.elemlen; j++)
-            for (int i = 0; i < mesh.ne; i++) {
-                mesh.elem[i * mesh.elemlen + j] = val[j * mesh.ne + i];
-            }
+        copy_rowmajor(mesh.elem, volume, mesh.ne, mesh.elemlen);
     }
 
 
@@ -243,13 +678,13 @@ void parse_config(const py::dict& user_cfg, mcconfig& mcx_config, tetmesh& mesh)
 
 
     if (user_cfg.contains("edgeroi")) {
-        auto f_style_volume = py::array_t < float, py::array::f_style | py::array::forcecast >::ensure(user_cfg["edgeroi"]);
+        auto volume = get_array_field<float>(user_cfg["edgeroi"]);
 
-        if (!f_style_volume) {
+        if (!volume) {
             throw py::value_error("Invalid edgeroi field value");
         }
 
-        auto buffer_info = f_style_volume.request();
+        auto buffer_info = volume.request();
 
         if ((buffer_info.shape.size() > 1 && buffer_info.shape.at(1) != 6) || (buffer_info.shape.size() == 1)) {
             throw py::value_error("the 'edgeroi' field must have 6 columns");
@@ -262,23 +697,18 @@ void parse_config(const py::dict& user_cfg, mcconfig& mcx_config, tetmesh& mesh)
         }
 
         mesh.edgeroi = (float*) malloc(mesh.ne * 6 * sizeof(float));
-        auto val = static_cast<float*>(buffer_info.ptr);
-
-        for (int j = 0; j < 6; j++)
-            for (int i = 0; i < mesh.ne; i++) {
-                mesh.edgeroi[i * 6 + j] = val[j * mesh.ne + i];
-            }
+        copy_rowmajor(mesh.edgeroi, volume, mesh.ne, 6);
     }
 
 
     if (user_cfg.contains("faceroi")) {
-        auto f_style_volume = py::array_t < float, py::array::f_style | py::array::forcecast >::ensure(user_cfg["faceroi"]);
+        auto volume = get_array_field<float>(user_cfg["faceroi"]);
 
-        if (!f_style_volume) {
+        if (!volume) {
             throw py::value_error("Invalid faceroi field value");
         }
 
-        auto buffer_info = f_style_volume.request();
+        auto buffer_info = volume.request();
 
         if ((buffer_info.shape.size() > 1 && buffer_info.shape.at(1) != 4) || (buffer_info.shape.size() == 1)) {
             throw py::value_error("the 'faceroi' field must have 6 columns");
@@ -291,23 +721,18 @@ void parse_config(const py::dict& user_cfg, mcconfig& mcx_config, tetmesh& mesh)
         }
 
         mesh.faceroi = (float*) malloc(mesh.ne * 4 * sizeof(float));
-        auto val = static_cast<float*>(buffer_info.ptr);
-
-        for (int j = 0; j < 4; j++)
-            for (int i = 0; i < mesh.ne; i++) {
-                mesh.faceroi[i * 4 + j] = val[j * mesh.ne + i];
-            }
+        copy_rowmajor(mesh.faceroi, volume, mesh.ne, 4);
     }
 
 
     if (user_cfg.contains("facenb")) {
-        auto f_style_volume = py::array_t < int, py::array::f_style | py::array::forcecast >::ensure(user_cfg["facenb"]);
+        auto volume = get_array_field<int>(user_cfg["facenb"]);
 
-        if (!f_style_volume) {
+        if (!volume) {
             throw py::value_error("Invalid facenb field value");
         }
 
-        auto buffer_info = f_style_volume.request();
+        auto buffer_info = volume.request();
 
         if ((buffer_info.shape.size() > 1 && (buffer_info.shape.at(0) == 0 || (buffer_info.shape.at(1) != 4 && buffer_info.shape.at(1) != 10))) || (buffer_info.shape.size() == 1)) {
             throw py::value_error("the 'facenb' field must have 4 or 10 columns");
@@ -321,12 +746,7 @@ void parse_config(const py::dict& user_cfg, mcconfig& mcx_config, tetmesh& mesh)
         }
 
         mesh.facenb = (int*) malloc(mesh.ne * mesh.elemlen * sizeof(int));
-        auto val = static_cast<int*>(buffer_info.ptr);
-
-        for (int j = 0; j < mesh.elemlen; j++)
-            for (int i = 0; i < mesh.ne; i++) {
-                mesh.facenb[i * mesh.elemlen + j] = val[j * mesh.ne + i];
-            }
+        copy_rowmajor(mesh.facenb, volume, mesh.ne, mesh.elemlen);
     }
 
 
@@ -356,42 +776,18 @@ void parse_config(const py::dict& user_cfg, mcconfig& mcx_config, tetmesh& mesh)
 
 
     if (user_cfg.contains("detpos")) {
-        auto f_style_volume = py::array_t < float, py::array::f_style | py::array::forcecast >::ensure(user_cfg["detpos"]);
-
-        if (!f_style_volume) {
-            throw py::value_error("Invalid detpos field value");
-        }
-
-        auto buffer_info = f_style_volume.request();
-
-        if ((buffer_info.shape.size() > 1 && buffer_info.shape.at(0) > 0 && buffer_info.shape.at(1) != 4) || (buffer_info.shape.size() == 1 && buffer_info.shape.at(0) != 4)) {
-            throw py::value_error("the 'detpos' field must have 4 columns (x,y,z,radius)");
-        }
-
-        mcx_config.detnum = (buffer_info.shape.size() == 1) ? 1 : buffer_info.shape.at(0);
-
-        if (mcx_config.detpos) {
-            free(mcx_config.detpos);
-        }
-
-        mcx_config.detpos = (float4*) malloc(mcx_config.detnum * sizeof(float4));
-        auto val = static_cast<float*>(buffer_info.ptr);
-
-        for (int j = 0; j < 4; j++)
-            for (int i = 0; i < mcx_config.detnum; i++) {
-                ((float*) (&mcx_config.detpos[i]))[j] = val[j * mcx_config.detnum + i];
-            }
+        parse_detpos(user_cfg["detpos"], mcx_config);
     }
 
 
     if (user_cfg.contains("prop")) {
-        auto f_style_volume = py::array_t < float, py::array::f_style | py::array::forcecast >::ensure(user_cfg["prop"]);
+        auto volume = get_array_field<float>(user_cfg["prop"]);
 
-        if (!f_style_volume) {
+        if (!volume) {
             throw py::value_error("Invalid prop field format");
         }
 
-        auto buffer_info = f_style_volume.request();
+        auto buffer_info = volume.request();
 
         if ((buffer_info.shape.size() > 1 && buffer_info.shape.at(0) > 0 && buffer_info.shape.at(1) != 4) || (buffer_info.shape.size() == 1 && buffer_info.shape.at(0) != 4)) {
             throw py::value_error("the 'prop' field must have 4 columns (mua,mus,g,n)");
@@ -404,16 +800,34 @@ void parse_config(const py::dict& user_cfg, mcconfig& mcx_config, tetmesh& mesh)
         }
 
         mesh.med = (medium*) malloc((mesh.prop + 1) * sizeof(medium));
-        auto val = static_cast<float*>(buffer_info.ptr);
-
-        for (int j = 0; j < 4; j++)
-            for (int i = 0; i <= mesh.prop; i++) {
-                ((float*) (&mesh.med[i]))[j] = val[j * (mesh.prop + 1) + i];
-            }
+        copy_rowmajor((float*)mesh.med, volume, mesh.prop + 1, 4);
 
         mcx_config.his.maxmedia = mesh.prop;
     }
 
+    if (user_cfg.contains("waveprop")) {
+        auto volume = get_array_field<float>(user_cfg["waveprop"]);
+
+        if (!volume) {
+            throw py::value_error("Invalid waveprop field format");
+        }
+
+        auto buffer_info = volume.request();
+
+        if (buffer_info.shape.size() != 2 || buffer_info.shape.at(1) != 4) {
+            throw py::value_error("the 'waveprop' field must have 4 columns (mua,mus,g,n)");
+        }
+
+        mcx_config.waveproplen = buffer_info.shape.at(0);
+
+        if (mcx_config.waveprop) {
+            free(mcx_config.waveprop);
+        }
+
+        mcx_config.waveprop = (medium*) malloc(std::max(mcx_config.waveproplen, 1) * sizeof(medium));
+        copy_rowmajor((float*)mcx_config.waveprop, volume, mcx_config.waveproplen, 4);
+    }
+
 
     if (user_cfg.contains("session")) {
         std::string session = py::str(user_cfg["session"]);
@@ -429,6 +843,16 @@ void parse_config(const py::dict& user_cfg, mcconfig& mcx_config, tetmesh& mesh)
         strncpy(mcx_config.session, session.c_str(), MAX_SESSION_LENGTH);
     }
 
+    if (user_cfg.contains("outmask")) {
+        std::string outmask = py::str(user_cfg["outmask"]);
+
+        if (outmask.size() >= MAX_PATH_LENGTH) {
+            throw py::value_error("the 'outmask' field is too long");
+        }
+
+        strncpy(mcx_config.outmask, outmask.c_str(), MAX_PATH_LENGTH - 1);
+    }
+
 
     if (user_cfg.contains("srctype")) {
         std::string src_type = py::str(user_cfg["srctype"]);
@@ -451,7 +875,7 @@ void parse_config(const py::dict& user_cfg, mcconfig& mcx_config, tetmesh& mesh)
 
     if (user_cfg.contains("method")) {
         std::string method_str = py::str(user_cfg["method"]);
-        const char* methods[] = {"plucker", "havel", "badouel", "elem", "grid", ""};
+        const char* methods[] = {"plucker", "havel", "badouel", "elem", "grid", "packet", ""};
 
         if (method_str.empty()) {
             throw py::value_error("the 'method' field must be a non-empty string");
@@ -501,6 +925,22 @@ void parse_config(const py::dict& user_cfg, mcconfig& mcx_config, tetmesh& mesh)
     }
 
 
+    if (user_cfg.contains("rng")) {
+        std::string rng_str = py::str(user_cfg["rng"]);
+        const char* rngtypename[] = {"xorshift128p", "philox", "posix", ""};
+
+        if (rng_str.empty()) {
+            throw py::value_error("the 'rng' field must be a non-empty string");
+        }
+
+        mcx_config.rngtype = mcx_keylookup((char*)(rng_str.c_str()), rngtypename);
+
+        if (mcx_config.rngtype == -1) {
+            throw py::value_error("the specified rng is not supported, use xorshift128p, philox or posix");
+        }
+    }
+
+
     if (user_cfg.contains("debuglevel")) {
         std::string debug_level = py::str(user_cfg["debuglevel"]);
         const char debugflag[] = {'R', 'M', 'P', '\0'};
@@ -522,6 +962,22 @@ void parse_config(const py::dict& user_cfg, mcconfig& mcx_config, tetmesh& mesh)
         }
     }
 
+    if (user_cfg.contains("savedetflag")) {
+        if (py::isinstance<py::str>(user_cfg["savedetflag"])) {
+            std::string save_flag = py::str(user_cfg["savedetflag"]);
+            char saveflagstr[MAX_SESSION_LENGTH] = {'\0'};
+
+            if (save_flag.empty() || save_flag.size() >= MAX_SESSION_LENGTH) {
+                throw py::value_error("the 'savedetflag' field must be a non-empty string");
+            }
+
+            strncpy(saveflagstr, save_flag.c_str(), MAX_SESSION_LENGTH - 1);
+            mcx_config.savedetflag = mcx_parsedebugopt(saveflagstr, saveflag);
+        } else {
+            mcx_config.savedetflag = py::int_(user_cfg["savedetflag"]);
+        }
+    }
+
 
     if (user_cfg.contains("srcpattern")) {
         auto f_style_volume = py::array_t < float, py::array::f_style | py::array::forcecast >::ensure(user_cfg["srcpattern"]);
@@ -656,24 +1112,75 @@ void parse_config(const py::dict& user_cfg, mcconfig& mcx_config, tetmesh& mesh)
         }
     }
 
-    //
-    if (user_cfg.contains("flog")) {
-        auto logfile_id_value = user_cfg["flog"];
+    if (user_cfg.contains("convroi")) {
+        auto convroi_value = py::array_t < int, py::array::f_style | py::array::forcecast >::ensure(user_cfg["convroi"]);
 
-        if (py::int_::check_(logfile_id_value)) {
-            int logid = py::int_(logfile_id_value);
-            mcx_config.flog = (logid >= 2 ? stderr : (logid == 1 ? stdout : (mcx_config.printnum = -1, stdout)));
-        } else if (py::str::check_(logfile_id_value)) {
-            std::string logfile_id_string_value = py::str(logfile_id_value);
+        if (!convroi_value) {
+            throw py::value_error("Invalid convroi field value");
+        }
 
-            if (logfile_id_string_value.empty()) {
-                throw py::value_error("the 'flog' field must be an integer or non-empty string");
-            }
+        auto buffer_info = convroi_value.request();
 
-            mcx_config.flog = fopen(logfile_id_string_value.c_str(), "a+");
+        mcx_config.convroinum = buffer_info.size;
+        mcx_config.convroi = (int*)realloc(mcx_config.convroi, std::max<size_t>(buffer_info.size, 1) * sizeof(int));
+        memcpy(mcx_config.convroi, buffer_info.ptr, buffer_info.size * sizeof(int));
+    }
 
-            if (mcx_config.flog == NULL) {
-                throw py::value_error("Log output file can not be written");
+    if (user_cfg.contains("freq")) {
+        auto freq_value = py::array_t < float, py::array::f_style | py::array::forcecast >::ensure(user_cfg["freq"]);
+
+        if (!freq_value) {
+            throw py::value_error("Invalid freq field value");
+        }
+
+        auto buffer_info = freq_value.request();
+
+        mcx_config.freqnum = buffer_info.size;
+        mcx_config.freq = (float*)realloc(mcx_config.freq, std::max<size_t>(buffer_info.size, 1) * sizeof(float));
+        memcpy(mcx_config.freq, buffer_info.ptr, buffer_info.size * sizeof(float));
+    }
+
+    // property sets to re-weight the detected photons by perturbation MC, a (setnum, medianum, 2) array of mua/mus
+    if (user_cfg.contains("pmcprop")) {
+        auto pmc_value = py::array_t < float, py::array::c_style | py::array::forcecast >::ensure(user_cfg["pmcprop"]);
+
+        if (!pmc_value) {
+            throw py::value_error("Invalid pmcprop field value");
+        }
+
+        auto buffer_info = pmc_value.request();
+
+        if (mesh.prop <= 0 || (buffer_info.ndim != 2 && buffer_info.ndim != 3) || buffer_info.shape.back() != 2 || buffer_info.shape.at(buffer_info.ndim - 2) != mesh.prop) {
+            throw py::value_error("the pmcprop field must be a (setnum, medianum, 2) array of mua/mus");
+        }
+
+        mcx_config.pmcsetnum = buffer_info.size / (2 * mesh.prop);
+        mcx_config.pmcprop = (float*)realloc(mcx_config.pmcprop, std::max<size_t>(buffer_info.size, 1) * sizeof(float));
+        memcpy(mcx_config.pmcprop, buffer_info.ptr, buffer_info.size * sizeof(float));
+
+        if (mcx_config.issavedet == 0) {
+            mcx_config.issavedet = 1;
+        }
+    }
+
+    //
+    if (user_cfg.contains("flog")) {
+        auto logfile_id_value = user_cfg["flog"];
+
+        if (py::int_::check_(logfile_id_value)) {
+            int logid = py::int_(logfile_id_value);
+            mcx_config.flog = (logid >= 2 ? stderr : (logid == 1 ? stdout : (mcx_config.printnum = -1, stdout)));
+        } else if (py::str::check_(logfile_id_value)) {
+            std::string logfile_id_string_value = py::str(logfile_id_value);
+
+            if (logfile_id_string_value.empty()) {
+                throw py::value_error("the 'flog' field must be an integer or non-empty string");
+            }
+
+            mcx_config.flog = fopen(logfile_id_string_value.c_str(), "a+");
+
+            if (mcx_config.flog == NULL) {
+                throw py::value_error("Log output file can not be written");
             }
         }
     }
@@ -690,6 +1197,8 @@ void parse_config(const py::dict& user_cfg, mcconfig& mcx_config, tetmesh& mesh)
         mesh_initelem(&mesh, &mcx_config);
     }
 
+    mcx_config.profile[ppLoad] = GetTimeNanos() - tphase;
+
     // Flush the std::cout and std::cerr
     std::cout.flush();
     std::cerr.flush();
@@ -712,16 +1221,189 @@ inline void cleanup_mesh(mcconfig& mcx_config, tetmesh& mesh) {
 }
 
 
+/**
+ * Launch one simulation on a prepared mesh with the selected CPU or GPU backend
+ * @param mcx_config reference to the prepared mcconfig data structure
+ * @param mesh reference to the prepared mesh
+ * @param tracer reference to the prepared ray-tracer
+ * @param exception_msgs error messages raised by the simulation are appended here
+ */
+void run_simulation(mcconfig& mcx_config, tetmesh& mesh, raytracer& tracer, std::vector<std::string>& exception_msgs) {
+    int thread_id = 0;
+    unsigned long long trun = GetTimeNanos();
+
+    /** Enclose all simulation calls inside a try/catch construct for exception handling */
+    try {
+        mcx_config.profile[ppSimulation] = 0;
+
+        if (mcx_config.compute == cbSSE || mcx_config.gpuid > MAX_DEVICE) {
+            mmc_run_mp(&mcx_config, &mesh, &tracer);
+        }
+
+#ifdef USE_CUDA
+        else if (mcx_config.compute == cbCUDA && mcx_config.hybrid > 0.f) {
+            mmc_run_hybrid(&mcx_config, &mesh, &tracer, mmc_run_cu);
+        } else if (mcx_config.compute == cbCUDA) {
+            mmc_run_cu(&mcx_config, &mesh, &tracer);
+        }
+
+#endif
+#ifdef USE_OPENCL
+        else if (mcx_config.hybrid > 0.f) {
+            mmc_run_hybrid(&mcx_config, &mesh, &tracer, mmc_run_cl);
+        } else {
+            mmc_run_cl(&mcx_config, &mesh, &tracer);
+        }
+
+#endif
+
+        /*the GPU backends only report the whole run as the simulation phase*/
+        if (mcx_config.profile[ppSimulation] == 0) {
+            mcx_config.profile[ppSimulation] = GetTimeNanos() - trun;
+        }
+    } catch (const char* err) {
+        exception_msgs.push_back("Error from thread (" + std::to_string(thread_id) + "): " + err);
+    } catch (const std::exception& err) {
+        exception_msgs.push_back("C++ Error from thread (" + std::to_string(thread_id) + "): " + err.what());
+    } catch (...) {
+        exception_msgs.push_back("Unknown Exception from thread (" + std::to_string(thread_id) + ")");
+    }
+}
+
+/**
+ * Convert the outputs of a completed simulation to a dictionary; the output buffers are handed over to numpy
+ * @param mcx_config reference to the mcconfig data structure of the completed simulation
+ * @param mesh reference to the mesh holding the fluence and reflectance outputs
+ * @param dlpack the output mode of the 'dlpack' field, see TDLPackMode; flux, var, dref and detp are returned as DLPack capsules if non-zero
+ */
+py::dict collect_output(mcconfig& mcx_config, tetmesh& mesh, int dlpack) {
+    unsigned int hostdetreclen = mcx_detreclen(&mcx_config, mesh.prop);
+    size_t field_dim[5] = {0};
+    py::dict output;
+
+    if (mcx_config.debuglevel & MCX_DEBUG_MOVE) {
+        output["traj"] = wrap_output(mcx_config.exportdebugdata, {MCX_DEBUG_REC_LEN, mcx_config.debugdatalen});
+    }
+
+    if (mcx_config.issaveseed == 1) {
+        output["seeds"] = wrap_output(mcx_config.exportseed, {sizeof(RandType) * RAND_BUF_LEN, mcx_config.detectedcount});
+    }
+
+    // re-weight the detected photons for the property sets of pmcprop before handing them over
+    if (mcx_config.pmcsetnum > 0) {
+        mcx_config.exportpmc = (double*)calloc(sizeof(double), (size_t)mcx_config.pmcsetnum * mcx_config.detnum * (1 + 2 * mesh.prop));
+        mesh_pmcreweight(mcx_config.exportpmc, mcx_config.exportdetected, mcx_config.detectedcount, hostdetreclen, mcx_config.detnum,
+                         (mcx_config.method != rtBLBadouelGrid) ? mcx_config.unitinmm : 1.f,
+                         (mcx_config.convphoton > 0) ? mcx_config.convphoton : mcx_config.nphoton, &mcx_config, &mesh);
+        output["pmc"] = wrap_output(mcx_config.exportpmc, {(size_t)(1 + 2 * mesh.prop), (size_t)mcx_config.detnum, (size_t)mcx_config.pmcsetnum});
+    }
+
+    if (mcx_config.issavedet >= 1) {
+        if (mcx_config.issaveexit != 2) {
+            field_dim[0] = hostdetreclen;
+            field_dim[1] = mcx_config.detectedcount;
+            field_dim[2] = 0;
+            field_dim[3] = 0;
+
+            if (mcx_config.detectedcount > 0) {
+                output["detp"] = wrap_field(mcx_config.exportdetected, {field_dim[0], field_dim[1]}, dlpack);
+            }
+        } else {
+            field_dim[0] = mcx_config.detparam1.w;
+            field_dim[1] = mcx_config.detparam2.w;
+            field_dim[2] = mcx_config.maxgate;
+            field_dim[3] = 0;
+
+            if (field_dim[0] * field_dim[1] > 0) {
+                auto partial_path = py::array_t<float, py::array::f_style>(std::initializer_list<size_t>({field_dim[0], field_dim[1], field_dim[2]}));
+                memcpy(partial_path.mutable_data(), (mcx_config.exportdetimage) ? mcx_config.exportdetimage : mcx_config.exportdetected,
+                       field_dim[0] * field_dim[1] * field_dim[2] * sizeof(float));
+                output["detp"] = partial_path;
+            }
+        }
+
+        free(mcx_config.exportdetected);
+        mcx_config.exportdetected = NULL;
+
+        if (mcx_config.exportdetimage) {
+            free(mcx_config.exportdetimage);
+            mcx_config.exportdetimage = NULL;
+        }
+    }
+
+    if (mcx_config.issave2pt) {
+        size_t datalen = (mcx_config.method == rtBLBadouelGrid) ? mcx_config.crop0.z : ( (mcx_config.basisorder) ? mesh.nn : MESH_ELEMOUT(&mesh));
+        field_dim[0] = mcx_config.srcnum;
+        field_dim[1] = datalen;
+        field_dim[2] = mcx_config.maxgate * mcx_config.replaydetnum * mcx_config.wavenum + 2 * mcx_config.freqnum; // per-detector replay Jacobians, per-wavelength or frequency-domain outputs follow one another along the time dimension
+        field_dim[3] = 0;
+        field_dim[4] = 0;
+
+        std::vector<size_t> array_dims;
+
+        if (mcx_config.method == rtBLBadouelGrid) {
+            field_dim[0] = mcx_config.srcnum;
+            field_dim[1] = mcx_config.dim.x;
+            field_dim[2] = mcx_config.dim.y;
+            field_dim[3] = mcx_config.dim.z;
+            field_dim[4] = mcx_config.maxgate * mcx_config.replaydetnum + 2 * mcx_config.freqnum;
+
+            if (mcx_config.srcnum > 1) {
+                array_dims = {field_dim[0], field_dim[1], field_dim[2], field_dim[3], field_dim[4]};
+            } else {
+                array_dims = {field_dim[1], field_dim[2], field_dim[3], field_dim[4]};
+            }
+        } else {
+            if (mcx_config.srcnum > 1) {
+                array_dims = {field_dim[0], field_dim[1], field_dim[2]};
+            } else {
+                array_dims = {field_dim[1], field_dim[2]};
+            }
+        }
+
+        output["flux"] = wrap_field(mesh.weight, array_dims, dlpack);
+
+        if (mesh.weightvar) {
+            array_dims.back() = mcx_config.maxgate;
+            output["var"] = wrap_field(mesh.weightvar, array_dims, dlpack);
+        }
+
+        if (mcx_config.issaveref) {
+            field_dim[1] = mesh.nf;
+            field_dim[2] = mcx_config.maxgate;
+            output["dref"] = wrap_field(mesh.dref, {field_dim[1], field_dim[2]}, dlpack);
+        }
+    }
+
+    if (mcx_config.convtarget > 0.f) {
+        output["convphoton"] = mcx_config.convphoton;
+        output["convrse"] = mcx_config.convrse;
+    } else if (MMC_CANCELLED(&mcx_config)) {
+        output["convphoton"] = mcx_config.convphoton;
+    }
+
+    if (mcx_config.isheatmap && mcx_config.exportheatmap) {
+        output["heatmap"] = wrap_field(mcx_config.exportheatmap, {(size_t)mesh.ne, (size_t)hmCounterNum}, dlpack);
+    }
+
+    if (mcx_config.issaveprofile) {
+        char* jsonstr = mcx_profilejson(&mcx_config);
+        output["profile"] = py::module_::import("json").attr("loads")(std::string(jsonstr));
+        free(jsonstr);
+    }
+
+    return output;
+}
+
 py::dict pmmc_interface(const py::dict& user_cfg) {
-    unsigned int hostdetreclen;
     mcconfig mcx_config;  /* mcx_config: structure to store all simulation parameters */
     tetmesh mesh;
     raytracer tracer = {NULL, 0, NULL, NULL, NULL};
     GPUInfo* gpu_info = nullptr;        /** gpuInfo: structure to store GPU information */
     unsigned int active_dev = 0;     /** activeDev: count of total active GPUs to be used */
     std::vector<std::string> exception_msgs;
-    int thread_id = 0;
-    size_t field_dim[5] = {0};
+    int dlpack = dlpNone;
+    py::dict hostcfg;
     py::dict output;
 
     try {
@@ -729,8 +1411,10 @@ py::dict pmmc_interface(const py::dict& user_cfg) {
          * To start an MCX simulation, we first create a simulation configuration and set all elements to its default settings.
          */
         det_ps = nullptr;
+        dlpack = parse_dlpack_mode(user_cfg);
 
-        parse_config(user_cfg, mcx_config, mesh);
+        hostcfg = host_fields(user_cfg);  // keeps the host copies of device arrays, such as detphotons, alive during the run
+        parse_config(hostcfg, mcx_config, mesh);
 
         if (mcx_config.compute == cbCUDA) {
 #ifdef USE_CUDA
@@ -753,188 +1437,230 @@ py::dict pmmc_interface(const py::dict& user_cfg) {
         mmc_validate_config(&mcx_config, det_ps, dim_det_ps, seed_byte);
         mesh_validate(&mesh, &mcx_config);
 
-        hostdetreclen = (2 + ((mcx_config.ismomentum) > 0)) * mesh.prop + (mcx_config.issaveexit > 0) * 6 + 2;
-
         /** One must define the domain and properties */
         if (mesh.node == nullptr || mesh.prop == 0) {
             throw py::value_error("You must define 'node' and 'prop' field.");
         }
 
-#if defined(MMC_LOGISTIC) || defined(MMC_SFMT)
-        mcx_config.issaveseed = 0;
-#endif
+        if (mcx_config.debuglevel & MCX_DEBUG_MOVE) {
+            mcx_config.exportdebugdata = (float*)malloc(mcx_config.maxjumpdebug * sizeof(float) * MCX_DEBUG_REC_LEN);
+            mcx_config.debuglevel |= dlTraj;
+        }
+
+        /** Release the GIL while preprocessing and simulating, so that other Python threads can run their own sessions */
+        {
+            py::gil_scoped_release release;
 
-        if (mcx_config.issavedet >= 1) {
-            mcx_config.exportdetected = (float*) malloc(hostdetreclen * mcx_config.maxdetphoton * sizeof(float));
+            mesh_srcdetelem(&mesh, &mcx_config);
+
+            if (mcx_config.isgpuinfo == 0) {
+                mmc_prep(&mcx_config, &mesh, &tracer);
+            }
+
+            run_simulation(mcx_config, mesh, tracer, exception_msgs);
+
+            tracer_clear(&tracer);
         }
 
-        if (mcx_config.issaveseed == 1) {
-            mcx_config.photonseed = malloc(mcx_config.maxdetphoton * sizeof(float) * RAND_BUF_LEN);
+        /** If error is detected, gracefully terminate the mex and return back to Python */
+        if (!exception_msgs.empty()) {
+            throw py::runtime_error("PMMC terminated due to an exception!");
         }
 
-        if (mcx_config.debuglevel & MCX_DEBUG_MOVE) {
-            mcx_config.exportdebugdata = (float*)malloc(mcx_config.maxjumpdebug * sizeof(float) * MCX_DEBUG_REC_LEN);
-            mcx_config.debuglevel |= dlTraj;
+        output = collect_output(mcx_config, mesh, dlpack);
+    } catch (const char* err) {
+        cleanup_configs(gpu_info, mcx_config);
+        throw py::runtime_error(err);
+    } catch (const py::type_error& err) {
+        cleanup_configs(gpu_info, mcx_config);
+        throw err;
+    } catch (const py::value_error& err) {
+        cleanup_configs(gpu_info, mcx_config);
+        throw err;
+    } catch (const py::runtime_error& err) {
+        cleanup_configs(gpu_info, mcx_config);
+        std::string error_msg = err.what();
+
+        for (const auto& m : exception_msgs) {
+            error_msg += (m + "\n");
         }
 
-        mesh_srcdetelem(&mesh, &mcx_config);
+        throw py::runtime_error(error_msg);
+    } catch (const std::exception& err) {
+        cleanup_configs(gpu_info, mcx_config);
+        throw py::runtime_error(std::string("C++ Error: ") + err.what());
+    } catch (...) {
+        cleanup_configs(gpu_info, mcx_config);
+        throw py::runtime_error("Unknown exception occurred");
+    }
+
+    /** Clear up simulation data structures by calling the destructors */
+    cleanup_mesh(mcx_config, mesh);
+    // return the MCX output dictionary
+    return output;
+}
 
-        if (mcx_config.isgpuinfo == 0) {
-            mmc_prep(&mcx_config, &mesh, &tracer);
+
+/**
+ * Apply the settings of one batch job to a session whose mesh has been prepared
+ * @param job a dictionary holding the fields that differ from the base configuration
+ * @param mcx_config reference to the mcconfig data structure of the session
+ * @param mesh reference to the prepared mesh
+ * @param med receives the optical properties of the job if it defines 'prop'
+ * @return true if the job redefines the optical properties
+ */
+bool parse_job(const py::dict& job, mcconfig& mcx_config, const tetmesh& mesh, std::vector<medium>& med) {
+    const std::vector<std::string> jobfields = {"nphoton", "seed", "srcpos", "srcdir", "srcparam1", "srcparam2", "detpos", "prop"};
+
+    for (auto item : job) {
+        std::string key = py::str(item.first);
+
+        if (std::find(jobfields.begin(), jobfields.end(), key) == jobfields.end()) {
+            throw py::value_error("a batch job can only change nphoton, seed, srcpos, srcdir, srcparam1, srcparam2, detpos and prop, but '" + key + "' is given");
         }
+    }
 
-        /** Enclose all simulation calls inside a try/catch construct for exception handling */
-        try {
+    GET_SCALAR_FIELD(job, mcx_config, nphoton, py::int_);
+    GET_VEC3_FIELD(job, mcx_config, srcpos, float);
+    GET_VEC34_FIELD(job, mcx_config, srcdir, float);
+    GET_VEC4_FIELD(job, mcx_config, srcparam1, float);
+    GET_VEC4_FIELD(job, mcx_config, srcparam2, float);
 
-            if (mcx_config.compute == cbSSE || mcx_config.gpuid > MAX_DEVICE) {
-                mmc_run_mp(&mcx_config, &mesh, &tracer);
-            }
+    if (job.contains("seed")) {
+        if (!py::int_::check_(job["seed"])) {
+            throw py::value_error("the seed of a batch job must be an integer");
+        }
 
-#ifdef USE_CUDA
-            else if (mcx_config.compute == cbCUDA) {
-                mmc_run_cu(&mcx_config, &mesh, &tracer);
-            }
+        mcx_config.seed = py::int_(job["seed"]);
+    }
 
-#endif
-#ifdef USE_OPENCL
-            else {
-                mmc_run_cl(&mcx_config, &mesh, &tracer);
-            }
+    if (job.contains("detpos")) {
+        parse_detpos(job["detpos"], mcx_config);
+    }
 
-#endif
-        } catch (const char* err) {
-            exception_msgs.push_back("Error from thread (" + std::to_string(thread_id) + "): " + err);
-        } catch (const std::exception& err) {
-            exception_msgs.push_back("C++ Error from thread (" + std::to_string(thread_id) + "): " + err.what());
-        } catch (...) {
-            exception_msgs.push_back("Unknown Exception from thread (" + std::to_string(thread_id) + ")");
+    if (job.contains("prop")) {
+        auto volume = get_array_field<float>(job["prop"]);
+
+        if (!volume) {
+            throw py::value_error("Invalid prop field format");
         }
 
+        auto buffer_info = volume.request();
 
-        tracer_clear(&tracer);
+        if (buffer_info.shape.size() != 2 || buffer_info.shape.at(1) != 4 || buffer_info.shape.at(0) != mesh.prop + 1) {
+            throw py::value_error("the 'prop' field of a batch job must have the same number of media as the base configuration and 4 columns (mua,mus,g,n)");
+        }
 
-        /** If error is detected, gracefully terminate the mex and return back to Python */
-        if (!exception_msgs.empty()) {
-            throw py::runtime_error("PMMC terminated due to an exception!");
+        med.resize(mesh.prop + 1);
+        copy_rowmajor((float*)med.data(), volume, mesh.prop + 1, 4);
+        return true;
+    }
+
+    return false;
+}
+
+/**
+ * Run a list of jobs on one mesh: the mesh is validated and prepared once from the base configuration,
+ * then each job only updates its source, detectors, optical properties or photon count and is simulated
+ * @param user_cfg the base configuration, including the mesh
+ * @param jobs a list of dictionaries, each holding the fields that differ from the base configuration
+ * @return a list of output dictionaries, one per job
+ */
+py::list pmmc_runbatch(const py::dict& user_cfg, const py::list& jobs) {
+    mcconfig mcx_config;  /* mcx_config: structure to store all simulation parameters */
+    tetmesh mesh;
+    raytracer tracer = {NULL, 0, NULL, NULL, NULL};
+    GPUInfo* gpu_info = nullptr;        /** gpuInfo: structure to store GPU information */
+    unsigned int active_dev = 0;     /** activeDev: count of total active GPUs to be used */
+    std::vector<std::string> exception_msgs;
+    std::vector<medium> med;
+    int dlpack = dlpNone;
+    py::dict hostcfg;
+    py::list output;
+
+    try {
+        det_ps = nullptr;
+        dlpack = parse_dlpack_mode(user_cfg);
+
+        hostcfg = host_fields(user_cfg);  // keeps the host copies of device arrays, such as detphotons, alive during the run
+        parse_config(hostcfg, mcx_config, mesh);
+
+        if (mcx_config.compute == cbCUDA) {
+#ifdef USE_CUDA
+            mcx_list_cu_gpu(&mcx_config, &active_dev, NULL, &gpu_info);
+#endif
+        } else {
+#ifdef USE_OPENCL
+            mcx_list_cl_gpu(&mcx_config, &active_dev, NULL, &gpu_info);
+#endif
         }
 
-        if (mcx_config.debuglevel & MCX_DEBUG_MOVE) {
-            field_dim[0] = MCX_DEBUG_REC_LEN;
-            field_dim[1] = mcx_config.debugdatalen; // his.savedphoton is for one repetition, should correct
-            field_dim[2] = 0;
-            field_dim[3] = 0;
-            auto photon_traj_data = py::array_t<float, py::array::f_style>({field_dim[0], field_dim[1]});
+        if (!active_dev) {
+            mcx_error(-1, "No GPU device found\n", __FILE__, __LINE__);
+        }
 
-            if (mcx_config.debuglevel & MCX_DEBUG_MOVE) {
-                memcpy(photon_traj_data.mutable_data(), mcx_config.exportdebugdata, field_dim[0] * field_dim[1] * sizeof(float));
-            }
+        mcx_python_flush();
 
-            if (mcx_config.exportdebugdata) {
-                free(mcx_config.exportdebugdata);
-            }
+        mmc_validate_config(&mcx_config, det_ps, dim_det_ps, seed_byte);
+        mesh_validate(&mesh, &mcx_config);
 
-            mcx_config.exportdebugdata = nullptr;
-            output["traj"] = photon_traj_data;
+        if (mesh.node == nullptr || mesh.prop == 0) {
+            throw py::value_error("You must define 'node' and 'prop' field.");
         }
 
-        if (mcx_config.issaveseed == 1) {
-            field_dim[0] = (mcx_config.issaveseed > 0) * RAND_BUF_LEN * sizeof(float);
-            field_dim[1] = mcx_config.detectedcount; // his.savedphoton is for one repetition, should correct
-            field_dim[2] = 0;
-            field_dim[3] = 0;
-            auto detected_seeds = py::array_t<uint8_t, py::array::f_style>({field_dim[0], field_dim[1]});
-            memcpy(detected_seeds.mutable_data(), mcx_config.photonseed, field_dim[0] * field_dim[1]);
-            free(mcx_config.photonseed);
-            mcx_config.photonseed = nullptr;
-            output["seeds"] = detected_seeds;
-        }
-
-        if (mcx_config.issavedet >= 1) {
-            if (mcx_config.issaveexit != 2) {
-                field_dim[0] = hostdetreclen;
-                field_dim[1] = mcx_config.detectedcount;
-                field_dim[2] = 0;
-                field_dim[3] = 0;
-
-                if (mcx_config.detectedcount > 0) {
-                    auto partial_path = py::array_t<float, py::array::f_style>(std::initializer_list<size_t>({field_dim[0], mcx_config.detectedcount}));
-                    memcpy(partial_path.mutable_data(), mcx_config.exportdetected,
-                           field_dim[0] * field_dim[1] * sizeof(float));
-                    output["detp"] = partial_path;
-                }
-            } else {
-                field_dim[0] = mcx_config.detparam1.w;
-                field_dim[1] = mcx_config.detparam2.w;
-                field_dim[2] = mcx_config.maxgate;
-                field_dim[3] = 0;
-
-                if (field_dim[0] * field_dim[1] > 0) {
-                    auto partial_path = py::array_t<float, py::array::f_style>(std::initializer_list<size_t>({field_dim[0], field_dim[1], field_dim[2]}));
-                    memcpy(partial_path.mutable_data(), mcx_config.exportdetected,
-                           field_dim[0] * field_dim[1] * field_dim[2] * sizeof(float));
-                    output["detp"] = partial_path;
-                }
-            }
+        if (mcx_config.seed == SEED_FROM_FILE) {
+            throw py::value_error("photon replay is not supported in batch runs");
+        }
 
-            free(mcx_config.exportdetected);
-            mcx_config.exportdetected = NULL;
+        if (mcx_config.debuglevel & MCX_DEBUG_MOVE) {
+            mcx_config.debuglevel |= dlTraj;
         }
 
-        if (mcx_config.issave2pt) {
-            size_t datalen = (mcx_config.method == rtBLBadouelGrid) ? mcx_config.crop0.z : ( (mcx_config.basisorder) ? mesh.nn : mesh.ne);
-            field_dim[0] = mcx_config.srcnum;
-            field_dim[1] = datalen;
-            field_dim[2] = mcx_config.maxgate;
-            field_dim[3] = 0;
-            field_dim[4] = 0;
-
-            std::vector<size_t> array_dims;
-
-            if (mcx_config.method == rtBLBadouelGrid) {
-                field_dim[0] = mcx_config.srcnum;
-                field_dim[1] = mcx_config.dim.x;
-                field_dim[2] = mcx_config.dim.y;
-                field_dim[3] = mcx_config.dim.z;
-                field_dim[4] = mcx_config.maxgate;
-
-                if (mcx_config.srcnum > 1) {
-                    array_dims = {field_dim[0], field_dim[1], field_dim[2], field_dim[3], field_dim[4]};
-                } else {
-                    array_dims = {field_dim[1], field_dim[2], field_dim[3], field_dim[4]};
-                }
-            } else {
-                if (mcx_config.srcnum > 1) {
-                    array_dims = {field_dim[0], field_dim[1], field_dim[2]};
-                } else {
-                    array_dims = {field_dim[1], field_dim[2]};
-                }
+        {
+            py::gil_scoped_release release;
+
+            mesh_srcdetelem(&mesh, &mcx_config);
+            mmc_prep(&mcx_config, &mesh, &tracer);
+        }
+
+        for (size_t i = 0; i < jobs.size(); i++) {
+            bool hasprop = parse_job(host_fields(jobs[i].cast<py::dict>()), mcx_config, mesh, med);
+
+            if ((mcx_config.debuglevel & MCX_DEBUG_MOVE) && mcx_config.exportdebugdata == NULL) {
+                mcx_config.exportdebugdata = (float*)malloc(mcx_config.maxjumpdebug * sizeof(float) * MCX_DEBUG_REC_LEN);
             }
 
-            auto data = py::array_t<double, py::array::f_style>(array_dims);
-            memcpy(data.mutable_data(), mesh.weight, data.size() * sizeof(double));
-            output["flux"] = data;
+            mcx_python_flush();
 
-            if (mcx_config.issaveref) {
-                field_dim[1] = mesh.nf;
-                field_dim[2] = mcx_config.maxgate;
-                array_dims = {field_dim[1], field_dim[2]};
-                auto dref_array = py::array_t<double, py::array::f_style>(array_dims);
-                auto* dref = static_cast<double*>(dref_array.mutable_data());
-                memcpy(dref, mesh.dref, dref_array.size() * sizeof(double));
+            {
+                py::gil_scoped_release release;
+
+                mmc_prep_next(&mcx_config, &mesh, &tracer, hasprop ? med.data() : NULL);
+                run_simulation(mcx_config, mesh, tracer, exception_msgs);
+            }
 
-                output["dref"] = dref_array;
+            if (!exception_msgs.empty()) {
+                throw py::runtime_error("PMMC terminated due to an exception in batch job #" + std::to_string(i + 1) + "!");
             }
+
+            output.append(collect_output(mcx_config, mesh, dlpack));
         }
+
+        tracer_clear(&tracer);
     } catch (const char* err) {
+        tracer_clear(&tracer);
         cleanup_configs(gpu_info, mcx_config);
         throw py::runtime_error(err);
     } catch (const py::type_error& err) {
+        tracer_clear(&tracer);
         cleanup_configs(gpu_info, mcx_config);
         throw err;
     } catch (const py::value_error& err) {
+        tracer_clear(&tracer);
         cleanup_configs(gpu_info, mcx_config);
         throw err;
     } catch (const py::runtime_error& err) {
+        tracer_clear(&tracer);
         cleanup_configs(gpu_info, mcx_config);
         std::string error_msg = err.what();
 
@@ -944,20 +1670,236 @@ py::dict pmmc_interface(const py::dict& user_cfg) {
 
         throw py::runtime_error(error_msg);
     } catch (const std::exception& err) {
+        tracer_clear(&tracer);
         cleanup_configs(gpu_info, mcx_config);
         throw py::runtime_error(std::string("C++ Error: ") + err.what());
     } catch (...) {
+        tracer_clear(&tracer);
         cleanup_configs(gpu_info, mcx_config);
         throw py::runtime_error("Unknown exception occurred");
     }
 
-    /** Clear up simulation data structures by calling the destructors */
     cleanup_mesh(mcx_config, mesh);
-    // return the MCX output dictionary
     return output;
 }
 
 
+/**
+ * The state of a simulation submitted by pmmc.runasync, shared by the RunHandle returned to Python and its
+ * worker thread; the worker only touches the C structures, all Python objects are used while holding the GIL
+ */
+struct PMMCJob {
+    mcconfig mcx_config;                            /**< the simulation settings, progressfun/cancelflag point back to this job */
+    tetmesh mesh;                                   /**< the mesh of the simulation */
+    raytracer tracer = {NULL, 0, NULL, NULL, NULL}; /**< the ray-tracer precomputed data */
+    GPUInfo* gpu_info = nullptr;                    /**< GPU information */
+    std::vector<std::string> exception_msgs;        /**< errors raised in the worker thread */
+    int dlpack = dlpNone;                           /**< the output mode of the 'dlpack' field */
+    py::dict hostcfg;                               /**< keeps the host copies of the input arrays alive during the run */
+    py::object callback;                            /**< the progress callback, or None */
+    std::thread worker;                             /**< the thread running the preparation and the simulation */
+    std::mutex lock;                                /**< guards isdone */
+    std::condition_variable finished;               /**< notified when the worker ends */
+    bool isdone = false;                            /**< true once the worker has ended */
+    bool iscollected = false;                       /**< true once the outputs are handed over to Python, or released */
+    volatile int cancel = 0;                        /**< set by cancel(), polled by the simulation through mcx_config.cancelflag */
+    volatile float progress = 0.f;                  /**< the last completed fraction reported by the simulation */
+    float reported = -1.f;                          /**< the last fraction passed to the callback */
+    py::dict output;                                /**< the output dictionary, once collected */
+
+    ~PMMCJob() {
+        cancel = 1;
+
+        if (worker.joinable()) {
+            py::gil_scoped_release release;
+            worker.join();
+        }
+
+        release();
+    }
+
+    /** Free the simulation data structures unless the outputs are already handed over */
+    void release() {
+        if (iscollected) {
+            return;
+        }
+
+        iscollected = true;
+
+        if (exception_msgs.empty()) {
+            mcx_cleargpuinfo(&gpu_info);
+            cleanup_mesh(mcx_config, mesh);
+        } else {
+            cleanup_configs(gpu_info, mcx_config);
+        }
+    }
+};
+
+/**
+ * Progress hook of a simulation submitted by pmmc.runasync, see mcx_reportprogress; it runs in a simulation thread,
+ * so the Python callback is called with the GIL acquired, at most once per percent
+ * @param data the PMMCJob of the simulation
+ * @param percent the completed fraction of the run
+ */
+extern "C" void pmmc_progress(void* data, float percent) {
+    PMMCJob* job = (PMMCJob*)data;
+
+    job->progress = percent;
+
+    if (job->callback.is_none() || (percent - job->reported < 0.01f && percent < 1.f) || percent == job->reported) {
+        return;
+    }
+
+    job->reported = percent;
+
+    py::gil_scoped_acquire acquire;
+
+    try {
+        job->callback(percent);
+    } catch (py::error_already_set& err) {
+        err.discard_as_unraisable("pmmc progress callback");
+    }
+}
+
+/**
+ * Submit a simulation without waiting for it: the configuration is parsed and validated in the calling thread, then
+ * the mesh is prepared and the photons are simulated in a worker thread while the caller continues
+ * @param user_cfg the simulation configuration, same as pmmc.run
+ * @param callback if not None, called from the simulation with the completed fraction (0-1) of the run
+ * @return a RunHandle to poll, cancel or wait for the simulation
+ */
+std::shared_ptr<PMMCJob> pmmc_runasync(const py::dict& user_cfg, const py::object& callback) {
+    std::shared_ptr<PMMCJob> job = std::make_shared<PMMCJob>();
+    PMMCJob* jp = job.get();
+    mcconfig& mcx_config = job->mcx_config;
+    tetmesh& mesh = job->mesh;
+    unsigned int active_dev = 0;
+
+    try {
+        det_ps = nullptr;
+        job->dlpack = parse_dlpack_mode(user_cfg);
+        job->hostcfg = host_fields(user_cfg);
+        parse_config(job->hostcfg, mcx_config, mesh);
+
+        if (mcx_config.compute == cbCUDA) {
+#ifdef USE_CUDA
+            mcx_list_cu_gpu(&mcx_config, &active_dev, NULL, &job->gpu_info);
+#endif
+        } else {
+#ifdef USE_OPENCL
+            mcx_list_cl_gpu(&mcx_config, &active_dev, NULL, &job->gpu_info);
+#endif
+        }
+
+        if (!active_dev) {
+            mcx_error(-1, "No GPU device found\n", __FILE__, __LINE__);
+        }
+
+        mcx_python_flush();
+
+        mmc_validate_config(&mcx_config, det_ps, dim_det_ps, seed_byte);
+        mesh_validate(&mesh, &mcx_config);
+
+        if (mesh.node == nullptr || mesh.prop == 0) {
+            throw py::value_error("You must define 'node' and 'prop' field.");
+        }
+
+        if (mcx_config.debuglevel & MCX_DEBUG_MOVE) {
+            mcx_config.exportdebugdata = (float*)malloc(mcx_config.maxjumpdebug * sizeof(float) * MCX_DEBUG_REC_LEN);
+            mcx_config.debuglevel |= dlTraj;
+        }
+    } catch (const char* err) {
+        job->iscollected = true;
+        cleanup_configs(job->gpu_info, mcx_config);
+        throw py::runtime_error(err);
+    } catch (...) {
+        job->iscollected = true;
+        cleanup_configs(job->gpu_info, mcx_config);
+        throw;
+    }
+
+    job->callback = callback;
+    mcx_config.progressfun = pmmc_progress;
+    mcx_config.progressdata = jp;
+    mcx_config.cancelflag = &jp->cancel;
+
+    job->worker = std::thread([jp]() {
+        try {
+            mesh_srcdetelem(&jp->mesh, &jp->mcx_config);
+
+            if (jp->mcx_config.isgpuinfo == 0) {
+                mmc_prep(&jp->mcx_config, &jp->mesh, &jp->tracer);
+            }
+
+            run_simulation(jp->mcx_config, jp->mesh, jp->tracer, jp->exception_msgs);
+        } catch (const char* err) {
+            jp->exception_msgs.push_back(std::string("Error: ") + err);
+        } catch (const std::exception& err) {
+            jp->exception_msgs.push_back(std::string("C++ Error: ") + err.what());
+        } catch (...) {
+            jp->exception_msgs.push_back("Unknown exception occurred");
+        }
+
+        tracer_clear(&jp->tracer);
+
+        std::lock_guard<std::mutex> guard(jp->lock);
+        jp->isdone = true;
+        jp->finished.notify_all();
+    });
+
+    return job;
+}
+
+/**
+ * Wait for a simulation submitted by pmmc.runasync and return its outputs, same as pmmc.run
+ * @param job the RunHandle of the simulation
+ * @param timeout if not None, the longest wait in seconds, a TimeoutError is raised if the run is not done by then
+ * @return the output dictionary; a cancelled run returns the output of the launched photons, see 'convphoton'
+ */
+py::dict pmmc_result(PMMCJob& job, const py::object& timeout) {
+    bool isdone = true;
+    bool forever = timeout.is_none();
+    double seconds = forever ? 0.0 : timeout.cast<double>();
+
+    {
+        py::gil_scoped_release release;
+        std::unique_lock<std::mutex> guard(job.lock);
+
+        if (forever) {
+            job.finished.wait(guard, [&job] {return job.isdone;});
+        } else {
+            isdone = job.finished.wait_for(guard, std::chrono::duration<double>(seconds), [&job] {return job.isdone;});
+        }
+    }
+
+    if (!isdone) {
+        PyErr_SetString(PyExc_TimeoutError, "the simulation is still running");
+        throw py::error_already_set();
+    }
+
+    if (job.worker.joinable()) {
+        job.worker.join();
+    }
+
+    if (!job.exception_msgs.empty()) {
+        std::string error_msg = "PMMC terminated due to an exception!";
+
+        for (const auto& m : job.exception_msgs) {
+            error_msg += (m + "\n");
+        }
+
+        job.release();
+        throw py::runtime_error(error_msg);
+    }
+
+    if (!job.iscollected) {
+        job.output = collect_output(job.mcx_config, job.mesh, job.dlpack);
+        job.release();
+    }
+
+    return job.output;
+}
+
 /**
  * @brief Error reporting function in PMMC, equivalent to mcx_error in binary mode
  *
@@ -1057,6 +1999,25 @@ PYBIND11_MODULE(_pmmc, m) {
           py::scoped_estream_redirect>());
     m.def("run", &pmmc_interface_wargs, "Runs MCX with the given config.", py::call_guard<py::scoped_ostream_redirect,
           py::scoped_estream_redirect>());
+    m.def("runbatch", &pmmc_runbatch, "Runs a list of jobs that share the mesh of the given base config.", py::arg("cfg"), py::arg("jobs"),
+          py::call_guard<py::scoped_ostream_redirect, py::scoped_estream_redirect>());
+    m.def("runasync", &pmmc_runasync, "Starts a simulation in the background and returns a RunHandle without waiting for it.",
+          py::arg("cfg"), py::arg("progress") = py::none(), py::call_guard<py::scoped_ostream_redirect, py::scoped_estream_redirect>());
+    py::class_<PMMCJob, std::shared_ptr<PMMCJob>>(m, "RunHandle", "The handle of a simulation started by runasync; dropping it cancels the simulation.")
+            .def("done", [](PMMCJob & job) {
+        std::lock_guard<std::mutex> guard(job.lock);
+        return job.isdone;
+    }, "Returns True once the simulation has ended.")
+    .def("progress", [](PMMCJob & job) {
+        return (float)job.progress;
+    }, "Returns the completed fraction (0-1) of the simulation.")
+    .def("cancel", [](PMMCJob & job) {
+        job.cancel = 1;
+    }, "Stops launching photons; result() then returns the output of the photons launched so far, normalized by their weight.")
+    .def("cancelled", [](PMMCJob & job) {
+        return job.cancel != 0;
+    }, "Returns True if cancel() was called.")
+    .def("result", &pmmc_result, "Waits for the simulation and returns its output dictionary, same as run().", py::arg("timeout") = py::none());
     m.def("gpuinfo",
           &get_GPU_info,
           "Prints out the list of CUDA-capable devices attached to this system.",
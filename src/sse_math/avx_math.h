@@ -0,0 +1,201 @@
+/* AVX2 implementation of log and sincos, 8 floats at a time
+
+   This is a lane-by-lane port of log_ps and sincos_ps in sse_math.h: the
+   same cephes polynomials are evaluated with the same sequence of
+   operations (and without FMA contraction), so that each lane returns a
+   result that is bitwise identical to the SSE2 version. Only the vector
+   width is doubled.
+
+   The functions work on arrays rather than on __m256 arguments so that
+   they can be called from translation units compiled without -mavx2; the
+   caller must check mmc_has_avx2() at runtime before calling them.
+
+   Derived from sse_math.h, Copyright (C) 2007  Julien Pommier, zlib license
+*/
+
+#ifndef _MMC_AVX_MATH_H
+#define _MMC_AVX_MATH_H
+
+#if !defined(__EMSCRIPTEN__) && !defined(MMC_SIMD_PORTABLE) && (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+
+#define MMC_USE_AVX_MATH
+
+#include <immintrin.h>
+
+/* return 1 if the running CPU supports AVX2, tested only once */
+static inline int mmc_has_avx2(void) {
+    static int hasavx2 = -1;
+
+    if (hasavx2 < 0) {
+        __builtin_cpu_init();
+        hasavx2 = (__builtin_cpu_supports("avx2") != 0);
+    }
+
+    return hasavx2;
+}
+
+/* natural logarithm of n (a multiple of 8) floats, NaN for x <= 0 */
+__attribute__((target("avx2")))
+static void log256_ps_block(const float* in, float* out, int n) {
+    const __m256 one = _mm256_set1_ps(1.0f), half = _mm256_set1_ps(0.5f);
+    int i;
+
+    for (i = 0; i < n; i += 8) {
+        __m256 x = _mm256_loadu_ps(in + i);
+        __m256 invalid_mask = _mm256_cmp_ps(x, _mm256_setzero_ps(), _CMP_LE_OS);
+        __m256i emm0;
+        __m256 e, mask, tmp, z, y;
+
+        x = _mm256_max_ps(x, _mm256_castsi256_ps(_mm256_set1_epi32(0x00800000)));  /* cut off denormalized stuff */
+        emm0 = _mm256_srli_epi32(_mm256_castps_si256(x), 23);
+
+        /* keep only the fractional part */
+        x = _mm256_and_ps(x, _mm256_castsi256_ps(_mm256_set1_epi32(~0x7f800000)));
+        x = _mm256_or_ps(x, half);
+
+        emm0 = _mm256_sub_epi32(emm0, _mm256_set1_epi32(0x7f));
+        e = _mm256_cvtepi32_ps(emm0);
+        e = _mm256_add_ps(e, one);
+
+        mask = _mm256_cmp_ps(x, _mm256_set1_ps(0.707106781186547524), _CMP_LT_OS);
+        tmp = _mm256_and_ps(x, mask);
+        x = _mm256_sub_ps(x, one);
+        e = _mm256_sub_ps(e, _mm256_and_ps(one, mask));
+        x = _mm256_add_ps(x, tmp);
+
+        z = _mm256_mul_ps(x, x);
+
+        y = _mm256_set1_ps(7.0376836292E-2);
+        y = _mm256_mul_ps(y, x);
+        y = _mm256_add_ps(y, _mm256_set1_ps(- 1.1514610310E-1));
+        y = _mm256_mul_ps(y, x);
+        y = _mm256_add_ps(y, _mm256_set1_ps(1.1676998740E-1));
+        y = _mm256_mul_ps(y, x);
+        y = _mm256_add_ps(y, _mm256_set1_ps(- 1.2420140846E-1));
+        y = _mm256_mul_ps(y, x);
+        y = _mm256_add_ps(y, _mm256_set1_ps(+ 1.4249322787E-1));
+        y = _mm256_mul_ps(y, x);
+        y = _mm256_add_ps(y, _mm256_set1_ps(- 1.6668057665E-1));
+        y = _mm256_mul_ps(y, x);
+        y = _mm256_add_ps(y, _mm256_set1_ps(+ 2.0000714765E-1));
+        y = _mm256_mul_ps(y, x);
+        y = _mm256_add_ps(y, _mm256_set1_ps(- 2.4999993993E-1));
+        y = _mm256_mul_ps(y, x);
+        y = _mm256_add_ps(y, _mm256_set1_ps(+ 3.3333331174E-1));
+        y = _mm256_mul_ps(y, x);
+
+        y = _mm256_mul_ps(y, z);
+
+        tmp = _mm256_mul_ps(e, _mm256_set1_ps(-2.12194440e-4));
+        y = _mm256_add_ps(y, tmp);
+
+        tmp = _mm256_mul_ps(z, half);
+        y = _mm256_sub_ps(y, tmp);
+
+        tmp = _mm256_mul_ps(e, _mm256_set1_ps(0.693359375));
+        x = _mm256_add_ps(x, y);
+        x = _mm256_add_ps(x, tmp);
+        x = _mm256_or_ps(x, invalid_mask); /* negative arg will be NAN */
+        _mm256_storeu_ps(out + i, x);
+    }
+}
+
+/* sine and cosine of n (a multiple of 8) floats */
+__attribute__((target("avx2")))
+static void sincos256_ps_block(const float* in, float* s, float* c, int n) {
+    const __m256i pi32_1 = _mm256_set1_epi32(1), pi32_2 = _mm256_set1_epi32(2), pi32_4 = _mm256_set1_epi32(4);
+    const __m256 one = _mm256_set1_ps(1.0f);
+    int i;
+
+    for (i = 0; i < n; i += 8) {
+        __m256 x = _mm256_loadu_ps(in + i);
+        __m256 xmm1, xmm2, xmm3, sign_bit_sin, y, swap_sign_bit_sin, poly_mask, sign_bit_cos, z, tmp, y2, ysin1, ysin2;
+        __m256i emm0, emm2, emm4;
+
+        sign_bit_sin = x;
+        /* take the absolute value */
+        x = _mm256_and_ps(x, _mm256_castsi256_ps(_mm256_set1_epi32(~0x80000000)));
+        /* extract the sign bit (upper one) */
+        sign_bit_sin = _mm256_and_ps(sign_bit_sin, _mm256_castsi256_ps(_mm256_set1_epi32(0x80000000)));
+
+        /* scale by 4/Pi */
+        y = _mm256_mul_ps(x, _mm256_set1_ps(1.27323954473516));
+
+        /* store the integer part of y in emm2 */
+        emm2 = _mm256_cvttps_epi32(y);
+
+        /* j=(j+1) & (~1) (see the cephes sources) */
+        emm2 = _mm256_add_epi32(emm2, pi32_1);
+        emm2 = _mm256_and_si256(emm2, _mm256_set1_epi32(~1));
+        y = _mm256_cvtepi32_ps(emm2);
+
+        emm4 = emm2;
+
+        /* get the swap sign flag for the sine */
+        emm0 = _mm256_and_si256(emm2, pi32_4);
+        emm0 = _mm256_slli_epi32(emm0, 29);
+        swap_sign_bit_sin = _mm256_castsi256_ps(emm0);
+
+        /* get the polynom selection mask for the sine*/
+        emm2 = _mm256_and_si256(emm2, pi32_2);
+        emm2 = _mm256_cmpeq_epi32(emm2, _mm256_setzero_si256());
+        poly_mask = _mm256_castsi256_ps(emm2);
+
+        /* x = ((x - y * DP1) - y * DP2) - y * DP3; */
+        xmm1 = _mm256_mul_ps(y, _mm256_set1_ps(-0.78515625));
+        xmm2 = _mm256_mul_ps(y, _mm256_set1_ps(-2.4187564849853515625e-4));
+        xmm3 = _mm256_mul_ps(y, _mm256_set1_ps(-3.77489497744594108e-8));
+        x = _mm256_add_ps(x, xmm1);
+        x = _mm256_add_ps(x, xmm2);
+        x = _mm256_add_ps(x, xmm3);
+
+        emm4 = _mm256_sub_epi32(emm4, pi32_2);
+        emm4 = _mm256_andnot_si256(emm4, pi32_4);
+        emm4 = _mm256_slli_epi32(emm4, 29);
+        sign_bit_cos = _mm256_castsi256_ps(emm4);
+
+        sign_bit_sin = _mm256_xor_ps(sign_bit_sin, swap_sign_bit_sin);
+
+        /* Evaluate the first polynom  (0 <= x <= Pi/4) */
+        z = _mm256_mul_ps(x, x);
+        y = _mm256_set1_ps(2.443315711809948E-005);
+
+        y = _mm256_mul_ps(y, z);
+        y = _mm256_add_ps(y, _mm256_set1_ps(-1.388731625493765E-003));
+        y = _mm256_mul_ps(y, z);
+        y = _mm256_add_ps(y, _mm256_set1_ps(4.166664568298827E-002));
+        y = _mm256_mul_ps(y, z);
+        y = _mm256_mul_ps(y, z);
+        tmp = _mm256_mul_ps(z, _mm256_set1_ps(0.5f));
+        y = _mm256_sub_ps(y, tmp);
+        y = _mm256_add_ps(y, one);
+
+        /* Evaluate the second polynom  (Pi/4 <= x <= 0) */
+        y2 = _mm256_set1_ps(-1.9515295891E-4);
+        y2 = _mm256_mul_ps(y2, z);
+        y2 = _mm256_add_ps(y2, _mm256_set1_ps(8.3321608736E-3));
+        y2 = _mm256_mul_ps(y2, z);
+        y2 = _mm256_add_ps(y2, _mm256_set1_ps(-1.6666654611E-1));
+        y2 = _mm256_mul_ps(y2, z);
+        y2 = _mm256_mul_ps(y2, x);
+        y2 = _mm256_add_ps(y2, x);
+
+        /* select the correct result from the two polynoms */
+        xmm3 = poly_mask;
+        ysin2 = _mm256_and_ps(xmm3, y2);
+        ysin1 = _mm256_andnot_ps(xmm3, y);
+        y2 = _mm256_sub_ps(y2, ysin2);
+        y = _mm256_sub_ps(y, ysin1);
+
+        xmm1 = _mm256_add_ps(ysin1, ysin2);
+        xmm2 = _mm256_add_ps(y, y2);
+
+        /* update the sign */
+        _mm256_storeu_ps(s + i, _mm256_xor_ps(xmm1, sign_bit_sin));
+        _mm256_storeu_ps(c + i, _mm256_xor_ps(xmm2, sign_bit_cos));
+    }
+}
+
+#endif
+
+#endif
@@ -29,7 +29,15 @@
   (this is the zlib license)
 */
 
-#include <smmintrin.h>
+#ifndef _MMC_SSE_MATH_H
+#define _MMC_SSE_MATH_H
+
+#include "../mmc_simd.h"
+
+/* the generic SIMD layer of mmc_simd.h has no MMX, use the SSE2 integer path */
+#if defined(MMC_SIMD_PORTABLE) && !defined(USE_SSE2)
+# define USE_SSE2
+#endif
 
 /* yes I know, the top of this file is quite ugly */
 
@@ -45,7 +53,9 @@
 typedef __m128 v4sf;  // vector of 4 float (sse1)
 
 #ifdef USE_SSE2
-# include <emmintrin.h>
+# ifndef MMC_SIMD_PORTABLE
+#  include <emmintrin.h>
+# endif
 typedef __m128i v4si; // vector of 4 int (sse2)
 #else
 typedef __m64 v2si;   // vector of 2 int (mmx)
@@ -439,3 +449,4 @@ static void sincos_ps(v4sf x, v4sf *s, v4sf *c) {
   *c = _mm_xor_ps(xmm2, sign_bit_cos);
 }
 
+#endif
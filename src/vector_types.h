@@ -38,7 +38,7 @@
 #ifndef _MMC_VECTOR_H
 #define _MMC_VECTOR_H
 
-#ifndef __VECTOR_TYPES_H__
+#if !defined(__VECTOR_TYPES_H__) && !defined(__HIPCC__)
 
 
 #ifdef _MSC_VER
@@ -624,6 +624,247 @@ int zmat_decode(const size_t inputsize, unsigned char* inputstr, size_t* outputs
     return zmat_run(inputsize, inputstr, outputsize, outputbuf, zipid, ret, 0);
 }
 
+/**
+ * @brief Compress one block of a zlib or gzip stream assembled by zmat_joinblocks
+ *
+ * The block is compressed as raw deflate data without any dictionary from the
+ * preceding blocks and, except for the last block, is terminated by a sync
+ * flush. Such blocks can be compressed in parallel and concatenated into one
+ * stream that any zlib/gzip decoder, including zmat_decode, can read.
+ *
+ * @param[in] inputsize: input block length
+ * @param[in] inputstr: input block pointer
+ * @param[out] outputsize: compressed block length
+ * @param[out] outputbuf: compressed block pointer, to be freed by the caller
+ * @param[in] zipid: zmZlib or zmGzip, selects the checksum
+ * @param[in] islast: 1 if this is the last block of the stream, 0 otherwise
+ * @param[out] checksum: adler32 (zlib) or crc32 (gzip) of the input block
+ * @param[out] ret: zlib specific detailed error code (if error occurs)
+ * @return return the coarse grained zmat error code; detailed error code is in ret.
+ */
+
+int zmat_encodeblock(const size_t inputsize, unsigned char* inputstr, size_t* outputsize, unsigned char** outputbuf, const int zipid, const int islast, unsigned long* checksum, int* ret) {
+    z_stream zs;
+    size_t buflen;
+
+    *outputbuf = NULL;
+    *outputsize = 0;
+
+    if (zipid != zmZlib && zipid != zmGzip) {
+        return -999;
+    }
+
+    if (inputsize == 0) {
+        return -1;
+    }
+
+    memset(&zs, 0, sizeof(zs));
+
+    if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 9, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return -2;
+    }
+
+    buflen = deflateBound(&zs, inputsize) + 16; /* a sync flush adds an empty stored block */
+
+    if (!(*outputbuf = (unsigned char*)malloc(buflen))) {
+        deflateEnd(&zs);
+        return -5;
+    }
+
+    zs.avail_in = inputsize;
+    zs.next_in = (Bytef*)inputstr;
+    zs.avail_out = buflen;
+    zs.next_out = (Bytef*)(*outputbuf);
+
+    *ret = deflate(&zs, islast ? Z_FINISH : Z_SYNC_FLUSH);
+    *outputsize = zs.total_out;
+    deflateEnd(&zs);
+
+    if ((islast && *ret != Z_STREAM_END) || (!islast && (*ret != Z_OK || zs.avail_in))) {
+        free(*outputbuf);
+        *outputbuf = NULL;
+        return -3;
+    }
+
+    *ret = 0;
+    *checksum = (zipid == zmZlib) ? adler32(1L, inputstr, inputsize) : crc32(0L, inputstr, inputsize);
+
+    return 0;
+}
+
+/* combine the adler32 checksums of two consecutive blocks, len2 is the length of the second */
+static unsigned long zmat_adler32_combine(unsigned long adler1, unsigned long adler2, size_t len2) {
+    const unsigned long base = 65521UL;
+    unsigned long sum1, sum2, rem = (unsigned long)(len2 % base);
+
+    sum1 = adler1 & 0xffff;
+    sum2 = (rem * sum1) % base;
+    sum1 += (adler2 & 0xffff) + base - 1;
+    sum2 += ((adler1 >> 16) & 0xffff) + ((adler2 >> 16) & 0xffff) + base - rem;
+
+    if (sum1 >= base) {
+        sum1 -= base;
+    }
+
+    if (sum1 >= base) {
+        sum1 -= base;
+    }
+
+    if (sum2 >= (base << 1)) {
+        sum2 -= (base << 1);
+    }
+
+    if (sum2 >= base) {
+        sum2 -= base;
+    }
+
+    return sum1 | (sum2 << 16);
+}
+
+/* multiply a 32x32 GF(2) matrix by a vector */
+static unsigned long zmat_gf2_times(const unsigned long* mat, unsigned long vec) {
+    unsigned long sum = 0;
+
+    while (vec) {
+        if (vec & 1) {
+            sum ^= *mat;
+        }
+
+        vec >>= 1;
+        mat++;
+    }
+
+    return sum;
+}
+
+/* square a 32x32 GF(2) matrix */
+static void zmat_gf2_square(unsigned long* square, const unsigned long* mat) {
+    int n;
+
+    for (n = 0; n < 32; n++) {
+        square[n] = zmat_gf2_times(mat, mat[n]);
+    }
+}
+
+/* combine the crc32 checksums of two consecutive blocks, len2 is the length of the second */
+static unsigned long zmat_crc32_combine(unsigned long crc1, unsigned long crc2, size_t len2) {
+    unsigned long even[32], odd[32], row = 1;
+    int n;
+
+    if (len2 == 0) {
+        return crc1;
+    }
+
+    odd[0] = 0xedb88320UL; /* the CRC-32 polynomial */
+
+    for (n = 1; n < 32; n++) {
+        odd[n] = row;
+        row <<= 1;
+    }
+
+    zmat_gf2_square(even, odd); /* operator for 2 zero bits */
+    zmat_gf2_square(odd, even); /* operator for 4 zero bits */
+
+    do {
+        zmat_gf2_square(even, odd);
+
+        if (len2 & 1) {
+            crc1 = zmat_gf2_times(even, crc1);
+        }
+
+        len2 >>= 1;
+
+        if (len2 == 0) {
+            break;
+        }
+
+        zmat_gf2_square(odd, even);
+
+        if (len2 & 1) {
+            crc1 = zmat_gf2_times(odd, crc1);
+        }
+
+        len2 >>= 1;
+    } while (len2);
+
+    return (crc1 ^ crc2) & 0xffffffffUL;
+}
+
+/**
+ * @brief Concatenate blocks from zmat_encodeblock into one zlib or gzip stream
+ *
+ * @param[in] nblock: the number of blocks, in stream order
+ * @param[in] inputsizes: the uncompressed length of each block
+ * @param[in] blocksizes: the compressed length of each block
+ * @param[in] blocks: the compressed blocks
+ * @param[in] checksums: the checksum of each block returned by zmat_encodeblock
+ * @param[out] outputsize: output stream buffer length
+ * @param[out] outputbuf: output stream buffer pointer, to be freed by the caller
+ * @param[in] zipid: zmZlib or zmGzip
+ * @return return the coarse grained zmat error code
+ */
+
+int zmat_joinblocks(const int nblock, const size_t* inputsizes, const size_t* blocksizes, unsigned char** blocks, const unsigned long* checksums,
+                    size_t* outputsize, unsigned char** outputbuf, const int zipid) {
+    const unsigned char zlibheader[] = {0x78, 0x9C};
+    const unsigned char gzipheader[] = {0x1F, 0x8B, 8, 0, 0, 0, 0, 0, 0, 0xFF};
+    size_t headlen = (zipid == zmZlib) ? sizeof(zlibheader) : sizeof(gzipheader);
+    size_t len = headlen + 8, total = 0, pos;
+    unsigned long sum = (zipid == zmZlib) ? 1UL : 0UL;
+    unsigned char* pb;
+    int i;
+
+    *outputbuf = NULL;
+    *outputsize = 0;
+
+    if (zipid != zmZlib && zipid != zmGzip) {
+        return -999;
+    }
+
+    if (nblock <= 0) {
+        return -1;
+    }
+
+    for (i = 0; i < nblock; i++) {
+        len += blocksizes[i];
+    }
+
+    if (!(*outputbuf = (unsigned char*)malloc(len))) {
+        return -5;
+    }
+
+    pb = *outputbuf;
+    memcpy(pb, (zipid == zmZlib) ? zlibheader : gzipheader, headlen);
+    pos = headlen;
+
+    for (i = 0; i < nblock; i++) {
+        memcpy(pb + pos, blocks[i], blocksizes[i]);
+        pos += blocksizes[i];
+        total += inputsizes[i];
+        sum = (i == 0) ? checksums[0] : ((zipid == zmZlib) ? zmat_adler32_combine(sum, checksums[i], inputsizes[i])
+                                         : zmat_crc32_combine(sum, checksums[i], inputsizes[i]));
+    }
+
+    if (zipid == zmZlib) { /* adler32 in big-endian */
+        pb[pos++] = (sum >> 24) & 0xFF;
+        pb[pos++] = (sum >> 16) & 0xFF;
+        pb[pos++] = (sum >> 8) & 0xFF;
+        pb[pos++] = sum & 0xFF;
+    } else {               /* crc32 and input size modulo 2^32 in little-endian */
+        pb[pos++] = sum & 0xFF;
+        pb[pos++] = (sum >> 8) & 0xFF;
+        pb[pos++] = (sum >> 16) & 0xFF;
+        pb[pos++] = (sum >> 24) & 0xFF;
+        pb[pos++] = total & 0xFF;
+        pb[pos++] = (total >> 8) & 0xFF;
+        pb[pos++] = (total >> 16) & 0xFF;
+        pb[pos++] = (total >> 24) & 0xFF;
+    }
+
+    *outputsize = pos;
+    return 0;
+}
+
 /**
  * @brief Look up a string in a string list and return the index
  *
@@ -115,6 +115,39 @@ int zmat_encode(const size_t inputsize, unsigned char* inputstr, size_t* outputs
 
 int zmat_decode(const size_t inputsize, unsigned char* inputstr, size_t* outputsize, unsigned char** outputbuf, const int zipid, int* ret);
 
+/**
+ * @brief Compress one block of a zlib or gzip stream assembled by zmat_joinblocks
+ *
+ * @param[in] inputsize: input block length
+ * @param[in] inputstr: input block pointer
+ * @param[out] outputsize: compressed block length
+ * @param[out] outputbuf: compressed block pointer, to be freed by the caller
+ * @param[in] zipid: zmZlib or zmGzip, selects the checksum
+ * @param[in] islast: 1 if this is the last block of the stream, 0 otherwise
+ * @param[out] checksum: adler32 (zlib) or crc32 (gzip) of the input block
+ * @param[out] ret: zlib specific detailed error code (if error occurs)
+ * @return return the coarse grained zmat error code; detailed error code is in ret.
+ */
+
+int zmat_encodeblock(const size_t inputsize, unsigned char* inputstr, size_t* outputsize, unsigned char** outputbuf, const int zipid, const int islast, unsigned long* checksum, int* ret);
+
+/**
+ * @brief Concatenate blocks from zmat_encodeblock into one zlib or gzip stream
+ *
+ * @param[in] nblock: the number of blocks, in stream order
+ * @param[in] inputsizes: the uncompressed length of each block
+ * @param[in] blocksizes: the compressed length of each block
+ * @param[in] blocks: the compressed blocks
+ * @param[in] checksums: the checksum of each block returned by zmat_encodeblock
+ * @param[out] outputsize: output stream buffer length
+ * @param[out] outputbuf: output stream buffer pointer, to be freed by the caller
+ * @param[in] zipid: zmZlib or zmGzip
+ * @return return the coarse grained zmat error code
+ */
+
+int zmat_joinblocks(const int nblock, const size_t* inputsizes, const size_t* blocksizes, unsigned char** blocks, const unsigned long* checksums,
+                    size_t* outputsize, unsigned char** outputbuf, const int zipid);
+
 /**
  * @brief Free the output buffer to facilitate use in fortran
  *
@@ -1 +0,0 @@
-@..\..\tools\make.exe %*
@@ -0,0 +1,44 @@
+/*
+ * WebMMC worker: runs one share of the photons in its own wasm instance
+ *
+ * message in:  {id, input, bench, nphoton, seed}
+ *              input is a JSON string (written to /input.json, run with -f),
+ *              otherwise bench names a built-in benchmark (run with -Q)
+ * message out: {id, fluence, nphoton, log} or {id, error, log}
+ *              fluence is the normalized output read from /webmmc.bin
+ */
+
+importScripts('webmmc.js');
+
+onmessage = async function (e) {
+    const job = e.data;
+    let log = [];
+
+    try {
+        /* a fresh instance per job, so no state of the previous run is kept */
+        const mmc = await WebMMC({
+            print: (s) => log.push(s),
+            printErr: (s) => log.push(s)
+        });
+        let args = ['-n', String(job.nphoton), '-E', String(job.seed), '-s', 'webmmc', '-F', 'bin'];
+
+        if (job.input) {
+            mmc.FS.writeFile('/input.json', job.input);
+            args = ['-f', '/input.json'].concat(args);
+        } else {
+            args = ['-Q', job.bench].concat(args);
+        }
+
+        const ret = mmc.callMain(args);
+
+        if (ret) {
+            throw new Error('mmc returned ' + ret);
+        }
+
+        const buf = mmc.FS.readFile('/webmmc.bin');
+        const fluence = new Float64Array(buf.buffer, buf.byteOffset, buf.byteLength >> 3).slice();
+        postMessage({id: job.id, fluence: fluence, nphoton: job.nphoton, log: log.join('\n')}, [fluence.buffer]);
+    } catch (err) {
+        postMessage({id: job.id, error: String(err), log: log.join('\n')});
+    }
+};